@@ -0,0 +1,309 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+// Host overheads of NCCL: enqueue to launch, group end, MSCCL selection, MSCCL algorithm parsing
+// and topology search. Collectives move a few bytes at most, so GPUs mostly wait for the host.
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "alloc.h"
+#include "checks.h"
+#include "comm.h"
+#include "graph.h"
+#include "nccl.h"
+#include "topo.h"
+#include "xml.h"
+
+#include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_parser.h"
+#include "msccl/msccl_struct.h"
+
+// Calls between two synchronizations of the stream, well below the depth of the work FIFO
+#define BENCH_SYNC_EVERY 256
+
+struct benchOptions {
+  int iters;
+  std::vector<std::string> benches;
+  std::vector<std::string> topoFiles;
+  std::vector<std::string> algoFiles;
+};
+
+static double benchNow() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool benchSelected(const benchOptions& opts, const char* name) {
+  return opts.benches.empty() || std::find(opts.benches.begin(), opts.benches.end(), name) != opts.benches.end();
+}
+
+static void benchReport(const char* name, const char* config, double us, int iters) {
+  printf("%-16s %-28s %12.2f us %8d iters\n", name, config, us / iters, iters);
+}
+
+// ncclAllReduce of one float on a single rank comm, from the argument checks to the kernel launch
+static ncclResult_t benchEnqueue(const benchOptions& opts, ncclComm_t comm, cudaStream_t stream, float* buff) {
+  for (int i = 0; i < BENCH_SYNC_EVERY; i++) NCCLCHECK(ncclAllReduce(buff, buff, 1, ncclFloat, ncclSum, comm, stream));
+  CUDACHECK(cudaStreamSynchronize(stream));
+  double total = 0;
+  for (int done = 0; done < opts.iters; done += BENCH_SYNC_EVERY) {
+    int n = std::min(BENCH_SYNC_EVERY, opts.iters - done);
+    double start = benchNow();
+    for (int i = 0; i < n; i++) NCCLCHECK(ncclAllReduce(buff, buff, 1, ncclFloat, ncclSum, comm, stream));
+    total += benchNow() - start;
+    CUDACHECK(cudaStreamSynchronize(stream));
+  }
+  benchReport("enqueue", "allreduce 4B", total, opts.iters);
+  return ncclSuccess;
+}
+
+// ncclGroupEnd of nOps collectives, enqueued outside of the timed region
+static ncclResult_t benchGroup(const benchOptions& opts, ncclComm_t comm, cudaStream_t stream, float* buff) {
+  const int opCounts[] = { 1, 8, 64 };
+  for (int nOps : opCounts) {
+    int iters = std::max(opts.iters / nOps, 1);
+    double total = 0;
+    for (int i = 0; i < iters; i++) {
+      NCCLCHECK(ncclGroupStart());
+      for (int o = 0; o < nOps; o++) NCCLCHECK(ncclAllReduce(buff + o, buff + o, 1, ncclFloat, ncclSum, comm, stream));
+      double start = benchNow();
+      NCCLCHECK(ncclGroupEnd());
+      total += benchNow() - start;
+      if ((i + 1) * nOps % BENCH_SYNC_EVERY < nOps) CUDACHECK(cudaStreamSynchronize(stream));
+    }
+    CUDACHECK(cudaStreamSynchronize(stream));
+    char config[32];
+    snprintf(config, sizeof(config), "groupend %d ops", nOps);
+    benchReport("group", config, total, iters);
+  }
+  return ncclSuccess;
+}
+
+// One ncclAllReduce per GPU of a single process comm. With the caller flag set, the collectives
+// skip mscclEnqueueCheck, so the difference of the two runs is the cost of the MSCCL selection
+// and setup.
+static ncclResult_t benchMsccl(const benchOptions& opts) {
+  int nDevs;
+  CUDACHECK(cudaGetDeviceCount(&nDevs));
+  if (nDevs < 2) {
+    printf("%-16s skipped, needs 2 GPUs\n", "msccl");
+    return ncclSuccess;
+  }
+  std::vector<ncclComm_t> comms(nDevs);
+  std::vector<cudaStream_t> streams(nDevs);
+  std::vector<float*> buffs(nDevs);
+  NCCLCHECK(ncclCommInitAll(comms.data(), nDevs, NULL));
+  for (int d = 0; d < nDevs; d++) {
+    CUDACHECK(cudaSetDevice(d));
+    CUDACHECK(cudaStreamCreateWithFlags(&streams[d], cudaStreamNonBlocking));
+    CUDACHECK(cudaMalloc(&buffs[d], 1024 * sizeof(float)));
+  }
+  if (!mscclAvailable()) printf("%-16s MSCCL is not enabled, both runs take the NCCL path\n", "msccl");
+  for (int bypass = 0; bypass < 2; bypass++) {
+    if (bypass) mscclSetIsCallerFlag();
+    double total = 0;
+    for (int i = 0; i < opts.iters; i++) {
+      double start = benchNow();
+      NCCLCHECK(ncclGroupStart());
+      for (int d = 0; d < nDevs; d++) {
+        NCCLCHECK(ncclAllReduce(buffs[d], buffs[d], 1024, ncclFloat, ncclSum, comms[d], streams[d]));
+      }
+      NCCLCHECK(ncclGroupEnd());
+      total += benchNow() - start;
+      if ((i + 1) % BENCH_SYNC_EVERY == 0) {
+        for (int d = 0; d < nDevs; d++) CUDACHECK(cudaStreamSynchronize(streams[d]));
+      }
+    }
+    for (int d = 0; d < nDevs; d++) CUDACHECK(cudaStreamSynchronize(streams[d]));
+    if (bypass) mscclClearIsCallerFlag();
+    char config[32];
+    snprintf(config, sizeof(config), "allreduce 4KB x %d %s", nDevs, bypass ? "nccl" : "msccl");
+    benchReport("msccl", config, total, opts.iters);
+  }
+  for (int d = 0; d < nDevs; d++) {
+    CUDACHECK(cudaSetDevice(d));
+    CUDACHECK(cudaFree(buffs[d]));
+    CUDACHECK(cudaStreamDestroy(streams[d]));
+    NCCLCHECK(ncclCommDestroy(comms[d]));
+  }
+  return ncclSuccess;
+}
+
+// mscclGetAlgoFromXmlFile on the algorithm files given with -m, as rank 0
+static ncclResult_t benchParse(const benchOptions& opts) {
+  if (opts.algoFiles.empty()) {
+    printf("%-16s skipped, no algorithm file (-m)\n", "parse");
+    return ncclSuccess;
+  }
+  struct mscclAlgo* algo;
+  NCCLCHECK(ncclCalloc(&algo, 1));
+  for (const std::string& file : opts.algoFiles) {
+    int iters = std::max(opts.iters / 100, 1);
+    double start = benchNow();
+    for (int i = 0; i < iters; i++) NCCLCHECK(mscclGetAlgoFromXmlFile(file.c_str(), algo, 0));
+    double total = benchNow() - start;
+    benchReport("parse", basename(file.c_str()), total, iters);
+  }
+  free(algo);
+  return ncclSuccess;
+}
+
+// Topology of a node with nCpus CPUs, each with nSwitches PCI switches holding nGpus GPUs and
+// nNics NICs. GPUs reach an NVSwitch with nvLinks links each when nvLinks is not 0.
+static std::string benchTopoXml(int nCpus, int nSwitches, int nGpus, int nNics, int nvLinks, int sm) {
+  std::string xml = "<system version=\"1\">\n";
+  char line[256];
+  int bus = 0x10, rank = 0, dev = 0, net = 0;
+  for (int c = 0; c < nCpus; c++) {
+    snprintf(line, sizeof(line), "<cpu numaid=\"%d\" affinity=\"%08x\" arch=\"x86_64\" vendor=\"GenuineIntel\" familyid=\"6\" modelid=\"143\">\n",
+      c, 0xffff << (16 * (c % 2)));
+    xml += line;
+    for (int s = 0; s < nSwitches; s++) {
+      snprintf(line, sizeof(line), "<pci busid=\"0000:%02x:00.0\" class=\"0x060400\" link_speed=\"32.0 GT/s PCIe\" link_width=\"16\">\n", bus++);
+      xml += line;
+      for (int g = 0; g < nGpus; g++) {
+        snprintf(line, sizeof(line), "<pci busid=\"0000:%02x:00.0\" class=\"0x030200\" link_speed=\"32.0 GT/s PCIe\" link_width=\"16\">\n", bus++);
+        xml += line;
+        snprintf(line, sizeof(line), "<gpu dev=\"%d\" sm=\"%d\" rank=\"%d\" gdr=\"1\">\n", dev++, sm, rank++);
+        xml += line;
+        if (nvLinks) {
+          snprintf(line, sizeof(line), "<nvlink target=\"0000:c1:00.0\" count=\"%d\" tclass=\"0x068000\"/>\n", nvLinks);
+          xml += line;
+        }
+        xml += "</gpu>\n</pci>\n";
+      }
+      for (int n = 0; n < nNics; n++) {
+        snprintf(line, sizeof(line), "<pci busid=\"0000:%02x:00.0\" class=\"0x020700\" link_speed=\"32.0 GT/s PCIe\" link_width=\"16\">\n", bus++);
+        xml += line;
+        snprintf(line, sizeof(line), "<nic>\n<net name=\"mlx5_%d\" dev=\"%d\" speed=\"400000\" port=\"1\" guid=\"0x%x\" maxconn=\"131072\" gdr=\"1\"/>\n</nic>\n",
+          net, net, 0x1000 + net);
+        xml += line;
+        net++;
+        xml += "</pci>\n";
+      }
+      xml += "</pci>\n";
+    }
+    xml += "</cpu>\n";
+  }
+  xml += "</system>\n";
+  return xml;
+}
+
+static ncclResult_t benchTopoFile(const benchOptions& opts, const char* config, const char* file) {
+  struct ncclXml* xml;
+  struct ncclTopoGraph* ringGraph, *treeGraph;
+  NCCLCHECK(xmlAlloc(&xml, NCCL_TOPO_XML_MAX_NODES));
+  NCCLCHECK(ncclCalloc(&ringGraph, 1));
+  NCCLCHECK(ncclCalloc(&treeGraph, 1));
+  int iters = std::max(opts.iters / 1000, 1);
+  double total = 0;
+  for (int i = 0; i < iters; i++) {
+    struct ncclTopoSystem* system;
+    double start = benchNow();
+    memset(xml, 0, xmlMemSize(NCCL_TOPO_XML_MAX_NODES));
+    xml->maxNodes = NCCL_TOPO_XML_MAX_NODES;
+    NCCLCHECK(ncclTopoGetXmlFromFile(file, xml, 1));
+    NCCLCHECK(ncclTopoGetSystemFromXml(xml, &system, 0));
+    NCCLCHECK(ncclTopoComputePaths(system, NULL));
+    NCCLCHECK(ncclTopoSearchInit(system));
+    memset(ringGraph, 0, sizeof(*ringGraph));
+    ringGraph->id = 0;
+    ringGraph->pattern = NCCL_TOPO_PATTERN_RING;
+    ringGraph->minChannels = 1;
+    ringGraph->maxChannels = MAXCHANNELS/2;
+    NCCLCHECK(ncclTopoCompute(system, ringGraph));
+    memset(treeGraph, 0, sizeof(*treeGraph));
+    treeGraph->id = 1;
+    treeGraph->pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
+    treeGraph->minChannels = 1;
+    treeGraph->maxChannels = ringGraph->nChannels;
+    NCCLCHECK(ncclTopoCompute(system, treeGraph));
+    total += benchNow() - start;
+    ncclTopoFree(system);
+  }
+  benchReport("topo", config, total, iters);
+  free(treeGraph);
+  free(ringGraph);
+  free(xml);
+  return ncclSuccess;
+}
+
+// Paths and ring and tree searches, from the XML file, on synthetic nodes and the files given with -t
+static ncclResult_t benchTopo(const benchOptions& opts) {
+  struct { const char* name; int nCpus, nSwitches, nGpus, nNics, nvLinks, sm; } synthetic[] = {
+    { "pcie 8gpu", 2, 2, 2, 0, 0, 80 },
+    { "pcie 8gpu 4nic", 2, 2, 2, 1, 0, 80 },
+    { "nvswitch 8gpu 8nic", 2, 4, 1, 1, 18, 90 },
+    { "nvswitch 16gpu 8nic", 2, 4, 2, 1, 18, 90 },
+  };
+  for (auto& t : synthetic) {
+    char path[] = "/tmp/nccl_hostbench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+      WARN("Could not create a temporary topology file");
+      return ncclSystemError;
+    }
+    std::string xml = benchTopoXml(t.nCpus, t.nSwitches, t.nGpus, t.nNics, t.nvLinks, t.sm);
+    ssize_t written = write(fd, xml.data(), xml.size());
+    close(fd);
+    ncclResult_t ret = written == (ssize_t)xml.size() ? benchTopoFile(opts, t.name, path) : ncclSystemError;
+    unlink(path);
+    NCCLCHECK(ret);
+  }
+  for (const std::string& file : opts.topoFiles) NCCLCHECK(benchTopoFile(opts, basename(file.c_str()), file.c_str()));
+  return ncclSuccess;
+}
+
+static void benchUsage(const char* argv0) {
+  printf("Usage: %s [-n iters] [-b enqueue|group|msccl|parse|topo]... [-m msccl_algo.xml]... [-t topo.xml]...\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  benchOptions opts;
+  opts.iters = 10000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:m:t:h")) != -1) {
+    switch (opt) {
+    case 'n': opts.iters = std::max(atoi(optarg), 1); break;
+    case 'b': opts.benches.push_back(optarg); break;
+    case 'm': opts.algoFiles.push_back(optarg); break;
+    case 't': opts.topoFiles.push_back(optarg); break;
+    default: benchUsage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  ncclResult_t ret = ncclSuccess;
+  ncclComm_t comm = NULL;
+  cudaStream_t stream = NULL;
+  float* buff = NULL;
+  if (benchSelected(opts, "enqueue") || benchSelected(opts, "group")) {
+    int dev = 0;
+    NCCLCHECKGOTO(ncclCommInitAll(&comm, 1, &dev), ret, exit);
+    CUDACHECKGOTO(cudaSetDevice(dev), ret, exit);
+    CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, exit);
+    CUDACHECKGOTO(cudaMalloc(&buff, 64 * sizeof(float)), ret, exit);
+    if (benchSelected(opts, "enqueue")) NCCLCHECKGOTO(benchEnqueue(opts, comm, stream, buff), ret, exit);
+    if (benchSelected(opts, "group")) NCCLCHECKGOTO(benchGroup(opts, comm, stream, buff), ret, exit);
+  }
+  if (benchSelected(opts, "msccl")) NCCLCHECKGOTO(benchMsccl(opts), ret, exit);
+  if (benchSelected(opts, "parse")) NCCLCHECKGOTO(benchParse(opts), ret, exit);
+  if (benchSelected(opts, "topo")) NCCLCHECKGOTO(benchTopo(opts), ret, exit);
+
+exit:
+  if (buff) cudaFree(buff);
+  if (stream) cudaStreamDestroy(stream);
+  if (comm) ncclCommDestroy(comm);
+  if (ret != ncclSuccess) {
+    fprintf(stderr, "nccl_hostbench: %s\n", ncclGetErrorString(ret));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,429 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+// Regression check of MSCCL on the GPUs of this node. Every algorithm the communicator can select
+// and the native collective of their functions are timed over the sizes of the algorithms,
+// in-place and out-of-place, with and without CUDA graph capture. The native collective runs on
+// its own selection and on each protocol. The slowest-rank times are compared with the baseline of
+// the platform, which is recorded when there is none. The exit status is 2 on regressions.
+
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+#include "alloc.h"
+#include "checks.h"
+#include "comm.h"
+#include "device.h"
+#include "nccl.h"
+
+#include "msccl/msccl_benchmark.h"
+#include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_status.h"
+
+struct regressOptions {
+  const char* baselineDir;
+  int nGpus;
+  int iters;
+  int warmupIters;
+  int64_t maxBytes;
+  int regressionPct;
+  bool updateBaseline;
+};
+
+// One path of the regression matrix, the same on all ranks
+struct regressPath {
+  // index of the algorithm in the catalog, -1 for the native collective
+  int metaIndex;
+  mscclFunc_t func;
+  // NCCL_PROTO_* the native collective is forced to, NCCL_PROTO_UNDEF for its own selection
+  int protocol;
+  bool inPlace;
+  bool graph;
+  int64_t nBytes;
+  size_t count;
+  // us, the slowest rank
+  float time;
+};
+
+struct regressRank {
+  ncclComm_t comm;
+  // Comms of the same ranks created with NCCL_PROTO set to one protocol, nullptr if not timed
+  ncclComm_t protoComms[NCCL_NUM_PROTOCOLS];
+  // us of each path on this rank
+  std::vector<float> times;
+  ncclResult_t ret;
+};
+
+static ncclFunc_t regressNcclFunc(mscclFunc_t func) {
+  switch (func) {
+    case mscclFuncReduce: return ncclFuncReduce;
+    case mscclFuncBroadcast: return ncclFuncBroadcast;
+    case mscclFuncAllReduce: return ncclFuncAllReduce;
+    case mscclFuncReduceScatter: return ncclFuncReduceScatter;
+    case mscclFuncAllGather: return ncclFuncAllGather;
+    default: return ncclNumFuncs;
+  }
+}
+
+// Whether the collective kernels of func can run protocol p on comm. Ring and Tree are checked
+// only, NVLS and CollNet have conditions of their own.
+static bool regressNativeProto(ncclComm_t comm, mscclFunc_t func, int p) {
+  ncclFunc_t coll = regressNcclFunc(func);
+  if (coll == ncclNumFuncs || (comm->connProtoMask & (1 << p)) == 0) return false;
+  if (comm->nRanks == 1) return p == NCCL_PROTO_SIMPLE;
+  return comm->bandwidths[coll][NCCL_ALGO_RING][p] > 0 || comm->ringbdw[coll][p] > 0 || comm->bandwidths[coll][NCCL_ALGO_TREE][p] > 0;
+}
+
+// Paths of the matrix of comm, from its catalog
+static void regressPaths(const regressOptions& opts, ncclComm_t comm, std::vector<struct regressPath>* paths) {
+  const struct mscclAlgoCatalog* catalog = mscclGetCommStatus(comm).catalog;
+  std::vector<std::pair<int, bool>> runs;
+  mscclBenchRuns(comm, catalog, &runs);
+  const bool graphs[] = {false, true};
+  // Counts of the native collective, at the sizes of the algorithms of the same func
+  std::map<std::tuple<mscclFunc_t, bool, int64_t>, size_t> nativeCounts;
+  for (auto& run : runs) {
+    const struct mscclAlgoMeta& m = catalog->metas[run.first];
+    const int64_t hiBytes = m.maxBytes > 0 ? std::min(m.maxBytes, opts.maxBytes) : opts.maxBytes;
+    for (bool graph : graphs) {
+      for (int64_t nBytes = MSCCL_BENCH_MIN_BYTES; nBytes <= hiBytes; nBytes *= 2) {
+        size_t count;
+        if (!mscclBenchCount(m, nBytes, &count)) continue;
+        paths->push_back({run.first, m.func, NCCL_PROTO_UNDEF, run.second, graph, nBytes, count, 0.0f});
+        nativeCounts[std::make_tuple(m.func, run.second, nBytes)] = count;
+      }
+    }
+  }
+  for (auto& native : nativeCounts) {
+    mscclFunc_t func = std::get<0>(native.first);
+    for (bool graph : graphs) {
+      for (int p = NCCL_PROTO_UNDEF; p < NCCL_NUM_PROTOCOLS; p++) {
+        if (p != NCCL_PROTO_UNDEF && !regressNativeProto(comm, func, p)) continue;
+        paths->push_back({-1, func, p, std::get<1>(native.first), graph, std::get<2>(native.first), native.second, 0.0f});
+      }
+    }
+  }
+}
+
+// A forced protocol runs on the comm of that protocol. The call is grouped so that the one-shot,
+// copy-engine and hierarchical PAT paths, which only take calls outside of groups, leave it to the
+// collective kernels.
+static ncclResult_t regressRun(const struct regressRank& rank, const struct regressPath& path, mscclAlgoHandle_t handle,
+    const void* sendBuff, void* recvBuff, cudaStream_t stream) {
+  if (path.metaIndex >= 0) {
+    NCCLCHECK(mscclRunAlgo(sendBuff, nullptr, nullptr, recvBuff, nullptr, nullptr, path.count, mscclBenchDataType, 0, 0, ncclSum,
+      handle, rank.comm, stream));
+  } else if (path.protocol == NCCL_PROTO_UNDEF) {
+    NCCLCHECK(mscclBenchRunNccl(path.func, sendBuff, recvBuff, path.count, rank.comm, stream));
+  } else {
+    NCCLCHECK(ncclGroupStart());
+    ncclResult_t ret = mscclBenchRunNccl(path.func, sendBuff, recvBuff, path.count, rank.protoComms[path.protocol], stream);
+    NCCLCHECK(ncclGroupEnd());
+    NCCLCHECK(ret);
+  }
+  return ncclSuccess;
+}
+
+// Mean time of a call in us on this rank. With graph, the timed calls are captured into a graph
+// once and replayed, the warmup calls still run eagerly to set up the connections.
+static ncclResult_t regressTime(const regressOptions& opts, const struct regressRank& rank, const struct regressPath& path,
+    mscclAlgoHandle_t handle, const void* sendBuff, void* recvBuff, cudaStream_t stream, cudaEvent_t events[2], float* time) {
+  float ms;
+  for (int i = 0; i < opts.warmupIters; i++) NCCLCHECK(regressRun(rank, path, handle, sendBuff, recvBuff, stream));
+  if (!path.graph) {
+    CUDACHECK(cudaEventRecord(events[0], stream));
+    for (int i = 0; i < opts.iters; i++) NCCLCHECK(regressRun(rank, path, handle, sendBuff, recvBuff, stream));
+    CUDACHECK(cudaEventRecord(events[1], stream));
+    CUDACHECK(cudaEventSynchronize(events[1]));
+    CUDACHECK(cudaEventElapsedTime(&ms, events[0], events[1]));
+    *time = ms * 1000.0f / opts.iters;
+    return ncclSuccess;
+  }
+#if CUDART_VERSION >= 11040
+  ncclResult_t ret = ncclSuccess;
+  cudaGraph_t cudaGraph = nullptr;
+  cudaGraphExec_t exec = nullptr;
+  CUDACHECK(cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed));
+  for (int i = 0; i < opts.iters && ret == ncclSuccess; i++) ret = regressRun(rank, path, handle, sendBuff, recvBuff, stream);
+  cudaError_t err = cudaStreamEndCapture(stream, &cudaGraph);
+  NCCLCHECKGOTO(ret, ret, exit);
+  CUDACHECKGOTO(err, ret, exit);
+  CUDACHECKGOTO(cudaGraphInstantiateWithFlags(&exec, cudaGraph, 0), ret, exit);
+  // The first launch uploads the graph
+  CUDACHECKGOTO(cudaGraphLaunch(exec, stream), ret, exit);
+  CUDACHECKGOTO(cudaEventRecord(events[0], stream), ret, exit);
+  CUDACHECKGOTO(cudaGraphLaunch(exec, stream), ret, exit);
+  CUDACHECKGOTO(cudaEventRecord(events[1], stream), ret, exit);
+  CUDACHECKGOTO(cudaEventSynchronize(events[1]), ret, exit);
+  CUDACHECKGOTO(cudaEventElapsedTime(&ms, events[0], events[1]), ret, exit);
+  *time = ms * 1000.0f / opts.iters;
+exit:
+  if (exec) (void)cudaGraphExecDestroy(exec);
+  if (cudaGraph) (void)cudaGraphDestroy(cudaGraph);
+  return ret;
+#else
+  WARN("Benchmarks under graph capture need CUDA 11.4 or later");
+  return ncclInvalidUsage;
+#endif
+}
+
+// Every path of the matrix on one rank, the ranks run them in the same order
+static ncclResult_t regressRankPaths(const regressOptions& opts, struct regressRank* rank, const std::vector<struct regressPath>& paths) {
+  ncclResult_t ret = ncclSuccess;
+  ncclComm_t comm = rank->comm;
+  cudaStream_t stream = nullptr;
+  cudaEvent_t events[2] = {nullptr, nullptr};
+  char* sendBuff = nullptr;
+  char* recvBuff = nullptr;
+  mscclAlgoHandle_t handle = -1;
+  int lastMeta = -1;
+
+  CUDACHECK(cudaSetDevice(comm->cudaDev));
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&sendBuff, opts.maxBytes), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&recvBuff, opts.maxBytes), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[0]), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[1]), ret, exit);
+  rank->times.resize(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    const struct regressPath& path = paths[i];
+    if (path.metaIndex >= 0 && path.metaIndex != lastMeta) {
+      NCCLCHECKGOTO(mscclPrepareCatalogAlgo(comm, path.metaIndex, &handle), ret, exit);
+      lastMeta = path.metaIndex;
+    }
+    const char* send;
+    char* recv;
+    mscclBenchBuffers(path.func, path.inPlace, path.count, comm, sendBuff, recvBuff, &send, &recv);
+    NCCLCHECKGOTO(regressTime(opts, *rank, path, handle, send, recv, stream, events, &rank->times[i]), ret, exit);
+  }
+
+exit:
+  if (events[0]) cudaEventDestroy(events[0]);
+  if (events[1]) cudaEventDestroy(events[1]);
+  if (sendBuff) ncclCudaFree(sendBuff);
+  if (recvBuff) ncclCudaFree(recvBuff);
+  if (stream) cudaStreamDestroy(stream);
+  return ret;
+}
+
+// Key of a path in the baselines: algorithm file name, or nccl for the native collective, func,
+// protocol, in-place, graph and size
+static std::string regressPathKey(const struct mscclAlgoCatalog* catalog, const struct regressPath& path) {
+  std::string name = "nccl", proto;
+  if (path.metaIndex >= 0) {
+    const struct mscclAlgoMeta& m = catalog->metas[path.metaIndex];
+    name = m.filePath.substr(m.filePath.find_last_of('/') + 1);
+    // Algorithms run the protocols their XML gives the thread blocks
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      if ((m.protocolMask & (1 << p)) == 0) continue;
+      if (!proto.empty()) proto += "+";
+      proto += ncclProtoStr[p];
+    }
+  } else {
+    proto = path.protocol == NCCL_PROTO_UNDEF ? "default" : ncclProtoStr[path.protocol];
+  }
+  char key[1024];
+  snprintf(key, sizeof(key), "%s,%s,%s,%d,%d,%ld", name.c_str(), mscclBenchFuncName(path.func), proto.c_str(),
+    path.inPlace ? 1 : 0, path.graph ? 1 : 0, path.nBytes);
+  return key;
+}
+
+// Baselines of a platform are kept apart: GPU of the first rank, its compute capability, and the shape of comm
+static ncclResult_t regressBaselineFile(const regressOptions& opts, ncclComm_t comm, std::string* file) {
+  cudaDeviceProp prop;
+  CUDACHECK(cudaGetDeviceProperties(&prop, comm->cudaDev));
+  char platform[512];
+  snprintf(platform, sizeof(platform), "%s-sm%d-%dn%dr", prop.name, comm->compCap, comm->nNodes, comm->nRanks);
+  for (char* c = platform; *c; c++) {
+    if (!isalnum(*c) && *c != '-') *c = '_';
+  }
+  *file = std::string(opts.baselineDir) + "/" + platform + ".csv";
+  return ncclSuccess;
+}
+
+// Time of each key of a baseline file, false if there is none
+static bool regressReadBaseline(const std::string& file, std::map<std::string, float>* baseline) {
+  FILE* f = fopen(file.c_str(), "r");
+  if (f == nullptr) return false;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || strncmp(line, "algorithm,", 10) == 0) continue;
+    // The time follows the 6 fields of the key
+    char* c = line;
+    for (int commas = 0; *c && commas < 6; c++) commas += *c == ',';
+    float time;
+    if (*c == '\0' || sscanf(c, "%f", &time) != 1) continue;
+    (*baseline)[std::string(line, c - 1 - line)] = time;
+  }
+  fclose(f);
+  return true;
+}
+
+static ncclResult_t regressWriteBaseline(ncclComm_t comm, const std::string& file, const std::vector<std::string>& keys,
+    const std::vector<struct regressPath>& paths) {
+  FILE* f = fopen(file.c_str(), "w");
+  if (f == nullptr) {
+    WARN("Unable to open baseline file %s : %s", file.c_str(), strerror(errno));
+    return ncclSystemError;
+  }
+  fprintf(f, "algorithm,func,protocol,inplace,graph,bytes,us,busbw\n");
+  for (size_t i = 0; i < paths.size(); i++) {
+    double busBw = paths[i].nBytes / (1000.0 * paths[i].time) * mscclBenchBusFactor(paths[i].func, comm->nRanks);
+    fprintf(f, "%s,%.2f,%.2f\n", keys[i].c_str(), paths[i].time, busBw);
+  }
+  fclose(f);
+  return ncclSuccess;
+}
+
+// Compare the times with the baseline, or record it when there is none
+static ncclResult_t regressCompare(const regressOptions& opts, ncclComm_t comm, const std::vector<struct regressPath>& paths,
+    int* nRegressions) {
+  const struct mscclAlgoCatalog* catalog = mscclGetCommStatus(comm).catalog;
+  std::string file;
+  NCCLCHECK(regressBaselineFile(opts, comm, &file));
+  std::vector<std::string> keys;
+  for (auto& path : paths) keys.push_back(regressPathKey(catalog, path));
+  std::map<std::string, float> baseline;
+  if (!regressReadBaseline(file, &baseline)) {
+    NCCLCHECK(regressWriteBaseline(comm, file, keys, paths));
+    printf("Recorded the baseline of %zu paths into %s\n", paths.size(), file.c_str());
+    return ncclSuccess;
+  }
+
+  const double limit = 1.0 + opts.regressionPct / 100.0;
+  int nNew = 0;
+  for (size_t i = 0; i < paths.size(); i++) {
+    auto it = baseline.find(keys[i]);
+    if (it == baseline.end()) {
+      nNew++;
+      continue;
+    }
+    if (paths[i].time > it->second * limit) {
+      printf("Regression of %s : %.2f us, baseline %.2f us\n", keys[i].c_str(), paths[i].time, it->second);
+      (*nRegressions)++;
+    }
+    baseline.erase(it);
+  }
+  // Paths of the baseline that no longer run, such as algorithms the comm stopped selecting
+  for (auto& missing : baseline) {
+    printf("Regression of %s : no longer runs, baseline %.2f us\n", missing.first.c_str(), missing.second);
+    (*nRegressions)++;
+  }
+  printf("Compared %zu paths with %s, %d regressions beyond %d%%, %d new\n", paths.size(), file.c_str(),
+    *nRegressions, opts.regressionPct, nNew);
+  if (opts.updateBaseline) NCCLCHECK(regressWriteBaseline(comm, file, keys, paths));
+  return ncclSuccess;
+}
+
+// Comms of every protocol some native path is forced to, initialized with NCCL_PROTO set to it
+static ncclResult_t regressProtoComms(std::vector<struct regressRank>& ranks, const std::vector<struct regressPath>& paths,
+    const std::vector<int>& devs) {
+  const char* savedProto = getenv("NCCL_PROTO");
+  std::string saved = savedProto ? savedProto : "";
+  ncclResult_t ret = ncclSuccess;
+  std::vector<ncclComm_t> comms(ranks.size());
+  for (int p = 0; p < NCCL_NUM_PROTOCOLS && ret == ncclSuccess; p++) {
+    bool used = false;
+    for (auto& path : paths) used |= path.protocol == p;
+    if (!used) continue;
+    setenv("NCCL_PROTO", ncclProtoStr[p], 1);
+    ret = ncclCommInitAll(comms.data(), ranks.size(), devs.data());
+    if (ret != ncclSuccess) break;
+    for (size_t r = 0; r < ranks.size(); r++) ranks[r].protoComms[p] = comms[r];
+  }
+  if (savedProto) setenv("NCCL_PROTO", saved.c_str(), 1);
+  else unsetenv("NCCL_PROTO");
+  return ret;
+}
+
+static void regressUsage(const char* argv0) {
+  printf("Usage: %s -d baseline_dir [-g gpus] [-n iters] [-w warmup_iters] [-e max_bytes] [-p regression_pct] [-u]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  regressOptions opts = {nullptr, 0, 20, 5, 1 << 28, 10, false};
+  int opt;
+  while ((opt = getopt(argc, argv, "d:g:n:w:e:p:uh")) != -1) {
+    switch (opt) {
+    case 'd': opts.baselineDir = optarg; break;
+    case 'g': opts.nGpus = atoi(optarg); break;
+    case 'n': opts.iters = std::max(atoi(optarg), 1); break;
+    case 'w': opts.warmupIters = std::max(atoi(optarg), 0); break;
+    case 'e': opts.maxBytes = std::max(atoll(optarg), (long long)MSCCL_BENCH_MIN_BYTES); break;
+    case 'p': opts.regressionPct = std::max(atoi(optarg), 0); break;
+    case 'u': opts.updateBaseline = true; break;
+    default: regressUsage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (opts.baselineDir == nullptr) {
+    regressUsage(argv[0]);
+    return 1;
+  }
+
+  ncclResult_t ret = ncclSuccess;
+  int nRegressions = 0;
+  int nDevs;
+  std::vector<int> devs;
+  std::vector<ncclComm_t> comms;
+  std::vector<struct regressRank> ranks;
+  std::vector<struct regressPath> paths;
+  std::vector<std::thread> threads;
+  CUDACHECKGOTO(cudaGetDeviceCount(&nDevs), ret, exit);
+  if (opts.nGpus > 0) nDevs = std::min(nDevs, opts.nGpus);
+  for (int d = 0; d < nDevs; d++) devs.push_back(d);
+  comms.resize(nDevs);
+  NCCLCHECKGOTO(ncclCommInitAll(comms.data(), nDevs, devs.data()), ret, exit);
+  ranks.resize(nDevs);
+  for (int r = 0; r < nDevs; r++) ranks[r] = {comms[r], {}, {}, ncclSuccess};
+  if (!mscclAvailable() || !comms[0]->mscclCompatible || comms[0]->mscclExternalScheduler) {
+    WARN("The regression check needs MSCCL with its internal scheduler");
+    ret = ncclInvalidUsage;
+    goto exit;
+  }
+
+  regressPaths(opts, comms[0], &paths);
+  if (paths.empty()) {
+    printf("No algorithm to benchmark on %d ranks\n", nDevs);
+    goto exit;
+  }
+  NCCLCHECKGOTO(regressProtoComms(ranks, paths, devs), ret, exit);
+
+  // Algorithms connect collectively over the ranks, one thread each
+  for (auto& rank : ranks) {
+    threads.emplace_back([&opts, &paths, &rank]() { rank.ret = regressRankPaths(opts, &rank, paths); });
+  }
+  for (auto& thread : threads) thread.join();
+  for (auto& rank : ranks) NCCLCHECKGOTO(rank.ret, ret, exit);
+  // A collective is as slow as its slowest rank
+  for (size_t i = 0; i < paths.size(); i++) {
+    for (auto& rank : ranks) paths[i].time = std::max(paths[i].time, rank.times[i]);
+  }
+  NCCLCHECKGOTO(regressCompare(opts, comms[0], paths, &nRegressions), ret, exit);
+
+exit:
+  for (auto& rank : ranks) {
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      if (rank.protoComms[p]) ncclCommDestroy(rank.protoComms[p]);
+    }
+  }
+  for (auto comm : comms) {
+    if (comm) ncclCommDestroy(comm);
+  }
+  if (ret != ncclSuccess) {
+    fprintf(stderr, "nccl_mscclregress: %s\n", ncclGetErrorString(ret));
+    return 1;
+  }
+  return nRegressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,588 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+// Net plugin wrapping another ncclNet implementation, as a base for fabric specific work done
+// out of tree.
+//
+// NCCL_NET_WRAP_INNER names the wrapped network: IB or Socket for the transports built into NCCL
+// (IB by default), otherwise a plugin loaded as libnccl-net-<name>.so, or the path of one. It must
+// not name this plugin.
+//
+// NCCL_NET_WRAP_STRIPE=K groups K consecutive devices of the inner network into one device. Its
+// connections hold one inner connection per device and post their requests round robin over them.
+// Both sides post in the same order, so request i of a sender and of its receiver go through device
+// i%K. Grouped receives and device offload are turned off for groups. The listen handles of the
+// inner devices are packed into the handle of the group without their trailing zeros, K is limited
+// by what fits in NCCL_NET_HANDLE_MAXSIZE.
+//
+// NCCL_NET_WRAP_BATCH=N queues sends and posts them N at a time, or when NCCL tests a request of the
+// connection. A fabric able to post several sends with one call would do it in postQueued.
+//
+// NCCL_NET_WRAP_STATS=1 times each send and receive from the moment NCCL posts it to its completion.
+// When a connection is closed, its requests, bytes, average and maximum latency and bandwidth over
+// the time it was busy are logged.
+
+#include "net.h"
+#include <dlfcn.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define __hidden __attribute__ ((visibility("hidden")))
+
+#define PLUGIN_NAME "Wrap"
+#define MAX_STRIPE 8
+#define MAX_RECVS 8
+
+#define WARN(...) do { if (logFunction) logFunction(NCCL_LOG_WARN, NCCL_NET, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define INFO(...) do { if (logFunction) logFunction(NCCL_LOG_INFO, NCCL_NET, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define WRAPCHECK(call) do { ncclResult_t res_ = (call); if (res_ != ncclSuccess) return res_; } while (0)
+
+struct wrapDev {
+  int n;
+  int inner[MAX_STRIPE];
+  char name[256];
+};
+
+enum wrapType { WRAP_FREE = 0, WRAP_SEND = 1, WRAP_RECV = 2, WRAP_FLUSH = 3 };
+
+struct wrapMr {
+  int n;
+  void* inner[MAX_STRIPE];
+};
+
+struct wrapRequest {
+  enum wrapType type;
+  struct wrapComm* comm;
+  void* inner;
+  int nRecvs;
+  // Arguments of a send still queued by NCCL_NET_WRAP_BATCH
+  int queued;
+  void* data;
+  int size, tag;
+  struct wrapMr* mhandle;
+  uint64_t postNs;
+};
+
+struct wrapStats {
+  uint64_t nReqs, bytes, sumNs, maxNs;
+  uint64_t firstNs, lastNs;
+};
+
+struct wrapComm {
+  enum wrapType type;
+  int dev, n;
+  void* inner[MAX_STRIPE];
+  // Inner comm of the next request
+  int next;
+  struct wrapRequest reqs[NCCL_NET_MAX_REQUESTS];
+  // Sends queued by NCCL_NET_WRAP_BATCH, posted in order
+  struct wrapRequest* queue[NCCL_NET_MAX_REQUESTS];
+  uint64_t queueHead, queueTail;
+  // Inner comm of the last receives, by buffer, so that iflush goes through the same device
+  void* recentData[NCCL_NET_MAX_REQUESTS];
+  int recentIdx[NCCL_NET_MAX_REQUESTS];
+  uint64_t recentHead;
+  struct wrapStats stats;
+  // Unpacked inner handles while connecting
+  char (*handles)[NCCL_NET_HANDLE_MAXSIZE];
+};
+
+struct wrapListenComm {
+  int dev, n;
+  void* inner[MAX_STRIPE];
+  // Inner recv comms accepted so far
+  void* recv[MAX_STRIPE];
+};
+
+// Handle of a group of devices, the handle of a single device is the one of the inner network
+struct wrapHandle {
+  // Connecting comm, kept across the calls of connect
+  struct wrapComm* stage;
+  uint8_t n;
+  uint8_t lens[MAX_STRIPE];
+  char data[];
+};
+
+static ncclNet_v8_t* inner;
+static ncclDebugLogger_t logFunction;
+static struct wrapDev* devs;
+static int nDevs;
+static int stripe = 1;
+static int batch = 1;
+static int stats = 0;
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int envInt(const char* name, int def) {
+  const char* str = getenv(name);
+  return str && *str ? atoi(str) : def;
+}
+
+static ncclResult_t loadInner(const char* name) {
+  if (strcasecmp(name, "IB") == 0 || strcasecmp(name, "Socket") == 0) {
+    // Exported by libnccl, which loaded this plugin
+    ncclNet_v8_t* (*getInternal)(const char*) = (ncclNet_v8_t* (*)(const char*))dlsym(RTLD_DEFAULT, "ncclNetGetInternal_v8");
+    if (getInternal == NULL) {
+      void* lib = dlopen("libnccl.so.2", RTLD_NOW | RTLD_NOLOAD);
+      if (lib) getInternal = (ncclNet_v8_t* (*)(const char*))dlsym(lib, "ncclNetGetInternal_v8");
+    }
+    if (getInternal) inner = getInternal(name);
+    if (inner == NULL) {
+      WARN("NET/" PLUGIN_NAME " : this NCCL does not export its %s network", name);
+      return ncclInternalError;
+    }
+    return ncclSuccess;
+  }
+  char path[PATH_MAX];
+  if (strchr(name, '/')) snprintf(path, sizeof(path), "%s", name);
+  else snprintf(path, sizeof(path), "libnccl-net-%s.so", name);
+  void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    WARN("NET/" PLUGIN_NAME " : failed to open %s : %s", path, dlerror());
+    return ncclInternalError;
+  }
+  inner = (ncclNet_v8_t*)dlsym(lib, "ncclNetPlugin_v8");
+  if (inner == NULL) {
+    WARN("NET/" PLUGIN_NAME " : %s has no ncclNetPlugin_v8 symbol", path);
+    dlclose(lib);
+    return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapInit(ncclDebugLogger_t logFn) {
+  logFunction = logFn;
+  const char* name = getenv("NCCL_NET_WRAP_INNER");
+  WRAPCHECK(loadInner(name && *name ? name : "IB"));
+  WRAPCHECK(inner->init(logFn));
+  stripe = envInt("NCCL_NET_WRAP_STRIPE", 1);
+  batch = envInt("NCCL_NET_WRAP_BATCH", 1);
+  stats = envInt("NCCL_NET_WRAP_STATS", 0);
+  if (stripe < 1) stripe = 1;
+  if (stripe > MAX_STRIPE) stripe = MAX_STRIPE;
+  if (batch < 1) batch = 1;
+  if (batch > NCCL_NET_MAX_REQUESTS) batch = NCCL_NET_MAX_REQUESTS;
+
+  int nInner;
+  WRAPCHECK(inner->devices(&nInner));
+  if (stripe > nInner && nInner > 0) stripe = nInner;
+  nDevs = nInner / stripe;
+  devs = (struct wrapDev*)calloc(nDevs > 0 ? nDevs : 1, sizeof(struct wrapDev));
+  if (devs == NULL) return ncclSystemError;
+  for (int d = 0; d < nDevs; d++) {
+    struct wrapDev* dev = devs+d;
+    dev->n = stripe;
+    int len = 0;
+    for (int i = 0; i < stripe; i++) {
+      ncclNetProperties_v8_t props;
+      dev->inner[i] = d*stripe+i;
+      WRAPCHECK(inner->getProperties(dev->inner[i], &props));
+      len += snprintf(dev->name+len, sizeof(dev->name)-len, "%s%s", i ? "+" : "", props.name);
+      if (len >= (int)sizeof(dev->name)) len = sizeof(dev->name)-1;
+    }
+  }
+  if (nDevs*stripe < nInner) INFO("NET/" PLUGIN_NAME " : %d devices of %s left out of groups of %d", nInner-nDevs*stripe, inner->name, stripe);
+  INFO("NET/" PLUGIN_NAME " : wrapping %s, %d devices, stripe %d batch %d%s", inner->name, nDevs, stripe, batch, stats ? " stats" : "");
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapDevices(int* ndev) {
+  *ndev = nDevs;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapGetProperties(int d, ncclNetProperties_v8_t* props) {
+  struct wrapDev* dev = devs+d;
+  WRAPCHECK(inner->getProperties(dev->inner[0], props));
+  for (int i = 1; i < dev->n; i++) {
+    ncclNetProperties_v8_t p;
+    WRAPCHECK(inner->getProperties(dev->inner[i], &p));
+    props->ptrSupport &= p.ptrSupport;
+    props->regIsGlobal &= p.regIsGlobal;
+    props->speed += p.speed;
+    if (p.latency > props->latency) props->latency = p.latency;
+    if (p.maxComms < props->maxComms) props->maxComms = p.maxComms;
+  }
+  props->name = dev->name;
+  if (dev->n > 1) {
+    props->maxRecvs = 1;
+    props->netDeviceType = NCCL_NET_DEVICE_HOST;
+    props->netDeviceVersion = NCCL_NET_DEVICE_INVALID_VERSION;
+  }
+  if (props->maxRecvs > MAX_RECVS) props->maxRecvs = MAX_RECVS;
+  return ncclSuccess;
+}
+
+static ncclResult_t newComm(enum wrapType type, int dev, int n, struct wrapComm** comm) {
+  *comm = (struct wrapComm*)calloc(1, sizeof(struct wrapComm));
+  if (*comm == NULL) return ncclSystemError;
+  (*comm)->type = type;
+  (*comm)->dev = dev;
+  (*comm)->n = n;
+  for (int r = 0; r < NCCL_NET_MAX_REQUESTS; r++) (*comm)->reqs[r].comm = *comm;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapListen(int d, void* opaqueHandle, void** listenComm) {
+  struct wrapDev* dev = devs+d;
+  struct wrapListenComm* lcomm = (struct wrapListenComm*)calloc(1, sizeof(struct wrapListenComm));
+  if (lcomm == NULL) return ncclSystemError;
+  lcomm->dev = d;
+  lcomm->n = dev->n;
+  ncclResult_t ret = ncclSuccess;
+  if (dev->n == 1) {
+    ret = inner->listen(dev->inner[0], opaqueHandle, lcomm->inner);
+  } else {
+    struct wrapHandle* handle = (struct wrapHandle*)opaqueHandle;
+    int room = NCCL_NET_HANDLE_MAXSIZE - offsetof(struct wrapHandle, data);
+    int offset = 0;
+    memset(handle, 0, NCCL_NET_HANDLE_MAXSIZE);
+    handle->n = dev->n;
+    for (int i = 0; i < dev->n && ret == ncclSuccess; i++) {
+      char h[NCCL_NET_HANDLE_MAXSIZE];
+      memset(h, 0, sizeof(h));
+      ret = inner->listen(dev->inner[i], h, lcomm->inner+i);
+      if (ret != ncclSuccess) break;
+      int len = NCCL_NET_HANDLE_MAXSIZE;
+      while (len > 0 && h[len-1] == 0) len--;
+      if (offset + len > room) {
+        WARN("NET/" PLUGIN_NAME " : handles of %d %s devices do not fit in one, lower NCCL_NET_WRAP_STRIPE", dev->n, inner->name);
+        ret = ncclInternalError;
+        break;
+      }
+      handle->lens[i] = len;
+      memcpy(handle->data+offset, h, len);
+      offset += len;
+    }
+  }
+  if (ret != ncclSuccess) {
+    for (int i = 0; i < dev->n; i++) if (lcomm->inner[i]) inner->closeListen(lcomm->inner[i]);
+    free(lcomm);
+    return ret;
+  }
+  *listenComm = lcomm;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapConnect(int d, void* opaqueHandle, void** sendComm, ncclNetDeviceHandle_v8_t** sendDevComm) {
+  struct wrapDev* dev = devs+d;
+  struct wrapComm* comm;
+  *sendComm = NULL;
+  if (dev->n == 1) {
+    // The inner network keeps its own state in the handle
+    void* innerComm = NULL;
+    WRAPCHECK(inner->connect(dev->inner[0], opaqueHandle, &innerComm, sendDevComm));
+    if (innerComm == NULL) return ncclSuccess;
+    WRAPCHECK(newComm(WRAP_SEND, d, 1, &comm));
+    comm->inner[0] = innerComm;
+    *sendComm = comm;
+    return ncclSuccess;
+  }
+  struct wrapHandle* handle = (struct wrapHandle*)opaqueHandle;
+  comm = handle->stage;
+  if (comm == NULL) {
+    if (handle->n != dev->n) {
+      WARN("NET/" PLUGIN_NAME " : peer groups %d devices, this rank %d, NCCL_NET_WRAP_STRIPE must match", handle->n, dev->n);
+      return ncclInvalidUsage;
+    }
+    WRAPCHECK(newComm(WRAP_SEND, d, dev->n, &comm));
+    comm->handles = (char (*)[NCCL_NET_HANDLE_MAXSIZE])calloc(dev->n, NCCL_NET_HANDLE_MAXSIZE);
+    if (comm->handles == NULL) { free(comm); return ncclSystemError; }
+    int offset = 0;
+    for (int i = 0; i < dev->n; i++) {
+      memcpy(comm->handles[i], handle->data+offset, handle->lens[i]);
+      offset += handle->lens[i];
+    }
+    handle->stage = comm;
+  }
+  int connected = 1;
+  for (int i = 0; i < comm->n; i++) {
+    if (comm->inner[i] == NULL) WRAPCHECK(inner->connect(dev->inner[i], comm->handles[i], comm->inner+i, NULL));
+    if (comm->inner[i] == NULL) connected = 0;
+  }
+  if (!connected) return ncclSuccess;
+  free(comm->handles);
+  comm->handles = NULL;
+  handle->stage = NULL;
+  *sendComm = comm;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapAccept(void* listenComm, void** recvComm, ncclNetDeviceHandle_v8_t** recvDevComm) {
+  struct wrapListenComm* lcomm = (struct wrapListenComm*)listenComm;
+  *recvComm = NULL;
+  int accepted = 1;
+  for (int i = 0; i < lcomm->n; i++) {
+    if (lcomm->recv[i] == NULL) WRAPCHECK(inner->accept(lcomm->inner[i], lcomm->recv+i, lcomm->n == 1 ? recvDevComm : NULL));
+    if (lcomm->recv[i] == NULL) accepted = 0;
+  }
+  if (!accepted) return ncclSuccess;
+  struct wrapComm* comm;
+  WRAPCHECK(newComm(WRAP_RECV, lcomm->dev, lcomm->n, &comm));
+  for (int i = 0; i < lcomm->n; i++) {
+    comm->inner[i] = lcomm->recv[i];
+    lcomm->recv[i] = NULL;
+  }
+  *recvComm = comm;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapRegMr(void* opaqueComm, void* data, size_t size, int type, void** mhandle) {
+  struct wrapComm* comm = (struct wrapComm*)opaqueComm;
+  struct wrapMr* mr = (struct wrapMr*)calloc(1, sizeof(struct wrapMr));
+  if (mr == NULL) return ncclSystemError;
+  mr->n = comm->n;
+  for (int i = 0; i < comm->n; i++) {
+    ncclResult_t ret = inner->regMr(comm->inner[i], data, size, type, mr->inner+i);
+    if (ret != ncclSuccess) {
+      while (i--) inner->deregMr(comm->inner[i], mr->inner[i]);
+      free(mr);
+      return ret;
+    }
+  }
+  *mhandle = mr;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapRegMrDmaBuf(void* opaqueComm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle) {
+  struct wrapComm* comm = (struct wrapComm*)opaqueComm;
+  if (inner->regMrDmaBuf == NULL) return ncclInternalError;
+  struct wrapMr* mr = (struct wrapMr*)calloc(1, sizeof(struct wrapMr));
+  if (mr == NULL) return ncclSystemError;
+  mr->n = comm->n;
+  for (int i = 0; i < comm->n; i++) {
+    ncclResult_t ret = inner->regMrDmaBuf(comm->inner[i], data, size, type, offset, fd, mr->inner+i);
+    if (ret != ncclSuccess) {
+      while (i--) inner->deregMr(comm->inner[i], mr->inner[i]);
+      free(mr);
+      return ret;
+    }
+  }
+  *mhandle = mr;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapDeregMr(void* opaqueComm, void* mhandle) {
+  struct wrapComm* comm = (struct wrapComm*)opaqueComm;
+  struct wrapMr* mr = (struct wrapMr*)mhandle;
+  ncclResult_t ret = ncclSuccess;
+  for (int i = 0; i < mr->n; i++) {
+    ncclResult_t res = inner->deregMr(comm->inner[i], mr->inner[i]);
+    if (ret == ncclSuccess) ret = res;
+  }
+  free(mr);
+  return ret;
+}
+
+static ncclResult_t getRequest(struct wrapComm* comm, struct wrapRequest** req) {
+  for (int r = 0; r < NCCL_NET_MAX_REQUESTS; r++) {
+    if (comm->reqs[r].type == WRAP_FREE) {
+      *req = comm->reqs+r;
+      (*req)->inner = NULL;
+      (*req)->queued = 0;
+      return ncclSuccess;
+    }
+  }
+  WARN("NET/" PLUGIN_NAME " : unable to allocate requests");
+  return ncclInternalError;
+}
+
+// Post the queued sends in order, until the inner network cannot take the next one
+static ncclResult_t postQueued(struct wrapComm* comm) {
+  while (comm->queueHead != comm->queueTail) {
+    struct wrapRequest* req = comm->queue[comm->queueHead%NCCL_NET_MAX_REQUESTS];
+    int idx = comm->next;
+    WRAPCHECK(inner->isend(comm->inner[idx], req->data, req->size, req->tag, req->mhandle->inner[idx], &req->inner));
+    if (req->inner == NULL) break;
+    req->queued = 0;
+    comm->next = (idx+1) % comm->n;
+    comm->queueHead++;
+  }
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapIsend(void* sendComm, void* data, int size, int tag, void* mhandle, void** request) {
+  struct wrapComm* comm = (struct wrapComm*)sendComm;
+  struct wrapMr* mr = (struct wrapMr*)mhandle;
+  struct wrapRequest* req;
+  *request = NULL;
+  WRAPCHECK(getRequest(comm, &req));
+  req->nRecvs = 1;
+  req->postNs = stats ? nowNs() : 0;
+  if (batch > 1) {
+    // NCCL may not send anything else until these complete, its tests post them
+    req->type = WRAP_SEND;
+    req->queued = 1;
+    req->data = data;
+    req->size = size;
+    req->tag = tag;
+    req->mhandle = mr;
+    comm->queue[comm->queueTail++%NCCL_NET_MAX_REQUESTS] = req;
+    if (comm->queueTail - comm->queueHead >= (uint64_t)batch) WRAPCHECK(postQueued(comm));
+    *request = req;
+    return ncclSuccess;
+  }
+  int idx = comm->next;
+  WRAPCHECK(inner->isend(comm->inner[idx], data, size, tag, mr->inner[idx], &req->inner));
+  if (req->inner == NULL) return ncclSuccess;
+  req->type = WRAP_SEND;
+  comm->next = (idx+1) % comm->n;
+  *request = req;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapIrecv(void* recvComm, int n, void** data, int* sizes, int* tags, void** mhandles, void** request) {
+  struct wrapComm* comm = (struct wrapComm*)recvComm;
+  struct wrapRequest* req;
+  void* innerMhandles[MAX_RECVS];
+  *request = NULL;
+  if (n > MAX_RECVS) return ncclInternalError;
+  WRAPCHECK(getRequest(comm, &req));
+  int idx = comm->next;
+  for (int i = 0; i < n; i++) innerMhandles[i] = ((struct wrapMr*)mhandles[i])->inner[idx];
+  req->postNs = stats ? nowNs() : 0;
+  WRAPCHECK(inner->irecv(comm->inner[idx], n, data, sizes, tags, innerMhandles, &req->inner));
+  if (req->inner == NULL) return ncclSuccess;
+  req->type = WRAP_RECV;
+  req->nRecvs = n;
+  int slot = comm->recentHead++ % NCCL_NET_MAX_REQUESTS;
+  comm->recentData[slot] = data[0];
+  comm->recentIdx[slot] = idx;
+  comm->next = (idx+1) % comm->n;
+  *request = req;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapIflush(void* recvComm, int n, void** data, int* sizes, void** mhandles, void** request) {
+  struct wrapComm* comm = (struct wrapComm*)recvComm;
+  struct wrapRequest* req;
+  void* innerMhandles[MAX_RECVS];
+  *request = NULL;
+  if (n > MAX_RECVS) return ncclInternalError;
+  // NCCL flushes a buffer right after its receive completed, go through the device it came from
+  int idx = 0;
+  for (uint64_t r = comm->recentHead; r > 0 && r + NCCL_NET_MAX_REQUESTS > comm->recentHead; r--) {
+    int slot = (r-1) % NCCL_NET_MAX_REQUESTS;
+    if (comm->recentData[slot] == data[0]) { idx = comm->recentIdx[slot]; break; }
+  }
+  WRAPCHECK(getRequest(comm, &req));
+  for (int i = 0; i < n; i++) innerMhandles[i] = ((struct wrapMr*)mhandles[i])->inner[idx];
+  WRAPCHECK(inner->iflush(comm->inner[idx], n, data, sizes, innerMhandles, &req->inner));
+  if (req->inner == NULL) return ncclSuccess;
+  req->type = WRAP_FLUSH;
+  *request = req;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t wrapTest(void* request, int* done, int* sizes) {
+  struct wrapRequest* req = (struct wrapRequest*)request;
+  struct wrapComm* comm = req->comm;
+  int innerSizes[MAX_RECVS];
+  *done = 0;
+  if (comm->queueHead != comm->queueTail) WRAPCHECK(postQueued(comm));
+  if (req->queued) return ncclSuccess;
+  WRAPCHECK(inner->test(req->inner, done, innerSizes));
+  if (*done == 0) return ncclSuccess;
+  if (sizes) memcpy(sizes, innerSizes, req->nRecvs*sizeof(int));
+  if (stats && req->type != WRAP_FLUSH) {
+    struct wrapStats* s = &comm->stats;
+    uint64_t now = nowNs();
+    uint64_t ns = now - req->postNs;
+    for (int i = 0; i < req->nRecvs; i++) s->bytes += innerSizes[i];
+    if (s->nReqs == 0 || req->postNs < s->firstNs) s->firstNs = req->postNs;
+    s->lastNs = now;
+    s->nReqs++;
+    s->sumNs += ns;
+    if (ns > s->maxNs) s->maxNs = ns;
+  }
+  req->type = WRAP_FREE;
+  return ncclSuccess;
+}
+
+static void logStats(struct wrapComm* comm) {
+  struct wrapStats* s = &comm->stats;
+  if (!stats || s->nReqs == 0) return;
+  uint64_t span = s->lastNs - s->firstNs;
+  INFO("NET/" PLUGIN_NAME " %s dev %s: %lu requests %lu bytes, latency avg %.1f us max %.1f us, %.2f GB/s",
+      comm->type == WRAP_SEND ? "send" : "recv", devs[comm->dev].name, s->nReqs, s->bytes,
+      s->sumNs/1e3/s->nReqs, s->maxNs/1e3, span ? (double)s->bytes/span : 0.0);
+}
+
+static ncclResult_t closeComm(struct wrapComm* comm, ncclResult_t (*closeFn)(void*)) {
+  ncclResult_t ret = ncclSuccess;
+  logStats(comm);
+  for (int i = 0; i < comm->n; i++) {
+    if (comm->inner[i] == NULL) continue;
+    ncclResult_t res = closeFn(comm->inner[i]);
+    if (ret == ncclSuccess) ret = res;
+  }
+  free(comm->handles);
+  free(comm);
+  return ret;
+}
+
+__hidden ncclResult_t wrapCloseSend(void* sendComm) {
+  return closeComm((struct wrapComm*)sendComm, inner->closeSend);
+}
+
+__hidden ncclResult_t wrapCloseRecv(void* recvComm) {
+  return closeComm((struct wrapComm*)recvComm, inner->closeRecv);
+}
+
+__hidden ncclResult_t wrapCloseListen(void* listenComm) {
+  struct wrapListenComm* lcomm = (struct wrapListenComm*)listenComm;
+  ncclResult_t ret = ncclSuccess;
+  for (int i = 0; i < lcomm->n; i++) {
+    if (lcomm->recv[i]) inner->closeRecv(lcomm->recv[i]);
+    ncclResult_t res = inner->closeListen(lcomm->inner[i]);
+    if (ret == ncclSuccess) ret = res;
+  }
+  free(lcomm);
+  return ret;
+}
+
+// Device offload is only passed through for single devices
+__hidden ncclResult_t wrapGetDeviceMr(void* opaqueComm, void* mhandle, void** dptr_mhandle) {
+  struct wrapComm* comm = (struct wrapComm*)opaqueComm;
+  if (comm->n != 1 || inner->getDeviceMr == NULL) return ncclInternalError;
+  return inner->getDeviceMr(comm->inner[0], ((struct wrapMr*)mhandle)->inner[0], dptr_mhandle);
+}
+
+__hidden ncclResult_t wrapIrecvConsumed(void* recvComm, int n, void* request) {
+  struct wrapComm* comm = (struct wrapComm*)recvComm;
+  if (comm->n != 1 || inner->irecvConsumed == NULL) return ncclInternalError;
+  return inner->irecvConsumed(comm->inner[0], n, ((struct wrapRequest*)request)->inner);
+}
+
+const ncclNet_v8_t ncclNetPlugin_v8 = {
+  .name = PLUGIN_NAME,
+  .init = wrapInit,
+  .devices = wrapDevices,
+  .getProperties = wrapGetProperties,
+  .listen = wrapListen,
+  .connect = wrapConnect,
+  .accept = wrapAccept,
+  .regMr = wrapRegMr,
+  .regMrDmaBuf = wrapRegMrDmaBuf,
+  .deregMr = wrapDeregMr,
+  .isend = wrapIsend,
+  .irecv = wrapIrecv,
+  .iflush = wrapIflush,
+  .test = wrapTest,
+  .closeSend = wrapCloseSend,
+  .closeRecv = wrapCloseRecv,
+  .closeListen = wrapCloseListen,
+  .getDeviceMr = wrapGetDeviceMr,
+  .irecvConsumed = wrapIrecvConsumed,
+};
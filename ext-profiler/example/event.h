@@ -36,6 +36,7 @@
 #define MAX_COMM_CLIQUES                 (32 * 8)
 
 struct proxyOp;
+struct threadPool;
 
 struct proxyStep {
   uint8_t type;                     // type of event: network transfer
@@ -66,6 +67,7 @@ struct proxyOp {
   int stepCount;                    // last processed network operation for this proxy operation
   struct proxyStep step[MAX_STEPS]; // array of network transfer events
   struct taskEventBase* parent;     // parent event p2p/collective
+  struct threadPool* pool;          // detach pool of PXN proxyOps, NULL otherwise
 };
 
 struct group;
@@ -110,6 +112,9 @@ struct collective {
   int nWarps;
   int isCollnet;
   int isNvls;
+  const char* mscclAlgoName;        // NULL unless the collective runs an MSCCL algorithm
+  int mscclAlgoHandle;
+  int mscclNBlocks;
   struct proxyOp send[MAX_CHANNELS];// array of send proxy operation events
   struct proxyOp recv[MAX_CHANNELS];// array of recv proxy operation events
 };
@@ -159,6 +164,53 @@ struct context {
   struct proxyCtrl* proxyCtrlPool;
 };
 
+// completed event handed to the writer thread
+struct streamEntry {
+  void* event;                      // group or PXN proxyOp, or &ctrl
+  struct proxyCtrl ctrl;            // copy of a proxyCtrl event, whose pool slot is reused without release
+};
+
+// per-thread pools, only the owning thread allocates from them and
+// pushes to its ring, only the writer thread releases and pops
+struct threadPool {
+  int detachPoolIndex;              // started PXN proxyOps
+  int detachPoolBase;               // released PXN proxyOps
+  struct proxyOp* detachPool;
+  uint64_t ringHead;                // pushed completed events
+  uint64_t ringTail;                // written completed events
+  struct streamEntry* ring;
+  struct threadPool* next;          // next pool of the process
+};
+
+// NCCL_PROFILE_STREAM=binary file layout: a header, then one record per
+// event, each group followed by its collectives and p2ps, each of these
+// by its proxyOps and each proxyOp by its proxySteps
+#define PROFILE_FILE_MAGIC               "NCCLPRF"
+#define PROFILE_FILE_VERSION             1
+
+struct profileFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  int32_t pid;
+  int32_t reserved;
+};
+
+struct profileRecord {
+  uint8_t type;                     // ncclProfile* event type
+  uint8_t func;                     // coll/p2p: ncclFunc, proxyOp/proxyStep: 1 for send, proxyCtrl: state
+  uint8_t algo;                     // coll: algorithm
+  uint8_t proto;                    // coll: protocol
+  int32_t rank;                     // coll/p2p/proxyOp: rank, group: group id, proxyStep: step
+  int32_t peer;                     // p2p/proxyOp: peer, coll: root, proxyCtrl: appended proxyOps
+  int32_t channel;                  // proxyOp: channel, coll: max channels
+  uint64_t seq;                     // coll: sequence number, proxyOp: transfer size
+  uint64_t count;                   // coll/p2p: element count, proxyOp: steps
+  uint64_t commHash;                // coll/p2p: communicator
+  double startTs;                   // microseconds since the profiler started
+  double stopTs;
+};
+
 int taskEventQueueEmpty(struct group* g);
 void taskEventQueueEnqueue(struct group* g, struct taskEventBase* event);
 struct taskEventBase* taskEventQueueHead(struct group* g);
@@ -42,6 +42,9 @@ typedef struct {
       uint8_t proto;
       int isCollnet;
       int isNvls;
+      const char* mscclAlgoName;  // NULL unless the collective runs an MSCCL algorithm
+      int mscclAlgoHandle;
+      int mscclNBlocks;           // thread blocks of the MSCCL kernel
     } coll;
 
     struct {
@@ -6,7 +6,9 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <linux/limits.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -26,10 +28,25 @@ static int collPoolSize = 16;
 static int p2pPoolSize = 1024;
 static int proxyCtrlPoolSize = 16;
 static int detachPoolSize = 128;
-static int detachPoolBase;
-static int detachPoolIndex;
-static int detachPoolDone;
-static struct proxyOp* detachPool;
+
+// Pools of the threads recording events, freed with the last context
+static struct threadPool* threadPools;
+static int threadPoolGen = 1;
+static __thread struct threadPool* myPool;
+static __thread int myPoolGen;
+
+// Completed events are written by a background thread with NCCL_PROFILE_STREAM
+#define STREAM_NONE     0
+#define STREAM_BINARY   1
+#define STREAM_PERFETTO 2
+static int streamFormat;
+static int streamRingSize = 4096;
+static FILE* streamFile;
+static pthread_t streamThread;
+static int streamStop;
+static uint64_t streamFlushRequest;
+static uint64_t streamFlushDone;
+static uint64_t streamDropped;
 
 static double freq = -1;
 __hidden void calibrate() {
@@ -49,13 +66,168 @@ __hidden double gettime(void) {
   return __rdtsc() / freq;
 }
 
+// Only taken by init and finalize, recording events is lock-free
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pid_t pid;
 
+static struct threadPool* getThreadPool(void) {
+  if (myPool && myPoolGen == __atomic_load_n(&threadPoolGen, __ATOMIC_ACQUIRE)) return myPool;
+  struct threadPool* tp = (struct threadPool *)calloc(1, sizeof(*tp));
+  if (tp == NULL) return NULL;
+  tp->detachPool = (struct proxyOp *)calloc(detachPoolSize, sizeof(*tp->detachPool));
+  if (streamFormat != STREAM_NONE) tp->ring = (struct streamEntry *)calloc(streamRingSize, sizeof(*tp->ring));
+  if (tp->detachPool == NULL || (streamFormat != STREAM_NONE && tp->ring == NULL)) {
+    free(tp->detachPool);
+    free(tp->ring);
+    free(tp);
+    return NULL;
+  }
+  tp->next = __atomic_load_n(&threadPools, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&threadPools, &tp->next, tp, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  myPool = tp;
+  myPoolGen = __atomic_load_n(&threadPoolGen, __ATOMIC_ACQUIRE);
+  return tp;
+}
+
+static void freeThreadPools(void) {
+  struct threadPool* tp = __atomic_exchange_n(&threadPools, NULL, __ATOMIC_ACQ_REL);
+  __atomic_fetch_add(&threadPoolGen, 1, __ATOMIC_RELEASE);
+  while (tp) {
+    struct threadPool* next = tp->next;
+    free(tp->detachPool);
+    free(tp->ring);
+    free(tp);
+    tp = next;
+  }
+}
+
+// Hands a completed event to the writer thread, which releases it once written.
+// Returns 0 when the ring of this thread is full and the event is not written.
+static int streamPush(void* event) {
+  struct threadPool* tp = getThreadPool();
+  if (tp == NULL) return 0;
+  uint64_t head = tp->ringHead;
+  if (head - __atomic_load_n(&tp->ringTail, __ATOMIC_ACQUIRE) == (uint64_t)streamRingSize) {
+    __atomic_fetch_add(&streamDropped, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  struct streamEntry* e = &tp->ring[head%streamRingSize];
+  if (*(uint8_t *)event == ncclProfileProxyCtrl) {
+    e->ctrl = *(struct proxyCtrl *)event;
+    e->event = &e->ctrl;
+  } else {
+    e->event = event;
+  }
+  __atomic_store_n(&tp->ringHead, head+1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void releaseEvent(void* event) {
+  uint8_t type = *(uint8_t *)event;
+  if (type == ncclProfileGroup) {
+    struct group* g = (struct group *)event;
+    __atomic_fetch_add(&g->ctx->groupPoolBase, 1, __ATOMIC_RELAXED);
+  } else if (type == ncclProfileProxyOp) {
+    struct proxyOp* op = (struct proxyOp *)event;
+    __atomic_fetch_add(&op->pool->detachPoolBase, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static int streamDrain(void) {
+  int n = 0;
+  for (struct threadPool* tp = __atomic_load_n(&threadPools, __ATOMIC_ACQUIRE); tp; tp = tp->next) {
+    uint64_t tail = tp->ringTail;
+    uint64_t head = __atomic_load_n(&tp->ringHead, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++, n++) {
+      void* event = tp->ring[tail%streamRingSize].event;
+      if (streamFormat == STREAM_BINARY) writeEvent(streamFile, event);
+      else printEvent(streamFile, event);
+      releaseEvent(event);
+    }
+    __atomic_store_n(&tp->ringTail, tail, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static void* streamMain(void* arg) {
+  while (1) {
+    uint64_t request = __atomic_load_n(&streamFlushRequest, __ATOMIC_ACQUIRE);
+    if (streamDrain() == 0) {
+      // Nothing was pushed before the request and left unwritten
+      fflush(streamFile);
+      __atomic_store_n(&streamFlushDone, request, __ATOMIC_RELEASE);
+      if (__atomic_load_n(&streamStop, __ATOMIC_ACQUIRE)) break;
+      usleep(1000);
+    }
+  }
+  return NULL;
+}
+
+// Waits until the events completed so far are written
+static void streamFlush(void) {
+  uint64_t request = __atomic_add_fetch(&streamFlushRequest, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&streamFlushDone, __ATOMIC_ACQUIRE) < request) usleep(100);
+}
+
+static ncclResult_t streamStart(void) {
+  const char* format = getenv("NCCL_PROFILE_STREAM");
+  const char* dump = getenv("NCCL_PROFILE_DUMP_FILE");
+  streamFormat = STREAM_NONE;
+  if (format == NULL || dump == NULL) return ncclSuccess;
+  if (strcasecmp(format, "binary") == 0) streamFormat = STREAM_BINARY;
+  else if (strcasecmp(format, "perfetto") == 0) streamFormat = STREAM_PERFETTO;
+  else return ncclSuccess;
+  if (getenv("NCCL_PROFILE_STREAM_RING_SIZE")) {
+    streamRingSize = atoi(getenv("NCCL_PROFILE_STREAM_RING_SIZE"));
+  }
+
+  char filename[PATH_MAX] = { 0 };
+  char hostname[64] = { 0 };
+  gethostname(hostname, 64);
+  snprintf(filename, PATH_MAX, "%s-%s-%d.%s", dump, hostname, getpid(), streamFormat == STREAM_BINARY ? "bin" : "json");
+  streamFile = fopen(filename, "w");
+  if (streamFile == NULL) goto fail;
+  if (streamFormat == STREAM_BINARY) {
+    struct profileFileHeader header = { PROFILE_FILE_MAGIC, PROFILE_FILE_VERSION, sizeof(struct profileRecord), getpid(), 0 };
+    fwrite(&header, sizeof(header), 1, streamFile);
+  } else {
+    fprintf(streamFile, "[\n");
+  }
+  streamStop = 0;
+  streamFlushRequest = streamFlushDone = streamDropped = 0;
+  if (pthread_create(&streamThread, NULL, streamMain, NULL) != 0) goto fail;
+  return ncclSuccess;
+fail:
+  if (streamFile) fclose(streamFile);
+  streamFile = NULL;
+  streamFormat = STREAM_NONE;
+  return ncclSystemError;
+}
+
+static void streamEnd(void) {
+  __atomic_store_n(&streamStop, 1, __ATOMIC_RELEASE);
+  pthread_join(streamThread, NULL);
+  if (streamFormat == STREAM_PERFETTO) fprintf(streamFile, "{}]\n");
+  if (streamDropped) fprintf(stderr, "NCCL profiler: %lu completed events were not written, the rings were full\n", streamDropped);
+  fclose(streamFile);
+  streamFile = NULL;
+  streamFormat = STREAM_NONE;
+}
+
+// last context stops the writer thread and frees the thread pools
+static void exampleProfilerRelease(void) {
+  pthread_mutex_lock(&lock);
+  if (__atomic_sub_fetch(&initialized, 1, __ATOMIC_RELAXED) == 0) {
+    if (streamFormat != STREAM_NONE) streamEnd();
+    freeThreadPools();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
 __hidden ncclResult_t exampleProfilerInit(void** context, int* eActivationMask) {
   pthread_mutex_lock(&lock);
   if (__atomic_fetch_add(&initialized, 1, __ATOMIC_RELAXED) == 0) {
-    // first thread initializes event mask, environment and detach pool
+    // first thread initializes event mask, environment and writer thread
     __atomic_store_n(eActivationMask, ncclProfileColl | ncclProfileP2p, __ATOMIC_RELAXED);
     if (getenv("NCCL_PROFILE_EVENT_MASK")) {
       __atomic_store_n(eActivationMask, atoi(getenv("NCCL_PROFILE_EVENT_MASK")), __ATOMIC_RELAXED);
@@ -75,12 +247,6 @@ __hidden ncclResult_t exampleProfilerInit(void** context, int* eActivationMask)
     if (getenv("NCCL_PROFILE_PROXY_DETACH_POOL_SIZE")) {
       detachPoolSize = atoi(getenv("NCCL_PROFILE_PROXY_DETACH_POOL_SIZE"));
     }
-    // detach pool is used to store PXN proxyOps and is shared among threads
-    detachPool = (struct proxyOp *)calloc(detachPoolSize, sizeof(*detachPool));
-    if (detachPool == NULL) {
-      pthread_mutex_unlock(&lock);
-      return ncclSystemError;
-    }
     // Pid of the process initializing the profiler first.
     // This is compared against the pid of proxyOp events
     // to figure out if they have a parent event in this
@@ -90,11 +256,18 @@ __hidden ncclResult_t exampleProfilerInit(void** context, int* eActivationMask)
     // calibrate and start timer
     calibrate();
     startTime = gettime();
+
+    if (streamStart() != ncclSuccess) {
+      __atomic_fetch_sub(&initialized, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&lock);
+      return ncclSystemError;
+    }
   }
   pthread_mutex_unlock(&lock);
 
   // pre-allocate memory for event object pools in dedicated profiler context
   struct context* ctx = (struct context *)calloc(1, sizeof(*ctx));
+  if (ctx == NULL) goto fail;
   ctx->groupPool = (struct group *)calloc(groupPoolSize, sizeof(*ctx->groupPool));
   if (ctx->groupPool == NULL) goto fail;
 
@@ -112,12 +285,14 @@ __hidden ncclResult_t exampleProfilerInit(void** context, int* eActivationMask)
 
 fail:
   // cleanup resources
-  if (ctx->proxyCtrlPool) free(ctx->proxyCtrlPool);
-  if (ctx->p2pPool) free(ctx->p2pPool);
-  if (ctx->collPool) free(ctx->collPool);
-  if (ctx->groupPool) free(ctx->groupPool);
-  free(ctx);
-  if (detachPool) free(detachPool);
+  if (ctx) {
+    free(ctx->proxyCtrlPool);
+    free(ctx->p2pPool);
+    free(ctx->collPool);
+    free(ctx->groupPool);
+    free(ctx);
+  }
+  exampleProfilerRelease();
   return ncclSystemError;
 }
 
@@ -125,16 +300,21 @@ __hidden ncclResult_t exampleProfilerFinalize(void* context) {
   FILE* fh = NULL;
   char filename[PATH_MAX] = { 0 };
   char hostname[64] = { 0 };
-  gethostname(hostname, 64);
+  struct context* ctx = (struct context *)context;
   const char* dump = getenv("NCCL_PROFILE_DUMP_FILE");
+  if (streamFormat != STREAM_NONE) {
+    // completed events of this context were streamed, write those still queued
+    streamFlush();
+    dump = NULL;
+  }
   if (dump) {
+    gethostname(hostname, 64);
     sprintf(filename, "%s-%s-%ld.txt", dump, hostname, syscall(SYS_gettid));
     fh = fopen(filename, "w");
-    fprintf(fh, "[\n");
+    if (fh) fprintf(fh, "[\n");
   }
 
   // print last N groups/collectives/p2ps
-  struct context* ctx = (struct context *)context;
   int start = (ctx->groupPoolIndex - groupPoolSize >= 0) ? ctx->groupPoolIndex - groupPoolSize : 0;
   int end = ctx->groupPoolIndex;
   for (int i = start; i < end; i++) {
@@ -153,19 +333,23 @@ __hidden ncclResult_t exampleProfilerFinalize(void* context) {
   free(ctx->proxyCtrlPool);
   free(ctx);
 
-  // last thread cleans up shared detach pool
-  if (__atomic_fetch_sub(&initialized, 1, __ATOMIC_RELAXED) - 1 == 0) {
-    start = (detachPoolIndex - detachPoolSize >= 0) ? detachPoolIndex - detachPoolSize : 0;
-    end = detachPoolIndex;
-    for (int i = start; i < end; i++) {
-      printEvent(fh, &detachPool[i%detachPoolSize]);
+  pthread_mutex_lock(&lock);
+  // last thread prints the PXN proxyOps of all threads
+  if (__atomic_load_n(&initialized, __ATOMIC_RELAXED) == 1) {
+    for (struct threadPool* tp = threadPools; tp; tp = tp->next) {
+      int index = __atomic_load_n(&tp->detachPoolIndex, __ATOMIC_ACQUIRE);
+      start = (index - detachPoolSize >= 0) ? index - detachPoolSize : 0;
+      for (int i = start; i < index; i++) {
+        printEvent(fh, &tp->detachPool[i%detachPoolSize]);
+      }
     }
-    free(detachPool);
   }
+  pthread_mutex_unlock(&lock);
 
   if (fh) fprintf(fh, "{}]\n");
   if (fh) fclose(fh);
 
+  exampleProfilerRelease();
   return ncclSuccess;
 }
 
@@ -246,6 +430,9 @@ __hidden ncclResult_t exampleProfilerStartEvent(void* context, void** eHandle, n
     event->proto = eDescr->coll.proto;
     event->isCollnet = eDescr->coll.isCollnet;
     event->isNvls = eDescr->coll.isNvls;
+    event->mscclAlgoName = eDescr->coll.mscclAlgoName;
+    event->mscclAlgoHandle = eDescr->coll.mscclAlgoHandle;
+    event->mscclNBlocks = eDescr->coll.mscclNBlocks;
     *eHandle = event;
     taskEventQueueEnqueue(parent, (struct taskEventBase *)event);
     // increment the group ref counter so the event will staty open
@@ -298,16 +485,18 @@ __hidden ncclResult_t exampleProfilerStartEvent(void* context, void** eHandle, n
 
     if (eDescr->proxyOp.pid != pid) {
       // PXN captured proxyOp events
-      struct proxyOp* event;
-      int detachId = __atomic_fetch_add(&detachPoolIndex, 1, __ATOMIC_RELAXED);
-      if ((detachId - detachPoolBase) < detachPoolSize) {
-        // if there are available detached proxyOp events grab one
-        event = &detachPool[detachId%detachPoolSize];
-      } else {
-        // else drop this event
-        __atomic_fetch_sub(&detachPoolIndex, 1, __ATOMIC_RELAXED);
+      // PXN proxyOps are started by proxy threads, each taking them from its own pool
+      struct threadPool* tp = getThreadPool();
+      if (tp == NULL) return ncclSuccess;
+      int detachId = tp->detachPoolIndex;
+      if ((detachId - __atomic_load_n(&tp->detachPoolBase, __ATOMIC_ACQUIRE)) >= detachPoolSize) {
+        // drop this event if the pool is full
         return ncclSuccess;
       }
+      struct proxyOp* event = &tp->detachPool[detachId%detachPoolSize];
+      memset(event, 0, sizeof(*event));
+      __atomic_store_n(&tp->detachPoolIndex, detachId+1, __ATOMIC_RELEASE);
+      event->pool = tp;
 
       event->type = ncclProfileProxyOp;
       event->channelId = eDescr->proxyOp.channelId;
@@ -381,8 +570,8 @@ void updateEvent(void* handle) {
     struct group* event = (struct group *)handle;
     if (__atomic_fetch_sub(&event->refCount, 1, __ATOMIC_RELAXED) == 1) {
       event->stopTs = gettime() - startTime;
-      // return group event to the pool
-      __atomic_fetch_add(&event->ctx->groupPoolBase, 1, __ATOMIC_RELAXED);
+      // return group event to the pool, once written when streaming
+      if (streamFormat == STREAM_NONE || !streamPush(event)) releaseEvent(event);
     }
     debugEvent(event, "GroupStop");
   } else if (type == ncclProfileColl) {
@@ -408,14 +597,7 @@ void updateEvent(void* handle) {
     event->stopTs = gettime() - startTime;
     if (event->pid != pid) {
       // only for proxyOps that don't have a parent collective/p2p (i.e., PXN)
-      int done = __atomic_fetch_add(&detachPoolDone, 1, __ATOMIC_RELAXED) + 1;
-      if (done == detachPoolSize) {
-        // reset the event completed (done) counter
-        __atomic_store_n(&detachPoolDone, 0, __ATOMIC_RELAXED);
-        // update the base pointer to the top of the pool
-        int index = __atomic_load_n(&detachPoolIndex, __ATOMIC_RELAXED);
-        __atomic_store_n(&detachPoolBase, index, __ATOMIC_RELAXED);
-      }
+      if (streamFormat == STREAM_NONE || !streamPush(event)) releaseEvent(event);
       debugEvent(event, "ProxyOpStop");
       return;
     }
@@ -428,6 +610,7 @@ void updateEvent(void* handle) {
   } else if (type == ncclProfileProxyCtrl) {
     struct proxyCtrl* event = (struct proxyCtrl *)handle;
     event->stopTs = gettime() - startTime;
+    if (streamFormat != STREAM_NONE) streamPush(event);
     debugEvent(event, "ProxyCtrlStop");
   }
 }
@@ -77,6 +77,11 @@ __hidden void printGroupEventTrailer(FILE* fh, struct group* event) {
 
 static __thread int collId;
 __hidden void printCollEventHeader(FILE* fh, struct collective* event) {
+  if (event->mscclAlgoName) {
+    fprintf(fh, "{\"name\": \"%s\", \"cat\": \"COLL\", \"ph\": \"b\", \"id\": %d, \"pid\": %d, \"tid\": %d, \"ts\": %f, \"args\": {\"SeqNum\": %lu, \"CommHash\": %lu, \"Rank\": %d, \"Count\": %lu, \"Datatype\": %d, \"Algorithm\": \"MSCCL\", \"MscclAlgo\": \"%s\", \"MscclHandle\": %d, \"nBlocks\": %d, \"Protocol\": \"%s\", \"nMaxChannels\": %d}},\n",
+            ncclFuncToString(event->base.func), collId, getpid(), 1, event->base.startTs, event->seqNumber, event->base.commHash, event->base.rank, event->count, event->datatype, event->mscclAlgoName, event->mscclAlgoHandle, event->mscclNBlocks, ncclProtoToString(event->proto), event->nMaxChannels);
+    return;
+  }
   fprintf(fh, "{\"name\": \"%s\", \"cat\": \"COLL\", \"ph\": \"b\", \"id\": %d, \"pid\": %d, \"tid\": %d, \"ts\": %f, \"args\": {\"SeqNum\": %lu, \"CommHash\": %lu, \"Rank\": %d, \"Count\": %lu, \"Datatype\": %d, \"Algorithm\": \"%s\", \"Protocol\": \"%s\", \"nMaxChannels\": %d}},\n",
           ncclFuncToString(event->base.func), collId, getpid(), 1, event->base.startTs, event->seqNumber, event->base.commHash, event->base.rank, event->count, event->datatype, ncclAlgoToString(event->algo), ncclProtoToString(event->proto), event->nMaxChannels);
 }
@@ -275,3 +280,71 @@ void printEvent(FILE* fh, void* handle) {
   }
   return;
 }
+
+static void writeRecord(FILE* fh, struct profileRecord* r, uint8_t type, double startTs, double stopTs) {
+  r->type = type;
+  r->startTs = startTs;
+  r->stopTs = stopTs;
+  fwrite(r, sizeof(*r), 1, fh);
+}
+
+void writeEvent(FILE* fh, void* handle) {
+  if (handle == NULL || fh == NULL) return;
+  struct profileRecord r = { 0 };
+  uint8_t type = *(uint8_t *)handle;
+  if (type == ncclProfileGroup) {
+    struct group* g = (struct group *)handle;
+    r.rank = g->groupId;
+    writeRecord(fh, &r, type, g->startTs, g->stopTs);
+    for (struct taskEventBase* base = taskEventQueueHead(g); base; base = base->next) {
+      writeEvent(fh, base);
+    }
+  } else if (type == ncclProfileColl) {
+    struct collective* c = (struct collective *)handle;
+    r.func = c->base.func;
+    r.algo = c->algo;
+    r.proto = c->proto;
+    r.rank = c->base.rank;
+    r.peer = c->root;
+    r.channel = c->nMaxChannels;
+    r.seq = c->seqNumber;
+    r.count = c->count;
+    r.commHash = c->base.commHash;
+    writeRecord(fh, &r, type, c->base.startTs, c->base.stopTs);
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+      writeEvent(fh, &c->send[i]);
+      writeEvent(fh, &c->recv[i]);
+    }
+  } else if (type == ncclProfileP2p) {
+    struct p2p* p = (struct p2p *)handle;
+    r.func = p->base.func;
+    r.rank = p->base.rank;
+    r.peer = p->peer;
+    r.count = p->count;
+    r.commHash = p->base.commHash;
+    writeRecord(fh, &r, type, p->base.startTs, p->base.stopTs);
+    writeEvent(fh, &p->op);
+  } else if (type == ncclProfileProxyOp) {
+    struct proxyOp* p = (struct proxyOp *)handle;
+    r.func = p->isSend;
+    r.rank = p->rank;
+    r.peer = p->peer;
+    r.channel = p->channelId;
+    r.seq = p->transSize;
+    r.count = p->nSteps;
+    writeRecord(fh, &r, type, p->startTs, p->stopTs);
+    for (int i = 0; i < MAX_STEPS; i++) {
+      writeEvent(fh, &p->step[i]);
+    }
+  } else if (type == ncclProfileProxyStep) {
+    struct proxyStep* p = (struct proxyStep *)handle;
+    r.func = p->isSend;
+    r.rank = p->step;
+    writeRecord(fh, &r, type, p->startTs, p->stopTs);
+  } else if (type == ncclProfileProxyCtrl) {
+    struct proxyCtrl* p = (struct proxyCtrl *)handle;
+    r.func = p->state;
+    r.peer = p->appended;
+    writeRecord(fh, &r, type, p->startTs, p->stopTs);
+  }
+}
@@ -9,5 +9,6 @@
 
 void debugEvent(void* eHandle, const char* tag);
 void printEvent(FILE* fh, void* handle);
+void writeEvent(FILE* fh, void* handle);
 
 #endif
@@ -46,6 +46,64 @@ typedef enum {
 #define NCCL_ALGO_PROTO_IGNORE -1.0
 
 // API to be implemented by external tuner
+typedef struct {
+  // Name of the tuner
+  const char* name;
+
+  // Initializes tuner states.
+  // Inputs:
+  //   - nRanks: number of ranks in current communicator. Each communicator initialize its own tuner.
+  //   - nNodes: number of nodes in current communicator.
+  //   - logFunction: a logFunction can be useful to integrate logging together with NCCL core.
+  // Outputs:
+  //   - context: tuner context object
+  ncclResult_t (*init)(size_t nRanks, size_t nNodes, ncclDebugLogger_t logFunction, void **context);
+
+  // Gets info (algo, protocol, number of ctas and threads) for a given collective.
+  // Inputs:
+  //   - context: tuner context object
+  //   - collType: collective type , e.g., allreduce, allgather…
+  //   - nBytes: collective size in bytes
+  //   - numPipeOps: number of operations in the group
+  //   - numAlgo: number of algorithms in collCostTable
+  //   - numProto: number of protocols in collCostTable
+  //
+  // Outputs:
+  //   - nChannels: number of channels (hence SMs) to be used.
+  //
+  // InOut:
+  //   - collCostTable: collective cost table, generated by NCCL core, containing algo|proto|time entries for collType.
+  //                    NCCL core sets ignored algo/proto cost table entries to -1.0 (NCCL_ALGO_PROTO_IGNORE).
+  //
+  // If getCollInfo() does not return ncclSuccess, NCCL will fall back to the
+  // default tuning for the given collective.
+  // Also, the plugin is allowed to not set any output, or set only the
+  // algorithm and protocol, but not only the algorithm or only the protocol.
+  // Unset fields will be set automatically by NCCL.
+  ncclResult_t (*getCollInfo)(void* context, ncclFunc_t collType, size_t nBytes,
+                              int numPipeOps, float** collCostTable, int numAlgo, int numProto,
+                              int* nChannels);
+
+  // Terminates the plugin and cleans up any resources that the plugin allocated.
+  // context: tuner context object
+  ncclResult_t (*destroy)(void* context);
+
+  // Reports the measured time of a collective NCCL ran with the outputs of getCollInfo, so that
+  // the plugin can adapt its choices online. May be NULL. Only a sample of collectives is timed,
+  // every NCCL_TUNER_FEEDBACK_INTERVAL launches of a kernel running a single collective, and they
+  // are reported from the thread launching the later ones, after the GPU completed them.
+  // Inputs:
+  //   - context: tuner context object
+  //   - collType: collective type , e.g., allreduce, allgather…
+  //   - nBytes: collective size in bytes, as given to getCollInfo
+  //   - algorithm: algorithm NCCL ran
+  //   - protocol: protocol NCCL ran
+  //   - nChannels: number of channels the kernel ran on
+  //   - timeUs: time of the kernel in microseconds, measured with CUDA events
+  ncclResult_t (*reportPerf)(void* context, ncclFunc_t collType, size_t nBytes,
+                             int algorithm, int protocol, int nChannels, float timeUs);
+} ncclTuner_v4_t;
+
 typedef struct {
   // Name of the tuner
   const char* name;
@@ -89,8 +147,8 @@ typedef struct {
   ncclResult_t (*destroy)(void* context);
 } ncclTuner_v3_t;
 
-typedef ncclTuner_v3_t ncclTuner_t;
+typedef ncclTuner_v4_t ncclTuner_t;
 
-#define NCCL_TUNER_PLUGIN_SYMBOL "ncclTunerPlugin_v3"
+#define NCCL_TUNER_PLUGIN_SYMBOL "ncclTunerPlugin_v4"
 
 #endif
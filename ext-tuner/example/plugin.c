@@ -21,13 +21,20 @@ __hidden ncclResult_t pluginGetCollInfo(void* context, ncclFunc_t collType, size
   return ncclSuccess;
 }
 
+__hidden ncclResult_t pluginReportPerf(void* context, ncclFunc_t collType, size_t nBytes,
+                              int algorithm, int protocol, int nChannels, float timeUs) {
+  // Measured times could correct the cost table returned by later getCollInfo calls
+  return ncclSuccess;
+}
+
 __hidden ncclResult_t pluginDestroy(void* context) { return ncclSuccess; }
 
 #define PLUGIN_NAME "Example"
 
-const ncclTuner_v3_t ncclTunerPlugin_v3 = {
+const ncclTuner_v4_t ncclTunerPlugin_v4 = {
   .name = PLUGIN_NAME,
   .init = pluginInit,
   .getCollInfo = pluginGetCollInfo,
-  .destroy = pluginDestroy
+  .destroy = pluginDestroy,
+  .reportPerf = pluginReportPerf
 };
@@ -0,0 +1,354 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+// Tuner plugin applying a table of measured-best choices.
+//
+// NCCL_TUNER_TABLE_FILE names a CSV file with one rule per line:
+//   coll,minBytes,maxBytes,nRanks,nNodes,algo,proto,nChannels[,timeUs]
+// coll is broadcast, reduce, allgather, reducescatter or allreduce. The rule applies to
+// collectives of minBytes to maxBytes bytes, both included. nRanks and nNodes may be -1 to
+// match any comm. algo is tree, ring, collnet_direct, collnet_chain, nvls, nvls_tree or pat,
+// proto is ll, ll128 or simple; either may be -1 to leave the choice to NCCL. nChannels -1 or
+// 0 keeps the channels of NCCL. Empty lines and lines starting with '#' are skipped.
+//
+// At init, the rules of the comm's nRanks and nNodes are kept. Where the ranges of two rules
+// overlap, the overlap goes to the one naming nRanks and nNodes over a wildcard, then to the one
+// with the lower timeUs, then to the first in the file. What is left is a sorted list of disjoint
+// ranges per collective, searched in O(log n) by getCollInfo.
+//
+// NCCL_TUNER_TABLE_DUMP_FILE names a file that rules are appended to when the comm is destroyed.
+// They are made from the times NCCL reports: for every collective and power of two size range,
+// the algorithm, protocol and channels with the lowest average time. Benchmarks run with various
+// NCCL_ALGO, NCCL_PROTO and NCCL_MAX_NCHANNELS settings and the same dump file therefore build
+// a table, whose overlapping rules the loader resolves by their time.
+
+#include "tuner.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define __hidden __attribute__ ((visibility("hidden")))
+
+#define PLUGIN_NAME "Table"
+#define MAX_LINE 256
+// Size ranges of the measured times, 2^i to 2^(i+1)-1 bytes
+#define NUM_SIZE_BUCKETS 64
+#define MAX_MEASURED 16
+
+struct tableRule {
+  size_t minBytes, maxBytes;
+  int nRanks, nNodes;
+  int algo, proto, nChannels;
+  float timeUs;
+  int line;
+};
+
+struct measured {
+  int algo, proto, nChannels;
+  int count;
+  double sumUs;
+};
+
+struct tableContext {
+  size_t nRanks, nNodes;
+  ncclDebugLogger_t log;
+  // Disjoint rules sorted by minBytes, per collective
+  struct tableRule* rules[NCCL_NUM_FUNCTIONS];
+  int nRules[NCCL_NUM_FUNCTIONS];
+  // Reported times, only with a dump file
+  char* dumpFile;
+  struct measured* measured[NCCL_NUM_FUNCTIONS][NUM_SIZE_BUCKETS];
+  int nMeasured[NCCL_NUM_FUNCTIONS][NUM_SIZE_BUCKETS];
+};
+
+#define WARN(ctx, ...) do { if ((ctx)->log) (ctx)->log(NCCL_LOG_WARN, NCCL_TUNING, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define INFO(ctx, ...) do { if ((ctx)->log) (ctx)->log(NCCL_LOG_INFO, NCCL_TUNING, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+
+static const char* collNames[NCCL_NUM_FUNCTIONS] = { "broadcast", "reduce", "allgather", "reducescatter", "allreduce" };
+static const char* algoNames[NCCL_NUM_ALGORITHMS] = { "tree", "ring", "collnet_direct", "collnet_chain", "nvls", "nvls_tree", "pat" };
+static const char* protoNames[NCCL_NUM_PROTOCOLS] = { "ll", "ll128", "simple" };
+
+// Index of name in names, -1 for "-1", -2 when unknown
+static int parseName(const char* str, const char** names, int n) {
+  if (strcmp(str, "-1") == 0) return -1;
+  for (int i = 0; i < n; i++) {
+    if (strcasecmp(str, names[i]) == 0) return i;
+  }
+  return -2;
+}
+
+static char* trim(char* str) {
+  while (isspace((unsigned char)*str)) str++;
+  char* end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1])) *--end = '\0';
+  return str;
+}
+
+// Returns 1 for a rule, 0 for a line to skip, -1 for a malformed line
+static int parseRule(char* line, int* coll, struct tableRule* rule) {
+  char* fields[9];
+  int nFields = 0;
+  char* str = trim(line);
+  if (*str == '\0' || *str == '#') return 0;
+  for (char* tok = strtok(str, ","); tok && nFields < 9; tok = strtok(NULL, ",")) fields[nFields++] = trim(tok);
+  if (nFields < 8) return -1;
+  char* end;
+  *coll = parseName(fields[0], collNames, NCCL_NUM_FUNCTIONS);
+  rule->minBytes = strtoull(fields[1], &end, 0);
+  if (*end) return -1;
+  rule->maxBytes = strtoull(fields[2], &end, 0);
+  if (*end) return -1;
+  rule->nRanks = strtol(fields[3], &end, 0);
+  if (*end) return -1;
+  rule->nNodes = strtol(fields[4], &end, 0);
+  if (*end) return -1;
+  rule->algo = parseName(fields[5], algoNames, NCCL_NUM_ALGORITHMS);
+  rule->proto = parseName(fields[6], protoNames, NCCL_NUM_PROTOCOLS);
+  rule->nChannels = strtol(fields[7], &end, 0);
+  if (*end) return -1;
+  rule->timeUs = -1;
+  if (nFields > 8) {
+    rule->timeUs = strtof(fields[8], &end);
+    if (*end) return -1;
+  }
+  if (*coll < 0 || rule->algo == -2 || rule->proto == -2 || rule->minBytes > rule->maxBytes) return -1;
+  return 1;
+}
+
+// Whether a wins over b where their ranges overlap
+static int ruleBefore(const struct tableRule* a, const struct tableRule* b) {
+  int specA = (a->nRanks != -1) + (a->nNodes != -1);
+  int specB = (b->nRanks != -1) + (b->nNodes != -1);
+  if (specA != specB) return specA > specB;
+  if (a->timeUs >= 0 && b->timeUs >= 0 && a->timeUs != b->timeUs) return a->timeUs < b->timeUs;
+  if ((a->timeUs >= 0) != (b->timeUs >= 0)) return a->timeUs >= 0;
+  return a->line < b->line;
+}
+
+static int ruleCmpPriority(const void* a, const void* b) {
+  return ruleBefore((const struct tableRule*)a, (const struct tableRule*)b) ? -1 : 1;
+}
+
+static int ruleCmpBytes(const void* a, const void* b) {
+  const struct tableRule* ra = (const struct tableRule*)a;
+  const struct tableRule* rb = (const struct tableRule*)b;
+  return ra->minBytes < rb->minBytes ? -1 : ra->minBytes > rb->minBytes ? 1 : 0;
+}
+
+// Takes rules by priority, each keeping the parts of its range no rule taken before covers, so
+// that kept rules are disjoint and sorted by size. kept needs room for 2*nRules-1 rules.
+static int buildIndex(struct tableRule* kept, struct tableRule* rules, int nRules) {
+  int nKept = 0;
+  qsort(rules, nRules, sizeof(struct tableRule), ruleCmpPriority);
+  for (int r = 0; r < nRules; r++) {
+    int nOld = nKept;
+    size_t lo = rules[r].minBytes;
+    int done = 0;
+    for (int k = 0; k <= nOld && !done; k++) {
+      size_t gapEnd = k < nOld ? kept[k].minBytes : 0;
+      if (k == nOld || gapEnd > lo) {
+        struct tableRule piece = rules[r];
+        piece.minBytes = lo;
+        if (k < nOld && gapEnd - 1 < piece.maxBytes) piece.maxBytes = gapEnd - 1;
+        if (piece.minBytes <= piece.maxBytes) kept[nKept++] = piece;
+      }
+      if (k == nOld || kept[k].maxBytes >= rules[r].maxBytes) done = 1;
+      else if (kept[k].maxBytes + 1 > lo) lo = kept[k].maxBytes + 1;
+    }
+    qsort(kept, nKept, sizeof(struct tableRule), ruleCmpBytes);
+  }
+  return nKept;
+}
+
+static ncclResult_t loadTable(struct tableContext* ctx, const char* path) {
+  ncclResult_t ret = ncclSuccess;
+  struct tableRule* rules[NCCL_NUM_FUNCTIONS] = { NULL };
+  int nRules[NCCL_NUM_FUNCTIONS] = { 0 };
+  int maxRules[NCCL_NUM_FUNCTIONS] = { 0 };
+  char line[MAX_LINE];
+  int lineNum = 0;
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    WARN(ctx, "TUNER/Table: cannot open %s: %s", path, strerror(errno));
+    return ncclSystemError;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    struct tableRule rule;
+    int coll;
+    lineNum++;
+    int res = parseRule(line, &coll, &rule);
+    if (res == 0) continue;
+    if (res < 0) {
+      WARN(ctx, "TUNER/Table: %s:%d is malformed", path, lineNum);
+      ret = ncclInvalidUsage;
+      goto exit;
+    }
+    if (rule.nRanks != -1 && rule.nRanks != (int)ctx->nRanks) continue;
+    if (rule.nNodes != -1 && rule.nNodes != (int)ctx->nNodes) continue;
+    rule.line = lineNum;
+    if (nRules[coll] == maxRules[coll]) {
+      maxRules[coll] = maxRules[coll] ? 2*maxRules[coll] : 16;
+      struct tableRule* grown = (struct tableRule*)realloc(rules[coll], maxRules[coll]*sizeof(struct tableRule));
+      if (grown == NULL) { ret = ncclSystemError; goto exit; }
+      rules[coll] = grown;
+    }
+    rules[coll][nRules[coll]++] = rule;
+  }
+  for (int c = 0; c < NCCL_NUM_FUNCTIONS; c++) {
+    if (nRules[c] == 0) continue;
+    ctx->rules[c] = (struct tableRule*)malloc((2*nRules[c]-1)*sizeof(struct tableRule));
+    if (ctx->rules[c] == NULL) { ret = ncclSystemError; goto exit; }
+    ctx->nRules[c] = buildIndex(ctx->rules[c], rules[c], nRules[c]);
+    INFO(ctx, "TUNER/Table: %d ranges from %d %s rules apply to %zu ranks on %zu nodes", ctx->nRules[c], nRules[c], collNames[c], ctx->nRanks, ctx->nNodes);
+  }
+exit:
+  for (int c = 0; c < NCCL_NUM_FUNCTIONS; c++) free(rules[c]);
+  fclose(file);
+  return ret;
+}
+
+static const struct tableRule* findRule(struct tableContext* ctx, int coll, size_t nBytes) {
+  const struct tableRule* rules = ctx->rules[coll];
+  int lo = 0, hi = ctx->nRules[coll];
+  // Last rule starting at or below nBytes
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (rules[mid].minBytes <= nBytes) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0 || rules[lo-1].maxBytes < nBytes) return NULL;
+  return rules + lo - 1;
+}
+
+__hidden ncclResult_t pluginInit(size_t nRanks, size_t nNodes, ncclDebugLogger_t logFunction, void **context) {
+  struct tableContext* ctx = (struct tableContext*)calloc(1, sizeof(struct tableContext));
+  if (ctx == NULL) return ncclSystemError;
+  ctx->nRanks = nRanks;
+  ctx->nNodes = nNodes;
+  ctx->log = logFunction;
+  const char* path = getenv("NCCL_TUNER_TABLE_FILE");
+  if (path && *path) {
+    ncclResult_t ret = loadTable(ctx, path);
+    if (ret != ncclSuccess) {
+      for (int c = 0; c < NCCL_NUM_FUNCTIONS; c++) free(ctx->rules[c]);
+      free(ctx);
+      return ret;
+    }
+  }
+  const char* dump = getenv("NCCL_TUNER_TABLE_DUMP_FILE");
+  if (dump && *dump) ctx->dumpFile = strdup(dump);
+  *context = ctx;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t pluginGetCollInfo(void* context, ncclFunc_t collType, size_t nBytes,
+                              int numPipeOps, float** collCostTable, int numAlgo, int numProto,
+                              int* nChannels) {
+  struct tableContext* ctx = (struct tableContext*)context;
+  if (collType >= NCCL_NUM_FUNCTIONS) return ncclSuccess;
+  const struct tableRule* rule = findRule(ctx, collType, nBytes);
+  if (rule == NULL) return ncclSuccess;
+  if (rule->algo >= 0 && rule->proto >= 0) {
+    // Rules naming a choice this comm cannot run leave it to NCCL
+    if (rule->algo >= numAlgo || rule->proto >= numProto) return ncclSuccess;
+    if (collCostTable[rule->algo][rule->proto] == NCCL_ALGO_PROTO_IGNORE) return ncclSuccess;
+    collCostTable[rule->algo][rule->proto] = 0.0;
+  } else if (rule->algo >= 0 || rule->proto >= 0) {
+    // Prefer the cheapest entry of the given algorithm or protocol
+    int bestA = -1, bestP = -1;
+    for (int a = 0; a < numAlgo; a++) {
+      if (rule->algo >= 0 && a != rule->algo) continue;
+      for (int p = 0; p < numProto; p++) {
+        if (rule->proto >= 0 && p != rule->proto) continue;
+        if (collCostTable[a][p] == NCCL_ALGO_PROTO_IGNORE) continue;
+        if (bestA == -1 || collCostTable[a][p] < collCostTable[bestA][bestP]) { bestA = a; bestP = p; }
+      }
+    }
+    if (bestA == -1) return ncclSuccess;
+    collCostTable[bestA][bestP] = 0.0;
+  }
+  if (rule->nChannels > 0) *nChannels = rule->nChannels;
+  return ncclSuccess;
+}
+
+__hidden ncclResult_t pluginReportPerf(void* context, ncclFunc_t collType, size_t nBytes,
+                              int algorithm, int protocol, int nChannels, float timeUs) {
+  struct tableContext* ctx = (struct tableContext*)context;
+  if (ctx->dumpFile == NULL || collType >= NCCL_NUM_FUNCTIONS || nBytes == 0) return ncclSuccess;
+  int bucket = 63 - __builtin_clzll((unsigned long long)nBytes);
+  struct measured* m = ctx->measured[collType][bucket];
+  int n = ctx->nMeasured[collType][bucket];
+  int i;
+  for (i = 0; i < n; i++) {
+    if (m[i].algo == algorithm && m[i].proto == protocol && m[i].nChannels == nChannels) break;
+  }
+  if (i == n) {
+    if (m == NULL) {
+      m = ctx->measured[collType][bucket] = (struct measured*)calloc(MAX_MEASURED, sizeof(struct measured));
+      if (m == NULL) return ncclSystemError;
+    }
+    if (n == MAX_MEASURED) return ncclSuccess;
+    m[i].algo = algorithm;
+    m[i].proto = protocol;
+    m[i].nChannels = nChannels;
+    ctx->nMeasured[collType][bucket]++;
+  }
+  m[i].count++;
+  m[i].sumUs += timeUs;
+  return ncclSuccess;
+}
+
+static void dumpTable(struct tableContext* ctx) {
+  FILE* file = fopen(ctx->dumpFile, "a");
+  if (file == NULL) {
+    WARN(ctx, "TUNER/Table: cannot open %s: %s", ctx->dumpFile, strerror(errno));
+    return;
+  }
+  int nWritten = 0;
+  for (int c = 0; c < NCCL_NUM_FUNCTIONS; c++) {
+    for (int b = 0; b < NUM_SIZE_BUCKETS; b++) {
+      struct measured* m = ctx->measured[c][b];
+      struct measured* best = NULL;
+      for (int i = 0; i < ctx->nMeasured[c][b]; i++) {
+        if (m[i].algo < 0 || m[i].algo >= NCCL_NUM_ALGORITHMS || m[i].proto < 0 || m[i].proto >= NCCL_NUM_PROTOCOLS) continue;
+        if (best == NULL || m[i].sumUs/m[i].count < best->sumUs/best->count) best = m+i;
+      }
+      if (best == NULL) continue;
+      unsigned long long lo = 1ULL << b;
+      unsigned long long hi = b == 63 ? ~0ULL : (1ULL << (b+1)) - 1;
+      fprintf(file, "%s,%llu,%llu,%zu,%zu,%s,%s,%d,%.3f\n", collNames[c], lo, hi, ctx->nRanks, ctx->nNodes,
+          algoNames[best->algo], protoNames[best->proto], best->nChannels, best->sumUs/best->count);
+      nWritten++;
+    }
+  }
+  fclose(file);
+  INFO(ctx, "TUNER/Table: appended %d rules to %s", nWritten, ctx->dumpFile);
+}
+
+__hidden ncclResult_t pluginDestroy(void* context) {
+  struct tableContext* ctx = (struct tableContext*)context;
+  if (ctx == NULL) return ncclSuccess;
+  if (ctx->dumpFile) {
+    dumpTable(ctx);
+    free(ctx->dumpFile);
+  }
+  for (int c = 0; c < NCCL_NUM_FUNCTIONS; c++) {
+    free(ctx->rules[c]);
+    for (int b = 0; b < NUM_SIZE_BUCKETS; b++) free(ctx->measured[c][b]);
+  }
+  free(ctx);
+  return ncclSuccess;
+}
+
+const ncclTuner_v4_t ncclTunerPlugin_v4 = {
+  .name = PLUGIN_NAME,
+  .init = pluginInit,
+  .getCollInfo = pluginGetCollInfo,
+  .destroy = pluginDestroy,
+  .reportPerf = pluginReportPerf
+};
@@ -17,6 +17,11 @@ NVTX ?= 1
 RDMA_CORE ?= 0
 ENABLE_PRECISION_CLIPPING_HALF ?= 0 # Flag to enable precision flag for half, set 1 to enable, 0 to disable
 MSCCL_MAX_NUM_STEPS ?= 64  # Default value for dynamic number of instructions
+MSCCL_SHMEM_NUM_STEPS ?= 64  # Steps of a thread block kept in shared memory, longer programs are streamed
+MSCCL_SPECIALIZE_KERNELS ?= 0 # Set 1 to also build kernels without the local copy and reduce paths
+MSCCL_MIXED_PROTOCOL_KERNELS ?= 1 # Set 0 to leave out the kernels of algorithms mixing protocols
+MSCCL_FAN_KERNELS ?= 1 # Set 0 to leave out the kernels of algorithms with fan-in and fan-out instructions
+NCCL_BULK_COPY ?= 0 # Set 1 to copy large Simple protocol slices with bulk copies on sm90 and later
 
 NVCC = $(CUDA_HOME)/bin/nvcc
 
@@ -137,3 +142,30 @@ ifdef MSCCL_MAX_NUM_STEPS
 CXXFLAGS += -DMSCCL_MAX_NUM_STEPS=$(MSCCL_MAX_NUM_STEPS)
 NVCUFLAGS += -DMSCCL_MAX_NUM_STEPS=$(MSCCL_MAX_NUM_STEPS)
 endif
+
+ifdef MSCCL_SHMEM_NUM_STEPS
+CXXFLAGS += -DMSCCL_SHMEM_NUM_STEPS=$(MSCCL_SHMEM_NUM_STEPS)
+NVCUFLAGS += -DMSCCL_SHMEM_NUM_STEPS=$(MSCCL_SHMEM_NUM_STEPS)
+endif
+
+ifneq ($(MSCCL_SPECIALIZE_KERNELS), 0)
+CXXFLAGS += -DMSCCL_SPECIALIZE_KERNELS
+NVCUFLAGS += -DMSCCL_SPECIALIZE_KERNELS
+endif
+
+ifneq ($(MSCCL_MIXED_PROTOCOL_KERNELS), 0)
+CXXFLAGS += -DMSCCL_MIXED_PROTOCOL_KERNELS
+NVCUFLAGS += -DMSCCL_MIXED_PROTOCOL_KERNELS
+endif
+
+# Fan kernels instantiate the interpreter twice, on the primitives of one peer and of all peers
+ifneq ($(MSCCL_FAN_KERNELS), 0)
+CXXFLAGS += -DMSCCL_FAN_KERNELS
+NVCUFLAGS += -DMSCCL_FAN_KERNELS
+endif
+
+# Host and device code have to agree on the shared memory of the kernels
+ifneq ($(NCCL_BULK_COPY), 0)
+CXXFLAGS += -DNCCL_BULK_COPY
+NVCUFLAGS += -DNCCL_BULK_COPY
+endif
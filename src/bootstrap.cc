@@ -11,6 +11,7 @@
 #include "net.h"
 #include <unistd.h>
 #include <sys/types.h>
+#include <dirent.h>
 #include "proxy.h"
 #include "param.h"
 
@@ -19,6 +20,9 @@
 #define BOOTSTRAP_TAG_ALLGATHER           (0x1 << 30)
 #define BOOTSTRAP_TAG_COMMSPLIT           (0x1 << 29)
 #define BOOTSTRAP_TAG_INTRANODE_ALLGATHER (0x1 << 28)
+// Low bits of the allgather tags hold the step of the recursive exchange
+#define BOOTSTRAP_TAG_ALLGATHER_GATHER    (BOOTSTRAP_TAG_ALLGATHER | 0x100)
+#define BOOTSTRAP_TAG_ALLGATHER_BCAST     (BOOTSTRAP_TAG_ALLGATHER | 0x200)
 
 #define BOOTSTRAP_INIT_TIME_CREATE 0
 #define BOOTSTRAP_INIT_TIME_SEND   1
@@ -86,7 +90,8 @@ static union ncclSocketAddress bootstrapNetIfAddr;
 static int bootstrapNetInitDone = 0;
 pthread_mutex_t bootstrapNetLock = PTHREAD_MUTEX_INITIALIZER;
 
-NCCL_PARAM(BootstrapNetEnable,"OOB_NET_ENABLE", 0);
+// -1 lets the process creating the unique ID turn it on when its host has InfiniBand devices
+NCCL_PARAM(BootstrapNetEnable,"OOB_NET_ENABLE", -1);
 
 ncclResult_t bootstrapNetInit() {
   if (bootstrapNetInitDone == 0) {
@@ -369,6 +374,12 @@ out:
   return NULL;
 }
 
+ncclResult_t bootstrapNetGetAddr(union ncclSocketAddress* addr) {
+  NCCLCHECK(bootstrapNetInit());
+  memcpy(addr, &bootstrapNetIfAddr, sizeof(union ncclSocketAddress));
+  return ncclSuccess;
+}
+
 ncclResult_t bootstrapCreateRoot(struct ncclBootstrapHandle* handle, bool idFromEnv) {
   ncclResult_t ret = ncclSuccess;
   struct ncclSocket* listenSock = NULL;
@@ -394,6 +405,16 @@ fail:
   goto exit;
 }
 
+static int bootstrapIbPresent() {
+  DIR* dir = opendir("/sys/class/infiniband");
+  if (dir == NULL) return 0;
+  int found = 0;
+  struct dirent* entry;
+  while (!found && (entry = readdir(dir)) != NULL) found = entry->d_name[0] != '.';
+  closedir(dir);
+  return found;
+}
+
 ncclResult_t bootstrapGetUniqueId(struct ncclBootstrapHandle* handle) {
   memset(handle, 0, sizeof(ncclBootstrapHandle));
 
@@ -409,6 +430,8 @@ ncclResult_t bootstrapGetUniqueId(struct ncclBootstrapHandle* handle) {
     NCCLCHECK(getRandomData(&handle->magic, sizeof(handle->magic)));
     memcpy(&handle->addr, &bootstrapNetIfAddr, sizeof(union ncclSocketAddress));
     NCCLCHECK(bootstrapCreateRoot(handle, false));
+    // All ranks follow the choice carried by the ID, ranks built from NCCL_COMM_ID have no common one
+    if (ncclParamBootstrapNetEnable() == -1) handle->netEnable = bootstrapIbPresent();
   }
 
   return ncclSuccess;
@@ -445,10 +468,53 @@ struct bootstrapListen_t {
   };
 };
 
+// P2P messages over the net plugin go through one connection per pair of ranks, opened by the
+// first message. Each accepted connection keeps a receive of BOOTSTRAP_NET_EAGER bytes posted, so
+// that a message fitting in it completes whatever the receiver does. A larger one only sends its
+// header there, and its payload once the receiver, inside any bootstrap call, has posted it.
+#define BOOTSTRAP_NET_EAGER 4096
+struct netMsgHeader {
+  int rank;
+  int tag;
+  int size;
+};
+#define BOOTSTRAP_NET_EAGER_DATA ((int)(BOOTSTRAP_NET_EAGER - sizeof(struct netMsgHeader)))
+
+struct netSendConn {
+  void* comm;
+  ncclNetDeviceHandle_t* devHandle;
+  char* buff; // header and eager payload
+  void* mhandle;
+};
+struct netRecvConn {
+  void* comm;
+  ncclNetDeviceHandle_t* devHandle;
+  char* buff;
+  void* mhandle;
+  void* req;
+  // Message larger than the eager buffer whose payload is being received
+  struct netMsgHeader large;
+  char* data;
+  void* dataHandle;
+  struct netRecvConn* next;
+};
+struct unexMsg {
+  int peer;
+  int tag;
+  int size;
+  char* data;
+  struct unexMsg* next;
+};
+
 struct bootstrapState {
   struct bootstrapRing_t ring;
   struct bootstrapListen_t listen;
   ncclNet_t* net;
+  int netEnable;    // ring and P2P messages go through the net plugin instead of sockets
+  char* peerNetHandles;
+  struct netSendConn* netSend; // per peer
+  struct netRecvConn* netRecv;
+  struct unexMsg* unexpectedMessages;
   uint64_t* peerProxyAddressesUDS;
   union ncclSocketAddress* peerProxyAddresses;
   union ncclSocketAddress* peerP2pAddresses;
@@ -458,6 +524,13 @@ struct bootstrapState {
   int nranks;
   uint64_t magic;
   volatile uint32_t* abortFlag;
+  int p2pReady;     // peerP2pAddresses are known to all ranks
+  // Host layout, set once the host hashes have been exchanged
+  int nHosts;
+  int maxLocalRanks;
+  int* rankToHost;
+  int* rankToLocal;
+  int* hostLeader;
 };
 #define STATE_RING(s, f) (s->ring.f)
 #define STATE_LISTEN(s, f) (s->listen.f)
@@ -545,7 +618,7 @@ static ncclResult_t socketRingConnect(ncclSocketAddress* addr, struct ncclSocket
 }
 static ncclResult_t ringAllInfo(struct ncclComm* comm, struct bootstrapState* state,
                                 union ncclSocketAddress* peerAddresss,
-                                union ncclSocketAddress* peerProxy, uint64_t* peerUDS) {
+                                union ncclSocketAddress* peerProxy, uint64_t* peerUDS, char* peerNetHandles) {
   ncclResult_t res = ncclSuccess;
   int rank = comm->rank;
   int nRanks = comm->nRanks;
@@ -553,29 +626,38 @@ static ncclResult_t ringAllInfo(struct ncclComm* comm, struct bootstrapState* st
     union ncclSocketAddress peerAddress;
     union ncclSocketAddress peerProxy;
     uint64_t peerUDS;
-  }* ringData = NULL;
+  };
+  // Net handles follow the fixed part only when they are exchanged
+  size_t stride = sizeof(struct bootstrapRingData) + (peerNetHandles ? NCCL_NET_HANDLE_MAXSIZE : 0);
+  char* ringData = NULL;
+#define RING_DATA(r) ((struct bootstrapRingData*)(ringData + (r) * stride))
 
-  NCCLCHECK(ncclCalloc(&ringData, nRanks));
+  NCCLCHECK(ncclCalloc(&ringData, nRanks * stride));
   // pack
   if (peerAddresss)
-    memcpy(&(ringData[rank].peerAddress), peerAddresss + rank, sizeof(union ncclSocketAddress));
+    memcpy(&(RING_DATA(rank)->peerAddress), peerAddresss + rank, sizeof(union ncclSocketAddress));
   if (peerProxy)
-    memcpy(&(ringData[rank].peerProxy), peerProxy + rank, sizeof(union ncclSocketAddress));
+    memcpy(&(RING_DATA(rank)->peerProxy), peerProxy + rank, sizeof(union ncclSocketAddress));
   if (peerUDS)
-    memcpy(&(ringData[rank].peerUDS), peerUDS + rank, sizeof(uint64_t));
+    memcpy(&(RING_DATA(rank)->peerUDS), peerUDS + rank, sizeof(uint64_t));
+  if (peerNetHandles)
+    memcpy(RING_DATA(rank) + 1, NET_HANDLE(peerNetHandles, rank), NCCL_NET_HANDLE_MAXSIZE);
 
   // allgather
-  NCCLCHECKGOTO(bootstrapAllGather(state, ringData, sizeof(struct bootstrapRingData)), res, exit);
+  NCCLCHECKGOTO(bootstrapAllGather(state, ringData, stride), res, exit);
 
   // unpack
   for (int irank = 0; irank < nRanks; ++irank) {
     if (peerAddresss)
-      memcpy(peerAddresss + irank, &(ringData[irank].peerAddress), sizeof(union ncclSocketAddress));
+      memcpy(peerAddresss + irank, &(RING_DATA(irank)->peerAddress), sizeof(union ncclSocketAddress));
     if (peerProxy)
-      memcpy(peerProxy + irank, &(ringData[irank].peerProxy), sizeof(union ncclSocketAddress));
+      memcpy(peerProxy + irank, &(RING_DATA(irank)->peerProxy), sizeof(union ncclSocketAddress));
     if (peerUDS)
-      memcpy(peerUDS + irank, &(ringData[irank].peerUDS), sizeof(uint64_t));
+      memcpy(peerUDS + irank, &(RING_DATA(irank)->peerUDS), sizeof(uint64_t));
+    if (peerNetHandles)
+      memcpy(NET_HANDLE(peerNetHandles, irank), RING_DATA(irank) + 1, NCCL_NET_HANDLE_MAXSIZE);
   }
+#undef RING_DATA
 
 exit:
   free(ringData);
@@ -616,6 +698,7 @@ ncclResult_t bootstrapInit(int nHandles, void* handles, struct ncclComm* comm) {
   state->cudaDev = comm->cudaDev;
   state->abortFlag = comm->abortFlag;
   state->net = comm->ncclNet;
+  state->netEnable = ncclParamBootstrapNetEnable() == -1 ? BOOTSTRAP_HANDLE(handles, 0)->netEnable : ncclParamBootstrapNetEnable();
   comm->bootstrap = state;
   comm->magic = state->magic = BOOTSTRAP_HANDLE(handles, 0)->magic; // state and comm magic set to the first magic ID
 
@@ -628,7 +711,7 @@ ncclResult_t bootstrapInit(int nHandles, void* handles, struct ncclComm* comm) {
   // get the ring connection info
   memset(&nextPeer, 0, sizeof(union ringConnectInfo));
   BOOTSTRAP_PROF_OPEN(timers[BOOTSTRAP_INIT_TIME_CREATE]);
-  if (ncclParamBootstrapNetEnable()) {
+  if (state->netEnable) {
     // Create net interface for other ranks to contact me (all gather)
     NCCLCHECK(netGetDevice(rank, comm, &STATE_LISTEN(state, net.dev)));
     NCCLCHECK(state->net->listen(STATE_LISTEN(state, net.dev), STATE_LISTEN(state, net.handle), &STATE_LISTEN(state, net.comm)));
@@ -684,7 +767,7 @@ ncclResult_t bootstrapInit(int nHandles, void* handles, struct ncclComm* comm) {
   BOOTSTRAP_PROF_CLOSE(timers[BOOTSTRAP_INIT_TIME_RECV]);
 
   // accept and connect the ring network
-  if (ncclParamBootstrapNetEnable()) {
+  if (state->netEnable) {
     NCCLCHECK(netRingConnect(state->net, &state->listen, nextPeer.handle,
                              &STATE_RING(state, net.sendComm), &STATE_RING(state, net.sendDevHandle),
                              &STATE_RING(state, net.recvComm), &STATE_RING(state, net.recvDevHandle), state->abortFlag));
@@ -701,14 +784,21 @@ ncclResult_t bootstrapInit(int nHandles, void* handles, struct ncclComm* comm) {
   NCCLCHECK(ncclCalloc(&state->peerProxyAddressesUDS, nranks));
   NCCLCHECK(getUDS(state->peerProxyAddressesUDS + rank));
 
-  // create a socket for others to reach out (P2P)
-  union ncclSocketAddress peerSocketAddress;
-  NCCLCHECK(createListenSocket(comm, comm->magic, &STATE_LISTEN(state, peerSocket), &peerSocketAddress, ncclSocketTypeBootstrap));
-  NCCLCHECK(ncclCalloc(&state->peerP2pAddresses, nranks * sizeof(union ncclSocketAddress)));
-  memcpy(state->peerP2pAddresses + rank, &peerSocketAddress, sizeof(union ncclSocketAddress));
+  // others reach out (P2P) through my net listen handle, or a socket
+  if (state->netEnable) {
+    NCCLCHECK(ncclCalloc(&state->peerNetHandles, nranks * NCCL_NET_HANDLE_MAXSIZE));
+    NCCLCHECK(ncclCalloc(&state->netSend, nranks));
+    memcpy(NET_HANDLE(state->peerNetHandles, rank), STATE_LISTEN(state, net.handle), NCCL_NET_HANDLE_MAXSIZE);
+  } else {
+    union ncclSocketAddress peerSocketAddress;
+    NCCLCHECK(createListenSocket(comm, comm->magic, &STATE_LISTEN(state, peerSocket), &peerSocketAddress, ncclSocketTypeBootstrap));
+    NCCLCHECK(ncclCalloc(&state->peerP2pAddresses, nranks * sizeof(union ncclSocketAddress)));
+    memcpy(state->peerP2pAddresses + rank, &peerSocketAddress, sizeof(union ncclSocketAddress));
+  }
 
   BOOTSTRAP_PROF_OPEN(timers[BOOTSTRAP_INIT_TIME_RING]);
-  NCCLCHECK(ringAllInfo(comm, state, state->peerP2pAddresses, state->peerProxyAddresses, state->peerProxyAddressesUDS));
+  NCCLCHECK(ringAllInfo(comm, state, state->peerP2pAddresses, state->peerProxyAddresses, state->peerProxyAddressesUDS, state->peerNetHandles));
+  state->p2pReady = 1;
   BOOTSTRAP_PROF_CLOSE(timers[BOOTSTRAP_INIT_TIME_RING]);
 
   // Create the service proxy and get the UDS
@@ -742,6 +832,7 @@ ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclCo
   state->cudaDev = comm->cudaDev;
   state->abortFlag = comm->abortFlag;
   state->net = comm->ncclNet;
+  state->netEnable = ((struct bootstrapState*)parent->bootstrap)->netEnable;
   comm->bootstrap = state;
   comm->magic = state->magic = magic;
 
@@ -749,7 +840,7 @@ ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclCo
   next = parentRanks[(rank + 1) % nranks];
 
   // create a handle for the others to reach out to me
-  if (ncclParamBootstrapNetEnable()) {
+  if (state->netEnable) {
     NCCLCHECKGOTO(netGetDevice(rank, comm, &STATE_LISTEN(state, net.dev)), ret, fail);
     NCCLCHECKGOTO(state->net->listen(STATE_LISTEN(state, net.dev), STATE_LISTEN(state, net.handle), &STATE_LISTEN(state, net.comm)), ret, fail);
     memcpy(info.handle, STATE_LISTEN(state, net.handle), NCCL_NET_HANDLE_MAXSIZE);
@@ -757,14 +848,16 @@ ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclCo
     // create socket for ring neightbor to contact mee
     NCCLCHECK(createListenSocket(comm, comm->magic, &STATE_LISTEN(state, socket), &info.addr, ncclSocketTypeBootstrap));
   }
-  // create a socket for others to reach out (P2P)
+  // others reach out (P2P) through my net listen handle, or a socket
   union ncclSocketAddress peerSocketAddress;
-  NCCLCHECK(createListenSocket(comm, comm->magic, &STATE_LISTEN(state, peerSocket), &peerSocketAddress, ncclSocketTypeBootstrap));
+  if (!state->netEnable) {
+    NCCLCHECK(createListenSocket(comm, comm->magic, &STATE_LISTEN(state, peerSocket), &peerSocketAddress, ncclSocketTypeBootstrap));
+  }
 
   // Get addr from next rank using the parent's connections
   NCCLCHECKGOTO(bootstrapSend(parent->bootstrap, prev, BOOTSTRAP_TAG_COMMSPLIT, &info, sizeof(union ringConnectInfo)), ret, fail);
   NCCLCHECKGOTO(bootstrapRecv(parent->bootstrap, next, BOOTSTRAP_TAG_COMMSPLIT, &nextPeer, sizeof(union ringConnectInfo)), ret, fail);
-  if (ncclParamBootstrapNetEnable()) {
+  if (state->netEnable) {
     NCCLCHECKGOTO(netRingConnect(state->net, &state->listen, nextPeer.handle,
                                  &STATE_RING(state, net.sendComm), &STATE_RING(state, net.sendDevHandle),
                                  &STATE_RING(state, net.recvComm), &STATE_RING(state, net.recvDevHandle), state->abortFlag),
@@ -773,14 +866,20 @@ ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclCo
     NCCLCHECK(socketRingConnect(&nextPeer.addr, &STATE_RING(state, socket.send), &STATE_LISTEN(state, socket), &STATE_RING(state, socket.recv), comm->magic, state->abortFlag));
   }
 
-  NCCLCHECKGOTO(ncclCalloc(&state->peerP2pAddresses, nranks * sizeof(union ncclSocketAddress)), ret, fail);
-  memcpy(state->peerP2pAddresses + rank, &peerSocketAddress, sizeof(union ncclSocketAddress));
-  if (parent->config.splitShare) {
+  if (state->netEnable) {
+    NCCLCHECKGOTO(ncclCalloc(&state->peerNetHandles, nranks * NCCL_NET_HANDLE_MAXSIZE), ret, fail);
+    NCCLCHECKGOTO(ncclCalloc(&state->netSend, nranks), ret, fail);
+    memcpy(NET_HANDLE(state->peerNetHandles, rank), STATE_LISTEN(state, net.handle), NCCL_NET_HANDLE_MAXSIZE);
+  } else {
+    NCCLCHECKGOTO(ncclCalloc(&state->peerP2pAddresses, nranks * sizeof(union ncclSocketAddress)), ret, fail);
+    memcpy(state->peerP2pAddresses + rank, &peerSocketAddress, sizeof(union ncclSocketAddress));
+  }
+  if (comm->shareRes) {
     /* map local rank to top parent local rank. */
     for (int i = 0; i < nranks; ++i) {
       comm->topParentRanks[i] = parent->topParentRanks[parentRanks[i]];
     }
-    NCCLCHECKGOTO(ringAllInfo(comm, state, state->peerP2pAddresses, NULL, NULL), ret, fail);
+    NCCLCHECKGOTO(ringAllInfo(comm, state, state->peerP2pAddresses, NULL, NULL, state->peerNetHandles), ret, fail);
   } else {
     NCCLCHECKGOTO(ncclCalloc(&state->peerProxyAddresses, nranks), ret, fail);
     NCCLCHECKGOTO(ncclCalloc(&state->peerProxyAddressesUDS, nranks), ret, fail);
@@ -788,9 +887,10 @@ ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclCo
     NCCLCHECKGOTO(ncclCalloc(&proxySocket, 1), ret, fail);
     NCCLCHECKGOTO(getUDS(state->peerProxyAddressesUDS + rank), ret, fail);
     NCCLCHECKGOTO(createListenSocket(comm, comm->magic, proxySocket, state->peerProxyAddresses + rank, ncclSocketTypeProxy), ret, fail);
-    NCCLCHECKGOTO(ringAllInfo(comm, state, state->peerP2pAddresses, state->peerProxyAddresses, state->peerProxyAddressesUDS), ret, fail);
+    NCCLCHECKGOTO(ringAllInfo(comm, state, state->peerP2pAddresses, state->peerProxyAddresses, state->peerProxyAddressesUDS, state->peerNetHandles), ret, fail);
     NCCLCHECKGOTO(ncclProxyInit(comm, proxySocket, state->peerProxyAddresses, state->peerProxyAddressesUDS), ret, fail);
   }
+  state->p2pReady = 1;
 
   TRACE(NCCL_BOOTSTRAP, "bootstrapSplit: comm %p parent %p rank %d nranks %d color %d key %d prev %d next %d - DONE", comm, parent, rank, nranks,
         color, key, prev, next);
@@ -802,6 +902,163 @@ fail:
   goto exit;
 }
 
+static ncclResult_t unexpectedMsgEnqueue(struct bootstrapState* state, int peer, int tag, char* data, int size) {
+  struct unexMsg* msg;
+  NCCLCHECK(ncclCalloc(&msg, 1));
+  msg->peer = peer;
+  msg->tag = tag;
+  msg->size = size;
+  msg->data = data;
+  // Messages of a peer arrive in order, and are taken in that order
+  struct unexMsg** list = &state->unexpectedMessages;
+  while (*list) list = &(*list)->next;
+  *list = msg;
+  return ncclSuccess;
+}
+static struct unexMsg* unexpectedMsgDequeue(struct bootstrapState* state, int peer, int tag) {
+  for (struct unexMsg** list = &state->unexpectedMessages; *list; list = &(*list)->next) {
+    struct unexMsg* msg = *list;
+    if (msg->peer == peer && msg->tag == tag) {
+      *list = msg->next;
+      return msg;
+    }
+  }
+  return NULL;
+}
+
+static ncclResult_t netRecvProgress(struct bootstrapState* state, struct netRecvConn* conn) {
+  ncclNet_t* net = state->net;
+  int done = 0;
+  if (conn->data == NULL) {
+    NCCLCHECK(netIrecv(net, conn->comm, conn->buff, BOOTSTRAP_NET_EAGER, conn->mhandle, 0, &conn->req, &done));
+    if (!done) return ncclSuccess;
+    struct netMsgHeader* hdr = (struct netMsgHeader*)conn->buff;
+    if (hdr->size <= BOOTSTRAP_NET_EAGER_DATA) {
+      char* data;
+      NCCLCHECK(ncclCalloc(&data, std::max(hdr->size, 1)));
+      memcpy(data, hdr + 1, hdr->size);
+      return unexpectedMsgEnqueue(state, hdr->rank, hdr->tag, data, hdr->size);
+    }
+    // The sender posts the payload next, it has to be received before the next eager message
+    conn->large = *hdr;
+    NCCLCHECK(ncclCalloc(&conn->data, conn->large.size));
+    NCCLCHECK(netReg(net, conn->comm, conn->data, conn->large.size, &conn->dataHandle));
+    done = 0;
+  }
+  NCCLCHECK(netIrecv(net, conn->comm, conn->data, conn->large.size, conn->dataHandle, 0, &conn->req, &done));
+  if (!done) return ncclSuccess;
+  NCCLCHECK(netDereg(net, conn->comm, &conn->dataHandle));
+  NCCLCHECK(unexpectedMsgEnqueue(state, conn->large.rank, conn->large.tag, conn->data, conn->large.size));
+  conn->data = NULL;
+  return ncclSuccess;
+}
+
+// Accept new connections and move messages from all of them to the unexpected queue. Every wait
+// on the net P2P path runs it, so that no two ranks waiting on each other block
+static ncclResult_t netP2pProgress(struct bootstrapState* state) {
+  void* recvComm = NULL;
+  ncclNetDeviceHandle_t* recvDevHandle = NULL;
+  NCCLCHECK(state->net->accept(STATE_LISTEN(state, net.comm), &recvComm, &recvDevHandle));
+  if (recvComm) {
+    struct netRecvConn* conn;
+    NCCLCHECK(ncclCalloc(&conn, 1));
+    conn->comm = recvComm;
+    conn->devHandle = recvDevHandle;
+    conn->next = state->netRecv;
+    state->netRecv = conn;
+    NCCLCHECK(ncclCalloc(&conn->buff, BOOTSTRAP_NET_EAGER));
+    NCCLCHECK(netReg(state->net, recvComm, conn->buff, BOOTSTRAP_NET_EAGER, &conn->mhandle));
+  }
+  for (struct netRecvConn* conn = state->netRecv; conn; conn = conn->next) {
+    NCCLCHECK(netRecvProgress(state, conn));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t netP2pIsend(struct bootstrapState* state, void* sendComm, void* data, int size, void* mhandle) {
+  int abortCounter = 0;
+  int done = 0;
+  void* req = NULL;
+  while (1) {
+    NCCLCHECK(netIsend(state->net, sendComm, data, size, mhandle, 0, &req, &done));
+    if (done) return ncclSuccess;
+    NCCLCHECK(checkAbort(state->abortFlag, &abortCounter));
+    NCCLCHECK(netP2pProgress(state));
+  }
+}
+
+static ncclResult_t netP2pSend(struct bootstrapState* state, int peer, int tag, void* data, int size) {
+  struct netSendConn* conn = state->netSend + peer;
+  if (conn->comm == NULL) {
+    int abortCounter = 0;
+    do {
+      NCCLCHECK(checkAbort(state->abortFlag, &abortCounter));
+      NCCLCHECK(state->net->connect(STATE_LISTEN(state, net.dev), NET_HANDLE(state->peerNetHandles, peer), &conn->comm, &conn->devHandle));
+      // The peer may itself be connecting to us
+      NCCLCHECK(netP2pProgress(state));
+    } while (conn->comm == NULL);
+    NCCLCHECK(ncclCalloc(&conn->buff, BOOTSTRAP_NET_EAGER));
+    NCCLCHECK(netReg(state->net, conn->comm, conn->buff, BOOTSTRAP_NET_EAGER, &conn->mhandle));
+  }
+  struct netMsgHeader hdr = {state->rank, tag, size};
+  bool eager = size <= BOOTSTRAP_NET_EAGER_DATA;
+  memcpy(conn->buff, &hdr, sizeof(hdr));
+  if (eager && size > 0) memcpy(conn->buff + sizeof(hdr), data, size);
+  NCCLCHECK(netP2pIsend(state, conn->comm, conn->buff, sizeof(hdr) + (eager ? size : 0), conn->mhandle));
+  if (!eager) {
+    ncclResult_t ret;
+    void* dataHandle = NULL;
+    NCCLCHECK(netReg(state->net, conn->comm, data, size, &dataHandle));
+    ret = netP2pIsend(state, conn->comm, data, size, dataHandle);
+    (void)netDereg(state->net, conn->comm, &dataHandle);
+    NCCLCHECK(ret);
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t netP2pRecv(struct bootstrapState* state, int peer, int tag, void* data, int size) {
+  int abortCounter = 0;
+  struct unexMsg* msg;
+  while ((msg = unexpectedMsgDequeue(state, peer, tag)) == NULL) {
+    NCCLCHECK(checkAbort(state->abortFlag, &abortCounter));
+    NCCLCHECK(netP2pProgress(state));
+  }
+  ncclResult_t ret = ncclSuccess;
+  if (msg->size > size) {
+    WARN("Message truncated : received %d bytes instead of %d", msg->size, size);
+    ret = ncclInternalError;
+  } else if (msg->size > 0) {
+    memcpy(data, msg->data, msg->size);
+  }
+  free(msg->data);
+  free(msg);
+  return ret;
+}
+
+static ncclResult_t netP2pClose(struct bootstrapState* state) {
+  ncclNet_t* net = state->net;
+  for (int p = 0; state->netSend && p < state->nranks; p++) {
+    struct netSendConn* conn = state->netSend + p;
+    if (conn->comm == NULL) continue;
+    NCCLCHECK(netDereg(net, conn->comm, &conn->mhandle));
+    NCCLCHECK(net->closeSend(conn->comm));
+    free(conn->buff);
+  }
+  while (state->netRecv) {
+    struct netRecvConn* conn = state->netRecv;
+    state->netRecv = conn->next;
+    if (conn->dataHandle) NCCLCHECK(netDereg(net, conn->comm, &conn->dataHandle));
+    NCCLCHECK(netDereg(net, conn->comm, &conn->mhandle));
+    NCCLCHECK(net->closeRecv(conn->comm));
+    free(conn->data);
+    free(conn->buff);
+    free(conn);
+  }
+  free(state->netSend);
+  free(state->peerNetHandles);
+  return ncclSuccess;
+}
+
 struct socketAckInfo {
   int rank;
   int tag;
@@ -823,6 +1080,7 @@ ncclResult_t bootstrapSend(void* commState, int peer, int tag, void* data, int s
   ncclResult_t ret = ncclSuccess;
   struct ncclSocket sock;
   TRACE(NCCL_BOOTSTRAP, "Sending to peer=%d tag=%d size=%d", peer, tag, size);
+  if (((struct bootstrapState*)commState)->netEnable) return netP2pSend((struct bootstrapState*)commState, peer, tag, data, size);
   NCCLCHECK(socketConnect(commState, peer, tag, &sock));
   NCCLCHECKGOTO(socketSend(&sock, data, size), ret, fail);
   TRACE(NCCL_BOOTSTRAP, "Sent to peer=%d tag=%d size=%d", peer, tag, size);
@@ -913,6 +1171,7 @@ fail:
 ncclResult_t bootstrapRecv(void* commState, int peer, int tag, void* data, int size) {
   ncclResult_t ret;
   struct ncclSocket sock;
+  if (((struct bootstrapState*)commState)->netEnable) return netP2pRecv((struct bootstrapState*)commState, peer, tag, data, size);
   NCCLCHECK(socketAccept(commState, peer, tag, &sock));
   TRACE(NCCL_BOOTSTRAP, "Receiving tag=%d peer=%d size=%d", tag, peer, size);
   NCCLCHECKGOTO(socketRecv(&sock, ((char*)data), size), ret, fail);
@@ -981,17 +1240,154 @@ static ncclResult_t socketRingAllGather(struct ncclSocket* sendSock, struct nccl
 exit:
   return res;
 }
+// Send to one peer while receiving from another, connecting first so that no rank of a step
+// waits on a peer that is itself waiting
+static ncclResult_t bootstrapP2PSendRecv(void* commState, int sendPeer, int recvPeer, int tag, void* sendData, int sendSize,
+                                         void* recvData, int recvSize) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclSocket sendSock, recvSock;
+  if (((struct bootstrapState*)commState)->netEnable) {
+    // Sends wait for the peer with its receives progressing
+    NCCLCHECK(netP2pSend((struct bootstrapState*)commState, sendPeer, tag, sendData, sendSize));
+    return netP2pRecv((struct bootstrapState*)commState, recvPeer, tag, recvData, recvSize);
+  }
+  NCCLCHECK(socketConnect(commState, sendPeer, tag, &sendSock));
+  NCCLCHECKGOTO(socketAccept(commState, recvPeer, tag, &recvSock), ret, fail_send);
+  NCCLCHECKGOTO(socketSendRecv(&sendSock, sendData, sendSize, &recvSock, recvData, recvSize), ret, fail);
+  NCCLCHECK(ncclSocketClose(&sendSock));
+  NCCLCHECK(ncclSocketClose(&recvSock));
+  return ret;
+fail:
+  (void)ncclSocketClose(&recvSock);
+fail_send:
+  (void)ncclSocketClose(&sendSock);
+  return ret;
+}
+
+/* AllGather in ceil(log2(nranks)) steps over the P2P sockets
+ *
+ * Based on the concatenation algorithm by Jehoshua Bruck, Ching-Tien Ho, Shlomo Kipnis, Eli Upfal and Derrick Weathersby,
+ * "Efficient Algorithms for All-to-All Communications in Multiport Message-Passing Systems,"
+ * IEEE Transactions on Parallel and Distributed Systems, 8(11):1143-1156, 1997
+ */
+static ncclResult_t bootstrapP2PAllGather(void* commState, int* ranks, int rank, int nranks, char* data, size_t size) {
+  ncclResult_t ret = ncclSuccess;
+  char* tmp = NULL;
+  if (nranks == 1) return ncclSuccess;
+  // Block i of tmp is the data of rank+i
+  NCCLCHECK(ncclCalloc(&tmp, nranks * size));
+  memcpy(tmp, data + rank * size, size);
+  for (int dist = 1, step = 0; dist < nranks; dist <<= 1, step++) {
+    int count = std::min(dist, nranks - dist);
+    int dst = (rank - dist + nranks) % nranks;
+    int src = (rank + dist) % nranks;
+    NCCLCHECKGOTO(bootstrapP2PSendRecv(commState, ranks ? ranks[dst] : dst, ranks ? ranks[src] : src, BOOTSTRAP_TAG_ALLGATHER | step,
+                                       tmp, count * size, tmp + dist * size, count * size), ret, exit);
+  }
+  for (int i = 0; i < nranks; i++) memcpy(data + ((rank + i) % nranks) * size, tmp + i * size, size);
+exit:
+  free(tmp);
+  return ret;
+}
+
+// Ranks hand their data to the first rank of their host, those run the recursive allgather on
+// whole hosts and send the result back, so only one process per host talks to the network
+static ncclResult_t bootstrapHostAllGather(struct bootstrapState* state, char* data, int size) {
+  ncclResult_t ret = ncclSuccess;
+  int rank = state->rank;
+  int nranks = state->nranks;
+  int host = state->rankToHost[rank];
+  int leader = state->hostLeader[host];
+  size_t hostSize = (size_t)state->maxLocalRanks * size;
+  char* hostData = NULL;
+
+  if (rank != leader) {
+    NCCLCHECK(bootstrapSend(state, leader, BOOTSTRAP_TAG_ALLGATHER_GATHER, data + rank * size, size));
+    NCCLCHECK(bootstrapRecv(state, leader, BOOTSTRAP_TAG_ALLGATHER_BCAST, data, nranks * size));
+    return ncclSuccess;
+  }
+  NCCLCHECK(ncclCalloc(&hostData, state->nHosts * hostSize));
+  for (int r = 0; r < nranks; r++) {
+    if (state->rankToHost[r] != host) continue;
+    char* slot = hostData + host * hostSize + state->rankToLocal[r] * size;
+    if (r == rank) {
+      memcpy(slot, data + r * size, size);
+    } else {
+      NCCLCHECKGOTO(bootstrapRecv(state, r, BOOTSTRAP_TAG_ALLGATHER_GATHER, slot, size), ret, exit);
+    }
+  }
+  NCCLCHECKGOTO(bootstrapP2PAllGather(state, state->hostLeader, host, state->nHosts, hostData, hostSize), ret, exit);
+  for (int r = 0; r < nranks; r++) {
+    memcpy(data + r * size, hostData + state->rankToHost[r] * hostSize + state->rankToLocal[r] * size, size);
+  }
+  for (int r = 0; r < nranks; r++) {
+    if (r != rank && state->rankToHost[r] == host) NCCLCHECKGOTO(bootstrapSend(state, r, BOOTSTRAP_TAG_ALLGATHER_BCAST, data, nranks * size), ret, exit);
+  }
+exit:
+  free(hostData);
+  return ret;
+}
+
+ncclResult_t bootstrapSetHosts(void* commState, uint64_t* hostHashes) {
+  struct bootstrapState* state = (struct bootstrapState*)commState;
+  int nranks = state->nranks;
+  uint64_t* hostHash = NULL;
+  int* localRanks = NULL;
+  if (state->rankToHost) return ncclSuccess;
+  NCCLCHECK(ncclCalloc(&state->rankToHost, nranks));
+  NCCLCHECK(ncclCalloc(&state->rankToLocal, nranks));
+  NCCLCHECK(ncclCalloc(&state->hostLeader, nranks));
+  NCCLCHECK(ncclCalloc(&hostHash, nranks));
+  NCCLCHECK(ncclCalloc(&localRanks, nranks));
+  state->nHosts = 0;
+  state->maxLocalRanks = 0;
+  for (int r = 0; r < nranks; r++) {
+    // Ranks of a host are usually contiguous, look at the last host first
+    int h = state->nHosts - 1;
+    if (h < 0 || hostHash[h] != hostHashes[r]) {
+      for (h = 0; h < state->nHosts && hostHash[h] != hostHashes[r]; h++);
+    }
+    if (h == state->nHosts) {
+      hostHash[h] = hostHashes[r];
+      state->hostLeader[h] = r;
+      state->nHosts++;
+    }
+    state->rankToHost[r] = h;
+    state->rankToLocal[r] = localRanks[h]++;
+    state->maxLocalRanks = std::max(state->maxLocalRanks, localRanks[h]);
+  }
+  free(hostHash);
+  free(localRanks);
+  TRACE(NCCL_BOOTSTRAP, "rank %d nranks %d nHosts %d maxLocalRanks %d", state->rank, nranks, state->nHosts, state->maxLocalRanks);
+  return ncclSuccess;
+}
+
+// 0 is the ring, 1 the recursive allgather, 2 the recursive allgather between hosts, -1 picks one
+NCCL_PARAM(BootstrapAllGather, "BOOTSTRAP_ALLGATHER", -1);
+NCCL_PARAM(BootstrapAllGatherThreshold, "BOOTSTRAP_ALLGATHER_THRESHOLD", 64);
+
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
   ncclResult_t res = ncclSuccess;
   struct bootstrapState* state = (struct bootstrapState*)commState;
   int rank = state->rank;
   int nranks = state->nranks;
+  // The ring is the only way to reach the others until the P2P addresses are known
+  int algo = state->p2pReady ? ncclParamBootstrapAllGather() : 0;
+  if (algo == -1) {
+    if (nranks < ncclParamBootstrapAllGatherThreshold()) algo = 0;
+    else algo = (state->nHosts > 1 && state->nHosts < nranks) ? 2 : 1;
+  }
+  if (algo == 2 && state->nHosts == 0) algo = 1;
 
-  TRACE(NCCL_BOOTSTRAP, "rank %d nranks %d size %d - AllGather", rank, nranks, size);
+  TRACE(NCCL_BOOTSTRAP, "rank %d nranks %d size %d algo %d - AllGather", rank, nranks, size, algo);
 
   uint64_t time = 0;
   BOOTSTRAP_PROF_OPEN(time);
-  if (ncclParamBootstrapNetEnable()) {
+  if (algo == 2) {
+    NCCLCHECKGOTO(bootstrapHostAllGather(state, (char*)allData, size), res, exit);
+  } else if (algo == 1) {
+    NCCLCHECKGOTO(bootstrapP2PAllGather(state, NULL, rank, nranks, (char*)allData, size), res, exit);
+  } else if (state->netEnable) {
     NCCLCHECKGOTO(netRingAllGather(state->net, STATE_RING(state, net.sendComm), STATE_RING(state, net.recvComm), rank, nranks, (char*)allData, size, state->abortFlag), res, exit);
   } else {
     NCCLCHECKGOTO(socketRingAllGather(&STATE_RING(state, socket.send), &STATE_RING(state, socket.recv), rank, nranks, (char*)allData, size), res, exit);
@@ -1045,7 +1441,16 @@ ncclResult_t bootstrapIntraNodeAllGather(void* commState, int* ranks, int rank,
 
   int prevRank = ranks[(rank - 1 + nranks) % nranks];
   int nextRank = ranks[(rank + 1) % nranks];
-  // intraNode bootstrap is done defacto using the socket-based implementation
+  if (((struct bootstrapState*)commState)->netEnable) {
+    for (int i = 0; i < nranks - 1; i++) {
+      size_t rslice = (rank - i - 1 + nranks) % nranks;
+      size_t sslice = (rank - i + nranks) % nranks;
+      NCCLCHECK(bootstrapP2PSendRecv(commState, nextRank, prevRank, BOOTSTRAP_TAG_INTRANODE_ALLGATHER, (char*)allData + sslice * size, size,
+                                     (char*)allData + rslice * size, size));
+    }
+    TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
+    return ncclSuccess;
+  }
   struct ncclSocket recvSocket, sendSocket;
   NCCLCHECK(socketConnect(commState, nextRank, BOOTSTRAP_TAG_INTRANODE_ALLGATHER, &sendSocket));
   NCCLCHECK(socketAccept(commState, prevRank, BOOTSTRAP_TAG_INTRANODE_ALLGATHER, &recvSocket));
@@ -1101,7 +1506,20 @@ ncclResult_t bootstrapClose(void* commState) {
       return ncclInternalError;
     }
   }
-  if (ncclParamBootstrapNetEnable()) {
+  if (state->unexpectedMessages != NULL) {
+    while (state->unexpectedMessages) {
+      struct unexMsg* msg = state->unexpectedMessages;
+      state->unexpectedMessages = msg->next;
+      free(msg->data);
+      free(msg);
+    }
+    if (__atomic_load_n(state->abortFlag, __ATOMIC_ACQUIRE) == 0) {
+      WARN("Unexpected messages are not empty");
+      return ncclInternalError;
+    }
+  }
+  if (state->netEnable) {
+    NCCLCHECK(netP2pClose(state));
     NCCLCHECK(state->net->closeSend(STATE_RING(state, net.sendComm)));
     NCCLCHECK(state->net->closeRecv(STATE_RING(state, net.recvComm)));
     NCCLCHECK(state->net->closeListen(STATE_LISTEN(state, net.comm)));
@@ -1109,12 +1527,15 @@ ncclResult_t bootstrapClose(void* commState) {
     NCCLCHECK(ncclSocketClose(&STATE_RING(state, socket.send)));
     NCCLCHECK(ncclSocketClose(&STATE_RING(state, socket.recv)));
     NCCLCHECK(ncclSocketClose(&STATE_LISTEN(state, socket)));
+    // close the p2p socket
+    NCCLCHECK(ncclSocketClose(&STATE_LISTEN(state, peerSocket)));
   }
-  // close the p2p socket
-  NCCLCHECK(ncclSocketClose(&STATE_LISTEN(state, peerSocket)));
 
   // proxy things are free'd elsewhere
   free(state->peerP2pAddresses);
+  free(state->rankToHost);
+  free(state->rankToLocal);
+  free(state->hostLeader);
   free(state);
   return ncclSuccess;
 }
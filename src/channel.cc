@@ -27,42 +27,88 @@ ncclResult_t initChannel(struct ncclComm* comm, int channelId) {
     // The extra on nRanks+1 is for collnet root (i.e. network)
     // Allocate everything related to sharedRes with ncclCalloc as this can be
     // shared between communicators hence should not be tied to comm.
+    // Rank entries stay NULL until the rank is connected, see initChannelPeers.
     if (sharedRes->peers[channelId] == NULL) {
       NCCLCHECK(ncclCalloc(sharedRes->peers + channelId, sharedRes->tpNRanks));
     }
     channel->peers = ncclMemoryStackAlloc<struct ncclChannelPeer*>(&comm->memPermanent, nPeers);
-    for (int r = 0; r < nRanks; r++) {
-      channel->peers[r] = comm->sharedRes->peers[channelId] + comm->topParentRanks[r];
-      ncclAtomicRefCountIncrement(&channel->peers[r]->refCount);
-    }
   }
 
   if (channel->devPeers == NULL) {
     if (sharedRes->devPeers[channelId] == NULL) {
-      NCCLCHECK(ncclCudaCallocAsync(sharedRes->devPeers + channelId, sharedRes->tpNRanks, sharedRes->deviceStream.cudaStream));
+      NCCLCHECK(ncclCalloc(sharedRes->devPeers + channelId, sharedRes->tpNRanks));
     }
-    /* channel->devPeers is not shared, so just free it when calling commFree() */
-    NCCLCHECK(ncclCudaCallocAsync(&channel->devPeers, nPeers, sharedRes->deviceStream.cudaStream));
-    ncclCommPushCudaFree(comm, channel->devPeers);
+    NCCLCHECK(ncclDevArenaCalloc(&sharedRes->devArena, &channel->devPeers, nPeers));
     NCCLCHECK(ncclCalloc(&channel->devPeersHostPtr, nPeers));
-    for (int r = 0; r < nRanks; r++) {
-      uintptr_t addr = (uintptr_t)(comm->sharedRes->devPeers[channelId] + comm->topParentRanks[r]);
-      NCCLCHECK(ncclCudaMemcpyAsync((uintptr_t*)(channel->devPeers + r), (uintptr_t*)&addr, 1, sharedRes->deviceStream.cudaStream));
-      channel->devPeersHostPtr[r] = (struct ncclDevChannelPeer*)addr;
-    }
   }
 
   channel->ring.userRanks = ncclMemoryStackAlloc<int>(&comm->memPermanent, nRanks);
-  NCCLCHECK(ncclCudaCallocAsync(&channel->devRingUserRanks, nRanks, sharedRes->deviceStream.cudaStream));
-  ncclCommPushCudaFree(comm, channel->devRingUserRanks);
+  NCCLCHECK(ncclDevArenaCalloc(&sharedRes->devArena, &channel->devRingUserRanks, nRanks));
 
-  /* guarantee addr has been copied into channel->devPeers */
   NCCLCHECK(ncclStrongStreamSynchronize(&sharedRes->deviceStream));
   NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), &sharedRes->deviceStream));
 
   return ncclSuccess;
 }
 
+// Comms sharing resources may connect the same rank at the same time, the first one to publish
+// its structure wins and the other is dropped
+template <typename T>
+static void publishPeer(T** slot, T** peer) {
+  T* expected = NULL;
+  if (!__atomic_compare_exchange_n(slot, &expected, *peer, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) *peer = expected;
+}
+
+static ncclResult_t initChannelPeer(struct ncclComm* comm, int channelId, int r) {
+  struct ncclChannel* channel = &comm->channels[channelId];
+  struct ncclSharedResources* sharedRes = comm->sharedRes;
+  int tpRank = comm->topParentRanks[r];
+  if (channel->peers[r] != NULL) return ncclSuccess;
+
+  struct ncclChannelPeer* peer = __atomic_load_n(sharedRes->peers[channelId] + tpRank, __ATOMIC_ACQUIRE);
+  if (peer == NULL) {
+    struct ncclChannelPeer* newPeer;
+    NCCLCHECK(ncclCalloc(&newPeer, 1));
+    peer = newPeer;
+    publishPeer(sharedRes->peers[channelId] + tpRank, &peer);
+    if (peer != newPeer) free(newPeer);
+  }
+  struct ncclDevChannelPeer* devPeer = __atomic_load_n(sharedRes->devPeers[channelId] + tpRank, __ATOMIC_ACQUIRE);
+  if (devPeer == NULL) {
+    // A dropped device structure stays in the arena until it is destroyed
+    NCCLCHECK(ncclDevArenaCalloc(&sharedRes->devArena, &devPeer, 1));
+    publishPeer(sharedRes->devPeers[channelId] + tpRank, &devPeer);
+  }
+
+  channel->peers[r] = peer;
+  ncclAtomicRefCountIncrement(&peer->refCount);
+  uintptr_t addr = (uintptr_t)devPeer;
+  NCCLCHECK(ncclCudaMemcpyAsync((uintptr_t*)(channel->devPeers + r), (uintptr_t*)&addr, 1, sharedRes->deviceStream.cudaStream));
+  channel->devPeersHostPtr[r] = devPeer;
+  return ncclSuccess;
+}
+
+ncclResult_t initChannelPeers(struct ncclComm* comm) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclSharedResources* sharedRes = comm->sharedRes;
+  bool copied = false;
+
+  NCCLCHECK(ncclStrongStreamAcquireUncaptured(&sharedRes->deviceStream));
+  for (int r = 0; r < comm->nRanks; r++) {
+    uint64_t mask = comm->connectSend[r] | comm->connectRecv[r];
+    for (int c = 0; c < MAXCHANNELS && mask; c++) {
+      if ((mask & (1UL << c)) == 0 || comm->channels[c].peers[r] != NULL) continue;
+      NCCLCHECKGOTO(initChannelPeer(comm, c, r), ret, exit);
+      copied = true;
+    }
+  }
+  /* guarantee addr has been copied into channel->devPeers */
+  if (copied) NCCLCHECKGOTO(ncclStrongStreamSynchronize(&sharedRes->deviceStream), ret, exit);
+exit:
+  NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), &sharedRes->deviceStream));
+  return ret;
+}
+
 ncclResult_t initNvlsChannel(struct ncclComm* comm, int channelId, struct ncclComm* parent, bool share) {
   struct ncclChannel* channel = &comm->channels[channelId];
   struct ncclSharedResources* sharedRes = comm->sharedRes;
@@ -90,7 +136,7 @@ ncclResult_t initNvlsChannel(struct ncclComm* comm, int channelId, struct ncclCo
     }
   } else {
     NCCLCHECK(ncclCalloc(&channel->nvlsPeers, nvlsRanks));
-    NCCLCHECK(ncclCudaCallocAsync(&channel->nvlsDevPeers, nvlsRanks, sharedRes->deviceStream.cudaStream));
+    NCCLCHECK(ncclDevArenaCalloc(&sharedRes->devArena, &channel->nvlsDevPeers, nvlsRanks));
     for (int r = 0; r < nvlsRanks; ++r) {
       uintptr_t addr = (uintptr_t)(channel->nvlsDevPeers + r);
       channel->peers[comm->nRanks + 1 + r] = channel->nvlsPeers + r;
@@ -129,7 +175,7 @@ ncclResult_t initCollnetChannel(struct ncclComm* comm, int channelId, struct ncc
     ncclAtomicRefCountIncrement(&parent->channels[channelId].collnetPeers->refCount);
   } else {
     NCCLCHECK(ncclCalloc(&channel->collnetPeers, 1));
-    NCCLCHECK(ncclCudaCallocAsync(&channel->collnetDevPeers, 1, sharedRes->deviceStream.cudaStream));
+    NCCLCHECK(ncclDevArenaCalloc(&sharedRes->devArena, &channel->collnetDevPeers, 1));
     addr = (uintptr_t)channel->collnetDevPeers;
     channel->peers[comm->nRanks] = channel->collnetPeers;
     NCCLCHECK(ncclCudaMemcpyAsync((uintptr_t*)(channel->devPeers + comm->nRanks), (uintptr_t*)&addr, 1, sharedRes->deviceStream.cudaStream));
@@ -162,10 +208,8 @@ ncclResult_t freeChannel(struct ncclChannel* channel, int nRanks, int collnetNRa
         }
         if (r == nRanks) {
           free(channel->collnetPeers);
-          ncclCudaFree(channel->collnetDevPeers);
         } else if (r == nPeers - 1) {
           free(channel->nvlsPeers);
-          ncclCudaFree(channel->nvlsDevPeers);
         }
       }
     }
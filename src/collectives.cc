@@ -6,6 +6,15 @@
  ************************************************************************/
 
 #include "argcheck.h" // Need some checks here since we access comm
+#include "ce_coll.h"
+#include "compress.h"
+#include "oneshot.h"
+#include "alltoall.h"
+#include "collv.h"
+#include "hierpat.h"
+#include "sparse.h"
+#include "redop.h"
+#include "bcast.h"
 #include "collectives.h"
 #include "enqueue.h"
 #include "nccl.h"
@@ -73,10 +82,18 @@ const char* ncclProtoToString(int proto) {
   default: return "Unknown";
   }
 }
+#include "msccl/msccl_benchmark.h"
+#include "msccl/msccl_binary.h"
+#include "msccl/msccl_fallback.h"
 #include "msccl/msccl_lifecycle.h"
 #include "msccl/msccl_parser.h"
+#include "msccl/msccl_persistent.h"
 #include "msccl/msccl_setup.h"
+#include "msccl/msccl_simulate.h"
 #include "msccl/msccl_status.h"
+#include "msccl/msccl_telemetry.h"
+#include "msccl/msccl_topo.h"
+#include "msccl/msccl_validate.h"
 
 NCCL_API(ncclResult_t, ncclAllGather, const void* sendbuff, void* recvbuff, size_t sendcount,
     ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
@@ -95,6 +112,16 @@ ncclResult_t ncclAllGather(const void* sendbuff, void* recvbuff, size_t sendcoun
       sendcount, datatype, 0, 0, ncclSum, mscclFuncAllGather, comm, stream);
   }
 
+  bool done;
+  NCCLCHECK(ncclOneShotAllGather(comm, sendbuff, recvbuff, sendcount, datatype, stream, &done));
+  if (done) return ncclSuccess;
+  NCCLCHECK(ncclCeCollAllGather(comm, sendbuff, recvbuff, msgsize, stream, &done));
+  if (done) return ncclSuccess;
+  NCCLCHECK(ncclCompressAllGather(comm, sendbuff, recvbuff, sendcount, datatype, stream, &done));
+  if (done) return ncclSuccess;
+  NCCLCHECK(ncclHierPatAllGather(comm, sendbuff, recvbuff, sendcount, datatype, stream, &done));
+  if (done) return ncclSuccess;
+
   struct ncclInfo info = { ncclFuncAllGather, "AllGather",
     sendbuff, recvbuff, sendcount, datatype, ncclSum, 0, comm, stream, /* Args */
     ALLGATHER_CHUNKSTEPS, ALLGATHER_SLICESTEPS };
@@ -119,12 +146,19 @@ ncclResult_t ncclAllReduce(const void* sendbuff, void* recvbuff, size_t count,
   NvtxParamsAllReduce payload{count * ncclTypeSize(datatype), op};
   NVTX3_FUNC_WITH_PARAMS(AllReduce, AllReduceSchema, payload)
 
+  struct ncclCustomRedOp* custom = ncclRedOpCustom(comm, op);
+  if (custom) return ncclCustomReduceRun(comm, ncclFuncAllReduce, sendbuff, recvbuff, count, datatype, custom, stream);
+
   if (mscclAvailable() && !mscclIsCaller()) {
     return mscclEnqueueCheck(
       sendbuff, nullptr, nullptr, recvbuff, nullptr, nullptr,
       count, datatype, 0, 0, op, mscclFuncAllReduce, comm, stream);
   }
 
+  bool done;
+  NCCLCHECK(ncclOneShotAllReduce(comm, sendbuff, recvbuff, count, datatype, op, stream, &done));
+  if (done) return ncclSuccess;
+
   struct ncclInfo info = { ncclFuncAllReduce, "AllReduce",
     sendbuff, recvbuff, count, datatype, op, 0, comm, stream, /* Args */
     ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
@@ -132,6 +166,36 @@ ncclResult_t ncclAllReduce(const void* sendbuff, void* recvbuff, size_t count,
   return ncclSuccess;
 }
 
+NCCL_API(ncclResult_t, ncclAllReduceWithEpilogue, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, const void* addend, float scale, void* outbuff,
+    ncclDataType_t outtype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllReduceWithEpilogue(const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, const void* addend, float scale, void* outbuff,
+    ncclDataType_t outtype, ncclComm_t comm, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  int saveDev;
+
+  NCCLCHECK(CommCheck(comm, "AllReduceWithEpilogue", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  // A deferred reduction would run after the epilogue reading its result
+  if (ncclGroupDepth != 0 || !comm->config.blocking) {
+    WARN("AllReduceWithEpilogue : cannot be called inside a group or on a non-blocking communicator");
+    return ncclInvalidUsage;
+  }
+  if (outbuff == NULL || (outbuff == recvbuff && outtype != datatype)) {
+    WARN("AllReduceWithEpilogue : outbuff %p cannot hold the result of type %d in recvbuff %p", outbuff, outtype, recvbuff);
+    return ncclInvalidArgument;
+  }
+
+  NCCLCHECK(ncclAllReduce(sendbuff, recvbuff, count, datatype, op, comm, stream));
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchEpilogue(outbuff, outtype, recvbuff, addend, count, scale, datatype, stream), ret, exit);
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
 NCCL_API(ncclResult_t, ncclBroadcast, const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype, int root,
     ncclComm_t comm, cudaStream_t stream);
 ncclResult_t ncclBroadcast(const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype, int root,
@@ -185,6 +249,11 @@ ncclResult_t ncclReduce(const void* sendbuff, void* recvbuff, size_t count,
   NvtxParamsReduce payload{count * ncclTypeSize(datatype), root, op};
   NVTX3_FUNC_WITH_PARAMS(Reduce, ReduceSchema, payload)
 
+  if (ncclRedOpCustom(comm, op)) {
+    WARN("Reduce : custom reduction operators are only supported by AllReduce and ReduceScatter");
+    return ncclInvalidArgument;
+  }
+
   if (mscclAvailable() && !mscclIsCaller()) {
     return mscclEnqueueCheck(
       sendbuff, nullptr, nullptr, recvbuff, nullptr, nullptr,
@@ -214,12 +283,21 @@ ncclResult_t ncclReduceScatter(const void* sendbuff, void* recvbuff, size_t recv
   NvtxParamsReduceScatter payload{recvcount * ncclTypeSize(datatype), op};
   NVTX3_FUNC_WITH_PARAMS(ReduceScatter, ReduceScatterSchema, payload)
 
+  struct ncclCustomRedOp* custom = ncclRedOpCustom(comm, op);
+  if (custom) return ncclCustomReduceRun(comm, ncclFuncReduceScatter, sendbuff, recvbuff, recvcount, datatype, custom, stream);
+
   if (mscclAvailable() && !mscclIsCaller()) {
     return mscclEnqueueCheck(
       sendbuff, nullptr, nullptr, recvbuff, nullptr, nullptr,
       recvcount, datatype, 0, 0, op, mscclFuncReduceScatter, comm, stream);
   }
 
+  bool done;
+  NCCLCHECK(ncclCompressReduceScatter(comm, sendbuff, recvbuff, recvcount, datatype, op, stream, &done));
+  if (done) return ncclSuccess;
+  NCCLCHECK(ncclHierPatReduceScatter(comm, sendbuff, recvbuff, recvcount, datatype, op, stream, &done));
+  if (done) return ncclSuccess;
+
   struct ncclInfo info = { ncclFuncReduceScatter, "ReduceScatter",
     sendbuff, recvbuff, recvcount, datatype, op, 0, comm, stream, /* Args */
     REDUCESCATTER_CHUNKSTEPS, REDUCESCATTER_SLICESTEPS };
@@ -300,6 +378,11 @@ ncclResult_t ncclAllToAll(const void* sendbuff, void* recvbuff, size_t count, nc
     int nRanks;
     NCCLCHECK(ncclCommCount(comm, &nRanks));
     if (count == 0) return ncclSuccess;
+    bool done;
+    NCCLCHECK(ncclCeCollAllToAll(comm, sendbuff, recvbuff, rankOffset, stream, &done));
+    if (done) return ncclSuccess;
+    NCCLCHECK(ncclHierAllToAllRun(comm, sendbuff, recvbuff, count, datatype, stream, &done));
+    if (done) return ncclSuccess;
     NCCLCHECK(ncclGroupStart());
     for (int r=0; r<nRanks; r++) {
       NCCLCHECK(ncclSend(((char*)sendbuff)+r*rankOffset, count, datatype, r, comm, stream));
@@ -311,27 +394,143 @@ ncclResult_t ncclAllToAll(const void* sendbuff, void* recvbuff, size_t count, nc
   return ret;
 }
 
-NCCL_API(ncclResult_t, mscclLoadAlgo, const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, int rank);
-ncclResult_t mscclLoadAlgo(const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, int rank) {
+NCCL_API(ncclResult_t, ncclAllToAllvDevice, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+  void* recvbuff, size_t* recvcounts, const size_t* rdispls, size_t maxcount, ncclDataType_t datatype,
+  ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllToAllvDevice(const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+  void* recvbuff, size_t* recvcounts, const size_t* rdispls, size_t maxcount, ncclDataType_t datatype,
+  ncclComm_t comm, cudaStream_t stream) {
+  return ncclAllToAllvDeviceRun(comm, sendbuff, sendcounts, sdispls, recvbuff, recvcounts, rdispls, maxcount, datatype, stream);
+}
+
+NCCL_API(ncclResult_t, ncclAllGatherV, const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+  const size_t* rdispls, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllGatherV(const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+  const size_t* rdispls, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  return ncclAllGatherVRun(comm, sendbuff, recvbuff, recvcounts, rdispls, datatype, stream);
+}
+
+NCCL_API(ncclResult_t, ncclReduceScatterV, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+  void* recvbuff, ncclDataType_t datatype, ncclRedOp_t op, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclReduceScatterV(const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+  void* recvbuff, ncclDataType_t datatype, ncclRedOp_t op, ncclComm_t comm, cudaStream_t stream) {
+  return ncclReduceScatterVRun(comm, sendbuff, sendcounts, sdispls, recvbuff, datatype, op, stream);
+}
+
+NCCL_API(ncclResult_t, ncclSparseAllReduce, const void* values, const int64_t* indices, const size_t* nnz, size_t maxnnz,
+  void* recvbuff, size_t count, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclSparseAllReduce(const void* values, const int64_t* indices, const size_t* nnz, size_t maxnnz,
+  void* recvbuff, size_t count, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  return ncclSparseAllReduceRun(comm, values, indices, nnz, maxnnz, recvbuff, count, datatype, stream);
+}
+
+NCCL_API(ncclResult_t, ncclBroadcastStaged, const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype, int root,
+  ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclBroadcastStaged(const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype, int root,
+  ncclComm_t comm, cudaStream_t stream) {
+  return ncclBroadcastStagedRun(comm, sendbuff, recvbuff, count, datatype, root, stream);
+}
+
+// On failure nothing refers to hostAlgo, which the caller frees
+static ncclResult_t mscclRegisterAlgo(struct mscclAlgo* hostAlgo, const char* name, mscclAlgoHandle_t *mscclAlgoHandle) {
   mscclStatus& status = mscclGetStatus();
+  std::lock_guard<std::mutex> lock(status.algoMutex);
   if (status.freeAlgoHandles.size() == 0) {
     WARN("MSCCL: MSCCL_MAX_NUM_ALGOS (%d) limit reached", MSCCL_MAX_NUM_ALGOS);
     return ncclInvalidUsage;
   }
+
+  // Copy to the current device, other devices get theirs on first use
+  int cudaDev;
+  struct mscclDevAlgo* devAlgo;
+  CUDACHECK(cudaGetDevice(&cudaDev));
+  NCCLCHECK(mscclSetupDevAlgo(hostAlgo, &devAlgo));
+
   *mscclAlgoHandle = *status.freeAlgoHandles.rbegin();
   status.freeAlgoHandles.pop_back();
+  status.hostAlgos[*mscclAlgoHandle] = hostAlgo;
+  status.algoNames[*mscclAlgoHandle] = name;
+  status.devAlgos[*mscclAlgoHandle][cudaDev] = devAlgo;
+
+  return ncclSuccess;
+}
+
+// Host algorithm and its copy on the device of comm, made on first use there
+ncclResult_t mscclGetAlgo(mscclAlgoHandle_t mscclAlgoHandle, ncclComm_t comm, struct mscclAlgo** hostAlgo, struct mscclDevAlgo** devAlgo) {
+  mscclStatus& status = mscclGetStatus();
+  std::lock_guard<std::mutex> lock(status.algoMutex);
+  auto h = status.hostAlgos.find(mscclAlgoHandle);
+  if (h == status.hostAlgos.end()) {
+    WARN("MSCCL: Invalid algorithm handle %d", mscclAlgoHandle);
+    return ncclInvalidArgument;
+  }
+  *hostAlgo = h->second;
+  std::map<int, struct mscclDevAlgo*>& devCopies = status.devAlgos[mscclAlgoHandle];
+  auto d = devCopies.find(comm->cudaDev);
+  if (d == devCopies.end()) {
+    NCCLCHECK(mscclSetupDevAlgo(*hostAlgo, devAlgo));
+    devCopies[comm->cudaDev] = *devAlgo;
+  } else {
+    *devAlgo = d->second;
+  }
+  return ncclSuccess;
+}
 
+ncclResult_t mscclLoadAlgoFromBinImage(const char* name, const char* image, size_t size, mscclAlgoHandle_t *mscclAlgoHandle, int rank) {
+  ncclResult_t ret = ncclSuccess;
   struct mscclAlgo* hostAlgo;
   NCCLCHECK(ncclCalloc(&hostAlgo, 1));
-  NCCLCHECK(mscclGetAlgoFromXmlFile(mscclAlgoFilePath, hostAlgo, rank));
-  status.hostAlgos[*mscclAlgoHandle] = hostAlgo;
+  NCCLCHECKGOTO(mscclGetAlgoFromBinImage(name, image, size, hostAlgo, rank), ret, fail);
+  // A program that would hang the kernel is rejected before it can be selected
+  NCCLCHECKGOTO(mscclValidateAlgo(hostAlgo, rank), ret, fail);
+  NCCLCHECKGOTO(mscclRegisterAlgo(hostAlgo, name, mscclAlgoHandle), ret, fail);
+  return ncclSuccess;
+fail:
+  free(hostAlgo);
+  return ret;
+}
 
-  struct mscclAlgo* devAlgo;
-  NCCLCHECK(ncclCudaCalloc(&devAlgo, 1));
-  CUDACHECK(cudaMemcpy(devAlgo, hostAlgo, sizeof(struct mscclAlgo), cudaMemcpyHostToDevice));
-  status.devAlgos[*mscclAlgoHandle] = devAlgo;
+NCCL_API(ncclResult_t, mscclLoadAlgo, const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, int rank);
+ncclResult_t mscclLoadAlgo(const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, int rank) {
+  struct NvtxParamsMscclLoadAlgo {
+    const char* path;
+    int rank;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t MscclLoadAlgoSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_CSTRING, "Algorithm file"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Rank", nullptr, 0, offsetof(NvtxParamsMscclLoadAlgo, rank)}
+  };
+  NvtxParamsMscclLoadAlgo payload{mscclAlgoFilePath, rank};
+  NVTX3_FUNC_WITH_PARAMS(MscclLoadAlgo, MscclLoadAlgoSchema, payload)
 
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgo* hostAlgo;
+  NCCLCHECK(ncclCalloc(&hostAlgo, 1));
+  NCCLCHECKGOTO(mscclGetAlgoFromFile(mscclAlgoFilePath, hostAlgo, rank), ret, fail);
+  // A program that would hang the kernel is rejected before it can be selected
+  NCCLCHECKGOTO(mscclValidateAlgo(hostAlgo, rank), ret, fail);
+  NCCLCHECKGOTO(mscclRegisterAlgo(hostAlgo, mscclAlgoFilePath, mscclAlgoHandle), ret, fail);
   return ncclSuccess;
+fail:
+  free(hostAlgo);
+  return ret;
+}
+
+// Load the program of logical rank rank and turn its peers into ranks of comm
+ncclResult_t mscclLoadAlgoRemapped(const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, ncclComm_t comm,
+    int rank, const int* logicalToRank) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgo* hostAlgo;
+  NCCLCHECK(ncclCalloc(&hostAlgo, 1));
+  NCCLCHECKGOTO(mscclGetAlgoFromFile(mscclAlgoFilePath, hostAlgo, rank), ret, fail);
+  NCCLCHECKGOTO(mscclValidateAlgo(hostAlgo, rank), ret, fail);
+  mscclTopoRemapAlgo(hostAlgo, logicalToRank);
+  NCCLCHECKGOTO(mscclRegisterAlgo(hostAlgo, mscclAlgoFilePath, mscclAlgoHandle), ret, fail);
+  INFO(NCCL_INIT, "MSCCL: Loaded %s on rank %d as logical rank %d", mscclAlgoFilePath, comm->rank, rank);
+  return ncclSuccess;
+fail:
+  free(hostAlgo);
+  return ret;
 }
 
 NCCL_API(ncclResult_t, mscclRunAlgo,
@@ -344,33 +543,126 @@ ncclResult_t mscclRunAlgo(
     void* recvBuff, const size_t recvCounts[], const size_t rDisPls[],
     size_t count, ncclDataType_t dataType, int root, int peer, ncclRedOp_t op,
     mscclAlgoHandle_t mscclAlgoHandle, ncclComm_t comm, cudaStream_t stream) {
-  mscclStatus& status = mscclGetStatus();
-  struct mscclAlgo* hostAlgo = status.hostAlgos[mscclAlgoHandle];
-  struct mscclAlgo* devAlgo = status.devAlgos[mscclAlgoHandle];
+  struct NvtxParamsMscclRunAlgo {
+    int handle;
+    size_t bytes;
+    ncclRedOp_t op;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t MscclRunAlgoSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Algorithm handle"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Message size [bytes]", nullptr, 0, offsetof(NvtxParamsMscclRunAlgo, bytes)},
+    {0, NVTX_PAYLOAD_ENTRY_NCCL_REDOP, "Reduction operation", nullptr, 0, offsetof(NvtxParamsMscclRunAlgo, op)}
+  };
+  NvtxParamsMscclRunAlgo payload{mscclAlgoHandle, count * ncclTypeSize(dataType), op};
+  NVTX3_FUNC_WITH_PARAMS(MscclRunAlgo, MscclRunAlgoSchema, payload)
+
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgo* hostAlgo;
+  struct mscclDevAlgo* devAlgo;
+  const struct mscclLaunchDesc* desc;
+  struct mscclTail tail;
+  struct mscclAlias alias;
+  // Groups may hold operations of communicators on different devices
+  int savedDevice;
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+
+  NCCLCHECKGOTO(mscclGetAlgo(mscclAlgoHandle, comm, &hostAlgo, &devAlgo), ret, exit);
+
+  NCCLCHECKGOTO(mscclGetCaptureStatus(comm, stream), ret, exit);
+
+  NCCLCHECKGOTO(mscclWaitDevAlgo(devAlgo, stream), ret, exit);
+
+  NCCLCHECKGOTO(mscclSetupCount(mscclAlgoHandle, hostAlgo, devAlgo, comm, count, dataType, &desc), ret, exit);
+
+  NCCLCHECKGOTO(mscclSetupTail(mscclAlgoHandle, hostAlgo, devAlgo, comm, count, dataType, &tail), ret, exit);
+
+  NCCLCHECKGOTO(mscclSetupAlias(sendBuff, recvBuff, desc, &tail, comm, stream, &alias), ret, exit);
+
+  if (mscclHasBody(&tail)) {
+    NCCLCHECKGOTO(mscclSetupProxy(alias.sendBuff, alias.recvBuff, op, desc, comm, stream), ret, exit);
+
+    NCCLCHECKGOTO(mscclTelemetryBegin(mscclAlgoHandle, hostAlgo, count * ncclTypeSize(dataType), comm), ret, exit);
+
+    NCCLCHECKGOTO(mscclSetupKernel(alias.sendBuff, alias.recvBuff, op, desc, comm, stream), ret, exit);
+
+    NCCLCHECKGOTO(mscclFinishAlias(&alias, stream), ret, exit);
+  }
+
+  NCCLCHECKGOTO(mscclRunTail(sendBuff, recvBuff, op, &tail, comm, stream), ret, exit);
+
+exit:
+  // the persistent mode and failed launches leave the mark of mscclTelemetryBegin
+  (void)mscclTelemetryEnd(comm);
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ret;
+}
 
-  NCCLCHECK(mscclGetCaptureStatus(stream));
+ncclResult_t mscclRunFusedAlgo(const std::vector<struct mscclSavedSchedulerParam*>& params) {
+  ncclResult_t ret = ncclSuccess;
+  ncclComm_t comm = params[0]->comm;
+  cudaStream_t stream = params[0]->stream;
+  struct mscclAlgo* hostAlgo;
+  struct mscclDevAlgo* devAlgo;
+  int savedDevice;
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+
+  NCCLCHECKGOTO(mscclGetAlgo(params[0]->p.handle, comm, &hostAlgo, &devAlgo), ret, exit);
+
+  NCCLCHECKGOTO(mscclGetCaptureStatus(comm, stream), ret, exit);
 
-  NCCLCHECK(mscclSetupCount(hostAlgo, comm, count, dataType));
+  NCCLCHECKGOTO(mscclWaitDevAlgo(devAlgo, stream), ret, exit);
 
-  NCCLCHECK(mscclSetupScratch(hostAlgo, stream));
+  NCCLCHECKGOTO(mscclSetupFusedKernel(params, hostAlgo, devAlgo, comm, stream), ret, exit);
 
-  NCCLCHECK(mscclSetupSyncFlags(stream));
+exit:
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ret;
+}
 
-  NCCLCHECK(mscclSetupProxy(hostAlgo, comm, stream));
+NCCL_API(ncclResult_t, mscclWarmup, ncclComm_t comm);
+ncclResult_t mscclWarmup(ncclComm_t comm) {
+  NCCLCHECK(CommCheck(comm, "mscclWarmup", "comm"));
+  NCCLCHECK(mscclWarmupComm(comm));
+  return ncclSuccess;
+}
 
-  NCCLCHECK(mscclSetupKernel(sendBuff, recvBuff, count, dataType, op, hostAlgo, devAlgo, comm, stream));
+NCCL_API(ncclResult_t, mscclQuiesce, ncclComm_t comm);
+ncclResult_t mscclQuiesce(ncclComm_t comm) {
+  NCCLCHECK(CommCheck(comm, "mscclQuiesce", "comm"));
+  NCCLCHECK(mscclPersistentStopDevice(comm->cudaDev));
+  return ncclSuccess;
+}
 
+NCCL_API(ncclResult_t, mscclReloadAlgos, ncclComm_t comm);
+ncclResult_t mscclReloadAlgos(ncclComm_t comm) {
+  NCCLCHECK(CommCheck(comm, "mscclReloadAlgos", "comm"));
+  NCCLCHECK(mscclReloadAlgosComm(comm));
   return ncclSuccess;
 }
 
 NCCL_API(ncclResult_t, mscclUnloadAlgo, mscclAlgoHandle_t mscclAlgoHandle);
 ncclResult_t mscclUnloadAlgo(mscclAlgoHandle_t mscclAlgoHandle) {
   mscclStatus& status = mscclGetStatus();
+  std::lock_guard<std::mutex> lock(status.algoMutex);
 
   free(status.hostAlgos[mscclAlgoHandle]);
   status.hostAlgos.erase(mscclAlgoHandle);
+  status.algoNames.erase(mscclAlgoHandle);
 
-  NCCLCHECK(ncclCudaFree(status.devAlgos[mscclAlgoHandle]));
+  for (auto &d : status.devAlgos[mscclAlgoHandle]) {
+    NCCLCHECK(mscclPersistentStopDevice(d.first));
+    NCCLCHECK(mscclFreeDevAlgo(d.second));
+  }
   status.devAlgos.erase(mscclAlgoHandle);
 
   status.freeAlgoHandles.push_back(mscclAlgoHandle);
@@ -381,3 +673,46 @@ ncclResult_t mscclUnloadAlgo(mscclAlgoHandle_t mscclAlgoHandle) {
 
   return ncclSuccess;
 }
+
+NCCL_API(ncclResult_t, mscclCompileAlgo, const char *mscclAlgoXmlPath, const char *mscclAlgoBinPath);
+ncclResult_t mscclCompileAlgo(const char *mscclAlgoXmlPath, const char *mscclAlgoBinPath) {
+  NCCLCHECK(PtrCheck((void*)mscclAlgoXmlPath, "mscclCompileAlgo", "mscclAlgoXmlPath"));
+  NCCLCHECK(PtrCheck((void*)mscclAlgoBinPath, "mscclCompileAlgo", "mscclAlgoBinPath"));
+  NCCLCHECK(mscclCompileAlgoXmlFile(mscclAlgoXmlPath, mscclAlgoBinPath));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, mscclSimulateAlgo, const char *mscclAlgoFilePath, ncclComm_t comm, const char *reportPath);
+ncclResult_t mscclSimulateAlgo(const char *mscclAlgoFilePath, ncclComm_t comm, const char *reportPath) {
+  NCCLCHECK(PtrCheck((void*)mscclAlgoFilePath, "mscclSimulateAlgo", "mscclAlgoFilePath"));
+  NCCLCHECK(PtrCheck((void*)reportPath, "mscclSimulateAlgo", "reportPath"));
+  if (comm != nullptr) NCCLCHECK(CommCheck(comm, "mscclSimulateAlgo", "comm"));
+  NCCLCHECK(mscclSimulateAlgoFile(mscclAlgoFilePath, comm, reportPath));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, mscclBenchmarkAlgos, const char *csvPath, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t mscclBenchmarkAlgos(const char *csvPath, ncclComm_t comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck((void*)csvPath, "mscclBenchmarkAlgos", "csvPath"));
+  NCCLCHECK(CommCheck(comm, "mscclBenchmarkAlgos", "comm"));
+  NCCLCHECK(mscclBenchmarkAlgosComm(comm, csvPath, stream));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, mscclGetLatencyHistograms, ncclComm_t comm, mscclLatencyHistogram_t* histograms, int* nHistograms,
+    unsigned long long* dropped);
+ncclResult_t mscclGetLatencyHistograms(ncclComm_t comm, mscclLatencyHistogram_t* histograms, int* nHistograms,
+    unsigned long long* dropped) {
+  NCCLCHECK(CommCheck(comm, "mscclGetLatencyHistograms", "comm"));
+  NCCLCHECK(PtrCheck(nHistograms, "mscclGetLatencyHistograms", "nHistograms"));
+  NCCLCHECK(mscclTelemetryQuery(comm, histograms, nHistograms, dropped));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, mscclGetFallbackStats, ncclComm_t comm, mscclFallbackStat_t* stats, int* nStats);
+ncclResult_t mscclGetFallbackStats(ncclComm_t comm, mscclFallbackStat_t* stats, int* nStats) {
+  NCCLCHECK(CommCheck(comm, "mscclGetFallbackStats", "comm"));
+  NCCLCHECK(PtrCheck(nStats, "mscclGetFallbackStats", "nStats"));
+  NCCLCHECK(mscclFallbackQuery(comm, stats, nStats));
+  return ncclSuccess;
+}
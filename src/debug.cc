@@ -12,6 +12,8 @@
 #include <strings.h>
 #include <sys/syscall.h>
 #include <chrono>
+#include <algorithm>
+#include <time.h>
 #include "param.h"
 
 int ncclDebugLevel = -1;
@@ -27,6 +29,162 @@ static bool ncclWarnSetDebugInfo = false;
 
 static __thread int tid = -1;
 
+// Messages of INFO and TRACE allowed per call site and second, 0 for no limit
+static int ncclDebugRateLimit = 0;
+
+// With NCCL_DEBUG_ASYNC=1, threads copy their messages into a ring of their own and a writer
+// thread writes them out, so that logging threads never wait on the file. WARN stays synchronous.
+#define NCCL_DEBUG_RING_BYTES (1 << 16)
+#define NCCL_DEBUG_WRITER_PERIOD_MS 10
+
+struct ncclDebugRing {
+  char buff[NCCL_DEBUG_RING_BYTES];
+  uint64_t head; // Advanced by the owner thread
+  uint64_t tail; // Advanced by whoever holds ncclDebugWriteLock
+  int dead;
+  struct ncclDebugRing* next;
+};
+
+static bool ncclDebugAsync = false;
+static pthread_mutex_t ncclDebugWriteLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ncclDebugWriterCond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ncclDebugWriterOnce = PTHREAD_ONCE_INIT;
+static pthread_t ncclDebugWriter;
+static bool ncclDebugWriterStop = false;
+static struct ncclDebugRing* ncclDebugRings = NULL;
+
+struct ncclDebugRingOwner {
+  struct ncclDebugRing* ring = NULL;
+  ~ncclDebugRingOwner() {
+    if (ring) __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+  }
+};
+static thread_local struct ncclDebugRingOwner threadRing;
+
+// Called with ncclDebugWriteLock held
+static void ncclDebugDrain() {
+  struct ncclDebugRing** prev = &ncclDebugRings;
+  while (*prev) {
+    struct ncclDebugRing* ring = *prev;
+    int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (ring->tail != head) {
+      size_t offset = ring->tail % NCCL_DEBUG_RING_BYTES;
+      size_t n = std::min((size_t)(head - ring->tail), NCCL_DEBUG_RING_BYTES - offset);
+      fwrite(ring->buff+offset, 1, n, ncclDebugFile);
+      __atomic_store_n(&ring->tail, ring->tail+n, __ATOMIC_RELEASE);
+    }
+    if (dead) {
+      *prev = ring->next;
+      free(ring);
+    } else {
+      prev = &ring->next;
+    }
+  }
+  fflush(ncclDebugFile);
+}
+
+static void* ncclDebugWriterMain(void*) {
+  pthread_mutex_lock(&ncclDebugWriteLock);
+  while (!ncclDebugWriterStop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += NCCL_DEBUG_WRITER_PERIOD_MS*1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_cond_timedwait(&ncclDebugWriterCond, &ncclDebugWriteLock, &ts);
+    ncclDebugDrain();
+  }
+  pthread_mutex_unlock(&ncclDebugWriteLock);
+  return NULL;
+}
+
+// Messages still in the rings are written when the process exits
+static void ncclDebugWriterExit() {
+  pthread_mutex_lock(&ncclDebugWriteLock);
+  __atomic_store_n(&ncclDebugAsync, false, __ATOMIC_RELEASE);
+  ncclDebugWriterStop = true;
+  pthread_cond_signal(&ncclDebugWriterCond);
+  pthread_mutex_unlock(&ncclDebugWriteLock);
+  pthread_join(ncclDebugWriter, NULL);
+  pthread_mutex_lock(&ncclDebugWriteLock);
+  ncclDebugDrain();
+  pthread_mutex_unlock(&ncclDebugWriteLock);
+}
+
+static void ncclDebugWriterStart() {
+  if (pthread_create(&ncclDebugWriter, NULL, ncclDebugWriterMain, NULL) != 0) {
+    __atomic_store_n(&ncclDebugAsync, false, __ATOMIC_RELEASE);
+    return;
+  }
+  atexit(ncclDebugWriterExit);
+}
+
+static void ncclDebugWriteSync(const char* buffer, size_t len) {
+  if (__atomic_load_n(&ncclDebugAsync, __ATOMIC_ACQUIRE)) {
+    // Keep the order of what this thread queued before
+    pthread_mutex_lock(&ncclDebugWriteLock);
+    ncclDebugDrain();
+    fwrite(buffer, 1, len, ncclDebugFile);
+    fflush(ncclDebugFile);
+    pthread_mutex_unlock(&ncclDebugWriteLock);
+  } else {
+    fwrite(buffer, 1, len, ncclDebugFile);
+  }
+}
+
+static void ncclDebugWrite(ncclDebugLogLevel level, const char* buffer, size_t len) {
+  if (level == NCCL_LOG_WARN || !__atomic_load_n(&ncclDebugAsync, __ATOMIC_ACQUIRE)) {
+    ncclDebugWriteSync(buffer, len);
+    return;
+  }
+  pthread_once(&ncclDebugWriterOnce, ncclDebugWriterStart);
+  struct ncclDebugRing* ring = NULL;
+  if (!__atomic_load_n(&ncclDebugAsync, __ATOMIC_ACQUIRE)) {
+    ncclDebugWriteSync(buffer, len);
+    return;
+  }
+  ring = threadRing.ring;
+  if (ring == NULL) {
+    ring = (struct ncclDebugRing*)calloc(1, sizeof(struct ncclDebugRing));
+    if (ring == NULL) {
+      ncclDebugWriteSync(buffer, len);
+      return;
+    }
+    pthread_mutex_lock(&ncclDebugWriteLock);
+    ring->next = ncclDebugRings;
+    ncclDebugRings = ring;
+    pthread_mutex_unlock(&ncclDebugWriteLock);
+    threadRing.ring = ring;
+  }
+  uint64_t head = ring->head;
+  if (NCCL_DEBUG_RING_BYTES - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < len) {
+    // Full, drains the rings in the order they were filled
+    ncclDebugWriteSync(buffer, len);
+    return;
+  }
+  size_t offset = head % NCCL_DEBUG_RING_BYTES;
+  size_t n = std::min(len, NCCL_DEBUG_RING_BYTES - offset);
+  memcpy(ring->buff+offset, buffer, n);
+  memcpy(ring->buff, buffer+n, len-n);
+  __atomic_store_n(&ring->head, head+len, __ATOMIC_RELEASE);
+}
+
+// Returns false when the site went over its messages of the current second. Otherwise sets
+// suppressed to the messages dropped in the previous seconds.
+static bool ncclDebugSiteAllow(struct ncclDebugSite* site, uint32_t* suppressed) {
+  *suppressed = 0;
+  if (site == NULL || ncclDebugRateLimit <= 0) return true;
+  uint64_t window = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - ncclEpoch).count();
+  uint64_t current = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+  if (current != window && __atomic_compare_exchange_n(&site->window, &current, window, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < (uint32_t)ncclDebugRateLimit) return true;
+  __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
 static void ncclDebugInit() {
   pthread_mutex_lock(&ncclDebugLock);
   if (ncclDebugLevel != -1) { pthread_mutex_unlock(&ncclDebugLock); return; }
@@ -109,6 +267,19 @@ static void ncclDebugInit() {
       ncclWarnSetDebugInfo = value;
   }
 
+  const char* ncclDebugAsyncEnv = ncclGetEnv("NCCL_DEBUG_ASYNC");
+  if (ncclDebugAsyncEnv != NULL && strlen(ncclDebugAsyncEnv) > 0) {
+    errno = 0;
+    int64_t value = strtoll(ncclDebugAsyncEnv, NULL, 0);
+    if (!errno) ncclDebugAsync = value != 0;
+  }
+  const char* ncclDebugRateLimitEnv = ncclGetEnv("NCCL_DEBUG_RATE_LIMIT");
+  if (ncclDebugRateLimitEnv != NULL && strlen(ncclDebugRateLimitEnv) > 0) {
+    errno = 0;
+    int64_t value = strtoll(ncclDebugRateLimitEnv, NULL, 0);
+    if (!errno && value > 0) ncclDebugRateLimit = value;
+  }
+
   // Cache pid and hostname
   getHostName(hostname, 1024, '.');
   pid = getpid();
@@ -170,7 +341,7 @@ static void ncclDebugInit() {
  * Also exported to the dynamically loadable Net transport modules so
  * they can share the debugging mechanisms and output files
  */
-void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, ...) {
+static void ncclDebugLogV(struct ncclDebugSite* site, ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, va_list args) {
   if (__atomic_load_n(&ncclDebugLevel, __ATOMIC_ACQUIRE) == -1) ncclDebugInit();
   if (ncclDebugNoWarn != 0 && level == NCCL_LOG_WARN) { level = NCCL_LOG_INFO; flags = ncclDebugNoWarn; }
 
@@ -178,12 +349,14 @@ void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *file
   if (level == NCCL_LOG_WARN) {
     pthread_mutex_lock(&ncclDebugLock);
     va_list vargs;
-    va_start(vargs, fmt);
+    va_copy(vargs, args);
     (void) vsnprintf(ncclLastError, sizeof(ncclLastError), fmt, vargs);
     va_end(vargs);
     pthread_mutex_unlock(&ncclDebugLock);
   }
   if (ncclDebugLevel < level || ((flags & ncclDebugMask) == 0)) return;
+  uint32_t suppressed;
+  if (!ncclDebugSiteAllow(site, &suppressed)) return;
 
   if (tid == -1) {
     tid = syscall(SYS_gettid);
@@ -211,19 +384,35 @@ void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *file
                    hostname, pid, tid, cudaDev, timestamp, filefunc, line);
   }
 
-  va_list vargs;
-  va_start(vargs, fmt);
-  len += vsnprintf(buffer+len, sizeof(buffer)-len, fmt, vargs);
-  va_end(vargs);
+  if (suppressed && len < sizeof(buffer)) {
+    len += snprintf(buffer+len, sizeof(buffer)-len, "[%u messages suppressed] ", suppressed);
+  }
+  if (len < sizeof(buffer)) {
+    len += vsnprintf(buffer+len, sizeof(buffer)-len, fmt, args);
+  }
   // vsnprintf may return len >= sizeof(buffer) in the case of a truncated output.
   // Rewind len so that we can replace the final \0 by \n
   if (len >= sizeof(buffer)) len = sizeof(buffer)-1;
   if (len) {
     buffer[len++] = '\n';
-    fwrite(buffer, 1, len, ncclDebugFile);
+    ncclDebugWrite(level, buffer, len);
   }
 }
 
+void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, ...) {
+  va_list vargs;
+  va_start(vargs, fmt);
+  ncclDebugLogV(NULL, level, flags, filefunc, line, fmt, vargs);
+  va_end(vargs);
+}
+
+void ncclDebugLogSite(struct ncclDebugSite* site, ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, ...) {
+  va_list vargs;
+  va_start(vargs, fmt);
+  ncclDebugLogV(site, level, flags, filefunc, line, fmt, vargs);
+  va_end(vargs);
+}
+
 NCCL_PARAM(SetThreadName, "SET_THREAD_NAME", 0);
 
 void ncclSetThreadName(pthread_t thread, const char *fmt, ...) {
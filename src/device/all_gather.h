@@ -30,17 +30,17 @@ namespace {
     int npKitCtxIdx = bid;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
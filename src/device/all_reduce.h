@@ -32,24 +32,24 @@ namespace {
     int npKitCtxIdx = bid;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -82,9 +82,9 @@ namespace {
       offset = gridOffset + elemOffset + chunkOffset;
       nelem = (int)min(chunkCount, remCount - chunkOffset);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_SEND_ENTRY)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_SEND_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_SEND_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_SEND_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -92,18 +92,18 @@ namespace {
 
       prims.directSend(offset, offset, nelem);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_SEND_EXIT)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_SEND_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_SEND_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_SEND_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
 
       // k-2 steps: reduce and copy to next GPU
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY)
-      if (tid == 0 && nranks > 2) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY, nelem*(nranks-2)*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && nranks > 2 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY, nelem*(nranks-2)*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -117,9 +117,9 @@ namespace {
         prims.directRecvReduceDirectSend(offset, offset, nelem);
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT)
-      if (tid == 0 && nranks > 2) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT, nelem*(nranks-2)*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && nranks > 2 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT, nelem*(nranks-2)*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -131,9 +131,9 @@ namespace {
       offset = gridOffset + elemOffset + chunkOffset;
       nelem = (int)min(chunkCount, remCount - chunkOffset);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -141,16 +141,16 @@ namespace {
 
       prims.directRecvReduceCopyDirectSend(offset, offset, nelem, /*postOp=*/true);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY)
-      if (tid == 0 && nranks > 2) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY, nelem*(nranks-2)*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && nranks > 2 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY, nelem*(nranks-2)*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -165,9 +165,9 @@ namespace {
         prims.directRecvCopyDirectSend(offset, nelem);
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT)
-      if (tid == 0 && nranks > 2) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT, nelem*(nranks-2)*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && nranks > 2 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT, nelem*(nranks-2)*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -178,9 +178,9 @@ namespace {
       offset = gridOffset + elemOffset + chunkOffset;
       nelem = (int)min(chunkCount, remCount - chunkOffset);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_ENTRY)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -188,18 +188,18 @@ namespace {
 
       prims.directRecv(offset, offset, nelem);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_EXIT)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_EXIT, nelem*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
 
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_RING_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_EXIT, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_RING_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_RING_EXIT, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -221,24 +221,24 @@ namespace {
     int npKitCtxIdx = bid;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -253,9 +253,9 @@ namespace {
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -283,9 +283,9 @@ namespace {
         }
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -301,9 +301,9 @@ namespace {
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -331,18 +331,18 @@ namespace {
         }
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT)
-      if (tid == 0) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
 
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_EXIT, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_EXIT, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -381,24 +381,24 @@ namespace {
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (isNpKitThread) {
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (isNpKitThread) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_ENTRY)
-    if (isNpKitThread) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -414,9 +414,9 @@ namespace {
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -428,9 +428,9 @@ namespace {
         prims.directRecvReduceCopyDirectSend(offset, offset, nelem, /*doPost=*/true);
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -457,9 +457,9 @@ namespace {
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -480,9 +480,9 @@ namespace {
         }
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -503,9 +503,9 @@ namespace {
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -526,18 +526,18 @@ namespace {
         }
       }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT, chunkCount*sizeof(T), prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
 
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_EXIT)
-    if (isNpKitThread) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_EXIT, chunkCount*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_EXIT, chunkCount*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -0,0 +1,73 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include <cuda_runtime.h>
+
+namespace {
+  constexpr int AllToAllvThreads = 512;
+
+  __device__ __forceinline__ void copyBytes(char* dst, char const* src, size_t bytes) {
+    if ((((uintptr_t)dst | (uintptr_t)src | bytes) & 15) == 0) {
+      uint4* d = reinterpret_cast<uint4*>(dst);
+      uint4 const* s = reinterpret_cast<uint4 const*>(src);
+      for (size_t i = threadIdx.x; i < bytes/16; i += blockDim.x) d[i] = s[i];
+    } else {
+      for (size_t i = threadIdx.x; i < bytes; i += blockDim.x) dst[i] = src[i];
+    }
+  }
+
+  // Offset of the block of peer p when the blocks are packed in rank order
+  __device__ __forceinline__ size_t packedOffset(size_t const* counts, size_t stride, int p) {
+    size_t offset = 0;
+    for (int q = 0; q < p; q++) offset += *reinterpret_cast<size_t const*>(reinterpret_cast<char const*>(counts) + q*stride);
+    return offset;
+  }
+
+  // One block per peer. Counts beyond maxCount are cut to it.
+  __global__ __launch_bounds__(AllToAllvThreads, 1)
+  void allToAllvPackKernel(char* dst, char const* src, size_t const* counts, size_t const* displs, size_t maxCount,
+      size_t eltSize, size_t slotBytes, int nRanks) {
+    for (int p = blockIdx.x; p < nRanks; p += gridDim.x) {
+      size_t n = min(counts[p], maxCount);
+      size_t offset = displs ? displs[p] : packedOffset(counts, sizeof(size_t), p);
+      char* slot = dst + p*slotBytes;
+      if (threadIdx.x == 0) *reinterpret_cast<uint64_t*>(slot) = n;
+      copyBytes(slot + NCCL_ALLTOALLV_HEADER_BYTES, src + offset*eltSize, n*eltSize);
+    }
+  }
+
+  __global__ __launch_bounds__(AllToAllvThreads, 1)
+  void allToAllvUnpackKernel(char* dst, size_t* counts, size_t const* displs, char const* src,
+      size_t eltSize, size_t slotBytes, int nRanks) {
+    for (int p = blockIdx.x; p < nRanks; p += gridDim.x) {
+      char const* slot = src + p*slotBytes;
+      size_t n = *reinterpret_cast<uint64_t const*>(slot);
+      // Received counts sit in the slot headers, one slot apart
+      size_t offset = displs ? displs[p] : packedOffset(reinterpret_cast<size_t const*>(src), slotBytes, p);
+      if (counts && threadIdx.x == 0) counts[p] = n;
+      copyBytes(dst + offset*eltSize, slot + NCCL_ALLTOALLV_HEADER_BYTES, n*eltSize);
+    }
+  }
+}
+
+ncclResult_t ncclLaunchAllToAllvPack(void* dst, void const* src, size_t const* counts, size_t const* displs, size_t maxCount,
+    size_t eltSize, size_t slotBytes, int nRanks, cudaStream_t stream) {
+  dim3 grid = {(unsigned)std::min(nRanks, 1024), 1, 1};
+  dim3 block = {AllToAllvThreads, 1, 1};
+  void* args[8] = {&dst, &src, &counts, &displs, &maxCount, &eltSize, &slotBytes, &nRanks};
+  CUDACHECK(cudaLaunchKernel((void const*)&allToAllvPackKernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLaunchAllToAllvUnpack(void* dst, size_t* counts, size_t const* displs, void const* src,
+    size_t eltSize, size_t slotBytes, int nRanks, cudaStream_t stream) {
+  dim3 grid = {(unsigned)std::min(nRanks, 1024), 1, 1};
+  dim3 block = {AllToAllvThreads, 1, 1};
+  void* args[7] = {&dst, &counts, &displs, &src, &eltSize, &slotBytes, &nRanks};
+  CUDACHECK(cudaLaunchKernel((void const*)&allToAllvUnpackKernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+}
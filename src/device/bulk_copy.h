@@ -0,0 +1,88 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_BULK_COPY_H_
+#define NCCL_BULK_COPY_H_
+
+#include "common.h"
+
+#if defined(NCCL_BULK_COPY) && __CUDA_ARCH__ >= 900 && CUDART_VERSION >= 12000
+// Bytes of a copy below which the threads moving data through registers are as fast
+#define NCCL_BULK_COPY_MIN_BYTES (16 << 10)
+
+__device__ __forceinline__ uint32_t bulkSmemAddr(void* ptr) {
+  return (uint32_t)__cvta_generic_to_shared(ptr);
+}
+
+__device__ __forceinline__ void bulkWaitParity(uint32_t mbar, uint32_t parity) {
+  uint32_t done;
+  do {
+    asm volatile("{ .reg .pred p; mbarrier.try_wait.parity.shared::cta.b64 p, [%1], %2; selp.u32 %0, 1, 0, p; }"
+        : "=r"(done) : "r"(mbar), "r"(parity) : "memory");
+  } while (!done);
+}
+
+// Each warp moves its share of the bytes through its scratch, one lane issuing the copies of the
+// tensor memory accelerator. Stages alternate so that the load of a stage overlaps the store of the
+// other. Returns false, for all threads, when the pointers or the size do not fit bulk copies.
+template<typename IntBytes>
+__device__ __forceinline__ bool bulkCopy(int thread, int nThreads, void const* src, void* dst, IntBytes nBytes) {
+  if (nBytes < NCCL_BULK_COPY_MIN_BYTES || nBytes % 16 != 0) return false;
+  if ((cvta_to_global(src) | cvta_to_global(dst)) % 16 != 0) return false;
+
+  int lane = thread%WARP_SIZE;
+  int nWarps = nThreads/WARP_SIZE;
+  int warp = thread/WARP_SIZE;
+  if (warp >= nWarps) return true;
+  IntBytes share = alignUp(divUp(nBytes, nWarps), 16);
+  IntBytes begin = min(nBytes, warp*share);
+  IntBytes end = min(nBytes, begin + share);
+
+  // Two mbarriers in the first 16 bytes of the scratch, the stages after them
+  char* scratch = (char*)ncclScratchForWarp(threadIdx.x/WARP_SIZE);
+  uint32_t mbar = bulkSmemAddr(scratch);
+  uint32_t stages = bulkSmemAddr(scratch + 16);
+  if (lane == 0 && begin < end) {
+    // The data was written through the generic proxy, the bulk copies read it through the async one
+    asm volatile("fence.proxy.async.global;" ::: "memory");
+    for (int s = 0; s < NCCL_BULK_COPY_STAGES; s++) {
+      asm volatile("mbarrier.init.shared::cta.b64 [%0], 1;" :: "r"(mbar + 8*s) : "memory");
+    }
+    asm volatile("fence.mbarrier_init.release.cluster;" ::: "memory");
+    uint32_t phases = 0;
+    int s = 0;
+    for (IntBytes o = begin; o < end; o += NCCL_BULK_COPY_STAGE_BYTES) {
+      uint32_t bytes = (uint32_t)min((IntBytes)NCCL_BULK_COPY_STAGE_BYTES, end - o);
+      uint32_t stage = stages + s*NCCL_BULK_COPY_STAGE_BYTES;
+      // The store of the stage issued NCCL_BULK_COPY_STAGES copies ago has to be done reading it
+      asm volatile("cp.async.bulk.wait_group.read %0;" :: "n"(NCCL_BULK_COPY_STAGES-1) : "memory");
+      asm volatile("mbarrier.arrive.expect_tx.shared::cta.b64 _, [%0], %1;" :: "r"(mbar + 8*s), "r"(bytes) : "memory");
+      asm volatile("cp.async.bulk.shared::cluster.global.mbarrier::complete_tx::bytes [%0], [%1], %2, [%3];"
+          :: "r"(stage), "l"((char const*)src + o), "r"(bytes), "r"(mbar + 8*s) : "memory");
+      bulkWaitParity(mbar + 8*s, (phases >> s) & 1);
+      phases ^= 1u << s;
+      asm volatile("cp.async.bulk.global.shared::cta.bulk_group [%0], [%1], %2;"
+          :: "l"((char*)dst + o), "r"(stage), "r"(bytes) : "memory");
+      asm volatile("cp.async.bulk.commit_group;" ::: "memory");
+      s = (s+1)%NCCL_BULK_COPY_STAGES;
+    }
+    // The writes have to be done before the barrier the caller posts the data after
+    asm volatile("cp.async.bulk.wait_group 0;" ::: "memory");
+    asm volatile("fence.proxy.async.global;" ::: "memory");
+    for (int s = 0; s < NCCL_BULK_COPY_STAGES; s++) {
+      asm volatile("mbarrier.inval.shared::cta.b64 [%0];" :: "r"(mbar + 8*s) : "memory");
+    }
+  }
+  __syncwarp();
+  return true;
+}
+#else
+template<typename IntBytes>
+__device__ __forceinline__ bool bulkCopy(int thread, int nThreads, void const* src, void* dst, IntBytes nBytes) {
+  return false;
+}
+#endif
+
+#endif
@@ -183,6 +183,12 @@ __device__ __forceinline__ void loadWorkBatchToShmem(
       packInWork = tid%(workSize/16);
       dstWork = tid/(workSize/16);
       break;
+    case (int)ncclDevWorkTypeP2pStrided:
+      workSize = sizeof(struct ncclDevWorkP2pStrided);
+      nPacks = nWorks*(workSize/16);
+      packInWork = tid%(workSize/16);
+      dstWork = tid/(workSize/16);
+      break;
     case (int)ncclDevWorkTypeColl:
       workSize = sizeof(struct ncclDevWorkColl);
       nPacks = nWorks*(workSize/16);
@@ -309,6 +315,21 @@ struct RunWorkBatch {
   }
 };
 
+// Tell the progress thread to post the proxy ops of the plan, waiting for room in the ring
+__device__ __forceinline__ void ncclRingProxyReplay(uint32_t replayId) {
+  struct ncclProxyReplayRing* ring = ncclShmem.comm.replayRing;
+  uint64_t seq = atomicAdd(ncclShmem.comm.replaySeq, 1ull);
+  int spins = 0;
+  while (seq - *(volatile uint64_t*)&ring->consumed >= NCCL_PROXY_REPLAY_RING) {
+    if (++spins == 1000000) {
+      if (*ncclShmem.comm.abortFlag) return;
+      spins = 0;
+    }
+  }
+  *(volatile uint64_t*)&ring->slots[seq % NCCL_PROXY_REPLAY_RING] = ((seq+1) << 32) | replayId;
+  __threadfence_system();
+}
+
 template<int SpecializedFnId, typename SpecializedRunWorkBatch>
 __device__ __forceinline__ void ncclKernelMain(struct ncclDevKernelArgs const* args) {
   int tid = threadIdx.x;
@@ -360,6 +381,8 @@ __device__ __forceinline__ void ncclKernelMain(struct ncclDevKernelArgs const* a
   }
   __syncthreads(); // publish ncclShmem
 
+  if (tid == 0 && blockIdx.x == 0 && ncclShmem.args.replayId != 0) ncclRingProxyReplay(ncclShmem.args.replayId);
+
   if (tid == 0 && ncclShmem.args.workStorageType == ncclDevWorkStorageTypeFifo) {
     // ncclShmem.workConsumed written by loadWorkBatchToShmem before __syncthreads()
     ncclShmem.comm.workConsumed[ncclShmem.channelId] = ncclShmem.workConsumed;
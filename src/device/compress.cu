@@ -0,0 +1,150 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#include <cuda_bf16.h>
+#endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+#include <cuda_fp8.h>
+#endif
+
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+namespace {
+  // Largest finite value of fp8 e4m3
+  constexpr float Fp8E4M3Max = 448.0f;
+  constexpr int CompressThreads = 256;
+
+  __device__ __forceinline__ float toFloat(float x) { return x; }
+  __device__ __forceinline__ float toFloat(half x) { return __half2float(x); }
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  __device__ __forceinline__ float toFloat(__nv_bfloat16 x) { return __bfloat162float(x); }
+#endif
+
+  template<typename T> __device__ __forceinline__ T fromFloat(float x);
+  template<> __device__ __forceinline__ float fromFloat<float>(float x) { return x; }
+  template<> __device__ __forceinline__ half fromFloat<half>(float x) { return __float2half(x); }
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> __device__ __forceinline__ __nv_bfloat16 fromFloat<__nv_bfloat16>(float x) { return __float2bfloat16(x); }
+#endif
+
+  __device__ __forceinline__ float decode(uint8_t const* chunk, size_t nElts, size_t i) {
+    __nv_fp8_e4m3 q;
+    q.__x = chunk[i];
+    float scale = reinterpret_cast<float const*>(chunk + alignUp(nElts, 16))[i/NCCL_COMPRESS_BLOCK];
+    return float(q)*scale;
+  }
+
+  // Each warp scales one block of elements so that its largest magnitude maps to the largest fp8 value
+  template<typename T>
+  __global__ __launch_bounds__(CompressThreads, 1)
+  void compressKernel(uint8_t* dst, T const* src, size_t nElts, int nChunks) {
+    constexpr int EltPerLane = NCCL_COMPRESS_BLOCK/WARP_SIZE;
+    int lane = threadIdx.x%WARP_SIZE;
+    size_t nGroups = divUp(nElts, NCCL_COMPRESS_BLOCK);
+    size_t chunkBytes = ncclCompressedBytes(nElts);
+    size_t warp = (blockIdx.x*(size_t)blockDim.x + threadIdx.x)/WARP_SIZE;
+    size_t nWarps = gridDim.x*(size_t)blockDim.x/WARP_SIZE;
+    for (size_t g = warp; g < nGroups*nChunks; g += nWarps) {
+      size_t c = g/nGroups;
+      size_t i0 = (g%nGroups)*NCCL_COMPRESS_BLOCK;
+      T const* in = src + c*nElts;
+      uint8_t* out = dst + c*chunkBytes;
+      float v[EltPerLane];
+      float amax = 0.0f;
+      #pragma unroll
+      for (int k = 0; k < EltPerLane; k++) {
+        size_t i = i0 + k*WARP_SIZE + lane;
+        v[k] = i < nElts ? toFloat(in[i]) : 0.0f;
+        amax = fmaxf(amax, fabsf(v[k]));
+      }
+      #pragma unroll
+      for (int offset = WARP_SIZE/2; offset > 0; offset /= 2) {
+        amax = fmaxf(amax, __shfl_xor_sync(0xffffffff, amax, offset));
+      }
+      float scale = amax > 0.0f ? amax/Fp8E4M3Max : 1.0f;
+      #pragma unroll
+      for (int k = 0; k < EltPerLane; k++) {
+        size_t i = i0 + k*WARP_SIZE + lane;
+        if (i < nElts) out[i] = __nv_fp8_e4m3(v[k]/scale).__x;
+      }
+      if (lane == 0) reinterpret_cast<float*>(out + alignUp(nElts, 16))[g%nGroups] = scale;
+    }
+  }
+
+  // Chunks are summed in order, so every rank gets the same bits for the same inputs
+  template<typename T>
+  __global__ __launch_bounds__(CompressThreads, 1)
+  void decompressKernel(T* dst, uint8_t const* src, size_t nElts, int nChunks, bool reduce, float scale) {
+    size_t chunkBytes = ncclCompressedBytes(nElts);
+    size_t nOut = reduce ? nElts : nElts*nChunks;
+    for (size_t j = blockIdx.x*(size_t)blockDim.x + threadIdx.x; j < nOut; j += gridDim.x*(size_t)blockDim.x) {
+      if (reduce) {
+        float sum = 0.0f;
+        for (int c = 0; c < nChunks; c++) sum += decode(src + c*chunkBytes, nElts, j);
+        dst[j] = fromFloat<T>(sum*scale);
+      } else {
+        dst[j] = fromFloat<T>(decode(src + (j/nElts)*chunkBytes, nElts, j%nElts));
+      }
+    }
+  }
+
+  ncclResult_t compressKernels(ncclDataType_t type, void const** compress, void const** decompress) {
+    switch (type) {
+    case ncclFloat16:
+      *compress = (void const*)&compressKernel<half>;
+      *decompress = (void const*)&decompressKernel<half>;
+      break;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16:
+      *compress = (void const*)&compressKernel<__nv_bfloat16>;
+      *decompress = (void const*)&decompressKernel<__nv_bfloat16>;
+      break;
+#endif
+    case ncclFloat32:
+      *compress = (void const*)&compressKernel<float>;
+      *decompress = (void const*)&decompressKernel<float>;
+      break;
+    default: return ncclInvalidArgument;
+    }
+    return ncclSuccess;
+  }
+}
+#endif
+
+ncclResult_t ncclLaunchCompress(void* dst, void const* src, size_t nElts, int nChunks, ncclDataType_t type, cudaStream_t stream) {
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  void const* kernel;
+  void const* unused;
+  NCCLCHECK(compressKernels(type, &kernel, &unused));
+  size_t nGroups = divUp(nElts, NCCL_COMPRESS_BLOCK)*nChunks;
+  dim3 grid = {(unsigned)std::min<size_t>(1024, divUp(nGroups, CompressThreads/WARP_SIZE)), 1, 1};
+  dim3 block = {CompressThreads, 1, 1};
+  void* args[4] = {&dst, &src, &nElts, &nChunks};
+  CUDACHECK(cudaLaunchKernel(kernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t ncclLaunchDecompress(void* dst, void const* src, size_t nElts, int nChunks, bool reduce, float scale, ncclDataType_t type, cudaStream_t stream) {
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  void const* unused;
+  void const* kernel;
+  NCCLCHECK(compressKernels(type, &unused, &kernel));
+  size_t nOut = reduce ? nElts : nElts*nChunks;
+  dim3 grid = {(unsigned)std::min<size_t>(1024, divUp(nOut, CompressThreads)), 1, 1};
+  dim3 block = {CompressThreads, 1, 1};
+  void* args[6] = {&dst, &src, &nElts, &nChunks, &reduce, &scale};
+  CUDACHECK(cudaLaunchKernel(kernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+#else
+  return ncclInvalidUsage;
+#endif
+}
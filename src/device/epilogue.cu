@@ -0,0 +1,76 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include <cuda_runtime.h>
+#include <cuda_fp16.h>
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#include <cuda_bf16.h>
+#endif
+
+namespace {
+  constexpr int EpilogueThreads = 256;
+
+  __device__ __forceinline__ float toFloat(float x) { return x; }
+  __device__ __forceinline__ float toFloat(half x) { return __half2float(x); }
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  __device__ __forceinline__ float toFloat(__nv_bfloat16 x) { return __bfloat162float(x); }
+#endif
+
+  template<typename T> __device__ __forceinline__ T fromFloat(float x);
+  template<> __device__ __forceinline__ float fromFloat<float>(float x) { return x; }
+  template<> __device__ __forceinline__ half fromFloat<half>(float x) { return __float2half(x); }
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  template<> __device__ __forceinline__ __nv_bfloat16 fromFloat<__nv_bfloat16>(float x) { return __float2bfloat16(x); }
+#endif
+
+  // Elements are read and written once each, the math is done in float
+  template<typename T, typename U>
+  __global__ __launch_bounds__(EpilogueThreads, 1)
+  void epilogueKernel(U* dst, T const* src, T const* addend, size_t nElts, float scale) {
+    for (size_t i = blockIdx.x*(size_t)blockDim.x + threadIdx.x; i < nElts; i += gridDim.x*(size_t)blockDim.x) {
+      float x = toFloat(src[i])*scale;
+      if (addend) x += toFloat(addend[i]);
+      dst[i] = fromFloat<U>(x);
+    }
+  }
+
+  template<typename T>
+  ncclResult_t epilogueKernelTo(ncclDataType_t outType, void const** kernel) {
+    switch (outType) {
+    case ncclFloat16: *kernel = (void const*)&epilogueKernel<T, half>; break;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16: *kernel = (void const*)&epilogueKernel<T, __nv_bfloat16>; break;
+#endif
+    case ncclFloat32: *kernel = (void const*)&epilogueKernel<T, float>; break;
+    default: return ncclInvalidArgument;
+    }
+    return ncclSuccess;
+  }
+
+  ncclResult_t epilogueKernelFor(ncclDataType_t type, ncclDataType_t outType, void const** kernel) {
+    switch (type) {
+    case ncclFloat16: return epilogueKernelTo<half>(outType, kernel);
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16: return epilogueKernelTo<__nv_bfloat16>(outType, kernel);
+#endif
+    case ncclFloat32: return epilogueKernelTo<float>(outType, kernel);
+    default: return ncclInvalidArgument;
+    }
+  }
+}
+
+ncclResult_t ncclLaunchEpilogue(void* dst, ncclDataType_t outType, void const* src, void const* addend, size_t nElts,
+    float scale, ncclDataType_t type, cudaStream_t stream) {
+  void const* kernel;
+  NCCLCHECK(epilogueKernelFor(type, outType, &kernel));
+  if (nElts == 0) return ncclSuccess;
+  dim3 grid = {(unsigned)std::min<size_t>(1024, divUp(nElts, EpilogueThreads)), 1, 1};
+  dim3 block = {EpilogueThreads, 1, 1};
+  void* args[5] = {&dst, &src, &addend, &nElts, &scale};
+  CUDACHECK(cudaLaunchKernel(kernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+}
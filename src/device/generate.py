@@ -308,6 +308,15 @@ with open(os.path.join(gensrc, "host_table.cc"), "w") as f:
     out("/*%4d*/ %s,\n" % (index, specialized))
     index += 1
   out("0};\n")
+  out("\n")
+
+  # Maps primary id to the index of its kernel in ncclDevKernelList.
+  out("extern int const ncclDevKernelIdForFunc[] = {\n")
+  index = 0
+  for fn in primary_funcs:
+    out("/*%4d*/ %d,\n" % (index, kernel_funcs.index(best_kernel(*fn))))
+    index += 1
+  out("-1};\n")
 
 # Maps to .cu filename which implements this func. The only constraint is that
 # "coll" is reflected in the name: formally that no two funcs having different
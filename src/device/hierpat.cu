@@ -0,0 +1,63 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include "common_kernel.h"
+#include <cuda_runtime.h>
+
+namespace {
+  constexpr int ReduceSlotsThreads = 512;
+
+  template<typename RedOp>
+  __global__ __launch_bounds__(ReduceSlotsThreads, 1)
+  void reduceSlotsKernel(typename RedOp::EltType* dst, char const* src, size_t nElts, size_t slotBytes, int nSlots, uint64_t redOpArg) {
+    using T = typename RedOp::EltType;
+    RedOp fn(redOpArg);
+    for (size_t i = blockIdx.x*(size_t)blockDim.x + threadIdx.x; i < nElts; i += gridDim.x*(size_t)blockDim.x) {
+      // Slots are reduced in order, so that every rank gets the same bits
+      T acc = reinterpret_cast<T const*>(src)[i];
+      for (int s = 1; s < nSlots; s++) acc = applyReduce(fn, acc, reinterpret_cast<T const*>(src + s*slotBytes)[i]);
+      dst[i] = acc;
+    }
+  }
+
+  template<typename T>
+  ncclResult_t reduceSlotsKernelFor(ncclDevRedOp_t op, void const** kernel) {
+    switch (op) {
+    case ncclDevSum:    *kernel = (void const*)&reduceSlotsKernel<FuncSum<T>>; break;
+    case ncclDevProd:   *kernel = (void const*)&reduceSlotsKernel<FuncProd<T>>; break;
+    case ncclDevMinMax: *kernel = (void const*)&reduceSlotsKernel<FuncMinMax<T>>; break;
+    default: return ncclInvalidArgument;
+    }
+    return ncclSuccess;
+  }
+}
+
+ncclResult_t ncclLaunchReduceSlots(void* dst, void const* src, size_t nElts, size_t slotBytes, int nSlots,
+    struct ncclDevRedOpFull redOp, ncclDataType_t type, cudaStream_t stream) {
+  void const* kernel;
+  switch (type) {
+  case ncclInt8:     NCCLCHECK(reduceSlotsKernelFor<int8_t>(redOp.op, &kernel)); break;
+  case ncclUint8:    NCCLCHECK(reduceSlotsKernelFor<uint8_t>(redOp.op, &kernel)); break;
+  case ncclInt32:    NCCLCHECK(reduceSlotsKernelFor<int32_t>(redOp.op, &kernel)); break;
+  case ncclUint32:   NCCLCHECK(reduceSlotsKernelFor<uint32_t>(redOp.op, &kernel)); break;
+  case ncclInt64:    NCCLCHECK(reduceSlotsKernelFor<int64_t>(redOp.op, &kernel)); break;
+  case ncclUint64:   NCCLCHECK(reduceSlotsKernelFor<uint64_t>(redOp.op, &kernel)); break;
+  case ncclFloat16:  NCCLCHECK(reduceSlotsKernelFor<half>(redOp.op, &kernel)); break;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16: NCCLCHECK(reduceSlotsKernelFor<__nv_bfloat16>(redOp.op, &kernel)); break;
+#endif
+  case ncclFloat32:  NCCLCHECK(reduceSlotsKernelFor<float>(redOp.op, &kernel)); break;
+  case ncclFloat64:  NCCLCHECK(reduceSlotsKernelFor<double>(redOp.op, &kernel)); break;
+  default: return ncclInvalidArgument;
+  }
+  if (nElts == 0) return ncclSuccess;
+  dim3 grid = {(unsigned)std::min<size_t>(1024, divUp(nElts, ReduceSlotsThreads)), 1, 1};
+  dim3 block = {ReduceSlotsThreads, 1, 1};
+  void* args[6] = {&dst, &src, &nElts, &slotBytes, &nSlots, &redOp.scalarArg};
+  CUDACHECK(cudaLaunchKernel(kernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+}
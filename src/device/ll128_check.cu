@@ -0,0 +1,68 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include "op128.h"
+#include <cuda_runtime.h>
+
+namespace {
+  // Lines are written and read like LL128 does: 8 threads move 16 bytes each, the last 8 bytes
+  // of a line are the flag. Every word of round r holds r.
+  constexpr int Ll128CheckThreads = 256;
+  constexpr int Ll128CheckBlocks = 8;
+  constexpr int Ll128CheckMaxSweeps = 1 << 20;
+  constexpr long long Ll128CheckGoSpins = 1ll << 20;
+
+  __global__ __launch_bounds__(Ll128CheckThreads, 1)
+  void ll128CheckWriterKernel(uint64_t* lines, int nIters, volatile int* go) {
+    // Start once the reader polls, so that it sees the lines change
+    if (threadIdx.x == 0) {
+      for (long long s = 0; *go == 0 && s < Ll128CheckGoSpins; s++);
+    }
+    __syncthreads();
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    uint64_t* ptr = lines + (tid/8)*16 + (tid%8)*2;
+    for (uint64_t r = 1; r <= (uint64_t)nIters; r++) store128(ptr, r, r);
+  }
+
+  __global__ __launch_bounds__(Ll128CheckThreads, 1)
+  void ll128CheckReaderKernel(uint64_t* lines, int nIters, volatile int* go, unsigned long long* counters) {
+    if (blockIdx.x == 0 && threadIdx.x == 0) {
+      *go = 1;
+      __threadfence_system();
+    }
+    int tid = blockIdx.x*blockDim.x + threadIdx.x;
+    uint64_t* ptr = lines + (tid/8)*16 + (tid%8)*2;
+    unsigned long long torn = 0, partial = 0;
+    for (int s = 0; s < Ll128CheckMaxSweeps; s++) {
+      uint64_t v0, v1;
+      load128(ptr, v0, v1);
+      uint64_t flag = __shfl_sync(0xffffffff, v1, 7, 8);
+      // Data older than the flag of its line is what LL128 cannot survive
+      if (v0 < flag || v1 < flag) torn++;
+      if (tid%8 == 0 && flag != 0 && flag != (uint64_t)nIters) partial++;
+      if (__all_sync(0xffffffff, flag == (uint64_t)nIters)) break;
+    }
+    if (torn) atomicAdd(counters+0, torn);
+    if (partial) atomicAdd(counters+1, partial);
+  }
+}
+
+int ncclLl128CheckLines() {
+  return Ll128CheckBlocks*Ll128CheckThreads/8;
+}
+
+ncclResult_t ncclLaunchLl128CheckWriter(uint64_t* lines, int nIters, volatile int* go, cudaStream_t stream) {
+  void* args[3] = {&lines, &nIters, &go};
+  CUDACHECK(cudaLaunchKernel((void const*)&ll128CheckWriterKernel, dim3(Ll128CheckBlocks), dim3(Ll128CheckThreads), args, 0, stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLaunchLl128CheckReader(uint64_t* lines, int nIters, volatile int* go, unsigned long long* counters, cudaStream_t stream) {
+  void* args[4] = {&lines, &nIters, &go, &counters};
+  CUDACHECK(cudaLaunchKernel((void const*)&ll128CheckReaderKernel, dim3(Ll128CheckBlocks), dim3(Ll128CheckThreads), args, 0, stream));
+  return ncclSuccess;
+}
@@ -17,15 +17,143 @@
 
 __shared__ struct mscclShmemData mscclShmem;
 
-#define MSCCL_MAX_ITER 65536
 #define DEBUG_PRINT 0
 
-// flags are a 3-tuple of (workindex, gridoffset_iter, step) and it follows a lexicographical order. a threadblock is ahead of another iff its flag is ahead
-#define COMPUTE_FLAG(__WORKINDEX__,__GRIDOFFSET_ITER__,__STEP__) \
-  MSCCL_MAX_ITER*MSCCL_MAX_NUM_STEPS*(uint64_t)__WORKINDEX__ + ((uint64_t)__GRIDOFFSET_ITER__ * MSCCL_MAX_NUM_STEPS + (uint64_t)__STEP__)
+// flags are a 2-tuple of (gridoffset_iter, step) past the base of the work, and they follow a lexicographical order.
+// a threadblock is ahead of another iff its flag is ahead. works take the flags of all their iterations, so flags
+// only grow from a work to the next, and from a launch to the next through mscclSyncEpoch.
+#define COMPUTE_FLAG(__BASE__,__GRIDOFFSET_ITER__,__STEP__) \
+  ((uint64_t)(__BASE__) + (uint64_t)(__GRIDOFFSET_ITER__) * MSCCL_MAX_NUM_STEPS + (uint64_t)(__STEP__) + 1)
 
-#define GET_WORKINDEX_FROM_FLAG(__FLAG__) \
-  (__FLAG__) / (MSCCL_MAX_ITER*MSCCL_MAX_NUM_STEPS)
+// Waiters on a dependency spin this many times before backing off with nanosleep
+#define MSCCL_DEP_SPINS 128
+#define MSCCL_DEP_MIN_SLEEP 32
+#define MSCCL_DEP_MAX_SLEEP 1024
+// and check for an abort or a timeout every this many polls, about 1ms once backed off
+#define MSCCL_DEP_CHECK_SPINS 1024
+
+// Copy of the flag of the thread block in its shared memory. Thread blocks of the same cluster on
+// sm90 poll it through distributed shared memory instead of the global flag, which stays set for
+// the others. It starts at 0 in every launch, below the flags of any work.
+__shared__ uint64_t mscclClusterFlag;
+
+// Thread blocks in the cluster of this one, 1 unless launched with clusters
+__device__ __forceinline__ static int mscclClusterSize() {
+#if __CUDA_ARCH__ >= 900
+  uint32_t size;
+  asm volatile("mov.u32 %0, %%cluster_nctarank;" : "=r"(size));
+  return size;
+#else
+  return 1;
+#endif
+}
+
+// All threads of the cluster, the shared memory of a thread block is only read between two of them
+__device__ __forceinline__ static void mscclClusterBarrier() {
+#if __CUDA_ARCH__ >= 900
+  asm volatile("barrier.cluster.arrive.release;\n\tbarrier.cluster.wait.acquire;" ::: "memory");
+#endif
+}
+
+// Thread blocks of a kernel only synchronize with each other, so flags are gpu scoped. The flag
+// is set after the barrier ending the transmission, its release covers the writes of the block.
+__device__ __forceinline__ static void mscclSetFlag(volatile struct mscclFlag* flag, uint64_t value, bool needsFence) {
+  uint64_t* ptr = (uint64_t*)&flag->flag;
+  if (needsFence) {
+    st_release_gpu_global(ptr, value);
+  } else {
+    st_relaxed_gpu_global(ptr, value);
+  }
+#if __CUDA_ARCH__ >= 900
+  // waiters of the cluster are ordered by the cluster scoped release of the copy
+  uint32_t addr = (uint32_t)__cvta_generic_to_shared(&mscclClusterFlag);
+  if (needsFence) {
+    asm volatile("st.release.cluster.shared::cta.u64 [%0], %1;" :: "r"(addr), "l"(value) : "memory");
+  } else {
+    asm volatile("st.relaxed.cluster.shared::cta.u64 [%0], %1;" :: "r"(addr), "l"(value) : "memory");
+  }
+#endif
+}
+
+// Flag of the thread block of rank clusterRank in the cluster, from its shared memory
+__device__ __forceinline__ static uint64_t mscclLoadClusterFlag(int clusterRank) {
+#if __CUDA_ARCH__ >= 900
+  uint32_t addr = (uint32_t)__cvta_generic_to_shared(&mscclClusterFlag);
+  uint32_t remote;
+  uint64_t value;
+  asm volatile("mapa.shared::cluster.u32 %0, %1, %2;" : "=r"(remote) : "r"(addr), "r"(clusterRank));
+  asm volatile("ld.relaxed.cluster.shared::cluster.u64 %0, [%1];" : "=l"(value) : "r"(remote) : "memory");
+  return value;
+#else
+  return 0;
+#endif
+}
+
+#define MSCCL_WAIT_DONE 0
+#define MSCCL_WAIT_ABORTED 1
+#define MSCCL_WAIT_TIMED_OUT 2
+
+// Wait for the dependent thread block to reach goalFlag, it may already be in a later work of the launch.
+// Backing off leaves the issue slots of the SM to the warps moving data. The wait is given up when the
+// communicator is aborted, another wait of the block was given up, or after mscclShmem.work.waitTimeout cycles.
+// The flag is read from the shared memory of the thread block of rank clusterRank of the cluster when it is not -1.
+__device__ __forceinline__ static int mscclWaitFlag(volatile struct mscclFlag* flag, uint64_t goalFlag, bool needsFence, uint64_t* lastFlag,
+    int clusterRank = -1) {
+  uint64_t* ptr = (uint64_t*)&flag->flag;
+  int spins = 0;
+  int checks = 0;
+  unsigned int sleepNs = MSCCL_DEP_MIN_SLEEP;
+  const uint64_t timeout = mscclShmem.work.waitTimeout;
+  uint64_t start = 0;
+  while ((*lastFlag = clusterRank >= 0 ? mscclLoadClusterFlag(clusterRank) : ld_relaxed_gpu_global(ptr)) < goalFlag) {
+#if __CUDA_ARCH__ >= 700
+    if (++spins > MSCCL_DEP_SPINS) {
+      __nanosleep(sleepNs);
+      sleepNs = min(2 * sleepNs, (unsigned int)MSCCL_DEP_MAX_SLEEP);
+    }
+#endif
+    if (++checks == MSCCL_DEP_CHECK_SPINS) {
+      checks = 0;
+      if (*(volatile int*)&ncclShmem.aborted || *ncclShmem.comm.abortFlag) {
+        ncclShmem.aborted = 1;
+        return MSCCL_WAIT_ABORTED;
+      }
+      if (timeout != 0) {
+        if (start == 0) start = clock64();
+        else if (clock64() - start > timeout) {
+          ncclShmem.aborted = 1;
+          return MSCCL_WAIT_TIMED_OUT;
+        }
+      }
+    }
+  }
+  // pairs with the release of mscclSetFlag, a single fence instead of an acquire per poll
+  if (needsFence) {
+#if __CUDA_ARCH__ >= 900
+    if (clusterRank >= 0) {
+      asm volatile("fence.acq_rel.cluster;" ::: "memory");
+      return MSCCL_WAIT_DONE;
+    }
+#endif
+    fence_acq_rel_gpu();
+  }
+  return MSCCL_WAIT_DONE;
+}
+
+// Only the first wait of the communicator to time out is recorded, the others follow from it
+__device__ static void mscclRecordTimeout(int bid, int step, int dependentBid, int dependentStep, uint64_t goalFlag, uint64_t flag) {
+  struct mscclWatchdog* watchdog = mscclShmem.work.watchdog;
+  if (watchdog == nullptr || atomicCAS_system(&watchdog->claimed, 0u, 1u) != 0u) return;
+  volatile struct mscclWatchdog* record = watchdog;
+  record->bid = bid;
+  record->step = step;
+  record->dependentBid = dependentBid;
+  record->dependentStep = dependentStep;
+  record->goalFlag = goalFlag;
+  record->flag = flag;
+  __threadfence_system();
+  record->timedOut = 1;
+}
 
 // a copy of the volatile load/store from prims_ll
 template<typename U>
@@ -81,77 +209,113 @@ __device__ __forceinline__ static void threadBlockCopy(
   }
 }
 
-template<typename T, typename RedOp, typename Proto>
-__device__ __forceinline__ void mscclRunInterpreter(
-  struct ncclDevComm* comm, struct mscclAlgo* algo, struct mscclWork work) {
-  const int tid = threadIdx.x;
-  const int bid = blockIdx.x;
-  const int nthreads = blockDim.x;
+// Where chunk j of a buffer starts, see mscclWork. Scratch chunks are never split in blocks.
+struct mscclChunkLayout {
+  ssize_t chunkSize;
+  ssize_t blockStride;
+  int chunksPerBlock;
+  __device__ __forceinline__ ssize_t offset(int j) const {
+    return (ssize_t)(j / chunksPerBlock) * blockStride + (ssize_t)(j % chunksPerBlock) * chunkSize;
+  }
+};
 
-  // initialize mscclShmem.mscclTB
-  threadBlockCopy(
-    (uint64_t *)&mscclShmem.mscclTB, (uint64_t *)(algo->mscclTBs + bid),
-    sizeof(struct mscclThreadBlock)/sizeof(uint64_t), tid, nthreads);
-  __syncthreads(); // publish mscclShmem.mscclTB.channelId
+// Reduce the numReductions sources at srcBase + layout.offset(offsets[r]) into the nelem elements of
+// dst, or into nothing when copy is set. Sources go through the pre-op of preFn. Threads take 16 byte
+// packs when every pointer is aligned to 16 bytes and the elements past the last pack.
+template<typename T, typename RedOp>
+__device__ __forceinline__ static void mscclReduceSmall(RedOp redFn, RedOp preFn, T* dst, T* srcBase, const int16_t* offsets,
+    int numReductions, const struct mscclChunkLayout& layout, int nelem, bool copy, int tid, int nthreads) {
+  constexpr int EltPerPack = 16 / sizeof(T);
+  uintptr_t bits = (uintptr_t)dst;
+  for (int r = 0; r < numReductions; r++) {
+    bits |= (uintptr_t)(srcBase + layout.offset(offsets[r]));
+  }
+  const int r0 = copy ? 1 : 0;
+  int nPacks = bits % 16 == 0 ? nelem / EltPerPack : 0;
+  for (int p = tid; p < nPacks; p += nthreads) {
+    uintptr_t dstAddr = (uintptr_t)(dst + p * EltPerPack);
+    BytePack<16> o = copy ? applyPreOp(preFn, ld_volatile_global<16>((uintptr_t)(srcBase + layout.offset(offsets[0]) + p * EltPerPack)))
+                          : ld_volatile_global<16>(dstAddr);
+    for (int r = r0; r < numReductions; r++) {
+      T* src = srcBase + layout.offset(offsets[r]) + p * EltPerPack;
+      o = applyReduce(redFn, applyPreOp(preFn, ld_volatile_global<16>((uintptr_t)src)), o);
+    }
+    st_global<16>(dstAddr, o);
+  }
+  // elements past the last pack, all of them without packs
+  for (int i = nPacks * EltPerPack + tid; i < nelem; i += nthreads) {
+    T o = copy ? applyPreOp(preFn, load(srcBase + layout.offset(offsets[0]) + i)) : load(dst + i);
+    for (int r = r0; r < numReductions; r++) {
+      o = applyReduce(redFn, applyPreOp(preFn, load(srcBase + layout.offset(offsets[r]) + i)), o);
+    }
+    store(dst + i, o);
+  }
+}
 
-  // initialize ncclShmem and mscclShmem.work
-  int channelId = mscclShmem.mscclTB.channelId;
-  {
-    void *dst, *src;
-    int bytes = 0;
-    // Use first 3 warps to load comm, channel, and work into shmem
-    switch (tid/WARP_SIZE) {
-    case 0:
-      dst = &ncclShmem.comm;
-      src = comm;
-      bytes = sizeof(ncclDevComm);
-      static_assert(sizeof(ncclDevComm) <= 16 * WARP_SIZE, "ncclDevComm cannot be loaded by a single warp in one insn.");
-      break;
-    case 1:
-      // Get address of channel without incurring indirect load from ncclDevComm::channels
-      dst = &ncclShmem.channel;
-      src = &((ncclDevCommAndChannels*)comm)->channels[channelId];
-      bytes = sizeof(ncclDevChannel);
-      static_assert(sizeof(ncclDevChannel) <= 16 * WARP_SIZE, "ncclDevChannel cannot be loaded by a single warp in one insn.");
-      break;
-    case 2:
-      dst = &mscclShmem.work;
-      src = &work;
-      bytes = sizeof(mscclWork);
-      static_assert(sizeof(mscclWork) <= 16 * WARP_SIZE, "mscclWork cannot be loaded by a single warp in one insn.");
-      break;
-    case 3:
-      /* set abort flag to 0 */
-      if (tid == 3 * WARP_SIZE) ncclShmem.aborted = 0;
-      break;
-    default:
-      break;
+// Scalar of FuncPreMulSum<T> that leaves elements as they are
+template<typename T>
+__device__ __forceinline__ static uint64_t mscclPreMulIdentity() {
+  union { uint64_t u64; T val; };
+  u64 = 0;
+  val = T(1.0f);
+  return u64;
+}
+
+// Reduce the numReductions sources at srcBase + layout.offset(offsets[r]) into dst, MSCCL_REDUCE_TILE
+// sources at a time. Each tile reduces dst with its sources, so any number of them can be fused.
+template<typename T, typename Prims>
+__device__ __forceinline__ static void mscclReduceTiled(Prims& prims, T* dst, T* srcBase, const int16_t* offsets,
+    int numReductions, const struct mscclChunkLayout& layout, int nelem) {
+  for (int r0 = 0; r0 < numReductions; r0 += MSCCL_REDUCE_TILE) {
+    T* srcs[MSCCL_REDUCE_TILE+1]; // +1 is for SIMPLE protocol as dst is added in the list of srcs
+    int nsrcs = min(MSCCL_REDUCE_TILE, numReductions - r0);
+    for (int r = 0; r < nsrcs; r++) {
+      srcs[r] = srcBase + layout.offset(offsets[r0+r]);
     }
-    copyToShmem16(tid%WARP_SIZE, dst, src, bytes);
+    prims.reduce(srcs, nsrcs, &dst, 1, nelem);
   }
-  __syncthreads(); // publish shmem
+}
 
+typedef ProtoSimple<MSCCL_CHUNKSTEPS/MSCCL_SLICESTEPS, MSCCL_SLICESTEPS> mscclProtoSimple;
+
+// Elements of a chunk moved per iteration by the thread blocks of all the protocols in protocolMask
+template<typename T>
+__device__ __forceinline__ static ssize_t mscclMixedChunkSize(int protocolMask) {
+  ssize_t chunkSize = INT_MAX;
+  if (protocolMask & (1 << NCCL_PROTO_LL)) chunkSize = min(chunkSize, (ssize_t)(ProtoLL::calcBytePerStep()/sizeof(T)));
+  if (protocolMask & (1 << NCCL_PROTO_LL128)) chunkSize = min(chunkSize, (ssize_t)(ProtoLL128::calcBytePerStep()/sizeof(T)));
+  if (protocolMask & (1 << NCCL_PROTO_SIMPLE)) chunkSize = min(chunkSize, (ssize_t)(mscclProtoSimple::calcBytePerStep()/sizeof(T) * MSCCL_CHUNKSTEPS));
+  return chunkSize;
+}
+
+// Elements of a chunk moved per iteration of mscclShmem.work, the host picks those of SIMPLE
+// kernels from the size of the call and the proxy counts loops of the same size
+template<typename T, typename Proto, bool Mixed>
+__device__ __forceinline__ static ssize_t mscclChunkSize() {
+  if (Mixed) return mscclMixedChunkSize<T>(mscclShmem.work.protocolMask);
+  if (Proto::Id == NCCL_PROTO_SIMPLE) return mscclShmem.work.simpleChunkSize;
+  return int(Proto::calcBytePerStep()/sizeof(T));
+}
+
+// Run mscclShmem.work with the thread block program already in mscclShmem.mscclTB. Transmission
+// types outside of OpMask are not compiled in, the host only picks kernels covering the algorithm.
+// bid is the index of the thread block in the grid, which holds nReplicas copies of the program.
+// Primitives are built with Fan, which covers all the peers of the thread block, and PrimsProto,
+// which differs from Proto for the NVLS connections of NVLS thread blocks. Thread blocks of Mixed
+// kernels iterate with the others over chunks of the smallest protocol of the algorithm.
+// Flags of the work start past flagBase.
+template<typename T, typename RedOp, typename Proto, int OpMask, bool Mixed, typename Fan, typename PrimsProto = Proto>
+__device__ __forceinline__ void mscclRunWork(const int tid, const int bid, const int nthreads, const uint64_t flagBase) {
 #if defined(ENABLE_NPKIT)
   int npKitCtxIdx = bid;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-  if (tid == 0) {
-    uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
-    NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
-        ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
-  }
-#endif
+  // PreMulSum, for ncclAvg and the ops of ncclRedOpCreatePreMulSum, multiplies every element read
+  // from the input buffer as its steps read it, the other buffers hold what was multiplied already
+  constexpr bool PreMul = std::is_same<RedOp, FuncPreMulSum<T>>::value;
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-  if (tid == 0) {
-    NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
-        ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
-  }
-#endif
-  
   // Deference reduce args if required
-  if (tid == 0 && mscclShmem.work.hasReduce && mscclShmem.work.redOpArgIsPtr) {
+  if (tid == 0 && (mscclShmem.work.hasReduce || PreMul) && mscclShmem.work.redOpArgIsPtr) {
     switch (sizeof(T)) {
       case 1:
         mscclShmem.work.redOpArg = *reinterpret_cast<uint8_t*>(mscclShmem.work.redOpArg);
@@ -175,10 +339,42 @@ __device__ __forceinline__ void mscclRunInterpreter(
   T* thisInput = (T*)mscclShmem.work.sendBuff;
   T* thisOutput = (T*)mscclShmem.work.recvBuff;
   T* thisScratch = (T*)mscclShmem.work.scratchBuffer;
-  int recvPeer = mscclShmem.mscclTB.recvPeer;
-  int sendPeer = mscclShmem.mscclTB.sendPeer;
+  int recvPeers[MSCCL_MAX_FAN_PEERS];
+  int sendPeers[MSCCL_MAX_FAN_PEERS];
+  for (int p = 0; p < MSCCL_MAX_FAN_PEERS; p++) {
+    recvPeers[p] = mscclShmem.mscclTB.recvPeers[p];
+    sendPeers[p] = mscclShmem.mscclTB.sendPeers[p];
+  }
+  // NVLS thread blocks use the NVLS peers of the channel: the head of this rank through the
+  // multicast buffers on connection 0, or the heads in their peers through the unicast ones on 1
+  const int nvls = mscclShmem.mscclTB.nvls;
+  int connIndex = 0;
+  int nvlsStepSize = 0;
+  if (nvls == MSCCL_NVLS_MULTIMEM) {
+    recvPeers[0] = sendPeers[0] = ncclShmem.channel.nvls.down;
+  } else if (nvls == MSCCL_NVLS_UNICAST) {
+    connIndex = 1;
+    if (recvPeers[0] >= 0) recvPeers[0] = ncclShmem.channel.nvls.up[recvPeers[0]];
+    if (sendPeers[0] >= 0) sendPeers[0] = ncclShmem.channel.nvls.up[sendPeers[0]];
+  }
+  if (nvls != MSCCL_NVLS_NONE) {
+    // NVLS buffers have steps of their own size, a primitive call moves at most one of them
+    struct ncclDevChannelPeer* nvlsPeer = ncclShmem.channel.peers[recvPeers[0] >= 0 ? recvPeers[0] : sendPeers[0]];
+    nvlsStepSize = (recvPeers[0] >= 0 ? nvlsPeer->recv[connIndex].stepSize : nvlsPeer->send[connIndex].stepSize) / sizeof(T);
+  }
+  // CollNet thread blocks are heads of a CollNet chain of NCCL: they send to the CollNet peer of the
+  // channel on connection 1 and receive the reduction of all nodes on connection 0
+  const bool collnet = (OpMask & MSCCL_OP_MASK_COLLNET) != 0 && Proto::Id == NCCL_PROTO_SIMPLE && !Mixed &&
+    mscclShmem.mscclTB.collnet;
+  int recvConnIndex = connIndex;
+  int sendConnIndex = connIndex;
+  if (collnet) {
+    recvPeers[0] = sendPeers[0] = ncclShmem.comm.nRanks;
+    recvConnIndex = 0;
+    sendConnIndex = 1;
+  }
 
-  const ssize_t chunkSize = int(Proto::calcBytePerStep()/sizeof(T) * (Proto::Id == NCCL_PROTO_SIMPLE ? MSCCL_CHUNKSTEPS : 1));
+  const ssize_t chunkSize = mscclChunkSize<T, Proto, Mixed>();
   int minChunkSize;
   if (Proto::Id == NCCL_PROTO_LL)
     minChunkSize = nthreads*(Proto::calcBytePerGrain()/sizeof(T));
@@ -188,8 +384,14 @@ __device__ __forceinline__ void mscclRunInterpreter(
   }
 
   RedOp redFn(mscclShmem.work.redOpArg);
-  Primitives<T, RedOp, FanAsymmetric<1,1>, 1, Proto, 0> prims
-    (tid, nthreads, &recvPeer, &sendPeer, thisInput, thisOutput, mscclShmem.work.redOpArg);
+  Primitives<T, RedOp, Fan, 1, PrimsProto, 0> prims
+    (tid, nthreads, recvPeers, sendPeers, thisInput, thisOutput, mscclShmem.work.redOpArg,
+     0, recvConnIndex, sendConnIndex, nullptr, false, false, nvlsStepSize);
+  // s and r marked by the host write into the destination of the receiver
+  const uint32_t* directMask = mscclShmem.mscclTB.directMask;
+  bool anyDirect = false;
+  for (int w = 0; w < MSCCL_DIRECT_MASK_WORDS; w++) anyDirect |= directMask[w] != 0;
+  if (anyDirect) prims.mscclLoadDirect();
 
 #if defined(ENABLE_NPKIT)
   if (tid == 0) {
@@ -199,139 +401,578 @@ __device__ __forceinline__ void mscclRunInterpreter(
 
   const ssize_t sizePerMscclChunk = mscclShmem.work.count / mscclShmem.work.nChunksPerLoop;
   uint32_t maxAllowedCount = mscclShmem.work.maxAllowedCount;
+  const struct mscclChunkLayout bufferLayout = {sizePerMscclChunk, (ssize_t)mscclShmem.work.blockStride, mscclShmem.work.chunksPerBlock};
+  const struct mscclChunkLayout scratchLayout = {sizePerMscclChunk, 0, INT_MAX};
 
-  // msccl flags all start out with 0. this is used as a part of the flag to make sure different work items deal with different synchronization flags
-  // this still needs more work. when we make a way around the queue, the flag might have been set to undesired values. will be fixed in subsequent versions.
-  const int64_t workIndex = mscclShmem.work.workIndex;
   volatile struct mscclFlag* mscclFlags = mscclShmem.work.syncFlags;
-  for (ssize_t gridOffset = 0, iter = 0; gridOffset < sizePerMscclChunk; gridOffset += chunkSize, iter++) {
-    ssize_t realChunkSize;
-    if (Proto::Id == NCCL_PROTO_SIMPLE) {
-      realChunkSize = min(chunkSize, sizePerMscclChunk-gridOffset);
-      realChunkSize = roundUp(realChunkSize, (nthreads-WARP_SIZE)*sizeof(uint64_t)/sizeof(T));
-    }
-    else
-      realChunkSize = min(chunkSize, divUp(sizePerMscclChunk-gridOffset, minChunkSize)*minChunkSize);
-    
-    realChunkSize = int(realChunkSize);
-    int nelem = min(realChunkSize, sizePerMscclChunk-gridOffset);
-
+  const int nSteps = mscclShmem.mscclTB.nSteps;
+  const struct mscclTransmission* streamedTransmissions = mscclShmem.mscclTB.streamedTransmissions;
+  const int16_t* dependentBids = mscclShmem.mscclTB.dependentBidPtr;
+  const int16_t* dependentSteps = mscclShmem.mscclTB.dependentStepPtr;
+  const int16_t* reductionSrcOffsets = mscclShmem.mscclTB.reductionSrcOffsetsPtr;
+  // Replicas of the program run contiguous ranges of iterations and only depend on each other
+  const int nBlocks = mscclShmem.work.nBlocks;
+  const int nReplicas = mscclShmem.work.nReplicas;
+  const int replica = bid / nBlocks;
+  volatile struct mscclFlag* replicaFlags = mscclFlags + replica * nBlocks;
+  // dependencies on thread blocks of the same cluster are waited on in distributed shared memory
+  const int clusterSize = mscclShmem.work.clusterFlags ? mscclClusterSize() : 1;
+  const ssize_t nIters = DIVUP(sizePerMscclChunk, chunkSize);
+  const ssize_t iterBegin = replica * nIters / nReplicas;
+  const ssize_t iterEnd = (replica + 1) * nIters / nReplicas;
+  // Pipelined thread blocks run the receives of an iteration in the next round, after the sends of
+  // the next iteration. Their flags only cover the steps done in the order of the program.
+  const bool pipelined = mscclShmem.mscclTB.pipelined && !anyDirect;
+  const ssize_t nRounds = iterEnd - iterBegin + (pipelined && iterEnd > iterBegin ? 1 : 0);
+  for (ssize_t round = 0; round < nRounds; round++) {
     ssize_t srcOffset, dstOffset;
     T *srcPointer, *dstPointer;
     int step = 0;
-    for (int i = 0; i < mscclShmem.mscclTB.nSteps; i++){
-      struct mscclTransmission* t = &mscclShmem.mscclTB.transmissions[i];
+    int firstRecvStep = -1;
+    for (int i = 0; i < nSteps; i++){
+      if (streamedTransmissions != nullptr && i % MSCCL_SHMEM_NUM_STEPS == 0) {
+        barrier(nthreads); // all threads are done with the previous window
+        threadBlockCopy(
+          (uint64_t *)mscclShmem.mscclTB.transmissions, (const uint64_t *)(streamedTransmissions + i),
+          min(MSCCL_SHMEM_NUM_STEPS, nSteps - i) * sizeof(struct mscclTransmission) / sizeof(uint64_t), tid, nthreads);
+        barrier(nthreads); // publish the window
+      }
+      struct mscclTransmission* t = &mscclShmem.mscclTB.transmissions[i % MSCCL_SHMEM_NUM_STEPS];
+      const bool lagged = pipelined && t->type == MSCCL_RECV;
+      const ssize_t iter = iterBegin + round - (lagged ? 1 : 0);
+      const bool active = iter >= iterBegin && iter < iterEnd;
+      if (lagged) {
+        if (firstRecvStep < 0) firstRecvStep = step;
+        // everything before this receive in its iteration is done
+        if (active && step > 0 && tid == nthreads-1) {
+          mscclSetFlag(mscclFlags + bid, (uint64_t) COMPUTE_FLAG(flagBase, iter, step - 1), mscclShmem.work.needsFence);
+        }
+      }
       // first wait if there is a dependence
       int16_t numDependencies = t->numDependencies;
       if (numDependencies > 0){
-        if (tid < numDependencies) {
+        if (active && tid < numDependencies) {
           int16_t dependentPointer = t->dependencePointer;
-          int8_t dependentBid = mscclShmem.mscclTB.dependentBid[dependentPointer+tid];
-          int16_t dependentStep = mscclShmem.mscclTB.dependentStep[dependentPointer+tid];
-          uint64_t goalFlag = COMPUTE_FLAG(workIndex, iter, dependentStep);
-          while (true){
-            uint64_t curFlag = (mscclFlags + dependentBid)->flag;
-            if (curFlag >= goalFlag && GET_WORKINDEX_FROM_FLAG(curFlag) == workIndex) break;
+          int16_t dependentBid = dependentBids[dependentPointer+tid];
+          int16_t dependentStep = dependentSteps[dependentPointer+tid];
+          uint64_t goalFlag = COMPUTE_FLAG(flagBase, iter, dependentStep);
+          uint64_t lastFlag;
+          const int producer = replica * nBlocks + dependentBid;
+          const int clusterRank = clusterSize > 1 && producer / clusterSize == bid / clusterSize ? producer % clusterSize : -1;
+          if (mscclWaitFlag(replicaFlags + dependentBid, goalFlag, mscclShmem.work.needsFence, &lastFlag, clusterRank) == MSCCL_WAIT_TIMED_OUT) {
+            mscclRecordTimeout(bid, step + numDependencies - 1, dependentBid, dependentStep, goalFlag, lastFlag);
           }
         }
         step += numDependencies-1;
         barrier(nthreads);
       }
+      // only pipelined thread blocks, which have no reductions, skip steps in the first and last rounds.
+      // Once a wait is given up the remaining steps are skipped, without setting the flags others wait on.
+      if (!active || ncclShmem.aborted) {
+        step++;
+        continue;
+      }
+
+      const ssize_t gridOffset = iter * chunkSize;
+      ssize_t realChunkSize;
+      // nelem below is the rest of the chunk, or chunkSize, for the thread blocks of all protocols
+      if (Proto::Id == NCCL_PROTO_SIMPLE) {
+        realChunkSize = min(chunkSize, sizePerMscclChunk-gridOffset);
+        realChunkSize = roundUp(realChunkSize, (nthreads-WARP_SIZE)*sizeof(uint64_t)/sizeof(T));
+      }
+      else
+        realChunkSize = min(chunkSize, divUp(sizePerMscclChunk-gridOffset, minChunkSize)*minChunkSize);
+
+      realChunkSize = int(realChunkSize);
+      int nelem = min(realChunkSize, sizePerMscclChunk-gridOffset);
 
       srcPointer = (t->srcBuffer == MSCCL_INPUT_BUFFER) ? thisInput : ((t->srcBuffer == MSCCL_OUTPUT_BUFFER) ? thisOutput : thisScratch);
       dstPointer = (t->dstBuffer == MSCCL_INPUT_BUFFER) ? thisInput : ((t->dstBuffer == MSCCL_OUTPUT_BUFFER) ? thisOutput : thisScratch);
-      prims.setDataPtrs(srcPointer, dstPointer);
+      const struct mscclChunkLayout& srcLayout = t->srcBuffer == MSCCL_SCRATCH_BUFFER ? scratchLayout : bufferLayout;
+      const struct mscclChunkLayout& dstLayout = t->dstBuffer == MSCCL_SCRATCH_BUFFER ? scratchLayout : bufferLayout;
+      const uint64_t preOpArg = !PreMul || t->srcBuffer == MSCCL_INPUT_BUFFER ? mscclShmem.work.redOpArg : mscclPreMulIdentity<T>();
+      RedOp preFn(preOpArg);
+      if (PreMul) {
+        prims.setDataPtrs(srcPointer, dstPointer, preOpArg);
+      } else {
+        prims.setDataPtrs(srcPointer, dstPointer);
+      }
+      const bool direct = (directMask[i / 32] >> (i % 32)) & 1;
+      // dstPointer as the peer process of a zero-copy r sees it, if the buffer is registered
+      T* peerDstPointer = nullptr;
+      if (direct && t->type == MSCCL_RECV) {
+        uintptr_t* rmtAddrs = t->dstBuffer == MSCCL_OUTPUT_BUFFER ? mscclShmem.work.recvBuffRmtAddrs :
+          (t->dstBuffer == MSCCL_INPUT_BUFFER ? mscclShmem.work.sendBuffRmtAddrs : mscclShmem.work.scratchRmtAddrs);
+        uintptr_t rmtOffset = t->dstBuffer == MSCCL_OUTPUT_BUFFER ? mscclShmem.work.recvBuffOffset :
+          (t->dstBuffer == MSCCL_INPUT_BUFFER ? mscclShmem.work.sendBuffOffset : mscclShmem.work.scratchOffset);
+        if (rmtAddrs != nullptr) peerDstPointer = (T*)(rmtAddrs[ncclShmem.comm.rankToLocalRank[recvPeers[0]]] + rmtOffset);
+      }
       int count = t->count;
       for (int c = 0; c < count; c += maxAllowedCount) {
-        srcOffset = gridOffset + (ssize_t) (t->srcOffset+c) * sizePerMscclChunk;
-        dstOffset = gridOffset + (ssize_t) (t->dstOffset+c) * sizePerMscclChunk;
+        // the host only joins chunks of a step when blocks are not apart
+        srcOffset = gridOffset + srcLayout.offset(t->srcOffset+c);
+        dstOffset = gridOffset + dstLayout.offset(t->dstOffset+c);
         int thisCount = min(maxAllowedCount, count - c);
         int thisNelem = nelem * thisCount;
-        if (t->type == MSCCL_SEND)
-          prims.sendWithBarrier(srcOffset, thisNelem); // LL.send is the only situation where there is no barrier at the end.
-        else if (t->type == MSCCL_RECV){
-          prims.recv(dstOffset, thisNelem);
+        if ((OpMask & MSCCL_OP_MASK_COLLNET) != 0 && collnet) {
+          // a step of the CollNet buffers per primitive call, the proxy counts MSCCL_CHUNKSTEPS of them
+          // per call even when the chunk is shorter
+          const int collnetStepSize = PrimsProto::calcBytePerStep()/sizeof(T);
+          if (t->type != MSCCL_COLLNET_ALLREDUCE) return;
+          for (int k = 0; k < MSCCL_CHUNKSTEPS; k++)
+            prims.send(srcOffset + k*collnetStepSize, min(collnetStepSize, thisNelem - k*collnetStepSize));
+          for (int k = 0; k < MSCCL_CHUNKSTEPS; k++)
+            prims.recv(dstOffset + k*collnetStepSize, min(collnetStepSize, thisNelem - k*collnetStepSize));
+        }
+        else if ((OpMask & MSCCL_OP_MASK_NVLS) != 0 && nvls != MSCCL_NVLS_NONE) {
+          for (int o = 0; o < thisNelem; o += nvlsStepSize) {
+            int n = min(nvlsStepSize, thisNelem - o);
+            // the multicast primitives ld_reduce what they receive and st what they send
+            if (t->type == MSCCL_SEND || t->type == MSCCL_MULTIMEM_ST)
+              prims.send(srcOffset + o, n);
+            else if (t->type == MSCCL_RECV || t->type == MSCCL_MULTIMEM_LD_REDUCE)
+              prims.recv(dstOffset + o, n);
+            else
+              return;
+          }
         }
-        else if (t->type == MSCCL_REDUCE) {
+        else if (MSCCL_OP_IN(OpMask, MSCCL_SEND) && t->type == MSCCL_SEND) {
+          // both ends of a zero-copy pair split it in the same pieces and exchange a pointer for each
+          if (direct && prims.mscclDirectSendAccept())
+            prims.mscclDirectSend(srcOffset, thisNelem);
+          else
+            prims.sendWithBarrier(srcOffset, thisNelem); // LL.send is the only situation where there is no barrier at the end.
+        }
+        else if (MSCCL_OP_IN(OpMask, MSCCL_RECV) && t->type == MSCCL_RECV){
+          if (direct && prims.mscclDirectRecvOffer(dstPointer, peerDstPointer, dstOffset))
+            prims.mscclDirectRecv(dstOffset, thisNelem);
+          else
+            prims.recv(dstOffset, thisNelem);
+        }
+        else if (MSCCL_OP_IN(OpMask, MSCCL_REDUCE) && t->type == MSCCL_REDUCE) {
           int numReductions = t->numReductions;
-          if (thisNelem < nthreads){
+          // the primitives do not multiply the sources of reductions
+          if (thisNelem < nthreads || (PreMul && t->srcBuffer == MSCCL_INPUT_BUFFER)){
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_REDUCE_ENTRY)
-            if (tid == 0) {
-              NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_REDUCE_ENTRY, thisNelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+            if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_REDUCE_ENTRY)) {
+              NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_REDUCE_ENTRY, thisNelem*sizeof(T), 0, NpKit::GpuTimestamp(),
                   ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
             }
 #endif
 
-            if (tid < thisNelem){
-              dstOffset = gridOffset + (ssize_t) (t->dstOffset+c) * sizePerMscclChunk;
-              T* dstIndex = dstPointer + dstOffset + tid;
-              T reduceInput;
-              T o = load(dstIndex);
-              ssize_t srcBaseOffset = gridOffset + (ssize_t)c * sizePerMscclChunk + tid;
-              for (int r = 0; r < numReductions; r++){
-                  srcOffset = srcBaseOffset + (ssize_t)mscclShmem.mscclTB.reductionSrcOffsets[t->reductionPointer+r] * sizePerMscclChunk;
-                  reduceInput = load(srcPointer + srcOffset);
-                  o = applyReduce(redFn, reduceInput, o);
-              }
-              store(dstIndex, o);
-            }
+            dstOffset = gridOffset + dstLayout.offset(t->dstOffset+c);
+            ssize_t srcBaseOffset = gridOffset + (ssize_t)c * sizePerMscclChunk;
+            mscclReduceSmall(redFn, preFn, dstPointer + dstOffset, srcPointer + srcBaseOffset,
+              reductionSrcOffsets + t->reductionPointer, numReductions, srcLayout, thisNelem, false, tid, nthreads);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_REDUCE_EXIT)
-            if (tid == 0) {
-              NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_REDUCE_EXIT, thisNelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+            if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_REDUCE_EXIT)) {
+              NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_REDUCE_EXIT, thisNelem*sizeof(T), 0, NpKit::GpuTimestamp(),
                   ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
             }
 #endif
 
             barrier(nthreads);
           } else {
-            T* srcs[MSCCL_MAX_REDUCE_FUSION+1]; // +1 is for SIMPLE protocol as dst is added in the list of srcs
-            dstOffset = gridOffset + (ssize_t) (t->dstOffset+c) * sizePerMscclChunk;
-            T* dst = dstPointer + dstOffset;
+            dstOffset = gridOffset + dstLayout.offset(t->dstOffset+c);
             ssize_t srcBaseOffset = gridOffset + (ssize_t)c * sizePerMscclChunk;
-            for (int r = 0; r < numReductions; r++){
-                srcOffset = srcBaseOffset + (ssize_t)mscclShmem.mscclTB.reductionSrcOffsets[t->reductionPointer+r] * sizePerMscclChunk;
-                srcs[r] = srcPointer + srcOffset;
-            }
-            prims.reduce(srcs, numReductions, &dst, 1, thisNelem);
+            mscclReduceTiled(prims, dstPointer + dstOffset, srcPointer + srcBaseOffset,
+              reductionSrcOffsets + t->reductionPointer, numReductions, srcLayout, thisNelem);
           }
           if (c == 0) step += (numReductions-1); // only advance step once!
-        } else if (t->type == MSCCL_RECV_COPY_SEND)
+        } else if (MSCCL_OP_IN(OpMask, MSCCL_RECV_COPY_SEND) && t->type == MSCCL_RECV_COPY_SEND)
           prims.recvCopySend(dstOffset, thisNelem);
-        else if (t->type == MSCCL_RECV_REDUCE_SEND)
+        else if (MSCCL_OP_IN(OpMask, MSCCL_RECV_REDUCE_SEND) && t->type == MSCCL_RECV_REDUCE_SEND)
           prims.recvReduceSend(srcOffset, thisNelem);
-        else if (t->type == MSCCL_RECV_REDUCE_COPY_SEND)
+        else if (MSCCL_OP_IN(OpMask, MSCCL_RECV_REDUCE_COPY_SEND) && t->type == MSCCL_RECV_REDUCE_COPY_SEND)
           prims.recvReduceCopySend(srcOffset, dstOffset, thisNelem);
-        else if (t->type == MSCCL_RECV_REDUCE_COPY)
+        else if (MSCCL_OP_IN(OpMask, MSCCL_RECV_REDUCE_COPY) && t->type == MSCCL_RECV_REDUCE_COPY)
+          prims.recvReduceCopy(srcOffset, dstOffset, thisNelem);
+        else if (MSCCL_OP_IN(OpMask, MSCCL_LOCAL_COPY) && t->type == MSCCL_LOCAL_COPY) {
+          if (PreMul && t->srcBuffer == MSCCL_INPUT_BUFFER) {
+            const int16_t noOffset = 0;
+            mscclReduceSmall(redFn, preFn, dstPointer + dstOffset, srcPointer + srcOffset, &noOffset, 1, srcLayout, thisNelem, true, tid, nthreads);
+            barrier(nthreads);
+          } else {
+            prims.localCopy(srcPointer+srcOffset, dstPointer+dstOffset, thisNelem);
+          }
+        }
+        // the primitives of a thread block with several peers receive from or send to all of them
+        else if (MSCCL_OP_IN(OpMask, MSCCL_RECV_REDUCE_COPY_N) && t->type == MSCCL_RECV_REDUCE_COPY_N)
           prims.recvReduceCopy(srcOffset, dstOffset, thisNelem);
-        else if (t->type == MSCCL_LOCAL_COPY)
-          prims.localCopy(srcPointer+srcOffset, dstPointer+dstOffset, thisNelem);
+        else if (MSCCL_OP_IN(OpMask, MSCCL_SEND_N) && t->type == MSCCL_SEND_N)
+          prims.sendWithBarrier(srcOffset, thisNelem);
         else
           return;
       }
-      if (t->hasDependence && tid == nthreads-1){
-        if (mscclShmem.work.needsFence) {
-          __threadfence();
-        }
-        mscclFlags[bid].flag = (uint64_t) COMPUTE_FLAG(workIndex, iter, step);
+      // the sends of pipelined thread blocks are ahead of their receives and flagged after them
+      if (t->hasDependence && (!pipelined || lagged) && tid == nthreads-1){
+        mscclSetFlag(mscclFlags + bid, (uint64_t) COMPUTE_FLAG(flagBase, iter, step), mscclShmem.work.needsFence);
       }
       step++;
     }
+    // the receives of the previous iteration are done, and the sends of this one before the first receive
+    if (pipelined && tid == nthreads-1) {
+      const ssize_t iter = iterBegin + round;
+      if (iter < iterEnd && firstRecvStep > 0) {
+        mscclSetFlag(mscclFlags + bid, (uint64_t) COMPUTE_FLAG(flagBase, iter, firstRecvStep - 1), mscclShmem.work.needsFence);
+      } else if (iter > iterBegin) {
+        mscclSetFlag(mscclFlags + bid, (uint64_t) COMPUTE_FLAG(flagBase, iter - 1, step - 1), mscclShmem.work.needsFence);
+      }
+    }
   }
 }
 
-#define MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
-__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, LL)(struct ncclDevComm* comm, struct mscclAlgo* algo, struct mscclWork work) { \
-  mscclRunInterpreter<type, Func##devredop<type>, ProtoLL>(comm, algo, work); \
+// Load the program of thread block bid of algo into mscclShmem.mscclTB, only its live steps are copied.
+// Arrays longer than MSCCL_SHMEM_NUM_STEPS stay in algo, transmissions are then copied by mscclRunWork.
+// directMask holds the zero-copy steps of the thread blocks of algo on this communicator, if any.
+__device__ __forceinline__ static void mscclLoadThreadBlock(
+  struct mscclDevAlgo* algo, const uint32_t* directMask, const int tid, const int bid, const int nthreads) {
+  const char* record = (const char*)algo + (size_t)((const uint32_t*)(algo + 1))[bid] * MSCCL_DEV_ALGO_ALIGN;
+  const struct mscclDevThreadBlock* devTB = (const struct mscclDevThreadBlock*)record;
+  const int nSteps = devTB->nSteps;
+  const int nDependencies = devTB->nDependencies;
+  const int nReductions = devTB->nReductions;
+  record += sizeof(struct mscclDevThreadBlock);
+  const struct mscclTransmission* transmissions = (const struct mscclTransmission*)record;
+  record += ROUNDUP(nSteps * sizeof(struct mscclTransmission), MSCCL_DEV_ALGO_ALIGN);
+  const int16_t* dependentBid = (const int16_t*)record;
+  record += ROUNDUP(nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+  const int16_t* dependentStep = (const int16_t*)record;
+  record += ROUNDUP(nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+  const int16_t* reductionSrcOffsets = (const int16_t*)record;
+  const bool streamed = nSteps > MSCCL_SHMEM_NUM_STEPS;
+  const bool dependenciesFit = nDependencies <= MSCCL_SHMEM_NUM_STEPS;
+  const bool reductionsFit = nReductions <= MSCCL_SHMEM_NUM_STEPS;
+  if (tid < MSCCL_DIRECT_MASK_WORDS) {
+    mscclShmem.mscclTB.directMask[tid] = directMask != nullptr ? directMask[bid * MSCCL_DIRECT_MASK_WORDS + tid] : 0;
+  }
+  if (tid < MSCCL_MAX_FAN_PEERS) {
+    mscclShmem.mscclTB.sendPeers[tid] = devTB->sendPeers[tid];
+    mscclShmem.mscclTB.recvPeers[tid] = devTB->recvPeers[tid];
+  }
+  if (tid == 0) {
+    mscclShmem.mscclTB.nSendPeers = devTB->nSendPeers;
+    mscclShmem.mscclTB.nRecvPeers = devTB->nRecvPeers;
+    mscclShmem.mscclTB.nSteps = nSteps;
+    mscclShmem.mscclTB.channelId = devTB->channelId;
+    mscclShmem.mscclTB.nvls = devTB->nvls;
+    mscclShmem.mscclTB.protocol = devTB->protocol;
+    mscclShmem.mscclTB.collnet = devTB->collnet;
+    mscclShmem.mscclTB.pipelined = devTB->pipelined;
+    mscclShmem.mscclTB.streamedTransmissions = streamed ? transmissions : nullptr;
+    mscclShmem.mscclTB.dependentBidPtr = dependenciesFit ? mscclShmem.mscclTB.dependentBid : dependentBid;
+    mscclShmem.mscclTB.dependentStepPtr = dependenciesFit ? mscclShmem.mscclTB.dependentStep : dependentStep;
+    mscclShmem.mscclTB.reductionSrcOffsetsPtr = reductionsFit ? mscclShmem.mscclTB.reductionSrcOffsets : reductionSrcOffsets;
+  }
+  if (!streamed) {
+    threadBlockCopy(
+      (uint64_t *)mscclShmem.mscclTB.transmissions, (const uint64_t *)transmissions,
+      nSteps * sizeof(struct mscclTransmission) / sizeof(uint64_t), tid, nthreads);
+  }
+  if (dependenciesFit) {
+    threadBlockCopy(
+      (uint64_t *)mscclShmem.mscclTB.dependentBid, (const uint64_t *)dependentBid,
+      DIVUP(nDependencies * sizeof(int16_t), sizeof(uint64_t)), tid, nthreads);
+    threadBlockCopy(
+      (uint64_t *)mscclShmem.mscclTB.dependentStep, (const uint64_t *)dependentStep,
+      DIVUP(nDependencies * sizeof(int16_t), sizeof(uint64_t)), tid, nthreads);
+  }
+  if (reductionsFit) {
+    threadBlockCopy(
+      (uint64_t *)mscclShmem.mscclTB.reductionSrcOffsets, (const uint64_t *)reductionSrcOffsets,
+      DIVUP(nReductions * sizeof(int16_t), sizeof(uint64_t)), tid, nthreads);
+  }
+}
+
+// Run mscclShmem.work on the thread block in mscclShmem.mscclTB, whose protocol is Proto
+template<typename T, typename RedOp, typename Proto, int OpMask, bool Mixed>
+__device__ __forceinline__ void mscclRunBlockWork(const int tid, const int bid, const int nthreads, const uint64_t flagBase) {
+  // NVLS thread blocks are only compiled where multimem supports RedOp, the host does not pick
+  // algorithms with NVLS channels elsewhere. The other kernels fall back to the regular primitives.
+  constexpr bool NvlsCompiled = (OpMask & MSCCL_OP_MASK_NVLS) != 0 && Proto::Id == NCCL_PROTO_SIMPLE &&
+    LoadMultimem_BigPackSize<RedOp>::BigPackSize != 0;
+  using MultimemProto = typename std::conditional<NvlsCompiled, ProtoSimple<1, 1, COLL_UNROLL, 1, 1>, Proto>::type;
+  using UnicastProto = typename std::conditional<NvlsCompiled, ProtoSimple<1, 1, COLL_UNROLL>, Proto>::type;
+  // CollNet buffers move a step per slice, as the CollNet chain of NCCL
+  constexpr bool CollNetCompiled = (OpMask & MSCCL_OP_MASK_COLLNET) != 0 && Proto::Id == NCCL_PROTO_SIMPLE && !Mixed;
+  using CollNetProto = typename std::conditional<CollNetCompiled, ProtoSimple<1, 1, COLL_UNROLL>, Proto>::type;
+  // Only kernels compiled for the fan types instantiate mscclRunWork on the primitives of several peers
+  constexpr bool FanCompiled = (OpMask & MSCCL_OP_MASK_FAN) != 0;
+  using FanPeers = typename std::conditional<FanCompiled, FanSymmetric<MSCCL_MAX_FAN_PEERS>, FanAsymmetric<1,1>>::type;
+  if (CollNetCompiled && mscclShmem.mscclTB.collnet) {
+    mscclRunWork<T, RedOp, Proto, OpMask, Mixed, FanAsymmetric<1,1>, CollNetProto>(tid, bid, nthreads, flagBase);
+  } else if (NvlsCompiled && mscclShmem.mscclTB.nvls == MSCCL_NVLS_MULTIMEM) {
+    mscclRunWork<T, RedOp, Proto, OpMask, Mixed, FanAsymmetric<1,1>, MultimemProto>(tid, bid, nthreads, flagBase);
+  } else if (NvlsCompiled && mscclShmem.mscclTB.nvls == MSCCL_NVLS_UNICAST) {
+    mscclRunWork<T, RedOp, Proto, OpMask, Mixed, FanAsymmetric<1,1>, UnicastProto>(tid, bid, nthreads, flagBase);
+  // only thread blocks with several peers of a direction pay for primitives covering them all
+  } else if (FanCompiled && (mscclShmem.mscclTB.nRecvPeers > 1 || mscclShmem.mscclTB.nSendPeers > 1)) {
+    mscclRunWork<T, RedOp, Proto, OpMask, Mixed, FanPeers>(tid, bid, nthreads, flagBase);
+  } else {
+    mscclRunWork<T, RedOp, Proto, OpMask, Mixed, FanAsymmetric<1,1>>(tid, bid, nthreads, flagBase);
+  }
+}
+
+// Run mscclShmem.work and the works fused after it, they all use the same algorithm. Mixed kernels
+// are built with the Simple Proto and run the LL and LL128 thread blocks on their own primitives.
+// Flags of the works start past flagBase, the base of the flags of the next launch is returned.
+// Thread blocks left out of the works still count their flags.
+template<typename T, typename RedOp, typename Proto, int OpMask, bool Mixed>
+__device__ __forceinline__ uint64_t mscclRunWorks(const int tid, const int bid, const int nthreads, uint64_t flagBase) {
+  const struct mscclWork* fusedWorks = mscclShmem.work.fusedWorks;
+  const int nFusedWorks = mscclShmem.work.nFusedWorks;
+  using LLProto = typename std::conditional<Mixed, ProtoLL, Proto>::type;
+  using LL128Proto = typename std::conditional<Mixed, ProtoLL128, Proto>::type;
+  for (int w = 0; ; w++) {
+    // Works of a fused launch may have fewer replicas than the grid holds
+    if (bid < mscclShmem.work.nBlocks * mscclShmem.work.nReplicas) {
+      if (Mixed && mscclShmem.mscclTB.protocol == NCCL_PROTO_LL) {
+        mscclRunBlockWork<T, RedOp, LLProto, OpMask, Mixed>(tid, bid, nthreads, flagBase);
+      } else if (Mixed && mscclShmem.mscclTB.protocol == NCCL_PROTO_LL128) {
+        mscclRunBlockWork<T, RedOp, LL128Proto, OpMask, Mixed>(tid, bid, nthreads, flagBase);
+      } else {
+        mscclRunBlockWork<T, RedOp, Proto, OpMask, Mixed>(tid, bid, nthreads, flagBase);
+      }
+    }
+    const ssize_t sizePerMscclChunk = mscclShmem.work.count / mscclShmem.work.nChunksPerLoop;
+    flagBase += DIVUP(sizePerMscclChunk, (mscclChunkSize<T, Proto, Mixed>())) * MSCCL_MAX_NUM_STEPS;
+    if (w == nFusedWorks) break;
+    __syncthreads(); // all threads are done with mscclShmem.work
+    if (tid < WARP_SIZE) copyToShmem16(tid, &mscclShmem.work, fusedWorks + w, sizeof(mscclWork));
+    __syncthreads(); // publish mscclShmem.work
+  }
+  return flagBase;
+}
+
+__shared__ int mscclPersistentStop;
+
+// Resident kernel of the persistent mode. Works are taken from the queue in sequence order once
+// their stream posted them and the previous one is done on every thread block. The thread block
+// program stays in shared memory for as long as the works use the same algorithm.
+template<typename T, typename RedOp, typename Proto, int OpMask, bool Mixed>
+__device__ __forceinline__ void mscclRunPersistent(
+  struct ncclDevComm* comm, struct mscclPersistentQueue* queue, struct mscclPersistentCtrl* ctrl) {
+  const int tid = threadIdx.x;
+  const int bid = blockIdx.x;
+  const int nthreads = blockDim.x;
+
+  if (tid < WARP_SIZE) copyToShmem16(tid, &ncclShmem.comm, comm, sizeof(ncclDevComm));
+  if (tid == WARP_SIZE) ncclShmem.aborted = 0;
+  if (tid == 0) mscclClusterFlag = 0;
+  mscclClusterBarrier(); // the flags of the cluster are reset before any of them is read
+  struct mscclDevAlgo* residentAlgo = nullptr;
+  bool residentLoaded = false;
+
+  for (uint32_t seq = load(&ctrl->done) + 1; ; seq++) {
+    if (tid == 0) {
+      int stop = 0;
+      while (true) {
+        if ((int32_t)(load(&ctrl->posted) - seq) >= 0 && (int32_t)(load(&ctrl->done) - (seq - 1)) >= 0) break;
+        if (load(&queue->stop) || *ncclShmem.comm.abortFlag) {
+          stop = 1;
+          break;
+        }
+      }
+      mscclPersistentStop = stop;
+    }
+    __syncthreads(); // publish mscclPersistentStop, all threads are done with mscclShmem.work
+    if (mscclPersistentStop) break;
+
+    // The queue is in host memory and its slots are rewritten, bypass the caches
+    const int slot = seq % MSCCL_PERSISTENT_QUEUE_DEPTH;
+    uint64_t* src = (uint64_t*)(queue->works + slot);
+    for (int i = tid; i < sizeof(struct mscclWork) / sizeof(uint64_t); i += nthreads) {
+      ((uint64_t*)&mscclShmem.work)[i] = load(src + i);
+    }
+    __syncthreads(); // publish mscclShmem.work
+
+    struct mscclDevAlgo* algo = mscclShmem.work.algo;
+    if (algo != residentAlgo) {
+      const int nBlocks = mscclShmem.work.nBlocks;
+      const int replica = bid / nBlocks;
+      residentAlgo = algo;
+      // only replicas with channels of their own can run a work of algo
+      residentLoaded = replica < MAXCHANNELS / mscclShmem.work.nChannels;
+      if (residentLoaded) {
+        mscclLoadThreadBlock(algo, mscclShmem.work.directMask, tid, bid % nBlocks, nthreads);
+        __syncthreads(); // publish mscclShmem.mscclTB.channelId
+        if (tid < WARP_SIZE) {
+          int channelId = mscclShmem.mscclTB.channelId + replica * mscclShmem.work.nChannels;
+          copyToShmem16(tid, &ncclShmem.channel, &((ncclDevCommAndChannels*)comm)->channels[channelId], sizeof(ncclDevChannel));
+        }
+        __syncthreads(); // publish ncclShmem.channel
+      }
+    }
+    // The grid is sized by the first algorithm, spare thread blocks of smaller ones only count the
+    // flags of the work and report completion. Thread blocks without channels for algo are spare.
+    const uint64_t flagEnd = mscclRunWorks<T, RedOp, Proto, OpMask, Mixed>(
+      tid, bid, nthreads, load(&mscclShmem.work.syncEpoch->base));
+
+    __syncthreads(); // all threads of the block are done with the work
+    if (tid == 0) {
+      __threadfence();
+      if (atomicAdd(&ctrl->arrivals[slot], 1u) == gridDim.x - 1) {
+        store(&ctrl->arrivals[slot], 0u);
+        // thread blocks only read the base of the next work once it is done
+        store(&mscclShmem.work.syncEpoch->base, flagEnd);
+        __threadfence();
+        store(&ctrl->done, seq);
+        __threadfence_system();
+        store(&queue->done, seq);
+      }
+    }
+  }
+  mscclClusterBarrier(); // no thread block of the cluster reads the flag of this one any more
+}
+
+// ns of the globaltimer of the GPU
+__device__ __forceinline__ uint64_t mscclGlobalTimer() {
+  uint64_t time;
+  asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(time));
+  return time;
+}
+
+template<typename T, typename RedOp, typename Proto, int OpMask, bool Mixed = false>
+__device__ __forceinline__ void mscclRunInterpreter(
+  struct ncclDevComm* comm, struct mscclWork work) {
+  const int tid = threadIdx.x;
+  const int bid = blockIdx.x;
+  const int nthreads = blockDim.x;
+
+  if (work.persistentQueue != nullptr) {
+    mscclRunPersistent<T, RedOp, Proto, OpMask, Mixed>(comm, work.persistentQueue, work.persistentCtrl);
+    return;
+  }
+
+  if (bid == 0 && tid == 0 && work.telemetry != nullptr) {
+    work.telemetry->start = mscclGlobalTimer();
+  }
+
+  // initialize mscclShmem.mscclTB, thread block bid runs replica bid / nBlocks of the program
+  mscclLoadThreadBlock(work.algo, work.directMask, tid, bid % work.nBlocks, nthreads);
+  __syncthreads(); // publish mscclShmem.mscclTB.channelId
+
+  // initialize ncclShmem and mscclShmem.work
+  int channelId = mscclShmem.mscclTB.channelId + (bid / work.nBlocks) * work.nChannels;
+  {
+    void *dst, *src;
+    int bytes = 0;
+    // Use first 3 warps to load comm, channel, and work into shmem
+    switch (tid/WARP_SIZE) {
+    case 0:
+      dst = &ncclShmem.comm;
+      src = comm;
+      bytes = sizeof(ncclDevComm);
+      static_assert(sizeof(ncclDevComm) <= 16 * WARP_SIZE, "ncclDevComm cannot be loaded by a single warp in one insn.");
+      break;
+    case 1:
+      // Get address of channel without incurring indirect load from ncclDevComm::channels
+      dst = &ncclShmem.channel;
+      src = &((ncclDevCommAndChannels*)comm)->channels[channelId];
+      bytes = sizeof(ncclDevChannel);
+      static_assert(sizeof(ncclDevChannel) <= 16 * WARP_SIZE, "ncclDevChannel cannot be loaded by a single warp in one insn.");
+      break;
+    case 2:
+      dst = &mscclShmem.work;
+      src = &work;
+      bytes = sizeof(mscclWork);
+      static_assert(sizeof(mscclWork) <= 16 * WARP_SIZE, "mscclWork cannot be loaded by a single warp in one insn.");
+      break;
+    case 3:
+      /* set abort flag to 0 */
+      if (tid == 3 * WARP_SIZE) ncclShmem.aborted = 0;
+      if (tid == 3 * WARP_SIZE + 1) mscclClusterFlag = 0;
+      break;
+    default:
+      break;
+    }
+    copyToShmem16(tid%WARP_SIZE, dst, src, bytes);
+  }
+  __syncthreads(); // publish shmem
+  mscclClusterBarrier(); // the flags of the cluster are reset before any of them is read
+
+#if defined(ENABLE_NPKIT)
+  int npKitCtxIdx = bid;
+#endif
+
+#if defined(ENABLE_NPKIT)
+  if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
+    uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
+    NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
+        ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
+  }
+#endif
+
+#if defined(ENABLE_NPKIT)
+  if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+    NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
+        ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
+  }
+#endif
+
+  struct mscclSyncEpoch* syncEpoch = work.syncEpoch;
+  const uint64_t flagEnd = mscclRunWorks<T, RedOp, Proto, OpMask, Mixed>(tid, bid, nthreads, load(&syncEpoch->base));
+
+  __syncthreads(); // all threads of the block are done with the works
+  if (tid == 0) {
+    // the last thread block moves the base of the flags past this launch, all of them read it already
+    if (atomicAdd(&syncEpoch->arrivals, 1u) == gridDim.x - 1) {
+      store(&syncEpoch->arrivals, 0u);
+      store(&syncEpoch->base, flagEnd);
+      if (work.telemetry != nullptr) {
+        volatile struct mscclTelemetryRecord* record = work.telemetry;
+        record->end = mscclGlobalTimer();
+        __threadfence_system();
+        record->seq = work.telemetrySeq;
+      }
+    }
+  }
+  mscclClusterBarrier(); // no thread block of the cluster reads the flag of this one any more
+}
+
+#define MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_NAME(name, devredop, type, opMask) \
+__global__ void name(devredop, type, LL)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, Func##devredop<type>, ProtoLL, opMask>(comm, work); \
 } \
-__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, LL128)(struct ncclDevComm* comm, struct mscclAlgo* algo, struct mscclWork work) { \
-  mscclRunInterpreter<type, Func##devredop<type>, ProtoLL128>(comm, algo, work); \
+__global__ void name(devredop, type, LL128)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, Func##devredop<type>, ProtoLL128, opMask>(comm, work); \
 } \
-__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, Simple)(struct ncclDevComm* comm, struct mscclAlgo* algo, struct mscclWork work) { \
-  mscclRunInterpreter<type, Func##devredop<type>, ProtoSimple<MSCCL_CHUNKSTEPS/MSCCL_SLICESTEPS, MSCCL_SLICESTEPS>>(comm, algo, work); \
+__global__ void name(devredop, type, Simple)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, Func##devredop<type>, mscclProtoSimple, opMask>(comm, work); \
 }
 
+#if defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+#define MSCCL_IMPL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+__global__ void MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, Func##devredop<type>, mscclProtoSimple, MSCCL_OP_MASK_MIXED, true>(comm, work); \
+}
+#else
+#define MSCCL_IMPL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
+#endif
+
+// Only the fan kernels instantiate mscclRunWork on the primitives of several peers
+#if defined(MSCCL_FAN_KERNELS)
+#define MSCCL_IMPL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+  MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_NAME(MSCCL_FAN_KERNEL_ENTRY_NAME, devredop, type, MSCCL_OP_MASK_ALL)
+#else
+#define MSCCL_IMPL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
+#endif
+
+#if defined(MSCCL_SPECIALIZE_KERNELS)
+#define MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+  MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_NAME(MSCCL_KERNEL_ENTRY_NAME, devredop, type, MSCCL_OP_MASK_GENERIC) \
+  MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_NAME(MSCCL_P2P_KERNEL_ENTRY_NAME, devredop, type, MSCCL_OP_MASK_P2P) \
+  MSCCL_IMPL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+  MSCCL_IMPL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
+#else
+#define MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+  MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_NAME(MSCCL_KERNEL_ENTRY_NAME, devredop, type, MSCCL_OP_MASK_GENERIC) \
+  MSCCL_IMPL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+  MSCCL_IMPL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
+#endif
+
 #if defined(__CUDA_BF16_TYPES_EXIST__) && defined(__CUDA_FP8_TYPES_EXIST__)
 #define MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP(devredop) \
   MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, int8_t) \
@@ -387,3 +1028,20 @@ __global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, Simple)(struct ncclDevCo
   MSCCL_IMPL_KERNEL_ENTRY_FUNC_DEVREDOP_NOFLOAT(SumPostDiv)
 
 MSCCL_IMPL_KERNEL_ENTRY_FUNC()
+
+// Moving data only depends on the size of the elements, the op is never applied
+#define MSCCL_IMPL_COPY_KERNEL_ENTRY_FUNC_TYPE(type) \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, FuncSum<type>, ProtoLL, MSCCL_OP_MASK_COPY>(comm, work); \
+} \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL128)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, FuncSum<type>, ProtoLL128, MSCCL_OP_MASK_COPY>(comm, work); \
+} \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, Simple)(struct ncclDevComm* comm, struct mscclWork work) { \
+  mscclRunInterpreter<type, FuncSum<type>, mscclProtoSimple, MSCCL_OP_MASK_COPY>(comm, work); \
+}
+
+MSCCL_IMPL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint8_t)
+MSCCL_IMPL_COPY_KERNEL_ENTRY_FUNC_TYPE(half)
+MSCCL_IMPL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint32_t)
+MSCCL_IMPL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint64_t)
@@ -0,0 +1,116 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "collectives.h"
+#include "common_kernel.h"
+#include "common.h"
+#include <cuda_runtime.h>
+
+namespace {
+  constexpr int OneShotThreads = 512;
+  constexpr int OneShotSpinsBeforeCheckAbort = 1000000;
+
+  __device__ __forceinline__ uint64_t volatile* oneShotFlag(char* scratch, int parity, int r) {
+    return (uint64_t volatile*)scratch + parity*NCCL_ONESHOT_MAX_RANKS + r;
+  }
+
+  __device__ __forceinline__ void* oneShotSlot(struct ncclOneShotArgs const& args, int owner, int parity, int r) {
+    return args.scratch[owner] + NCCL_ONESHOT_DATA_OFFSET + (parity*NCCL_ONESHOT_MAX_RANKS + r)*args.slotBytes;
+  }
+
+  template<typename RedOp>
+  __global__ __launch_bounds__(OneShotThreads, 1)
+  void oneShotKernel(struct ncclOneShotArgs args) {
+    using T = typename RedOp::EltType;
+    __shared__ uint64_t seq;
+    int tid = threadIdx.x;
+    int tn = blockDim.x;
+    int me = args.localRank;
+    int n = args.localRanks;
+    char* local = args.scratch[me];
+    void* srcs[NCCL_ONESHOT_MAX_RANKS];
+    void* dsts[NCCL_ONESHOT_MAX_RANKS];
+
+    // Counting calls on the device keeps graph replays in step with the flags
+    if (tid == 0) seq = *(uint64_t volatile*)(local + NCCL_ONESHOT_COUNTER_OFFSET) + 1;
+    __syncthreads();
+    // Every peer finished the previous call on this parity before it sent us the data of the last call
+    int parity = seq & 1;
+
+    srcs[0] = (void*)args.sendbuff;
+    for (int r = 0; r < n; r++) dsts[r] = oneShotSlot(args, r, parity, me);
+    reduceCopy<COLL_UNROLL, RedOp, T, 0, 1, 1, 0, 1, NCCL_ONESHOT_MAX_RANKS, /*PreOpSrcs*/0>
+      (tid, tn, args.redOpArg, nullptr, false, 1, srcs, n, dsts, args.count);
+    __threadfence_system();
+    __syncthreads();
+
+    if (tid < n) {
+      *oneShotFlag(args.scratch[tid], parity, me) = seq;
+      uint64_t volatile* flag = oneShotFlag(local, parity, tid);
+      int spins = 0;
+      while (*flag != seq) {
+        if (++spins == OneShotSpinsBeforeCheckAbort) {
+          if (*(uint32_t volatile*)args.abortFlag) break;
+          spins = 0;
+        }
+      }
+    }
+    __syncthreads();
+
+    // Slots are read in local rank order, so that all ranks get the same bits
+    for (int r = 0; r < n; r++) srcs[r] = oneShotSlot(args, me, parity, r);
+    if (args.allGather) {
+      for (int r = 0; r < n; r++) {
+        dsts[0] = (T*)args.recvbuff + args.ranks[r]*args.count;
+        reduceCopy<COLL_UNROLL, RedOp, T, 0, 1, 1, 0, 1, 1, /*PreOpSrcs*/0>
+          (tid, tn, args.redOpArg, nullptr, false, 1, srcs+r, 1, dsts, args.count);
+      }
+    } else {
+      uint64_t preOpArgs[NCCL_ONESHOT_MAX_RANKS];
+      for (int r = 0; r < NCCL_ONESHOT_MAX_RANKS; r++) preOpArgs[r] = args.redOpArg;
+      dsts[0] = args.recvbuff;
+      reduceCopy<COLL_UNROLL, RedOp, T, 0, 1, NCCL_ONESHOT_MAX_RANKS, 0, 1, 1, /*PreOpSrcs*/NCCL_ONESHOT_MAX_RANKS>
+        (tid, tn, args.redOpArg, preOpArgs, true, n, srcs, 1, dsts, args.count);
+    }
+    if (tid == 0) *(uint64_t volatile*)(local + NCCL_ONESHOT_COUNTER_OFFSET) = seq;
+  }
+
+  template<typename T>
+  ncclResult_t oneShotKernelFor(ncclDevRedOp_t op, void const** kernel) {
+    switch (op) {
+    case ncclDevSum:        *kernel = (void const*)&oneShotKernel<FuncSum<T>>; break;
+    case ncclDevProd:       *kernel = (void const*)&oneShotKernel<FuncProd<T>>; break;
+    case ncclDevMinMax:     *kernel = (void const*)&oneShotKernel<FuncMinMax<T>>; break;
+    case ncclDevPreMulSum:  *kernel = (void const*)&oneShotKernel<FuncPreMulSum<T>>; break;
+    case ncclDevSumPostDiv: *kernel = (void const*)&oneShotKernel<FuncSumPostDiv<T>>; break;
+    default: return ncclInvalidArgument;
+    }
+    return ncclSuccess;
+  }
+}
+
+ncclResult_t ncclLaunchOneShot(struct ncclOneShotArgs* args, ncclDevRedOp_t op, ncclDataType_t type, cudaStream_t stream) {
+  void const* kernel;
+  switch (type) {
+  case ncclInt8:     NCCLCHECK(oneShotKernelFor<int8_t>(op, &kernel)); break;
+  case ncclUint8:    NCCLCHECK(oneShotKernelFor<uint8_t>(op, &kernel)); break;
+  case ncclInt32:    NCCLCHECK(oneShotKernelFor<int32_t>(op, &kernel)); break;
+  case ncclUint32:   NCCLCHECK(oneShotKernelFor<uint32_t>(op, &kernel)); break;
+  case ncclInt64:    NCCLCHECK(oneShotKernelFor<int64_t>(op, &kernel)); break;
+  case ncclUint64:   NCCLCHECK(oneShotKernelFor<uint64_t>(op, &kernel)); break;
+  case ncclFloat16:  NCCLCHECK(oneShotKernelFor<half>(op, &kernel)); break;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16: NCCLCHECK(oneShotKernelFor<__nv_bfloat16>(op, &kernel)); break;
+#endif
+  case ncclFloat32:  NCCLCHECK(oneShotKernelFor<float>(op, &kernel)); break;
+  case ncclFloat64:  NCCLCHECK(oneShotKernelFor<double>(op, &kernel)); break;
+  default: return ncclInvalidArgument;
+  }
+  dim3 grid = {1, 1, 1};
+  dim3 block = {OneShotThreads, 1, 1};
+  void* kernelArgs[1] = {args};
+  CUDACHECK(cudaLaunchKernel(kernel, grid, block, kernelArgs, 0, stream));
+  return ncclSuccess;
+}
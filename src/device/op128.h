@@ -322,6 +322,20 @@ __device__ __forceinline__ void st_relaxed_sys_global(uint64_t *ptr, uint64_t va
     asm volatile("st.volatile.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
   #endif
 }
+__device__ __forceinline__ void st_relaxed_gpu_global(uint64_t *ptr, uint64_t val) {
+  #if __CUDA_ARCH__ >= 700
+    asm volatile("st.relaxed.gpu.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
+  #else
+    asm volatile("st.volatile.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
+  #endif
+}
+__device__ __forceinline__ void st_release_gpu_global(uint64_t *ptr, uint64_t val) {
+  #if __CUDA_ARCH__ >= 700
+    asm volatile("st.release.gpu.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
+  #else
+    asm volatile("membar.gl; st.volatile.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
+  #endif
+}
 __device__ __forceinline__ void st_release_sys_global(uint64_t *ptr, uint64_t val) {
   #if __CUDA_ARCH__ >= 700
     asm volatile("st.release.sys.global.u64 [%0], %1;" :: "l"(cvta_to_global(ptr)), "l"(val) : "memory");
@@ -11,6 +11,7 @@
 #include "reduce_kernel.h" // for reduction funcs
 #include "common_kernel.h"
 #include "common.h"
+#include "bulk_copy.h"
 
 #define NCCL_SPINS_BEFORE_CHECK_ABORT 1000000
 
@@ -50,7 +50,9 @@ public:
 private:
 #endif
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
+  // Whether receive waits are timed, for the data process event or the collected data process time
+  bool npKitWaitRecvTimed = false;
   uint64_t npKitWaitRecvDataProcessSize = 0;
   uint64_t npKitWaitRecvEntryTime = 0;
   uint64_t npKitWaitRecvExitTime = 0;
@@ -84,9 +86,9 @@ private:
   }
 
   inline __device__ void waitSend(int nbytes) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_WAIT_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_WAIT_SEND_ENTRY, nbytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_WAIT_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_WAIT_SEND_ENTRY, nbytes, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -105,9 +107,9 @@ private:
     }
     barrier();
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_WAIT_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_WAIT_SEND_EXIT, nbytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_WAIT_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_WAIT_SEND_EXIT, nbytes, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -137,17 +139,17 @@ private:
     uint32_t data1, flag1, data2, flag2;
     int spins = 0;
 
-  #if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+  #if defined(ENABLE_NPKIT)
     int npkitWaitRecvSpins = 0;
-    if (tid == 0) {
-      npKitWaitRecvEntryTime = clock64();
+    if (tid == 0 && npKitWaitRecvTimed) {
+      npKitWaitRecvEntryTime = NpKit::GpuTimestamp();
     }
 #endif
 
     do {
       asm volatile("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(data1), "=r"(flag1), "=r"(data2), "=r"(flag2) : "l"(&src->i4) : "memory");
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
       npkitWaitRecvSpins++;
 #endif
 
@@ -155,9 +157,9 @@ private:
     } while ((flag1 != flag) || (flag2 != flag));
     uint64_t val64 = data1 + (((uint64_t)data2) << 32);
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
-    if (tid == 0) {
-      npKitWaitRecvExitTime = clock64();
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && npKitWaitRecvTimed) {
+      npKitWaitRecvExitTime = NpKit::GpuTimestamp();
       npKitWaitRecvTotalTime += (npKitWaitRecvExitTime - npKitWaitRecvEntryTime) * (npkitWaitRecvSpins - 1) / npkitWaitRecvSpins;
     }
 #endif
@@ -182,17 +184,17 @@ private:
     uint32_t flag = recvFlag(i);
     int spins = 0;
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
     int npkitWaitRecvSpins = 0;
-    if (tid == 0) {
-      npKitWaitRecvEntryTime = clock64();
+    if (tid == 0 && npKitWaitRecvTimed) {
+      npKitWaitRecvEntryTime = NpKit::GpuTimestamp();
     }
 #endif
 
     while (line[i].flag1 != flag || line[i].flag2 != flag) {
       asm volatile("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(line[i].data1), "=r"(line[i].flag1), "=r"(line[i].data2), "=r"(line[i].flag2) : "l"(&src->i4) : "memory");
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
       npkitWaitRecvSpins++;
 #endif
 
@@ -200,9 +202,9 @@ private:
     }
     uint64_t val64 = line[i].data1 + (((uint64_t)line[i].data2) << 32);
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
-    if (tid == 0) {
-      npKitWaitRecvExitTime = clock64();
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && npKitWaitRecvTimed) {
+      npKitWaitRecvExitTime = NpKit::GpuTimestamp();
       npKitWaitRecvTotalTime += (npKitWaitRecvExitTime - npKitWaitRecvEntryTime) * (npkitWaitRecvSpins - 1) / npkitWaitRecvSpins;
     }
 #endif
@@ -333,19 +335,21 @@ private:
     nelem = nelem < 0 ? 0 : nelem;
     if (SEND) waitSend(divUp(nelem, EltPerLine)*sizeof(ncclLLFifoLine));
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    npKitWaitRecvTimed = NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT);
+    if (tid == 0 && npKitWaitRecvTimed) {
       npKitWaitRecvTotalTime = 0;
       npKitWaitRecvDataProcessSize = nelem*sizeof(T);
       NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY,
-          npKitWaitRecvDataProcessSize, 0, clock64(), ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
+          npKitWaitRecvDataProcessSize, 0, NpKit::GpuTimestamp(), ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
+    npKitWaitRecvTimed = true;
     if (tid == 0) {
       npKitWaitRecvTotalTime = 0;
-      npKitDataProcessEntryTime = clock64();
+      npKitDataProcessEntryTime = NpKit::GpuTimestamp();
     }
 #endif
 
@@ -403,15 +407,15 @@ private:
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
     if (tid == 0) {
-      npKitDataProcessExitTime = clock64();
+      npKitDataProcessExitTime = NpKit::GpuTimestamp();
       npKitDataProcessTotalTime += npKitDataProcessExitTime - npKitDataProcessEntryTime - npKitWaitRecvTotalTime;
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY) && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT)) {
       NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT,
-          npKitWaitRecvDataProcessSize, npKitWaitRecvTotalTime, clock64(),
+          npKitWaitRecvDataProcessSize, npKitWaitRecvTotalTime, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -431,9 +435,9 @@ private:
 
 template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
   __device__ __forceinline__ void mscclGenericOp(T** srcs, int nsrcs, T** dsts, int ndsts, int nelem) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -497,9 +501,9 @@ template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
       offset += nthreads;
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -583,144 +587,150 @@ template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
     userBufs[Output] = (T*)outputBuf;
   }
 
+  // MSCCL data pointers, with the argument of the pre-op applied to what is read from inputBuf
+  __device__ void setDataPtrs(void const *inputBuf, void *outputBuf, uint64_t preOpArg) {
+    setDataPtrs(inputBuf, outputBuf);
+    redOp = RedOp(preOpArg);
+  }
+
   __device__ void moveDataPtrs(intptr_t delta) {
     userBufs[Input] += delta;
     userBufs[Output] += delta;
   }
 
   __device__ void send(intptr_t inpIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<0, 1, Input, -1>(inpIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
   }
   __device__ void sendFromOutput(intptr_t outIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<0, 1, Output, -1>(outIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recv(intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<1, 0, -1, Output>(-1, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceSend(intptr_t inpIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<1, 1, Input, -1>(inpIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceCopy(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<1, 0, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void copySend(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<0, 1, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvCopySend(intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<1, 1, -1, Output>(-1, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceCopySend(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     LLGenericOp<1, 1, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -731,6 +741,12 @@ template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
     // This is the only primitive.instruction where there is no barrier at the end, add it
     barrier();
   }
+  // Zero-copy s and r are only done with the Simple protocol
+  __device__ void mscclLoadDirect() {}
+  __device__ bool mscclDirectRecvOffer(T* dstBase, T* peerDstBase, ssize_t dstIx) { return false; }
+  __device__ bool mscclDirectSendAccept() { return false; }
+  __device__ void mscclDirectSend(intptr_t inpIx, int eltN) { sendWithBarrier(inpIx, eltN); }
+  __device__ void mscclDirectRecv(intptr_t outIx, int eltN) { recv(outIx, eltN); }
   __device__ void localCopy(T* srcs, T* dsts, int eltN) {
     return mscclGenericOp<0,1,0,0>(&srcs, 1, &dsts, 1, eltN);
   }
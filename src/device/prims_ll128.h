@@ -56,7 +56,9 @@ public:
 private:
 #endif
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
+  // Whether receive waits are timed, for the data process event or the collected data process time
+  bool npKitWaitRecvTimed = false;
   uint64_t npKitWaitRecvDataProcessSize = 0;
   uint64_t npKitWaitRecvEntryTime = 0;
   uint64_t npKitWaitRecvExitTime = 0;
@@ -86,9 +88,9 @@ private:
   }
 
   inline __device__ void waitSend(int nbytes) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_WAIT_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_ENTRY, nbytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_ENTRY, nbytes, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -105,9 +107,9 @@ private:
       sendConnHead += 1;
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_WAIT_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_EXIT, nbytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_WAIT_SEND_EXIT, nbytes, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -231,10 +233,10 @@ private:
       bool needReload;
       int spins = 0;
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
       int npkitWaitRecvSpins = 0;
-      if (tid == 0) {
-        npKitWaitRecvEntryTime = clock64();
+      if (tid == 0 && npKitWaitRecvTimed) {
+        npKitWaitRecvEntryTime = NpKit::GpuTimestamp();
       }
 #endif
 
@@ -246,16 +248,16 @@ private:
           needReload |= flagThread && (vr[u+1] != flag);
         }
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
         npkitWaitRecvSpins++;
 #endif
 
         needReload &= (0 == checkAbort(spins, 0, 0));
       } while (__any_sync(WARP_MASK, needReload));
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
-      if (tid == 0) {
-        npKitWaitRecvExitTime = clock64();
+#if defined(ENABLE_NPKIT)
+      if (tid == 0 && npKitWaitRecvTimed) {
+        npKitWaitRecvExitTime = NpKit::GpuTimestamp();
         npKitWaitRecvTotalTime += (npKitWaitRecvExitTime - npKitWaitRecvEntryTime) * (npkitWaitRecvSpins - 1) / npkitWaitRecvSpins;
         npkitWaitRecvSpins = 0;
       }
@@ -299,10 +301,10 @@ private:
         bool needReload;
         int spins = 0;
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
         int npkitWaitRecvSpins = 0;
-        if (tid == 0) {
-          npKitWaitRecvEntryTime = clock64();
+        if (tid == 0 && npKitWaitRecvTimed) {
+          npKitWaitRecvEntryTime = NpKit::GpuTimestamp();
         }
 #endif
 
@@ -314,16 +316,16 @@ private:
             needReload |= flagThread && (vr[u+1] != flag);
           }
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
+#if defined(ENABLE_NPKIT)
           npkitWaitRecvSpins++;
 #endif
 
           needReload &= (0 == checkAbort(spins, i, 0));
         } while (__any_sync(WARP_MASK, needReload));
 
-#if defined(ENABLE_NPKIT) && (defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT) || defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME))
-        if (tid == 0) {
-          npKitWaitRecvExitTime = clock64();
+#if defined(ENABLE_NPKIT)
+        if (tid == 0 && npKitWaitRecvTimed) {
+          npKitWaitRecvExitTime = NpKit::GpuTimestamp();
           npKitWaitRecvTotalTime += (npKitWaitRecvExitTime - npKitWaitRecvEntryTime) * (npkitWaitRecvSpins - 1) / npkitWaitRecvSpins;
           npkitWaitRecvSpins = 0;
         }
@@ -388,19 +390,21 @@ private:
     if (SEND) waitSend(divUp(nelem, DataEltPerSlice)*WireWordPerSlice*sizeof(uint64_t));
     barrier();
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    npKitWaitRecvTimed = NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT);
+    if (tid == 0 && npKitWaitRecvTimed) {
       npKitWaitRecvTotalTime = 0;
       npKitWaitRecvDataProcessSize = nelem*sizeof(T);
       NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY,
-          npKitWaitRecvDataProcessSize, 0, clock64(), ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
+          npKitWaitRecvDataProcessSize, 0, NpKit::GpuTimestamp(), ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
+    npKitWaitRecvTimed = true;
     if (tid == 0) {
       npKitWaitRecvTotalTime = 0;
-      npKitDataProcessEntryTime = clock64();
+      npKitDataProcessEntryTime = NpKit::GpuTimestamp();
     }
 #endif
 
@@ -424,15 +428,15 @@ private:
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
     if (tid == 0) {
-      npKitDataProcessExitTime = clock64();
+      npKitDataProcessExitTime = NpKit::GpuTimestamp();
       npKitDataProcessTotalTime += npKitDataProcessExitTime - npKitDataProcessEntryTime - npKitWaitRecvTotalTime;
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && defined(ENABLE_NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT)
-    if (tid == 0) {
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY) && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT)) {
       NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT,
-          npKitWaitRecvDataProcessSize, npKitWaitRecvTotalTime, clock64(),
+          npKitWaitRecvDataProcessSize, npKitWaitRecvTotalTime, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -445,9 +449,9 @@ private:
 
    template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
   __device__ __forceinline__ void mscclGenericOp(T** srcs, int nsrcs, T** dsts, int ndsts, int nelem) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -526,9 +530,9 @@ private:
       nelem -= DataEltPerSlice*nwarps;
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -615,143 +619,149 @@ public:
     userBufs[Output] = (T*)outputBuf;
   }
 
+  // MSCCL data pointers, with the argument of the pre-op applied to what is read from inputBuf
+  __device__ void setDataPtrs(void const *inputBuf, void *outputBuf, uint64_t preOpArg) {
+    setDataPtrs(inputBuf, outputBuf);
+    redOp = RedOp(preOpArg);
+  }
+
   __device__ void moveDataPtrs(intptr_t delta) {
     userBufs[Input] += delta;
     userBufs[Output] += delta;
   }
 
   __device__ void send(intptr_t inpIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<0, 1, Input, -1>(inpIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void sendFromOutput(intptr_t outIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<0, 1, Output, -1>(outIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recv(intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<1, 0, -1, Output>(-1, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceSend(intptr_t inpIx, int eltN) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<1, 1, Input, -1>(inpIx, -1, eltN, false);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceCopy(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<1, 0, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void copySend(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<0, 1, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvCopySend(intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<1, 1, -1, Output>(-1, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
   }
   __device__ void recvReduceCopySend(intptr_t inpIx, intptr_t outIx, int eltN, bool postOp=false) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
     GenericOp<1, 1, Input, Output>(inpIx, outIx, eltN, postOp);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT, eltN*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT, eltN*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -760,6 +770,12 @@ public:
   __device__ void sendWithBarrier(intptr_t inpIx, int eltN) {
     send(inpIx, eltN);
   }
+  // Zero-copy s and r are only done with the Simple protocol
+  __device__ void mscclLoadDirect() {}
+  __device__ bool mscclDirectRecvOffer(T* dstBase, T* peerDstBase, ssize_t dstIx) { return false; }
+  __device__ bool mscclDirectSendAccept() { return false; }
+  __device__ void mscclDirectSend(intptr_t inpIx, int eltN) { sendWithBarrier(inpIx, eltN); }
+  __device__ void mscclDirectRecv(intptr_t outIx, int eltN) { recv(outIx, eltN); }
   __device__ void localCopy(T* srcs, T* dsts, int eltN) {
     return mscclGenericOp<0,1,0,0>(&srcs, 1, &dsts, 1, eltN);
   }
@@ -44,7 +44,8 @@ class Primitives<
                        NvlsDirectRead = 0x8000,
                        NvlsDirectWrite = 0x10000,
                        IpcWrite = 0x20000,
-                       IpcRead = 0x40000;
+                       IpcRead = 0x40000,
+                       NetRegSend = 0x80000;
   const int tid, tidInBlock;
   const int nthreads;
   int nworkers;
@@ -58,6 +59,8 @@ class Primitives<
   struct ncclConnFifo* connFifo = NULL;
   T* connEltsFifo;
   T* directBuff = NULL;
+  T* netRegInput = NULL;
+  T* netRegOutput = NULL;
   uint64_t *connStepPtr;
   uint64_t connStepCache; // Cache last seen value of (*connStepPtr)
   int      connStepSize; // Connection step size
@@ -132,7 +135,7 @@ private:
   }
 
   template <int DirectRecv, int DirectSend, int Recv, int Send, int Src, int Dst>
-  __device__ __forceinline__ void waitPeer(intptr_t srcIx, intptr_t dstIx, int offset, int nelts) {
+  __device__ __forceinline__ void waitPeer(intptr_t srcIx, intptr_t dstIx, int offset, int nelts, T* userData = nullptr) {
     const bool isSendNotRecv = (Send && Recv) ? (flags & RoleWaitSend) : Send;
     const bool noRecvWait = DirectRecv && Src && (flags & (DirectRead | IpcRead));        // no wait when directly reading from remote input
     const bool noSendWait = DirectSend && (flags & (DirectRead|DirectWrite)); // no wait in empty send (e.g. directScatter) or direct remote write
@@ -156,6 +159,11 @@ private:
                                   : (ncclShmem.groups[group].srcs + Src);
       if (flags & NetRegMode) {
          // Do nothing
+      } else if (isSendNotRecv && (flags & NetRegSend)) {
+        // The proxy sends data already in the user buffer from there. Only data which is
+        // not there goes through the FIFO.
+        connFifo[step%NCCL_STEPS].ptr = userData;
+        ptrs[index] = userData ? nullptr : connEltsFifo + (step%NCCL_STEPS)*connStepSize;
       } else if ((flags & ConnFifoEnabled) && connFifo[step%NCCL_STEPS].mode == NCCL_MODE_OFFSET) {
         ptrs[index] = connEltsFifo + loadInt(&connFifo[step%NCCL_STEPS].offset)/sizeof(T);
       } else if (isSendNotRecv && DirectSend) {
@@ -184,6 +192,12 @@ private:
         ncclNetDeviceIncrementHead(group, index);
       }
       step += StepPerSlice;
+      // Issue the load of the next slice's flag now, it lands while the data of this slice moves
+      // instead of stalling the next waitPeer. A stale value only means the next wait spins.
+      if (((flags & (Recv*RoleWaitRecv)) && !noRecvWait) || ((flags & (Send*RoleWaitSend)) && !noSendWait)) {
+        if (!(flags & Aborted) && connStepCache + (isSendNotRecv ? NCCL_STEPS : 0) < step + StepPerSlice)
+          connStepCache = loadStepValue(connStepPtr);
+      }
     }
   }
 
@@ -251,7 +265,12 @@ private:
           if (Src) ncclShmem.groups[group].srcs[0] = (SrcBuf==Input ? userInput : userOutput) + srcIx + offset;
           if (Dst) ncclShmem.groups[group].dsts[0] = (DstBuf==Input ? userInput : userOutput) + dstIx + offset;
         }
-        waitPeer<DirectRecv, DirectSend, Recv, Send, Src, Dst>(srcIx, dstIx, offset, sliceSize);
+        T* sendData = nullptr;
+        if (Send && (Src || Dst) && (flags & NetRegSend)) {
+          sendData = Dst ? (DstBuf==Input ? netRegInput : netRegOutput) + dstIx + offset
+                         : (SrcBuf==Input ? netRegInput : netRegOutput) + srcIx + offset;
+        }
+        waitPeer<DirectRecv, DirectSend, Recv, Send, Src, Dst>(srcIx, dstIx, offset, sliceSize, sendData);
         subBarrier();
         /* if user abort the kernel, we don't need to actually perform copy/reduce; just set size
          * to 0 to avoid unnecessary workload. */
@@ -267,18 +286,18 @@ private:
              * so we need to check whether MultimemSrcs and MultimemDsts are 0. */
             && MultimemSrcs == 0 && MultimemDsts == 0 && !Src) {
           // We can only have one direct receive. Since srcs[0] == dstPtr+offset, skip one copy
-          if (Send) {
+          if (Send && ncclShmem.groups[group].dsts[1] != nullptr) {
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)
-            if (tid == 0) {
-              NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+            if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)) {
+              NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                   ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
             }
 #endif
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
             if (tid == 0) {
-              npKitDataProcessEntryTime = clock64();
+              npKitDataProcessEntryTime = NpKit::GpuTimestamp();
             }
 #endif
 
@@ -290,14 +309,14 @@ private:
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
             if (tid == 0) {
-              npKitDataProcessExitTime = clock64();
+              npKitDataProcessExitTime = NpKit::GpuTimestamp();
               npKitDataProcessTotalTime += npKitDataProcessExitTime - npKitDataProcessEntryTime;
             }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)
-            if (tid == 0) {
-              NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+            if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)) {
+              NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                   ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
             }
 #endif
@@ -306,16 +325,16 @@ private:
         } else if (DirectSend && !DirectRecv && SrcBuf != Input && ncclShmem.groups[group].dsts[Dst] == nullptr) {
           // For broadcast in CollNet to do empty send
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)
-          if (tid == 0) {
-            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+          if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)) {
+            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                 ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
           }
 #endif
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
           if (tid == 0) {
-            npKitDataProcessEntryTime = clock64();
+            npKitDataProcessEntryTime = NpKit::GpuTimestamp();
           }
 #endif
 
@@ -327,53 +346,67 @@ private:
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
           if (tid == 0) {
-            npKitDataProcessExitTime = clock64();
+            npKitDataProcessExitTime = NpKit::GpuTimestamp();
             npKitDataProcessTotalTime += npKitDataProcessExitTime - npKitDataProcessEntryTime;
           }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)
-          if (tid == 0) {
-            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+          if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)) {
+            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                 ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
           }
 #endif
 
         } else if (ncclShmem.groups[group].srcs[0] && ncclShmem.groups[group].dsts[0]) {
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)
-          if (tid == 0) {
-            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+          if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY)) {
+            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                 ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
           }
 #endif
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
           if (tid == 0) {
-            npKitDataProcessEntryTime = clock64();
+            npKitDataProcessEntryTime = NpKit::GpuTimestamp();
           }
 #endif
 
           constexpr int PreOpSrcs = SrcBuf != Input ? 0 :
                                     DirectRecv*MaxRecv == NCCL_MAX_DIRECT_ARITY ? (1+NCCL_MAX_DIRECT_ARITY) : 1;
-          reduceCopy<Unroll, RedOp, T,
-            MultimemSrcs, Recv+Src, Recv*MaxRecv+Src,
-            MultimemDsts, Send+Dst, Send*MaxSend+Dst, PreOpSrcs>
-            (tid, nworkers, ncclShmem.redOpArgs[0], ncclShmem.redOpArgs, postOp,
-             Recv*fan.nrecv()+Src, ncclShmem.groups[group].srcs,
-             Send*fan.nsend()+Dst, ncclShmem.groups[group].dsts,
-             workSize);
+          // Plain copies from one buffer to another may go through the bulk copy engine of the SM
+          constexpr bool Copy = MultimemSrcs == 0 && MultimemDsts == 0 && Recv*MaxRecv+Src == 1 && Send*MaxSend+Dst == 1;
+          if (Send && Dst && MaxSend == 1 && ncclShmem.groups[group].dsts[Dst] == nullptr) {
+            // The proxy sends this slice from the output (NetRegSend), only write the output
+            reduceCopy<Unroll, RedOp, T,
+              MultimemSrcs, Recv+Src, Recv*MaxRecv+Src,
+              MultimemDsts, 1, 1, PreOpSrcs>
+              (tid, nworkers, ncclShmem.redOpArgs[0], ncclShmem.redOpArgs, postOp,
+               Recv*fan.nrecv()+Src, ncclShmem.groups[group].srcs,
+               1, ncclShmem.groups[group].dsts,
+               workSize);
+          } else if (!(Copy && (PreOpSrcs == 0 || Apply_PreOp<RedOp, 1>::IsIdentity) && !postOp &&
+                bulkCopy(tid, nworkers, ncclShmem.groups[group].srcs[0], ncclShmem.groups[group].dsts[0], (int64_t)workSize*sizeof(T)))) {
+            reduceCopy<Unroll, RedOp, T,
+              MultimemSrcs, Recv+Src, Recv*MaxRecv+Src,
+              MultimemDsts, Send+Dst, Send*MaxSend+Dst, PreOpSrcs>
+              (tid, nworkers, ncclShmem.redOpArgs[0], ncclShmem.redOpArgs, postOp,
+               Recv*fan.nrecv()+Src, ncclShmem.groups[group].srcs,
+               Send*fan.nsend()+Dst, ncclShmem.groups[group].dsts,
+               workSize);
+          }
 
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME)
           if (tid == 0) {
-            npKitDataProcessExitTime = clock64();
+            npKitDataProcessExitTime = NpKit::GpuTimestamp();
             npKitDataProcessTotalTime += npKitDataProcessExitTime - npKitDataProcessEntryTime;
           }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)
-          if (tid == 0) {
-            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+          if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT)) {
+            NpKit::CollectGpuEvent(NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, sliceSize*sizeof(T), 0, NpKit::GpuTimestamp(),
                 ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
           }
 #endif
@@ -514,9 +547,9 @@ public:
 private:
   template <int REDUCE, int COPY, int MULTISRCS, int MULTIDSTS>
   __device__ __forceinline__ void mscclGenericOp(T** srcs, int nsrcs, T** dsts, int ndsts, int nelem) {
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -527,7 +560,7 @@ private:
         srcs[nsrcs] = dsts[0];
         nsrcs++;
         if (MULTISRCS){
-          reduceCopy<Unroll, RedOp, T, MultimemSrcs, 3, MSCCL_MAX_REDUCE_FUSION, 0, 1, 1, 0>
+          reduceCopy<Unroll, RedOp, T, MultimemSrcs, 3, MSCCL_REDUCE_TILE+1, 0, 1, 1, 0>
             (tid, nworkers, ncclShmem.redOpArgs[0], nullptr, false, nsrcs, (void**)srcs, 1, (void**)dsts, nelem);
         } else {
           reduceCopy<Unroll, RedOp, T, 0, 2, 2, 0, 1, 1, 0>
@@ -535,8 +568,10 @@ private:
         }
       }
       if (COPY){
-        reduceCopy<Unroll, RedOp, T, 0, 1, 1, 0, 1, 1, 0>
-          (tid, nworkers, ncclShmem.redOpArgs[0], nullptr, false, 1, (void**)srcs, 1, (void**)dsts, nelem);
+        if (!bulkCopy(tid, nworkers, srcs[0], dsts[0], (int64_t)nelem*sizeof(T))) {
+          reduceCopy<Unroll, RedOp, T, 0, 1, 1, 0, 1, 1, 0>
+            (tid, nworkers, ncclShmem.redOpArgs[0], nullptr, false, 1, (void**)srcs, 1, (void**)dsts, nelem);
+        }
         if (MULTISRCS) {
           for (int i = 1; i < nsrcs; i++){
             reduceCopy<Unroll, RedOp, T, 0, 1, 1, 0, 1, 1, 0>
@@ -546,9 +581,9 @@ private:
       }
     }
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)
-    if (tid == 0) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (tid == 0 && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, nelem*sizeof(T), 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -794,6 +829,11 @@ private:
     if (flags & (RoleWaitSend|RolePostSend)) loadSendConn(ncclShmem.channel.peers[peer], connIndexSend, e ? e->direct : 0, e ? e->regUsed : ipcReg);
 
     if (netReg) flags |= NetRegMode;
+    if ((flags & RoleWaitSend) && (flags & ConnFifoEnabled) && e && e->netRegUsed && (conn->flags & NCCL_NET_REG_SEND)) {
+      flags |= NetRegSend;
+      netRegInput = (T*)inputBuf;
+      netRegOutput = (T*)outputBuf;
+    }
 
     if (barrierAny(flags & NetDeviceUnpack)) {
       flags |= AnyNetDeviceUnpack;
@@ -821,6 +861,12 @@ private:
       int spins = 0;
       while (*ptr != -1) if (checkAbort(spins)) break;
     }
+    if (flags & NetRegSend) {
+      // The proxy reads the user buffer until the network completed the sends. Wait for
+      // all of them, so that the next kernel does not overwrite data still being sent.
+      int spins = 0;
+      while (loadStepValue(connStepPtr) < step) if (checkAbort(spins)) break;
+    }
 
     if (flags & NetDeviceUnpack) {
       ncclNetDeviceSaveHead(netDeviceHandle, group, index);
@@ -953,6 +999,14 @@ private:
       ncclShmem.groups[group].userOutput = (T*)outputBuf;
     }
   }
+  // Set MSCCL data pointers and the argument of the pre-op applied to what is read from inputBuf
+  __device__ __forceinline__ void setDataPtrs(void const *inputBuf, void *outputBuf, uint64_t preOpArg) {
+    if (tid==0) {
+      ncclShmem.groups[group].userInput = (T*)inputBuf;
+      ncclShmem.groups[group].userOutput = (T*)outputBuf;
+      ncclShmem.redOpArgs[0] = preOpArg;
+    }
+  }
 
   __device__ __forceinline__ void send(intptr_t inpIx, int eltN) {
     genericOp<0, 0, 0, 1, Input, -1>(inpIx, -1, eltN, false);
@@ -1171,6 +1225,56 @@ private:
   __device__ __forceinline__ void sendWithBarrier(intptr_t inpIx, int eltN) {
     send(inpIx, eltN);
   }
+  // Zero-copy s and r write into the destination of the receiver, which publishes it in the
+  // ptrExchange slot of the connection before each of them, as registered NCCL P2P operations do
+  __device__ __forceinline__ void mscclLoadDirect() {
+    if (flags & (RoleWaitRecv | RoleWaitSend)) {
+      if (conn->ptrExchange != nullptr && conn->connFifo == nullptr) {
+        if (conn->flags & (NCCL_IPC_READ | NCCL_IPC_WRITE)) flags |= IpcWrite;
+        else if (conn->flags & (NCCL_DIRECT_READ | NCCL_DIRECT_WRITE)) flags |= DirectWrite;
+      }
+    }
+  }
+  // dstBase + dstIx is where the data goes, peerDstBase is dstBase in the address space of the
+  // sender for peers of other processes, nullptr if it is not registered. Returns whether the
+  // sender writes there.
+  __device__ __forceinline__ bool mscclDirectRecvOffer(T* dstBase, T* peerDstBase, ssize_t dstIx) {
+    bool direct = false;
+    if ((flags & RoleWaitRecv) && (flags & (DirectWrite | IpcWrite))) {
+      int spins = 0;
+      void* volatile* slot = ncclShmem.groups[group].recvConns[index]->ptrExchange;
+      while (*slot != nullptr && !checkAbort(spins));
+      T* exchgPtr = (flags & DirectWrite) ? dstBase : peerDstBase;
+      direct = exchgPtr != nullptr;
+      directBuff = dstBase;
+      *slot = direct ? reinterpret_cast<void*>(exchgPtr + dstIx) : MSCCL_DIRECT_FIFO;
+    }
+    return barrierAny(direct);
+  }
+  // Returns whether the receiver offered its destination
+  __device__ __forceinline__ bool mscclDirectSendAccept() {
+    bool direct = false;
+    if ((flags & RoleWaitSend) && (flags & (DirectWrite | IpcWrite))) {
+      int spins = 0;
+      void* volatile* slot = ncclShmem.groups[group].sendConns[index]->ptrExchange;
+      void* ptr;
+      while (true) {
+        ptr = *slot;
+        if (ptr != nullptr || checkAbort(spins)) break;
+      }
+      *slot = nullptr;
+      direct = ptr != nullptr && ptr != MSCCL_DIRECT_FIFO;
+      directBuff = reinterpret_cast<T*>(ptr);
+    }
+    return barrierAny(direct);
+  }
+  __device__ __forceinline__ void mscclDirectSend(intptr_t inpIx, int eltN) {
+    directSend(inpIx, 0, eltN);
+  }
+  __device__ __forceinline__ void mscclDirectRecv(intptr_t outIx, int eltN) {
+    // the data already is in place, the source and destination match and no copy is done
+    directRecv(outIx, outIx, eltN);
+  }
   __device__ __forceinline__ void localCopy(T* srcs, T* dsts, int eltN) {
     return mscclGenericOp<0,1,0,0>(&srcs, 1, &dsts, 1, eltN);
   }
@@ -9,6 +9,7 @@
 #ifndef NCCL_REDUCE_KERNEL_H_
 #define NCCL_REDUCE_KERNEL_H_
 
+#include "device.h"
 #include "op128.h"
 #include <limits>
 #include <type_traits>
@@ -56,6 +57,23 @@ struct FuncMinMax {
   }
 };
 
+// Sums of 16 bit floats round stochastically when the host asks for it, partial sums of long
+// reductions then stay unbiased even though each hop stores them in 16 bits.
+template<>
+struct FuncSum<half> {
+  using EltType = half;
+  bool stochastic;
+  __device__ FuncSum(uint64_t opArg=0): stochastic((opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0) {}
+};
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<>
+struct FuncSum<__nv_bfloat16> {
+  using EltType = __nv_bfloat16;
+  bool stochastic;
+  __device__ FuncSum(uint64_t opArg=0): stochastic((opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0) {}
+};
+#endif
+
 template<typename T> struct FuncPreMulSum;
 template<typename T> struct FuncSumPostDiv;
 
@@ -262,28 +280,65 @@ struct Apply_Reduce<FuncProd<uint8_t>, /*EltPerPack=*/4> {
     } \
   };
 
+// Random bits for the rounding of a sum, hashed from its operands so that reruns get the same result
+__device__ __forceinline__ uint32_t stochasticBits(uint32_t key) {
+  key ^= key >> 16; key *= 0x85ebca6b;
+  key ^= key >> 13; key *= 0xc2b2ae35;
+  key ^= key >> 16;
+  return key;
+}
+
+// Round to the value below or above the float sum, with a probability given by the distance to them.
+// Infinities and NaNs are kept, sums never round up to infinity.
+__device__ __forceinline__ half stochasticSum(half x, half y) {
+  float f = __half2float(x) + __half2float(y);
+  half lo = __float2half_rz(f);
+  half hi = __ushort_as_half(__half_as_ushort(lo) + 1);
+  float frac = (f - __half2float(lo)) / (__half2float(hi) - __half2float(lo));
+  uint32_t bits = stochasticBits((uint32_t(__half_as_ushort(x)) << 16) | __half_as_ushort(y));
+  return (bits >> 8)*(1.0f/(1 << 24)) < frac ? hi : lo;
+}
+__device__ __forceinline__ half2 stochasticSum(half2 x, half2 y) {
+  return __halves2half2(stochasticSum(__low2half(x), __low2half(y)), stochasticSum(__high2half(x), __high2half(y)));
+}
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+__device__ __forceinline__ __nv_bfloat16 stochasticSum(__nv_bfloat16 x, __nv_bfloat16 y) {
+  float f = __bfloat162float(x) + __bfloat162float(y);
+  __nv_bfloat16 lo = __float2bfloat16_rz(f);
+  __nv_bfloat16 hi = __ushort_as_bfloat16(__bfloat16_as_ushort(lo) + 1);
+  float frac = (f - __bfloat162float(lo)) / (__bfloat162float(hi) - __bfloat162float(lo));
+  uint32_t bits = stochasticBits((uint32_t(__bfloat16_as_ushort(x)) << 16) | __bfloat16_as_ushort(y));
+  return (bits >> 8)*(1.0f/(1 << 24)) < frac ? hi : lo;
+}
+#if __CUDA_ARCH__ >= 800
+__device__ __forceinline__ __nv_bfloat162 stochasticSum(__nv_bfloat162 x, __nv_bfloat162 y) {
+  return __halves2bfloat162(stochasticSum(__low2bfloat16(x), __low2bfloat16(y)), stochasticSum(__high2bfloat16(x), __high2bfloat16(y)));
+}
+#endif
+#endif
+
 SPECIALIZE_REDUCE(FuncMinMax, float, 1, float, fn.isMinNotMax ? fminf(x, y) : fmaxf(x, y))
 SPECIALIZE_REDUCE(FuncMinMax, double, 1, double, fn.isMinNotMax ? fmin(x, y) : fmax(x, y))
 
 #if __CUDA_ARCH__ >= 530 && __CUDA_ARCH__ != 610
 #if __CUDA_ARCH__ >= 800 && ENABLE_PRECISION_CLIPPING_HALF == 1
-  SPECIALIZE_REDUCE(FuncSum, half, 1, half,  __hmin(__hmax(__hadd(x, y), __half(-65504.0f)), __half(65504.0f)))
+  SPECIALIZE_REDUCE(FuncSum, half, 1, half, fn.stochastic ? stochasticSum(x, y) : __hmin(__hmax(__hadd(x, y), __half(-65504.0f)), __half(65504.0f)))
 #else
-  SPECIALIZE_REDUCE(FuncSum, half, 1, half, __hadd(x, y))
+  SPECIALIZE_REDUCE(FuncSum, half, 1, half, fn.stochastic ? stochasticSum(x, y) : __hadd(x, y))
 #endif
   // Coverity recommends the use of std::move here but, given that half is a scalar,
   // a plain copy will be just as efficient.
   // coverity[copy_constructor_call]
 #if __CUDA_ARCH__ >= 800 && ENABLE_PRECISION_CLIPPING_HALF == 1
-  SPECIALIZE_REDUCE(FuncSum, half, 2, half2,  __hmin2(__hmax2(__hadd2(x, y), __halves2half2(-65504.0f, -65504.0f)), __halves2half2(65504.0f, 65504.0f)))
+  SPECIALIZE_REDUCE(FuncSum, half, 2, half2, fn.stochastic ? stochasticSum(x, y) : __hmin2(__hmax2(__hadd2(x, y), __halves2half2(-65504.0f, -65504.0f)), __halves2half2(65504.0f, 65504.0f)))
 #else
-  SPECIALIZE_REDUCE(FuncSum, half, 2, half2, __hadd2(x, y))
+  SPECIALIZE_REDUCE(FuncSum, half, 2, half2, fn.stochastic ? stochasticSum(x, y) : __hadd2(x, y))
 #endif
   SPECIALIZE_REDUCE(FuncProd, half, 1, half, __hmul(x, y))
   // coverity[copy_constructor_call]
   SPECIALIZE_REDUCE(FuncProd, half, 2, half2, __hmul2(x, y))
 #else
-  SPECIALIZE_REDUCE(FuncSum, half, 1, half, __float2half(__half2float(x) + __half2float(y)))
+  SPECIALIZE_REDUCE(FuncSum, half, 1, half, fn.stochastic ? stochasticSum(x, y) : __float2half(__half2float(x) + __half2float(y)))
   SPECIALIZE_REDUCE(FuncProd, half, 1, half, __float2half(__half2float(x) * __half2float(y)))
 #endif
 
@@ -297,9 +352,9 @@ SPECIALIZE_REDUCE(FuncMinMax, double, 1, double, fn.isMinNotMax ? fmin(x, y) : f
 
 #if defined(__CUDA_BF16_TYPES_EXIST__)
 #if __CUDA_ARCH__ >= 800
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, __hadd(x, y))
+  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, fn.stochastic ? stochasticSum(x, y) : __hadd(x, y))
   // coverity[copy_constructor_call]
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 2, __nv_bfloat162, __hadd2(x, y))
+  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 2, __nv_bfloat162, fn.stochastic ? stochasticSum(x, y) : __hadd2(x, y))
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 1, __nv_bfloat16, __hmul(x, y))
   // coverity[copy_constructor_call]
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 2, __nv_bfloat162, __hmul2(x, y))
@@ -307,7 +362,7 @@ SPECIALIZE_REDUCE(FuncMinMax, double, 1, double, fn.isMinNotMax ? fmin(x, y) : f
   // coverity[copy_constructor_call]
   SPECIALIZE_REDUCE(FuncMinMax, __nv_bfloat16, 2, __nv_bfloat162, fn.isMinNotMax ? __hmin2(x, y) : __hmax2(x, y))
 #else
-  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(__bfloat162float(x) + __bfloat162float(y)))
+  SPECIALIZE_REDUCE(FuncSum, __nv_bfloat16, 1, __nv_bfloat16, fn.stochastic ? stochasticSum(x, y) : __float2bfloat16(__bfloat162float(x) + __bfloat162float(y)))
   SPECIALIZE_REDUCE(FuncProd, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(__bfloat162float(x) * __bfloat162float(y)))
   SPECIALIZE_REDUCE(FuncMinMax, __nv_bfloat16, 1, __nv_bfloat16, __float2bfloat16(fn.isMinNotMax ? fminf(__bfloat162float(x), __bfloat162float(y)) : fmaxf(__bfloat162float(x), __bfloat162float(y))))
 #endif
@@ -454,11 +509,13 @@ template<>
 // coverity[moveable_type]
 struct FuncPreMulSum<half> {
   using EltType = half;
+  bool stochastic;
 #if __CUDA_ARCH__ >= 530 && __CUDA_ARCH__ != 610
   half2 scalar;
   __device__ FuncPreMulSum(uint64_t opArg=0) {
     union { uint64_t u64; half val; };
     u64 = opArg;
+    stochastic = (opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0;
     scalar.x = val;
     scalar.y = val;
   }
@@ -467,6 +524,7 @@ struct FuncPreMulSum<half> {
   __device__ FuncPreMulSum(uint64_t opArg=0) {
     union { uint64_t u64; half val; };
     u64 = opArg;
+    stochastic = (opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0;
     scalar = __half2float(val);
   }
 #endif
@@ -479,11 +537,13 @@ struct FuncPreMulSum<half> {
   // coverity[moveable_type]
   struct FuncPreMulSum<__nv_bfloat16> {
     using EltType = __nv_bfloat16;
+    bool stochastic;
   #if __CUDA_ARCH__ >= 800
     __nv_bfloat162 scalar;
     __device__ FuncPreMulSum(uint64_t opArg=0) {
       union { uint64_t u64; __nv_bfloat16 val; };
       u64 = opArg;
+      stochastic = (opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0;
       scalar.x = val;
       scalar.y = val;
     }
@@ -492,6 +552,7 @@ struct FuncPreMulSum<half> {
     __device__ FuncPreMulSum(uint64_t opArg=0) {
       union { uint64_t u64; __nv_bfloat16 val; };
       u64 = opArg;
+      stochastic = (opArg & NCCL_REDOP_ARG_STOCHASTIC) != 0;
       scalar = __bfloat162float(val);
     }
   #endif
@@ -542,6 +603,21 @@ struct Apply_Reduce<FuncPreMulSum<T>, /*EltPerPack=*/1> {
   }
 };
 
+template<>
+struct Apply_Reduce<FuncPreMulSum<half>, /*EltPerPack=*/1> {
+  __device__ static BytePack<sizeof(half)> reduce(FuncPreMulSum<half> fn, BytePack<sizeof(half)> a, BytePack<sizeof(half)> b) {
+    return Apply_Reduce<FuncSum<half>, 1>::reduce(FuncSum<half>(fn.stochastic ? NCCL_REDOP_ARG_STOCHASTIC : 0), a, b);
+  }
+};
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<>
+struct Apply_Reduce<FuncPreMulSum<__nv_bfloat16>, /*EltPerPack=*/1> {
+  __device__ static BytePack<sizeof(__nv_bfloat16)> reduce(FuncPreMulSum<__nv_bfloat16> fn, BytePack<sizeof(__nv_bfloat16)> a, BytePack<sizeof(__nv_bfloat16)> b) {
+    return Apply_Reduce<FuncSum<__nv_bfloat16>, 1>::reduce(FuncSum<__nv_bfloat16>(fn.stochastic ? NCCL_REDOP_ARG_STOCHASTIC : 0), a, b);
+  }
+};
+#endif
+
 // PreOp of FuncPreMulSum for integral types, float, and double.
 template<typename T>
 struct Apply_PreOp<FuncPreMulSum<T>, /*EltPerPack=*/1> {
@@ -24,17 +24,17 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
     int npKitCtxIdx = blockIdx.x * NCCL_MAX_GROUPS + group;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (isNpKitThread) {
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (isNpKitThread) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -52,9 +52,9 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_RECV_SEND_ENTRY)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_SEND_ENTRY, bytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_RECV_SEND_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_SEND_ENTRY, bytes, 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -66,9 +66,9 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
       cursor += n;
     } while (cursor < bytes && work->sendRegistered == 0);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_RECV_SEND_EXIT)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_SEND_EXIT, bytes, prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_RECV_SEND_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_SEND_EXIT, bytes, prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -82,17 +82,17 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
     int npKitCtxIdx = blockIdx.x * NCCL_MAX_GROUPS + group;
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_CPU)
-    if (isNpKitThread) {
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_CPU)) {
       uint64_t* cpuTimestamp = ncclShmem.comm.cpuTimestamp;
       NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_CPU, 0, 0, *cpuTimestamp,
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_TIME_SYNC_GPU)
-    if (isNpKitThread) {
-      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+    if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_TIME_SYNC_GPU)) {
+      NpKit::CollectGpuEvent(NPKIT_EVENT_TIME_SYNC_GPU, 0, 0, NpKit::GpuTimestamp(),
           ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
     }
 #endif
@@ -110,9 +110,9 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
       }
 #endif
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_RECV_RECV_ENTRY)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_RECV_ENTRY, bytes, 0, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_RECV_RECV_ENTRY)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_RECV_ENTRY, bytes, 0, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
         prims.npKitDataProcessTotalTime = 0;
       }
@@ -124,9 +124,9 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
       cursor += n;
     } while (cursor < bytes && work->recvRegistered == 0);
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_SEND_RECV_RECV_EXIT)
-      if (isNpKitThread) {
-        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_RECV_EXIT, bytes, prims.npKitDataProcessTotalTime, clock64(),
+#if defined(ENABLE_NPKIT)
+      if (isNpKitThread && NPKIT_GPU_EVENT_ENABLED(NPKIT_EVENT_SEND_RECV_RECV_EXIT)) {
+        NpKit::CollectGpuEvent(NPKIT_EVENT_SEND_RECV_RECV_EXIT, bytes, prims.npKitDataProcessTotalTime, NpKit::GpuTimestamp(),
             ncclShmem.comm.npKitEventCollectContexts + npKitCtxIdx);
       }
 #endif
@@ -147,6 +147,38 @@ struct RunWorkBatch<ncclFuncSendRecv, T, RedOp, NCCL_ALGO_RING, NCCL_PROTO_SIMPL
     Shared* shared = (Shared*)ncclScratchForWarp(0);
 
     struct ncclDevWorkP2p* works = (ncclDevWorkP2p*)ncclShmem.workStorage;
+    if (ncclShmem.workType == ncclDevWorkTypeP2pStrided) {
+      // Expand the strided work in place into the works of its rounds
+      if (wid == 0) {
+        struct ncclDevWorkP2pStrided strided = *(struct ncclDevWorkP2pStrided*)ncclShmem.workStorage;
+        __syncwarp();
+        if (lane < strided.nRounds) {
+          int sendRank = ncclShmem.comm.p2pSchedule[2*(strided.roundBeg+lane)];
+          int recvRank = ncclShmem.comm.p2pSchedule[2*(strided.roundBeg+lane)+1];
+          struct ncclDevWorkP2p* work = &works[lane];
+          work->sendAddr = (char*)strided.sendAddr + sendRank*strided.stride;
+          work->recvAddr = (char*)strided.recvAddr + recvRank*strided.stride;
+          work->sendBytes = strided.bytes;
+          work->recvBytes = strided.bytes;
+          work->sendRank = sendRank;
+          work->recvRank = recvRank;
+          work->nP2pChannels = strided.nP2pChannels;
+          work->channelBase = strided.channelBase;
+          work->nSendChannels = strided.nChannels;
+          work->nRecvChannels = strided.nChannels;
+          work->sendChunkSize_u32fp8 = strided.sendChunkSize_u32fp8;
+          work->recvChunkSize_u32fp8 = strided.recvChunkSize_u32fp8;
+          work->sendProtoLL = strided.sendProtoLL;
+          work->recvProtoLL = strided.recvProtoLL;
+          work->sendRegistered = 0;
+          work->recvRegistered = 0;
+          work->sendIpcReg = 0;
+          work->recvIpcReg = 0;
+        }
+        if (lane == 0) ncclShmem.nWorks = strided.nRounds;
+      }
+      __syncthreads();
+    }
     int nWorks = ncclShmem.nWorks;
 
     if (wid == 0) {
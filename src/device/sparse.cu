@@ -0,0 +1,91 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "device.h"
+#include "checks.h"
+#include "common_kernel.h"
+#include <cuda_runtime.h>
+
+namespace {
+  constexpr int SparseThreads = 512;
+
+  __device__ __forceinline__ void copyBytes(char* dst, char const* src, size_t bytes) {
+    size_t tid = blockIdx.x*(size_t)blockDim.x + threadIdx.x;
+    size_t nThreads = gridDim.x*(size_t)blockDim.x;
+    if ((((uintptr_t)dst | (uintptr_t)src | bytes) & 15) == 0) {
+      uint4* d = reinterpret_cast<uint4*>(dst);
+      uint4 const* s = reinterpret_cast<uint4 const*>(src);
+      for (size_t i = tid; i < bytes/16; i += nThreads) d[i] = s[i];
+    } else {
+      for (size_t i = tid; i < bytes; i += nThreads) dst[i] = src[i];
+    }
+  }
+
+  __global__ __launch_bounds__(SparseThreads, 1)
+  void sparsePackKernel(char* slot, char const* values, int64_t const* indices, size_t const* nnz, size_t maxNnz, size_t eltSize) {
+    size_t n = nnz ? min(*nnz, maxNnz) : maxNnz;
+    if (blockIdx.x == 0 && threadIdx.x == 0) *reinterpret_cast<uint64_t*>(slot) = n;
+    char* slotIndices = slot + NCCL_SPARSE_HEADER_BYTES;
+    char* slotValues = slotIndices + alignUp(maxNnz*sizeof(int64_t), 16);
+    copyBytes(slotIndices, reinterpret_cast<char const*>(indices), n*sizeof(int64_t));
+    copyBytes(slotValues, values, n*eltSize);
+  }
+
+  template<typename T>
+  __global__ __launch_bounds__(SparseThreads, 1)
+  void sparseAccumulateKernel(T* dst, size_t count, char const* slot, size_t maxNnz) {
+    size_t n = *reinterpret_cast<uint64_t const*>(slot);
+    int64_t const* indices = reinterpret_cast<int64_t const*>(slot + NCCL_SPARSE_HEADER_BYTES);
+    T const* values = reinterpret_cast<T const*>(slot + NCCL_SPARSE_HEADER_BYTES + alignUp(maxNnz*sizeof(int64_t), 16));
+    for (size_t k = blockIdx.x*(size_t)blockDim.x + threadIdx.x; k < n; k += gridDim.x*(size_t)blockDim.x) {
+      int64_t i = indices[k];
+      if (i < 0 || (uint64_t)i >= count) continue;
+      dst[i] = applyReduce(FuncSum<T>(), dst[i], values[k]);
+    }
+  }
+}
+
+ncclResult_t ncclLaunchSparsePack(void* slot, void const* values, int64_t const* indices, size_t const* nnz, size_t maxNnz,
+    size_t eltSize, cudaStream_t stream) {
+  dim3 grid = {(unsigned)std::min<size_t>(1024, std::max<size_t>(1, divUp(maxNnz*sizeof(int64_t), 16*SparseThreads))), 1, 1};
+  dim3 block = {SparseThreads, 1, 1};
+  void* args[6] = {&slot, &values, &indices, &nnz, &maxNnz, &eltSize};
+  CUDACHECK(cudaLaunchKernel((void const*)&sparsePackKernel, grid, block, args, 0, stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLaunchSparseAccumulate(void* dst, size_t count, void const* src, size_t slotBytes, int nSlots, size_t maxNnz,
+    ncclDataType_t type, cudaStream_t stream) {
+  void const* kernel;
+  switch (type) {
+  case ncclInt8:     kernel = (void const*)&sparseAccumulateKernel<int8_t>; break;
+  case ncclUint8:    kernel = (void const*)&sparseAccumulateKernel<uint8_t>; break;
+  case ncclInt32:    kernel = (void const*)&sparseAccumulateKernel<int32_t>; break;
+  case ncclUint32:   kernel = (void const*)&sparseAccumulateKernel<uint32_t>; break;
+  case ncclInt64:    kernel = (void const*)&sparseAccumulateKernel<int64_t>; break;
+  case ncclUint64:   kernel = (void const*)&sparseAccumulateKernel<uint64_t>; break;
+  case ncclFloat16:  kernel = (void const*)&sparseAccumulateKernel<half>; break;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16: kernel = (void const*)&sparseAccumulateKernel<__nv_bfloat16>; break;
+#endif
+#if defined(__CUDA_FP8_TYPES_EXIST__)
+  case ncclFp8E4M3: kernel = (void const*)&sparseAccumulateKernel<__nv_fp8_e4m3>; break;
+  case ncclFp8E5M2: kernel = (void const*)&sparseAccumulateKernel<__nv_fp8_e5m2>; break;
+#endif
+  case ncclFloat32:  kernel = (void const*)&sparseAccumulateKernel<float>; break;
+  case ncclFloat64:  kernel = (void const*)&sparseAccumulateKernel<double>; break;
+  default: return ncclInvalidArgument;
+  }
+  if (maxNnz == 0) return ncclSuccess;
+  dim3 grid = {(unsigned)std::min<size_t>(1024, divUp(maxNnz, SparseThreads)), 1, 1};
+  dim3 block = {SparseThreads, 1, 1};
+  // Slots are added in rank order, each by its own launch, for the same rounding everywhere
+  for (int p = 0; p < nSlots; p++) {
+    char const* slot = (char const*)src + p*slotBytes;
+    void* args[4] = {&dst, &count, &slot, &maxNnz};
+    CUDACHECK(cudaLaunchKernel(kernel, grid, block, args, 0, stream));
+  }
+  return ncclSuccess;
+}
@@ -13,19 +13,68 @@
 #include "channel.h"
 #include "cudawrap.h"
 #include "profiler.h"
+#include "greenctx.h"
+#include "lanes.h"
+#include "metrics.h"
+#include "redop.h"
+#include "simtimeline.h"
 #include "transport.h"
+#include "tuner.h"
+#include "msccl/msccl_persistent.h"
 
 #include <cstring> // std::memcpy
+#include <mutex>
 #include <cinttypes> // PRIx64
 
 NCCL_PARAM(L1SharedMemoryCarveout, "L1_SHARED_MEMORY_CARVEOUT", 0);
 
+// 0 sets the attributes of all kernels when the first comm of a device is created, 1 sets
+// them for each kernel before its first launch
+NCCL_PARAM(LazyKernelInit, "LAZY_KERNEL_INIT", 1);
+
+static std::mutex kernelInitMutex;
+// Per device, whether each kernel of ncclDevKernelList has its attributes set
+static uint8_t** kernelReady;
+static size_t* kernelMaxStackSize;
+
+static ncclResult_t initKernel(int cudaArch, int k) {
+  ncclResult_t result = ncclSuccess;
+  void* fn = ncclDevKernelList[k];
+  int carveout = ncclParamL1SharedMemoryCarveout();
+  if (fn == nullptr) return ncclSuccess;
+  if (carveout) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
+      result, ignore);
+  ignore:;
+  }
+  if (ncclShmemDynamicSize(cudaArch) != 0) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
+      result, exit);
+  }
+exit:
+  return result;
+}
+
 // Returns maximum kernel stack size of all CUDA kernels
-ncclResult_t ncclInitKernelsForDevice(int cudaArch, size_t* maxStackSize) {
+ncclResult_t ncclInitKernelsForDevice(int cudaDev, int cudaArch, size_t* maxStackSize) {
   ncclResult_t result = ncclSuccess;
+  std::lock_guard<std::mutex> lock(kernelInitMutex);
 
   if (maxStackSize) *maxStackSize = 0;
-  int carveout = ncclParamL1SharedMemoryCarveout();
+  if (kernelReady == nullptr) {
+    int nDevs;
+    CUDACHECK(cudaGetDeviceCount(&nDevs));
+    NCCLCHECK(ncclCalloc(&kernelReady, nDevs));
+    NCCLCHECK(ncclCalloc(&kernelMaxStackSize, nDevs));
+  }
+  // Later comms on the device reuse what the first one found
+  if (kernelReady[cudaDev] != nullptr) {
+    if (maxStackSize) *maxStackSize = kernelMaxStackSize[cudaDev];
+    return ncclSuccess;
+  }
+  NCCLCHECK(ncclCalloc(&kernelReady[cudaDev], ncclDevKernelCount));
 
   for (int k=0; k < ncclDevKernelCount; k++) {
     void* fn = ncclDevKernelList[k];
@@ -34,22 +83,26 @@ ncclResult_t ncclInitKernelsForDevice(int cudaArch, size_t* maxStackSize) {
     if (maxStackSize) {
       cudaFuncAttributes attr = {0};
       CUDACHECKGOTO(cudaFuncGetAttributes(&attr, fn), result, ignore0);
-      if (attr.localSizeBytes > *maxStackSize) *maxStackSize = attr.localSizeBytes;
+      if (attr.localSizeBytes > kernelMaxStackSize[cudaDev]) kernelMaxStackSize[cudaDev] = attr.localSizeBytes;
     ignore0:;
     }
-    if (carveout) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
-        result, ignore1);
-    ignore1:;
-    }
-    if (ncclShmemDynamicSize(cudaArch) != 0) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
-        result, next_kernel);
+    if (!ncclParamLazyKernelInit()) {
+      ncclResult_t res = initKernel(cudaArch, k);
+      if (res != ncclSuccess) result = res;
+      kernelReady[cudaDev][k] = 1;
     }
-  next_kernel:;
   }
+  if (maxStackSize) *maxStackSize = kernelMaxStackSize[cudaDev];
+  return result;
+}
+
+ncclResult_t ncclPrepareKernel(int cudaDev, int cudaArch, int kernelId) {
+  uint8_t* ready = kernelReady[cudaDev];
+  if (__atomic_load_n(&ready[kernelId], __ATOMIC_ACQUIRE)) return ncclSuccess;
+  std::lock_guard<std::mutex> lock(kernelInitMutex);
+  if (ready[kernelId]) return ncclSuccess;
+  ncclResult_t result = initKernel(cudaArch, kernelId);
+  __atomic_store_n(&ready[kernelId], 1, __ATOMIC_RELEASE);
   return result;
 }
 
@@ -74,6 +127,25 @@ static inline size_t ncclFuncMaxSendRecvCount(ncclFunc_t func, int nRanks, size_
   return func == ncclFuncAllGather || func == ncclFuncReduceScatter ? nRanks*count : count;
 }
 
+// Ranks a collective runs between, node steps only involve the local ranks
+static inline int ncclTaskNRanks(struct ncclComm* comm, struct ncclTaskColl* task) {
+  return task->nvlsNode ? comm->localRanks : comm->nRanks;
+}
+
+// Each channel of a collective is a CTA, the SM budget of the comm caps them
+static inline int ncclSmBudgetChannels(struct ncclComm* comm, int nChannels) {
+  return comm->config.smBudget > 0 ? std::min(nChannels, comm->config.smBudget) : nChannels;
+}
+
+// Ring and tree collectives run on the channels from collChannelBase, or on those of their lane
+static inline int ncclCollChannelBase(struct ncclComm* comm) {
+  return comm->planner.lane ? comm->planner.lane->channelBase : comm->collChannelBase;
+}
+static inline int ncclCollChannels(struct ncclComm* comm) {
+  if (comm->planner.lane) return ncclSmBudgetChannels(comm, comm->planner.lane->nChannels);
+  return ncclSmBudgetChannels(comm, comm->nChannels - comm->collChannelBase);
+}
+
 /*****************************************************************************/
 /*       Launch system : synchronization and CUDA kernel launch              */
 /*****************************************************************************/
@@ -109,6 +181,7 @@ static void addWorkBatchToPlan(
     // wipBatch.workBytes and wipBatch.nP2ps aren't reset to 0 for a new extension
     // batch further down.
     newBatch |= NCCL_MAX_DEV_WORK_BATCH_BYTES < chan->wipBatch.workBytes + workSize;
+    newBatch |= workType == ncclDevWorkTypeP2pStrided;
     if (workType == ncclDevWorkTypeP2p) {
       newBatch |= chan->wipBatch.nP2ps == NCCL_MAX_DEV_WORK_P2P_PER_BATCH;
       for (int i=0; i < chan->wipBatch.nP2ps; i++) {
@@ -143,13 +216,13 @@ static void addWorkBatchToPlan(
       chan->wipBatch.nP2ps = 0;
       // We don't count extension batches since this is used to derive a proxyOpCount,
       // and we wan't all ops which are fused together to have the same value.
-      chan->nWorkBatchesP2p += (workType == ncclDevWorkTypeP2p ? 1 : 0);
+      chan->nWorkBatchesP2p += (workType == ncclDevWorkTypeP2p || workType == ncclDevWorkTypeP2pStrided ? 1 : 0);
     }
     plan->nWorkBatches += 1;
   }
   batch->offsetBitset |= 1ull<<(offset/workSize);
   chan->wipBatch.workBytes += workSize;
-  if (workType == ncclDevWorkTypeP2p) {
+  if (workType == ncclDevWorkTypeP2p || workType == ncclDevWorkTypeP2pStrided) {
     // We need to ensure that a single batch doesn't have multiple p2p's
     // of the same round since they would use the same connections.
     chan->wipBatch.p2pRounds[chan->wipBatch.nP2ps++] = p2pRound;
@@ -174,6 +247,7 @@ static void finishPlan(struct ncclComm* comm, struct ncclKernelPlan* plan) {
   plan->kernelArgs->comm = comm->devComm;
   plan->kernelArgs->channelMask = plan->channelMask;
   plan->kernelArgs->workStorageType = plan->workStorageType;
+  plan->kernelArgs->replayId = 0;
 
   // Put batches into the kernel arguments. The first batch for each channel
   // must be located at batchZero[blockIdx.x]. To achieve this we round robin
@@ -233,6 +307,7 @@ static void finishPlan(struct ncclComm* comm, struct ncclKernelPlan* plan) {
 
 int64_t ncclParamLocalRegister();
 NCCL_PARAM(GraphRegister, "GRAPH_REGISTER", 1);
+NCCL_PARAM(NetRegColl, "NET_REG_COLL", 1);
 
 struct ncclIpcCleanupCallback {
   struct ncclCommCallback base;
@@ -277,9 +352,26 @@ static ncclResult_t registerCollBuffers(
   ncclResult_t result = ncclSuccess;
 
   info->regBufType = NCCL_REGULAR_BUFFER;
+  info->netRegUsed = false;
+  info->netRegHost = false;
   *regNeedConnect = true;
   if (!(ncclParamLocalRegister() || (comm->planner.persistent && ncclParamGraphRegister()))) goto exit;
+  // Buffer sizes below are those of the whole comm
+  if (info->nvlsNode) goto exit;
+  if (ncclParamLocalRegister() && ncclParamNetRegColl() && comm->nNodes > 1 &&
+      info->algorithm == NCCL_ALGO_RING && info->protocol == NCCL_PROTO_SIMPLE &&
+      (info->func == ncclFuncAllGather || info->func == ncclFuncBroadcast)) {
+    // Ring allgather and broadcast only send data already in recvbuff. When it is registered
+    // with the network, the proxy sends it from there instead of from the connection FIFO.
+    struct ncclReg* regRecord;
+    size_t recvbuffSize = ncclTypeSize(info->datatype)*ncclFuncRecvCount(info->func, comm->nRanks, info->count);
+    NCCLCHECK(ncclRegFind(comm, info->recvbuff, recvbuffSize, &regRecord));
+    info->netRegUsed = regRecord && regRecord->nDevs;
+    info->netRegHost = info->netRegUsed && (regRecord->state & HOST_REG_MEMORY);
+  }
 #if CUDART_VERSION >= 11030
+  // Peers and the NVLS switch cannot map pinned host memory
+  if (info->hostBytes) goto exit;
   if (info->algorithm == NCCL_ALGO_NVLS || info->algorithm == NCCL_ALGO_NVLS_TREE) {
     if (!comm->nvlsRegSupport || info->opDev.op == ncclDevPreMulSum) goto exit;
     bool regBufUsed = false;
@@ -551,90 +643,164 @@ static bool testBudget(
   return ok;
 }
 
+NCCL_PARAM(AlgoCache, "ALGO_CACHE", 1);
+
+// A collective enqueued alone is not aggregated, so its selection only depends on
+// (fn,op,ty) and its count. Tuner plugins may change their answer from one call to the next.
+static bool algoCacheUsable(struct ncclComm* comm, ncclSimInfo_t* simInfo) {
+  // Lanes and the NCCL part of an MSCCL split have fewer channels than the groups the cache was filled by
+  return comm->tuner == NULL && simInfo == NULL && ncclParamAlgoCache() && comm->planner.lane == NULL &&
+    comm->collChannelBase == 0;
+}
+
+static struct ncclAlgoCacheEntry* algoCacheSlot(struct ncclComm* comm, int fnOpTy, size_t count) {
+  uint64_t hash = (count * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)fnOpTy;
+  return &comm->algoCache[(hash ^ (hash >> 32)) % NCCL_ALGO_CACHE_SIZE];
+}
+
+static ncclResult_t prepareSingleTask(struct ncclComm* comm, struct ncclTaskColl* task, ncclSimInfo_t* simInfo) {
+  int fnOpTy = 1 + ((int)task->func*ncclNumDevRedOps + (int)task->opDev.op)*ncclNumTypes + (int)task->datatype;
+  // Entries are keyed by count only, calls on host memory are tuned every time
+  bool cacheUsable = algoCacheUsable(comm, simInfo) && task->hostBytes == 0;
+  struct ncclAlgoCacheEntry* entry = algoCacheSlot(comm, fnOpTy, task->count);
+  if (task->nvlsNode) {
+    // Hierarchical PAT asked for NVLS, which the model of the whole comm does not cover
+    task->algorithm = NCCL_ALGO_NVLS;
+    task->protocol = NCCL_PROTO_SIMPLE;
+    task->nMaxChannels = ncclSmBudgetChannels(comm, comm->nvlsChannels);
+    task->nWarps = comm->maxThreads[NCCL_ALGO_NVLS][NCCL_PROTO_SIMPLE]/WARP_SIZE;
+    task->devFuncId = ncclDevFuncId(task->func, task->opDev.op, task->datatype, task->algorithm, task->protocol);
+    task->isNvls = 1;
+    task->isCollnet = 0;
+    return ncclSuccess;
+  }
+  if (cacheUsable && entry->fnOpTy == fnOpTy && entry->count == task->count) {
+    task->algorithm = entry->algorithm;
+    task->protocol = entry->protocol;
+    task->nMaxChannels = entry->nMaxChannels;
+    task->nWarps = entry->nWarps;
+    task->devFuncId = entry->devFuncId;
+    task->isCollnet = entry->isCollnet;
+    task->isNvls = entry->isNvls;
+    return ncclSuccess;
+  }
+  int collNetSupport = 0;
+  NCCLCHECK(getCollNetSupport(comm, task, &collNetSupport));
+  int nvlsSupport = comm->nvlsSupport && (ncclNvlsSupported(task->opDev.op, task->datatype) || task->func == ncclFuncAllGather);
+  // NVLS and CollNet run on channels from 0, outside the lane
+  if (comm->planner.lane) collNetSupport = nvlsSupport = 0;
+  NCCLCHECK(getAlgoInfo(comm, task, collNetSupport, nvlsSupport, 1, simInfo));
+  task->devFuncId = ncclDevFuncId(task->func, task->opDev.op, task->datatype, task->algorithm, task->protocol);
+  task->isNvls = task->algorithm == NCCL_ALGO_NVLS || task->algorithm == NCCL_ALGO_NVLS_TREE;
+  task->isCollnet = (task->algorithm == NCCL_ALGO_NVLS && comm->nNodes > 1) ||
+    task->algorithm == NCCL_ALGO_COLLNET_CHAIN || task->algorithm == NCCL_ALGO_COLLNET_DIRECT;
+  if (cacheUsable) {
+    entry->fnOpTy = fnOpTy;
+    entry->count = task->count;
+    entry->algorithm = task->algorithm;
+    entry->protocol = task->protocol;
+    entry->nMaxChannels = task->nMaxChannels;
+    entry->nWarps = task->nWarps;
+    entry->devFuncId = task->devFuncId;
+    entry->isCollnet = task->isCollnet;
+    entry->isNvls = task->isNvls;
+  }
+  return ncclSuccess;
+}
+
 // Called once per ncclGroup to organize the user submitted tasks in
 // comm->planner so that they can be peeled off into plans.
 ncclResult_t ncclPrepareTasks(struct ncclComm* comm, bool* algoNeedConnect, bool* needConnect, ncclSimInfo_t* simInfo) {
   struct ncclKernelPlanner* planner = &comm->planner;
+  planner->lane = ncclLanesPlannerLane(comm);
   // Tasks from the sorter come out ordered size descending.
   struct ncclTaskColl* task = ncclTaskCollSorterDequeueAll(&planner->collSorter);
-  // Tasks are assembled by (fn,op,ty) size ascending.
-  struct ncclTaskColl* tasksByFnOpTy[ncclNumFuncs*ncclNumDevRedOps*ncclNumTypes];
-  memset(tasksByFnOpTy, 0, sizeof(tasksByFnOpTy));
-  int fnOpTyIndices[ncclNumFuncs*ncclNumDevRedOps*ncclNumTypes];
-  int fnOpTyCount = 0;
-
-  // Walk the size sorted tasks, binning them by (fn,op,ty).
-  while (task != nullptr) {
-    struct ncclTaskColl* next = task->next;
-    int index = ((int)task->func*ncclNumDevRedOps + (int)task->opDev.op)*ncclNumTypes + (int)task->datatype;
-    // Add to set of (fn,op,ty) indices on first occurrence
-    if (tasksByFnOpTy[index] == nullptr) fnOpTyIndices[fnOpTyCount++] = index;
-    // Add to LIFO for this (fn,op,ty)
-    task->next = tasksByFnOpTy[index];
-    tasksByFnOpTy[index] = task;
-    // Next task
-    task = next;
-  }
-
-  // Walk (fn,op,ty) bins, compute algo and proto etc. Then bin them by their
-  // scheduling constraints (collnet x nvls).
-  struct ncclIntruQueue<struct ncclTaskColl, &ncclTaskColl::next> collBins[2][2] = {};
-  for (int cursor=0; cursor < fnOpTyCount; cursor++) {
-    struct ncclTaskColl* aggBeg = tasksByFnOpTy[fnOpTyIndices[cursor]];
-    int collNetSupport = 0;
-    NCCLCHECK(getCollNetSupport(comm, aggBeg, &collNetSupport));
-    int nvlsSupport = comm->nvlsSupport && (ncclNvlsSupported(aggBeg->opDev.op, aggBeg->datatype) || aggBeg->func == ncclFuncAllGather);
-    // Crudely estimate number of tasks per channel. This is using the wrong number
-    // of channels for NVLS algos, but knowing the algo requires having this value,
-    // so either be crude our iterate until fixed point, we chose the former.
-    int nTasksPerChannel = divUp(comm->planner.nTasksColl, comm->nChannels);
-    do {
-      struct ncclTaskColl* aggEnd = aggBeg->next;
-      struct ncclTaskColl agg = *aggBeg;
-      // We aggregate operations that are within 4X size of each other.
-      while (aggEnd != nullptr && aggEnd->trafficBytes < 4*aggBeg->trafficBytes) {
-        agg.count += aggEnd->count;
-        agg.trafficBytes += aggEnd->trafficBytes;
-        aggEnd = aggEnd->next;
-      }
+  if (task != nullptr && task->next == nullptr) {
+    // Nothing to bin or aggregate
+    NCCLCHECK(prepareSingleTask(comm, task, simInfo));
+    ncclIntruQueueEnqueue(&planner->collTaskQueue, task);
+  } else {
+    // Tasks are assembled by (fn,op,ty) size ascending.
+    struct ncclTaskColl* tasksByFnOpTy[ncclNumFuncs*ncclNumDevRedOps*ncclNumTypes];
+    memset(tasksByFnOpTy, 0, sizeof(tasksByFnOpTy));
+    int fnOpTyIndices[ncclNumFuncs*ncclNumDevRedOps*ncclNumTypes];
+    int fnOpTyCount = 0;
 
-      NCCLCHECK(getAlgoInfo(comm, &agg, collNetSupport, nvlsSupport, nTasksPerChannel, simInfo));
-      agg.devFuncId = ncclDevFuncId(agg.func, agg.opDev.op, agg.datatype, agg.algorithm, agg.protocol);
+    // Walk the size sorted tasks, binning them by (fn,op,ty).
+    while (task != nullptr) {
+      struct ncclTaskColl* next = task->next;
+      int index = ((int)task->func*ncclNumDevRedOps + (int)task->opDev.op)*ncclNumTypes + (int)task->datatype;
+      // Add to set of (fn,op,ty) indices on first occurrence
+      if (tasksByFnOpTy[index] == nullptr) fnOpTyIndices[fnOpTyCount++] = index;
+      // Add to LIFO for this (fn,op,ty)
+      task->next = tasksByFnOpTy[index];
+      tasksByFnOpTy[index] = task;
+      // Next task
+      task = next;
+    }
 
-      int isCollnet=0, isNvls=0;
-      switch (agg.algorithm) {
-      case NCCL_ALGO_NVLS:
-      case NCCL_ALGO_NVLS_TREE:
-        isNvls = 1;
-        isCollnet = agg.algorithm == NCCL_ALGO_NVLS && comm->nNodes > 1;
-        break;
-      case NCCL_ALGO_COLLNET_CHAIN:
-      case NCCL_ALGO_COLLNET_DIRECT:
-        isCollnet = 1;
-        break;
-      }
-      // Update the aggregated tasks with the computed values.
+    // Walk (fn,op,ty) bins, compute algo and proto etc. Then bin them by their
+    // scheduling constraints (collnet x nvls).
+    struct ncclIntruQueue<struct ncclTaskColl, &ncclTaskColl::next> collBins[2][2] = {};
+    for (int cursor=0; cursor < fnOpTyCount; cursor++) {
+      struct ncclTaskColl* aggBeg = tasksByFnOpTy[fnOpTyIndices[cursor]];
+      int collNetSupport = 0;
+      NCCLCHECK(getCollNetSupport(comm, aggBeg, &collNetSupport));
+      int nvlsSupport = comm->nvlsSupport && (ncclNvlsSupported(aggBeg->opDev.op, aggBeg->datatype) || aggBeg->func == ncclFuncAllGather);
+      if (comm->planner.lane) collNetSupport = nvlsSupport = 0;
+      // Crudely estimate number of tasks per channel. This is using the wrong number
+      // of channels for NVLS algos, but knowing the algo requires having this value,
+      // so either be crude our iterate until fixed point, we chose the former.
+      int nTasksPerChannel = divUp(comm->planner.nTasksColl, comm->nChannels);
       do {
-        struct ncclTaskColl* next = aggBeg->next;
-        aggBeg->algorithm = agg.algorithm;
-        aggBeg->protocol = agg.protocol;
-        aggBeg->nMaxChannels = agg.nMaxChannels;
-        aggBeg->nWarps = agg.nWarps;
-        aggBeg->devFuncId = agg.devFuncId;
-        aggBeg->isCollnet = isCollnet;
-        aggBeg->isNvls = isNvls;
-        ncclIntruQueueEnqueue(&collBins[isCollnet][isNvls], aggBeg);
-        aggBeg = next;
-      } while (aggBeg != aggEnd);
-    } while (aggBeg != nullptr);
-  }
+        struct ncclTaskColl* aggEnd = aggBeg->next;
+        struct ncclTaskColl agg = *aggBeg;
+        // We aggregate operations that are within 4X size of each other.
+        while (aggEnd != nullptr && aggEnd->trafficBytes < 4*aggBeg->trafficBytes) {
+          agg.count += aggEnd->count;
+          agg.trafficBytes += aggEnd->trafficBytes;
+          agg.hostBytes += aggEnd->hostBytes;
+          aggEnd = aggEnd->next;
+        }
 
-  // Concatenate `collBins[*][*]` together into final list `planner->collTaskQueue`.
-  // Collnet is the outer dimension since that affects how we divide over the
-  // channels.
-  for (int isCollnet=0; isCollnet <= 1; isCollnet++) {
-    for (int isNvls=0; isNvls <= 1; isNvls++) {
-      ncclIntruQueueTransfer(&planner->collTaskQueue, &collBins[isCollnet][isNvls]);
+        NCCLCHECK(getAlgoInfo(comm, &agg, collNetSupport, nvlsSupport, nTasksPerChannel, simInfo));
+        agg.devFuncId = ncclDevFuncId(agg.func, agg.opDev.op, agg.datatype, agg.algorithm, agg.protocol);
+
+        int isCollnet=0, isNvls=0;
+        switch (agg.algorithm) {
+        case NCCL_ALGO_NVLS:
+        case NCCL_ALGO_NVLS_TREE:
+          isNvls = 1;
+          isCollnet = agg.algorithm == NCCL_ALGO_NVLS && comm->nNodes > 1;
+          break;
+        case NCCL_ALGO_COLLNET_CHAIN:
+        case NCCL_ALGO_COLLNET_DIRECT:
+          isCollnet = 1;
+          break;
+        }
+        // Update the aggregated tasks with the computed values.
+        do {
+          struct ncclTaskColl* next = aggBeg->next;
+          aggBeg->algorithm = agg.algorithm;
+          aggBeg->protocol = agg.protocol;
+          aggBeg->nMaxChannels = agg.nMaxChannels;
+          aggBeg->nWarps = agg.nWarps;
+          aggBeg->devFuncId = agg.devFuncId;
+          aggBeg->isCollnet = isCollnet;
+          aggBeg->isNvls = isNvls;
+          ncclIntruQueueEnqueue(&collBins[isCollnet][isNvls], aggBeg);
+          aggBeg = next;
+        } while (aggBeg != aggEnd);
+      } while (aggBeg != nullptr);
+    }
+
+    // Concatenate `collBins[*][*]` together into final list `planner->collTaskQueue`.
+    // Collnet is the outer dimension since that affects how we divide over the
+    // channels.
+    for (int isCollnet=0; isCollnet <= 1; isCollnet++) {
+      for (int isNvls=0; isNvls <= 1; isNvls++) {
+        ncclIntruQueueTransfer(&planner->collTaskQueue, &collBins[isCollnet][isNvls]);
+      }
     }
   }
 
@@ -645,6 +811,7 @@ ncclResult_t ncclPrepareTasks(struct ncclComm* comm, bool* algoNeedConnect, bool
   //    may be assigned to {collnet, nvls, standard}
   task = ncclIntruQueueHead(&planner->collTaskQueue);
   while (task != nullptr) {
+    if (simInfo == NULL) ncclMetricsColl(task->func, task->algorithm, task->protocol, task->count*ncclTypeSize(task->datatype));
     // Build a ncclDevWorkColl[Reg?] struct for each task.
     void* regBufSend[NCCL_MAX_LOCAL_RANKS];
     void* regBufRecv[NCCL_MAX_LOCAL_RANKS];
@@ -676,6 +843,7 @@ ncclResult_t ncclPrepareTasks(struct ncclComm* comm, bool* algoNeedConnect, bool
     devWork.redOpArgIsPtr = task->opDev.scalarArgIsPtr;
     devWork.oneNode = (comm->nNodes == 1);
     devWork.regUsed = task->regBufType;
+    devWork.netRegUsed = task->netRegUsed;
 
     struct ncclWorkList* workNode;
     switch (task->regBufType) {
@@ -719,8 +887,10 @@ static ncclResult_t scheduleCollTasksToPlan(
   int nPlanColls = 0;
   size_t trafficBytes[2*2] = {0, 0, 0, 0}; // [collnet][nvls]
   int nChannels[2*2] = {0, 0, 0, 0}; // [collnet][nvls]
-  int const nMaxChannels[2*2] = {comm->nChannels, comm->nvlsChannels, // [collnet][nvls]
-                                 comm->nChannels, comm->nvlsChannels};
+  int const nCollChannels = ncclCollChannels(comm);
+  int const nNvlsChannels = ncclSmBudgetChannels(comm, comm->nvlsChannels);
+  int const nMaxChannels[2*2] = {nCollChannels, nNvlsChannels, // [collnet][nvls]
+                                 nCollChannels, nNvlsChannels};
   constexpr size_t MinTrafficPerChannel = 16 << 10; // 16K traffic as minimal
   do {
     size_t workBytes = 0;
@@ -745,6 +915,7 @@ static ncclResult_t scheduleCollTasksToPlan(
   int kindPrev = -1;
   size_t trafficPerChannel = 0;
   int channelId = 0;
+  int channelBase = 0;
   size_t currentTraffic = 0;
   while (nPlanColls!=0 && !ncclIntruQueueEmpty(&planner->collTaskQueue)) {
     struct ncclTaskColl* task = ncclIntruQueueHead(&planner->collTaskQueue);
@@ -757,6 +928,8 @@ static ncclResult_t scheduleCollTasksToPlan(
       trafficPerChannel = std::max<size_t>(MinTrafficPerChannel, trafficBytes[kind]/nChannels[kind]);
       kindPrev = kind;
       channelId = 0;
+      // NVLS and CollNet connections are not used by MSCCL kernels
+      channelBase = kind == 0 ? ncclCollChannelBase(comm) : 0;
       currentTraffic = 0;
     }
 
@@ -787,7 +960,7 @@ static ncclResult_t scheduleCollTasksToPlan(
         NCCLCHECK(addProxyOpIfNeeded(comm, plan, &proxyOp));
       }
     } else { // not task->isCollnet
-      int trafficPerByte = ncclFuncTrafficPerByte(task->func, comm->nRanks);
+      int trafficPerByte = ncclFuncTrafficPerByte(task->func, ncclTaskNRanks(comm, task));
       size_t cellSize = divUp(divUp(MinTrafficPerChannel, (size_t)trafficPerByte), 16) * 16;
       int elementsPerCell = cellSize/elementSize;
       size_t cells = divUp(task->count*elementSize, cellSize);
@@ -828,15 +1001,15 @@ static ncclResult_t scheduleCollTasksToPlan(
         return ncclSuccess;
       }
 
-      devWork->channelLo = channelId;
-      devWork->channelHi = channelId + nChannels-1;
+      devWork->channelLo = channelBase + channelId;
+      devWork->channelHi = channelBase + channelId + nChannels-1;
       devWork->cbd.countLo = countLo;
       devWork->cbd.countMid = countMid;
       devWork->cbd.countHi = countHi;
 
       // calcCollChunking() uses global bytes instead of traffic which differs
       // in that allreduce isn't multiplied by 2.
-      size_t globalBytesPerElement = elementSize*ncclFuncMaxSendRecvCount(task->func, comm->nRanks, 1);
+      size_t globalBytesPerElement = elementSize*ncclFuncMaxSendRecvCount(task->func, ncclTaskNRanks(comm, task), 1);
       struct ncclProxyOp proxyOpLo, proxyOpMid, proxyOpHi;
 
       uint32_t chunkSize, directFlags=0;
@@ -886,10 +1059,11 @@ static ncclResult_t scheduleCollTasksToPlan(
         proxyOp->task.coll = task;
         proxyOp->rank = comm->rank;
         addWorkBatchToPlan(comm, plan, c, workNode->workType, task->devFuncId, plan->workBytes);
+        // Node steps do not go over the network, even on channels NVLS shares with CollNet.
         // Coverity reports "proxyOp->connection" as being possibly uninitialized.  It's hard to
         // determine if that's actually true but it's also not clear if that would be an issue.
         // coverity[uninit_use_in_call:FALSE]
-        NCCLCHECK(addProxyOpIfNeeded(comm, plan, proxyOp));
+        if (!task->nvlsNode) NCCLCHECK(addProxyOpIfNeeded(comm, plan, proxyOp));
       }
     }
 
@@ -897,6 +1071,7 @@ static ncclResult_t scheduleCollTasksToPlan(
     plan->threadPerBlock = std::max(plan->threadPerBlock, task->nWarps*WARP_SIZE);
     if (!plan->kernelSpecialized) {
       plan->kernelFn = ncclDevKernelForFunc[task->devFuncId];
+      plan->kernelId = ncclDevKernelIdForFunc[task->devFuncId];
       plan->kernelSpecialized = ncclDevKernelForFuncIsSpecialized[task->devFuncId];
     }
 
@@ -938,16 +1113,24 @@ static ncclResult_t scheduleCollTasksToPlan(
 NCCL_PARAM(P2pLLThreshold, "P2P_LL_THRESHOLD", 16384);
 NCCL_PARAM(ChunkSize, "CHUNK_SIZE", 0);
 
-// Put p2p op in plan assuming there is sizeof(ncclDevWorkBatch) in batch budget
-// and sizeof(ncclDevWorkP2p) in work budget. "sendRank" and "recvRank" must
+// How a p2p op of one round is run, before it is given a work struct in the plan
+struct ncclP2pRoundInfo {
+  struct ncclDevWorkP2p work;
+  int protocol[2]; // recv: dir=0, send: dir=1
+  int chunkSize[2];
+  struct ncclTaskP2p* p2pTasks[2];
+  bool regHost[2]; // The registered buffer is pinned host memory
+};
+
+// Fill info for the p2p op of a round. "sendRank" and "recvRank" must
 // match the corresponding values for this round of the p2p schedule (no -1's).
 // No-op's are encoded with a -1 size.
-static ncclResult_t addP2pToPlan(
+static ncclResult_t getP2pRoundInfo(
     struct ncclComm* comm, struct ncclKernelPlan* plan,
     int nChannelsMin, int nChannelsMax, int p2pRound,
     int sendRank, void* sendAddr, ssize_t sendBytes,
     int recvRank, void* recvAddr, ssize_t recvBytes,
-    struct ncclTaskP2p** p2pTasks
+    struct ncclTaskP2p** p2pTasks, struct ncclP2pRoundInfo* info
   ) {
   constexpr int connIndex = 1;
   bool selfSend = (sendRank == comm->rank);
@@ -983,6 +1166,7 @@ static ncclResult_t addP2pToPlan(
   int chunkDataSize[2];
   int chunkDataSize_u32fp8[2];
   bool registered[2] = {false, false};
+  bool regHost[2] = {false, false};
   bool ipcRegistered[2] = {false, false};
 
   for (int dir=0; dir < 2; dir++) { // 0=recv, 1=send
@@ -1012,6 +1196,7 @@ static ncclResult_t addP2pToPlan(
         struct ncclReg* regRecord;
         NCCLCHECK(ncclRegFind(comm, addrs[dir], bytes[dir], &regRecord));
         registered[dir] = regRecord && regRecord->nDevs;
+        regHost[dir] = registered[dir] && (regRecord->state & HOST_REG_MEMORY);
       }
     } else if (bytes[dir] > 0 && addrs[dir] && protocol[dir] == NCCL_PROTO_SIMPLE && !selfSend) {
       int peerRank = dir ? sendRank : recvRank;
@@ -1046,14 +1231,8 @@ static ncclResult_t addP2pToPlan(
     }
   }
 
-  struct ncclWorkList* workNode = ncclMemoryStackAllocInlineArray<ncclWorkList, ncclDevWorkP2p>(&comm->memScoped, 1);
-  workNode->workType = ncclDevWorkTypeP2p;
-  workNode->size = sizeof(struct ncclDevWorkP2p);
-  ncclIntruQueueEnqueue(&plan->workQueue, workNode);
-  uint32_t workOffset = plan->workBytes;
-  plan->workBytes += sizeof(struct ncclDevWorkP2p);
-
-  struct ncclDevWorkP2p* work = (struct ncclDevWorkP2p*)(workNode+1);
+  struct ncclDevWorkP2p* work = &info->work;
+  memset(work, 0, sizeof(*work));
   work->nP2pChannels = comm->p2pnChannels;
   work->channelBase = base;
   work->nSendChannels = nChannels[1];
@@ -1072,74 +1251,158 @@ static ncclResult_t addP2pToPlan(
   work->recvRank = recvRank;
   work->recvAddr = recvAddr;
   work->recvBytes = recvBytes==-1 ? 0 : recvBytes;
+  for (int dir=0; dir < 2; dir++) {
+    info->protocol[dir] = protocol[dir];
+    info->chunkSize[dir] = chunkSize[dir];
+    info->p2pTasks[dir] = p2pTasks[dir];
+    info->regHost[dir] = regHost[dir];
+  }
+  return ncclSuccess;
+}
 
+// Add the proxy ops of the p2p op of info to the channel running its given part.
+// The batch holding its work must already be in the plan.
+static ncclResult_t addP2pProxyOpsToPlan(
+    struct ncclComm* comm, struct ncclKernelPlan* plan, struct ncclP2pRoundInfo* info, int part, int channelId
+  ) {
+  struct ncclDevWorkP2p* work = &info->work;
   struct ncclProxyOp proxyOps[2] = {};
-  int nProxyOps = selfSend ? 0 : 2;
+  int nProxyOps = work->sendRank == comm->rank ? 0 : 2;
   for (int dir=0; dir < nProxyOps; dir++) {
     struct ncclProxyOp* op = &proxyOps[dir];
-    op->root = dir ? sendRank : recvRank;
+    op->root = dir ? work->sendRank : work->recvRank;
     op->sliceSteps = 1;
     op->chunkSteps = 1;
     op->dtype = ncclInt8;
     op->redOp = ncclSum;
-    op->protocol = protocol[dir];
+    op->protocol = info->protocol[dir];
     op->pattern = dir ? ncclPatternSend : ncclPatternRecv;
-    op->chunkSize = chunkSize[dir];
-    op->reg = registered[dir];
-    op->coll = p2pTasks[dir] ? p2pTasks[dir]->func : 0;
-    op->task.p2p = p2pTasks[dir];
+    op->chunkSize = info->chunkSize[dir];
+    op->reg = dir ? work->sendRegistered : work->recvRegistered;
+    op->regHost = info->regHost[dir];
+    op->coll = info->p2pTasks[dir] ? info->p2pTasks[dir]->func : 0;
+    op->task.p2p = info->p2pTasks[dir];
     op->rank = comm->rank;
-    // The following are modified per channel part in addWorkToChannels():
+    // The following are modified per channel part below:
     // op->buffer, op->nbytes, op->nsteps = ...;
   }
-
-  nChannelsMax = std::max(nChannels[0], nChannels[1]);
-  for (int part=0; part < nChannelsMax; part++) {
-    int channelId = ncclP2pChannelForPart(comm->p2pnChannels, base, part);
-    plan->channelMask |= uint64_t(1)<<channelId;
-    // Add batch first.
-    addWorkBatchToPlan(comm, plan, channelId, ncclDevWorkTypeP2p, ncclDevFuncId_P2p(), workOffset, p2pRound);
-    // Add proxy ops.
-    for (int dir=0; dir < nProxyOps; dir++) {
-      // Partition steps across channels.
-      int nParts = dir ? work->nSendChannels : work->nRecvChannels;
-      void* addr = dir ? work->sendAddr : work->recvAddr;
-      size_t bytes = dir ? work->sendBytes : work->recvBytes;
-
-      proxyOps[dir].recvbuff = nullptr;
-      if (nParts <= part) {
-        proxyOps[dir].nsteps = 0;
-      } else if (bytes == 0) {
+  for (int dir=0; dir < nProxyOps; dir++) {
+    // Partition steps across channels.
+    int nParts = dir ? work->nSendChannels : work->nRecvChannels;
+    void* addr = dir ? work->sendAddr : work->recvAddr;
+    size_t bytes = dir ? work->sendBytes : work->recvBytes;
+
+    proxyOps[dir].recvbuff = nullptr;
+    if (nParts <= part) {
+      proxyOps[dir].nsteps = 0;
+    } else if (bytes == 0) {
+      proxyOps[dir].nsteps = 1;
+      proxyOps[dir].nbytes = 0;
+    } else {
+      size_t chunkDataSize = u32fp8Decode(dir ? work->sendChunkSize_u32fp8 : work->recvChunkSize_u32fp8);
+      size_t partBeg, partEnd;
+      ncclP2pPartBounds(nParts, part, bytes, &partBeg, &partEnd);
+      if (proxyOps[dir].reg) {
         proxyOps[dir].nsteps = 1;
-        proxyOps[dir].nbytes = 0;
+        proxyOps[dir].recvbuff = (uint8_t*)addr+partBeg;
+        proxyOps[dir].nbytes = partEnd-partBeg;
       } else {
-        size_t chunkDataSize = u32fp8Decode(dir ? work->sendChunkSize_u32fp8 : work->recvChunkSize_u32fp8);
-        size_t partBeg, partEnd;
-        ncclP2pPartBounds(nParts, part, bytes, &partBeg, &partEnd);
-        if (proxyOps[dir].reg) {
-          proxyOps[dir].nsteps = 1;
-          proxyOps[dir].recvbuff = (uint8_t*)addr+partBeg;
-          proxyOps[dir].nbytes = partEnd-partBeg;
-        } else {
-          proxyOps[dir].nsteps = divUp(partEnd-partBeg, chunkDataSize);
-          proxyOps[dir].nbytes = std::min(partEnd-partBeg, chunkDataSize);
-        }
-        if (proxyOps[dir].protocol == NCCL_PROTO_LL) {
-          proxyOps[dir].nbytes *= 2;
-          proxyOps[dir].nbytes = roundUp(proxyOps[dir].nbytes, sizeof(union ncclLLFifoLine));
-        }
+        proxyOps[dir].nsteps = divUp(partEnd-partBeg, chunkDataSize);
+        proxyOps[dir].nbytes = std::min(partEnd-partBeg, chunkDataSize);
       }
-
-      if (proxyOps[dir].nsteps != 0) {
-        // Calculate the opCount after adding batch since then the batch count will
-        // equal one plus the batch index this p2p settled in.
-        proxyOps[dir].channelId = channelId;
-        proxyOps[dir].opCount = uint64_t(comm->planner.wipPlan.channels[channelId].nWorkBatchesP2p)<<1 | 1;
-        NCCLCHECK(addProxyOpIfNeeded(comm, plan, &proxyOps[dir]));
+      if (proxyOps[dir].protocol == NCCL_PROTO_LL) {
+        proxyOps[dir].nbytes *= 2;
+        proxyOps[dir].nbytes = roundUp(proxyOps[dir].nbytes, sizeof(union ncclLLFifoLine));
       }
     }
+
+    if (proxyOps[dir].nsteps != 0) {
+      // Calculate the opCount after adding batch since then the batch count will
+      // equal one plus the batch index this p2p settled in.
+      proxyOps[dir].channelId = channelId;
+      proxyOps[dir].opCount = uint64_t(comm->planner.wipPlan.channels[channelId].nWorkBatchesP2p)<<1 | 1;
+      NCCLCHECK(addProxyOpIfNeeded(comm, plan, &proxyOps[dir]));
+    }
   }
+  return ncclSuccess;
+}
 
+// Put the p2p op of info in plan assuming there is sizeof(ncclDevWorkBatch) per channel
+// in batch budget and sizeof(ncclDevWorkP2p) in work budget.
+static ncclResult_t addP2pToPlan(struct ncclComm* comm, struct ncclKernelPlan* plan, int p2pRound, struct ncclP2pRoundInfo* info) {
+  struct ncclWorkList* workNode = ncclMemoryStackAllocInlineArray<ncclWorkList, ncclDevWorkP2p>(&comm->memScoped, 1);
+  workNode->workType = ncclDevWorkTypeP2p;
+  workNode->size = sizeof(struct ncclDevWorkP2p);
+  ncclIntruQueueEnqueue(&plan->workQueue, workNode);
+  uint32_t workOffset = plan->workBytes;
+  plan->workBytes += sizeof(struct ncclDevWorkP2p);
+  memcpy((void*)(workNode+1), &info->work, sizeof(struct ncclDevWorkP2p));
+
+  int nChannels = std::max(info->work.nSendChannels, info->work.nRecvChannels);
+  for (int part=0; part < nChannels; part++) {
+    int channelId = ncclP2pChannelForPart(comm->p2pnChannels, info->work.channelBase, part);
+    plan->channelMask |= uint64_t(1)<<channelId;
+    // Add batch first.
+    addWorkBatchToPlan(comm, plan, channelId, ncclDevWorkTypeP2p, ncclDevFuncId_P2p(), workOffset, p2pRound);
+    NCCLCHECK(addP2pProxyOpsToPlan(comm, plan, info, part, channelId));
+  }
+  return ncclSuccess;
+}
+
+NCCL_PARAM(P2pStridedWork, "P2P_STRIDED_WORK", 1);
+
+// Whether the ops of rounds [0..n) of infos can share a strided work: same channels and settings,
+// and the slices of consecutive peers are contiguous, as in alltoall.
+static bool p2pRoundsStrided(struct ncclComm* comm, struct ncclP2pRoundInfo* infos, int n) {
+  for (int i=0; i < n; i++) {
+    struct ncclDevWorkP2p* w = &infos[i].work;
+    struct ncclDevWorkP2p* w0 = &infos[0].work;
+    if (w->sendRank == comm->rank) return false;
+    if (w->nSendChannels == 0 || w->nRecvChannels == 0 || w->nSendChannels != w->nRecvChannels) return false;
+    if (w->sendRegistered || w->recvRegistered || w->sendIpcReg || w->recvIpcReg) return false;
+    if (w->sendBytes != w0->sendBytes || w->recvBytes != w0->sendBytes || w0->sendBytes == 0) return false;
+    if (w->channelBase != w0->channelBase || w->nSendChannels != w0->nSendChannels) return false;
+    if (w->sendChunkSize_u32fp8 != w0->sendChunkSize_u32fp8 || w->recvChunkSize_u32fp8 != w0->recvChunkSize_u32fp8) return false;
+    if (w->sendProtoLL != w0->sendProtoLL || w->recvProtoLL != w0->recvProtoLL) return false;
+    size_t stride = w0->sendBytes;
+    if ((uintptr_t)w->sendAddr - w->sendRank*stride != (uintptr_t)w0->sendAddr - w0->sendRank*stride) return false;
+    if ((uintptr_t)w->recvAddr - w->recvRank*stride != (uintptr_t)w0->recvAddr - w0->recvRank*stride) return false;
+  }
+  return true;
+}
+
+// Put the p2p ops of rounds [p2pRound..p2pRound+n) in plan as one strided work, in a batch of its own
+static ncclResult_t addP2pStridedToPlan(struct ncclComm* comm, struct ncclKernelPlan* plan, int p2pRound, struct ncclP2pRoundInfo* infos, int n) {
+  struct ncclDevWorkP2p* w0 = &infos[0].work;
+  struct ncclWorkList* workNode = ncclMemoryStackAllocInlineArray<ncclWorkList, ncclDevWorkP2pStrided>(&comm->memScoped, 1);
+  workNode->workType = ncclDevWorkTypeP2pStrided;
+  workNode->size = sizeof(struct ncclDevWorkP2pStrided);
+  ncclIntruQueueEnqueue(&plan->workQueue, workNode);
+  uint32_t workOffset = plan->workBytes;
+  plan->workBytes += sizeof(struct ncclDevWorkP2pStrided);
+
+  struct ncclDevWorkP2pStrided* work = (struct ncclDevWorkP2pStrided*)(workNode+1);
+  memset(work, 0, sizeof(*work));
+  work->bytes = w0->sendBytes;
+  work->stride = w0->sendBytes;
+  work->sendAddr = (char*)w0->sendAddr - w0->sendRank*work->stride;
+  work->recvAddr = (char*)w0->recvAddr - w0->recvRank*work->stride;
+  work->roundBeg = p2pRound;
+  work->nRounds = n;
+  work->nP2pChannels = w0->nP2pChannels;
+  work->channelBase = w0->channelBase;
+  work->nChannels = w0->nSendChannels;
+  work->sendChunkSize_u32fp8 = w0->sendChunkSize_u32fp8;
+  work->recvChunkSize_u32fp8 = w0->recvChunkSize_u32fp8;
+  work->sendProtoLL = w0->sendProtoLL;
+  work->recvProtoLL = w0->recvProtoLL;
+
+  for (int part=0; part < work->nChannels; part++) {
+    int channelId = ncclP2pChannelForPart(comm->p2pnChannels, work->channelBase, part);
+    plan->channelMask |= uint64_t(1)<<channelId;
+    addWorkBatchToPlan(comm, plan, channelId, ncclDevWorkTypeP2pStrided, ncclDevFuncId_P2p(), workOffset, p2pRound);
+    for (int i=0; i < n; i++) NCCLCHECK(addP2pProxyOpsToPlan(comm, plan, &infos[i], part, channelId));
+  }
   return ncclSuccess;
 }
 
@@ -1162,6 +1425,7 @@ static ncclResult_t scheduleP2pTasksToPlan(
   plan->threadPerBlock = std::max(plan->threadPerBlock, NCCL_MAX_NTHREADS);
   if (!plan->kernelSpecialized) {
     plan->kernelFn = ncclDevKernelForFunc[ncclDevFuncId_P2p()];
+    plan->kernelId = ncclDevKernelIdForFunc[ncclDevFuncId_P2p()];
     plan->kernelSpecialized = ncclDevKernelForFuncIsSpecialized[ncclDevFuncId_P2p()];
   }
 
@@ -1190,34 +1454,64 @@ static ncclResult_t scheduleP2pTasksToPlan(
           return ncclInvalidUsage;
         }
       }
-      ssize_t sendBytes = send ? send->bytes : -1;
-      ssize_t recvBytes = recv ? recv->bytes : -1;
-      void* sendBuff = send ? send->buff : nullptr;
-      void* recvBuff = recv ? recv->buff : nullptr;
-
       if (sendRank == comm->rank && send->buff == recv->buff) {
         // Skip send to self in-place (we don't need to support this).
         ncclIntruQueueDequeue(&peers[sendRank].sendQueue);
         ncclIntruQueueDequeue(&peers[recvRank].recvQueue);
         comm->planner.nTasksP2p -= 2;
-      } else {
-        // Ensure room for worst case of one new batch per channel.
-        if (!testBudget(budget, plan->nWorkBatches+nChannelsMax, plan->workBytes + sizeof(struct ncclDevWorkP2p))) {
-          return ncclSuccess;
+        continue;
+      }
+
+      // Rounds sharing a channel base with a send and a recv of the same size to
+      // every peer (alltoall) may go in one strided work, like they would go in one batch.
+      int nRounds = 1;
+      if (ncclParamP2pStridedWork() && send != nullptr && recv != nullptr && sendRank != comm->rank && send->bytes == recv->bytes && send->bytes > 0) {
+        uint8_t base = ncclP2pChannelBaseForRound(comm, round);
+        while (nRounds < NCCL_MAX_DEV_WORK_P2P_PER_BATCH && round+nRounds < nRanks) {
+          int r = round+nRounds;
+          struct ncclTaskP2p* s = ncclIntruQueueHead(&peers[comm->p2pSchedule[r].sendRank].sendQueue);
+          struct ncclTaskP2p* q = ncclIntruQueueHead(&peers[comm->p2pSchedule[r].recvRank].recvQueue);
+          if (ncclP2pChannelBaseForRound(comm, r) != base || comm->p2pSchedule[r].sendRank == comm->rank) break;
+          if (s == nullptr || q == nullptr || s->bytes != send->bytes || q->bytes != send->bytes) break;
+          nRounds++;
         }
-        struct ncclTaskP2p* p2pTasks[2] = { recv, send };
-        NCCLCHECK(addP2pToPlan(comm, plan, nChannelsMin, nChannelsMax, round, sendRank, sendBuff, sendBytes, recvRank, recvBuff, recvBytes, p2pTasks));
-        if (send != nullptr) {
-          ncclIntruQueueDequeue(&peers[sendRank].sendQueue);
-          ncclIntruQueueEnqueue(&plan->p2pTaskQueue, send);
+      }
+
+      // Ensure room for worst case of one new batch per channel per round.
+      if (!testBudget(budget, plan->nWorkBatches+nRounds*nChannelsMax, plan->workBytes + nRounds*sizeof(struct ncclDevWorkP2p))) {
+        return ncclSuccess;
+      }
+      struct ncclP2pRoundInfo infos[NCCL_MAX_DEV_WORK_P2P_PER_BATCH];
+      for (int i=0; i < nRounds; i++) {
+        int r = round+i;
+        int sRank = comm->p2pSchedule[r].sendRank;
+        int rRank = comm->p2pSchedule[r].recvRank;
+        struct ncclTaskP2p* s = ncclIntruQueueHead(&peers[sRank].sendQueue);
+        struct ncclTaskP2p* q = ncclIntruQueueHead(&peers[rRank].recvQueue);
+        struct ncclTaskP2p* p2pTasks[2] = { q, s };
+        NCCLCHECK(getP2pRoundInfo(comm, plan, nChannelsMin, nChannelsMax, r,
+          sRank, s ? s->buff : nullptr, s ? s->bytes : -1, rRank, q ? q->buff : nullptr, q ? q->bytes : -1, p2pTasks, &infos[i]));
+      }
+      if (nRounds > 1 && p2pRoundsStrided(comm, infos, nRounds)) {
+        NCCLCHECK(addP2pStridedToPlan(comm, plan, round, infos, nRounds));
+      } else {
+        for (int i=0; i < nRounds; i++) NCCLCHECK(addP2pToPlan(comm, plan, round+i, &infos[i]));
+      }
+      for (int i=0; i < nRounds; i++) {
+        struct ncclTaskP2p* s = infos[i].p2pTasks[1];
+        struct ncclTaskP2p* q = infos[i].p2pTasks[0];
+        if (s != nullptr) {
+          ncclIntruQueueDequeue(&peers[infos[i].work.sendRank].sendQueue);
+          ncclIntruQueueEnqueue(&plan->p2pTaskQueue, s);
           comm->planner.nTasksP2p -= 1;
         }
-        if (recv != nullptr) {
-          ncclIntruQueueDequeue(&peers[recvRank].recvQueue);
-          ncclIntruQueueEnqueue(&plan->p2pTaskQueue, recv);
+        if (q != nullptr) {
+          ncclIntruQueueDequeue(&peers[infos[i].work.recvRank].recvQueue);
+          ncclIntruQueueEnqueue(&plan->p2pTaskQueue, q);
           comm->planner.nTasksP2p -= 1;
         }
       }
+      round += nRounds-1;
     }
   }
   return ncclSuccess;
@@ -1463,6 +1757,7 @@ static ncclResult_t reclaimPlan(struct ncclComm* comm, struct ncclCommCallback*
       CUDACHECK(cudaFree(plan->workBufPersistent));
       CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
     }
+    if (plan->replayId) NCCLCHECK(ncclProxyReplayUnregister(comm, plan->replayId));
     struct ncclProxyOp* q = ncclIntruQueueHead(&plan->proxyOpQueue);
     while (q != nullptr) {
       struct ncclProxyOp* q1 = q->enqNext;
@@ -1568,17 +1863,25 @@ ncclResult_t ncclLaunchPrepare(struct ncclComm* comm) {
     //   7. userStream[1...] each waits on deviceStream
     // The two-level fan-in fan-out is because ncclStrongStreamWaitStream() requires
     // at least one of the two streams to be strong-stream.
+    // With lanes, deviceStream is the strong stream of the lane of the group.
     cudaStream_t launchStream = planner->streams->stream;
-    NCCLCHECKGOTO(ncclStrongStreamAcquire(planner->capturingGraph, &comm->sharedRes->deviceStream), result, failure);
+    struct ncclStrongStream* deviceStream;
+    NCCLCHECKGOTO(ncclLanesAcquire(comm, planner->capturingGraph, &deviceStream), result, failure);
 
     // Create dependency for device stream on user streams. First from extra user
     // streams to deviceStream. Then deviceStream to first user stream.
     for (struct ncclCudaStreamList* l=planner->streams->next; l != nullptr; l = l->next) {
-      NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, &comm->sharedRes->deviceStream, l->stream), result, failure);
+      NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, deviceStream, l->stream), result, failure);
     }
-    NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, launchStream, &comm->sharedRes->deviceStream), result, failure);
+    NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, launchStream, deviceStream), result, failure);
 
-    if (persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking) {
+    if (comm->proxyReplay) {
+      // The kernels ring for their proxy ops to be posted, in the order they run, replays included
+      for (struct ncclKernelPlan* plan=planHead; plan != nullptr; plan = plan->next) {
+        if (plan->hasProxyOps) NCCLCHECKGOTO(ncclProxyReplayRegister(comm, plan, !persistent, &plan->replayId), result, failure);
+        plan->kernelArgs->replayId = plan->replayId;
+      }
+    } else if (persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking) {
       // We have to launch host tasks to push proxy args. We are careful to only
       // do this if necessary since host tasks impose a high performance cost in CUDA.
       bool acquired = false;
@@ -1626,8 +1929,9 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
   void* sym = plan->kernelFn;
   dim3 grid = {(unsigned)nChannels, 1, 1};
   dim3 block = {(unsigned)plan->threadPerBlock, 1, 1};
-  int smem = ncclShmemDynamicSize(comm->cudaArch);
-  cudaStream_t launchStream = planner->streams->stream;
+  int smem = ncclShmemDynamicSize(comm->cudaArch, plan->threadPerBlock);
+  cudaStream_t userStream = planner->streams->stream;
+  cudaStream_t launchStream;
   void* extra[] = {
     CU_LAUNCH_PARAM_BUFFER_POINTER, plan->kernelArgs,
     CU_LAUNCH_PARAM_BUFFER_SIZE, &plan->kernelArgsSize,
@@ -1635,8 +1939,23 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
   };
 
   CUfunction fn;
+  // Resident MSCCL kernels of the device may hold the SMs of this kernel, see NCCL_MSCCL_PERSISTENT
+  if (!plan->persistent) NCCLCHECK(mscclPersistentExclude(comm->cudaDev));
+  NCCLCHECK(ncclPrepareKernel(comm->cudaDev, comm->cudaArch, plan->kernelId));
   CUDACHECK(cudaGetFuncBySymbol(&fn, sym));
 
+  NCCLCHECK(ncclTunerFeedbackBeforeLaunch(comm, plan, userStream));
+  NCCLCHECK(ncclGreenCtxFork(comm, userStream, ncclCudaGraphValid(planner->capturingGraph), &launchStream));
+  #if CUDART_VERSION >= 12040
+  if (launchStream != userStream) {
+    // The function of the primary context cannot run in the green context, the kernel handle
+    // launches in the context of the stream
+    cudaKernel_t kernel;
+    CUDACHECK(cudaGetKernel(&kernel, sym));
+    fn = (CUfunction)kernel;
+  }
+  #endif
+
   #if CUDART_VERSION >= 11080
   int driverVersion;
   NCCLCHECK(ncclCudaDriverVersion(&driverVersion));
@@ -1645,7 +1964,7 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
     unsigned int clusterSize = (compCap == 90) ? comm->config.cgaClusterSize : 0;
 
     CUlaunchConfig launchConfig = {0};
-    CUlaunchAttribute launchAttrs[3];
+    CUlaunchAttribute launchAttrs[4];
     int attrs = 0;
     /* Cooperative Group Array (CGA)
      * On sm90 and later we have an extra level of hierarchy where we
@@ -1671,6 +1990,11 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
       launchAttrs[attrs].id = CU_LAUNCH_ATTRIBUTE_MEM_SYNC_DOMAIN;
       launchAttrs[attrs++].value.memSyncDomain = (CUlaunchMemSyncDomain) ncclParamMemSyncDomain();
     }
+    if (comm->config.launchPriority != 0 && driverVersion >= 12000) {
+      // Ahead of the compute kernels queued on streams of lower priority
+      launchAttrs[attrs].id = CU_LAUNCH_ATTRIBUTE_PRIORITY;
+      launchAttrs[attrs++].value.priority = comm->config.launchPriority;
+    }
     #endif
     launchConfig.gridDimX = grid.x;
     launchConfig.gridDimY = grid.y;
@@ -1685,17 +2009,33 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
 
     //CUDACHECK(cudaLaunchKernelExC(&launchConfig, fnAddr, args));
     CUCHECK(cuLaunchKernelEx(&launchConfig, fn, nullptr, extra));
+    NCCLCHECK(ncclGreenCtxJoin(comm, userStream, launchStream));
+    NCCLCHECK(ncclTunerFeedbackAfterLaunch(comm, userStream));
     return ncclSuccess;
   }
   #endif
   // Standard kernel launch
   CUCHECK(cuLaunchKernel(fn, grid.x, grid.y, grid.z, block.x, block.y, block.z, smem, launchStream, nullptr, extra));
   //CUDACHECK(cudaLaunchKernel(fnAddr, grid, block, args, smem, launchStream));
+  NCCLCHECK(ncclGreenCtxJoin(comm, userStream, launchStream));
+  NCCLCHECK(ncclTunerFeedbackAfterLaunch(comm, userStream));
   return ncclSuccess;
 }
 
 ncclResult_t ncclLaunchKernelAfter_NoCuda(struct ncclComm* comm, struct ncclKernelPlan* plan) {
-  if (!(plan->persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking)) {
+  if (comm->proxyReplay) {
+    // The proxy ops were saved by ncclLaunchPrepare(), persistent plans keep them until reclaimed
+    if (!plan->persistent) {
+      struct ncclProxyOp* op = ncclIntruQueueHead(&plan->proxyOpQueue);
+      while (op != nullptr) {
+        struct ncclProxyOp* opNext = op->enqNext;
+        ncclMemoryPoolFree(&comm->memPool_ncclProxyOp, op);
+        op = opNext;
+      }
+      ncclIntruQueueConstruct(&plan->proxyOpQueue);
+      ncclIntruQueueMpscEnqueue(&comm->callbackQueue, &plan->reclaimer);
+    }
+  } else if (!(plan->persistent || comm->persistentRefs != 0 || ncclCudaLaunchBlocking)) {
     // We are not using the host stream for proxy ops and reclaimation submission.
     NCCLCHECK(hostStreamPlanTask(comm, plan));
   } else {
@@ -1719,10 +2059,11 @@ ncclResult_t ncclLaunchFinish(struct ncclComm* comm) {
     // back to us for reclaiming via callbackQueue.
     ncclIntruQueueConstruct(&planner->planQueue);
     cudaStream_t launchStream = planner->streams->stream; // First user stream gets launch
+    struct ncclStrongStream* deviceStream = ncclLanesStream(comm);
     // Create dependency for deviceStream on launchStream. We know that deviceStream
     // hasn't been modified since launchStream waited on it (in ncclLaunchPrepare),
     // so we can say that launchStream subsumes it.
-    NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, &comm->sharedRes->deviceStream, launchStream, /*b_subsumes_a=*/true), result, resume1);
+    NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, deviceStream, launchStream, /*b_subsumes_a=*/true), result, resume1);
   resume1:
     // Create dependency for other user streams (skip launch stream) on deviceStream.
     // Again, the user streams haven't been touched since deviceStream waited on them
@@ -1730,12 +2071,12 @@ ncclResult_t ncclLaunchFinish(struct ncclComm* comm) {
     struct ncclCudaStreamList* sl = planner->streams->next;
     planner->streams = nullptr; // Reset comm->planner.streams to empty.
     while (sl != nullptr) {
-      NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, sl->stream, &comm->sharedRes->deviceStream, /*b_subsumes_a=*/true), result, resume2);
+      NCCLCHECKGOTO(ncclStrongStreamWaitStream(planner->capturingGraph, sl->stream, deviceStream, /*b_subsumes_a=*/true), result, resume2);
     resume2:
       sl = sl->next;
     }
     // Release device stream as acquired in ncclLaunchPrepare()
-    NCCLCHECKGOTO(ncclStrongStreamRelease(planner->capturingGraph, &comm->sharedRes->deviceStream), result, resume3);
+    NCCLCHECKGOTO(ncclStrongStreamRelease(planner->capturingGraph, deviceStream), result, resume3);
   resume3:;
   }
   return result;
@@ -1776,12 +2117,17 @@ static void initCollCostTable(float** collCostTable) {
 }
 
 // numPipeOps: number of pipelined ops. Can be greater than 1 in aggregation mode. Used to adjust latency.
+// GB/s between the GPU and pinned host memory, bounds the calls on registered host buffers
+NCCL_PARAM(HostBufferBw, "HOST_BUFFER_BW", 24);
+
 static ncclResult_t updateCollCostTable(
     struct ncclComm* comm, struct ncclTaskColl* info, size_t nBytes,
     int collNetSupport, int nvlsSupport, int numPipeOps,
     float** collCostTable, int* backupAlgo, int* backupProto, float* backupTime
   ) {
   float (*table)[NCCL_NUM_PROTOCOLS] = (float (*)[NCCL_NUM_PROTOCOLS])collCostTable;
+  // Host buffers are read and written over PCIe, which no algorithm can go faster than
+  float hostTime = info->hostBytes ? info->hostBytes / (1000.0f * std::max<int64_t>(1, ncclParamHostBufferBw())) : 0.0f;
 
   if (comm->nRanks == 1) {
     table[NCCL_ALGO_RING][NCCL_PROTO_SIMPLE] = 0.0;
@@ -1802,7 +2148,10 @@ static ncclResult_t updateCollCostTable(
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
       bool backup;
       float time;
+      // Connections have no buffer for it
+      if ((comm->connProtoMask & (1 << p)) == 0) continue;
       NCCLCHECK(ncclTopoGetAlgoTime(comm, info->func, a, p, nBytes, numPipeOps, &time, &backup));
+      if (time >= 0.0) time = std::max(time, hostTime);
       if (!backup) {
         table[a][p] = time;
       } else {
@@ -1820,7 +2169,7 @@ static ncclResult_t updateCollCostTable(
 
 static ncclResult_t topoGetAlgoInfo(
     struct ncclComm* comm, struct ncclTaskColl* info, size_t nBytes,
-    float** collCostTable, int backupAlgo, int backupProto, float backupTime, ncclSimInfo_t* simInfo
+    float** collCostTable, int backupAlgo, int backupProto, float backupTime, float* estimatedTime
   ) {
   float (*table)[NCCL_NUM_PROTOCOLS] = (float (*)[NCCL_NUM_PROTOCOLS])collCostTable;
 
@@ -1830,6 +2179,8 @@ static ncclResult_t topoGetAlgoInfo(
   for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
       if (table[a][p] == NCCL_ALGO_PROTO_IGNORE) continue;
+      // Tuner plugins may set entries of protocols the connections have no buffer for
+      if ((comm->connProtoMask & (1 << p)) == 0) continue;
       if (table[a][p] >= 0.0 && table[a][p] < minTime) {
         algorithm = a;
         protocol = p;
@@ -1854,10 +2205,10 @@ static ncclResult_t topoGetAlgoInfo(
     time = backupTime;
   }
   if (comm->rank == 0) INFO(NCCL_TUNING, "%s: %ld Bytes -> Algo %d proto %d time %f", ncclFuncToString(info->func), nBytes, info->algorithm, info->protocol, time);
-  if (simInfo) simInfo->estimatedTime = time;
+  if (estimatedTime) *estimatedTime = time;
   TRACE(NCCL_COLL, "%ld Bytes -> Algo %d proto %d time %f", nBytes, info->algorithm, info->protocol, time);
 
-  int nc = comm->nChannels;
+  int nc = ncclCollChannels(comm);
   int nt = comm->maxThreads[info->algorithm][info->protocol];
   int threadThreshold = comm->threadThresholds[info->algorithm][info->protocol];
   if (info->algorithm == NCCL_ALGO_COLLNET_DIRECT) {
@@ -1873,7 +2224,7 @@ static ncclResult_t topoGetAlgoInfo(
     }
   } else if (info->algorithm == NCCL_ALGO_NVLS || info->algorithm == NCCL_ALGO_NVLS_TREE) {
     // NVLS should not need more than 16 channels to get peak BW.
-    nc = comm->nvlsChannels;
+    nc = ncclSmBudgetChannels(comm, comm->nvlsChannels);
   } else {
     // Ring/Tree channel tuning
     while (nBytes < nc * nt * threadThreshold) {
@@ -1897,11 +2248,29 @@ static ncclResult_t topoGetAlgoInfo(
   nt = nt/WARP_SIZE < 3 ? 3*WARP_SIZE : nt;
   if (info->algorithm == NCCL_ALGO_TREE) nt = NCCL_MAX_NTHREADS; // Tree now uses all threads always.
   if (info->algorithm == NCCL_ALGO_PAT) nt = NCCL_MAX_NTHREADS;
+  if (comm->config.maxCTAThreads > 0) nt = std::min(nt, comm->config.maxCTAThreads);
   info->nMaxChannels = nc;
   info->nWarps = nt/WARP_SIZE;
   return ncclSuccess;
 }
 
+// The model times a collective on all the channels of the comm, the bandwidth part of it is
+// stretched to the channels it really gets.
+static ncclResult_t simRecordColl(struct ncclComm* comm, struct ncclTaskColl* info, size_t nBytes, int numPipeOps, float time) {
+  int a = info->algorithm, p = info->protocol;
+  float latTime;
+  NCCLCHECK(ncclTopoGetAlgoTime(comm, info->func, a, p, 0, numPipeOps, &latTime, NULL));
+  float linkTime = std::max(time - std::max(latTime, 0.0f), 0.0f);
+  int modelChannels = (a == NCCL_ALGO_NVLS || a == NCCL_ALGO_NVLS_TREE) ? comm->nvlsChannels : comm->nChannels;
+  if (comm->config.smBudget > 0) modelChannels = std::min(modelChannels, comm->config.smBudget);
+  if (info->nMaxChannels > 0 && info->nMaxChannels < modelChannels) {
+    time += linkTime * (modelChannels - info->nMaxChannels) / info->nMaxChannels;
+  }
+  NCCLCHECK(ncclSimTimelineRecord(comm, ncclFuncToString(info->func), nBytes, ncclAlgoStr[a], ncclProtoStr[p],
+    info->nMaxChannels, time, linkTime));
+  return ncclSuccess;
+}
+
 // Use the default topo-based tuner if tuner plugin is not successful.
 // Call the plugin first. Let it set algo+proto, and/or nChannels.
 // Then, topoGetAlgoInfo will set algo/proto if not set, then nChannels and nThreads based on algo/proto.
@@ -1926,8 +2295,10 @@ static ncclResult_t getAlgoInfo(
           numPipeOps, (float **)collCostTable, NCCL_NUM_ALGORITHMS, NCCL_NUM_PROTOCOLS,
           &nMaxChannels));
   }
-  NCCLCHECK(topoGetAlgoInfo(comm, info, nBytes, (float **)collCostTable, backupAlgo, backupProto, backupTime, simInfo));
-  info->nMaxChannels = nMaxChannels == 0 ? info->nMaxChannels : nMaxChannels;
+  float time = 0.0f;
+  NCCLCHECK(topoGetAlgoInfo(comm, info, nBytes, (float **)collCostTable, backupAlgo, backupProto, backupTime, simInfo ? &time : NULL));
+  info->nMaxChannels = nMaxChannels == 0 ? info->nMaxChannels : ncclSmBudgetChannels(comm, nMaxChannels);
+  if (simInfo) NCCLCHECK(simRecordColl(comm, info, nBytes, numPipeOps, time));
   return ncclSuccess;
 }
 
@@ -2027,7 +2398,7 @@ static ncclResult_t calcCollChunking(
     while (nBytes / (nChannels * chunkSize) < comm->channels[0].collnetChain.depth && chunkSize > 32768) chunkSize /= 2;
   } else if (info->algorithm == NCCL_ALGO_NVLS) {
     int maxChunkSize = comm->nvlsChunkSize;
-    if (comm->nNodes > 1 && comm->bandwidths[ncclFuncAllReduce][NCCL_ALGO_NVLS][NCCL_PROTO_SIMPLE] < 150) maxChunkSize = 32768;
+    if (comm->nNodes > 1 && !info->nvlsNode && comm->bandwidths[ncclFuncAllReduce][NCCL_ALGO_NVLS][NCCL_PROTO_SIMPLE] < 150) maxChunkSize = 32768;
     if (chunkSize > maxChunkSize) chunkSize = maxChunkSize;
     // Use uint64_t so that concurrentOps*chunkSize*X does not overflow.
     // However, nChannels * comm->channels[0].nvls.nHeads should easily fit in 32 bits.
@@ -2107,6 +2478,12 @@ static ncclResult_t calcCollChunking(
   } else {
     proxyOp->reg = 0;
   }
+  if (info->netRegUsed) {
+    proxyOp->netRegSend = 1;
+    proxyOp->regHost = info->netRegHost;
+    proxyOp->sendbuff = (uint8_t*)info->recvbuff;
+    proxyOp->netRegBytes = ncclTypeSize(info->datatype)*ncclFuncRecvCount(info->func, comm->nRanks, info->count);
+  }
 
   if (pattern == ncclPatternCollnetDirect) {
     proxyOp->specifics.collnetDirect.nNodes = comm->nNodes;
@@ -2124,7 +2501,19 @@ static ncclResult_t calcCollChunking(
   return ncclSuccess;
 }
 
-static ncclResult_t hostToDevRedOp(
+// Round sums of half and bfloat16 stochastically, so that long chains of partial sums stay unbiased
+NCCL_PARAM(SumStochasticRounding, "SUM_STOCHASTIC_ROUNDING", 0);
+
+uint64_t ncclRedOpRoundingArg(ncclDataType_t datatype) {
+  if (!ncclParamSumStochasticRounding()) return 0;
+  if (datatype == ncclFloat16) return NCCL_REDOP_ARG_STOCHASTIC;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  if (datatype == ncclBfloat16) return NCCL_REDOP_ARG_STOCHASTIC;
+#endif
+  return 0;
+}
+
+ncclResult_t ncclHostToDevRedOp(
     ncclDevRedOpFull *opFull, ncclRedOp_t op, ncclDataType_t datatype, ncclComm *comm
   ) {
   union {
@@ -2151,7 +2540,10 @@ static ncclResult_t hostToDevRedOp(
   uint64_t signBit = allBits^(allBits>>1);
 
   switch (int(op)) {
-  case ncclSum:  opFull->op = ncclDevSum;  break;
+  case ncclSum:
+    opFull->op = ncclDevSum;
+    opFull->scalarArg = ncclRedOpRoundingArg(datatype);
+    break;
   case ncclProd: opFull->op = ncclDevProd; break;
   case ncclMin:
   case ncclMax:
@@ -2201,7 +2593,7 @@ static ncclResult_t hostToDevRedOp(
       break;
     }
     opFull->scalarArgIsPtr = false;
-    opFull->scalarArg = u64;
+    opFull->scalarArg = u64 | ncclRedOpRoundingArg(datatype);
     break;
   default: // user created
     int ix = int(ncclUserRedOpMangle(comm, op)) - int(ncclNumOps);
@@ -2255,12 +2647,14 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo* info) {
         for (int c=0; c < comm->p2pnChannelsPerPeer; c++) {
           int channelId = ncclP2pChannelForPart(comm->p2pnChannels, base, c);
           if (isSendNotRecv) {
-            if (comm->channels[channelId].peers[peer]->send[1].connected == 0) { // P2P uses only 1 connector
+            struct ncclChannelPeer* channelPeer = comm->channels[channelId].peers[peer];
+            if (channelPeer == NULL || channelPeer->send[1].connected == 0) { // P2P uses only 1 connector
               comm->connectSend[peer] |= (1UL<<channelId);
               ncclGroupCommPreconnect(comm);
             }
           } else {
-            if (comm->channels[channelId].peers[peer]->recv[1].connected == 0) { // P2P uses only 1 connector
+            struct ncclChannelPeer* channelPeer = comm->channels[channelId].peers[peer];
+            if (channelPeer == NULL || channelPeer->recv[1].connected == 0) { // P2P uses only 1 connector
               comm->connectRecv[peer] |= (1UL<<channelId);
               ncclGroupCommPreconnect(comm);
             }
@@ -2275,7 +2669,7 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo* info) {
     // Copy reduction op state from op handle into info struct here since the
     // op handle may be destroyed before ncclGroupEnd().
     struct ncclDevRedOpFull opDev;
-    NCCLCHECK(hostToDevRedOp(&opDev, info->op, info->datatype, comm));
+    NCCLCHECK(ncclHostToDevRedOp(&opDev, info->op, info->datatype, comm));
 
     if (comm->nRanks == 1) {
       NCCLCHECK(ncclLaunchOneRank(info->recvbuff, info->sendbuff, info->count, opDev, info->datatype, info->stream));
@@ -2290,13 +2684,23 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo* info) {
       t->count = info->count;
       t->root = info->root;
       t->datatype = info->datatype;
+      t->nvlsNode = info->nvlsNode;
       size_t elementSize = ncclTypeSize(t->datatype);
+      if (comm->regCache.population > 0 && !t->nvlsNode) {
+        struct ncclReg* reg;
+        size_t sendBytes = elementSize*ncclFuncSendCount(t->func, comm->nRanks, t->count);
+        size_t recvBytes = elementSize*ncclFuncRecvCount(t->func, comm->nRanks, t->count);
+        NCCLCHECK(ncclRegFind(comm, t->sendbuff, sendBytes, &reg));
+        if (reg && (reg->state & HOST_REG_MEMORY)) t->hostBytes += sendBytes;
+        NCCLCHECK(ncclRegFind(comm, t->recvbuff, recvBytes, &reg));
+        if (reg && (reg->state & HOST_REG_MEMORY)) t->hostBytes += recvBytes;
+      }
       if (t->func == ncclFuncAllGather || t->func == ncclFuncBroadcast) {
         t->count *= elementSize;
         t->datatype = ncclInt8;
         elementSize = 1;
       }
-      t->trafficBytes = t->count*elementSize*ncclFuncTrafficPerByte(t->func, comm->nRanks);
+      t->trafficBytes = t->count*elementSize*ncclFuncTrafficPerByte(t->func, ncclTaskNRanks(comm, t));
       t->opHost = info->op;
       t->opDev = opDev; // C++ struct assignment
       t->chunkSteps = info->chunkSteps;
@@ -2335,6 +2739,8 @@ static ncclResult_t taskAppend(struct ncclComm* comm, struct ncclInfo* info) {
 }
 
 ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
+  bool defer = false;
+  NCCLCHECK(ncclGroupImplicitCheck(info, &defer));
   NCCLCHECK(ncclGroupStartInternal());
   ncclResult_t ret = ncclSuccess;
   int devOld = -1;
@@ -2359,7 +2765,11 @@ ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
 exit:
   if (devOld != -1) CUDACHECK(cudaSetDevice(devOld));
   ncclGroupErrCheck(ret);
-  NCCLCHECK(ncclGroupEndInternal());
+  if (defer && ret == ncclSuccess) {
+    NCCLCHECK(ncclGroupImplicitDefer());
+  } else {
+    NCCLCHECK(ncclGroupEndInternal());
+  }
   /* if depth is 1, ncclGroupEndInternal() will trigger group ops. The state can change
    * so we have to check state here. */
   if (info->comm && !info->comm->config.blocking) { NCCLCHECK(ncclCommGetAsyncError(info->comm, &ret)); }
@@ -2369,12 +2779,7 @@ fail:
   goto exit;
 }
 
-NCCL_API(ncclResult_t, ncclRedOpCreatePreMulSum, ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm);
-ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm) {
-  NCCLCHECK(CommCheck(comm, "ncclRedOpCreatePreMulSum", "comm"));
-  /* join init thread before creating PreMulSum op. */
-  NCCLCHECK(ncclCommEnsureReady(comm));
-
+static int userRedOpAlloc(struct ncclComm* comm) {
   if (comm->userRedOpFreeHead == comm->userRedOpCapacity) {
     // double capacity and resize
     int cap = 2*comm->userRedOpCapacity;
@@ -2390,11 +2795,21 @@ ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataTyp
   }
   // pop from free list
   int ix = comm->userRedOpFreeHead;
-  ncclUserRedOp *user = &comm->userRedOps[ix];
-  comm->userRedOpFreeHead = user->freeNext;
+  comm->userRedOpFreeHead = comm->userRedOps[ix].freeNext;
+  comm->userRedOps[ix].freeNext = -1; // allocated
+  return ix;
+}
+
+NCCL_API(ncclResult_t, ncclRedOpCreatePreMulSum, ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm);
+ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataType_t datatype, ncclScalarResidence_t residence, ncclComm_t comm) {
+  NCCLCHECK(CommCheck(comm, "ncclRedOpCreatePreMulSum", "comm"));
+  /* join init thread before creating PreMulSum op. */
+  NCCLCHECK(ncclCommEnsureReady(comm));
 
-  user->freeNext = -1; // allocated
+  int ix = userRedOpAlloc(comm);
+  ncclUserRedOp *user = &comm->userRedOps[ix];
   user->datatype = datatype;
+  user->custom = NULL;
   user->opFull.op = ncclDevPreMulSum;
   if (residence == ncclScalarHostImmediate) {
     int size = ncclTypeSize(datatype);
@@ -2411,6 +2826,32 @@ ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t *op, void *scalar, ncclDataTyp
   return ncclSuccess;
 }
 
+NCCL_API(ncclResult_t, ncclRedOpCreateCustom, ncclRedOp_t *op, const void *image, const char *funcName, ncclDataType_t datatype, ncclComm_t comm);
+ncclResult_t ncclRedOpCreateCustom(ncclRedOp_t *op, const void *image, const char *funcName, ncclDataType_t datatype, ncclComm_t comm) {
+  NCCLCHECK(CommCheck(comm, "ncclRedOpCreateCustom", "comm"));
+  NCCLCHECK(PtrCheck(op, "ncclRedOpCreateCustom", "op"));
+  NCCLCHECK(PtrCheck(image, "ncclRedOpCreateCustom", "image"));
+  NCCLCHECK(PtrCheck((void*)funcName, "ncclRedOpCreateCustom", "funcName"));
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("ncclRedOpCreateCustom : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  NCCLCHECK(ncclCommEnsureReady(comm));
+
+  struct ncclCustomRedOp* custom;
+  NCCLCHECK(ncclCustomRedOpLoad(comm, image, funcName, datatype, &custom));
+  int ix = userRedOpAlloc(comm);
+  ncclUserRedOp *user = &comm->userRedOps[ix];
+  user->datatype = datatype;
+  user->custom = custom;
+  // Never reaches the device, the collectives of custom operators are run by ncclCustomReduceRun
+  std::memset(&user->opFull, 0, sizeof(user->opFull));
+  *op = ncclRedOp_t(int(ncclNumOps) + ix);
+  *op = ncclUserRedOpMangle(comm, *op);
+  TRACE_CALL("ncclRedOpCreateCustom(%d,%p,%s,%d,%p)", *op, image, funcName, datatype, comm);
+  return ncclSuccess;
+}
+
 NCCL_API(ncclResult_t, ncclRedOpDestroy, ncclRedOp_t op, ncclComm_t comm);
 ncclResult_t ncclRedOpDestroy(ncclRedOp_t op, ncclComm_t comm) {
   if (0 <= int(op) && int(op) < int(ncclNumOps)) {
@@ -2435,6 +2876,8 @@ ncclResult_t ncclRedOpDestroy(ncclRedOp_t op, ncclComm_t comm) {
     WARN("ncclRedOpDestroy : operator unknown to this communicator.");
     return ncclInvalidArgument;
   }
+  NCCLCHECK(ncclCustomRedOpFree(comm->userRedOps[ix].custom));
+  comm->userRedOps[ix].custom = NULL;
   // push to free list
   comm->userRedOps[ix].freeNext = comm->userRedOpFreeHead;
   comm->userRedOpFreeHead = ix;
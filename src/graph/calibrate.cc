@@ -0,0 +1,267 @@
+/*************************************************************************
+ * Copyright (c) 2016-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "comm.h"
+#include "graph.h"
+#include "bootstrap.h"
+#include "collectives.h"
+#include "enqueue.h"
+#include "info.h"
+#include <errno.h>
+
+// Replace the AllReduce model with latencies and bandwidths measured on the real channels
+NCCL_PARAM(TuningCalibrate, "TUNING_CALIBRATE", 0);
+NCCL_PARAM(TuningCalibrateMaxBytes, "TUNING_CALIBRATE_MAX_BYTES", 64 << 20);
+NCCL_PARAM(TuningCalibrateIters, "TUNING_CALIBRATE_ITERS", 10);
+NCCL_PARAM(TuningCalibrateWarmupIters, "TUNING_CALIBRATE_WARMUP_ITERS", 3);
+
+#define NCCL_CALIBRATE_MIN_BYTES 4096
+#define NCCL_CALIBRATE_MAX_SIZES 16
+#define NCCL_CALIBRATE_DEFAULT_CACHE_DIR "/tmp"
+
+struct ncclCalibration {
+  int valid;
+  float latencies[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+  float bandwidths[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+};
+
+// Everything the model tables are computed from shows up in the tables themselves
+static uint64_t calibrateTopoHash(struct ncclComm* comm) {
+  struct {
+    int version, nRanks, nNodes, maxLocalRanks, cudaArch, nChannels, collNetSupport, nvlsSupport;
+    int64_t maxBytes;
+    float latencies[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+    float bandwidths[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+    float ringbdw[NCCL_NUM_PROTOCOLS];
+  } key;
+  memset(&key, 0, sizeof(key));
+  key.version = NCCL_VERSION_CODE;
+  key.nRanks = comm->nRanks;
+  key.nNodes = comm->nNodes;
+  key.maxLocalRanks = comm->maxLocalRanks;
+  key.cudaArch = comm->cudaArch;
+  key.nChannels = comm->nChannels;
+  key.collNetSupport = comm->collNetSupport;
+  key.nvlsSupport = comm->nvlsSupport;
+  key.maxBytes = ncclParamTuningCalibrateMaxBytes();
+  memcpy(key.latencies, comm->latencies[ncclFuncAllReduce], sizeof(key.latencies));
+  memcpy(key.bandwidths, comm->bandwidths[ncclFuncAllReduce], sizeof(key.bandwidths));
+  memcpy(key.ringbdw, comm->ringbdw[ncclFuncAllReduce], sizeof(key.ringbdw));
+  return getHash((const char*)&key, sizeof(key));
+}
+
+static void calibrateCachePath(struct ncclComm* comm, char* path, size_t len) {
+  const char* dir = ncclGetEnv("NCCL_TUNING_CALIBRATE_CACHE_DIR");
+  if (dir == NULL) dir = NCCL_CALIBRATE_DEFAULT_CACHE_DIR;
+  if (dir[0] == '\0') {
+    path[0] = '\0';
+    return;
+  }
+  snprintf(path, len, "%s/nccl-tuning-%016lx.txt", dir, calibrateTopoHash(comm));
+}
+
+static int calibrateFind(const char* name, const char* names[], int n) {
+  for (int i=0; i<n; i++) if (strcmp(name, names[i]) == 0) return i;
+  return -1;
+}
+
+// One "<algo> <proto> <latency> <bandwidth>" line per measured entry
+static void calibrateCacheLoad(const char* path, struct ncclCalibration* calib) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    char algo[32], proto[32];
+    float lat, bw;
+    if (line[0] == '#' || sscanf(line, "%31s %31s %f %f", algo, proto, &lat, &bw) != 4) continue;
+    int a = calibrateFind(algo, ncclAlgoStr, NCCL_NUM_ALGORITHMS);
+    int p = calibrateFind(proto, ncclProtoStr, NCCL_NUM_PROTOCOLS);
+    if (a < 0 || p < 0 || lat < 0 || bw <= 0) continue;
+    calib->latencies[a][p] = lat;
+    calib->bandwidths[a][p] = bw;
+    calib->valid = 1;
+  }
+  fclose(file);
+}
+
+static void calibrateCacheStore(const char* path, struct ncclComm* comm, struct ncclCalibration* calib) {
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+  FILE* file = fopen(tmpPath, "w");
+  if (file == NULL) {
+    INFO(NCCL_TUNING, "Unable to write tuning calibration to %s : %s", tmpPath, strerror(errno));
+    return;
+  }
+  fprintf(file, "# NCCL %d AllReduce calibration, %d ranks %d nodes: algo proto latency(us) bandwidth(GB/s)\n",
+      NCCL_VERSION_CODE, comm->nRanks, comm->nNodes);
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if (calib->bandwidths[a][p] > 0) fprintf(file, "%s %s %f %f\n", ncclAlgoStr[a], ncclProtoStr[p], calib->latencies[a][p], calib->bandwidths[a][p]);
+    }
+  }
+  fclose(file);
+  // Concurrent inits of the same topology each write a whole file
+  if (rename(tmpPath, path) != 0) {
+    INFO(NCCL_TUNING, "Unable to write tuning calibration to %s : %s", path, strerror(errno));
+    unlink(tmpPath);
+  }
+}
+
+// Same filter as updateCollCostTable, for a float sum
+static bool calibrateAlgoSupported(struct ncclComm* comm, int a) {
+  bool collNet = comm->collNetSupport && comm->collNetSupportMatrix[ncclSum][ncclFloat];
+  if ((a == NCCL_ALGO_COLLNET_DIRECT || a == NCCL_ALGO_COLLNET_CHAIN) && !collNet) return false;
+  if (a == NCCL_ALGO_COLLNET_DIRECT && comm->maxLocalRanks > NCCL_MAX_DIRECT_ARITY+1) return false;
+  if ((a == NCCL_ALGO_NVLS || a == NCCL_ALGO_NVLS_TREE) && !comm->nvlsSupport) return false;
+  if (a == NCCL_ALGO_NVLS && !collNet && comm->nNodes > 1) return false;
+  return true;
+}
+
+// Mean time of an AllReduce in us on this rank
+static ncclResult_t calibrateTime(struct ncclComm* comm, void* sendBuff, void* recvBuff, size_t count, cudaStream_t stream, cudaEvent_t events[2], float* time) {
+  const int iters = std::max((int)ncclParamTuningCalibrateIters(), 1);
+  struct ncclInfo info = { ncclFuncAllReduce, "AllReduce",
+    sendBuff, recvBuff, count, ncclFloat, ncclSum, 0, comm, stream, /* Args */
+    ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+  for (int i=0; i<ncclParamTuningCalibrateWarmupIters(); i++) NCCLCHECK(ncclEnqueueCheck(&info));
+  CUDACHECK(cudaEventRecord(events[0], stream));
+  for (int i=0; i<iters; i++) NCCLCHECK(ncclEnqueueCheck(&info));
+  CUDACHECK(cudaEventRecord(events[1], stream));
+  CUDACHECK(cudaEventSynchronize(events[1]));
+  float ms;
+  CUDACHECK(cudaEventElapsedTime(&ms, events[0], events[1]));
+  *time = ms * 1000.0f / iters;
+  return ncclSuccess;
+}
+
+// Fit of time = latency + nBytes / (1000 * bandwidth), weighted so that each size counts for its
+// relative error and small sizes still pin the latency down
+static void calibrateFit(const int64_t* sizes, const float* times, int n, float* latency, float* bandwidth) {
+  double sw = 0.0, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (int i=0; i<n; i++) {
+    if (times[i] <= 0) continue;
+    double x = sizes[i], y = times[i], w = 1.0 / (y * y);
+    sw += w; sx += w * x; sy += w * y; sxx += w * x * x; sxy += w * x * y;
+  }
+  double det = sw * sxx - sx * sx;
+  double slope = det > 0.0 ? (sw * sxy - sx * sy) / det : 0.0;
+  *latency = sw > 0.0 ? std::max(0.0, (sy - slope * sx) / sw) : 0.0f;
+  *bandwidth = slope > 0.0 ? 1.0 / (1000.0 * slope) : 0.0f;
+}
+
+static ncclResult_t calibrateRun(struct ncclComm* comm, struct ncclCalibration* calib) {
+  ncclResult_t ret = ncclSuccess;
+  const int64_t maxBytes = std::max((int64_t)ncclParamTuningCalibrateMaxBytes(), (int64_t)NCCL_CALIBRATE_MIN_BYTES);
+  int64_t sizes[NCCL_CALIBRATE_MAX_SIZES];
+  int nSizes = 0;
+  for (int64_t nBytes = NCCL_CALIBRATE_MIN_BYTES; nBytes <= maxBytes && nSizes < NCCL_CALIBRATE_MAX_SIZES; nBytes *= 4) sizes[nSizes++] = nBytes;
+
+  float savedBw[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+  float savedRingBw[NCCL_NUM_PROTOCOLS];
+  float* times = NULL;
+  float* allTimes = NULL;
+  const int nTimes = NCCL_NUM_ALGORITHMS*NCCL_NUM_PROTOCOLS*NCCL_CALIBRATE_MAX_SIZES;
+  cudaStream_t stream = NULL;
+  cudaEvent_t events[2] = { NULL, NULL };
+  char* sendBuff = NULL;
+  char* recvBuff = NULL;
+  memcpy(savedBw, comm->bandwidths[ncclFuncAllReduce], sizeof(savedBw));
+  memcpy(savedRingBw, comm->ringbdw[ncclFuncAllReduce], sizeof(savedRingBw));
+
+  NCCLCHECKGOTO(ncclCalloc(&times, nTimes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&allTimes, nTimes*comm->nRanks), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&sendBuff, maxBytes), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&recvBuff, maxBytes), ret, exit);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[0]), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[1]), ret, exit);
+
+  // Leaving a single entry in the table forces the selection onto it. All ranks go through the
+  // same entries since the tables and supports are the same on all of them.
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    if (!calibrateAlgoSupported(comm, a)) continue;
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if (savedBw[a][p] == 0) continue;
+      memset(comm->bandwidths[ncclFuncAllReduce], 0, sizeof(savedBw));
+      memset(comm->ringbdw[ncclFuncAllReduce], 0, sizeof(savedRingBw));
+      comm->bandwidths[ncclFuncAllReduce][a][p] = savedBw[a][p];
+      ncclAlgoCacheClear(comm);
+      for (int s=0; s<nSizes; s++) {
+        NCCLCHECKGOTO(calibrateTime(comm, sendBuff, recvBuff, sizes[s]/sizeof(float), stream, events,
+              times+(a*NCCL_NUM_PROTOCOLS+p)*NCCL_CALIBRATE_MAX_SIZES+s), ret, exit);
+      }
+    }
+  }
+
+  // A collective is as slow as its slowest rank, and all ranks need the same tables
+  memcpy(allTimes+comm->rank*nTimes, times, nTimes*sizeof(float));
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allTimes, nTimes*sizeof(float)), ret, exit);
+  for (int r=0; r<comm->nRanks; r++) {
+    for (int i=0; i<nTimes; i++) times[i] = std::max(times[i], allTimes[r*nTimes+i]);
+  }
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      const float* t = times+(a*NCCL_NUM_PROTOCOLS+p)*NCCL_CALIBRATE_MAX_SIZES;
+      for (int s=0; s<nSizes; s++) {
+        if (t[s] > 0) TRACE(NCCL_TUNING, "Calibration %s/%s %ld bytes %f us", ncclAlgoStr[a], ncclProtoStr[p], sizes[s], t[s]);
+      }
+      calibrateFit(sizes, t, nSizes, &calib->latencies[a][p], &calib->bandwidths[a][p]);
+      if (calib->bandwidths[a][p] > 0) calib->valid = 1;
+    }
+  }
+
+exit:
+  memcpy(comm->bandwidths[ncclFuncAllReduce], savedBw, sizeof(savedBw));
+  memcpy(comm->ringbdw[ncclFuncAllReduce], savedRingBw, sizeof(savedRingBw));
+  ncclAlgoCacheClear(comm);
+  if (events[0]) cudaEventDestroy(events[0]);
+  if (events[1]) cudaEventDestroy(events[1]);
+  if (stream) cudaStreamDestroy(stream);
+  if (sendBuff) ncclCudaFree(sendBuff);
+  if (recvBuff) ncclCudaFree(recvBuff);
+  free(times);
+  free(allTimes);
+  return ret;
+}
+
+ncclResult_t ncclTopoCalibrateModel(struct ncclComm* comm) {
+  if (ncclParamTuningCalibrate() == 0 || comm->nRanks == 1) return ncclSuccess;
+  // Nonblocking communicators cannot take collectives before their init returns
+  if (!comm->config.blocking) {
+    INFO(NCCL_INIT|NCCL_TUNING, "Tuning calibration skipped on nonblocking communicator %p", comm);
+    return ncclSuccess;
+  }
+
+  struct ncclCalibration calib;
+  memset(&calib, 0, sizeof(calib));
+  char path[PATH_MAX];
+  calibrateCachePath(comm, path, sizeof(path));
+  // Rank 0 decides for all ranks, whose caches may be on other nodes
+  if (comm->rank == 0 && path[0] != '\0') calibrateCacheLoad(path, &calib);
+  NCCLCHECK(bootstrapBroadcast(comm->bootstrap, comm->rank, comm->nRanks, 0, &calib, sizeof(calib)));
+  bool cached = calib.valid;
+  if (!cached) {
+    uint64_t start = clockNano();
+    NCCLCHECK(calibrateRun(comm, &calib));
+    INFO(NCCL_INIT|NCCL_TUNING, "Tuning calibration took %.2f ms", (clockNano()-start)/1e6);
+    if (comm->rank == 0 && path[0] != '\0' && calib.valid) calibrateCacheStore(path, comm, &calib);
+  }
+
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if (calib.bandwidths[a][p] <= 0 || comm->bandwidths[ncclFuncAllReduce][a][p] == 0) continue;
+      if (comm->rank == 0) INFO(NCCL_TUNING, "AllReduce %s/%s model %.1f/%.1f calibrated %.1f/%.1f", ncclAlgoStr[a], ncclProtoStr[p],
+          comm->latencies[ncclFuncAllReduce][a][p], comm->bandwidths[ncclFuncAllReduce][a][p], calib.latencies[a][p], calib.bandwidths[a][p]);
+      comm->latencies[ncclFuncAllReduce][a][p] = calib.latencies[a][p];
+      comm->bandwidths[ncclFuncAllReduce][a][p] = calib.bandwidths[a][p];
+      comm->tuningCalibrated = true;
+    }
+  }
+  ncclAlgoCacheClear(comm);
+  if (comm->rank == 0) INFO(NCCL_INIT|NCCL_TUNING, "Tuning calibration %s %s", cached ? "loaded from" : "measured", path[0] ? path : "(not cached)");
+  return ncclSuccess;
+}
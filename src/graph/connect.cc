@@ -136,6 +136,31 @@ static ncclResult_t setTreeDown(struct ncclTree* tree, int* indexes, int d) {
   return ncclSuccess;
 }
 
+// Children per node of the inter-node trees built over leaf switches, the kernels take at most 2
+NCCL_PARAM(TreeArity, "TREE_ARITY", 2);
+
+// Leaf switch of every node, as an index of the first node under the same leaf. NULL unless every
+// node knows its leaf and they are not all under the same one.
+static ncclResult_t getNodeLeaves(struct ncclComm* comm, int** nodeLeaf) {
+  int nNodes = comm->nNodes;
+  bool spread = false;
+  *nodeLeaf = NULL;
+  for (int n = 0; n < nNodes; n++) {
+    uint64_t leaf = comm->peerInfo[comm->nodeRanks[n].localRankToRank[0]].fabricLeafHash;
+    if (leaf == 0) return ncclSuccess;
+    if (leaf != comm->peerInfo[comm->nodeRanks[0].localRankToRank[0]].fabricLeafHash) spread = true;
+  }
+  if (!spread) return ncclSuccess;
+  NCCLCHECK(ncclCalloc(nodeLeaf, nNodes));
+  for (int n = 0; n < nNodes; n++) {
+    uint64_t leaf = comm->peerInfo[comm->nodeRanks[n].localRankToRank[0]].fabricLeafHash;
+    int first = 0;
+    while (comm->peerInfo[comm->nodeRanks[first].localRankToRank[0]].fabricLeafHash != leaf) first++;
+    (*nodeLeaf)[n] = first;
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t connectTrees(struct ncclComm* comm, int* treeToParent, int* treeToChild0, int* treeToChild1, int* treePatterns) {
   const int nChannels = comm->nChannels, nNodes = comm->nNodes, node = comm->node;
 
@@ -145,7 +170,20 @@ static ncclResult_t connectTrees(struct ncclComm* comm, int* treeToParent, int*
 
   int t0u, t0d0, t0d1, t0ChildType, t1u, t1d0, t1d1, t1ChildType;
   int* ttp, *ttc0, *ttc1;
-  NCCLCHECK(ncclGetDtree(nNodes, node, &t0u, &t0d0, &t0d1, &t0ChildType, &t1u, &t1d0, &t1d1, &t1ChildType));
+  int* nodeLeaf;
+  NCCLCHECK(getNodeLeaves(comm, &nodeLeaf));
+  if (nodeLeaf) {
+    int arity = std::min(std::max((int)ncclParamTreeArity(), 1), NCCL_MAX_TREE_ARITY-1);
+    int interDepth;
+    ncclResult_t ret = ncclGetFabricDtree(nNodes, node, nodeLeaf, arity, &interDepth,
+      &t0u, &t0d0, &t0d1, &t0ChildType, &t1u, &t1d0, &t1d1, &t1ChildType);
+    free(nodeLeaf);
+    NCCLCHECK(ret);
+    depth = comm->nRanks/nNodes - 1 + interDepth;
+    INFO(NCCL_GRAPH, "Trees keep nodes of a leaf switch together, arity %d depth %d", arity, depth);
+  } else {
+    NCCLCHECK(ncclGetDtree(nNodes, node, &t0u, &t0d0, &t0d1, &t0ChildType, &t1u, &t1d0, &t1d1, &t1ChildType));
+  }
   for (int c=0; c<nChannels; c++) {
      struct ncclChannel* channel0 = comm->channels+c;
      struct ncclChannel* channel1 = channel0+nChannels;
@@ -384,7 +422,7 @@ ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePa
   int nNodes = comm->nNodes;
   int nChannels = comm->nChannels;
   int minHeadNum = INT_MAX;
-  int shared = parent && parent->nvlsSupport  && parent->config.splitShare;
+  int shared = parent && parent->nvlsSupport && comm->shareRes;
   int minNchannels = 0;
   NCCLCHECK(ncclCalloc(&ringRecv, nNodes*MAXCHANNELS));
   NCCLCHECKGOTO(ncclCalloc(&ringSend, nNodes*MAXCHANNELS), ret, fail);
@@ -481,9 +519,9 @@ ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePa
 
   minNchannels = ncclMinNchannels();
 
-  if (mscclEnabled()) {
+  if (mscclEnabled(comm)) {
     int mscclNumChannelsRequired = 0;
-    mscclSchedulerInit(comm, &mscclNumChannelsRequired);
+    NCCLCHECKGOTO(mscclSchedulerInit(comm, &mscclNumChannelsRequired), ret, fail);
     minNchannels = std::max(minNchannels, mscclNumChannelsRequired);
   }
 
@@ -417,12 +417,33 @@ ncclResult_t ncclTopoCheckGdr(struct ncclTopoSystem* system, int64_t busId, int6
 NCCL_PARAM(NetForceFlush, "NET_FORCE_FLUSH", 0);
 
 // Determine whether we need to flush the GDR recv buffers
+// Whether the GPU sees the writes of the NIC in order without being flushed
+static bool ncclTopoGdrWritesOrdered(int64_t busId) {
+#if CUDART_VERSION >= 11030
+  char busIdStr[] = "00000000:00:00.0";
+  int dev, ordering;
+  if (int64ToBusId(busId, busIdStr) != ncclSuccess) return false;
+  if (cudaDeviceGetByPCIBusId(&dev, busIdStr) != cudaSuccess ||
+      cudaDeviceGetAttribute(&ordering, cudaDevAttrGPUDirectRDMAWritesOrdering, dev) != cudaSuccess) {
+    (void)cudaGetLastError();
+    return false;
+  }
+  return ordering >= cudaGPUDirectRDMAWritesOrderingOwner;
+#else
+  return false;
+#endif
+}
+
 ncclResult_t ncclTopoNeedFlush(struct ncclTopoSystem* system, int64_t busId, int* flush) {
   int g;
   NCCLCHECK(ncclTopoIdToIndex(system, GPU, busId, &g));
   struct ncclTopoNode* gpu = system->nodes[GPU].nodes+g;
-  // Flush is required on Ampere and earlier
+  // Flush is required on Ampere and earlier, unless the platform orders GPUDirect RDMA writes
   *flush = gpu->gpu.cudaCompCap < 90 ? 1 : ncclParamNetForceFlush();
+  if (*flush && ncclParamNetForceFlush() == 0 && ncclTopoGdrWritesOrdered(busId)) {
+    TRACE(NCCL_NET, "GPU %lx orders GPUDirect RDMA writes, receives are not flushed", busId);
+    *flush = 0;
+  }
   return ncclSuccess;
 }
 
@@ -685,6 +706,45 @@ void ncclTopoFree(struct ncclTopoSystem* system) {
   free(system);
 }
 
+// Deep copy of system with its paths, for searches that change link bandwidths to run at the same time.
+// Links and paths point inside the system, so they move by the offset of the copy.
+ncclResult_t ncclTopoDupSystem(struct ncclTopoSystem* system, struct ncclTopoSystem** dupSystem) {
+  struct ncclTopoSystem* dup;
+  NCCLCHECK(ncclCalloc(&dup, 1));
+  memcpy(dup, system, sizeof(struct ncclTopoSystem));
+  ptrdiff_t offset = (char*)dup - (char*)system;
+#define TOPO_RELOCATE(ptr) ptr = (decltype(ptr))((char*)(ptr) + offset)
+  for (int t1=0; t1<NCCL_TOPO_NODE_TYPES; t1++) {
+    for (int n=0; n<dup->nodes[t1].count; n++) {
+      struct ncclTopoNode* node = dup->nodes[t1].nodes+n;
+      for (int l=0; l<node->nlinks; l++) TOPO_RELOCATE(node->links[l].remNode);
+      for (int t2=0; t2<NCCL_TOPO_NODE_TYPES; t2++) node->paths[t2] = NULL;
+    }
+  }
+  for (int t1=0; t1<NCCL_TOPO_NODE_TYPES; t1++) {
+    for (int n=0; n<dup->nodes[t1].count; n++) {
+      struct ncclTopoNode* src = system->nodes[t1].nodes+n;
+      struct ncclTopoNode* node = dup->nodes[t1].nodes+n;
+      for (int t2=0; t2<NCCL_TOPO_NODE_TYPES; t2++) {
+        if (src->paths[t2] == NULL) continue;
+        int count = dup->nodes[t2].count;
+        ncclResult_t ret = ncclCalloc(&node->paths[t2], count);
+        if (ret != ncclSuccess) {
+          ncclTopoFree(dup);
+          return ret;
+        }
+        memcpy(node->paths[t2], src->paths[t2], count*sizeof(struct ncclTopoLinkList));
+        for (int i=0; i<count; i++) {
+          for (int h=0; h<node->paths[t2][i].count; h++) TOPO_RELOCATE(node->paths[t2][i].list[h]);
+        }
+      }
+    }
+  }
+#undef TOPO_RELOCATE
+  *dupSystem = dup;
+  return ncclSuccess;
+}
+
 NCCL_PARAM(NChannelsPerNetPeer, "NCHANNELS_PER_NET_PEER", -1);
 
 static ncclResult_t ncclTopoGetNchannels(struct ncclComm* comm, int g /*local gpu index*/, int peerRank, int* nChannels) {
@@ -11,7 +11,10 @@
 #include "topo.h"
 #include "transport.h"
 #include "xml.h"
+#include <errno.h>
 #include <math.h>
+#include <mutex>
+#include <vector>
 
 #include "msccl/msccl_lifecycle.h"
 
@@ -547,6 +550,8 @@ ncclResult_t ncclTopoSearchRecGpu(struct ncclTopoSystem* system, struct ncclTopo
         } else {
           if (graph->crossNic == 0 && (net->net.asic != startNet->net.asic || net->net.port != startNet->net.port)) continue;
         }
+        // The peer node receives on the rail of startNet, leaving on another one goes through the spine
+        if (net->net.rail != startNet->net.rail) continue;
 
         // Balanced Tree : count half of the bandwidth on first two GPUs
         int nextBackToNet = -1;
@@ -940,6 +945,164 @@ float sm90SpeedArrayInter[] = { 48.0, 45.0, 42.0, 40.0, 30.0, 24.0, 22.0, 20.0,
 #define NSPEEDSINTRA_SM90 (sizeof(sm90SpeedArrayIntra)/sizeof(float))
 #define NSPEEDSINTER_SM90 (sizeof(sm90SpeedArrayInter)/sizeof(float))
 
+// Search results are cached per system and search parameters, in memory across communicators and
+// optionally on disk. GPUs are kept as indices in memory and as devices on disk, so that comms
+// with other ranks on the same GPUs, like splits, find them too.
+NCCL_PARAM(GraphCache, "GRAPH_CACHE", 1);
+
+#define NCCL_GRAPH_CACHE_MAX_ENTRIES 1024
+
+struct ncclTopoGraphCacheEntry {
+  uint64_t key;
+  // Fields of the graph before intra
+  char header[offsetof(struct ncclTopoGraph, intra)];
+  std::vector<int> intra;
+  std::vector<int64_t> inter;
+};
+
+static std::mutex graphCacheLock;
+static std::vector<struct ncclTopoGraphCacheEntry> graphCache;
+
+static uint64_t graphCacheHash(uint64_t hash, const void* data, size_t n) {
+  // Based on DJB2a, as getHash
+  const char* bytes = (const char*)data;
+  for (size_t c = 0; c < n; c++) hash = ((hash << 5) + hash) ^ bytes[c];
+  return hash;
+}
+#define GRAPH_CACHE_HASH(hash, v) hash = graphCacheHash(hash, &(v), sizeof(v))
+
+static uint64_t ncclTopoGraphCacheKey(struct ncclTopoSystem* system, struct ncclTopoGraph* graph) {
+  uint64_t hash = 5381;
+  int params[] = { NCCL_VERSION_CODE, (int)ncclParamCrossNic(), graph->id, graph->pattern, graph->crossNic, graph->collNet,
+    graph->minChannels, graph->maxChannels, system->systemId, system->nHosts };
+  GRAPH_CACHE_HASH(hash, params);
+  GRAPH_CACHE_HASH(hash, system->maxBw);
+  GRAPH_CACHE_HASH(hash, system->totalBw);
+  for (int t=0; t<NCCL_TOPO_NODE_TYPES; t++) {
+    GRAPH_CACHE_HASH(hash, system->nodes[t].count);
+    for (int n=0; n<system->nodes[t].count; n++) {
+      struct ncclTopoNode* node = system->nodes[t].nodes+n;
+      GRAPH_CACHE_HASH(hash, node->id);
+      // Not the rank of GPUs, graphs are translated to ranks when they are taken from the cache
+      if (t == GPU) {
+        GRAPH_CACHE_HASH(hash, node->gpu.dev);
+        GRAPH_CACHE_HASH(hash, node->gpu.cudaCompCap);
+        GRAPH_CACHE_HASH(hash, node->gpu.gdrSupport);
+      } else if (t == NET) {
+        GRAPH_CACHE_HASH(hash, node->net.dev);
+        GRAPH_CACHE_HASH(hash, node->net.asic);
+        GRAPH_CACHE_HASH(hash, node->net.port);
+        GRAPH_CACHE_HASH(hash, node->net.bw);
+        GRAPH_CACHE_HASH(hash, node->net.latency);
+        GRAPH_CACHE_HASH(hash, node->net.gdrSupport);
+        GRAPH_CACHE_HASH(hash, node->net.collSupport);
+        GRAPH_CACHE_HASH(hash, node->net.maxChannels);
+        GRAPH_CACHE_HASH(hash, node->net.rail);
+      } else if (t == CPU) {
+        GRAPH_CACHE_HASH(hash, node->cpu.arch);
+        GRAPH_CACHE_HASH(hash, node->cpu.vendor);
+        GRAPH_CACHE_HASH(hash, node->cpu.model);
+      } else if (t == PCI) {
+        GRAPH_CACHE_HASH(hash, node->pci.device);
+      }
+      GRAPH_CACHE_HASH(hash, node->nlinks);
+      for (int l=0; l<node->nlinks; l++) {
+        struct ncclTopoLink* link = node->links+l;
+        int remType = link->remNode->type;
+        int remIndex = link->remNode - system->nodes[remType].nodes;
+        GRAPH_CACHE_HASH(hash, link->type);
+        GRAPH_CACHE_HASH(hash, link->bw);
+        GRAPH_CACHE_HASH(hash, remType);
+        GRAPH_CACHE_HASH(hash, remIndex);
+      }
+      // Paths carry the P2P and NET levels of the environment
+      for (int p=0; p<NCCL_TOPO_NODE_TYPES; p++) {
+        if (node->paths[p] == NULL) continue;
+        for (int i=0; i<system->nodes[p].count; i++) {
+          GRAPH_CACHE_HASH(hash, node->paths[p][i].type);
+          GRAPH_CACHE_HASH(hash, node->paths[p][i].bw);
+          GRAPH_CACHE_HASH(hash, node->paths[p][i].count);
+        }
+      }
+    }
+  }
+  return hash;
+}
+
+static void ncclTopoGraphCachePath(uint64_t key, struct ncclTopoGraph* graph, char* path, size_t len) {
+  const char* dir = ncclGetEnv("NCCL_GRAPH_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0') {
+    path[0] = '\0';
+    return;
+  }
+  snprintf(path, len, "%s/nccl-graph-%d-%016lx.xml", dir, graph->id, key);
+}
+
+static bool ncclTopoGraphCacheGet(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key) {
+  std::lock_guard<std::mutex> locked(graphCacheLock);
+  for (auto& entry : graphCache) {
+    if (entry.key != key) continue;
+    memcpy(graph, entry.header, sizeof(entry.header));
+    for (size_t i=0; i<entry.intra.size(); i++) {
+      graph->intra[i] = entry.intra[i] < 0 ? entry.intra[i] : system->nodes[GPU].nodes[entry.intra[i]].gpu.rank;
+    }
+    memcpy(graph->inter, entry.inter.data(), entry.inter.size()*sizeof(int64_t));
+    return true;
+  }
+  return false;
+}
+
+// Returns false when another thread already added key
+static bool ncclTopoGraphCachePut(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, uint64_t key) {
+  int ngpus = system->nodes[GPU].count;
+  struct ncclTopoGraphCacheEntry entry;
+  entry.key = key;
+  memcpy(entry.header, graph, sizeof(entry.header));
+  entry.intra.resize(graph->nChannels*ngpus, -1);
+  for (size_t i=0; i<entry.intra.size(); i++) {
+    for (int g=0; g<ngpus; g++) {
+      if (system->nodes[GPU].nodes[g].gpu.rank == graph->intra[i]) entry.intra[i] = g;
+    }
+  }
+  entry.inter.assign(graph->inter, graph->inter+graph->nChannels*2);
+  std::lock_guard<std::mutex> locked(graphCacheLock);
+  for (auto& e : graphCache) if (e.key == key) return false;
+  if (graphCache.size() >= NCCL_GRAPH_CACHE_MAX_ENTRIES) return false;
+  graphCache.push_back(std::move(entry));
+  return true;
+}
+
+static bool ncclTopoGraphCacheLoad(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, const char* path) {
+  if (path[0] == '\0' || access(path, R_OK) != 0) return false;
+  char header[offsetof(struct ncclTopoGraph, intra)];
+  memcpy(header, graph, sizeof(header));
+  struct ncclXml* xml;
+  int nChannels = 0;
+  if (xmlAlloc(&xml, NCCL_GRAPH_XML_MAX_NODES) != ncclSuccess) return false;
+  ncclResult_t ret = ncclTopoGetXmlGraphFromFile(path, xml);
+  if (ret == ncclSuccess) ret = ncclTopoGetGraphFromXml(xml->nodes, system, graph, &nChannels);
+  free(xml);
+  if (ret != ncclSuccess || graph->nChannels == 0) {
+    INFO(NCCL_GRAPH, "Search %d : ignoring cached graph %s", graph->id, path);
+    memcpy(graph, header, sizeof(header));
+    return false;
+  }
+  return true;
+}
+
+static void ncclTopoGraphCacheStore(struct ncclTopoSystem* system, struct ncclTopoGraph* graph, const char* path) {
+  if (path[0] == '\0') return;
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+  struct ncclXml* xml;
+  if (xmlAlloc(&xml, NCCL_GRAPH_XML_MAX_NODES) != ncclSuccess) return;
+  if (ncclTopoGetXmlFromGraphs(1, &graph, system, xml) == ncclSuccess && ncclTopoDumpXmlToFile(tmpPath, xml) == ncclSuccess) {
+    // Other processes may read the file while it is written
+    if (rename(tmpPath, path) != 0) unlink(tmpPath);
+  }
+  free(xml);
+}
+
 ncclResult_t ncclTopoCompute(ncclTopoSystem* system, struct ncclTopoGraph* graph) {
   int ngpus = system->nodes[GPU].count;
   int crossNic = (system->nodes[NET].count > 1) &&
@@ -974,6 +1137,22 @@ ncclResult_t ncclTopoCompute(ncclTopoSystem* system, struct ncclTopoGraph* graph
   int ccMin;
   NCCLCHECK(ncclTopoGetCompCap(system, &ccMin, NULL));
   if (graph->pattern == NCCL_TOPO_PATTERN_NVLS && (system->nodes[NVS].count == 0 || ccMin < 90)) return ncclSuccess;
+
+  uint64_t cacheKey = 0;
+  char cachePath[PATH_MAX];
+  if (ncclParamGraphCache()) {
+    cacheKey = ncclTopoGraphCacheKey(system, graph);
+    ncclTopoGraphCachePath(cacheKey, graph, cachePath, sizeof(cachePath));
+    if (ncclTopoGraphCacheGet(system, graph, cacheKey)) {
+      INFO(NCCL_GRAPH, "Search %d : %d channels found in graph cache", graph->id, graph->nChannels);
+      return ncclSuccess;
+    }
+    if (ncclTopoGraphCacheLoad(system, graph, cachePath)) {
+      INFO(NCCL_GRAPH, "Search %d : %d channels loaded from graph cache %s", graph->id, graph->nChannels, cachePath);
+      ncclTopoGraphCachePut(system, graph, cacheKey);
+      return ncclSuccess;
+    }
+  }
   // NVLS and COLLNET_DIRECT search must have ngpus heads at most.
   if (graph->pattern == NCCL_TOPO_PATTERN_NVLS || graph->pattern == NCCL_TOPO_PATTERN_COLLNET_DIRECT)
     graph->maxChannels = system->nodes[GPU].count;
@@ -1125,9 +1304,68 @@ done:
     graph->typeIntra = graph->typeInter = PATH_SYS;
     graph->nChannels = 1;
   }
+  if (ncclParamGraphCache() && ncclTopoGraphCachePut(system, graph, cacheKey)) ncclTopoGraphCacheStore(system, graph, cachePath);
   return ncclSuccess;
 }
 
+NCCL_PARAM(GraphSearchParallel, "GRAPH_SEARCH_PARALLEL", 1);
+
+struct ncclTopoSearchJob {
+  pthread_t thread;
+  struct ncclTopoSystem* system;
+  struct ncclTopoGraph* graph;
+  ncclResult_t result;
+};
+
+static void* ncclTopoSearchThread(void* arg) {
+  struct ncclTopoSearchJob* job = (struct ncclTopoSearchJob*)arg;
+  job->result = ncclTopoCompute(job->system, job->graph);
+  return NULL;
+}
+
+ncclResult_t ncclTopoComputeGraphs(struct ncclTopoSystem* system, int nGraphs, struct ncclTopoGraph** graphs) {
+  if (nGraphs == 0) return ncclSuccess;
+  if (nGraphs == 1 || ncclParamGraphSearchParallel() == 0) {
+    for (int g=0; g<nGraphs; g++) NCCLCHECK(ncclTopoCompute(system, graphs[g]));
+    return ncclSuccess;
+  }
+  ncclResult_t ret = ncclSuccess;
+  struct ncclTopoSearchJob jobs[NCCL_NUM_ALGORITHMS];
+  int nJobs = 0;
+  if (nGraphs > NCCL_NUM_ALGORITHMS) {
+    WARN("Too many graphs to search at once : %d", nGraphs);
+    return ncclInternalError;
+  }
+  // The first graph is searched by this thread on system itself
+  for (int g=1; g<nGraphs; g++) {
+    struct ncclTopoSearchJob* job = jobs+nJobs;
+    job->graph = graphs[g];
+    job->result = ncclSuccess;
+    NCCLCHECKGOTO(ncclTopoDupSystem(system, &job->system), ret, exit);
+    if (pthread_create(&job->thread, NULL, ncclTopoSearchThread, job) != 0) {
+      // Search this one later in this thread
+      INFO(NCCL_GRAPH, "Search %d : unable to start a search thread : %s", job->graph->id, strerror(errno));
+      ncclTopoFree(job->system);
+      continue;
+    }
+    ncclSetThreadName(job->thread, "NCCL Search %2d", job->graph->id);
+    nJobs++;
+  }
+exit:
+  if (ret == ncclSuccess) ret = ncclTopoCompute(system, graphs[0]);
+  for (int g=1; g<nGraphs && ret == ncclSuccess; g++) {
+    bool threaded = false;
+    for (int j=0; j<nJobs; j++) threaded |= jobs[j].graph == graphs[g];
+    if (!threaded) ret = ncclTopoCompute(system, graphs[g]);
+  }
+  for (int j=0; j<nJobs; j++) {
+    pthread_join(jobs[j].thread, NULL);
+    ncclTopoFree(jobs[j].system);
+    if (ret == ncclSuccess) ret = jobs[j].result;
+  }
+  return ret;
+}
+
 ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph) {
   INFO(NCCL_GRAPH, "Pattern %d, crossNic %d, nChannels %d, bw %f/%f, type %s/%s, sameChannels %d", graph->pattern, graph->crossNic, graph->nChannels, graph->bwIntra, graph->bwInter, topoPathTypeStr[graph->typeIntra], topoPathTypeStr[graph->typeInter], graph->sameChannels);
   int ngpus = system->nodes[GPU].count;
@@ -1200,6 +1438,43 @@ fail:
 // 0: don't use PXN for P2P, 1: use PXN if needed, 2: use PXN as much as possible to maximize aggregation
 NCCL_PARAM(P2pPxnLevel, "P2P_PXN_LEVEL", 2);
 
+static bool ncclTopoRailAware(struct ncclTopoSystem* system) {
+  for (int n=0; n<system->nodes[NET].count; n++) if (system->nodes[NET].nodes[n].net.rail != -1) return true;
+  return false;
+}
+
+// Peers receive on the NIC local to their GPU, which is on the rail of the NIC local to the same GPU
+// on this node. Send from that rail, through a GPU close to the NIC when our own NIC is on another one.
+static ncclResult_t ncclTopoGetRailNetDev(struct ncclComm* comm, int rank, int channelId, int peerRank, int64_t* id, int* dev, int* proxyRank) {
+  int64_t netId, peerNetId;
+  int netDev, peerNetDev, localRank, n, peerN;
+  NCCLCHECK(ncclTopoGetLocalNet(comm->topo, rank, channelId, &netId, &netDev));
+  if (dev) *dev = netDev;
+  if (id) *id = netId;
+  *proxyRank = rank;
+  if (ncclTopoDevToRank(comm->topo, comm->peerInfo[peerRank].nvmlDev, &localRank) != ncclSuccess) return ncclSuccess;
+  NCCLCHECK(ncclTopoGetLocalNet(comm->topo, localRank, channelId, &peerNetId, &peerNetDev));
+  NCCLCHECK(ncclTopoIdToIndex(comm->topo, NET, netId, &n));
+  NCCLCHECK(ncclTopoIdToIndex(comm->topo, NET, peerNetId, &peerN));
+  if (comm->topo->nodes[NET].nodes[n].net.rail == comm->topo->nodes[NET].nodes[peerN].net.rail) return ncclSuccess;
+
+  if (dev) *dev = peerNetDev;
+  if (id) *id = peerNetId;
+  if (ncclPxnDisable(comm) == 1) return ncclSuccess;
+  int g1, g2;
+  NCCLCHECK(ncclTopoRankToIndex(comm->topo, rank, &g1));
+  NCCLCHECK(ncclTopoGetLocalGpu(comm->topo, peerNetId, &g2));
+  if (g2 != -1) {
+    struct ncclTopoNode* peerGpu = comm->topo->nodes[GPU].nodes+g2;
+    if (peerGpu->paths[GPU][g1].type <= PATH_NVL && peerGpu->paths[NET][peerN].type <= PATH_PXB) {
+      *proxyRank = peerGpu->gpu.rank;
+      return ncclSuccess;
+    }
+  }
+  NCCLCHECK(ncclTopoGetIntermediateRank(comm->topo, rank, peerNetId, proxyRank));
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetNetDev(struct ncclComm* comm, int rank, struct ncclTopoGraph* graph, int channelId, int peerRank, int64_t* id, int* dev, int* proxyRank) {
   int64_t netId = -1;
   int netDev = -1;
@@ -1219,6 +1494,8 @@ ncclResult_t ncclTopoGetNetDev(struct ncclComm* comm, int rank, struct ncclTopoG
     NCCLCHECK(ncclTopoGetIntermediateRank(comm->topo, rank, netId, proxyRank));
   } else if (peerRank == -1) {
     return ncclInternalError;
+  } else if (ncclTopoRailAware(comm->topo)) {
+    return ncclTopoGetRailNetDev(comm, rank, channelId, peerRank, id, dev, proxyRank);
   } else {
     // Start with our local NIC and local Rank
     NCCLCHECK(ncclTopoGetLocalNet(comm->topo, rank, channelId, &netId, &netDev));
@@ -0,0 +1,281 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <vector>
+
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "comm.h"
+#include "core.h"
+#include "device.h"
+#include "graph.h"
+#include "param.h"
+#include "topo.h"
+#include "xml.h"
+
+#include "msccl/msccl_lifecycle.h"
+
+// Init phases of the simulated comm, in the order they run
+enum { SIM_PHASE_TOPO, SIM_PHASE_GRAPHS, SIM_PHASE_POSTSET, SIM_PHASE_TUNE, SIM_NUM_PHASES };
+static const char* simPhaseStr[SIM_NUM_PHASES] = { "topo", "graphs", "postset", "tune" };
+
+struct ncclSimWorkload {
+  int func;
+  size_t nBytes;
+};
+
+// "allreduce:1M,allgather:64K", sizes are those of the larger of the send and receive buffers
+static ncclResult_t simParseWorkloads(const char* str, std::vector<struct ncclSimWorkload>* workloads) {
+  char* copy = strdup(str);
+  char* save = NULL;
+  ncclResult_t ret = ncclSuccess;
+  for (char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    char* colon = strchr(tok, ':');
+    struct ncclSimWorkload w = { -1, 0 };
+    if (colon) {
+      *colon = '\0';
+      for (int f = 0; f < NCCL_NUM_FUNCTIONS; f++) if (strcasecmp(tok, ncclFuncStr[f]) == 0) w.func = f;
+      char* end;
+      w.nBytes = strtoull(colon + 1, &end, 0);
+      switch (*end) {
+      case 'K': case 'k': w.nBytes <<= 10; end++; break;
+      case 'M': case 'm': w.nBytes <<= 20; end++; break;
+      case 'G': case 'g': w.nBytes <<= 30; end++; break;
+      }
+      if (*end != '\0' || end == colon + 1) w.func = -1;
+    }
+    if (w.func == -1) {
+      WARN("ncclSimulateTopo: workload %s is not <collective>:<bytes>", tok);
+      ret = ncclInvalidArgument;
+      break;
+    }
+    workloads->push_back(w);
+  }
+  free(copy);
+  return ret;
+}
+
+// Algorithm and protocol the comm would pick for w, following the candidates of updateCollCostTable
+static ncclResult_t simSelect(struct ncclComm* comm, const struct ncclSimWorkload& w, int* algo, int* proto, float* time) {
+  *algo = NCCL_ALGO_UNDEF;
+  *proto = NCCL_PROTO_UNDEF;
+  *time = -1.0f;
+  for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) {
+    if (a == NCCL_ALGO_COLLNET_DIRECT || a == NCCL_ALGO_COLLNET_CHAIN) continue;
+    if ((a == NCCL_ALGO_NVLS || a == NCCL_ALGO_NVLS_TREE) && comm->nvlsSupport != 1 && w.func != ncclFuncAllGather) continue;
+    if (a == NCCL_ALGO_NVLS && comm->nNodes > 1) continue;
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      float t;
+      bool backup;
+      NCCLCHECK(ncclTopoGetAlgoTime(comm, w.func, a, p, w.nBytes, 1, &t, &backup));
+      if (t >= 0.0f && (*time < 0.0f || t < *time)) {
+        *algo = a;
+        *proto = p;
+        *time = t;
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t simulate(const char* topoFile, int nNodes, const char* workloadStr, FILE* report) {
+  ncclResult_t ret = ncclSuccess;
+  std::vector<struct ncclSimWorkload> workloads;
+  struct ncclXml* xml = NULL;
+  struct ncclComm* comm = NULL;
+  struct ncclSharedResources* sharedRes = NULL;
+  struct ncclTopoSystem* system = NULL;
+  struct ncclTopoGraph graphStore[NCCL_NUM_ALGORITHMS];
+  struct ncclTopoGraph* graphs[NCCL_NUM_ALGORITHMS];
+  struct ncclTopoRanks* topoRanks = NULL;
+  struct ncclTopoRanks** allTopoRanks = NULL;
+  int *firstRanks = NULL, *treePatterns = NULL, *rings = NULL;
+  uint64_t phases[SIM_NUM_PHASES] = { 0 };
+  int localRanks, nRanks;
+  bool postset = !mscclEnabled();
+
+  NCCLCHECKGOTO(simParseWorkloads(workloadStr, &workloads), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&comm, 1), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&sharedRes, 1), ret, exit);
+
+  // The XML describes one node, all nodes are the same and hold consecutive ranks
+  phases[SIM_PHASE_TOPO] = clockNano();
+  NCCLCHECKGOTO(xmlAlloc(&xml, NCCL_TOPO_XML_MAX_NODES), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetXmlFromFile(topoFile, xml, 1), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetSystemFromXml(xml, &system, 0), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetGpuCount(system, &localRanks), ret, exit);
+  if (localRanks == 0) {
+    WARN("ncclSimulateTopo: %s has no GPU", topoFile);
+    ret = ncclInvalidArgument;
+    goto exit;
+  }
+  nRanks = nNodes * localRanks;
+  comm->topo = system;
+  comm->rank = 0;
+  comm->nRanks = nRanks;
+  comm->nNodes = nNodes;
+  comm->node = 0;
+  comm->localRanks = comm->maxLocalRanks = localRanks;
+  comm->sharedRes = sharedRes;
+  sharedRes->owner = comm;
+  sharedRes->tpNRanks = nRanks;
+  sharedRes->tpNChannels = MAXCHANNELS;
+  comm->config.minCTAs = 1;
+  comm->config.maxCTAs = MAXCHANNELS;
+  comm->netDeviceType = NCCL_NET_DEVICE_HOST;
+  // Without a comm the paths are those of P2P everywhere, then NICs are dropped on a single node
+  NCCLCHECKGOTO(ncclTopoComputePaths(system, NULL), ret, exit);
+  NCCLCHECKGOTO(ncclTopoTrimSystem(system, comm), ret, exit);
+  NCCLCHECKGOTO(ncclTopoComputePaths(system, NULL), ret, exit);
+  NCCLCHECKGOTO(ncclTopoSearchInit(system), ret, exit);
+  NCCLCHECKGOTO(ncclTopoComputeCommCPU(comm), ret, exit);
+  NCCLCHECKGOTO(ncclTopoGetCompCap(system, &comm->minCompCap, &comm->maxCompCap), ret, exit);
+  phases[SIM_PHASE_TOPO] = clockNano() - phases[SIM_PHASE_TOPO];
+
+  // NVLS is assumed wherever NVSwitches and sm90 are, there is no device to ask
+  {
+    int nvsCount;
+    const char* nvlsEnable = ncclGetEnv("NCCL_NVLS_ENABLE");
+    NCCLCHECKGOTO(ncclTopoGetNvsCount(system, &nvsCount), ret, exit);
+    if (nvsCount > 0 && comm->minCompCap >= 90 && localRanks > 2 && (nvlsEnable == NULL || atoi(nvlsEnable) != 0)) {
+      comm->nvlsSupport = 1;
+      comm->nvlsChannels = 16;
+    }
+  }
+
+  phases[SIM_PHASE_GRAPHS] = clockNano();
+  memset(graphStore, 0, sizeof(graphStore));
+  for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) graphs[a] = graphStore + a;
+  graphs[NCCL_ALGO_RING]->id = 0;
+  graphs[NCCL_ALGO_RING]->pattern = NCCL_TOPO_PATTERN_RING;
+  graphs[NCCL_ALGO_RING]->minChannels = 1;
+  graphs[NCCL_ALGO_RING]->maxChannels = MAXCHANNELS/2;
+  graphs[NCCL_ALGO_TREE]->id = 1;
+  graphs[NCCL_ALGO_TREE]->pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
+  graphs[NCCL_ALGO_COLLNET_CHAIN]->id = 2;
+  graphs[NCCL_ALGO_COLLNET_CHAIN]->pattern = NCCL_TOPO_PATTERN_TREE;
+  graphs[NCCL_ALGO_NVLS]->id = 3;
+  graphs[NCCL_ALGO_NVLS]->pattern = NCCL_TOPO_PATTERN_NVLS;
+  graphs[NCCL_ALGO_NVLS]->minChannels = 1;
+  graphs[NCCL_ALGO_NVLS]->maxChannels = MAXCHANNELS;
+  graphs[NCCL_ALGO_COLLNET_DIRECT]->id = 4;
+  graphs[NCCL_ALGO_COLLNET_DIRECT]->pattern = NCCL_TOPO_PATTERN_COLLNET_DIRECT;
+  {
+    struct ncclTopoGraph* searchGraphs[2];
+    int nSearchGraphs = 0;
+    searchGraphs[nSearchGraphs++] = graphs[NCCL_ALGO_RING];
+    if (comm->nvlsSupport) searchGraphs[nSearchGraphs++] = graphs[NCCL_ALGO_NVLS];
+    NCCLCHECKGOTO(ncclTopoComputeGraphs(system, nSearchGraphs, searchGraphs), ret, exit);
+    graphs[NCCL_ALGO_TREE]->minChannels = graphs[NCCL_ALGO_TREE]->maxChannels = graphs[NCCL_ALGO_RING]->nChannels;
+    NCCLCHECKGOTO(ncclTopoCompute(system, graphs[NCCL_ALGO_TREE]), ret, exit);
+  }
+  if (graphs[NCCL_ALGO_NVLS]->nChannels == 0) comm->nvlsSupport = comm->nvlsChannels = 0;
+  comm->nChannels = graphs[NCCL_ALGO_TREE]->nChannels = graphs[NCCL_ALGO_RING]->nChannels =
+    std::min(graphs[NCCL_ALGO_TREE]->nChannels, graphs[NCCL_ALGO_RING]->nChannels);
+  phases[SIM_PHASE_GRAPHS] = clockNano() - phases[SIM_PHASE_GRAPHS];
+
+  // Topo ranks of the first node, those of the others are the same shifted by their first rank
+  phases[SIM_PHASE_POSTSET] = clockNano();
+  NCCLCHECKGOTO(ncclCalloc(&topoRanks, nRanks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&allTopoRanks, nRanks), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&firstRanks, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&treePatterns, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&rings, nRanks*MAXCHANNELS), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&comm->rankToNode, nRanks), ret, exit);
+  for (int r = localRanks - 1; r >= 0; r--) {
+    comm->rank = r;
+    NCCLCHECKGOTO(ncclTopoPreset(comm, graphs, topoRanks + r), ret, exit);
+  }
+  for (int r = localRanks; r < nRanks; r++) {
+    int shift = r / localRanks * localRanks;
+    struct ncclTopoRanks* src = topoRanks + r % localRanks;
+    struct ncclTopoRanks* dst = topoRanks + r;
+    *dst = *src;
+    for (int c = 0; c < MAXCHANNELS; c++) {
+      int* fields[] = { dst->ringRecv+c, dst->ringSend+c, dst->ringPrev+c, dst->ringNext+c,
+        dst->treeToParent+c, dst->treeToChild0+c, dst->treeToChild1+c, dst->nvlsHeads+c };
+      for (int* f : fields) if (*f >= 0) *f += shift;
+    }
+  }
+  for (int r = 0; r < nRanks; r++) {
+    allTopoRanks[r] = topoRanks + r;
+    comm->rankToNode[r] = r / localRanks;
+  }
+  for (int n = 0; n < nNodes; n++) {
+    firstRanks[n] = n * localRanks;
+    treePatterns[n] = graphs[NCCL_ALGO_TREE]->pattern;
+  }
+  // The MSCCL scheduler is set up by the postset, it needs a real comm
+  if (postset) NCCLCHECKGOTO(ncclTopoPostset(comm, firstRanks, treePatterns, allTopoRanks, rings, graphs, NULL), ret, exit);
+  phases[SIM_PHASE_POSTSET] = clockNano() - phases[SIM_PHASE_POSTSET];
+
+  phases[SIM_PHASE_TUNE] = clockNano();
+  NCCLCHECKGOTO(ncclTopoTuneModel(comm, comm->minCompCap, comm->maxCompCap, graphs), ret, exit);
+  phases[SIM_PHASE_TUNE] = clockNano() - phases[SIM_PHASE_TUNE];
+
+  fprintf(report, "# %s: %d nodes of %d GPUs, %d ranks, sm%d, %d channels\n", topoFile, nNodes, localRanks, nRanks,
+    comm->minCompCap, comm->nChannels);
+  for (int p = 0; p < SIM_NUM_PHASES; p++) {
+    if (p == SIM_PHASE_POSTSET && !postset) {
+      fprintf(report, "phase %-8s skipped, MSCCL is enabled\n", simPhaseStr[p]);
+    } else {
+      fprintf(report, "phase %-8s %12.1f us\n", simPhaseStr[p], phases[p] / 1e3);
+    }
+  }
+  for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) {
+    if (graphs[a]->nChannels == 0) continue;
+    fprintf(report, "graph %-14s %2d channels, intra %s %6.1f GB/s, inter %s %6.1f GB/s\n", ncclAlgoStr[a], graphs[a]->nChannels,
+      topoPathTypeStr[graphs[a]->typeIntra], graphs[a]->bwIntra, topoPathTypeStr[graphs[a]->typeInter], graphs[a]->bwInter);
+  }
+  for (const struct ncclSimWorkload& w : workloads) {
+    int algo, proto;
+    float time;
+    NCCLCHECKGOTO(simSelect(comm, w, &algo, &proto, &time), ret, exit);
+    if (algo == NCCL_ALGO_UNDEF) {
+      fprintf(report, "workload %-14s %14zu bytes: no algorithm\n", ncclFuncStr[w.func], w.nBytes);
+    } else {
+      fprintf(report, "workload %-14s %14zu bytes: %-14s %-6s %12.1f us, algbw %.1f GB/s\n", ncclFuncStr[w.func], w.nBytes,
+        ncclAlgoStr[algo], ncclProtoStr[proto], time, w.nBytes / (1e3 * time));
+    }
+  }
+
+exit:
+  free(rings);
+  free(treePatterns);
+  free(firstRanks);
+  free(allTopoRanks);
+  free(topoRanks);
+  if (system) ncclTopoFree(system);
+  free(xml);
+  if (comm) free(comm->rankToNode);
+  free(sharedRes);
+  free(comm);
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclSimulateTopo, const char* topoFile, int nNodes, const char* workloads, const char* reportPath);
+ncclResult_t ncclSimulateTopo(const char* topoFile, int nNodes, const char* workloads, const char* reportPath) {
+  NCCLCHECK(PtrCheck((void*)topoFile, "ncclSimulateTopo", "topoFile"));
+  NCCLCHECK(PtrCheck((void*)workloads, "ncclSimulateTopo", "workloads"));
+  NCCLCHECK(PtrCheck((void*)reportPath, "ncclSimulateTopo", "reportPath"));
+  if (nNodes < 1) {
+    WARN("ncclSimulateTopo: nNodes %d must be at least 1", nNodes);
+    return ncclInvalidArgument;
+  }
+  FILE* report = fopen(reportPath, "w");
+  if (report == NULL) {
+    WARN("ncclSimulateTopo: could not open %s: %s", reportPath, strerror(errno));
+    return ncclSystemError;
+  }
+  ncclResult_t ret = simulate(topoFile, nNodes, workloads, report);
+  fclose(report);
+  return ret;
+}
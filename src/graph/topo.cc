@@ -14,9 +14,12 @@
 #include "transport.h"
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include "xml.h"
 #include "cpuset.h"
 #include "bootstrap.h"
+#include <mutex>
+#include <vector>
 
 #define BUSID_SIZE (sizeof("0000:00:00.0"))
 #define BUSID_REDUCED_SIZE (sizeof("0000:00"))
@@ -348,6 +351,19 @@ ncclResult_t ncclTopoSortSystem(struct ncclTopoSystem* system) {
   return ncclSuccess;
 }
 
+NCCL_PARAM(RailAware, "RAIL_AWARE", 0);
+
+// NCCL_RAIL_MAP is a list of <NIC name>=<rail> pairs separated by commas
+static int ncclTopoRailFromMap(const char* name) {
+  const char* map = ncclGetEnv("NCCL_RAIL_MAP");
+  if (map == NULL || name == NULL) return -1;
+  size_t len = strlen(name);
+  for (const char* entry = map; entry; entry = strchr(entry, ',') ? strchr(entry, ',')+1 : NULL) {
+    if (strncmp(entry, name, len) == 0 && entry[len] == '=') return atoi(entry+len+1);
+  }
+  return -1;
+}
+
 ncclResult_t ncclTopoAddNet(struct ncclXmlNode* xmlNet, struct ncclTopoSystem* system, struct ncclTopoNode* nic, int systemId) {
   int dev;
   NCCLCHECK(xmlGetAttrInt(xmlNet, "dev", &dev));
@@ -370,6 +386,11 @@ ncclResult_t ncclTopoAddNet(struct ncclXmlNode* xmlNet, struct ncclTopoSystem* s
   NCCLCHECK(xmlGetAttrIntDefault(xmlNet, "gdr", &net->net.gdrSupport, 0));
   NCCLCHECK(xmlGetAttrIntDefault(xmlNet, "maxconn", &net->net.maxChannels, MAXCHANNELS));
   NCCLCHECK(xmlGetAttrIntDefault(xmlNet, "coll", &net->net.collSupport, 0));
+  // Rails come from the map, then the topology file, then the NIC order, the same on all nodes
+  NCCLCHECK(xmlGetAttr(xmlNet, "name", &str));
+  net->net.rail = ncclTopoRailFromMap(str);
+  if (net->net.rail == -1) NCCLCHECK(xmlGetAttrIntDefault(xmlNet, "rail", &net->net.rail, -1));
+  if (net->net.rail == -1 && ncclParamRailAware()) net->net.rail = dev;
   ncclDebugNoWarn = 0;
 
   NCCLCHECK(ncclTopoConnectNodes(nic, net, LINK_NET, net->net.bw));
@@ -725,6 +746,138 @@ ncclResult_t ncclTopoRefreshBcmP2pLinks(void) {
   return ncclSuccess;
 }
 
+// Fused XML of a host, by set of local GPUs. Comms created again on the same GPUs, like after a
+// restart of the job, skip the detection and the exchange of XMLs between local ranks.
+NCCL_PARAM(TopoCache, "TOPO_CACHE", 1);
+
+#define NCCL_TOPO_CACHE_MAX_ENTRIES 16
+
+struct ncclTopoXmlCacheEntry {
+  uint64_t key;
+  std::vector<char> xml; // Pointers relative to the first node
+};
+
+static std::mutex topoCacheLock;
+static std::vector<struct ncclTopoXmlCacheEntry> topoCache;
+// XML detected for the GPU of a process and its NICs, before fusion, by GPU. Comms on another set
+// of local GPUs still skip the NVML and sysfs queries of the GPUs they have seen.
+static std::vector<struct ncclTopoXmlCacheEntry> topoLocalCache;
+
+static void ncclTopoCacheLookup(std::vector<struct ncclTopoXmlCacheEntry>& cache, uint64_t key, struct ncclXml* xml) {
+  std::lock_guard<std::mutex> locked(topoCacheLock);
+  xml->maxIndex = 0;
+  for (auto& entry : cache) {
+    if (entry.key != key) continue;
+    memcpy(xml, entry.xml.data(), entry.xml.size());
+    xml->maxNodes = NCCL_TOPO_XML_MAX_NODES;
+    ncclTopoConvertXml(xml, (uintptr_t)xml->nodes, 0);
+    break;
+  }
+}
+
+static void ncclTopoCacheInsert(std::vector<struct ncclTopoXmlCacheEntry>& cache, uint64_t key, struct ncclXml* xml) {
+  struct ncclTopoXmlCacheEntry entry;
+  entry.key = key;
+  entry.xml.resize(xmlMemSize(xml->maxIndex));
+  memcpy(entry.xml.data(), xml, entry.xml.size());
+  ncclTopoConvertXml((struct ncclXml*)entry.xml.data(), (uintptr_t)xml->nodes, 1);
+  std::lock_guard<std::mutex> locked(topoCacheLock);
+  bool present = false;
+  for (auto& e : cache) present |= e.key == key;
+  if (!present && cache.size() < NCCL_TOPO_CACHE_MAX_ENTRIES) cache.push_back(std::move(entry));
+}
+
+static uint64_t ncclTopoCacheKey(struct ncclComm* comm, int* localRanks, int nLocalRanks) {
+  std::vector<char> key;
+  auto add = [&key](const void* data, size_t n) { key.insert(key.end(), (const char*)data, (const char*)data+n); };
+  const char* topoFile = ncclGetEnv("NCCL_TOPO_FILE");
+  int version = NCCL_TOPO_XML_VERSION;
+  int collNet = collNetSupport(comm);
+  add(&version, sizeof(version));
+  add(&comm->peerInfo[comm->rank].hostHash, sizeof(uint64_t));
+  add(comm->ncclNet->name, strlen(comm->ncclNet->name));
+  add(&collNet, sizeof(collNet));
+  if (topoFile) add(topoFile, strlen(topoFile));
+  for (int i = 0; i < nLocalRanks; i++) {
+    add(&comm->peerInfo[localRanks[i]].busId, sizeof(int64_t));
+    add(&comm->peerInfo[localRanks[i]].gdrSupport, sizeof(int));
+  }
+  return getHash(key.data(), key.size());
+}
+
+static uint64_t ncclTopoLocalCacheKey(struct ncclComm* comm) {
+  int rank = comm->rank;
+  return ncclTopoCacheKey(comm, &rank, 1) ^ (uint64_t)comm->dmaBufSupport;
+}
+
+static void ncclTopoCachePath(uint64_t key, char* path, size_t len) {
+  const char* dir = ncclGetEnv("NCCL_TOPO_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0') {
+    path[0] = '\0';
+    return;
+  }
+  snprintf(path, len, "%s/nccl-topo-%016lx.xml", dir, key);
+}
+
+// GPUs of the cached XML take the ranks of this comm
+static ncclResult_t ncclTopoCacheSetRanks(struct ncclComm* comm, struct ncclXml* xml, int* localRanks, int nLocalRanks, bool* found) {
+  *found = false;
+  for (int i = 0; i < nLocalRanks; i++) {
+    char busId[NVML_DEVICE_PCI_BUS_ID_BUFFER_SIZE];
+    struct ncclXmlNode *pci, *gpu;
+    NCCLCHECK(int64ToBusId(comm->peerInfo[localRanks[i]].busId, busId));
+    NCCLCHECK(xmlFindTagKv(xml, "pci", &pci, "busid", busId));
+    if (pci == NULL) return ncclSuccess;
+    NCCLCHECK(xmlGetSub(pci, "gpu", &gpu));
+    if (gpu == NULL) return ncclSuccess;
+    NCCLCHECK(xmlSetAttrInt(gpu, "rank", localRanks[i]));
+  }
+  *found = true;
+  return ncclSuccess;
+}
+
+static bool ncclTopoCacheGet(struct ncclComm* comm, uint64_t key, struct ncclXml* xml, int* localRanks, int nLocalRanks) {
+  char path[PATH_MAX];
+  bool found = false;
+  ncclTopoCacheLookup(topoCache, key, xml);
+  ncclTopoCachePath(key, path, sizeof(path));
+  if (xml->maxIndex == 0 && path[0] != '\0' && access(path, R_OK) == 0) {
+    if (ncclTopoGetXmlFromFile(path, xml, 0) != ncclSuccess) xml->maxIndex = 0;
+  }
+  if (xml->maxIndex == 0) return false;
+  if (ncclTopoCacheSetRanks(comm, xml, localRanks, nLocalRanks, &found) != ncclSuccess || !found) {
+    INFO(NCCL_GRAPH, "Ignoring cached topology %016lx", key);
+    return false;
+  }
+  return true;
+}
+
+static void ncclTopoCachePut(struct ncclComm* comm, uint64_t key, struct ncclXml* xml, int localRank) {
+  char path[PATH_MAX];
+  ncclTopoCacheInsert(topoCache, key, xml);
+  // One writer per host, other processes may read the file while it is written
+  ncclTopoCachePath(key, path, sizeof(path));
+  if (localRank != 0 || path[0] == '\0') return;
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+  if (ncclTopoDumpXmlToFile(tmpPath, xml) == ncclSuccess) {
+    if (rename(tmpPath, path) != 0) unlink(tmpPath);
+  }
+}
+
+// Set by the detection of the NICs otherwise
+static ncclResult_t ncclTopoCacheNetDeviceType(struct ncclComm* comm) {
+  int netDevCount = 0;
+  if (collNetSupport(comm)) NCCLCHECK(collNetDevices(comm, &netDevCount));
+  if (netDevCount == 0) NCCLCHECK(comm->ncclNet->devices(&netDevCount));
+  for (int n=0; n<netDevCount; n++) {
+    ncclNetProperties_t props;
+    NCCLCHECK(comm->ncclNet->getProperties(n, &props));
+    comm->netDeviceType = props.netDeviceType;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** system) {
   ncclResult_t ret = ncclSuccess;
   struct ncclXml* xml;
@@ -733,8 +886,53 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
   int netDevCount = 0;
   struct ncclXml* rankXml;
   int localRank = -1, nLocalRanks = 0;
+  uint64_t cacheKey = 0, localCacheKey = 0;
+  bool useCache = !comm->MNNVL && ncclParamTopoCache();
   NCCLCHECK(xmlAlloc(&xml, NCCL_TOPO_XML_MAX_NODES));
-  const char* xmlTopoFile = ncclGetEnv("NCCL_TOPO_FILE");
+  const char* xmlTopoFile;
+  if (useCache) {
+    NCCLCHECKGOTO(ncclCalloc(&localRanks, comm->nRanks), ret, fail);
+    for (int i = 0; i < comm->nRanks; i++) {
+      if (comm->peerInfo[i].hostHash == comm->peerInfo[comm->rank].hostHash) {
+        if (i == comm->rank)
+          localRank = nLocalRanks;
+        localRanks[nLocalRanks++] = i;
+      }
+    }
+    cacheKey = ncclTopoCacheKey(comm, localRanks, nLocalRanks);
+    int* hits = NULL;
+    int hit = ncclTopoCacheGet(comm, cacheKey, xml, localRanks, nLocalRanks) ? 1 : 0;
+    // Local ranks either all take the cache or all detect and fuse
+    NCCLCHECKGOTO(ncclCalloc(&hits, nLocalRanks), ret, fail);
+    hits[localRank] = hit;
+    ret = bootstrapIntraNodeAllGather(comm->bootstrap, localRanks, localRank, nLocalRanks, hits, sizeof(int));
+    for (int i = 0; i < nLocalRanks; i++) hit &= hits[i];
+    free(hits);
+    if (ret != ncclSuccess) goto fail;
+    if (hit) {
+      INFO(NCCL_GRAPH, "Topology %016lx taken from the cache", cacheKey);
+      NCCLCHECKGOTO(ncclTopoCacheNetDeviceType(comm), ret, fail);
+      goto fused;
+    }
+    free(localRanks);
+    localRanks = NULL;
+    localRank = -1;
+    nLocalRanks = 0;
+    localCacheKey = ncclTopoLocalCacheKey(comm);
+    ncclTopoCacheLookup(topoLocalCache, localCacheKey, xml);
+    if (xml->maxIndex) {
+      bool found = false;
+      NCCLCHECKGOTO(ncclTopoCacheSetRanks(comm, xml, &comm->rank, 1, &found), ret, fail);
+      if (found) {
+        INFO(NCCL_GRAPH, "Topology of GPU %lx taken from the cache", comm->peerInfo[comm->rank].busId);
+        NCCLCHECKGOTO(ncclTopoCacheNetDeviceType(comm), ret, fail);
+        goto detected;
+      }
+    }
+    memset(xml, 0, xmlMemSize(NCCL_TOPO_XML_MAX_NODES));
+    xml->maxNodes = NCCL_TOPO_XML_MAX_NODES;
+  }
+  xmlTopoFile = ncclGetEnv("NCCL_TOPO_FILE");
   if (xmlTopoFile) {
     INFO(NCCL_ENV, "NCCL_TOPO_FILE set by environment to %s", xmlTopoFile);
     NCCLCHECKGOTO(ncclTopoGetXmlFromFile(xmlTopoFile, xml, 1), ret, fail);
@@ -805,7 +1003,9 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
 
   // Remove XML branches which don't have a node with keep="1" (typically when importing a topology)
   NCCLCHECKGOTO(ncclTopoTrimXml(xml), ret, fail);
+  if (useCache) ncclTopoCacheInsert(topoLocalCache, localCacheKey, xml);
 
+detected:
   // XML topo fusion.
   if (comm->MNNVL) {
     // MNNVL clique support
@@ -844,7 +1044,9 @@ ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** sy
     NCCLCHECKGOTO(ncclTopoConvertXml(peerXml, (uintptr_t)peerXml->nodes, 0), ret, fail);
     NCCLCHECKGOTO(ncclTopoFuseXml(xml, peerXml), ret, fail);
   }
+  if (useCache) ncclTopoCachePut(comm, cacheKey, xml, localRank);
 
+fused:
   xmlTopoFile = ncclGetEnv("NCCL_TOPO_DUMP_FILE");
   if (xmlTopoFile && comm->rank == ncclParamTopoDumpFileRank()) {
     INFO(NCCL_ENV, "NCCL_TOPO_DUMP_FILE set by environment to %s", xmlTopoFile);
@@ -861,6 +1063,48 @@ fail:
   goto exit;
 }
 
+// Split children run on GPUs of their parent, so they start from its trimmed system instead of
+// detecting it again. GPUs of the parent that left are removed and the others take their child rank.
+ncclResult_t ncclTopoGetSystemFromParent(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoSystem** system, bool* changed) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclTopoSystem* topo;
+  uint64_t hostHash = comm->peerInfo[comm->rank].hostHash;
+  bool found = false;
+  *changed = false;
+  NCCLCHECK(ncclTopoDupSystem(parent->topo, &topo));
+  for (int g=topo->nodes[GPU].count-1; g>=0; g--) {
+    struct ncclTopoNode* gpu = topo->nodes[GPU].nodes+g;
+    int rank = -1;
+    for (int r=0; r<comm->nRanks; r++) {
+      if (comm->peerInfo[r].hostHash == hostHash && comm->peerInfo[r].busId == NCCL_TOPO_ID_LOCAL_ID(gpu->id)) rank = r;
+    }
+    if (rank == -1) {
+      NCCLCHECKGOTO(ncclTopoRemoveNode(topo, GPU, g), ret, fail);
+      *changed = true;
+    } else {
+      gpu->gpu.rank = rank;
+      if (rank == comm->rank) found = true;
+    }
+  }
+  if (!found) {
+    WARN("Could not find rank %d busId %lx in the topology of its parent", comm->rank, comm->busId);
+    ret = ncclInternalError;
+    goto fail;
+  }
+  // Same as ncclTopoTrimSystem, the parent may have needed NICs the child does not
+  if (topo->nodes[GPU].count == comm->nRanks && topo->nodes[NET].count > 0) {
+    for (int n=topo->nodes[NET].count-1; n>=0; n--) NCCLCHECKGOTO(ncclTopoRemoveNode(topo, NET, n), ret, fail);
+    *changed = true;
+  }
+  comm->netDeviceType = parent->netDeviceType;
+  *system = topo;
+  INFO(NCCL_GRAPH, "Topology of %d GPUs and %d NICs inherited from parent comm %p", topo->nodes[GPU].count, topo->nodes[NET].count, parent);
+  return ncclSuccess;
+fail:
+  ncclTopoFree(topo);
+  return ret;
+}
+
 ncclResult_t ncclTopoGetLocal(struct ncclTopoSystem* system, int type, int index, int resultType, int** locals, int* localCount, int* pathType) {
   int minType = PATH_DIS;
   float maxBw = 0;
@@ -129,6 +129,7 @@ struct ncclTopoNode {
       int gdrSupport;
       int collSupport;
       int maxChannels;
+      int rail; // Switch of a rail-optimized fabric the NIC is on, -1 when unknown
     }net;
     struct {
       int arch;
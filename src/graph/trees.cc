@@ -5,6 +5,9 @@
  ************************************************************************/
 
 #include "nccl.h"
+#include "alloc.h"
+#include "checks.h"
+#include <algorithm>
 
 #define RANK_TO_INDEX(r) (rank > root ? rank-1 : rank)
 
@@ -107,3 +110,124 @@ ncclResult_t ncclGetDtree(int nranks, int rank, int* s0, int* d0_0, int* d0_1, i
   }
   return ncclSuccess;
 }
+
+/* Build a tree over nodes grouped under leaf switches, with at most arity children per node.
+ * Nodes of a leaf form a btree (a chain with arity 1) rooted at their first node. The leaves
+ * form a btree (or chain) of their own, the root of a leaf hanging off the node of its parent
+ * leaf that has a free child slot closest to that leaf's root, so that each edge between leaves
+ * crosses the spine once and no other edge does.
+ */
+static ncclResult_t getFabricTree(int nNodes, const int* order, const int* nodeLeaf, int arity,
+    int* parent, int* child0, int* child1, int* depth) {
+  ncclResult_t ret = ncclSuccess;
+  int *leafOf = NULL, *leafStart = NULL, *members = NULL, *pos = NULL, *nodeDepth = NULL;
+  int nLeaves = 0;
+  NCCLCHECKGOTO(ncclCalloc(&leafOf, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&leafStart, nNodes+1), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&members, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&pos, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&nodeDepth, nNodes), ret, exit);
+
+  // Leaves and their members in the given order of nodes
+  for (int i = 0; i < nNodes; i++) {
+    int n = order[i], l;
+    for (l = 0; l < i; l++) if (nodeLeaf[order[l]] == nodeLeaf[n]) break;
+    leafOf[i] = l == i ? nLeaves++ : leafOf[l];
+  }
+  for (int i = 0; i < nNodes; i++) leafStart[leafOf[i]+1]++;
+  for (int l = 0; l < nLeaves; l++) leafStart[l+1] += leafStart[l];
+  for (int i = 0; i < nNodes; i++) members[leafStart[leafOf[i]] + pos[leafOf[i]]++] = order[i];
+
+  for (int n = 0; n < nNodes; n++) parent[n] = child0[n] = child1[n] = -1;
+  for (int l = 0; l < nLeaves; l++) {
+    int* m = members+leafStart[l];
+    int k = leafStart[l+1]-leafStart[l];
+    for (int i = 0; i < k; i++) {
+      int u, d0, d1, pct;
+      if (arity == 1) {
+        u = i-1; d0 = -1; d1 = i+1 < k ? i+1 : -1;
+      } else {
+        NCCLCHECKGOTO(ncclGetBtree(k, i, &u, &d0, &d1, &pct), ret, exit);
+      }
+      parent[m[i]] = u == -1 ? -1 : m[u];
+      child0[m[i]] = d0 == -1 ? -1 : m[d0];
+      child1[m[i]] = d1 == -1 ? -1 : m[d1];
+    }
+    for (int i = 0; i < k; i++) {
+      int d = 0;
+      for (int p = parent[m[i]]; p != -1; p = parent[p]) d++;
+      nodeDepth[m[i]] = d;
+    }
+  }
+
+  // Hang the root of each leaf off its parent leaf
+  for (int l = 1; l < nLeaves; l++) {
+    int up, d0, d1, pct, best = -1;
+    if (arity == 1) up = l-1;
+    else NCCLCHECKGOTO(ncclGetBtree(nLeaves, l, &up, &d0, &d1, &pct), ret, exit);
+    int* m = members+leafStart[up];
+    int k = leafStart[up+1]-leafStart[up];
+    for (int i = 0; i < k; i++) {
+      int free = (child1[m[i]] == -1) + (arity > 1 && child0[m[i]] == -1);
+      if (free && (best == -1 || nodeDepth[m[i]] < nodeDepth[best])) best = m[i];
+    }
+    if (best == -1) {
+      WARN("Internal error : no free child slot on leaf %d for leaf %d", up, l);
+      ret = ncclInternalError;
+      goto exit;
+    }
+    int root = members[leafStart[l]];
+    parent[root] = best;
+    if (child1[best] == -1) child1[best] = root;
+    else child0[best] = root;
+  }
+
+  // Depth of the whole tree, leaves hang below nodes of any depth
+  *depth = 0;
+  for (int n = 0; n < nNodes; n++) {
+    int d = 0;
+    for (int p = parent[n]; p != -1; p = parent[p]) d++;
+    if (d > *depth) *depth = d;
+  }
+exit:
+  free(leafOf);
+  free(leafStart);
+  free(members);
+  free(pos);
+  free(nodeDepth);
+  return ret;
+}
+
+/* Double tree over leaf switches: the second tree is built over the nodes in reverse order,
+ * so that nodes inside the first tree are mostly at the bottom of the second one.
+ */
+ncclResult_t ncclGetFabricDtree(int nNodes, int node, const int* nodeLeaf, int arity, int* depth,
+    int* s0, int* d0_0, int* d0_1, int* parentChildType0, int* s1, int* d1_0, int* d1_1, int* parentChildType1) {
+  ncclResult_t ret = ncclSuccess;
+  int *order = NULL, *parent = NULL, *child0 = NULL, *child1 = NULL;
+  int depth0, depth1;
+  NCCLCHECKGOTO(ncclCalloc(&order, nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&parent, 2*nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&child0, 2*nNodes), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&child1, 2*nNodes), ret, exit);
+  for (int i = 0; i < nNodes; i++) order[i] = i;
+  NCCLCHECKGOTO(getFabricTree(nNodes, order, nodeLeaf, arity, parent, child0, child1, &depth0), ret, exit);
+  for (int i = 0; i < nNodes; i++) order[i] = nNodes-1-i;
+  NCCLCHECKGOTO(getFabricTree(nNodes, order, nodeLeaf, arity, parent+nNodes, child0+nNodes, child1+nNodes, &depth1), ret, exit);
+
+  *s0 = parent[node];
+  *d0_0 = child0[node];
+  *d0_1 = child1[node];
+  *parentChildType0 = *s0 == -1 || child0[*s0] == node ? 0 : 1;
+  *s1 = parent[nNodes+node];
+  *d1_0 = child0[nNodes+node];
+  *d1_1 = child1[nNodes+node];
+  *parentChildType1 = *s1 == -1 || child0[nNodes+*s1] == node ? 0 : 1;
+  *depth = std::max(depth0, depth1);
+exit:
+  free(order);
+  free(parent);
+  free(child0);
+  free(child1);
+  return ret;
+}
@@ -8,6 +8,7 @@
 #include "device.h"
 #include "comm.h"
 #include "topo.h"
+#include "ll128_check.h"
 
 NCCL_PARAM(Nthreads, "NTHREADS", -2);
 NCCL_PARAM(Ll128Nthreads, "LL128_NTHREADS", -2);
@@ -105,6 +106,30 @@ static const double perChMaxTreeBws[3][3] = {
   /* Hopper (N1/N2/N4) */ {38.7, 41.4, 36.0},
 };
 
+static int compCapIdx(int compCap) {
+  return compCap >= 90 ? HOPPER_COMPCAP_IDX : compCap >= 80 ? AMPERE_COMPCAP_IDX : VOLTA_COMPCAP_IDX;
+}
+
+// Every hop runs at the speed of the GPUs at its ends, so a comm mixing generations is capped
+// by the lowest cap among the generations it has, which need not be the oldest one's
+static double compCapsMinBw(const double bws[3][3], int compCapIdxMask, int index) {
+  double bw = -1;
+  for (int i = 0; i < 3; i++) {
+    if ((compCapIdxMask & (1 << i)) && (bw < 0 || bws[i][index] < bw)) bw = bws[i][index];
+  }
+  return bw;
+}
+
+// GPU generations LL128 is tested on
+static int ll128TestedCompCap(int compCap) {
+  switch (compCap) {
+  case 70: return 1;
+  case 80: return 1;
+  case 90: return 1;
+  default: return 0;
+  }
+}
+
 NCCL_PARAM(PatEnable, "PAT_ENABLE", 2);
 static int ncclPatEnable(struct ncclComm* comm) {
   int patEnable = ncclParamPatEnable();
@@ -143,16 +168,21 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
   int nRanks = comm->nRanks;
   if (nRanks <= 1) return ncclSuccess;
 
-  int compCapIndex = minCompCap >= 90 ? HOPPER_COMPCAP_IDX : minCompCap >= 80 ? AMPERE_COMPCAP_IDX : VOLTA_COMPCAP_IDX;
+  int compCapIdxMask = 1 << compCapIdx(minCompCap);
+  int ll128Tested = ll128TestedCompCap(minCompCap);
+  for (int r = 0; comm->peerInfo && r < nRanks; r++) {
+    compCapIdxMask |= 1 << compCapIdx(comm->peerInfo[r].cudaCompCap);
+    ll128Tested &= ll128TestedCompCap(comm->peerInfo[r].cudaCompCap);
+  }
   int cpuArch, cpuVendor, cpuModel;
   NCCLCHECK(ncclTopoCpuType(comm->topo, &cpuArch, &cpuVendor, &cpuModel));
   int index2 = nNodes <= 2 ? nNodes-1 : 2;
   // LL: for single node, we look at GPU type; for multi-node, we look at CPU type
-  int index1 = nNodes == 1 ? compCapIndex : cpuVendor == NCCL_TOPO_CPU_VENDOR_AMD ? 1 : 0;
-  double llMaxBw = llMaxBws[index1][index2];
-  double perChMaxTreeBw = perChMaxTreeBws[compCapIndex][index2];
-  double perChMaxRingLL128Bw = perChMaxRingLL128Bws[compCapIndex][index2];
-  double perChMaxTreeLL128Bw = perChMaxTreeLL128Bws[compCapIndex][index2];
+  int index1 = cpuVendor == NCCL_TOPO_CPU_VENDOR_AMD ? 1 : 0;
+  double llMaxBw = nNodes == 1 ? compCapsMinBw(llMaxBws, compCapIdxMask, 0) : llMaxBws[index1][index2];
+  double perChMaxTreeBw = compCapsMinBw(perChMaxTreeBws, compCapIdxMask, index2);
+  double perChMaxRingLL128Bw = compCapsMinBw(perChMaxRingLL128Bws, compCapIdxMask, index2);
+  double perChMaxTreeLL128Bw = compCapsMinBw(perChMaxTreeLL128Bws, compCapIdxMask, index2);
   // De-penalize Tree/Simple latency on Power systems to favor Tree than Ring
   if (cpuArch == NCCL_TOPO_CPU_ARCH_POWER) hwLat[NCCL_HW_PCI][NCCL_ALGO_TREE][NCCL_PROTO_SIMPLE] = hwLat[NCCL_HW_PCI][NCCL_ALGO_RING][NCCL_PROTO_SIMPLE];
   float ppn = (float)nRanks / nNodes;
@@ -284,6 +314,23 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
     }
   }
 
+  // Hierarchical PAT: one NVLink step between the local ranks, each a send/recv group on the
+  // ring channels, then log steps along the rail that only cross the network. On NVLS the NVLink
+  // step is one collective of the local ranks that the switch reduces or multicasts.
+  for (int i = 0; i < 3; i++) comm->hierPatLat[i] = comm->hierPatBw[i] = 0;
+  if (nNodes > 1 && ppn > 1) {
+    int a = NCCL_ALGO_RING, p = NCCL_PROTO_SIMPLE;
+    comm->hierPatLat[0] = baseLat[a][p] + hwLat[intraHw[a]][a][p];
+    comm->hierPatLat[1] = baseLat[a][p] + hwLat[NCCL_HW_NET][NCCL_ALGO_TREE][p] + 2*graphs[a]->latencyInter;
+    comm->hierPatBw[0] = graphs[a]->nChannels * graphs[a]->bwIntra;
+    comm->hierPatBw[1] = graphs[a]->nChannels * graphs[a]->bwInter * .85;
+    if (comm->nvlsSupport && graphs[NCCL_ALGO_NVLS]->nChannels > 0) {
+      a = NCCL_ALGO_NVLS;
+      comm->hierPatLat[2] = baseLat[a][p] + hwLat[NCCL_HW_NVLINK][a][p];
+      comm->hierPatBw[2] = graphs[a]->nChannels * graphs[a]->bwIntra;
+    }
+  }
+
   // Protocols/Algorithms enable/disable, and user overrides.
   // All are enabled except ll128 which is enabled by default only in certain cases.
   int protoEnable[NCCL_NUM_PROTOCOLS] = { 1, 2, 1 };
@@ -319,6 +366,23 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
     if (nvsCount == 0) algoEnable[NCCL_ALGO_COLLNET_DIRECT] = 0;
   }
 
+  // These kernels split a block of NCCL_MAX_NTHREADS threads, smaller blocks of a thread cap cannot run them
+  if (comm->config.maxCTAThreads > 0 && comm->config.maxCTAThreads < NCCL_MAX_NTHREADS) {
+    algoEnable[NCCL_ALGO_COLLNET_DIRECT] = 0;
+    algoEnable[NCCL_ALGO_NVLS] = 0;
+    algoEnable[NCCL_ALGO_NVLS_TREE] = 0;
+    algoEnable[NCCL_ALGO_PAT] = 0;
+    if (algoEnable[NCCL_ALGO_RING] == 0 && algoEnable[NCCL_ALGO_TREE] == 0 && algoEnable[NCCL_ALGO_COLLNET_CHAIN] == 0) {
+      algoEnable[NCCL_ALGO_RING] = algoEnable[NCCL_ALGO_TREE] = 1;
+    }
+  }
+
+  // Links every rank saw keep 128-byte lines whole, and the ones LL128 would go over here
+  int ll128Passed = comm->peerInfo ? ~0 : 0;
+  for (int r = 0; comm->peerInfo && r < nRanks; r++) ll128Passed &= comm->peerInfo[r].ll128Check;
+  int ll128Needed = (nNodes > 1 ? NCCL_LL128_CHECK_DMA|NCCL_LL128_CHECK_HOST : 0) |
+                    (nRanks > nNodes ? NCCL_LL128_CHECK_P2P|NCCL_LL128_CHECK_HOST : 0);
+
   for (int c=0; c<NCCL_NUM_FUNCTIONS; c++) for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     int pEnable = protoEnable[p];
     if (pEnable == 2 && p == NCCL_PROTO_LL128) {
@@ -326,14 +390,14 @@ ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCom
       pEnable = 1;
       pEnable &= (graphs[a]->typeInter <= PATH_PXB || (minCompCap >= 90 && graphs[a]->typeInter <= PATH_PXN));
       pEnable &= (graphs[a]->typeIntra <= PATH_NVB);
-      pEnable &= (minCompCap == maxCompCap);
-      switch (minCompCap) {
-      case 70: pEnable &= 1; break;
-      case 80: pEnable &= 1; break;
-      case 90: pEnable &= !(CUDART_VERSION == 11080 && c == ncclFuncAllReduce && a == NCCL_ALGO_RING && comm->nRanks == 2); break;
-      default: pEnable &= 0; break;
-      }
+      pEnable &= ll128Tested;
+      // Elsewhere, enable it when the links it uses passed the self-test on every rank
+      if (pEnable == 0 && ll128Needed) pEnable = (ll128Passed & ll128Needed) == ll128Needed;
+      // Generations can differ between nodes, whose GPUs only see LL128 lines through the network
+      pEnable &= (minCompCap == maxCompCap || comm->compCapPerNode);
+      if (minCompCap == 90) pEnable &= !(CUDART_VERSION == 11080 && c == ncclFuncAllReduce && a == NCCL_ALGO_RING && comm->nRanks == 2);
     }
+    if (p == NCCL_PROTO_LL128 && comm->config.maxCTAThreads > 0 && comm->config.maxCTAThreads < NCCL_LL128_MAX_NTHREADS/4) pEnable = 0;
     if (pEnable == 0) comm->bandwidths[c][a][p] = 0;
     if (algoEnable[a] == 0) comm->bandwidths[c][a][p] = 0;
     if (a == NCCL_ALGO_RING && pEnable == 0) comm->ringbdw[c][p] = 0;
@@ -438,6 +502,22 @@ static float treeCorrectionFactor[NCCL_NUM_PROTOCOLS][23] = {
   {  .9,  .9,  .9,  .9,  .9,  .9,  .9,  .8,  .7,  .6,  .6,  .5,  .5,  .5,  .5,  .6,  .7,  .8,  .7,  .7,  .8,  .9,  .9 }
 };
 
+ncclResult_t ncclTopoGetHierPatTime(struct ncclComm* comm, size_t nBytes, bool nvls, float* time) {
+  int nvl = nvls ? 2 : 0;
+  if (comm->hierPatBw[nvl] == 0 || comm->hierPatBw[1] == 0) {
+    *time = -1.0; return ncclSuccess;
+  }
+  int nNodes = comm->nNodes;
+  int localRanks = comm->localRanks;
+  int railSteps = log2i(nNodes-1) + 1;
+  // A rank moves (nNodes-1) blocks along its rail and the nBytes/localRanks of every other local rank over NVLink
+  double railBytes = (double)nBytes / localRanks * (nNodes-1) / nNodes;
+  double nvlBytes = (double)nBytes * (localRanks-1) / localRanks;
+  *time = comm->hierPatLat[nvl] + railSteps * comm->hierPatLat[1]
+    + nvlBytes / (1000 * comm->hierPatBw[nvl]) + railBytes / (1000 * comm->hierPatBw[1]);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoGetAlgoTime(struct ncclComm* comm, int coll, int algorithm, int protocol, size_t nBytes, int numPipeOps, float* time, bool* backup) {
   float bw = comm->bandwidths[coll][algorithm][protocol];
   float lat = comm->latencies[coll][algorithm][protocol];
@@ -454,9 +534,13 @@ ncclResult_t ncclTopoGetAlgoTime(struct ncclComm* comm, int coll, int algorithm,
   if (bw == 0) {
     *time = -1.0; return ncclSuccess;
   }
+  // Bandwidths are for all channels, an SM budget leaves fewer of them
+  int nc = (algorithm == NCCL_ALGO_NVLS || algorithm == NCCL_ALGO_NVLS_TREE) ? comm->nvlsChannels : comm->nChannels;
+  if (comm->config.smBudget > 0 && comm->config.smBudget < nc) bw = bw * comm->config.smBudget / nc;
   int logSize = log2i(nBytes>>6);
-  if (algorithm == NCCL_ALGO_TREE && coll == ncclFuncAllReduce && logSize >= 0 && logSize < 23) bw *= treeCorrectionFactor[protocol][logSize];
-  if (algorithm == NCCL_ALGO_RING && protocol == NCCL_PROTO_SIMPLE && comm->nNodes > 1
+  bool calibrated = coll == ncclFuncAllReduce && comm->tuningCalibrated;
+  if (!calibrated && algorithm == NCCL_ALGO_TREE && coll == ncclFuncAllReduce && logSize >= 0 && logSize < 23) bw *= treeCorrectionFactor[protocol][logSize];
+  if (!calibrated && algorithm == NCCL_ALGO_RING && protocol == NCCL_PROTO_SIMPLE && comm->nNodes > 1
       && coll == ncclFuncAllReduce && nBytes/(comm->nChannels*comm->nRanks) >= 64) {
     lat *= comm->minCompCap < 80 ? 1.9 : 1.4; // Plateau effect of ring
   }
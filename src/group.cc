@@ -12,6 +12,9 @@
 #include "channel.h"
 #include <assert.h>
 #include "bootstrap.h"
+#include "info.h"
+#include "cudawrap.h"
+#include "simtimeline.h"
 
 #include "msccl/msccl_lifecycle.h"
 
@@ -25,6 +28,22 @@ __thread struct ncclGroupJob ncclGroupJobMain;
 __thread int ncclGroupBlocking = -1; /* default mode */
 __thread bool ncclGroupJobAbortFlag = false;
 
+NCCL_PARAM(ImplicitAgg, "IMPLICIT_AGG", 0);
+NCCL_PARAM(ImplicitAggMaxBytes, "IMPLICIT_AGG_MAX_BYTES", 1 << 20);
+NCCL_PARAM(ImplicitAggMaxOps, "IMPLICIT_AGG_MAX_OPS", 16);
+NCCL_PARAM(ImplicitAggWindowUs, "IMPLICIT_AGG_WINDOW_US", 50);
+
+// Collectives left pending by ncclEnqueueCheck, their comm is in ncclGroupCommHead, or in
+// ncclImplicitBatch between two calls of the thread
+__thread struct ncclComm* ncclImplicitComm = nullptr;
+__thread cudaStream_t ncclImplicitStream = nullptr;
+__thread int ncclImplicitOps = 0;
+__thread size_t ncclImplicitBytes = 0;
+__thread uint64_t ncclImplicitStart = 0;
+__thread struct ncclImplicitBatch* ncclImplicitBatch = nullptr;
+
+static ncclResult_t groupImplicitPark();
+
 void* ncclAsyncJobMain(void* arg);
 
 ncclResult_t ncclAsyncLaunch(
@@ -81,9 +100,94 @@ void* ncclAsyncJobMain(void* arg) {
   return arg;
 }
 
+NCCL_PARAM(AsyncJobPool, "ASYNC_JOB_POOL", 1);
+// Idle threads the pool keeps, the others exit once their job is done
+NCCL_PARAM(AsyncJobPoolIdle, "ASYNC_JOB_POOL_IDLE", 64);
+
+// Threads running async jobs, parked between jobs instead of exiting. A job never waits for a
+// thread, one is started when none is idle, so that the jobs of a group waiting on each other all run.
+struct ncclAsyncWorker {
+  pthread_cond_t cond;
+  struct ncclAsyncJob* job;
+  struct ncclAsyncWorker* next;
+};
+
+static pthread_mutex_t asyncPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclAsyncWorker* asyncPoolIdle = nullptr;
+static int asyncPoolIdleCount = 0;
+
+static void* asyncWorkerMain(void* arg) {
+  struct ncclAsyncWorker* worker = (struct ncclAsyncWorker*)arg;
+  cpu_set_t affinity;
+  sched_getaffinity(0, sizeof(cpu_set_t), &affinity);
+  ncclSetThreadName(pthread_self(), "NCCL AsyncJob");
+  pthread_mutex_lock(&asyncPoolLock);
+  while (true) {
+    struct ncclAsyncJob* job = worker->job;
+    pthread_mutex_unlock(&asyncPoolLock);
+    // The job may be freed as soon as it is done
+    ncclAsyncJobMain(job);
+    // Jobs pin the thread to the CPUs of their comm, the next one may belong to another comm
+    sched_setaffinity(0, sizeof(cpu_set_t), &affinity);
+    pthread_mutex_lock(&asyncPoolLock);
+    worker->job = nullptr;
+    if (asyncPoolIdleCount >= ncclParamAsyncJobPoolIdle()) break;
+    worker->next = asyncPoolIdle;
+    asyncPoolIdle = worker;
+    asyncPoolIdleCount++;
+    while (worker->job == nullptr) pthread_cond_wait(&worker->cond, &asyncPoolLock);
+  }
+  pthread_mutex_unlock(&asyncPoolLock);
+  pthread_cond_destroy(&worker->cond);
+  free(worker);
+  return NULL;
+}
+
+static ncclResult_t asyncJobStart(struct ncclAsyncJob* job) {
+  struct ncclAsyncWorker* worker;
+  job->pooled = ncclParamAsyncJobPool() != 0;
+  if (!job->pooled) {
+    PTHREADCHECK(pthread_create(&job->thread, nullptr, ncclAsyncJobMain, job), "pthread_create");
+    return ncclSuccess;
+  }
+  pthread_mutex_lock(&asyncPoolLock);
+  worker = asyncPoolIdle;
+  if (worker) {
+    asyncPoolIdle = worker->next;
+    asyncPoolIdleCount--;
+    worker->job = job;
+    pthread_cond_signal(&worker->cond);
+  }
+  pthread_mutex_unlock(&asyncPoolLock);
+  if (worker) return ncclSuccess;
+
+  pthread_t thread;
+  NCCLCHECK(ncclCalloc(&worker, 1));
+  pthread_cond_init(&worker->cond, NULL);
+  worker->job = job;
+  int err = pthread_create(&thread, nullptr, asyncWorkerMain, worker);
+  if (err != 0) {
+    WARN("Could not start an async job thread : %s", strerror(err));
+    pthread_cond_destroy(&worker->cond);
+    free(worker);
+    return ncclSystemError;
+  }
+  pthread_detach(thread);
+  return ncclSuccess;
+}
+
+static ncclResult_t asyncJobJoin(struct ncclAsyncJob* job) {
+  if (job->pooled) {
+    while (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == ncclGroupJobRunning) usleep(1);
+  } else {
+    PTHREADCHECK(pthread_join(job->thread, NULL), "pthread_join");
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclAsyncJobComplete(struct ncclAsyncJob* job) {
   ncclResult_t ret;
-  PTHREADCHECK(pthread_join(job->thread, NULL), "pthread_join");
+  NCCLCHECK(asyncJobJoin(job));
   if (job->result != ncclSuccess) {
     WARN("ncclAsyncJobComplete: job %p failed, job error %d", job, job->result);
   }
@@ -92,6 +196,69 @@ ncclResult_t ncclAsyncJobComplete(struct ncclAsyncJob* job) {
   return ret;
 }
 
+static void groupImplicitReset() {
+  ncclImplicitComm = nullptr;
+  ncclImplicitOps = 0;
+  ncclImplicitBytes = 0;
+}
+
+ncclResult_t ncclGroupImplicitFlush() {
+  NCCLCHECK(ncclGroupImplicitReclaim());
+  if (ncclImplicitComm == nullptr) return ncclSuccess;
+  groupImplicitReset();
+  // Within a group, they are launched with it
+  if (ncclGroupDepth > 0) return ncclSuccess;
+  // They are NCCL tasks only, MSCCL stays out of their launch
+  bool mscclCaller = mscclIsCaller();
+  if (!mscclCaller) mscclSetIsCallerFlag();
+  ncclResult_t ret = ncclGroupStartInternal();
+  if (ret == ncclSuccess) ret = ncclGroupEndInternal();
+  if (!mscclCaller) mscclClearIsCallerFlag();
+  return ret;
+}
+
+ncclResult_t ncclGroupImplicitCheck(struct ncclInfo* info, bool* defer) {
+  *defer = false;
+  if (ncclParamImplicitAgg() == 0) return ncclSuccess;
+  NCCLCHECK(ncclGroupImplicitReclaim());
+  struct ncclComm* comm = info->comm;
+  size_t bytes = info->count*ncclTypeSize(info->datatype);
+  size_t maxBytes = ncclParamImplicitAggMaxBytes();
+  bool eligible = ncclGroupDepth == 0 && comm != NULL && comm->config.blocking == 1 && comm->nRanks > 1 &&
+    info->coll != ncclFuncSend && info->coll != ncclFuncRecv && bytes <= maxBytes &&
+    // MSCCL would start a group of its own around the call
+    !(mscclAvailable() && !mscclIsCaller());
+  if (eligible) {
+    // Captured work must be launched before the capture ends, which NCCL does not see
+    struct ncclCudaGraph graph;
+    NCCLCHECK(ncclCudaGetCapturingGraph(&graph, info->stream));
+    eligible = !ncclCudaGraphValid(graph);
+  }
+  if (ncclImplicitComm != nullptr && !(eligible && comm == ncclImplicitComm && info->stream == ncclImplicitStream &&
+        ncclImplicitBytes + bytes <= maxBytes)) {
+    NCCLCHECK(ncclGroupImplicitFlush());
+  }
+  if (!eligible) return ncclSuccess;
+  if (ncclImplicitComm == nullptr) {
+    ncclImplicitComm = comm;
+    ncclImplicitStream = info->stream;
+    ncclImplicitStart = clockNano();
+  }
+  ncclImplicitOps++;
+  ncclImplicitBytes += bytes;
+  // The last collective of a full or expired batch launches it
+  *defer = ncclImplicitOps < ncclParamImplicitAggMaxOps() &&
+    clockNano() - ncclImplicitStart < (uint64_t)ncclParamImplicitAggWindowUs()*1000;
+  if (!*defer) groupImplicitReset();
+  return ncclSuccess;
+}
+
+ncclResult_t ncclGroupImplicitDefer() {
+  // Leave the tasks in the group of the thread without launching them
+  ncclGroupDepth--;
+  return groupImplicitPark();
+}
+
 NCCL_API(ncclResult_t, ncclGroupStart);
 ncclResult_t ncclGroupStart() {
   ncclResult_t ret = ncclSuccess;
@@ -194,12 +361,191 @@ fail:
   goto exit;
 }
 
+NCCL_PARAM(GroupParallelLaunch, "GROUP_PARALLEL_LAUNCH", 1);
+
+// Persistent thread of a CUDA device, running the part of the groups of any thread that
+// belongs to the comms of that device
+struct ncclGroupWorkItem {
+  struct ncclComm* head;
+  int cudaDev;
+  ncclResult_t (*func)(struct ncclComm* comm, int index, void* arg);
+  void* arg;
+  ncclResult_t result;
+  bool done;
+  struct ncclGroupWorkItem* next;
+};
+
+struct ncclGroupWorker {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int cudaDev;
+  struct ncclIntruQueue<struct ncclGroupWorkItem, &ncclGroupWorkItem::next> queue;
+};
+
+static pthread_mutex_t groupWorkersLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclGroupWorker** groupWorkers = nullptr;
+static int groupWorkersCount = 0;
+
+// Comms of a device are done in the order of the group, index is the place of comm in it
+static ncclResult_t groupRunDevice(struct ncclComm* head, int cudaDev, ncclResult_t (*func)(struct ncclComm*, int, void*), void* arg) {
+  int i = 0;
+  for (struct ncclComm* comm = head; comm != nullptr; comm = comm->groupNext, i++) {
+    if (comm->cudaDev != cudaDev) continue;
+    CUDACHECK(cudaSetDevice(cudaDev));
+    NCCLCHECK(func(comm, i, arg));
+  }
+  return ncclSuccess;
+}
+
+static void* groupWorkerMain(void* arg) {
+  struct ncclGroupWorker* worker = (struct ncclGroupWorker*)arg;
+  cudaSetDevice(worker->cudaDev);
+  pthread_mutex_lock(&worker->mutex);
+  while (true) {
+    while (ncclIntruQueueEmpty(&worker->queue)) pthread_cond_wait(&worker->cond, &worker->mutex);
+    struct ncclGroupWorkItem* item = ncclIntruQueueDequeue(&worker->queue);
+    pthread_mutex_unlock(&worker->mutex);
+    ncclResult_t ret = groupRunDevice(item->head, item->cudaDev, item->func, item->arg);
+    pthread_mutex_lock(&worker->mutex);
+    item->result = ret;
+    item->done = true;
+    pthread_cond_broadcast(&worker->cond);
+  }
+  return NULL;
+}
+
+// NULL when the thread cannot be started, the caller then does the work itself
+static struct ncclGroupWorker* groupWorkerGet(int cudaDev) {
+  struct ncclGroupWorker* worker = nullptr;
+  pthread_mutex_lock(&groupWorkersLock);
+  if (groupWorkers == nullptr) {
+    if (cudaGetDeviceCount(&groupWorkersCount) != cudaSuccess || ncclCalloc(&groupWorkers, groupWorkersCount) != ncclSuccess) {
+      groupWorkersCount = 0;
+      goto exit;
+    }
+  }
+  if (cudaDev >= groupWorkersCount) goto exit;
+  if (groupWorkers[cudaDev] == nullptr) {
+    if (ncclCalloc(&worker, 1) != ncclSuccess) goto exit;
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->cudaDev = cudaDev;
+    ncclIntruQueueConstruct(&worker->queue);
+    if (pthread_create(&worker->thread, NULL, groupWorkerMain, worker) != 0) {
+      WARN("Could not start the group launch thread of device %d, launching from the calling thread", cudaDev);
+      pthread_mutex_destroy(&worker->mutex);
+      pthread_cond_destroy(&worker->cond);
+      free(worker);
+      worker = nullptr;
+      goto exit;
+    }
+    ncclSetThreadName(worker->thread, "NCCL Group%2d", cudaDev);
+    groupWorkers[cudaDev] = worker;
+  }
+  worker = groupWorkers[cudaDev];
+exit:
+  pthread_mutex_unlock(&groupWorkersLock);
+  return worker;
+}
+
+// Groups of a thread driving several GPUs are split by device unless the comms have to launch in lock step
+static bool groupParallelLaunch(struct ncclComm* head) {
+  if (!ncclParamGroupParallelLaunch() || ncclParamLaunchMode == ncclLaunchModeGroup) return false;
+  for (struct ncclComm* comm = head->groupNext; comm != nullptr; comm = comm->groupNext) {
+    if (comm->cudaDev != head->cudaDev) return true;
+  }
+  return false;
+}
+
+// Runs func on every comm of the group, the comms of each device on the thread of that device.
+// The comms of the device of head are done by the calling thread.
+static ncclResult_t groupRunPerDevice(struct ncclComm* head, ncclResult_t (*func)(struct ncclComm*, int, void*), void* arg) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclGroupWorkItem* items;
+  struct ncclGroupWorker** workers;
+  int nComms = 0, nItems = 0;
+  for (struct ncclComm* comm = head; comm != nullptr; comm = comm->groupNext) nComms++;
+  NCCLCHECK(ncclCalloc(&items, nComms));
+  NCCLCHECKGOTO(ncclCalloc(&workers, nComms), ret, fail);
+  for (struct ncclComm* comm = head; comm != nullptr; comm = comm->groupNext) {
+    bool seen = comm->cudaDev == head->cudaDev;
+    for (int i = 0; i < nItems && !seen; i++) seen = items[i].cudaDev == comm->cudaDev;
+    if (seen) continue;
+    struct ncclGroupWorkItem* item = items + nItems;
+    item->head = head;
+    item->cudaDev = comm->cudaDev;
+    item->func = func;
+    item->arg = arg;
+    workers[nItems] = groupWorkerGet(comm->cudaDev);
+    nItems++;
+    if (workers[nItems-1] == nullptr) continue;
+    pthread_mutex_lock(&workers[nItems-1]->mutex);
+    ncclIntruQueueEnqueue(&workers[nItems-1]->queue, item);
+    pthread_cond_broadcast(&workers[nItems-1]->cond);
+    pthread_mutex_unlock(&workers[nItems-1]->mutex);
+  }
+  ret = groupRunDevice(head, head->cudaDev, func, arg);
+  for (int i = 0; i < nItems; i++) {
+    struct ncclGroupWorker* worker = workers[i];
+    if (worker == nullptr) {
+      items[i].result = groupRunDevice(head, items[i].cudaDev, func, arg);
+    } else {
+      pthread_mutex_lock(&worker->mutex);
+      while (!items[i].done) pthread_cond_wait(&worker->cond, &worker->mutex);
+      pthread_mutex_unlock(&worker->mutex);
+    }
+    if (ret == ncclSuccess) ret = items[i].result;
+  }
+  free(workers);
+exit:
+  free(items);
+  return ret;
+fail:
+  goto exit;
+}
+
+// Once the comms of a group are prepared, each launches its plans independently of the others
+static ncclResult_t doLaunchesComm(struct ncclComm* comm, int index, void* arg) {
+  NCCLCHECK(ncclLaunchPrepare(comm));
+  while (comm->planner.unlaunchedPlansHead != nullptr) {
+    struct ncclKernelPlan* plan = comm->planner.unlaunchedPlansHead;
+    comm->planner.unlaunchedPlansHead = plan->next;
+    NCCLCHECK(ncclLaunchKernelBefore_NoUncapturedCuda(comm, plan));
+    NCCLCHECK(ncclLaunchKernel(comm, plan));
+    NCCLCHECK(ncclLaunchKernelAfter_NoCuda(comm, plan));
+  }
+  NCCLCHECK(ncclLaunchFinish(comm));
+  return ncclSuccess;
+}
+
+struct groupPrepared {
+  bool needConnect;
+  bool algoNeedConnect[NCCL_NUM_ALGORITHMS];
+};
+
+static ncclResult_t groupPrepareComm(struct ncclComm* comm, int index, void* arg) {
+  struct groupPrepared* prepared = (struct groupPrepared*)arg + index;
+  return ncclPrepareTasks(comm, prepared->algoNeedConnect, &prepared->needConnect, NULL);
+}
+
 static ncclResult_t doLaunches(struct ncclComm* head) {
   ncclResult_t result = ncclSuccess;
   struct ncclComm* cliqueComm0 = head->intraComm0;
   struct ncclComm* cliqueHead = head;
   struct ncclComm* cliqueNextHead;
   bool useBarrier = ncclParamLaunchMode == ncclLaunchModeGroup;
+  if (groupParallelLaunch(head)) {
+    for (struct ncclComm* comm = head; comm != nullptr; comm = comm->groupNext) {
+      struct ncclComm* first = head;
+      while (first->intraComm0 != comm->intraComm0) first = first->groupNext;
+      if (ncclCudaGraphValid(first->planner.capturingGraph) != ncclCudaGraphValid(comm->planner.capturingGraph)) {
+        WARN("Either none or all communicators in a ncclGroup() can be CUDA graph captured.");
+        return ncclInvalidUsage;
+      }
+    }
+    return groupRunPerDevice(head, doLaunchesComm, NULL);
+  }
   // This outer loop iterates over cliques of comms which are siblings of the
   // same global entity. We calculate a clique as all comms which have the same
   // `intraComm0` value.
@@ -343,7 +689,7 @@ static ncclResult_t asyncJobLaunch(struct ncclIntruQueue<struct ncclAsyncJob, &n
   if (!ncclIntruQueueEmpty(asyncJobsMain)) {
     struct ncclAsyncJob* job = ncclIntruQueueHead(asyncJobsMain);
     do {
-      PTHREADCHECKGOTO(pthread_create(&job->thread, nullptr, ncclAsyncJobMain, job), "pthread_create", ret, fail);
+      NCCLCHECKGOTO(asyncJobStart(job), ret, fail);
       job = job->next;
     } while (job != nullptr);
 
@@ -355,11 +701,7 @@ static ncclResult_t asyncJobLaunch(struct ncclIntruQueue<struct ncclAsyncJob, &n
         if (state == ncclGroupJobRunning) {
           jobsDone = false;
         } else if (state == ncclGroupJobDone) {
-          int err;
-          if ((err = pthread_join(job->thread, nullptr)) != 0) {
-            WARN("Error waiting for pthread_join: %s", strerror(err));
-            ret = ncclSystemError;
-          }
+          if (asyncJobJoin(job) != ncclSuccess) ret = ncclSystemError;
           job->state = ncclGroupJobJoined;
           if (job->result != ncclSuccess && ret == ncclSuccess) {
             ret = job->result;
@@ -401,6 +743,7 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_, ncclSimInfo_t* simInf
   struct ncclComm *groupCommHeadMain = *gjob->groupCommHeadPtr;
   struct ncclComm *groupCommPreconnectHeadMain = *gjob->groupCommPreconnectHeadPtr;
   struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::next> *asyncJobsMain = gjob->asyncJobsPtr;
+  struct groupPrepared* prepared = NULL;
 
   bool *groupAbortFlag = gjob->abortFlagPtr;
 
@@ -433,13 +776,26 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_, ncclSimInfo_t* simInf
     struct ncclComm* comm = groupCommHeadMain;
     struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::next> asyncCollJobs;
     ncclIntruQueueConstruct(&asyncCollJobs);
+    int nComms = 0;
+    for (struct ncclComm* c = comm; c != nullptr; c = c->groupNext) nComms++;
+    if (!simInfo && groupParallelLaunch(comm)) {
+      NCCLCHECKGOTO(ncclCalloc(&prepared, nComms), ret, fail);
+      NCCLCHECKGOTO(groupRunPerDevice(comm, groupPrepareComm, prepared), ret, fail);
+    }
+    int index = 0;
     do {
       bool needConnect = false;
       bool algoNeedConnect[NCCL_NUM_ALGORITHMS];
       memset(algoNeedConnect, 0, sizeof(bool) * NCCL_NUM_ALGORITHMS);
 
-      CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, fail);
-      NCCLCHECKGOTO(ncclPrepareTasks(comm, algoNeedConnect, &needConnect, simInfo), ret, fail);
+      if (prepared) {
+        needConnect = prepared[index].needConnect;
+        memcpy(algoNeedConnect, prepared[index].algoNeedConnect, sizeof(bool) * NCCL_NUM_ALGORITHMS);
+      } else {
+        CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, fail);
+        NCCLCHECKGOTO(ncclPrepareTasks(comm, algoNeedConnect, &needConnect, simInfo), ret, fail);
+      }
+      index++;
 
       if (comm->cuMemSupport && needConnect) {
         struct ncclPreconnectJob* job;
@@ -489,6 +845,7 @@ static ncclResult_t groupLaunch(struct ncclAsyncJob *job_, ncclSimInfo_t* simInf
   CUDACHECK(cudaSetDevice(savedDev));
 
 exit:
+  free(prepared);
   return ret;
 fail:
   groupCleanup(gjob->groupCommHeadPtr, gjob->groupCommPreconnectHeadPtr, gjob->asyncJobsPtr, gjob->groupErrorPtr, gjob->groupBlockingPtr, gjob->abortFlagPtr, ret);
@@ -499,6 +856,316 @@ static ncclResult_t groupLaunchNonBlocking(struct ncclAsyncJob *job_) {
   return groupLaunch(job_ /* estimatedTime = NULL */);
 }
 
+NCCL_PARAM(AsyncLaunch, "ASYNC_LAUNCH", 0);
+
+// Builds plans and launches the groups of one comm posted by ncclGroupEndInternal. The plans
+// are launched on stream, which waits on the user stream at posting time, and the user stream
+// waits for seq to show in flag, which stream writes after the kernels.
+struct ncclAsyncLauncher {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool pending;
+  bool stop;
+  ncclResult_t result;
+  cudaStream_t stream;
+  cudaEvent_t ready;
+  uint32_t* flag;
+  uint32_t seq;
+  // Group state of the posted group, in place of the thread local one of the user thread
+  struct ncclGroupJob job;
+  struct ncclComm* groupCommHead;
+  struct ncclComm* groupCommPreconnectHead;
+  struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::next> asyncJobs;
+  ncclResult_t groupError;
+  bool abortFlag;
+  int groupBlocking;
+};
+
+#if CUDA_VERSION >= 11070
+static void* asyncLauncherMain(void* arg) {
+  struct ncclComm* comm = (struct ncclComm*)arg;
+  struct ncclAsyncLauncher* launcher = comm->asyncLauncher;
+  cudaSetDevice(comm->cudaDev);
+  pthread_mutex_lock(&launcher->mutex);
+  while (true) {
+    while (!launcher->pending && !launcher->stop) pthread_cond_wait(&launcher->cond, &launcher->mutex);
+    if (!launcher->pending) break;
+    pthread_mutex_unlock(&launcher->mutex);
+
+    ncclResult_t ret = groupLaunch(&launcher->job.base);
+    if (ret == ncclSuccess) {
+      CUCHECKGOTO(cuStreamWriteValue32((CUstream)launcher->stream, (CUdeviceptr)launcher->flag, launcher->seq, CU_STREAM_WRITE_VALUE_DEFAULT), ret, done);
+    }
+  done:
+    if (ret != ncclSuccess) {
+      // Nothing will write the flag from the stream, the user stream must not stay blocked
+      WARN("Asynchronous launch failed for comm %p rank %d : %d", comm, comm->rank, ret);
+      __atomic_store_n(launcher->flag, launcher->seq, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&launcher->mutex);
+    if (launcher->result == ncclSuccess) launcher->result = ret;
+    launcher->pending = false;
+    pthread_cond_broadcast(&launcher->cond);
+  }
+  pthread_mutex_unlock(&launcher->mutex);
+  return NULL;
+}
+
+static ncclResult_t asyncLauncherInit(struct ncclComm* comm) {
+  struct ncclAsyncLauncher* launcher;
+  NCCLCHECK(ncclCalloc(&launcher, 1));
+  pthread_mutex_init(&launcher->mutex, NULL);
+  pthread_cond_init(&launcher->cond, NULL);
+  CUDACHECK(cudaStreamCreateWithFlags(&launcher->stream, cudaStreamNonBlocking));
+  CUDACHECK(cudaEventCreateWithFlags(&launcher->ready, cudaEventDisableTiming));
+  NCCLCHECK(ncclCudaHostCalloc(&launcher->flag, 1));
+  comm->asyncLauncher = launcher;
+  PTHREADCHECK(pthread_create(&launcher->thread, NULL, asyncLauncherMain, comm), "pthread_create");
+  ncclSetThreadName(launcher->thread, "NCCL Launch%2d", comm->cudaDev);
+  INFO(NCCL_INIT, "comm %p rank %d launches kernels from a background thread", comm, comm->rank);
+  return ncclSuccess;
+}
+#endif
+
+// A group can be handed to the launcher when it is made of a single comm with its tasks
+// on a single stream not being captured, and has no other job to run.
+static bool groupAsyncLaunchEligible(ncclSimInfo_t* simInfo) {
+#if CUDA_VERSION >= 11070
+  struct ncclComm* comm = ncclGroupCommHead;
+  if (!ncclParamAsyncLaunch() || simInfo != NULL) return false;
+  if (CUPFN(cuStreamWriteValue32) == nullptr || CUPFN(cuStreamWaitValue32) == nullptr) return false;
+  if (comm == nullptr || comm->groupNext != nullptr || ncclGroupCommPreconnectHead != nullptr) return false;
+  if (!ncclIntruQueueEmpty(&ncclAsyncJobs) || !comm->config.blocking) return false;
+  struct ncclKernelPlanner* planner = &comm->planner;
+  if (planner->streams == nullptr || planner->streams->next != nullptr) return false;
+  return !ncclCudaGraphValid(planner->capturingGraph);
+#else
+  return false;
+#endif
+}
+
+// Hand the group of this thread to the launcher of its comm. The user stream is made to wait
+// for the kernels before the launcher even starts building plans.
+static ncclResult_t groupAsyncLaunchPost() {
+#if CUDA_VERSION >= 11070
+  struct ncclComm* comm = ncclGroupCommHead;
+  if (comm->asyncLauncher == nullptr) NCCLCHECK(asyncLauncherInit(comm));
+  NCCLCHECK(ncclAsyncLaunchWait(comm));
+  struct ncclAsyncLauncher* launcher = comm->asyncLauncher;
+  cudaStream_t userStream = comm->planner.streams->stream;
+  CUDACHECK(cudaEventRecord(launcher->ready, userStream));
+  CUDACHECK(cudaStreamWaitEvent(launcher->stream, launcher->ready, 0));
+  uint32_t seq = launcher->seq + 1;
+  CUCHECK(cuStreamWaitValue32((CUstream)userStream, (CUdeviceptr)launcher->flag, seq, CU_STREAM_WAIT_VALUE_GEQ));
+  comm->planner.streams->stream = launcher->stream;
+
+  pthread_mutex_lock(&launcher->mutex);
+  launcher->seq = seq;
+  launcher->groupCommHead = comm;
+  launcher->groupCommPreconnectHead = nullptr;
+  ncclIntruQueueConstruct(&launcher->asyncJobs);
+  launcher->groupError = ncclSuccess;
+  launcher->abortFlag = false;
+  launcher->groupBlocking = 1;
+  memset(&launcher->job, 0, sizeof(launcher->job));
+  launcher->job.groupCommHeadPtr = &launcher->groupCommHead;
+  launcher->job.groupCommPreconnectHeadPtr = &launcher->groupCommPreconnectHead;
+  launcher->job.groupErrorPtr = &launcher->groupError;
+  launcher->job.asyncJobsPtr = &launcher->asyncJobs;
+  launcher->job.abortFlagPtr = &launcher->abortFlag;
+  launcher->job.groupBlockingPtr = &launcher->groupBlocking;
+  launcher->job.initialized = true;
+  launcher->pending = true;
+  pthread_cond_signal(&launcher->cond);
+  pthread_mutex_unlock(&launcher->mutex);
+  // The comm now belongs to the launcher until it is done with the group
+  ncclGroupCommHead = nullptr;
+#endif
+  return ncclSuccess;
+}
+
+ncclResult_t ncclAsyncLaunchWait(struct ncclComm* comm) {
+  struct ncclAsyncLauncher* launcher = comm->asyncLauncher;
+  if (launcher == nullptr) return ncclSuccess;
+  pthread_mutex_lock(&launcher->mutex);
+  while (launcher->pending) pthread_cond_wait(&launcher->cond, &launcher->mutex);
+  ncclResult_t ret = launcher->result;
+  launcher->result = ncclSuccess;
+  pthread_mutex_unlock(&launcher->mutex);
+  return ret;
+}
+
+ncclResult_t ncclAsyncLaunchDestroy(struct ncclComm* comm) {
+  struct ncclAsyncLauncher* launcher = comm->asyncLauncher;
+  if (launcher == nullptr) return ncclSuccess;
+  pthread_mutex_lock(&launcher->mutex);
+  launcher->stop = true;
+  pthread_cond_signal(&launcher->cond);
+  pthread_mutex_unlock(&launcher->mutex);
+  PTHREADCHECK(pthread_join(launcher->thread, nullptr), "pthread_join");
+  CUDACHECK(cudaEventDestroy(launcher->ready));
+  CUDACHECK(cudaStreamDestroy(launcher->stream));
+  NCCLCHECK(ncclCudaHostFree(launcher->flag));
+  pthread_mutex_destroy(&launcher->mutex);
+  pthread_cond_destroy(&launcher->cond);
+  free(launcher);
+  comm->asyncLauncher = nullptr;
+  return ncclSuccess;
+}
+
+// A batch of collectives left pending by a thread, with the group state of the thread holding
+// them. The watchdog launches it once NCCL_IMPLICIT_AGG_WINDOW_US has passed since its first
+// collective, unless the thread takes it back first.
+enum ncclImplicitBatchState { ncclImplicitBatchPending, ncclImplicitBatchLaunching, ncclImplicitBatchLaunched };
+
+struct ncclImplicitBatch {
+  struct ncclImplicitBatch* next;
+  enum ncclImplicitBatchState state;
+  uint64_t deadline;
+  int cudaDev;
+  ncclResult_t result;
+  struct ncclGroupJob job;
+  struct ncclComm* groupCommHead;
+  struct ncclComm* groupCommPreconnectHead;
+  struct ncclIntruQueue<struct ncclAsyncJob, &ncclAsyncJob::next> asyncJobs;
+  ncclResult_t groupError;
+  bool abortFlag;
+  int groupBlocking;
+};
+
+static pthread_mutex_t implicitBatchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t implicitBatchCond = PTHREAD_COND_INITIALIZER;
+// Pending batches of all threads, in the order of their deadlines
+static struct ncclImplicitBatch* implicitBatches = nullptr;
+static bool implicitWatchdogStarted = false;
+
+static void* implicitWatchdogMain(void* arg) {
+  // Batches only hold NCCL tasks, as for ncclGroupImplicitFlush
+  mscclSetIsCallerFlag();
+  pthread_mutex_lock(&implicitBatchLock);
+  while (true) {
+    struct ncclImplicitBatch* batch = implicitBatches;
+    if (batch == nullptr) {
+      pthread_cond_wait(&implicitBatchCond, &implicitBatchLock);
+      continue;
+    }
+    uint64_t now = clockNano();
+    if (now < batch->deadline) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t wakeNs = ts.tv_nsec + (batch->deadline - now);
+      ts.tv_sec += wakeNs / 1000000000ULL;
+      ts.tv_nsec = wakeNs % 1000000000ULL;
+      pthread_cond_timedwait(&implicitBatchCond, &implicitBatchLock, &ts);
+      continue;
+    }
+    implicitBatches = batch->next;
+    batch->state = ncclImplicitBatchLaunching;
+    pthread_mutex_unlock(&implicitBatchLock);
+
+    ncclResult_t ret = ncclSuccess;
+    CUDACHECKGOTO(cudaSetDevice(batch->cudaDev), ret, done);
+    NCCLCHECKGOTO(groupLaunch(&batch->job.base), ret, done);
+  done:
+    if (ret != ncclSuccess) WARN("Launch of the pending collectives of device %d failed : %d", batch->cudaDev, ret);
+    pthread_mutex_lock(&implicitBatchLock);
+    batch->result = ret;
+    batch->state = ncclImplicitBatchLaunched;
+    pthread_cond_broadcast(&implicitBatchCond);
+  }
+  pthread_mutex_unlock(&implicitBatchLock);
+  return NULL;
+}
+
+// Move the group state of the thread, which only holds the pending collectives, to a batch
+static ncclResult_t groupImplicitPark() {
+  struct ncclImplicitBatch* batch;
+  NCCLCHECK(ncclCalloc(&batch, 1));
+  batch->state = ncclImplicitBatchPending;
+  batch->deadline = ncclImplicitStart + (uint64_t)ncclParamImplicitAggWindowUs()*1000;
+  batch->cudaDev = ncclImplicitComm->cudaDev;
+  batch->groupCommHead = ncclGroupCommHead;
+  batch->groupCommPreconnectHead = ncclGroupCommPreconnectHead;
+  batch->asyncJobs = ncclAsyncJobs;
+  batch->groupError = ncclGroupError;
+  batch->abortFlag = ncclGroupJobAbortFlag;
+  batch->groupBlocking = ncclGroupBlocking;
+  batch->job.groupCommHeadPtr = &batch->groupCommHead;
+  batch->job.groupCommPreconnectHeadPtr = &batch->groupCommPreconnectHead;
+  batch->job.groupErrorPtr = &batch->groupError;
+  batch->job.asyncJobsPtr = &batch->asyncJobs;
+  batch->job.abortFlagPtr = &batch->abortFlag;
+  batch->job.groupBlockingPtr = &batch->groupBlocking;
+  batch->job.initialized = true;
+  ncclGroupCommHead = nullptr;
+  ncclGroupCommPreconnectHead = nullptr;
+  ncclIntruQueueConstruct(&ncclAsyncJobs);
+  ncclGroupError = ncclSuccess;
+  ncclGroupJobAbortFlag = false;
+  ncclGroupBlocking = -1;
+
+  pthread_mutex_lock(&implicitBatchLock);
+  if (!implicitWatchdogStarted) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, implicitWatchdogMain, NULL) != 0) {
+      pthread_mutex_unlock(&implicitBatchLock);
+      WARN("Failed to create the thread launching pending collectives");
+      ncclGroupCommHead = batch->groupCommHead;
+      ncclGroupCommPreconnectHead = batch->groupCommPreconnectHead;
+      ncclAsyncJobs = batch->asyncJobs;
+      ncclGroupError = batch->groupError;
+      ncclGroupJobAbortFlag = batch->abortFlag;
+      ncclGroupBlocking = batch->groupBlocking;
+      free(batch);
+      return ncclSystemError;
+    }
+    pthread_detach(thread);
+    ncclSetThreadName(thread, "NCCL ImplAgg");
+    implicitWatchdogStarted = true;
+  }
+  struct ncclImplicitBatch** b = &implicitBatches;
+  while (*b != nullptr && (*b)->deadline <= batch->deadline) b = &(*b)->next;
+  batch->next = *b;
+  *b = batch;
+  // Threads taking back their batch wait on the same condition
+  pthread_cond_broadcast(&implicitBatchCond);
+  pthread_mutex_unlock(&implicitBatchLock);
+  ncclImplicitBatch = batch;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclGroupImplicitReclaim() {
+  struct ncclImplicitBatch* batch = ncclImplicitBatch;
+  if (batch == nullptr) return ncclSuccess;
+  ncclImplicitBatch = nullptr;
+  pthread_mutex_lock(&implicitBatchLock);
+  while (batch->state == ncclImplicitBatchLaunching) pthread_cond_wait(&implicitBatchCond, &implicitBatchLock);
+  if (batch->state == ncclImplicitBatchPending) {
+    for (struct ncclImplicitBatch** b = &implicitBatches; *b != nullptr; b = &(*b)->next) {
+      if (*b == batch) {
+        *b = batch->next;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&implicitBatchLock);
+  ncclResult_t ret = batch->result;
+  if (batch->state == ncclImplicitBatchPending) {
+    ncclGroupCommHead = batch->groupCommHead;
+    ncclGroupCommPreconnectHead = batch->groupCommPreconnectHead;
+    ncclAsyncJobs = batch->asyncJobs;
+    ncclGroupError = batch->groupError;
+    ncclGroupJobAbortFlag = batch->abortFlag;
+    ncclGroupBlocking = batch->groupBlocking;
+  } else {
+    // Launched by the watchdog, the next collective starts a batch of its own
+    groupImplicitReset();
+  }
+  free(batch);
+  return ret;
+}
+
 ncclResult_t ncclGroupEndInternal(ncclSimInfo_t* simInfo) {
   ncclResult_t ret = ncclSuccess;
   ncclSimInfo_t internalSimInfo = NCCL_SIM_INFO_INITIALIZER;
@@ -513,12 +1180,16 @@ ncclResult_t ncclGroupEndInternal(ncclSimInfo_t* simInfo) {
     goto exit;
   }
 
+  // Operations MSCCL takes are timed when its group ends, before those of NCCL
+  if (simInfo && ncclGroupDepth == 1) NCCLCHECK(ncclSimTimelineBegin());
   if (mscclAvailable() && !mscclIsCaller()) {
-    NCCLCHECK(mscclGroupEnd());
+    NCCLCHECK(mscclGroupEnd(simInfo != NULL));
   }
 
   if ((--ncclGroupDepth) > 0) goto exit;
 
+  // Collectives left pending are launched with this group
+  groupImplicitReset();
   if ((ret = ncclGroupError) != ncclSuccess) goto fail;
 
   if (simInfo) {
@@ -566,16 +1237,24 @@ ncclResult_t ncclGroupEndInternal(ncclSimInfo_t* simInfo) {
       }
 
       ncclGroupJobMainPtr->base.func = groupLaunchNonBlocking;
-      PTHREADCHECKGOTO(pthread_create(&ncclGroupJobMainPtr->base.thread, NULL, ncclAsyncJobMain, (void*)&ncclGroupJobMainPtr->base), "pthread_create", ret, fail);
+      NCCLCHECKGOTO(asyncJobStart(&ncclGroupJobMainPtr->base), ret, fail);
       ret = ncclInProgress;
+    } else if (groupAsyncLaunchEligible(internalSimInfoPtr)) {
+      /* blocking group launched by the launcher thread of its comm */
+      NCCLCHECKGOTO(groupAsyncLaunchPost(), ret, fail);
+      groupResetJobState(ncclGroupJobMainPtr);
     } else {
       /* blocking group */
       NCCLCHECKGOTO(groupLaunch(&ncclGroupJobMainPtr->base, internalSimInfoPtr), ret, fail);
-      if (simInfo) memcpy((void*)simInfo, (void*)internalSimInfoPtr, realSize);
       groupResetJobState(ncclGroupJobMainPtr);
     }
   }
 
+  if (simInfo) {
+    NCCLCHECKGOTO(ncclSimTimelineEnd(internalSimInfoPtr), ret, fail);
+    memcpy((void*)simInfo, (void*)internalSimInfoPtr, realSize);
+  }
+
 exit:
   return ret;
 fail:
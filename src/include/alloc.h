@@ -350,6 +350,56 @@ finish:
 }
 #define ncclCudaCallocAsync(...) ncclCudaCallocAsyncDebug(__VA_ARGS__, __FILE__, __LINE__)
 
+// Stream-ordered allocation from a cudaMemPool_t. If the pool cannot satisfy the
+// request, unused memory cached by the pool is released and the allocation retried.
+template <typename T>
+ncclResult_t ncclCudaMallocPoolAsyncDebug(T** ptr, size_t nelem, cudaMemPool_t pool, cudaStream_t stream, const char *filefunc, int line) {
+  ncclResult_t result = ncclSuccess;
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  *ptr = nullptr;
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  if (nelem > 0) {
+    if (cudaMallocAsync((void**)ptr, nelem*ncclSizeOfT<T>(), pool, stream) != cudaSuccess) {
+      (void)cudaGetLastError();
+      INFO(NCCL_ALLOC, "%s:%d Cuda pool alloc of %ld bytes failed, trimming pool and retrying", filefunc, line, nelem*ncclSizeOfT<T>());
+      CUDACHECKGOTO(cudaMemPoolTrimTo(pool, 0), result, finish);
+      CUDACHECKGOTO(cudaMallocAsync((void**)ptr, nelem*ncclSizeOfT<T>(), pool, stream), result, finish);
+    }
+  }
+finish:
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  if (*ptr == nullptr && nelem > 0) WARN("Failed to CUDA pool alloc async %ld bytes", nelem*ncclSizeOfT<T>());
+  INFO(NCCL_ALLOC, "%s:%d Cuda Pool Alloc Size %ld pointer %p", filefunc, line, nelem*ncclSizeOfT<T>(), *ptr);
+  return result;
+}
+#define ncclCudaMallocPoolAsync(...) ncclCudaMallocPoolAsyncDebug(__VA_ARGS__, __FILE__, __LINE__)
+
+// Return a pool allocation in stream order
+template <typename T>
+ncclResult_t ncclCudaFreePoolAsync(T* ptr, cudaStream_t stream) {
+  ncclResult_t result = ncclSuccess;
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  TRACE(NCCL_ALLOC, "Cuda Pool Free Async pointer %p", ptr);
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  CUDACHECKGOTO(cudaFreeAsync(ptr, stream), result, finish);
+finish:
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  return result;
+}
+
+// Return a pool allocation synchronously, e.g. at teardown or while a stream is being captured
+template <typename T>
+ncclResult_t ncclCudaFreePool(T* ptr) {
+  ncclResult_t result = ncclSuccess;
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  TRACE(NCCL_ALLOC, "Cuda Pool Free pointer %p", ptr);
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  CUDACHECKGOTO(cudaFree(ptr), result, finish);
+finish:
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  return result;
+}
+
 template <typename T>
 ncclResult_t ncclCudaMemcpy(T* dst, T* src, size_t nelem) {
   ncclResult_t result = ncclSuccess;
@@ -393,6 +443,73 @@ finish:
   return result;
 }
 
+struct ncclScratchGraphBuff {
+  char* buff;
+  struct ncclScratchGraphBuff* next;
+};
+
+// Device scratch of a feature whose calls may come on any stream. Calls outside graph capture
+// share buff, grown when too small. Replays may run at any time, so each captured call gets a
+// buffer of its own which its graph keeps until ncclScratchDestroy.
+struct ncclScratch {
+  char* buff;
+  size_t size;
+  // Recorded by ncclScratchRelease once the last call is done with buff, NULL until the first call
+  cudaEvent_t done;
+  struct ncclScratchGraphBuff* graphBuffs;
+};
+
+// Get size bytes for a call queued on stream, captured telling whether stream is being captured
+static inline ncclResult_t ncclScratchAcquire(struct ncclScratch* s, size_t size, bool captured, cudaStream_t stream, char** buff) {
+  if (s->done == NULL) CUDACHECK(cudaEventCreateWithFlags(&s->done, cudaEventDisableTiming));
+  if (captured) {
+    struct ncclScratchGraphBuff* b;
+    NCCLCHECK(ncclCalloc(&b, 1));
+    ncclResult_t ret = ncclCudaCalloc(&b->buff, size);
+    if (ret != ncclSuccess) {
+      free(b);
+      return ret;
+    }
+    b->next = s->graphBuffs;
+    s->graphBuffs = b;
+    *buff = b->buff;
+    return ncclSuccess;
+  }
+  if (s->size < size) {
+    if (s->buff) {
+      CUDACHECK(cudaEventSynchronize(s->done));
+      NCCLCHECK(ncclCudaFree(s->buff));
+      s->buff = NULL;
+      s->size = 0;
+    }
+    NCCLCHECK(ncclCudaCalloc(&s->buff, size));
+    s->size = size;
+  }
+  // An earlier call on another stream may still use it
+  CUDACHECK(cudaStreamWaitEvent(stream, s->done, 0));
+  *buff = s->buff;
+  return ncclSuccess;
+}
+
+// Called after the last work of the call using the buffer is queued on stream
+static inline ncclResult_t ncclScratchRelease(struct ncclScratch* s, bool captured, cudaStream_t stream) {
+  if (!captured) CUDACHECK(cudaEventRecord(s->done, stream));
+  return ncclSuccess;
+}
+
+static inline ncclResult_t ncclScratchDestroy(struct ncclScratch* s) {
+  if (s->buff) NCCLCHECK(ncclCudaFree(s->buff));
+  while (s->graphBuffs) {
+    struct ncclScratchGraphBuff* b = s->graphBuffs;
+    s->graphBuffs = b->next;
+    NCCLCHECK(ncclCudaFree(b->buff));
+    free(b);
+  }
+  if (s->done) CUDACHECK(cudaEventDestroy(s->done));
+  memset(s, 0, sizeof(*s));
+  return ncclSuccess;
+}
+
 // Allocate memory to be potentially ibv_reg_mr'd. This needs to be
 // allocated on separate pages as those pages will be marked DONTFORK
 // and if they are shared, that could cause a crash in a child process
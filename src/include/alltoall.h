@@ -0,0 +1,27 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_ALLTOALL_H_
+#define NCCL_ALLTOALL_H_
+
+#include "comm.h"
+
+// Run the alltoall in two steps on multi-node comms: the local ranks first exchange over
+// NVLink the blocks for the other nodes, so that each rank holds those of its rail, then one
+// message per node pair carries them. Sets done to false when the call has to go through
+// the flat send/recv path, all ranks decide it the same way.
+ncclResult_t ncclHierAllToAllRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+  ncclDataType_t datatype, cudaStream_t stream, bool* done);
+
+ncclResult_t ncclHierAllToAllDestroy(struct ncclComm* comm);
+
+// Pack the blocks into slots of maxcount elements, exchange the slots with ncclAllToAll and
+// unpack them, counts and displacements being only read by the kernels.
+ncclResult_t ncclAllToAllvDeviceRun(struct ncclComm* comm, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+  void* recvbuff, size_t* recvcounts, const size_t* rdispls, size_t maxcount, ncclDataType_t datatype, cudaStream_t stream);
+
+ncclResult_t ncclAllToAllvDestroy(struct ncclComm* comm);
+
+#endif
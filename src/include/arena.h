@@ -0,0 +1,36 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_ARENA_H_
+#define NCCL_ARENA_H_
+
+#include "alloc.h"
+#include <pthread.h>
+
+struct ncclDevArenaChunk {
+  char* base;
+  size_t size;
+  size_t used;
+  struct ncclDevArenaChunk* next;
+};
+
+// Small device structures of the comms sharing resources, carved out of large allocations so that
+// they do not each take a cuMem granule and a mapping. Memory is zeroed and only freed with the arena.
+struct ncclDevArena {
+  pthread_mutex_t mutex;
+  struct ncclDevArenaChunk* chunks;
+  size_t allocBytes;
+};
+
+ncclResult_t ncclDevArenaInit(struct ncclDevArena* arena);
+ncclResult_t ncclDevArenaAlloc(struct ncclDevArena* arena, void** ptr, size_t size);
+ncclResult_t ncclDevArenaDestroy(struct ncclDevArena* arena);
+
+template <typename T>
+ncclResult_t ncclDevArenaCalloc(struct ncclDevArena* arena, T** ptr, size_t nelem) {
+  return ncclDevArenaAlloc(arena, (void**)ptr, nelem*ncclSizeOfT<T>());
+}
+
+#endif
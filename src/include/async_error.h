@@ -0,0 +1,27 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_ASYNC_ERROR_H_
+#define NCCL_ASYNC_ERROR_H_
+
+#include "nccl.h"
+
+struct ncclComm;
+
+// Asynchronous error of comm: its own, its proxy's, a fatal error of a network device its
+// connections use, or an MSCCL watchdog timeout. What ncclCommGetAsyncError returns.
+ncclResult_t ncclAsyncErrorGet(struct ncclComm* comm, ncclResult_t* asyncError);
+
+// Comms with an eventfd or callback are watched by a thread of the process, which notifies
+// them once of their first error. Errors set by the library wake it at once, others are seen
+// within NCCL_ASYNC_ERROR_POLL_MS.
+void ncclAsyncErrorWake();
+// Device netDev of ncclNetIb got a fatal async event, comms with connections on it fail
+void ncclAsyncErrorNetFatal(int netDev);
+// Stop notifying comm, before it is aborted or destroyed. Waits for a callback of comm
+// running on another thread.
+void ncclAsyncErrorUnregister(struct ncclComm* comm);
+
+#endif
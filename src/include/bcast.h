@@ -0,0 +1,31 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_BCAST_H_
+#define NCCL_BCAST_H_
+
+#include "comm.h"
+
+struct ncclBcastStaged {
+  // Two chunks host buffers are copied through, allocated on the first call that needs them
+  struct ncclScratch chunks;
+  // Copies between the host buffers and the chunks, overlapping the broadcasts
+  cudaStream_t copyStream;
+  cudaEvent_t fork;
+  cudaEvent_t join;
+  cudaEvent_t copied[2];
+  cudaEvent_t sent[2];
+  cudaEvent_t drained[2];
+};
+
+// Broadcast count elements as a pipeline of ncclBroadcast calls of NCCL_BCAST_STAGED_CHUNK_SIZE
+// bytes. sendbuff and recvbuff may each be in host memory, pinned or not, on any rank; such
+// chunks go through device memory on a side stream while the previous chunk is broadcast.
+ncclResult_t ncclBroadcastStagedRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+  ncclDataType_t datatype, int root, cudaStream_t stream);
+
+ncclResult_t ncclBroadcastStagedDestroy(struct ncclComm* comm);
+
+#endif
@@ -13,15 +13,20 @@
 struct ncclBootstrapHandle {
   uint64_t magic;
   union ncclSocketAddress addr;
+  int netEnable; // ranks joining through this handle bootstrap over the net plugin
 };
 static_assert(sizeof(struct ncclBootstrapHandle) <= sizeof(ncclUniqueId), "Bootstrap handle is too large to fit inside NCCL unique ID");
 
 ncclResult_t bootstrapNetInit();
+// Address of the interface bootstrap listens on, for other out of band sockets
+ncclResult_t bootstrapNetGetAddr(union ncclSocketAddress* addr);
 ncclResult_t bootstrapCreateRoot(struct ncclBootstrapHandle* handle, bool idFromEnv);
 ncclResult_t bootstrapGetUniqueId(struct ncclBootstrapHandle* handle);
 ncclResult_t bootstrapInit(int nHandles, void* handle, struct ncclComm* comm);
 ncclResult_t bootstrapSplit(uint64_t magic, struct ncclComm* comm, struct ncclComm* parent, int color, int key, int* parentRanks);
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size);
+// Lets bootstrapAllGather aggregate the data of each host before going to the network
+ncclResult_t bootstrapSetHosts(void* commState, uint64_t* hostHashes);
 ncclResult_t bootstrapSend(void* commState, int peer, int tag, void* data, int size);
 ncclResult_t bootstrapRecv(void* commState, int peer, int tag, void* data, int size);
 ncclResult_t bootstrapBarrier(void* commState, int rank, int nranks, int tag);
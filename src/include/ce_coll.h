@@ -0,0 +1,31 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_CE_COLL_H_
+#define NCCL_CE_COLL_H_
+
+#include "comm.h"
+
+struct ncclCeColl {
+  // One slot per local rank, written by that rank through its IPC mapping
+  uint32_t* flags;
+  void* flagsHandle;
+  uint32_t seq;
+  // 1 once the flags are mapped by every local peer, -1 if that failed
+  int ready;
+  struct ncclCeCollInfo* infos;
+};
+
+// Run the collective, sendBytes per rank pair, as copies between the registered buffers of the
+// local ranks. Sets done to false, after agreeing so with the other ranks, when the call has to
+// go through the kernels instead.
+ncclResult_t ncclCeCollAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendBytes,
+  cudaStream_t stream, bool* done);
+ncclResult_t ncclCeCollAllToAll(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendBytes,
+  cudaStream_t stream, bool* done);
+
+ncclResult_t ncclCeCollDestroy(struct ncclComm* comm);
+
+#endif
@@ -12,6 +12,9 @@
 #include <algorithm>
 
 ncclResult_t initChannel(struct ncclComm* comm, int channelid);
+// Channel structures of a rank are only allocated once it is connected, until then its entry in
+// channel->peers is NULL. Allocates them for the ranks set in comm->connectSend/connectRecv.
+ncclResult_t initChannelPeers(struct ncclComm* comm);
 ncclResult_t initNvlsChannel(struct ncclComm* comm, int channelId, struct ncclComm* parent, bool share);
 ncclResult_t initCollnetChannel(struct ncclComm* comm, int channelId, struct ncclComm* parent, bool share);
 ncclResult_t freeChannel(struct ncclChannel* channel, int nRanks, int collnetNRanks, int nvlsNRanks);
@@ -0,0 +1,21 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_COLLV_H_
+#define NCCL_COLLV_H_
+
+#include "comm.h"
+
+// Gather blocks of per-rank counts: calls whose blocks are all the same size and packed in rank order
+// go through ncclAllGather, the others are one broadcast per non-empty block in a single group.
+ncclResult_t ncclAllGatherVRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+  const size_t* rdispls, ncclDataType_t datatype, cudaStream_t stream);
+
+// Reduce-scatter blocks of per-rank counts, through ncclReduceScatter or one reduce per non-empty
+// block in a single group, as for ncclAllGatherVRun.
+ncclResult_t ncclReduceScatterVRun(struct ncclComm* comm, const void* sendbuff, const size_t* sendcounts,
+  const size_t* sdispls, void* recvbuff, ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream);
+
+#endif
@@ -18,6 +18,7 @@
 #include "register.h"
 #include "graph.h"
 #include "profiler.h"
+#include "arena.h"
 
 #if CUDART_VERSION < 9000
 struct cudaLaunchParams {
@@ -83,6 +84,7 @@ struct ncclUserRedOp {
   int freeNext; // -1=allocated, otherwise index of next free entry in array
   ncclDataType_t datatype;
   ncclDevRedOpFull opFull;
+  struct ncclCustomRedOp* custom; // NULL unless created by ncclRedOpCreateCustom
 };
 
 struct ncclNodeRanks {
@@ -115,8 +117,9 @@ struct ncclCommEventCallback {
 struct ncclSharedResources {
   int refCount;
   struct ncclComm* owner; /* comm which creates this shared res. */
-  struct ncclChannelPeer* peers[MAXCHANNELS];
-  struct ncclDevChannelPeer* devPeers[MAXCHANNELS];
+  /* Per channel and top parent rank, NULL until the rank is connected on the channel */
+  struct ncclChannelPeer** peers[MAXCHANNELS];
+  struct ncclDevChannelPeer** devPeers[MAXCHANNELS];
   /* P2P operation counter, one per channel */
   uint64_t p2pOpCount[MAXCHANNELS];
   /* Collective operation counter */
@@ -135,6 +138,8 @@ struct ncclSharedResources {
 
   /* proxy related shared res */
   struct ncclProxyState* proxyState;
+  // Device structures of the channels and of the comms sharing these resources
+  struct ncclDevArena devArena;
 };
 
 struct ncclChannel {
@@ -198,7 +203,14 @@ struct ncclTaskColl {
   int32_t algorithm:8, protocol:8;
   uint32_t isCollnet:1, isNvls:1;
   uint32_t devFuncId:30;
+  // AllGather or ReduceScatter of the local ranks on NVLS, count is per local rank
+  bool nvlsNode;
   enum ncclRegBufferType regBufType;
+  // recvbuff is registered with the network, ring sends over the net are taken from it
+  bool netRegUsed;
+  bool netRegHost; // and it is pinned host memory
+  // Bytes of sendbuff and recvbuff registered in pinned host memory
+  size_t hostBytes;
   // number of elements in planner->ipcMemQueue associated with this collective
   int nCleanupQueueElts;
 
@@ -240,10 +252,12 @@ struct ncclKernelPlan {
   enum ncclDevWorkStorageType workStorageType;
   bool kernelSpecialized;
   void *kernelFn;
+  int kernelId; // Index of kernelFn in ncclDevKernelList
   struct ncclDevKernelArgs* kernelArgs;
   size_t kernelArgsSize;
   uint64_t channelMask; // bitset of which channels are present
   bool hasProxyOps; // does any channel have a non-empty proxyOpQueue
+  uint32_t replayId; // Proxy ops template posted by the kernel, 0 if none
   int threadPerBlock;
 
   int collOpCount; // Number of collectives in this plan.
@@ -359,6 +373,8 @@ struct ncclKernelPlanner {
   // at all. Technically we could probably relax this, but that would mean
   // collecting a different `ncclTasks` per graph and one for non-graph.
   struct ncclCudaGraph capturingGraph;
+  // Lane the tasks run on, NULL for all channels, see ncclLanesPlannerLane
+  struct ncclLane* lane;
 
   //////////////////////////////////////////////////////////////////////////////
   // Lists of tasks to be assembled into plans.
@@ -397,6 +413,16 @@ struct ncclKernelPlanner {
 
 #define NCCL_MAGIC 0x0280028002800280 // Nickel atomic number is 28.
 
+#define NCCL_ALGO_CACHE_SIZE 64
+// Algorithm selection of a collective enqueued alone, fnOpTy is 0 for free entries
+struct ncclAlgoCacheEntry {
+  size_t count;
+  int fnOpTy;
+  int8_t algorithm, protocol, nMaxChannels, nWarps;
+  uint32_t isCollnet:1, isNvls:1;
+  uint32_t devFuncId:30;
+};
+
 struct ncclComm {
   uint64_t startMagic;
   struct ncclMemoryStack memPermanent, memScoped;
@@ -437,6 +463,7 @@ struct ncclComm {
   int nvmlDev; // my nvml device index
   int compCap; // compute capability of the GPU
   int minCompCap, maxCompCap; // min/max compute capability in the communicator
+  bool compCapPerNode; // compute capability is the same within each node, and may differ between nodes
   int64_t busId;   // my PCI bus ID in int format
   cpu_set_t cpuAffinity; // CPU affinity of the GPU
   int cudaArch; // matches __CUDA_ARCH__ of device
@@ -469,6 +496,8 @@ struct ncclComm {
   int nChannels; // connection nChannels
   int collChannels; // enqueue nChannels
   int nvlsChannels; // enqueue nChannels
+  // First channel of ring and tree collectives, above those of an MSCCL kernel running alongside
+  int collChannelBase;
   // all nvls heads stored to check if we can splitShare
   int nvlsHeads[MAXCHANNELS];
   // Channels (per peer) for p2p
@@ -480,6 +509,8 @@ struct ncclComm {
 
   // Buffer sizes
   int buffSizes[NCCL_NUM_PROTOCOLS];
+  // Protocols that connections of connIndex 0 get buffers for
+  int connProtoMask;
   int p2pChunkSize;
   int nvlsChunkSize;
 
@@ -488,6 +519,13 @@ struct ncclComm {
   float latencies[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
   float bandwidths[NCCL_NUM_FUNCTIONS][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
   float ringbdw[NCCL_NUM_FUNCTIONS][NCCL_NUM_PROTOCOLS];
+  // Hierarchical PAT model: latency in us of the NVLink step, of each step across nodes and of the
+  // NVLink step on NVLS, and their bandwidths
+  float hierPatLat[3];
+  float hierPatBw[3];
+  // AllReduce latencies and bandwidths were measured, the model corrections do not apply
+  bool tuningCalibrated;
+  struct ncclAlgoCacheEntry algoCache[NCCL_ALGO_CACHE_SIZE];
   int maxThreads[NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
 
   /* This attribute can indicate the states of communicators and return code of
@@ -548,6 +586,9 @@ struct ncclComm {
   int nvlsRegSupport;
   /* sharable NVLS resource. */
   struct ncclNvlsSharedRes* nvlsResources;
+  /* multicast objects of graph-registered buffers, shared by the graphs capturing them */
+  struct ncclNvlsGraphReg* nvlsGraphRegs;
+  uint64_t nvlsGraphRegCount;
 
   // pools backed by comm->memPermanent
   struct ncclMemoryPool memPool_ncclTaskColl;
@@ -588,13 +629,57 @@ struct ncclComm {
   int finalizeRankCnt;
   // Whether this comm is compatible with MSCCL
   bool mscclCompatible;
+  // Whether the external scheduler selects the algorithms of this comm instead of the internal one
+  bool mscclExternalScheduler;
+  // MSCCL scratch, flags and work index of this comm, NULL if MSCCL is not initialized
+  struct mscclCommStatus* mscclCommStatus;
   // group job to support multi-thread FT
   struct ncclGroupJob *groupJob;
+  // Rest of the init of a split child, run in the background, see NCCL_COMM_SPLIT_ASYNC
+  pthread_t splitInitThread;
+  bool splitInitPending;
+  struct ncclComm* splitInitNext;
+  // Children whose init in the background still reads this comm
+  struct ncclComm* splitInits;
+  // Split or shrunk from a parent whose resources it shares
+  bool shareRes;
+  // Background thread launching the groups of this comm, NULL unless NCCL_ASYNC_LAUNCH is set
+  struct ncclAsyncLauncher* asyncLauncher;
+  // Flags of the copy engine collectives, NULL until the first one
+  struct ncclCeColl* ceColl;
+  // Scratch of the compressed collectives
+  struct ncclScratch compress;
+  // Scratch of the one-shot collectives, NULL until the first one
+  struct ncclOneShot* oneShot;
+  // Scratch of the hierarchical alltoall
+  struct ncclScratch hierAllToAll;
+  // Scratch of the hierarchical PAT
+  struct ncclScratch hierPat;
+  // Slots of the device-count alltoallv
+  struct ncclScratch allToAllv;
+  // Slots of the sparse allreduce
+  struct ncclScratch sparseAllReduce;
+  // Partial blocks of the custom operator reductions
+  struct ncclScratch customReduce;
+  // Chunks host buffers of the staged broadcast go through, NULL until the first one
+  struct ncclBcastStaged* bcastStaged;
+  // Channels split between streams given with ncclCommSetStreamLane, NULL until the first one
+  struct ncclLanes* lanes;
+  // Green context of config.smPartition SMs, NULL until the first launch
+  struct ncclGreenCtx* greenCtx;
+  // Buffers of other processes queued for a batched import, see p2pImportBatched
+  struct ncclP2pImport* p2pImports;
+  // Proxy ops of plans are posted by the progress thread when their kernel starts, see NCCL_GRAPH_DEVICE_REPLAY
+  bool proxyReplay;
+  // Template ncclLocalOpAppend() saves proxy ops to instead of posting them, NULL when posting
+  struct ncclProxyReplayPlan* proxyReplayBuild;
 
   // Tuning plugin
   int tunerPluginLoaded;
   ncclTuner_t* tuner;
   void *tunerContext;
+  // Kernels timed for the reportPerf callback of the tuner, NULL until the first one
+  struct ncclTunerFeedback* tunerFeedback;
 
   // Profiler plugin
   void* profilerContext;
@@ -704,7 +789,14 @@ static inline ncclRedOp_t ncclUserRedOpMangle(ncclComm *comm, ncclRedOp_t op) {
   return op1 < int(ncclNumOps) ? op : ncclRedOp_t(op1);
 }
 
+// To be called when the tuning tables change
+static inline void ncclAlgoCacheClear(struct ncclComm* comm) {
+  memset(comm->algoCache, 0, sizeof(comm->algoCache));
+}
+
 ncclResult_t ncclCommEnsureReady(ncclComm_t comm);
+// Waits for the init ncclCommSplit() left running in the background, if any
+ncclResult_t ncclCommSplitInitJoin(ncclComm_t comm);
 ncclResult_t ncclCommSetAsyncError(ncclComm_t comm, ncclResult_t nextState);
 
 #endif
@@ -0,0 +1,20 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_COMPRESS_H_
+#define NCCL_COMPRESS_H_
+
+#include "comm.h"
+
+// Run the collective on data compressed to fp8 when the comm asks for it. Sets done to false
+// when the call has to go through the uncompressed path, all ranks decide it the same way.
+ncclResult_t ncclCompressAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+  ncclDataType_t datatype, cudaStream_t stream, bool* done);
+ncclResult_t ncclCompressReduceScatter(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t recvcount,
+  ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done);
+
+ncclResult_t ncclCompressDestroy(struct ncclComm* comm);
+
+#endif
@@ -82,6 +82,9 @@ DECLARE_CUDA_PFN_EXTERN(cuCtxSetCurrent);
 DECLARE_CUDA_PFN_EXTERN(cuCtxGetDevice);
 DECLARE_CUDA_PFN_EXTERN(cuPointerGetAttribute);
 DECLARE_CUDA_PFN_EXTERN(cuLaunchKernel);
+DECLARE_CUDA_PFN_EXTERN(cuModuleLoadData);
+DECLARE_CUDA_PFN_EXTERN(cuModuleGetFunction);
+DECLARE_CUDA_PFN_EXTERN(cuModuleUnload);
 #if CUDART_VERSION >= 11080
 DECLARE_CUDA_PFN_EXTERN(cuLaunchKernelEx);
 #endif
@@ -100,6 +103,18 @@ DECLARE_CUDA_PFN_EXTERN(cuMemUnmap);
 DECLARE_CUDA_PFN_EXTERN(cuMemGetAllocationPropertiesFromHandle);
 #if CUDA_VERSION >= 11070
 DECLARE_CUDA_PFN_EXTERN(cuMemGetHandleForAddressRange); // DMA-BUF support
+/* Stream memory operations */
+DECLARE_CUDA_PFN_EXTERN(cuStreamWriteValue32);
+DECLARE_CUDA_PFN_EXTERN(cuStreamWaitValue32);
+#endif
+#if CUDA_VERSION >= 12040
+/* Green contexts */
+DECLARE_CUDA_PFN_EXTERN(cuDeviceGetDevResource);
+DECLARE_CUDA_PFN_EXTERN(cuDevSmResourceSplitByCount);
+DECLARE_CUDA_PFN_EXTERN(cuDevResourceGenerateDesc);
+DECLARE_CUDA_PFN_EXTERN(cuGreenCtxCreate);
+DECLARE_CUDA_PFN_EXTERN(cuGreenCtxDestroy);
+DECLARE_CUDA_PFN_EXTERN(cuGreenCtxStreamCreate);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
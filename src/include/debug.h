@@ -10,6 +10,7 @@
 #include "nccl.h"
 #include "nccl_common.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 
 // Conform to pthread and NVTX standard
@@ -20,17 +21,31 @@ extern FILE *ncclDebugFile;
 
 void ncclDebugLog(ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, ...) __attribute__ ((format (printf, 5, 6)));
 
+// Call site of INFO and TRACE, rate limited by NCCL_DEBUG_RATE_LIMIT
+struct ncclDebugSite {
+  uint64_t window;
+  uint32_t count;
+  uint32_t suppressed;
+};
+void ncclDebugLogSite(struct ncclDebugSite* site, ncclDebugLogLevel level, unsigned long flags, const char *filefunc, int line, const char *fmt, ...) __attribute__ ((format (printf, 6, 7)));
+
 // Let code temporarily downgrade WARN into INFO
 extern thread_local int ncclDebugNoWarn;
 extern char ncclLastError[];
 
 #define VERSION(...) ncclDebugLog(NCCL_LOG_VERSION, NCCL_ALL, __FILE__, __LINE__, __VA_ARGS__)
 #define WARN(...) ncclDebugLog(NCCL_LOG_WARN, NCCL_ALL, __FILE__, __LINE__, __VA_ARGS__)
-#define INFO(FLAGS, ...) ncclDebugLog(NCCL_LOG_INFO, (FLAGS), __func__, __LINE__, __VA_ARGS__)
+#define INFO(FLAGS, ...) do { \
+  static struct ncclDebugSite ncclDebugSite_; \
+  ncclDebugLogSite(&ncclDebugSite_, NCCL_LOG_INFO, (FLAGS), __func__, __LINE__, __VA_ARGS__); \
+} while (0)
 #define TRACE_CALL(...) ncclDebugLog(NCCL_LOG_TRACE, NCCL_CALL, __func__, __LINE__, __VA_ARGS__)
 
 #ifdef ENABLE_TRACE
-#define TRACE(FLAGS, ...) ncclDebugLog(NCCL_LOG_TRACE, (FLAGS), __func__, __LINE__, __VA_ARGS__)
+#define TRACE(FLAGS, ...) do { \
+  static struct ncclDebugSite ncclDebugSite_; \
+  ncclDebugLogSite(&ncclDebugSite_, NCCL_LOG_TRACE, (FLAGS), __func__, __LINE__, __VA_ARGS__); \
+} while (0)
 #else
 #define TRACE(...)
 #endif
@@ -45,6 +45,9 @@ struct ncclDevRedOpFull {
   bool scalarArgIsPtr;
   uint64_t scalarArg;
 };
+// Bit of scalarArg asking sums and pre-multiplied sums of half and bfloat16 to round stochastically.
+// Their scalars only use the low 16 bits.
+#define NCCL_REDOP_ARG_STOCHASTIC (1ULL<<32)
 
 union ncclLLFifoLine {
   /* Flags have to be *after* data, because otherwise, an incomplete receive
@@ -97,6 +100,7 @@ static_assert(NCCL_LL_CLEAN_MASK % NCCL_STEPS == 0, "Invalid NCCL_LL_CLEAN_MASK
 #define NCCL_IPC_WRITE    0x08
 #define NCCL_IPC_READ     0x10
 #define NCCL_NVLS_MIN_POLL 0x20
+#define NCCL_NET_REG_SEND 0x40 // Net send connection whose proxy can send from registered user buffers
 
 // Number of named barriers supported by CUDA
 #define NCCL_MAX_GROUPS 16
@@ -148,6 +152,9 @@ struct ncclConnector {
   struct ncclConnInfo conn;
   int sendMemSameProcess;
   int recvMemSameProcess;
+  // Proxy setup call left in flight by the transport setup, and where its response goes
+  int setupPending;
+  void* setupResp;
 };
 
 struct ncclRing {
@@ -235,6 +242,19 @@ struct alignas(16) ncclDevWorkP2p {
   uint8_t sendIpcReg:1, recvIpcReg:1;
 };
 
+// Consecutive rounds of the p2p schedule sharing a channel base, each sending and receiving
+// bytes to and from the slice of its peer at sendAddr/recvAddr + peer*stride, as alltoall does.
+// The device expands it to one ncclDevWorkP2p per round, taking the peers from the schedule.
+struct alignas(16) ncclDevWorkP2pStrided {
+  void *sendAddr, *recvAddr;
+  size_t bytes, stride;
+  uint32_t roundBeg;
+  uint8_t nRounds; // Up to NCCL_MAX_DEV_WORK_P2P_PER_BATCH
+  uint8_t nP2pChannels, channelBase, nChannels;
+  uint8_t sendChunkSize_u32fp8, recvChunkSize_u32fp8;
+  uint8_t sendProtoLL:1, recvProtoLL:1;
+};
+
 // Compute the subset of the data transfer corresponding to the given part index.
 inline __host__ __device__ void ncclP2pPartBounds(int nParts, int part, size_t bytes, size_t* partBeg, size_t* partEnd) {
   size_t partBytes = alignUp(divUp(bytes, nParts), 4<<10);
@@ -269,7 +289,7 @@ struct alignas(16) ncclDevWorkColl {
   // Running on channels [channelLo..channelHi], hi is inclusive.
   //   nChannels == (channelHi - channelLo) + 1
   uint32_t channelLo:8, channelHi:8;
-  uint32_t nWarps:8;
+  uint32_t nWarps:7, netRegUsed:1;
   uint32_t redOpArgIsPtr:1, regUsed:2, oneNode:1, direct:4;
   uint32_t root;
   void* recvbuff;
@@ -341,12 +361,14 @@ struct alignas(16) ncclDevWorkCollReg {
 enum ncclDevWorkType: uint8_t {
   ncclDevWorkTypeP2p,
   ncclDevWorkTypeColl,
-  ncclDevWorkTypeCollReg
+  ncclDevWorkTypeCollReg,
+  ncclDevWorkTypeP2pStrided // Alone in its batch
 };
 
 constexpr size_t ncclDevWorkSize(enum ncclDevWorkType type) {
   return type == ncclDevWorkTypeP2p ? sizeof(ncclDevWorkP2p) :
-         type == ncclDevWorkTypeColl ? sizeof(ncclDevWorkColl) : sizeof(ncclDevWorkCollReg);
+         type == ncclDevWorkTypeColl ? sizeof(ncclDevWorkColl) :
+         type == ncclDevWorkTypeP2pStrided ? sizeof(ncclDevWorkP2pStrided) : sizeof(ncclDevWorkCollReg);
 }
 
 #define NCCL_MAX_DEV_WORK_BATCH_BYTES 1024
@@ -389,6 +411,14 @@ struct alignas(16) ncclDevChannel {
   uint32_t* workFifoDone; // Location of done counter, device writes index+1 of last work processed
 };
 
+// Doorbells rung by kernels of plans whose proxy ops the progress thread posts itself.
+// Slot seq%N holds ((seq+1)<<32)|replayId, consumed is advanced by the progress thread.
+#define NCCL_PROXY_REPLAY_RING 256
+struct ncclProxyReplayRing {
+  uint64_t consumed;
+  uint64_t slots[NCCL_PROXY_REPLAY_RING];
+};
+
 struct ncclDevComm {
   int rank;
   int nRanks;
@@ -409,10 +439,16 @@ struct ncclDevComm {
   // Channels, device side
   struct ncclDevChannel* channels/*[MAXCHANNELS]*/;
   int* rankToLocalRank;
+  int* p2pSchedule/*[2*nRanks]*/; // Send and recv peers of each round
+
+  // NCCL_GRAPH_DEVICE_REPLAY, NULL when off
+  struct ncclProxyReplayRing* replayRing;
+  unsigned long long* replaySeq;
 
 #if defined(ENABLE_NPKIT)
   NpKitEventCollectContext* npKitEventCollectContexts;
   uint64_t* cpuTimestamp;
+  NpKitEventMask npKitEventMask;
 #endif
 };
 
@@ -433,6 +469,8 @@ struct alignas(16) ncclDevKernelArgs {
   enum ncclDevWorkStorageType workStorageType;
   uint32_t workMask;
   void* workBuf;
+  // Proxy ops template to post when the kernel starts, 0 when they were posted by the host
+  uint32_t replayId;
   // A channel's first batch is at `blockIdx.x`. Use `nextJump` to follow rest of list.
   // struct ncclDevWorkBatch batches[];
 };
@@ -497,19 +535,29 @@ __host__ __device__ constexpr int ncclNvlsUnroll(int bytePerPack, int cudaArch =
 }
 
 // The amount of dynamic shmem per warp
+// Stages of the bulk copies of the Simple protocol, built with NCCL_BULK_COPY for sm90 and later
+#define NCCL_BULK_COPY_STAGES 2
+#define NCCL_BULK_COPY_STAGE_BYTES 4096
+#if defined(NCCL_BULK_COPY) && CUDART_VERSION >= 12000
+#define NCCL_BULK_COPY_SCRATCH(cudaArch) ((cudaArch) >= 900 ? 16 + NCCL_BULK_COPY_STAGES*NCCL_BULK_COPY_STAGE_BYTES : 0)
+#else
+#define NCCL_BULK_COPY_SCRATCH(cudaArch) 0
+#endif
+
 __host__ __device__ constexpr int ncclShmemScratchWarpSize(int cudaArch = NCCL_CUDA_ARCH) {
   return (max_constexpr<int>(
       /*LL    */0,
       /*LL128 */(NCCL_LL128_SHMEM_ELEMS_PER_THREAD*WARP_SIZE)*sizeof(uint64_t),
       /*SIMPLE*/(ncclCollUnroll(cudaArch)*WARP_SIZE + 1)*16,
       // NVLS needs an extra 16B to read unaligned data.
-      /*NVLS  */WARP_SIZE*(cudaArch >= 900 ? ncclNvlsUnrollBytes(cudaArch) : 0) + 16
+      /*NVLS  */WARP_SIZE*(cudaArch >= 900 ? ncclNvlsUnrollBytes(cudaArch) : 0) + 16,
+      /*BULK  */NCCL_BULK_COPY_SCRATCH(cudaArch)
     ) + 15) & -16; // pad to 16 bytes
 }
 
-// The amount of dynamic shmem per block
-__host__ __device__ constexpr int ncclShmemDynamicSize(int cudaArch = NCCL_CUDA_ARCH) {
-  return cudaArch < 700 ? 0 : ncclShmemScratchWarpSize(cudaArch)*(NCCL_MAX_NTHREADS/WARP_SIZE);
+// The amount of dynamic shmem per block, the scratch of each warp of a block of nThreads
+__host__ __device__ constexpr int ncclShmemDynamicSize(int cudaArch = NCCL_CUDA_ARCH, int nThreads = NCCL_MAX_NTHREADS) {
+  return cudaArch < 700 ? 0 : ncclShmemScratchWarpSize(cudaArch)*(nThreads/WARP_SIZE);
 }
 
 // Host-side table of kernel function pointers.
@@ -520,11 +568,90 @@ extern void* const ncclDevKernelList[/*ncclDevKernelCount*/];
 extern int const ncclDevFuncIdCount;
 extern int const ncclDevFuncRowToId[];
 extern void* const ncclDevKernelForFunc[/*funcIndex*/];
+extern int const ncclDevKernelIdForFunc[/*funcIndex*/];
 extern bool const ncclDevKernelForFuncIsSpecialized[/*funcIndex*/];
 
 // Launch a one-rank reduction on stream.
 ncclResult_t ncclLaunchOneRank(void* dst, void const* src, size_t nElts, struct ncclDevRedOpFull redOp, ncclDataType_t type, cudaStream_t stream);
 
+// A compressed chunk of nElts elements holds their fp8 e4m3 values, then one float scale per
+// NCCL_COMPRESS_BLOCK elements.
+#define NCCL_COMPRESS_BLOCK 128
+inline __host__ __device__ size_t ncclCompressedBytes(size_t nElts) {
+  return alignUp(nElts, 16) + alignUp(divUp(nElts, NCCL_COMPRESS_BLOCK)*sizeof(float), 16);
+}
+
+// Compress nChunks chunks of nElts elements of src, laid out one after the other, into the chunks of dst.
+ncclResult_t ncclLaunchCompress(void* dst, void const* src, size_t nElts, int nChunks, ncclDataType_t type, cudaStream_t stream);
+// Decompress the nChunks chunks of src into consecutive chunks of dst, or into their sum times
+// scale when reduce is set.
+ncclResult_t ncclLaunchDecompress(void* dst, void const* src, size_t nElts, int nChunks, bool reduce, float scale, ncclDataType_t type, cudaStream_t stream);
+
+// Slots of the device-count alltoallv hold the element count of the block, then the block.
+#define NCCL_ALLTOALLV_HEADER_BYTES 16
+// Copy the block of each of the nRanks peers, counts[p] elements at displs[p] of src, or packed
+// in rank order when displs is NULL, into slot p of dst, slots being slotBytes apart.
+ncclResult_t ncclLaunchAllToAllvPack(void* dst, void const* src, size_t const* counts, size_t const* displs, size_t maxCount,
+  size_t eltSize, size_t slotBytes, int nRanks, cudaStream_t stream);
+// Copy the blocks of the slots of src to displs[p] of dst, or packed in rank order when displs is
+// NULL, and their counts to counts when it is not NULL.
+ncclResult_t ncclLaunchAllToAllvUnpack(void* dst, size_t* counts, size_t const* displs, void const* src,
+  size_t eltSize, size_t slotBytes, int nRanks, cudaStream_t stream);
+
+// Slots of the sparse allreduce hold the number of entries, then maxNnz indices, then maxNnz values.
+#define NCCL_SPARSE_HEADER_BYTES 16
+inline __host__ __device__ size_t ncclSparseSlotBytes(size_t maxNnz, size_t eltSize) {
+  return NCCL_SPARSE_HEADER_BYTES + alignUp(maxNnz*sizeof(int64_t), 16) + alignUp(maxNnz*eltSize, 16);
+}
+// Copy the first *nnz entries of indices and values, or maxNnz when nnz is NULL, into slot.
+ncclResult_t ncclLaunchSparsePack(void* slot, void const* values, int64_t const* indices, size_t const* nnz, size_t maxNnz,
+  size_t eltSize, cudaStream_t stream);
+// Add the values of the nSlots slots of src, slotBytes apart, to dst at their indices, one slot
+// after the other so that the sums are the same on every rank. Indices of a slot must be distinct,
+// those outside [0, count) are skipped.
+ncclResult_t ncclLaunchSparseAccumulate(void* dst, size_t count, void const* src, size_t slotBytes, int nSlots, size_t maxNnz,
+  ncclDataType_t type, cudaStream_t stream);
+
+// LL128 self-test over ncclLl128CheckLines() lines of 128 bytes. The writer stores nIters rounds once the
+// reader has set go. The reader adds its loads that got data older than the flag of their line to
+// counters[0], and the times it saw a line between rounds 0 and nIters to counters[1].
+int ncclLl128CheckLines();
+ncclResult_t ncclLaunchLl128CheckWriter(uint64_t* lines, int nIters, volatile int* go, cudaStream_t stream);
+ncclResult_t ncclLaunchLl128CheckReader(uint64_t* lines, int nIters, volatile int* go, unsigned long long* counters, cudaStream_t stream);
+
+// Reduce the nSlots slots of src, slotBytes apart, into dst in slot order. dst may be the first slot.
+ncclResult_t ncclLaunchReduceSlots(void* dst, void const* src, size_t nElts, size_t slotBytes, int nSlots,
+  struct ncclDevRedOpFull redOp, ncclDataType_t type, cudaStream_t stream);
+
+// Write scale*src[i] + addend[i] to dst as elements of outType, addend may be NULL.
+ncclResult_t ncclLaunchEpilogue(void* dst, ncclDataType_t outType, void const* src, void const* addend, size_t nElts,
+  float scale, ncclDataType_t type, cudaStream_t stream);
+
+// One-shot collectives of local ranks. The scratch of each rank holds the flags its peers set,
+// one per rank and parity, then its own call counter, then one data slot per rank and parity.
+#define NCCL_ONESHOT_MAX_RANKS 8
+#define NCCL_ONESHOT_COUNTER_OFFSET (2*NCCL_ONESHOT_MAX_RANKS*sizeof(uint64_t))
+#define NCCL_ONESHOT_DATA_OFFSET 256
+struct ncclOneShotArgs {
+  // Scratch of every local rank, mapped in this rank
+  char* scratch[NCCL_ONESHOT_MAX_RANKS];
+  // Rank of each local rank, where its data goes in the output of an AllGather
+  int ranks[NCCL_ONESHOT_MAX_RANKS];
+  void const* sendbuff;
+  void* recvbuff;
+  size_t count;
+  size_t slotBytes;
+  uint32_t* abortFlag;
+  uint64_t redOpArg;
+  int localRank;
+  int localRanks;
+  bool allGather;
+};
+
+// Launch a single block that pushes sendbuff into the scratch of every local rank, then reduces
+// or gathers what the others pushed into this rank's scratch.
+ncclResult_t ncclLaunchOneShot(struct ncclOneShotArgs* args, ncclDevRedOp_t op, ncclDataType_t type, cudaStream_t stream);
+
 // `ncclNvlsSupported()` needs to be in sync with "func_valid" in "src/device/generate.py"
 inline bool ncclNvlsSupported(int devRedOp, int type) {
   switch (type) {
@@ -17,7 +17,11 @@
 #define NCCL_SIMPLE_ALIGNMENT (WARP_SIZE * 8LL * 16LL)
 #define NCCL_BYTES_ALIGNMENT 16
 
-ncclResult_t ncclInitKernelsForDevice(int cudaArch, size_t* maxStackSize);
+// NCCL_LAZY_KERNEL_INIT, shared by the NCCL and MSCCL kernels
+int64_t ncclParamLazyKernelInit();
+ncclResult_t ncclInitKernelsForDevice(int cudaDev, int cudaArch, size_t* maxStackSize);
+// Sets the attributes of a kernel of ncclDevKernelList the first time it is launched on the device
+ncclResult_t ncclPrepareKernel(int cudaDev, int cudaArch, int kernelId);
 ncclResult_t ncclEnqueueCheck(struct ncclInfo* info);
 ncclResult_t ncclLaunchPrepare(struct ncclComm* comm);
 ncclResult_t ncclLaunchKernelBefore_NoUncapturedCuda(struct ncclComm* comm, struct ncclKernelPlan* plan);
@@ -25,5 +29,8 @@ ncclResult_t ncclLaunchKernel(struct ncclComm* comm, struct ncclKernelPlan* plan
 ncclResult_t ncclLaunchKernelAfter_NoCuda(struct ncclComm* comm, struct ncclKernelPlan* plan);
 ncclResult_t ncclLaunchFinish(struct ncclComm* comm);
 ncclResult_t ncclPrepareTasks(struct ncclComm* comm, bool* algoNeedConnect, bool* needConnect, ncclSimInfo_t* simInfo);
+// Rounding bits to add to the scalar argument of sums of datatype
+uint64_t ncclRedOpRoundingArg(ncclDataType_t datatype);
+ncclResult_t ncclHostToDevRedOp(struct ncclDevRedOpFull* opFull, ncclRedOp_t op, ncclDataType_t datatype, struct ncclComm* comm);
 
 #endif // End include guard
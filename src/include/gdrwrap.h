@@ -50,6 +50,19 @@ static inline void wc_store_fence(void) { std::atomic_thread_fence(std::memory_o
 static inline void wc_store_fence(void) { atomic_thread_fence(memory_order_release); }
 #endif
 #endif
+
+// Force a PCI-E read from GPU memory through a GDR mapping. The read does not pass the writes of the
+// NIC before it, and the fence keeps what the proxy does next after its completion.
+static inline void wc_flush_read(void* ptr) {
+  (void)*(volatile uint32_t*)ptr;
+#if defined(__PPC__)
+  asm volatile("sync");
+#elif defined(__x86_64__)
+  _mm_lfence();
+#elif defined(__aarch64__)
+  asm volatile("dmb osh" ::: "memory");
+#endif
+}
 #endif
 
 //#define GDR_DIRECT 1
@@ -146,6 +159,8 @@ ncclResult_t wrap_gdr_copy_from_mapping(gdr_mh_t handle, void *h_ptr, const void
 
 // Global GDR driver handle
 extern gdr_t ncclGdrCopy;
+// The net and collnet transports use the handle too, it may be open for the work FIFO only
+extern bool ncclGdrCopyTransports;
 
 #include "alloc.h"
 
@@ -189,11 +204,16 @@ error:
 
 template <typename T>
 static ncclResult_t ncclGdrCudaCalloc(T** ptr, T** devPtr, size_t nelem, void** gdrHandle) {
+  ncclResult_t ret = ncclSuccess;
   gdr_info_t info;
   size_t mapSize;
   gdr_mh_t mh;
   char *devMem;
   void *gdrMap;
+  uint64_t alignedAddr;
+  size_t align;
+  ssize_t off;
+  gdr_mem_desc_t* md;
 
   mapSize = ncclSizeOfT<T>()*nelem;
 
@@ -201,22 +221,22 @@ static ncclResult_t ncclGdrCudaCalloc(T** ptr, T** devPtr, size_t nelem, void**
   ALIGN_SIZE(mapSize, GPU_PAGE_SIZE);
   // GDRCOPY Pinned buffer has to be GPU_PAGE_SIZE aligned too
   NCCLCHECK(ncclCudaCalloc(&devMem, mapSize+GPU_PAGE_SIZE-1));
-  uint64_t alignedAddr = (((uint64_t) devMem) + GPU_PAGE_OFFSET) & GPU_PAGE_MASK;
-  size_t align = alignedAddr - (uint64_t)devMem;
+  alignedAddr = (((uint64_t) devMem) + GPU_PAGE_OFFSET) & GPU_PAGE_MASK;
+  align = alignedAddr - (uint64_t)devMem;
 
   //TRACE(NCCL_INIT, "GDRCOPY: Pin buffer 0x%lx (%p) align %zu size %zu", alignedAddr, devMem, align, mapSize);
-  NCCLCHECK(wrap_gdr_pin_buffer(ncclGdrCopy, alignedAddr, mapSize, 0, 0, &mh));
+  // Callers may fall back to other memory, so nothing is left behind on failure
+  NCCLCHECKGOTO(wrap_gdr_pin_buffer(ncclGdrCopy, alignedAddr, mapSize, 0, 0, &mh), ret, fail);
 
-  NCCLCHECK(wrap_gdr_map(ncclGdrCopy, mh, &gdrMap, mapSize));
+  NCCLCHECKGOTO(wrap_gdr_map(ncclGdrCopy, mh, &gdrMap, mapSize), ret, unpin);
   //TRACE(NCCL_INIT, "GDRCOPY : mapped %p (0x%lx) at %p", devMem, alignedAddr, gdrMap);
 
-  NCCLCHECK(wrap_gdr_get_info(ncclGdrCopy, mh, &info));
+  NCCLCHECKGOTO(wrap_gdr_get_info(ncclGdrCopy, mh, &info), ret, unmap);
 
   // Will offset ever be non zero ?
-  ssize_t off = info.va - alignedAddr;
+  off = info.va - alignedAddr;
 
-  gdr_mem_desc_t* md;
-  NCCLCHECK(ncclCalloc(&md, 1));
+  NCCLCHECKGOTO(ncclCalloc(&md, 1), ret, unmap);
   md->gdrDevMem = devMem;
   md->gdrMap = gdrMap;
   md->gdrMapSize = mapSize;
@@ -231,6 +251,13 @@ static ncclResult_t ncclGdrCudaCalloc(T** ptr, T** devPtr, size_t nelem, void**
        md->gdrDevMem, md->gdrMap, md->gdrOffset, md->gdrMh.h, md->gdrMapSize, *ptr);
 
   return ncclSuccess;
+unmap:
+  (void)wrap_gdr_unmap(ncclGdrCopy, mh, gdrMap, mapSize);
+unpin:
+  (void)wrap_gdr_unpin_buffer(ncclGdrCopy, mh);
+fail:
+  (void)ncclCudaFree(devMem);
+  return ret;
 }
 
 template <typename T>
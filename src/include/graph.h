@@ -20,11 +20,13 @@ ncclResult_t ncclTopoCudaPath(int cudaDev, char** path);
 struct ncclTopoSystem;
 // Build the topology
 ncclResult_t ncclTopoGetSystem(struct ncclComm* comm, struct ncclTopoSystem** system);
+ncclResult_t ncclTopoGetSystemFromParent(struct ncclComm* comm, struct ncclComm* parent, struct ncclTopoSystem** system, bool* changed);
 ncclResult_t ncclTopoSortSystem(struct ncclTopoSystem* system);
 ncclResult_t ncclTopoPrint(struct ncclTopoSystem* system);
 
 ncclResult_t ncclTopoComputePaths(struct ncclTopoSystem* system, struct ncclComm* comm);
 void ncclTopoFree(struct ncclTopoSystem* system);
+ncclResult_t ncclTopoDupSystem(struct ncclTopoSystem* system, struct ncclTopoSystem** dupSystem);
 ncclResult_t ncclTopoTrimSystem(struct ncclTopoSystem* system, struct ncclComm* comm);
 ncclResult_t ncclTopoComputeP2pChannels(struct ncclComm* comm);
 ncclResult_t ncclTopoGetNvbGpus(struct ncclTopoSystem* system, int rank, int* nranks, int** ranks);
@@ -96,6 +98,8 @@ struct ncclTopoGraph {
   int64_t inter[MAXCHANNELS*2];
 };
 ncclResult_t ncclTopoCompute(struct ncclTopoSystem* system, struct ncclTopoGraph* graph);
+// Searches independent graphs at the same time, each on its own copy of system
+ncclResult_t ncclTopoComputeGraphs(struct ncclTopoSystem* system, int nGraphs, struct ncclTopoGraph** graphs);
 
 ncclResult_t ncclTopoPrintGraph(struct ncclTopoSystem* system, struct ncclTopoGraph* graph);
 ncclResult_t ncclTopoDumpGraphs(struct ncclTopoSystem* system, int ngraphs, struct ncclTopoGraph** graphs);
@@ -118,6 +122,10 @@ ncclResult_t ncclTopoPostset(struct ncclComm* comm, int* firstRanks, int* treePa
     struct ncclTopoRanks** allTopoRanks, int* rings, struct ncclTopoGraph** graphs, struct ncclComm* parent);
 
 ncclResult_t ncclTopoTuneModel(struct ncclComm* comm, int minCompCap, int maxCompCap, struct ncclTopoGraph** graphs);
+// Optionally replace the AllReduce model with measured times, needs a connected communicator
+ncclResult_t ncclTopoCalibrateModel(struct ncclComm* comm);
 ncclResult_t ncclTopoGetAlgoTime(struct ncclComm* comm, int coll, int algorithm, int protocol, size_t nBytes, int numPipeOps, float* time, bool* backup=nullptr);
+// Time of an AllGather or ReduceScatter of nBytes through the hierarchical PAT, -1 when it cannot run
+ncclResult_t ncclTopoGetHierPatTime(struct ncclComm* comm, size_t nBytes, bool nvls, float* time);
 
 #endif
@@ -0,0 +1,31 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_GREENCTX_H_
+#define NCCL_GREENCTX_H_
+
+#include "comm.h"
+#include "cudawrap.h"
+
+// Green context of config.smPartition SMs the kernels of the comm run in, through a stream of
+// its own joined to the user stream around each launch
+struct ncclGreenCtx {
+#if CUDART_VERSION >= 12040
+  CUgreenCtx ctx;
+  CUstream stream;
+#endif
+  cudaEvent_t fork;
+  cudaEvent_t join;
+};
+
+// Stream to launch the kernels of comm on instead of stream, stream itself when the comm has
+// no SM partition or the launch is captured
+ncclResult_t ncclGreenCtxFork(struct ncclComm* comm, cudaStream_t stream, bool captured, cudaStream_t* launchStream);
+// Make stream wait for the launches since ncclGreenCtxFork returned launchStream
+ncclResult_t ncclGreenCtxJoin(struct ncclComm* comm, cudaStream_t stream, cudaStream_t launchStream);
+
+ncclResult_t ncclGreenCtxDestroy(struct ncclComm* comm);
+
+#endif
@@ -42,6 +42,7 @@ struct ncclAsyncJob {
   uint32_t* childAbortFlagDev; /* point to child abortFlagDev */
   ncclComm_t comm;
   int destroyFlag;
+  bool pooled; /* run by a thread of the job pool, there is no thread to join */
 };
 
 ncclResult_t ncclAsyncLaunch(
@@ -64,8 +65,26 @@ struct ncclGroupJob {
 
 ncclResult_t ncclGroupStartInternal();
 ncclResult_t ncclGroupEndInternal(ncclSimInfo_t* simInfo = NULL);
+
+// Implicit aggregation of small collectives enqueued outside of groups. Check flushes the
+// collectives left pending when info cannot join them and tells whether info should be left
+// pending too, in which case the enqueue ends with Defer instead of ncclGroupEndInternal.
+// Between two calls of the thread, they are held in a batch that a background thread launches
+// once NCCL_IMPLICIT_AGG_WINDOW_US has passed. Reclaim takes them back into the group state of
+// the thread, or returns the error of their launch.
+struct ncclInfo;
+ncclResult_t ncclGroupImplicitCheck(struct ncclInfo* info, bool* defer);
+ncclResult_t ncclGroupImplicitDefer();
+ncclResult_t ncclGroupImplicitFlush();
+ncclResult_t ncclGroupImplicitReclaim();
+extern __thread struct ncclImplicitBatch* ncclImplicitBatch;
 ncclResult_t ncclAsyncJobComplete(struct ncclAsyncJob* job);
 
+// Groups of a single comm on a single stream may be launched by a thread of the comm when
+// NCCL_ASYNC_LAUNCH is set. Wait returns once the posted group is launched, with its error.
+ncclResult_t ncclAsyncLaunchWait(struct ncclComm* comm);
+ncclResult_t ncclAsyncLaunchDestroy(struct ncclComm* comm);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 extern __thread int ncclGroupDepth; // depth of ncclGroupStart nesting
@@ -96,6 +115,8 @@ extern bool mscclAvailable();
 extern bool mscclIsCaller();
 extern ncclResult_t mscclGroupStart();
 inline ncclResult_t ncclGroupStartInternal() {
+  // Collectives left pending by this thread are launched with the group
+  if (ncclGroupDepth == 0 && ncclImplicitBatch != nullptr) NCCLCHECK(ncclGroupImplicitReclaim());
   ncclGroupDepth++;
   if (mscclAvailable() && !mscclIsCaller()) {
     NCCLCHECK(mscclGroupStart());
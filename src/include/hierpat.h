@@ -0,0 +1,22 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_HIERPAT_H_
+#define NCCL_HIERPAT_H_
+
+#include "comm.h"
+
+// Run the AllGather or ReduceScatter of multi-node comms with several GPUs per node in two levels:
+// the ranks of each local index (a rail) exchange their blocks across nodes in log2(nNodes) steps,
+// the local ranks exchange whole rails over NVLink. Sets done to false when the call has to go
+// through the regular kernels, all ranks decide it the same way.
+ncclResult_t ncclHierPatAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+  ncclDataType_t datatype, cudaStream_t stream, bool* done);
+ncclResult_t ncclHierPatReduceScatter(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t recvcount,
+  ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done);
+
+ncclResult_t ncclHierPatDestroy(struct ncclComm* comm);
+
+#endif
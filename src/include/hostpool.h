@@ -0,0 +1,22 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_HOSTPOOL_H_
+#define NCCL_HOSTPOOL_H_
+
+#include "alloc.h"
+
+// Pinned, mapped host memory shared by the proxy connections of all comms of the process.
+// Freed blocks are kept per NUMA node and size class, so that setting up and tearing down
+// connections does not pin and unpin memory each time. Memory is zeroed.
+ncclResult_t ncclHostPoolAlloc(void** ptr, size_t size);
+ncclResult_t ncclHostPoolFree(void* ptr);
+
+template <typename T>
+ncclResult_t ncclHostPoolCalloc(T** ptr, size_t nelem) {
+  return ncclHostPoolAlloc((void**)ptr, nelem*ncclSizeOfT<T>());
+}
+
+#endif
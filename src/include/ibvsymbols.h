@@ -35,6 +35,8 @@ struct ncclIbvSymbols {
   struct ibv_qp * (*ibv_internal_create_qp)(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr);
   int (*ibv_internal_modify_qp)(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask);
   int (*ibv_internal_destroy_qp)(struct ibv_qp *qp);
+  struct ibv_srq * (*ibv_internal_create_srq)(struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr);
+  int (*ibv_internal_destroy_srq)(struct ibv_srq *srq);
   const char * (*ibv_internal_event_type_str)(enum ibv_event_type event);
   int (*ibv_internal_query_ece)(struct ibv_qp *qp, struct ibv_ece *ece);
   int (*ibv_internal_set_ece)(struct ibv_qp *qp, struct ibv_ece *ece);
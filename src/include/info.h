@@ -28,6 +28,8 @@ struct ncclInfo {
   // Algorithm details
   int chunkSteps;
   int sliceSteps;
+  // Runs between the local ranks only, on the NVLS kernels (hierarchical PAT node step)
+  bool nvlsNode;
 };
 
 #endif
@@ -0,0 +1,53 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_LANES_H_
+#define NCCL_LANES_H_
+
+#include "comm.h"
+#include "strongstream.h"
+
+#define NCCL_MAX_LANES 8
+#define NCCL_LANES_MAX_STREAMS 64
+
+// Channels [channelBase, channelBase+nChannels) of the comm, with a strong stream ordering the
+// kernels of the lane instead of deviceStream
+struct ncclLane {
+  struct ncclStrongStream stream;
+  int channelBase;
+  int nChannels;
+};
+
+struct ncclLaneStream {
+  cudaStream_t stream;
+  int lane;
+};
+
+struct ncclLanes {
+  int nLanes;
+  struct ncclLane lanes[NCCL_MAX_LANES];
+  int nStreams;
+  struct ncclLaneStream streams[NCCL_LANES_MAX_STREAMS];
+};
+
+ncclResult_t ncclLanesSetStream(struct ncclComm* comm, cudaStream_t stream, int lane);
+
+// Lane stream was given with ncclCommSetStreamLane, NULL if none
+struct ncclLane* ncclLaneOfStream(struct ncclComm* comm, cudaStream_t stream);
+
+// Lane the group of comm runs on: set when all its user streams are on the same lane and it
+// has no p2p task. Groups without a lane run on all channels and are ordered against all lanes.
+struct ncclLane* ncclLanesPlannerLane(struct ncclComm* comm);
+
+// Strong stream the kernels of the group of comm are ordered by, acquired
+ncclResult_t ncclLanesAcquire(struct ncclComm* comm, struct ncclCudaGraph graph, struct ncclStrongStream** stream);
+
+static inline struct ncclStrongStream* ncclLanesStream(struct ncclComm* comm) {
+  return comm->planner.lane ? &comm->planner.lane->stream : &comm->sharedRes->deviceStream;
+}
+
+ncclResult_t ncclLanesDestroy(struct ncclComm* comm);
+
+#endif
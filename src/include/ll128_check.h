@@ -0,0 +1,20 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_LL128_CHECK_H_
+#define NCCL_LL128_CHECK_H_
+
+#include "comm.h"
+
+// Links on which the self-test saw every 128-byte line arrive whole
+#define NCCL_LL128_CHECK_HOST 0x1 // GPU stores to and loads from pinned host memory
+#define NCCL_LL128_CHECK_DMA  0x2 // Writes coming over PCIe into GPU memory, from the copy engine
+#define NCCL_LL128_CHECK_P2P  0x4 // Stores of a peer GPU into GPU memory
+
+// Stress the LL128 line stores on the links of the GPU of comm and set the links that passed.
+// Results are kept per process and device, and on disk per platform fingerprint.
+ncclResult_t ncclLl128Check(struct ncclComm* comm, int* passed);
+
+#endif
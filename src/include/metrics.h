@@ -0,0 +1,32 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_METRICS_H_
+#define NCCL_METRICS_H_
+
+#include "nccl.h"
+#include <stddef.h>
+
+// Cumulative counters of the process, enabled by NCCL_METRICS=1. Each thread adds to counters of
+// its own without locks, readers sum them. The calls below return at once when disabled.
+bool ncclMetricsEnabled();
+
+// Collective given to the NCCL kernels, by ncclFunc_t, NCCL_ALGO_* and NCCL_PROTO_*
+void ncclMetricsColl(int func, int algorithm, int protocol, size_t bytes);
+// Kernel time of a sampled collective
+void ncclMetricsCollLatency(int func, int algorithm, int protocol, float us);
+// Bytes the network plugin completed on device netDev, name is kept from the first call
+void ncclMetricsNetDevice(int netDev, const char* name);
+void ncclMetricsNetBytes(int netDev, bool send, size_t bytes);
+// Scheduling decision of an MSCCL call, reason is a mscclSelectReason
+void ncclMetricsMscclSelect(int reason, bool scheduled);
+// IB device whose port counters are exported, and its async errors
+void ncclMetricsIbDevice(int ibDev, const char* name, int port);
+void ncclMetricsIbAsyncError(int ibDev, bool fatal);
+
+// Start the exporter thread of NCCL_METRICS_PORT or NCCL_METRICS_FILE, once per process
+ncclResult_t ncclMetricsInit();
+
+#endif
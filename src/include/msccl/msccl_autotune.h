@@ -0,0 +1,27 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_AUTOTUNE_H_
+#define MSCCL_AUTOTUNE_H_
+
+#include <vector>
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+bool mscclAutotuneEnabled();
+
+// Pick between the candidate algoMetas indices and NCCL (-1) for the call in savedParam. Without
+// a decision for the call, the candidates are rotated and the call is marked to be timed by
+// mscclAutotuneBegin/End. defaultChoice is used when the call cannot be explored.
+ncclResult_t mscclAutotuneChoose(struct mscclSavedSchedulerParam* savedParam, bool inPlace,
+  const std::vector<int>& candidates, int defaultChoice, int* choice);
+
+// Time the call chosen by mscclAutotuneChoose, no-ops when the call is not explored
+ncclResult_t mscclAutotuneBegin(ncclComm_t comm, cudaStream_t stream);
+ncclResult_t mscclAutotuneEnd(ncclComm_t comm, cudaStream_t stream);
+
+ncclResult_t mscclAutotuneTeardown(ncclComm_t comm);
+
+#endif
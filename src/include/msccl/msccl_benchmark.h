@@ -0,0 +1,46 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_BENCHMARK_H_
+#define MSCCL_BENCHMARK_H_
+
+#include <utility>
+#include <vector>
+
+#include "nccl.h"
+#include "msccl/msccl_struct.h"
+
+#define MSCCL_BENCH_MIN_BYTES 1024
+
+// Collectives are timed on floats with a sum, the most common case of the algorithms
+static const ncclDataType_t mscclBenchDataType = ncclFloat;
+
+// Time every algorithm comm can select against the NCCL collective over the sizes it covers, and
+// write algbw and busbw of both to csvFile on rank 0, followed by the fitted latency and bandwidth
+// of each algorithm and the fastest choice per size. Collective over all the ranks of comm.
+ncclResult_t mscclBenchmarkAlgosComm(ncclComm_t comm, const char* csvFile, cudaStream_t stream);
+
+// Helpers shared with the benchmarks of bench/
+
+// Name of func in CSV files, nullptr if it is not timed
+const char* mscclBenchFuncName(mscclFunc_t func);
+
+// Ratio of busbw to algbw, as nccl-tests compute it
+double mscclBenchBusFactor(mscclFunc_t func, int nRanks);
+
+// The NCCL collective of func, with the same arguments and root as the algorithm gets
+ncclResult_t mscclBenchRunNccl(mscclFunc_t func, const void* sendBuff, void* recvBuff, size_t count, ncclComm_t comm, cudaStream_t stream);
+
+// Count of a call of nBytes to the algorithm, false if its size constraints rule it out
+bool mscclBenchCount(const struct mscclAlgoMeta& m, int64_t nBytes, size_t* count);
+
+// In-place calls place the buffer of this rank as the selection recognizes it
+void mscclBenchBuffers(mscclFunc_t func, bool inPlace, size_t count, ncclComm_t comm, char* sendBuff, char* recvBuff,
+    const char** send, char** recv);
+
+// Algorithms comm can select, once for each of in-place and out-of-place they support
+void mscclBenchRuns(ncclComm_t comm, const struct mscclAlgoCatalog* catalog, std::vector<std::pair<int, bool>>* runs);
+
+#endif
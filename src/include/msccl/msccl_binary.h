@@ -0,0 +1,86 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_BINARY_H_
+#define MSCCL_BINARY_H_
+
+#include <vector>
+#include "nccl.h"
+#include "msccl/msccl_struct.h"
+
+// Precompiled MSCCL algorithm file. It holds the mscclAlgo already resolved from the XML for
+// every rank, so loading is a mmap and a few copies instead of a parse:
+//   struct mscclAlgoBinHeader
+//   uint64_t rankOffsets[nRanks]              // 0 if the rank has no gpu entry
+//   for each rank:
+//     struct mscclAlgoBinRank
+//     struct mscclThreadBlock mscclTBs[nBlocks]
+//     struct mscclChannelInfo mscclChannels[nChannelInfos]
+//     struct mscclChannelPeerInfo peerInfos[nPeerInfos]
+// Files are only valid for builds with the same MSCCL_MAX_NUM_STEPS and MAXCHANNELS.
+#define MSCCL_ALGO_BIN_MAGIC "MSCCLBIN"
+#define MSCCL_ALGO_BIN_VERSION 12
+
+struct alignas(16) mscclAlgoBinHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t maxNumSteps;
+  uint32_t threadBlockSize;
+  uint32_t channelInfoSize;
+  uint32_t peerInfoSize;
+  int32_t nChunksPerLoop;
+  int32_t protocol;
+  int32_t nChannels;
+  int32_t nNvlsChannels;
+  int32_t nRanks;
+  int32_t sizeMultiplier;
+  int32_t chunkSteps;
+  int32_t sliceSteps;
+  int32_t func;
+  int64_t minBytes;
+  int64_t maxBytes;
+  uint8_t inPlace;
+  uint8_t outOfPlace;
+  uint8_t collNet;
+  uint8_t writesInput;
+  // Protocols used by any of the compiled ranks
+  int32_t protocolMask;
+  float latency;
+  float bandwidth;
+  struct mscclAlgoTopo topo;
+  int32_t root;
+};
+
+struct alignas(16) mscclAlgoBinRank {
+  int32_t nBlocks;
+  int32_t nScratchChunks;
+  int32_t nChannelInfos;
+  int32_t nPeerInfos;
+  int32_t protocolMask;
+  uint8_t hasReduce;
+};
+
+bool mscclIsAlgoBinFile(const char* filePath);
+
+ncclResult_t mscclGetAlgoFromBinImage(const char* name, const char* base, size_t size, struct mscclAlgo* algo, int rank);
+
+ncclResult_t mscclGetAlgoFromBinFile(const char* binFile, struct mscclAlgo* algo, int rank);
+
+ncclResult_t mscclGetAlgoMetaFromBinFile(const char* binFile, struct mscclAlgoMeta* algoMeta);
+
+// Compile the given ranks of xmlFile, or all of them if ranks is empty
+ncclResult_t mscclCompileAlgoXml(const char* xmlFile, const std::vector<int>& ranks, std::vector<char>* image);
+
+ncclResult_t mscclCompileAlgoXmlFile(const char* xmlFile, const char* binFile);
+
+// Register the algorithm of rank found in a compiled image, defined next to mscclLoadAlgo
+ncclResult_t mscclLoadAlgoFromBinImage(const char* name, const char* image, size_t size, mscclAlgoHandle_t *mscclAlgoHandle, int rank);
+
+// Pick the parser based on the file content
+ncclResult_t mscclGetAlgoFromFile(const char* filePath, struct mscclAlgo* algo, int rank);
+
+ncclResult_t mscclGetAlgoMetaFromFile(const char* filePath, struct mscclAlgoMeta* algoMeta);
+
+#endif
@@ -0,0 +1,35 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_DIRECT_H_
+#define MSCCL_DIRECT_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+bool mscclDirectEnabled();
+
+// Find the s and r of hostAlgo that can be zero-copy on comm. The k-th send of a connection is
+// the k-th receive of its peer, the steps of both ends are exchanged with the P2P peers of the
+// node and a pair is zero-copy when it is a plain s on one end and a plain r of the same count on
+// the other. Collective over the peers of hostAlgo, like the connection setup.
+ncclResult_t mscclDirectSetup(struct mscclAlgo* hostAlgo, ncclComm_t comm, int nReplicas);
+
+// Whether algorithms set up on comm receive into scratch from peers in other processes, which
+// then needs a scratch buffer they can map
+bool mscclDirectScratchIpc(ncclComm_t comm);
+
+// Fill the zero-copy fields of a launch descriptor of hostAlgo
+void mscclDirectInitLaunchDesc(struct mscclAlgo* hostAlgo, ncclComm_t comm, struct mscclLaunchDesc* desc);
+
+// Register the buffers of a call with the peer processes of its zero-copy steps, locally
+// registered buffers first, then through the graph being captured. Steps whose buffers are not
+// registered go through the FIFOs. The scratch of work is registered when it is exportable.
+ncclResult_t mscclDirectRegisterBuffers(const void* sendBuff, void* recvBuff, const struct mscclLaunchDesc* desc,
+  ncclComm_t comm, struct mscclWork* work);
+
+ncclResult_t mscclDirectTeardown(ncclComm_t comm);
+
+#endif
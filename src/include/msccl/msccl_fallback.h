@@ -0,0 +1,25 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_FALLBACK_H_
+#define MSCCL_FALLBACK_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+// Name of a reason in the counters, the metrics and the INFO report
+const char* mscclSelectReasonName(int reason);
+
+ncclResult_t mscclFallbackInit(ncclComm_t comm);
+
+// Count a scheduling decision of the call p of its communicator
+void mscclFallbackRecord(const struct mscclSchedulerParam* p, mscclSelectReason reason);
+
+ncclResult_t mscclFallbackQuery(ncclComm_t comm, mscclFallbackStat_t* stats, int* nStats);
+
+// Print the calls that went to NCCL and why, and free the counters
+ncclResult_t mscclFallbackTeardown(ncclComm_t comm);
+
+#endif
@@ -7,14 +7,46 @@
 #define MSCCL_KERNEL_H_
 
 #define MSCCL_KERNEL_ENTRY_NAME(devredop, type, proto) mscclKernel_##devredop##_##type##_##proto
+// kernels compiled for MSCCL_OP_MASK_P2P
+#define MSCCL_P2P_KERNEL_ENTRY_NAME(devredop, type, proto) mscclP2pKernel_##devredop##_##type##_##proto
+// kernels compiled for MSCCL_OP_MASK_ALL, for algorithms with fan types
+#define MSCCL_FAN_KERNEL_ENTRY_NAME(devredop, type, proto) mscclFanKernel_##devredop##_##type##_##proto
+// kernels running the protocol of each thread block
+#define MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type) mscclMixedKernel_##devredop##_##type
+// kernels compiled for MSCCL_OP_MASK_COPY, one per size of the types
+#define MSCCL_COPY_KERNEL_ENTRY_NAME(type, proto) mscclCopyKernel_##type##_##proto
 
+#if defined(MSCCL_SPECIALIZE_KERNELS)
 #define MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, proto) \
-__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevComm* comm, struct mscclAlgo* algo, struct mscclWork work);
+__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevComm* comm, struct mscclWork work); \
+__global__ void MSCCL_P2P_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevComm* comm, struct mscclWork work);
+#else
+#define MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, proto) \
+__global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevComm* comm, struct mscclWork work);
+#endif
+
+#if defined(MSCCL_FAN_KERNELS)
+#define MSCCL_DECL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, proto) \
+__global__ void MSCCL_FAN_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevComm* comm, struct mscclWork work);
+#else
+#define MSCCL_DECL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, proto)
+#endif
+
+#if defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+#define MSCCL_DECL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
+__global__ void MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type)(struct ncclDevComm* comm, struct mscclWork work);
+#else
+#define MSCCL_DECL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
+#endif
 
 #define MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type) \
   MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, LL) \
   MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, LL128) \
-  MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, Simple)
+  MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, Simple) \
+  MSCCL_DECL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, LL) \
+  MSCCL_DECL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, LL128) \
+  MSCCL_DECL_FAN_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE_PROTO(devredop, type, Simple) \
+  MSCCL_DECL_MIXED_KERNEL_ENTRY_FUNC_DEVREDOP_TYPE(devredop, type)
 
 #if defined(__CUDA_BF16_TYPES_EXIST__) && defined(__CUDA_FP8_TYPES_EXIST__)
 #define MSCCL_DECL_KERNEL_ENTRY_FUNC_DEVREDOP(devredop) \
@@ -72,4 +104,14 @@ __global__ void MSCCL_KERNEL_ENTRY_NAME(devredop, type, proto)(struct ncclDevCom
 
 MSCCL_DECL_KERNEL_ENTRY_FUNC()
 
+#define MSCCL_DECL_COPY_KERNEL_ENTRY_FUNC_TYPE(type) \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL)(struct ncclDevComm* comm, struct mscclWork work); \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL128)(struct ncclDevComm* comm, struct mscclWork work); \
+__global__ void MSCCL_COPY_KERNEL_ENTRY_NAME(type, Simple)(struct ncclDevComm* comm, struct mscclWork work);
+
+MSCCL_DECL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint8_t)
+MSCCL_DECL_COPY_KERNEL_ENTRY_FUNC_TYPE(half)
+MSCCL_DECL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint32_t)
+MSCCL_DECL_COPY_KERNEL_ENTRY_FUNC_TYPE(uint64_t)
+
 #endif
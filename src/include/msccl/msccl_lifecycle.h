@@ -12,6 +12,9 @@
 
 bool mscclEnabled();
 
+// Whether comm runs MSCCL, config.mscclEnable or MSCCL_ENABLE when it is not set
+bool mscclEnabled(ncclComm_t comm);
+
 void mscclSetIsCallerFlag();
 void mscclClearIsCallerFlag();
 bool mscclIsCaller();
@@ -24,7 +27,7 @@ ncclResult_t mscclSchedulerInit(ncclComm_t comm, int* numChannelsRequired);
 
 ncclResult_t mscclInit(ncclComm_t comm);
 
-ncclResult_t mscclInitKernelsForDevice(int cudaArch, size_t* maxStackSize);
+ncclResult_t mscclInitKernelsForDevice(int cudaDev, int cudaArch, size_t* maxStackSize);
 
 ncclResult_t mscclGroupStart();
 
@@ -34,8 +37,30 @@ ncclResult_t mscclEnqueueCheck(
     size_t count, ncclDataType_t datatype, int root, int peer, ncclRedOp_t op,
     mscclFunc_t mscclFunc, ncclComm_t comm, cudaStream_t stream);
 
-ncclResult_t mscclGroupEnd();
+// Operations of a group ended by ncclGroupSimulateEnd are timed instead of run when simulate is set
+ncclResult_t mscclGroupEnd(bool simulate = false);
+
+ncclResult_t mscclWarmupComm(ncclComm_t comm);
+
+ncclResult_t mscclReloadAlgosComm(ncclComm_t comm);
+
+// Turn a dependency wait given up by the kernel on comm into an asynchronous error
+ncclResult_t mscclCheckWatchdog(ncclComm_t comm, ncclResult_t* asyncError);
+
+// Load and connect algorithm metaIndex of the catalog of comm, collective over the ranks of comm
+ncclResult_t mscclPrepareCatalogAlgo(ncclComm_t comm, int metaIndex, mscclAlgoHandle_t* handle);
+
+// Look up an algorithm and its copy on the device of comm, defined next to mscclRunAlgo
+ncclResult_t mscclGetAlgo(mscclAlgoHandle_t mscclAlgoHandle, ncclComm_t comm, struct mscclAlgo** hostAlgo, struct mscclDevAlgo** devAlgo);
+
+// Load the program of logical rank rank for comm, logicalToRank giving the rank of comm running each
+// program: node order of algorithms with nLocalRanks (see mscclCommTopo) or rotation to another root
+ncclResult_t mscclLoadAlgoRemapped(const char *mscclAlgoFilePath, mscclAlgoHandle_t *mscclAlgoHandle, ncclComm_t comm,
+  int rank, const int* logicalToRank);
+
+// Run scheduled operations sharing comm, stream and algorithm with a single kernel launch
+ncclResult_t mscclRunFusedAlgo(const std::vector<struct mscclSavedSchedulerParam*>& params);
 
-ncclResult_t mscclTeardown();
+ncclResult_t mscclTeardown(ncclComm_t comm);
 
 #endif
@@ -0,0 +1,19 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_NODE_CACHE_H_
+#define MSCCL_NODE_CACHE_H_
+
+#include "comm.h"
+
+bool mscclNodeCacheEnabled(ncclComm_t comm);
+
+// Collective over the local ranks of comm. Local rank 0, which must already have its algorithm
+// metas loaded, publishes them and the algorithms compiled for the other local ranks through
+// shared memory. Ranks passing needMetas get them in mscclStatus and loaded is set on success.
+// Caller must hold mscclLifecycleMutex.
+ncclResult_t mscclNodeCacheShare(ncclComm_t comm, bool needMetas, bool* loaded);
+
+#endif
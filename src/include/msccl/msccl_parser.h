@@ -79,6 +79,32 @@ static ncclResult_t mscclXmlGetAttrInt(struct mscclXmlNode* node, const char* at
   return ncclSuccess;
 }
 
+static ncclResult_t mscclXmlGetAttrIntDefault(struct mscclXmlNode* node, const char* attrName, int* value, int defaultValue) {
+  const char* str;
+  NCCLCHECK(mscclXmlGetAttr(node, attrName, &str));
+  *value = str ? strtol(str, NULL, 0) : defaultValue;
+  return ncclSuccess;
+}
+
+// Comma separated list of at most maxValues integers
+static ncclResult_t mscclXmlGetAttrIntList(struct mscclXmlNode* node, const char* attrName, int* values, int maxValues, int* nValues) {
+  const char* str;
+  NCCLCHECK(mscclXmlGetAttrStr(node, attrName, &str));
+  *nValues = 0;
+  while (true) {
+    char* end;
+    int value = strtol(str, &end, 0);
+    if (end == str || *nValues == maxValues) {
+      WARN("MSCCL: attribute %s of %s must be a list of at most %d integers", attrName, node->name, maxValues);
+      return ncclInvalidUsage;
+    }
+    values[(*nValues)++] = value;
+    if (*end != ',') break;
+    str = end + 1;
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t mscclXmlGetAttrInt64(struct mscclXmlNode* node, const char* attrName, int64_t* value) {
   const char* str;
   NCCLCHECK(mscclXmlGetAttrStr(node, attrName, &str));
@@ -98,6 +124,10 @@ static ncclResult_t mscclXmlFindTag(struct mscclXml* xml, const char* tagName, s
   return ncclSuccess;
 }
 
+// Resolve the protocol of an algorithm whose thread blocks all use the same one, and reject
+// several of them in builds without mixed protocol kernels
+ncclResult_t mscclCheckProtocols(struct mscclAlgo* algo, int rank);
+
 ncclResult_t mscclGetAlgoFromXmlFile(const char* xmlGraphFile, struct mscclAlgo* algo, int rank);
 
 ncclResult_t mscclGetAlgoMetaFromXmlFile(const char* xmlGraphFile, struct mscclAlgoMeta* algoMeta);
@@ -0,0 +1,31 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_PERSISTENT_H_
+#define MSCCL_PERSISTENT_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+bool mscclPersistentEnabled();
+
+// Queue work on the resident kernel of comm, starting the kernel with func and grid if it is not
+// running. posted is left false when work has to be launched as a regular kernel instead.
+ncclResult_t mscclPersistentPost(void* func, dim3 grid, dim3 block, struct mscclWork* work,
+  ncclComm_t comm, cudaStream_t stream, bool* posted);
+
+// Wait for the queued works and make the resident kernels of every communicator of cudaDev exit.
+// Device wide synchronization, such as cudaFree, would otherwise wait for them forever. They are
+// started again by the next post.
+ncclResult_t mscclPersistentStopDevice(int cudaDev);
+
+// Stop the resident kernels of cudaDev before another kernel is launched there. A resident kernel
+// holds its SMs until it exits, a kernel waiting for them while its peers wait for it would hang.
+ncclResult_t mscclPersistentExclude(int cudaDev);
+
+// Stop the resident kernels of the device of comm and release the queue of comm
+ncclResult_t mscclPersistentTeardown(ncclComm_t comm);
+
+#endif
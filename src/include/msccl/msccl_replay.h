@@ -0,0 +1,20 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_REPLAY_H_
+#define MSCCL_REPLAY_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+// Launch the kernel of work by replaying the CUDA graph instantiated for the launch shape of handle,
+// with func and work set on its kernel node. launched is left false when the kernel has to be
+// launched as usual instead, as in captures of the application or with NCCL_MSCCL_LAUNCH_GRAPHS=0.
+ncclResult_t mscclReplayLaunch(mscclAlgoHandle_t handle, void* func, dim3 grid, dim3 block, struct mscclWork* work,
+  ncclComm_t comm, cudaStream_t stream, bool* launched);
+
+ncclResult_t mscclReplayTeardown(ncclComm_t comm);
+
+#endif
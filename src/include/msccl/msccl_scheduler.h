@@ -17,7 +17,9 @@ typedef enum { mscclFuncReduce             =  0,
                mscclFuncScatter            =  8,
                mscclFuncAllToAll           =  9,
                mscclFuncAllToAllv          =  10,
-               mscclNumFuncs               =  11 } mscclFunc_t;
+               mscclFuncAllGatherV         =  11,
+               mscclFuncReduceScatterV     =  12,
+               mscclNumFuncs               =  13 } mscclFunc_t;
 
 struct mscclSchedulerParam {
   const void* sendBuff;
@@ -36,6 +38,39 @@ struct mscclSchedulerParam {
   int nRanks;
   bool scheduled;
   mscclAlgoHandle_t handle;
+  // Communicator and stream of the operation
+  ncclComm_t comm;
+  cudaStream_t stream;
+};
+
+// Topology of a communicator, as seen from one of its ranks
+struct mscclSchedulerTopo {
+  // Nodes of the communicator and its ranks on the node of this rank
+  int nNodes;
+  int nLocalRanks;
+  // GPUs and network interfaces of the node of this rank
+  int nGpus;
+  int nNics;
+  // Compute capability of the GPU of this rank, e.g. 900
+  int cudaArch;
+  // Bandwidths of one ring channel within and across nodes, in GB/s
+  float bwIntra;
+  float bwInter;
+  // Best bandwidth of a path between two GPUs of the node, and of all the paths out of a GPU, in GB/s
+  float maxBw;
+  float totalBw;
+  // Lowest and highest compute capability of the communicator, and whether GPUs of different
+  // ones are only on different nodes
+  int minCudaArch;
+  int maxCudaArch;
+  int cudaArchPerNode;
+};
+
+struct mscclSchedulerCommInfo {
+  ncclComm_t comm;
+  int rank;
+  int nRanks;
+  struct mscclSchedulerTopo topo;
 };
 
 typedef struct {
@@ -47,6 +82,29 @@ typedef struct {
   ncclResult_t (*selectAlgo)(struct mscclSchedulerParam* param);
   // Unload all algorithms
   ncclResult_t (*teardown)();
-} mscclSchedulerInterface;
+} mscclSchedulerInterface_v1;
+
+// Exported as mscclScheduler
+typedef mscclSchedulerInterface_v1 mscclSchedulerInterface;
+
+// Exported as mscclScheduler_v2, which is preferred over mscclScheduler
+typedef struct {
+  // Name of the scheduler (mainly for logs)
+  const char* name;
+  // Called once, when the scheduler is loaded
+  ncclResult_t (*init)();
+  // Called for every communicator before its channels are set up, e.g. to load the algorithms it
+  // may run with mscclLoadAlgo. numChannelsRequired is set to the channels these algorithms use,
+  // commContext is handed back to the other calls for this communicator.
+  ncclResult_t (*initComm)(const struct mscclSchedulerCommInfo* info, int* numChannelsRequired, void** commContext);
+  // Select algorithms for nParams operations of a communicator, in the order they were issued.
+  // The operations of a group are selected together when it ends, and it only runs on MSCCL if
+  // all of them are scheduled.
+  ncclResult_t (*selectAlgos)(void* commContext, struct mscclSchedulerParam** params, int nParams);
+  // Called when the communicator is destroyed
+  ncclResult_t (*finalizeComm)(void* commContext);
+  // Called when the last communicator is destroyed, before the scheduler is unloaded
+  ncclResult_t (*teardown)();
+} mscclSchedulerInterface_v2;
 
 #endif
@@ -9,20 +9,110 @@
 #include "comm.h"
 #include "msccl/msccl_struct.h"
 
-ncclResult_t mscclGetCaptureStatus(cudaStream_t stream);
+// Classify the capture state of stream for comm. The first capture of comm in a graph allocates
+// the captured state, which is released after the graph is destroyed.
+ncclResult_t mscclGetCaptureStatus(ncclComm_t comm, cudaStream_t stream);
 
-ncclResult_t mscclSetupScratch(struct mscclAlgo* hostAlgo, cudaStream_t stream);
+// Callbacks run when the graph the calling thread captures on comm is destroyed, e.g. buffer deregistrations
+ncclResult_t mscclGetCapturedCleanupQueue(ncclComm_t comm,
+    struct ncclIntruQueue<struct ncclCommCallback, &ncclCommCallback::next>** cleanupQueue);
 
-ncclResult_t mscclSetupSyncFlags(cudaStream_t stream);
+// Copy hostAlgo to the current device on its upload stream, without waiting for the copy
+ncclResult_t mscclSetupDevAlgo(struct mscclAlgo* hostAlgo, struct mscclDevAlgo** devAlgo);
+
+// Order stream after the upload of devAlgo, before its first launch. Under capture the upload is
+// waited for on the host instead. Takes algoMutex.
+ncclResult_t mscclWaitDevAlgo(struct mscclDevAlgo* devAlgo, cudaStream_t stream);
+
+// Free devAlgo after its upload, under algoMutex
+ncclResult_t mscclFreeDevAlgo(struct mscclDevAlgo* devAlgo);
+
+ncclResult_t mscclTeardownUploads();
+
+ncclResult_t mscclReserveScratch(ncclComm_t comm, size_t size);
+
+ncclResult_t mscclTeardownScratch(ncclComm_t comm);
+
+// Whether algorithms of func made for in-place or out-of-place calls only may run the other calls
+bool mscclAliasable(mscclFunc_t func);
+
+// Whether a call of func with rankBytes per rank on the smaller of its buffers is in-place
+bool mscclIsInPlaceCall(mscclFunc_t func, const void* sendBuff, const void* recvBuff, size_t rankBytes, int rank);
+
+// Set up the scratch of a call of the algorithm of desc and of its tail. Calls that are in-place when
+// the algorithm is out-of-place only, or the other way around, get their input copied where the
+// algorithm expects it, and alias holds the buffers to run it on.
+ncclResult_t mscclSetupAlias(const void* sendBuff, void* recvBuff, const struct mscclLaunchDesc* desc,
+    const struct mscclTail* tail, ncclComm_t comm, cudaStream_t stream, struct mscclAlias* alias);
+
+// Copy the output of the call of alias to the user buffer if it was staged, after the kernel
+ncclResult_t mscclFinishAlias(const struct mscclAlias* alias, cudaStream_t stream);
+
+// Whether a call of count elements leaves elements of its blocks out of the chunks of hostAlgo
+bool mscclHasTail(const struct mscclAlgo* hostAlgo, size_t count);
+
+// Whether algorithms of func with nChunksPerLoop chunks can run calls of count elements
+bool mscclCountSupported(mscclFunc_t func, int nChunksPerLoop, int sizeMultiplier, size_t count);
+
+// Whether the call of tail has whole chunks to run before it
+bool mscclHasBody(const struct mscclTail* tail);
+
+// Plan the second launch of a call of count elements that runs what its chunks leave out of each
+// block. Calls whose count divides into the chunks get no launch.
+ncclResult_t mscclSetupTail(mscclAlgoHandle_t handle, struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo,
+    ncclComm_t comm, size_t count, ncclDataType_t dataType, struct mscclTail* tail);
+
+// Copy the tail of each block of sendBuff to scratch, run the algorithm over it and copy the result
+// to the tail of each block of recvBuff, after the launch of the whole chunks
+ncclResult_t mscclRunTail(const void* sendBuff, void* recvBuff, ncclRedOp_t op, const struct mscclTail* tail,
+    ncclComm_t comm, cudaStream_t stream);
+
+// Times the thread blocks of an algorithm may be replicated, each replica on channels of its own
+int mscclBlockReplicas();
+
+// Channels the calls of hostAlgo may use on comm, from channel 0 on
+int mscclAlgoChannels(struct mscclAlgo* hostAlgo, ncclComm_t comm);
+
+// Whether comm has the NVLS channels an algorithm with nNvlsChannels needs
+bool mscclNvlsAvailable(ncclComm_t comm, int nNvlsChannels);
+
+// Op the network reduces with for the car steps of a call with op
+ncclRedOp_t mscclCollNetRedOp(ncclRedOp_t op);
+
+// Whether comm has CollNet connections reducing op on dataType
+bool mscclCollNetAvailable(ncclComm_t comm, ncclRedOp_t op, ncclDataType_t dataType);
+
+// Device reduction op running op on datatype, and its scalar argument
+ncclResult_t mscclHostToDevRedOp(ncclDevRedOpFull *opFull, ncclRedOp_t op, ncclDataType_t datatype, ncclComm *comm);
 
 ncclResult_t mscclSetupConnections(struct mscclAlgo* hostAlgo, ncclComm_t comm);
 
-ncclResult_t mscclSetupCount(struct mscclAlgo* hostAlgo, ncclComm_t comm, size_t count, ncclDataType_t dataType);
+// Launch descriptor of the algorithm for count elements of dataType, from the cache of comm. The
+// descriptor stays valid until MSCCL_LAUNCH_CACHE_SIZE other ones are looked up.
+ncclResult_t mscclSetupCount(mscclAlgoHandle_t handle, struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo,
+    ncclComm_t comm, size_t count, ncclDataType_t dataType, const struct mscclLaunchDesc** desc);
+
+ncclResult_t mscclTeardownLaunchCache(ncclComm_t comm);
 
-ncclResult_t mscclSetupProxy(struct mscclAlgo* hostAlgo, ncclComm_t comm, cudaStream_t stream);
+// Queue and start the proxy operations of a collective, under group and coll events of the profiler
+// plugin. Nothing is queued for connections without a proxy, which is all of them for pure P2P/NVLS
+// algorithms.
+ncclResult_t mscclSetupProxy(const void* sendBuff, void* recvBuff, ncclRedOp_t op,
+    const struct mscclLaunchDesc* desc, ncclComm_t comm, cudaStream_t stream);
 
-ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, size_t count,
-    ncclDataType_t dataType, ncclRedOp_t op, struct mscclAlgo* hostAlgo, struct mscclAlgo* devAlgo,
+// Launch func with work as argument, shared by regular launches and resident kernels
+ncclResult_t mscclLaunchKernelGrid(void* func, dim3 grid, dim3 block, struct mscclWork* work,
     ncclComm_t comm, cudaStream_t stream);
 
+ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, ncclRedOp_t op,
+    const struct mscclLaunchDesc* desc, ncclComm_t comm, cudaStream_t stream);
+
+// Scratch parts of fused works are aligned to this
+#define MSCCL_FUSED_SCRATCH_ALIGN 256
+
+// Set up and launch the operations of params, which share comm, stream, algorithm, data type and
+// reduction op, as a single kernel with a single proxy start. Not for use during capture.
+ncclResult_t mscclSetupFusedKernel(const std::vector<struct mscclSavedSchedulerParam*>& params,
+    struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo, ncclComm_t comm, cudaStream_t stream);
+
 #endif
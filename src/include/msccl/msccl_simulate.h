@@ -0,0 +1,20 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_SIMULATE_H_
+#define MSCCL_SIMULATE_H_
+
+#include "nccl.h"
+
+// Replay the steps of all the ranks of algoFile on a model of the links and write the predicted
+// times, the critical path, the link utilization and any deadlock to reportFile. The links are
+// those of comm when it is not null, otherwise they come from the NCCL_MSCCL_SIM_* parameters.
+ncclResult_t mscclSimulateAlgoFile(const char* algoFile, ncclComm_t comm, const char* reportFile);
+
+// Predicted time in us of algoFile on nBytes over the links of comm, and the time its busiest
+// link is busy. Used by ncclGroupSimulateEnd for the operations a scheduler gives to MSCCL.
+ncclResult_t mscclSimulateAlgoTime(const char* algoFile, ncclComm_t comm, int64_t nBytes, float* time, float* linkTime);
+
+#endif
@@ -0,0 +1,19 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_SPLIT_H_
+#define MSCCL_SPLIT_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+// Run the scheduled call of param as an MSCCL part on the channels of its algorithm and an NCCL
+// part on the channels above them, at the same time, the stream of the call waiting for both.
+// Sets done to false when the call is not split, all ranks decide it the same way.
+ncclResult_t mscclSplitRun(struct mscclSavedSchedulerParam* param, bool* done);
+
+ncclResult_t mscclSplitTeardown(ncclComm_t comm);
+
+#endif
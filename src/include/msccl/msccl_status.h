@@ -6,10 +6,13 @@
 #ifndef MSCCL_STATUS_H_
 #define MSCCL_STATUS_H_
 
+#include "comm.h"
 #include "msccl/msccl_struct.h"
 
 mscclStatus& mscclGetStatus();
 
+mscclCommStatus& mscclGetCommStatus(ncclComm_t comm);
+
 mscclSavedProxyArgs& mscclGetSavedProxyArgs();
 
 mscclThreadLocalStatus& mscclGetThreadLocalStatus();
@@ -6,18 +6,31 @@
 #ifndef MSCCL_STRUCT_H_
 #define MSCCL_STRUCT_H_
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <list>
 #include <map>
+#include <mutex>
 #include <set>
 #include <vector>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include "device.h"
+#include "profiler.h"
 #include "msccl/msccl_scheduler.h"
 
 #define MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL 32
 #define MSCCL_MAX_NUM_THREAD_BLOCKS (MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL * MAXCHANNELS)
+// Peers a channel sends to or receives from, their infos come from a pool shared by all the
+// channels of an algorithm, so that a few channels can carry the peers of many thread blocks
+#define MSCCL_MAX_CHANNEL_PEERS 256
+#define MSCCL_MAX_PEER_INFOS (2 * MSCCL_MAX_NUM_THREAD_BLOCKS)
 #define MSCCL_MAX_COUNT 72 // max concurrent number of msccl chunk transmission
-#define MSCCL_MAX_REDUCE_FUSION 16
+#define MSCCL_MAX_REDUCE_FUSION 64 // max reductions with the same dst fused into one transmission
+#define MSCCL_REDUCE_TILE 7 // sources reduced per primitive call, dst is the extra source of each
 #define MSCCL_MAX_NUM_ALGOS 1024
 
 #define MSCCL_SLICESTEPS (NCCL_STEPS/4)
@@ -35,6 +48,59 @@
 #define MSCCL_RECV_REDUCE_COPY_SEND 5
 #define MSCCL_LOCAL_COPY 6
 #define MSCCL_REDUCE 7
+// receive from all the recv peers of the thread block and reduce with the source into the destination
+#define MSCCL_RECV_REDUCE_COPY_N 8
+// send the source to all the send peers of the thread block
+#define MSCCL_SEND_N 9
+// multimem.ld_reduce into the destination the chunk every local rank put in the NVLS buffer of this head
+#define MSCCL_MULTIMEM_LD_REDUCE 10
+// multimem.st the source into the NVLS buffer of this head on every local rank
+#define MSCCL_MULTIMEM_ST 11
+// send the source to the CollNet of the channel and receive the allreduce of all nodes into the destination
+#define MSCCL_COLLNET_ALLREDUCE 12
+
+// Peers a thread block may receive from or send to, as NCCL direct collectives
+#define MSCCL_MAX_FAN_PEERS NCCL_MAX_DIRECT_ARITY
+
+// Sets of transmission types a kernel is compiled for, the interpreter skips the others
+#define MSCCL_OP_BIT(type) (1 << (type))
+#define MSCCL_OP_MASK_ALL (~0)
+#define MSCCL_OP_IN(mask, type) (((mask) >> (type)) & 1)
+// types run on the primitives of all the peers of a thread block
+#define MSCCL_OP_MASK_FAN (MSCCL_OP_BIT(MSCCL_RECV_REDUCE_COPY_N) | MSCCL_OP_BIT(MSCCL_SEND_N))
+// types run on the multicast buffers of NVLS channels
+#define MSCCL_OP_MASK_NVLS (MSCCL_OP_BIT(MSCCL_MULTIMEM_LD_REDUCE) | MSCCL_OP_BIT(MSCCL_MULTIMEM_ST))
+// types run on the CollNet connections of a channel
+#define MSCCL_OP_MASK_COLLNET MSCCL_OP_BIT(MSCCL_COLLNET_ALLREDUCE)
+// kernels of the algorithms without fan types, whose thread blocks all run on the primitives of one peer
+#define MSCCL_OP_MASK_GENERIC (MSCCL_OP_MASK_ALL & ~MSCCL_OP_MASK_FAN)
+// kernels running algorithms that mix protocols, the fan types need a second mscclRunWork per protocol
+#if defined(MSCCL_FAN_KERNELS)
+#define MSCCL_OP_MASK_MIXED MSCCL_OP_MASK_ALL
+#else
+#define MSCCL_OP_MASK_MIXED MSCCL_OP_MASK_GENERIC
+#endif
+// kernels for algorithms only exchanging data with one peer at a time, without local copies and reductions
+#define MSCCL_OP_MASK_P2P (MSCCL_OP_MASK_ALL & ~(MSCCL_OP_BIT(MSCCL_LOCAL_COPY) | MSCCL_OP_BIT(MSCCL_REDUCE) | \
+  MSCCL_OP_MASK_FAN | MSCCL_OP_MASK_NVLS | MSCCL_OP_MASK_COLLNET))
+// kernels for algorithms only moving data, which do not depend on the reduction op and only on the size of the type
+#define MSCCL_OP_MASK_COPY (MSCCL_OP_MASK_ALL & ~(MSCCL_OP_BIT(MSCCL_RECV_REDUCE_SEND) | MSCCL_OP_BIT(MSCCL_RECV_REDUCE_COPY) | \
+  MSCCL_OP_BIT(MSCCL_RECV_REDUCE_COPY_SEND) | MSCCL_OP_BIT(MSCCL_REDUCE) | MSCCL_OP_MASK_FAN | \
+  MSCCL_OP_MASK_NVLS | MSCCL_OP_MASK_COLLNET))
+
+// Thread blocks of an NVLS channel run on the NVLS connections NCCL sets up on the channel
+#define MSCCL_NVLS_NONE 0
+// multimem types through the multicast buffer of the NVLS head of this rank
+#define MSCCL_NVLS_MULTIMEM 1
+// s and r to the unicast buffers of the NVLS heads, peers are head indices instead of ranks
+#define MSCCL_NVLS_UNICAST 2
+
+// Zero-copy s and r between P2P peers: the receiver publishes in the ptrExchange slot of the
+// connection where the data goes in the address space of the sender, or this when it has to go
+// through the FIFO, e.g. into a scratch buffer a peer process cannot map
+#define MSCCL_DIRECT_FIFO ((void*)0x1)
+// words of the bit mask of the zero-copy steps of a thread block
+#define MSCCL_DIRECT_MASK_WORDS DIVUP(MSCCL_MAX_NUM_STEPS, 32)
 
 struct alignas(16) mscclTransmission {
   int16_t dependencePointer; // index to the first dependence
@@ -51,29 +117,81 @@ struct alignas(16) mscclTransmission {
 }; // 16 bytes
 
 static_assert((1ULL << (8*sizeof(mscclTransmission::count))) - 1 > MSCCL_MAX_COUNT, "MSCCL_MAX_COUNT must representable by datatype of count");
+static_assert(MSCCL_MAX_NUM_THREAD_BLOCKS <= INT16_MAX, "MSCCL_MAX_NUM_THREAD_BLOCKS must be representable by dependentBid");
+static_assert(MSCCL_MAX_PEER_INFOS <= INT16_MAX, "MSCCL_MAX_PEER_INFOS must be representable by the peer indices of channels");
 
 struct alignas(16) mscclThreadBlock {
   // step is used to index into these arrays
   alignas(16) struct mscclTransmission transmissions[MSCCL_MAX_NUM_STEPS]; // 4KB
-  int8_t dependentBid[MSCCL_MAX_NUM_STEPS]; // -1 if not dependent on any thread block, 256 bytes
+  int16_t dependentBid[MSCCL_MAX_NUM_STEPS]; // -1 if not dependent on any thread block, 512 bytes
   int16_t dependentStep[MSCCL_MAX_NUM_STEPS]; // 512 bytes
   int16_t reductionSrcOffsets[MSCCL_MAX_NUM_STEPS]; // 512 bytes
-  int16_t sendPeer;
-  int16_t recvPeer;
+  // peers are -1 past nSendPeers and nRecvPeers, more than one is only used by the _N types
+  int16_t sendPeers[MSCCL_MAX_FAN_PEERS];
+  int16_t recvPeers[MSCCL_MAX_FAN_PEERS];
+  int8_t nSendPeers;
+  int8_t nRecvPeers;
   uint16_t nSteps;
   int16_t channelId; // associated channel. -1 indicates a thread block with only local copies
-}; // 5384 bytes
+  int8_t nvls; // MSCCL_NVLS_*
+  int8_t protocol; // NCCL_PROTO_*, the same for all the thread blocks of a channel
+  int8_t collnet; // 1 when the thread block runs on the CollNet connections of its channel
+}; // 5680 bytes
 
 static_assert(sizeof(struct mscclThreadBlock) % sizeof(uint64_t) == 0, "Sanity check: sizeof(struct mscclThreadBlock) \
   % sizeof(uint64_t) != 0");
 
+// the kernel copies the per-step arrays of mscclThreadBlock in uint64_t words
+static_assert(MSCCL_MAX_NUM_STEPS % 8 == 0, "MSCCL_MAX_NUM_STEPS must be a multiple of 8");
+
+// Device copy of an algorithm only carries what the kernel reads, packed by mscclSetupDevAlgo:
+//   struct mscclDevAlgo
+//   uint32_t tbOffsets[nBlocks]              // in units of MSCCL_DEV_ALGO_ALIGN from the start
+//   for each thread block:
+//     struct mscclDevThreadBlock
+//     struct mscclTransmission transmissions[nSteps]
+//     int16_t dependentBid[nDependencies]
+//     int16_t dependentStep[nDependencies]
+//     int16_t reductionSrcOffsets[nReductions]
+// Every array is padded to MSCCL_DEV_ALGO_ALIGN bytes.
+#define MSCCL_DEV_ALGO_ALIGN 16
+
+struct alignas(16) mscclDevAlgo {
+  int nBlocks;
+  // total bytes of the packed algorithm
+  uint32_t nBytes;
+};
+
+struct alignas(16) mscclDevThreadBlock {
+  int16_t sendPeers[MSCCL_MAX_FAN_PEERS];
+  int16_t recvPeers[MSCCL_MAX_FAN_PEERS];
+  int8_t nSendPeers;
+  int8_t nRecvPeers;
+  uint16_t nSteps;
+  int16_t channelId;
+  int8_t nvls;
+  int8_t protocol;
+  int8_t collnet;
+  // receives run a grid iteration behind the sends, see mscclCanPipeline
+  int8_t pipelined;
+  uint16_t nDependencies;
+  uint16_t nReductions;
+};
+
 struct mscclFlag {
   uint64_t flag;
   uint64_t align[3]; // to avoid false sharing
 };
 
+// Link a thread block expects to reach its peers over, from the hop attribute of its tb tag
+#define MSCCL_HOP_ANY 0
+#define MSCCL_HOP_NVLINK 1
+#define MSCCL_HOP_NET 2
+
 struct mscclChannelPeerInfo {
   int peer;
+  // MSCCL_HOP_*, checked against the transport of the connection once it is set up
+  int hop;
   // nTransmissionsOfCount[i]: number of transmissions with count i (in terms of msccl chunks)
   int nTransmissionsOfCount[MSCCL_MAX_COUNT + 1];
   int existingCounts[MSCCL_MAX_COUNT + 1];
@@ -81,19 +199,70 @@ struct mscclChannelPeerInfo {
 };
 
 struct mscclChannelInfo {
-  struct mscclChannelPeerInfo sendPeerInfo[MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL];
+  // indices of the peer infos in mscclAlgo::peerInfos, see mscclChannelSendPeer and mscclChannelRecvPeer
+  int16_t sendPeerInfos[MSCCL_MAX_CHANNEL_PEERS];
   int nSendPeers;
-  struct mscclChannelPeerInfo recvPeerInfo[MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL];
+  int16_t recvPeerInfos[MSCCL_MAX_CHANNEL_PEERS];
   int nRecvPeers;
+  // protocol of the thread blocks on the channel
+  int protocol;
+  // 1 when a thread block of the channel runs on its CollNet connections, they have no peer
+  int collnet;
+  struct mscclChannelPeerInfo collnetPeerInfo;
+};
+
+// Topology an algorithm is written for, from optional attributes of its <algo> tag
+struct mscclAlgoTopo {
+  // ranks and NICs of every node, 0 for any
+  int32_t nLocalRanks;
+  int32_t nNics;
+  // 1 when all the GPUs of every node must be connected by NVLink, or have NVSwitches, 0 when they
+  // must not, -1 for any
+  int32_t nvlink;
+  int32_t nvswitch;
+  // 1 when ranks of the same local rank on all nodes must use the same NIC of their node
+  int32_t rails;
+  // ranks of every NVLink domain, a multi-node NVLink clique or else a node, 0 for any
+  int32_t nDomainRanks;
+  // 1 when the NVLink domains must span nodes through multi-node NVLink, 0 when they must not, -1 for any
+  int32_t mnnvl;
+};
+
+// Topology of a communicator that algorithms can require, the same on all of its ranks
+struct mscclCommTopo {
+  // ranks and NICs of every node, 0 if nodes differ
+  int nLocalRanks;
+  int nNics;
+  bool nvlink;
+  bool nvswitch;
+  bool railAligned;
+  // ranks of every NVLink domain, 0 if domains differ
+  int nDomainRanks;
+  // NVLink domains are multi-node NVLink cliques
+  bool mnnvl;
+  // Algorithms with nLocalRanks see ranks in node order, logical rank node * nLocalRanks +
+  // local rank. nullptr when every rank is its own logical rank.
+  int* rankToLogical;
+  int* logicalToRank;
+  // index of logicalToRank among the rank layouts of the process, algorithms are loaded per layout
+  int rankLayout;
 };
 
 struct mscclAlgoMeta {
   // Path to algorithm file
   std::string filePath;
+  // config.mscclAlgoDir of the communicators that may run it, empty for the directory of the process
+  std::string algoDir;
   // number of chunks of input/output in each MSCCL algorithm loop
   int nChunksPerLoop;
   // number of channels needed by MSCCL algorithm
   int nChannels;
+  // number of NVLS channels needed by MSCCL algorithm
+  int nNvlsChannels;
+  // Whether this algorithm has CollNet thread blocks
+  bool collNet;
+  // Bits of the protocols the thread blocks of this algorithm may use
+  int protocolMask;
   // number of ranks required by this algorithm
   int nRanks;
   // need to times nRanks for all-gather, reduce-scatter and all-to-all
@@ -108,15 +277,34 @@ struct mscclAlgoMeta {
   bool inPlace;
   // Whether this algorithm is suitable for out-of-place.
   bool outOfPlace;
+  // Whether a step of any rank writes the input buffer, pre-ops cannot tell its chunks apart then
+  bool writesInput;
+  // Performance model, predicted time is latency + nBytes / (1000 * bandwidth) in us.
+  // A bandwidth of 0 means the algorithm has no model.
+  float latency;
+  float bandwidth;
+  struct mscclAlgoTopo topo;
+  // Root the reduce or broadcast was written for, other roots run it with ranks rotated
+  int root;
+  // Modification time of the file, in ns, a reload replaces algorithms whose file changed
+  int64_t mtime;
+  // Removed by a reload, still loaded for the work and graphs that use it but no longer selected
+  bool retired;
 };
 
 struct mscclAlgo {
   // number of chunks of input/output in each MSCCL algorithm loop
   int nChunksPerLoop;
-  // the protocol that the algorithm needs to use
+  // the protocol that the algorithm needs to use, thread blocks may override it
   int protocol;
+  // bits of the protocols of the thread blocks, algorithms with several of them run the mixed kernels
+  int protocolMask;
   // number of channels needed by MSCCL algorithm
   int nChannels;
+  // channels [0, nNvlsChannels) may hold NVLS thread blocks, they need as many NVLS channels from NCCL
+  int nNvlsChannels;
+  // thread blocks may allreduce through CollNet, the head ranks of all nodes need CollNet connections
+  bool collNet;
   // number of ranks required by this algorithm
   int nRanks;
   // number of necessary thread blocks
@@ -133,6 +321,9 @@ struct mscclAlgo {
   alignas(16) struct mscclThreadBlock mscclTBs[MSCCL_MAX_NUM_THREAD_BLOCKS];
   // used to calculate proxy info
   struct mscclChannelInfo mscclChannels[MAXCHANNELS];
+  // send and receive peers of all the channels, in the order of their thread blocks
+  struct mscclChannelPeerInfo peerInfos[MSCCL_MAX_PEER_INFOS];
+  int nPeerInfos;
   // Whether the algorithm requires reduce operation
   bool hasReduce;
   // MSCCL function type
@@ -147,6 +338,94 @@ struct mscclAlgo {
   bool outOfPlace;
 };
 
+// Peer p of the sends and of the receives of channel ch of algo
+inline struct mscclChannelPeerInfo* mscclChannelSendPeer(struct mscclAlgo* algo, const struct mscclChannelInfo* ch, int p) {
+  return algo->peerInfos + ch->sendPeerInfos[p];
+}
+inline const struct mscclChannelPeerInfo* mscclChannelSendPeer(const struct mscclAlgo* algo, const struct mscclChannelInfo* ch, int p) {
+  return algo->peerInfos + ch->sendPeerInfos[p];
+}
+inline struct mscclChannelPeerInfo* mscclChannelRecvPeer(struct mscclAlgo* algo, const struct mscclChannelInfo* ch, int p) {
+  return algo->peerInfos + ch->recvPeerInfos[p];
+}
+inline const struct mscclChannelPeerInfo* mscclChannelRecvPeer(const struct mscclAlgo* algo, const struct mscclChannelInfo* ch, int p) {
+  return algo->peerInfos + ch->recvPeerInfos[p];
+}
+
+// Algorithms with the same (func, nRanks, inPlace) are indexed by message size.
+// The byte axis is cut at every minBytes/maxBytes boundary, so that each segment
+// [startBytes, next segment's startBytes) holds a fixed list of candidate algorithms.
+struct mscclAlgoIndexSegment {
+  int64_t startBytes;
+  // indices into algoMetas, in algorithm directory order
+  std::vector<int> metaIndices;
+};
+
+struct mscclAlgoIndex {
+  // need to times nRanks for all-gather, reduce-scatter and all-to-all
+  int sizeMultiplier;
+  // sorted by startBytes
+  std::vector<struct mscclAlgoIndexSegment> segments;
+};
+
+typedef std::tuple<mscclFunc_t, int, bool> mscclAlgoIndexKey;
+
+// What the internal scheduler selects from on a communicator, rebuilt when it reloads algorithms
+struct mscclAlgoCatalog {
+  // copy of algoMetas, so that indices are those of rankToAlgoHandles
+  std::vector<mscclAlgoMeta> metas;
+  // over the metas usable by the communicator
+  std::map<mscclAlgoIndexKey, struct mscclAlgoIndex> index;
+};
+
+// Last scheduling decision of a communicator, reused when the same collective is called again
+// Why the scheduler took or left a call, shown on the NVTX marks of the decisions
+typedef enum {
+  mscclSelectChosen,
+  mscclSelectAvgOnIntegers,
+  mscclSelectNoCatalog,
+  mscclSelectNoAlgo,
+  mscclSelectNcclFaster,
+  mscclSelectNotLoaded,
+  mscclSelectExternal,
+  // Finer reasons for mscclSelectNoAlgo
+  mscclSelectNRanksMismatch,
+  mscclSelectInPlaceMismatch,
+  mscclSelectSizeOutOfRange,
+  mscclSelectCountNotDivisible,
+  mscclSelectResourceUnusable,
+  // Left before selection: the comm has no MSCCL state or the stream is a lane
+  mscclSelectIncompatible,
+  // Chosen, then run by NCCL with a call of its group MSCCL cannot run
+  mscclSelectGroupUnsupportedOp,
+  mscclSelectAutotuneNccl,
+  // PreMulSum ops scale the input as steps read it, which in-place calls and algorithms writing
+  // the input buffer would do twice or not at all
+  mscclSelectPreMulUnsafe,
+  mscclSelectNumReasons
+} mscclSelectReason;
+
+// Calls of [2^i, 2^(i+1)) bytes per decision and function, the last bucket also counts larger calls
+#define MSCCL_FALLBACK_SIZE_BUCKETS 48
+
+struct mscclFallbackStatus {
+  std::atomic<uint64_t> counts[mscclSelectNumReasons][mscclNumFuncs][MSCCL_FALLBACK_SIZE_BUCKETS];
+};
+
+struct mscclSelectMemo {
+  bool valid;
+  mscclFunc_t func;
+  size_t count;
+  ncclDataType_t dataType;
+  ncclRedOp_t op;
+  int root;
+  bool inPlace;
+  bool scheduled;
+  mscclAlgoHandle_t handle;
+  mscclSelectReason reason;
+  const char* algoName;
+};
+
 enum mscclGroupStatus {
   mscclNoGroup,
   mscclGroupSupportedOp,
@@ -169,14 +448,50 @@ enum mscclCaptureStatus {
   mscclExistingCapture
 };
 
+// Sizes the proxy operations of a collective are computed from
+struct mscclProxyParams {
+  size_t nBytes;
+  // by protocol, for the protocols of the algorithm
+  int stepSize[NCCL_NUM_PROTOCOLS];
+  int chunkSteps[NCCL_NUM_PROTOCOLS];
+  int sliceSteps[NCCL_NUM_PROTOCOLS];
+  int chunkSize[NCCL_NUM_PROTOCOLS];
+  // bytes of a chunk per loop, the smallest of the protocols of the algorithm
+  int chunkEffectiveSize;
+  uint32_t maxAllowedCount;
+  ncclDataType_t dataType;
+  // loops of the algorithm are split between this many replicas of its thread blocks
+  int nReplicas;
+};
+
+// Proxy operation of a connection for one (count, dataType), built with the launch descriptor.
+// The connector is resolved once so that posting a call only fills the op and appends it.
+struct mscclProxyPeerOp {
+  struct ncclProxyConnector* proxyConn;
+  int channelId;
+  int protocol;
+  int peer;
+  int nsteps;
+  // on the CollNet connections of the channel, peer is unused
+  bool collNet;
+};
+
+// Proxy operations of a collective posted from a host task of the host stream of comm
 struct mscclProxyArg {
-  struct mscclAlgo* hostAlgo;
   ncclComm_t comm;
-  mscclProxyArg(struct mscclAlgo* hostAlgo, ncclComm_t comm) 
-    : hostAlgo(hostAlgo), comm(comm) {}
+  struct mscclProxyParams params;
+  std::vector<struct mscclProxyPeerOp> peerOps;
+  // captured in a graph and posted on every replay, otherwise freed once posted
+  bool persistent;
+  // events are started again on every replay
+  struct ncclProfilerMscclTask profilerTask;
 };
 
-typedef std::map<unsigned long long, std::vector<struct mscclProxyArg>> mscclSavedProxyArgs;
+// MSCCL state of a communicator captured in a graph, defined in msccl_setup.cc
+struct mscclCapturedGraph;
+
+// Captured state by (capture id, communicator), released when the graph is destroyed
+typedef std::map<std::pair<unsigned long long, ncclComm_t>, struct mscclCapturedGraph*> mscclSavedProxyArgs;
 
 struct mscclThreadLocalStatus {
   bool mscclIsCallerFlag;
@@ -188,51 +503,467 @@ struct mscclThreadLocalStatus {
   cudaGraph_t graph;
 };
 
+// Upload of a device algorithm not yet seen complete, its pinned staging is freed once it is
+struct mscclUpload {
+  cudaEvent_t done;
+  char* staging;
+};
+
 struct mscclStatus {
   std::vector<mscclAlgoHandle_t> freeAlgoHandles;
   std::map<mscclAlgoHandle_t, mscclAlgo *> hostAlgos;
-  std::map<mscclAlgoHandle_t, mscclAlgo *> devAlgos;
+  // file or image each algorithm was loaded from
+  std::map<mscclAlgoHandle_t, std::string> algoNames;
+  // device copies of each algorithm, by cudaDev, as a process may drive several GPUs
+  std::map<mscclAlgoHandle_t, std::map<int, mscclDevAlgo *>> devAlgos;
+  // side stream uploading the device algorithms of each device, by cudaDev
+  std::map<int, cudaStream_t> uploadStreams;
+  // uploads launches still have to wait for, by device copy
+  std::map<mscclDevAlgo *, mscclUpload> pendingUploads;
+  // guards hostAlgos, devAlgos and the uploads, which mscclRunAlgo reads without mscclLifecycleMutex
+  std::mutex algoMutex;
+  std::map<ncclComm_t, std::set<mscclAlgoHandle_t>> connectedAlgos;
+  // algorithms a thread is connecting on each comm, outside of mscclLifecycleMutex
+  std::map<ncclComm_t, std::set<mscclAlgoHandle_t>> connectingAlgos;
+  // signaled with mscclLifecycleMutex when a connection leaves connectingAlgos
+  std::condition_variable connectCond;
+  void* mscclSchedulerLib;
+  mscclSchedulerInterface_v2* mscclSchedulerPtr;
+  // path mscclSchedulerLib was opened from, a process holds a single external scheduler
+  std::string mscclSchedulerPath;
+  // contexts the external scheduler returned for communicators mscclInit has not set up yet
+  std::map<ncclComm_t, void*> schedulerContexts;
+  std::vector<mscclAlgoMeta> algoMetas;
+  // algorithm directories whose metas are in algoMetas, see mscclAlgoMeta::algoDir
+  std::set<std::string> loadedAlgoDirs;
+  // keyed by rank and, for algorithms of remapped ranks, by rank layout, see mscclAlgoRankKey
+  std::vector<std::map<uint64_t, mscclAlgoHandle_t>> rankToAlgoHandles;
+  // logicalToRank of every remapped layout of the communicators, layout i + 1 is rankLayouts[i]
+  std::vector<std::vector<int>> rankLayouts;
+  // compiled algorithm images received from the node cache, by (algoMetas index, rank)
+  std::map<std::pair<size_t, int>, std::vector<char>> nodeCachedAlgos;
+  // number of communicators holding a mscclCommStatus
+  int nComms;
+  // devices whose MSCCL kernel attributes are set up
+  std::set<int> initializedDevices;
+};
+
+// Autotuning key: func, log2 of the message size, data type and whether the call is in-place
+typedef std::tuple<mscclFunc_t, int, ncclDataType_t, bool> mscclAutotuneKey;
+
+// Exploration state of one autotuning key. Candidates are algoMetas indices, -1 stands for NCCL.
+struct mscclAutotuneEntry {
+  std::vector<int> candidates;
+  std::vector<float> totalTime;
+  int nCalls;
+  bool decided;
+  int winner;
+};
+
+struct mscclAutotuneStatus {
+  std::map<mscclAutotuneKey, struct mscclAutotuneEntry> table;
+  bool fileLoaded;
+  // set by the scheduler when the current call is timed
+  bool pending;
+  mscclAutotuneKey pendingKey;
+  cudaEvent_t events[2];
+  bool eventsCreated;
+};
+
+// Share of the elements run by MSCCL in the split calls of an algorithm and log2 of the message size
+struct mscclSplitEntry {
+  float ratio;
+  // Times summed over the calls timed since the last agreement, in us. The first call of an entry
+  // sets up connections and is not counted.
+  int nSamples;
+  double msccl;
+  double nccl;
+  int nRounds;
+  // Set once an agreement moves the ratio by less than the tolerance, calls are no longer timed
+  bool settled;
+};
+
+struct mscclSplitStatus {
+  std::map<uint64_t, struct mscclSplitEntry> table;
+  // MSCCL runs its part on this stream, forked from and joined to the stream of the call
+  cudaStream_t stream;
+  // Recorded at the fork, when the MSCCL part ends and when the NCCL part ends
+  cudaEvent_t events[3];
+  // Entry of the timed call whose events are not read yet
+  bool pending;
+  uint64_t pendingKey;
+};
+
+// Host mapped timestamps of a timed launch, in ns of the globaltimer. seq is written last.
+struct mscclTelemetryRecord {
+  uint64_t start;
+  uint64_t end;
+  uint64_t seq;
+};
+
+// Launches in flight whose timestamps are not folded into the histograms yet
+#define MSCCL_TELEMETRY_RING 64
+#define MSCCL_TELEMETRY_MAX_KEYS 256
+
+// Histograms of a (handle, func, protocol, log2 of the message size) key, read by queries while
+// the launching thread adds to them
+struct mscclTelemetryEntry {
+  // 0 while the entry is free, published once the entry is taken
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sumNs;
+  std::atomic<uint64_t> minNs;
+  std::atomic<uint64_t> maxNs;
+  std::atomic<uint64_t> latency[MSCCL_HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> bandwidth[MSCCL_HISTOGRAM_BUCKETS];
+};
+
+// Launch of records[seq % MSCCL_TELEMETRY_RING], seq is 0 once it is folded
+struct mscclTelemetrySlot {
+  std::atomic<uint64_t> seq;
+  uint64_t key;
+  size_t nBytes;
+};
+
+struct mscclTelemetryStatus {
+  struct mscclTelemetryRecord* records;
+  struct mscclTelemetrySlot slots[MSCCL_TELEMETRY_RING];
+  uint64_t nextSeq;
+  // taken by the thread folding completed launches, the others skip folding
+  std::atomic_flag folding;
+  // next launch to fold, only used by the thread holding folding
+  uint64_t foldSeq;
+  struct mscclTelemetryEntry entries[MSCCL_TELEMETRY_MAX_KEYS];
+  // launches not timed as the ring or the table was full
+  std::atomic<uint64_t> dropped;
+  // set by mscclTelemetryBegin for the kernel of the body of the current call
+  bool pending;
+  uint64_t pendingKey;
+  size_t pendingBytes;
+};
+
+// Zero-copy steps of an algorithm on a communicator, they depend on the transports of its peers
+struct mscclDirectAlgo {
+  uint32_t* devMask;
+  std::vector<int> ipcPeers;
+  uint8_t ipcBuffers;
+};
+
+struct mscclDirectStatus {
+  std::map<struct mscclAlgo*, struct mscclDirectAlgo> algos;
+};
+
+// Resident kernel of a communicator in the persistent mode
+struct mscclPersistentStatus {
+  struct mscclPersistentQueue* queue;
+  struct mscclPersistentCtrl* ctrl;
+  // the kernel runs on its own stream, user streams only post works to it
+  cudaStream_t stream;
+  // kernel entry and launch geometry of the resident kernel, fixed until it exits
+  void* func;
+  dim3 grid;
+  dim3 block;
+  bool running;
+  // sequence number of the last work queued
+  uint32_t seq;
+  cudaStream_t lastStream;
+};
+
+// Flags of a launch count up from base, past the flags of all the launches before it on the
+// communicator, so they never need a reset. The last thread block of a launch moves base on.
+struct mscclSyncEpoch {
+  uint64_t base;
+  uint32_t arrivals;
+};
+
+// Host mapped record of the first dependency wait of a communicator given up after
+// NCCL_MSCCL_WAIT_TIMEOUT_MS, reported as an asynchronous error of the communicator
+struct mscclWatchdog {
+  // taken by the first waiter that times out
+  uint32_t claimed;
+  // set once the fields below are written
+  uint32_t timedOut;
+  int bid;
+  // step of the waiting thread block and the one it waits for, as numbered in the algorithm
+  int step;
+  int dependentBid;
+  int dependentStep;
+  uint64_t goalFlag;
+  uint64_t flag;
+};
+
+// MSCCL state owned by a single communicator, so that collectives on different
+// communicators (and streams) do not share scratch, flags or work indices.
+struct mscclCommStatus {
   struct mscclFlag* syncFlags;
   void *scratchBuffer;
   uint64_t scratchBufferSize;
-  size_t nBytes;
-  int stepSize;
-  int chunkSteps;
-  int sliceSteps;
-  int chunkSize;
-  int chunkEffectiveSize;
-  uint32_t workIndex;
-  uint32_t maxAllowedCount;
-  ncclDataType_t dataType;
-  std::map<ncclComm_t, std::set<mscclAlgoHandle_t>> connectedAlgos;
+  // scratchBuffer comes from comm->memPool and is released in stream order
+  bool scratchBufferFromPool;
+  // scratchBuffer can be exported to the peer processes of zero-copy steps into scratch, and is
+  // registered with comm through scratchRegHandle
+  bool scratchBufferIpc;
+  void* scratchRegHandle;
+  struct mscclSyncEpoch* syncEpoch;
+  struct mscclWatchdog* watchdog;
+  // clock64 cycles after which a dependency wait is given up, 0 to wait forever
+  uint64_t waitTimeout;
+  bool watchdogReported;
   cudaStream_t lastStream;
-  void* mscclSchedulerLib;
-  mscclSchedulerInterface* mscclSchedulerPtr;
-  std::vector<mscclAlgoMeta> algoMetas;
-  std::vector<std::map<int, mscclAlgoHandle_t>> rankToAlgoHandles;
+  struct mscclSelectMemo selectMemo;
+  // algorithms of the internal scheduler, replaced by mscclReloadAlgos
+  struct mscclAlgoCatalog* catalog;
+  // returned by the external scheduler for this communicator
+  void* schedulerContext;
+  // allocated on first use when autotuning is enabled
+  struct mscclAutotuneStatus* autotune;
+  // allocated on the first split call
+  struct mscclSplitStatus* split;
+  // allocated on first use when telemetry is enabled
+  struct mscclTelemetryStatus* telemetry;
+  // allocated at init unless NCCL_MSCCL_FALLBACK_STATS is 0
+  struct mscclFallbackStatus* fallback;
+  // allocated on first use when the persistent mode is enabled
+  struct mscclPersistentStatus* persistent;
+  // allocated on first use
+  struct mscclLaunchCache* launchCache;
+  // allocated on first use when NCCL_MSCCL_LAUNCH_GRAPHS is set
+  struct mscclReplayStatus* replay;
+  // allocated when an algorithm has zero-copy steps
+  struct mscclDirectStatus* direct;
+  // gathered from all ranks at init
+  struct mscclCommTopo* topo;
+  // hash of the rings the synthesized algorithms of this comm follow, 0 when there are none
+  uint64_t synthKey;
   bool graphEnabled;
   bool graphFirstKernel;
   bool needsFence;
   bool needsProxy;
 };
 
+// Upper bound of the operations of a group run by a single MSCCL kernel launch
+#define MSCCL_MAX_FUSED_WORKS 64
+
+struct mscclPersistentQueue;
+struct mscclPersistentCtrl;
+
 struct alignas(16) mscclWork {
+  struct mscclDevAlgo* algo;
+  // only set in the launch of a resident kernel, which then runs the works of this queue
+  struct mscclPersistentQueue* persistentQueue;
+  struct mscclPersistentCtrl* persistentCtrl;
+  // works fused after this one in the same launch, only read from the first work
+  const struct mscclWork* fusedWorks;
+  int nFusedWorks;
   volatile struct mscclFlag *syncFlags;
+  struct mscclSyncEpoch* syncEpoch;
+  struct mscclWatchdog* watchdog;
+  uint64_t waitTimeout;
   void *scratchBuffer;
   const void *sendBuff;
   void *recvBuff;
   size_t count;
   uint64_t redOpArg;
-  uint32_t workIndex;
   int nChunksPerLoop;
   uint32_t maxAllowedCount;
+  // elements of a loop of SIMPLE kernels, smaller than the buffers allow for calls of a few chunks
+  int simpleChunkSize;
+  // chunk j of the input and output starts at (j / chunksPerBlock) * blockStride + (j % chunksPerBlock)
+  // * (count / nChunksPerLoop). Calls whose count does not divide into chunks leave a tail in each block.
+  int chunksPerBlock;
+  size_t blockStride;
+  // thread block b runs the program of b % nBlocks on the channels of replica b / nBlocks, that is
+  // shifted by replica * nChannels, for its share of the iterations of the nReplicas replicas
+  int nBlocks;
+  int nChannels;
+  int nReplicas;
   bool hasReduce;
   bool redOpArgIsPtr;
   bool needsFence;
+  // dependencies on thread blocks of the same cluster are waited on in their shared memory, sm90
+  bool clusterFlags;
+  // protocols of the thread blocks, iterations of mixed kernels move the chunk of the smallest one
+  uint8_t protocolMask;
+  // zero-copy steps of thread block b in directMask[b * MSCCL_DIRECT_MASK_WORDS], nullptr if none
+  const uint32_t* directMask;
+  // where sendBuff, recvBuff and scratchBuffer start in the address space of each local rank, by
+  // local rank, plus the offset. nullptr unless the buffer is registered with the peers of
+  // zero-copy steps.
+  uintptr_t* sendBuffRmtAddrs;
+  uintptr_t sendBuffOffset;
+  uintptr_t* recvBuffRmtAddrs;
+  uintptr_t recvBuffOffset;
+  uintptr_t* scratchRmtAddrs;
+  uintptr_t scratchOffset;
+  // globaltimer at the start and end of the launch are written there, then telemetrySeq, nullptr
+  // when the launch is not timed
+  struct mscclTelemetryRecord* telemetry;
+  uint64_t telemetrySeq;
+};
+
+// Works of the persistent mode go through a ring of this depth
+#define MSCCL_PERSISTENT_QUEUE_DEPTH 64
+
+// Host mapped side of the queue of a resident kernel. Work seq is in works[seq % depth].
+struct mscclPersistentQueue {
+  struct mscclWork works[MSCCL_PERSISTENT_QUEUE_DEPTH];
+  // sequence number of the last work done, written by the kernel for the host
+  uint32_t done;
+  // set by the host to make the kernel exit once no work is posted
+  uint32_t stop;
+};
+
+// Device side of the queue of a resident kernel
+struct mscclPersistentCtrl {
+  // sequence number of the last work whose stream reached it, written by the stream
+  uint32_t posted;
+  // sequence number of the last work done, waited on by the streams
+  uint32_t done;
+  // thread blocks done with the work in each slot
+  uint32_t arrivals[MSCCL_PERSISTENT_QUEUE_DEPTH];
+};
+
+// Launch parameters of an algorithm for one (count, dataType), computed once by mscclSetupCount
+// and never modified, so that the launch path only reads them
+struct mscclLaunchDesc {
+  struct mscclAlgo* hostAlgo;
+  mscclAlgoHandle_t handle;
+  // for the profiler plugin
+  std::string algoName;
+  struct mscclProxyParams proxy;
+  size_t scratchSize;
+  // proxy operations of a call, empty for algorithms only using P2P and NVLS
+  std::vector<struct mscclProxyPeerOp> peerOps;
+  dim3 grid;
+  dim3 block;
+  // kernel entries by ncclDevRedOp_t, the reduction op of a call is only known at launch
+  void* funcs[ncclNumDevRedOps];
+  // peers in other processes zero-copy steps receive from, they need the buffers of the call
+  // in directIpcBuffers (bits of MSCCL_*_BUFFER) registered
+  std::vector<int> directIpcPeers;
+  uint8_t directIpcBuffers;
+  // fields of the work that only depend on the key, the others are filled at launch
+  struct mscclWork work;
+};
+
+typedef enum {
+  mscclAliasNone,
+  // in-place call of an out-of-place algorithm, the input is read from a copy in scratch
+  mscclAliasStageInput,
+  // out-of-place call of an in-place algorithm, the input is copied to where the output aliases it
+  mscclAliasInPlace
+} mscclAliasMode;
+
+// Buffers a call runs its algorithm on, when the algorithm was only made for the other one of
+// in-place and out-of-place calls. Staging space follows the scratch of the algorithm.
+struct mscclAlias {
+  mscclAliasMode mode;
+  const void* sendBuff;
+  void* recvBuff;
+  // scratch of the call, the stagingBytes at stagingOffset included
+  size_t scratchSize;
+  size_t stagingOffset;
+  size_t stagingBytes;
+  // copied once the kernel is done, results of reduce-scatter staged in scratch
+  const void* copyOutSrc;
+  void* copyOutDst;
+  size_t copyOutBytes;
+};
+
+// Elements of a call past the last whole chunk of each block of its buffers, run by a second
+// launch of the algorithm over copies padded to one element per chunk, planned by mscclSetupTail
+struct mscclTail {
+  // launch of the padded copies, nullptr when the count divides into chunks
+  const struct mscclLaunchDesc* desc;
+  // elements of a block, of them in whole chunks, and past them
+  size_t blockCount;
+  size_t bodyCount;
+  size_t remCount;
+  size_t chunksPerBlock;
+  int nSendBlocks;
+  int nRecvBlocks;
+  // scratch the tail launch needs, its padded copies start at sendOffset and recvOffset
+  size_t scratchSize;
+  size_t sendOffset;
+  size_t recvOffset;
+};
+
+// Descriptors of a fused launch are all used at once and must stay cached
+#define MSCCL_LAUNCH_CACHE_SIZE (2 * MSCCL_MAX_FUSED_WORKS)
+
+typedef std::tuple<mscclAlgoHandle_t, size_t, ncclDataType_t> mscclLaunchKey;
+
+struct mscclLaunchKeyHash {
+  size_t operator()(const mscclLaunchKey& key) const {
+    size_t h = std::hash<size_t>()(std::get<1>(key));
+    h ^= std::hash<int>()(std::get<0>(key)) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    h ^= std::hash<int>()(std::get<2>(key)) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+  }
+};
+
+// Least recently used cache of the launch descriptors of a communicator, most recent first
+struct mscclLaunchCache {
+  std::list<std::pair<mscclLaunchKey, struct mscclLaunchDesc>> lru;
+  std::unordered_map<mscclLaunchKey, std::list<std::pair<mscclLaunchKey, struct mscclLaunchDesc>>::iterator,
+    mscclLaunchKeyHash> index;
+};
+
+// Kernel launches replayed from CUDA graphs outside of captures, one graph per launch shape of an
+// algorithm: its handle and the grid and block sizes, which set the attributes of the kernel node
+#define MSCCL_REPLAY_MAX_GRAPHS MSCCL_LAUNCH_CACHE_SIZE
+
+typedef std::tuple<mscclAlgoHandle_t, unsigned int, unsigned int> mscclReplayKey;
+
+struct mscclReplayGraph {
+  cudaGraph_t graph;
+  // the kernel node of graph, the only one
+  cudaGraphNode_t node;
+  cudaGraphExec_t exec;
+};
+
+struct mscclReplayStatus {
+  // launches are captured on a stream of their own
+  cudaStream_t captureStream;
+  std::map<mscclReplayKey, struct mscclReplayGraph> graphs;
+};
+
+// Steps of a thread block program kept in shared memory. Longer programs are streamed from the
+// device algorithm a window of this many steps at a time.
+#ifndef MSCCL_SHMEM_NUM_STEPS
+#define MSCCL_SHMEM_NUM_STEPS 64
+#endif
+static_assert(MSCCL_SHMEM_NUM_STEPS % 8 == 0, "MSCCL_SHMEM_NUM_STEPS must be a multiple of 8");
+
+// Thread block program as read by the kernel. The pointers are to the arrays below when they fit,
+// or to the device algorithm otherwise, so that shared memory does not grow with MSCCL_MAX_NUM_STEPS.
+struct alignas(16) mscclShmemThreadBlock {
+  // step i is in transmissions[i % MSCCL_SHMEM_NUM_STEPS]
+  alignas(16) struct mscclTransmission transmissions[MSCCL_SHMEM_NUM_STEPS];
+  int16_t dependentBid[MSCCL_SHMEM_NUM_STEPS];
+  int16_t dependentStep[MSCCL_SHMEM_NUM_STEPS];
+  int16_t reductionSrcOffsets[MSCCL_SHMEM_NUM_STEPS];
+  // all the transmissions of a program streamed through the window, nullptr if they all fit
+  const struct mscclTransmission* streamedTransmissions;
+  const int16_t* dependentBidPtr;
+  const int16_t* dependentStepPtr;
+  const int16_t* reductionSrcOffsetsPtr;
+  int16_t sendPeers[MSCCL_MAX_FAN_PEERS];
+  int16_t recvPeers[MSCCL_MAX_FAN_PEERS];
+  int8_t nSendPeers;
+  int8_t nRecvPeers;
+  uint16_t nSteps;
+  int16_t channelId;
+  int8_t nvls;
+  int8_t protocol;
+  int8_t collnet;
+  int8_t pipelined;
+  // bit i is set when step i is a zero-copy s or r
+  uint32_t directMask[MSCCL_DIRECT_MASK_WORDS];
 };
 
 struct mscclShmemData {
-  alignas(16) struct mscclThreadBlock mscclTB;
+  alignas(16) struct mscclShmemThreadBlock mscclTB;
   alignas(16) struct mscclWork work;
 };
 static_assert(offsetof(struct mscclShmemData, work) % 16 == 0, "mscclShmemData.work needs to be 16B aligned");
@@ -0,0 +1,29 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_SYNTH_H_
+#define MSCCL_SYNTH_H_
+
+#include <string>
+#include <vector>
+
+#include "comm.h"
+
+bool mscclSynthEnabled();
+
+// Synthesized algorithms have no file, their path names the text kept for them by the process
+bool mscclIsSynthPath(const char* path);
+
+// Text of the synthesized algorithm path, valid until the process exits
+ncclResult_t mscclSynthGetText(const char* path, const char** data, size_t* size);
+
+// Whether synthesized algorithm path was built from the rings of comm
+bool mscclSynthUsable(const std::string& path, ncclComm_t comm);
+
+// Build allreduce, reducescatter and allgather algorithms following the rings NCCL found for
+// comm and return their paths. All ranks of comm get the same algorithms.
+ncclResult_t mscclSynthesizeAlgos(ncclComm_t comm, std::vector<std::string>* paths);
+
+#endif
@@ -0,0 +1,30 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_TELEMETRY_H_
+#define MSCCL_TELEMETRY_H_
+
+#include "comm.h"
+#include "msccl/msccl_struct.h"
+
+bool mscclTelemetryEnabled();
+
+// Mark the kernel of the body of the current call to be timed under its key, and fold the
+// launches that completed since the last call
+ncclResult_t mscclTelemetryBegin(mscclAlgoHandle_t handle, const struct mscclAlgo* hostAlgo, size_t nBytes,
+  ncclComm_t comm);
+
+// Give work the record of the call marked by mscclTelemetryBegin, no-ops for other launches
+ncclResult_t mscclTelemetryAttach(ncclComm_t comm, struct mscclWork* work);
+
+// Drop the mark of mscclTelemetryBegin when no launch took it, so that no later launch takes it
+ncclResult_t mscclTelemetryEnd(ncclComm_t comm);
+
+ncclResult_t mscclTelemetryQuery(ncclComm_t comm, mscclLatencyHistogram_t* histograms, int* nHistograms,
+  unsigned long long* dropped);
+
+ncclResult_t mscclTelemetryTeardown(ncclComm_t comm);
+
+#endif
@@ -0,0 +1,30 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_TOPO_H_
+#define MSCCL_TOPO_H_
+
+#include "nccl.h"
+#include "msccl/msccl_struct.h"
+
+// Gather the topology algorithms can require from all the ranks of comm. Collective, and must run
+// without mscclLifecycleMutex held, which ranks sharing a process also need.
+ncclResult_t mscclTopoInit(ncclComm_t comm);
+
+ncclResult_t mscclTopoTeardown(ncclComm_t comm);
+
+// Whether the algorithm of m requires a topology, which mscclTopoInit has to gather first
+bool mscclTopoConstrained(const struct mscclAlgoMeta& m);
+
+// Whether comm has the topology of the algorithm of m
+bool mscclTopoUsable(const struct mscclAlgoMeta& m, ncclComm_t comm);
+
+// Whether the algorithm of m runs on comm with logical ranks other than the ranks of comm
+bool mscclTopoRemapped(const struct mscclAlgoMeta& m, ncclComm_t comm);
+
+// Turn the peers of algo from logical ranks into ranks, see mscclCommTopo
+void mscclTopoRemapAlgo(struct mscclAlgo* algo, const int* logicalToRank);
+
+#endif
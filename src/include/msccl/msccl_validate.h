@@ -0,0 +1,21 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef MSCCL_VALIDATE_H_
+#define MSCCL_VALIDATE_H_
+
+#include "nccl.h"
+#include "msccl/msccl_struct.h"
+
+// Check the program of rank in algo for what would make the kernel spin forever: dependencies on
+// thread blocks or steps that never set their flag and cycles between the thread blocks. Accesses
+// of different thread blocks to the same chunks that no dependency orders are reported as races.
+ncclResult_t mscclValidateAlgo(const struct mscclAlgo* algo, int rank);
+
+// Check that every rank of comm receives from each peer on each channel what the peer sends to it.
+// Collective over all the ranks of comm.
+ncclResult_t mscclValidateAlgoPeers(const struct mscclAlgo* algo, ncclComm_t comm);
+
+#endif
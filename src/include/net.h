@@ -24,6 +24,16 @@ int ncclNetVersion(struct ncclComm* comm);
 ncclResult_t ncclGpuGdrSupport(struct ncclComm* comm, int* gdrSupport);
 
 extern ncclNet_t ncclNetIb;
+// Post the IB sends and GPU flushes deferred by the calling thread, see NCCL_IB_POST_BATCH
+ncclResult_t ncclIbPostFlush();
+// Post n sends, possibly on different comms, with one doorbell per QP. Same semantics as n calls
+// to ncclNetIb.isend, each request may come back NULL.
+ncclResult_t ncclIbIsendv(int n, void** sendComms, void** data, int* sizes, int* tags, void** mhandles, void** requests);
+// Traffic class and service level of the IB connections the calling thread establishes next,
+// -1 for NCCL_IB_TC and NCCL_IB_SL. Other networks ignore them.
+void ncclIbSetConnectQos(int trafficClass, int serviceLevel);
+// Levels of the netPriority config, sends of a comm yield the NICs of the process to higher ones
+#define NCCL_NET_PRIORITIES 4
 extern ncclNet_t ncclNetSocket;
 
 #endif
@@ -1,21 +1,27 @@
 #ifndef NPKIT_H_
 #define NPKIT_H_
 
+#include <fstream>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <cuda_runtime.h>
 
 #include "npkit/npkit_event.h"
 #include "npkit/npkit_struct.h"
 
+struct ncclSocket;
+
 class NpKit {
  public:
   static const uint64_t kNumGpuEventBuffers = 512;
 
   static const uint64_t kNumCpuEventBuffers = 32;
 
-  static ncclResult_t Init(int rank);
+  // Collective over the ranks of bootstrap, which rank 0 uses to share its clock sync address
+  static ncclResult_t Init(int rank, int nranks, void* bootstrap);
 
   static ncclResult_t Dump(const std::string& dump_dir);
 
@@ -23,31 +29,93 @@ class NpKit {
 
   static NpKitEventCollectContext* GetGpuEventCollectContexts();
 
+  static const NpKitEventMask& GetEventMask();
+
+  static inline __host__ __device__ bool EventEnabled(const NpKitEventMask& mask, uint8_t type) {
+    return (mask.bits[type >> 6] >> (type & 63)) & 1;
+  }
+
+  // Timestamp of GPU events. With ENABLE_NPKIT_GLOBALTIMER, ns of the globaltimer, which all SMs share
+  // and clock boosts do not change, at the price of a slower read. Otherwise cycles of the SM clock.
+  static inline __device__ uint64_t GpuTimestamp() {
+#if defined(ENABLE_NPKIT_GLOBALTIMER)
+    uint64_t timestamp;
+    asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(timestamp));
+    return timestamp;
+#else
+    return clock64();
+#endif
+  }
+
   static inline __device__ void CollectGpuEvent(uint8_t type, uint32_t size, uint32_t rsvd, uint64_t timestamp,
                                                 NpKitEventCollectContext* ctx) {
     uint64_t event_buffer_head = ctx->event_buffer_head;
-    if (event_buffer_head < kMaxNumGpuEventsPerBuffer) {
-      NpKitEvent& event = ctx->event_buffer[event_buffer_head];
+    if (ctx->drain_head != nullptr) {
+      // Ring in host memory, the event is published once it is written
+      NpKitEvent& event = ctx->event_buffer[event_buffer_head & (ctx->event_buffer_size - 1)];
       event.fields.type = type;
       event.fields.size = size;
       event.fields.rsvd = rsvd;
       event.fields.timestamp = timestamp;
-      ctx->event_buffer_head++;
+      ctx->event_buffer_head = event_buffer_head + 1;
+      __threadfence_system();
+      *(volatile uint64_t*)ctx->drain_head = event_buffer_head + 1;
+    } else {
+      if (event_buffer_head < ctx->event_buffer_size) {
+        NpKitEvent& event = ctx->event_buffer[event_buffer_head];
+        event.fields.type = type;
+        event.fields.size = size;
+        event.fields.rsvd = rsvd;
+        event.fields.timestamp = timestamp;
+      }
+      // Counts past the end so that Dump reports the dropped events
+      ctx->event_buffer_head = event_buffer_head + 1;
     }
   }
 
   static void CollectCpuEvent(uint8_t type, uint32_t size, uint32_t rsvd, uint64_t timestamp, int channel_id);
 
+  // Channel of the events of network plugins, which do not know channels, set by the proxy
+  // thread before it calls into them
+  static void SetCpuChannel(int channel_id);
+
+  static int GetCpuChannel();
+
   static uint64_t* GetCpuTimestamp();
 
+  // Device and pinned host bytes of the event buffers, 0 before Init
+  static void GetMemoryUsage(size_t* dev_bytes, size_t* host_bytes);
+
  private:
   static void CpuTimestampUpdateThread();
 
-  // 64K * 512 * 16B = 512MB per GPU
-  static const uint64_t kMaxNumGpuEventsPerBuffer = 1ULL << 16;
+  static void GpuEventDrainThread();
+
+  static ncclResult_t DrainGpuEvents();
 
+  static ncclResult_t InitClockSync(int nranks, void* bootstrap);
+
+  static ncclResult_t SampleClockOffset();
+
+  static void ClockSyncServerThread();
+
+  static void ClockSyncClientThread();
+
+  static void StopClockSync();
+
+  // Defaults of NCCL_NPKIT_GPU_EVENTS_PER_BUFFER, 64K * 512 * 16B = 512MB per GPU of device memory,
+  // or in ring mode 4K * 512 * 16B = 32MB per GPU of host memory
+  static const uint64_t kDefaultNumGpuEventsPerBuffer = 1ULL << 16;
+  static const uint64_t kDefaultNumGpuEventsPerRing = 1ULL << 12;
+
+  // Default of NCCL_NPKIT_CPU_EVENTS_PER_BUFFER,
   // 64K * 2 (send/recv) * (512/32) = 2M, 2M * 32 * 16B = 1GB per CPU
-  static const uint64_t kMaxNumCpuEventsPerBuffer = 1ULL << 21;
+  static const uint64_t kDefaultNumCpuEventsPerBuffer = 1ULL << 21;
+
+  static NpKitEventMask event_mask_;
+
+  static uint64_t num_gpu_events_per_buffer_;
+  static uint64_t num_cpu_events_per_buffer_;
 
   static NpKitEvent** gpu_event_buffers_;
   static NpKitEvent** cpu_event_buffers_;
@@ -60,6 +128,28 @@ class NpKit {
 
   static std::thread* cpu_timestamp_update_thread_;
   static volatile bool cpu_timestamp_update_thread_should_stop_;
+
+  // Ring mode: GPU events are written to host memory and streamed to dump_dir while the job runs
+  static bool gpu_ring_mode_;
+  static std::string gpu_drain_dir_;
+  static uint64_t* gpu_drain_heads_;
+  static std::vector<uint64_t> gpu_drain_tails_;
+  static std::vector<std::ofstream> gpu_drain_files_;
+  static std::vector<NpKitEvent> gpu_drain_copy_;
+  static uint64_t gpu_drain_lost_;
+  static std::thread* gpu_drain_thread_;
+  static volatile bool gpu_drain_thread_should_stop_;
+
+  // Clock sync: rank 0 answers the pings of the other ranks with its CPU timestamp
+  static int nranks_;
+  static struct ncclSocket* clock_sync_socks_;
+  static std::vector<NpKitClockSample> clock_samples_;
+  static std::mutex clock_samples_mutex_;
+  static std::thread* clock_sync_thread_;
+  static volatile bool clock_sync_thread_should_stop_;
 };
 
+// In device code, whether the kernel collects events of type, with the mask loaded into ncclShmem
+#define NPKIT_GPU_EVENT_ENABLED(type) NpKit::EventEnabled(ncclShmem.comm.npKitEventMask, (type))
+
 #endif
@@ -100,4 +100,17 @@
 #define NPKIT_EVENT_MSCCL_REDUCE_ENTRY                          0x52
 #define NPKIT_EVENT_MSCCL_REDUCE_EXIT                           0x53
 
+// rsvd of the IB events is NPKIT_NET_IB_QP_ID of the NIC, device of the merged NIC and QP
+#define NPKIT_EVENT_NET_IB_POST_SEND_ENTRY                      0x54
+#define NPKIT_EVENT_NET_IB_POST_SEND_EXIT                       0x55
+#define NPKIT_EVENT_NET_IB_POLL_CQ_ENTRY                        0x56
+#define NPKIT_EVENT_NET_IB_POLL_CQ_EXIT                         0x57
+#define NPKIT_EVENT_NET_IB_COMPLETION                           0x58
+// size is the part of the sends given to the device, out of 1024
+#define NPKIT_EVENT_NET_IB_SPLIT                                0x59
+
+// The QP is NPKIT_NET_IB_NO_QP for events of a CQ
+#define NPKIT_NET_IB_NO_QP 0xff
+#define NPKIT_NET_IB_QP_ID(nic, dev, qp) ((((nic) & 0xff) << 16) | (((dev) & 0xff) << 8) | ((qp) & 0xff))
+
 #endif
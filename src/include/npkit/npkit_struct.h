@@ -17,7 +17,25 @@ union NpKitEvent {
 
 struct NpKitEventCollectContext {
   NpKitEvent* event_buffer;
+  // events collected so far, including those dropped or overwritten
   uint64_t event_buffer_head;
+  uint64_t event_buffer_size;
+  // in ring mode, mapped host copy of event_buffer_head read by the drain thread, else nullptr
+  uint64_t* drain_head;
+};
+
+// Offset of the CPU clock of rank 0 to the local one around local_time, within rtt/2
+struct NpKitClockSample {
+  uint64_t local_time;
+  int64_t offset;
+  uint64_t rtt;
+};
+
+// Bit t enables the events of type t, NCCL_NPKIT_EVENTS at runtime
+#define NPKIT_EVENT_MASK_WORDS 4
+
+struct NpKitEventMask {
+  uint64_t bits[NPKIT_EVENT_MASK_WORDS];
 };
 
 #pragma pack(pop)
@@ -30,10 +30,19 @@
 #define NVTX_SID_CommInitRankConfig   11 // same schema as NVTX_SID_CommInitRank
 #define NVTX_SID_CommInitRankScalable 12 // same schema as NVTX_SID_CommInitRank
 #define NVTX_SID_CommSplit            13
+// 14 is NVTX_PAYLOAD_ENTRY_NCCL_REDOP
+#define NVTX_SID_MscclRunAlgo         15
+#define NVTX_SID_MscclLoadAlgo        16
+#define NVTX_SID_MscclSelectAlgo      17
+#define NVTX_SID_MscclSetupKernel     18
+#define NVTX_SID_ProxyProgress        19
 
 // Define static schema ID for the reduction operation.
 #define NVTX_PAYLOAD_ENTRY_NCCL_REDOP 14 + NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START
 
+// Define static schema ID for the reason of an MSCCL selection decision.
+#define NVTX_PAYLOAD_ENTRY_MSCCL_SELECT_REASON 20 + NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START
+
 extern const nvtxDomainHandle_t ncclNvtxDomainHandle;
 
 struct nccl_domain{static constexpr char const* name{"NCCL"};};
@@ -83,6 +92,20 @@ class payload_schema {
   ::nvtx3::v1::event_attributes const nvtx3_func_attr__{nvtx3_func_name__, nvtx3_bpl__}; \
   ::nvtx3::v1::scoped_range_in<nccl_domain> const nvtx3_range__{nvtx3_func_attr__};
 
+// Create NVTX mark with parameters, for decisions only known at the end of a range
+// @param name of the event (see `NVTX_SID_*`)
+// @param S  schema (entries)
+// @param P  payload (struct)
+#define NVTX3_MARK_WITH_PARAMS(ID, S, P) \
+  do { \
+    static const payload_schema schema{S, std::extent<decltype(S)>::value, \
+      NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, #ID}; \
+    static ::nvtx3::v1::registered_string_in<nccl_domain> const nvtx3_mark_name__{#ID}; \
+    nvtxPayloadData_t nvtx3_bpl__[] = { \
+      {NVTX_PAYLOAD_ENTRY_TYPE_SCHEMA_ID_STATIC_START + NVTX_SID_##ID, sizeof(P), &(P)}}; \
+    ::nvtx3::v1::mark_in<nccl_domain>(::nvtx3::v1::event_attributes{nvtx3_mark_name__, nvtx3_bpl__}); \
+  } while (0)
+
 extern void initNvtxRegisteredEnums();
 
 #endif
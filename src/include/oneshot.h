@@ -0,0 +1,31 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_ONESHOT_H_
+#define NCCL_ONESHOT_H_
+
+#include "comm.h"
+
+struct ncclOneShot {
+  char* scratch;
+  void* scratchHandle;
+  size_t slotBytes;
+  // 1 once the scratch of every local rank is mapped here, -1 if that failed on any rank
+  int ready;
+  // Scratch of every local rank, as mapped in this rank
+  char* peerScratch[NCCL_ONESHOT_MAX_RANKS];
+};
+
+// Run tiny collectives of single node comms as one kernel of one block, which writes the data
+// into the scratch of the peers and reduces or gathers what they wrote. Sets done to false when
+// the call has to go through the regular kernels, all ranks decide it the same way.
+ncclResult_t ncclOneShotAllReduce(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+  ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done);
+ncclResult_t ncclOneShotAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+  ncclDataType_t datatype, cudaStream_t stream, bool* done);
+
+ncclResult_t ncclOneShotDestroy(struct ncclComm* comm);
+
+#endif
@@ -49,6 +49,32 @@ ncclResult_t ncclProfilerRecordProxyOpEventState(int sub, struct ncclProxyArgs*
 ncclResult_t ncclProfilerRecordProxyStepEventStates(int sub, struct ncclProxyArgs* args, uint64_t stepLo, uint64_t stepHi, ncclProfilerEventState_t eState);
 ncclResult_t ncclProfilerRecordProxyCtrlEventState(void*eHandle, int appended, ncclProfilerEventState_t eState);
 
+// MSCCL collectives do not go through a kernel plan, they get group and coll events of their own
+struct ncclProfilerMscclTask {
+  struct ncclComm* comm;
+  uint8_t func;
+  const void* sendBuff;
+  void* recvBuff;
+  size_t count;
+  uint8_t datatype;
+  uint32_t op;
+  size_t trafficBytes;
+  uint8_t nChannels;
+  uint8_t nWarps;
+  uint8_t proto;
+  const char* algoName;
+  int algoHandle;
+  int nBlocks;
+  // set by ncclProfilerStartMscclEvents, the proxy operations of the call take them
+  void* groupEventHandle;
+  void* eventHandle;
+  int eActivationMask;
+};
+
+// MSCCL Start/Stop Events Wrappers
+ncclResult_t ncclProfilerStartMscclEvents(struct ncclProfilerMscclTask* task);
+ncclResult_t ncclProfilerStopMscclEvents(struct ncclProfilerMscclTask* task);
+
 // Profiler utility functions
 ncclResult_t ncclProfilerAddPidToProxyOp(struct ncclProxyOp* op);
 
@@ -67,6 +67,11 @@ struct ncclProxyOp {
   uint8_t /*ncclPattern_t*/ pattern;
   uint8_t protocol;
   uint8_t reg;
+  // The registered user buffer is pinned host memory
+  uint8_t regHost;
+  // Ring sends may come from the user buffer [sendbuff, sendbuff+netRegBytes)
+  uint8_t netRegSend;
+  size_t netRegBytes;
   // collnet buffer reg handles
   void* sendMhandle;
   void* recvMhandle;
@@ -94,8 +99,13 @@ struct ncclProxyOp {
 struct ncclProxySubArgs {
   struct ncclProxyConnection* connection;
   int reg;
+  int regHost;
   // p2p mhandle
   void* mhandle;
+  // ring sends from the user buffer
+  int netRegSend;
+  size_t netRegBytes;
+  void* netRegMhandle;
   // collnet handles
   void* sendMhandle;
   void* recvMhandle;
@@ -116,6 +126,10 @@ struct ncclProxySubArgs {
   uint64_t done;
   uint64_t end;
   void* requests[NCCL_STEPS];
+  // Bytes of each send counted against the NCCL_NET_SEND_WINDOW of its NIC, 0 if not paced
+  int pacedSizes[NCCL_STEPS];
+  // Since when the next send yields its NIC to comms of a higher net priority, 0 if it does not
+  uint64_t netYieldStart;
 
   // Profiler plugin
   int eActivationMask;
@@ -125,11 +139,10 @@ struct ncclProxySubArgs {
   void* stepEventHandles[NCCL_STEPS];
   size_t transSize;
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_SEND_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_SEND_EXIT)
+#if defined(ENABLE_NPKIT) || defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
   int npKitSizesFifo[NCCL_STEPS];
 #endif
 #if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
-  int npKitSizesFifo[NCCL_STEPS];
   uint64_t npKitStartTime[NCCL_STEPS];
   uint64_t npKitLastPollTime[NCCL_STEPS];
   uint64_t npKitLastPollInterval[NCCL_STEPS];
@@ -184,11 +197,24 @@ struct ncclProxyArgs {
 // p2p work contains a send and recv proxy op hence the 2x before it.
 #define MAX_OPS_PER_PEER (2*MAXCHANNELS*2*NCCL_MAX_DEV_WORK_P2P_PER_BATCH)
 
+// Chains of ops posted by one local rank, written by that rank (tail) and read in order
+// by the progress thread (head)
+#define NCCL_PROXY_POST_RING 256
+struct ncclProxyOpsPosted {
+  struct {
+    int nextOps;
+    int nextOpsEnd;
+  } chains[NCCL_PROXY_POST_RING];
+  alignas(64) volatile uint64_t tail;
+  alignas(64) volatile uint64_t head;
+};
+
 struct ncclProxyOpsPool {
   struct ncclProxyOp ops[MAX_OPS_PER_PEER*NCCL_MAX_LOCAL_RANKS];
-  volatile int nextOps;
-  volatile int nextOpsEnd;
+  struct ncclProxyOpsPosted posted[NCCL_MAX_LOCAL_RANKS];
   volatile int freeOps[NCCL_MAX_LOCAL_RANKS];
+  // Set by the progress thread before it waits on cond, posting only takes mutex then
+  volatile int sleeping;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
 };
@@ -202,6 +228,9 @@ struct ncclProxyOps {
   int nextOpsEnd;
 };
 
+// Net connections can be progressed by several threads, each owning the connections of some NICs
+#define NCCL_PROXY_MAX_PROGRESS_THREADS 8
+
 struct ncclProxySharedP2p {
   int refcount;
   int size;
@@ -209,7 +238,7 @@ struct ncclProxySharedP2p {
   char* hostBuff;
   // CUDA IPC
   ncclIpcDesc ipcDesc;
-  struct ncclProxyArgs* proxyAppend[MAXCHANNELS]; // Separate send and recv
+  struct ncclProxyArgs* proxyAppend[NCCL_PROXY_MAX_PROGRESS_THREADS][MAXCHANNELS]; // Separate send and recv, per progress thread
 };
 
 struct ncclProxyPeer {
@@ -235,10 +264,43 @@ struct ncclProxyProgressState {
   volatile int stop;
   struct ncclProxyPeer** localPeers;
   struct ncclSharedNetComms* netComms[NCCL_MAX_NETDEVS];
+  // Bytes of p2p sends in flight on each NIC, updated atomically as shards progress sends too
+  uint64_t netSendInflight[NCCL_MAX_NETDEVS];
   struct ncclProxyArgs* active;
   struct ncclProxyArgs* pool;
   struct ncclProxyPool* pools;
   int nextOps;
+  // Other threads progressing net connections, ops are handed to them by this thread.
+  // shards[0] stands for this thread and is not used.
+  int nShards;
+  struct ncclProxyProgressShard* shards;
+  // Idle policy of this thread: yields while spinning, timed waits of the backoff
+  // and its entries, blocking waits for posted ops
+  uint64_t nIdleYields, nIdleBackoffs, nIdleBackoffEntries, nIdleSleeps;
+  int lastIdle, idleIters, appendCounter;
+  // Progressed by the thread of its device instead of its own, see NCCL_PROXY_SHARED_PROGRESS
+  struct ncclProxyProgressHub* hub;
+  struct ncclProxyState* hubNext;
+  int hubDone;
+  // NUMA node this thread is bound to and the ncclProxyState::netConnsSeq it was chosen at
+  int boundNuma, netConnsSeen;
+};
+
+#define NCCL_PROXY_SHARD_RING 512
+
+// Ops go through ring from the progress thread (tail) to the shard thread (head)
+struct ncclProxyProgressShard {
+  struct ncclProxyState* proxyState;
+  struct ncclProxyProgressState state;
+  struct ncclProxyOp ring[NCCL_PROXY_SHARD_RING];
+  uint64_t head;
+  uint64_t tail;
+  int sleeping;
+  int idleIters;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int index;
+  int numaNode;
 };
 
 // Expected proxy response fifo
@@ -321,14 +383,51 @@ struct ncclProxyState {
 
   // Progress thread
   struct ncclProxyProgressState progressState;
+  // Net connections set up on each NIC, progress threads move next to the NIC they drive most
+  int netConns[NCCL_MAX_NETDEVS];
+  int netConnsSeq;
 
   // Profiler plugin
   void* profilerContext;
 
   // Queue of expected responses from the proxy
   struct ncclExpectedProxyResponse* expectedResponses;
+
+  // Bytes of connection buffers allocated for the comms using this proxy, device then host
+  uint64_t fifoBytes[2];
+  uint64_t sharedBuffBytes[2];
+
+  // NCCL_GRAPH_DEVICE_REPLAY, proxy ops posted from doorbells rung by the kernels
+  struct ncclProxyReplay* replay;
+};
+
+// Proxy ops of a plan with opCounts relative to the plan, posted each time its kernel runs
+struct ncclProxyReplayPlan {
+  int nOps, maxOps;
+  struct ncclProxyOp* ops;
+  uint64_t collOpCount;
+  uint64_t p2pOpBump[MAXCHANNELS];
+  // Freed by the progress thread once posted
+  bool once;
 };
 
+struct ncclProxyReplay {
+  struct ncclProxyReplayRing* ring; // Host memory
+  unsigned long long* seq; // Device memory
+  pthread_mutex_t mutex;
+  struct ncclProxyReplayPlan** plans;
+  int nPlans;
+  // Used by the progress thread
+  uint64_t head;
+  int nextOp;
+  uint64_t collOpCount;
+  uint64_t p2pOpCount[MAXCHANNELS];
+};
+
+static inline void ncclProxyMemAdd(uint64_t* bytes, bool host, size_t size) {
+  __atomic_fetch_add(bytes + (host ? 1 : 0), (uint64_t)size, __ATOMIC_RELAXED);
+}
+
 enum proxyConnectState {
   connUninitialized     = 0,
   connInitialized       = 1,
@@ -351,6 +450,8 @@ struct ncclProxyConnection {
   proxyConnectState state;
   struct ncclCollNetSharedRes* collNet;
   int needsProxyProgress;
+  // Index of the thread progressing the ops of this connection, see ncclProxyProgressShardForNet()
+  int progressShard;
 };
 
 typedef ncclResult_t (*threadFunc_t)(struct ncclProxyArgs*);
@@ -362,6 +463,12 @@ enum proxyMode {
 };
 
 ncclResult_t ncclProxySaveOp(struct ncclComm* comm, struct ncclProxyOp* proxyOp, bool *justInquire);
+ncclResult_t ncclProxyReplayInit(struct ncclComm* comm);
+// Save the proxy ops of plan as a template the kernel posts with ncclDevKernelArgs::replayId
+ncclResult_t ncclProxyReplayRegister(struct ncclComm* comm, struct ncclKernelPlan* plan, bool once, uint32_t* replayId);
+ncclResult_t ncclProxyReplayUnregister(struct ncclComm* comm, uint32_t replayId);
+int ncclProxyProgressShardForNet(struct ncclProxyState* proxyState, int netDev);
+void ncclProxyNetConnAdd(struct ncclProxyState* proxyState, int netDev);
 ncclResult_t ncclProxyStart(struct ncclComm* comm);
 ncclResult_t ncclProxyInit(struct ncclComm* comm, struct ncclSocket* sock, union ncclSocketAddress* peerAddresses, uint64_t *peerAddressesUDS);
 ncclResult_t ncclProxyCreate(struct ncclComm* comm);
@@ -378,7 +485,8 @@ enum ncclProxyMsgType {
   ncclProxyMsgGetFd = 9, // cuMem API support (UDS)
   ncclProxyMsgQueryFd = 10,
   ncclProxyMsgRegister = 11,
-  ncclProxyMsgDeregister = 12
+  ncclProxyMsgDeregister = 12,
+  ncclProxyMsgGetFds = 13 // several GetFd in one UDS message
 };
 
 // This function is called by a client of the proxy that needs to invoke any of the non-progress proxyOp types
@@ -392,6 +500,8 @@ ncclResult_t ncclPollProxyResponse(struct ncclComm* comm, struct ncclProxyConnec
 
 // UDS support
 ncclResult_t ncclProxyClientGetFdBlocking(struct ncclComm* comm, int rank, void *handle, int* convertedFd);
+// Fds of nHandles cuMem handles of proxyRank, NCCL_IPC_MAX_FDS per UDS round trip
+ncclResult_t ncclProxyClientGetFdsBlocking(struct ncclComm* comm, int proxyRank, int nHandles, uint64_t* handles, int* convertedFds);
 ncclResult_t ncclProxyClientQueryFdBlocking(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int localFd, int* rmtFd);
 
 ncclResult_t ncclProxyStop(struct ncclComm* comm);
@@ -399,5 +509,5 @@ ncclResult_t ncclProxyShmUnlink(struct ncclComm* comm);
 ncclResult_t ncclProxyDestroy(struct ncclComm* comm);
 
 enum { proxyRecv=0, proxySend=1 };
-ncclResult_t mscclSaveProxy(struct ncclComm* comm, struct ncclChannel* channel, int type, int peer, struct ncclProxyOp* op, int connIndex);
+ncclResult_t mscclAppendProxyOp(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, struct ncclProxyOp* op);
 #endif
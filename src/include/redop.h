@@ -0,0 +1,36 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_REDOP_H_
+#define NCCL_REDOP_H_
+
+#include "comm.h"
+#include "cudawrap.h"
+
+// Reduction operator of ncclRedOpCreateCustom, loaded for the device of its comm
+struct ncclCustomRedOp {
+  CUmodule module;
+  CUfunction function;
+  ncclDataType_t datatype;
+  // Recorded after the last call outside graph capture, waited for before unloading the module
+  cudaEvent_t done;
+};
+
+// Custom operator of comm op stands for, NULL for builtin and PreMulSum operators
+struct ncclCustomRedOp* ncclRedOpCustom(struct ncclComm* comm, ncclRedOp_t op);
+
+// Run the AllReduce or ReduceScatter of a custom operator as a ring of send/recv steps, the
+// operator kernel reducing each received block into the partial one, the AllReduce then
+// passing the reduced blocks around the ring.
+ncclResult_t ncclCustomReduceRun(struct ncclComm* comm, ncclFunc_t coll, const void* sendbuff, void* recvbuff, size_t count,
+  ncclDataType_t datatype, struct ncclCustomRedOp* custom, cudaStream_t stream);
+
+// Load funcName from the cubin, PTX or fatbin image for the device of comm
+ncclResult_t ncclCustomRedOpLoad(struct ncclComm* comm, const void* image, const char* funcName, ncclDataType_t datatype,
+  struct ncclCustomRedOp** custom);
+ncclResult_t ncclCustomRedOpFree(struct ncclCustomRedOp* custom);
+ncclResult_t ncclCustomReduceDestroy(struct ncclComm* comm);
+
+#endif
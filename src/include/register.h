@@ -12,7 +12,8 @@ enum {
   NVLS_REG_POSSIBLE = 0x04,
   NVLS_REG_NO_SUPPORT = 0x08,
   COLLNET_REG_COMPLETE = 0x10,
-  IPC_REG_COMPLETE = 0x20
+  IPC_REG_COMPLETE = 0x20,
+  HOST_REG_MEMORY = 0x40 // Pinned host memory, registered with the network only
 };
 
 struct ncclPeerRegIpcAddr {
@@ -25,6 +26,7 @@ struct ncclReg {
   size_t pages;
   int refs;
   uintptr_t addr;
+  uintptr_t maxEnd; // Largest end of this slot and the ones before it in the cache
   uint32_t state;
   // net reg
   int nDevs;
@@ -55,6 +57,7 @@ struct ncclRegCache {
 };
 
 ncclResult_t ncclRegCleanup(struct ncclComm* comm);
+ncclResult_t ncclRegister(struct ncclComm* comm, void* data, size_t size, void** handle);
 ncclResult_t ncclRegFind(struct ncclComm* comm, const void* data, size_t size, struct ncclReg** reg);
 
 #endif
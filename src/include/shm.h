@@ -5,6 +5,8 @@
 
 struct shmLegacyIpc {
   char shmSuffix[7];
+  // The file is in NCCL_SHM_HUGEPAGE_DIR rather than /dev/shm
+  bool hugetlb;
   ncclShmHandle_t handle;
   size_t shmSize;
 };
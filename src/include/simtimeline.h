@@ -0,0 +1,22 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_SIMTIMELINE_H_
+#define NCCL_SIMTIMELINE_H_
+
+#include "nccl.h"
+
+struct ncclComm;
+
+// Timeline of the group ended by ncclGroupSimulateEnd, per thread as groups are. The operations
+// of a comm run one after the other, the comms of a GPU at the same time and share its links.
+ncclResult_t ncclSimTimelineBegin();
+// Operation of comm taking time us, linkTime of which its links are busy
+ncclResult_t ncclSimTimelineRecord(struct ncclComm* comm, const char* opName, size_t bytes, const char* algorithm,
+  const char* protocol, int nChannels, float time, float linkTime);
+// Lay out the operations recorded since ncclSimTimelineBegin into estimatedTime and the events of simInfo
+ncclResult_t ncclSimTimelineEnd(ncclSimInfo_t* simInfo);
+
+#endif
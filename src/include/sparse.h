@@ -0,0 +1,20 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#ifndef NCCL_SPARSE_H_
+#define NCCL_SPARSE_H_
+
+#include "comm.h"
+
+// Pack the entries of the rank into a slot of maxnnz entries, gather the slots of all ranks
+// with ncclAllGather and add them into the zeroed recvbuff in rank order. When the slots would
+// move more bytes than a dense allreduce, the entries are added into recvbuff first and
+// recvbuff is summed with ncclAllReduce instead, all ranks decide it the same way.
+ncclResult_t ncclSparseAllReduceRun(struct ncclComm* comm, const void* values, const int64_t* indices, const size_t* nnz,
+  size_t maxnnz, void* recvbuff, size_t count, ncclDataType_t datatype, cudaStream_t stream);
+
+ncclResult_t ncclSparseAllReduceDestroy(struct ncclComm* comm);
+
+#endif
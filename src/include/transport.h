@@ -49,6 +49,10 @@ struct ncclPeerInfo {
   nvmlGpuFabricInfoV_t fabricInfo;
   int cuMemSupport;
   int version;
+  // Leaf switch of the host, 0 when unknown
+  uint64_t fabricLeafHash;
+  // Links that passed the LL128 self-test, NCCL_LL128_CHECK_* bits
+  int ll128Check;
 };
 
 #define CONNECT_SIZE 256
@@ -116,6 +120,9 @@ struct ncclTransport {
 
 ncclResult_t ncclTransportP2pConnect(struct ncclComm* comm, int channelId, int nrecv, int* peerRecv, int nsend, int* peerSend, int connIndex);
 ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, int connIndex, int* highestTransportType=NULL, bool* needsProxy=NULL);
+// Issue the proxy setup call of a connector without waiting for it. ncclTransportP2pSetup completes it
+// before the connect information in resp is sent to the peer.
+ncclResult_t ncclTransportSetupAsync(struct ncclComm* comm, struct ncclConnector* connector, void* req, int reqSize, void* resp, int respSize);
 ncclResult_t ncclTransportCheckP2pType(struct ncclComm* comm, bool* intraNodeP2pSupport, bool* directMode);
 
 ncclResult_t ncclNvlsInit(struct ncclComm* comm);
@@ -135,6 +142,14 @@ ncclResult_t ncclCollnetLocalRegisterBuffer(struct ncclComm* comm, const void* u
 ncclResult_t ncclCollnetGraphRegisterBuffer(struct ncclComm* comm, const void* userbuff, size_t buffSize, int type, int* outRegBufFlag, void** outHandle, struct ncclIntruQueue<struct ncclCommCallback, &ncclCommCallback::next>* cleanupQueue, int* nCleanupQueueElts);
 ncclResult_t ncclCollnetDeregBuffer(struct ncclComm* comm, struct ncclProxyConnector* proxyconn, void* handle);
 
+// Size of the buffer of protocol p on a connection, 0 when no collective of the comm can use it
+static inline int ncclConnBuffSize(struct ncclComm* comm, int connIndex, int p) {
+  return (connIndex != 0 || (comm->connProtoMask & (1 << p))) ? comm->buffSizes[p] : 0;
+}
+static inline int ncclConnProtoMask(struct ncclComm* comm, int connIndex) {
+  return connIndex != 0 ? (1 << NCCL_NUM_PROTOCOLS) - 1 : comm->connProtoMask;
+}
+
 ncclResult_t ncclTransportRingConnect(struct ncclComm* comm, int* highestTransportType=NULL, bool* needsProxy=NULL);
 ncclResult_t ncclTransportTreeConnect(struct ncclComm* comm, int* highestTransportType=NULL, bool* needsProxy=NULL);
 ncclResult_t ncclTransportPatConnect(struct ncclComm* comm, int* highestTransportType=NULL, bool* needsProxy=NULL);
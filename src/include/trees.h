@@ -9,5 +9,9 @@
 
 ncclResult_t ncclGetBtree(int nranks, int rank, int* u0, int* d1, int* d0, int* parentChildType);
 ncclResult_t ncclGetDtree(int nranks, int rank, int* u0, int* d0_0, int* d0_1, int* parentChildType0, int* u1, int* d1_0, int* d1_1, int* parentChildType1);
+// Double tree of at most arity children per node, keeping the nodes of a leaf switch together.
+// nodeLeaf gives the leaf of every node, depth is set to the depth of the deeper tree.
+ncclResult_t ncclGetFabricDtree(int nNodes, int node, const int* nodeLeaf, int arity, int* depth,
+  int* u0, int* d0_0, int* d0_1, int* parentChildType0, int* u1, int* d1_0, int* d1_1, int* parentChildType1);
 
 #endif
@@ -20,4 +20,12 @@ ncclResult_t ncclTunerPluginLoad(struct ncclComm* comm);
 
 // Cleans up NCCL tuner plugin.
 ncclResult_t ncclTunerPluginUnload(struct ncclComm* comm);
+
+// Time a sample of the kernels running a single collective with CUDA events around their
+// launch on stream, and report those the GPU completed to the reportPerf callback of the tuner.
+ncclResult_t ncclTunerFeedbackBeforeLaunch(struct ncclComm* comm, struct ncclKernelPlan* plan, cudaStream_t stream);
+ncclResult_t ncclTunerFeedbackAfterLaunch(struct ncclComm* comm, cudaStream_t stream);
+
+// Drops the samples not reported yet.
+ncclResult_t ncclTunerFeedbackFree(struct ncclComm* comm);
 #endif
@@ -25,10 +25,14 @@ ncclResult_t int64ToBusId(int64_t id, char* busId);
 ncclResult_t busIdToInt64(const char* busId, int64_t* id);
 
 ncclResult_t getBusId(int cudaDev, int64_t *busId);
+// NUMA node of the GPU of the calling thread, -1 when unknown
+int ncclCudaDevNumaNode();
 
 ncclResult_t getHostName(char* hostname, int maxlen, const char delim);
 uint64_t getHostHash();
 uint64_t getPidHash();
+// Leaf switch of the host from NCCL_TREE_FABRIC_LEAF or NCCL_TREE_FABRIC_FILE, 0 when unknown
+uint64_t getFabricLeafHash();
 ncclResult_t getRandomData(void* buffer, size_t bytes);
 
 struct netIf {
@@ -14,6 +14,17 @@
 #include "group.h"
 #include "net.h"
 #include "coll_net.h"
+#include "ce_coll.h"
+#include "compress.h"
+#include "oneshot.h"
+#include "alltoall.h"
+#include "hierpat.h"
+#include "sparse.h"
+#include "redop.h"
+#include "bcast.h"
+#include "lanes.h"
+#include "greenctx.h"
+#include "metrics.h"
 #include "enqueue.h"
 #include "graph.h"
 #include "argcheck.h"
@@ -23,6 +34,8 @@
 #endif
 
 #include "tuner.h"
+#include "ll128_check.h"
+#include "async_error.h"
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
@@ -33,6 +46,7 @@
 #include <unistd.h>
 #include "param.h"
 #include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_persistent.h"
 #include "msccl/msccl_status.h"
 
 #define STR2(v) #v
@@ -53,6 +67,7 @@ NCCL_PARAM(GroupCudaStream, "GROUP_CUDA_STREAM", NCCL_GROUP_CUDA_STREAM);
 NCCL_PARAM(CheckPointers, "CHECK_POINTERS", 0);
 NCCL_PARAM(CommBlocking, "COMM_BLOCKING", NCCL_CONFIG_UNDEF_INT);
 NCCL_PARAM(RuntimeConnect, "RUNTIME_CONNECT", 1);
+NCCL_PARAM(RuntimeConnectProtoTrim, "RUNTIME_CONNECT_PROTO_TRIM", 1);
 
 static ncclResult_t commReclaim(ncclComm_t comm);
 
@@ -70,13 +85,18 @@ static uint64_t hashUniqueId(ncclUniqueId const &id) {
 // GDRCOPY support: Off by default
 NCCL_PARAM(GdrCopyEnable, "GDRCOPY_ENABLE", 0);
 
+// GDRCOPY support: FIFO_ENABLE when enabled locates a workFifo in CUDA memory, 2 opens GDRCOPY for it alone
+NCCL_PARAM(GdrCopyFifoEnable, "GDRCOPY_FIFO_ENABLE", 1);
+
 // GDRCOPY support
 gdr_t ncclGdrCopy = NULL;
+bool ncclGdrCopyTransports = false;
 
 ncclResult_t initGdrCopy() {
-  if (ncclParamGdrCopyEnable() == 1) {
+  if (ncclParamGdrCopyEnable() == 1 || ncclParamGdrCopyFifoEnable() == 2) {
     ncclGdrCopy = ncclGdrInit();
   }
+  ncclGdrCopyTransports = ncclGdrCopy != NULL && ncclParamGdrCopyEnable() == 1;
   return ncclSuccess;
 }
 
@@ -88,6 +108,7 @@ static void initOnceFunc() {
   initGdrCopy();
   // Always initialize bootstrap network
   NCCLCHECKGOTO(bootstrapNetInit(), initResult, exit);
+  NCCLCHECKGOTO(ncclMetricsInit(), initResult, exit);
 
   initNvtxRegisteredEnums();
 exit:;
@@ -193,6 +214,8 @@ static ncclResult_t commFree(ncclComm_t comm) {
   /* in commReclaim, we have guaranteed only last rank which calls ncclCommDestroy() will
    * free all intra-process communicators; therefore, we only need to focus on local
    * resource cleanup in commFree(). */
+  NCCLCHECK(ncclAsyncLaunchDestroy(comm));
+  ncclAsyncErrorUnregister(comm);
   if (comm->proxyState && comm->proxyRefCountOld == 0 && comm->proxyState->thread) {
     PTHREADCHECK(pthread_join(comm->proxyState->thread, nullptr), "pthread_join");
     if (comm->proxyState->threadUDS) {
@@ -203,6 +226,9 @@ static ncclResult_t commFree(ncclComm_t comm) {
 
   CUDACHECK(cudaMemPoolDestroy(comm->memPool));
 
+  for (int ix = 0; ix < comm->userRedOpCapacity; ix++) {
+    if (comm->userRedOps[ix].freeNext == -1) NCCLCHECK(ncclCustomRedOpFree(comm->userRedOps[ix].custom));
+  }
   delete[] comm->userRedOps;
 
   free(comm->connectSend);
@@ -228,9 +254,13 @@ static ncclResult_t commFree(ncclComm_t comm) {
   if (comm->sharedRes) {
     if (ncclAtomicRefCountDecrement(&comm->sharedRes->refCount) == 0) {
       for (int c=0; c<MAXCHANNELS; c++) {
-        if (comm->sharedRes->peers[c]) free(comm->sharedRes->peers[c]);
-        if (comm->sharedRes->devPeers[c]) ncclCudaFree(comm->sharedRes->devPeers[c]);
+        if (comm->sharedRes->peers[c]) {
+          for (int r=0; r<comm->sharedRes->tpNRanks; r++) free(comm->sharedRes->peers[c][r]);
+          free(comm->sharedRes->peers[c]);
+        }
+        free(comm->sharedRes->devPeers[c]);
       }
+      NCCLCHECK(ncclDevArenaDestroy(&comm->sharedRes->devArena));
       free(comm->sharedRes->tpRankToLocalRank);
       NCCLCHECK(ncclStrongStreamDestruct(&comm->sharedRes->hostStream));
       NCCLCHECK(ncclStrongStreamDestruct(&comm->sharedRes->deviceStream));
@@ -257,12 +287,26 @@ static ncclResult_t commFree(ncclComm_t comm) {
     free(comm->abortFlagRefCount);
   }
   free((void*)comm->config.netName);
+  free((void*)comm->config.mscclAlgoDir);
+  free((void*)comm->config.mscclScheduler);
 
   free(comm->topParentRanks);
   free(comm->topParentLocalRanks);
   free(comm->gproxyConn);
 
   NCCLCHECK(ncclRegCleanup(comm));
+  NCCLCHECK(ncclCeCollDestroy(comm));
+  NCCLCHECK(ncclCompressDestroy(comm));
+  NCCLCHECK(ncclOneShotDestroy(comm));
+  NCCLCHECK(ncclHierAllToAllDestroy(comm));
+  NCCLCHECK(ncclHierPatDestroy(comm));
+  NCCLCHECK(ncclAllToAllvDestroy(comm));
+  NCCLCHECK(ncclSparseAllReduceDestroy(comm));
+  NCCLCHECK(ncclCustomReduceDestroy(comm));
+  NCCLCHECK(ncclBroadcastStagedDestroy(comm));
+  NCCLCHECK(ncclLanesDestroy(comm));
+  NCCLCHECK(ncclGreenCtxDestroy(comm));
+  NCCLCHECK(ncclP2pImportsFree(comm));
 
   INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d busId %lx - %s COMPLETE", comm, comm->rank, comm->nRanks, comm->cudaDev, comm->busId, abort ? "Abort" : "Destroy");
 
@@ -276,8 +320,6 @@ static ncclResult_t commFree(ncclComm_t comm) {
 }
 
 NCCL_PARAM(DisableGraphHelper, "GRAPH_HELPER_DISABLE", 0);
-// GDRCOPY support: FIFO_ENABLE when enabled locates a workFifo in CUDA memory
-NCCL_PARAM(GdrCopyFifoEnable, "GDRCOPY_FIFO_ENABLE", 1);
 #define NCCL_WORK_FIFO_BYTES_DEFAULT (1<<20)
 NCCL_PARAM(WorkFifoBytes, "WORK_FIFO_BYTES", NCCL_WORK_FIFO_BYTES_DEFAULT);
 NCCL_PARAM(WorkArgsBytes, "WORK_ARGS_BYTES", INT64_MAX);
@@ -304,12 +346,29 @@ static ncclResult_t dmaBufSupported(struct ncclComm* comm) {
   return ncclInternalError;
 }
 
+// Comm whose init in the background runs on this thread, see commSplitInitMain()
+static __thread struct ncclComm* splitInitSelf = NULL;
+
+ncclResult_t ncclCommSplitInitJoin(ncclComm_t comm) {
+  // The init thread itself may call back into the API, it must not wait for itself
+  if (comm == splitInitSelf) return ncclSuccess;
+  if (__atomic_exchange_n(&comm->splitInitPending, false, __ATOMIC_ACQ_REL)) {
+    PTHREADCHECK(pthread_join(comm->splitInitThread, NULL), "pthread_join");
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclCommEnsureReady(ncclComm_t comm) {
   /* comm must be ready, or error will be reported */
   ncclResult_t ret = ncclSuccess;
+  /* the init ncclCommSplit() left running in the background must be done with the comm */
+  NCCLCHECK(ncclCommSplitInitJoin(comm));
   if (__atomic_load_n(comm->abortFlag, __ATOMIC_ACQUIRE)) {
+    (void)ncclAsyncLaunchWait(comm);
     ncclGroupJobAbort(comm->groupJob);
   } else {
+    /* the launcher thread must be done with the comm, its error is the one of the last call */
+    NCCLCHECK(ncclAsyncLaunchWait(comm));
     NCCLCHECK(ncclCommGetAsyncError(comm, &ret));
     if (ret != ncclSuccess) {
       /* if ret is not ncclInProgress, we just keep it. */
@@ -349,7 +408,7 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
   NCCLCHECK(ncclProfilerPluginInit(comm));
   INFO(NCCL_INIT, "Using network %s", comm->ncclNet->name);
 
-  if (parent && parent->config.splitShare) {
+  if (parent && comm->shareRes) {
     if (parent->ncclNet != comm->ncclNet) {
       WARN("Split shares resources, but parent comm netName %s is different from child comm netName %s", parent->ncclNet->name, comm->ncclNet->name);
       return ncclInvalidUsage;
@@ -389,7 +448,7 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
   // Mark channels as non initialized.
   for (int c=0; c < MAXCHANNELS; c++) comm->channels[c].id = -1;
 
-  if (parent == NULL || !parent->config.splitShare) {
+  if (parent == NULL || !comm->shareRes) {
     struct ncclSharedResources* sharedRes = NULL;
     NCCLCHECK(ncclCalloc(&sharedRes, 1));
     /* most of attributes are assigned later in initTransportsRank(). */
@@ -398,6 +457,7 @@ static ncclResult_t commAlloc(struct ncclComm* comm, struct ncclComm* parent, in
     NCCLCHECK(ncclCalloc(&sharedRes->tpRankToLocalRank, comm->nRanks));
     NCCLCHECK(ncclStrongStreamConstruct(&sharedRes->deviceStream));
     NCCLCHECK(ncclStrongStreamConstruct(&sharedRes->hostStream));
+    NCCLCHECK(ncclDevArenaInit(&sharedRes->devArena));
     comm->sharedRes = sharedRes;
     sharedRes->refCount = 1;
   } else {
@@ -445,17 +505,20 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
   struct ncclNvmlCCStatus ccStatus;
 
   NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->deviceStream), ret, fail);
-  NCCLCHECKGOTO(ncclCudaCallocAsync(&devCommAndChans, 1, comm->sharedRes->deviceStream.cudaStream), ret, fail);
-  ncclCommPushCudaFree(comm, devCommAndChans);
-  NCCLCHECKGOTO(ncclCudaCallocAsync(&tmpCommAndChans.comm.rankToLocalRank, comm->nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
-  ncclCommPushCudaFree(comm, tmpCommAndChans.comm.rankToLocalRank);
+  NCCLCHECKGOTO(ncclDevArenaCalloc(&comm->sharedRes->devArena, &devCommAndChans, 1), ret, fail);
+  NCCLCHECKGOTO(ncclDevArenaCalloc(&comm->sharedRes->devArena, &tmpCommAndChans.comm.rankToLocalRank, comm->nRanks), ret, fail);
   NCCLCHECKGOTO(ncclCudaMemcpyAsync(tmpCommAndChans.comm.rankToLocalRank, comm->rankToLocalRank, comm->nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
+  static_assert(sizeof(ncclComm::P2pSchedulePair) == 2*sizeof(int), "p2pSchedule is copied as pairs of ints");
+  NCCLCHECKGOTO(ncclDevArenaCalloc(&comm->sharedRes->devArena, &tmpCommAndChans.comm.p2pSchedule, 2*nRanks), ret, fail);
+  NCCLCHECKGOTO(ncclCudaMemcpyAsync(tmpCommAndChans.comm.p2pSchedule, (int*)comm->p2pSchedule, 2*nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
   comm->devComm = &devCommAndChans->comm;
   tmpCommAndChans.comm.rank = comm->rank;
   tmpCommAndChans.comm.nRanks = nRanks;
   tmpCommAndChans.comm.node = comm->node;
   tmpCommAndChans.comm.nNodes = comm->nNodes;
   tmpCommAndChans.comm.abortFlag = comm->abortFlagDev;
+  tmpCommAndChans.comm.replayRing = comm->proxyReplay ? comm->proxyState->replay->ring : NULL;
+  tmpCommAndChans.comm.replaySeq = comm->proxyReplay ? comm->proxyState->replay->seq : NULL;
   tmpCommAndChans.comm.isNvlink = ncclTopoPathAllNVLink(comm->topo);
   for (int p=0; p < NCCL_NUM_PROTOCOLS; p++) {
     tmpCommAndChans.comm.buffSizes[p] = comm->buffSizes[p];
@@ -484,13 +547,18 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
     INFO(NCCL_INIT, "CC %s, Multi-GPU CC %s, workFifoBytes %d", ccStatus.CCEnabled ? "On" : "Off", ccStatus.multiGpuCCEnabled ? "On" : "Off", comm->workFifoBytes);
   }
 
-  if (ncclGdrCopy != NULL && ncclParamGdrCopyFifoEnable() == 1) {
-    // The workFifoBuf lives in GDR mapped CUDA memory.
-    NCCLCHECKGOTO(ncclGdrCudaCalloc(&comm->workFifoBuf, &comm->workFifoBufDev, comm->workFifoBytes, &comm->workFifoBufGdrHandle), ret, fail);
-    ncclCommPushCudaGdrFree(comm, comm->workFifoBufGdrHandle);
-  } else {
+  comm->workFifoBufGdrHandle = nullptr;
+  if (ncclGdrCopy != NULL && ncclParamGdrCopyFifoEnable() != 0 && comm->workFifoBytes != 0) {
+    // The workFifoBuf lives in GDR mapped CUDA memory, the kernels fetch their work from HBM.
+    if (ncclGdrCudaCalloc(&comm->workFifoBuf, &comm->workFifoBufDev, comm->workFifoBytes, &comm->workFifoBufGdrHandle) == ncclSuccess) {
+      ncclCommPushCudaGdrFree(comm, comm->workFifoBufGdrHandle);
+    } else {
+      INFO(NCCL_INIT, "GDRCOPY could not map a work FIFO of %d bytes, using host memory", comm->workFifoBytes);
+      comm->workFifoBufGdrHandle = nullptr;
+    }
+  }
+  if (comm->workFifoBufGdrHandle == nullptr) {
     // The workFifoBuf lives in cudaHost memory.
-    comm->workFifoBufGdrHandle = nullptr;
     NCCLCHECKGOTO(ncclCudaHostCalloc(&comm->workFifoBuf, comm->workFifoBytes), ret, fail);
     ncclCommPushCudaHostFree(comm, comm->workFifoBuf);
     comm->workFifoBufDev = comm->workFifoBuf;
@@ -503,8 +571,7 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
   tmpCommAndChans.comm.workConsumed = comm->workFifoConsumed;
 
   if (comm->collNetDenseToUserRank != nullptr) {
-    NCCLCHECKGOTO(ncclCudaCallocAsync(&tmpCommAndChans.comm.collNetDenseToUserRank, nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
-    ncclCommPushCudaFree(comm, tmpCommAndChans.comm.collNetDenseToUserRank);
+    NCCLCHECKGOTO(ncclDevArenaCalloc(&comm->sharedRes->devArena, &tmpCommAndChans.comm.collNetDenseToUserRank, nRanks), ret, fail);
     NCCLCHECKGOTO(ncclCudaMemcpyAsync(tmpCommAndChans.comm.collNetDenseToUserRank, comm->collNetDenseToUserRank, nRanks, comm->sharedRes->deviceStream.cudaStream), ret, fail);
   }
 
@@ -524,9 +591,10 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
 
 #if defined(ENABLE_NPKIT)
   // Init NPKit
-  NCCLCHECK(NpKit::Init(comm->rank));
+  NCCLCHECK(NpKit::Init(comm->rank, comm->nRanks, comm->bootstrap));
   tmpCommAndChans.comm.npKitEventCollectContexts = NpKit::GetGpuEventCollectContexts();
   tmpCommAndChans.comm.cpuTimestamp = NpKit::GetCpuTimestamp();
+  tmpCommAndChans.comm.npKitEventMask = NpKit::GetEventMask();
 #endif
 
   NCCLCHECKGOTO(ncclCudaMemcpyAsync(devCommAndChans, &tmpCommAndChans, 1, comm->sharedRes->deviceStream.cudaStream), ret, fail);
@@ -557,6 +625,7 @@ static ncclResult_t fillInfo(struct ncclComm* comm, struct ncclPeerInfo* info, u
   NCCLCHECK(ncclGetVersion(&info->version));
   info->hostHash=getHostHash()+commHash;
   info->pidHash=getPidHash()+commHash;
+  info->fabricLeafHash = getFabricLeafHash();
   info->cuMemSupport = ncclCuMemEnable();
 
   // Get the device MAJOR:MINOR of /dev/shm so we can use that
@@ -571,6 +640,7 @@ static ncclResult_t fillInfo(struct ncclComm* comm, struct ncclPeerInfo* info, u
   NCCLCHECK(ncclGpuGdrSupport(comm, &info->gdrSupport));
   info->comm = comm;
   info->cudaCompCap = comm->minCompCap = comm->maxCompCap = comm->compCap;
+  NCCLCHECK(ncclLl128Check(comm, &info->ll128Check));
 
   // MNNVL support
   {
@@ -632,6 +702,7 @@ static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
     comm->buffSizes[p] = envs[p] != -2 ? envs[p] : defaults[p];
   }
+  comm->connProtoMask = (1 << NCCL_NUM_PROTOCOLS) - 1;
 
   if (comm->nNodes > 1) comm->p2pChunkSize = ncclParamP2pNetChunkSize();
   else if (ncclTopoPathAllNVLink(comm->topo)) comm->p2pChunkSize = ncclParamP2pNvlChunkSize();
@@ -651,6 +722,66 @@ static ncclResult_t computeBuffSizes(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+int64_t ncclParamNvlsChunkSize();
+#define NCCL_MEM_BUDGET_MIN_BUFFSIZE (1 << 20)
+#define NCCL_MEM_BUDGET_MIN_NVLS_CHUNKSIZE (1 << 15)
+
+// Bytes of the connection and NVLS buffers of a rank, from values all ranks agree on
+static size_t memBudgetEstimate(struct ncclComm* comm) {
+  size_t fifoBytes = 0;
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+    if (comm->connProtoMask & (1 << p)) fifoBytes += comm->buffSizes[p];
+  }
+  // Each channel receives from its ring and from both ends of its tree chain
+  size_t bytes = 3*fifoBytes*comm->nChannels;
+  if (comm->nvlsSupport) bytes += 2*(size_t)comm->nvlsChannels*comm->nvlsChunkSize*NCCL_STEPS*comm->maxLocalRanks;
+  return bytes;
+}
+
+// Shrink the Simple buffers, then the NVLS chunks, then drop LL128 buffers and channels until the
+// buffers fit config.memBudget.
+static ncclResult_t memBudgetFit(struct ncclComm* comm) {
+  size_t budget = (size_t)comm->config.memBudget << 20;
+  // Children sharing resources use the proxy and the NVLS buffers of their parent
+  bool owner = comm->sharedRes->owner == comm;
+  // MSCCL algorithms need the protocols and channels they were built for
+  bool msccl = mscclEnabled(comm);
+  size_t bytes;
+
+  if (comm->nvlsChunkSize == 0) comm->nvlsChunkSize = ncclParamNvlsChunkSize();
+  if (comm->config.memBudget == 0) return ncclSuccess;
+  bytes = memBudgetEstimate(comm);
+  while (owner && bytes > budget && comm->buffSizes[NCCL_PROTO_SIMPLE] > NCCL_MEM_BUDGET_MIN_BUFFSIZE) {
+    comm->buffSizes[NCCL_PROTO_SIMPLE] /= 2;
+    bytes = memBudgetEstimate(comm);
+  }
+  while (owner && bytes > budget && comm->nvlsSupport && comm->nvlsChunkSize > NCCL_MEM_BUDGET_MIN_NVLS_CHUNKSIZE) {
+    comm->nvlsChunkSize /= 2;
+    bytes = memBudgetEstimate(comm);
+  }
+  if (!msccl && bytes > budget && (comm->connProtoMask & (1 << NCCL_PROTO_LL128))) {
+    comm->connProtoMask &= ~(1 << NCCL_PROTO_LL128);
+    bytes = memBudgetEstimate(comm);
+  }
+  while (!msccl && bytes > budget && comm->nChannels > std::max(1, comm->config.minCTAs)) {
+    comm->nChannels--;
+    comm->nvlsChannels = std::min(comm->nvlsChannels, comm->nChannels);
+    bytes = memBudgetEstimate(comm);
+  }
+  comm->collChannels = std::min(comm->collChannels, comm->nChannels);
+
+  if (comm->p2pChunkSize * NCCL_STEPS > comm->buffSizes[NCCL_PROTO_SIMPLE]) comm->p2pChunkSize = comm->buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS;
+  if (owner) comm->sharedRes->tpP2pChunkSize = comm->p2pChunkSize;
+
+  if (bytes > budget) {
+    WARN("Memory budget of %d MB cannot be met, buffers take about %zu MB", comm->config.memBudget, bytes >> 20);
+  }
+  INFO(NCCL_INIT, "Memory budget %d MB: buffSize %d, NVLS chunk %d, LL128 %s, %d channels, about %zu MB of buffers",
+       comm->config.memBudget, comm->buffSizes[NCCL_PROTO_SIMPLE], comm->nvlsChunkSize,
+       (comm->connProtoMask & (1 << NCCL_PROTO_LL128)) ? "on" : "off", comm->nChannels, bytes >> 20);
+  return ncclSuccess;
+}
+
 NCCL_PARAM(GraphDumpFileRank, "GRAPH_DUMP_FILE_RANK", 0);
 NCCL_PARAM(CollNetNodeThreshold, "COLLNET_NODE_THRESHOLD", 2);
 NCCL_PARAM(NvbPreconnect, "NVB_PRECONNECT", 1);
@@ -658,6 +789,8 @@ NCCL_PARAM(AllocP2pNetLLBuffers, "ALLOC_P2P_NET_LL_BUFFERS", 0);
 
 // MNNVL: Flag to indicate whether to enable Multi-Node NVLink
 NCCL_PARAM(MNNVLEnable, "MNNVL_ENABLE", 2);
+NCCL_PARAM(SplitInheritTopo, "COMM_SPLIT_INHERIT_TOPO", 1);
+NCCL_PARAM(GraphDeviceReplay, "GRAPH_DEVICE_REPLAY", 0);
 
 #if CUDART_VERSION >= 11030
 
@@ -807,6 +940,14 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
     }
   }
   // AllGather1 - end
+  {
+    uint64_t* hostHashes = NULL;
+    NCCLCHECKGOTO(ncclCalloc(&hostHashes, nranks), ret, fail);
+    for (int i = 0; i < nranks; i++) hostHashes[i] = comm->peerInfo[i].hostHash;
+    ret = bootstrapSetHosts(comm->bootstrap, hostHashes);
+    free(hostHashes);
+    if (ret != ncclSuccess) goto fail;
+  }
   timers[TIMER_INIT_ALLGATHER] = clockNano() - timers[TIMER_INIT_ALLGATHER];
 
   // MNNVL support
@@ -871,14 +1012,21 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   } while(0);
 
   timers[TIMER_INIT_TOPO] = clockNano();
-  // Topo detection / System graph creation
-  NCCLCHECKGOTO(ncclTopoGetSystem(comm, &comm->topo), ret, fail);
-  // Compute paths between GPUs and NICs
-  NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
-  // Remove inaccessible GPUs and unused NICs
-  NCCLCHECKGOTO(ncclTopoTrimSystem(comm->topo, comm), ret, fail);
-  // Recompute paths after trimming
-  NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
+  if (parent && parent->topo && !parent->MNNVL && !comm->MNNVL && ncclParamSplitInheritTopo()) {
+    // Start from the system of the parent, paths only change when GPUs or NICs left
+    bool changed;
+    NCCLCHECKGOTO(ncclTopoGetSystemFromParent(comm, parent, &comm->topo, &changed), ret, fail);
+    if (changed) NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
+  } else {
+    // Topo detection / System graph creation
+    NCCLCHECKGOTO(ncclTopoGetSystem(comm, &comm->topo), ret, fail);
+    // Compute paths between GPUs and NICs
+    NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
+    // Remove inaccessible GPUs and unused NICs
+    NCCLCHECKGOTO(ncclTopoTrimSystem(comm->topo, comm), ret, fail);
+    // Recompute paths after trimming
+    NCCLCHECKGOTO(ncclTopoComputePaths(comm->topo, comm), ret, fail);
+  }
   // Init search
   NCCLCHECKGOTO(ncclTopoSearchInit(comm->topo), ret, fail);
   // Decide on comm's CPU architecture.
@@ -916,23 +1064,15 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   ringGraph->pattern = NCCL_TOPO_PATTERN_RING;
   ringGraph->minChannels = 1;
   ringGraph->maxChannels = MAXCHANNELS/2;
-  NCCLCHECKGOTO(ncclTopoCompute(comm->topo, ringGraph), ret, fail);
-  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, ringGraph), ret, fail);
 
   memset(treeGraph, 0, sizeof(struct ncclTopoGraph));
   treeGraph->id = 1;
   treeGraph->pattern = NCCL_TOPO_PATTERN_BALANCED_TREE;
-  treeGraph->minChannels = ringGraph->nChannels;
-  treeGraph->maxChannels = ringGraph->nChannels;
-  NCCLCHECKGOTO(ncclTopoCompute(comm->topo, treeGraph), ret, fail);
-  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, treeGraph), ret, fail);
 
   memset(collNetChainGraph, 0, sizeof(struct ncclTopoGraph));
   collNetChainGraph->id = 2;
   collNetChainGraph->pattern = NCCL_TOPO_PATTERN_TREE;
   collNetChainGraph->collNet = 1;
-  collNetChainGraph->minChannels = ringGraph->nChannels;
-  collNetChainGraph->maxChannels = ringGraph->nChannels;
 
   memset(collNetDirectGraph, 0, sizeof(struct ncclTopoGraph));
   collNetDirectGraph->id = 4;
@@ -940,20 +1080,37 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   collNetDirectGraph->collNet = 1;
   collNetDirectGraph->minChannels = 1;
   collNetDirectGraph->maxChannels = MAXCHANNELS;
-  if (comm->collNetSupport) {
-    NCCLCHECKGOTO(ncclTopoCompute(comm->topo, collNetChainGraph), ret, fail);
-    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, collNetChainGraph), ret, fail);
-    NCCLCHECKGOTO(ncclTopoCompute(comm->topo, collNetDirectGraph), ret, fail);
-    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, collNetDirectGraph), ret, fail);
-  }
 
   memset(nvlsGraph, 0, sizeof(struct ncclTopoGraph));
   nvlsGraph->id = 3;
   nvlsGraph->pattern = NCCL_TOPO_PATTERN_NVLS;
   nvlsGraph->minChannels = 1;
   nvlsGraph->maxChannels = MAXCHANNELS;
+
+  {
+    // Trees and the CollNet chain take the channels of the ring, the other graphs do not wait for it
+    struct ncclTopoGraph* searchGraphs[3];
+    int nSearchGraphs = 0;
+    searchGraphs[nSearchGraphs++] = ringGraph;
+    if (comm->collNetSupport) searchGraphs[nSearchGraphs++] = collNetDirectGraph;
+    if (comm->nvlsSupport) searchGraphs[nSearchGraphs++] = nvlsGraph;
+    NCCLCHECKGOTO(ncclTopoComputeGraphs(comm->topo, nSearchGraphs, searchGraphs), ret, fail);
+
+    treeGraph->minChannels = treeGraph->maxChannels = ringGraph->nChannels;
+    collNetChainGraph->minChannels = collNetChainGraph->maxChannels = ringGraph->nChannels;
+    nSearchGraphs = 0;
+    searchGraphs[nSearchGraphs++] = treeGraph;
+    if (comm->collNetSupport) searchGraphs[nSearchGraphs++] = collNetChainGraph;
+    NCCLCHECKGOTO(ncclTopoComputeGraphs(comm->topo, nSearchGraphs, searchGraphs), ret, fail);
+  }
+
+  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, ringGraph), ret, fail);
+  NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, treeGraph), ret, fail);
+  if (comm->collNetSupport) {
+    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, collNetChainGraph), ret, fail);
+    NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, collNetDirectGraph), ret, fail);
+  }
   if (comm->nvlsSupport) {
-    NCCLCHECKGOTO(ncclTopoCompute(comm->topo, nvlsGraph), ret, fail);
     NCCLCHECKGOTO(ncclTopoPrintGraph(comm->topo, nvlsGraph), ret, fail);
   }
   timers[TIMER_INIT_GRAPHS] = clockNano() - timers[TIMER_INIT_GRAPHS];
@@ -1051,6 +1208,16 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   comm->localRankToRank = comm->nodeRanks[comm->node].localRankToRank;
   comm->localRank = comm->rankToLocalRank[rank];
   comm->localRanks = comm->nodeRanks[comm->node].localRanks;
+  // Mixed generations are modeled per node when each node has GPUs of one of them
+  comm->compCapPerNode = true;
+  for (int r=0; r<comm->nRanks; r++) {
+    int nodeRank0 = comm->nodeRanks[comm->rankToNode[r]].localRankToRank[0];
+    if (comm->peerInfo[r].cudaCompCap != comm->peerInfo[nodeRank0].cudaCompCap) comm->compCapPerNode = false;
+  }
+  if (rank == 0 && comm->minCompCap != comm->maxCompCap) {
+    INFO(NCCL_INIT, "GPUs of compute capability %d to %d, %s", comm->minCompCap, comm->maxCompCap,
+        comm->compCapPerNode ? "one kind per node" : "mixed within nodes");
+  }
 
   TRACE(NCCL_INIT,"hostHash[%d] %lx localRank %d localRanks %d localRank0 %d",
         rank, comm->peerInfo[rank].hostHash, comm->localRank, comm->localRanks, comm->localRankToRank[0]);
@@ -1120,6 +1287,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   INFO(NCCL_INIT, "Trees%s", line);
 
   NCCLCHECKGOTO(computeBuffSizes(comm), ret, fail);
+  NCCLCHECKGOTO(memBudgetFit(comm), ret, fail);
 
   // Compute nChannels per peer for p2p
   NCCLCHECKGOTO(ncclTopoComputeP2pChannels(comm), ret, fail);
@@ -1143,12 +1311,17 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
 
   NCCLCHECKGOTO(ncclTransportCheckP2pType(comm, &comm->intraNodeP2pSupport, &comm->directMode), ret, fail);
   // Launch proxy service thread, after this, the proxy calls can be used.
-  if (parent && parent->config.splitShare) {
+  if (parent && comm->shareRes) {
     comm->proxyState = parent->sharedRes->proxyState;
     ncclAtomicRefCountIncrement(&parent->sharedRes->proxyState->refCount);
   } else {
     NCCLCHECKGOTO(ncclProxyCreate(comm), ret, fail);
+    // The progress thread only polls for doorbells when they exist before it starts
+    if (ncclParamGraphDeviceReplay()) NCCLCHECKGOTO(ncclProxyReplayInit(comm), ret, fail);
   }
+  // Kernels can only post the ops of connections progressed by this rank
+  comm->proxyReplay = comm->proxyState->replay && !mscclEnabled(comm) && (comm->nNodes == 1 || ncclPxnDisable(comm));
+  if (comm->proxyReplay) INFO(NCCL_INIT, "Rank %d: proxy ops posted from kernel doorbells", comm->rank);
   NCCLCHECKGOTO(ncclCalloc(&comm->gproxyConn, comm->nRanks), ret, fail);
 
   timers[TIMER_INIT_CONNECT] = clockNano();
@@ -1281,11 +1454,11 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
         for (int c=0; c<comm->p2pnChannelsPerPeer; c++) {
           int channelId;
           channelId = ncclP2pChannelForPart(comm->p2pnChannels, sendBase, c);
-          if (comm->channels[channelId].peers[peer]->send[1].connected == 0) {
+          if (comm->channels[channelId].peers[peer] == NULL || comm->channels[channelId].peers[peer]->send[1].connected == 0) {
             comm->connectSend[peer] |= (1UL<<channelId);
           }
           channelId = ncclP2pChannelForPart(comm->p2pnChannels, recvBase, c);
-          if (comm->channels[channelId].peers[peer]->recv[1].connected == 0) {
+          if (comm->channels[channelId].peers[peer] == NULL || comm->channels[channelId].peers[peer]->recv[1].connected == 0) {
             comm->connectRecv[peer] |= (1UL<<channelId);
           }
         }
@@ -1300,6 +1473,18 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   // Compute time models for algorithm and protocol combinations
   NCCLCHECKGOTO(ncclTopoTuneModel(comm, comm->minCompCap, comm->maxCompCap, graphs), ret, fail);
 
+  // Connections made at runtime leave out the buffers of protocols no algorithm can pick
+  if (comm->runtimeConn && ncclParamRuntimeConnectProtoTrim()) {
+    int mask = 1 << NCCL_PROTO_SIMPLE;
+    for (int c=0; c<NCCL_NUM_FUNCTIONS; c++) for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if (comm->bandwidths[c][a][p] > 0) mask |= 1 << p;
+    }
+    comm->connProtoMask &= mask;
+    mask = comm->connProtoMask;
+    INFO(NCCL_INIT, "Runtime connections allocate buffers for protocols%s%s%s", mask & (1 << NCCL_PROTO_LL) ? " LL" : "",
+         mask & (1 << NCCL_PROTO_LL128) ? " LL128" : "", mask & (1 << NCCL_PROTO_SIMPLE) ? " Simple" : "");
+  }
+
   INFO(NCCL_INIT, "%d coll channels, %d collnet channels, %d nvls channels, %d p2p channels, %d p2p channels per peer", comm->nChannels, comm->nChannels, comm->nvlsChannels, comm->p2pnChannels, comm->p2pnChannelsPerPeer);
 
   if (comm->intraRank == 0) { // Load ncclParamLaunchMode
@@ -1323,11 +1508,13 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, struct ncclComm* p
   NCCLCHECKGOTO(devCommSetup(comm), ret, fail);
   timers[TIMER_INIT_CONNECT] = clockNano() -  timers[TIMER_INIT_CONNECT];
 
-  if (mscclEnabled()) {
+  if (mscclEnabled(comm)) {
     NCCLCHECK(mscclInit(comm));
-    mscclStatus& status = mscclGetStatus();
-    status.needsFence |= mscclHighestTransportType > TRANSPORT_P2P;
-    status.needsProxy |= mscclNeedsProxy;
+    if (comm->mscclCommStatus) {
+      mscclCommStatus& status = mscclGetCommStatus(comm);
+      status.needsFence |= mscclHighestTransportType > TRANSPORT_P2P;
+      status.needsProxy |= mscclNeedsProxy;
+    }
   }
 
   /* Local intra-node barrier */
@@ -1360,6 +1547,13 @@ NCCL_PARAM(CGAClusterSize, "CGA_CLUSTER_SIZE", NCCL_CONFIG_UNDEF_INT);
 // Match config max/minCTAs
 NCCL_PARAM(MaxCTAs, "MAX_CTAS", NCCL_CONFIG_UNDEF_INT);
 NCCL_PARAM(MinCTAs, "MIN_CTAS", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(SmBudget, "SM_BUDGET", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(Compression, "COMPRESSION", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(MaxCTAThreads, "MAX_CTA_THREADS", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(MemBudget, "MEM_BUDGET", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(LaunchPriority, "LAUNCH_PRIORITY", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(SmPartition, "SM_PARTITION", NCCL_CONFIG_UNDEF_INT);
+NCCL_PARAM(NetPriority, "NET_PRIORITY", NCCL_CONFIG_UNDEF_INT);
 #define NCCL_MAX_CGA_CLUSTER_SIZE 8
 
 #define NCCL_COMMINIT_FUNCNAME_LEN 128
@@ -1374,6 +1568,9 @@ struct ncclCommInitRankAsyncJob {
   // for ncclCommSplit
   struct ncclComm* parent;
   int color, key;
+  // for ncclCommShrink, the ranks of parent that are left out
+  int* excludeRanks;
+  int excludeCount;
   // name of the function calling
   char funcName[NCCL_COMMINIT_FUNCNAME_LEN];
 };
@@ -1431,6 +1628,153 @@ fail:
   goto exit;
 }
 
+// Every rank left in gets the same list, so the new ranks follow from it without talking to the failed ones
+static ncclResult_t commGetShrinkInfo(struct ncclComm* parent, int* excludeRanks, int excludeCount, int* nRanksRet, int* myRankRet, int* parentRanksRet) {
+  bool* excluded;
+  int nRanks = 0;
+  NCCLCHECK(ncclCalloc(&excluded, parent->nRanks));
+  for (int i = 0; i < excludeCount; i++) excluded[excludeRanks[i]] = true;
+  for (int r = 0; r < parent->nRanks; r++) {
+    if (excluded[r]) continue;
+    if (r == parent->rank) *myRankRet = nRanks;
+    parentRanksRet[nRanks++] = r;
+  }
+  *nRanksRet = nRanks;
+  free(excluded);
+  return ncclSuccess;
+}
+
+// Everything after the bootstrap of comm, on the thread of the job or in the background
+static ncclResult_t commInitRankFinish(struct ncclCommInitRankAsyncJob* job, uint64_t* timers, unsigned long long commIdHash) {
+  ncclComm_t comm = job->comm;
+  ncclResult_t res = ncclSuccess;
+  double sum_timers = 0;
+
+  NCCLCHECKGOTO(initTransportsRank(comm, job->parent, timers), res, fail);
+  NCCLCHECKGOTO(ncclTopoCalibrateModel(comm), res, fail);
+  NCCLCHECKGOTO(ncclTunerPluginLoad(comm), res, fail);
+  if (comm->tuner) {
+    NCCLCHECK(comm->tuner->init(comm->nRanks, comm->nNodes, ncclDebugLog, &comm->tunerContext));
+  }
+
+  // update communicator state
+  comm->initState = ncclSuccess;
+  timers[TIMER_INIT_TOTAL] = clockNano() - timers[TIMER_INIT_TOTAL];
+
+  // Trace this call for replay tool
+  if (job->parent) {
+    /* unlink child abort flag. */
+    __atomic_store_n(&job->parent->childAbortFlag, NULL, __ATOMIC_RELEASE);
+    TRACE_CALL("ncclCommSplit(%p, %d, %d, %p, %d, %d)", job->parent, job->color, job->key, comm, comm->rank, comm->nRanks);
+    INFO(NCCL_INIT, "%s comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx parent %p color %d key %d - Init COMPLETE", job->funcName,
+         comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, job->parent, job->color, job->key);
+  } else {
+    // the name for the replay tool is ncclCommInitRank for all the variations
+    TRACE_CALL("ncclCommInitRank(%p, %d, 0x%llx, %d, %d)", comm, comm->nRanks, commIdHash, comm->rank, comm->cudaDev);
+    INFO(NCCL_INIT, "%s comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx commId 0x%llx - Init COMPLETE", job->funcName,
+         comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, commIdHash);
+  }
+  for (int it = 1; it < TIMERS_INIT_COUNT; ++it)
+    sum_timers += (timers[it] / 1e9);
+  INFO(NCCL_INIT | NCCL_PROFILE,
+       "Init timings - %s: rank %d nranks %d total %.2f (kernels %.2f, alloc %.2f, bootstrap %.2f, allgathers %.2f, topo %.2f, graphs %.2f, "
+       "connections %.2f, rest %.2f)",
+       job->funcName, comm->rank, comm->nRanks,
+       timers[TIMER_INIT_TOTAL] / 1e9, timers[TIMER_INIT_KERNELS] / 1e9, timers[TIMER_INIT_ALLOC] / 1e9,
+       timers[TIMER_INIT_BOOTSTRAP] / 1e9, timers[TIMER_INIT_ALLGATHER] / 1e9, timers[TIMER_INIT_TOPO] / 1e9,
+       timers[TIMER_INIT_GRAPHS] / 1e9, timers[TIMER_INIT_CONNECT] / 1e9, timers[TIMER_INIT_TOTAL] / 1e9 - sum_timers);
+  return ncclSuccess;
+fail:
+  comm->initState = res;
+  return res;
+}
+
+// Children of blocking splits are returned once their bootstrap is set up, the rest of their
+// init runs in the background until they are first used
+NCCL_PARAM(CommSplitAsync, "COMM_SPLIT_ASYNC", 1);
+
+struct ncclSplitInit {
+  struct ncclCommInitRankAsyncJob job;
+  uint64_t timers[TIMERS_INIT_COUNT];
+};
+
+// Children still reading their parent, linked through splitInitNext
+static pthread_mutex_t splitInitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t splitInitCond = PTHREAD_COND_INITIALIZER;
+
+static void commSplitInitUnlink(struct ncclComm* parent, struct ncclComm* comm) {
+  pthread_mutex_lock(&splitInitLock);
+  for (struct ncclComm** c = &parent->splitInits; *c; c = &(*c)->splitInitNext) {
+    if (*c == comm) {
+      *c = comm->splitInitNext;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&splitInitCond);
+  pthread_mutex_unlock(&splitInitLock);
+}
+
+static void* commSplitInitMain(void* arg) {
+  struct ncclSplitInit* init = (struct ncclSplitInit*)arg;
+  ncclComm_t comm = init->job.comm;
+  struct ncclComm* parent = init->job.parent;
+  ncclResult_t res = ncclSuccess;
+
+  splitInitSelf = comm;
+  CUDACHECKGOTO(cudaSetDevice(init->job.cudaDev), res, exit);
+  NCCLCHECKGOTO(commInitRankFinish(&init->job, init->timers, 0), res, exit);
+exit:
+  splitInitSelf = NULL;
+  if (res != ncclSuccess) comm->initState = res;
+  commSplitInitUnlink(parent, comm);
+  (void)ncclCommSetAsyncError(comm, res);
+  free(init);
+  return NULL;
+}
+
+static ncclResult_t commSplitInitStart(struct ncclCommInitRankAsyncJob* job, uint64_t* timers) {
+  ncclComm_t comm = job->comm;
+  struct ncclSplitInit* init;
+  NCCLCHECK(ncclCalloc(&init, 1));
+  init->job = *job;
+  init->job.newcomm = NULL;
+  memcpy(init->timers, timers, sizeof(init->timers));
+  NCCLCHECK(ncclCommSetAsyncError(comm, ncclInProgress));
+  pthread_mutex_lock(&splitInitLock);
+  comm->splitInitNext = job->parent->splitInits;
+  job->parent->splitInits = comm;
+  pthread_mutex_unlock(&splitInitLock);
+  comm->splitInitPending = true;
+  if (pthread_create(&comm->splitInitThread, NULL, commSplitInitMain, init) != 0) {
+    WARN("Failed to create the init thread of comm %p rank %d", comm, comm->rank);
+    comm->splitInitPending = false;
+    commSplitInitUnlink(job->parent, comm);
+    free(init);
+    // Finish the init here instead
+    NCCLCHECK(ncclCommSetAsyncError(comm, ncclSuccess));
+    return commInitRankFinish(job, timers, 0);
+  }
+  ncclSetThreadName(comm->splitInitThread, "NCCL Split %2d", comm->cudaDev);
+  INFO(NCCL_INIT, "%s comm %p rank %d nranks %d parent %p color %d key %d - Init continues in the background", job->funcName,
+       comm, comm->rank, comm->nRanks, job->parent, job->color, job->key);
+  return ncclSuccess;
+}
+
+// The children of parent created by ncclCommSplit() must be done with it before it goes away
+static void commSplitInitsWait(struct ncclComm* parent) {
+  pthread_mutex_lock(&splitInitLock);
+  while (parent->splitInits) {
+    if (__atomic_load_n(parent->abortFlag, __ATOMIC_ACQUIRE)) {
+      for (struct ncclComm* c = parent->splitInits; c; c = c->splitInitNext) {
+        __atomic_store_n(c->abortFlag, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(c->abortFlagDev, 1, __ATOMIC_RELEASE);
+      }
+    }
+    pthread_cond_wait(&splitInitCond, &splitInitLock);
+  }
+  pthread_mutex_unlock(&splitInitLock);
+}
+
 static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
   struct ncclCommInitRankAsyncJob* job = (struct ncclCommInitRankAsyncJob*)job_;
   ncclComm_t comm = job->comm;
@@ -1440,7 +1784,6 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
   int cudaDev = job->cudaDev;
   int* parentRanks = NULL;
   int cudaArch;
-  double sum_timers = 0;
   uint64_t timers[TIMERS_INIT_COUNT] = {0};
   unsigned long long commIdHash;
 
@@ -1451,7 +1794,8 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
   cudaArch = 100*archMajor + 10*archMinor;
 
   timers[TIMER_INIT_KERNELS] = clockNano();
-  NCCLCHECK(ncclInitKernelsForDevice(cudaArch, &maxLocalSizeBytes));
+  // The stack sizes take a query per kernel, skip them unless they are used
+  NCCLCHECK(ncclInitKernelsForDevice(cudaDev, cudaArch, ncclParamSetStackSize() == 1 ? &maxLocalSizeBytes : NULL));
   // Set the maximum kernel stack size of all kernels to avoid
   // a CUDA memory reconfig on load (c.f. NVSHMEM issue)
   if (maxLocalSizeBytes > 0 && ncclParamSetStackSize() == 1) {
@@ -1462,7 +1806,11 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
 
   if (job->parent) {
     NCCLCHECKGOTO(ncclCalloc(&parentRanks, job->parent->nRanks), res, fail);
-    NCCLCHECKGOTO(commGetSplitInfo(comm, job->parent, job->color, job->key, &job->nranks, &job->myrank, parentRanks), res, fail);
+    if (job->excludeRanks) {
+      NCCLCHECKGOTO(commGetShrinkInfo(job->parent, job->excludeRanks, job->excludeCount, &job->nranks, &job->myrank, parentRanks), res, fail);
+    } else {
+      NCCLCHECKGOTO(commGetSplitInfo(comm, job->parent, job->color, job->key, &job->nranks, &job->myrank, parentRanks), res, fail);
+    }
     // Negative color does not create a new comm object. We needed to take part in the allgather, but we're done now.
     if (job->color == NCCL_SPLIT_NOCOLOR) goto exit;
     timers[TIMER_INIT_ALLOC] = clockNano();
@@ -1471,7 +1819,11 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
     // obtain a unique hash for the comm, re-using part of the parent's hash, commHash is a 64bit struct (=16 hex), add the color
     ncclUniqueId tmpId;
     memset(&tmpId,0,sizeof(ncclUniqueId));// must set 0 here to avoid undefined bits
-    snprintf((char*)&tmpId, NCCL_UNIQUE_ID_BYTES, "%016lx-%d", job->parent->commHash, job->color);
+    if (job->excludeRanks) {
+      snprintf((char*)&tmpId, NCCL_UNIQUE_ID_BYTES, "%016lx-shrink-%d", job->parent->commHash, job->nranks);
+    } else {
+      snprintf((char*)&tmpId, NCCL_UNIQUE_ID_BYTES, "%016lx-%d", job->parent->commHash, job->color);
+    }
     comm->commHash = getHash(tmpId.internal, NCCL_UNIQUE_ID_BYTES);
     INFO(NCCL_INIT, "%s comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx parent %p color %d key %d- Init START", job->funcName,
          comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, job->parent, job->color, job->key);
@@ -1495,39 +1847,12 @@ static ncclResult_t ncclCommInitRankFunc(struct ncclAsyncJob* job_) {
   }
   comm->cudaArch = cudaArch;
 
-  NCCLCHECKGOTO(initTransportsRank(comm, job->parent, timers), res, fail);
-  NCCLCHECKGOTO(ncclTunerPluginLoad(comm), res, fail);
-  if (comm->tuner) {
-    NCCLCHECK(comm->tuner->init(comm->nRanks, comm->nNodes, ncclDebugLog, &comm->tunerContext));
-  }
-
-  // update communicator state
-  comm->initState = ncclSuccess;
-  timers[TIMER_INIT_TOTAL] = clockNano() - timers[TIMER_INIT_TOTAL];
-
-  // Trace this call for replay tool
-  if (job->parent) {
-    /* unlink child abort flag. */
-    __atomic_store_n(&job->parent->childAbortFlag, NULL, __ATOMIC_RELEASE);
-    TRACE_CALL("ncclCommSplit(%p, %d, %d, %p, %d, %d)", job->parent, job->color, job->key, comm, comm->rank, comm->nRanks);
-    INFO(NCCL_INIT, "%s comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx parent %p color %d key %d - Init COMPLETE", job->funcName,
-         comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, job->parent, job->color, job->key);
+  if (job->parent && ncclParamCommSplitAsync() && comm->config.blocking && !comm->shareRes) {
+    NCCLCHECKGOTO(commSplitInitStart(job, timers), res, fail);
   } else {
-    // the name for the replay tool is ncclCommInitRank for all the variations
-    TRACE_CALL("ncclCommInitRank(%p, %d, 0x%llx, %d, %d)", comm, comm->nRanks, commIdHash, comm->rank, comm->cudaDev);
-    INFO(NCCL_INIT, "%s comm %p rank %d nranks %d cudaDev %d nvmlDev %d busId %lx commId 0x%llx - Init COMPLETE", job->funcName,
-         comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev, comm->busId, commIdHash);
+    NCCLCHECKGOTO(commInitRankFinish(job, timers, commIdHash), res, fail);
   }
-  sum_timers = 0.0;
-  for (int it = 1; it < TIMERS_INIT_COUNT; ++it)
-    sum_timers += (timers[it] / 1e9);
-  INFO(NCCL_INIT | NCCL_PROFILE,
-       "Init timings - %s: rank %d nranks %d total %.2f (kernels %.2f, alloc %.2f, bootstrap %.2f, allgathers %.2f, topo %.2f, graphs %.2f, "
-       "connections %.2f, rest %.2f)",
-       job->funcName, comm->rank, comm->nRanks,
-       timers[TIMER_INIT_TOTAL] / 1e9, timers[TIMER_INIT_KERNELS] / 1e9, timers[TIMER_INIT_ALLOC] / 1e9,
-       timers[TIMER_INIT_BOOTSTRAP] / 1e9, timers[TIMER_INIT_ALLGATHER] / 1e9, timers[TIMER_INIT_TOPO] / 1e9,
-       timers[TIMER_INIT_GRAPHS] / 1e9, timers[TIMER_INIT_CONNECT] / 1e9, timers[TIMER_INIT_TOTAL] / 1e9 - sum_timers);
+
 exit:
   if (job->newcomm) {
     /* assign it to user pointer. */
@@ -1556,6 +1881,13 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
   int minCTAsEnv;
   int maxCTAsEnv;
   int splitShareEnv;
+  int smBudgetEnv;
+  int compressionEnv;
+  int maxCTAThreadsEnv;
+  int memBudgetEnv;
+  int launchPriorityEnv;
+  int smPartitionEnv;
+  int netPriorityEnv;
 
   /* override configuration from env variable. */
   blockingEnv = ncclParamCommBlocking();
@@ -1590,12 +1922,50 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
   } else {
     comm->config.netName = NULL;
   }
+  // Strings of the config belong to the comm, children get their own copy of those of their parent
+  comm->config.mscclAlgoDir = comm->config.mscclAlgoDir ? strdup(comm->config.mscclAlgoDir) : NULL;
+  comm->config.mscclScheduler = comm->config.mscclScheduler ? strdup(comm->config.mscclScheduler) : NULL;
 
   splitShareEnv = ncclParamCommSplitShareResources();
   if (splitShareEnv != NCCL_CONFIG_UNDEF_INT) {
     comm->config.splitShare = splitShareEnv;
   }
 
+  smBudgetEnv = ncclParamSmBudget();
+  if (smBudgetEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.smBudget = smBudgetEnv;
+  }
+
+  compressionEnv = ncclParamCompression();
+  if (compressionEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.compression = compressionEnv;
+  }
+
+  maxCTAThreadsEnv = ncclParamMaxCTAThreads();
+  if (maxCTAThreadsEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.maxCTAThreads = maxCTAThreadsEnv;
+  }
+
+  memBudgetEnv = ncclParamMemBudget();
+  if (memBudgetEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.memBudget = memBudgetEnv;
+  }
+
+  launchPriorityEnv = ncclParamLaunchPriority();
+  if (launchPriorityEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.launchPriority = launchPriorityEnv;
+  }
+
+  smPartitionEnv = ncclParamSmPartition();
+  if (smPartitionEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.smPartition = smPartitionEnv;
+  }
+
+  netPriorityEnv = ncclParamNetPriority();
+  if (netPriorityEnv != NCCL_CONFIG_UNDEF_INT) {
+    comm->config.netPriority = netPriorityEnv;
+  }
+
   /* cap channels if needed */
   if (comm->config.minCTAs > MAXCHANNELS) {
     WARN("minCTAs %d is larger than #channels upper limit %d, cap it to %d", comm->config.minCTAs, MAXCHANNELS, MAXCHANNELS);
@@ -1617,6 +1987,43 @@ static ncclResult_t envConfigOverride(ncclComm_t comm) {
     comm->config.splitShare = 0;
   }
 
+  if (comm->config.smBudget < 0) {
+    WARN("smBudget %d is not a valid value, set it to 0 (no budget)", comm->config.smBudget);
+    comm->config.smBudget = 0;
+  }
+
+  if (comm->config.compression != ncclCompressionNone && comm->config.compression != ncclCompressionFp8) {
+    WARN("compression %d is not a valid value, set it to %d (none)", comm->config.compression, ncclCompressionNone);
+    comm->config.compression = ncclCompressionNone;
+  }
+
+  if (comm->config.maxCTAThreads != 0 && (comm->config.maxCTAThreads % WARP_SIZE != 0 ||
+      comm->config.maxCTAThreads < NCCL_MIN_NTHREADS || comm->config.maxCTAThreads > NCCL_MAX_NTHREADS)) {
+    WARN("maxCTAThreads %d is not a multiple of %d between %d and %d, set it to 0 (no cap)",
+      comm->config.maxCTAThreads, WARP_SIZE, NCCL_MIN_NTHREADS, NCCL_MAX_NTHREADS);
+    comm->config.maxCTAThreads = 0;
+  }
+
+  if (comm->config.memBudget < 0) {
+    WARN("memBudget %d is not a valid value, set it to 0 (no budget)", comm->config.memBudget);
+    comm->config.memBudget = 0;
+  }
+
+  if (comm->config.launchPriority > 0) {
+    WARN("launchPriority %d is not a valid value, set it to 0 (priority of the stream)", comm->config.launchPriority);
+    comm->config.launchPriority = 0;
+  }
+
+  if (comm->config.smPartition < 0) {
+    WARN("smPartition %d is not a valid value, set it to 0 (no partition)", comm->config.smPartition);
+    comm->config.smPartition = 0;
+  }
+
+  if (comm->config.netPriority < 0 || comm->config.netPriority >= NCCL_NET_PRIORITIES) {
+    WARN("netPriority %d is not a valid value 0 to %d, set it to 0 (bulk)", comm->config.netPriority, NCCL_NET_PRIORITIES-1);
+    comm->config.netPriority = 0;
+  }
+
   return ret;
 }
 
@@ -1657,6 +2064,22 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
       internalConfigPtr->maxCTAs = defaultConfig.maxCTAs;
       internalConfigPtr->netName = defaultConfig.netName;
     }
+
+    if (internalConfigPtr->version < NCCL_VERSION(2, 23, 4)) {
+      internalConfigPtr->smBudget = defaultConfig.smBudget;
+      internalConfigPtr->compression = defaultConfig.compression;
+      internalConfigPtr->maxCTAThreads = defaultConfig.maxCTAThreads;
+      internalConfigPtr->memBudget = defaultConfig.memBudget;
+      internalConfigPtr->launchPriority = defaultConfig.launchPriority;
+      internalConfigPtr->smPartition = defaultConfig.smPartition;
+      internalConfigPtr->trafficClass = defaultConfig.trafficClass;
+      internalConfigPtr->serviceLevel = defaultConfig.serviceLevel;
+      internalConfigPtr->mscclEnable = defaultConfig.mscclEnable;
+      internalConfigPtr->mscclAlgoDir = defaultConfig.mscclAlgoDir;
+      internalConfigPtr->mscclScheduler = defaultConfig.mscclScheduler;
+      internalConfigPtr->mscclScratchReserve = defaultConfig.mscclScratchReserve;
+      internalConfigPtr->netPriority = defaultConfig.netPriority;
+    }
   }
 
   /* check input config attributes, -1 means user-undefined and we should use default value from NCCL. */
@@ -1688,6 +2111,87 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
     goto fail;
   }
 
+  if (internalConfigPtr->smBudget != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->smBudget < 0) {
+    WARN("Invalid config smBudget attribute value %d", internalConfigPtr->smBudget);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->compression != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->compression != ncclCompressionNone &&
+      internalConfigPtr->compression != ncclCompressionFp8) {
+    WARN("Invalid config compression attribute value %d", internalConfigPtr->compression);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->maxCTAThreads != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->maxCTAThreads != 0 &&
+      (internalConfigPtr->maxCTAThreads % WARP_SIZE != 0 || internalConfigPtr->maxCTAThreads < NCCL_MIN_NTHREADS ||
+       internalConfigPtr->maxCTAThreads > NCCL_MAX_NTHREADS)) {
+    WARN("Invalid config maxCTAThreads attribute value %d", internalConfigPtr->maxCTAThreads);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->memBudget != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->memBudget < 0) {
+    WARN("Invalid config memBudget attribute value %d", internalConfigPtr->memBudget);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->launchPriority != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->launchPriority > 0) {
+    WARN("Invalid config launchPriority attribute value %d", internalConfigPtr->launchPriority);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->smPartition != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->smPartition < 0) {
+    WARN("Invalid config smPartition attribute value %d", internalConfigPtr->smPartition);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->trafficClass != NCCL_CONFIG_UNDEF_INT &&
+      (internalConfigPtr->trafficClass < -1 || internalConfigPtr->trafficClass > 255)) {
+    WARN("Invalid config trafficClass attribute value %d", internalConfigPtr->trafficClass);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->serviceLevel != NCCL_CONFIG_UNDEF_INT &&
+      (internalConfigPtr->serviceLevel < -1 || internalConfigPtr->serviceLevel > 15)) {
+    WARN("Invalid config serviceLevel attribute value %d", internalConfigPtr->serviceLevel);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->mscclEnable != NCCL_CONFIG_UNDEF_INT &&
+      (internalConfigPtr->mscclEnable < -1 || internalConfigPtr->mscclEnable > 1)) {
+    WARN("Invalid config mscclEnable attribute value %d", internalConfigPtr->mscclEnable);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->mscclScratchReserve != NCCL_CONFIG_UNDEF_INT && internalConfigPtr->mscclScratchReserve < -1) {
+    WARN("Invalid config mscclScratchReserve attribute value %d", internalConfigPtr->mscclScratchReserve);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  if (internalConfigPtr->netPriority != NCCL_CONFIG_UNDEF_INT &&
+      (internalConfigPtr->netPriority < 0 || internalConfigPtr->netPriority >= NCCL_NET_PRIORITIES)) {
+    WARN("Invalid config netPriority attribute value %d", internalConfigPtr->netPriority);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+
+  /* an empty directory or scheduler means the one of the process */
+  if (internalConfigPtr->mscclAlgoDir != NULL && internalConfigPtr->mscclAlgoDir[0] == '\0') {
+    internalConfigPtr->mscclAlgoDir = NULL;
+  }
+  if (internalConfigPtr->mscclScheduler != NULL && internalConfigPtr->mscclScheduler[0] == '\0') {
+    internalConfigPtr->mscclScheduler = NULL;
+  }
+
   /* default config value can be tuned on different platform. */
   NCCL_CONFIG_DEFAULT(internalConfigPtr, blocking, NCCL_CONFIG_UNDEF_INT, 1, "Blocking", "%d");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, cgaClusterSize, NCCL_CONFIG_UNDEF_INT, 4, "CGA cluster size", "%d");
@@ -1695,6 +2199,19 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
   NCCL_CONFIG_DEFAULT(internalConfigPtr, maxCTAs, NCCL_CONFIG_UNDEF_INT, MAXCHANNELS, "Max CTAs", "%d");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, netName, NCCL_CONFIG_UNDEF_PTR, NULL, "Net name", "%s");
   NCCL_CONFIG_DEFAULT(internalConfigPtr, splitShare, NCCL_CONFIG_UNDEF_INT, 0, "Split share", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, smBudget, NCCL_CONFIG_UNDEF_INT, 0, "SM budget", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, compression, NCCL_CONFIG_UNDEF_INT, ncclCompressionNone, "Compression", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, maxCTAThreads, NCCL_CONFIG_UNDEF_INT, 0, "Max CTA threads", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, memBudget, NCCL_CONFIG_UNDEF_INT, 0, "Memory budget", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, launchPriority, NCCL_CONFIG_UNDEF_INT, 0, "Launch priority", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, smPartition, NCCL_CONFIG_UNDEF_INT, 0, "SM partition", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, trafficClass, NCCL_CONFIG_UNDEF_INT, -1, "Traffic class", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, serviceLevel, NCCL_CONFIG_UNDEF_INT, -1, "Service level", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, mscclEnable, NCCL_CONFIG_UNDEF_INT, -1, "MSCCL enable", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, mscclAlgoDir, NCCL_CONFIG_UNDEF_PTR, NULL, "MSCCL algorithm directory", "%s");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, mscclScheduler, NCCL_CONFIG_UNDEF_PTR, NULL, "MSCCL scheduler", "%s");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, mscclScratchReserve, NCCL_CONFIG_UNDEF_INT, -1, "MSCCL scratch reserve", "%d");
+  NCCL_CONFIG_DEFAULT(internalConfigPtr, netPriority, NCCL_CONFIG_UNDEF_INT, 0, "Net priority", "%d");
 
   /* assign config to communicator */
   comm->config.blocking = internalConfigPtr->blocking;
@@ -1703,6 +2220,19 @@ static ncclResult_t parseCommConfig(ncclComm_t comm, ncclConfig_t *config) {
   comm->config.maxCTAs = internalConfigPtr->maxCTAs;
   comm->config.netName = internalConfigPtr->netName;
   comm->config.splitShare = internalConfigPtr->splitShare;
+  comm->config.smBudget = internalConfigPtr->smBudget;
+  comm->config.compression = internalConfigPtr->compression;
+  comm->config.maxCTAThreads = internalConfigPtr->maxCTAThreads;
+  comm->config.memBudget = internalConfigPtr->memBudget;
+  comm->config.launchPriority = internalConfigPtr->launchPriority;
+  comm->config.smPartition = internalConfigPtr->smPartition;
+  comm->config.trafficClass = internalConfigPtr->trafficClass;
+  comm->config.serviceLevel = internalConfigPtr->serviceLevel;
+  comm->config.mscclEnable = internalConfigPtr->mscclEnable;
+  comm->config.mscclAlgoDir = internalConfigPtr->mscclAlgoDir;
+  comm->config.mscclScheduler = internalConfigPtr->mscclScheduler;
+  comm->config.mscclScratchReserve = internalConfigPtr->mscclScratchReserve;
+  comm->config.netPriority = internalConfigPtr->netPriority;
 
   NCCLCHECKGOTO(envConfigOverride(comm), ret, fail);
 
@@ -1896,6 +2426,7 @@ ncclResult_t ncclCommSetAsyncError(ncclComm_t comm, ncclResult_t nextState) {
   }
 
   __atomic_store_n(&comm->asyncResult, nextState, __ATOMIC_RELEASE);
+  if (nextState != ncclSuccess && nextState != ncclInProgress) ncclAsyncErrorWake();
   return ncclSuccess;
 }
 
@@ -1974,6 +2505,10 @@ static ncclResult_t commDestroySync(struct ncclAsyncJob* job_) {
   TRACE(NCCL_INIT, "Destroying comm %p rank %d abortFlag %d asyncResult %d", comm, comm->rank, *comm->abortFlag, comm->asyncResult);
 
   if (comm->initState == ncclSuccess) {
+    if (mscclEnabled(comm) && comm->mscclCommStatus) {
+      // Resident MSCCL kernels would block the device synchronization of the teardown
+      NCCLCHECKGOTO(mscclPersistentStopDevice(comm->cudaDev), ret, fail);
+    }
     if ((ret = ncclStrongStreamSynchronize(&comm->sharedRes->hostStream)) != ncclSuccess) {
       WARN("commDestroySync: comm %p rank %d sync hostStream error %d\n", comm, comm->rank, ret);
     }
@@ -2009,7 +2544,9 @@ fail:
   goto exit;
 }
 
-static ncclResult_t commCleanup(ncclComm_t comm) {
+// Cleanup of the state a comm shares with the calling thread and the plugins. Runs on the thread
+// destroying the comm, since MSCCL keeps operations of the comm in state of that thread.
+static ncclResult_t commCleanupShared(ncclComm_t comm) {
   int savedDevice;
   int commDevice = comm->cudaDev;
 
@@ -2018,17 +2555,40 @@ static ncclResult_t commCleanup(ncclComm_t comm) {
     CUDACHECK(cudaSetDevice(commDevice));
   }
 
+  // Metrics time kernels without a tuner too
+  NCCLCHECK(ncclTunerFeedbackFree(comm));
   if (comm->tuner != NULL) {
     NCCLCHECK(comm->tuner->destroy(comm->tunerContext));
     NCCLCHECK(ncclTunerPluginUnload(comm));
   }
 
-  NCCLCHECK(commFree(comm));
+  if (mscclEnabled(comm)) {
+    NCCLCHECK(mscclTeardown(comm));
+  }
 
   if (savedDevice != commDevice) {
     CUDACHECK(cudaSetDevice(savedDevice));
   }
+  return ncclSuccess;
+}
 
+// Release the resources of a comm, safe to run for several comms at once
+static ncclResult_t commCleanupFree(ncclComm_t comm) {
+  int savedDevice;
+  int commDevice = comm->cudaDev;
+
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != commDevice) {
+    CUDACHECK(cudaSetDevice(commDevice));
+  }
+  NCCLCHECK(commFree(comm));
+  if (savedDevice != commDevice) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t commCleanupDone() {
 #if defined(ENABLE_NPKIT)
   // Dump NPKit events and shutdown
   const char* npkitDumpDir = getenv("NPKIT_DUMP_DIR");
@@ -2040,10 +2600,13 @@ static ncclResult_t commCleanup(ncclComm_t comm) {
   NCCLCHECK(NpKit::Shutdown());
 #endif
 
-  if (mscclEnabled()) {
-    NCCLCHECK(mscclTeardown());
-  }
+  return ncclSuccess;
+}
 
+static ncclResult_t commCleanup(ncclComm_t comm) {
+  NCCLCHECK(commCleanupShared(comm));
+  NCCLCHECK(commCleanupFree(comm));
+  NCCLCHECK(commCleanupDone());
   return ncclSuccess;
 }
 
@@ -2058,6 +2621,7 @@ ncclResult_t ncclCommFinalize(ncclComm_t comm) {
 
   /* wait comm ready before finalize. */
   NCCLCHECKGOTO(ncclCommEnsureReady(comm), ret, fail);
+  commSplitInitsWait(comm);
 
   /* prevent double finalize. */
   if (comm->finalizeCalled) {
@@ -2082,6 +2646,43 @@ fail:
   goto exit;
 }
 
+NCCL_PARAM(CommDestroyParallel, "COMM_DESTROY_PARALLEL", 1);
+
+struct commTeardownTask {
+  ncclComm_t comm;
+  int rank;
+  ncclResult_t (*fn)(ncclComm_t comm);
+  ncclResult_t ret;
+  pthread_t thread;
+  bool started;
+};
+
+static void* commTeardownMain(void* task_) {
+  struct commTeardownTask* task = (struct commTeardownTask*)task_;
+  task->ret = task->fn(task->comm);
+  return NULL;
+}
+
+// Run the task of each comm of the process, each on a thread of its own with NCCL_COMM_DESTROY_PARALLEL,
+// so that the syncs and frees of different GPUs overlap. Tasks whose thread fails to start run here.
+static void commTeardownRun(struct commTeardownTask* tasks, int nTasks) {
+  bool parallel = ncclParamCommDestroyParallel() && nTasks > 1;
+  for (int i = 0; i < nTasks; i++) {
+    tasks[i].started = parallel && pthread_create(&tasks[i].thread, NULL, commTeardownMain, tasks+i) == 0;
+    if (tasks[i].started) ncclSetThreadName(tasks[i].thread, "NCCL Teardown%2d", tasks[i].comm->cudaDev);
+  }
+  for (int i = 0; i < nTasks; i++) {
+    if (tasks[i].started) pthread_join(tasks[i].thread, NULL);
+    else commTeardownMain(tasks+i);
+  }
+}
+
+static ncclResult_t commDestroySyncComm(ncclComm_t comm) {
+  struct ncclCommFinalizeAsyncJob job;
+  job.comm = comm;
+  return commDestroySync((struct ncclAsyncJob*)&job);
+}
+
 static ncclResult_t commReclaim(struct ncclAsyncJob* job_) {
   struct ncclCommFinalizeAsyncJob* job = (struct ncclCommFinalizeAsyncJob*) job_;
   ncclComm_t comm = job->comm;
@@ -2089,7 +2690,6 @@ static ncclResult_t commReclaim(struct ncclAsyncJob* job_) {
 
   if (comm->intraComm0 != NULL) {
     int curRankCnt;
-    int curRank; /* Debug info */
     int intraRanks = comm->intraRanks;
     ncclComm_t intracomm0 = comm->intraComm0;
     int *finalizeRankCnt = &intracomm0->finalizeRankCnt;
@@ -2097,38 +2697,40 @@ static ncclResult_t commReclaim(struct ncclAsyncJob* job_) {
     assert(intracomm0 != NULL && finalizeRankCnt != NULL);
     curRankCnt = __atomic_add_fetch(finalizeRankCnt, 1, __ATOMIC_ACQ_REL);
     if (curRankCnt == intraRanks) {
-      ncclComm_t curIntraComm;
-      ncclComm_t nextIntraComm = intracomm0;
+      struct commTeardownTask* tasks = NULL;
+      int nTasks = 0;
+      NCCLCHECK(ncclCalloc(&tasks, intraRanks));
 
       /* this is  the last call to ncclCommDestroy/Abort, we need to make sure all comms
        * in the process have been finalized before we free local resources. */
-      while (nextIntraComm) {
-        curIntraComm = nextIntraComm;
-        curRank = curIntraComm->rank;
-        nextIntraComm = nextIntraComm->intraNext;
-
-        if (curIntraComm->finalizeCalled == false) {
-          struct ncclCommFinalizeAsyncJob job;
-          job.comm = curIntraComm;
-          /* every comm aborts, commDestroySync should not be blocked. */
-          if ((ret = commDestroySync((struct ncclAsyncJob*) &job)) != ncclSuccess)
-            WARN("commReclaim: comm %p (rank = %d) in commDestroySync, error %d", curIntraComm, curRank, ret);
-        }
+      for (ncclComm_t c = intracomm0; c; c = c->intraNext) {
+        /* every comm aborts, commDestroySync should not be blocked. */
+        if (c->finalizeCalled == false) tasks[nTasks++] = { c, c->rank, commDestroySyncComm };
+      }
+      commTeardownRun(tasks, nTasks);
+      for (int i = 0; i < nTasks; i++) {
+        if (tasks[i].ret != ncclSuccess)
+          WARN("commReclaim: comm %p (rank = %d) in commDestroySync, error %d", tasks[i].comm, tasks[i].rank, tasks[i].ret);
       }
 
       /* free local resources. */
-      nextIntraComm = intracomm0;
-      while (nextIntraComm) {
-        curIntraComm = nextIntraComm;
-        curRank = curIntraComm->rank;
-        nextIntraComm = nextIntraComm->intraNext;
-
-        if ((ret = commCleanup(curIntraComm)) != ncclSuccess) {
-          // We pass a freed pointer, but we don't dereference; we merely print its value, so it's OK.
-          // coverity[pass_freed_arg]
-          WARN("commReclaim: cleanup comm %p rank %d failed in destroy/abort, error %d", curIntraComm, curRank, ret);
+      nTasks = 0;
+      for (ncclComm_t c = intracomm0; c; c = c->intraNext) {
+        if ((ret = commCleanupShared(c)) != ncclSuccess) {
+          WARN("commReclaim: cleanup comm %p rank %d failed in destroy/abort, error %d", c, c->rank, ret);
+          continue;
         }
+        tasks[nTasks++] = { c, c->rank, commCleanupFree };
+      }
+      commTeardownRun(tasks, nTasks);
+      for (int i = 0; i < nTasks; i++) {
+        // We pass a freed pointer, but we don't dereference; we merely print its value, so it's OK.
+        // coverity[pass_freed_arg]
+        if ((ret = tasks[i].ret) == ncclSuccess) ret = commCleanupDone();
+        if (ret != ncclSuccess)
+          WARN("commReclaim: cleanup comm %p rank %d failed in destroy/abort, error %d", tasks[i].comm, tasks[i].rank, ret);
       }
+      free(tasks);
     }
   }
 
@@ -2156,9 +2758,12 @@ ncclResult_t ncclCommDestroy(ncclComm_t comm) {
     return ncclInvalidArgument;
   }
 
+  NCCLCHECK(ncclGroupImplicitFlush());
+  ncclAsyncErrorUnregister(comm);
   comm->destroyFlag = 1;
   /* init thread must be joined before we destroy the comm. */
   NCCLCHECK(ncclCommEnsureReady(comm));
+  commSplitInitsWait(comm);
   NCCLCHECKGOTO(ncclCalloc(&job, 1), res, fail);
   job->comm = comm;
   NCCLCHECKGOTO(ncclAsyncLaunch((struct ncclAsyncJob*)job, commReclaim, NULL, free, comm), res, fail);
@@ -2176,6 +2781,10 @@ ncclResult_t ncclCommAbort(ncclComm_t comm) {
     return ncclSuccess;
   }
 
+  // Pending collectives must leave the group of the thread before the comm goes
+  (void)ncclGroupImplicitFlush();
+  // Errors caused by the abort are not notified
+  ncclAsyncErrorUnregister(comm);
   // Ask anything that might still be running on the device to quit
   if (comm->childAbortFlag != nullptr) {
     __atomic_store_n(comm->childAbortFlag, 1, __ATOMIC_RELEASE);
@@ -2187,6 +2796,7 @@ ncclResult_t ncclCommAbort(ncclComm_t comm) {
   /* init thread must be joined before we destroy the comm,
    * and we should ignore the init error here. */
   (void)ncclCommEnsureReady(comm);
+  commSplitInitsWait(comm);
 
   // once the comm is ready, we can access ranks etc
   int rank = comm->rank, nranks = comm->nRanks, cudaDev = comm->cudaDev;
@@ -2223,23 +2833,21 @@ constexpr nvtxPayloadSchemaEntry_t CommSplitSchema[] = {
     {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "key", nullptr, 0, offsetof(NvtxParamsCommSplit, key)},
 };
 
-NCCL_API(ncclResult_t, ncclCommSplit, ncclComm_t comm, int color, int key, ncclComm_t *newcomm, ncclConfig_t *config);
-ncclResult_t ncclCommSplit(ncclComm_t comm, int color, int key, ncclComm_t *newcomm, ncclConfig_t *config) {
+static void commSplitJobFree(void* job_) {
+  struct ncclCommInitRankAsyncJob* job = (struct ncclCommInitRankAsyncJob*)job_;
+  free(job->excludeRanks);
+  free(job);
+}
+
+// Common to ncclCommSplit and ncclCommShrink, excludeRanks is owned by the job once it is launched
+static ncclResult_t commSplitLaunch(ncclComm_t comm, int color, int key, int* excludeRanks, int excludeCount, bool share,
+    ncclComm_t* newcomm, ncclConfig_t* config, const char* funcName) {
   struct ncclCommInitRankAsyncJob *job = NULL;
   struct ncclComm* childComm = NCCL_COMM_NULL;
   ncclResult_t res = ncclSuccess;
 
-  NvtxParamsCommSplit payload{comm->rank, comm->nRanks, comm->cudaDev, color, key};
-  NVTX3_FUNC_WITH_PARAMS(CommSplit, CommSplitSchema, payload)
-
-  int oldDev;
-  CUDACHECK(cudaGetDevice(&oldDev));
-
-  NCCLCHECK(ncclGroupStartInternal());
-  NCCLCHECKGOTO(CommCheck(comm, "CommSplit", "comm"), res, fail);
-  NCCLCHECKGOTO(PtrCheck(newcomm, "CommSplit", "newcomm"), res, fail);
-  NCCLCHECKGOTO(ncclCommEnsureReady(comm), res, fail);
-
+  int oldDev = -1;
+  CUDACHECKGOTO(cudaGetDevice(&oldDev), res, fail);
   CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), res, fail);
   /* *newcomm should be NCCL_COMM_NULL until comm split fully complete. */
   *newcomm = NCCL_COMM_NULL;
@@ -2248,7 +2856,8 @@ ncclResult_t ncclCommSplit(ncclComm_t comm, int color, int key, ncclComm_t *newc
   } else {
     NCCLCHECKGOTO(ncclCalloc(&childComm, 1), res, fail);
     childComm->startMagic = childComm->endMagic = NCCL_MAGIC;
-    if (comm->config.splitShare) {
+    childComm->shareRes = share;
+    if (share) {
       childComm->abortFlag = comm->abortFlag;
       childComm->abortFlagDev = comm->abortFlagDev;
       childComm->abortFlagRefCount = comm->abortFlagRefCount;
@@ -2279,24 +2888,96 @@ ncclResult_t ncclCommSplit(ncclComm_t comm, int color, int key, ncclComm_t *newc
   job->parent = comm;
   job->color = color;
   job->key = key;
+  job->excludeRanks = excludeRanks;
+  job->excludeCount = excludeCount;
   job->cudaDev = comm->cudaDev;
-  snprintf(job->funcName, NCCL_COMMINIT_FUNCNAME_LEN, "%s", __func__);
-  NCCLCHECKGOTO(ncclAsyncLaunch((struct ncclAsyncJob*)job, ncclCommInitRankFunc, NULL, free, comm), res, fail);
+  snprintf(job->funcName, NCCL_COMMINIT_FUNCNAME_LEN, "%s", funcName);
+  excludeRanks = NULL;
+  NCCLCHECKGOTO(ncclAsyncLaunch((struct ncclAsyncJob*)job, ncclCommInitRankFunc, NULL, commSplitJobFree, comm), res, fail);
 
 exit:
-  cudaSetDevice(oldDev);
-  (void)ncclGroupErrCheck(res);
-  NCCLCHECK(ncclGroupEndInternal());
+  if (oldDev != -1) cudaSetDevice(oldDev);
   return res;
 fail:
   if (childComm) {
-    if (comm && !comm->config.splitShare) {
+    if (!share) {
       free(childComm->abortFlag);
       if (childComm->abortFlagDev) ncclCudaHostFree(childComm->abortFlagDev);
       free(childComm->abortFlagRefCount);
     }
     free(childComm);
   }
+  free(excludeRanks);
+  if (newcomm) *newcomm = NULL;
+  goto exit;
+}
+
+NCCL_API(ncclResult_t, ncclCommSplit, ncclComm_t comm, int color, int key, ncclComm_t *newcomm, ncclConfig_t *config);
+ncclResult_t ncclCommSplit(ncclComm_t comm, int color, int key, ncclComm_t *newcomm, ncclConfig_t *config) {
+  ncclResult_t res = ncclSuccess;
+
+  NvtxParamsCommSplit payload{comm->rank, comm->nRanks, comm->cudaDev, color, key};
+  NVTX3_FUNC_WITH_PARAMS(CommSplit, CommSplitSchema, payload)
+
+  NCCLCHECK(ncclGroupStartInternal());
+  NCCLCHECKGOTO(CommCheck(comm, "CommSplit", "comm"), res, fail);
+  NCCLCHECKGOTO(PtrCheck(newcomm, "CommSplit", "newcomm"), res, fail);
+  NCCLCHECKGOTO(ncclCommEnsureReady(comm), res, fail);
+  NCCLCHECKGOTO(commSplitLaunch(comm, color, key, NULL, 0, comm->config.splitShare, newcomm, config, __func__), res, fail);
+
+exit:
+  (void)ncclGroupErrCheck(res);
+  NCCLCHECK(ncclGroupEndInternal());
+  return res;
+fail:
+  if (newcomm) *newcomm = NULL;
+  goto exit;
+}
+
+NCCL_API(ncclResult_t, ncclCommShrink, ncclComm_t comm, int* excludeRanksList, int excludeRanksCount, ncclComm_t* newcomm, ncclConfig_t* config, int shrinkFlags);
+ncclResult_t ncclCommShrink(ncclComm_t comm, int* excludeRanksList, int excludeRanksCount, ncclComm_t* newcomm, ncclConfig_t* config, int shrinkFlags) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  ncclResult_t res = ncclSuccess;
+  int* excludeRanks = NULL;
+  bool abortParent = shrinkFlags & NCCL_SHRINK_ABORT;
+
+  NCCLCHECK(ncclGroupStartInternal());
+  NCCLCHECKGOTO(CommCheck(comm, "CommShrink", "comm"), res, fail);
+  NCCLCHECKGOTO(PtrCheck(newcomm, "CommShrink", "newcomm"), res, fail);
+  if (excludeRanksCount > 0) NCCLCHECKGOTO(PtrCheck(excludeRanksList, "CommShrink", "excludeRanksList"), res, fail);
+  if (excludeRanksCount < 0 || excludeRanksCount >= comm->nRanks || (shrinkFlags & ~NCCL_SHRINK_ABORT)) {
+    WARN("CommShrink : invalid excludeRanksCount %d or shrinkFlags 0x%x", excludeRanksCount, shrinkFlags);
+    res = ncclInvalidArgument;
+    goto fail;
+  }
+  for (int i = 0; i < excludeRanksCount; i++) {
+    if (excludeRanksList[i] < 0 || excludeRanksList[i] >= comm->nRanks || excludeRanksList[i] == comm->rank) {
+      WARN("CommShrink : rank %d cannot exclude rank %d of %d", comm->rank, excludeRanksList[i], comm->nRanks);
+      res = ncclInvalidArgument;
+      goto fail;
+    }
+  }
+  if (abortParent) {
+    // Kernels of the parent may wait on the failed ranks forever. Only the device flag is set, so that the
+    // bootstrap of the parent still works for the child. The parent can only be aborted afterwards.
+    __atomic_store_n(comm->abortFlagDev, 1, __ATOMIC_RELEASE);
+    NCCLCHECKGOTO(ncclCommSplitInitJoin(comm), res, fail);
+    (void)ncclAsyncLaunchWait(comm);
+  } else {
+    NCCLCHECKGOTO(ncclCommEnsureReady(comm), res, fail);
+  }
+  NCCLCHECKGOTO(ncclCalloc(&excludeRanks, std::max(excludeRanksCount, 1)), res, fail);
+  if (excludeRanksCount > 0) memcpy(excludeRanks, excludeRanksList, excludeRanksCount*sizeof(int));
+  INFO(NCCL_INIT, "CommShrink comm %p rank %d nranks %d excludes %d ranks%s", comm, comm->rank, comm->nRanks, excludeRanksCount,
+       abortParent ? ", parent aborted" : "");
+  // The connections of the parent to the ranks left in are reused, unless the parent was stopped in the middle of its work
+  NCCLCHECKGOTO(commSplitLaunch(comm, 0, comm->rank, excludeRanks, excludeRanksCount, !abortParent, newcomm, config, __func__), res, fail);
+
+exit:
+  (void)ncclGroupErrCheck(res);
+  NCCLCHECK(ncclGroupEndInternal());
+  return res;
+fail:
   if (newcomm) *newcomm = NULL;
   goto exit;
 }
@@ -2329,8 +3010,7 @@ ncclResult_t ncclCommGetAsyncError(ncclComm_t comm, ncclResult_t *asyncError) {
   NCCLCHECK(CommCheck(comm, "ncclGetAsyncError", "comm"));
   NCCLCHECK(PtrCheck(asyncError, "ncclGetAsyncError", "asyncError"));
 
-  *asyncError = __atomic_load_n(&comm->asyncResult, __ATOMIC_ACQUIRE);
-  if (*asyncError == ncclSuccess && comm->proxyState) *asyncError = __atomic_load_n(&comm->proxyState->asyncResult, __ATOMIC_ACQUIRE);
+  NCCLCHECK(ncclAsyncErrorGet(comm, asyncError));
   return ncclSuccess;
 }
 
@@ -2374,6 +3054,56 @@ ncclResult_t ncclCommUserRank(const ncclComm_t comm, int* rank) {
   return ncclSuccess;
 }
 
+NCCL_API(ncclResult_t, ncclCommSetStreamLane, ncclComm_t comm, cudaStream_t stream, int lane);
+ncclResult_t ncclCommSetStreamLane(ncclComm_t comm, cudaStream_t stream, int lane) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+  ncclResult_t ret = ncclSuccess;
+  int saveDev;
+
+  NCCLCHECK(CommCheck(comm, "CommSetStreamLane", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (ncclGroupDepth != 0) {
+    // Tasks already enqueued in the group were given the lane of their stream
+    WARN("ncclCommSetStreamLane : cannot be called inside a group");
+    return ncclInvalidUsage;
+  }
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclLanesSetStream(comm, stream, lane), ret, exit);
+  TRACE_CALL("ncclCommSetStreamLane(%p,%p,%d)", comm, stream, lane);
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclCommGetMemoryUsage, const ncclComm_t comm, ncclMemoryUsage_t* usage);
+ncclResult_t ncclCommGetMemoryUsage(const ncclComm_t comm, ncclMemoryUsage_t* usage) {
+  NVTX3_FUNC_RANGE_IN(nccl_domain);
+
+  NCCLCHECK(CommCheck(comm, "CommGetMemoryUsage", "comm"));
+  NCCLCHECK(PtrCheck(usage, "CommGetMemoryUsage", "usage"));
+
+  NCCLCHECK(ncclCommEnsureReady(comm));
+
+  memset(usage, 0, sizeof(*usage));
+  if (comm->proxyState) {
+    usage->fifoDevBytes = __atomic_load_n(comm->proxyState->fifoBytes, __ATOMIC_RELAXED);
+    usage->fifoHostBytes = __atomic_load_n(comm->proxyState->fifoBytes+1, __ATOMIC_RELAXED);
+    usage->proxySharedDevBytes = __atomic_load_n(comm->proxyState->sharedBuffBytes, __ATOMIC_RELAXED);
+    usage->proxySharedHostBytes = __atomic_load_n(comm->proxyState->sharedBuffBytes+1, __ATOMIC_RELAXED);
+  }
+  if (comm->nvlsResources) usage->nvlsDevBytes = comm->nvlsResources->buffSize + comm->nvlsResources->creditSize;
+  if (comm->mscclCommStatus) usage->mscclScratchDevBytes = mscclGetCommStatus(comm).scratchBufferSize;
+#if defined(ENABLE_NPKIT)
+  NpKit::GetMemoryUsage(&usage->npkitDevBytes, &usage->npkitHostBytes);
+#endif
+  usage->totalDevBytes = usage->fifoDevBytes + usage->nvlsDevBytes + usage->proxySharedDevBytes +
+    usage->mscclScratchDevBytes + usage->npkitDevBytes;
+  usage->totalHostBytes = usage->fifoHostBytes + usage->proxySharedHostBytes + usage->npkitHostBytes;
+  return ncclSuccess;
+}
+
 NCCL_API(ncclResult_t, ncclMemAlloc, void **ptr, size_t size);
 ncclResult_t  ncclMemAlloc(void **ptr, size_t size) {
   NVTX3_FUNC_RANGE_IN(nccl_domain);
@@ -2476,6 +3206,7 @@ ncclResult_t  ncclMemFree(void *ptr) {
   NVTX3_FUNC_RANGE_IN(nccl_domain);
   ncclResult_t ret = ncclSuccess;
   int saveDevice;
+  int freeDev;
 
   CUDACHECK(cudaGetDevice(&saveDevice));
 #if CUDART_VERSION >= 12010
@@ -2491,6 +3222,8 @@ ncclResult_t  ncclMemFree(void *ptr) {
     CUCHECKGOTO(cuDeviceGetAttribute(&mcSupport, CU_DEVICE_ATTRIBUTE_MULTICAST_SUPPORTED, ptrDev), ret, fail);
 
   CUDACHECKGOTO(cudaSetDevice((int)ptrDev), ret, fail);
+  // Frees synchronize the device, which never finishes while a resident MSCCL kernel runs on it
+  NCCLCHECKGOTO(mscclPersistentStopDevice((int)ptrDev), ret, fail);
   if (mcSupport) {
     NCCLCHECKGOTO(ncclCuMemFree(ptr), ret, fail);
     goto exit;
@@ -2498,6 +3231,8 @@ ncclResult_t  ncclMemFree(void *ptr) {
 
 fallback:
 #endif
+  CUDACHECKGOTO(cudaGetDevice(&freeDev), ret, fail);
+  NCCLCHECKGOTO(mscclPersistentStopDevice(freeDev), ret, fail);
   CUDACHECKGOTO(cudaFree(ptr), ret, fail);
 
 exit:
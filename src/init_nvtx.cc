@@ -1,5 +1,6 @@
 #include "nccl.h"
 #include "nvtx.h"
+#include "msccl/msccl_struct.h"
 
 static constexpr const nvtxPayloadEnum_t NvtxEnumRedSchema[] = {
   {"Sum", ncclSum, 0},
@@ -9,6 +10,25 @@ static constexpr const nvtxPayloadEnum_t NvtxEnumRedSchema[] = {
   {"Avg", ncclAvg, 0}
 };
 
+static constexpr const nvtxPayloadEnum_t NvtxEnumMscclSelectReasonSchema[] = {
+  {"Chosen", mscclSelectChosen, 0},
+  {"Avg on integers", mscclSelectAvgOnIntegers, 0},
+  {"No algorithms loaded", mscclSelectNoCatalog, 0},
+  {"No algorithm matches", mscclSelectNoAlgo, 0},
+  {"NCCL predicted faster", mscclSelectNcclFaster, 0},
+  {"Not loaded during capture", mscclSelectNotLoaded, 0},
+  {"External scheduler", mscclSelectExternal, 0},
+  {"Algorithms for other rank counts", mscclSelectNRanksMismatch, 0},
+  {"Algorithms for the other placement", mscclSelectInPlaceMismatch, 0},
+  {"Size out of range", mscclSelectSizeOutOfRange, 0},
+  {"Count not divisible", mscclSelectCountNotDivisible, 0},
+  {"NVLS or CollNet unusable", mscclSelectResourceUnusable, 0},
+  {"Communicator or stream incompatible", mscclSelectIncompatible, 0},
+  {"Group has an unsupported call", mscclSelectGroupUnsupportedOp, 0},
+  {"Autotuning chose NCCL", mscclSelectAutotuneNccl, 0},
+  {"PreMulSum on an input the algorithm rewrites", mscclSelectPreMulUnsafe, 0}
+};
+
 // Must be called before the first call to any reduction operation.
 void initNvtxRegisteredEnums() {
   // Register schemas and strings
@@ -24,4 +44,17 @@ void initNvtxRegisteredEnums() {
   };
 
   nvtxPayloadEnumRegister(nvtx3::domain::get<nccl_domain>(), &eAttr);
+
+  constexpr const nvtxPayloadEnumAttr_t reasonAttr {
+    .fieldMask = NVTX_PAYLOAD_ENUM_ATTR_ENTRIES | NVTX_PAYLOAD_ENUM_ATTR_NUM_ENTRIES |
+      NVTX_PAYLOAD_ENUM_ATTR_SIZE | NVTX_PAYLOAD_ENUM_ATTR_SCHEMA_ID,
+    .name = NULL,
+    .entries = NvtxEnumMscclSelectReasonSchema,
+    .numEntries = std::extent<decltype(NvtxEnumMscclSelectReasonSchema)>::value,
+    .sizeOfEnum = sizeof(mscclSelectReason),
+    .schemaId = NVTX_PAYLOAD_ENTRY_MSCCL_SELECT_REASON,
+    .extension = nullptr
+  };
+
+  nvtxPayloadEnumRegister(nvtx3::domain::get<nccl_domain>(), &reasonAttr);
 }
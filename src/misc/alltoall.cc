@@ -0,0 +1,141 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "alltoall.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "device.h"
+#include "group.h"
+#include "param.h"
+
+NCCL_PARAM(AllToAllHier, "ALLTOALL_HIER", 1);
+// Bytes per rank pair from which the extra NVLink pass costs more than the saved network messages
+NCCL_PARAM(AllToAllHierMaxBytes, "ALLTOALL_HIER_MAX_BYTES", 256 << 10);
+
+// Only looks at the comm and the size, so that all ranks take the same path
+static bool hierEligible(struct ncclComm* comm, size_t rankBytes) {
+  if (ncclParamAllToAllHier() == 0 || rankBytes > (size_t)ncclParamAllToAllHierMaxBytes()) return false;
+  if (comm->nNodes == 1 || comm->localRanks == 1) return false;
+  // Each rank needs a peer of the same local rank on every node, and the blocks received from
+  // a node land contiguous in recvbuff only if its ranks are consecutive
+  for (int n = 0; n < comm->nNodes; n++) {
+    struct ncclNodeRanks* node = comm->nodeRanks+n;
+    if (node->localRanks != comm->localRanks) return false;
+    for (int l = 1; l < node->localRanks; l++) {
+      if (node->localRankToRank[l] != node->localRankToRank[0]+l) return false;
+    }
+  }
+  // The two steps have to be queued one after the other
+  return ncclGroupDepth == 0 && comm->config.blocking;
+}
+
+ncclResult_t ncclHierAllToAllRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  size_t rankBytes = count*ncclTypeSize(datatype);
+  int localRanks = comm->localRanks;
+  int node = comm->node;
+  struct ncclCudaGraph graph;
+  char* buff;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "AllToAll", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (!hierEligible(comm, rankBytes)) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  // Block l of node m holds what local rank l sends to the rank of this rail on node m
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->hierAllToAll, rankBytes*comm->nRanks, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  TRACE(NCCL_COLL, "AllToAll: rank %d %zu bytes per rank through %d rails of %d nodes", comm->rank, rankBytes, localRanks, comm->nNodes);
+
+  // Intra-node step, blocks for the ranks of this node go straight to recvbuff
+  NCCLCHECKGOTO(ncclGroupStart(), ret, exit);
+  for (int l = 0; l < localRanks; l++) {
+    int localPeer = comm->localRankToRank[l];
+    for (int m = 0; m < comm->nNodes; m++) {
+      int sendPeer = comm->nodeRanks[m].localRankToRank[l];
+      char* dst = m == node ? (char*)recvbuff + localPeer*rankBytes : buff + (m*localRanks + l)*rankBytes;
+      NCCLCHECKGOTO(ncclSend((const char*)sendbuff + sendPeer*rankBytes, count, datatype, localPeer, comm, stream), ret, group);
+      NCCLCHECKGOTO(ncclRecv(dst, count, datatype, localPeer, comm, stream), ret, group);
+    }
+  }
+group:
+  NCCLCHECK(ncclGroupEnd());
+  if (ret != ncclSuccess) goto exit;
+
+  // Inter-node step, one message per node along this rail
+  NCCLCHECKGOTO(ncclGroupStart(), ret, exit);
+  for (int m = 0; m < comm->nNodes; m++) {
+    if (m == node) continue;
+    int railPeer = comm->nodeRanks[m].localRankToRank[comm->localRank];
+    char* dst = (char*)recvbuff + comm->nodeRanks[m].localRankToRank[0]*rankBytes;
+    NCCLCHECKGOTO(ncclSend(buff + m*localRanks*rankBytes, count*localRanks, datatype, railPeer, comm, stream), ret, rail);
+    NCCLCHECKGOTO(ncclRecv(dst, count*localRanks, datatype, railPeer, comm, stream), ret, rail);
+  }
+rail:
+  NCCLCHECK(ncclGroupEnd());
+  if (ret != ncclSuccess) goto exit;
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->hierAllToAll, ncclCudaGraphValid(graph), stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclHierAllToAllDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->hierAllToAll);
+}
+
+ncclResult_t ncclAllToAllvDeviceRun(struct ncclComm* comm, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+    void* recvbuff, size_t* recvcounts, const size_t* rdispls, size_t maxcount, ncclDataType_t datatype, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  size_t eltSize = ncclTypeSize(datatype);
+  size_t slotBytes = NCCL_ALLTOALLV_HEADER_BYTES + alignUp(maxcount*eltSize, 16);
+  size_t slotsBytes;
+  struct ncclCudaGraph graph;
+  char* buff;
+  int saveDev;
+
+  NCCLCHECK(CommCheck(comm, "AllToAllvDevice", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (ncclGroupDepth != 0 || !comm->config.blocking) {
+    // The slots are unpacked by a kernel queued after the exchange
+    WARN("AllToAllvDevice : cannot be called inside a group or on a nonblocking communicator");
+    return ncclInvalidUsage;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("AllToAllvDevice : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (sendcounts == NULL) {
+    WARN("AllToAllvDevice : sendcounts argument is NULL");
+    return ncclInvalidArgument;
+  }
+  if (maxcount == 0) return ncclSuccess;
+  slotsBytes = slotBytes*comm->nRanks;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->allToAllv, 2*slotsBytes, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  TRACE(NCCL_COLL, "AllToAllvDevice: rank %d up to %zu elements per rank in slots of %zu bytes", comm->rank, maxcount, slotBytes);
+  NCCLCHECKGOTO(ncclLaunchAllToAllvPack(buff, sendbuff, sendcounts, sdispls, maxcount, eltSize, slotBytes, comm->nRanks, stream), ret, exit);
+  NCCLCHECKGOTO(ncclAllToAll(buff, buff+slotsBytes, slotBytes, ncclUint8, comm, stream), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchAllToAllvUnpack(recvbuff, recvcounts, rdispls, buff+slotsBytes, eltSize, slotBytes, comm->nRanks, stream), ret, exit);
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->allToAllv, ncclCudaGraphValid(graph), stream), ret, exit);
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclAllToAllvDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->allToAllv);
+}
@@ -0,0 +1,68 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "arena.h"
+#include "bitops.h"
+#include "checks.h"
+#include "param.h"
+#include <algorithm>
+
+// One cuMem granule on most GPUs
+NCCL_PARAM(DevArenaChunkSize, "DEV_ARENA_CHUNK_SIZE", 2 << 20);
+
+#define NCCL_DEV_ARENA_ALIGN 256
+
+ncclResult_t ncclDevArenaInit(struct ncclDevArena* arena) {
+  pthread_mutex_init(&arena->mutex, NULL);
+  arena->chunks = NULL;
+  arena->allocBytes = 0;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclDevArenaAlloc(struct ncclDevArena* arena, void** ptr, size_t size) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclDevArenaChunk* chunk;
+  *ptr = NULL;
+  if (size == 0) return ncclSuccess;
+  size = alignUp(size, NCCL_DEV_ARENA_ALIGN);
+
+  pthread_mutex_lock(&arena->mutex);
+  for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+    if (chunk->size - chunk->used >= size) break;
+  }
+  if (chunk == NULL) {
+    // Structures larger than a chunk get one of their own
+    size_t chunkSize = std::max(size, (size_t)ncclParamDevArenaChunkSize());
+    NCCLCHECKGOTO(ncclCalloc(&chunk, 1), ret, exit);
+    if ((ret = ncclCudaCalloc(&chunk->base, chunkSize)) != ncclSuccess) {
+      free(chunk);
+      goto exit;
+    }
+    chunk->size = chunkSize;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    INFO(NCCL_ALLOC, "Device arena %p grows by %zu bytes at %p", arena, chunkSize, chunk->base);
+  }
+  *ptr = chunk->base + chunk->used;
+  chunk->used += size;
+  arena->allocBytes += size;
+exit:
+  pthread_mutex_unlock(&arena->mutex);
+  return ret;
+}
+
+ncclResult_t ncclDevArenaDestroy(struct ncclDevArena* arena) {
+  struct ncclDevArenaChunk* chunk = arena->chunks;
+  if (chunk) INFO(NCCL_ALLOC, "Device arena %p frees %zu bytes of structures", arena, arena->allocBytes);
+  while (chunk) {
+    struct ncclDevArenaChunk* next = chunk->next;
+    NCCLCHECK(ncclCudaFree(chunk->base));
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  pthread_mutex_destroy(&arena->mutex);
+  return ncclSuccess;
+}
@@ -39,6 +39,8 @@ ncclResult_t CommCheck(struct ncclComm* comm, const char* opname, const char* pt
     WARN("Error: corrupted comm object detected");
     return ncclInvalidArgument;
   }
+  // Every call taking a comm sees the comm once its init is done, see NCCL_COMM_SPLIT_ASYNC
+  NCCLCHECK(ncclCommSplitInitJoin(comm));
   return ncclSuccess;
 }
 
@@ -67,6 +69,10 @@ ncclResult_t ArgsCheck(struct ncclInfo* info) {
     WARN("%s : reduction operation %d unknown to this communicator", info->opName, info->op);
     return ncclInvalidArgument;
   }
+  if (ncclNumOps <= info->op && info->comm->userRedOps[opIx].custom) {
+    WARN("%s : custom reduction operators are only supported by AllReduce and ReduceScatter", info->opName);
+    return ncclInvalidArgument;
+  }
 
   if (info->comm->checkPointers) {
     if ((info->coll == ncclFuncSend || info->coll == ncclFuncRecv)) {
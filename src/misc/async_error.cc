@@ -0,0 +1,196 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "alloc.h"
+#include "argcheck.h"
+#include "async_error.h"
+#include "checks.h"
+#include "comm.h"
+#include "net.h"
+#include "param.h"
+#include "msccl/msccl_lifecycle.h"
+
+NCCL_PARAM(AsyncErrorPollMs, "ASYNC_ERROR_POLL_MS", 1);
+
+// How a comm is told of its first asynchronous error
+struct ncclAsyncErrorNotify {
+  struct ncclComm* comm;
+  int fd;
+  ncclAsyncErrorCallback_t callback;
+  void* userData;
+  // Whether fd and callback were given the error, each can be set up after the other was
+  bool fdNotified, callbackNotified;
+};
+
+static std::mutex ncclAsyncErrorMutex;
+// Signaled by ncclAsyncErrorWake, and when a callback returns
+static std::condition_variable ncclAsyncErrorCond;
+static std::vector<struct ncclAsyncErrorNotify*> ncclAsyncErrorComms;
+// Notify whose callback is running, outside of the mutex
+static struct ncclAsyncErrorNotify* ncclAsyncErrorCalling;
+static bool ncclAsyncErrorWoken;
+static pthread_t ncclAsyncErrorThread;
+static bool ncclAsyncErrorThreadStarted;
+// Devices of ncclNetIb with a fatal async event
+static int ncclAsyncErrorNetFatalDevs[NCCL_MAX_NETDEVS];
+
+ncclResult_t ncclAsyncErrorGet(struct ncclComm* comm, ncclResult_t* asyncError) {
+  *asyncError = __atomic_load_n(&comm->asyncResult, __ATOMIC_ACQUIRE);
+  if (*asyncError == ncclSuccess && comm->proxyState) *asyncError = __atomic_load_n(&comm->proxyState->asyncResult, __ATOMIC_ACQUIRE);
+  if (*asyncError == ncclSuccess && comm->proxyState && comm->ncclNet == &ncclNetIb) {
+    for (int d = 0; d < NCCL_MAX_NETDEVS; d++) {
+      if (__atomic_load_n(ncclAsyncErrorNetFatalDevs+d, __ATOMIC_ACQUIRE) &&
+          __atomic_load_n(comm->proxyState->netConns+d, __ATOMIC_RELAXED)) {
+        *asyncError = ncclSystemError;
+        break;
+      }
+    }
+  }
+  if (*asyncError == ncclSuccess) NCCLCHECK(mscclCheckWatchdog(comm, asyncError));
+  return ncclSuccess;
+}
+
+void ncclAsyncErrorWake() {
+  {
+    std::lock_guard<std::mutex> lock(ncclAsyncErrorMutex);
+    if (ncclAsyncErrorComms.empty()) return;
+    ncclAsyncErrorWoken = true;
+  }
+  ncclAsyncErrorCond.notify_all();
+}
+
+void ncclAsyncErrorNetFatal(int netDev) {
+  if (netDev < 0 || netDev >= NCCL_MAX_NETDEVS) return;
+  __atomic_store_n(ncclAsyncErrorNetFatalDevs+netDev, 1, __ATOMIC_RELEASE);
+  ncclAsyncErrorWake();
+}
+
+static void* ncclAsyncErrorMain(void* arg) {
+  std::unique_lock<std::mutex> lock(ncclAsyncErrorMutex);
+  while (true) {
+    if (ncclAsyncErrorComms.empty()) {
+      ncclAsyncErrorCond.wait(lock, [] { return ncclAsyncErrorWoken || !ncclAsyncErrorComms.empty(); });
+    } else {
+      int64_t pollMs = std::max(ncclParamAsyncErrorPollMs(), (int64_t)1);
+      ncclAsyncErrorCond.wait_for(lock, std::chrono::milliseconds(pollMs), [] { return ncclAsyncErrorWoken; });
+    }
+    ncclAsyncErrorWoken = false;
+    // Each pass notifies one comm at most, then looks at the list again since it may have changed
+    for (size_t i = 0; i < ncclAsyncErrorComms.size(); i++) {
+      struct ncclAsyncErrorNotify* notify = ncclAsyncErrorComms[i];
+      bool notifyFd = notify->fd >= 0 && !notify->fdNotified;
+      bool notifyCallback = notify->callback && !notify->callbackNotified;
+      ncclResult_t error = ncclSuccess;
+      if (!notifyFd && !notifyCallback) continue;
+      if (ncclAsyncErrorGet(notify->comm, &error) != ncclSuccess) continue;
+      if (error == ncclSuccess || error == ncclInProgress) continue;
+      INFO(NCCL_INIT, "comm %p rank %d asynchronous error %d notified", notify->comm, notify->comm->rank, error);
+      if (notifyFd) {
+        uint64_t one = 1;
+        notify->fdNotified = true;
+        if (write(notify->fd, &one, sizeof(one)) != sizeof(one)) WARN("Unable to signal async error eventfd %d : %s", notify->fd, strerror(errno));
+      }
+      if (notifyCallback) {
+        notify->callbackNotified = true;
+        ncclAsyncErrorCalling = notify;
+        lock.unlock();
+        notify->callback(notify->comm, error, notify->userData);
+        lock.lock();
+        ncclAsyncErrorCalling = nullptr;
+        ncclAsyncErrorCond.notify_all();
+        ncclAsyncErrorWoken = true;
+        break;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// Notify of comm, created on first use. Caller must hold ncclAsyncErrorMutex.
+static ncclResult_t ncclAsyncErrorRegister(struct ncclComm* comm, struct ncclAsyncErrorNotify** notifyRet) {
+  for (struct ncclAsyncErrorNotify* notify : ncclAsyncErrorComms) {
+    if (notify->comm == comm) {
+      *notifyRet = notify;
+      return ncclSuccess;
+    }
+  }
+  if (!ncclAsyncErrorThreadStarted) {
+    PTHREADCHECK(pthread_create(&ncclAsyncErrorThread, NULL, ncclAsyncErrorMain, NULL), "pthread_create");
+    ncclSetThreadName(ncclAsyncErrorThread, "NCCL AsyncError");
+    PTHREADCHECK(pthread_detach(ncclAsyncErrorThread), "pthread_detach");
+    ncclAsyncErrorThreadStarted = true;
+  }
+  struct ncclAsyncErrorNotify* notify;
+  NCCLCHECK(ncclCalloc(&notify, 1));
+  notify->comm = comm;
+  notify->fd = -1;
+  ncclAsyncErrorComms.push_back(notify);
+  *notifyRet = notify;
+  return ncclSuccess;
+}
+
+void ncclAsyncErrorUnregister(struct ncclComm* comm) {
+  std::unique_lock<std::mutex> lock(ncclAsyncErrorMutex);
+  for (size_t i = 0; i < ncclAsyncErrorComms.size(); i++) {
+    struct ncclAsyncErrorNotify* notify = ncclAsyncErrorComms[i];
+    if (notify->comm != comm) continue;
+    // A callback may abort its own comm, from the thread that called it
+    if (!pthread_equal(pthread_self(), ncclAsyncErrorThread)) {
+      ncclAsyncErrorCond.wait(lock, [notify] { return ncclAsyncErrorCalling != notify; });
+    }
+    ncclAsyncErrorComms.erase(ncclAsyncErrorComms.begin() + i);
+    if (notify->fd >= 0) close(notify->fd);
+    free(notify);
+    return;
+  }
+}
+
+NCCL_API(ncclResult_t, ncclCommGetAsyncErrorFd, ncclComm_t comm, int* fd);
+ncclResult_t ncclCommGetAsyncErrorFd(ncclComm_t comm, int* fd) {
+  NCCLCHECK(CommCheck(comm, "CommGetAsyncErrorFd", "comm"));
+  NCCLCHECK(PtrCheck(fd, "CommGetAsyncErrorFd", "fd"));
+  struct ncclAsyncErrorNotify* notify;
+  {
+    std::lock_guard<std::mutex> lock(ncclAsyncErrorMutex);
+    NCCLCHECK(ncclAsyncErrorRegister(comm, &notify));
+    if (notify->fd < 0) {
+      notify->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (notify->fd < 0) {
+        WARN("Call to eventfd failed: %s", strerror(errno));
+        return ncclSystemError;
+      }
+    }
+    *fd = notify->fd;
+    ncclAsyncErrorWoken = true;
+  }
+  ncclAsyncErrorCond.notify_all();
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommSetAsyncErrorCallback, ncclComm_t comm, ncclAsyncErrorCallback_t callback, void* userData);
+ncclResult_t ncclCommSetAsyncErrorCallback(ncclComm_t comm, ncclAsyncErrorCallback_t callback, void* userData) {
+  NCCLCHECK(CommCheck(comm, "CommSetAsyncErrorCallback", "comm"));
+  {
+    std::lock_guard<std::mutex> lock(ncclAsyncErrorMutex);
+    struct ncclAsyncErrorNotify* notify;
+    NCCLCHECK(ncclAsyncErrorRegister(comm, &notify));
+    notify->callback = callback;
+    notify->userData = userData;
+    notify->callbackNotified = false;
+    ncclAsyncErrorWoken = true;
+  }
+  ncclAsyncErrorCond.notify_all();
+  return ncclSuccess;
+}
@@ -0,0 +1,150 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "bcast.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "group.h"
+#include "param.h"
+#include <algorithm>
+
+// Bytes of each ncclBroadcast of the pipeline, must be the same on all ranks
+NCCL_PARAM(BcastStagedChunkSize, "BCAST_STAGED_CHUNK_SIZE", 64 << 20);
+
+// Host memory is copied through the chunks, device and managed memory is used in place
+static bool bcastIsHost(const void* ptr) {
+  cudaPointerAttributes attr;
+  if (cudaPointerGetAttributes(&attr, ptr) != cudaSuccess) {
+    // Older runtimes fail on pageable memory
+    (void)cudaGetLastError();
+    return true;
+  }
+  return attr.type == cudaMemoryTypeHost || attr.type == cudaMemoryTypeUnregistered;
+}
+
+static ncclResult_t bcastStagedGet(struct ncclComm* comm, size_t size, cudaStream_t stream, struct ncclBcastStaged** staged, char** buff) {
+  struct ncclBcastStaged* b = comm->bcastStaged;
+  if (b == NULL) {
+    NCCLCHECK(ncclCalloc(&b, 1));
+    comm->bcastStaged = b;
+    CUDACHECK(cudaStreamCreateWithFlags(&b->copyStream, cudaStreamNonBlocking));
+    CUDACHECK(cudaEventCreateWithFlags(&b->fork, cudaEventDisableTiming));
+    CUDACHECK(cudaEventCreateWithFlags(&b->join, cudaEventDisableTiming));
+    for (int s = 0; s < 2; s++) {
+      CUDACHECK(cudaEventCreateWithFlags(&b->copied[s], cudaEventDisableTiming));
+      CUDACHECK(cudaEventCreateWithFlags(&b->sent[s], cudaEventDisableTiming));
+      CUDACHECK(cudaEventCreateWithFlags(&b->drained[s], cudaEventDisableTiming));
+    }
+  }
+  // Captured calls are refused, the chunks are always shared
+  NCCLCHECK(ncclScratchAcquire(&b->chunks, size, false, stream, buff));
+  *staged = b;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclBroadcastStagedRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, int root, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclBcastStaged* b = NULL;
+  char* chunks = NULL;
+  struct ncclCudaGraph graph;
+  size_t eltSize, chunkCount, nChunks;
+  bool sendHost, recvHost;
+  int saveDev;
+
+  NCCLCHECK(CommCheck(comm, "BroadcastStaged", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (ncclGroupDepth != 0 || !comm->config.blocking) {
+    // Each chunk is a broadcast of its own, waited for by the copies of the side stream
+    WARN("BroadcastStaged : cannot be called inside a group or on a nonblocking communicator");
+    return ncclInvalidUsage;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("BroadcastStaged : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (root < 0 || root >= comm->nRanks) {
+    WARN("BroadcastStaged : invalid root %d (root should be in the 0..%d range)", root, comm->nRanks);
+    return ncclInvalidArgument;
+  }
+  if (count == 0) return ncclSuccess;
+  if ((comm->rank == root && sendbuff == NULL) || recvbuff == NULL) {
+    WARN("BroadcastStaged : sendbuff or recvbuff argument is NULL");
+    return ncclInvalidArgument;
+  }
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  if (ncclCudaGraphValid(graph)) {
+    WARN("BroadcastStaged : cannot be captured in a CUDA graph");
+    return ncclInvalidUsage;
+  }
+  eltSize = ncclTypeSize(datatype);
+  chunkCount = std::max<size_t>(ncclParamBcastStagedChunkSize() / eltSize, 1);
+  nChunks = divUp(count, chunkCount);
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  sendHost = comm->rank == root && bcastIsHost(sendbuff);
+  recvHost = bcastIsHost(recvbuff);
+  if (sendHost || recvHost) {
+    NCCLCHECKGOTO(bcastStagedGet(comm, 2*alignUp(chunkCount*eltSize, 16), stream, &b, &chunks), ret, exit);
+    CUDACHECKGOTO(cudaEventRecord(b->fork, stream), ret, exit);
+    CUDACHECKGOTO(cudaStreamWaitEvent(b->copyStream, b->fork, 0), ret, exit);
+  }
+  TRACE(NCCL_COLL, "BroadcastStaged: rank %d root %d %zu elements in %zu chunks, send %s recv %s", comm->rank, root, count, nChunks,
+    sendHost ? "host" : "device", recvHost ? "host" : "device");
+
+  for (size_t k = 0; k < nChunks; k++) {
+    size_t offset = k*chunkCount*eltSize;
+    size_t len = std::min(chunkCount, count - k*chunkCount);
+    int s = k%2;
+    char* stage = b ? chunks + s*alignUp(chunkCount*eltSize, 16) : NULL;
+    const char* src = comm->rank == root ? (sendHost ? stage : (const char*)sendbuff + offset) : NULL;
+    char* dst = recvHost ? stage : (char*)recvbuff + offset;
+    if (sendHost) {
+      // The chunk is free once its broadcast two steps ago has been sent
+      CUDACHECKGOTO(cudaStreamWaitEvent(b->copyStream, b->sent[s], 0), ret, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync(stage, (const char*)sendbuff + offset, len*eltSize, cudaMemcpyHostToDevice, b->copyStream), ret, exit);
+      CUDACHECKGOTO(cudaEventRecord(b->copied[s], b->copyStream), ret, exit);
+      CUDACHECKGOTO(cudaStreamWaitEvent(stream, b->copied[s], 0), ret, exit);
+    } else if (recvHost) {
+      CUDACHECKGOTO(cudaStreamWaitEvent(stream, b->drained[s], 0), ret, exit);
+    }
+    NCCLCHECKGOTO(ncclBroadcast(src, dst, len, datatype, root, comm, stream), ret, exit);
+    if (b) CUDACHECKGOTO(cudaEventRecord(b->sent[s], stream), ret, exit);
+    if (recvHost && !(comm->rank == root && sendHost && sendbuff == recvbuff)) {
+      CUDACHECKGOTO(cudaStreamWaitEvent(b->copyStream, b->sent[s], 0), ret, exit);
+      CUDACHECKGOTO(cudaMemcpyAsync((char*)recvbuff + offset, stage, len*eltSize, cudaMemcpyDeviceToHost, b->copyStream), ret, exit);
+      CUDACHECKGOTO(cudaEventRecord(b->drained[s], b->copyStream), ret, exit);
+    }
+  }
+  if (b) {
+    CUDACHECKGOTO(cudaEventRecord(b->join, b->copyStream), ret, exit);
+    CUDACHECKGOTO(cudaStreamWaitEvent(stream, b->join, 0), ret, exit);
+    NCCLCHECKGOTO(ncclScratchRelease(&b->chunks, false, stream), ret, exit);
+  }
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclBroadcastStagedDestroy(struct ncclComm* comm) {
+  struct ncclBcastStaged* b = comm->bcastStaged;
+  if (b == NULL) return ncclSuccess;
+  CUDACHECK(cudaStreamSynchronize(b->copyStream));
+  NCCLCHECK(ncclScratchDestroy(&b->chunks));
+  CUDACHECK(cudaStreamDestroy(b->copyStream));
+  CUDACHECK(cudaEventDestroy(b->fork));
+  CUDACHECK(cudaEventDestroy(b->join));
+  for (int s = 0; s < 2; s++) {
+    CUDACHECK(cudaEventDestroy(b->copied[s]));
+    CUDACHECK(cudaEventDestroy(b->sent[s]));
+    CUDACHECK(cudaEventDestroy(b->drained[s]));
+  }
+  free(b);
+  comm->bcastStaged = NULL;
+  return ncclSuccess;
+}
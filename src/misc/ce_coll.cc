@@ -0,0 +1,194 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "ce_coll.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "bootstrap.h"
+#include "checks.h"
+#include "cudawrap.h"
+#include "graph.h"
+#include "group.h"
+#include "p2p.h"
+#include "param.h"
+#include "register.h"
+
+// 0 disables the copy engine path, 1 takes it when the comm has an SM budget below its channel
+// count, 2 takes it whenever the buffers allow it
+NCCL_PARAM(CeColl, "CE_COLL", 1);
+NCCL_PARAM(CeCollThreshold, "CE_COLL_THRESHOLD", 8 << 20);
+
+// What a rank tells the others about one call, addresses are the ones each peer has to use
+struct ncclCeCollInfo {
+  int ok;
+  uintptr_t recvAddrs[NCCL_MAX_LOCAL_RANKS];
+  uintptr_t flagAddrs[NCCL_MAX_LOCAL_RANKS];
+};
+
+// Map the flags of this rank to every local peer, once per comm
+static ncclResult_t ceCollSetup(struct ncclComm* comm, struct ncclCeColl* ce) {
+  struct ncclReg* reg;
+  NCCLCHECK(ncclCudaCalloc(&ce->flags, comm->localRanks));
+  NCCLCHECK(ncclRegister(comm, ce->flags, comm->localRanks*sizeof(uint32_t), &ce->flagsHandle));
+  NCCLCHECK(ncclRegFind(comm, ce->flags, comm->localRanks*sizeof(uint32_t), &reg));
+  if (reg == NULL) return ncclSuccess;
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (p == comm->localRank) continue;
+    int peer = comm->localRankToRank[p];
+    int regFlag;
+    uintptr_t offset;
+    uintptr_t* rmtAddr;
+    NCCLCHECK(ncclIpcLocalRegisterBuffer(comm, ce->flags, comm->localRanks*sizeof(uint32_t), &peer, 1, NCCL_IPC_SENDRECV, &regFlag, &offset, &rmtAddr));
+    if (regFlag == 0) return ncclSuccess;
+  }
+  ce->ready = 1;
+  return ncclSuccess;
+}
+
+// Peers copy straight into each other's recvbuff, so the checks only use the config, the size and
+// the topology, which every rank sees the same
+static ncclResult_t ceCollEligible(struct ncclComm* comm, size_t sendBytes, cudaStream_t stream, bool* eligible) {
+  *eligible = false;
+  int mode = ncclParamCeColl();
+  if (mode == 0 || sendBytes < (size_t)ncclParamCeCollThreshold()) return ncclSuccess;
+  if (mode == 1 && (comm->config.smBudget <= 0 || comm->config.smBudget >= comm->nChannels)) return ncclSuccess;
+  if (comm->nNodes != 1 || comm->localRanks != comm->nRanks || comm->nRanks == 1) return ncclSuccess;
+  if (ncclGroupDepth != 0 || !comm->config.blocking) return ncclSuccess;
+  if (CUPFN(cuStreamWriteValue32) == nullptr || CUPFN(cuStreamWaitValue32) == nullptr) return ncclSuccess;
+  // Replays of a graph would write the flag values of the captured call
+  struct ncclCudaGraph graph;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  if (ncclCudaGraphValid(graph)) return ncclSuccess;
+  for (int p = 0; p < comm->nRanks; p++) {
+    int p2p;
+    if (p == comm->rank) continue;
+    NCCLCHECK(ncclTopoCheckP2p(comm->topo, comm->rank, p, &p2p, NULL, NULL));
+    if (!p2p) return ncclSuccess;
+  }
+  *eligible = true;
+  return ncclSuccess;
+}
+
+// Fill the part of info about this rank, ok stays 0 when any peer cannot write recvbuff
+static ncclResult_t ceCollLocalInfo(struct ncclComm* comm, struct ncclCeColl* ce, void* recvbuff, size_t recvBytes,
+    struct ncclCeCollInfo* info) {
+  struct ncclReg* reg;
+  memset(info, 0, sizeof(*info));
+  if (ce->ready != 1) return ncclSuccess;
+  NCCLCHECK(ncclRegFind(comm, recvbuff, recvBytes, &reg));
+  if (reg == NULL) return ncclSuccess;
+  NCCLCHECK(ncclRegFind(comm, ce->flags, comm->localRanks*sizeof(uint32_t), &reg));
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (p == comm->localRank) continue;
+    int peer = comm->localRankToRank[p];
+    int regFlag;
+    uintptr_t offset;
+    uintptr_t* rmtAddr;
+    NCCLCHECK(ncclIpcLocalRegisterBuffer(comm, recvbuff, recvBytes, &peer, 1, NCCL_IPC_SENDRECV, &regFlag, &offset, &rmtAddr));
+    if (regFlag == 0) return ncclSuccess;
+    info->recvAddrs[p] = (uintptr_t)rmtAddr + offset;
+    // Peer p writes its own slot of the flags
+    info->flagAddrs[p] = reg->regIpcAddrs.hostPeerRmtAddrs[p] + ((uintptr_t)ce->flags - reg->addr) + p*sizeof(uint32_t);
+  }
+  info->ok = 1;
+  return ncclSuccess;
+}
+
+// Tell every peer the stream of this rank got to value, then wait for all of them to get there
+static ncclResult_t ceCollBarrier(struct ncclComm* comm, struct ncclCeColl* ce, uint32_t value, cudaStream_t stream) {
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (p == comm->localRank) continue;
+    CUCHECK(cuStreamWriteValue32((CUstream)stream, (CUdeviceptr)ce->infos[p].flagAddrs[comm->localRank], value, CU_STREAM_WRITE_VALUE_DEFAULT));
+  }
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (p == comm->localRank) continue;
+    CUCHECK(cuStreamWaitValue32((CUstream)stream, (CUdeviceptr)(ce->flags + p), value, CU_STREAM_WAIT_VALUE_GEQ));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ceCollRun(struct ncclComm* comm, bool allToAll, const void* sendbuff, void* recvbuff,
+    size_t sendBytes, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  bool eligible;
+  int localRanks = comm->localRanks;
+  int me = comm->localRank;
+  size_t recvBytes = sendBytes*comm->nRanks;
+  struct ncclCeColl* ce = comm->ceColl;
+  struct ncclCeCollInfo info;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, allToAll ? "AllToAll" : "AllGather", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  NCCLCHECK(ceCollEligible(comm, sendBytes, stream, &eligible));
+  if (!eligible) return ncclSuccess;
+  // Collectives held back for implicit aggregation come first on the stream
+  NCCLCHECK(ncclGroupImplicitFlush());
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  if (ce == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&ce, 1), ret, exit);
+    comm->ceColl = ce;
+    NCCLCHECKGOTO(ncclCalloc(&ce->infos, localRanks), ret, exit);
+    if (ceCollSetup(comm, ce) != ncclSuccess || ce->ready != 1) {
+      INFO(NCCL_COLL, "rank %d cannot map copy engine flags to its peers", comm->rank);
+      ce->ready = -1;
+    }
+  }
+  // An in-place AllToAll would have peers overwrite blocks this rank is still sending
+  if (allToAll && sendbuff == recvbuff) {
+    memset(&info, 0, sizeof(info));
+  } else {
+    NCCLCHECKGOTO(ceCollLocalInfo(comm, ce, recvbuff, recvBytes, &info), ret, exit);
+  }
+  ce->infos[me] = info;
+  NCCLCHECKGOTO(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, me, localRanks, ce->infos, sizeof(struct ncclCeCollInfo)), ret, exit);
+  for (int p = 0; p < localRanks; p++) {
+    if (ce->infos[p].ok == 0) goto exit;
+  }
+
+  ce->seq++;
+  TRACE(NCCL_COLL, "%s: rank %d seq %u %zu bytes per rank through the copy engines", allToAll ? "AllToAll" : "AllGather",
+    comm->rank, ce->seq, sendBytes);
+  // Peer buffers may still be in use by the work queued before the call on their streams
+  NCCLCHECKGOTO(ceCollBarrier(comm, ce, 2*ce->seq-1, stream), ret, exit);
+  // Start with a different peer on every rank so that the links are loaded evenly
+  for (int i = 0; i < localRanks; i++) {
+    int p = (me + i) % localRanks;
+    const char* src = (const char*)sendbuff + (allToAll ? comm->localRankToRank[p]*sendBytes : 0);
+    char* dst = (p == me ? (char*)recvbuff : (char*)ce->infos[p].recvAddrs[me]) + comm->rank*sendBytes;
+    if (p == me && dst == src) continue;
+    CUDACHECKGOTO(cudaMemcpyAsync(dst, src, sendBytes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+  }
+  // Flag writes fence the copies before them, peers then see all of their data
+  NCCLCHECKGOTO(ceCollBarrier(comm, ce, 2*ce->seq, stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclCeCollAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendBytes,
+    cudaStream_t stream, bool* done) {
+  return ceCollRun(comm, false, sendbuff, recvbuff, sendBytes, stream, done);
+}
+
+ncclResult_t ncclCeCollAllToAll(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendBytes,
+    cudaStream_t stream, bool* done) {
+  return ceCollRun(comm, true, sendbuff, recvbuff, sendBytes, stream, done);
+}
+
+ncclResult_t ncclCeCollDestroy(struct ncclComm* comm) {
+  struct ncclCeColl* ce = comm->ceColl;
+  if (ce == NULL) return ncclSuccess;
+  if (ce->flags) NCCLCHECK(ncclCudaFree(ce->flags));
+  free(ce->infos);
+  free(ce);
+  comm->ceColl = NULL;
+  return ncclSuccess;
+}
@@ -0,0 +1,96 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "collv.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "group.h"
+#include "nccl.h"
+
+#include "msccl/msccl_lifecycle.h"
+
+// Whether the blocks are all count elements and packed in rank order, NULL displs being packed
+static bool collVUniform(const size_t* counts, const size_t* displs, int nRanks) {
+  for (int r = 0; r < nRanks; r++) {
+    if (counts[r] != counts[0]) return false;
+    if (displs && displs[r] != r*counts[0]) return false;
+  }
+  return true;
+}
+
+ncclResult_t ncclAllGatherVRun(struct ncclComm* comm, const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+    const size_t* rdispls, ncclDataType_t datatype, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  size_t eltSize, displ = 0;
+
+  NCCLCHECK(CommCheck(comm, "AllGatherV", "comm"));
+  if (recvcounts == NULL) {
+    WARN("AllGatherV : recvcounts argument is NULL");
+    return ncclInvalidArgument;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("AllGatherV : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (collVUniform(recvcounts, rdispls, comm->nRanks)) {
+    return ncclAllGather(sendbuff, recvbuff, recvcounts[0], datatype, comm, stream);
+  }
+  // Schedulers see the counts, the internal one has no algorithms for them and falls back here
+  if (mscclAvailable() && !mscclIsCaller()) {
+    return mscclEnqueueCheck(sendbuff, nullptr, nullptr, recvbuff, recvcounts, rdispls,
+      recvcounts[comm->rank], datatype, 0, 0, ncclSum, mscclFuncAllGatherV, comm, stream);
+  }
+
+  // Every block is broadcast by its rank along the ring, the group runs them in one launch
+  eltSize = ncclTypeSize(datatype);
+  TRACE(NCCL_COLL, "AllGatherV: rank %d %zu elements of %d ranks through broadcasts", comm->rank, recvcounts[comm->rank], comm->nRanks);
+  NCCLCHECK(ncclGroupStart());
+  for (int r = 0; r < comm->nRanks; r++) {
+    size_t offset = rdispls ? rdispls[r] : displ;
+    displ += recvcounts[r];
+    if (recvcounts[r] == 0) continue;
+    NCCLCHECKGOTO(ncclBroadcast(sendbuff, (char*)recvbuff + offset*eltSize, recvcounts[r], datatype, r, comm, stream), ret, group);
+  }
+group:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+ncclResult_t ncclReduceScatterVRun(struct ncclComm* comm, const void* sendbuff, const size_t* sendcounts,
+    const size_t* sdispls, void* recvbuff, ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  size_t eltSize, displ = 0;
+
+  NCCLCHECK(CommCheck(comm, "ReduceScatterV", "comm"));
+  if (sendcounts == NULL) {
+    WARN("ReduceScatterV : sendcounts argument is NULL");
+    return ncclInvalidArgument;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("ReduceScatterV : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (collVUniform(sendcounts, sdispls, comm->nRanks)) {
+    return ncclReduceScatter(sendbuff, recvbuff, sendcounts[0], datatype, op, comm, stream);
+  }
+  if (mscclAvailable() && !mscclIsCaller()) {
+    return mscclEnqueueCheck(sendbuff, sendcounts, sdispls, recvbuff, nullptr, nullptr,
+      sendcounts[comm->rank], datatype, 0, 0, op, mscclFuncReduceScatterV, comm, stream);
+  }
+
+  // Every block is reduced to its rank along the ring, the group runs them in one launch
+  eltSize = ncclTypeSize(datatype);
+  TRACE(NCCL_COLL, "ReduceScatterV: rank %d %zu elements of %d ranks through reduces", comm->rank, sendcounts[comm->rank], comm->nRanks);
+  NCCLCHECK(ncclGroupStart());
+  for (int r = 0; r < comm->nRanks; r++) {
+    size_t offset = sdispls ? sdispls[r] : displ;
+    displ += sendcounts[r];
+    if (sendcounts[r] == 0) continue;
+    NCCLCHECKGOTO(ncclReduce((const char*)sendbuff + offset*eltSize, recvbuff, sendcounts[r], datatype, op, r, comm, stream), ret, group);
+  }
+group:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
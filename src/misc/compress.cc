@@ -0,0 +1,108 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "compress.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "device.h"
+#include "group.h"
+#include "param.h"
+
+// Bytes per rank below which the collectives are not worth compressing
+NCCL_PARAM(CompressThreshold, "COMPRESS_THRESHOLD", 1 << 20);
+
+static bool compressType(ncclDataType_t datatype) {
+#if !defined(__CUDA_FP8_TYPES_EXIST__)
+  return false;
+#endif
+  if (datatype == ncclFloat16 || datatype == ncclFloat32) return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  if (datatype == ncclBfloat16) return true;
+#endif
+  return false;
+}
+
+// The config and the counts match across ranks, so either all of them compress the call or none does
+static bool compressEligible(struct ncclComm* comm, size_t count, ncclDataType_t datatype) {
+  if (comm->config.compression != ncclCompressionFp8 || !compressType(datatype)) return false;
+  if (count*ncclTypeSize(datatype) < (size_t)ncclParamCompressThreshold()) return false;
+  // Only the network is slow enough for the kernels to pay off
+  if (comm->nNodes == 1) return false;
+  // The decompression has to be queued after the collective
+  return ncclGroupDepth == 0 && comm->config.blocking;
+}
+
+ncclResult_t ncclCompressAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+    ncclDataType_t datatype, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclCudaGraph graph;
+  size_t chunkBytes = ncclCompressedBytes(sendcount);
+  char* buff;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "AllGather", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (!compressEligible(comm, sendcount, datatype)) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  // Collectives held back for implicit aggregation come first on the stream
+  NCCLCHECK(ncclGroupImplicitFlush());
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->compress, chunkBytes*(comm->nRanks+1), ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  TRACE(NCCL_COLL, "AllGather: rank %d %zu elements per rank compressed to %zu bytes", comm->rank, sendcount, chunkBytes);
+  NCCLCHECKGOTO(ncclLaunchCompress(buff, sendbuff, sendcount, 1, datatype, stream), ret, exit);
+  NCCLCHECKGOTO(ncclAllGather(buff, buff+chunkBytes, chunkBytes, ncclUint8, comm, stream), ret, exit);
+  // The decompression reads what it gathered, it must not be held back
+  NCCLCHECKGOTO(ncclGroupImplicitFlush(), ret, exit);
+  // The chunk of this rank is decompressed too, so that all ranks end up with the same data
+  NCCLCHECKGOTO(ncclLaunchDecompress(recvbuff, buff+chunkBytes, sendcount, comm->nRanks, false, 1.0f, datatype, stream), ret, exit);
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->compress, ncclCudaGraphValid(graph), stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclCompressReduceScatter(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t recvcount,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclCudaGraph graph;
+  size_t chunkBytes = ncclCompressedBytes(recvcount);
+  char* buff;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "ReduceScatter", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (op != ncclSum && op != ncclAvg) return ncclSuccess;
+  if (!compressEligible(comm, recvcount, datatype)) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  NCCLCHECK(ncclGroupImplicitFlush());
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->compress, 2*chunkBytes*comm->nRanks, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  TRACE(NCCL_COLL, "ReduceScatter: rank %d %zu elements per rank compressed to %zu bytes", comm->rank, recvcount, chunkBytes);
+  // Every chunk is quantized once, by its sender, and summed in float by the rank it belongs to
+  NCCLCHECKGOTO(ncclLaunchCompress(buff, sendbuff, recvcount, comm->nRanks, datatype, stream), ret, exit);
+  NCCLCHECKGOTO(ncclAllToAll(buff, buff+chunkBytes*comm->nRanks, chunkBytes, ncclUint8, comm, stream), ret, exit);
+  NCCLCHECKGOTO(ncclGroupImplicitFlush(), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchDecompress(recvbuff, buff+chunkBytes*comm->nRanks, recvcount, comm->nRanks, true,
+      op == ncclAvg ? 1.0f/comm->nRanks : 1.0f, datatype, stream), ret, exit);
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->compress, ncclCudaGraphValid(graph), stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclCompressDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->compress);
+}
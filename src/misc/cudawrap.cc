@@ -68,6 +68,10 @@ DECLARE_CUDA_PFN(cuGetErrorName);
 /* enqueue.cc */
 DECLARE_CUDA_PFN(cuMemGetAddressRange);
 DECLARE_CUDA_PFN(cuLaunchKernel);
+/* redop.cc */
+DECLARE_CUDA_PFN(cuModuleLoadData);
+DECLARE_CUDA_PFN(cuModuleGetFunction);
+DECLARE_CUDA_PFN(cuModuleUnload);
 #if CUDA_VERSION >= 11080
 DECLARE_CUDA_PFN(cuLaunchKernelEx);
 #endif
@@ -95,6 +99,18 @@ DECLARE_CUDA_PFN(cuPointerGetAttribute);
 #if CUDA_VERSION >= 11070
 /* transport/collNet.cc/net.cc*/
 DECLARE_CUDA_PFN(cuMemGetHandleForAddressRange); // DMA-BUF support
+/* msccl_persistent.cc, group.cc */
+DECLARE_CUDA_PFN(cuStreamWriteValue32);
+DECLARE_CUDA_PFN(cuStreamWaitValue32);
+#endif
+#if CUDA_VERSION >= 12040
+/* greenctx.cc */
+DECLARE_CUDA_PFN(cuDeviceGetDevResource);
+DECLARE_CUDA_PFN(cuDevSmResourceSplitByCount);
+DECLARE_CUDA_PFN(cuDevResourceGenerateDesc);
+DECLARE_CUDA_PFN(cuGreenCtxCreate);
+DECLARE_CUDA_PFN(cuGreenCtxDestroy);
+DECLARE_CUDA_PFN(cuGreenCtxStreamCreate);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
@@ -151,6 +167,9 @@ static ncclResult_t cudaPfnFuncLoader(void) {
   LOAD_SYM(cuCtxSetCurrent, 1);
   LOAD_SYM(cuCtxGetDevice, 1);
   LOAD_SYM(cuLaunchKernel, 1);
+  LOAD_SYM(cuModuleLoadData, 1);
+  LOAD_SYM(cuModuleGetFunction, 1);
+  LOAD_SYM(cuModuleUnload, 1);
 #if CUDA_VERSION >= 11080
   LOAD_SYM(cuLaunchKernelEx, 1);
 #endif
@@ -171,6 +190,16 @@ static ncclResult_t cudaPfnFuncLoader(void) {
   LOAD_SYM(cuPointerGetAttribute, 1);
 #if CUDA_VERSION >= 11070
   LOAD_SYM(cuMemGetHandleForAddressRange, 1); // DMA-BUF support
+  LOAD_SYM(cuStreamWriteValue32, 1);
+  LOAD_SYM(cuStreamWaitValue32, 1);
+#endif
+#if CUDA_VERSION >= 12040
+  LOAD_SYM(cuDeviceGetDevResource, 1);
+  LOAD_SYM(cuDevSmResourceSplitByCount, 1);
+  LOAD_SYM(cuDevResourceGenerateDesc, 1);
+  LOAD_SYM(cuGreenCtxCreate, 1);
+  LOAD_SYM(cuGreenCtxDestroy, 1);
+  LOAD_SYM(cuGreenCtxStreamCreate, 1);
 #endif
 #if CUDA_VERSION >= 12010
 /* NVSwitch Multicast support */
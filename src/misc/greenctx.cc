@@ -0,0 +1,84 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "greenctx.h"
+#include "alloc.h"
+#include "checks.h"
+
+static ncclResult_t greenCtxInit(struct ncclComm* comm) {
+#if CUDART_VERSION >= 12040
+  int driverVersion;
+  NCCLCHECK(ncclCudaDriverVersion(&driverVersion));
+  if (driverVersion < 12040 || CUPFN(cuGreenCtxCreate) == NULL || comm->compCap < 90) {
+    WARN("smPartition %d needs green contexts, available from CUDA 12.4 on sm90 and later", comm->config.smPartition);
+    return ncclInvalidUsage;
+  }
+  struct ncclGreenCtx* g;
+  CUdevice dev;
+  CUdevResource sms, part, rest;
+  CUdevResourceDesc desc;
+  unsigned int nGroups = 1;
+  NCCLCHECK(ncclCalloc(&g, 1));
+  comm->greenCtx = g;
+  CUCHECK(cuDeviceGet(&dev, comm->cudaDev));
+  CUCHECK(cuDeviceGetDevResource(dev, &sms, CU_DEV_RESOURCE_TYPE_SM));
+  // The count is rounded up to the SM granularity of the architecture
+  CUCHECK(cuDevSmResourceSplitByCount(&part, &nGroups, &sms, &rest, 0, comm->config.smPartition));
+  if (nGroups == 0) {
+    WARN("smPartition %d cannot be carved out of the %u SMs of the device", comm->config.smPartition, sms.sm.smCount);
+    return ncclInvalidUsage;
+  }
+  CUCHECK(cuDevResourceGenerateDesc(&desc, &part, 1));
+  CUCHECK(cuGreenCtxCreate(&g->ctx, desc, dev, CU_GREEN_CTX_DEFAULT_STREAM));
+  CUCHECK(cuGreenCtxStreamCreate(&g->stream, g->ctx, CU_STREAM_NON_BLOCKING, 0));
+  CUDACHECK(cudaEventCreateWithFlags(&g->fork, cudaEventDisableTiming));
+  CUDACHECK(cudaEventCreateWithFlags(&g->join, cudaEventDisableTiming));
+  INFO(NCCL_INIT, "comm %p rank %d kernels run on a green context of %u SMs", comm, comm->rank, part.sm.smCount);
+  return ncclSuccess;
+#else
+  WARN("smPartition %d needs green contexts, NCCL was built without them (CUDA < 12.4)", comm->config.smPartition);
+  return ncclInvalidUsage;
+#endif
+}
+
+ncclResult_t ncclGreenCtxFork(struct ncclComm* comm, cudaStream_t stream, bool captured, cudaStream_t* launchStream) {
+  *launchStream = stream;
+  // Captured launches stay on the user stream, the graph decides where they run
+  if (comm->config.smPartition == 0 || captured) return ncclSuccess;
+#if CUDART_VERSION >= 12040
+  if (comm->greenCtx == NULL) NCCLCHECK(greenCtxInit(comm));
+  struct ncclGreenCtx* g = comm->greenCtx;
+  CUDACHECK(cudaEventRecord(g->fork, stream));
+  CUDACHECK(cudaStreamWaitEvent((cudaStream_t)g->stream, g->fork, 0));
+  *launchStream = (cudaStream_t)g->stream;
+  return ncclSuccess;
+#else
+  return greenCtxInit(comm);
+#endif
+}
+
+ncclResult_t ncclGreenCtxJoin(struct ncclComm* comm, cudaStream_t stream, cudaStream_t launchStream) {
+  if (launchStream == stream) return ncclSuccess;
+  CUDACHECK(cudaEventRecord(comm->greenCtx->join, launchStream));
+  CUDACHECK(cudaStreamWaitEvent(stream, comm->greenCtx->join, 0));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclGreenCtxDestroy(struct ncclComm* comm) {
+  struct ncclGreenCtx* g = comm->greenCtx;
+  if (g == NULL) return ncclSuccess;
+#if CUDART_VERSION >= 12040
+  if (g->stream) {
+    CUDACHECK(cudaStreamSynchronize((cudaStream_t)g->stream));
+    CUDACHECK(cudaStreamDestroy((cudaStream_t)g->stream));
+  }
+  if (g->ctx) CUCHECK(cuGreenCtxDestroy(g->ctx));
+#endif
+  if (g->fork) CUDACHECK(cudaEventDestroy(g->fork));
+  if (g->join) CUDACHECK(cudaEventDestroy(g->join));
+  free(g);
+  comm->greenCtx = NULL;
+  return ncclSuccess;
+}
@@ -0,0 +1,313 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "hierpat.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "device.h"
+#include "enqueue.h"
+#include "graph.h"
+#include "group.h"
+#include "info.h"
+#include "lanes.h"
+#include "param.h"
+
+#include <algorithm>
+
+// 1 runs it whenever the topology allows, 2 only when the model expects it to beat the regular algorithms
+NCCL_PARAM(PatHier, "PAT_HIER", 2);
+// Bytes per rank above which the scratch would grow too large for what the log steps save
+NCCL_PARAM(PatHierMaxBytes, "PAT_HIER_MAX_BYTES", 4 << 20);
+// Run the NVLink step on the NVLS kernels when the switch can reduce or multicast it
+NCCL_PARAM(PatHierNvls, "PAT_HIER_NVLS", 1);
+
+static bool hierPatType(ncclDataType_t datatype) {
+  switch (datatype) {
+  case ncclInt8: case ncclUint8: case ncclInt32: case ncclUint32: case ncclInt64: case ncclUint64:
+  case ncclFloat16: case ncclFloat32: case ncclFloat64:
+    return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+// Best time of the regular algorithms for the call, -1 when none of them can run it
+static ncclResult_t flatTime(struct ncclComm* comm, ncclFunc_t func, size_t nBytes, float* time) {
+  *time = -1.0;
+  for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) {
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      float t;
+      NCCLCHECK(ncclTopoGetAlgoTime(comm, func, a, p, nBytes, 1, &t));
+      if (t >= 0 && (*time < 0 || t < *time)) *time = t;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Whether the NVLink step can go through the NVLS kernels: every local rank heads one NVLS channel,
+// so slice h of the kernels is the row of local rank headLocal[h]
+static bool hierPatNvls(struct ncclComm* comm, cudaStream_t stream, int* headLocal) {
+  if (!ncclParamPatHierNvls() || !comm->nvlsSupport || comm->nvlsChannels == 0) return false;
+  if (comm->channels[0].nvls.nHeads != comm->localRanks) return false;
+  // The kernels split a block of NCCL_MAX_NTHREADS threads and run on channels from 0, outside lanes
+  if (comm->config.maxCTAThreads > 0 && comm->config.maxCTAThreads < NCCL_MAX_NTHREADS) return false;
+  if (ncclLaneOfStream(comm, stream) != NULL) return false;
+  for (int h = 0; h < comm->localRanks; h++) headLocal[h] = comm->rankToLocalRank[comm->nvlsHeads[h]];
+  return true;
+}
+
+// Every rank has the same topology and tuning model, so they all take the same path without agreeing on it
+static ncclResult_t hierPatEligible(struct ncclComm* comm, ncclFunc_t func, size_t rankBytes, bool nvls, bool* eligible) {
+  *eligible = false;
+  int mode = ncclParamPatHier();
+  if (mode == 0 || rankBytes == 0 || rankBytes > (size_t)ncclParamPatHierMaxBytes()) return ncclSuccess;
+  if (comm->nNodes == 1 || comm->localRanks == 1 || comm->localRanks > NCCL_MAX_LOCAL_RANKS) return ncclSuccess;
+  // Rails need a rank of every local index on each node, and the blocks of a node land in
+  // recvbuff one after the other only if node n holds ranks n*localRanks and up
+  for (int n = 0; n < comm->nNodes; n++) {
+    struct ncclNodeRanks* node = comm->nodeRanks+n;
+    if (node->localRanks != comm->localRanks) return ncclSuccess;
+    for (int l = 0; l < node->localRanks; l++) {
+      if (node->localRankToRank[l] != n*comm->localRanks+l) return ncclSuccess;
+    }
+  }
+  // The steps have to be queued one after the other
+  if (ncclGroupDepth != 0 || !comm->config.blocking) return ncclSuccess;
+  if (mode == 2) {
+    float hierTime, regularTime;
+    size_t nBytes = rankBytes*comm->nRanks;
+    NCCLCHECK(ncclTopoGetHierPatTime(comm, nBytes, nvls, &hierTime));
+    NCCLCHECK(flatTime(comm, func, nBytes, &regularTime));
+    if (hierTime < 0 || (regularTime >= 0 && hierTime >= regularTime)) return ncclSuccess;
+  }
+  // Collectives held back for implicit aggregation come first on the stream
+  NCCLCHECK(ncclGroupImplicitFlush());
+  *eligible = true;
+  return ncclSuccess;
+}
+
+// Split the cnt blocks of a rail from block first, wrapping around nNodes, into contiguous pieces
+static int railPieces(int first, int cnt, int nNodes, int starts[2], int lens[2]) {
+  starts[0] = first % nNodes;
+  lens[0] = std::min(cnt, nNodes-starts[0]);
+  if (lens[0] == cnt) return 1;
+  starts[1] = 0;
+  lens[1] = cnt-lens[0];
+  return 2;
+}
+
+// One log step along the rail: send cnt blocks of rail from sendFirst to the rank of node sendNode
+// and receive cnt blocks from node recvNode, into their place from recvFirst, or one after the
+// other into packed when it is set. Both sides split the blocks at the same wraparound.
+static ncclResult_t railStep(struct ncclComm* comm, char* rail, size_t blockBytes, int cnt, int sendNode, int sendFirst,
+    int recvNode, int recvFirst, char* packed, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  int sendPeer = comm->nodeRanks[sendNode].localRankToRank[comm->localRank];
+  int recvPeer = comm->nodeRanks[recvNode].localRankToRank[comm->localRank];
+  int starts[2], lens[2], n, off = 0;
+
+  NCCLCHECK(ncclGroupStart());
+  n = railPieces(sendFirst, cnt, comm->nNodes, starts, lens);
+  for (int i = 0; i < n; i++) {
+    NCCLCHECKGOTO(ncclSend(rail + starts[i]*blockBytes, lens[i]*blockBytes, ncclInt8, sendPeer, comm, stream), ret, exit);
+  }
+  n = railPieces(recvFirst, cnt, comm->nNodes, starts, lens);
+  for (int i = 0; i < n; i++) {
+    char* dst = packed ? packed + off*blockBytes : rail + starts[i]*blockBytes;
+    NCCLCHECKGOTO(ncclRecv(dst, lens[i]*blockBytes, ncclInt8, recvPeer, comm, stream), ret, exit);
+    off += lens[i];
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+// Each local rank sends block l of its rows to local rank l and receives the row of its peers
+// into row l of rows
+static ncclResult_t nvlStep(struct ncclComm* comm, char* const* sendRows, char* rows, size_t rowBytes, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int l = 0; l < comm->localRanks; l++) {
+    if (l == comm->localRank) continue;
+    int localPeer = comm->localRankToRank[l];
+    NCCLCHECKGOTO(ncclSend(sendRows[l], rowBytes, ncclInt8, localPeer, comm, stream), ret, exit);
+    NCCLCHECKGOTO(ncclRecv(rows + l*rowBytes, rowBytes, ncclInt8, localPeer, comm, stream), ret, exit);
+  }
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+// NVLink step on the NVLS kernels, between the local ranks only: the switch multicasts sendbuff
+// to slice headRank of recvbuff, or reduces slice headRank of sendbuff into recvbuff
+static ncclResult_t nvlsStep(struct ncclComm* comm, ncclFunc_t func, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  bool allGather = func == ncclFuncAllGather;
+  struct ncclInfo info = { func, allGather ? "AllGather" : "ReduceScatter",
+    sendbuff, recvbuff, count, datatype, op, 0, comm, stream, /* Args */
+    allGather ? ALLGATHER_CHUNKSTEPS : REDUCESCATTER_CHUNKSTEPS, allGather ? ALLGATHER_SLICESTEPS : REDUCESCATTER_SLICESTEPS };
+  info.nvlsNode = true;
+  NCCLCHECK(ncclGroupStart());
+  NCCLCHECKGOTO(ncclEnqueueCheck(&info), ret, exit);
+exit:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+ncclResult_t ncclHierPatAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+    ncclDataType_t datatype, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  bool eligible;
+  size_t rankBytes = sendcount*ncclTypeSize(datatype);
+  int nNodes = comm->nNodes;
+  int localRanks = comm->localRanks;
+  int node = comm->node;
+  size_t rowBytes = nNodes*rankBytes;
+  char* buff;
+  char* rail;
+  char* sendRows[NCCL_MAX_LOCAL_RANKS];
+  int headLocal[NCCL_MAX_LOCAL_RANKS];
+  int rowOf[NCCL_MAX_LOCAL_RANKS];
+  bool nvls;
+  struct ncclCudaGraph graph;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "AllGather", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (comm->localRanks > NCCL_MAX_LOCAL_RANKS) return ncclSuccess;
+  nvls = hierPatNvls(comm, stream, headLocal);
+  NCCLCHECK(hierPatEligible(comm, ncclFuncAllGather, rankBytes, nvls, &eligible));
+  if (!eligible) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+  for (int l = 0; l < localRanks; l++) rowOf[l] = l;
+  if (nvls) for (int h = 0; h < localRanks; h++) rowOf[headLocal[h]] = h;
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  // Row rowOf[l] holds the blocks of the rail of local rank l, in node order
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->hierPat, rowBytes*localRanks, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  rail = buff + rowOf[comm->localRank]*rowBytes;
+  TRACE(NCCL_COLL, "AllGather: rank %d %zu bytes per rank through %d rails of %d nodes", comm->rank, rankBytes, localRanks, nNodes);
+  CUDACHECKGOTO(cudaMemcpyAsync(rail + node*rankBytes, sendbuff, rankBytes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+
+  // Rail steps, each doubling the blocks held from this node on
+  for (int held = 1; held < nNodes; held *= 2) {
+    int cnt = std::min(held, nNodes-held);
+    NCCLCHECKGOTO(railStep(comm, rail, rankBytes, cnt, (node+nNodes-held)%nNodes, node,
+      (node+held)%nNodes, (node+held)%nNodes, NULL, stream), ret, exit);
+  }
+
+  // NVLink step, every local rank gets the whole rail of this rank
+  if (nvls) {
+    NCCLCHECKGOTO(nvlsStep(comm, ncclFuncAllGather, rail, buff, rowBytes, ncclInt8, ncclSum, stream), ret, exit);
+  } else {
+    for (int l = 0; l < localRanks; l++) sendRows[l] = rail;
+    NCCLCHECKGOTO(nvlStep(comm, sendRows, buff, rowBytes, stream), ret, exit);
+  }
+  for (int l = 0; l < localRanks; l++) {
+    CUDACHECKGOTO(cudaMemcpy2DAsync((char*)recvbuff + l*rankBytes, localRanks*rankBytes, buff + rowOf[l]*rowBytes, rankBytes,
+      rankBytes, nNodes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+  }
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->hierPat, ncclCudaGraphValid(graph), stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclHierPatReduceScatter(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t recvcount,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  bool eligible;
+  struct ncclDevRedOpFull opFull;
+  size_t rankBytes = recvcount*ncclTypeSize(datatype);
+  int nNodes = comm->nNodes;
+  int localRanks = comm->localRanks;
+  int node = comm->node;
+  size_t rowBytes = nNodes*rankBytes;
+  int helds[32], nSteps = 0;
+  char* buff;
+  char* rows;
+  char* packed;
+  char* sendRows[NCCL_MAX_LOCAL_RANKS];
+  int headLocal[NCCL_MAX_LOCAL_RANKS];
+  bool nvls;
+  struct ncclCudaGraph graph;
+  int saveDev;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "ReduceScatter", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (!hierPatType(datatype) || comm->localRanks > NCCL_MAX_LOCAL_RANKS) return ncclSuccess;
+  // Averages and scaled sums apply their scalar once, on the whole sum
+  if (ncclHostToDevRedOp(&opFull, op, datatype, comm) != ncclSuccess || opFull.scalarArgIsPtr) return ncclSuccess;
+  if (opFull.op != ncclDevSum && opFull.op != ncclDevProd && opFull.op != ncclDevMinMax) return ncclSuccess;
+  nvls = hierPatNvls(comm, stream, headLocal) && ncclNvlsSupported(opFull.op, datatype);
+  NCCLCHECK(hierPatEligible(comm, ncclFuncReduceScatter, rankBytes, nvls, &eligible));
+  if (!eligible) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  // Row l holds what local rank l reduces for the rail of this rank, then the rows packed for the
+  // local ranks, reused for the partial blocks received along the rail
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->hierPat, 2*rowBytes*localRanks, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  rows = buff;
+  packed = buff + rowBytes*localRanks;
+  TRACE(NCCL_COLL, "ReduceScatter: rank %d %zu bytes per rank through %d rails of %d nodes", comm->rank, rankBytes, localRanks, nNodes);
+
+  // NVLink step, every local rank gets the blocks of its rail reduced into row 0. The switch reduces
+  // the rows packed in head order, otherwise they are exchanged then reduced.
+  if (nvls) {
+    for (int h = 0; h < localRanks; h++) {
+      CUDACHECKGOTO(cudaMemcpy2DAsync(packed + h*rowBytes, rankBytes, (const char*)sendbuff + headLocal[h]*rankBytes, localRanks*rankBytes,
+        rankBytes, nNodes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+    }
+    NCCLCHECKGOTO(nvlsStep(comm, ncclFuncReduceScatter, packed, rows, nNodes*recvcount, datatype, op, stream), ret, exit);
+  } else {
+    for (int l = 0; l < localRanks; l++) {
+      sendRows[l] = (l == comm->localRank ? rows : packed) + l*rowBytes;
+      CUDACHECKGOTO(cudaMemcpy2DAsync(sendRows[l], rankBytes, (const char*)sendbuff + l*rankBytes, localRanks*rankBytes,
+        rankBytes, nNodes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+    }
+    NCCLCHECKGOTO(nvlStep(comm, sendRows, rows, rowBytes, stream), ret, exit);
+    NCCLCHECKGOTO(ncclLaunchReduceSlots(rows, rows, nNodes*recvcount, rowBytes, localRanks, opFull, datatype, stream), ret, exit);
+  }
+
+  // Rail steps of the AllGather backwards, partial blocks go back to the node they came from
+  for (int held = 1; held < nNodes; held *= 2) helds[nSteps++] = held;
+  for (int s = nSteps-1; s >= 0; s--) {
+    int held = helds[s];
+    int cnt = std::min(held, nNodes-held);
+    int starts[2], lens[2], n, off = 0;
+    NCCLCHECKGOTO(railStep(comm, rows, rankBytes, cnt, (node+held)%nNodes, (node+held)%nNodes,
+      (node+nNodes-held)%nNodes, node, packed, stream), ret, exit);
+    n = railPieces(node, cnt, nNodes, starts, lens);
+    for (int i = 0; i < n; i++) {
+      char* own = rows + starts[i]*rankBytes;
+      NCCLCHECKGOTO(ncclLaunchReduceSlots(own, own, lens[i]*recvcount, packed + off*rankBytes - own, 2, opFull, datatype, stream), ret, exit);
+      off += lens[i];
+    }
+  }
+  CUDACHECKGOTO(cudaMemcpyAsync(recvbuff, rows + node*rankBytes, rankBytes, cudaMemcpyDeviceToDevice, stream), ret, exit);
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->hierPat, ncclCudaGraphValid(graph), stream), ret, exit);
+  *done = true;
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclHierPatDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->hierPat);
+}
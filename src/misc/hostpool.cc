@@ -0,0 +1,160 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "hostpool.h"
+#include "bitops.h"
+#include "checks.h"
+#include "param.h"
+#include "utils.h"
+#include <pthread.h>
+
+NCCL_PARAM(HostPool, "HOST_POOL", 1);
+// Bytes of free blocks kept per NUMA node, beyond which freed blocks are unpinned
+NCCL_PARAM(HostPoolMaxBytes, "HOST_POOL_MAX_BYTES", 1LL << 30);
+
+#define HOST_POOL_MIN_SIZE 4096
+#define HOST_POOL_NCLASSES (4*64)
+// GPUs on higher or unknown NUMA nodes share the last list
+#define HOST_POOL_MAX_NODES 32
+#define HOST_POOL_MAX_DEVS 64
+#define HOST_POOL_HASH_SIZE 1024
+
+struct hostPoolBlock {
+  void* ptr;
+  size_t size;
+  int node;
+  struct hostPoolBlock* next;
+};
+
+static pthread_mutex_t hostPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct hostPoolBlock* hostPoolFreeBlocks[HOST_POOL_MAX_NODES+1][HOST_POOL_NCLASSES];
+static size_t hostPoolFreeBytes[HOST_POOL_MAX_NODES+1];
+// Blocks handed out, hashed by address
+static struct hostPoolBlock* hostPoolUsedBlocks[HOST_POOL_HASH_SIZE];
+static int hostPoolDevNodes[HOST_POOL_MAX_DEVS];
+static bool hostPoolDevNodesInit = false;
+
+// Four classes per doubling, so that rounding up never wastes more than a quarter
+static int hostPoolClass(size_t size, size_t* classSize) {
+  if (size < HOST_POOL_MIN_SIZE) size = HOST_POOL_MIN_SIZE;
+  int log = log2Up(size);
+  size_t step = (size_t)1 << (log-3);
+  *classSize = DIVUP(size, step)*step;
+  return log*4 + (int)(*classSize/step) - 5;
+}
+
+static int hostPoolHash(void* ptr) {
+  uint64_t h = (uint64_t)ptr >> 12;
+  return (int)((h ^ (h >> 17)) % HOST_POOL_HASH_SIZE);
+}
+
+// Called with the lock held. The NUMA node of a GPU is read from sysfs once.
+static int hostPoolNode() {
+  int cudaDev;
+  if (!hostPoolDevNodesInit) {
+    for (int d=0; d<HOST_POOL_MAX_DEVS; d++) hostPoolDevNodes[d] = -2;
+    hostPoolDevNodesInit = true;
+  }
+  if (cudaGetDevice(&cudaDev) != cudaSuccess) {
+    (void)cudaGetLastError();
+    return HOST_POOL_MAX_NODES;
+  }
+  int node = cudaDev < HOST_POOL_MAX_DEVS ? hostPoolDevNodes[cudaDev] : -1;
+  if (node == -2) node = hostPoolDevNodes[cudaDev] = ncclCudaDevNumaNode();
+  return (node < 0 || node >= HOST_POOL_MAX_NODES) ? HOST_POOL_MAX_NODES : node;
+}
+
+static ncclResult_t hostPoolPin(void** ptr, size_t size) {
+  ncclResult_t result = ncclSuccess;
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  *ptr = NULL;
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  // Portable, the block may later go to a comm on another GPU of the same node
+  CUDACHECKGOTO(cudaHostAlloc(ptr, size, cudaHostAllocMapped | cudaHostAllocPortable), result, finish);
+  memset(*ptr, 0, size);
+finish:
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  if (*ptr == NULL) WARN("Failed to CUDA host alloc %ld bytes", size);
+  return result;
+}
+
+ncclResult_t ncclHostPoolAlloc(void** ptr, size_t size) {
+  ncclResult_t ret = ncclSuccess;
+  struct hostPoolBlock* block = NULL;
+  size_t classSize;
+  int cls = hostPoolClass(size, &classSize);
+  int node;
+  *ptr = NULL;
+  if (size == 0) return ncclSuccess;
+
+  pthread_mutex_lock(&hostPoolLock);
+  node = hostPoolNode();
+  if (ncclParamHostPool()) {
+    block = hostPoolFreeBlocks[node][cls];
+    if (block) {
+      hostPoolFreeBlocks[node][cls] = block->next;
+      hostPoolFreeBytes[node] -= block->size;
+    }
+  }
+  pthread_mutex_unlock(&hostPoolLock);
+
+  if (block) {
+    memset(block->ptr, 0, size);
+    INFO(NCCL_ALLOC, "Host pool reuses %zu bytes at %p for %zu bytes, NUMA node %d", block->size, block->ptr, size, node);
+  } else {
+    NCCLCHECK(ncclCalloc(&block, 1));
+    NCCLCHECKGOTO(hostPoolPin(&block->ptr, classSize), ret, fail);
+    block->size = classSize;
+    block->node = node;
+    INFO(NCCL_ALLOC, "Host pool pins %zu bytes at %p for %zu bytes, NUMA node %d", classSize, block->ptr, size, node);
+  }
+
+  pthread_mutex_lock(&hostPoolLock);
+  {
+    int h = hostPoolHash(block->ptr);
+    block->next = hostPoolUsedBlocks[h];
+    hostPoolUsedBlocks[h] = block;
+  }
+  pthread_mutex_unlock(&hostPoolLock);
+  *ptr = block->ptr;
+  return ncclSuccess;
+fail:
+  free(block);
+  return ret;
+}
+
+ncclResult_t ncclHostPoolFree(void* ptr) {
+  struct hostPoolBlock* block = NULL;
+  if (ptr == NULL) return ncclSuccess;
+
+  pthread_mutex_lock(&hostPoolLock);
+  for (struct hostPoolBlock** b = hostPoolUsedBlocks+hostPoolHash(ptr); *b; b = &(*b)->next) {
+    if ((*b)->ptr == ptr) {
+      block = *b;
+      *b = block->next;
+      break;
+    }
+  }
+  if (block && ncclParamHostPool() && hostPoolFreeBytes[block->node] + block->size <= (size_t)ncclParamHostPoolMaxBytes()) {
+    size_t classSize;
+    int cls = hostPoolClass(block->size, &classSize);
+    block->next = hostPoolFreeBlocks[block->node][cls];
+    hostPoolFreeBlocks[block->node][cls] = block;
+    hostPoolFreeBytes[block->node] += block->size;
+    TRACE(NCCL_ALLOC, "Host pool keeps %zu bytes at %p, NUMA node %d", block->size, ptr, block->node);
+    block = NULL;
+    ptr = NULL;
+  }
+  pthread_mutex_unlock(&hostPoolLock);
+
+  if (ptr == NULL) return ncclSuccess;
+  if (block == NULL) {
+    WARN("Host pool free of unknown pointer %p", ptr);
+    return ncclInternalError;
+  }
+  free(block);
+  NCCLCHECK(ncclCudaHostFree(ptr));
+  return ncclSuccess;
+}
@@ -48,6 +48,8 @@ ncclResult_t buildIbvSymbols(struct ncclIbvSymbols* ibvSymbols) {
   ASSIGN_SYM(ibvSymbols, ibv_create_qp, ibv_internal_create_qp);
   ASSIGN_SYM(ibvSymbols, ibv_modify_qp, ibv_internal_modify_qp);
   ASSIGN_SYM(ibvSymbols, ibv_destroy_qp, ibv_internal_destroy_qp);
+  ASSIGN_SYM(ibvSymbols, ibv_create_srq, ibv_internal_create_srq);
+  ASSIGN_SYM(ibvSymbols, ibv_destroy_srq, ibv_internal_destroy_srq);
   ASSIGN_SYM(ibvSymbols, ibv_fork_init, ibv_internal_fork_init);
   ASSIGN_SYM(ibvSymbols, ibv_event_type_str, ibv_internal_event_type_str);
   
@@ -123,6 +125,8 @@ ncclResult_t buildIbvSymbols(struct ncclIbvSymbols* ibvSymbols) {
   LOAD_SYM(ibvhandle, "ibv_create_qp", ibvSymbols->ibv_internal_create_qp);
   LOAD_SYM(ibvhandle, "ibv_modify_qp", ibvSymbols->ibv_internal_modify_qp);
   LOAD_SYM(ibvhandle, "ibv_destroy_qp", ibvSymbols->ibv_internal_destroy_qp);
+  LOAD_SYM(ibvhandle, "ibv_create_srq", ibvSymbols->ibv_internal_create_srq);
+  LOAD_SYM(ibvhandle, "ibv_destroy_srq", ibvSymbols->ibv_internal_destroy_srq);
   LOAD_SYM(ibvhandle, "ibv_fork_init", ibvSymbols->ibv_internal_fork_init);
   LOAD_SYM(ibvhandle, "ibv_event_type_str", ibvSymbols->ibv_internal_event_type_str);
 
@@ -154,6 +158,8 @@ teardown:
   ibvSymbols->ibv_internal_create_qp = NULL;
   ibvSymbols->ibv_internal_modify_qp = NULL;
   ibvSymbols->ibv_internal_destroy_qp = NULL;
+  ibvSymbols->ibv_internal_create_srq = NULL;
+  ibvSymbols->ibv_internal_destroy_srq = NULL;
   ibvSymbols->ibv_internal_fork_init = NULL;
   ibvSymbols->ibv_internal_event_type_str = NULL;
   ibvSymbols->ibv_internal_query_ece = NULL;
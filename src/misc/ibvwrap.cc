@@ -202,6 +202,14 @@ ncclResult_t wrap_ibv_create_qp(struct ibv_qp **ret, struct ibv_pd *pd, struct i
   IBV_PTR_CHECK_ERRNO(ibvSymbols, ibv_internal_create_qp, ibv_internal_create_qp(pd, qp_init_attr), *ret, NULL, "ibv_create_qp");
 }
 
+ncclResult_t wrap_ibv_create_srq(struct ibv_srq **ret, struct ibv_pd *pd, struct ibv_srq_init_attr *srq_init_attr) {
+  IBV_PTR_CHECK_ERRNO(ibvSymbols, ibv_internal_create_srq, ibv_internal_create_srq(pd, srq_init_attr), *ret, NULL, "ibv_create_srq");
+}
+
+ncclResult_t wrap_ibv_destroy_srq(struct ibv_srq *srq) {
+  IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_destroy_srq, ibv_internal_destroy_srq(srq), 0, "ibv_destroy_srq");
+}
+
 ncclResult_t wrap_ibv_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr, int attr_mask) { /*returns 0 on success, or the value of errno on failure (which indicates the failure reason)*/
   IBV_INT_CHECK_RET_ERRNO(ibvSymbols, ibv_internal_modify_qp, ibv_internal_modify_qp(qp, attr, attr_mask), 0, "ibv_modify_qp");
 }
@@ -101,13 +101,22 @@ ncclResult_t ncclIpcSocketClose(ncclIpcSocket *handle) {
 }
 
 ncclResult_t ncclIpcSocketRecvMsg(ncclIpcSocket *handle, void *hdr, int hdrLen, int *recvFd) {
+  return ncclIpcSocketRecvMsgFds(handle, hdr, hdrLen, recvFd, recvFd ? 1 : 0);
+}
+
+ncclResult_t ncclIpcSocketRecvMsgFds(ncclIpcSocket *handle, void *hdr, int hdrLen, int *recvFds, int nFds) {
   struct msghdr msg = {0, 0, 0, 0, 0, 0, 0};
   struct iovec iov[1];
 
+  if (nFds > NCCL_IPC_MAX_FDS) {
+    WARN("UDS: Cannot receive %d fds in one message", nFds);
+    return ncclInternalError;
+  }
+
   // Union to guarantee alignment requirements for control array
   union {
     struct cmsghdr cm;
-    char control[CMSG_SPACE(sizeof(int))];
+    char control[CMSG_SPACE(sizeof(int) * NCCL_IPC_MAX_FDS)];
   } control_un;
 
   struct cmsghdr *cmptr;
@@ -136,19 +145,19 @@ ncclResult_t ncclIpcSocketRecvMsg(ncclIpcSocket *handle, void *hdr, int hdrLen,
     if (handle->abortFlag && __atomic_load_n(handle->abortFlag, __ATOMIC_ACQUIRE)) return ncclInternalError;
   }
 
-  if (recvFd != NULL) {
-    if (((cmptr = CMSG_FIRSTHDR(&msg)) != NULL) && (cmptr->cmsg_len == CMSG_LEN(sizeof(int)))) {
+  if (nFds > 0) {
+    if (((cmptr = CMSG_FIRSTHDR(&msg)) != NULL) && (cmptr->cmsg_len == CMSG_LEN(sizeof(int) * nFds))) {
       if ((cmptr->cmsg_level != SOL_SOCKET) || (cmptr->cmsg_type != SCM_RIGHTS)) {
         WARN("UDS: Receiving data over socket failed");
       return ncclSystemError;
       }
 
-      memmove(recvFd, CMSG_DATA(cmptr), sizeof(*recvFd));
+      memmove(recvFds, CMSG_DATA(cmptr), sizeof(int) * nFds);
     } else {
       WARN("UDS: Receiving data over socket %s failed", handle->socketName);
       return ncclSystemError;
     }
-    TRACE(NCCL_INIT|NCCL_P2P, "UDS: Got recvFd %d from socket %s", *recvFd, handle->socketName);
+    TRACE(NCCL_INIT|NCCL_P2P, "UDS: Got %d fds, first %d, from socket %s", nFds, recvFds[0], handle->socketName);
   }
 
   return ncclSuccess;
@@ -159,13 +168,22 @@ ncclResult_t ncclIpcSocketRecvFd(ncclIpcSocket *handle, int *recvFd) {
 }
 
 ncclResult_t ncclIpcSocketSendMsg(ncclIpcSocket *handle, void *hdr, int hdrLen, const int sendFd, int rank, uint64_t hash) {
+  return ncclIpcSocketSendMsgFds(handle, hdr, hdrLen, &sendFd, 1, rank, hash);
+}
+
+ncclResult_t ncclIpcSocketSendMsgFds(ncclIpcSocket *handle, void *hdr, int hdrLen, const int* sendFds, int nFds, int rank, uint64_t hash) {
   struct msghdr msg = {0, 0, 0, 0, 0, 0, 0};
   struct iovec iov[1];
   char temp[NCCL_IPC_SOCKNAME_LEN];
 
+  if (nFds < 1 || nFds > NCCL_IPC_MAX_FDS) {
+    WARN("UDS: Cannot send %d fds in one message", nFds);
+    return ncclInternalError;
+  }
+
   union {
     struct cmsghdr cm;
-    char control[CMSG_SPACE(sizeof(int))];
+    char control[CMSG_SPACE(sizeof(int) * NCCL_IPC_MAX_FDS)];
   } control_un;
 
   struct cmsghdr *cmptr;
@@ -187,16 +205,16 @@ ncclResult_t ncclIpcSocketSendMsg(ncclIpcSocket *handle, void *hdr, int hdrLen,
   cliaddr.sun_path[0] = '\0'; // Linux abstract socket trick
 #endif
 
-  TRACE(NCCL_INIT, "UDS: Sending hdr %p len %d fd %d to UDS socket %s", hdr, hdrLen, sendFd, temp);
+  TRACE(NCCL_INIT, "UDS: Sending hdr %p len %d %d fds, first %d, to UDS socket %s", hdr, hdrLen, nFds, sendFds[0], temp);
 
   msg.msg_control = control_un.control;
-  msg.msg_controllen = sizeof(control_un.control);
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
 
   cmptr = CMSG_FIRSTHDR(&msg);
-  cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+  cmptr->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
   cmptr->cmsg_level = SOL_SOCKET;
   cmptr->cmsg_type = SCM_RIGHTS;
-  memmove(CMSG_DATA(cmptr), &sendFd, sizeof(sendFd));
+  memmove(CMSG_DATA(cmptr), sendFds, sizeof(int) * nFds);
 
   msg.msg_name = (void *)&cliaddr;
   msg.msg_namelen = sizeof(struct sockaddr_un);
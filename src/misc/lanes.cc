@@ -0,0 +1,119 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "lanes.h"
+#include "alloc.h"
+#include "checks.h"
+#include "param.h"
+
+NCCL_PARAM(Lanes, "LANES", 0);
+
+static ncclResult_t lanesInit(struct ncclComm* comm) {
+  int nLanes = std::min<int>(std::min<int>(ncclParamLanes(), NCCL_MAX_LANES), comm->nChannels);
+  if (nLanes < 2) {
+    WARN("ncclCommSetStreamLane : NCCL_LANES is %ld, at least 2 lanes of one channel each are needed (comm has %d channels)",
+      ncclParamLanes(), comm->nChannels);
+    return ncclInvalidUsage;
+  }
+  if (comm->sharedRes->owner != comm) {
+    // The channels are those of the comm sharing its resources, which orders its kernels with deviceStream
+    WARN("ncclCommSetStreamLane : lanes are not available on a comm sharing the resources of another");
+    return ncclInvalidUsage;
+  }
+  struct ncclLanes* lanes;
+  NCCLCHECK(ncclCalloc(&lanes, 1));
+  comm->lanes = lanes;
+  for (int l = 0; l < nLanes; l++) {
+    lanes->lanes[l].channelBase = l*comm->nChannels/nLanes;
+    lanes->lanes[l].nChannels = (l+1)*comm->nChannels/nLanes - lanes->lanes[l].channelBase;
+    ncclResult_t ret = ncclStrongStreamConstruct(&lanes->lanes[l].stream);
+    if (ret != ncclSuccess) {
+      (void)ncclLanesDestroy(comm);
+      return ret;
+    }
+    lanes->nLanes = l+1;
+  }
+  INFO(NCCL_INIT, "comm %p rank %d split %d channels into %d lanes", comm, comm->rank, comm->nChannels, nLanes);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLanesSetStream(struct ncclComm* comm, cudaStream_t stream, int lane) {
+  if (comm->lanes == NULL) NCCLCHECK(lanesInit(comm));
+  struct ncclLanes* lanes = comm->lanes;
+  if (lane < -1 || lane >= lanes->nLanes) {
+    WARN("ncclCommSetStreamLane : invalid lane %d (lane should be -1 or in the 0..%d range)", lane, lanes->nLanes-1);
+    return ncclInvalidArgument;
+  }
+  int s = 0;
+  while (s < lanes->nStreams && lanes->streams[s].stream != stream) s++;
+  if (lane == -1) {
+    if (s < lanes->nStreams) lanes->streams[s] = lanes->streams[--lanes->nStreams];
+    return ncclSuccess;
+  }
+  if (s == NCCL_LANES_MAX_STREAMS) {
+    WARN("ncclCommSetStreamLane : no more than %d streams can be given a lane", NCCL_LANES_MAX_STREAMS);
+    return ncclInvalidUsage;
+  }
+  if (s == lanes->nStreams) lanes->nStreams++;
+  lanes->streams[s].stream = stream;
+  lanes->streams[s].lane = lane;
+  return ncclSuccess;
+}
+
+struct ncclLane* ncclLaneOfStream(struct ncclComm* comm, cudaStream_t stream) {
+  struct ncclLanes* lanes = comm->lanes;
+  if (lanes == NULL) return NULL;
+  for (int s = 0; s < lanes->nStreams; s++) {
+    if (lanes->streams[s].stream == stream) return &lanes->lanes[lanes->streams[s].lane];
+  }
+  return NULL;
+}
+
+struct ncclLane* ncclLanesPlannerLane(struct ncclComm* comm) {
+  struct ncclKernelPlanner* planner = &comm->planner;
+  // p2p channels are picked per peer over all channels
+  if (comm->lanes == NULL || planner->nTasksP2p != 0 || planner->streams == NULL) return NULL;
+  struct ncclLane* lane = ncclLaneOfStream(comm, planner->streams->stream);
+  for (struct ncclCudaStreamList* l = planner->streams->next; lane && l; l = l->next) {
+    if (ncclLaneOfStream(comm, l->stream) != lane) lane = NULL;
+  }
+  return lane;
+}
+
+ncclResult_t ncclLanesAcquire(struct ncclComm* comm, struct ncclCudaGraph graph, struct ncclStrongStream** stream) {
+  struct ncclStrongStream* deviceStream = &comm->sharedRes->deviceStream;
+  struct ncclLane* lane = comm->planner.lane;
+  NCCLCHECK(ncclStrongStreamAcquire(graph, deviceStream));
+  if (lane) {
+    // Setup copies and groups without a lane are on deviceStream, other lanes are not
+    NCCLCHECK(ncclStrongStreamAcquire(graph, &lane->stream));
+    NCCLCHECK(ncclStrongStreamWaitStream(graph, &lane->stream, deviceStream));
+    NCCLCHECK(ncclStrongStreamRelease(graph, deviceStream));
+    *stream = &lane->stream;
+    return ncclSuccess;
+  }
+  if (comm->lanes) {
+    for (int l = 0; l < comm->lanes->nLanes; l++) {
+      struct ncclStrongStream* laneStream = &comm->lanes->lanes[l].stream;
+      NCCLCHECK(ncclStrongStreamAcquire(graph, laneStream));
+      NCCLCHECK(ncclStrongStreamWaitStream(graph, deviceStream, laneStream));
+      NCCLCHECK(ncclStrongStreamRelease(graph, laneStream));
+    }
+  }
+  *stream = deviceStream;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLanesDestroy(struct ncclComm* comm) {
+  struct ncclLanes* lanes = comm->lanes;
+  if (lanes == NULL) return ncclSuccess;
+  for (int l = 0; l < lanes->nLanes; l++) {
+    NCCLCHECK(ncclStrongStreamSynchronize(&lanes->lanes[l].stream));
+    NCCLCHECK(ncclStrongStreamDestruct(&lanes->lanes[l].stream));
+  }
+  free(lanes);
+  comm->lanes = NULL;
+  return ncclSuccess;
+}
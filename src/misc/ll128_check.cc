@@ -0,0 +1,271 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "ll128_check.h"
+#include "core.h"
+#include "checks.h"
+#include "device.h"
+#include "param.h"
+#include <errno.h>
+#include <mutex>
+
+// Stress LL128 at init so that it can run on platforms the tuner does not enable it on
+NCCL_PARAM(Ll128Selftest, "LL128_SELFTEST", 1);
+NCCL_PARAM(Ll128SelftestIters, "LL128_SELFTEST_ITERS", 4096);
+
+#define NCCL_LL128_CHECK_DEFAULT_CACHE_DIR "/tmp"
+#define NCCL_LL128_CHECK_MAX_DEVS 64
+// Rounds of the copy engine test, each one is a buffer of host memory
+#define NCCL_LL128_CHECK_DMA_ITERS 64
+// How long the host waits for the reader to start before giving up
+#define NCCL_LL128_CHECK_GO_TIMEOUT_NS 1000000000ULL
+
+static const char* ll128CheckNames[] = { "host", "dma", "p2p" };
+#define NCCL_LL128_CHECK_NUM 3
+
+static std::mutex ll128CheckMutex;
+// Links passed plus one, 0 while the device was not tested
+static int ll128CheckResults[NCCL_LL128_CHECK_MAX_DEVS];
+
+// Whatever changes the links or how the GPUs drive them
+static uint64_t ll128CheckFingerprint(int dev, int peerDev) {
+  struct {
+    int version, driverVersion, compCap, peerCompCap, peerRank;
+    char name[256], peerName[256], product[128];
+  } key;
+  memset(&key, 0, sizeof(key));
+  key.version = NCCL_VERSION_CODE;
+  (void)cudaDriverGetVersion(&key.driverVersion);
+  cudaDeviceProp prop;
+  if (cudaGetDeviceProperties(&prop, dev) == cudaSuccess) {
+    memcpy(key.name, prop.name, sizeof(key.name));
+    key.compCap = prop.major*10 + prop.minor;
+  }
+  if (peerDev >= 0 && cudaGetDeviceProperties(&prop, peerDev) == cudaSuccess) {
+    memcpy(key.peerName, prop.name, sizeof(key.peerName));
+    key.peerCompCap = prop.major*10 + prop.minor;
+    (void)cudaDeviceGetP2PAttribute(&key.peerRank, cudaDevP2PAttrPerformanceRank, peerDev, dev);
+  }
+  FILE* file = fopen("/sys/devices/virtual/dmi/id/product_name", "r");
+  if (file) {
+    if (fgets(key.product, sizeof(key.product), file) == NULL) key.product[0] = '\0';
+    fclose(file);
+  }
+  (void)cudaGetLastError();
+  return getHash((const char*)&key, sizeof(key));
+}
+
+static void ll128CheckCachePath(uint64_t fingerprint, char* path, size_t len) {
+  const char* dir = ncclGetEnv("NCCL_LL128_SELFTEST_CACHE_DIR");
+  if (dir == NULL) dir = NCCL_LL128_CHECK_DEFAULT_CACHE_DIR;
+  if (dir[0] == '\0') {
+    path[0] = '\0';
+    return;
+  }
+  snprintf(path, len, "%s/nccl-ll128-%016lx.txt", dir, fingerprint);
+}
+
+// One "<link> <passed>" line per test, false when there is no cache
+static bool ll128CheckCacheLoad(const char* path, int* passed) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+  char line[256];
+  *passed = 0;
+  while (fgets(line, sizeof(line), file)) {
+    char name[32];
+    int ok;
+    if (line[0] == '#' || sscanf(line, "%31s %d", name, &ok) != 2) continue;
+    for (int t = 0; t < NCCL_LL128_CHECK_NUM; t++) {
+      if (strcmp(name, ll128CheckNames[t]) == 0 && ok) *passed |= 1 << t;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+static void ll128CheckCacheStore(const char* path, int passed) {
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+  FILE* file = fopen(tmpPath, "w");
+  if (file == NULL) {
+    INFO(NCCL_INIT, "Unable to write LL128 self-test results to %s : %s", tmpPath, strerror(errno));
+    return;
+  }
+  fprintf(file, "# NCCL %d LL128 self-test: link passed\n", NCCL_VERSION_CODE);
+  for (int t = 0; t < NCCL_LL128_CHECK_NUM; t++) fprintf(file, "%s %d\n", ll128CheckNames[t], (passed >> t) & 1);
+  fclose(file);
+  // Concurrent inits on the same platform each write a whole file
+  if (rename(tmpPath, path) != 0) {
+    INFO(NCCL_INIT, "Unable to write LL128 self-test results to %s : %s", path, strerror(errno));
+    unlink(tmpPath);
+  }
+}
+
+// Host mapped flag the reader sets and the host polls, and the counters of the reader
+struct ll128CheckRun {
+  volatile int* go;
+  unsigned long long* counters;
+  cudaStream_t readStream, writeStream;
+};
+
+static ncclResult_t ll128CheckRunInit(struct ll128CheckRun* run) {
+  memset(run, 0, sizeof(*run));
+  CUDACHECK(cudaHostAlloc((void**)&run->go, sizeof(int), cudaHostAllocMapped | cudaHostAllocPortable));
+  CUDACHECK(cudaHostAlloc((void**)&run->counters, 2*sizeof(unsigned long long), cudaHostAllocMapped));
+  *run->go = 0;
+  run->counters[0] = run->counters[1] = 0;
+  CUDACHECK(cudaStreamCreateWithFlags(&run->readStream, cudaStreamNonBlocking));
+  return ncclSuccess;
+}
+
+static void ll128CheckRunFini(struct ll128CheckRun* run) {
+  if (run->readStream) (void)cudaStreamDestroy(run->readStream);
+  if (run->go) (void)cudaFreeHost((void*)run->go);
+  if (run->counters) (void)cudaFreeHost(run->counters);
+}
+
+// The reader has to see lines mid-way for the test to say anything
+static bool ll128CheckVerdict(struct ll128CheckRun* run, int dev, const char* link) {
+  bool ok = run->counters[0] == 0 && run->counters[1] > 0;
+  INFO(NCCL_INIT, "LL128 self-test on device %d over %s: %llu torn loads, %llu partial lines seen, %s",
+      dev, link, run->counters[0], run->counters[1], ok ? "passed" : "failed");
+  return ok;
+}
+
+// Writer and reader on the GPU, the lines in host memory
+static ncclResult_t ll128CheckHost(int dev, int nIters, bool* ok) {
+  ncclResult_t ret = ncclSuccess;
+  struct ll128CheckRun run;
+  uint64_t* lines = NULL;
+  size_t bytes = ncclLl128CheckLines()*128;
+  *ok = false;
+  NCCLCHECKGOTO(ll128CheckRunInit(&run), ret, exit);
+  CUDACHECKGOTO(cudaHostAlloc((void**)&lines, bytes, cudaHostAllocMapped), ret, exit);
+  memset(lines, 0, bytes);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&run.writeStream, cudaStreamNonBlocking), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchLl128CheckReader(lines, nIters, run.go, run.counters, run.readStream), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchLl128CheckWriter(lines, nIters, run.go, run.writeStream), ret, exit);
+  CUDACHECKGOTO(cudaStreamSynchronize(run.writeStream), ret, exit);
+  CUDACHECKGOTO(cudaStreamSynchronize(run.readStream), ret, exit);
+  *ok = ll128CheckVerdict(&run, dev, "host memory");
+exit:
+  if (run.writeStream) (void)cudaStreamDestroy(run.writeStream);
+  if (lines) (void)cudaFreeHost(lines);
+  ll128CheckRunFini(&run);
+  return ret;
+}
+
+// The copy engine brings the lines of each round from host memory while the GPU reads them
+static ncclResult_t ll128CheckDma(int dev, bool* ok) {
+  ncclResult_t ret = ncclSuccess;
+  struct ll128CheckRun run;
+  uint64_t* lines = NULL;
+  uint64_t* rounds = NULL;
+  size_t bytes = ncclLl128CheckLines()*128;
+  uint64_t t0;
+  *ok = false;
+  NCCLCHECKGOTO(ll128CheckRunInit(&run), ret, exit);
+  CUDACHECKGOTO(cudaMalloc((void**)&lines, bytes), ret, exit);
+  CUDACHECKGOTO(cudaMemset(lines, 0, bytes), ret, exit);
+  CUDACHECKGOTO(cudaHostAlloc((void**)&rounds, NCCL_LL128_CHECK_DMA_ITERS*bytes, cudaHostAllocDefault), ret, exit);
+  for (int r = 0; r < NCCL_LL128_CHECK_DMA_ITERS; r++) {
+    for (size_t w = 0; w < bytes/sizeof(uint64_t); w++) rounds[r*bytes/sizeof(uint64_t) + w] = r+1;
+  }
+  CUDACHECKGOTO(cudaDeviceSynchronize(), ret, exit);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&run.writeStream, cudaStreamNonBlocking), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchLl128CheckReader(lines, NCCL_LL128_CHECK_DMA_ITERS, run.go, run.counters, run.readStream), ret, exit);
+  t0 = clockNano();
+  while (*run.go == 0 && clockNano() - t0 < NCCL_LL128_CHECK_GO_TIMEOUT_NS) sched_yield();
+  for (int r = 0; r < NCCL_LL128_CHECK_DMA_ITERS; r++) {
+    CUDACHECKGOTO(cudaMemcpyAsync(lines, (char*)rounds + r*bytes, bytes, cudaMemcpyHostToDevice, run.writeStream), ret, exit);
+  }
+  CUDACHECKGOTO(cudaStreamSynchronize(run.writeStream), ret, exit);
+  CUDACHECKGOTO(cudaStreamSynchronize(run.readStream), ret, exit);
+  *ok = ll128CheckVerdict(&run, dev, "copy engine writes");
+exit:
+  if (run.writeStream) (void)cudaStreamDestroy(run.writeStream);
+  if (rounds) (void)cudaFreeHost(rounds);
+  if (lines) (void)cudaFree(lines);
+  ll128CheckRunFini(&run);
+  return ret;
+}
+
+// The writer runs on peerDev and stores into the memory of dev, where the reader runs
+static ncclResult_t ll128CheckP2p(int dev, int peerDev, int nIters, bool* ok) {
+  ncclResult_t ret = ncclSuccess;
+  struct ll128CheckRun run;
+  uint64_t* lines = NULL;
+  size_t bytes = ncclLl128CheckLines()*128;
+  bool peerEnabled = false;
+  cudaError_t err;
+  *ok = false;
+  NCCLCHECKGOTO(ll128CheckRunInit(&run), ret, exit);
+  CUDACHECKGOTO(cudaMalloc((void**)&lines, bytes), ret, exit);
+  CUDACHECKGOTO(cudaMemset(lines, 0, bytes), ret, exit);
+  CUDACHECKGOTO(cudaDeviceSynchronize(), ret, exit);
+  CUDACHECKGOTO(cudaSetDevice(peerDev), ret, exit);
+  err = cudaDeviceEnablePeerAccess(dev, 0);
+  if (err == cudaSuccess) peerEnabled = true;
+  else if (err == cudaErrorPeerAccessAlreadyEnabled) (void)cudaGetLastError();
+  else CUDACHECKGOTO(err, ret, restore);
+  CUDACHECKGOTO(cudaStreamCreateWithFlags(&run.writeStream, cudaStreamNonBlocking), ret, restore);
+  CUDACHECKGOTO(cudaSetDevice(dev), ret, restore);
+  NCCLCHECKGOTO(ncclLaunchLl128CheckReader(lines, nIters, run.go, run.counters, run.readStream), ret, restore);
+  CUDACHECKGOTO(cudaSetDevice(peerDev), ret, restore);
+  NCCLCHECKGOTO(ncclLaunchLl128CheckWriter(lines, nIters, run.go, run.writeStream), ret, restore);
+  CUDACHECKGOTO(cudaStreamSynchronize(run.writeStream), ret, restore);
+  CUDACHECKGOTO(cudaStreamSynchronize(run.readStream), ret, restore);
+  *ok = ll128CheckVerdict(&run, dev, "peer GPU stores");
+restore:
+  (void)cudaSetDevice(peerDev);
+  if (run.writeStream) (void)cudaStreamDestroy(run.writeStream);
+  run.writeStream = NULL;
+  if (peerEnabled) (void)cudaDeviceDisablePeerAccess(dev);
+  (void)cudaSetDevice(dev);
+exit:
+  if (lines) (void)cudaFree(lines);
+  ll128CheckRunFini(&run);
+  return ret;
+}
+
+// First other GPU of the process that can store into dev
+static int ll128CheckPeer(int dev) {
+  int nDevs = 0;
+  if (cudaGetDeviceCount(&nDevs) != cudaSuccess) return -1;
+  for (int d = 0; d < nDevs; d++) {
+    int canAccess = 0;
+    if (d != dev && cudaDeviceCanAccessPeer(&canAccess, d, dev) == cudaSuccess && canAccess) return d;
+  }
+  return -1;
+}
+
+ncclResult_t ncclLl128Check(struct ncclComm* comm, int* passed) {
+  int dev = comm->cudaDev;
+  *passed = 0;
+  if (ncclParamLl128Selftest() == 0 || dev < 0 || dev >= NCCL_LL128_CHECK_MAX_DEVS) return ncclSuccess;
+
+  std::lock_guard<std::mutex> lock(ll128CheckMutex);
+  if (ll128CheckResults[dev]) {
+    *passed = ll128CheckResults[dev]-1;
+    return ncclSuccess;
+  }
+  int peerDev = ll128CheckPeer(dev);
+  char path[PATH_MAX];
+  ll128CheckCachePath(ll128CheckFingerprint(dev, peerDev), path, sizeof(path));
+  if (path[0] && ll128CheckCacheLoad(path, passed)) {
+    INFO(NCCL_INIT, "LL128 self-test results of device %d read from %s: links 0x%x", dev, path, *passed);
+  } else {
+    int nIters = std::max<int>(ncclParamLl128SelftestIters(), 1);
+    bool ok;
+    // A test that cannot run does not pass, and leaves the init alone
+    if (ll128CheckHost(dev, nIters, &ok) == ncclSuccess && ok) *passed |= NCCL_LL128_CHECK_HOST;
+    if (ll128CheckDma(dev, &ok) == ncclSuccess && ok) *passed |= NCCL_LL128_CHECK_DMA;
+    if (peerDev >= 0 && ll128CheckP2p(dev, peerDev, nIters, &ok) == ncclSuccess && ok) *passed |= NCCL_LL128_CHECK_P2P;
+    (void)cudaGetLastError();
+    if (path[0]) ll128CheckCacheStore(path, *passed);
+  }
+  ll128CheckResults[dev] = *passed+1;
+  return ncclSuccess;
+}
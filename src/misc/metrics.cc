@@ -0,0 +1,379 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "collectives.h"
+#include "core.h"
+#include "device.h"
+#include "metrics.h"
+#include "param.h"
+#include "utils.h"
+#include "msccl/msccl_fallback.h"
+#include "msccl/msccl_struct.h"
+
+NCCL_PARAM(Metrics, "METRICS", 0);
+NCCL_PARAM(MetricsPort, "METRICS_PORT", 0);
+NCCL_PARAM(MetricsIntervalMs, "METRICS_INTERVAL_MS", 10000);
+
+static constexpr int ncclMetricsNetDevs = 64;
+static constexpr int ncclMetricsIbDevs = 32;
+static constexpr int ncclMetricsReasons = mscclSelectNumReasons;
+static constexpr int ncclMetricsColls = NCCL_NUM_FUNCTIONS * NCCL_NUM_ALGORITHMS * NCCL_NUM_PROTOCOLS;
+
+// Counter indices: per collective (func, algo, proto), then per net device and direction, per
+// MSCCL reason and outcome and per IB device and severity
+enum {
+  ncclMetricCollCount = 0,
+  ncclMetricCollBytes = ncclMetricCollCount + ncclMetricsColls,
+  ncclMetricCollLatencyNs = ncclMetricCollBytes + ncclMetricsColls,
+  ncclMetricCollLatencySamples = ncclMetricCollLatencyNs + ncclMetricsColls,
+  ncclMetricNetBytes = ncclMetricCollLatencySamples + ncclMetricsColls,
+  ncclMetricMscclSelect = ncclMetricNetBytes + ncclMetricsNetDevs * 2,
+  ncclMetricIbAsync = ncclMetricMscclSelect + ncclMetricsReasons * 2,
+  ncclMetricCount = ncclMetricIbAsync + ncclMetricsIbDevs * 2
+};
+
+struct ncclMetricsBlock {
+  uint64_t counters[ncclMetricCount];
+};
+
+// Blocks of the live threads, those of exited threads are folded into ncclMetricsRetired
+static std::mutex ncclMetricsMutex;
+static std::vector<struct ncclMetricsBlock*> ncclMetricsBlocks;
+static uint64_t ncclMetricsRetired[ncclMetricCount];
+static char ncclMetricsNetNames[ncclMetricsNetDevs][64];
+static struct { char name[64]; int port; } ncclMetricsIbPorts[ncclMetricsIbDevs];
+// Names and labels handed out by ncclMetricsGet, never freed
+static std::set<std::string> ncclMetricsStrings;
+
+struct ncclMetricsThread {
+  struct ncclMetricsBlock* block = nullptr;
+  ~ncclMetricsThread() {
+    if (block == nullptr) return;
+    std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+    for (int i = 0; i < ncclMetricCount; i++) ncclMetricsRetired[i] += __atomic_load_n(block->counters + i, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < ncclMetricsBlocks.size(); b++) {
+      if (ncclMetricsBlocks[b] == block) { ncclMetricsBlocks.erase(ncclMetricsBlocks.begin() + b); break; }
+    }
+    delete block;
+  }
+};
+static thread_local struct ncclMetricsThread ncclMetricsLocal;
+
+bool ncclMetricsEnabled() {
+  return ncclParamMetrics() == 1;
+}
+
+// Only the owning thread writes a counter, readers may see it one add late
+static void ncclMetricsAdd(int index, uint64_t value) {
+  struct ncclMetricsBlock* block = ncclMetricsLocal.block;
+  if (block == nullptr) {
+    block = new ncclMetricsBlock();
+    std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+    ncclMetricsBlocks.push_back(block);
+    ncclMetricsLocal.block = block;
+  }
+  uint64_t* counter = block->counters + index;
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static int ncclMetricsCollIndex(int func, int algorithm, int protocol) {
+  if (func < 0 || func >= NCCL_NUM_FUNCTIONS || algorithm < 0 || algorithm >= NCCL_NUM_ALGORITHMS ||
+      protocol < 0 || protocol >= NCCL_NUM_PROTOCOLS) return -1;
+  return (func * NCCL_NUM_ALGORITHMS + algorithm) * NCCL_NUM_PROTOCOLS + protocol;
+}
+
+void ncclMetricsColl(int func, int algorithm, int protocol, size_t bytes) {
+  if (!ncclMetricsEnabled()) return;
+  int c = ncclMetricsCollIndex(func, algorithm, protocol);
+  if (c < 0) return;
+  ncclMetricsAdd(ncclMetricCollCount + c, 1);
+  ncclMetricsAdd(ncclMetricCollBytes + c, bytes);
+}
+
+void ncclMetricsCollLatency(int func, int algorithm, int protocol, float us) {
+  if (!ncclMetricsEnabled()) return;
+  int c = ncclMetricsCollIndex(func, algorithm, protocol);
+  if (c < 0 || us < 0.0f) return;
+  ncclMetricsAdd(ncclMetricCollLatencyNs + c, (uint64_t)(us * 1000.0f));
+  ncclMetricsAdd(ncclMetricCollLatencySamples + c, 1);
+}
+
+void ncclMetricsNetDevice(int netDev, const char* name) {
+  if (!ncclMetricsEnabled() || netDev < 0 || netDev >= ncclMetricsNetDevs || name == nullptr) return;
+  std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+  if (ncclMetricsNetNames[netDev][0] == '\0') snprintf(ncclMetricsNetNames[netDev], sizeof(ncclMetricsNetNames[netDev]), "%s", name);
+}
+
+void ncclMetricsNetBytes(int netDev, bool send, size_t bytes) {
+  if (!ncclMetricsEnabled() || netDev < 0 || netDev >= ncclMetricsNetDevs) return;
+  ncclMetricsAdd(ncclMetricNetBytes + netDev * 2 + (send ? 0 : 1), bytes);
+}
+
+void ncclMetricsMscclSelect(int reason, bool scheduled) {
+  if (!ncclMetricsEnabled() || reason < 0 || reason >= ncclMetricsReasons) return;
+  ncclMetricsAdd(ncclMetricMscclSelect + reason * 2 + (scheduled ? 0 : 1), 1);
+}
+
+void ncclMetricsIbDevice(int ibDev, const char* name, int port) {
+  if (!ncclMetricsEnabled() || ibDev < 0 || ibDev >= ncclMetricsIbDevs) return;
+  std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+  snprintf(ncclMetricsIbPorts[ibDev].name, sizeof(ncclMetricsIbPorts[ibDev].name), "%s", name);
+  ncclMetricsIbPorts[ibDev].port = port;
+}
+
+void ncclMetricsIbAsyncError(int ibDev, bool fatal) {
+  if (!ncclMetricsEnabled() || ibDev < 0 || ibDev >= ncclMetricsIbDevs) return;
+  ncclMetricsAdd(ncclMetricIbAsync + ibDev * 2 + (fatal ? 0 : 1), 1);
+}
+
+// IB port counters of retransmissions and the errors that cause them
+static const char* ncclMetricsIbCounters[] = {
+  "local_ack_timeout_err", "out_of_sequence", "packet_seq_err", "implied_nak_seq_err", "rnr_nak_retry_err"
+};
+
+static const char* ncclMetricsIntern(const std::string& str) {
+  return ncclMetricsStrings.insert(str).first->c_str();
+}
+
+static void ncclMetricsPush(std::vector<ncclMetric_t>* metrics, const char* name, const std::string& labels, double value) {
+  metrics->push_back({name, ncclMetricsIntern(labels), value});
+}
+
+// Summaries are the _sum and _count series of one family
+static std::string ncclMetricsFamily(const char* name) {
+  const char* summary = strstr(name, "_latency_us_");
+  return summary ? std::string(name, summary - name) + "_latency_us" : std::string(name);
+}
+
+// All non-zero series, those of a family together. Called with ncclMetricsMutex held.
+static void ncclMetricsCollect(std::vector<ncclMetric_t>* metrics) {
+  std::vector<uint64_t> totals(ncclMetricsRetired, ncclMetricsRetired + ncclMetricCount);
+  for (struct ncclMetricsBlock* block : ncclMetricsBlocks) {
+    for (int i = 0; i < ncclMetricCount; i++) totals[i] += __atomic_load_n(block->counters + i, __ATOMIC_RELAXED);
+  }
+  char labels[256];
+  for (int f = 0; f < NCCL_NUM_FUNCTIONS; f++) {
+    for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) {
+      for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+        int c = ncclMetricsCollIndex(f, a, p);
+        if (totals[ncclMetricCollCount + c] == 0 && totals[ncclMetricCollLatencySamples + c] == 0) continue;
+        snprintf(labels, sizeof(labels), "func=\"%s\",algo=\"%s\",proto=\"%s\"", ncclFuncToString((ncclFunc_t)f), ncclAlgoStr[a], ncclProtoStr[p]);
+        ncclMetricsPush(metrics, "nccl_collectives_total", labels, totals[ncclMetricCollCount + c]);
+        ncclMetricsPush(metrics, "nccl_collective_bytes_total", labels, totals[ncclMetricCollBytes + c]);
+        if (totals[ncclMetricCollLatencySamples + c] == 0) continue;
+        ncclMetricsPush(metrics, "nccl_collective_latency_us_sum", labels, totals[ncclMetricCollLatencyNs + c] / 1000.0);
+        ncclMetricsPush(metrics, "nccl_collective_latency_us_count", labels, totals[ncclMetricCollLatencySamples + c]);
+      }
+    }
+  }
+  for (int d = 0; d < ncclMetricsNetDevs; d++) {
+    for (int dir = 0; dir < 2; dir++) {
+      uint64_t value = totals[ncclMetricNetBytes + d * 2 + dir];
+      if (value == 0) continue;
+      if (ncclMetricsNetNames[d][0]) snprintf(labels, sizeof(labels), "dev=\"%s\",dir=\"%s\"", ncclMetricsNetNames[d], dir ? "recv" : "send");
+      else snprintf(labels, sizeof(labels), "dev=\"%d\",dir=\"%s\"", d, dir ? "recv" : "send");
+      ncclMetricsPush(metrics, "nccl_net_bytes_total", labels, value);
+    }
+  }
+  for (int r = 0; r < ncclMetricsReasons; r++) {
+    for (int s = 0; s < 2; s++) {
+      uint64_t value = totals[ncclMetricMscclSelect + r * 2 + s];
+      if (value == 0) continue;
+      snprintf(labels, sizeof(labels), "result=\"%s\",reason=\"%s\"", s ? "nccl" : "msccl", mscclSelectReasonName(r));
+      ncclMetricsPush(metrics, "nccl_msccl_selections_total", labels, value);
+    }
+  }
+  for (int d = 0; d < ncclMetricsIbDevs; d++) {
+    for (int s = 0; s < 2; s++) {
+      uint64_t value = totals[ncclMetricIbAsync + d * 2 + s];
+      if (value == 0) continue;
+      snprintf(labels, sizeof(labels), "dev=\"%s\",severity=\"%s\"", ncclMetricsIbPorts[d].name, s ? "error" : "fatal");
+      ncclMetricsPush(metrics, "nccl_ib_async_events_total", labels, value);
+    }
+  }
+  for (int d = 0; d < ncclMetricsIbDevs; d++) {
+    if (ncclMetricsIbPorts[d].name[0] == '\0') continue;
+    for (const char* counter : ncclMetricsIbCounters) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "/sys/class/infiniband/%s/ports/%d/hw_counters/%s", ncclMetricsIbPorts[d].name, ncclMetricsIbPorts[d].port, counter);
+      FILE* file = fopen(path, "r");
+      if (file == nullptr) continue;
+      unsigned long long value;
+      if (fscanf(file, "%llu", &value) == 1 && value != 0) {
+        snprintf(labels, sizeof(labels), "dev=\"%s\",port=\"%d\",counter=\"%s\"", ncclMetricsIbPorts[d].name, ncclMetricsIbPorts[d].port, counter);
+        ncclMetricsPush(metrics, "nccl_ib_port_errors_total", labels, value);
+      }
+      fclose(file);
+    }
+  }
+  std::stable_sort(metrics->begin(), metrics->end(), [](const ncclMetric_t& a, const ncclMetric_t& b) {
+    return ncclMetricsFamily(a.name) < ncclMetricsFamily(b.name);
+  });
+}
+
+NCCL_API(ncclResult_t, ncclMetricsGet, ncclMetric_t* metrics, int* nMetrics);
+ncclResult_t ncclMetricsGet(ncclMetric_t* metrics, int* nMetrics) {
+  NCCLCHECK(PtrCheck(nMetrics, "MetricsGet", "nMetrics"));
+  std::vector<ncclMetric_t> all;
+  {
+    std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+    ncclMetricsCollect(&all);
+  }
+  if (metrics) memcpy(metrics, all.data(), std::min((size_t)std::max(*nMetrics, 0), all.size()) * sizeof(ncclMetric_t));
+  *nMetrics = all.size();
+  return ncclSuccess;
+}
+
+// Prometheus text exposition format
+static std::string ncclMetricsText() {
+  std::vector<ncclMetric_t> all;
+  {
+    std::lock_guard<std::mutex> lock(ncclMetricsMutex);
+    ncclMetricsCollect(&all);
+  }
+  std::string text, family;
+  char line[512];
+  for (const ncclMetric_t& m : all) {
+    if (ncclMetricsFamily(m.name) != family) {
+      family = ncclMetricsFamily(m.name);
+      text += "# TYPE " + family + (family == m.name ? " counter\n" : " summary\n");
+    }
+    snprintf(line, sizeof(line), "%s{%s} %.17g\n", m.name, m.labels, m.value);
+    text += line;
+  }
+  return text;
+}
+
+static void ncclMetricsWriteFile(const char* path) {
+  std::string text = ncclMetricsText();
+  // Written aside then renamed, so that readers never see a partial file
+  std::string tmp = std::string(path) + ".tmp";
+  FILE* file = fopen(tmp.c_str(), "w");
+  if (file == nullptr) return;
+  size_t written = fwrite(text.data(), 1, text.size(), file);
+  fclose(file);
+  if (written == text.size()) rename(tmp.c_str(), path);
+}
+
+static void ncclMetricsServe(int fd) {
+  char request[4096];
+  // The request is not parsed, any path gets the metrics
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if (poll(&pfd, 1, 1000) <= 0 || recv(fd, request, sizeof(request), 0) <= 0) return;
+  std::string body = ncclMetricsText();
+  char header[256];
+  snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+  std::string response = header + body;
+  size_t offset = 0;
+  while (offset < response.size()) {
+    ssize_t n = send(fd, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+    if (n <= 0) break;
+    offset += n;
+  }
+}
+
+struct ncclMetricsExporter {
+  int listenFd;
+  char path[PATH_MAX];
+};
+
+static void* ncclMetricsExporterMain(void* args) {
+  struct ncclMetricsExporter* exporter = (struct ncclMetricsExporter*)args;
+  int64_t interval = std::max(ncclParamMetricsIntervalMs(), (int64_t)100);
+  uint64_t nextWrite = clockNano();
+  while (true) {
+    if (exporter->path[0] && clockNano() >= nextWrite) {
+      ncclMetricsWriteFile(exporter->path);
+      nextWrite = clockNano() + interval * 1000000;
+    }
+    if (exporter->listenFd < 0) {
+      usleep(interval * 1000);
+      continue;
+    }
+    struct pollfd pfd = { exporter->listenFd, POLLIN, 0 };
+    if (poll(&pfd, 1, exporter->path[0] ? interval : -1) <= 0) continue;
+    int fd = accept(exporter->listenFd, nullptr, nullptr);
+    if (fd < 0) continue;
+    ncclMetricsServe(fd);
+    close(fd);
+  }
+  return nullptr;
+}
+
+// Ranks of a node share the port range, each process takes the first free port from NCCL_METRICS_PORT
+static int ncclMetricsListen(int basePort) {
+  for (int port = basePort; port < basePort + 64 && port < 65536; port++) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(fd, 16) == 0) {
+      INFO(NCCL_INIT, "Metrics served over HTTP on port %d", port);
+      return fd;
+    }
+    close(fd);
+  }
+  WARN("Metrics: no free port from NCCL_METRICS_PORT=%d", basePort);
+  return -1;
+}
+
+// %h and %p of NCCL_METRICS_FILE are the hostname and pid, as in NCCL_DEBUG_FILE
+static void ncclMetricsExpandPath(const char* env, char* path) {
+  char hostname[1024];
+  getHostName(hostname, sizeof(hostname), '.');
+  std::string out;
+  for (int c = 0; env[c] != '\0'; c++) {
+    if (env[c] != '%' || env[c + 1] == '\0') { out += env[c]; continue; }
+    c++;
+    if (env[c] == 'h') out += hostname;
+    else if (env[c] == 'p') out += std::to_string(getpid());
+    else if (env[c] == '%') out += '%';
+    else { out += '%'; out += env[c]; }
+  }
+  snprintf(path, PATH_MAX, "%s", out.c_str());
+}
+
+ncclResult_t ncclMetricsInit() {
+  if (!ncclMetricsEnabled()) return ncclSuccess;
+  const char* fileEnv = ncclGetEnv("NCCL_METRICS_FILE");
+  int port = ncclParamMetricsPort();
+  if (port <= 0 && (fileEnv == nullptr || fileEnv[0] == '\0')) return ncclSuccess;
+  struct ncclMetricsExporter* exporter;
+  NCCLCHECK(ncclCalloc(&exporter, 1));
+  exporter->listenFd = port > 0 ? ncclMetricsListen(port) : -1;
+  if (fileEnv && fileEnv[0]) ncclMetricsExpandPath(fileEnv, exporter->path);
+  if (exporter->listenFd < 0 && exporter->path[0] == '\0') {
+    free(exporter);
+    return ncclSuccess;
+  }
+  // Lives as long as the process
+  pthread_t thread;
+  PTHREADCHECK(pthread_create(&thread, NULL, ncclMetricsExporterMain, exporter), "pthread_create");
+  ncclSetThreadName(thread, "NCCL Metrics");
+  PTHREADCHECK(pthread_detach(thread), "pthread_detach");
+  return ncclSuccess;
+}
@@ -0,0 +1,254 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+#include "utils.h"
+
+#include "msccl/msccl_autotune.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclAutotune, "MSCCL_AUTOTUNE", 0);
+NCCL_PARAM(MscclAutotuneIters, "MSCCL_AUTOTUNE_ITERS", 3);
+
+// Decisions are appended to this file by rank 0, one per line:
+//   nRanks func log2(nBytes) dataType inPlace <algorithm file path or "nccl">
+// and read back by later jobs, the last line of a key wins.
+static const char* mscclAutotuneFileEnv = "NCCL_MSCCL_AUTOTUNE_FILE";
+static const char* mscclAutotuneNcclName = "nccl";
+
+bool mscclAutotuneEnabled() {
+  return ncclParamMscclAutotune() != 0;
+}
+
+static int mscclAutotuneIters() {
+  return std::max((int)ncclParamMscclAutotuneIters(), 1);
+}
+
+// Decisions are agreed by all ranks, so only collectives every rank takes part in are tuned
+static bool mscclAutotuneSupported(mscclFunc_t func) {
+  return func != mscclFuncSend && func != mscclFuncRecv;
+}
+
+static const char* mscclAutotuneName(ncclComm_t comm, int candidate) {
+  return candidate < 0 ? mscclAutotuneNcclName : mscclGetCommStatus(comm).catalog->metas[candidate].filePath.c_str();
+}
+
+static ncclResult_t mscclAutotuneLoadFile(ncclComm_t comm, struct mscclAutotuneStatus* tune) {
+  const char* path = ncclGetEnv(mscclAutotuneFileEnv);
+  if (path == nullptr) {
+    return ncclSuccess;
+  }
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) {
+    INFO(NCCL_TUNING, "MSCCL: Autotune file %s not found, exploring from scratch", path);
+    return ncclSuccess;
+  }
+  const std::vector<mscclAlgoMeta>& metas = mscclGetCommStatus(comm).catalog->metas;
+  char line[PATH_MAX + 64];
+  char name[PATH_MAX];
+  int nLoaded = 0;
+  while (fgets(line, sizeof(line), file)) {
+    int nRanks, func, log2Bytes, dataType, inPlace;
+    if (sscanf(line, "%d %d %d %d %d %4095[^\n]", &nRanks, &func, &log2Bytes, &dataType, &inPlace, name) != 6) {
+      continue;
+    }
+    if (nRanks != comm->nRanks) {
+      continue;
+    }
+    int winner = -2;
+    if (strcmp(name, mscclAutotuneNcclName) == 0) {
+      winner = -1;
+    } else {
+      for (size_t i = 0; i < metas.size(); i++) {
+        if (metas[i].nRanks == nRanks && !metas[i].retired && metas[i].filePath == name) {
+          winner = i;
+          break;
+        }
+      }
+    }
+    if (winner == -2) {
+      TRACE(NCCL_TUNING, "MSCCL: Autotune file entry for %s ignored, algorithm is not loaded", name);
+      continue;
+    }
+    struct mscclAutotuneEntry& entry = tune->table[mscclAutotuneKey((mscclFunc_t)func, log2Bytes, (ncclDataType_t)dataType, inPlace != 0)];
+    entry.decided = true;
+    entry.winner = winner;
+    nLoaded++;
+  }
+  fclose(file);
+  INFO(NCCL_TUNING, "MSCCL: Loaded %d autotuning decisions from %s", nLoaded, path);
+  return ncclSuccess;
+}
+
+static void mscclAutotuneSaveEntry(ncclComm_t comm, const mscclAutotuneKey& key, const struct mscclAutotuneEntry& entry) {
+  const char* path = ncclGetEnv(mscclAutotuneFileEnv);
+  if (path == nullptr) {
+    return;
+  }
+  FILE* file = fopen(path, "a");
+  if (file == nullptr) {
+    WARN("MSCCL: Unable to open autotune file %s : %s", path, strerror(errno));
+    return;
+  }
+  fprintf(file, "%d %d %d %d %d %s\n", comm->nRanks, (int)std::get<0>(key), std::get<1>(key),
+    (int)std::get<2>(key), (int)std::get<3>(key), mscclAutotuneName(comm, entry.winner));
+  fclose(file);
+}
+
+ncclResult_t mscclAutotuneChoose(struct mscclSavedSchedulerParam* savedParam, bool inPlace,
+    const std::vector<int>& candidates, int defaultChoice, int* choice) {
+  struct mscclSchedulerParam* param = &savedParam->p;
+  mscclCommStatus& commStatus = mscclGetCommStatus(savedParam->comm);
+  *choice = defaultChoice;
+  if (commStatus.autotune == nullptr) {
+    commStatus.autotune = new mscclAutotuneStatus();
+  }
+  struct mscclAutotuneStatus* tune = commStatus.autotune;
+  tune->pending = false;
+  if (!tune->fileLoaded) {
+    NCCLCHECK(mscclAutotuneLoadFile(savedParam->comm, tune));
+    tune->fileLoaded = true;
+  }
+
+  if (!mscclAutotuneSupported(param->func) || candidates.empty()) {
+    return ncclSuccess;
+  }
+  std::vector<int> allCandidates(candidates);
+  allCandidates.push_back(-1);
+
+  mscclAutotuneKey key(param->func, log2i(param->count * ncclTypeSize(param->dataType)), param->dataType, inPlace);
+  auto it = tune->table.find(key);
+  if (it != tune->table.end() && it->second.decided) {
+    int winner = it->second.winner;
+    if (std::find(allCandidates.begin(), allCandidates.end(), winner) != allCandidates.end()) {
+      *choice = winner;
+    }
+    return ncclSuccess;
+  }
+
+  // Only standalone calls outside of graph capture can be timed
+  if (mscclGetThreadLocalStatus().groupStatus != mscclNoGroup) {
+    return ncclSuccess;
+  }
+  cudaStreamCaptureStatus captureStatus;
+  CUDACHECK(cudaStreamIsCapturing(savedParam->stream, &captureStatus));
+  if (captureStatus != cudaStreamCaptureStatusNone) {
+    return ncclSuccess;
+  }
+
+  if (it == tune->table.end()) {
+    struct mscclAutotuneEntry& entry = tune->table[key];
+    entry.candidates = allCandidates;
+    entry.totalTime.assign(allCandidates.size(), 0.0f);
+    entry.nCalls = 0;
+    entry.decided = false;
+    entry.winner = defaultChoice;
+    it = tune->table.find(key);
+  }
+  // Calls of a size bucket that straddles algorithm ranges are not explored
+  struct mscclAutotuneEntry& entry = it->second;
+  if (entry.candidates != allCandidates) {
+    return ncclSuccess;
+  }
+  *choice = entry.candidates[entry.nCalls % entry.candidates.size()];
+  tune->pending = true;
+  tune->pendingKey = key;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclAutotuneBegin(ncclComm_t comm, cudaStream_t stream) {
+  struct mscclAutotuneStatus* tune = mscclGetCommStatus(comm).autotune;
+  if (tune == nullptr || !tune->pending) {
+    return ncclSuccess;
+  }
+  if (!tune->eventsCreated) {
+    CUDACHECK(cudaEventCreate(&tune->events[0]));
+    CUDACHECK(cudaEventCreate(&tune->events[1]));
+    tune->eventsCreated = true;
+  }
+  CUDACHECK(cudaEventRecord(tune->events[0], stream));
+  return ncclSuccess;
+}
+
+// Agree on the winner across ranks. A collective is as slow as its slowest rank, so candidates
+// are ranked by the maximum over ranks of their mean time.
+static ncclResult_t mscclAutotuneDecide(ncclComm_t comm, const mscclAutotuneKey& key, struct mscclAutotuneEntry& entry) {
+  int n = entry.candidates.size();
+  std::vector<float> times(comm->nRanks * n);
+  for (int i = 0; i < n; i++) {
+    times[comm->rank * n + i] = entry.totalTime[i] / mscclAutotuneIters();
+  }
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, times.data(), n * sizeof(float)));
+  int best = -1;
+  float bestTime = 0.0f;
+  for (int i = 0; i < n; i++) {
+    float time = 0.0f;
+    for (int r = 0; r < comm->nRanks; r++) {
+      time = std::max(time, times[r * n + i]);
+    }
+    TRACE(NCCL_TUNING, "MSCCL: Autotune candidate %s took %f us", mscclAutotuneName(comm, entry.candidates[i]), time);
+    if (best < 0 || time < bestTime) {
+      best = i;
+      bestTime = time;
+    }
+  }
+  entry.winner = entry.candidates[best];
+  entry.decided = true;
+  INFO(NCCL_TUNING, "MSCCL: Autotune func %d log2(bytes) %d dtype %d inPlace %d selected %s (%f us)",
+    (int)std::get<0>(key), std::get<1>(key), (int)std::get<2>(key), (int)std::get<3>(key),
+    mscclAutotuneName(comm, entry.winner), bestTime);
+  if (comm->rank == 0) {
+    mscclAutotuneSaveEntry(comm, key, entry);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclAutotuneEnd(ncclComm_t comm, cudaStream_t stream) {
+  struct mscclAutotuneStatus* tune = mscclGetCommStatus(comm).autotune;
+  if (tune == nullptr || !tune->pending) {
+    return ncclSuccess;
+  }
+  tune->pending = false;
+  float ms;
+  CUDACHECK(cudaEventRecord(tune->events[1], stream));
+  CUDACHECK(cudaEventSynchronize(tune->events[1]));
+  CUDACHECK(cudaEventElapsedTime(&ms, tune->events[0], tune->events[1]));
+
+  // The first round over the candidates warms up connections and caches and is not counted
+  struct mscclAutotuneEntry& entry = tune->table[tune->pendingKey];
+  int n = entry.candidates.size();
+  if (entry.nCalls >= n) {
+    entry.totalTime[entry.nCalls % n] += ms * 1000.0f;
+  }
+  entry.nCalls++;
+  if (entry.nCalls == n * (mscclAutotuneIters() + 1)) {
+    NCCLCHECK(mscclAutotuneDecide(comm, tune->pendingKey, entry));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclAutotuneTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclAutotuneStatus* tune = commStatus.autotune;
+  if (tune == nullptr) {
+    return ncclSuccess;
+  }
+  if (tune->eventsCreated) {
+    CUDACHECK(cudaEventDestroy(tune->events[0]));
+    CUDACHECK(cudaEventDestroy(tune->events[1]));
+  }
+  delete tune;
+  commStatus.autotune = nullptr;
+  return ncclSuccess;
+}
@@ -0,0 +1,313 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <errno.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "alloc.h"
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+
+#include "msccl/msccl_benchmark.h"
+#include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_setup.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclBenchMaxBytes, "MSCCL_BENCH_MAX_BYTES", 1 << 28);
+NCCL_PARAM(MscclBenchIters, "MSCCL_BENCH_ITERS", 20);
+NCCL_PARAM(MscclBenchWarmupIters, "MSCCL_BENCH_WARMUP_ITERS", 5);
+
+struct mscclBenchResult {
+  int metaIndex;
+  bool inPlace;
+  int64_t nBytes;
+  // us, the slowest rank
+  float mscclTime;
+  float ncclTime;
+};
+
+const char* mscclBenchFuncName(mscclFunc_t func) {
+  switch (func) {
+    case mscclFuncReduce: return "reduce";
+    case mscclFuncBroadcast: return "broadcast";
+    case mscclFuncAllReduce: return "allreduce";
+    case mscclFuncReduceScatter: return "reducescatter";
+    case mscclFuncAllGather: return "allgather";
+    case mscclFuncAllToAll: return "alltoall";
+    default: return nullptr;
+  }
+}
+
+double mscclBenchBusFactor(mscclFunc_t func, int nRanks) {
+  switch (func) {
+    case mscclFuncAllReduce: return 2.0 * (nRanks - 1) / nRanks;
+    case mscclFuncReduceScatter:
+    case mscclFuncAllGather:
+    case mscclFuncAllToAll: return (double)(nRanks - 1) / nRanks;
+    default: return 1.0;
+  }
+}
+
+ncclResult_t mscclBenchRunNccl(mscclFunc_t func, const void* sendBuff, void* recvBuff, size_t count, ncclComm_t comm, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  mscclSetIsCallerFlag();
+  switch (func) {
+    case mscclFuncReduce:
+      ret = ncclReduce(sendBuff, recvBuff, count, mscclBenchDataType, ncclSum, 0, comm, stream);
+      break;
+    case mscclFuncBroadcast:
+      ret = ncclBroadcast(sendBuff, recvBuff, count, mscclBenchDataType, 0, comm, stream);
+      break;
+    case mscclFuncAllReduce:
+      ret = ncclAllReduce(sendBuff, recvBuff, count, mscclBenchDataType, ncclSum, comm, stream);
+      break;
+    case mscclFuncReduceScatter:
+      ret = ncclReduceScatter(sendBuff, recvBuff, count, mscclBenchDataType, ncclSum, comm, stream);
+      break;
+    case mscclFuncAllGather:
+      ret = ncclAllGather(sendBuff, recvBuff, count, mscclBenchDataType, comm, stream);
+      break;
+    case mscclFuncAllToAll:
+      ret = ncclAllToAll(sendBuff, recvBuff, count, mscclBenchDataType, comm, stream);
+      break;
+    default:
+      ret = ncclInvalidUsage;
+  }
+  mscclClearIsCallerFlag();
+  return ret;
+}
+
+static ncclResult_t mscclBenchRun(mscclFunc_t func, mscclAlgoHandle_t handle, bool msccl, const void* sendBuff, void* recvBuff,
+    size_t count, ncclComm_t comm, cudaStream_t stream) {
+  if (!msccl) {
+    NCCLCHECK(mscclBenchRunNccl(func, sendBuff, recvBuff, count, comm, stream));
+    return ncclSuccess;
+  }
+  NCCLCHECK(mscclRunAlgo(sendBuff, nullptr, nullptr, recvBuff, nullptr, nullptr, count, mscclBenchDataType, 0, 0, ncclSum, handle, comm, stream));
+  return ncclSuccess;
+}
+
+// Mean time of a call in us on this rank
+static ncclResult_t mscclBenchTime(mscclFunc_t func, mscclAlgoHandle_t handle, bool msccl, const void* sendBuff, void* recvBuff,
+    size_t count, ncclComm_t comm, cudaStream_t stream, cudaEvent_t events[2], float* time) {
+  const int iters = std::max((int)ncclParamMscclBenchIters(), 1);
+  for (int i = 0; i < ncclParamMscclBenchWarmupIters(); i++) {
+    NCCLCHECK(mscclBenchRun(func, handle, msccl, sendBuff, recvBuff, count, comm, stream));
+  }
+  CUDACHECK(cudaEventRecord(events[0], stream));
+  for (int i = 0; i < iters; i++) {
+    NCCLCHECK(mscclBenchRun(func, handle, msccl, sendBuff, recvBuff, count, comm, stream));
+  }
+  CUDACHECK(cudaEventRecord(events[1], stream));
+  CUDACHECK(cudaEventSynchronize(events[1]));
+  float ms;
+  CUDACHECK(cudaEventElapsedTime(&ms, events[0], events[1]));
+  *time = ms * 1000.0f / iters;
+  return ncclSuccess;
+}
+
+bool mscclBenchCount(const struct mscclAlgoMeta& m, int64_t nBytes, size_t* count) {
+  const int typeSize = ncclTypeSize(mscclBenchDataType);
+  if (nBytes < m.minBytes || nBytes % ((int64_t)typeSize * m.sizeMultiplier) != 0) return false;
+  *count = nBytes / typeSize / m.sizeMultiplier;
+  return (*count * m.sizeMultiplier) % m.nChunksPerLoop == 0;
+}
+
+void mscclBenchBuffers(mscclFunc_t func, bool inPlace, size_t count, ncclComm_t comm, char* sendBuff, char* recvBuff,
+    const char** send, char** recv) {
+  *send = sendBuff;
+  *recv = recvBuff;
+  if (!inPlace) return;
+  const size_t rankOffset = comm->rank * count * ncclTypeSize(mscclBenchDataType);
+  if (func == mscclFuncAllGather) *send = recvBuff + rankOffset;
+  else if (func == mscclFuncReduceScatter) *recv = sendBuff + rankOffset;
+  else *send = recvBuff;
+}
+
+void mscclBenchRuns(ncclComm_t comm, const struct mscclAlgoCatalog* catalog, std::vector<std::pair<int, bool>>* runs) {
+  for (auto& entry : catalog->index) {
+    if (mscclBenchFuncName(std::get<0>(entry.first)) == nullptr) continue;
+    std::set<int> indices;
+    for (auto& seg : entry.second.segments) indices.insert(seg.metaIndices.begin(), seg.metaIndices.end());
+    for (int i : indices) {
+      const struct mscclAlgoMeta& m = catalog->metas[i];
+      if (m.nNvlsChannels > 0 && !mscclNvlsAvailable(comm, m.nNvlsChannels)) continue;
+      if (m.collNet && !mscclCollNetAvailable(comm, ncclSum, mscclBenchDataType)) continue;
+      runs->push_back(std::make_pair(i, std::get<2>(entry.first)));
+    }
+  }
+}
+
+// Least squares fit of time = latency + nBytes / (1000 * bandwidth), on the sizes of one algorithm
+static void mscclBenchFit(const std::vector<struct mscclBenchResult>& results, size_t first, size_t last, float* latency, float* bandwidth) {
+  double n = last - first, sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (size_t i = first; i < last; i++) {
+    double x = results[i].nBytes, y = results[i].mscclTime;
+    sx += x; sy += y; sxx += x * x; sxy += x * y;
+  }
+  double det = n * sxx - sx * sx;
+  double slope = det > 0.0 ? (n * sxy - sx * sy) / det : 0.0;
+  *latency = std::max(0.0, (sy - slope * sx) / n);
+  *bandwidth = slope > 0.0 ? 1.0 / (1000.0 * slope) : 0.0f;
+}
+
+static void mscclBenchWriteCsv(FILE* file, ncclComm_t comm, const struct mscclAlgoCatalog* catalog, const std::vector<struct mscclBenchResult>& results) {
+  fprintf(file, "algorithm,func,inplace,bytes,msccl_us,nccl_us,msccl_algbw,msccl_busbw,nccl_algbw,nccl_busbw,speedup\n");
+  for (auto& r : results) {
+    const struct mscclAlgoMeta& m = catalog->metas[r.metaIndex];
+    double factor = mscclBenchBusFactor(m.func, comm->nRanks);
+    double mscclAlgBw = r.nBytes / (1000.0 * r.mscclTime);
+    double ncclAlgBw = r.nBytes / (1000.0 * r.ncclTime);
+    fprintf(file, "%s,%s,%d,%ld,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f\n", m.filePath.c_str(), mscclBenchFuncName(m.func), r.inPlace ? 1 : 0,
+      r.nBytes, r.mscclTime, r.ncclTime, mscclAlgBw, mscclAlgBw * factor, ncclAlgBw, ncclAlgBw * factor, r.ncclTime / r.mscclTime);
+  }
+
+  // Performance model of each algorithm, as the latency and bandwidth attributes of its algo tag
+  fprintf(file, "# model: algorithm,inplace,latency,bandwidth\n");
+  for (size_t first = 0; first < results.size();) {
+    size_t last = first;
+    while (last < results.size() && results[last].metaIndex == results[first].metaIndex && results[last].inPlace == results[first].inPlace) last++;
+    float latency, bandwidth;
+    mscclBenchFit(results, first, last, &latency, &bandwidth);
+    fprintf(file, "# model: %s,%d,%.2f,%.2f\n", catalog->metas[results[first].metaIndex].filePath.c_str(),
+      results[first].inPlace ? 1 : 0, latency, bandwidth);
+    first = last;
+  }
+
+  // Fastest of the algorithms and NCCL for each call
+  fprintf(file, "# best: func,inplace,bytes,choice,us\n");
+  std::vector<size_t> order(results.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const struct mscclBenchResult& ra = results[a];
+    const struct mscclBenchResult& rb = results[b];
+    mscclFunc_t fa = catalog->metas[ra.metaIndex].func, fb = catalog->metas[rb.metaIndex].func;
+    if (fa != fb) return fa < fb;
+    if (ra.inPlace != rb.inPlace) return ra.inPlace < rb.inPlace;
+    return ra.nBytes != rb.nBytes ? ra.nBytes < rb.nBytes : a < b;
+  });
+  for (size_t first = 0; first < order.size();) {
+    const struct mscclBenchResult& head = results[order[first]];
+    mscclFunc_t func = catalog->metas[head.metaIndex].func;
+    const char* choice = "nccl";
+    float best = head.ncclTime;
+    size_t last = first;
+    for (; last < order.size(); last++) {
+      const struct mscclBenchResult& r = results[order[last]];
+      if (catalog->metas[r.metaIndex].func != func || r.inPlace != head.inPlace || r.nBytes != head.nBytes) break;
+      if (r.mscclTime < best) {
+        best = r.mscclTime;
+        choice = catalog->metas[r.metaIndex].filePath.c_str();
+      }
+    }
+    fprintf(file, "# best: %s,%d,%ld,%s,%.2f\n", mscclBenchFuncName(func), head.inPlace ? 1 : 0, head.nBytes, choice, best);
+    first = last;
+  }
+}
+
+static ncclResult_t mscclBenchAlgos(ncclComm_t comm, const char* csvFile, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  const struct mscclAlgoCatalog* catalog = mscclGetCommStatus(comm).catalog;
+  const int64_t maxBytes = ncclParamMscclBenchMaxBytes();
+  std::vector<struct mscclBenchResult> results;
+  cudaEvent_t events[2] = {nullptr, nullptr};
+  char* sendBuff = nullptr;
+  char* recvBuff = nullptr;
+  FILE* file = nullptr;
+
+  std::vector<std::pair<int, bool>> runs;
+  mscclBenchRuns(comm, catalog, &runs);
+  if (runs.empty()) {
+    INFO(NCCL_INIT, "MSCCL: no algorithm to benchmark on %d ranks", comm->nRanks);
+    return ncclSuccess;
+  }
+
+  NCCLCHECKGOTO(ncclCudaCalloc(&sendBuff, maxBytes), ret, exit);
+  NCCLCHECKGOTO(ncclCudaCalloc(&recvBuff, maxBytes), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[0]), ret, exit);
+  CUDACHECKGOTO(cudaEventCreate(&events[1]), ret, exit);
+
+  for (auto& run : runs) {
+    const struct mscclAlgoMeta& m = catalog->metas[run.first];
+    const bool inPlace = run.second;
+    mscclAlgoHandle_t handle;
+    NCCLCHECKGOTO(mscclPrepareCatalogAlgo(comm, run.first, &handle), ret, exit);
+    const int64_t hiBytes = m.maxBytes > 0 ? std::min(m.maxBytes, maxBytes) : maxBytes;
+    for (int64_t nBytes = MSCCL_BENCH_MIN_BYTES; nBytes <= hiBytes; nBytes *= 2) {
+      size_t count;
+      if (!mscclBenchCount(m, nBytes, &count)) continue;
+      const char* send;
+      char* recv;
+      mscclBenchBuffers(m.func, inPlace, count, comm, sendBuff, recvBuff, &send, &recv);
+      float times[2];
+      NCCLCHECKGOTO(mscclBenchTime(m.func, handle, true, send, recv, count, comm, stream, events, &times[0]), ret, exit);
+      NCCLCHECKGOTO(mscclBenchTime(m.func, handle, false, send, recv, count, comm, stream, events, &times[1]), ret, exit);
+      // A collective is as slow as its slowest rank
+      std::vector<float> allTimes(2 * comm->nRanks);
+      allTimes[2 * comm->rank] = times[0];
+      allTimes[2 * comm->rank + 1] = times[1];
+      NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allTimes.data(), 2 * sizeof(float)), ret, exit);
+      struct mscclBenchResult r = {run.first, inPlace, nBytes, 0.0f, 0.0f};
+      for (int i = 0; i < comm->nRanks; i++) {
+        r.mscclTime = std::max(r.mscclTime, allTimes[2 * i]);
+        r.ncclTime = std::max(r.ncclTime, allTimes[2 * i + 1]);
+      }
+      TRACE(NCCL_TUNING, "MSCCL: Benchmark %s inPlace %d %ld bytes msccl %f us nccl %f us", m.filePath.c_str(), inPlace, nBytes, r.mscclTime, r.ncclTime);
+      results.push_back(r);
+    }
+  }
+
+  if (comm->rank == 0) {
+    file = fopen(csvFile, "w");
+    if (file == nullptr) {
+      WARN("MSCCL: Unable to open benchmark file %s : %s", csvFile, strerror(errno));
+      ret = ncclSystemError;
+      goto exit;
+    }
+    mscclBenchWriteCsv(file, comm, catalog, results);
+    fclose(file);
+    INFO(NCCL_INIT, "MSCCL: Benchmarked %zu algorithms over %zu calls into %s", runs.size(), results.size(), csvFile);
+  }
+
+exit:
+  if (events[0]) cudaEventDestroy(events[0]);
+  if (events[1]) cudaEventDestroy(events[1]);
+  if (sendBuff) ncclCudaFree(sendBuff);
+  if (recvBuff) ncclCudaFree(recvBuff);
+  return ret;
+}
+
+static ncclResult_t mscclBenchUsable(ncclComm_t comm) {
+  if (!mscclAvailable() || !comm->mscclCompatible) {
+    WARN("MSCCL: benchmark needs MSCCL to be enabled on the communicator");
+    return ncclInvalidUsage;
+  }
+  if (comm->mscclExternalScheduler) {
+    WARN("MSCCL: algorithms of external scheduler %s cannot be benchmarked", mscclGetStatus().mscclSchedulerPtr->name);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclBenchmarkAlgosComm(ncclComm_t comm, const char* csvFile, cudaStream_t stream) {
+  NCCLCHECK(mscclBenchUsable(comm));
+  ncclResult_t ret = ncclSuccess;
+  int savedDevice;
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+  ret = mscclBenchAlgos(comm, csvFile, stream);
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ret;
+}
@@ -0,0 +1,321 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "alloc.h"
+#include "checks.h"
+#include "debug.h"
+
+#include "msccl/msccl_binary.h"
+#include "msccl/msccl_parser.h"
+
+bool mscclIsAlgoBinFile(const char* filePath) {
+  char magic[sizeof(((struct mscclAlgoBinHeader*)0)->magic)];
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t n = read(fd, magic, sizeof(magic));
+  close(fd);
+  return n == sizeof(magic) && memcmp(magic, MSCCL_ALGO_BIN_MAGIC, sizeof(magic)) == 0;
+}
+
+static ncclResult_t mscclCheckAlgoBinHeader(const char* binFile, const struct mscclAlgoBinHeader* header, size_t fileSize) {
+  if (fileSize < sizeof(struct mscclAlgoBinHeader) ||
+      memcmp(header->magic, MSCCL_ALGO_BIN_MAGIC, sizeof(header->magic)) != 0) {
+    WARN("MSCCL: %s is not a precompiled MSCCL algorithm file", binFile);
+    return ncclInvalidUsage;
+  }
+  if (header->version != MSCCL_ALGO_BIN_VERSION) {
+    WARN("MSCCL: %s has version %u, expected %u", binFile, header->version, MSCCL_ALGO_BIN_VERSION);
+    return ncclInvalidUsage;
+  }
+  if (header->maxNumSteps != MSCCL_MAX_NUM_STEPS ||
+      header->threadBlockSize != sizeof(struct mscclThreadBlock) ||
+      header->channelInfoSize != sizeof(struct mscclChannelInfo) ||
+      header->peerInfoSize != sizeof(struct mscclChannelPeerInfo)) {
+    WARN("MSCCL: %s was compiled for MSCCL_MAX_NUM_STEPS %u, this library uses %d, please recompile it", binFile, header->maxNumSteps, MSCCL_MAX_NUM_STEPS);
+    return ncclInvalidUsage;
+  }
+  if (header->nRanks <= 0 || sizeof(struct mscclAlgoBinHeader) + header->nRanks * sizeof(uint64_t) > fileSize) {
+    WARN("MSCCL: %s is truncated", binFile);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclGetAlgoFromBinImage(const char* name, const char* base, size_t size, struct mscclAlgo* algo, int rank) {
+  const struct mscclAlgoBinHeader* header = (const struct mscclAlgoBinHeader*)base;
+  const uint64_t* rankOffsets = (const uint64_t*)(header + 1);
+  NCCLCHECK(mscclCheckAlgoBinHeader(name, header, size));
+
+  // zeroing out all entries, as the XML parser does
+  memset(algo, 0, sizeof(struct mscclAlgo));
+  algo->nChunksPerLoop = header->nChunksPerLoop;
+  algo->protocol = header->protocol;
+  algo->nChannels = header->nChannels;
+  algo->nNvlsChannels = header->nNvlsChannels;
+  algo->nRanks = header->nRanks;
+  algo->sizeMultiplier = header->sizeMultiplier;
+  algo->chunkSteps = header->chunkSteps;
+  algo->sliceSteps = header->sliceSteps;
+  algo->func = (mscclFunc_t)header->func;
+  algo->minBytes = header->minBytes;
+  algo->maxBytes = header->maxBytes;
+  algo->inPlace = header->inPlace;
+  algo->outOfPlace = header->outOfPlace;
+  algo->collNet = header->collNet;
+  if (rank < 0 || rank >= header->nRanks || rankOffsets[rank] == 0) return ncclSuccess;
+
+  if (rankOffsets[rank] + sizeof(struct mscclAlgoBinRank) > size) {
+    WARN("MSCCL: %s is truncated", name);
+    return ncclInvalidUsage;
+  }
+  const struct mscclAlgoBinRank* binRank = (const struct mscclAlgoBinRank*)(base + rankOffsets[rank]);
+  if (binRank->nBlocks < 0 || binRank->nBlocks > MSCCL_MAX_NUM_THREAD_BLOCKS ||
+      binRank->nChannelInfos < 0 || binRank->nChannelInfos > MAXCHANNELS ||
+      binRank->nPeerInfos < 0 || binRank->nPeerInfos > MSCCL_MAX_PEER_INFOS) {
+    WARN("MSCCL: %s has an invalid record for rank %d", name, rank);
+    return ncclInvalidUsage;
+  }
+  size_t recordSize = sizeof(struct mscclAlgoBinRank) + binRank->nBlocks * sizeof(struct mscclThreadBlock) +
+    binRank->nChannelInfos * sizeof(struct mscclChannelInfo) + binRank->nPeerInfos * sizeof(struct mscclChannelPeerInfo);
+  if (rankOffsets[rank] + recordSize > size) {
+    WARN("MSCCL: %s is truncated", name);
+    return ncclInvalidUsage;
+  }
+  algo->nBlocks = binRank->nBlocks;
+  algo->nScratchChunks = binRank->nScratchChunks;
+  algo->hasReduce = binRank->hasReduce;
+  algo->protocolMask = binRank->protocolMask;
+  NCCLCHECK(mscclCheckProtocols(algo, rank));
+  const char* p = (const char*)(binRank + 1);
+  memcpy(algo->mscclTBs, p, binRank->nBlocks * sizeof(struct mscclThreadBlock));
+  p += binRank->nBlocks * sizeof(struct mscclThreadBlock);
+  memcpy(algo->mscclChannels, p, binRank->nChannelInfos * sizeof(struct mscclChannelInfo));
+  p += binRank->nChannelInfos * sizeof(struct mscclChannelInfo);
+  memcpy(algo->peerInfos, p, binRank->nPeerInfos * sizeof(struct mscclChannelPeerInfo));
+  algo->nPeerInfos = binRank->nPeerInfos;
+  for (int c = 0; c < binRank->nChannelInfos; c++) {
+    const struct mscclChannelInfo* mCh = algo->mscclChannels + c;
+    bool valid = mCh->nSendPeers >= 0 && mCh->nSendPeers <= MSCCL_MAX_CHANNEL_PEERS &&
+      mCh->nRecvPeers >= 0 && mCh->nRecvPeers <= MSCCL_MAX_CHANNEL_PEERS;
+    for (int i = 0; valid && i < mCh->nSendPeers; i++) valid = mCh->sendPeerInfos[i] >= 0 && mCh->sendPeerInfos[i] < algo->nPeerInfos;
+    for (int i = 0; valid && i < mCh->nRecvPeers; i++) valid = mCh->recvPeerInfos[i] >= 0 && mCh->recvPeerInfos[i] < algo->nPeerInfos;
+    if (!valid) {
+      WARN("MSCCL: %s has an invalid record for rank %d", name, rank);
+      return ncclInvalidUsage;
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclGetAlgoFromBinFile(const char* binFile, struct mscclAlgo* algo, int rank) {
+  int fd = open(binFile, O_RDONLY);
+  if (fd < 0) {
+    WARN("Could not open MSCCL algorithm file %s : %s", binFile, strerror(errno));
+    return ncclSystemError;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    WARN("Could not stat MSCCL algorithm file %s : %s", binFile, strerror(errno));
+    close(fd);
+    return ncclSystemError;
+  }
+  size_t fileSize = st.st_size;
+  // Pages are shared through the page cache by all ranks of the node mapping the same file
+  char* base = (char*)mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    WARN("Could not mmap MSCCL algorithm file %s : %s", binFile, strerror(errno));
+    return ncclSystemError;
+  }
+  ncclResult_t ret = mscclGetAlgoFromBinImage(binFile, base, fileSize, algo, rank);
+  munmap(base, fileSize);
+  return ret;
+}
+
+ncclResult_t mscclGetAlgoMetaFromBinFile(const char* binFile, struct mscclAlgoMeta* algoMeta) {
+  struct mscclAlgoBinHeader header;
+  int fd = open(binFile, O_RDONLY);
+  if (fd < 0) {
+    WARN("Could not open MSCCL algorithm file %s : %s", binFile, strerror(errno));
+    return ncclSystemError;
+  }
+  struct stat st;
+  ssize_t n = -1;
+  if (fstat(fd, &st) == 0) n = read(fd, &header, sizeof(header));
+  close(fd);
+  if (n != sizeof(header)) {
+    WARN("Could not read MSCCL algorithm file %s", binFile);
+    return ncclSystemError;
+  }
+  NCCLCHECK(mscclCheckAlgoBinHeader(binFile, &header, st.st_size));
+
+  algoMeta->filePath = binFile;
+  algoMeta->nChunksPerLoop = header.nChunksPerLoop;
+  algoMeta->nChannels = header.nChannels;
+  algoMeta->nNvlsChannels = header.nNvlsChannels;
+  algoMeta->nRanks = header.nRanks;
+  algoMeta->sizeMultiplier = header.sizeMultiplier;
+  algoMeta->func = (mscclFunc_t)header.func;
+  algoMeta->minBytes = header.minBytes;
+  algoMeta->maxBytes = header.maxBytes;
+  algoMeta->inPlace = header.inPlace;
+  algoMeta->outOfPlace = header.outOfPlace;
+  algoMeta->collNet = header.collNet;
+  algoMeta->writesInput = header.writesInput;
+  algoMeta->protocolMask = header.protocolMask;
+  algoMeta->latency = header.latency;
+  algoMeta->bandwidth = header.bandwidth;
+  algoMeta->topo = header.topo;
+  algoMeta->root = header.root;
+  return ncclSuccess;
+}
+
+static void mscclAppendBinImage(std::vector<char>* image, const void* data, size_t size) {
+  image->insert(image->end(), (const char*)data, (const char*)data + size);
+}
+
+ncclResult_t mscclCompileAlgoXml(const char* xmlFile, const std::vector<int>& ranks, std::vector<char>* image) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgoMeta meta;
+  NCCLCHECK(mscclGetAlgoMetaFromXmlFile(xmlFile, &meta));
+  if (meta.nRanks <= 0) {
+    WARN("MSCCL: %s has an invalid number of gpus %d", xmlFile, meta.nRanks);
+    return ncclInvalidUsage;
+  }
+  std::vector<int> allRanks;
+  if (ranks.empty()) {
+    for (int rank = 0; rank < meta.nRanks; rank++) allRanks.push_back(rank);
+  }
+  const std::vector<int>& compiledRanks = ranks.empty() ? allRanks : ranks;
+
+  struct mscclAlgo* algo;
+  NCCLCHECK(ncclCalloc(&algo, 1));
+  std::vector<uint64_t> rankOffsets(meta.nRanks, 0);
+  struct mscclAlgoBinHeader header;
+  memset(&header, 0, sizeof(header));
+  image->clear();
+  // Header and offsets are filled in once all rank records are placed
+  image->resize(sizeof(struct mscclAlgoBinHeader) + meta.nRanks * sizeof(uint64_t));
+  for (int rank : compiledRanks) {
+    if (rank < 0 || rank >= meta.nRanks) continue;
+    NCCLCHECKGOTO(mscclGetAlgoFromXmlFile(xmlFile, algo, rank), ret, exit);
+    if (header.version == 0) {
+      memcpy(header.magic, MSCCL_ALGO_BIN_MAGIC, sizeof(header.magic));
+      header.version = MSCCL_ALGO_BIN_VERSION;
+      header.maxNumSteps = MSCCL_MAX_NUM_STEPS;
+      header.threadBlockSize = sizeof(struct mscclThreadBlock);
+      header.channelInfoSize = sizeof(struct mscclChannelInfo);
+      header.peerInfoSize = sizeof(struct mscclChannelPeerInfo);
+      header.nChunksPerLoop = algo->nChunksPerLoop;
+      header.protocol = algo->protocol;
+      header.nChannels = algo->nChannels;
+      header.nNvlsChannels = algo->nNvlsChannels;
+      header.nRanks = algo->nRanks;
+      header.sizeMultiplier = algo->sizeMultiplier;
+      header.chunkSteps = algo->chunkSteps;
+      header.sliceSteps = algo->sliceSteps;
+      header.func = algo->func;
+      header.minBytes = algo->minBytes;
+      header.maxBytes = algo->maxBytes;
+      header.inPlace = algo->inPlace;
+      header.outOfPlace = algo->outOfPlace;
+      header.collNet = algo->collNet;
+      header.writesInput = meta.writesInput;
+      header.latency = meta.latency;
+      header.bandwidth = meta.bandwidth;
+      header.topo = meta.topo;
+      header.root = meta.root;
+    }
+    if (algo->nBlocks == 0) continue;
+    header.protocolMask |= algo->protocolMask;
+
+    struct mscclAlgoBinRank binRank;
+    memset(&binRank, 0, sizeof(binRank));
+    binRank.nBlocks = algo->nBlocks;
+    binRank.nScratchChunks = algo->nScratchChunks;
+    binRank.hasReduce = algo->hasReduce;
+    binRank.protocolMask = algo->protocolMask;
+    binRank.nPeerInfos = algo->nPeerInfos;
+    for (int bid = 0; bid < algo->nBlocks; bid++) {
+      binRank.nChannelInfos = std::max(binRank.nChannelInfos, algo->mscclTBs[bid].channelId + 1);
+    }
+    rankOffsets[rank] = image->size();
+    mscclAppendBinImage(image, &binRank, sizeof(binRank));
+    mscclAppendBinImage(image, algo->mscclTBs, binRank.nBlocks * sizeof(struct mscclThreadBlock));
+    mscclAppendBinImage(image, algo->mscclChannels, binRank.nChannelInfos * sizeof(struct mscclChannelInfo));
+    mscclAppendBinImage(image, algo->peerInfos, binRank.nPeerInfos * sizeof(struct mscclChannelPeerInfo));
+  }
+  if (header.version == 0) {
+    WARN("MSCCL: no rank of %s was compiled", xmlFile);
+    ret = ncclInvalidUsage;
+    goto exit;
+  }
+  memcpy(image->data(), &header, sizeof(header));
+  memcpy(image->data() + sizeof(header), rankOffsets.data(), meta.nRanks * sizeof(uint64_t));
+exit:
+  free(algo);
+  return ret;
+}
+
+ncclResult_t mscclCompileAlgoXmlFile(const char* xmlFile, const char* binFile) {
+  std::vector<char> image;
+  NCCLCHECK(mscclCompileAlgoXml(xmlFile, std::vector<int>(), &image));
+
+  // Write to a temporary file first so that concurrent readers never see a partial file
+  std::string tmpFile = std::string(binFile) + ".XXXXXX";
+  int fd = mkstemp(&tmpFile[0]);
+  if (fd < 0) {
+    WARN("Could not create MSCCL algorithm file %s : %s", tmpFile.c_str(), strerror(errno));
+    return ncclSystemError;
+  }
+  size_t written = 0;
+  while (written < image.size()) {
+    ssize_t n = write(fd, image.data() + written, image.size() - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    written += n;
+  }
+  if (close(fd) != 0 || written != image.size()) {
+    WARN("Could not write MSCCL algorithm file %s : %s", tmpFile.c_str(), strerror(errno));
+    unlink(tmpFile.c_str());
+    return ncclSystemError;
+  }
+  if (rename(tmpFile.c_str(), binFile) != 0) {
+    WARN("Could not rename %s to %s : %s", tmpFile.c_str(), binFile, strerror(errno));
+    unlink(tmpFile.c_str());
+    return ncclSystemError;
+  }
+  INFO(NCCL_INIT, "MSCCL: Compiled %s into %s, %zu bytes", xmlFile, binFile, image.size());
+  return ncclSuccess;
+}
+
+ncclResult_t mscclGetAlgoFromFile(const char* filePath, struct mscclAlgo* algo, int rank) {
+  if (mscclIsAlgoBinFile(filePath)) {
+    NCCLCHECK(mscclGetAlgoFromBinFile(filePath, algo, rank));
+  } else {
+    NCCLCHECK(mscclGetAlgoFromXmlFile(filePath, algo, rank));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclGetAlgoMetaFromFile(const char* filePath, struct mscclAlgoMeta* algoMeta) {
+  if (mscclIsAlgoBinFile(filePath)) {
+    NCCLCHECK(mscclGetAlgoMetaFromBinFile(filePath, algoMeta));
+  } else {
+    NCCLCHECK(mscclGetAlgoMetaFromXmlFile(filePath, algoMeta));
+  }
+  return ncclSuccess;
+}
@@ -0,0 +1,337 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <map>
+#include <vector>
+
+#include "alloc.h"
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "p2p.h"
+#include "param.h"
+
+#include "msccl/msccl_direct.h"
+#include "msccl/msccl_setup.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclDirect, "MSCCL_DIRECT", 1);
+NCCL_PARAM(MscclScratchIpc, "MSCCL_SCRATCH_IPC", 1);
+
+int64_t ncclParamLocalRegister();
+int64_t ncclParamGraphRegister();
+
+// Steps of the connections with a peer are exchanged with this bootstrap tag
+#define MSCCL_DIRECT_TAG 0x4d534344
+
+// Code of a step in the exchanged lists, steps that can not be zero-copy are MSCCL_DIRECT_NONE
+#define MSCCL_DIRECT_NONE ((uint16_t)0xffff)
+#define MSCCL_DIRECT_CODE(type, count) ((uint16_t)((type) | ((count) << 8)))
+
+// Steps of thread blocks going through one connection of a channel, in program order
+struct mscclDirectConnSteps {
+  int bid = -1;
+  // thread blocks of the same channel and peer interleave their steps, none of them is zero-copy
+  bool shared = false;
+  std::vector<uint16_t> codes;
+  std::vector<int> steps;
+};
+
+// Send and recv connections of each channel with a peer
+struct mscclDirectPeerSteps {
+  std::vector<struct mscclDirectConnSteps> conns[2];
+  bool ipcRecv = false;
+};
+
+bool mscclDirectEnabled() {
+  return ncclParamMscclDirect() != 0;
+}
+
+static bool mscclDirectIsSend(int type) {
+  return type == MSCCL_SEND || type == MSCCL_RECV_COPY_SEND || type == MSCCL_RECV_REDUCE_SEND ||
+    type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_SEND_N;
+}
+
+static bool mscclDirectIsRecv(int type) {
+  return type == MSCCL_RECV || type == MSCCL_RECV_COPY_SEND || type == MSCCL_RECV_REDUCE_SEND ||
+    type == MSCCL_RECV_REDUCE_COPY || type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_RECV_REDUCE_COPY_N;
+}
+
+// P2P connections exchanging pointers and without a proxy, as NCCL direct collectives use them
+static bool mscclDirectConnOk(struct ncclConnector* conn) {
+  return conn->connected && conn->conn.ptrExchange != nullptr && conn->conn.connFifo == nullptr &&
+    (conn->conn.flags & (NCCL_DIRECT_WRITE | NCCL_DIRECT_READ | NCCL_IPC_WRITE | NCCL_IPC_READ)) != 0;
+}
+
+static void mscclDirectAddStep(std::map<int, struct mscclDirectPeerSteps>& peers, int nChannels, int peer, int channelId,
+    int dir, int bid, int step, uint16_t code) {
+  struct mscclDirectPeerSteps& peerSteps = peers[peer];
+  if (peerSteps.conns[dir].empty()) {
+    peerSteps.conns[0].resize(nChannels);
+    peerSteps.conns[1].resize(nChannels);
+  }
+  struct mscclDirectConnSteps& conn = peerSteps.conns[dir][channelId];
+  if (conn.bid >= 0 && conn.bid != bid) conn.shared = true;
+  conn.bid = bid;
+  conn.codes.push_back(code);
+  conn.steps.push_back(step);
+}
+
+static ncclResult_t mscclDirectExchange(ncclComm_t comm, std::map<int, struct mscclDirectPeerSteps>& peers,
+    std::map<int, std::vector<uint16_t>>* peerCodes) {
+  // [nSends][codes][nRecvs][codes] for each channel
+  std::map<int, std::vector<uint16_t>> codes;
+  for (auto& it : peers) {
+    std::vector<uint16_t>& msg = codes[it.first];
+    for (size_t c = 0; c < it.second.conns[0].size(); c++) {
+      for (int dir = 0; dir < 2; dir++) {
+        struct mscclDirectConnSteps& conn = it.second.conns[dir][c];
+        msg.push_back(conn.codes.size());
+        for (uint16_t code : conn.codes) {
+          msg.push_back(conn.shared ? MSCCL_DIRECT_NONE : code);
+        }
+      }
+    }
+  }
+  for (auto& it : codes) {
+    int size = it.second.size() * sizeof(uint16_t);
+    NCCLCHECK(bootstrapSend(comm->bootstrap, it.first, MSCCL_DIRECT_TAG, &size, sizeof(int)));
+    NCCLCHECK(bootstrapSend(comm->bootstrap, it.first, MSCCL_DIRECT_TAG, it.second.data(), size));
+  }
+  for (auto& it : codes) {
+    int size;
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, it.first, MSCCL_DIRECT_TAG, &size, sizeof(int)));
+    std::vector<uint16_t>& msg = (*peerCodes)[it.first];
+    msg.resize(size / sizeof(uint16_t));
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, it.first, MSCCL_DIRECT_TAG, msg.data(), size));
+  }
+  return ncclSuccess;
+}
+
+// Codes of the connection dir of the peer on channel c, nullptr if the peer message is malformed
+static const uint16_t* mscclDirectPeerConn(const std::vector<uint16_t>& msg, int c, int dir, int* n) {
+  size_t pos = 0;
+  for (int i = 0; i <= 2 * c + dir; i++) {
+    if (pos >= msg.size()) return nullptr;
+    *n = msg[pos];
+    if (pos + 1 + *n > msg.size()) return nullptr;
+    if (i == 2 * c + dir) return msg.data() + pos + 1;
+    pos += 1 + *n;
+  }
+  return nullptr;
+}
+
+ncclResult_t mscclDirectSetup(struct mscclAlgo* hostAlgo, ncclComm_t comm, int nReplicas) {
+  if (!mscclDirectEnabled() || (hostAlgo->protocolMask & (1 << NCCL_PROTO_SIMPLE)) == 0) {
+    return ncclSuccess;
+  }
+  int nChannels = hostAlgo->nChannels;
+
+  std::map<int, struct mscclDirectPeerSteps> peers;
+  for (int b = 0; b < hostAlgo->nBlocks; b++) {
+    struct mscclThreadBlock* tb = hostAlgo->mscclTBs + b;
+    if (tb->channelId < 0 || tb->nvls != MSCCL_NVLS_NONE || tb->protocol != NCCL_PROTO_SIMPLE) continue;
+    bool single = tb->nSendPeers <= 1 && tb->nRecvPeers <= 1;
+    for (int i = 0; i < tb->nSteps; i++) {
+      struct mscclTransmission* t = tb->transmissions + i;
+      for (int dir = 0; dir < 2; dir++) {
+        if (dir == 0 ? !mscclDirectIsSend(t->type) : !mscclDirectIsRecv(t->type)) continue;
+        int nPeers = dir == 0 ? tb->nSendPeers : tb->nRecvPeers;
+        const int16_t* tbPeers = dir == 0 ? tb->sendPeers : tb->recvPeers;
+        bool plain = single && t->type == (dir == 0 ? MSCCL_SEND : MSCCL_RECV);
+        for (int p = 0; p < nPeers; p++) {
+          int peer = tbPeers[p];
+          if (peer == comm->rank || comm->rankToNode[peer] != comm->node) continue;
+          mscclDirectAddStep(peers, nChannels, peer, tb->channelId, dir, b, i,
+            plain ? MSCCL_DIRECT_CODE(t->type, t->count) : MSCCL_DIRECT_NONE);
+        }
+      }
+    }
+  }
+
+  // Every replica of a channel has to be connected the same way
+  for (auto& it : peers) {
+    for (int c = 0; c < nChannels; c++) {
+      for (int dir = 0; dir < 2; dir++) {
+        struct mscclDirectConnSteps& conn = it.second.conns[dir][c];
+        if (conn.codes.empty()) continue;
+        for (int r = 0; r < nReplicas; r++) {
+          struct ncclChannelPeer* channelPeer = comm->channels[c + r * nChannels].peers[it.first];
+          struct ncclConnector* connector = dir == 0 ? &channelPeer->send[0] : &channelPeer->recv[0];
+          if (!mscclDirectConnOk(connector)) conn.shared = true;
+          if (dir == 1 && (connector->conn.flags & (NCCL_IPC_WRITE | NCCL_IPC_READ))) it.second.ipcRecv = true;
+        }
+      }
+    }
+  }
+
+  std::map<int, std::vector<uint16_t>> peerCodes;
+  NCCLCHECK(mscclDirectExchange(comm, peers, &peerCodes));
+
+  std::vector<uint32_t> mask(hostAlgo->nBlocks * MSCCL_DIRECT_MASK_WORDS, 0);
+  std::vector<int> ipcPeers;
+  uint8_t ipcBuffers = 0;
+  int nSteps = 0, nDirect = 0;
+  for (auto& it : peers) {
+    bool peerRecvs = false;
+    for (int c = 0; c < nChannels; c++) {
+      for (int dir = 0; dir < 2; dir++) {
+        struct mscclDirectConnSteps& conn = it.second.conns[dir][c];
+        nSteps += conn.codes.size();
+        int nPeerCodes;
+        // the sends of this end are the recvs of the other end
+        const uint16_t* codes = mscclDirectPeerConn(peerCodes[it.first], c, 1 - dir, &nPeerCodes);
+        if (conn.shared || codes == nullptr || nPeerCodes != (int)conn.codes.size()) continue;
+        for (int k = 0; k < nPeerCodes; k++) {
+          if (conn.codes[k] == MSCCL_DIRECT_NONE || codes[k] == MSCCL_DIRECT_NONE) continue;
+          if ((conn.codes[k] >> 8) != (codes[k] >> 8)) continue;
+          int step = conn.steps[k];
+          mask[conn.bid * MSCCL_DIRECT_MASK_WORDS + step / 32] |= 1U << (step % 32);
+          nDirect++;
+          if (dir == 1 && it.second.ipcRecv) {
+            ipcBuffers |= 1 << hostAlgo->mscclTBs[conn.bid].transmissions[step].dstBuffer;
+            peerRecvs = true;
+          }
+        }
+      }
+    }
+    if (peerRecvs) ipcPeers.push_back(it.first);
+  }
+
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if (status.direct == nullptr) {
+    status.direct = new mscclDirectStatus();
+  }
+  // A reloaded algorithm may reuse the address of an unloaded one
+  auto old = status.direct->algos.find(hostAlgo);
+  if (old != status.direct->algos.end()) {
+    NCCLCHECK(ncclCudaFree(old->second.devMask));
+    status.direct->algos.erase(old);
+  }
+  if (nDirect == 0) {
+    return ncclSuccess;
+  }
+  struct mscclDirectAlgo& direct = status.direct->algos[hostAlgo];
+  NCCLCHECK(ncclCudaCalloc(&direct.devMask, mask.size()));
+  NCCLCHECK(ncclCudaMemcpy(direct.devMask, mask.data(), mask.size()));
+  direct.ipcPeers = ipcPeers;
+  direct.ipcBuffers = ipcBuffers;
+  INFO(NCCL_INIT|NCCL_P2P, "MSCCL: %d of %d s and r steps to local peers are zero-copy, %zu peers in other processes",
+    nDirect, nSteps, ipcPeers.size());
+  return ncclSuccess;
+}
+
+bool mscclDirectScratchIpc(ncclComm_t comm) {
+  struct mscclDirectStatus* status = mscclGetCommStatus(comm).direct;
+  if (status == nullptr || !ncclParamMscclScratchIpc() || !ncclParamLocalRegister()) {
+    return false;
+  }
+  for (auto& it : status->algos) {
+    if (it.second.ipcBuffers & (1 << MSCCL_SCRATCH_BUFFER)) return true;
+  }
+  return false;
+}
+
+void mscclDirectInitLaunchDesc(struct mscclAlgo* hostAlgo, ncclComm_t comm, struct mscclLaunchDesc* desc) {
+  desc->directIpcPeers.clear();
+  desc->directIpcBuffers = 0;
+  struct mscclDirectStatus* status = mscclGetCommStatus(comm).direct;
+  if (status == nullptr) {
+    return;
+  }
+  auto it = status->algos.find(hostAlgo);
+  if (it == status->algos.end()) {
+    return;
+  }
+  desc->work.directMask = it->second.devMask;
+  desc->directIpcPeers = it->second.ipcPeers;
+  desc->directIpcBuffers = it->second.ipcBuffers;
+}
+
+// Sizes of the buffers of a call, 0 when they are not known from its count
+static void mscclDirectBuffBytes(const struct mscclLaunchDesc* desc, size_t* sendBytes, size_t* recvBytes) {
+  size_t bytes = desc->work.count * ncclTypeSize(desc->proxy.dataType);
+  size_t rankBytes = bytes / desc->hostAlgo->sizeMultiplier;
+  *sendBytes = *recvBytes = 0;
+  switch (desc->hostAlgo->func) {
+    case mscclFuncAllGather:
+      *sendBytes = rankBytes;
+      *recvBytes = bytes;
+      break;
+    case mscclFuncReduceScatter:
+      *sendBytes = bytes;
+      *recvBytes = rankBytes;
+      break;
+    case mscclFuncReduce:
+    case mscclFuncBroadcast:
+    case mscclFuncAllReduce:
+    case mscclFuncAllToAll:
+      *sendBytes = *recvBytes = bytes;
+      break;
+    default:
+      break;
+  }
+}
+
+static ncclResult_t mscclDirectRegister(ncclComm_t comm, const void* buff, size_t bytes, int* peers, int nPeers,
+    uintptr_t* offset, uintptr_t** rmtAddrs) {
+  int regFlag = 0;
+  if (buff == nullptr || bytes == 0) {
+    return ncclSuccess;
+  }
+  // Registration is best effort, as for NCCL collectives, unregistered buffers use the FIFOs
+  if (ncclParamLocalRegister()) {
+    ncclIpcLocalRegisterBuffer(comm, buff, bytes, peers, nPeers, NCCL_IPC_COLLECTIVE, &regFlag, offset, rmtAddrs);
+  }
+  if (!regFlag && mscclGetThreadLocalStatus().captureStatus != mscclNoCapture && ncclParamGraphRegister()) {
+    struct ncclIntruQueue<struct ncclCommCallback, &ncclCommCallback::next>* cleanupQueue;
+    NCCLCHECK(mscclGetCapturedCleanupQueue(comm, &cleanupQueue));
+    ncclIpcGraphRegisterBuffer(comm, buff, bytes, peers, nPeers, NCCL_IPC_COLLECTIVE, &regFlag, offset, rmtAddrs,
+      cleanupQueue, nullptr);
+  }
+  if (!regFlag) {
+    *offset = 0;
+    *rmtAddrs = nullptr;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclDirectRegisterBuffers(const void* sendBuff, void* recvBuff, const struct mscclLaunchDesc* desc,
+    ncclComm_t comm, struct mscclWork* work) {
+  if (desc->directIpcPeers.empty()) {
+    return ncclSuccess;
+  }
+  size_t sendBytes, recvBytes;
+  mscclDirectBuffBytes(desc, &sendBytes, &recvBytes);
+  int* peers = const_cast<int*>(desc->directIpcPeers.data());
+  int nPeers = desc->directIpcPeers.size();
+  if (desc->directIpcBuffers & (1 << MSCCL_OUTPUT_BUFFER)) {
+    NCCLCHECK(mscclDirectRegister(comm, recvBuff, recvBytes, peers, nPeers, &work->recvBuffOffset, &work->recvBuffRmtAddrs));
+  }
+  if (desc->directIpcBuffers & (1 << MSCCL_INPUT_BUFFER)) {
+    NCCLCHECK(mscclDirectRegister(comm, sendBuff, sendBytes, peers, nPeers, &work->sendBuffOffset, &work->sendBuffRmtAddrs));
+  }
+  // Pool allocations can not be exported, only a scratch allocated for it is registered
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if ((desc->directIpcBuffers & (1 << MSCCL_SCRATCH_BUFFER)) && status.scratchBufferIpc && work->scratchBuffer != nullptr) {
+    size_t scratchBytes = status.scratchBufferSize - ((char*)work->scratchBuffer - (char*)status.scratchBuffer);
+    NCCLCHECK(mscclDirectRegister(comm, work->scratchBuffer, scratchBytes, peers, nPeers, &work->scratchOffset, &work->scratchRmtAddrs));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclDirectTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclDirectStatus* direct = commStatus.direct;
+  if (direct == nullptr) {
+    return ncclSuccess;
+  }
+  for (auto& it : direct->algos) {
+    NCCLCHECK(ncclCudaFree(it.second.devMask));
+  }
+  delete direct;
+  commStatus.direct = nullptr;
+  return ncclSuccess;
+}
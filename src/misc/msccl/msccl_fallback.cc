@@ -0,0 +1,117 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <string>
+
+#include "bitops.h"
+#include "collectives.h"
+#include "comm.h"
+#include "param.h"
+
+#include "msccl/msccl_fallback.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclFallbackStats, "MSCCL_FALLBACK_STATS", 1);
+
+static const char* mscclFallbackFuncNames[mscclNumFuncs] = { "Reduce", "Broadcast", "AllReduce", "ReduceScatter",
+  "AllGather", "Send", "Recv", "Gather", "Scatter", "AllToAll", "AllToAllv", "AllGatherV", "ReduceScatterV" };
+
+const char* mscclSelectReasonName(int reason) {
+  switch (reason) {
+    case mscclSelectChosen: return "chosen";
+    case mscclSelectAvgOnIntegers: return "avg_on_integers";
+    case mscclSelectNoCatalog: return "no_catalog";
+    case mscclSelectNoAlgo: return "no_algo";
+    case mscclSelectNcclFaster: return "nccl_faster";
+    case mscclSelectNotLoaded: return "not_loaded";
+    case mscclSelectExternal: return "external";
+    case mscclSelectNRanksMismatch: return "nranks_mismatch";
+    case mscclSelectInPlaceMismatch: return "inplace_mismatch";
+    case mscclSelectSizeOutOfRange: return "size_out_of_range";
+    case mscclSelectCountNotDivisible: return "count_not_divisible";
+    case mscclSelectResourceUnusable: return "resource_unusable";
+    case mscclSelectIncompatible: return "incompatible";
+    case mscclSelectGroupUnsupportedOp: return "group_unsupported_op";
+    case mscclSelectAutotuneNccl: return "autotune_nccl";
+    case mscclSelectPreMulUnsafe: return "premul_unsafe";
+    default: return "unknown";
+  }
+}
+
+ncclResult_t mscclFallbackInit(ncclComm_t comm) {
+  if (ncclParamMscclFallbackStats() == 0) {
+    return ncclSuccess;
+  }
+  // Value-initialized, as atomics are not zeroed by a plain new
+  mscclGetCommStatus(comm).fallback = new mscclFallbackStatus();
+  return ncclSuccess;
+}
+
+void mscclFallbackRecord(const struct mscclSchedulerParam* p, mscclSelectReason reason) {
+  if (p->comm == nullptr || p->comm->mscclCommStatus == nullptr) return;
+  struct mscclFallbackStatus* fallback = mscclGetCommStatus(p->comm).fallback;
+  if (fallback == nullptr || reason < 0 || reason >= mscclSelectNumReasons || p->func < 0 || p->func >= mscclNumFuncs) return;
+  size_t nBytes = p->count * ncclTypeSize(p->dataType);
+  int bucket = nBytes < 2 ? 0 : std::min(log2Down(nBytes), MSCCL_FALLBACK_SIZE_BUCKETS - 1);
+  // Only the thread driving the communicator counts, readers take snapshots
+  std::atomic<uint64_t>& count = fallback->counts[reason][p->func][bucket];
+  count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+ncclResult_t mscclFallbackQuery(ncclComm_t comm, mscclFallbackStat_t* stats, int* nStats) {
+  struct mscclFallbackStatus* fallback = comm->mscclCommStatus ? mscclGetCommStatus(comm).fallback : nullptr;
+  int capacity = stats ? *nStats : 0;
+  int n = 0;
+  for (int r = 0; fallback && r < mscclSelectNumReasons; r++) {
+    for (int f = 0; f < mscclNumFuncs; f++) {
+      for (int b = 0; b < MSCCL_FALLBACK_SIZE_BUCKETS; b++) {
+        uint64_t count = fallback->counts[r][f][b].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        if (n < capacity) {
+          mscclFallbackStat_t* s = stats + n;
+          s->reason = r;
+          s->reasonName = mscclSelectReasonName(r);
+          s->func = f;
+          s->log2Bytes = b;
+          s->count = count;
+        }
+        n++;
+      }
+    }
+  }
+  *nStats = n;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclFallbackTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclFallbackStatus* fallback = commStatus.fallback;
+  if (fallback == nullptr) {
+    return ncclSuccess;
+  }
+  // One line per function and reason calls went to NCCL for, with the sizes of these calls
+  for (int f = 0; f < mscclNumFuncs; f++) {
+    for (int r = 0; r < mscclSelectNumReasons; r++) {
+      if (r == mscclSelectChosen) continue;
+      uint64_t total = 0;
+      std::string sizes;
+      for (int b = 0; b < MSCCL_FALLBACK_SIZE_BUCKETS; b++) {
+        uint64_t count = fallback->counts[r][f][b].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        total += count;
+        sizes += " 2^" + std::to_string(b) + ":" + std::to_string(count);
+      }
+      if (total == 0) continue;
+      uint64_t chosen = 0;
+      for (int b = 0; b < MSCCL_FALLBACK_SIZE_BUCKETS; b++) chosen += fallback->counts[mscclSelectChosen][f][b].load(std::memory_order_relaxed);
+      INFO(NCCL_INIT|NCCL_TUNING, "MSCCL: rank %d %s %s %lu calls (%lu chosen), bytes%s", comm->rank, mscclFallbackFuncNames[f],
+        mscclSelectReasonName(r), (unsigned long)total, (unsigned long)chosen, sizes.c_str());
+    }
+  }
+  delete fallback;
+  commStatus.fallback = nullptr;
+  return ncclSuccess;
+}
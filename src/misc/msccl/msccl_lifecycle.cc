@@ -3,6 +3,7 @@
  * Licensed under the MIT License.
  ************************************************************************/
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <mutex>
@@ -12,20 +13,45 @@
 #include <dlfcn.h>
 #include <error.h>
 #include <link.h>
+#include <sys/stat.h>
 
 #include "alloc.h"
+#include "argcheck.h"
 #include "checks.h"
 #include "comm.h"
+#include "group.h"
+#include "lanes.h"
+#include "metrics.h"
+#include "simtimeline.h"
 #include "transport.h"
 #include "graph/topo.h"
 
+#include "msccl/msccl_autotune.h"
+#include "msccl/msccl_binary.h"
+#include "msccl/msccl_direct.h"
+#include "msccl/msccl_fallback.h"
 #include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_node_cache.h"
 #include "msccl/msccl_parser.h"
+#include "msccl/msccl_persistent.h"
+#include "msccl/msccl_replay.h"
 #include "msccl/msccl_setup.h"
+#include "msccl/msccl_simulate.h"
+#include "msccl/msccl_split.h"
 #include "msccl/msccl_status.h"
+#include "msccl/msccl_synth.h"
+#include "msccl/msccl_telemetry.h"
+#include "msccl/msccl_topo.h"
 
 NCCL_PARAM(MscclEnabled, "MSCCL_ENABLE", 1);
+NCCL_PARAM(MscclScratchReserve, "MSCCL_SCRATCH_RESERVE", 0);
+NCCL_PARAM(MscclLazyLoad, "MSCCL_LAZY_LOAD", 0);
+NCCL_PARAM(MscclModelFallback, "MSCCL_MODEL_FALLBACK", 1);
+NCCL_PARAM(MscclFuseGroup, "MSCCL_FUSE_GROUP", 1);
+NCCL_PARAM(MscclWaitTimeoutMs, "MSCCL_WAIT_TIMEOUT_MS", 0);
 static std::atomic<bool> mscclInitialized;
+// Set once a communicator enabled MSCCL through its config
+static std::atomic<bool> mscclConfigEnabled;
 static std::mutex mscclLifecycleMutex;
 
 int getEnvInt(const char* env, int64_t deftVal) {
@@ -39,7 +65,11 @@ int getEnvInt(const char* env, int64_t deftVal) {
 }
 
 bool mscclEnabled() {
-  return ncclParamMscclEnabled();
+  return ncclParamMscclEnabled() || mscclConfigEnabled.load(std::memory_order_acquire);
+}
+
+bool mscclEnabled(ncclComm_t comm) {
+  return comm->config.mscclEnable == -1 ? ncclParamMscclEnabled() : comm->config.mscclEnable == 1;
 }
 
 void mscclSetIsCallerFlag() {
@@ -58,22 +88,6 @@ bool mscclAvailable() {
   return mscclEnabled() && mscclInitialized.load(std::memory_order_acquire);
 }
 
-static bool mscclCommCompatible(ncclComm_t comm) {
-  std::map<uint64_t, std::set<uint64_t>> hostHashToPidHashes;
-  for (int i = 0; i < comm->nRanks; i++) {
-    uint64_t hostHash = comm->peerInfo[i].hostHash;
-    uint64_t pidHash = comm->peerInfo[i].pidHash;
-    if (hostHashToPidHashes.find(hostHash) != hostHashToPidHashes.end()) {
-      auto& pidHashSet = hostHashToPidHashes[hostHash];
-      if (pidHashSet.find(pidHash) != pidHashSet.end()) {
-        return false;
-      }
-    }
-    hostHashToPidHashes[hostHash].insert(pidHash);
-  }
-  return true;
-}
-
 static const char* mscclSchedulerPathEnv = "MSCCL_SCHEDULER";
 static const char* mscclSchedulerDefaultPath = "libmsccl-scheduler.so";
 static const char* mscclAlgoDirEnv = "MSCCL_ALGO_DIR";
@@ -85,21 +99,122 @@ static const char* mscclUnitTestAlgoShareDirPath = "../share/nccl/msccl-unit-tes
 static const char* mscclPackageInstalledAlgoShareDirPath = "/usr/share/nccl/msccl-algorithms";
 static const char* mscclUnitTestPackageInstalledAlgoShareDirPath = "/usr/share/nccl/msccl-unit-test-algorithms";
 
-static ncclResult_t mscclInternalSchedulerInit(ncclComm_t comm, int* numChannelsRequired) {
-  static bool mscclAlgoMetaLoaded = false;
+// Directory comm reads its algorithms from, empty for the directory of the process
+static const char* mscclCommAlgoDir(ncclComm_t comm) {
+  return comm->config.mscclAlgoDir ? comm->config.mscclAlgoDir : "";
+}
+
+// Whether m was read from the algorithm directory of comm, synthesized algorithms belong to all of them
+static bool mscclAlgoOfComm(const struct mscclAlgoMeta& m, ncclComm_t comm) {
+  return mscclIsSynthPath(m.filePath.c_str()) || m.algoDir == mscclCommAlgoDir(comm);
+}
+
+// External scheduler selecting the algorithms of comm, nullptr for the internal one
+static mscclSchedulerInterface_v2* mscclCommScheduler(ncclComm_t comm) {
+  return comm->mscclExternalScheduler ? mscclGetStatus().mscclSchedulerPtr : nullptr;
+}
+
+// Whether an algorithm the internal scheduler may select for comm requires a topology. The metas of
+// the directory of comm are the same on all of its ranks, which agree.
+// Caller must hold mscclLifecycleMutex.
+static bool mscclCommNeedsTopo(ncclComm_t comm) {
+  if (!comm->mscclCompatible || mscclCommScheduler(comm)) return false;
+  for (auto& m : mscclGetStatus().algoMetas) {
+    if (m.nRanks == comm->nRanks && !m.retired && mscclAlgoOfComm(m, comm) && mscclTopoConstrained(m)) return true;
+  }
+  return false;
+}
+
+// Algorithms comm can select: of its directory and size, not removed by a reload and within its
+// channels. Synthesized algorithms are only selected by the comms whose rings they follow.
+static bool mscclInternalSchedulerUsable(const struct mscclAlgoMeta& m, ncclComm_t comm) {
+  if (!mscclAlgoOfComm(m, comm)) return false;
+  if (mscclIsSynthPath(m.filePath.c_str()) && !mscclSynthUsable(m.filePath, comm)) return false;
+  // Like NCCL, LL128 is left to communicators whose GPUs of different generations do not talk directly
+  if ((m.protocolMask & (1 << NCCL_PROTO_LL128)) && comm->minCompCap != comm->maxCompCap && !comm->compCapPerNode) return false;
+  return m.nRanks == comm->nRanks && !m.retired && m.nChannels <= comm->nChannels && mscclTopoUsable(m, comm);
+}
+
+// Handles are kept per rank, and per rank layout for algorithms with remapped ranks or per
+// rotation for reduce and broadcast run on another root than theirs
+static uint64_t mscclAlgoRankKey(const struct mscclAlgoMeta& m, ncclComm_t comm, int rotation) {
+  if (rotation > 0) return (1ULL << 63) | ((uint64_t)rotation << 32) | (uint32_t)comm->rank;
+  uint64_t layout = mscclTopoRemapped(m, comm) ? mscclGetCommStatus(comm).topo->rankLayout : 0;
+  return (layout << 32) | (uint32_t)comm->rank;
+}
+
+// How far the ranks of algorithm m move for the call to have its root on root: logical rank l
+// runs on rank (l + rotation) % nRanks
+static int mscclAlgoRotation(const struct mscclAlgoMeta& m, mscclFunc_t func, int root, int nRanks) {
+  if (func != mscclFuncReduce && func != mscclFuncBroadcast) return 0;
+  return (root - m.root + nRanks) % nRanks;
+}
+
+// Index of the rank layout of comm among those of the process, 1 based.
+// Caller must hold mscclLifecycleMutex.
+static int mscclRankLayout(ncclComm_t comm) {
   mscclStatus& status = mscclGetStatus();
+  const struct mscclCommTopo* topo = mscclGetCommStatus(comm).topo;
+  std::vector<int> layout(topo->logicalToRank, topo->logicalToRank + comm->nRanks);
+  auto it = std::find(status.rankLayouts.begin(), status.rankLayouts.end(), layout);
+  if (it == status.rankLayouts.end()) it = status.rankLayouts.insert(it, layout);
+  return (int)(it - status.rankLayouts.begin()) + 1;
+}
 
-  *numChannelsRequired = 0;
-  // Query numChannelsRequired from loaded algorithm metas
-  if (mscclAlgoMetaLoaded) {
-    for (auto& m : status.algoMetas) {
-      if (comm->nRanks == m.nRanks) {
-        *numChannelsRequired = std::max(*numChannelsRequired, m.nChannels);
+// Build the (func, nRanks, inPlace) -> message size index over the status.algoMetas usable by comm
+static ncclResult_t mscclInternalSchedulerBuildCatalog(ncclComm_t comm, struct mscclAlgoCatalog** catalog) {
+  mscclStatus& status = mscclGetStatus();
+  std::map<mscclAlgoIndexKey, std::vector<int>> buckets;
+  struct mscclAlgoCatalog* c = new mscclAlgoCatalog();
+  c->metas = status.algoMetas;
+  for (int i = 0; i < (int)c->metas.size(); i++) {
+    auto &m = c->metas[i];
+    if (!mscclInternalSchedulerUsable(m, comm)) continue;
+    // Algorithms added by a reload cannot use protocols the connections have no buffers for
+    if (m.protocolMask & ~comm->connProtoMask) {
+      INFO(NCCL_INIT, "MSCCL: %s uses protocols the connections of rank %d have no buffers for", m.filePath.c_str(), comm->rank);
+      continue;
+    }
+    if (m.inPlace) buckets[mscclAlgoIndexKey(m.func, m.nRanks, true)].push_back(i);
+    if (m.outOfPlace) buckets[mscclAlgoIndexKey(m.func, m.nRanks, false)].push_back(i);
+  }
+  // Algorithms made for the other kind of calls come after the ones made for them, in directory order
+  for (int i = 0; i < (int)c->metas.size(); i++) {
+    auto &m = c->metas[i];
+    if (!mscclInternalSchedulerUsable(m, comm) || m.inPlace == m.outOfPlace || !mscclAliasable(m.func)) continue;
+    if (m.protocolMask & ~comm->connProtoMask) continue;
+    buckets[mscclAlgoIndexKey(m.func, m.nRanks, !m.inPlace)].push_back(i);
+  }
+  for (auto &b : buckets) {
+    // Byte ranges are inclusive, maxBytes of 0 means no upper limit
+    std::set<int64_t> bounds;
+    for (int i : b.second) {
+      auto &m = c->metas[i];
+      bounds.insert(m.minBytes);
+      if (m.maxBytes != 0) bounds.insert(m.maxBytes + 1);
+    }
+    struct mscclAlgoIndex& index = c->index[b.first];
+    index.sizeMultiplier = c->metas[b.second[0]].sizeMultiplier;
+    for (int64_t start : bounds) {
+      index.segments.emplace_back();
+      struct mscclAlgoIndexSegment& seg = index.segments.back();
+      seg.startBytes = start;
+      for (int i : b.second) {
+        auto &m = c->metas[i];
+        if (m.minBytes <= start && (m.maxBytes == 0 || start <= m.maxBytes)) {
+          seg.metaIndices.push_back(i);
+        }
       }
     }
-    return ncclSuccess;
   }
+  INFO(NCCL_INIT, "MSCCL: Internal Scheduler indexed %zu algorithms into %zu buckets on rank %d", status.algoMetas.size(), c->index.size(), comm->rank);
+  *catalog = c;
+  return ncclSuccess;
+}
 
+// Paths of the files of the algorithm directory, sorted, with their modification times. algoDir
+// is the directory of a communicator config, or empty for the directory of the process.
+static ncclResult_t mscclInternalSchedulerScanDir(const std::string& algoDir, std::map<std::string, int64_t>* files) {
   const char* mscclAlgoDir = getenv(mscclAlgoDirEnv);
   const char* mscclAlgoShareDir = nullptr;
   const char* mscclPackageInstalledAlgoShareDir = nullptr;
@@ -107,11 +222,20 @@ static ncclResult_t mscclInternalSchedulerInit(ncclComm_t comm, int* numChannels
   std::string mscclAlgoShareDirStr;
   std::string mscclPackageInstalledAlgoShareDirStr;
   const char *fullDirPath = nullptr;
-  if (mscclAlgoDir == nullptr) {
+  if (!algoDir.empty()) {
+    // Directories given in a config are used as they are
+    DIR *dp = opendir(algoDir.c_str());
+    if (dp == nullptr) {
+      WARN("MSCCL Internal Scheduler: open algorithm directory %s of the communicator config failed", algoDir.c_str());
+      return ncclInvalidUsage;
+    }
+    closedir(dp);
+    mscclAlgoDir = mscclAlgoShareDir = mscclPackageInstalledAlgoShareDir = algoDir.c_str();
+  } else if (mscclAlgoDir == nullptr) {
     // Try to find default algorithm directory based on librccl.so path
     Dl_info dl_info;
     struct link_map *link_map_ptr = nullptr;
-    if (!dladdr1((void *)mscclInternalSchedulerInit, &dl_info, (void **)&link_map_ptr, RTLD_DL_LINKMAP)) {
+    if (!dladdr1((void *)mscclInternalSchedulerScanDir, &dl_info, (void **)&link_map_ptr, RTLD_DL_LINKMAP)) {
       WARN("MSCCL Internal Scheduler: dladdr1 failed");
       return ncclInvalidUsage;
     }
@@ -150,7 +274,7 @@ static ncclResult_t mscclInternalSchedulerInit(ncclComm_t comm, int* numChannels
     fullDirPath = mscclAlgoDir;
   }
   INFO(NCCL_INIT, "Using MSCCL Algo files from %s", fullDirPath);
-  std::set<std::string> sortedFullPaths;
+  files->clear();
   while ((entry = readdir(dp))) {
     if (entry->d_type != DT_LNK && entry->d_type != DT_REG) {
       continue;
@@ -158,69 +282,314 @@ static ncclResult_t mscclInternalSchedulerInit(ncclComm_t comm, int* numChannels
     std::string fullPath = fullDirPath;
     fullPath += "/";
     fullPath += entry->d_name;
-    sortedFullPaths.insert(fullPath);
-  }
-  for (auto& fullPath : sortedFullPaths) {
-    status.algoMetas.emplace_back();
-    NCCLCHECK(mscclGetAlgoMetaFromXmlFile(fullPath.c_str(), &(status.algoMetas.back())));
-    if (status.algoMetas.back().nRanks == comm->nRanks) {
-      *numChannelsRequired = std::max(*numChannelsRequired, status.algoMetas.back().nChannels);
+    struct stat st;
+    if (stat(fullPath.c_str(), &st) != 0) {
+      continue;
     }
+    (*files)[fullPath] = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
   }
   if (closedir(dp)) {
     WARN("MSCCL Internal Scheduler: closedir failed, error %d", errno);
     return ncclInvalidUsage;
   }
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclInternalSchedulerAddMeta(const std::string& fullPath, int64_t mtime, const std::string& algoDir) {
+  mscclStatus& status = mscclGetStatus();
+  status.algoMetas.emplace_back();
+  NCCLCHECK(mscclGetAlgoMetaFromFile(fullPath.c_str(), &(status.algoMetas.back())));
+  status.algoMetas.back().algoDir = algoDir;
+  status.algoMetas.back().mtime = mtime;
+  status.algoMetas.back().retired = false;
   status.rankToAlgoHandles.resize(status.algoMetas.size());
-  mscclAlgoMetaLoaded = true;
   return ncclSuccess;
 }
 
-ncclResult_t mscclSchedulerInit(ncclComm_t comm, int* numChannelsRequired) {
+static ncclResult_t mscclInternalSchedulerLoadMetas(const std::string& algoDir) {
+  std::map<std::string, int64_t> files;
+  NCCLCHECK(mscclInternalSchedulerScanDir(algoDir, &files));
+  for (auto& f : files) {
+    NCCLCHECK(mscclInternalSchedulerAddMeta(f.first, f.second, algoDir));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclInternalSchedulerInit(ncclComm_t comm, int* numChannelsRequired) {
+  mscclStatus& status = mscclGetStatus();
+  ncclResult_t ret = ncclSuccess;
+  std::string algoDir = mscclCommAlgoDir(comm);
+  bool algoMetaLoaded = status.loadedAlgoDirs.count(algoDir) > 0;
+  bool metasFromNodeCache = false;
+
   *numChannelsRequired = 0;
-  comm->mscclCompatible = mscclCommCompatible(comm);
-  if (!comm->mscclCompatible) {
-    return ncclSuccess;
+  // The node cache carries the directory of the process, comms with their own read it themselves
+  if (algoDir.empty() && mscclNodeCacheEnabled(comm)) {
+    // Local rank 0 reads the algorithm directory once for the whole node
+    if (comm->localRank == 0 && !algoMetaLoaded) {
+      size_t nMetas = status.algoMetas.size();
+      ret = mscclInternalSchedulerLoadMetas(algoDir);
+      algoMetaLoaded = ret == ncclSuccess;
+      if (ret != ncclSuccess) {
+        status.algoMetas.resize(nMetas);
+        status.rankToAlgoHandles.resize(nMetas);
+      }
+    }
+    NCCLCHECK(mscclNodeCacheShare(comm, !algoMetaLoaded, &metasFromNodeCache));
+    NCCLCHECK(ret);
+    if (metasFromNodeCache) {
+      algoMetaLoaded = true;
+      status.rankToAlgoHandles.resize(status.algoMetas.size());
+    }
+  }
+  if (!algoMetaLoaded) {
+    NCCLCHECK(mscclInternalSchedulerLoadMetas(algoDir));
   }
+  status.loadedAlgoDirs.insert(algoDir);
 
-  std::lock_guard<std::mutex> lock(mscclLifecycleMutex);
+  // Query numChannelsRequired from loaded algorithm metas, replicas of thread blocks use more channels
+  for (auto& m : status.algoMetas) {
+    if (comm->nRanks == m.nRanks && !m.retired && mscclAlgoOfComm(m, comm)) {
+      *numChannelsRequired = std::max(*numChannelsRequired, std::min(m.nChannels * mscclBlockReplicas(), MAXCHANNELS));
+    }
+  }
+  return ncclSuccess;
+}
 
+// Load algorithm metaIndex for this rank, with its ranks rotated by rotation, and connect it on
+// comm, if not done yet.
+// Caller must hold mscclLifecycleMutex through lock, which is released while connecting so that
+// ranks of the same process sharing the mutex can connect to each other.
+static ncclResult_t mscclInternalSchedulerPrepareAlgo(size_t metaIndex, ncclComm_t comm, int rotation, std::unique_lock<std::mutex>& lock, mscclAlgoHandle_t* handle) {
   mscclStatus& status = mscclGetStatus();
-  bool useInternalScheduler = false;
+  auto &m = status.algoMetas[metaIndex];
+  uint64_t rankKey = mscclAlgoRankKey(m, comm, rotation);
+  // Load algorithms
+  if (status.rankToAlgoHandles[metaIndex].find(rankKey) == status.rankToAlgoHandles[metaIndex].end()) {
+    mscclAlgoHandle_t newHandle;
+    auto cached = status.nodeCachedAlgos.find(std::make_pair(metaIndex, comm->rank));
+    // The node cache holds the programs of the ranks, not of their logical ranks
+    if (rotation > 0) {
+      std::vector<int> logicalToRank(comm->nRanks);
+      for (int l = 0; l < comm->nRanks; l++) logicalToRank[l] = (l + rotation) % comm->nRanks;
+      int rank = (comm->rank - rotation + comm->nRanks) % comm->nRanks;
+      NCCLCHECK(mscclLoadAlgoRemapped(m.filePath.c_str(), &newHandle, comm, rank, logicalToRank.data()));
+    } else if (mscclTopoRemapped(m, comm)) {
+      const struct mscclCommTopo* topo = mscclGetCommStatus(comm).topo;
+      NCCLCHECK(mscclLoadAlgoRemapped(m.filePath.c_str(), &newHandle, comm, topo->rankToLogical[comm->rank], topo->logicalToRank));
+    } else if (cached != status.nodeCachedAlgos.end()) {
+      NCCLCHECK(mscclLoadAlgoFromBinImage(m.filePath.c_str(), cached->second.data(), cached->second.size(), &newHandle, comm->rank));
+      status.nodeCachedAlgos.erase(cached);
+    } else {
+      NCCLCHECK(mscclLoadAlgo(m.filePath.c_str(), &newHandle, comm->rank));
+    }
+    status.rankToAlgoHandles[metaIndex][rankKey] = newHandle;
+  }
+  // Connect algorithms
+  mscclAlgoHandle_t mscclAlgoHandle = status.rankToAlgoHandles[metaIndex][rankKey];
+  // Another thread of comm may be connecting it with the mutex released, it must not be connected twice
+  status.connectCond.wait(lock, [&] {
+    auto c = status.connectingAlgos.find(comm);
+    return c == status.connectingAlgos.end() || c->second.count(mscclAlgoHandle) == 0;
+  });
+  if (status.connectedAlgos[comm].find(mscclAlgoHandle) == status.connectedAlgos[comm].end()) {
+    struct mscclAlgo* hostAlgo;
+    struct mscclDevAlgo* devAlgo;
+    ncclResult_t ret = ncclSuccess;
+    int savedDevice;
+    CUDACHECK(cudaGetDevice(&savedDevice));
+    if (savedDevice != comm->cudaDev) {
+      CUDACHECK(cudaSetDevice(comm->cudaDev));
+    }
+    // Also makes the device copy for this device before any capture can start
+    NCCLCHECKGOTO(mscclGetAlgo(mscclAlgoHandle, comm, &hostAlgo, &devAlgo), ret, exit);
+    status.connectingAlgos[comm].insert(mscclAlgoHandle);
+    lock.unlock();
+    ret = mscclSetupConnections(hostAlgo, comm);
+    lock.lock();
+    status.connectingAlgos[comm].erase(mscclAlgoHandle);
+    if (status.connectingAlgos[comm].empty()) status.connectingAlgos.erase(comm);
+    status.connectCond.notify_all();
+    if (ret == ncclSuccess) {
+      status.connectedAlgos[comm].insert(mscclAlgoHandle);
+    }
+exit:
+    if (savedDevice != comm->cudaDev) {
+      CUDACHECK(cudaSetDevice(savedDevice));
+    }
+    NCCLCHECK(ret);
+  }
+  *handle = mscclAlgoHandle;
+  return ncclSuccess;
+}
 
-  const char* mscclSchedulerPath = getenv(mscclSchedulerPathEnv);
-  if (mscclSchedulerPath) {
-    status.mscclSchedulerLib = dlopen(mscclSchedulerPath, RTLD_NOW | RTLD_LOCAL);
-  } else {
-    status.mscclSchedulerLib = dlopen(mscclSchedulerDefaultPath, RTLD_NOW | RTLD_LOCAL);
+static bool mscclInternalSchedulerAlgoReady(size_t metaIndex, ncclComm_t comm, int rotation) {
+  mscclStatus& status = mscclGetStatus();
+  auto h = status.rankToAlgoHandles[metaIndex].find(mscclAlgoRankKey(status.algoMetas[metaIndex], comm, rotation));
+  if (h == status.rankToAlgoHandles[metaIndex].end()) return false;
+  auto c = status.connectedAlgos.find(comm);
+  return c != status.connectedAlgos.end() && c->second.count(h->second) > 0;
+}
+
+// Load and connect all algorithms of catalog usable by comm, and reserve the scratch they need.
+// Caller must hold mscclLifecycleMutex through lock.
+static ncclResult_t mscclInternalSchedulerPrepareComm(ncclComm_t comm, const struct mscclAlgoCatalog* catalog, std::unique_lock<std::mutex>& lock) {
+  size_t scratchReserveSize = 0;
+  for (size_t i = 0; i < catalog->metas.size(); i++) {
+    auto &m = catalog->metas[i];
+    if (mscclInternalSchedulerUsable(m, comm) && (m.protocolMask & ~comm->connProtoMask) == 0) {
+      mscclAlgoHandle_t mscclAlgoHandle;
+      NCCLCHECK(mscclInternalSchedulerPrepareAlgo(i, comm, 0, lock, &mscclAlgoHandle));
+      // Largest scratch any bounded algorithm may need
+      struct mscclAlgo* hostAlgo;
+      struct mscclDevAlgo* devAlgo;
+      NCCLCHECK(mscclGetAlgo(mscclAlgoHandle, comm, &hostAlgo, &devAlgo));
+      if (m.maxBytes > 0) {
+        scratchReserveSize = std::max(scratchReserveSize, (size_t)m.maxBytes * hostAlgo->nScratchChunks / hostAlgo->nChunksPerLoop);
+      }
+    }
+  }
+  // config.mscclScratchReserve caps the reservation in MB, calls needing more grow the scratch
+  if (comm->config.mscclScratchReserve >= 0) {
+    scratchReserveSize = std::min(scratchReserveSize, (size_t)comm->config.mscclScratchReserve << 20);
+  } else if (!ncclParamMscclScratchReserve()) {
+    scratchReserveSize = 0;
+  }
+  if (scratchReserveSize > 0) {
+    NCCLCHECK(mscclReserveScratch(comm, scratchReserveSize));
   }
+  return ncclSuccess;
+}
+
+// Schedulers of the first interface load their algorithms on every init and get all channels
+static mscclSchedulerInterface_v1* mscclSchedulerV1;
+
+static ncclResult_t mscclSchedulerV1Init() {
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclSchedulerV1InitComm(const struct mscclSchedulerCommInfo* info, int* numChannelsRequired, void** commContext) {
+  *numChannelsRequired = MAXCHANNELS;
+  *commContext = nullptr;
+  return mscclSchedulerV1->init();
+}
+
+static ncclResult_t mscclSchedulerV1SelectAlgos(void* commContext, struct mscclSchedulerParam** params, int nParams) {
+  for (int i = 0; i < nParams; i++) {
+    NCCLCHECK(mscclSchedulerV1->selectAlgo(params[i]));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclSchedulerV1FinalizeComm(void* commContext) {
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclSchedulerV1Teardown() {
+  return mscclSchedulerV1->teardown();
+}
+
+static mscclSchedulerInterface_v2 mscclSchedulerV1AsV2 = {
+  nullptr, mscclSchedulerV1Init, mscclSchedulerV1InitComm, mscclSchedulerV1SelectAlgos,
+  mscclSchedulerV1FinalizeComm, mscclSchedulerV1Teardown
+};
+
+// Load the external scheduler once for all communicators, nullptr if there is none. configPath
+// is the scheduler a communicator config asks for, which has to be found.
+static ncclResult_t mscclLoadScheduler(mscclStatus& status, const char* configPath) {
+  const char* mscclSchedulerPath = configPath ? configPath : getenv(mscclSchedulerPathEnv);
+  if (mscclSchedulerPath == nullptr) mscclSchedulerPath = mscclSchedulerDefaultPath;
+  status.mscclSchedulerLib = dlopen(mscclSchedulerPath, RTLD_NOW | RTLD_LOCAL);
   if (status.mscclSchedulerLib == nullptr) {
+    if (configPath) {
+      WARN("MSCCL: could not load scheduler %s of the communicator config: %s", configPath, dlerror());
+      return ncclInvalidUsage;
+    }
     INFO(NCCL_INIT, "MSCCL: No external scheduler found, using internal implementation");
-    useInternalScheduler = true;
-  } else {
-    status.mscclSchedulerPtr = (mscclSchedulerInterface *)dlsym(status.mscclSchedulerLib, "mscclScheduler");
-    if (status.mscclSchedulerPtr == nullptr) {
-      INFO(NCCL_INIT, "MSCCL: Failed to find mscclScheduler symbol, using internal implementation");
-      useInternalScheduler = true;
+    return ncclSuccess;
+  }
+  status.mscclSchedulerPtr = (mscclSchedulerInterface_v2 *)dlsym(status.mscclSchedulerLib, "mscclScheduler_v2");
+  if (status.mscclSchedulerPtr == nullptr) {
+    mscclSchedulerV1 = (mscclSchedulerInterface_v1 *)dlsym(status.mscclSchedulerLib, "mscclScheduler");
+    if (mscclSchedulerV1 == nullptr) {
+      INFO(NCCL_INIT, "MSCCL: Failed to find mscclScheduler_v2 or mscclScheduler symbol, using internal implementation");
+      dlclose(status.mscclSchedulerLib);
+      status.mscclSchedulerLib = nullptr;
+      if (configPath) {
+        WARN("MSCCL: scheduler %s of the communicator config has no mscclScheduler_v2 or mscclScheduler symbol", configPath);
+        return ncclInvalidUsage;
+      }
+      return ncclSuccess;
     }
+    mscclSchedulerV1AsV2.name = mscclSchedulerV1->name;
+    status.mscclSchedulerPtr = &mscclSchedulerV1AsV2;
+  }
+  INFO(NCCL_INIT, "MSCCL: Using external scheduler %s", status.mscclSchedulerPtr->name);
+  ncclResult_t ret = status.mscclSchedulerPtr->init();
+  if (ret != ncclSuccess) {
+    status.mscclSchedulerPtr = nullptr;
+    dlclose(status.mscclSchedulerLib);
+    status.mscclSchedulerLib = nullptr;
+  } else {
+    status.mscclSchedulerPath = mscclSchedulerPath;
   }
+  return ret;
+}
+
+static void mscclGetSchedulerCommInfo(ncclComm_t comm, struct mscclSchedulerCommInfo* info) {
+  info->comm = comm;
+  info->rank = comm->rank;
+  info->nRanks = comm->nRanks;
+  info->topo.nNodes = comm->nNodes;
+  info->topo.nLocalRanks = comm->localRanks;
+  info->topo.nGpus = comm->topo->nodes[GPU].count;
+  info->topo.nNics = comm->topo->nodes[NET].count;
+  info->topo.cudaArch = comm->cudaArch;
+  info->topo.bwIntra = comm->graphs[NCCL_ALGO_RING].bwIntra;
+  info->topo.bwInter = comm->graphs[NCCL_ALGO_RING].bwInter;
+  info->topo.maxBw = comm->topo->maxBw;
+  info->topo.totalBw = comm->topo->totalBw;
+  info->topo.minCudaArch = comm->minCompCap*10;
+  info->topo.maxCudaArch = comm->maxCompCap*10;
+  info->topo.cudaArchPerNode = comm->compCapPerNode;
+}
+
+ncclResult_t mscclSchedulerInit(ncclComm_t comm, int* numChannelsRequired) {
+  // config.mscclScheduler is "internal", the path of the external scheduler, or NULL for the one of the process
+  const char* configScheduler = comm->config.mscclScheduler;
+  bool internal = configScheduler && strcmp(configScheduler, "internal") == 0;
+  *numChannelsRequired = 0;
+  comm->mscclCompatible = true;
+  mscclConfigEnabled.store(true, std::memory_order_release);
+
+  std::lock_guard<std::mutex> lock(mscclLifecycleMutex);
 
-  if (useInternalScheduler) {
+  mscclStatus& status = mscclGetStatus();
+  if (!internal && status.mscclSchedulerPtr == nullptr) {
+    NCCLCHECK(mscclLoadScheduler(status, configScheduler));
+  } else if (!internal && configScheduler && status.mscclSchedulerPath != configScheduler) {
+    WARN("MSCCL: rank %d asks for scheduler %s but the process already uses %s", comm->rank, configScheduler, status.mscclSchedulerPath.c_str());
+    return ncclInvalidUsage;
+  }
+  comm->mscclExternalScheduler = !internal && status.mscclSchedulerPtr != nullptr;
+
+  if (!comm->mscclExternalScheduler) {
     NCCLCHECK(mscclInternalSchedulerInit(comm, numChannelsRequired));
   } else {
-    NCCLCHECK(status.mscclSchedulerPtr->init());
-    *numChannelsRequired = MAXCHANNELS;
+    struct mscclSchedulerCommInfo info;
+    void* commContext = nullptr;
+    mscclGetSchedulerCommInfo(comm, &info);
+    NCCLCHECK(status.mscclSchedulerPtr->initComm(&info, numChannelsRequired, &commContext));
+    *numChannelsRequired = std::min(std::max(*numChannelsRequired, 0), MAXCHANNELS);
+    status.schedulerContexts[comm] = commContext;
+    INFO(NCCL_INIT, "MSCCL: Scheduler %s requires %d channels on rank %d", status.mscclSchedulerPtr->name, *numChannelsRequired, comm->rank);
   }
 
   return ncclSuccess;
 }
 
 ncclResult_t mscclInit(ncclComm_t comm) {
-  if (comm->intraRanks > 1) {
-    mscclInitialized.store(false, std::memory_order_release);
-    INFO(NCCL_INIT, "MSCCL doesn't support multiple GPUs in one process and is not available");
-    return ncclSuccess;
-  }
+  bool initDevice;
   // Always initialize thread local status
   mscclThreadLocalStatus threadLocalStatus = mscclGetThreadLocalStatus();
   threadLocalStatus.groupStatus = mscclNoGroup;
@@ -228,60 +597,111 @@ ncclResult_t mscclInit(ncclComm_t comm) {
   threadLocalStatus.captureId = ULLONG_MAX;
   threadLocalStatus.captureStatus = mscclNoCapture;
 
+  // Per-communicator scratch and flags
+  struct mscclCommStatus* commStatus;
+  NCCLCHECK(ncclCalloc(&commStatus, 1));
+  commStatus->scratchBuffer = nullptr;
+  commStatus->scratchBufferSize = 0;
+  commStatus->scratchBufferIpc = false;
+  commStatus->scratchRegHandle = nullptr;
+  NCCLCHECK(ncclCudaCalloc(&commStatus->syncFlags, MSCCL_MAX_NUM_THREAD_BLOCKS));
+  NCCLCHECK(ncclCudaCalloc(&commStatus->syncEpoch, 1));
+  NCCLCHECK(ncclCudaHostCalloc(&commStatus->watchdog, 1));
+  commStatus->waitTimeout = 0;
+  commStatus->watchdogReported = false;
+  if (ncclParamMscclWaitTimeoutMs() > 0) {
+    int clockRate; // kHz, clock64 counts cycles of the SM clock
+    CUDACHECK(cudaDeviceGetAttribute(&clockRate, cudaDevAttrClockRate, comm->cudaDev));
+    commStatus->waitTimeout = (uint64_t)ncclParamMscclWaitTimeoutMs() * clockRate;
+  }
+  commStatus->lastStream = nullptr;
+  commStatus->needsProxy = false;
+  commStatus->needsFence = false;
+  commStatus->autotune = nullptr;
+  commStatus->telemetry = nullptr;
+  commStatus->fallback = nullptr;
+  commStatus->schedulerContext = nullptr;
+  commStatus->catalog = nullptr;
+  commStatus->topo = nullptr;
+  commStatus->synthKey = 0;
+  comm->mscclCommStatus = commStatus;
+  NCCLCHECK(mscclFallbackInit(comm));
+  bool needsTopo;
   {
     std::lock_guard<std::mutex> lock(mscclLifecycleMutex);
+    needsTopo = mscclCommNeedsTopo(comm);
+  }
+  // Gathered from all ranks only for the algorithms that require one
+  if (needsTopo) NCCLCHECK(mscclTopoInit(comm));
+
+  {
+    std::unique_lock<std::mutex> lock(mscclLifecycleMutex);
 
     mscclStatus& status = mscclGetStatus();
+    auto context = status.schedulerContexts.find(comm);
+    if (context != status.schedulerContexts.end()) {
+      commStatus->schedulerContext = context->second;
+      status.schedulerContexts.erase(context);
+    }
 
-    // freeAlgoHandles, needsProxy and needsFence are initialized globally once and before algorithm pre-processing and connection
+    // freeAlgoHandles are initialized globally once and before algorithm pre-processing and connection
     if (!mscclInitialized.load(std::memory_order_acquire)) {
       status.freeAlgoHandles.resize(MSCCL_MAX_NUM_ALGOS);
       for (int i = 0; i < MSCCL_MAX_NUM_ALGOS; i++) {
         status.freeAlgoHandles[i] = MSCCL_MAX_NUM_ALGOS - i - 1;
       }
-      status.needsProxy = false;
-      status.needsFence = false;
-    }
-
-    // Pre-process all algorithms for internal scheduler and for different comms.
-    // This is a temp fix to bypass the issue that stream cannot be synchronized during HIP graph capturing,
-    // should use dynamic loading approach after the issue is fixed.
-    if (comm->mscclCompatible && !status.mscclSchedulerPtr) {
-      for (size_t i = 0; i < status.algoMetas.size(); i++) {
-        auto &m = status.algoMetas[i];
-        if (m.nRanks == comm->nRanks) {
-          // Load algorithms
-          if (status.rankToAlgoHandles[i].find(comm->rank) == status.rankToAlgoHandles[i].end()) {
-            NCCLCHECK(mscclLoadAlgo(m.filePath.c_str(), &(status.rankToAlgoHandles[i][comm->rank]), comm->rank));
-          }
-          // Connect algorithms
-          mscclAlgoHandle_t mscclAlgoHandle = status.rankToAlgoHandles[i][comm->rank];
-          if (status.connectedAlgos[comm].find(mscclAlgoHandle) == status.connectedAlgos[comm].end()) {
-            NCCLCHECK(mscclSetupConnections(status.hostAlgos[mscclAlgoHandle], comm));
-            status.connectedAlgos[comm].insert(mscclAlgoHandle);
-          }
+    }
+    status.nComms++;
+    // Synthesized algorithms come after those read from files, which win ties in the catalog
+    if (comm->mscclCompatible && !mscclCommScheduler(comm) && mscclSynthEnabled()) {
+      std::vector<std::string> paths;
+      NCCLCHECK(mscclSynthesizeAlgos(comm, &paths));
+      for (auto& path : paths) {
+        bool known = false;
+        for (auto& m : status.algoMetas) known |= m.filePath == path;
+        if (!known) NCCLCHECK(mscclInternalSchedulerAddMeta(path, 0, ""));
+      }
+    }
+    // Connections made at runtime need buffers for the protocols of the algorithms this comm may run,
+    // algorithms of external schedulers are not known before they are loaded
+    if (comm->mscclCompatible) {
+      if (mscclCommScheduler(comm)) {
+        comm->connProtoMask = (1 << NCCL_NUM_PROTOCOLS) - 1;
+      } else {
+        for (auto& m : status.algoMetas) {
+          if (m.nRanks == comm->nRanks && !m.retired && mscclAlgoOfComm(m, comm)) comm->connProtoMask |= m.protocolMask;
         }
       }
     }
-
-    if (mscclInitialized.load(std::memory_order_acquire)) {
-      return ncclSuccess;
+    if (commStatus->topo != nullptr && commStatus->topo->logicalToRank != nullptr) {
+      commStatus->topo->rankLayout = mscclRankLayout(comm);
     }
 
-    status.scratchBuffer = nullptr;
-    status.scratchBufferSize = 0;
-    status.workIndex = 1;
-    NCCLCHECK(ncclCudaCalloc(&status.syncFlags, MSCCL_MAX_NUM_THREAD_BLOCKS));
-    status.lastStream = nullptr;
+    // Pre-process all algorithms for internal scheduler and for different comms, unless they are
+    // loaded on first use. Lazy loading cannot happen while a stream is being captured, so callers
+    // using graphs with lazy loading should call mscclWarmup() before capturing. Ranks sharing a
+    // process may be driven by a single thread, which cannot connect them one after the other,
+    // so they always connect here where every rank has its own init thread.
+    if (comm->mscclCompatible && !mscclCommScheduler(comm)) {
+      NCCLCHECK(mscclInternalSchedulerBuildCatalog(comm, &commStatus->catalog));
+      if (!ncclParamMscclLazyLoad() || comm->intraRanks > 1) {
+        NCCLCHECK(mscclInternalSchedulerPrepareComm(comm, commStatus->catalog, lock));
+      }
+    }
 
+    // Kernel attributes and stack limit are set once per device
+    initDevice = status.initializedDevices.insert(comm->cudaDev).second;
     mscclInitialized.store(true, std::memory_order_release);
   }
-
+  if (!initDevice) {
+    return ncclSuccess;
+  }
 
   size_t maxLocalSizeBytes = 0, mscclMaxLocalSizeBytes = 0;
   cudaDeviceGetLimit(&maxLocalSizeBytes, cudaLimitStackSize);
-  NCCLCHECK(mscclInitKernelsForDevice(comm->cudaArch, &mscclMaxLocalSizeBytes));
-  if (mscclMaxLocalSizeBytes > maxLocalSizeBytes && getEnvInt("NCCL_SET_STACK_SIZE", 0) == 1) {
+  bool setStackSize = getEnvInt("NCCL_SET_STACK_SIZE", 0) == 1;
+  NCCLCHECK(mscclInitKernelsForDevice(comm->cudaDev, comm->cudaArch, setStackSize ? &mscclMaxLocalSizeBytes : NULL));
+  if (mscclMaxLocalSizeBytes > maxLocalSizeBytes && setStackSize) {
     // Reset the maximum kernel stack size of all msccl kernels to avoid
     // a CUDA memory reconfig on load (c.f. NVSHMEM issue)
     TRACE(NCCL_INIT, "Msccl Resetting cudaLimitStackSize to %zi", mscclMaxLocalSizeBytes);
@@ -301,59 +721,252 @@ ncclResult_t mscclGroupStart() {
   return ncclSuccess;
 }
 
-static ncclResult_t mscclInternalSchedulerSelectAlgo(struct mscclSchedulerParam* param) {
+// Best time predicted by NCCL's own tuning model for the equivalent collective, -1 if there is none
+static ncclResult_t mscclPredictNcclTime(ncclComm_t comm, mscclFunc_t func, int64_t nBytes, float* time) {
+  int coll;
+  *time = -1.0f;
+  switch (func) {
+    case mscclFuncReduce: coll = ncclFuncReduce; break;
+    case mscclFuncBroadcast: coll = ncclFuncBroadcast; break;
+    case mscclFuncAllReduce: coll = ncclFuncAllReduce; break;
+    case mscclFuncReduceScatter: coll = ncclFuncReduceScatter; break;
+    case mscclFuncAllGather: coll = ncclFuncAllGather; break;
+    default: return ncclSuccess;
+  }
+  for (int a = 0; a < NCCL_NUM_ALGORITHMS; a++) {
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      bool backup;
+      float t;
+      NCCLCHECK(ncclTopoGetAlgoTime(comm, coll, a, p, nBytes, 1, &t, &backup));
+      if (!backup && t >= 0.0f && (*time < 0.0f || t < *time)) *time = t;
+    }
+  }
+  return ncclSuccess;
+}
+
+// NVLS thread blocks need the NVLS channels of the algorithm and multimem support for op and dataType
+static bool mscclNvlsUsable(ncclComm_t comm, const struct mscclAlgoMeta& m, ncclDevRedOp_t devRedOp, ncclDataType_t dataType) {
+  if (m.nNvlsChannels == 0) return true;
+  if (!mscclNvlsAvailable(comm, m.nNvlsChannels)) return false;
+  return ncclNvlsSupported(devRedOp, dataType);
+}
+
+// CollNet thread blocks need CollNet support for op and dataType
+static bool mscclCollNetUsable(ncclComm_t comm, const struct mscclAlgoMeta& m, ncclRedOp_t op, ncclDataType_t dataType) {
+  return !m.collNet || mscclCollNetAvailable(comm, op, dataType);
+}
+
+static bool mscclIsInPlace(struct mscclSchedulerParam* param) {
+  return mscclIsInPlaceCall(param->func, param->sendBuff, param->recvBuff, param->count * ncclTypeSize(param->dataType), param->rank);
+}
+
+// Why no algorithm of the catalog is made for calls of this function, rank count and placement
+static mscclSelectReason mscclSelectNoAlgoReason(const struct mscclAlgoCatalog* catalog, const struct mscclSchedulerParam* param,
+    bool isInPlace) {
+  if (catalog->index.count(mscclAlgoIndexKey(param->func, param->nRanks, !isInPlace))) {
+    return mscclSelectInPlaceMismatch;
+  }
+  for (auto& m : catalog->metas) {
+    if (!m.retired && m.func == param->func && m.nRanks != param->nRanks) return mscclSelectNRanksMismatch;
+  }
+  return mscclSelectNoAlgo;
+}
+
+static ncclResult_t mscclInternalSchedulerSelectAlgo(struct mscclSavedSchedulerParam* savedParam, struct mscclSelectMemo* memo,
+    mscclSelectReason* reason, const char** algoName) {
   mscclStatus& status = mscclGetStatus();
+  struct mscclSchedulerParam* param = &savedParam->p;
   param->scheduled = false;
+  *reason = mscclSelectNoAlgo;
+  *algoName = nullptr;
+
+  // Whether the algorithm is in-place
+  bool isInPlace = mscclIsInPlace(param);
 
-  // Current MSCCL doesn't support pre/post op
-  if (param->op >= ncclAvg) {
+  // Reductions run the device op NCCL would, pre-ops are applied as steps read the input buffer.
+  // The division of ncclAvg on integers has to happen once on the final sums, it stays on NCCL.
+  struct ncclDevRedOpFull opFull;
+  NCCLCHECK(mscclHostToDevRedOp(&opFull, param->op, param->dataType, savedParam->comm));
+  if (opFull.op == ncclDevSumPostDiv) {
+    *reason = mscclSelectAvgOnIntegers;
+    return ncclSuccess;
+  }
+  // In-place programs may read the data of the call through the output buffer, which is not scaled
+  const bool preMul = opFull.op == ncclDevPreMulSum;
+  if (preMul && isInPlace) {
+    *reason = mscclSelectPreMulUnsafe;
     return ncclSuccess;
   }
-  //nccl imp: ncclRedOp_t netOp = info->op == ncclAvg || info->op >= ncclNumOps ? ncclSum : info->op;
 
-  // Whether the algorithm is in-place
-  bool isInPlace = false;
-  if (param->func == mscclFuncReduce ||
-      param->func == mscclFuncBroadcast ||
-      param->func == mscclFuncAllReduce ||
-      param->func == mscclFuncAllToAll) {
-    isInPlace = param->sendBuff == param->recvBuff;
-  } else if (param->func == mscclFuncAllGather ||
-             param->func == mscclFuncGather) {
-    isInPlace = (char*)param->sendBuff == (char*)param->recvBuff + param->rank * param->count * ncclTypeSize(param->dataType);
-  } else if (param->func == mscclFuncReduceScatter ||
-             param->func == mscclFuncScatter) {
-    isInPlace = (char*)param->recvBuff == (char*)param->sendBuff + param->rank * param->count * ncclTypeSize(param->dataType);
+  // Autotuning decides per call until its decisions are made
+  if (mscclAutotuneEnabled()) {
+    memo = nullptr;
+  }
+
+  // Reuse the last decision of this communicator if the call is the same
+  if (memo && memo->valid && memo->func == param->func && memo->count == param->count &&
+      memo->dataType == param->dataType && memo->op == param->op && memo->root == param->root &&
+      memo->inPlace == isInPlace) {
+    param->scheduled = memo->scheduled;
+    param->handle = memo->handle;
+    *reason = memo->reason;
+    *algoName = memo->algoName;
+    return ncclSuccess;
   }
 
   // Search suitable algorithms
-  for (size_t i = 0; i < status.algoMetas.size(); i++) {
-    auto &m = status.algoMetas[i];
-    size_t nBytes = param->count * ncclTypeSize(param->dataType) * m.sizeMultiplier;
-    bool msgSizeIsValid =
-      param->count > 0 && ((param->count * m.sizeMultiplier) % m.nChunksPerLoop) == 0 &&
-      nBytes >= m.minBytes && (m.maxBytes == 0 || nBytes <= m.maxBytes);
-    if (msgSizeIsValid &&
-        m.nRanks == param->nRanks &&
-        m.func == param->func &&
-        (isInPlace ? m.inPlace : m.outOfPlace)) {
-      param->handle = status.rankToAlgoHandles[i][param->rank];
-      param->scheduled = true;
-      TRACE("MSCCL: SchedulerSelectAlgo: Algo %s is selected", m.filePath.c_str());
-      return ncclSuccess;
+  const struct mscclAlgoCatalog* catalog = mscclGetCommStatus(savedParam->comm).catalog;
+  if (catalog == nullptr) {
+    *reason = mscclSelectNoCatalog;
+    return ncclSuccess;
+  }
+  int metaIndex = -1;
+  std::vector<int> candidates;
+  auto it = catalog->index.find(mscclAlgoIndexKey(param->func, param->nRanks, isInPlace));
+  if (it == catalog->index.end()) {
+    *reason = mscclSelectNoAlgoReason(catalog, param, isInPlace);
+  } else if (param->count == 0) {
+    *reason = mscclSelectSizeOutOfRange;
+  } else {
+    struct mscclAlgoIndex& index = it->second;
+    int64_t nBytes = param->count * ncclTypeSize(param->dataType) * index.sizeMultiplier;
+    // Find the last segment starting at or below nBytes
+    auto seg = std::upper_bound(index.segments.begin(), index.segments.end(), nBytes,
+      [](int64_t bytes, const struct mscclAlgoIndexSegment& s) { return bytes < s.startBytes; });
+    if (seg == index.segments.begin() || std::prev(seg)->metaIndices.empty()) {
+      *reason = mscclSelectSizeOutOfRange;
+    } else {
+      --seg;
+      // Algorithms with a performance model are ranked by predicted time, the others keep
+      // directory order and are only used when no modelled algorithm matches
+      int firstIndex = -1;
+      float bestTime = 0.0f;
+      *reason = mscclSelectCountNotDivisible;
+      for (int i : seg->metaIndices) {
+        auto &m = catalog->metas[i];
+        if (!mscclCountSupported(m.func, m.nChunksPerLoop, m.sizeMultiplier, param->count)) continue;
+        if (preMul && m.writesInput) {
+          *reason = mscclSelectPreMulUnsafe;
+          continue;
+        }
+        if (!mscclNvlsUsable(savedParam->comm, m, opFull.op, param->dataType) ||
+            !mscclCollNetUsable(savedParam->comm, m, param->op, param->dataType)) {
+          *reason = mscclSelectResourceUnusable;
+          continue;
+        }
+        candidates.push_back(i);
+        if (m.bandwidth > 0.0f) {
+          float time = m.latency + nBytes / (1000.0f * m.bandwidth);
+          if (metaIndex < 0 || time < bestTime) {
+            metaIndex = i;
+            bestTime = time;
+          }
+        } else if (firstIndex < 0) {
+          firstIndex = i;
+        }
+      }
+      if (metaIndex >= 0 && ncclParamMscclModelFallback()) {
+        float ncclTime;
+        NCCLCHECK(mscclPredictNcclTime(savedParam->comm, param->func, nBytes, &ncclTime));
+        if (ncclTime >= 0.0f && ncclTime < bestTime) {
+          TRACE(NCCL_COLL, "MSCCL: SchedulerSelectAlgo: NCCL predicted %f us is faster than %s predicted %f us",
+            ncclTime, catalog->metas[metaIndex].filePath.c_str(), bestTime);
+          metaIndex = -1;
+          firstIndex = -1;
+          *reason = mscclSelectNcclFaster;
+        }
+      }
+      if (metaIndex < 0) metaIndex = firstIndex;
+    }
+  }
+
+  if (mscclAutotuneEnabled()) {
+    NCCLCHECK(mscclAutotuneChoose(savedParam, isInPlace, candidates, metaIndex, &metaIndex));
+    if (metaIndex < 0 && !candidates.empty() && *reason != mscclSelectNcclFaster) *reason = mscclSelectAutotuneNccl;
+  }
+
+  if (metaIndex >= 0) {
+    int rotation = mscclAlgoRotation(catalog->metas[metaIndex], param->func, param->root, param->nRanks);
+    // Rotated copies are only loaded for the roots calls use, as with lazy loading
+    if (ncclParamMscclLazyLoad() || rotation > 0) {
+      std::unique_lock<std::mutex> lock(mscclLifecycleMutex);
+      if (!mscclInternalSchedulerAlgoReady(metaIndex, savedParam->comm, rotation)) {
+        cudaStreamCaptureStatus captureStatus;
+        CUDACHECK(cudaStreamIsCapturing(savedParam->stream, &captureStatus));
+        if (captureStatus != cudaStreamCaptureStatusNone) {
+          // Connection setup is not allowed during capture, fall back to NCCL and do not memoize
+          INFO(NCCL_COLL, "MSCCL: Algo %s is not loaded and stream is capturing, call mscclWarmup before capture", catalog->metas[metaIndex].filePath.c_str());
+          *reason = mscclSelectNotLoaded;
+          *algoName = catalog->metas[metaIndex].filePath.c_str();
+          return ncclSuccess;
+        }
+      }
+      NCCLCHECK(mscclInternalSchedulerPrepareAlgo(metaIndex, savedParam->comm, rotation, lock, &param->handle));
+    } else {
+      // Reloads on other communicators may grow rankToAlgoHandles
+      std::lock_guard<std::mutex> lock(mscclLifecycleMutex);
+      param->handle = status.rankToAlgoHandles[metaIndex][mscclAlgoRankKey(catalog->metas[metaIndex], savedParam->comm, 0)];
     }
+    param->scheduled = true;
+    *reason = mscclSelectChosen;
+    *algoName = catalog->metas[metaIndex].filePath.c_str();
+    TRACE(NCCL_COLL, "MSCCL: SchedulerSelectAlgo: Algo %s is selected", catalog->metas[metaIndex].filePath.c_str());
   }
 
+  if (memo) {
+    memo->func = param->func;
+    memo->count = param->count;
+    memo->dataType = param->dataType;
+    memo->op = param->op;
+    memo->root = param->root;
+    memo->inPlace = isInPlace;
+    memo->scheduled = param->scheduled;
+    memo->handle = param->handle;
+    memo->reason = *reason;
+    memo->algoName = *algoName;
+    memo->valid = true;
+  }
   return ncclSuccess;
 }
 
+// Show a scheduling decision on the NVTX marks, the metrics and the fallback counters
+static void mscclMarkSelect(const struct mscclSchedulerParam* p, mscclSelectReason reason, const char* algoName) {
+  struct NvtxParamsMscclSelectAlgo {
+    int func;
+    size_t bytes;
+    int rank;
+    int scheduled;
+    int handle;
+    mscclSelectReason reason;
+    const char* algoName;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t MscclSelectAlgoSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Function"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_SIZE, "Message size [bytes]", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, bytes)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Rank", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, rank)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Scheduled", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, scheduled)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Algorithm handle", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, handle)},
+    {0, NVTX_PAYLOAD_ENTRY_MSCCL_SELECT_REASON, "Reason", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, reason)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_CSTRING, "Algorithm", nullptr, 0, offsetof(NvtxParamsMscclSelectAlgo, algoName)}
+  };
+  NvtxParamsMscclSelectAlgo payload{p->func, p->count * ncclTypeSize(p->dataType), p->rank, p->scheduled ? 1 : 0,
+    p->scheduled ? p->handle : -1, reason, algoName ? algoName : ""};
+  NVTX3_MARK_WITH_PARAMS(MscclSelectAlgo, MscclSelectAlgoSchema, payload);
+  ncclMetricsMscclSelect(reason, p->scheduled);
+  mscclFallbackRecord(p, reason);
+}
+
 static ncclResult_t mscclSchedulerSelectAlgo(struct mscclSavedSchedulerParam* param) {
-  mscclStatus& status = mscclGetStatus();
-  if (status.mscclSchedulerPtr) {
-    NCCLCHECK(status.mscclSchedulerPtr->selectAlgo(&(param->p)));
+  mscclSchedulerInterface_v2* scheduler = mscclCommScheduler(param->comm);
+  mscclSelectReason reason = mscclSelectExternal;
+  const char* algoName = nullptr;
+  if (scheduler) {
+    struct mscclSchedulerParam* p = &param->p;
+    NCCLCHECK(scheduler->selectAlgos(mscclGetCommStatus(param->comm).schedulerContext, &p, 1));
   } else {
-    NCCLCHECK(mscclInternalSchedulerSelectAlgo(&(param->p)));
+    NCCLCHECK(mscclInternalSchedulerSelectAlgo(param, &mscclGetCommStatus(param->comm).selectMemo, &reason, &algoName));
   }
+  mscclMarkSelect(&param->p, reason, algoName);
   return ncclSuccess;
 }
 
@@ -377,36 +990,144 @@ static ncclResult_t mscclSetSavedSchedulerParam(
   param->p.func = func;
   param->p.rank = comm->rank;
   param->p.nRanks = comm->nRanks;
+  param->p.comm = comm;
+  param->p.stream = stream;
   param->comm = comm;
   param->stream = stream;
   return ncclSuccess;
 }
 
+// AllGatherV only has receive counts and ReduceScatterV send counts, their displacements may be NULL
 static ncclResult_t mscclSaveCountsAndDispls(struct mscclSavedSchedulerParam* param) {
   if (param->p.sendCounts) {
     param->savedSendCounts.assign(param->p.sendCounts, param->p.sendCounts + param->p.nRanks);
     param->p.sendCounts = param->savedSendCounts.data();
+  }
+  if (param->p.sDisPls) {
     param->savedSDisPls.assign(param->p.sDisPls, param->p.sDisPls + param->p.nRanks);
     param->p.sDisPls = param->savedSDisPls.data();
+  }
+  if (param->p.recvCounts) {
     param->savedRecvCounts.assign(param->p.recvCounts, param->p.recvCounts + param->p.nRanks);
     param->p.recvCounts = param->savedRecvCounts.data();
+  }
+  if (param->p.rDisPls) {
     param->savedRDisPls.assign(param->p.rDisPls, param->p.rDisPls + param->p.nRanks);
     param->p.rDisPls = param->savedRDisPls.data();
   }
   return ncclSuccess;
 }
 
+static bool mscclCanFuse(const struct mscclSavedSchedulerParam& a, const struct mscclSavedSchedulerParam& b) {
+  return a.stream == b.stream && a.p.handle == b.p.handle &&
+    a.p.dataType == b.p.dataType && a.p.op == b.p.op;
+}
+
+// Collect the operations following params[first] on the same communicator that can run in the
+// same kernel. Operations of a group are concurrent, so only the order on each communicator is
+// kept. Captured streams keep one launch per operation.
+static ncclResult_t mscclCollectFused(std::vector<struct mscclSavedSchedulerParam>& params, size_t first,
+    std::vector<bool>& taken, std::vector<struct mscclSavedSchedulerParam*>& fused) {
+  fused.assign(1, &params[first]);
+  if (!ncclParamMscclFuseGroup()) {
+    return ncclSuccess;
+  }
+  cudaStreamCaptureStatus captureStatus;
+  CUDACHECK(cudaStreamIsCapturing(params[first].stream, &captureStatus));
+  if (captureStatus != cudaStreamCaptureStatusNone) {
+    return ncclSuccess;
+  }
+  // Fused launches post their proxy operations directly, not ordered with the host tasks of graphs
+  if (params[first].comm->persistentRefs != 0) {
+    return ncclSuccess;
+  }
+  // Calls with a tail need a second launch of their own
+  struct mscclAlgo* hostAlgo;
+  struct mscclDevAlgo* devAlgo;
+  NCCLCHECK(mscclGetAlgo(params[first].p.handle, params[first].comm, &hostAlgo, &devAlgo));
+  if (mscclHasTail(hostAlgo, params[first].p.count)) {
+    return ncclSuccess;
+  }
+  for (size_t i = first + 1; i < params.size() && fused.size() < MSCCL_MAX_FUSED_WORKS; i++) {
+    if (taken[i] || params[i].comm != params[first].comm) continue;
+    if (!mscclCanFuse(params[first], params[i]) || mscclHasTail(hostAlgo, params[i].p.count)) break;
+    fused.push_back(&params[i]);
+    taken[i] = true;
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t mscclRunSavedParams() {
+  // MSCCL kernels go to the stream directly, after the collectives NCCL left pending
+  NCCLCHECK(ncclGroupImplicitFlush());
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
+  auto& params = threadLocalStatus.savedSchedulerParams;
+  std::vector<bool> taken(params.size(), false);
+  std::vector<struct mscclSavedSchedulerParam*> fused;
 
-  for (size_t i = 0; i < threadLocalStatus.savedSchedulerParams.size(); i++) {
-    auto& param = threadLocalStatus.savedSchedulerParams[i];
+  for (size_t i = 0; i < params.size(); i++) {
+    if (taken[i]) continue;
+    NCCLCHECK(mscclCollectFused(params, i, taken, fused));
+    if (fused.size() > 1) {
+      NCCLCHECK(mscclRunFusedAlgo(fused));
+      continue;
+    }
+    auto& param = params[i];
     NCCLCHECK(mscclRunAlgo(
       param.p.sendBuff, param.p.sendCounts, param.p.sDisPls,
       param.p.recvBuff, param.p.recvCounts, param.p.rDisPls,
       param.p.count, param.p.dataType, param.p.root, param.p.peer, param.p.op, param.p.handle, param.comm, param.stream));
   }
-  threadLocalStatus.savedSchedulerParams.clear();
+  params.clear();
+  return ncclSuccess;
+}
+
+// Collectives without an NCCL counterpart are decomposed into grouped point-to-point operations.
+// Counts and displacements of AllToAllv are in elements of dataType.
+static ncclResult_t mscclFallBackAllToAllv(struct mscclSavedSchedulerParam* param) {
+  size_t typeSize = ncclTypeSize(param->p.dataType);
+  NCCLCHECK(ncclGroupStart());
+  for (int r = 0; r < param->p.nRanks; r++) {
+    if (param->p.sendCounts[r] != 0) {
+      NCCLCHECK(ncclSend(((char*)param->p.sendBuff)+param->p.sDisPls[r]*typeSize, param->p.sendCounts[r], param->p.dataType,
+        r, param->comm, param->stream));
+    }
+    if (param->p.recvCounts[r] != 0) {
+      NCCLCHECK(ncclRecv(((char*)param->p.recvBuff)+param->p.rDisPls[r]*typeSize, param->p.recvCounts[r], param->p.dataType,
+        r, param->comm, param->stream));
+    }
+  }
+  NCCLCHECK(ncclGroupEnd());
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclFallBackGather(struct mscclSavedSchedulerParam* param) {
+  size_t rankOffset = param->p.count * ncclTypeSize(param->p.dataType);
+  if (param->p.count == 0) return ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  NCCLCHECK(ncclSend(param->p.sendBuff, param->p.count, param->p.dataType, param->p.root, param->comm, param->stream));
+  if (param->p.rank == param->p.root) {
+    for (int r = 0; r < param->p.nRanks; r++) {
+      NCCLCHECK(ncclRecv(((char*)param->p.recvBuff)+r*rankOffset, param->p.count, param->p.dataType,
+        r, param->comm, param->stream));
+    }
+  }
+  NCCLCHECK(ncclGroupEnd());
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclFallBackScatter(struct mscclSavedSchedulerParam* param) {
+  size_t rankOffset = param->p.count * ncclTypeSize(param->p.dataType);
+  if (param->p.count == 0) return ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  if (param->p.rank == param->p.root) {
+    for (int r = 0; r < param->p.nRanks; r++) {
+      NCCLCHECK(ncclSend(((char*)param->p.sendBuff)+r*rankOffset, param->p.count, param->p.dataType,
+        r, param->comm, param->stream));
+    }
+  }
+  NCCLCHECK(ncclRecv(param->p.recvBuff, param->p.count, param->p.dataType, param->p.root, param->comm, param->stream));
+  NCCLCHECK(ncclGroupEnd());
   return ncclSuccess;
 }
 
@@ -447,6 +1168,23 @@ static ncclResult_t mscclFallBackSavedParams() {
         NCCLCHECK(ncclAllToAll(param.p.sendBuff, param.p.recvBuff, param.p.count, param.p.dataType,
           param.comm, param.stream));
         break;
+      case mscclFuncAllToAllv:
+        NCCLCHECK(mscclFallBackAllToAllv(&param));
+        break;
+      case mscclFuncAllGatherV:
+        NCCLCHECK(ncclAllGatherV(param.p.sendBuff, param.p.recvBuff, param.p.recvCounts, param.p.rDisPls,
+          param.p.dataType, param.comm, param.stream));
+        break;
+      case mscclFuncReduceScatterV:
+        NCCLCHECK(ncclReduceScatterV(param.p.sendBuff, param.p.sendCounts, param.p.sDisPls, param.p.recvBuff,
+          param.p.dataType, param.p.op, param.comm, param.stream));
+        break;
+      case mscclFuncGather:
+        NCCLCHECK(mscclFallBackGather(&param));
+        break;
+      case mscclFuncScatter:
+        NCCLCHECK(mscclFallBackScatter(&param));
+        break;
       default:
         WARN("Invalid MSCCL function type in saved parameter");
         return ncclInvalidUsage;
@@ -457,12 +1195,25 @@ static ncclResult_t mscclFallBackSavedParams() {
   return ncclSuccess;
 }
 
+// The first n saved operations go to NCCL with a call of their group that MSCCL cannot run
+static void mscclMarkGroupFallBack(size_t n) {
+  auto& params = mscclGetThreadLocalStatus().savedSchedulerParams;
+  for (size_t i = 0; i < n && i < params.size(); i++) {
+    params[i].p.scheduled = false;
+    mscclMarkSelect(&params[i].p, mscclSelectGroupUnsupportedOp, nullptr);
+  }
+}
+
 ncclResult_t mscclEnqueueCheck(
     const void* sendBuff, const size_t sendCounts[], const size_t sDisPls[],
     void* recvBuff, const size_t recvCounts[], const size_t rDisPls[],
     size_t count, ncclDataType_t dataType, int root, int peer, ncclRedOp_t op,
     mscclFunc_t func, ncclComm_t comm, cudaStream_t stream) {
+  // Reads the comm, which must be done with its init first
+  NCCLCHECK(CommCheck(comm, "mscclEnqueueCheck", "comm"));
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
+  // MSCCL kernels share the flags of the comm and run on channels from 0, outside the lanes
+  bool compatible = comm->mscclCompatible && ncclLaneOfStream(comm, stream) == NULL;
   threadLocalStatus.savedSchedulerParams.push_back({});
   NCCLCHECK(mscclSetSavedSchedulerParam(
     sendBuff, sendCounts, sDisPls, recvBuff, recvCounts, rDisPls,
@@ -471,27 +1222,48 @@ ncclResult_t mscclEnqueueCheck(
 
   switch (threadLocalStatus.groupStatus) {
     case mscclNoGroup:
-      if (comm->mscclCompatible) {
+      if (compatible) {
             NCCLCHECK(mscclSchedulerSelectAlgo(&threadLocalStatus.savedSchedulerParams.back()));
+            NCCLCHECK(mscclAutotuneBegin(comm, stream));
             if (threadLocalStatus.savedSchedulerParams.back().p.scheduled) {
-              NCCLCHECK(mscclRunSavedParams());
-              break;
+              bool split;
+              NCCLCHECK(mscclSplitRun(&threadLocalStatus.savedSchedulerParams.back(), &split));
+              if (split) {
+                threadLocalStatus.savedSchedulerParams.clear();
+              } else {
+                NCCLCHECK(mscclRunSavedParams());
+              }
+            } else {
+              NCCLCHECK(mscclFallBackSavedParams());
             }
+            NCCLCHECK(mscclAutotuneEnd(comm, stream));
+            break;
         }
+      mscclMarkSelect(&threadLocalStatus.savedSchedulerParams.back().p, mscclSelectIncompatible, nullptr);
       NCCLCHECK(mscclFallBackSavedParams());
       break;
     case mscclGroupSupportedOp:
-      if (comm->mscclCompatible) {
+      if (compatible && mscclCommScheduler(comm)) {
+        // Selected with the rest of the group when it ends
+        NCCLCHECK(mscclSaveCountsAndDispls(&threadLocalStatus.savedSchedulerParams.back()));
+        break;
+      }
+      if (compatible) {
           NCCLCHECK(mscclSchedulerSelectAlgo(&threadLocalStatus.savedSchedulerParams.back()));
           if (threadLocalStatus.savedSchedulerParams.back().p.scheduled) {
             // Only save counts and displs when there is suitable MSCCL algorithm for this
             NCCLCHECK(mscclSaveCountsAndDispls(&threadLocalStatus.savedSchedulerParams.back()));
             break;
           }
+        } else {
+          mscclMarkSelect(&threadLocalStatus.savedSchedulerParams.back().p, mscclSelectIncompatible, nullptr);
         }
       threadLocalStatus.groupStatus = mscclGroupUnsupportedOp;
+      mscclMarkGroupFallBack(threadLocalStatus.savedSchedulerParams.size() - 1);
       NCCLCHECK(mscclFallBackSavedParams());
+      break;
     case mscclGroupUnsupportedOp:
+      mscclMarkGroupFallBack(threadLocalStatus.savedSchedulerParams.size());
       NCCLCHECK(mscclFallBackSavedParams());
       break;
     default:
@@ -500,18 +1272,221 @@ ncclResult_t mscclEnqueueCheck(
   return ncclSuccess;
 }
 
-ncclResult_t mscclGroupEnd() {
+// Let the external scheduler select the saved operations of a group, those of each communicator in one call.
+// Operations of communicators using the internal scheduler were selected when they were saved.
+static ncclResult_t mscclSchedulerSelectGroup(bool* allScheduled) {
+  mscclStatus& status = mscclGetStatus();
+  auto& params = mscclGetThreadLocalStatus().savedSchedulerParams;
+  std::vector<bool> taken(params.size(), false);
+  std::vector<struct mscclSchedulerParam*> batch;
+  *allScheduled = true;
+  for (size_t i = 0; i < params.size(); i++) {
+    if (taken[i] || !mscclCommScheduler(params[i].comm)) continue;
+    batch.clear();
+    for (size_t j = i; j < params.size(); j++) {
+      if (params[j].comm != params[i].comm) continue;
+      taken[j] = true;
+      batch.push_back(&params[j].p);
+    }
+    NCCLCHECK(status.mscclSchedulerPtr->selectAlgos(mscclGetCommStatus(params[i].comm).schedulerContext, batch.data(), (int)batch.size()));
+    for (auto p : batch) {
+      mscclMarkSelect(p, mscclSelectExternal, nullptr);
+      *allScheduled = *allScheduled && p->scheduled;
+    }
+  }
+  return ncclSuccess;
+}
+
+static const char* mscclSimFuncNames[mscclNumFuncs] = { "Reduce", "Broadcast", "AllReduce", "ReduceScatter", "AllGather",
+  "Send", "Recv", "Gather", "Scatter", "AllToAll", "AllToAllv", "AllGatherV", "ReduceScatterV" };
+
+// Time the saved operations of a simulated group instead of running them. They are only timed
+// when the programs of all of them can be replayed, otherwise NCCL times the group.
+static ncclResult_t mscclSimulateSavedParams(bool* simulated) {
+  mscclStatus& status = mscclGetStatus();
+  auto& params = mscclGetThreadLocalStatus().savedSchedulerParams;
+  std::vector<float> times(params.size()), linkTimes(params.size());
+  std::vector<struct mscclAlgo*> algos(params.size());
+  *simulated = false;
+  for (size_t i = 0; i < params.size(); i++) {
+    auto& param = params[i];
+    std::string name;
+    {
+      std::lock_guard<std::mutex> lock(status.algoMutex);
+      auto h = status.hostAlgos.find(param.p.handle);
+      auto n = status.algoNames.find(param.p.handle);
+      if (h == status.hostAlgos.end() || n == status.algoNames.end()) return ncclSuccess;
+      algos[i] = h->second;
+      name = n->second;
+    }
+    int64_t nBytes = param.p.count * ncclTypeSize(param.p.dataType) * algos[i]->sizeMultiplier;
+    if (mscclSimulateAlgoTime(name.c_str(), param.comm, nBytes, &times[i], &linkTimes[i]) != ncclSuccess) {
+      INFO(NCCL_TUNING, "MSCCL: %s cannot be replayed, the simulated group is timed by NCCL", name.c_str());
+      return ncclSuccess;
+    }
+  }
+  for (size_t i = 0; i < params.size(); i++) {
+    auto& param = params[i];
+    NCCLCHECK(ncclSimTimelineRecord(param.comm, mscclSimFuncNames[param.p.func],
+      param.p.count * ncclTypeSize(param.p.dataType) * algos[i]->sizeMultiplier, "MSCCL", ncclProtoStr[algos[i]->protocol],
+      algos[i]->nChannels, times[i], linkTimes[i]));
+  }
+  params.clear();
+  *simulated = true;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclGroupEnd(bool simulate) {
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
   threadLocalStatus.groupDepth--;
   if (threadLocalStatus.groupDepth == 0) {
     if (threadLocalStatus.groupStatus == mscclGroupSupportedOp) {
-      NCCLCHECK(mscclRunSavedParams());
+      bool allScheduled = true;
+      if (mscclGetStatus().mscclSchedulerPtr) {
+        NCCLCHECK(mscclSchedulerSelectGroup(&allScheduled));
+      }
+      if (allScheduled && simulate) {
+        bool simulated;
+        NCCLCHECK(mscclSimulateSavedParams(&simulated));
+        if (!simulated) NCCLCHECK(mscclFallBackSavedParams());
+      } else if (allScheduled) {
+        NCCLCHECK(mscclRunSavedParams());
+      } else {
+        for (auto& param : threadLocalStatus.savedSchedulerParams) {
+          if (!param.p.scheduled) continue;
+          param.p.scheduled = false;
+          mscclMarkSelect(&param.p, mscclSelectGroupUnsupportedOp, nullptr);
+        }
+        NCCLCHECK(mscclFallBackSavedParams());
+      }
     }
     threadLocalStatus.groupStatus = mscclNoGroup;
   }
   return ncclSuccess;
 }
 
+ncclResult_t mscclWarmupComm(ncclComm_t comm) {
+  if (!mscclAvailable() || !comm->mscclCompatible) {
+    return ncclSuccess;
+  }
+  ncclResult_t ret = ncclSuccess;
+  int savedDevice;
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+  {
+    std::unique_lock<std::mutex> lock(mscclLifecycleMutex);
+    if (!mscclCommScheduler(comm)) {
+      ret = mscclInternalSchedulerPrepareComm(comm, mscclGetCommStatus(comm).catalog, lock);
+    }
+  }
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ret;
+}
+
+ncclResult_t mscclCheckWatchdog(ncclComm_t comm, ncclResult_t* asyncError) {
+  if (comm->mscclCommStatus == nullptr) {
+    return ncclSuccess;
+  }
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  volatile struct mscclWatchdog* watchdog = status.watchdog;
+  if (watchdog == nullptr || watchdog->timedOut == 0) {
+    return ncclSuccess;
+  }
+  __sync_synchronize(); // the record is written before timedOut
+  if (!status.watchdogReported) {
+    status.watchdogReported = true;
+    WARN("MSCCL: rank %d thread block %d step %d waited more than %ld ms for step %d of thread block %d, its flag is %lu instead of %lu",
+      comm->rank, watchdog->bid, watchdog->step, ncclParamMscclWaitTimeoutMs(), watchdog->dependentStep, watchdog->dependentBid,
+      (unsigned long)watchdog->flag, (unsigned long)watchdog->goalFlag);
+  }
+  *asyncError = ncclSystemError;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclPrepareCatalogAlgo(ncclComm_t comm, int metaIndex, mscclAlgoHandle_t* handle) {
+  std::unique_lock<std::mutex> lock(mscclLifecycleMutex);
+  NCCLCHECK(mscclInternalSchedulerPrepareAlgo(metaIndex, comm, 0, lock, handle));
+  return ncclSuccess;
+}
+
+// Read the algorithm directory algoDir again. Files that are new or modified since they were read are
+// added, algorithms whose file is gone or was modified are retired. Caller must hold mscclLifecycleMutex.
+static ncclResult_t mscclInternalSchedulerRescan(const std::string& algoDir) {
+  mscclStatus& status = mscclGetStatus();
+  std::map<std::string, int64_t> files;
+  int nRetired = 0;
+  NCCLCHECK(mscclInternalSchedulerScanDir(algoDir, &files));
+  for (auto& m : status.algoMetas) {
+    if (m.retired || mscclIsSynthPath(m.filePath.c_str()) || m.algoDir != algoDir) continue;
+    auto f = files.find(m.filePath);
+    if (f != files.end() && f->second == m.mtime) {
+      files.erase(f);
+    } else {
+      m.retired = true;
+      nRetired++;
+    }
+  }
+  for (auto& f : files) {
+    NCCLCHECK(mscclInternalSchedulerAddMeta(f.first, f.second, algoDir));
+  }
+  if (nRetired > 0 || files.size() > 0) {
+    INFO(NCCL_INIT, "MSCCL: Reload added %zu and retired %d algorithms", files.size(), nRetired);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclReloadAlgosComm(ncclComm_t comm) {
+  if (!mscclAvailable() || !comm->mscclCompatible) {
+    return ncclSuccess;
+  }
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgoCatalog* catalog = nullptr;
+  int savedDevice;
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(comm->cudaDev));
+  }
+  {
+    std::unique_lock<std::mutex> lock(mscclLifecycleMutex);
+    mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+    if (mscclCommScheduler(comm)) {
+      WARN("MSCCL: algorithms of external scheduler %s cannot be reloaded", mscclCommScheduler(comm)->name);
+      ret = ncclInvalidUsage;
+      goto exit;
+    }
+    // Other communicators of the process may have read the directory already
+    NCCLCHECKGOTO(mscclInternalSchedulerRescan(mscclCommAlgoDir(comm)), ret, exit);
+    // New algorithms may require a topology the init did not gather, all ranks reload together
+    if (commStatus.topo == nullptr && mscclCommNeedsTopo(comm)) {
+      lock.unlock();
+      ret = mscclTopoInit(comm);
+      lock.lock();
+      NCCLCHECKGOTO(ret, ret, exit);
+      if (commStatus.topo->logicalToRank != nullptr) commStatus.topo->rankLayout = mscclRankLayout(comm);
+    }
+    NCCLCHECKGOTO(mscclInternalSchedulerBuildCatalog(comm, &catalog), ret, exit);
+    // The new algorithms are connected before any call can select them, the ranks of the
+    // communicator switch at the same call as they all reload between the same calls
+    if (!ncclParamMscclLazyLoad() || comm->intraRanks > 1) {
+      NCCLCHECKGOTO(mscclInternalSchedulerPrepareComm(comm, catalog, lock), ret, exit);
+    }
+    std::swap(commStatus.catalog, catalog);
+    commStatus.selectMemo.valid = false;
+    NCCLCHECKGOTO(mscclAutotuneTeardown(comm), ret, exit);
+    NCCLCHECKGOTO(mscclSplitTeardown(comm), ret, exit);
+  }
+exit:
+  delete catalog;
+  if (savedDevice != comm->cudaDev) {
+    CUDACHECK(cudaSetDevice(savedDevice));
+  }
+  return ret;
+}
+
 static ncclResult_t mscclInternalSchedulerTeardown() {
   ncclResult_t ret = ncclSuccess, tmpRet = ncclSuccess;
   mscclStatus& status = mscclGetStatus();
@@ -524,45 +1499,82 @@ static ncclResult_t mscclInternalSchedulerTeardown() {
     }
   }
   status.algoMetas.clear();
+  status.loadedAlgoDirs.clear();
   status.rankToAlgoHandles.clear();
+  status.rankLayouts.clear();
+  status.nodeCachedAlgos.clear();
   return ret;
 }
 
-ncclResult_t mscclTeardown() {
-  // Always teardown thread local status
-  mscclThreadLocalStatus threadLocalStatus = mscclGetThreadLocalStatus();
-  threadLocalStatus.savedSchedulerParams.clear();
+ncclResult_t mscclTeardown(ncclComm_t comm) {
+  // Drop the operations of this communicator only, the thread may drive other communicators
+  mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
+  auto& savedParams = threadLocalStatus.savedSchedulerParams;
+  savedParams.erase(std::remove_if(savedParams.begin(), savedParams.end(),
+    [comm](const struct mscclSavedSchedulerParam& p) { return p.comm == comm; }), savedParams.end());
 
   {
     std::lock_guard<std::mutex> lock(mscclLifecycleMutex);
 
-    if (!mscclInitialized.load(std::memory_order_acquire)) {
+    if (comm->mscclCommStatus == nullptr) {
       return ncclSuccess;
     }
     mscclStatus& status = mscclGetStatus();
-    for (auto &p : status.hostAlgos) {
-      free(p.second);
-      status.freeAlgoHandles.push_back(p.first);
-    }
-    for (auto &p : status.devAlgos) {
-      NCCLCHECK(ncclCudaFree(p.second));
-    }
-    NCCLCHECK(ncclCudaFree(status.scratchBuffer));
-    NCCLCHECK(ncclCudaFree(status.syncFlags));
-    status.hostAlgos.clear();
-    status.devAlgos.clear();
-    status.freeAlgoHandles.clear();
-    status.scratchBuffer = nullptr;
-    status.scratchBufferSize = 0;
+
+    // Release the state owned by this communicator
+    mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+    if (mscclCommScheduler(comm)) {
+      NCCLCHECK(status.mscclSchedulerPtr->finalizeComm(commStatus.schedulerContext));
+    }
+    NCCLCHECK(mscclPersistentTeardown(comm));
+    NCCLCHECK(mscclTeardownScratch(comm));
+    NCCLCHECK(mscclTeardownLaunchCache(comm));
+    NCCLCHECK(mscclReplayTeardown(comm));
+    NCCLCHECK(mscclDirectTeardown(comm));
+    NCCLCHECK(mscclAutotuneTeardown(comm));
+    NCCLCHECK(mscclSplitTeardown(comm));
+    NCCLCHECK(mscclTelemetryTeardown(comm));
+    NCCLCHECK(mscclFallbackTeardown(comm));
+    NCCLCHECK(mscclTopoTeardown(comm));
+    delete commStatus.catalog;
+    NCCLCHECK(ncclCudaFree(commStatus.syncFlags));
+    NCCLCHECK(ncclCudaFree(commStatus.syncEpoch));
+    NCCLCHECK(ncclCudaHostFree(commStatus.watchdog));
+    free(comm->mscclCommStatus);
+    comm->mscclCommStatus = nullptr;
+    status.connectedAlgos.erase(comm);
+    if (--status.nComms > 0) {
+      return ncclSuccess;
+    }
+
+    // Last communicator, release algorithms and the scheduler
+    {
+      std::lock_guard<std::mutex> algoLock(status.algoMutex);
+      for (auto &p : status.hostAlgos) {
+        free(p.second);
+        status.freeAlgoHandles.push_back(p.first);
+      }
+      for (auto &p : status.devAlgos) {
+        for (auto &d : p.second) {
+          NCCLCHECK(mscclFreeDevAlgo(d.second));
+        }
+      }
+      NCCLCHECK(mscclTeardownUploads());
+      status.hostAlgos.clear();
+      status.devAlgos.clear();
+      status.freeAlgoHandles.clear();
+    }
     status.connectedAlgos.clear();
+    status.initializedDevices.clear();
+    // Communicators asking for the internal scheduler may have run next to the external one
     if (status.mscclSchedulerPtr) {
       NCCLCHECK(status.mscclSchedulerPtr->teardown());
       status.mscclSchedulerPtr = nullptr;
       dlclose(status.mscclSchedulerLib);
       status.mscclSchedulerLib = nullptr;
-    } else {
-      NCCLCHECK(mscclInternalSchedulerTeardown());
+      status.mscclSchedulerPath.clear();
     }
+    NCCLCHECK(mscclInternalSchedulerTeardown());
     mscclInitialized.store(false, std::memory_order_release);
   }
 
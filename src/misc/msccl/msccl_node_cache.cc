@@ -0,0 +1,236 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <limits.h>
+#include <string.h>
+#include <vector>
+
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+#include "shmutils.h"
+#include "transport.h"
+
+#include "msccl/msccl_binary.h"
+#include "msccl/msccl_node_cache.h"
+#include "msccl/msccl_status.h"
+#include "msccl/msccl_synth.h"
+
+NCCL_PARAM(MscclNodeCache, "MSCCL_NODE_CACHE", 0);
+
+// Shared memory published by local rank 0:
+//   struct mscclNodeCacheHeader
+//   struct mscclNodeCacheMeta metas[nMetas]
+//   compiled images (see msccl_binary.h), each holding the records of the requesting ranks
+struct mscclNodeCacheHeader {
+  uint64_t nMetas;
+};
+
+struct mscclNodeCacheMeta {
+  char filePath[PATH_MAX];
+  int32_t nChunksPerLoop;
+  int32_t nChannels;
+  int32_t nNvlsChannels;
+  int32_t nRanks;
+  int32_t sizeMultiplier;
+  int32_t func;
+  uint8_t inPlace;
+  uint8_t outOfPlace;
+  uint8_t collNet;
+  uint8_t writesInput;
+  int32_t protocolMask;
+  int64_t minBytes;
+  int64_t maxBytes;
+  float latency;
+  float bandwidth;
+  struct mscclAlgoTopo topo;
+  int32_t root;
+  int64_t mtime;
+  // 0 if the algorithm was not compiled for the node
+  uint64_t imageOffset;
+  uint64_t imageSize;
+};
+
+struct mscclNodeCacheInfo {
+  char shmPath[sizeof("/dev/shm/nccl-XXXXXX")];
+  // 0 if local rank 0 could not build the cache
+  size_t size;
+};
+
+// Local ranks sharing a process already share mscclStatus and could not take part in the
+// exchange one after the other while holding mscclLifecycleMutex, so the node cache is only used
+// when every local rank has its own process. All local ranks see the same peerInfo and agree.
+bool mscclNodeCacheEnabled(ncclComm_t comm) {
+  if (!ncclParamMscclNodeCache() || comm->localRanks <= 1) {
+    return false;
+  }
+  for (int i = 0; i < comm->localRanks; i++) {
+    for (int j = 0; j < i; j++) {
+      if (comm->peerInfo[comm->localRankToRank[i]].pidHash == comm->peerInfo[comm->localRankToRank[j]].pidHash) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static ncclResult_t mscclNodeCacheBuild(ncclComm_t comm, const std::vector<int>& ranks, std::vector<char>* cache) {
+  mscclStatus& status = mscclGetStatus();
+  // Synthesized algorithms only exist in the process that built them, the others build their own.
+  // Algorithms of the directories of communicator configs are read by each process.
+  std::vector<size_t> shared;
+  for (size_t i = 0; i < status.algoMetas.size(); i++) {
+    auto &m = status.algoMetas[i];
+    if (!mscclIsSynthPath(m.filePath.c_str()) && m.algoDir.empty()) shared.push_back(i);
+  }
+  size_t nMetas = shared.size();
+  std::vector<struct mscclNodeCacheMeta> metas(nMetas);
+  std::vector<std::vector<char>> images(nMetas);
+  size_t offset = sizeof(struct mscclNodeCacheHeader) + nMetas * sizeof(struct mscclNodeCacheMeta);
+  for (size_t i = 0; i < nMetas; i++) {
+    auto &m = status.algoMetas[shared[i]];
+    struct mscclNodeCacheMeta* c = &metas[i];
+    memset(c, 0, sizeof(struct mscclNodeCacheMeta));
+    if (m.filePath.size() >= sizeof(c->filePath)) {
+      WARN("MSCCL: algorithm path %s is too long for the node cache", m.filePath.c_str());
+      return ncclInvalidUsage;
+    }
+    strcpy(c->filePath, m.filePath.c_str());
+    c->nChunksPerLoop = m.nChunksPerLoop;
+    c->nChannels = m.nChannels;
+    c->nNvlsChannels = m.nNvlsChannels;
+    c->nRanks = m.nRanks;
+    c->sizeMultiplier = m.sizeMultiplier;
+    c->func = m.func;
+    c->inPlace = m.inPlace;
+    c->outOfPlace = m.outOfPlace;
+    c->collNet = m.collNet;
+    c->writesInput = m.writesInput;
+    c->protocolMask = m.protocolMask;
+    c->minBytes = m.minBytes;
+    c->maxBytes = m.maxBytes;
+    c->latency = m.latency;
+    c->bandwidth = m.bandwidth;
+    c->topo = m.topo;
+    c->root = m.root;
+    c->mtime = m.mtime;
+    // Only algorithms usable by this communicator are compiled, precompiled files are cheap to map
+    if (m.nRanks == comm->nRanks && !mscclIsAlgoBinFile(m.filePath.c_str())) {
+      NCCLCHECK(mscclCompileAlgoXml(m.filePath.c_str(), ranks, &images[i]));
+      c->imageOffset = offset;
+      c->imageSize = images[i].size();
+      offset += images[i].size();
+    }
+  }
+  cache->resize(offset);
+  struct mscclNodeCacheHeader header = { nMetas };
+  memcpy(cache->data(), &header, sizeof(header));
+  memcpy(cache->data() + sizeof(header), metas.data(), nMetas * sizeof(struct mscclNodeCacheMeta));
+  for (size_t i = 0; i < nMetas; i++) {
+    if (metas[i].imageSize) memcpy(cache->data() + metas[i].imageOffset, images[i].data(), metas[i].imageSize);
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclNodeCacheLoad(ncclComm_t comm, const char* cache, size_t size) {
+  mscclStatus& status = mscclGetStatus();
+  const struct mscclNodeCacheHeader* header = (const struct mscclNodeCacheHeader*)cache;
+  if (size < sizeof(*header) || size < sizeof(*header) + header->nMetas * sizeof(struct mscclNodeCacheMeta)) {
+    WARN("MSCCL: node cache is truncated");
+    return ncclInternalError;
+  }
+  const struct mscclNodeCacheMeta* metas = (const struct mscclNodeCacheMeta*)(header + 1);
+  for (size_t i = 0; i < header->nMetas; i++) {
+    const struct mscclNodeCacheMeta* c = &metas[i];
+    if (c->imageOffset + c->imageSize > size) {
+      WARN("MSCCL: node cache is truncated");
+      return ncclInternalError;
+    }
+  }
+  // Metas of the directories of communicator configs read before stay in front
+  size_t base = status.algoMetas.size();
+  status.algoMetas.resize(base + header->nMetas);
+  for (size_t i = 0; i < header->nMetas; i++) {
+    const struct mscclNodeCacheMeta* c = &metas[i];
+    auto &m = status.algoMetas[base + i];
+    m.filePath = c->filePath;
+    m.nChunksPerLoop = c->nChunksPerLoop;
+    m.nChannels = c->nChannels;
+    m.nNvlsChannels = c->nNvlsChannels;
+    m.nRanks = c->nRanks;
+    m.sizeMultiplier = c->sizeMultiplier;
+    m.func = (mscclFunc_t)c->func;
+    m.inPlace = c->inPlace;
+    m.outOfPlace = c->outOfPlace;
+    m.collNet = c->collNet;
+    m.writesInput = c->writesInput;
+    m.protocolMask = c->protocolMask;
+    m.minBytes = c->minBytes;
+    m.maxBytes = c->maxBytes;
+    m.latency = c->latency;
+    m.bandwidth = c->bandwidth;
+    m.topo = c->topo;
+    m.root = c->root;
+    m.mtime = c->mtime;
+    m.retired = false;
+    if (c->imageSize) {
+      status.nodeCachedAlgos[std::make_pair(base + i, comm->rank)].assign(cache + c->imageOffset, cache + c->imageOffset + c->imageSize);
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclNodeCacheShare(ncclComm_t comm, bool needMetas, bool* loaded) {
+  ncclResult_t ret = ncclSuccess;
+  mscclStatus& status = mscclGetStatus();
+  *loaded = false;
+
+  std::vector<int> needs(comm->localRanks);
+  needs[comm->localRank] = needMetas ? 1 : 0;
+  NCCLCHECK(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, needs.data(), sizeof(int)));
+  std::vector<int> ranks;
+  for (int r = 1; r < comm->localRanks; r++) {
+    if (needs[r]) ranks.push_back(comm->localRankToRank[r]);
+  }
+  if (ranks.empty()) return ncclSuccess;
+
+  struct mscclNodeCacheInfo info;
+  memset(&info, 0, sizeof(info));
+  ncclShmHandle_t handle = NULL;
+  char* shmPtr = NULL;
+  std::vector<int> barrier(comm->localRanks);
+  if (comm->localRank == 0) {
+    std::vector<char> cache;
+    if (mscclNodeCacheBuild(comm, ranks, &cache) == ncclSuccess &&
+        ncclShmOpen(info.shmPath, cache.size(), (void**)&shmPtr, NULL, ranks.size(), &handle) == ncclSuccess) {
+      memcpy(shmPtr, cache.data(), cache.size());
+      info.size = cache.size();
+      INFO(NCCL_INIT, "MSCCL: Published %zu algorithms (%zu bytes) to %zu local ranks", status.algoMetas.size(), info.size, ranks.size());
+    } else {
+      INFO(NCCL_INIT, "MSCCL: Could not build the node cache, local ranks will load algorithms themselves");
+    }
+  }
+  NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, &info, sizeof(info)), ret, exit);
+  if (comm->localRank != 0 && needMetas && info.size > 0) {
+    if (ncclShmOpen(info.shmPath, info.size, (void**)&shmPtr, NULL, -1, &handle) == ncclSuccess) {
+      size_t nMetas = status.algoMetas.size();
+      if (mscclNodeCacheLoad(comm, shmPtr, info.size) == ncclSuccess) {
+        *loaded = true;
+        INFO(NCCL_INIT, "MSCCL: Loaded %zu algorithms from the node cache", status.algoMetas.size() - nMetas);
+      } else {
+        status.algoMetas.resize(nMetas);
+        status.nodeCachedAlgos.clear();
+      }
+      NCCLCHECKGOTO(ncclShmClose(handle), ret, exit);
+      handle = NULL;
+    }
+  }
+  // Local rank 0 keeps the segment until every rank had a chance to attach
+  NCCLCHECKGOTO(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, barrier.data(), sizeof(int)), ret, exit);
+exit:
+  if (handle) NCCLCHECK(ncclShmClose(handle));
+  return ret;
+}
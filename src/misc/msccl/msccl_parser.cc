@@ -7,6 +7,7 @@
  ************************************************************************/
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -14,16 +15,84 @@
 #include "core.h"
 #include "collectives.h"
 #include "msccl/msccl_parser.h"
+#include "msccl/msccl_synth.h"
+
+// Algorithm files are mapped once and tokenized from memory. Only the pages that are
+// actually parsed get read, so loading the meta of a file touches just its first page.
+// Synthesized algorithms are read from the text kept for them, which is not mapped.
+struct mscclXmlStream {
+  const char* data;
+  size_t size;
+  size_t pos;
+  bool mapped;
+};
+
+static ncclResult_t mscclXmlStreamOpen(const char* xmlFilePath, struct mscclXmlStream* stream) {
+  stream->data = NULL;
+  stream->size = 0;
+  stream->pos = 0;
+  stream->mapped = false;
+  if (mscclIsSynthPath(xmlFilePath)) {
+    return mscclSynthGetText(xmlFilePath, &stream->data, &stream->size);
+  }
+  int fd = open(xmlFilePath, O_RDONLY);
+  if (fd < 0) {
+    WARN("Could not open MSCCL XML algorithm file %s : %s", xmlFilePath, strerror(errno));
+    return ncclSystemError;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    WARN("Could not stat MSCCL XML algorithm file %s : %s", xmlFilePath, strerror(errno));
+    close(fd);
+    return ncclSystemError;
+  }
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      WARN("Could not mmap MSCCL XML algorithm file %s : %s", xmlFilePath, strerror(errno));
+      close(fd);
+      return ncclSystemError;
+    }
+    stream->data = (const char*)data;
+    stream->size = st.st_size;
+    stream->mapped = true;
+  }
+  close(fd);
+  return ncclSuccess;
+}
+
+static void mscclXmlStreamClose(struct mscclXmlStream* stream) {
+  if (stream->mapped) munmap((void*)stream->data, stream->size);
+  stream->data = NULL;
+  stream->size = 0;
+  stream->mapped = false;
+}
+
+static inline bool mscclXmlStreamRead(struct mscclXmlStream* stream, char* c) {
+  if (stream->pos == stream->size) return false;
+  *c = stream->data[stream->pos++];
+  return true;
+}
+
+// Nodes are large and files can hold tens of thousands of them; only reset what the parser
+// reads back, attrs and subs are only accessed up to nAttrs and nSubs.
+static inline void mscclXmlResetNode(struct mscclXmlNode* node) {
+  node->name[0] = '\0';
+  node->nAttrs = 0;
+  node->type = NODE_TYPE_NONE;
+  node->parent = NULL;
+  node->nSubs = 0;
+}
 
-ncclResult_t mscclXmlGetChar(FILE* file, char* c) {
-  if (fread(c, 1, 1, file) == 0) {
+ncclResult_t mscclXmlGetChar(struct mscclXmlStream* file, char* c) {
+  if (!mscclXmlStreamRead(file, c)) {
     WARN("XML Parse : Unexpected EOF");
     return ncclInternalError;
   }
   return ncclSuccess;
 }
 
-ncclResult_t mscclXmlGetValue(FILE* file, char* value, char* last) {
+ncclResult_t mscclXmlGetValue(struct mscclXmlStream* file, char* value, char* last) {
   char c;
   NCCLCHECK(mscclXmlGetChar(file, &c));
   if (c != '"' && c != '\'') {
@@ -44,6 +113,11 @@ ncclResult_t mscclXmlGetValue(FILE* file, char* value, char* last) {
   int o = 0;
   do {
     NCCLCHECK(mscclXmlGetChar(file, &c));
+    if (o == MAX_STR_LEN) {
+      value[o] = '\0';
+      WARN("Error : value %s too long (max %d)", value, MAX_STR_LEN);
+      return ncclInternalError;
+    }
     value[o++] = c;
   } while (c != '"');
   value[o-1] = '\0';
@@ -51,7 +125,7 @@ ncclResult_t mscclXmlGetValue(FILE* file, char* value, char* last) {
   return ncclSuccess;
 }
 
-ncclResult_t mscclXmlGetToken(FILE* file, char* name, char* value, char* last) {
+ncclResult_t mscclXmlGetToken(struct mscclXmlStream* file, char* name, char* value, char* last) {
   char c;
   char* ptr = name;
   int o = 0;
@@ -80,7 +154,7 @@ ncclResult_t mscclXmlGetToken(FILE* file, char* name, char* value, char* last) {
 
 // Shift the 3-chars string by one char and append c at the end
 #define SHIFT_APPEND(s, c) do { s[0]=s[1]; s[1]=s[2]; s[2]=c; } while(0)
-ncclResult_t mscclXmlSkipComment(FILE* file, char* start, char next) {
+ncclResult_t mscclXmlSkipComment(struct mscclXmlStream* file, char* start, char next) {
   // Start from something neutral with \0 at the end.
   char end[4] = "...";
 
@@ -91,8 +165,8 @@ ncclResult_t mscclXmlSkipComment(FILE* file, char* start, char next) {
 
   // Stop when we find "-->"
   while (strcmp(end, "-->") != 0) {
-    int c;
-    if (fread(&c, 1, 1, file) != 1) {
+    char c;
+    if (!mscclXmlStreamRead(file, &c)) {
       WARN("XML Parse error : unterminated comment");
       return ncclInternalError;
     }
@@ -101,11 +175,11 @@ ncclResult_t mscclXmlSkipComment(FILE* file, char* start, char next) {
   return ncclSuccess;
 }
 
-ncclResult_t mscclXmlGetNode(FILE* file, struct mscclXmlNode* node) {
+ncclResult_t mscclXmlGetNode(struct mscclXmlStream* file, struct mscclXmlNode* node) {
   node->type = NODE_TYPE_NONE;
   char c = ' ';
   while (c == ' ' || c == '\n' || c == '\r') {
-    if (fread(&c, 1, 1, file) == 0) return ncclSuccess;
+    if (!mscclXmlStreamRead(file, &c)) return ncclSuccess;
   }
   if (c != '<') {
     WARN("XML Parse error : expecting '<', got '%c'", c);
@@ -156,14 +230,14 @@ ncclResult_t mscclXmlGetNode(FILE* file, struct mscclXmlNode* node) {
   return ncclSuccess;
 }
 
-typedef ncclResult_t (*mscclXmlHandlerFunc_t)(FILE*, struct mscclXml*, struct mscclXmlNode*);
+typedef ncclResult_t (*mscclXmlHandlerFunc_t)(struct mscclXmlStream*, struct mscclXml*, struct mscclXmlNode*);
 
 struct mscclXmlHandler {
   const char * name;
   mscclXmlHandlerFunc_t func;
 };
 
-ncclResult_t mscclXmlLoadSub(FILE* file, struct mscclXml* xml, struct mscclXmlNode* head, struct mscclXmlHandler handlers[], int nHandlers) {
+ncclResult_t mscclXmlLoadSub(struct mscclXmlStream* file, struct mscclXml* xml, struct mscclXmlNode* head, struct mscclXmlHandler handlers[], int nHandlers) {
   if (head && head->type == NODE_TYPE_SINGLE) return ncclSuccess;
   while (1) {
     if (xml->maxIndex == MAX_NODES) {
@@ -171,7 +245,7 @@ ncclResult_t mscclXmlLoadSub(FILE* file, struct mscclXml* xml, struct mscclXmlNo
       return ncclInternalError;
     }
     struct mscclXmlNode* node = xml->nodes+xml->maxIndex;
-    memset(node, 0, sizeof(struct mscclXmlNode));
+    mscclXmlResetNode(node);
     NCCLCHECK(mscclXmlGetNode(file, node));
     if (node->type == NODE_TYPE_NONE) {
       if (head) {
@@ -208,12 +282,12 @@ ncclResult_t mscclXmlLoadSub(FILE* file, struct mscclXml* xml, struct mscclXmlNo
   }
 }
 
-ncclResult_t mscclAlgoXmlStep(FILE* file, struct mscclXml* xml, struct mscclXmlNode* head) {
+ncclResult_t mscclAlgoXmlStep(struct mscclXmlStream* file, struct mscclXml* xml, struct mscclXmlNode* head) {
   NCCLCHECK(mscclXmlLoadSub(file, xml, head, NULL, 1));
   return ncclSuccess;
 }
 
-ncclResult_t mscclAlgoXmlThreadBlock(FILE* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
+ncclResult_t mscclAlgoXmlThreadBlock(struct mscclXmlStream* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
   struct mscclXmlHandler handlers[] = { { "step", mscclAlgoXmlStep } };
   NCCLCHECK(mscclXmlLoadSub(file, xmlGraph, head, handlers, 1));
   return ncclSuccess;
@@ -221,7 +295,7 @@ ncclResult_t mscclAlgoXmlThreadBlock(FILE* file, struct mscclXml* xmlGraph, stru
 
 static int currentRank;
 
-ncclResult_t mscclAlgoXmlGpu(FILE* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
+ncclResult_t mscclAlgoXmlGpu(struct mscclXmlStream* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
   int thisrank;
   NCCLCHECK(mscclXmlGetAttrInt(head, "id", &thisrank));
   if (thisrank == currentRank) {
@@ -233,24 +307,23 @@ ncclResult_t mscclAlgoXmlGpu(FILE* file, struct mscclXml* xmlGraph, struct msccl
   return ncclSuccess;
 }
 
-ncclResult_t mscclAlgoXmlAlgo(FILE* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
+ncclResult_t mscclAlgoXmlAlgo(struct mscclXmlStream* file, struct mscclXml* xmlGraph, struct mscclXmlNode* head) {
   struct mscclXmlHandler handlers[] = { { "gpu", mscclAlgoXmlGpu } };
   NCCLCHECK(mscclXmlLoadSub(file, xmlGraph, head, handlers, 1));
   return ncclSuccess;
 }
 
 ncclResult_t mscclAlgoXmlLoad(const char* xmlFilePath, struct mscclXml* xml, int rank) {
+  ncclResult_t ret = ncclSuccess;
   currentRank = rank;
-  FILE* file = fopen(xmlFilePath, "r");
-  if (file == NULL) {
-    WARN("Could not open MSCCL XML algorithm file %s : %s", xmlFilePath, strerror(errno));
-    return ncclSystemError;
-  }
+  struct mscclXmlStream stream;
+  NCCLCHECK(mscclXmlStreamOpen(xmlFilePath, &stream));
   struct mscclXmlHandler handlers[] = { { "algo", mscclAlgoXmlAlgo } };
   xml->maxIndex = 0;
-  NCCLCHECK(mscclXmlLoadSub(file, xml, NULL, handlers, 1));
-  fclose(file);
-  return ncclSuccess;
+  NCCLCHECKGOTO(mscclXmlLoadSub(&stream, xml, NULL, handlers, 1), ret, exit);
+exit:
+  mscclXmlStreamClose(&stream);
+  return ret;
 }
 
 ncclResult_t mscclGetBufferType(const char* str, uint8_t* output) {
@@ -301,6 +374,50 @@ ncclResult_t mscclProtocolStrToId(const char *protocol, int *protocolId) {
   return ncclSuccess;
 }
 
+// Protocol of the thread blocks of gpu peer on channel channelId, or -1 if it has none there
+static ncclResult_t mscclPeerChannelProtocol(struct mscclXmlNode* topNode, int peer, int channelId, int algoProtocol, int* protocol) {
+  *protocol = -1;
+  for (int s = 0; s < topNode->nSubs; s++) {
+    struct mscclXmlNode* node = topNode->subs[s];
+    int id;
+    if (strcmp(node->name, "gpu") != 0) continue;
+    NCCLCHECK(mscclXmlGetAttrInt(node, "id", &id));
+    if (id != peer) continue;
+    for (int t = 0; t < node->nSubs; t++) {
+      struct mscclXmlNode* threadBlockNode = node->subs[t];
+      int chan;
+      if (strcmp(threadBlockNode->name, "tb") != 0) continue;
+      NCCLCHECK(mscclXmlGetAttrInt(threadBlockNode, "chan", &chan));
+      if (chan != channelId) continue;
+      const char* protocolStr;
+      *protocol = algoProtocol;
+      NCCLCHECK(mscclXmlGetAttr(threadBlockNode, "proto", &protocolStr));
+      if (protocolStr != NULL) NCCLCHECK(mscclProtocolStrToId(protocolStr, protocol));
+      return ncclSuccess;
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclCheckProtocols(struct mscclAlgo* algo, int rank) {
+  if (algo->protocolMask == 0) {
+    algo->protocolMask = 1 << algo->protocol;
+  }
+  if ((algo->protocolMask & (algo->protocolMask - 1)) == 0) {
+    // thread blocks may all override the protocol of the algorithm
+    for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+      if (algo->protocolMask == (1 << p)) algo->protocol = p;
+    }
+    return ncclSuccess;
+  }
+#if !defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+  WARN("MSCCL: thread blocks of rank %d use several protocols, this build has no mixed protocol kernels", rank);
+  return ncclInvalidUsage;
+#else
+  return ncclSuccess;
+#endif
+}
+
 ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, int rank) {
   struct mscclXml* xml;
   NCCLCHECK(ncclCalloc(&xml, 1));
@@ -319,6 +436,18 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
   NCCLCHECK(mscclXmlGetAttrInt(topNode, "nchannels", &nChannels));
   algo->nChannels = nChannels;
 
+  int nNvlsChannels;
+  NCCLCHECK(mscclXmlGetAttrIntDefault(topNode, "nvlschannels", &nNvlsChannels, 0));
+  if (nNvlsChannels < 0 || nNvlsChannels > nChannels) {
+    WARN("MSCCL: nvlschannels (%d) must be between 0 and nchannels (%d)", nNvlsChannels, nChannels);
+    return ncclInvalidUsage;
+  }
+  algo->nNvlsChannels = nNvlsChannels;
+
+  int collNet;
+  NCCLCHECK(mscclXmlGetAttrIntDefault(topNode, "collnet", &collNet, 0));
+  algo->collNet = collNet != 0;
+
   int nGpus;
   NCCLCHECK(mscclXmlGetAttrInt(topNode, "ngpus", &nGpus));
   algo->nRanks = nGpus;
@@ -395,6 +524,9 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
     if (strcmp(node->name, "gpu") == 0) {
       int blockExists[MSCCL_MAX_NUM_THREAD_BLOCKS];
       memset(blockExists, 0, sizeof(int[MSCCL_MAX_NUM_THREAD_BLOCKS]));
+      // connections of a channel are shared by its thread blocks, which must agree on the protocol
+      int channelProtocols[MAXCHANNELS];
+      for (int c = 0; c < MAXCHANNELS; c++) channelProtocols[c] = -1;
       int id, nScratchChunks, nInputChunks, nOutputChunks;
       NCCLCHECK(mscclXmlGetAttrInt(node, "id", &id));
       if (id == rank) {
@@ -409,11 +541,38 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
         for (int t=0; t<node->nSubs; t++) {
           struct mscclXmlNode* threadBlockNode = node->subs[t];
           if (strcmp(threadBlockNode->name, "tb") == 0) {
-            int bid, recvPeer, sendPeer, channelId;
+            int bid, channelId, nvls, collnet;
+            // recv and send are peers separated by commas, or -1 for none
+            int recvPeers[MSCCL_MAX_FAN_PEERS], sendPeers[MSCCL_MAX_FAN_PEERS];
+            int nRecvPeers, nSendPeers;
             NCCLCHECK(mscclXmlGetAttrInt(threadBlockNode, "id", &bid));
-            NCCLCHECK(mscclXmlGetAttrInt(threadBlockNode, "recv", &recvPeer));
-            NCCLCHECK(mscclXmlGetAttrInt(threadBlockNode, "send", &sendPeer));
+            NCCLCHECK(mscclXmlGetAttrIntList(threadBlockNode, "recv", recvPeers, MSCCL_MAX_FAN_PEERS, &nRecvPeers));
+            NCCLCHECK(mscclXmlGetAttrIntList(threadBlockNode, "send", sendPeers, MSCCL_MAX_FAN_PEERS, &nSendPeers));
             NCCLCHECK(mscclXmlGetAttrInt(threadBlockNode, "chan", &channelId));
+            // thread blocks of an NVLS channel send to and receive from NVLS heads, given by their index
+            NCCLCHECK(mscclXmlGetAttrIntDefault(threadBlockNode, "nvls", &nvls, 0));
+            // thread blocks of a CollNet channel have no peers, they reduce with the same channel of all nodes
+            NCCLCHECK(mscclXmlGetAttrIntDefault(threadBlockNode, "collnet", &collnet, 0));
+            int tbProtocol = algo->protocol;
+            const char* tbProtocolStr;
+            NCCLCHECK(mscclXmlGetAttr(threadBlockNode, "proto", &tbProtocolStr));
+            if (tbProtocolStr != NULL) NCCLCHECK(mscclProtocolStrToId(tbProtocolStr, &tbProtocol));
+            // links the peers must be reached over, checked once the connections are set up
+            int hop = MSCCL_HOP_ANY;
+            const char* hopStr;
+            NCCLCHECK(mscclXmlGetAttr(threadBlockNode, "hop", &hopStr));
+            if (hopStr != NULL) {
+              if (strcmp(hopStr, "nvlink") == 0) {
+                hop = MSCCL_HOP_NVLINK;
+              } else if (strcmp(hopStr, "net") == 0) {
+                hop = MSCCL_HOP_NET;
+              } else if (strcmp(hopStr, "any") != 0) {
+                WARN("MSCCL: hop of thread block %d on gpu %d is %s, expected nvlink, net or any", bid, id, hopStr);
+                return ncclInvalidUsage;
+              }
+            }
+            if (nRecvPeers == 1 && recvPeers[0] == -1) nRecvPeers = 0;
+            if (nSendPeers == 1 && sendPeers[0] == -1) nSendPeers = 0;
             if (bid < 0) {
               WARN("MSCCL: bid must be not negative. bid: %d", bid);
               return ncclInvalidUsage;
@@ -428,32 +587,115 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
             }
             blockExists[bid] = 1;
 
-            if (recvPeer == id || sendPeer == id) {
-              WARN("MSCCL: peer (%d,%d) and gpu id (%d) must be different", recvPeer, sendPeer, id);
-              return ncclInvalidUsage;
-            }
             struct mscclThreadBlock* sTB = &algo->mscclTBs[bid];
             sTB->nSteps = 0;
-            if (recvPeer < -1 || sendPeer < -1) {
-              WARN("MSCCL: wrong recvPeer (%d) or sendPeer (%d) in thread block %d on gpu %d", recvPeer, sendPeer, bid, id);
+            if (nvls != 0 && nvls != 1) {
+              WARN("MSCCL: nvls needs to be 0 or 1, but it was %d in thread block %d on gpu %d", nvls, bid, id);
               return ncclInvalidUsage;
             }
-
-            if (recvPeer == id || sendPeer == id) {
-              WARN("MSCCL: recvPeer (%d) or sendPeer (%d) for thread block %d cannot be gpu %d", recvPeer, sendPeer, bid, id);
+            if (nvls && (channelId < 0 || channelId >= algo->nNvlsChannels)) {
+              WARN("MSCCL: NVLS thread block %d on gpu %d uses channel %d, only the first %d channels are NVLS channels",
+                bid, id, channelId, algo->nNvlsChannels);
+              return ncclInvalidUsage;
+            }
+            if (nvls && tbProtocol != NCCL_PROTO_SIMPLE) {
+              WARN("MSCCL: NVLS thread block %d on gpu %d needs the Simple protocol", bid, id);
+              return ncclInvalidUsage;
+            }
+            if (nvls && (nRecvPeers > 1 || nSendPeers > 1)) {
+              WARN("MSCCL: NVLS thread block %d on gpu %d has more than one peer in a direction", bid, id);
+              return ncclInvalidUsage;
+            }
+            if (collnet != 0 && collnet != 1) {
+              WARN("MSCCL: collnet needs to be 0 or 1, but it was %d in thread block %d on gpu %d", collnet, bid, id);
+              return ncclInvalidUsage;
+            }
+            if (collnet && (!algo->collNet || nvls)) {
+              WARN("MSCCL: CollNet thread block %d on gpu %d needs collnet=\"1\" on the algorithm and no nvls", bid, id);
+              return ncclInvalidUsage;
+            }
+            if (collnet && (tbProtocol != NCCL_PROTO_SIMPLE || nRecvPeers > 0 || nSendPeers > 0)) {
+              WARN("MSCCL: CollNet thread block %d on gpu %d needs the Simple protocol and no peers", bid, id);
               return ncclInvalidUsage;
             }
+            if (hop != MSCCL_HOP_ANY && (nvls || collnet)) {
+              WARN("MSCCL: thread block %d on gpu %d has a hop, NVLS and CollNet thread blocks have no peer connections", bid, id);
+              return ncclInvalidUsage;
+            }
+            for (int p = 0; p < nRecvPeers; p++) {
+              if (recvPeers[p] < 0 || (recvPeers[p] == id && !nvls)) {
+                WARN("MSCCL: wrong recvPeer (%d) in thread block %d on gpu %d", recvPeers[p], bid, id);
+                return ncclInvalidUsage;
+              }
+            }
+            for (int p = 0; p < nSendPeers; p++) {
+              if (sendPeers[p] < 0 || (sendPeers[p] == id && !nvls)) {
+                WARN("MSCCL: wrong sendPeer (%d) in thread block %d on gpu %d", sendPeers[p], bid, id);
+                return ncclInvalidUsage;
+              }
+            }
 
-            sTB->recvPeer = recvPeer;
-            sTB->sendPeer = sendPeer;
-            if (channelId < 0 || channelId > MAXCHANNELS) {
+            for (int p = 0; p < MSCCL_MAX_FAN_PEERS; p++) {
+              sTB->recvPeers[p] = p < nRecvPeers ? recvPeers[p] : -1;
+              sTB->sendPeers[p] = p < nSendPeers ? sendPeers[p] : -1;
+            }
+            sTB->nRecvPeers = nRecvPeers;
+            sTB->nSendPeers = nSendPeers;
+            sTB->nvls = nvls ? MSCCL_NVLS_UNICAST : MSCCL_NVLS_NONE;
+            sTB->collnet = collnet;
+            if (channelId < 0 || channelId >= MAXCHANNELS) {
               WARN("MSCCL: threadblock %d on GPU %d has an invalid channel %d", bid, id, channelId);
               return ncclInvalidUsage;
             }
             sTB->channelId = channelId;
+            if (channelProtocols[channelId] != -1 && channelProtocols[channelId] != tbProtocol) {
+              WARN("MSCCL: thread block %d on GPU %d uses another protocol than the other thread blocks of channel %d",
+                bid, id, channelId);
+              return ncclInvalidUsage;
+            }
+            channelProtocols[channelId] = tbProtocol;
+            // both ends of a connection must lay out its buffers for the same protocol
+            if (!nvls && !collnet) {
+              for (int p = 0; p < nRecvPeers + nSendPeers; p++) {
+                int peer = p < nRecvPeers ? recvPeers[p] : sendPeers[p - nRecvPeers];
+                int peerProtocol;
+                NCCLCHECK(mscclPeerChannelProtocol(topNode, peer, channelId, algo->protocol, &peerProtocol));
+                if (peerProtocol != -1 && peerProtocol != tbProtocol) {
+                  WARN("MSCCL: thread block %d on GPU %d uses another protocol than GPU %d on channel %d",
+                    bid, id, peer, channelId);
+                  return ncclInvalidUsage;
+                }
+              }
+            }
+            sTB->protocol = tbProtocol;
+            algo->protocolMask |= 1 << tbProtocol;
 
             // setting the summary of the msccl algorithm in msccl channels
             mscclChannelInfo* mscclChannel = &algo->mscclChannels[sTB->channelId];
+            mscclChannel->protocol = tbProtocol;
+            // the CollNet connections of a channel carry the steps of a single thread block
+            if (collnet && mscclChannel->collnet) {
+              WARN("MSCCL: CollNet thread block %d on gpu %d shares channel %d with another one", bid, id, channelId);
+              return ncclInvalidUsage;
+            }
+            if (collnet) mscclChannel->collnet = 1;
+            if (mscclChannel->nSendPeers + nSendPeers > MSCCL_MAX_CHANNEL_PEERS) {
+              WARN("MSCCL: too many sends per channel. Max allowed %d", MSCCL_MAX_CHANNEL_PEERS);
+              return ncclInvalidUsage;
+            }
+            if (mscclChannel->nRecvPeers + nRecvPeers > MSCCL_MAX_CHANNEL_PEERS) {
+              WARN("MSCCL: too many recvs per channel. Max allowed %d", MSCCL_MAX_CHANNEL_PEERS);
+              return ncclInvalidUsage;
+            }
+            // peers of NVLS and CollNet thread blocks stay out of mscclChannel
+            if (!nvls && !collnet) {
+              if (algo->nPeerInfos + nSendPeers + nRecvPeers > MSCCL_MAX_PEER_INFOS) {
+                WARN("MSCCL: too many sends and recvs. Max allowed %d", MSCCL_MAX_PEER_INFOS);
+                return ncclInvalidUsage;
+              }
+              for (int p = 0; p < nSendPeers; p++) mscclChannel->sendPeerInfos[mscclChannel->nSendPeers + p] = algo->nPeerInfos++;
+              for (int p = 0; p < nRecvPeers; p++) mscclChannel->recvPeerInfos[mscclChannel->nRecvPeers + p] = algo->nPeerInfos++;
+            }
 
             int numDependencies = 0;
             int oldDependencePointer = 0; // Indicator of where the dependencies started for nop
@@ -464,6 +706,7 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
             int numReductions = 0;
 
             int numTransfers = 0;
+            int numMultimem = 0;
             for (int st=0; st<threadBlockNode->nSubs; st++) {
               struct mscclXmlNode* stepNode = threadBlockNode->subs[st];
               if (strcmp(stepNode->name, "step") == 0) {
@@ -493,6 +736,8 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
 
                 int hasSend = 0;
                 int hasRecv = 0;
+                int fanIn = 0; // receives from all the recv peers
+                int fanOut = 0; // sends to all the send peers
                 int checkSrc = 0;
                 int checkDst = 0;
                 int transferType = -1; // -1 indicate a nop
@@ -535,6 +780,38 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
                   checkSrc = 1;
                   checkDst = 1;
                   algo->hasReduce = true;
+                } else if (strcmp(type, "rrcn") == 0) {
+#if !defined(MSCCL_FAN_KERNELS)
+                  WARN("MSCCL: type of transfer %s needs the fan kernels, this build has none", type);
+                  return ncclInvalidUsage;
+#endif
+                  transferType = MSCCL_RECV_REDUCE_COPY_N;
+                  hasRecv = 1;
+                  fanIn = 1;
+                  checkSrc = 1;
+                  checkDst = 1;
+                  algo->hasReduce = true;
+                } else if (strcmp(type, "sn") == 0) {
+#if !defined(MSCCL_FAN_KERNELS)
+                  WARN("MSCCL: type of transfer %s needs the fan kernels, this build has none", type);
+                  return ncclInvalidUsage;
+#endif
+                  transferType = MSCCL_SEND_N;
+                  hasSend = 1;
+                  fanOut = 1;
+                  checkSrc = 1;
+                } else if (strcmp(type, "mld") == 0) {
+                  transferType = MSCCL_MULTIMEM_LD_REDUCE;
+                  checkDst = 1;
+                  algo->hasReduce = true;
+                } else if (strcmp(type, "mst") == 0) {
+                  transferType = MSCCL_MULTIMEM_ST;
+                  checkSrc = 1;
+                } else if (strcmp(type, "car") == 0) {
+                  transferType = MSCCL_COLLNET_ALLREDUCE;
+                  checkSrc = 1;
+                  checkDst = 1;
+                  algo->hasReduce = true;
                 } else if (strcmp(type, "nop") == 0) {
                   transferType = -1;
                 } else {
@@ -542,6 +819,11 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
                   return ncclInternalError;
                 }
 
+                if (dependBid >= MSCCL_MAX_NUM_THREAD_BLOCKS) {
+                  WARN("MSCCL: step %d of thread block %d on GPU %d depends on thread block %d. Max thread blocks: %d", s, bid, id,
+                    dependBid, MSCCL_MAX_NUM_THREAD_BLOCKS);
+                  return ncclInvalidUsage;
+                }
                 if (dependBid >= 0) {
                   sTB->dependentBid[numDependencies] = dependBid;
                   sTB->dependentStep[numDependencies] = dependStep;
@@ -581,30 +863,49 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
 
                   mscclTran->count = count;
 
+                  // multimem types use the NVLS head of this rank, other types of an NVLS thread block the heads in its peers
+                  if (transferType == MSCCL_MULTIMEM_LD_REDUCE || transferType == MSCCL_MULTIMEM_ST) {
+                    if (!nvls || nRecvPeers > 0 || nSendPeers > 0) {
+                      WARN("MSCCL: %s in thread block %d on GPU %d needs an NVLS thread block without peers", type, bid, id);
+                      return ncclInvalidUsage;
+                    }
+                    numMultimem++;
+                  } else if (nvls && transferType != MSCCL_SEND && transferType != MSCCL_RECV) {
+                    WARN("MSCCL: %s is not supported in NVLS thread block %d on GPU %d, only s, r, mld and mst are", type, bid, id);
+                    return ncclInvalidUsage;
+                  }
+                  if ((transferType == MSCCL_COLLNET_ALLREDUCE) != (collnet != 0)) {
+                    WARN("MSCCL: %s in thread block %d on GPU %d, car is the only type of CollNet thread blocks", type, bid, id);
+                    return ncclInvalidUsage;
+                  }
+                  if (collnet) mscclChannel->collnetPeerInfo.nTransmissionsOfCount[count]++;
+
+                  // Primitives of a thread block move data with all of its peers of a direction
                   if (hasSend) {
-                    if (sendPeer < 0) {
+                    if (nSendPeers == 0) {
                       WARN("MSCCL: there is a send in thread block %d on GPU %d without a sendPeer.", bid, id);
                       return ncclInvalidUsage;
                     }
-                    if (mscclChannel->nSendPeers >= MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL) {
-                      WARN("MSCCL: too many sends per channel. Max allowed %d", MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL);
+                    if (nSendPeers > 1 && !fanOut) {
+                      WARN("MSCCL: thread block %d on GPU %d has %d send peers, only sn can send to them", bid, id, nSendPeers);
                       return ncclInvalidUsage;
                     }
-
-                    struct mscclChannelPeerInfo* sendPeerInfo = &mscclChannel->sendPeerInfo[mscclChannel->nSendPeers];
-                    sendPeerInfo->nTransmissionsOfCount[count]++;
+                    for (int p = 0; p < nSendPeers && !nvls && !collnet; p++) {
+                      mscclChannelSendPeer(algo, mscclChannel, mscclChannel->nSendPeers + p)->nTransmissionsOfCount[count]++;
+                    }
                   }
                   if (hasRecv) {
-                    if (recvPeer < 0) {
+                    if (nRecvPeers == 0) {
                       WARN("MSCCL: there is a recv in thread block %d on GPU %d without a recvPeer.", bid, id);
                       return ncclInvalidUsage;
                     }
-                    if (mscclChannel->nRecvPeers >= MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL) {
-                      WARN("MSCCL: too many recvs per channel. Max allowed %d", MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL);
+                    if (nRecvPeers > 1 && !fanIn) {
+                      WARN("MSCCL: thread block %d on GPU %d has %d recv peers, only rrcn can receive from them", bid, id, nRecvPeers);
                       return ncclInvalidUsage;
                     }
-                    struct mscclChannelPeerInfo* recvPeerInfo = &mscclChannel->recvPeerInfo[mscclChannel->nRecvPeers];
-                    recvPeerInfo->nTransmissionsOfCount[count]++;
+                    for (int p = 0; p < nRecvPeers && !nvls && !collnet; p++) {
+                      mscclChannelRecvPeer(algo, mscclChannel, mscclChannel->nRecvPeers + p)->nTransmissionsOfCount[count]++;
+                    }
                   }
 
                   if (checkSrc) NCCLCHECK(mscclCheckBufferBounds(mscclTran->srcBuffer, mscclTran->srcOffset, nInputChunks, nOutputChunks, nScratchChunks));
@@ -656,29 +957,47 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
               }
             }
 
-            // finish up mscclChannel calculation
-
-            for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
-              struct mscclChannelPeerInfo* sendPeer = &mscclChannel->sendPeerInfo[mscclChannel->nSendPeers];
-              if (sendPeer->nTransmissionsOfCount[c] > 0) {
-                sendPeer->existingCounts[sendPeer->nExistingCounts] = c;
-                sendPeer->nExistingCounts++;
-              }
-              struct mscclChannelPeerInfo* recvPeer = &mscclChannel->recvPeerInfo[mscclChannel->nRecvPeers];
-              if (recvPeer->nTransmissionsOfCount[c] > 0) {
-                recvPeer->existingCounts[recvPeer->nExistingCounts] = c;
-                recvPeer->nExistingCounts++;
+            if (numMultimem > 0) sTB->nvls = MSCCL_NVLS_MULTIMEM;
+            // NVLS connections are set up by NCCL and have no proxy, they stay out of mscclChannel
+            if (nvls) continue;
+            if (collnet) {
+              struct mscclChannelPeerInfo* collnetPeer = &mscclChannel->collnetPeerInfo;
+              for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
+                if (collnetPeer->nTransmissionsOfCount[c] > 0) {
+                  collnetPeer->existingCounts[collnetPeer->nExistingCounts] = c;
+                  collnetPeer->nExistingCounts++;
+                }
               }
+              collnetPeer->peer = -1;
+              continue;
             }
 
-            if (sTB->sendPeer >= 0) {
-              mscclChannel->sendPeerInfo[mscclChannel->nSendPeers].peer = sTB->sendPeer;
-              mscclChannel->nSendPeers++;
+            // finish up mscclChannel calculation
+
+            for (int p = 0; p < nSendPeers; p++) {
+              struct mscclChannelPeerInfo* sendPeer = mscclChannelSendPeer(algo, mscclChannel, mscclChannel->nSendPeers + p);
+              for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
+                if (sendPeer->nTransmissionsOfCount[c] > 0) {
+                  sendPeer->existingCounts[sendPeer->nExistingCounts] = c;
+                  sendPeer->nExistingCounts++;
+                }
+              }
+              sendPeer->peer = sendPeers[p];
+              sendPeer->hop = hop;
             }
-            if (sTB->recvPeer >= 0) {
-              mscclChannel->recvPeerInfo[mscclChannel->nRecvPeers].peer = sTB->recvPeer;
-              mscclChannel->nRecvPeers++;
+            for (int p = 0; p < nRecvPeers; p++) {
+              struct mscclChannelPeerInfo* recvPeer = mscclChannelRecvPeer(algo, mscclChannel, mscclChannel->nRecvPeers + p);
+              for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
+                if (recvPeer->nTransmissionsOfCount[c] > 0) {
+                  recvPeer->existingCounts[recvPeer->nExistingCounts] = c;
+                  recvPeer->nExistingCounts++;
+                }
+              }
+              recvPeer->peer = recvPeers[p];
+              recvPeer->hop = hop;
             }
+            mscclChannel->nSendPeers += nSendPeers;
+            mscclChannel->nRecvPeers += nRecvPeers;
           }
         }
         // make sure that thread blocks are in order. Something like 0, 2, 3 is not allowed.
@@ -699,23 +1018,55 @@ ncclResult_t mscclGetAlgoFromXmlFile(const char* str, struct mscclAlgo* algo, in
     }
   }
   free(xml);
+  NCCLCHECK(mscclCheckProtocols(algo, rank));
+  // the mixed protocol kernels have no CollNet primitives
+  if (algo->collNet && algo->protocolMask != (1 << NCCL_PROTO_SIMPLE)) {
+    WARN("MSCCL: CollNet algorithms need the Simple protocol on all thread blocks of rank %d", rank);
+    return ncclInvalidUsage;
+  }
   return ncclSuccess;
 }
 
-ncclResult_t mscclXmlLoadSingleNode(FILE* file, struct mscclXmlNode* node) {
-  memset(node, 0, sizeof(struct mscclXmlNode));
+ncclResult_t mscclXmlLoadSingleNode(struct mscclXmlStream* file, struct mscclXmlNode* node) {
+  mscclXmlResetNode(node);
   return mscclXmlGetNode(file, node);
 }
 
 ncclResult_t mscclAlgoMetaXmlLoad(const char* xmlFilePath, struct mscclXmlNode* node) {
-  FILE* file = fopen(xmlFilePath, "r");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open MSCCL XML algorithm file %s : %s", xmlFilePath, strerror(errno));
-    return ncclSystemError;
+  ncclResult_t ret = ncclSuccess;
+  struct mscclXmlStream stream;
+  NCCLCHECK(mscclXmlStreamOpen(xmlFilePath, &stream));
+  NCCLCHECKGOTO(mscclXmlLoadSingleNode(&stream, node), ret, exit);
+exit:
+  mscclXmlStreamClose(&stream);
+  return ret;
+}
+
+// Whether a step of any gpu writes the input buffer. Pre-ops scale what steps read from it,
+// a chunk it holds may then be a partial sum already scaled. Walks the whole file.
+static ncclResult_t mscclXmlWritesInput(const char* xmlFilePath, struct mscclXmlNode* node, bool* writesInput) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclXmlStream stream;
+  *writesInput = false;
+  NCCLCHECK(mscclXmlStreamOpen(xmlFilePath, &stream));
+  while (true) {
+    NCCLCHECKGOTO(mscclXmlLoadSingleNode(&stream, node), ret, exit);
+    if (node->type == NODE_TYPE_NONE) break;
+    if (node->type == NODE_TYPE_CLOSE || strcmp(node->name, "step") != 0) continue;
+    const char* type;
+    const char* dstBuffer;
+    NCCLCHECKGOTO(mscclXmlGetAttr(node, "type", &type), ret, exit);
+    NCCLCHECKGOTO(mscclXmlGetAttr(node, "dstbuf", &dstBuffer), ret, exit);
+    // Sends name the buffer of the peer, which writes it with a step of its own
+    if (type && dstBuffer && strcmp(dstBuffer, "i") == 0 && strcmp(type, "s") != 0 && strcmp(type, "sn") != 0 &&
+        strcmp(type, "nop") != 0) {
+      *writesInput = true;
+      break;
+    }
   }
-  NCCLCHECK(mscclXmlLoadSingleNode(file, node));
-  fclose(file);
-  return ncclSuccess;
+exit:
+  mscclXmlStreamClose(&stream);
+  return ret;
 }
 
 ncclResult_t mscclGetAlgoMetaFromXmlFile(const char* str, struct mscclAlgoMeta* algoMeta) {
@@ -733,6 +1084,16 @@ ncclResult_t mscclGetAlgoMetaFromXmlFile(const char* str, struct mscclAlgoMeta*
   NCCLCHECK(mscclXmlGetAttrInt(node, "nchannels", &nChannels));
   algoMeta->nChannels = nChannels;
 
+  int nNvlsChannels;
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "nvlschannels", &nNvlsChannels, 0));
+  algoMeta->nNvlsChannels = nNvlsChannels;
+
+  int collNet;
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "collnet", &collNet, 0));
+  algoMeta->collNet = collNet != 0;
+  // Protocols are only known once the thread blocks of a rank are read
+  algoMeta->protocolMask = (1 << NCCL_NUM_PROTOCOLS) - 1;
+
   int nGpus;
   NCCLCHECK(mscclXmlGetAttrInt(node, "ngpus", &nGpus));
   algoMeta->nRanks = nGpus;
@@ -785,6 +1146,57 @@ ncclResult_t mscclGetAlgoMetaFromXmlFile(const char* str, struct mscclAlgoMeta*
   NCCLCHECK(mscclXmlGetAttrInt(node, "outofplace", &outofplace));
   algoMeta->outOfPlace = (bool)outofplace;
 
+  // Optional performance model, in us and GB/s like NCCL's tuning tables
+  const char* latency;
+  const char* bandwidth;
+  NCCLCHECK(mscclXmlGetAttr(node, "latency", &latency));
+  NCCLCHECK(mscclXmlGetAttr(node, "bandwidth", &bandwidth));
+  algoMeta->latency = latency ? strtof(latency, NULL) : 0.0f;
+  algoMeta->bandwidth = bandwidth ? strtof(bandwidth, NULL) : 0.0f;
+  if (algoMeta->latency < 0.0f || algoMeta->bandwidth < 0.0f) {
+    WARN("MSCCL: invalid performance model latency %s bandwidth %s in %s", latency, bandwidth, str);
+    free(node);
+    return ncclInvalidUsage;
+  }
+
+  // Optional topology constraints, checked against the communicator by the scheduler
+  struct mscclAlgoTopo* topo = &algoMeta->topo;
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "localranks", &topo->nLocalRanks, 0));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "nics", &topo->nNics, 0));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "nvlink", &topo->nvlink, -1));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "nvswitch", &topo->nvswitch, -1));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "rails", &topo->rails, 0));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "domainranks", &topo->nDomainRanks, 0));
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "mnnvl", &topo->mnnvl, -1));
+  if (topo->nLocalRanks < 0 || (topo->nLocalRanks > 0 && nGpus % topo->nLocalRanks != 0)) {
+    WARN("MSCCL: localranks %d does not divide the %d gpus of %s", topo->nLocalRanks, nGpus, str);
+    free(node);
+    return ncclInvalidUsage;
+  }
+  if (topo->nDomainRanks < 0 || (topo->nDomainRanks > 0 && nGpus % topo->nDomainRanks != 0)) {
+    WARN("MSCCL: domainranks %d does not divide the %d gpus of %s", topo->nDomainRanks, nGpus, str);
+    free(node);
+    return ncclInvalidUsage;
+  }
+
+  // Root the program was written for, only reduce and broadcast have one
+  NCCLCHECK(mscclXmlGetAttrIntDefault(node, "root", &algoMeta->root, 0));
+  if (algoMeta->root < 0 || algoMeta->root >= nGpus) {
+    WARN("MSCCL: root %d is not a rank of the %d gpus of %s", algoMeta->root, nGpus, str);
+    free(node);
+    return ncclInvalidUsage;
+  }
+
+  // Only reductions have pre-ops, the other files are left to load lazily
+  algoMeta->writesInput = false;
+  if (algoMeta->func == mscclFuncAllReduce || algoMeta->func == mscclFuncReduceScatter || algoMeta->func == mscclFuncReduce) {
+    ncclResult_t ret = mscclXmlWritesInput(str, node, &algoMeta->writesInput);
+    if (ret != ncclSuccess) {
+      free(node);
+      return ret;
+    }
+  }
+
   free(node);
   return ncclSuccess;
 }
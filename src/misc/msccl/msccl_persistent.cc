@@ -0,0 +1,170 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+#include <set>
+
+#include "alloc.h"
+#include "checks.h"
+#include "comm.h"
+#include "cudawrap.h"
+#include "param.h"
+
+#include "msccl/msccl_persistent.h"
+#include "msccl/msccl_setup.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclPersistent, "MSCCL_PERSISTENT", 0);
+
+// Communicators with a resident kernel state, they are stopped per device from any thread
+static std::mutex mscclPersistentMutex;
+static std::set<ncclComm_t> mscclPersistentComms;
+// Resident kernels running on any device, so that launches only take the mutex when there is one
+static std::atomic<int> mscclPersistentRunning(0);
+
+bool mscclPersistentEnabled() {
+#if CUDA_VERSION >= 11070
+  return ncclParamMscclPersistent() != 0;
+#else
+  return false;
+#endif
+}
+
+#if CUDA_VERSION >= 11070
+static ncclResult_t mscclPersistentInit(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclPersistentStatus* persistent = new mscclPersistentStatus();
+  NCCLCHECK(ncclCudaHostCalloc(&persistent->queue, 1));
+  NCCLCHECK(ncclCudaCalloc(&persistent->ctrl, 1));
+  CUDACHECK(cudaStreamCreateWithFlags(&persistent->stream, cudaStreamNonBlocking));
+  commStatus.persistent = persistent;
+  mscclPersistentComms.insert(comm);
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclPersistentStart(void* func, dim3 grid, dim3 block, ncclComm_t comm) {
+  struct mscclPersistentStatus* persistent = mscclGetCommStatus(comm).persistent;
+  struct mscclWork work = {};
+  work.persistentQueue = persistent->queue;
+  work.persistentCtrl = persistent->ctrl;
+  __atomic_store_n(&persistent->queue->stop, 0, __ATOMIC_RELAXED);
+  NCCLCHECK(mscclLaunchKernelGrid(func, grid, block, &work, comm, persistent->stream));
+  persistent->func = func;
+  persistent->grid = grid;
+  persistent->block = block;
+  persistent->running = true;
+  mscclPersistentRunning.fetch_add(1, std::memory_order_release);
+  INFO(NCCL_INIT, "MSCCL: Started resident kernel with %d thread blocks", grid.x);
+  return ncclSuccess;
+}
+#endif
+
+ncclResult_t mscclPersistentPost(void* func, dim3 grid, dim3 block, struct mscclWork* work,
+    ncclComm_t comm, cudaStream_t stream, bool* posted) {
+  *posted = false;
+#if CUDA_VERSION >= 11070
+  // Works are written to the queue at enqueue time, graph replays would not write them again
+  if (mscclGetThreadLocalStatus().captureStatus != mscclNoCapture) {
+    return ncclSuccess;
+  }
+  if (CUPFN(cuStreamWriteValue32) == nullptr || CUPFN(cuStreamWaitValue32) == nullptr) {
+    static bool warned = false;
+    if (!warned) {
+      INFO(NCCL_INIT, "MSCCL: Stream memory operations are not available, persistent mode is disabled");
+      warned = true;
+    }
+    return ncclSuccess;
+  }
+
+  std::lock_guard<std::mutex> lock(mscclPersistentMutex);
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  if (commStatus.persistent == nullptr) {
+    NCCLCHECK(mscclPersistentInit(comm));
+  }
+  struct mscclPersistentStatus* persistent = commStatus.persistent;
+  if (!persistent->running) {
+    NCCLCHECK(mscclPersistentStart(func, grid, block, comm));
+  } else if (func != persistent->func || grid.x > persistent->grid.x) {
+    return ncclSuccess;
+  }
+  // A regular launch is ordered after the queued works by the stream, no need to wait for a slot
+  struct mscclPersistentQueue* queue = persistent->queue;
+  if (persistent->seq - __atomic_load_n(&queue->done, __ATOMIC_ACQUIRE) >= MSCCL_PERSISTENT_QUEUE_DEPTH) {
+    return ncclSuccess;
+  }
+
+  uint32_t seq = persistent->seq + 1;
+  queue->works[seq % MSCCL_PERSISTENT_QUEUE_DEPTH] = *work;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  CUdeviceptr postedPtr = (CUdeviceptr)&persistent->ctrl->posted;
+  CUdeviceptr donePtr = (CUdeviceptr)&persistent->ctrl->done;
+  // The kernel runs works in sequence order, a work posted from another stream must not overtake
+  if (persistent->lastStream != stream) {
+    CUCHECK(cuStreamWaitValue32((CUstream)stream, donePtr, persistent->seq, CU_STREAM_WAIT_VALUE_GEQ));
+  }
+  CUCHECK(cuStreamWriteValue32((CUstream)stream, postedPtr, seq, CU_STREAM_WRITE_VALUE_DEFAULT));
+  CUCHECK(cuStreamWaitValue32((CUstream)stream, donePtr, seq, CU_STREAM_WAIT_VALUE_GEQ));
+  persistent->seq = seq;
+  persistent->lastStream = stream;
+  *posted = true;
+  TRACE(NCCL_COLL, "MSCCL: Posted work %u to the resident kernel", seq);
+#endif
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclPersistentStopComm(ncclComm_t comm) {
+  struct mscclPersistentStatus* persistent = mscclGetCommStatus(comm).persistent;
+  if (persistent == nullptr || !persistent->running) {
+    return ncclSuccess;
+  }
+  // Streams wait for the works already queued, they have to run first
+  while (__atomic_load_n(&persistent->queue->done, __ATOMIC_ACQUIRE) != persistent->seq &&
+      __atomic_load_n(comm->abortFlag, __ATOMIC_ACQUIRE) == 0) {
+    sched_yield();
+  }
+  __atomic_store_n(&persistent->queue->stop, 1, __ATOMIC_RELEASE);
+  CUDACHECK(cudaStreamSynchronize(persistent->stream));
+  persistent->running = false;
+  mscclPersistentRunning.fetch_sub(1, std::memory_order_release);
+  INFO(NCCL_INIT, "MSCCL: Stopped resident kernel after %u works", persistent->seq);
+  return ncclSuccess;
+}
+
+ncclResult_t mscclPersistentStopDevice(int cudaDev) {
+  std::lock_guard<std::mutex> lock(mscclPersistentMutex);
+  for (ncclComm_t comm : mscclPersistentComms) {
+    if (comm->cudaDev == cudaDev) {
+      NCCLCHECK(mscclPersistentStopComm(comm));
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclPersistentExclude(int cudaDev) {
+  if (mscclPersistentRunning.load(std::memory_order_acquire) == 0) {
+    return ncclSuccess;
+  }
+  return mscclPersistentStopDevice(cudaDev);
+}
+
+ncclResult_t mscclPersistentTeardown(ncclComm_t comm) {
+  // The state of comm is about to be freed and cudaFree waits for every resident kernel
+  NCCLCHECK(mscclPersistentStopDevice(comm->cudaDev));
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclPersistentStatus* persistent = commStatus.persistent;
+  if (persistent == nullptr) {
+    return ncclSuccess;
+  }
+  std::lock_guard<std::mutex> lock(mscclPersistentMutex);
+  mscclPersistentComms.erase(comm);
+  CUDACHECK(cudaStreamDestroy(persistent->stream));
+  NCCLCHECK(ncclCudaHostFree(persistent->queue));
+  NCCLCHECK(ncclCudaFree(persistent->ctrl));
+  delete persistent;
+  commStatus.persistent = nullptr;
+  return ncclSuccess;
+}
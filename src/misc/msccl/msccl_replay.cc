@@ -0,0 +1,105 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "checks.h"
+#include "comm.h"
+#include "device.h"
+#include "param.h"
+
+#include "msccl/msccl_replay.h"
+#include "msccl/msccl_setup.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclLaunchGraphs, "MSCCL_LAUNCH_GRAPHS", 0);
+
+// Capture a launch of the shape into a graph of its own. The attributes of the launch, such as
+// the cluster dimension, stay on the kernel node, only its parameters change from call to call.
+static ncclResult_t mscclReplayCapture(void* func, dim3 grid, dim3 block, struct mscclWork* work, ncclComm_t comm,
+    struct mscclReplayStatus* replay, struct mscclReplayGraph* g) {
+  ncclResult_t ret = ncclSuccess;
+  cudaGraph_t graph = nullptr;
+  size_t nNodes = 1;
+  CUDACHECK(cudaStreamBeginCapture(replay->captureStream, cudaStreamCaptureModeRelaxed));
+  ret = mscclLaunchKernelGrid(func, grid, block, work, comm, replay->captureStream);
+  cudaError_t err = cudaStreamEndCapture(replay->captureStream, &graph);
+  NCCLCHECKGOTO(ret, ret, fail);
+  CUDACHECKGOTO(err, ret, fail);
+  CUDACHECKGOTO(cudaGraphGetNodes(graph, &g->node, &nNodes), ret, fail);
+  if (nNodes != 1) {
+    WARN("MSCCL: captured launch has %zu nodes instead of a kernel node", nNodes);
+    ret = ncclInternalError;
+    goto fail;
+  }
+  CUDACHECKGOTO(cudaGraphInstantiateWithFlags(&g->exec, graph, 0), ret, fail);
+  g->graph = graph;
+  return ncclSuccess;
+fail:
+  if (graph != nullptr) (void)cudaGraphDestroy(graph);
+  return ret;
+}
+
+ncclResult_t mscclReplayLaunch(mscclAlgoHandle_t handle, void* func, dim3 grid, dim3 block, struct mscclWork* work,
+    ncclComm_t comm, cudaStream_t stream, bool* launched) {
+  *launched = false;
+#if CUDART_VERSION >= 11040
+  if (!ncclParamMscclLaunchGraphs()) {
+    return ncclSuccess;
+  }
+  // launches captured by the application go into its graph as they are
+  cudaStreamCaptureStatus captureStatus;
+  CUDACHECK(cudaStreamIsCapturing(stream, &captureStatus));
+  if (captureStatus != cudaStreamCaptureStatusNone) {
+    return ncclSuccess;
+  }
+
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if (status.replay == nullptr) {
+    status.replay = new mscclReplayStatus();
+    CUDACHECK(cudaStreamCreateWithFlags(&status.replay->captureStream, cudaStreamNonBlocking));
+  }
+  struct mscclReplayStatus* replay = status.replay;
+  mscclReplayKey key(handle, grid.x, block.x);
+  auto it = replay->graphs.find(key);
+  if (it == replay->graphs.end()) {
+    if (replay->graphs.size() >= MSCCL_REPLAY_MAX_GRAPHS) {
+      return ncclSuccess;
+    }
+    struct mscclReplayGraph g;
+    NCCLCHECK(mscclReplayCapture(func, grid, block, work, comm, replay, &g));
+    it = replay->graphs.emplace(key, g).first;
+    TRACE(NCCL_COLL, "MSCCL: Instantiated the launch graph of algorithm %d on %u thread blocks", handle, grid.x);
+  }
+
+  // The node takes a copy of the arguments, work can go away once the graph is launched
+  void* args[2] = {&comm->devComm, work};
+  cudaKernelNodeParams params = {};
+  params.func = func;
+  params.gridDim = grid;
+  params.blockDim = block;
+  params.sharedMemBytes = ncclShmemDynamicSize(comm->cudaArch, block.x);
+  params.kernelParams = args;
+  CUDACHECK(cudaGraphExecKernelNodeSetParams(it->second.exec, it->second.node, &params));
+  CUDACHECK(cudaGraphLaunch(it->second.exec, stream));
+  *launched = true;
+#endif
+  return ncclSuccess;
+}
+
+ncclResult_t mscclReplayTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclReplayStatus* replay = commStatus.replay;
+  if (replay == nullptr) {
+    return ncclSuccess;
+  }
+  // graphs still in flight are freed once they complete
+  for (auto& g : replay->graphs) {
+    CUDACHECK(cudaGraphExecDestroy(g.second.exec));
+    CUDACHECK(cudaGraphDestroy(g.second.graph));
+  }
+  CUDACHECK(cudaStreamDestroy(replay->captureStream));
+  delete replay;
+  commStatus.replay = nullptr;
+  return ncclSuccess;
+}
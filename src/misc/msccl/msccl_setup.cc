@@ -3,110 +3,765 @@
  * Licensed under the MIT License.
  ************************************************************************/
 
+#include <list>
+#include <mutex>
+#include <set>
+
 #include "channel.h"
 #include "checks.h"
 #include "device.h"
+#include "enqueue.h"
+#include "profiler.h"
 #include "proxy.h"
+#include "register.h"
 #include "transport.h"
 
+#include "msccl/msccl_direct.h"
 #include "msccl/msccl_lifecycle.h"
 #include "msccl/msccl_kernel.h"
+#include "msccl/msccl_persistent.h"
+#include "msccl/msccl_replay.h"
 #include "msccl/msccl_setup.h"
 #include "msccl/msccl_status.h"
+#include "msccl/msccl_telemetry.h"
+#include "msccl/msccl_validate.h"
+
+// Threads driving different devices of the process capture concurrently
+static std::mutex mscclSavedProxyArgsMutex;
 
 #if CUDART_VERSION >= 12000
 // MSCCL uses the "Remote" Mem Sync domain by default
 NCCL_PARAM(MscclMemSyncDomain, "MSCCL_MEM_SYNC_DOMAIN", cudaLaunchMemSyncDomainRemote);
 #endif
 
-ncclResult_t mscclGetCaptureStatus(cudaStream_t stream) {
+// Thread blocks of an algorithm are replicated up to this many times for calls of several loops
+NCCL_PARAM(MscclBlockReplicas, "MSCCL_BLOCK_REPLICAS", 1);
+
+struct mscclCapturedGraph {
+  struct ncclCommCallback reclaimer; // must be first
+  ncclComm_t comm;
+  unsigned long long captureId;
+  // host tasks of the graph point into it, so elements must not move
+  std::list<struct mscclProxyArg> proxyArgs;
+  // buffers registered for the graph, released with it
+  struct ncclIntruQueue<struct ncclCommCallback, &ncclCommCallback::next> cleanupQueue;
+};
+
+// Run by the main thread of comm once the graph is gone, like the reclaim of persistent plans
+static ncclResult_t mscclReclaimCapturedGraph(struct ncclComm* comm, struct ncclCommCallback* cb) {
+  struct mscclCapturedGraph* captured = (struct mscclCapturedGraph*)cb;
+  {
+    std::lock_guard<std::mutex> lock(mscclSavedProxyArgsMutex);
+    mscclGetSavedProxyArgs().erase(std::make_pair(captured->captureId, comm));
+  }
+  INFO(NCCL_INIT|NCCL_NET, "MSCCL: Released %zu proxy args of captureId %llu", captured->proxyArgs.size(), captured->captureId);
+  ncclResult_t result = ncclSuccess;
+  while (!ncclIntruQueueEmpty(&captured->cleanupQueue)) {
+    struct ncclCommCallback* cleanup = ncclIntruQueueDequeue(&captured->cleanupQueue);
+    ncclResult_t res1 = cleanup->fn(comm, cleanup); // Expect to reclaim memory of cleanup
+    if (res1 != ncclSuccess) result = res1;
+  }
+  delete captured;
+  comm->persistentRefs -= 1;
+  return result;
+}
+
+static void mscclCapturedGraphDestructor(void* arg) {
+  struct mscclCapturedGraph* captured = (struct mscclCapturedGraph*)arg;
+  ncclIntruQueueMpscEnqueue(&captured->comm->callbackQueue, &captured->reclaimer);
+}
+
+ncclResult_t mscclGetCaptureStatus(ncclComm_t comm, cudaStream_t stream) {
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
   mscclSavedProxyArgs& savedProxyArgs = mscclGetSavedProxyArgs();
   cudaStreamCaptureStatus captureStatus;
   unsigned long long captureId;
   CUDACHECK(cudaStreamGetCaptureInfo_v2(stream, &captureStatus, &captureId, &threadLocalStatus.graph, nullptr, nullptr));
-  if (captureStatus == cudaStreamCaptureStatusActive) {
-    if (savedProxyArgs.count(captureId) == 0) {
-      threadLocalStatus.captureStatus = mscclNewCapture;
-      savedProxyArgs[captureId] = std::vector<struct mscclProxyArg>();
-    } else {
-      INFO(NCCL_INIT|NCCL_NET,"mscclGetCaptureStatus: captureId %llu is same with the previous one\n", captureId);
-      threadLocalStatus.captureStatus = mscclExistingCapture;
-    }
-    threadLocalStatus.captureId = captureId;
-  } else {
+  if (captureStatus != cudaStreamCaptureStatusActive) {
     threadLocalStatus.captureStatus = mscclNoCapture;
+    return ncclSuccess;
   }
-  INFO(NCCL_INIT|NCCL_NET,"mscclGetCaptureStatus: %d, captureId: %llu, size: %lu\n", threadLocalStatus.captureStatus, threadLocalStatus.captureId, mscclGetSavedProxyArgs()[captureId].size());
+  threadLocalStatus.captureId = captureId;
+  std::lock_guard<std::mutex> lock(mscclSavedProxyArgsMutex);
+  auto key = std::make_pair(captureId, comm);
+  if (savedProxyArgs.count(key) == 0) {
+    threadLocalStatus.captureStatus = mscclNewCapture;
+    struct mscclCapturedGraph* captured = new mscclCapturedGraph();
+    captured->reclaimer.fn = mscclReclaimCapturedGraph;
+    captured->comm = comm;
+    captured->captureId = captureId;
+    ncclIntruQueueConstruct(&captured->cleanupQueue);
+    struct ncclCudaGraph graph;
+    graph.graph = threadLocalStatus.graph;
+    graph.graphId = captureId;
+    NCCLCHECK(ncclCudaGraphAddDestructor(graph, mscclCapturedGraphDestructor, captured));
+    savedProxyArgs[key] = captured;
+    // Holds comm destruction until the graph is destroyed, as NCCL does for its captured plans
+    comm->persistentRefs += 1;
+  } else {
+    threadLocalStatus.captureStatus = mscclExistingCapture;
+  }
+  TRACE(NCCL_COLL, "MSCCL: Capture status %d, captureId %llu, %zu proxy args", threadLocalStatus.captureStatus, threadLocalStatus.captureId, savedProxyArgs[key]->proxyArgs.size());
   return ncclSuccess;
 }
 
-ncclResult_t mscclSetupCount(struct mscclAlgo* hostAlgo, ncclComm_t comm, size_t count, ncclDataType_t dataType) {
-  mscclStatus& status = mscclGetStatus();
-  status.stepSize = comm->buffSizes[hostAlgo->protocol] / NCCL_STEPS;
-  status.chunkSteps = hostAlgo->protocol == NCCL_PROTO_SIMPLE ? hostAlgo->chunkSteps : 1;
-  status.sliceSteps = hostAlgo->protocol == NCCL_PROTO_SIMPLE ? hostAlgo->sliceSteps : 1;
-  status.chunkSize  = status.stepSize * status.chunkSteps;
-  status.chunkEffectiveSize = status.chunkSize;
-  if (hostAlgo->protocol == NCCL_PROTO_LL) status.chunkEffectiveSize /= 2;
-  if (hostAlgo->protocol == NCCL_PROTO_LL128) status.chunkEffectiveSize = (status.chunkSize / NCCL_LL128_LINEELEMS) * NCCL_LL128_DATAELEMS;
-  status.dataType = dataType;
-  status.nBytes = count * ncclTypeSize(status.dataType) * hostAlgo->sizeMultiplier;
-  status.maxAllowedCount = std::max((uint32_t)1, (uint32_t)(status.chunkEffectiveSize / DIVUP(status.nBytes, (size_t)(hostAlgo->nChunksPerLoop))));
-  if (status.maxAllowedCount == 0){
-    WARN("MSCCL: something went wrong. Max allowed count is 0\n");
+ncclResult_t mscclGetCapturedCleanupQueue(ncclComm_t comm,
+    struct ncclIntruQueue<struct ncclCommCallback, &ncclCommCallback::next>** cleanupQueue) {
+  mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
+  std::lock_guard<std::mutex> lock(mscclSavedProxyArgsMutex);
+  auto it = mscclGetSavedProxyArgs().find(std::make_pair(threadLocalStatus.captureId, comm));
+  if (it == mscclGetSavedProxyArgs().end()) {
+    WARN("MSCCL: no graph is being captured on comm %p", comm);
     return ncclInternalError;
   }
-  if (status.maxAllowedCount >= MSCCL_MAX_COUNT) {
-    status.maxAllowedCount = MSCCL_MAX_COUNT - 1;
+  *cleanupQueue = &it->second->cleanupQueue;
+  return ncclSuccess;
+}
+
+// Thread blocks with independent sends run them a grid iteration ahead of their receives
+NCCL_PARAM(MscclPipeline, "MSCCL_PIPELINE", 0);
+
+static bool mscclMayOverlap(const struct mscclTransmission* src, const struct mscclTransmission* dst) {
+  // input and output are the same buffer for in-place calls
+  bool sameBuffer = src->srcBuffer == dst->dstBuffer ||
+    (src->srcBuffer != MSCCL_SCRATCH_BUFFER && dst->dstBuffer != MSCCL_SCRATCH_BUFFER);
+  return sameBuffer && src->srcOffset < dst->dstOffset + dst->count && dst->dstOffset < src->srcOffset + src->count;
+}
+
+// A thread block of plain s and r with one peer each can run its receives a grid iteration behind
+// its sends when the sends wait on no other thread block, neither directly nor through an earlier
+// receive, and do not read what an earlier receive of the iteration wrote. Two iterations of sends
+// must also fit in the NCCL_STEPS credits of the connection, so that a send never waits for the
+// peer to consume what it may only get to after a receive lagging behind.
+static bool mscclCanPipeline(struct mscclThreadBlock* tb) {
+  if (tb->channelId < 0 || tb->nvls != MSCCL_NVLS_NONE || tb->nSendPeers != 1 || tb->nRecvPeers != 1) return false;
+  const int stepSlots = tb->protocol == NCCL_PROTO_SIMPLE ? MSCCL_CHUNKSTEPS : 1;
+  int sendSlots = 0;
+  bool recvSeen = false, recvWaits = false, overtakes = false;
+  for (int i = 0; i < tb->nSteps; i++) {
+    struct mscclTransmission* t = &tb->transmissions[i];
+    if (t->type == MSCCL_RECV) {
+      recvSeen = true;
+      recvWaits |= t->numDependencies > 0;
+      continue;
+    }
+    if (t->type != MSCCL_SEND || t->numDependencies > 0) return false;
+    if (recvSeen) {
+      if (recvWaits) return false;
+      for (int k = 0; k < i; k++) {
+        if (tb->transmissions[k].type == MSCCL_RECV && mscclMayOverlap(t, &tb->transmissions[k])) return false;
+      }
+      overtakes = true;
+    }
+    sendSlots += t->count * stepSlots;
+  }
+  return overtakes && 2 * sendSlots <= NCCL_STEPS;
+}
+
+ncclResult_t mscclSetupDevAlgo(struct mscclAlgo* hostAlgo, struct mscclDevAlgo** devAlgo) {
+  int nPipelined = 0;
+  // Live size of the per-step arrays of each thread block
+  std::vector<struct mscclDevThreadBlock> devTBs(hostAlgo->nBlocks);
+  std::vector<uint32_t> tbOffsets(hostAlgo->nBlocks);
+  size_t nBytes = ROUNDUP(sizeof(struct mscclDevAlgo) + hostAlgo->nBlocks * sizeof(uint32_t), MSCCL_DEV_ALGO_ALIGN);
+  for (int bid = 0; bid < hostAlgo->nBlocks; bid++) {
+    struct mscclThreadBlock* tb = &hostAlgo->mscclTBs[bid];
+    struct mscclDevThreadBlock* devTB = &devTBs[bid];
+    memcpy(devTB->sendPeers, tb->sendPeers, sizeof(devTB->sendPeers));
+    memcpy(devTB->recvPeers, tb->recvPeers, sizeof(devTB->recvPeers));
+    devTB->nSendPeers = tb->nSendPeers;
+    devTB->nRecvPeers = tb->nRecvPeers;
+    devTB->nSteps = tb->nSteps;
+    devTB->channelId = tb->channelId;
+    devTB->nvls = tb->nvls;
+    devTB->protocol = tb->protocol;
+    devTB->collnet = tb->collnet;
+    devTB->pipelined = ncclParamMscclPipeline() && mscclCanPipeline(tb);
+    nPipelined += devTB->pipelined;
+    devTB->nDependencies = 0;
+    devTB->nReductions = 0;
+    for (int i = 0; i < tb->nSteps; i++) {
+      struct mscclTransmission* t = &tb->transmissions[i];
+      if (t->numDependencies > 0) {
+        devTB->nDependencies = std::max(devTB->nDependencies, (uint16_t)(t->dependencePointer + t->numDependencies));
+      }
+      if (t->numReductions > 0) {
+        devTB->nReductions = std::max(devTB->nReductions, (uint16_t)(t->reductionPointer + t->numReductions));
+      }
+    }
+    tbOffsets[bid] = nBytes / MSCCL_DEV_ALGO_ALIGN;
+    nBytes += sizeof(struct mscclDevThreadBlock);
+    nBytes += ROUNDUP(devTB->nSteps * sizeof(struct mscclTransmission), MSCCL_DEV_ALGO_ALIGN);
+    nBytes += ROUNDUP(devTB->nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+    nBytes += ROUNDUP(devTB->nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+    nBytes += ROUNDUP(devTB->nReductions * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+  }
+
+  // Packed in pinned memory so that the copy is asynchronous, the staging lives until it is done
+  char* packed;
+  NCCLCHECK(ncclCudaHostCalloc(&packed, nBytes));
+  struct mscclDevAlgo* header = (struct mscclDevAlgo*)packed;
+  header->nBlocks = hostAlgo->nBlocks;
+  header->nBytes = nBytes;
+  memcpy(header + 1, tbOffsets.data(), hostAlgo->nBlocks * sizeof(uint32_t));
+  for (int bid = 0; bid < hostAlgo->nBlocks; bid++) {
+    struct mscclThreadBlock* tb = &hostAlgo->mscclTBs[bid];
+    struct mscclDevThreadBlock* devTB = &devTBs[bid];
+    char* p = packed + (size_t)tbOffsets[bid] * MSCCL_DEV_ALGO_ALIGN;
+    memcpy(p, devTB, sizeof(struct mscclDevThreadBlock));
+    p += sizeof(struct mscclDevThreadBlock);
+    memcpy(p, tb->transmissions, devTB->nSteps * sizeof(struct mscclTransmission));
+    p += ROUNDUP(devTB->nSteps * sizeof(struct mscclTransmission), MSCCL_DEV_ALGO_ALIGN);
+    memcpy(p, tb->dependentBid, devTB->nDependencies * sizeof(int16_t));
+    p += ROUNDUP(devTB->nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+    memcpy(p, tb->dependentStep, devTB->nDependencies * sizeof(int16_t));
+    p += ROUNDUP(devTB->nDependencies * sizeof(int16_t), MSCCL_DEV_ALGO_ALIGN);
+    memcpy(p, tb->reductionSrcOffsets, devTB->nReductions * sizeof(int16_t));
+  }
+
+  ncclResult_t result = ncclSuccess;
+  mscclStatus& status = mscclGetStatus();
+  struct mscclUpload upload = { nullptr, packed };
+  cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+  cudaStream_t stream = nullptr;
+  int cudaDev;
+  *devAlgo = nullptr;
+  // Nothing here joins a graph the calling thread may be capturing
+  CUDACHECKGOTO(cudaThreadExchangeStreamCaptureMode(&mode), result, fail);
+  CUDACHECKGOTO(cudaGetDevice(&cudaDev), result, restore);
+  if (status.uploadStreams.count(cudaDev) == 0) {
+    CUDACHECKGOTO(cudaStreamCreateWithFlags(&status.uploadStreams[cudaDev], cudaStreamNonBlocking), result, restore);
+  }
+  stream = status.uploadStreams[cudaDev];
+  NCCLCHECKGOTO(ncclCudaMalloc((char**)devAlgo, nBytes), result, restore);
+  CUDACHECKGOTO(cudaMemcpyAsync(*devAlgo, packed, nBytes, cudaMemcpyHostToDevice, stream), result, restore);
+  CUDACHECKGOTO(cudaEventCreateWithFlags(&upload.done, cudaEventDisableTiming), result, restore);
+  CUDACHECKGOTO(cudaEventRecord(upload.done, stream), result, restore);
+  status.pendingUploads[*devAlgo] = upload;
+  INFO(NCCL_INIT, "MSCCL: Packed device algorithm is %zu bytes, %zu bytes unpacked, %d of %d thread blocks pipelined",
+    nBytes, sizeof(struct mscclAlgo), nPipelined, hostAlgo->nBlocks);
+restore:
+  CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+  if (result == ncclSuccess) return ncclSuccess;
+  // The copy may have been queued, it has to be done before the staging goes
+  if (stream != nullptr) (void)cudaStreamSynchronize(stream);
+  if (upload.done) (void)cudaEventDestroy(upload.done);
+  if (*devAlgo) (void)ncclCudaFree(*devAlgo);
+  *devAlgo = nullptr;
+fail:
+  ncclCudaHostFree(packed);
+  return result;
+}
+
+// Drop the upload of devAlgo once done, waiting for it if needed
+static ncclResult_t mscclReleaseUpload(mscclStatus& status, std::map<struct mscclDevAlgo*, struct mscclUpload>::iterator u,
+    bool wait) {
+  if (wait) {
+    cudaStreamCaptureMode mode = cudaStreamCaptureModeRelaxed;
+    CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+    cudaError_t err = cudaEventSynchronize(u->second.done);
+    CUDACHECK(cudaThreadExchangeStreamCaptureMode(&mode));
+    CUDACHECK(err);
   }
+  CUDACHECK(cudaEventDestroy(u->second.done));
+  NCCLCHECK(ncclCudaHostFree(u->second.staging));
+  status.pendingUploads.erase(u);
   return ncclSuccess;
 }
 
-ncclResult_t mscclSetupScratch(struct mscclAlgo* hostAlgo, cudaStream_t stream) {
+ncclResult_t mscclWaitDevAlgo(struct mscclDevAlgo* devAlgo, cudaStream_t stream) {
   mscclStatus& status = mscclGetStatus();
-  size_t sizeNeeded = (status.nBytes * (size_t)(hostAlgo->nScratchChunks)) / (size_t)(hostAlgo->nChunksPerLoop);
-  if (sizeNeeded > status.scratchBufferSize){
-    NCCLCHECK(ncclCudaFree(status.scratchBuffer));
-    NCCLCHECK(ncclCudaCalloc((char**)&status.scratchBuffer, sizeNeeded));
-    status.scratchBufferSize = sizeNeeded;
+  std::lock_guard<std::mutex> lock(status.algoMutex);
+  auto u = status.pendingUploads.find(devAlgo);
+  if (u == status.pendingUploads.end()) return ncclSuccess;
+  cudaError_t err = cudaEventQuery(u->second.done);
+  if (err == cudaSuccess) {
+    NCCLCHECK(mscclReleaseUpload(status, u, false));
+    return ncclSuccess;
+  }
+  if (err != cudaErrorNotReady) CUDACHECK(err);
+  if (mscclGetThreadLocalStatus().captureStatus == mscclNoCapture) {
+    CUDACHECK(cudaStreamWaitEvent(stream, u->second.done, 0));
+  } else {
+    // A graph cannot depend on work outside of its capture, the upload is waited for here instead
+    NCCLCHECK(mscclReleaseUpload(status, u, true));
   }
   return ncclSuccess;
 }
 
-ncclResult_t mscclSetupSyncFlags(cudaStream_t stream) {
+ncclResult_t mscclFreeDevAlgo(struct mscclDevAlgo* devAlgo) {
   mscclStatus& status = mscclGetStatus();
+  auto u = status.pendingUploads.find(devAlgo);
+  if (u != status.pendingUploads.end()) {
+    NCCLCHECK(mscclReleaseUpload(status, u, true));
+  }
+  NCCLCHECK(ncclCudaFree(devAlgo));
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTeardownUploads() {
+  mscclStatus& status = mscclGetStatus();
+  for (auto& s : status.uploadStreams) {
+    CUDACHECK(cudaStreamDestroy(s.second));
+  }
+  status.uploadStreams.clear();
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclFreeScratch(ncclComm_t comm, cudaStream_t stream) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if (status.scratchBuffer == nullptr) return ncclSuccess;
+  if (status.scratchBufferIpc) {
+    // Peers only write it during calls this rank takes part in, done once its stream is idle
+    if (stream != nullptr) CUDACHECK(cudaStreamSynchronize(stream));
+    NCCLCHECK(ncclCommDeregister(comm, status.scratchRegHandle));
+    status.scratchRegHandle = nullptr;
+    status.scratchBufferIpc = false;
+  }
+  if (!status.scratchBufferFromPool) {
+    NCCLCHECK(ncclCudaFree(status.scratchBuffer));
+  } else if (stream == nullptr) {
+    NCCLCHECK(ncclCudaFreePool(status.scratchBuffer));
+  } else {
+    NCCLCHECK(ncclCudaFreePoolAsync(status.scratchBuffer, stream));
+  }
+  status.scratchBuffer = nullptr;
+  status.scratchBufferSize = 0;
+  return ncclSuccess;
+}
+
+// Scratch that peer processes write into through zero-copy steps is allocated outside of the pool,
+// whose memory can not be exported, and registered with the comm so that calls can share it
+static ncclResult_t mscclAllocScratchIpc(ncclComm_t comm, size_t size) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  NCCLCHECK(mscclPersistentStopDevice(comm->cudaDev));
+  NCCLCHECK(mscclFreeScratch(comm, nullptr));
+  NCCLCHECK(ncclCudaCalloc((char**)&status.scratchBuffer, size));
+  status.scratchBufferSize = size;
+  status.scratchBufferFromPool = false;
+  NCCLCHECK(ncclRegister(comm, status.scratchBuffer, size, &status.scratchRegHandle));
+  status.scratchBufferIpc = status.scratchRegHandle != nullptr;
+  INFO(NCCL_INIT|NCCL_REG, "MSCCL: Allocated %zu bytes of scratch buffer peers can map", size);
+  return ncclSuccess;
+}
+
+ncclResult_t mscclReserveScratch(ncclComm_t comm, size_t size) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if (size <= status.scratchBufferSize) return ncclSuccess;
+  if (mscclDirectScratchIpc(comm)) {
+    return mscclAllocScratchIpc(comm, size);
+  }
+  // Work already queued on user streams may still use the old buffer, so release it synchronously
+  NCCLCHECK(mscclPersistentStopDevice(comm->cudaDev));
+  NCCLCHECK(mscclFreeScratch(comm, nullptr));
+  cudaStream_t stream;
+  CUDACHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  NCCLCHECK(ncclCudaMallocPoolAsync((char**)&status.scratchBuffer, size, comm->memPool, stream));
+  status.scratchBufferSize = size;
+  status.scratchBufferFromPool = true;
+  CUDACHECK(cudaStreamSynchronize(stream));
+  CUDACHECK(cudaStreamDestroy(stream));
+  INFO(NCCL_INIT, "MSCCL: Reserved %zu bytes of scratch buffer", size);
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTeardownScratch(ncclComm_t comm) {
+  return mscclFreeScratch(comm, nullptr);
+}
+
+static ncclResult_t mscclSetupScratchSize(ncclComm_t comm, size_t sizeNeeded, cudaStream_t stream) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
-  if (threadLocalStatus.captureStatus == mscclNewCapture ||
-      status.workIndex > (1ULL << (8*sizeof(status.workIndex))) - 2 * NCCL_MAX_OPS - 1) {
-    CUDACHECK(cudaMemsetAsync(status.syncFlags, 0, sizeof(struct mscclFlag) * MSCCL_MAX_NUM_THREAD_BLOCKS, stream));
-    status.workIndex = 1; // setting the workIndex back to 1 for next iterations
-    status.graphFirstKernel = false;
+  bool capturing = threadLocalStatus.captureStatus != mscclNoCapture;
+  if (sizeNeeded > 0 && (!status.scratchBufferIpc || sizeNeeded > status.scratchBufferSize) && mscclDirectScratchIpc(comm)) {
+    // Work queued before may still use the old buffer. During capture it is freed like the other
+    // allocations made outside of the pool.
+    if (!capturing) CUDACHECK(cudaStreamSynchronize(stream));
+    NCCLCHECK(mscclAllocScratchIpc(comm, std::max(sizeNeeded, (size_t)status.scratchBufferSize)));
+    return ncclSuccess;
+  }
+  if (sizeNeeded > status.scratchBufferSize){
+    if (!capturing) {
+      // Old buffer goes back to the pool once the work queued before it on stream is done. The
+      // last call may have run on another stream, whose kernels are only waited for by a
+      // synchronous free.
+      bool sameStream = status.lastStream == nullptr || status.lastStream == stream;
+      NCCLCHECK(mscclFreeScratch(comm, sameStream ? stream : nullptr));
+      NCCLCHECK(ncclCudaMallocPoolAsync((char**)&status.scratchBuffer, sizeNeeded, comm->memPool, stream));
+      status.scratchBufferFromPool = true;
+    } else {
+      // Pool allocations made during capture would belong to the graph, allocate outside of it
+      NCCLCHECK(mscclPersistentStopDevice(comm->cudaDev));
+      NCCLCHECK(mscclFreeScratch(comm, nullptr));
+      NCCLCHECK(ncclCudaCalloc((char**)&status.scratchBuffer, sizeNeeded));
+      status.scratchBufferFromPool = false;
+    }
+    status.scratchBufferSize = sizeNeeded;
+  }
+  return ncclSuccess;
+}
+
+// Algorithms of these collectives made for in-place or out-of-place calls only also run the
+// other calls. Their buffers have the same size on every rank and no root.
+NCCL_PARAM(MscclAlias, "MSCCL_ALIAS", 1);
+
+bool mscclAliasable(mscclFunc_t func) {
+  if (!ncclParamMscclAlias()) return false;
+  return func == mscclFuncAllReduce || func == mscclFuncAllGather ||
+    func == mscclFuncReduceScatter || func == mscclFuncAllToAll;
+}
+
+bool mscclIsInPlaceCall(mscclFunc_t func, const void* sendBuff, const void* recvBuff, size_t rankBytes, int rank) {
+  if (func == mscclFuncReduce ||
+      func == mscclFuncBroadcast ||
+      func == mscclFuncAllReduce ||
+      func == mscclFuncAllToAll) {
+    return sendBuff == recvBuff;
+  } else if (func == mscclFuncAllGather ||
+             func == mscclFuncGather) {
+    return (const char*)sendBuff == (const char*)recvBuff + rank * rankBytes;
+  } else if (func == mscclFuncReduceScatter ||
+             func == mscclFuncScatter) {
+    return (const char*)recvBuff == (const char*)sendBuff + rank * rankBytes;
   }
+  return false;
+}
+
+// Plan how the call runs the algorithm of desc, staging space is placed relative to its scratch
+static void mscclGetAlias(const void* sendBuff, void* recvBuff, const struct mscclLaunchDesc* desc,
+    ncclComm_t comm, struct mscclAlias* alias) {
+  struct mscclAlgo* hostAlgo = desc->hostAlgo;
+  size_t bytes = desc->work.count * ncclTypeSize(desc->proxy.dataType);
+  size_t rankBytes = bytes / hostAlgo->sizeMultiplier;
+  alias->mode = mscclAliasNone;
+  alias->sendBuff = sendBuff;
+  alias->recvBuff = recvBuff;
+  alias->scratchSize = desc->scratchSize;
+  alias->stagingOffset = ROUNDUP(desc->scratchSize, MSCCL_FUSED_SCRATCH_ALIGN);
+  alias->stagingBytes = 0;
+  alias->copyOutBytes = 0;
+  if (!mscclAliasable(hostAlgo->func) || hostAlgo->inPlace == hostAlgo->outOfPlace) return;
+  bool inPlace = mscclIsInPlaceCall(hostAlgo->func, sendBuff, recvBuff, rankBytes, comm->rank);
+  if (inPlace == hostAlgo->inPlace) return;
+  if (inPlace) {
+    // Writes of the output must not reach the input before it is read
+    alias->mode = mscclAliasStageInput;
+    alias->stagingBytes = hostAlgo->func == mscclFuncAllGather ? rankBytes : bytes;
+  } else {
+    alias->mode = mscclAliasInPlace;
+    // The input of reduce-scatter holds its output, that input cannot be the one of the user
+    if (hostAlgo->func == mscclFuncReduceScatter) alias->stagingBytes = bytes;
+  }
+  if (alias->stagingBytes > 0) alias->scratchSize = alias->stagingOffset + alias->stagingBytes;
+}
+
+// Copy the input where the algorithm reads it, scratch is the scratch part of the call
+static ncclResult_t mscclAliasCopyIn(struct mscclAlias* alias, const struct mscclLaunchDesc* desc, void* scratch,
+    ncclComm_t comm, cudaStream_t stream) {
+  struct mscclAlgo* hostAlgo = desc->hostAlgo;
+  size_t bytes = desc->work.count * ncclTypeSize(desc->proxy.dataType);
+  size_t rankBytes = bytes / hostAlgo->sizeMultiplier;
+  char* staging = (char*)scratch + alias->stagingOffset;
+  if (alias->mode == mscclAliasStageInput) {
+    CUDACHECK(cudaMemcpyAsync(staging, alias->sendBuff, alias->stagingBytes, cudaMemcpyDeviceToDevice, stream));
+    alias->sendBuff = staging;
+  } else if (alias->mode == mscclAliasInPlace) {
+    if (hostAlgo->func == mscclFuncReduceScatter) {
+      CUDACHECK(cudaMemcpyAsync(staging, alias->sendBuff, bytes, cudaMemcpyDeviceToDevice, stream));
+      alias->copyOutSrc = staging + comm->rank * rankBytes;
+      alias->copyOutDst = alias->recvBuff;
+      alias->copyOutBytes = rankBytes;
+      alias->sendBuff = staging;
+      alias->recvBuff = staging + comm->rank * rankBytes;
+    } else {
+      size_t sendBytes = hostAlgo->func == mscclFuncAllGather ? rankBytes : bytes;
+      char* dst = (char*)alias->recvBuff + (hostAlgo->func == mscclFuncAllGather ? comm->rank * rankBytes : 0);
+      CUDACHECK(cudaMemcpyAsync(dst, alias->sendBuff, sendBytes, cudaMemcpyDeviceToDevice, stream));
+      alias->sendBuff = dst;
+    }
+  } else {
+    return ncclSuccess;
+  }
+  TRACE(NCCL_COLL, "MSCCL: Running %s algorithm on a%s call of %zu bytes",
+    hostAlgo->inPlace ? "in-place" : "out-of-place", hostAlgo->inPlace ? "n out-of-place" : " in-place", bytes);
+  return ncclSuccess;
+}
+
+ncclResult_t mscclSetupAlias(const void* sendBuff, void* recvBuff, const struct mscclLaunchDesc* desc,
+    const struct mscclTail* tail, ncclComm_t comm, cudaStream_t stream, struct mscclAlias* alias) {
+  mscclGetAlias(sendBuff, recvBuff, desc, comm, alias);
+  if (!mscclHasBody(tail)) {
+    alias->mode = mscclAliasNone;
+    alias->scratchSize = 0;
+  }
+  // The tail launch runs after the body is done with its scratch
+  NCCLCHECK(mscclSetupScratchSize(comm, std::max(alias->scratchSize, tail->scratchSize), stream));
+  NCCLCHECK(mscclAliasCopyIn(alias, desc, mscclGetCommStatus(comm).scratchBuffer, comm, stream));
+  return ncclSuccess;
+}
+
+ncclResult_t mscclFinishAlias(const struct mscclAlias* alias, cudaStream_t stream) {
+  if (alias->copyOutBytes > 0) {
+    CUDACHECK(cudaMemcpyAsync(alias->copyOutDst, alias->copyOutSrc, alias->copyOutBytes, cudaMemcpyDeviceToDevice, stream));
+  }
+  return ncclSuccess;
+}
+
+// Calls of these collectives whose count does not divide into the chunks of an algorithm run the
+// chunks that fit in each block of their buffers, then the elements past them as a second call
+// of the algorithm over copies padded to one element per chunk.
+NCCL_PARAM(MscclTail, "MSCCL_TAIL", 1);
+
+static bool mscclTailable(mscclFunc_t func, int nChunksPerLoop, int sizeMultiplier) {
+  if (!ncclParamMscclTail()) return false;
+  if (nChunksPerLoop % sizeMultiplier != 0) return false;
+  return func == mscclFuncAllReduce || func == mscclFuncAllGather ||
+    func == mscclFuncReduceScatter || func == mscclFuncAllToAll;
+}
+
+bool mscclHasTail(const struct mscclAlgo* hostAlgo, size_t count) {
+  return (count * hostAlgo->sizeMultiplier) % hostAlgo->nChunksPerLoop != 0;
+}
+
+bool mscclCountSupported(mscclFunc_t func, int nChunksPerLoop, int sizeMultiplier, size_t count) {
+  return (count * sizeMultiplier) % nChunksPerLoop == 0 || mscclTailable(func, nChunksPerLoop, sizeMultiplier);
+}
+
+bool mscclHasBody(const struct mscclTail* tail) {
+  return tail->desc == nullptr || tail->bodyCount > 0;
+}
+
+ncclResult_t mscclSetupTail(mscclAlgoHandle_t handle, struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo,
+    ncclComm_t comm, size_t count, ncclDataType_t dataType, struct mscclTail* tail) {
+  memset(tail, 0, sizeof(*tail));
+  tail->blockCount = count;
+  tail->bodyCount = count;
+  if (!mscclHasTail(hostAlgo, count)) return ncclSuccess;
+  mscclFunc_t func = hostAlgo->func;
+  if (!mscclTailable(func, hostAlgo->nChunksPerLoop, hostAlgo->sizeMultiplier)) {
+    WARN("MSCCL: count %zu does not divide into the %d chunks of the algorithm", count, hostAlgo->nChunksPerLoop);
+    return ncclInvalidArgument;
+  }
+  size_t typeSize = ncclTypeSize(dataType);
+  tail->chunksPerBlock = hostAlgo->nChunksPerLoop / hostAlgo->sizeMultiplier;
+  tail->bodyCount = count / tail->chunksPerBlock * tail->chunksPerBlock;
+  tail->remCount = count - tail->bodyCount;
+  tail->nSendBlocks = (func == mscclFuncReduceScatter || func == mscclFuncAllToAll) ? hostAlgo->sizeMultiplier : 1;
+  tail->nRecvBlocks = (func == mscclFuncAllGather || func == mscclFuncAllToAll) ? hostAlgo->sizeMultiplier : 1;
+  NCCLCHECK(mscclSetupCount(handle, hostAlgo, devAlgo, comm, tail->chunksPerBlock, dataType, &tail->desc));
+
+  size_t rankBytes = tail->chunksPerBlock * typeSize;
+  size_t sendBytes = tail->nSendBlocks * rankBytes;
+  size_t recvBytes = tail->nRecvBlocks * rankBytes;
+  size_t stagingOffset = ROUNDUP(tail->desc->scratchSize, MSCCL_FUSED_SCRATCH_ALIGN);
+  if (hostAlgo->outOfPlace) {
+    tail->sendOffset = stagingOffset;
+    tail->recvOffset = stagingOffset + ROUNDUP(sendBytes, MSCCL_FUSED_SCRATCH_ALIGN);
+    tail->scratchSize = tail->recvOffset + recvBytes;
+  } else {
+    // In-place algorithms find the input where the output aliases it
+    tail->sendOffset = stagingOffset + (func == mscclFuncAllGather ? comm->rank * rankBytes : 0);
+    tail->recvOffset = stagingOffset + (func == mscclFuncReduceScatter ? comm->rank * rankBytes : 0);
+    tail->scratchSize = stagingOffset + std::max(sendBytes, recvBytes);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclRunTail(const void* sendBuff, void* recvBuff, ncclRedOp_t op, const struct mscclTail* tail,
+    ncclComm_t comm, cudaStream_t stream) {
+  if (tail->desc == nullptr) return ncclSuccess;
+  size_t typeSize = ncclTypeSize(tail->desc->proxy.dataType);
+  size_t blockBytes = tail->blockCount * typeSize;
+  size_t paddedBytes = tail->chunksPerBlock * typeSize;
+  size_t bodyBytes = tail->bodyCount * typeSize;
+  size_t remBytes = tail->remCount * typeSize;
+  char* scratch = (char*)mscclGetCommStatus(comm).scratchBuffer;
+  CUDACHECK(cudaMemcpy2DAsync(scratch + tail->sendOffset, paddedBytes, (const char*)sendBuff + bodyBytes, blockBytes,
+    remBytes, tail->nSendBlocks, cudaMemcpyDeviceToDevice, stream));
+  NCCLCHECK(mscclSetupProxy(scratch + tail->sendOffset, scratch + tail->recvOffset, op, tail->desc, comm, stream));
+  NCCLCHECK(mscclSetupKernel(scratch + tail->sendOffset, scratch + tail->recvOffset, op, tail->desc, comm, stream));
+  CUDACHECK(cudaMemcpy2DAsync((char*)recvBuff + bodyBytes, blockBytes, scratch + tail->recvOffset, paddedBytes,
+    remBytes, tail->nRecvBlocks, cudaMemcpyDeviceToDevice, stream));
+  TRACE(NCCL_COLL, "MSCCL: Ran tail of %zu elements past %zu in %d blocks", tail->remCount, tail->bodyCount,
+    std::max(tail->nSendBlocks, tail->nRecvBlocks));
+  return ncclSuccess;
+}
+
+int mscclBlockReplicas() {
+  return std::max((int)ncclParamMscclBlockReplicas(), 1);
+}
+
+bool mscclNvlsAvailable(ncclComm_t comm, int nNvlsChannels) {
+  return nNvlsChannels == 0 || (comm->nvlsSupport && comm->nvlsChannels >= nNvlsChannels);
+}
+
+// Replica r of the thread blocks of hostAlgo uses channels [r * nChannels, (r + 1) * nChannels)
+static int mscclMaxReplicas(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
+  int maxReplicas = std::min(mscclBlockReplicas(), comm->nChannels / hostAlgo->nChannels);
+  maxReplicas = std::min(maxReplicas, MSCCL_MAX_NUM_THREAD_BLOCKS / std::max(hostAlgo->nBlocks, 1));
+  // NVLS thread blocks of every replica need an NVLS channel
+  if (hostAlgo->nNvlsChannels > 0 && mscclNvlsAvailable(comm, hostAlgo->nNvlsChannels)) {
+    maxReplicas = std::min(maxReplicas, (comm->nvlsChannels - hostAlgo->nNvlsChannels) / hostAlgo->nChannels + 1);
+  }
+  return std::max(maxReplicas, 1);
+}
+
+int mscclAlgoChannels(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
+  return hostAlgo->nChannels * mscclMaxReplicas(hostAlgo, comm);
+}
+
+// NVLS thread blocks run on the NVLS connections of NCCL, only their buffers may still be missing
+static ncclResult_t mscclSetupNvls(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
+  if (hostAlgo->nNvlsChannels == 0) {
+    return ncclSuccess;
+  }
+  if (!mscclNvlsAvailable(comm, hostAlgo->nNvlsChannels)) {
+    INFO(NCCL_INIT|NCCL_NVLS, "MSCCL: algorithm needs %d NVLS channels, communicator has %d, it will not be used",
+      hostAlgo->nNvlsChannels, comm->nvlsSupport ? comm->nvlsChannels : 0);
+    return ncclSuccess;
+  }
+  int nHeads = comm->channels[0].nvls.nHeads;
+  for (int b = 0; b < hostAlgo->nBlocks; b++) {
+    struct mscclThreadBlock* tb = hostAlgo->mscclTBs + b;
+    if (tb->nvls != MSCCL_NVLS_UNICAST) continue;
+    if (tb->sendPeers[0] >= nHeads || tb->recvPeers[0] >= nHeads) {
+      WARN("MSCCL: NVLS thread block %d uses head %d, communicator has %d NVLS heads",
+        b, std::max(tb->sendPeers[0], tb->recvPeers[0]), nHeads);
+      return ncclInvalidUsage;
+    }
+  }
+  NCCLCHECK(ncclNvlsBufferSetup(comm));
   return ncclSuccess;
 }
 
+ncclRedOp_t mscclCollNetRedOp(ncclRedOp_t op) {
+  // ncclAvg and the PreMulSum ops multiply the input in the kernel, the network sums
+  return op < ncclAvg ? op : ncclSum;
+}
+
+bool mscclCollNetAvailable(ncclComm_t comm, ncclRedOp_t op, ncclDataType_t dataType) {
+  return comm->collNetSupport && comm->collNetSupportMatrix[mscclCollNetRedOp(op)][dataType];
+}
+
+// CollNet thread blocks run on the CollNet connections NCCL sets up on every channel of its heads.
+// Proxy operations of all the channels of a call are merged, they need the same number of steps.
+static ncclResult_t mscclSetupCollNet(struct mscclAlgo* hostAlgo, ncclComm_t comm, int nReplicas) {
+  const struct mscclChannelPeerInfo* first = nullptr;
+  for (int c = 0; c < hostAlgo->nChannels; c++) {
+    const struct mscclChannelInfo* mCh = hostAlgo->mscclChannels + c;
+    if (!mCh->collnet) continue;
+    if (first != nullptr && memcmp(first->nTransmissionsOfCount, mCh->collnetPeerInfo.nTransmissionsOfCount,
+        sizeof(first->nTransmissionsOfCount)) != 0) {
+      WARN("MSCCL: CollNet thread blocks of rank %d do not run the same car steps on every channel", comm->rank);
+      return ncclInvalidUsage;
+    }
+    first = &mCh->collnetPeerInfo;
+  }
+  if (first == nullptr) {
+    return ncclSuccess;
+  }
+  if (!comm->collNetSupport) {
+    INFO(NCCL_INIT|NCCL_NET, "MSCCL: algorithm needs CollNet, communicator has no CollNet support, it will not be used");
+    return ncclSuccess;
+  }
+  bool head = false;
+  for (int h = 0; h < comm->collNetHeadsNum; h++) head |= comm->collNetHeads[h] == comm->rank;
+  if (!head) {
+    WARN("MSCCL: rank %d has CollNet thread blocks but is not a CollNet head of its node", comm->rank);
+    return ncclInvalidUsage;
+  }
+  for (int c = 0; c < hostAlgo->nChannels * nReplicas; c++) {
+    struct ncclChannelPeer* peer = comm->channels[c].peers[comm->nRanks];
+    if (hostAlgo->mscclChannels[c % hostAlgo->nChannels].collnet && (!peer->send[1].connected || !peer->recv[0].connected)) {
+      WARN("MSCCL: channel %d of rank %d has no CollNet connections", c, comm->rank);
+      return ncclInternalError;
+    }
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclCheckHop(ncclComm_t comm, int channelId, const struct mscclChannelPeerInfo* info, struct ncclConnector* conn, bool send) {
+  if (info->hop == MSCCL_HOP_ANY) return ncclSuccess;
+  bool p2p = conn->transportComm == (send ? &p2pTransport.send : &p2pTransport.recv);
+  if (info->hop == MSCCL_HOP_NVLINK && !p2p) {
+    WARN("MSCCL: rank %d %s rank %d on channel %d without P2P, its thread block has hop=\"nvlink\"%s", comm->rank,
+      send ? "sends to" : "receives from", info->peer, channelId, comm->MNNVL ? "" : " and multi-node NVLink is off");
+    return ncclInvalidUsage;
+  }
+  if (info->hop == MSCCL_HOP_NET && p2p) {
+    WARN("MSCCL: rank %d %s rank %d on channel %d through P2P, its thread block has hop=\"net\"", comm->rank,
+      send ? "sends to" : "receives from", info->peer, channelId);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+// Hops an algorithm is written for must use the links it expects, a hop meant to stay in the
+// NVLink domain would otherwise silently run over the network
+static ncclResult_t mscclCheckHops(struct mscclAlgo* hostAlgo, ncclComm_t comm, int nReplicas) {
+  for (int i = 0; i < hostAlgo->nChannels * nReplicas; i++) {
+    struct mscclChannelInfo* mCh = hostAlgo->mscclChannels + i % hostAlgo->nChannels;
+    struct ncclChannel* channel = comm->channels + i;
+    for (int p = 0; p < mCh->nSendPeers; p++) {
+      const struct mscclChannelPeerInfo* info = mscclChannelSendPeer(hostAlgo, mCh, p);
+      NCCLCHECK(mscclCheckHop(comm, i, info, channel->peers[info->peer]->send, true));
+    }
+    for (int p = 0; p < mCh->nRecvPeers; p++) {
+      const struct mscclChannelPeerInfo* info = mscclChannelRecvPeer(hostAlgo, mCh, p);
+      NCCLCHECK(mscclCheckHop(comm, i, info, channel->peers[info->peer]->recv, false));
+    }
+  }
+  return ncclSuccess;
+}
+
+NCCL_PARAM(MscclClusterFlags, "MSCCL_CLUSTER_FLAGS", 1);
+
+// Dependencies of the kernel waited on in distributed shared memory are between thread blocks
+// of the same cluster, that is of consecutive thread blocks, the order is up to the algorithm
+static void mscclReportClusterDeps(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
+  int clusterSize = comm->config.cgaClusterSize;
+  if (comm->compCap != 90 || clusterSize <= 1 || !ncclParamMscclClusterFlags()) return;
+  int nDeps = 0, nClusterDeps = 0;
+  for (int b = 0; b < hostAlgo->nBlocks; b++) {
+    struct mscclThreadBlock* tb = hostAlgo->mscclTBs + b;
+    for (int i = 0; i < tb->nSteps; i++) {
+      struct mscclTransmission* t = tb->transmissions + i;
+      for (int d = 0; d < t->numDependencies; d++) {
+        nDeps++;
+        if (tb->dependentBid[t->dependencePointer + d] / clusterSize == b / clusterSize) nClusterDeps++;
+      }
+    }
+  }
+  if (nDeps > 0) {
+    INFO(NCCL_INIT, "MSCCL: %d of %d dependencies of the algorithm within clusters of %d thread blocks",
+      nClusterDeps, nDeps, clusterSize);
+  }
+}
+
 ncclResult_t mscclSetupConnections(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
-  mscclStatus& status = mscclGetStatus();
+  mscclCommStatus& status = mscclGetCommStatus(comm);
 
   // Check whether there are enough channels
   if (hostAlgo->nChannels > comm->nChannels) {
     WARN("MSCCL: number of channels available (%d) less than required (%d)", comm->nChannels, hostAlgo->nChannels);
     return ncclInvalidUsage;
   }
+  // Mismatched sends and receives between peers would hang the kernel
+  NCCLCHECK(mscclValidateAlgoPeers(hostAlgo, comm));
 
-  // Flag MSCCL connections
-  for (int i = 0; i < hostAlgo->nChannels; i++) {
-    struct mscclChannelInfo* mCh = hostAlgo->mscclChannels + i;
+  // Flag MSCCL connections, replicas connect the same peers on their own channels
+  int nReplicas = mscclMaxReplicas(hostAlgo, comm);
+  for (int i = 0; i < hostAlgo->nChannels * nReplicas; i++) {
+    struct mscclChannelInfo* mCh = hostAlgo->mscclChannels + i % hostAlgo->nChannels;
 
-    int sendPeers[MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL];
+    int sendPeers[MSCCL_MAX_CHANNEL_PEERS];
     for (int p = 0; p < mCh->nSendPeers; p++) {
-      sendPeers[p] = mCh->sendPeerInfo[p].peer;
+      sendPeers[p] = mscclChannelSendPeer(hostAlgo, mCh, p)->peer;
     }
 
-    int recvPeers[MSCCL_MAX_NUM_THREAD_BLOCKS_PER_CHANNEL];
+    int recvPeers[MSCCL_MAX_CHANNEL_PEERS];
     for (int p = 0; p < mCh->nRecvPeers; p++) {
-      recvPeers[p] = mCh->recvPeerInfo[p].peer;
+      recvPeers[p] = mscclChannelRecvPeer(hostAlgo, mCh, p)->peer;
     }
 
     NCCLCHECK(ncclTransportP2pConnect(comm, i, mCh->nRecvPeers, recvPeers, mCh->nSendPeers, sendPeers, 0 /*connIndex*/));
@@ -120,97 +775,240 @@ ncclResult_t mscclSetupConnections(struct mscclAlgo* hostAlgo, ncclComm_t comm)
   status.needsFence |= highestTransportType > TRANSPORT_P2P;
   status.needsProxy |= needsProxy;
   mscclClearIsCallerFlag();
+  NCCLCHECK(mscclCheckHops(hostAlgo, comm, nReplicas));
+
+  NCCLCHECK(mscclSetupNvls(hostAlgo, comm));
+  NCCLCHECK(mscclSetupCollNet(hostAlgo, comm, nReplicas));
+  NCCLCHECK(mscclDirectSetup(hostAlgo, comm, nReplicas));
+  mscclReportClusterDeps(hostAlgo, comm);
+
+  // A reloaded algorithm may reuse the handle and the address of an unloaded one
+  struct mscclLaunchCache* cache = status.launchCache;
+  if (cache != nullptr) {
+    for (auto it = cache->lru.begin(); it != cache->lru.end();) {
+      if (it->second.hostAlgo == hostAlgo) {
+        cache->index.erase(it->first);
+        it = cache->lru.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
 
   return ncclSuccess;
 }
 
-static ncclResult_t mscclSetupProxyImpl(struct mscclAlgo* hostAlgo, ncclComm_t comm) {
-  mscclStatus& status = mscclGetStatus();
+static int mscclPeerSteps(struct mscclChannelPeerInfo* peerInfo, uint32_t maxAllowedCount) {
+  int nSteps = 0;
+  for (int j = 0; j < peerInfo->nExistingCounts; j++) {
+    int c = peerInfo->existingCounts[j];
+    nSteps += peerInfo->nTransmissionsOfCount[c] * DIVUP(c, maxAllowedCount);
+  }
+  return nSteps;
+}
+
+// Loops of a call run by replica r, the kernel splits them the same way
+static int mscclReplicaLoops(int nLoops, int nReplicas, int r) {
+  return (int)((int64_t)(r + 1) * nLoops / nReplicas - (int64_t)r * nLoops / nReplicas);
+}
+
+static ncclResult_t mscclAddPeerOp(ncclComm_t comm, const struct mscclProxyParams* params, int channelId, int nLoops, int type,
+    int protocol, struct mscclChannelPeerInfo* peerInfo, std::vector<struct mscclProxyPeerOp>* peerOps) {
+  struct ncclChannelPeer* peer = comm->channels[channelId].peers[peerInfo->peer];
+  struct ncclConnector* connector = type == proxyRecv ? peer->recv : peer->send;
+  // Same tests as SaveProxy, connections without a progress function never get proxy operations
+  if (connector->transportComm == NULL) {
+    WARN("MSCCL: rank %d has no transport for %s peer %d on channel %d", comm->rank,
+      type == proxyRecv ? "recv" : "send", peerInfo->peer, channelId);
+    return ncclInternalError;
+  }
+  if (connector->proxyConn.proxyProgress == NULL) return ncclSuccess;
+  // every loop runs one primitive call of the protocol of the channel per chunk step
+  int nsteps = nLoops * params->chunkSteps[protocol] * mscclPeerSteps(peerInfo, params->maxAllowedCount);
+  if (nsteps > 0) {
+    peerOps->push_back({&connector->proxyConn, channelId, protocol, peerInfo->peer, nsteps});
+  }
+  return ncclSuccess;
+}
+
+// CollNet thread blocks receive on connection 0 of the CollNet peer of their channel and send on 1.
+// The kernel splits every call of a car in MSCCL_CHUNKSTEPS steps, empty ones included.
+static void mscclAddCollNetOps(ncclComm_t comm, const struct mscclProxyParams* params, int channelId, int nLoops,
+    struct mscclChannelPeerInfo* peerInfo, std::vector<struct mscclProxyPeerOp>* peerOps) {
+  struct ncclChannelPeer* peer = comm->channels[channelId].peers[comm->nRanks];
+  int nsteps = nLoops * MSCCL_CHUNKSTEPS * mscclPeerSteps(peerInfo, params->maxAllowedCount);
+  struct ncclConnector* connectors[2] = { peer->recv + 0, peer->send + 1 };
+  for (struct ncclConnector* connector : connectors) {
+    if (nsteps == 0 || connector->transportComm == NULL || connector->proxyConn.proxyProgress == NULL) continue;
+    peerOps->push_back({&connector->proxyConn, channelId, NCCL_PROTO_SIMPLE, comm->nRanks, nsteps, true});
+  }
+}
+
+// Loops of a call, the kernel only moves whole elements per chunk and leaves the rest to the tail
+static int mscclCallLoops(struct mscclAlgo* hostAlgo, const struct mscclProxyParams* params) {
+  size_t typeSize = ncclTypeSize(params->dataType);
+  size_t chunkBytes = params->nBytes / typeSize / hostAlgo->nChunksPerLoop * typeSize;
+  return (int)DIVUP(chunkBytes, (size_t)params->chunkEffectiveSize);
+}
+
+// Proxy operations of a call of hostAlgo with params, in the order they are queued
+static ncclResult_t mscclGetProxyPeerOps(struct mscclAlgo* hostAlgo, ncclComm_t comm, const struct mscclProxyParams* params,
+    std::vector<struct mscclProxyPeerOp>* peerOps) {
+  peerOps->clear();
+  int nLoops = mscclCallLoops(hostAlgo, params);
+  for (int r = 0; r < params->nReplicas; r++) {
+    int replicaLoops = mscclReplicaLoops(nLoops, params->nReplicas, r);
+    for (int c = 0; c < hostAlgo->nChannels; c++) {
+      struct mscclChannelInfo* mscclChannel = hostAlgo->mscclChannels + c;
+      int ch = r * hostAlgo->nChannels + c;
+      for (int i = 0; i < mscclChannel->nRecvPeers; i++) {
+        NCCLCHECK(mscclAddPeerOp(comm, params, ch, replicaLoops, proxyRecv, mscclChannel->protocol, mscclChannelRecvPeer(hostAlgo, mscclChannel, i), peerOps));
+      }
+      for (int i = 0; i < mscclChannel->nSendPeers; i++) {
+        NCCLCHECK(mscclAddPeerOp(comm, params, ch, replicaLoops, proxySend, mscclChannel->protocol, mscclChannelSendPeer(hostAlgo, mscclChannel, i), peerOps));
+      }
+      if (mscclChannel->collnet) {
+        mscclAddCollNetOps(comm, params, ch, replicaLoops, &mscclChannel->collnetPeerInfo, peerOps);
+      }
+    }
+  }
+  return ncclSuccess;
+}
+
+// Profiler view of a call of desc on sendBuff and recvBuff
+static void mscclGetProfilerTask(const void* sendBuff, void* recvBuff, ncclRedOp_t op, const struct mscclLaunchDesc* desc,
+    ncclComm_t comm, struct ncclProfilerMscclTask* task) {
+  struct mscclAlgo* hostAlgo = desc->hostAlgo;
+  *task = {};
+  task->comm = comm;
+  switch (hostAlgo->func) {
+    case mscclFuncReduce: task->func = ncclFuncReduce; break;
+    case mscclFuncBroadcast: task->func = ncclFuncBroadcast; break;
+    case mscclFuncAllReduce: task->func = ncclFuncAllReduce; break;
+    case mscclFuncReduceScatter: task->func = ncclFuncReduceScatter; break;
+    case mscclFuncAllGather: task->func = ncclFuncAllGather; break;
+    default: task->func = ncclFuncSendRecv; break;
+  }
+  task->sendBuff = sendBuff;
+  task->recvBuff = recvBuff;
+  task->count = desc->work.blockStride;
+  task->datatype = desc->proxy.dataType;
+  task->op = op;
+  task->trafficBytes = desc->proxy.nBytes;
+  task->nChannels = hostAlgo->nChannels * desc->proxy.nReplicas;
+  task->nWarps = desc->block.x / WARP_SIZE;
+  task->proto = hostAlgo->protocol;
+  task->algoName = desc->algoName.c_str();
+  task->algoHandle = desc->handle;
+  task->nBlocks = desc->grid.x;
+}
+
+// Queue the proxy operations of one collective, posted by the next ncclProxyStart
+static ncclResult_t mscclSaveProxyOps(ncclComm_t comm, const struct mscclProxyParams* params,
+    const std::vector<struct mscclProxyPeerOp>& peerOps, const struct ncclProfilerMscclTask* task) {
+  const struct mscclProxyParams& status = *params;
   struct ncclProxyOp proxyOp = {};
 
   // proxyOp.connIndex = 0;
-  proxyOp.sliceSteps = status.sliceSteps;
-  proxyOp.chunkSteps = status.chunkSteps;
-  proxyOp.chunkSize = status.chunkSize;
-  proxyOp.protocol = hostAlgo->protocol;
+  proxyOp.rank = comm->rank;
+  proxyOp.profilerContext = comm->profilerContext;
+  proxyOp.eActivationMask = task->eActivationMask;
+  proxyOp.taskEventHandle = task->eventHandle;
+  ncclProfilerAddPidToProxyOp(&proxyOp);
   proxyOp.dtype = status.dataType;
-  proxyOp.redOp = 0;
-  proxyOp.pattern = 0;
   proxyOp.root = 0;
-  proxyOp.nbytes = status.stepSize*proxyOp.sliceSteps;
   proxyOp.opCount = comm->sharedRes->collOpCount;
-  int nLoops = (int)(DIVUP(status.nBytes, (size_t)((size_t)hostAlgo->nChunksPerLoop*(size_t)status.chunkEffectiveSize)));
-  int nLoopsChunkSteps = nLoops * status.chunkSteps;
-  for (int ch = 0; ch < hostAlgo->nChannels; ch++) {
-    proxyOp.channelId = ch;
-    struct mscclChannelInfo* mscclChannel = hostAlgo->mscclChannels + ch;
-    struct ncclChannel* ncclChannel = comm->channels + ch;
-    for (int i = 0; i < mscclChannel->nRecvPeers; i++){
-      struct mscclChannelPeerInfo* recvPeer = mscclChannel->recvPeerInfo + i;
-      int nRecvs = 0;
-      for (int j = 0; j < recvPeer->nExistingCounts; j++){
-        int c = recvPeer->existingCounts[j];
-        int nStepsInCount = DIVUP(c, status.maxAllowedCount);
-        nRecvs += recvPeer->nTransmissionsOfCount[c] * nStepsInCount;
-      }
-      proxyOp.nsteps = nLoopsChunkSteps * nRecvs;
-      if (proxyOp.nsteps > 0) {
-        NCCLCHECK(mscclSaveProxy(comm, ncclChannel, proxyRecv, recvPeer->peer, &proxyOp, 0));
-      }
-    }
-    for (int i=0; i<mscclChannel->nSendPeers; i++){
-      struct mscclChannelPeerInfo* sendPeer = &mscclChannel->sendPeerInfo[i];
-      int nSends = 0;
-      for (int j = 0; j < sendPeer->nExistingCounts; j++){
-        int c = sendPeer->existingCounts[j];
-        int nStepsInCount = DIVUP(c, status.maxAllowedCount);
-        nSends += sendPeer->nTransmissionsOfCount[c] * nStepsInCount;
-      }
-      proxyOp.nsteps = nLoopsChunkSteps * nSends;
-      if (proxyOp.nsteps > 0) {
-        NCCLCHECK(mscclSaveProxy(comm, ncclChannel, proxySend, sendPeer->peer, &proxyOp, 0));
-      }
+  for (const struct mscclProxyPeerOp& peerOp : peerOps) {
+    int p = peerOp.protocol;
+    proxyOp.sliceSteps = status.sliceSteps[p];
+    proxyOp.chunkSteps = status.chunkSteps[p];
+    proxyOp.chunkSize = status.chunkSize[p];
+    proxyOp.protocol = p;
+    proxyOp.nbytes = status.stepSize[p]*proxyOp.sliceSteps;
+    proxyOp.redOp = 0;
+    proxyOp.pattern = 0;
+    proxyOp.coll = 0;
+    if (peerOp.collNet) {
+      // the steps of the CollNet chain of NCCL, every one of them is allreduced by the network
+      proxyOp.sliceSteps = proxyOp.chunkSteps = 1;
+      proxyOp.chunkSize = proxyOp.nbytes = status.stepSize[p];
+      proxyOp.redOp = mscclCollNetRedOp(task->op);
+      proxyOp.pattern = ncclPatternCollnetChain;
+      proxyOp.coll = ncclFuncAllReduce;
     }
+    proxyOp.channelId = peerOp.channelId;
+    proxyOp.peer = peerOp.peer;
+    proxyOp.nsteps = peerOp.nsteps;
+    NCCLCHECK(mscclAppendProxyOp(comm, peerOp.proxyConn, &proxyOp));
   }
-  NCCLCHECK(ncclProxyStart(comm));
   comm->sharedRes->collOpCount++;
   return ncclSuccess;
 }
 
-
 static void CUDART_CB mscclSetupProxyCallback(void *args) {
-  std::vector<struct mscclProxyArg>* params = (std::vector<struct mscclProxyArg>*)args;
-  INFO(NCCL_INIT|NCCL_NET,"mscclSetupProxyCallback: proxy args size: %ld\n", params->size());
-  for (auto &p : *params) {
-    mscclSetupProxyImpl(p.hostAlgo, p.comm);
-  }    
+  struct mscclProxyArg* arg = (struct mscclProxyArg*)args;
+  ncclProfilerStartMscclEvents(&arg->profilerTask);
+  ncclResult_t result = mscclSaveProxyOps(arg->comm, &arg->params, arg->peerOps, &arg->profilerTask);
+  if (result == ncclSuccess) result = ncclProxyStart(arg->comm);
+  ncclProfilerStopMscclEvents(&arg->profilerTask);
+  if (result != ncclSuccess) {
+    WARN("mscclSetupProxyCallback() failed : %s", ncclGetErrorString(result));
+  }
+  if (!arg->persistent) delete arg;
 }
 
-ncclResult_t mscclSetupProxy(struct mscclAlgo* hostAlgo, ncclComm_t comm, cudaStream_t stream) {
-  mscclStatus& status = mscclGetStatus();
+ncclResult_t mscclSetupProxy(const void* sendBuff, void* recvBuff, ncclRedOp_t op,
+    const struct mscclLaunchDesc* desc, ncclComm_t comm, cudaStream_t stream) {
   mscclThreadLocalStatus& threadLocalStatus = mscclGetThreadLocalStatus();
-  mscclSavedProxyArgs& savedProxyArgs = mscclGetSavedProxyArgs();
-  if (threadLocalStatus.captureStatus == mscclNoCapture) {
-    INFO(NCCL_INIT|NCCL_NET,"mscclSetupProxy: no capture\n");
-    NCCLCHECK(mscclSetupProxyImpl(hostAlgo, comm));
-  } else if (status.needsProxy) {
-    INFO(NCCL_INIT|NCCL_NET,"mscclSetupProxy: capture\n");
-    if (savedProxyArgs[threadLocalStatus.captureId].size() == 0) {
-      INFO(NCCL_INIT|NCCL_NET,"mscclSetupProxy: adding callback\n");
-
-      cudaGraphNode_t callbackNode;
-      cudaHostNodeParams p;
-      p.fn = mscclSetupProxyCallback;
-      auto params = &savedProxyArgs[threadLocalStatus.captureId];
-      p.userData = params;
-      CUDACHECK(cudaGraphAddHostNode(&callbackNode, threadLocalStatus.graph, nullptr, 0, &p));
+  bool capturing = threadLocalStatus.captureStatus != mscclNoCapture;
+  struct ncclProfilerMscclTask task;
+  mscclGetProfilerTask(sendBuff, recvBuff, op, desc, comm, &task);
+  // Pure P2P/NVLS algorithms have nothing for the proxy, the kernel drives all transfers
+  if (desc->peerOps.empty()) {
+    if (!capturing) {
+      comm->sharedRes->collOpCount++;
+      NCCLCHECK(ncclProfilerStartMscclEvents(&task));
+      NCCLCHECK(ncclProfilerStopMscclEvents(&task));
     }
-    mscclGetSavedProxyArgs()[threadLocalStatus.captureId].emplace_back(hostAlgo, comm);
+    return ncclSuccess;
+  }
+  if (!capturing && comm->persistentRefs == 0) {
+    NCCLCHECK(ncclProfilerStartMscclEvents(&task));
+    NCCLCHECK(mscclSaveProxyOps(comm, &desc->proxy, desc->peerOps, &task));
+    NCCLCHECK(ncclProxyStart(comm));
+    NCCLCHECK(ncclProfilerStopMscclEvents(&task));
+    return ncclSuccess;
+  }
+
+  // Captured proxy operations are posted by host tasks of the host stream on every replay.
+  // While graphs of comm are alive, other proxy operations go through it too to keep their order.
+  struct mscclProxyArg* arg;
+  struct ncclCudaGraph graph = ncclCudaGraphNone();
+  if (capturing) {
+    std::lock_guard<std::mutex> lock(mscclSavedProxyArgsMutex);
+    struct mscclCapturedGraph* captured = mscclGetSavedProxyArgs()[std::make_pair(threadLocalStatus.captureId, comm)];
+    captured->proxyArgs.emplace_back();
+    arg = &captured->proxyArgs.back();
+    graph.graph = threadLocalStatus.graph;
+    graph.graphId = threadLocalStatus.captureId;
+  } else {
+    arg = new mscclProxyArg();
   }
+  arg->comm = comm;
+  arg->params = desc->proxy;
+  arg->peerOps = desc->peerOps;
+  arg->persistent = capturing;
+  arg->profilerTask = task;
+
+  struct ncclStrongStream* hostStream = &comm->sharedRes->hostStream;
+  NCCLCHECK(ncclStrongStreamAcquire(graph, hostStream));
+  NCCLCHECK(ncclStrongStreamLaunchHost(graph, hostStream, mscclSetupProxyCallback, arg));
+  NCCLCHECK(ncclStrongStreamWaitStream(graph, stream, hostStream));
+  NCCLCHECK(ncclStrongStreamRelease(graph, hostStream));
   return ncclSuccess;
 }
 
-static ncclResult_t hostToDevRedOp(
+ncclResult_t mscclHostToDevRedOp(
     ncclDevRedOpFull *opFull, ncclRedOp_t op, ncclDataType_t datatype, ncclComm *comm
   ) {
   union {
@@ -239,7 +1037,10 @@ static ncclResult_t hostToDevRedOp(
   uint64_t signBit = allBits^(allBits>>1);
   
   switch (int(op)) {
-  case ncclSum:  opFull->op = ncclDevSum;  break;
+  case ncclSum:
+    opFull->op = ncclDevSum;
+    opFull->scalarArg = ncclRedOpRoundingArg(datatype);
+    break;
   case ncclProd: opFull->op = ncclDevProd; break;
   case ncclMax:
   case ncclMin:
@@ -289,7 +1090,7 @@ static ncclResult_t hostToDevRedOp(
       break;
     }
     opFull->scalarArgIsPtr = false;
-    opFull->scalarArg = u64;
+    opFull->scalarArg = u64 | ncclRedOpRoundingArg(datatype);
     break;
   default: // user created
     int ix = int(ncclUserRedOpMangle(comm, op)) - int(ncclNumOps);
@@ -404,18 +1205,111 @@ void* mscclKernelEntries[ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS] =
   MSCCL_KERNEL_ENTRY()
 };
 
+#if defined(MSCCL_SPECIALIZE_KERNELS)
+#undef MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE
+#define MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE(devredop, type) \
+  (void *)MSCCL_P2P_KERNEL_ENTRY_NAME(devredop, type, LL), \
+  (void *)MSCCL_P2P_KERNEL_ENTRY_NAME(devredop, type, LL128), \
+  (void *)MSCCL_P2P_KERNEL_ENTRY_NAME(devredop, type, Simple)
+
+// Same layout as mscclKernelEntries, for algorithms within MSCCL_OP_MASK_P2P
+void* mscclP2pKernelEntries[ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS] = {
+  MSCCL_KERNEL_ENTRY()
+};
+#endif
+
+#if defined(MSCCL_FAN_KERNELS)
+#undef MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE
+#define MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE(devredop, type) \
+  (void *)MSCCL_FAN_KERNEL_ENTRY_NAME(devredop, type, LL), \
+  (void *)MSCCL_FAN_KERNEL_ENTRY_NAME(devredop, type, LL128), \
+  (void *)MSCCL_FAN_KERNEL_ENTRY_NAME(devredop, type, Simple)
+
+// Same layout as mscclKernelEntries, for algorithms with fan types
+void* mscclFanKernelEntries[ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS] = {
+  MSCCL_KERNEL_ENTRY()
+};
+#endif
+
+#if defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+#undef MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE
+#define MSCCL_KERNEL_ENTRY_DEVREDOP_TYPE(devredop, type) \
+  (void *)MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type), \
+  (void *)MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type), \
+  (void *)MSCCL_MIXED_KERNEL_ENTRY_NAME(devredop, type)
+
+// Same layout as mscclKernelEntries, for algorithms mixing protocols. Every protocol of a type
+// holds the same kernel, which runs the protocol of each thread block.
+void* mscclMixedKernelEntries[ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS] = {
+  MSCCL_KERNEL_ENTRY()
+};
+#endif
+
+#define MSCCL_COPY_KERNEL_ENTRY_TYPE(type) \
+  (void *)MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL), \
+  (void *)MSCCL_COPY_KERNEL_ENTRY_NAME(type, LL128), \
+  (void *)MSCCL_COPY_KERNEL_ENTRY_NAME(type, Simple)
+
+// Indexed by log2 of the type size and protocol, for algorithms within MSCCL_OP_MASK_COPY.
+// Padded to the size of the other tables.
+static void* mscclCopyKernelEntries[ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS] = {
+  MSCCL_COPY_KERNEL_ENTRY_TYPE(uint8_t),
+  MSCCL_COPY_KERNEL_ENTRY_TYPE(half),
+  MSCCL_COPY_KERNEL_ENTRY_TYPE(uint32_t),
+  MSCCL_COPY_KERNEL_ENTRY_TYPE(uint64_t)
+};
+
+static void** mscclKernelTables[] = {
+  mscclKernelEntries,
+  mscclCopyKernelEntries,
+#if defined(MSCCL_SPECIALIZE_KERNELS)
+  mscclP2pKernelEntries,
+#endif
+#if defined(MSCCL_FAN_KERNELS)
+  mscclFanKernelEntries,
+#endif
+#if defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+  mscclMixedKernelEntries,
+#endif
+};
+
+static std::mutex mscclKernelInitMutex;
+// Devices and kernels with their attributes set
+static std::set<std::pair<int, void*>> mscclKernelsReady;
+
+static ncclResult_t mscclInitKernel(int cudaArch, void* fn) {
+  ncclResult_t result = ncclSuccess;
+  int carveout = getEnvInt("NCCL_L1_SHARED_MEMORY_CARVEOUT", 0);
+  if (carveout) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
+      result, ignore);
+  ignore:;
+  }
+  if (ncclShmemDynamicSize(cudaArch) != 0) {
+    CUDACHECKGOTO(cudaFuncSetAttribute(fn,
+      cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
+      result, exit);
+  }
+exit:
+  return result;
+}
+
 // Returns maximum kernel stack size of all CUDA kernels
-ncclResult_t mscclInitKernelsForDevice(int cudaArch, size_t* maxStackSize) {
+ncclResult_t mscclInitKernelsForDevice(int cudaDev, int cudaArch, size_t* maxStackSize) {
   constexpr int KernelCount = ncclNumDevRedOps * ncclNumTypes * NCCL_NUM_PROTOCOLS;
+  constexpr int TableCount = sizeof(mscclKernelTables) / sizeof(mscclKernelTables[0]);
   ncclResult_t result = ncclSuccess;
 
   if (maxStackSize) *maxStackSize = 0;
-  int carveout = getEnvInt("NCCL_L1_SHARED_MEMORY_CARVEOUT", 0);
+  // Nothing to do when the kernels are set up on first use and the stack sizes are not needed
+  if (maxStackSize == NULL && ncclParamLazyKernelInit()) return ncclSuccess;
+  std::lock_guard<std::mutex> lock(mscclKernelInitMutex);
   // Keep track if we already visited a function pointer.
   void* lru[2] = {nullptr, nullptr};
-  for (int i=0; i < KernelCount; i++) {
-    void* fn = mscclKernelEntries[i];
-    if (fn == lru[0] || fn == lru[1] || fn == nullptr) goto next_kernel;
+  for (int i=0; i < KernelCount * TableCount; i++) {
+    void* fn = mscclKernelTables[i / KernelCount][i % KernelCount];
+    if (fn == lru[0] || fn == lru[1] || fn == nullptr) continue;
     lru[1] = lru[0];
     lru[0] = fn;
 
@@ -426,64 +1320,225 @@ ncclResult_t mscclInitKernelsForDevice(int cudaArch, size_t* maxStackSize) {
     ignore0:;
     }
 
-    if (carveout) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributePreferredSharedMemoryCarveout, carveout),
-        result, ignore1);
-    ignore1:;
+    if (!ncclParamLazyKernelInit() && mscclKernelsReady.insert({cudaDev, fn}).second) {
+      ncclResult_t res = mscclInitKernel(cudaArch, fn);
+      if (res != ncclSuccess) result = res;
     }
-
-    if (ncclShmemDynamicSize(cudaArch) != 0) {
-      CUDACHECKGOTO(cudaFuncSetAttribute(fn,
-        cudaFuncAttributeMaxDynamicSharedMemorySize, ncclShmemDynamicSize(cudaArch)),
-        result, next_kernel);
-    }
-  next_kernel:;
   }
   return result;
 }
 
-ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, size_t count,
-    ncclDataType_t dataType, ncclRedOp_t op, struct mscclAlgo* hostAlgo, struct mscclAlgo* devAlgo,
-    ncclComm_t comm, cudaStream_t stream) {
-  mscclStatus& status = mscclGetStatus();
-  
-  if (status.lastStream != stream && status.lastStream != nullptr) {
-    INFO(NCCL_INIT|NCCL_NET, "mscclSetupKernel - Waiting for last stream to finish");
-    // TODO: Wait for last stream to finish, will refactor this later
-    // CUDACHECK(cudaStreamWaitEvent(stream, comm->doneEvent, 0));
+static ncclResult_t mscclPrepareKernel(struct ncclComm* comm, void* fn) {
+  if (fn == nullptr) return ncclSuccess;
+  std::lock_guard<std::mutex> lock(mscclKernelInitMutex);
+  if (!mscclKernelsReady.insert({comm->cudaDev, fn}).second) return ncclSuccess;
+  return mscclInitKernel(comm->cudaArch, fn);
+}
+
+NCCL_PARAM(MscclChunkMinLoops, "MSCCL_CHUNK_MIN_LOOPS", 4);
+NCCL_PARAM(MscclChunkMinBytes, "MSCCL_CHUNK_MIN_BYTES", 128 << 10);
+
+// Calls of a few chunks run in too few loops for the steps of the algorithm to pipeline. Their
+// SIMPLE chunks are halved until a call has NCCL_MSCCL_CHUNK_MIN_LOOPS loops or a chunk would be
+// under NCCL_MSCCL_CHUNK_MIN_BYTES. Primitive calls keep their MSCCL_CHUNKSTEPS steps, which each
+// carry less. Chunks stay multiples of what the kernel rounds them up to, so loops never overlap.
+static void mscclAdaptChunkSize(struct mscclAlgo* hostAlgo, int nThreads, struct mscclProxyParams* proxy) {
+  int grain = (nThreads - WARP_SIZE) * sizeof(uint64_t);
+  int64_t minBytes = std::max<int64_t>(ncclParamMscclChunkMinBytes(), grain);
+  while (mscclCallLoops(hostAlgo, proxy) < ncclParamMscclChunkMinLoops()) {
+    int chunkSize = proxy->chunkEffectiveSize / 2 / grain * grain;
+    if (chunkSize < minBytes) break;
+    proxy->chunkEffectiveSize = chunkSize;
   }
+}
 
-  dim3 grid = {(uint32_t)hostAlgo->nBlocks, 1, 1};
-  dim3 block;
-  if (hostAlgo->protocol == NCCL_PROTO_SIMPLE) {
-    block = {NCCL_SIMPLE_MAX_NTHREADS + WARP_SIZE, 1, 1};
+static ncclResult_t mscclInitLaunchDesc(struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo, ncclComm_t comm,
+    size_t count, ncclDataType_t dataType, struct mscclLaunchDesc* desc) {
+  struct mscclProxyParams& proxy = desc->proxy;
+  // several protocols only pass mscclCheckProtocols in builds with mixed protocol kernels
+  bool mixed = (hostAlgo->protocolMask & (hostAlgo->protocolMask - 1)) != 0;
+  if (!mixed && hostAlgo->protocol == NCCL_PROTO_SIMPLE) {
+    desc->block = {NCCL_SIMPLE_MAX_NTHREADS + WARP_SIZE, 1, 1};
   }
   else
   {
-    block = {NCCL_MAX_NTHREADS, 1, 1};
+    // Simple thread blocks of mixed kernels run with all the threads, as NCCL trees do
+    desc->block = {NCCL_MAX_NTHREADS, 1, 1};
+  }
+  if (comm->config.maxCTAThreads > 0) desc->block.x = std::min<uint32_t>(desc->block.x, comm->config.maxCTAThreads);
+
+  // Thread blocks of all the protocols iterate over chunks of the same size, the smallest they can move
+  proxy.chunkEffectiveSize = 0;
+  for (int p = 0; p < NCCL_NUM_PROTOCOLS; p++) {
+    if ((hostAlgo->protocolMask & (1 << p)) == 0) continue;
+    proxy.stepSize[p] = comm->buffSizes[p] / NCCL_STEPS;
+    // Primitive calls of the kernel move MSCCL_CHUNKSTEPS steps of SIMPLE buffers, whatever the collective
+    proxy.chunkSteps[p] = p == NCCL_PROTO_SIMPLE ? MSCCL_CHUNKSTEPS : 1;
+    proxy.sliceSteps[p] = p == NCCL_PROTO_SIMPLE ? MSCCL_SLICESTEPS : 1;
+    proxy.chunkSize[p] = proxy.stepSize[p] * proxy.chunkSteps[p];
+    int chunkEffectiveSize = proxy.chunkSize[p];
+    if (p == NCCL_PROTO_LL) chunkEffectiveSize /= 2;
+    if (p == NCCL_PROTO_LL128) chunkEffectiveSize = (proxy.chunkSize[p] / NCCL_LL128_LINEELEMS) * NCCL_LL128_DATAELEMS;
+    if (proxy.chunkEffectiveSize == 0 || chunkEffectiveSize < proxy.chunkEffectiveSize) {
+      proxy.chunkEffectiveSize = chunkEffectiveSize;
+    }
+  }
+  proxy.dataType = dataType;
+  proxy.nBytes = count * ncclTypeSize(proxy.dataType) * hostAlgo->sizeMultiplier;
+  if (!mixed && hostAlgo->protocol == NCCL_PROTO_SIMPLE) mscclAdaptChunkSize(hostAlgo, desc->block.x, &proxy);
+  proxy.maxAllowedCount = std::max((uint32_t)1, (uint32_t)(proxy.chunkEffectiveSize / DIVUP(proxy.nBytes, (size_t)(hostAlgo->nChunksPerLoop))));
+  if (proxy.maxAllowedCount == 0){
+    WARN("MSCCL: something went wrong. Max allowed count is 0\n");
+    return ncclInternalError;
+  }
+  if (proxy.maxAllowedCount >= MSCCL_MAX_COUNT) {
+    proxy.maxAllowedCount = MSCCL_MAX_COUNT - 1;
+  }
+  // Consecutive chunks of a step are apart when the blocks of the buffers have a tail
+  if (mscclHasTail(hostAlgo, count)) {
+    proxy.maxAllowedCount = 1;
+  }
+
+  // Each replica needs a loop of its own, calls of a single loop keep the latency of one thread block
+  int nLoops = mscclCallLoops(hostAlgo, &proxy);
+  proxy.nReplicas = std::max(1, std::min(mscclMaxReplicas(hostAlgo, comm), nLoops));
+
+  desc->hostAlgo = hostAlgo;
+  desc->scratchSize = (proxy.nBytes * (size_t)(hostAlgo->nScratchChunks)) / (size_t)(hostAlgo->nChunksPerLoop);
+  NCCLCHECK(mscclGetProxyPeerOps(hostAlgo, comm, &proxy, &desc->peerOps));
+  desc->grid = {(uint32_t)(hostAlgo->nBlocks * proxy.nReplicas), 1, 1};
+  // Algorithms within the transmission types of a specialized kernel run it instead of the generic one
+  void** entries = mscclKernelEntries;
+#if defined(MSCCL_MIXED_PROTOCOL_KERNELS)
+  if (mixed) entries = mscclMixedKernelEntries;
+#endif
+  int opMask = 0;
+  for (int b = 0; b < hostAlgo->nBlocks; b++) {
+    struct mscclThreadBlock* tb = hostAlgo->mscclTBs + b;
+    for (int i = 0; i < tb->nSteps; i++) {
+      opMask |= MSCCL_OP_BIT(tb->transmissions[i].type);
+    }
+    // s and r of NVLS thread blocks run on NVLS primitives
+    if (tb->nvls != MSCCL_NVLS_NONE) opMask |= MSCCL_OP_MASK_NVLS;
+  }
+#if defined(MSCCL_SPECIALIZE_KERNELS)
+  if ((opMask & ~MSCCL_OP_MASK_P2P) == 0 && !mixed) {
+    entries = mscclP2pKernelEntries;
+  }
+#endif
+#if defined(MSCCL_FAN_KERNELS)
+  if ((opMask & MSCCL_OP_MASK_FAN) != 0 && !mixed) {
+    entries = mscclFanKernelEntries;
   }
+#endif
+  // Algorithms only moving data share the kernels of the types of their size, whatever the op
+  bool copy = !mixed && !hostAlgo->hasReduce && (opMask & ~MSCCL_OP_MASK_COPY) == 0;
+  int sizeLog2 = log2i(ncclTypeSize(dataType));
+  for (int op = 0; op < ncclNumDevRedOps; op++) {
+    desc->funcs[op] = entries[(op * ncclNumTypes + dataType) * NCCL_NUM_PROTOCOLS + hostAlgo->protocol];
+    // PreMulSum scales what steps read from the input, so it is not a copy
+    if (copy && op != ncclDevPreMulSum && desc->funcs[op] != nullptr) {
+      desc->funcs[op] = mscclCopyKernelEntries[sizeLog2 * NCCL_NUM_PROTOCOLS + hostAlgo->protocol];
+    }
+    NCCLCHECK(mscclPrepareKernel(comm, desc->funcs[op]));
+  }
+
+  struct mscclWork* work = &desc->work;
+  memset(work, 0, sizeof(*work));
+  work->algo = devAlgo;
+  work->count = count * hostAlgo->sizeMultiplier; // count is sum of all ranks in MSCCL kernel
+  work->nChunksPerLoop = hostAlgo->nChunksPerLoop;
+  work->maxAllowedCount = proxy.maxAllowedCount;
+  work->simpleChunkSize = proxy.chunkEffectiveSize / ncclTypeSize(dataType);
+  // Blocks of the buffers hold count elements each, the chunks that fit in a block come first
+  work->chunksPerBlock = hostAlgo->nChunksPerLoop % hostAlgo->sizeMultiplier == 0 ?
+    hostAlgo->nChunksPerLoop / hostAlgo->sizeMultiplier : hostAlgo->nChunksPerLoop;
+  work->blockStride = count;
+  work->nBlocks = hostAlgo->nBlocks;
+  work->nChannels = hostAlgo->nChannels;
+  work->nReplicas = proxy.nReplicas;
+  work->hasReduce = hostAlgo->hasReduce;
+  work->protocolMask = hostAlgo->protocolMask;
+  work->clusterFlags = comm->compCap == 90 && comm->config.cgaClusterSize > 1 && ncclParamMscclClusterFlags();
+  mscclDirectInitLaunchDesc(hostAlgo, comm, desc);
+  return ncclSuccess;
+}
+
+ncclResult_t mscclSetupCount(mscclAlgoHandle_t handle, struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo,
+    ncclComm_t comm, size_t count, ncclDataType_t dataType, const struct mscclLaunchDesc** desc) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  if (status.launchCache == nullptr) {
+    status.launchCache = new mscclLaunchCache();
+  }
+  struct mscclLaunchCache* cache = status.launchCache;
+  mscclLaunchKey key(handle, count, dataType);
+  auto it = cache->index.find(key);
+  if (it != cache->index.end()) {
+    auto entry = it->second;
+    // Handles are reused once their algorithm is unloaded
+    if (entry->second.hostAlgo == hostAlgo && entry->second.work.algo == devAlgo) {
+      cache->lru.splice(cache->lru.begin(), cache->lru, entry);
+      *desc = &entry->second;
+      return ncclSuccess;
+    }
+    cache->lru.erase(entry);
+    cache->index.erase(it);
+  }
+
+  struct mscclLaunchDesc newDesc;
+  NCCLCHECK(mscclInitLaunchDesc(hostAlgo, devAlgo, comm, count, dataType, &newDesc));
+  newDesc.handle = handle;
+  {
+    mscclStatus& globalStatus = mscclGetStatus();
+    std::lock_guard<std::mutex> lock(globalStatus.algoMutex);
+    auto name = globalStatus.algoNames.find(handle);
+    if (name != globalStatus.algoNames.end()) newDesc.algoName = name->second;
+  }
+  if (cache->lru.size() >= MSCCL_LAUNCH_CACHE_SIZE) {
+    cache->index.erase(cache->lru.back().first);
+    cache->lru.pop_back();
+  }
+  cache->lru.emplace_front(key, std::move(newDesc));
+  cache->index[key] = cache->lru.begin();
+  *desc = &cache->lru.front().second;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTeardownLaunchCache(ncclComm_t comm) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  delete status.launchCache;
+  status.launchCache = nullptr;
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclSetupWork(const void* sendBuff, void* recvBuff, ncclRedOp_t op,
+    const struct mscclLaunchDesc* desc, void* scratchBuffer, ncclComm_t comm, struct mscclWork* work, void** func) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
   struct ncclDevRedOpFull opFull = {};
-  NCCLCHECK(hostToDevRedOp(&opFull, op, dataType, comm));
-  size_t smem = ncclShmemDynamicSize(comm->cudaArch);
-  
-  mscclWork work;
-  work.syncFlags = status.syncFlags;
-  work.scratchBuffer = status.scratchBuffer;
-  work.sendBuff = sendBuff;
-  work.recvBuff = recvBuff;
-  work.count = count * hostAlgo->sizeMultiplier; // count is sum of all ranks in MSCCL kernel
-  work.redOpArg = opFull.scalarArg;
-  work.workIndex = status.workIndex;
-  work.nChunksPerLoop = hostAlgo->nChunksPerLoop;
-  work.maxAllowedCount = status.maxAllowedCount;
-  work.hasReduce = hostAlgo->hasReduce;
-  work.redOpArgIsPtr = opFull.scalarArgIsPtr;
-  work.needsFence = status.needsFence;
-  INFO(NCCL_INIT, "MSCCL: Setup Kernel finished, smem %ld needsFence %d", smem, status.needsFence);
-  void *args[3] = {&comm->devComm, &devAlgo, &work};
-  void *func = mscclKernelEntries[(opFull.op * ncclNumTypes + dataType) * NCCL_NUM_PROTOCOLS + hostAlgo->protocol];
+  NCCLCHECK(mscclHostToDevRedOp(&opFull, op, desc->proxy.dataType, comm));
 
+  *work = desc->work;
+  work->syncFlags = status.syncFlags;
+  work->syncEpoch = status.syncEpoch;
+  work->watchdog = status.watchdog;
+  work->waitTimeout = status.waitTimeout;
+  work->scratchBuffer = scratchBuffer;
+  work->sendBuff = sendBuff;
+  work->recvBuff = recvBuff;
+  work->redOpArg = opFull.scalarArg;
+  work->redOpArgIsPtr = opFull.scalarArgIsPtr;
+  work->needsFence = status.needsFence;
+  NCCLCHECK(mscclDirectRegisterBuffers(sendBuff, recvBuff, desc, comm, work));
+  *func = desc->funcs[opFull.op];
+  return ncclSuccess;
+}
+
+ncclResult_t mscclLaunchKernelGrid(void* func, dim3 grid, dim3 block, struct mscclWork* work,
+    ncclComm_t comm, cudaStream_t stream) {
+  size_t smem = ncclShmemDynamicSize(comm->cudaArch, block.x);
+
+  TRACE(NCCL_COLL, "MSCCL: Launching kernel, smem %ld needsFence %d", smem, work->needsFence);
+  void *args[2] = {&comm->devComm, work};
   #if CUDART_VERSION >= 11080
   int driverVersion;
   NCCLCHECK(ncclCudaDriverVersion(&driverVersion));
@@ -492,7 +1547,7 @@ ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, size_t count
     unsigned int clusterSize = (compCap == 90) ? comm->config.cgaClusterSize : 0;
 
     cudaLaunchConfig_t launchConfig = {0};
-    cudaLaunchAttribute launchAttrs[3];
+    cudaLaunchAttribute launchAttrs[4];
     int attrs = 0;
     /* Cooperative Group Array (CGA)
      * On sm90 and later we have an extra level of hierarchy where we
@@ -518,6 +1573,10 @@ ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, size_t count
       launchAttrs[attrs].id = cudaLaunchAttributeMemSyncDomain;
       launchAttrs[attrs++].val.memSyncDomain = (cudaLaunchMemSyncDomain) ncclParamMscclMemSyncDomain();
     }
+    if (comm->config.launchPriority != 0 && driverVersion >= 12000) {
+      launchAttrs[attrs].id = cudaLaunchAttributePriority;
+      launchAttrs[attrs++].val.priority = comm->config.launchPriority;
+    }
     #endif
     launchConfig.gridDim = grid;
     launchConfig.blockDim = block;
@@ -531,8 +1590,143 @@ ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, size_t count
   #else
   CUDACHECK(cudaLaunchKernel(func, grid, block, args, smem, stream));
   #endif
-  
-  status.workIndex++;
+  return ncclSuccess;
+}
+
+static ncclResult_t mscclLaunchKernel(void* func, const struct mscclLaunchDesc* desc, struct mscclWork* work,
+    ncclComm_t comm, cudaStream_t stream) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+
+  if (status.lastStream != stream && status.lastStream != nullptr) {
+    TRACE(NCCL_COLL, "MSCCL: Launching on a different stream than the last call");
+  }
+
+  dim3 grid = desc->grid;
+  dim3 block = desc->block;
+
+  bool posted = false;
+  if (mscclPersistentEnabled()) {
+    NCCLCHECK(mscclPersistentPost(func, grid, block, work, comm, stream, &posted));
+  }
+  if (!posted) {
+    // captured launches run at replay, after the resident kernels are stopped by then or not
+    if (mscclGetThreadLocalStatus().captureStatus == mscclNoCapture) {
+      NCCLCHECK(mscclPersistentExclude(comm->cudaDev));
+    }
+    NCCLCHECK(mscclTelemetryAttach(comm, work));
+    // fused launches read their other works from memory of the call, they are not replayed
+    bool launched = false;
+    if (work->nFusedWorks == 0) {
+      NCCLCHECK(mscclReplayLaunch(desc->handle, func, grid, block, work, comm, stream, &launched));
+    }
+    if (!launched) {
+      NCCLCHECK(mscclLaunchKernelGrid(func, grid, block, work, comm, stream));
+    }
+  }
+
   status.lastStream = stream;
   return ncclSuccess;
 }
+
+ncclResult_t mscclSetupKernel(const void* sendBuff, void* recvBuff, ncclRedOp_t op,
+    const struct mscclLaunchDesc* desc, ncclComm_t comm, cudaStream_t stream) {
+  struct NvtxParamsMscclSetupKernel {
+    const char* algoName;
+    int nBlocks;
+    int nThreads;
+    int protocol;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t MscclSetupKernelSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_CSTRING, "Algorithm"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Thread blocks", nullptr, 0, offsetof(NvtxParamsMscclSetupKernel, nBlocks)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Threads per block", nullptr, 0, offsetof(NvtxParamsMscclSetupKernel, nThreads)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Protocol", nullptr, 0, offsetof(NvtxParamsMscclSetupKernel, protocol)}
+  };
+  NvtxParamsMscclSetupKernel payload{desc->algoName.c_str(), (int)desc->grid.x, (int)desc->block.x, desc->hostAlgo->protocol};
+  NVTX3_FUNC_WITH_PARAMS(MscclSetupKernel, MscclSetupKernelSchema, payload)
+
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  mscclWork work;
+  void* func;
+  NCCLCHECK(mscclSetupWork(sendBuff, recvBuff, op, desc, status.scratchBuffer, comm, &work, &func));
+  NCCLCHECK(mscclLaunchKernel(func, desc, &work, comm, stream));
+  return ncclSuccess;
+}
+
+ncclResult_t mscclSetupFusedKernel(const std::vector<struct mscclSavedSchedulerParam*>& params,
+    struct mscclAlgo* hostAlgo, struct mscclDevAlgo* devAlgo, ncclComm_t comm, cudaStream_t stream) {
+  mscclCommStatus& status = mscclGetCommStatus(comm);
+  int nWorks = params.size();
+  ncclResult_t ret = ncclSuccess;
+
+  // Thread blocks may already be in a later work while others still use the scratch of an
+  // earlier one, so every work gets its own part of the scratch buffer
+  std::vector<const struct mscclLaunchDesc*> descs(nWorks);
+  std::vector<struct mscclAlias> aliases(nWorks);
+  std::vector<size_t> scratchOffsets(nWorks);
+  size_t scratchSize = 0;
+  for (int w = 0; w < nWorks; w++) {
+    struct mscclSchedulerParam* p = &params[w]->p;
+    NCCLCHECK(mscclSetupCount(p->handle, hostAlgo, devAlgo, comm, p->count, p->dataType, &descs[w]));
+    mscclGetAlias(p->sendBuff, p->recvBuff, descs[w], comm, &aliases[w]);
+    scratchOffsets[w] = scratchSize;
+    scratchSize += ROUNDUP(aliases[w].scratchSize, MSCCL_FUSED_SCRATCH_ALIGN);
+  }
+  NCCLCHECK(mscclSetupScratchSize(comm, scratchSize, stream));
+  for (int w = 0; w < nWorks; w++) {
+    NCCLCHECK(mscclAliasCopyIn(&aliases[w], descs[w], (char*)status.scratchBuffer + scratchOffsets[w], comm, stream));
+  }
+
+  std::vector<struct mscclWork> works(nWorks);
+  const struct mscclLaunchDesc* launchDesc = descs[0];
+  void* func = nullptr;
+  bool needsProxyStart = false;
+  std::vector<struct ncclProfilerMscclTask> tasks(nWorks);
+  for (int w = 0; w < nWorks; w++) {
+    struct mscclSchedulerParam* p = &params[w]->p;
+    const struct mscclLaunchDesc* desc = descs[w];
+    void* workFunc;
+    mscclGetProfilerTask(p->sendBuff, p->recvBuff, p->op, desc, comm, &tasks[w]);
+    NCCLCHECK(ncclProfilerStartMscclEvents(&tasks[w]));
+    if (!desc->peerOps.empty()) {
+      NCCLCHECK(mscclSaveProxyOps(comm, &desc->proxy, desc->peerOps, &tasks[w]));
+      needsProxyStart = true;
+    } else {
+      comm->sharedRes->collOpCount++;
+    }
+    NCCLCHECK(mscclSetupWork(aliases[w].sendBuff, aliases[w].recvBuff, p->op, desc,
+      (char*)status.scratchBuffer + scratchOffsets[w], comm, &works[w], &workFunc));
+    if (func != nullptr && workFunc != func) {
+      WARN("MSCCL: fused works need the same kernel");
+      return ncclInternalError;
+    }
+    func = workFunc;
+  }
+  if (needsProxyStart) {
+    NCCLCHECK(ncclProxyStart(comm));
+  }
+  for (int w = 0; w < nWorks; w++) {
+    NCCLCHECK(ncclProfilerStopMscclEvents(&tasks[w]));
+  }
+
+  // The first work is passed as kernel argument, the others are read from a stream ordered
+  // allocation. Pageable copies are staged before cudaMemcpyAsync returns, works can go away.
+  struct mscclWork* fusedWorks;
+  size_t fusedSize = (nWorks - 1) * sizeof(struct mscclWork);
+  NCCLCHECK(ncclCudaMallocPoolAsync((char**)&fusedWorks, fusedSize, comm->memPool, stream));
+  CUDACHECKGOTO(cudaMemcpyAsync(fusedWorks, works.data() + 1, fusedSize, cudaMemcpyHostToDevice, stream), ret, exit);
+  works[0].fusedWorks = fusedWorks;
+  works[0].nFusedWorks = nWorks - 1;
+  // Works have as many replicas as their size allows, the grid covers the largest one
+  for (int w = 1; w < nWorks; w++) {
+    if (descs[w]->grid.x > launchDesc->grid.x) launchDesc = descs[w];
+  }
+  NCCLCHECKGOTO(mscclLaunchKernel(func, launchDesc, &works[0], comm, stream), ret, exit);
+  for (int w = 0; w < nWorks; w++) {
+    NCCLCHECKGOTO(mscclFinishAlias(&aliases[w], stream), ret, exit);
+  }
+  TRACE(NCCL_COLL, "MSCCL: Fused %d works into one kernel launch", nWorks);
+exit:
+  NCCLCHECK(ncclCudaFreePoolAsync(fusedWorks, stream));
+  return ret;
+}
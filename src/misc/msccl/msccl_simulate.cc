@@ -0,0 +1,549 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "alloc.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+#include "graph/topo.h"
+
+#include "msccl/msccl_binary.h"
+#include "msccl/msccl_simulate.h"
+
+// Links of the model when there is no communicator to take them from
+NCCL_PARAM(MscclSimLocalRanks, "MSCCL_SIM_LOCAL_RANKS", 8);
+NCCL_PARAM(MscclSimIntraBw, "MSCCL_SIM_INTRA_BW", 100); // GB/s from a GPU to another of its node
+NCCL_PARAM(MscclSimInterBw, "MSCCL_SIM_INTER_BW", 12); // GB/s out of and into a GPU across nodes
+// Costs the communicator does not give
+NCCL_PARAM(MscclSimIntraLat, "MSCCL_SIM_INTRA_LAT", 1000); // ns
+NCCL_PARAM(MscclSimInterLat, "MSCCL_SIM_INTER_LAT", 5000); // ns
+NCCL_PARAM(MscclSimLocalBw, "MSCCL_SIM_LOCAL_BW", 1000); // GB/s of local copies and reductions
+NCCL_PARAM(MscclSimStepLat, "MSCCL_SIM_STEP_LAT", 500); // ns to start a step
+
+// Steps are indexed globally, connections carry the sends and receives of a (sender, receiver,
+// channel) in program order and match them in that order as the FIFOs do.
+struct mscclSimStep {
+  int block;
+  int type;
+  int count;
+  // chunks read per chunk moved by the local part of the step
+  int nLocalReads;
+  std::vector<std::pair<int, int>> deps; // (bid, step) of the same rank
+  std::vector<std::pair<int, int>> sends; // (connection, index of the send in it)
+  std::vector<std::pair<int, int>> recvs;
+};
+
+struct mscclSimBlock {
+  int rank;
+  int bid;
+  int firstStep;
+  int nSteps;
+  // kernel step counter after each step and whether the step sets the flag of the thread block
+  std::vector<int> flagSteps;
+  std::vector<bool> flagged;
+};
+
+struct mscclSimConn {
+  int src;
+  int dst;
+  int channel;
+  std::vector<int> sends;
+  std::vector<int> recvs;
+  std::vector<int> slots;
+  // receive the k-th send waits for before it fits in the NCCL_STEPS slots, -1 if none
+  std::vector<int> creditRecv;
+};
+
+struct mscclSimModel {
+  int nRanks;
+  std::vector<int> rankToNode;
+  // GB/s and us
+  std::vector<float> pairBw;
+  std::vector<float> netBw;
+  float intraLat;
+  float interLat;
+  float localBw;
+  float stepLat;
+};
+
+struct mscclSimProgram {
+  std::string name;
+  int nRanks;
+  int nChunksPerLoop;
+  int protocol;
+  int64_t minBytes;
+  int64_t maxBytes;
+  bool hasNvls;
+  bool hasCollNet;
+  std::vector<struct mscclSimStep> steps;
+  std::vector<struct mscclSimBlock> blocks;
+  std::vector<struct mscclSimConn> conns;
+  // (rank, bid) to blocks index
+  std::map<std::pair<int, int>, int> blockIndex;
+};
+
+static const char* mscclSimTypeName(int type) {
+  switch (type) {
+    case MSCCL_SEND: return "s";
+    case MSCCL_RECV: return "r";
+    case MSCCL_RECV_COPY_SEND: return "rcs";
+    case MSCCL_RECV_REDUCE_SEND: return "rrs";
+    case MSCCL_RECV_REDUCE_COPY: return "rrc";
+    case MSCCL_RECV_REDUCE_COPY_SEND: return "rrcs";
+    case MSCCL_LOCAL_COPY: return "cpy";
+    case MSCCL_REDUCE: return "re";
+    case MSCCL_RECV_REDUCE_COPY_N: return "rrcn";
+    case MSCCL_SEND_N: return "sn";
+    case MSCCL_MULTIMEM_LD_REDUCE: return "mld";
+    case MSCCL_MULTIMEM_ST: return "mst";
+    case MSCCL_COLLNET_ALLREDUCE: return "car";
+  }
+  return "?";
+}
+
+static bool mscclSimHasSend(int type) {
+  return type == MSCCL_SEND || type == MSCCL_RECV_COPY_SEND || type == MSCCL_RECV_REDUCE_SEND ||
+    type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_SEND_N;
+}
+
+static bool mscclSimHasRecv(int type) {
+  return type == MSCCL_RECV || type == MSCCL_RECV_COPY_SEND || type == MSCCL_RECV_REDUCE_SEND ||
+    type == MSCCL_RECV_REDUCE_COPY || type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_RECV_REDUCE_COPY_N;
+}
+
+static int mscclSimConnection(struct mscclSimProgram* prog, std::map<std::tuple<int, int, int>, int>& conns, int src, int dst, int channel) {
+  auto key = std::make_tuple(src, dst, channel);
+  auto it = conns.find(key);
+  if (it != conns.end()) return it->second;
+  prog->conns.emplace_back();
+  prog->conns.back().src = src;
+  prog->conns.back().dst = dst;
+  prog->conns.back().channel = channel;
+  conns[key] = prog->conns.size() - 1;
+  return prog->conns.size() - 1;
+}
+
+// Read the program of every rank, one mscclAlgo at a time as it holds all thread blocks
+static ncclResult_t mscclSimLoadProgram(const char* algoFile, struct mscclSimProgram* prog) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclAlgoMeta meta;
+  std::map<std::tuple<int, int, int>, int> conns;
+  struct mscclAlgo* algo = nullptr;
+  NCCLCHECK(mscclGetAlgoMetaFromFile(algoFile, &meta));
+  if (meta.nRanks <= 0) {
+    WARN("MSCCL: %s has an invalid number of gpus %d", algoFile, meta.nRanks);
+    return ncclInvalidUsage;
+  }
+  prog->name = algoFile;
+  prog->nRanks = meta.nRanks;
+  prog->nChunksPerLoop = meta.nChunksPerLoop;
+  prog->minBytes = meta.minBytes;
+  prog->maxBytes = meta.maxBytes;
+  prog->hasNvls = false;
+  prog->hasCollNet = false;
+  NCCLCHECK(ncclCalloc(&algo, 1));
+  for (int rank = 0; rank < meta.nRanks; rank++) {
+    NCCLCHECKGOTO(mscclGetAlgoFromFile(algoFile, algo, rank), ret, exit);
+    prog->protocol = algo->protocol;
+    for (int bid = 0; bid < algo->nBlocks; bid++) {
+      struct mscclThreadBlock* tb = algo->mscclTBs + bid;
+      const int stepSlots = tb->protocol == NCCL_PROTO_SIMPLE ? MSCCL_CHUNKSTEPS : 1;
+      prog->blockIndex[std::make_pair(rank, bid)] = prog->blocks.size();
+      prog->blocks.emplace_back();
+      struct mscclSimBlock& b = prog->blocks.back();
+      b.rank = rank;
+      b.bid = bid;
+      b.firstStep = prog->steps.size();
+      b.nSteps = tb->nSteps;
+      int flagStep = 0;
+      for (int i = 0; i < tb->nSteps; i++) {
+        struct mscclTransmission* t = tb->transmissions + i;
+        prog->steps.emplace_back();
+        struct mscclSimStep& s = prog->steps.back();
+        s.block = prog->blocks.size() - 1;
+        s.type = t->type;
+        s.count = t->count;
+        s.nLocalReads = t->type == MSCCL_REDUCE ? t->numReductions + 1 :
+          t->type == MSCCL_LOCAL_COPY || (mscclSimHasRecv(t->type) && t->type != MSCCL_RECV) ? 1 : 0;
+        for (int d = 0; d < t->numDependencies; d++) {
+          s.deps.push_back(std::make_pair((int)tb->dependentBid[t->dependencePointer + d], (int)tb->dependentStep[t->dependencePointer + d]));
+        }
+        // as the kernel counts steps, the dependencies stand for the nop steps before this one
+        if (t->numDependencies > 0) flagStep += t->numDependencies - 1;
+        if (t->type == MSCCL_REDUCE && t->numReductions > 0) flagStep += t->numReductions - 1;
+        b.flagSteps.push_back(flagStep++);
+        b.flagged.push_back(t->hasDependence != 0);
+        if (tb->nvls != MSCCL_NVLS_NONE) {
+          // NVLS heads are not modelled, their steps are timed as local ones
+          prog->hasNvls = true;
+          s.nLocalReads = 1;
+          continue;
+        }
+        if (tb->collnet) {
+          // the other nodes are not modelled, CollNet steps are a round trip through the network
+          prog->hasCollNet = true;
+          continue;
+        }
+        if (mscclSimHasSend(t->type)) {
+          for (int p = 0; p < tb->nSendPeers; p++) {
+            int c = mscclSimConnection(prog, conns, rank, tb->sendPeers[p], tb->channelId);
+            s.sends.push_back(std::make_pair(c, (int)prog->conns[c].sends.size()));
+            prog->conns[c].sends.push_back(prog->steps.size() - 1);
+            prog->conns[c].slots.push_back(t->count * stepSlots);
+          }
+        }
+        if (mscclSimHasRecv(t->type)) {
+          for (int p = 0; p < tb->nRecvPeers; p++) {
+            int c = mscclSimConnection(prog, conns, tb->recvPeers[p], rank, tb->channelId);
+            s.recvs.push_back(std::make_pair(c, (int)prog->conns[c].recvs.size()));
+            prog->conns[c].recvs.push_back(prog->steps.size() - 1);
+          }
+        }
+      }
+    }
+  }
+  // A send can only be issued once it fits in the slots of the connection with the sends not received yet
+  for (auto& c : prog->conns) {
+    c.creditRecv.assign(c.sends.size(), -1);
+    for (int k = 0; k < (int)c.sends.size(); k++) {
+      int first = k, slots = c.slots[k];
+      while (first > 0 && slots + c.slots[first - 1] <= NCCL_STEPS) slots += c.slots[--first];
+      if (first > 0 || slots > NCCL_STEPS) {
+        int r = slots > NCCL_STEPS ? k - 1 : first - 1;
+        if (r >= 0) c.creditRecv[k] = r < (int)c.recvs.size() ? c.recvs[r] : -2;
+      }
+    }
+  }
+exit:
+  free(algo);
+  return ret;
+}
+
+static ncclResult_t mscclSimGetModel(ncclComm_t comm, int nRanks, struct mscclSimModel* model) {
+  model->nRanks = nRanks;
+  model->rankToNode.resize(nRanks);
+  model->pairBw.assign(nRanks * nRanks, (float)ncclParamMscclSimIntraBw());
+  model->netBw.assign(nRanks, (float)ncclParamMscclSimInterBw());
+  model->intraLat = ncclParamMscclSimIntraLat() / 1000.0f;
+  model->interLat = ncclParamMscclSimInterLat() / 1000.0f;
+  model->localBw = (float)ncclParamMscclSimLocalBw();
+  model->stepLat = ncclParamMscclSimStepLat() / 1000.0f;
+  if (comm == nullptr) {
+    int localRanks = std::max((int)ncclParamMscclSimLocalRanks(), 1);
+    for (int r = 0; r < nRanks; r++) model->rankToNode[r] = r / localRanks;
+    return ncclSuccess;
+  }
+  if (comm->nRanks != nRanks) {
+    WARN("MSCCL: algorithm for %d ranks cannot be simulated on a communicator of %d ranks", nRanks, comm->nRanks);
+    return ncclInvalidUsage;
+  }
+  for (int r = 0; r < nRanks; r++) model->rankToNode[r] = comm->rankToNode[r];
+  // Paths between the GPUs of this node, the other nodes are assumed to be alike
+  struct ncclTopoSystem* topo = comm->topo;
+  float netBw = 0.0f, netLat = 0.0f;
+  for (int g = 0; g < topo->nodes[GPU].count; g++) {
+    struct ncclTopoNode* gpu = topo->nodes[GPU].nodes + g;
+    for (int n = 0; n < topo->nodes[NET].count; n++) {
+      netBw = std::max(netBw, gpu->paths[NET][n].bw);
+      netLat = std::max(netLat, topo->nodes[NET].nodes[n].net.latency);
+    }
+  }
+  float intraBw = topo->maxBw;
+  for (int i = 0; i < nRanks * nRanks; i++) model->pairBw[i] = intraBw;
+  for (int g = 0; g < topo->nodes[GPU].count; g++) {
+    for (int h = 0; h < topo->nodes[GPU].count; h++) {
+      int a = topo->nodes[GPU].nodes[g].gpu.rank, b = topo->nodes[GPU].nodes[h].gpu.rank;
+      if (g != h && a >= 0 && a < nRanks && b >= 0 && b < nRanks) {
+        model->pairBw[a * nRanks + b] = topo->nodes[GPU].nodes[g].paths[GPU][h].bw;
+      }
+    }
+  }
+  if (netBw > 0.0f) model->netBw.assign(nRanks, netBw);
+  if (netLat > 0.0f) model->interLat = netLat;
+  return ncclSuccess;
+}
+
+struct mscclSimResult {
+  double time;
+  std::vector<double> start;
+  std::vector<double> finish;
+  // step that determined when each step could complete, -1 for the first steps
+  std::vector<int> pred;
+  // links: intra-node pairs src * nRanks + dst, then the network egress and ingress of each rank
+  std::vector<double> linkBusy;
+  std::vector<int> blocked;
+};
+
+static void mscclSimWait(std::vector<std::vector<int>>& waiters, int step, int block, int* waitingOn) {
+  waiters[step].push_back(block);
+  *waitingOn = step;
+}
+
+// Discrete event replay. A thread block runs its steps in order, each once its dependencies are
+// flagged, what it receives has arrived and what it sends fits in the slots of the connection.
+// Transfers take their links in the order they are ready.
+static void mscclSimRun(const struct mscclSimProgram* prog, const struct mscclSimModel* model, int64_t nBytes, struct mscclSimResult* res) {
+  const int nRanks = prog->nRanks;
+  const int nSteps = prog->steps.size();
+  const int nBlocks = prog->blocks.size();
+  const double chunkBytes = (double)nBytes / prog->nChunksPerLoop;
+  std::vector<int> pc(nBlocks, 0);
+  std::vector<std::vector<int>> waiters(nSteps);
+  std::vector<std::vector<double>> arrivals(prog->conns.size());
+  std::vector<double> linkFree(nRanks * nRanks + 2 * nRanks, 0.0);
+  std::vector<int> linkLast(linkFree.size(), -1);
+  for (size_t c = 0; c < prog->conns.size(); c++) arrivals[c].assign(prog->conns[c].sends.size(), 0.0);
+  res->time = 0.0;
+  res->start.assign(nSteps, -1.0);
+  res->finish.assign(nSteps, -1.0);
+  res->pred.assign(nSteps, -1);
+  res->linkBusy.assign(linkFree.size(), 0.0);
+  res->blocked.clear();
+
+  typedef std::pair<double, int> readyBlock;
+  std::priority_queue<readyBlock, std::vector<readyBlock>, std::greater<readyBlock>> ready;
+  std::vector<int> evaluate;
+  for (int b = 0; b < nBlocks; b++) evaluate.push_back(b);
+  std::vector<int> waitingOn(nBlocks, -1);
+
+  while (true) {
+    // Blocks woken up find out whether their next step can run, and from when
+    for (int b : evaluate) {
+      const struct mscclSimBlock& blk = prog->blocks[b];
+      if (pc[b] == blk.nSteps) continue;
+      int sid = blk.firstStep + pc[b];
+      const struct mscclSimStep& s = prog->steps[sid];
+      double t = pc[b] > 0 ? res->finish[sid - 1] : 0.0;
+      int pred = pc[b] > 0 ? sid - 1 : -1;
+      bool blocked = false;
+      for (auto& d : s.deps) {
+        auto it = prog->blockIndex.find(std::make_pair(blk.rank, d.first));
+        int target = -2;
+        if (it != prog->blockIndex.end()) {
+          const struct mscclSimBlock& dep = prog->blocks[it->second];
+          for (int i = 0; i < dep.nSteps; i++) {
+            if (dep.flagged[i] && dep.flagSteps[i] >= d.second) { target = dep.firstStep + i; break; }
+          }
+        }
+        if (target == -2) { waitingOn[b] = -2; blocked = true; break; }
+        if (res->finish[target] < 0.0) { mscclSimWait(waiters, target, b, &waitingOn[b]); blocked = true; break; }
+        if (res->finish[target] > t) { t = res->finish[target]; pred = target; }
+      }
+      for (size_t i = 0; i < s.recvs.size() && !blocked; i++) {
+        const struct mscclSimConn& c = prog->conns[s.recvs[i].first];
+        int k = s.recvs[i].second;
+        if (k >= (int)c.sends.size()) { waitingOn[b] = -2; blocked = true; break; }
+        if (res->finish[c.sends[k]] < 0.0) { mscclSimWait(waiters, c.sends[k], b, &waitingOn[b]); blocked = true; }
+      }
+      for (size_t i = 0; i < s.sends.size() && !blocked; i++) {
+        const struct mscclSimConn& c = prog->conns[s.sends[i].first];
+        int r = c.creditRecv[s.sends[i].second];
+        if (r == -2) { waitingOn[b] = -2; blocked = true; break; }
+        if (r >= 0 && res->finish[r] < 0.0) { mscclSimWait(waiters, r, b, &waitingOn[b]); blocked = true; }
+      }
+      if (blocked) continue;
+      waitingOn[b] = -1;
+      res->start[sid] = t;
+      res->pred[sid] = pred;
+      ready.push(readyBlock(t, b));
+    }
+    evaluate.clear();
+    if (ready.empty()) break;
+
+    int b = ready.top().second;
+    ready.pop();
+    const struct mscclSimBlock& blk = prog->blocks[b];
+    int sid = blk.firstStep + pc[b];
+    const struct mscclSimStep& s = prog->steps[sid];
+    const double bytes = chunkBytes * s.count;
+    double t = res->start[sid] + model->stepLat;
+    for (auto& rv : s.recvs) {
+      double arrival = arrivals[rv.first][rv.second];
+      if (arrival > t) { t = arrival; res->pred[sid] = prog->conns[rv.first].sends[rv.second]; }
+    }
+    const bool multimem = s.type == MSCCL_MULTIMEM_LD_REDUCE || s.type == MSCCL_MULTIMEM_ST;
+    t += bytes * s.nLocalReads / (1000.0 * (multimem ? model->pairBw[0] : model->localBw));
+    if (s.type == MSCCL_COLLNET_ALLREDUCE) {
+      double bw = model->netBw[blk.rank];
+      t += (bw > 0.0 ? 2.0 * bytes / (1000.0 * bw) : 0.0) + 2.0 * model->interLat;
+    }
+    double end = t;
+    for (auto& sd : s.sends) {
+      const struct mscclSimConn& c = prog->conns[sd.first];
+      double sendStart = t;
+      int r = c.creditRecv[sd.second];
+      if (r >= 0 && res->finish[r] > sendStart) { sendStart = res->finish[r]; res->pred[sid] = r; }
+      bool inter = model->rankToNode[c.src] != model->rankToNode[c.dst];
+      int l0 = inter ? nRanks * nRanks + c.src : c.src * nRanks + c.dst;
+      int l1 = inter ? nRanks * nRanks + nRanks + c.dst : l0;
+      double bw = inter ? std::min(model->netBw[c.src], model->netBw[c.dst]) : model->pairBw[c.src * nRanks + c.dst];
+      double linkStart = std::max(sendStart, std::max(linkFree[l0], linkFree[l1]));
+      if (linkStart > sendStart) {
+        int last = linkFree[l0] >= linkFree[l1] ? linkLast[l0] : linkLast[l1];
+        if (last >= 0) res->pred[sid] = last;
+      }
+      double duration = bw > 0.0 ? bytes / (1000.0 * bw) : 0.0;
+      linkFree[l0] = linkFree[l1] = linkStart + duration;
+      linkLast[l0] = linkLast[l1] = sid;
+      res->linkBusy[l0] += duration;
+      if (l1 != l0) res->linkBusy[l1] += duration;
+      arrivals[sd.first][sd.second] = linkStart + duration + (inter ? model->interLat : model->intraLat);
+      end = std::max(end, linkStart + duration);
+    }
+    res->finish[sid] = end;
+    res->time = std::max(res->time, end);
+    pc[b]++;
+    evaluate.push_back(b);
+    for (int w : waiters[sid]) evaluate.push_back(w);
+    waiters[sid].clear();
+  }
+  for (int b = 0; b < nBlocks; b++) {
+    if (pc[b] < prog->blocks[b].nSteps) res->blocked.push_back(b);
+  }
+}
+
+static void mscclSimPrintStep(FILE* file, const struct mscclSimProgram* prog, int sid) {
+  const struct mscclSimStep& s = prog->steps[sid];
+  const struct mscclSimBlock& b = prog->blocks[s.block];
+  fprintf(file, "rank %d tb %d step %d %s", b.rank, b.bid, sid - b.firstStep, mscclSimTypeName(s.type));
+}
+
+static void mscclSimReportDeadlock(FILE* file, const struct mscclSimProgram* prog, const struct mscclSimResult* res) {
+  fprintf(file, "# deadlock: %zu thread blocks cannot finish\n", res->blocked.size());
+  for (size_t i = 0; i < res->blocked.size() && i < 32; i++) {
+    const struct mscclSimBlock& b = prog->blocks[res->blocked[i]];
+    int sid = b.firstStep;
+    while (sid < b.firstStep + b.nSteps && res->finish[sid] >= 0.0) sid++;
+    fprintf(file, "blocked ");
+    mscclSimPrintStep(file, prog, sid);
+    const struct mscclSimStep& s = prog->steps[sid];
+    for (auto& rv : s.recvs) {
+      const struct mscclSimConn& c = prog->conns[rv.first];
+      if (rv.second >= (int)c.sends.size()) {
+        fprintf(file, ", receive %d from rank %d on channel %d has no matching send", rv.second, c.src, c.channel);
+      }
+    }
+    fprintf(file, "\n");
+  }
+}
+
+static void mscclSimReportPath(FILE* file, const struct mscclSimProgram* prog, const struct mscclSimResult* res) {
+  int last = -1;
+  for (int i = 0; i < (int)prog->steps.size(); i++) {
+    if (last < 0 || res->finish[i] > res->finish[last]) last = i;
+  }
+  std::vector<int> path;
+  for (int sid = last; sid >= 0; sid = res->pred[sid]) path.push_back(sid);
+  fprintf(file, "# critical path: %zu steps\n", path.size());
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    fprintf(file, "  ");
+    mscclSimPrintStep(file, prog, *it);
+    fprintf(file, " start %.2f end %.2f us\n", res->start[*it], res->finish[*it]);
+  }
+}
+
+static void mscclSimReportLinks(FILE* file, const struct mscclSimProgram* prog, const struct mscclSimResult* res) {
+  const int nRanks = prog->nRanks;
+  fprintf(file, "# link utilization\n");
+  for (int l = 0; l < (int)res->linkBusy.size(); l++) {
+    if (res->linkBusy[l] <= 0.0) continue;
+    double util = res->time > 0.0 ? 100.0 * res->linkBusy[l] / res->time : 0.0;
+    if (l < nRanks * nRanks) {
+      fprintf(file, "  rank %d -> rank %d %.1f%%\n", l / nRanks, l % nRanks, util);
+    } else if (l < nRanks * nRanks + nRanks) {
+      fprintf(file, "  rank %d net out %.1f%%\n", l - nRanks * nRanks, util);
+    } else {
+      fprintf(file, "  rank %d net in %.1f%%\n", l - nRanks * nRanks - nRanks, util);
+    }
+  }
+}
+
+ncclResult_t mscclSimulateAlgoFile(const char* algoFile, ncclComm_t comm, const char* reportFile) {
+  struct mscclSimProgram prog;
+  struct mscclSimModel model;
+  struct mscclSimResult res;
+  NCCLCHECK(mscclSimLoadProgram(algoFile, &prog));
+  NCCLCHECK(mscclSimGetModel(comm, prog.nRanks, &model));
+
+  FILE* file = fopen(reportFile, "w");
+  if (file == nullptr) {
+    WARN("MSCCL: Unable to open simulation report %s : %s", reportFile, strerror(errno));
+    return ncclSystemError;
+  }
+  int nNodes = 0;
+  for (int r = 0; r < prog.nRanks; r++) nNodes = std::max(nNodes, model.rankToNode[r] + 1);
+  fprintf(file, "# %s: %d ranks on %d nodes, %d chunks per loop, %zu thread blocks, %zu steps\n",
+    algoFile, prog.nRanks, nNodes, prog.nChunksPerLoop, prog.blocks.size(), prog.steps.size());
+  fprintf(file, "# model: latency intra %.2f inter %.2f step %.2f us, bandwidth net %.1f local %.1f GB/s\n",
+    model.intraLat, model.interLat, model.stepLat, model.netBw[0], model.localBw);
+  if (prog.hasNvls) fprintf(file, "# NVLS thread blocks are timed as local steps\n");
+  if (prog.hasCollNet) fprintf(file, "# CollNet steps are timed as round trips through the network of their rank\n");
+
+  // Deadlocks do not depend on the size
+  ncclResult_t ret = ncclSuccess;
+  int64_t minBytes = std::max(prog.minBytes, (int64_t)1024);
+  int64_t maxBytes = prog.maxBytes > 0 ? prog.maxBytes : (int64_t)1 << 30;
+  int64_t lastBytes = 0;
+  fprintf(file, "# bytes time_us algbw_GBps\n");
+  for (int64_t bytes = 1024; bytes <= maxBytes; bytes *= 2) {
+    if (bytes < minBytes) continue;
+    mscclSimRun(&prog, &model, bytes, &res);
+    if (!res.blocked.empty()) {
+      mscclSimReportDeadlock(file, &prog, &res);
+      WARN("MSCCL: %s deadlocks, see %s", algoFile, reportFile);
+      ret = ncclInvalidUsage;
+      break;
+    }
+    fprintf(file, "%ld %.2f %.2f\n", bytes, res.time, res.time > 0.0 ? bytes / (1000.0 * res.time) : 0.0);
+    lastBytes = bytes;
+  }
+  if (ret == ncclSuccess && lastBytes > 0) {
+    // Bottlenecks of the largest size
+    fprintf(file, "# at %ld bytes\n", lastBytes);
+    mscclSimReportPath(file, &prog, &res);
+    mscclSimReportLinks(file, &prog, &res);
+  }
+  fclose(file);
+  INFO(NCCL_INIT, "MSCCL: Simulated %s into %s", algoFile, reportFile);
+  return ret;
+}
+
+// Programs timed by the simulated groups, loaded once per file
+static std::mutex mscclSimProgramsMutex;
+static std::map<std::string, struct mscclSimProgram> mscclSimPrograms;
+
+ncclResult_t mscclSimulateAlgoTime(const char* algoFile, ncclComm_t comm, int64_t nBytes, float* time, float* linkTime) {
+  struct mscclSimModel model;
+  struct mscclSimResult res;
+  std::lock_guard<std::mutex> lock(mscclSimProgramsMutex);
+  auto it = mscclSimPrograms.find(algoFile);
+  if (it == mscclSimPrograms.end()) {
+    struct mscclSimProgram prog;
+    NCCLCHECK(mscclSimLoadProgram(algoFile, &prog));
+    it = mscclSimPrograms.emplace(algoFile, std::move(prog)).first;
+  }
+  const struct mscclSimProgram* prog = &it->second;
+  NCCLCHECK(mscclSimGetModel(comm, prog->nRanks, &model));
+  mscclSimRun(prog, &model, nBytes, &res);
+  if (!res.blocked.empty()) {
+    WARN("MSCCL: %s deadlocks at %ld bytes", algoFile, nBytes);
+    return ncclInvalidUsage;
+  }
+  *time = res.time;
+  *linkTime = 0.0f;
+  for (double busy : res.linkBusy) *linkTime = std::max(*linkTime, (float)busy);
+  return ncclSuccess;
+}
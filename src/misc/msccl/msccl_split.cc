@@ -0,0 +1,220 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#include "bitops.h"
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "group.h"
+#include "param.h"
+
+#include "msccl/msccl_autotune.h"
+#include "msccl/msccl_lifecycle.h"
+#include "msccl/msccl_setup.h"
+#include "msccl/msccl_split.h"
+#include "msccl/msccl_status.h"
+
+NCCL_PARAM(MscclSplit, "MSCCL_SPLIT", 0);
+NCCL_PARAM(MscclSplitMinBytes, "MSCCL_SPLIT_MIN_BYTES", 64 << 20);
+// Percent of the elements MSCCL starts with, before any measurement
+NCCL_PARAM(MscclSplitRatio, "MSCCL_SPLIT_RATIO", 50);
+NCCL_PARAM(MscclSplitIters, "MSCCL_SPLIT_ITERS", 8);
+
+// Neither part is dropped, so that both keep being measured
+static const float mscclSplitMinRatio = 0.05f;
+static const float mscclSplitMaxRatio = 0.95f;
+// An agreement moving the ratio by less than this settles the entry
+static const float mscclSplitTolerance = 0.02f;
+static const int mscclSplitMaxRounds = 8;
+
+static int mscclSplitIters() {
+  return std::max((int)ncclParamMscclSplitIters(), 1);
+}
+
+static uint64_t mscclSplitKey(mscclAlgoHandle_t handle, size_t nBytes) {
+  return ((uint64_t)(uint32_t)handle << 8) | (uint64_t)log2Down(nBytes);
+}
+
+static ncclResult_t mscclSplitGetStatus(ncclComm_t comm, struct mscclSplitStatus** split) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  if (commStatus.split == nullptr) {
+    struct mscclSplitStatus* s = new mscclSplitStatus();
+    CUDACHECK(cudaStreamCreateWithFlags(&s->stream, cudaStreamNonBlocking));
+    for (int i = 0; i < 3; i++) {
+      CUDACHECK(cudaEventCreate(&s->events[i]));
+    }
+    commStatus.split = s;
+  }
+  *split = commStatus.split;
+  return ncclSuccess;
+}
+
+// Agree on the ratio across ranks. A part is as slow as its slowest rank, so each part is timed
+// by the maximum over ranks of its mean time.
+static ncclResult_t mscclSplitAgree(ncclComm_t comm, uint64_t key, struct mscclSplitEntry& entry) {
+  std::vector<double> times(2 * comm->nRanks);
+  times[2 * comm->rank] = entry.msccl / entry.nSamples;
+  times[2 * comm->rank + 1] = entry.nccl / entry.nSamples;
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, times.data(), 2 * sizeof(double)));
+  double msccl = 0.0, nccl = 0.0;
+  for (int r = 0; r < comm->nRanks; r++) {
+    msccl = std::max(msccl, times[2 * r]);
+    nccl = std::max(nccl, times[2 * r + 1]);
+  }
+  entry.nSamples = 0;
+  entry.msccl = 0.0;
+  entry.nccl = 0.0;
+  if (msccl <= 0.0 || nccl <= 0.0) {
+    return ncclSuccess;
+  }
+  // Both parts end together when each gets its share of the summed bandwidths
+  double mscclBw = entry.ratio / msccl;
+  double ncclBw = (1.0 - entry.ratio) / nccl;
+  float ratio = std::min(std::max((float)(mscclBw / (mscclBw + ncclBw)), mscclSplitMinRatio), mscclSplitMaxRatio);
+  entry.settled = fabsf(ratio - entry.ratio) < mscclSplitTolerance || ++entry.nRounds >= mscclSplitMaxRounds;
+  INFO(NCCL_TUNING, "MSCCL: Split of handle %d at 2^%d bytes took %f us on MSCCL and %f us on NCCL, MSCCL share %.2f -> %.2f%s",
+    (int)(key >> 8), (int)(key & 0xff), msccl, nccl, entry.ratio, ratio, entry.settled ? ", settled" : "");
+  entry.ratio = ratio;
+  return ncclSuccess;
+}
+
+// Read the times of the last timed call. All ranks do it at the same call, so they reach the
+// agreements together.
+static ncclResult_t mscclSplitFold(ncclComm_t comm, struct mscclSplitStatus* split) {
+  if (!split->pending) {
+    return ncclSuccess;
+  }
+  split->pending = false;
+  struct mscclSplitEntry& entry = split->table[split->pendingKey];
+  float msccl, nccl;
+  CUDACHECK(cudaEventSynchronize(split->events[1]));
+  CUDACHECK(cudaEventSynchronize(split->events[2]));
+  CUDACHECK(cudaEventElapsedTime(&msccl, split->events[0], split->events[1]));
+  CUDACHECK(cudaEventElapsedTime(&nccl, split->events[0], split->events[2]));
+  if (entry.nSamples++ < 0) {
+    return ncclSuccess;
+  }
+  entry.msccl += msccl * 1000.0;
+  entry.nccl += nccl * 1000.0;
+  if (entry.nSamples == mscclSplitIters()) {
+    NCCLCHECK(mscclSplitAgree(comm, split->pendingKey, entry));
+  }
+  return ncclSuccess;
+}
+
+// The NCCL part runs on the channels above those of the algorithm on every rank, so either all ranks
+// split the call or none does; the checks only read the algorithm, the call and the config
+static ncclResult_t mscclSplitEligible(struct mscclSavedSchedulerParam* param, struct mscclAlgo* hostAlgo, bool* eligible) {
+  struct mscclSchedulerParam* p = &param->p;
+  ncclComm_t comm = param->comm;
+  *eligible = false;
+  if (ncclParamMscclSplit() == 0 || p->func != mscclFuncAllReduce) return ncclSuccess;
+  if (p->count * ncclTypeSize(p->dataType) < (size_t)ncclParamMscclSplitMinBytes()) return ncclSuccess;
+  // The NCCL part is launched before returning, with the channel base of the comm set
+  if (!comm->config.blocking || ncclGroupDepth != 0) return ncclSuccess;
+  // Explored calls time the whole call on a single stream
+  if (mscclAutotuneEnabled()) return ncclSuccess;
+  // NVLS and CollNet connections may be those of the NCCL part
+  if (hostAlgo->nNvlsChannels > 0 || hostAlgo->collNet) return ncclSuccess;
+  // The NCCL part needs channels of its own
+  if (mscclAlgoChannels(hostAlgo, comm) >= comm->nChannels) return ncclSuccess;
+  // The side stream and the timing events are not captured
+  cudaStreamCaptureStatus captureStatus;
+  CUDACHECK(cudaStreamIsCapturing(param->stream, &captureStatus));
+  if (captureStatus != cudaStreamCaptureStatusNone) return ncclSuccess;
+  *eligible = true;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclSplitRun(struct mscclSavedSchedulerParam* param, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclSchedulerParam* p = &param->p;
+  ncclComm_t comm = param->comm;
+  cudaStream_t stream = param->stream;
+  size_t typeSize = ncclTypeSize(p->dataType);
+  struct mscclAlgo* hostAlgo;
+  struct mscclDevAlgo* devAlgo;
+  struct mscclSplitStatus* split;
+  bool eligible, timed, mscclCaller;
+  size_t grain, mscclCount, mscclBytes;
+  int savedDevice;
+  *done = false;
+
+  NCCLCHECK(mscclGetAlgo(p->handle, comm, &hostAlgo, &devAlgo));
+  NCCLCHECK(mscclSplitEligible(param, hostAlgo, &eligible));
+  if (!eligible) return ncclSuccess;
+
+  CUDACHECK(cudaGetDevice(&savedDevice));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(mscclSplitGetStatus(comm, &split), ret, exit);
+  NCCLCHECKGOTO(mscclSplitFold(comm, split), ret, exit);
+  {
+    uint64_t key = mscclSplitKey(p->handle, p->count * typeSize);
+    auto it = split->table.find(key);
+    if (it == split->table.end()) {
+      struct mscclSplitEntry entry = {};
+      entry.ratio = std::min(std::max(ncclParamMscclSplitRatio() / 100.0f, mscclSplitMinRatio), mscclSplitMaxRatio);
+      entry.nSamples = -1;
+      it = split->table.emplace(key, entry).first;
+    }
+    // MSCCL gets whole loops of its chunks, and the NCCL part starts 16 bytes aligned
+    grain = (size_t)hostAlgo->nChunksPerLoop * std::max<size_t>(16 / typeSize, 1);
+    mscclCount = (size_t)(it->second.ratio * p->count) / grain * grain;
+    if (mscclCount == 0 || mscclCount == p->count) goto exit;
+    mscclBytes = mscclCount * typeSize;
+    timed = !it->second.settled;
+    TRACE(NCCL_COLL, "MSCCL: Split %zu elements, %zu on MSCCL channels [0, %d) and the rest on NCCL", p->count, mscclCount,
+      mscclAlgoChannels(hostAlgo, comm));
+
+    // Tasks NCCL left pending must not get the channel base of the NCCL part
+    NCCLCHECKGOTO(ncclGroupImplicitFlush(), ret, exit);
+    CUDACHECKGOTO(cudaEventRecord(split->events[0], stream), ret, exit);
+    CUDACHECKGOTO(cudaStreamWaitEvent(split->stream, split->events[0], 0), ret, exit);
+    NCCLCHECKGOTO(mscclRunAlgo(p->sendBuff, p->sendCounts, p->sDisPls, p->recvBuff, p->recvCounts, p->rDisPls,
+      mscclCount, p->dataType, p->root, p->peer, p->op, p->handle, comm, split->stream), ret, exit);
+    CUDACHECKGOTO(cudaEventRecord(split->events[1], split->stream), ret, exit);
+
+    comm->collChannelBase = mscclAlgoChannels(hostAlgo, comm);
+    mscclCaller = mscclIsCaller();
+    if (!mscclCaller) mscclSetIsCallerFlag();
+    ret = ncclAllReduce((const char*)p->sendBuff + mscclBytes, (char*)p->recvBuff + mscclBytes, p->count - mscclCount,
+      p->dataType, p->op, comm, stream);
+    if (ret == ncclSuccess) ret = ncclGroupImplicitFlush();
+    if (!mscclCaller) mscclClearIsCallerFlag();
+    comm->collChannelBase = 0;
+    if (ret != ncclSuccess) goto exit;
+
+    CUDACHECKGOTO(cudaEventRecord(split->events[2], stream), ret, exit);
+    CUDACHECKGOTO(cudaStreamWaitEvent(stream, split->events[1], 0), ret, exit);
+    if (timed) {
+      split->pending = true;
+      split->pendingKey = key;
+    }
+    *done = true;
+  }
+
+exit:
+  CUDACHECK(cudaSetDevice(savedDevice));
+  return ret;
+}
+
+ncclResult_t mscclSplitTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclSplitStatus* split = commStatus.split;
+  if (split == nullptr) {
+    return ncclSuccess;
+  }
+  for (int i = 0; i < 3; i++) {
+    CUDACHECK(cudaEventDestroy(split->events[i]));
+  }
+  CUDACHECK(cudaStreamDestroy(split->stream));
+  delete split;
+  commStatus.split = nullptr;
+  return ncclSuccess;
+}
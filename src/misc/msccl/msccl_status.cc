@@ -11,6 +11,10 @@ mscclStatus& mscclGetStatus() {
   return status;
 }
 
+mscclCommStatus& mscclGetCommStatus(ncclComm_t comm) {
+  return *comm->mscclCommStatus;
+}
+
 mscclThreadLocalStatus& mscclGetThreadLocalStatus() {
   static thread_local mscclThreadLocalStatus threadLocalStatus;
   return threadLocalStatus;
@@ -0,0 +1,178 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+
+#include "msccl/msccl_parser.h"
+#include "msccl/msccl_status.h"
+#include "msccl/msccl_synth.h"
+
+NCCL_PARAM(MscclSynthesize, "MSCCL_SYNTHESIZE", 0);
+NCCL_PARAM(MscclSynthRings, "MSCCL_SYNTH_RINGS", 2);
+
+static const char* mscclSynthPrefix = "msccl-synth:";
+
+// Texts are never removed, algorithms of a comm may be loaded after it is gone from the catalog
+static std::mutex mscclSynthMutex;
+static std::map<std::string, std::string> mscclSynthTexts;
+
+bool mscclSynthEnabled() {
+  return ncclParamMscclSynthesize() != 0;
+}
+
+bool mscclIsSynthPath(const char* path) {
+  return strncmp(path, mscclSynthPrefix, strlen(mscclSynthPrefix)) == 0;
+}
+
+ncclResult_t mscclSynthGetText(const char* path, const char** data, size_t* size) {
+  std::lock_guard<std::mutex> lock(mscclSynthMutex);
+  auto it = mscclSynthTexts.find(path);
+  if (it == mscclSynthTexts.end()) {
+    WARN("MSCCL: synthesized algorithm %s is not known to this process", path);
+    return ncclInvalidUsage;
+  }
+  *data = it->second.data();
+  *size = it->second.size();
+  return ncclSuccess;
+}
+
+static std::string mscclSynthKeyStr(uint64_t key) {
+  char str[17];
+  snprintf(str, sizeof(str), "%016lx", key);
+  return str;
+}
+
+bool mscclSynthUsable(const std::string& path, ncclComm_t comm) {
+  uint64_t key = mscclGetCommStatus(comm).synthKey;
+  if (key == 0) return false;
+  std::string suffix = "." + mscclSynthKeyStr(key);
+  return path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Ring layouts to follow, each starting from rank 0 so that all ranks build the same ones
+static void mscclSynthRings(ncclComm_t comm, std::vector<std::vector<int>>* rings, uint64_t* key) {
+  int nRings = std::min((int)ncclParamMscclSynthRings(), comm->nChannels);
+  nRings = std::min(nRings, MAXCHANNELS);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int r = 0; r < nRings; r++) {
+    const int* userRanks = comm->channels[r].ring.userRanks;
+    int start = std::find(userRanks, userRanks + comm->nRanks, 0) - userRanks;
+    std::vector<int> ring(comm->nRanks);
+    for (int p = 0; p < comm->nRanks; p++) {
+      ring[p] = userRanks[(start + p) % comm->nRanks];
+      hash = (hash ^ (uint64_t)ring[p]) * 0x100000001b3ULL;
+    }
+    rings->push_back(ring);
+  }
+  *key = hash ? hash : 1;
+}
+
+static void mscclSynthStep(std::string* xml, int s, const char* type, const char* srcBuf, int srcOff, const char* dstBuf, int dstOff) {
+  char str[256];
+  snprintf(str, sizeof(str),
+    "<step s=\"%d\" type=\"%s\" srcbuf=\"%s\" srcoff=\"%d\" dstbuf=\"%s\" dstoff=\"%d\" cnt=\"1\" depid=\"-1\" deps=\"-1\" hasdep=\"0\"/>\n",
+    s, type, srcBuf, srcOff, dstBuf, dstOff);
+  *xml += str;
+}
+
+// Steps of the thread block of ring r on the rank at position p of the ring. Chunk c of a ring
+// is the one fully reduced, or owned, by the rank at position c.
+static void mscclSynthRingSteps(std::string* xml, mscclFunc_t func, const std::vector<int>& ring, int r, int nRings, int p) {
+  int n = ring.size();
+  auto pos = [n](int c) { return ((c % n) + n) % n; };
+  int s = 0;
+  if (func == mscclFuncAllReduce) {
+    // Reduce-scatter then allgather around the ring, chunk c of ring r at offset r*n + c
+    auto off = [n, r](int c) { return r * n + c; };
+    mscclSynthStep(xml, s++, "s", "i", off(pos(p - 1)), "i", off(pos(p - 1)));
+    for (int k = 1; k < n - 1; k++) {
+      mscclSynthStep(xml, s++, "rrs", "i", off(pos(p - 1 - k)), "i", off(pos(p - 1 - k)));
+    }
+    mscclSynthStep(xml, s++, "rrcs", "i", off(p), "o", off(p));
+    for (int k = 1; k < n - 1; k++) {
+      mscclSynthStep(xml, s++, "rcs", "o", off(pos(p - k)), "o", off(pos(p - k)));
+    }
+    mscclSynthStep(xml, s++, "r", "o", off(pos(p + 1)), "o", off(pos(p + 1)));
+  } else if (func == mscclFuncReduceScatter) {
+    // Block of rank d cut in nRings chunks, ring r carrying chunk r
+    auto off = [&ring, nRings, r](int c) { return ring[c] * nRings + r; };
+    mscclSynthStep(xml, s++, "s", "i", off(pos(p - 1)), "i", off(pos(p - 1)));
+    for (int k = 1; k < n - 1; k++) {
+      mscclSynthStep(xml, s++, "rrs", "i", off(pos(p - 1 - k)), "i", off(pos(p - 1 - k)));
+    }
+    mscclSynthStep(xml, s++, "rrc", "i", off(p), "o", r);
+  } else {
+    auto off = [&ring, nRings, r](int c) { return ring[c] * nRings + r; };
+    mscclSynthStep(xml, s++, "cpy", "i", r, "o", off(p));
+    mscclSynthStep(xml, s++, "s", "o", off(p), "o", off(p));
+    for (int k = 1; k < n - 1; k++) {
+      mscclSynthStep(xml, s++, "rcs", "o", off(pos(p - k)), "o", off(pos(p - k)));
+    }
+    mscclSynthStep(xml, s++, "r", "o", off(pos(p + 1)), "o", off(pos(p + 1)));
+  }
+}
+
+static void mscclSynthAlgo(const char* name, mscclFunc_t func, const std::vector<std::vector<int>>& rings, int nRanks, std::string* xml) {
+  int nRings = rings.size();
+  int nInput = func == mscclFuncAllGather ? nRings : nRanks * nRings;
+  int nOutput = func == mscclFuncReduceScatter ? nRings : nRanks * nRings;
+  const char* coll = func == mscclFuncAllReduce ? "allreduce" : func == mscclFuncReduceScatter ? "reducescatter" : "allgather";
+  char str[512];
+  snprintf(str, sizeof(str),
+    "<algo name=\"%s\" nchunksperloop=\"%d\" nchannels=\"%d\" ngpus=\"%d\" proto=\"Simple\" coll=\"%s\" inplace=\"1\" outofplace=\"1\" minBytes=\"0\" maxBytes=\"0\">\n",
+    name, std::max(nInput, nOutput), nRings, nRanks, coll);
+  *xml = str;
+  for (int g = 0; g < nRanks; g++) {
+    snprintf(str, sizeof(str), "<gpu id=\"%d\" i_chunks=\"%d\" o_chunks=\"%d\" s_chunks=\"0\">\n", g, nInput, nOutput);
+    *xml += str;
+    for (int r = 0; r < nRings; r++) {
+      const std::vector<int>& ring = rings[r];
+      int p = std::find(ring.begin(), ring.end(), g) - ring.begin();
+      snprintf(str, sizeof(str), "<tb id=\"%d\" send=\"%d\" recv=\"%d\" chan=\"%d\">\n", r, ring[(p + 1) % nRanks],
+        ring[(p + nRanks - 1) % nRanks], r);
+      *xml += str;
+      mscclSynthRingSteps(xml, func, ring, r, nRings, p);
+      *xml += "</tb>\n";
+    }
+    *xml += "</gpu>\n";
+  }
+  *xml += "</algo>\n";
+}
+
+ncclResult_t mscclSynthesizeAlgos(ncclComm_t comm, std::vector<std::string>* paths) {
+  int nRanks = comm->nRanks;
+  std::vector<std::vector<int>> rings;
+  uint64_t key;
+  if (nRanks < 2) return ncclSuccess;
+  mscclSynthRings(comm, &rings, &key);
+  int nRings = rings.size();
+  // The allreduce has the most steps, 2*nRanks-1 per thread block
+  if (nRings == 0 || 2 * nRanks - 1 > MSCCL_MAX_NUM_STEPS || nRings * 2 * nRanks + nRanks + nRings + 2 > MAX_NODES) {
+    INFO(NCCL_INIT, "MSCCL: No algorithm synthesized for %d ranks on %d rings", nRanks, nRings);
+    return ncclSuccess;
+  }
+  mscclGetCommStatus(comm).synthKey = key;
+  const mscclFunc_t funcs[] = { mscclFuncAllReduce, mscclFuncReduceScatter, mscclFuncAllGather };
+  const char* names[] = { "allreduce", "reducescatter", "allgather" };
+  std::lock_guard<std::mutex> lock(mscclSynthMutex);
+  for (int f = 0; f < 3; f++) {
+    std::string path = std::string(mscclSynthPrefix) + names[f] + ".ring" + std::to_string(nRings) + ".n" +
+      std::to_string(nRanks) + "." + mscclSynthKeyStr(key);
+    if (mscclSynthTexts.find(path) == mscclSynthTexts.end()) {
+      mscclSynthAlgo(path.c_str(), funcs[f], rings, nRanks, &mscclSynthTexts[path]);
+    }
+    paths->push_back(path);
+  }
+  INFO(NCCL_INIT, "MSCCL: Synthesized %zu algorithms on %d rings for %d ranks", paths->size(), nRings, nRanks);
+  return ncclSuccess;
+}
@@ -0,0 +1,205 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+
+#include "alloc.h"
+#include "bitops.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+
+#include "msccl/msccl_status.h"
+#include "msccl/msccl_telemetry.h"
+
+NCCL_PARAM(MscclTelemetry, "MSCCL_TELEMETRY", 1);
+
+bool mscclTelemetryEnabled() {
+  return ncclParamMscclTelemetry() != 0;
+}
+
+// Bit 63 tells a taken key from a free entry, handles are not negative
+static uint64_t mscclTelemetryKey(mscclAlgoHandle_t handle, const struct mscclAlgo* hostAlgo, size_t nBytes) {
+  int log2Bytes = nBytes == 0 ? 0 : log2Down(nBytes);
+  return (1ULL << 63) | ((uint64_t)(uint32_t)handle << 24) | ((uint64_t)(hostAlgo->func & 0xff) << 16) |
+    ((uint64_t)(hostAlgo->protocol & 0xff) << 8) | (uint64_t)log2Bytes;
+}
+
+static int mscclTelemetryBucket(uint64_t value) {
+  return value < 2 ? 0 : std::min(log2Down(value), MSCCL_HISTOGRAM_BUCKETS - 1);
+}
+
+// Only called by the thread holding folding, which is the only one taking entries
+static struct mscclTelemetryEntry* mscclTelemetryFindEntry(struct mscclTelemetryStatus* tel, uint64_t key) {
+  int first = (int)((key * 0x9E3779B97F4A7C15ULL) >> 56) % MSCCL_TELEMETRY_MAX_KEYS;
+  for (int i = 0; i < MSCCL_TELEMETRY_MAX_KEYS; i++) {
+    struct mscclTelemetryEntry* entry = &tel->entries[(first + i) % MSCCL_TELEMETRY_MAX_KEYS];
+    uint64_t entryKey = entry->key.load(std::memory_order_relaxed);
+    if (entryKey == key) return entry;
+    if (entryKey == 0) {
+      entry->minNs.store(UINT64_MAX, std::memory_order_relaxed);
+      entry->key.store(key, std::memory_order_release);
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+static void mscclTelemetryAdd(struct mscclTelemetryStatus* tel, uint64_t key, size_t nBytes, uint64_t ns) {
+  struct mscclTelemetryEntry* entry = mscclTelemetryFindEntry(tel, key);
+  if (entry == nullptr) {
+    tel->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // bytes per ns are GB/s, 1000 times the MB/s of the buckets
+  uint64_t mbps = ns == 0 ? UINT64_MAX : (uint64_t)((double)nBytes * 1000.0 / ns);
+  entry->latency[mscclTelemetryBucket(ns / 1000)].fetch_add(1, std::memory_order_relaxed);
+  entry->bandwidth[mscclTelemetryBucket(mbps)].fetch_add(1, std::memory_order_relaxed);
+  entry->sumNs.fetch_add(ns, std::memory_order_relaxed);
+  if (ns < entry->minNs.load(std::memory_order_relaxed)) entry->minNs.store(ns, std::memory_order_relaxed);
+  if (ns > entry->maxNs.load(std::memory_order_relaxed)) entry->maxNs.store(ns, std::memory_order_relaxed);
+  entry->count.fetch_add(1, std::memory_order_release);
+}
+
+// Fold the launches the GPU is done with, in launch order. Another thread already folding has
+// them covered, so this one does not wait for it.
+static void mscclTelemetryFold(struct mscclTelemetryStatus* tel) {
+  if (tel->folding.test_and_set(std::memory_order_acquire)) return;
+  while (true) {
+    struct mscclTelemetrySlot* slot = &tel->slots[tel->foldSeq % MSCCL_TELEMETRY_RING];
+    if (slot->seq.load(std::memory_order_acquire) != tel->foldSeq) break;
+    volatile struct mscclTelemetryRecord* record = tel->records + tel->foldSeq % MSCCL_TELEMETRY_RING;
+    if (record->seq != tel->foldSeq) break;
+    uint64_t start = record->start;
+    uint64_t end = record->end;
+    mscclTelemetryAdd(tel, slot->key, slot->nBytes, end > start ? end - start : 0);
+    slot->seq.store(0, std::memory_order_release);
+    tel->foldSeq++;
+  }
+  tel->folding.clear(std::memory_order_release);
+}
+
+static ncclResult_t mscclTelemetryInit(ncclComm_t comm, struct mscclTelemetryStatus** telemetry) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  if (commStatus.telemetry == nullptr) {
+    struct mscclTelemetryStatus* tel = new mscclTelemetryStatus();
+    ncclResult_t ret = ncclCudaHostCalloc(&tel->records, MSCCL_TELEMETRY_RING);
+    if (ret != ncclSuccess) {
+      delete tel;
+      return ret;
+    }
+    for (int i = 0; i < MSCCL_TELEMETRY_RING; i++) tel->slots[i].seq.store(0);
+    for (int i = 0; i < MSCCL_TELEMETRY_MAX_KEYS; i++) tel->entries[i].key.store(0);
+    tel->folding.clear();
+    tel->dropped.store(0);
+    // seq 0 stands for a free slot and a record never written
+    tel->nextSeq = 1;
+    tel->foldSeq = 1;
+    tel->pending = false;
+    commStatus.telemetry = tel;
+  }
+  *telemetry = commStatus.telemetry;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTelemetryBegin(mscclAlgoHandle_t handle, const struct mscclAlgo* hostAlgo, size_t nBytes,
+    ncclComm_t comm) {
+  if (!mscclTelemetryEnabled()) {
+    return ncclSuccess;
+  }
+  // Replays of a graph would all write the record of the captured launch
+  if (mscclGetThreadLocalStatus().captureStatus != mscclNoCapture) {
+    return ncclSuccess;
+  }
+  struct mscclTelemetryStatus* tel;
+  NCCLCHECK(mscclTelemetryInit(comm, &tel));
+  mscclTelemetryFold(tel);
+  tel->pending = true;
+  tel->pendingKey = mscclTelemetryKey(handle, hostAlgo, nBytes);
+  tel->pendingBytes = nBytes;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTelemetryAttach(ncclComm_t comm, struct mscclWork* work) {
+  struct mscclTelemetryStatus* tel = mscclGetCommStatus(comm).telemetry;
+  if (tel == nullptr || !tel->pending) {
+    return ncclSuccess;
+  }
+  tel->pending = false;
+  struct mscclTelemetrySlot* slot = &tel->slots[tel->nextSeq % MSCCL_TELEMETRY_RING];
+  if (slot->seq.load(std::memory_order_acquire) != 0) {
+    tel->dropped.fetch_add(1, std::memory_order_relaxed);
+    return ncclSuccess;
+  }
+  slot->key = tel->pendingKey;
+  slot->nBytes = tel->pendingBytes;
+  slot->seq.store(tel->nextSeq, std::memory_order_release);
+  work->telemetry = tel->records + tel->nextSeq % MSCCL_TELEMETRY_RING;
+  work->telemetrySeq = tel->nextSeq;
+  tel->nextSeq++;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTelemetryEnd(ncclComm_t comm) {
+  struct mscclTelemetryStatus* tel = comm->mscclCommStatus ? mscclGetCommStatus(comm).telemetry : nullptr;
+  if (tel != nullptr) tel->pending = false;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTelemetryQuery(ncclComm_t comm, mscclLatencyHistogram_t* histograms, int* nHistograms,
+    unsigned long long* dropped) {
+  struct mscclTelemetryStatus* tel = comm->mscclCommStatus ? mscclGetCommStatus(comm).telemetry : nullptr;
+  int capacity = histograms ? *nHistograms : 0;
+  int n = 0;
+  if (dropped) *dropped = tel ? tel->dropped.load(std::memory_order_relaxed) : 0;
+  if (tel == nullptr) {
+    *nHistograms = 0;
+    return ncclSuccess;
+  }
+  mscclTelemetryFold(tel);
+  for (int i = 0; i < MSCCL_TELEMETRY_MAX_KEYS; i++) {
+    struct mscclTelemetryEntry* entry = &tel->entries[i];
+    uint64_t key = entry->key.load(std::memory_order_acquire);
+    if (key == 0) continue;
+    uint64_t count = entry->count.load(std::memory_order_acquire);
+    if (count == 0) continue;
+    if (n < capacity) {
+      // A snapshot, the launching thread may be adding to the entry
+      mscclLatencyHistogram_t* h = histograms + n;
+      h->algoHandle = (mscclAlgoHandle_t)((key >> 24) & 0x7fffffff);
+      h->func = (int)((key >> 16) & 0xff);
+      h->protocol = (int)((key >> 8) & 0xff);
+      h->log2Bytes = (int)(key & 0xff);
+      h->count = count;
+      h->sumUs = entry->sumNs.load(std::memory_order_relaxed) / 1000.0;
+      h->minUs = entry->minNs.load(std::memory_order_relaxed) / 1000.0;
+      h->maxUs = entry->maxNs.load(std::memory_order_relaxed) / 1000.0;
+      for (int b = 0; b < MSCCL_HISTOGRAM_BUCKETS; b++) {
+        h->latency[b] = entry->latency[b].load(std::memory_order_relaxed);
+        h->bandwidth[b] = entry->bandwidth[b].load(std::memory_order_relaxed);
+      }
+    }
+    n++;
+  }
+  *nHistograms = n;
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTelemetryTeardown(ncclComm_t comm) {
+  mscclCommStatus& commStatus = mscclGetCommStatus(comm);
+  struct mscclTelemetryStatus* tel = commStatus.telemetry;
+  if (tel == nullptr) {
+    return ncclSuccess;
+  }
+  mscclTelemetryFold(tel);
+  if (tel->nextSeq != tel->foldSeq) {
+    INFO(NCCL_COLL, "MSCCL: %lu timed launches of rank %d never completed", (unsigned long)(tel->nextSeq - tel->foldSeq),
+      comm->rank);
+  }
+  NCCLCHECK(ncclCudaHostFree(tel->records));
+  delete tel;
+  commStatus.telemetry = nullptr;
+  return ncclSuccess;
+}
@@ -0,0 +1,148 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "graph/topo.h"
+
+#include "msccl/msccl_status.h"
+#include "msccl/msccl_topo.h"
+
+// What a rank sees of its node
+struct mscclRankTopo {
+  int nvlink;
+  int nvswitch;
+  int nNics;
+  // NIC of the first channel, -1 without NICs
+  int netDev;
+  // ranks reachable over NVLink, its multi-node NVLink clique or else its node
+  int domainRanks;
+  int mnnvl;
+};
+
+static ncclResult_t mscclGetRankTopo(ncclComm_t comm, struct mscclRankTopo* rankTopo) {
+  struct ncclTopoSystem* system = comm->topo;
+  rankTopo->nvlink = 1;
+  for (int g = 0; g < system->nodes[GPU].count; g++) {
+    for (int p = 0; p < system->nodes[GPU].count; p++) {
+      // NVLink bridges through other GPUs still keep the traffic on NVLink
+      if (p != g && system->nodes[GPU].nodes[g].paths[GPU][p].type > PATH_NVB) rankTopo->nvlink = 0;
+    }
+  }
+  rankTopo->nvswitch = system->nodes[NVS].count > 0;
+  rankTopo->nNics = system->nodes[NET].count;
+  rankTopo->netDev = -1;
+  rankTopo->mnnvl = comm->MNNVL;
+  rankTopo->domainRanks = comm->MNNVL ? comm->clique.size : comm->localRanks;
+  if (rankTopo->nNics > 0) {
+    NCCLCHECK(ncclTopoGetLocalNet(system, comm->rank, 0, NULL, &rankTopo->netDev));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t mscclTopoInit(ncclComm_t comm) {
+  ncclResult_t ret = ncclSuccess;
+  struct mscclRankTopo* rankTopos;
+  struct mscclCommTopo* topo;
+  NCCLCHECK(ncclCalloc(&rankTopos, comm->nRanks));
+  NCCLCHECKGOTO(ncclCalloc(&topo, 1), ret, exit);
+  mscclGetCommStatus(comm).topo = topo;
+  NCCLCHECKGOTO(mscclGetRankTopo(comm, rankTopos + comm->rank), ret, exit);
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, rankTopos, sizeof(struct mscclRankTopo)), ret, exit);
+
+  topo->nLocalRanks = comm->nodeRanks[0].localRanks;
+  for (int n = 1; n < comm->nNodes; n++) {
+    if (comm->nodeRanks[n].localRanks != topo->nLocalRanks) topo->nLocalRanks = 0;
+  }
+  topo->nNics = rankTopos[0].nNics;
+  topo->nvlink = true;
+  topo->nvswitch = true;
+  topo->nDomainRanks = rankTopos[0].domainRanks;
+  topo->mnnvl = true;
+  for (int r = 0; r < comm->nRanks; r++) {
+    if (rankTopos[r].nNics != topo->nNics) topo->nNics = 0;
+    topo->nvlink &= rankTopos[r].nvlink != 0;
+    topo->nvswitch &= rankTopos[r].nvswitch != 0;
+    if (rankTopos[r].domainRanks != topo->nDomainRanks) topo->nDomainRanks = 0;
+    topo->mnnvl &= rankTopos[r].mnnvl != 0;
+  }
+  // Rails line up when every local rank reaches the network through the same NIC on every node
+  topo->railAligned = topo->nLocalRanks > 0;
+  for (int n = 0; n < comm->nNodes && topo->railAligned; n++) {
+    for (int l = 0; l < topo->nLocalRanks; l++) {
+      int netDev = rankTopos[comm->nodeRanks[n].localRankToRank[l]].netDev;
+      if (netDev < 0 || netDev != rankTopos[comm->nodeRanks[0].localRankToRank[l]].netDev) topo->railAligned = false;
+    }
+  }
+
+  if (topo->nLocalRanks > 0) {
+    bool identity = true;
+    for (int r = 0; r < comm->nRanks; r++) {
+      identity &= comm->rankToNode[r] * topo->nLocalRanks + comm->rankToLocalRank[r] == r;
+    }
+    if (!identity) {
+      NCCLCHECKGOTO(ncclCalloc(&topo->rankToLogical, comm->nRanks), ret, exit);
+      NCCLCHECKGOTO(ncclCalloc(&topo->logicalToRank, comm->nRanks), ret, exit);
+      for (int r = 0; r < comm->nRanks; r++) {
+        int logical = comm->rankToNode[r] * topo->nLocalRanks + comm->rankToLocalRank[r];
+        topo->rankToLogical[r] = logical;
+        topo->logicalToRank[logical] = r;
+      }
+    }
+  }
+  INFO(NCCL_INIT, "MSCCL: Topology of %d nodes with %d local ranks, %d NICs, nvlink %d nvswitch %d rails %d, NVLink domains of %d ranks mnnvl %d%s",
+    comm->nNodes, topo->nLocalRanks, topo->nNics, topo->nvlink, topo->nvswitch, topo->railAligned, topo->nDomainRanks, topo->mnnvl,
+    topo->logicalToRank ? ", ranks remapped to node order" : "");
+exit:
+  free(rankTopos);
+  return ret;
+}
+
+ncclResult_t mscclTopoTeardown(ncclComm_t comm) {
+  struct mscclCommTopo* topo = mscclGetCommStatus(comm).topo;
+  if (topo == nullptr) return ncclSuccess;
+  free(topo->rankToLogical);
+  free(topo->logicalToRank);
+  free(topo);
+  mscclGetCommStatus(comm).topo = nullptr;
+  return ncclSuccess;
+}
+
+bool mscclTopoRemapped(const struct mscclAlgoMeta& m, ncclComm_t comm) {
+  const struct mscclCommTopo* topo = mscclGetCommStatus(comm).topo;
+  return m.topo.nLocalRanks > 0 && topo != nullptr && topo->logicalToRank != nullptr;
+}
+
+bool mscclTopoConstrained(const struct mscclAlgoMeta& m) {
+  const struct mscclAlgoTopo& want = m.topo;
+  return want.nLocalRanks != 0 || want.nNics != 0 || want.nvlink >= 0 || want.nvswitch >= 0 || want.rails != 0 ||
+    want.nDomainRanks != 0 || want.mnnvl >= 0;
+}
+
+bool mscclTopoUsable(const struct mscclAlgoMeta& m, ncclComm_t comm) {
+  const struct mscclAlgoTopo& want = m.topo;
+  const struct mscclCommTopo* topo = mscclGetCommStatus(comm).topo;
+  if (topo == nullptr) return !mscclTopoConstrained(m);
+  if (want.nLocalRanks > 0 && want.nLocalRanks != topo->nLocalRanks) return false;
+  if (want.nNics > 0 && want.nNics != topo->nNics) return false;
+  if (want.nvlink >= 0 && (want.nvlink != 0) != topo->nvlink) return false;
+  if (want.nvswitch >= 0 && (want.nvswitch != 0) != topo->nvswitch) return false;
+  if (want.rails > 0 && !topo->railAligned) return false;
+  if (want.nDomainRanks > 0 && want.nDomainRanks != topo->nDomainRanks) return false;
+  if (want.mnnvl >= 0 && (want.mnnvl != 0) != topo->mnnvl) return false;
+  // Other collectives place the data of each rank by its rank, which remapping would move
+  if (mscclTopoRemapped(m, comm) && m.func != mscclFuncAllReduce) return false;
+  return true;
+}
+
+void mscclTopoRemapAlgo(struct mscclAlgo* algo, const int* logicalToRank) {
+  for (int b = 0; b < algo->nBlocks; b++) {
+    struct mscclThreadBlock* tb = algo->mscclTBs + b;
+    for (int p = 0; p < tb->nSendPeers; p++) tb->sendPeers[p] = logicalToRank[tb->sendPeers[p]];
+    for (int p = 0; p < tb->nRecvPeers; p++) tb->recvPeers[p] = logicalToRank[tb->recvPeers[p]];
+  }
+  for (int i = 0; i < algo->nPeerInfos; i++) algo->peerInfos[i].peer = logicalToRank[algo->peerInfos[i].peer];
+}
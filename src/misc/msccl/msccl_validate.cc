@@ -0,0 +1,272 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "bootstrap.h"
+#include "checks.h"
+#include "comm.h"
+#include "param.h"
+
+#include "msccl/msccl_validate.h"
+
+// 0 disables the checks, 1 fails on what would hang and warns about races, 2 also fails on races
+NCCL_PARAM(MscclValidate, "MSCCL_VALIDATE", 1);
+
+// Races are looked for with a clock per step and thread block, bigger programs skip them
+#define MSCCL_VALIDATE_MAX_CLOCKS (1 << 24)
+#define MSCCL_VALIDATE_MAX_REPORTS 8
+
+static const char* mscclValidateBufferName(int buffer) {
+  return buffer == MSCCL_INPUT_BUFFER ? "input" : buffer == MSCCL_OUTPUT_BUFFER ? "output" : "scratch";
+}
+
+static bool mscclValidateReadsSrc(int type) {
+  return type == MSCCL_SEND || type == MSCCL_RECV_REDUCE_SEND || type == MSCCL_RECV_REDUCE_COPY ||
+    type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_LOCAL_COPY || type == MSCCL_REDUCE ||
+    type == MSCCL_RECV_REDUCE_COPY_N || type == MSCCL_SEND_N || type == MSCCL_MULTIMEM_ST || type == MSCCL_COLLNET_ALLREDUCE;
+}
+
+static bool mscclValidateWritesDst(int type) {
+  return type == MSCCL_RECV || type == MSCCL_RECV_COPY_SEND || type == MSCCL_RECV_REDUCE_COPY ||
+    type == MSCCL_RECV_REDUCE_COPY_SEND || type == MSCCL_LOCAL_COPY || type == MSCCL_REDUCE ||
+    type == MSCCL_RECV_REDUCE_COPY_N || type == MSCCL_MULTIMEM_LD_REDUCE || type == MSCCL_COLLNET_ALLREDUCE;
+}
+
+struct mscclValidateAccess {
+  int node;
+  bool write;
+};
+
+static void mscclValidateAddAccesses(std::map<std::pair<int, int>, std::vector<struct mscclValidateAccess>>& accesses, int buffer, int offset, int count, int node, bool write) {
+  for (int c = 0; c < count; c++) {
+    accesses[std::make_pair(buffer, offset + c)].push_back({node, write});
+  }
+}
+
+ncclResult_t mscclValidateAlgo(const struct mscclAlgo* algo, int rank) {
+  const int level = ncclParamMscclValidate();
+  if (level == 0) return ncclSuccess;
+  const int nBlocks = algo->nBlocks;
+
+  // Steps of all thread blocks are numbered one after the other, and named as in the XML by the
+  // step counter of the kernel, which also counts the nops and the fused reductions
+  std::vector<int> firstNode(nBlocks + 1, 0);
+  for (int b = 0; b < nBlocks; b++) firstNode[b + 1] = firstNode[b] + algo->mscclTBs[b].nSteps;
+  const int nNodes = firstNode[nBlocks];
+  std::vector<int> blockOf(nNodes);
+  std::vector<int> stepOf(nNodes);
+  std::vector<bool> flagged(nNodes);
+  for (int b = 0; b < nBlocks; b++) {
+    const struct mscclThreadBlock* tb = algo->mscclTBs + b;
+    int step = 0;
+    for (int i = 0; i < tb->nSteps; i++) {
+      const struct mscclTransmission* t = tb->transmissions + i;
+      if (t->numDependencies > 0) step += t->numDependencies - 1;
+      if (t->type == MSCCL_REDUCE && t->numReductions > 0) step += t->numReductions - 1;
+      blockOf[firstNode[b] + i] = b;
+      stepOf[firstNode[b] + i] = step++;
+      flagged[firstNode[b] + i] = t->hasDependence != 0;
+    }
+  }
+
+  // A dependency waits for the first step of its thread block that flags at least its step
+  std::vector<std::vector<int>> preds(nNodes);
+  std::vector<std::vector<int>> succs(nNodes);
+  for (int b = 0; b < nBlocks; b++) {
+    const struct mscclThreadBlock* tb = algo->mscclTBs + b;
+    for (int i = 0; i < tb->nSteps; i++) {
+      const struct mscclTransmission* t = tb->transmissions + i;
+      const int node = firstNode[b] + i;
+      if (i > 0) preds[node].push_back(node - 1);
+      for (int d = 0; d < t->numDependencies; d++) {
+        int depBid = tb->dependentBid[t->dependencePointer + d];
+        int depStep = tb->dependentStep[t->dependencePointer + d];
+        if (depBid < 0 || depBid >= nBlocks) {
+          WARN("MSCCL: step %d of thread block %d on GPU %d depends on thread block %d, which does not exist", stepOf[node], b, rank, depBid);
+          return ncclInvalidUsage;
+        }
+        int target = -1;
+        for (int n = firstNode[depBid]; n < firstNode[depBid + 1] && target < 0; n++) {
+          if (flagged[n] && stepOf[n] >= depStep) target = n;
+        }
+        if (target < 0) {
+          WARN("MSCCL: step %d of thread block %d on GPU %d depends on step %d of thread block %d, which is never flagged", stepOf[node], b, rank, depStep, depBid);
+          return ncclInvalidUsage;
+        }
+        preds[node].push_back(target);
+      }
+      for (int p : preds[node]) succs[p].push_back(node);
+    }
+  }
+
+  // Steps left out of a topological order wait on each other
+  std::vector<int> order;
+  std::vector<int> nPending(nNodes);
+  order.reserve(nNodes);
+  for (int n = 0; n < nNodes; n++) {
+    nPending[n] = preds[n].size();
+    if (nPending[n] == 0) order.push_back(n);
+  }
+  for (size_t o = 0; o < order.size(); o++) {
+    for (int s : succs[order[o]]) {
+      if (--nPending[s] == 0) order.push_back(s);
+    }
+  }
+  if ((int)order.size() < nNodes) {
+    // Walk back through waiting steps until one repeats, that is a cycle
+    int node = 0;
+    while (nPending[node] == 0) node++;
+    std::vector<int> visit(nNodes, -1);
+    std::vector<int> path;
+    while (visit[node] < 0) {
+      visit[node] = path.size();
+      path.push_back(node);
+      for (int p : preds[node]) {
+        if (nPending[p] > 0) { node = p; break; }
+      }
+    }
+    WARN("MSCCL: dependencies of GPU %d form a cycle of %zu steps:", rank, path.size() - visit[node]);
+    for (int i = visit[node]; i < (int)path.size() && i < visit[node] + 2 * MSCCL_VALIDATE_MAX_REPORTS; i++) {
+      WARN("MSCCL:   thread block %d step %d", blockOf[path[i]], stepOf[path[i]]);
+    }
+    return ncclInvalidUsage;
+  }
+
+  if ((int64_t)nNodes * nBlocks > MSCCL_VALIDATE_MAX_CLOCKS) {
+    INFO(NCCL_INIT, "MSCCL: GPU %d has %d steps in %d thread blocks, races are not checked", rank, nNodes, nBlocks);
+    return ncclSuccess;
+  }
+  // clocks[n][b]: last step of thread block b that finishes before step n
+  std::vector<int16_t> clocks((size_t)nNodes * nBlocks, -1);
+  for (int n : order) {
+    int16_t* clock = clocks.data() + (size_t)n * nBlocks;
+    for (int p : preds[n]) {
+      const int16_t* predClock = clocks.data() + (size_t)p * nBlocks;
+      for (int b = 0; b < nBlocks; b++) clock[b] = std::max(clock[b], predClock[b]);
+    }
+    clock[blockOf[n]] = n - firstNode[blockOf[n]];
+  }
+
+  std::map<std::pair<int, int>, std::vector<struct mscclValidateAccess>> accesses;
+  for (int b = 0; b < nBlocks; b++) {
+    const struct mscclThreadBlock* tb = algo->mscclTBs + b;
+    for (int i = 0; i < tb->nSteps; i++) {
+      const struct mscclTransmission* t = tb->transmissions + i;
+      const int node = firstNode[b] + i;
+      if (t->type == MSCCL_REDUCE) {
+        for (int r = 0; r < t->numReductions; r++) {
+          mscclValidateAddAccesses(accesses, t->srcBuffer, tb->reductionSrcOffsets[t->reductionPointer + r], t->count, node, false);
+        }
+      } else if (mscclValidateReadsSrc(t->type)) {
+        mscclValidateAddAccesses(accesses, t->srcBuffer, t->srcOffset, t->count, node, false);
+      }
+      if (mscclValidateWritesDst(t->type)) {
+        mscclValidateAddAccesses(accesses, t->dstBuffer, t->dstOffset, t->count, node, true);
+      }
+    }
+  }
+  int nRaces = 0;
+  for (auto& chunk : accesses) {
+    auto& list = chunk.second;
+    for (size_t i = 0; i < list.size(); i++) {
+      for (size_t j = i + 1; j < list.size(); j++) {
+        int a = list[i].node, b = list[j].node;
+        int blockA = blockOf[a], blockB = blockOf[b];
+        if (blockA == blockB || !(list[i].write || list[j].write)) continue;
+        if (clocks[(size_t)b * nBlocks + blockA] >= a - firstNode[blockA]) continue;
+        if (clocks[(size_t)a * nBlocks + blockB] >= b - firstNode[blockB]) continue;
+        if (nRaces++ < MSCCL_VALIDATE_MAX_REPORTS) {
+          WARN("MSCCL: step %d of thread block %d and step %d of thread block %d on GPU %d access chunk %d of the %s buffer in any order",
+            stepOf[a], blockA, stepOf[b], blockB, rank, chunk.first.second, mscclValidateBufferName(chunk.first.first));
+        }
+      }
+    }
+  }
+  if (nRaces > 0) {
+    WARN("MSCCL: GPU %d has %d races between its thread blocks%s", rank, nRaces,
+      level >= 2 ? "" : ", set NCCL_MSCCL_VALIDATE=2 to reject such algorithms");
+    if (level >= 2) return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+static uint64_t mscclValidateMix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Both ends of a connection hash what goes through it alike, regardless of how their thread blocks split it
+static void mscclValidatePeers(const struct mscclAlgo* algo, const int16_t* peerInfos, int nPeers,
+    std::map<int, std::vector<int>>& peers) {
+  for (int p = 0; p < nPeers; p++) {
+    const struct mscclChannelPeerInfo* peerInfo = algo->peerInfos + peerInfos[p];
+    auto& counts = peers[peerInfo->peer];
+    counts.resize(MSCCL_MAX_COUNT + 1, 0);
+    for (int c = 1; c <= MSCCL_MAX_COUNT; c++) counts[c] += peerInfo->nTransmissionsOfCount[c];
+  }
+}
+
+static uint64_t mscclValidateDigest(const std::map<int, std::vector<int>>& peers, int rank, bool send, int channel) {
+  uint64_t digest = 0;
+  for (auto& p : peers) {
+    int src = send ? rank : p.first;
+    int dst = send ? p.first : rank;
+    uint64_t h = mscclValidateMix(mscclValidateMix(mscclValidateMix(src) + dst) + channel);
+    for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
+      if (p.second[c] > 0) h = mscclValidateMix(h + ((uint64_t)c << 32) + p.second[c]);
+    }
+    digest += h;
+  }
+  return digest;
+}
+
+static void mscclValidateReportPeers(const std::map<int, std::vector<int>>& peers, int rank, bool send, int channel) {
+  for (auto& p : peers) {
+    int nTransmissions = 0, nChunks = 0;
+    for (int c = 1; c <= MSCCL_MAX_COUNT; c++) {
+      nTransmissions += p.second[c];
+      nChunks += c * p.second[c];
+    }
+    WARN("MSCCL: rank %d channel %d %s %d transmissions of %d chunks %s rank %d", rank, channel, send ? "sends" : "receives",
+      nTransmissions, nChunks, send ? "to" : "from", p.first);
+  }
+}
+
+ncclResult_t mscclValidateAlgoPeers(const struct mscclAlgo* algo, ncclComm_t comm) {
+  if (ncclParamMscclValidate() == 0) return ncclSuccess;
+  // Channel digests of the sends then of the receives, for every rank
+  std::vector<uint64_t> digests((size_t)comm->nRanks * 2 * MAXCHANNELS, 0);
+  std::vector<std::map<int, std::vector<int>>> sendPeers(algo->nChannels), recvPeers(algo->nChannels);
+  uint64_t* myDigests = digests.data() + (size_t)comm->rank * 2 * MAXCHANNELS;
+  for (int ch = 0; ch < algo->nChannels; ch++) {
+    const struct mscclChannelInfo* mCh = algo->mscclChannels + ch;
+    mscclValidatePeers(algo, mCh->sendPeerInfos, mCh->nSendPeers, sendPeers[ch]);
+    mscclValidatePeers(algo, mCh->recvPeerInfos, mCh->nRecvPeers, recvPeers[ch]);
+    myDigests[ch] = mscclValidateDigest(sendPeers[ch], comm->rank, true, ch);
+    myDigests[MAXCHANNELS + ch] = mscclValidateDigest(recvPeers[ch], comm->rank, false, ch);
+  }
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, digests.data(), 2 * MAXCHANNELS * sizeof(uint64_t)));
+
+  bool mismatch = false;
+  for (int ch = 0; ch < algo->nChannels; ch++) {
+    uint64_t sends = 0, recvs = 0;
+    for (int r = 0; r < comm->nRanks; r++) {
+      sends += digests[(size_t)r * 2 * MAXCHANNELS + ch];
+      recvs += digests[(size_t)r * 2 * MAXCHANNELS + MAXCHANNELS + ch];
+    }
+    if (sends == recvs) continue;
+    // Every rank adds what it does on the channel, so that the logs show which peers disagree
+    if (comm->rank == 0) WARN("MSCCL: sends and receives of channel %d do not match between ranks", ch);
+    mscclValidateReportPeers(sendPeers[ch], comm->rank, true, ch);
+    mscclValidateReportPeers(recvPeers[ch], comm->rank, false, ch);
+    mismatch = true;
+  }
+  return mismatch ? ncclInvalidUsage : ncclSuccess;
+}
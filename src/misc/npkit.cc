@@ -1,12 +1,42 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <mutex>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "alloc.h"
+#include "bootstrap.h"
+#include "param.h"
+#include "socket.h"
 #include "npkit/npkit.h"
 
+// 0 picks kDefaultNumGpuEventsPerBuffer, or kDefaultNumGpuEventsPerRing in ring mode
+NCCL_PARAM(NpKitGpuEventsPerBuffer, "NPKIT_GPU_EVENTS_PER_BUFFER", 0);
+NCCL_PARAM(NpKitCpuEventsPerBuffer, "NPKIT_CPU_EVENTS_PER_BUFFER", 0);
+// Stream GPU events to NPKIT_DUMP_DIR while the job runs instead of keeping the first ones
+NCCL_PARAM(NpKitRing, "NPKIT_RING", 0);
+NCCL_PARAM(NpKitDrainIntervalMs, "NPKIT_DRAIN_INTERVAL_MS", 10);
+// Estimate the offset of the CPU clock of rank 0 at Init and then every interval
+NCCL_PARAM(NpKitClockSync, "NPKIT_CLOCK_SYNC", 1);
+NCCL_PARAM(NpKitClockSyncIntervalMs, "NPKIT_CLOCK_SYNC_INTERVAL_MS", 1000);
+NCCL_PARAM(NpKitClockSyncRounds, "NPKIT_CLOCK_SYNC_ROUNDS", 16);
+// Write the dump from a thread so that comm destroy does not wait for the file system
+NCCL_PARAM(NpKitDumpAsync, "NPKIT_DUMP_ASYNC", 1);
+// Delta encode the timestamps of NCCL_NPKIT_DUMP_FORMAT=bin
+NCCL_PARAM(NpKitDumpDelta, "NPKIT_DUMP_DELTA", 1);
+
 uint64_t NpKit::rank_ = 0;
 
+NpKitEventMask NpKit::event_mask_ = {};
+
+uint64_t NpKit::num_gpu_events_per_buffer_ = 0;
+uint64_t NpKit::num_cpu_events_per_buffer_ = 0;
+
 NpKitEvent** NpKit::gpu_event_buffers_ = nullptr;
 NpKitEvent** NpKit::cpu_event_buffers_ = nullptr;
 
@@ -17,6 +47,62 @@ uint64_t* NpKit::cpu_timestamp_ = nullptr;
 std::thread* NpKit::cpu_timestamp_update_thread_ = nullptr;
 volatile bool NpKit::cpu_timestamp_update_thread_should_stop_ = false;
 
+bool NpKit::gpu_ring_mode_ = false;
+std::string NpKit::gpu_drain_dir_;
+uint64_t* NpKit::gpu_drain_heads_ = nullptr;
+std::vector<uint64_t> NpKit::gpu_drain_tails_;
+std::vector<std::ofstream> NpKit::gpu_drain_files_;
+std::vector<NpKitEvent> NpKit::gpu_drain_copy_;
+uint64_t NpKit::gpu_drain_lost_ = 0;
+std::thread* NpKit::gpu_drain_thread_ = nullptr;
+volatile bool NpKit::gpu_drain_thread_should_stop_ = false;
+
+// NCCL_NPKIT_EVENTS is "all" or a comma separated list of the event types of npkit_event.h and
+// ranges of them, e.g. "0x2F-0x32,0x50-0x53". Unset, no event is collected.
+static void NpKitParseEventMask(const char* str, NpKitEventMask* mask) {
+  memset(mask, 0, sizeof(*mask));
+  if (str == nullptr) return;
+  if (strcasecmp(str, "all") == 0) {
+    memset(mask->bits, 0xff, sizeof(mask->bits));
+    return;
+  }
+  const int maxType = NPKIT_EVENT_MASK_WORDS*64 - 1;
+  const char* p = str;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 0);
+    long last = first;
+    if (end != p && *end == '-') {
+      const char* q = end + 1;
+      last = strtol(q, &end, 0);
+      if (end == q) last = -1;
+    }
+    if (end == p || first < 0 || last < first || last > maxType || (*end != ',' && *end != '\0')) {
+      WARN("NPKit: ignoring invalid NCCL_NPKIT_EVENTS entry in '%s'", str);
+      while (*end && *end != ',') end++;
+    } else {
+      for (long t = first; t <= last; t++) mask->bits[t >> 6] |= 1ULL << (t & 63);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+}
+
+int NpKit::nranks_ = 1;
+struct ncclSocket* NpKit::clock_sync_socks_ = nullptr;
+std::vector<NpKitClockSample> NpKit::clock_samples_;
+std::mutex NpKit::clock_samples_mutex_;
+std::thread* NpKit::clock_sync_thread_ = nullptr;
+volatile bool NpKit::clock_sync_thread_should_stop_ = false;
+
+static std::string NpKitGpuEventFilePath(const std::string& dump_dir, uint64_t rank, uint64_t buf) {
+  std::string dump_file_path = dump_dir;
+  dump_file_path += "/gpu_events_rank_";
+  dump_file_path += std::to_string(rank);
+  dump_file_path += "_buf_";
+  dump_file_path += std::to_string(buf);
+  return dump_file_path;
+}
+
 void NpKit::CpuTimestampUpdateThread() {
   uint64_t init_system_clock = std::chrono::system_clock::now().time_since_epoch().count();
   uint64_t init_steady_clock = std::chrono::steady_clock::now().time_since_epoch().count();
@@ -28,25 +114,231 @@ void NpKit::CpuTimestampUpdateThread() {
   }
 }
 
-ncclResult_t NpKit::Init(int rank) {
+// Append the events published since the last drain to the file of each ring. Events the GPU may
+// have overwritten before or while they were copied are dropped.
+ncclResult_t NpKit::DrainGpuEvents() {
+  for (uint64_t i = 0; i < kNumGpuEventBuffers; i++) {
+    volatile uint64_t* drain_head = gpu_drain_heads_ + i;
+    uint64_t head = *drain_head;
+    uint64_t tail = gpu_drain_tails_[i];
+    if (head == tail) continue;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (head - tail > num_gpu_events_per_buffer_) {
+      gpu_drain_lost_ += head - tail - num_gpu_events_per_buffer_;
+      tail = head - num_gpu_events_per_buffer_;
+    }
+    for (uint64_t e = tail; e < head; e++) {
+      gpu_drain_copy_[e - tail] = gpu_event_buffers_[i][e & (num_gpu_events_per_buffer_ - 1)];
+    }
+    uint64_t first = tail;
+    uint64_t new_head = *drain_head;
+    if (new_head - tail > num_gpu_events_per_buffer_) {
+      first = std::min(head, new_head - num_gpu_events_per_buffer_);
+      gpu_drain_lost_ += first - tail;
+    }
+    if (first < head) {
+      if (!gpu_drain_files_[i].is_open()) {
+        gpu_drain_files_[i].open(NpKitGpuEventFilePath(gpu_drain_dir_, rank_, i), std::ios::out | std::ios::binary);
+        if (!gpu_drain_files_[i].is_open()) {
+          WARN("NPKit: could not open %s", NpKitGpuEventFilePath(gpu_drain_dir_, rank_, i).c_str());
+          return ncclSystemError;
+        }
+      }
+      gpu_drain_files_[i].write(reinterpret_cast<char*>(gpu_drain_copy_.data() + (first - tail)),
+          (head - first) * sizeof(NpKitEvent));
+    }
+    gpu_drain_tails_[i] = head;
+  }
+  return ncclSuccess;
+}
+
+void NpKit::GpuEventDrainThread() {
+  while (!gpu_drain_thread_should_stop_) {
+    if (DrainGpuEvents() != ncclSuccess) return;
+    std::this_thread::sleep_for(std::chrono::milliseconds(ncclParamNpKitDrainIntervalMs()));
+  }
+  DrainGpuEvents();
+}
+
+// Keep the ping of the round trip that took least, its error is at most half of it
+ncclResult_t NpKit::SampleClockOffset() {
+  volatile uint64_t* volatile_cpu_timestamp = cpu_timestamp_;
+  NpKitClockSample best = { 0, 0, UINT64_MAX };
+  int64_t rounds = std::max(ncclParamNpKitClockSyncRounds(), (int64_t)1);
+  for (int64_t r = 0; r < rounds; r++) {
+    uint64_t t0 = *volatile_cpu_timestamp;
+    uint64_t remote;
+    NCCLCHECK(ncclSocketSend(clock_sync_socks_, &t0, sizeof(t0)));
+    NCCLCHECK(ncclSocketRecv(clock_sync_socks_, &remote, sizeof(remote)));
+    uint64_t t1 = *volatile_cpu_timestamp;
+    if (t1 - t0 < best.rtt) {
+      best.rtt = t1 - t0;
+      best.local_time = t0 + best.rtt / 2;
+      best.offset = static_cast<int64_t>(remote - best.local_time);
+    }
+  }
+  std::lock_guard<std::mutex> lock(clock_samples_mutex_);
+  clock_samples_.push_back(best);
+  return ncclSuccess;
+}
+
+void NpKit::ClockSyncServerThread() {
+  int nsocks = nranks_ - 1;
+  std::vector<struct pollfd> fds(nsocks);
+  for (int i = 0; i < nsocks; i++) {
+    ncclSocketGetFd(clock_sync_socks_ + i, &fds[i].fd);
+    fds[i].events = POLLIN;
+  }
+  volatile uint64_t* volatile_cpu_timestamp = cpu_timestamp_;
+  while (!clock_sync_thread_should_stop_) {
+    if (poll(fds.data(), nsocks, 100) <= 0) continue;
+    for (int i = 0; i < nsocks; i++) {
+      if (fds[i].fd < 0 || fds[i].revents == 0) continue;
+      uint64_t ping;
+      int closed = 0;
+      if (ncclSocketTryRecv(clock_sync_socks_ + i, &ping, sizeof(ping), &closed, true) != ncclSuccess || closed) {
+        fds[i].fd = -1;
+        continue;
+      }
+      uint64_t now = *volatile_cpu_timestamp;
+      if (ncclSocketSend(clock_sync_socks_ + i, &now, sizeof(now)) != ncclSuccess) fds[i].fd = -1;
+    }
+  }
+}
+
+void NpKit::ClockSyncClientThread() {
+  auto interval = std::chrono::milliseconds(ncclParamNpKitClockSyncIntervalMs());
+  auto next = std::chrono::steady_clock::now() + interval;
+  while (!clock_sync_thread_should_stop_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (std::chrono::steady_clock::now() < next) continue;
+    next += interval;
+    if (SampleClockOffset() != ncclSuccess) {
+      INFO(NCCL_INIT, "NPKit: rank 0 stopped answering clock sync pings");
+      return;
+    }
+  }
+}
+
+// Rank 0 accepts one socket per rank, the other ranks take a first sample before they return so
+// that every dump has an offset
+ncclResult_t NpKit::InitClockSync(int nranks, void* bootstrap) {
+  ncclResult_t ret = ncclSuccess;
+  union ncclSocketAddress addr;
+  struct ncclSocket listen_sock;
+  int i;
+
+  nranks_ = nranks;
+  clock_samples_.clear();
+  clock_sync_thread_should_stop_ = false;
+  if (nranks == 1 || ncclParamNpKitClockSync() == 0) return ncclSuccess;
+
+  memset(&addr, 0, sizeof(addr));
+  NCCLCHECK(ncclSocketInit(&listen_sock));
+  if (rank_ == 0) {
+    NCCLCHECK(bootstrapNetGetAddr(&addr));
+    NCCLCHECK(ncclSocketInit(&listen_sock, &addr));
+    NCCLCHECKGOTO(ncclSocketListen(&listen_sock), ret, fail);
+    NCCLCHECKGOTO(ncclSocketGetAddr(&listen_sock, &addr), ret, fail);
+  }
+  NCCLCHECKGOTO(bootstrapBroadcast(bootstrap, rank_, nranks, 0, &addr, sizeof(addr)), ret, fail);
+
+  if (rank_ == 0) {
+    NCCLCHECKGOTO(ncclCalloc(&clock_sync_socks_, nranks - 1), ret, fail);
+    for (i = 0; i < nranks - 1; i++) NCCLCHECKGOTO(ncclSocketInit(clock_sync_socks_ + i), ret, fail);
+    for (i = 0; i < nranks - 1; i++) NCCLCHECKGOTO(ncclSocketAccept(clock_sync_socks_ + i, &listen_sock), ret, fail);
+    clock_sync_thread_ = new std::thread(ClockSyncServerThread);
+  } else {
+    NCCLCHECKGOTO(ncclCalloc(&clock_sync_socks_, 1), ret, fail);
+    NCCLCHECKGOTO(ncclSocketInit(clock_sync_socks_, &addr), ret, fail);
+    NCCLCHECKGOTO(ncclSocketConnect(clock_sync_socks_), ret, fail);
+    NCCLCHECKGOTO(SampleClockOffset(), ret, fail);
+    if (ncclParamNpKitClockSyncIntervalMs() > 0) clock_sync_thread_ = new std::thread(ClockSyncClientThread);
+  }
+exit:
+  ncclSocketClose(&listen_sock);
+  return ret;
+fail:
+  StopClockSync();
+  goto exit;
+}
+
+void NpKit::StopClockSync() {
+  if (clock_sync_thread_ != nullptr) {
+    clock_sync_thread_should_stop_ = true;
+    clock_sync_thread_->join();
+    delete clock_sync_thread_;
+    clock_sync_thread_ = nullptr;
+  }
+  if (clock_sync_socks_ != nullptr) {
+    int nsocks = rank_ == 0 ? nranks_ - 1 : 1;
+    for (int i = 0; i < nsocks; i++) ncclSocketClose(clock_sync_socks_ + i);
+    free(clock_sync_socks_);
+    clock_sync_socks_ = nullptr;
+  }
+}
+
+ncclResult_t NpKit::Init(int rank, int nranks, void* bootstrap) {
   uint64_t i = 0;
   NpKitEventCollectContext ctx;
   ctx.event_buffer_head = 0;
+  ctx.drain_head = nullptr;
   rank_ = rank;
 
+  NpKitParseEventMask(ncclGetEnv("NCCL_NPKIT_EVENTS"), &event_mask_);
+
+  gpu_ring_mode_ = ncclParamNpKitRing() != 0;
+  if (gpu_ring_mode_) {
+    const char* npkitDumpDir = getenv("NPKIT_DUMP_DIR");
+    if (npkitDumpDir == nullptr) {
+      WARN("NPKit: NCCL_NPKIT_RING needs NPKIT_DUMP_DIR to stream events to, keeping the first events instead");
+      gpu_ring_mode_ = false;
+    } else {
+      gpu_drain_dir_ = npkitDumpDir;
+    }
+  }
+  num_gpu_events_per_buffer_ = ncclParamNpKitGpuEventsPerBuffer();
+  if (num_gpu_events_per_buffer_ == 0) {
+    num_gpu_events_per_buffer_ = gpu_ring_mode_ ? kDefaultNumGpuEventsPerRing : kDefaultNumGpuEventsPerBuffer;
+  }
+  if (gpu_ring_mode_) {
+    // Ring positions are masked
+    uint64_t ring_size = 1;
+    while (ring_size < num_gpu_events_per_buffer_) ring_size <<= 1;
+    num_gpu_events_per_buffer_ = ring_size;
+  }
+  num_cpu_events_per_buffer_ = ncclParamNpKitCpuEventsPerBuffer();
+  if (num_cpu_events_per_buffer_ == 0) num_cpu_events_per_buffer_ = kDefaultNumCpuEventsPerBuffer;
+
   // Init event data structures
+  ctx.event_buffer_size = num_gpu_events_per_buffer_;
   NCCLCHECK(ncclCalloc(&gpu_event_buffers_, kNumGpuEventBuffers));
   NCCLCHECK(ncclCudaCalloc(&gpu_collect_contexts_, kNumGpuEventBuffers));
+  if (gpu_ring_mode_) {
+    NCCLCHECK(ncclCudaHostCalloc(&gpu_drain_heads_, kNumGpuEventBuffers));
+    gpu_drain_tails_.assign(kNumGpuEventBuffers, 0);
+    gpu_drain_files_.clear();
+    gpu_drain_files_.resize(kNumGpuEventBuffers);
+    gpu_drain_copy_.resize(num_gpu_events_per_buffer_);
+    gpu_drain_lost_ = 0;
+  }
   for (i = 0; i < kNumGpuEventBuffers; i++) {
-    NCCLCHECK(ncclCudaCalloc(gpu_event_buffers_ + i, kMaxNumGpuEventsPerBuffer));
+    if (gpu_ring_mode_) {
+      NCCLCHECK(ncclCudaHostCalloc(gpu_event_buffers_ + i, num_gpu_events_per_buffer_));
+      ctx.drain_head = gpu_drain_heads_ + i;
+    } else {
+      NCCLCHECK(ncclCudaCalloc(gpu_event_buffers_ + i, num_gpu_events_per_buffer_));
+    }
     ctx.event_buffer = gpu_event_buffers_[i];
     NCCLCHECK(ncclCudaMemcpy(gpu_collect_contexts_ + i, &ctx, 1));
   }
 
+  ctx.event_buffer_size = num_cpu_events_per_buffer_;
+  ctx.drain_head = nullptr;
   NCCLCHECK(ncclCalloc(&cpu_event_buffers_, kNumCpuEventBuffers));
   NCCLCHECK(ncclCalloc(&cpu_collect_contexts_, kNumCpuEventBuffers));
   for (i = 0; i < kNumCpuEventBuffers; i++) {
-    NCCLCHECK(ncclCalloc(cpu_event_buffers_ + i, kMaxNumCpuEventsPerBuffer));
+    NCCLCHECK(ncclCalloc(cpu_event_buffers_ + i, num_cpu_events_per_buffer_));
     ctx.event_buffer = cpu_event_buffers_[i];
     cpu_collect_contexts_[i] = ctx;
   }
@@ -58,77 +350,467 @@ ncclResult_t NpKit::Init(int rank) {
   cpu_timestamp_update_thread_should_stop_ = false;
   cpu_timestamp_update_thread_ = new std::thread(CpuTimestampUpdateThread);
 
+  if (gpu_ring_mode_) {
+    gpu_drain_thread_should_stop_ = false;
+    gpu_drain_thread_ = new std::thread(GpuEventDrainThread);
+    INFO(NCCL_INIT, "NPKit: streaming GPU events to %s through rings of %lu events", gpu_drain_dir_.c_str(), num_gpu_events_per_buffer_);
+  }
+
+  NCCLCHECK(InitClockSync(nranks, bootstrap));
+
   return ncclSuccess;
 }
 
+// Events of one buffer copied out for the dump writer
+struct NpKitDumpBuffer {
+  bool gpu;
+  uint64_t id;
+  std::vector<NpKitEvent> events;
+};
+
+struct NpKitDumpJob {
+  std::string dir;
+  uint64_t rank;
+  uint64_t gpu_clock_rate;
+  std::vector<NpKitDumpBuffer> buffers;
+  std::vector<NpKitClockSample> clock_samples;
+};
+
+static const struct {
+  uint8_t type;
+  const char* name;
+} kNpKitEventNames[] = {
+  { NPKIT_EVENT_ALL_REDUCE_RING_ENTRY, "ALL_REDUCE_RING_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_EXIT, "ALL_REDUCE_RING_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_ENTRY, "ALL_REDUCE_TREE_UPDOWN_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_EXIT, "ALL_REDUCE_TREE_UPDOWN_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_ENTRY, "ALL_REDUCE_TREE_SPLIT_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_EXIT, "ALL_REDUCE_TREE_SPLIT_EXIT" },
+  { NPKIT_EVENT_COPY_SEND_ENTRY, "COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_COPY_SEND_EXIT, "COPY_SEND_EXIT" },
+  { NPKIT_EVENT_DIRECT_COPY_SEND_ENTRY, "DIRECT_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_DIRECT_COPY_SEND_EXIT, "DIRECT_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_DIRECT_RECV_ENTRY, "DIRECT_RECV_ENTRY" },
+  { NPKIT_EVENT_DIRECT_RECV_EXIT, "DIRECT_RECV_EXIT" },
+  { NPKIT_EVENT_DIRECT_RECV_COPY_SEND_ENTRY, "DIRECT_RECV_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_DIRECT_RECV_COPY_SEND_EXIT, "DIRECT_RECV_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY, "DIRECT_RECV_REDUCE_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_DIRECT_RECV_REDUCE_COPY_SEND_EXIT, "DIRECT_RECV_REDUCE_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_DIRECT_SEND_ENTRY, "DIRECT_SEND_ENTRY" },
+  { NPKIT_EVENT_DIRECT_SEND_EXIT, "DIRECT_SEND_EXIT" },
+  { NPKIT_EVENT_DIRECT_SEND_FROM_OUTPUT_ENTRY, "DIRECT_SEND_FROM_OUTPUT_ENTRY" },
+  { NPKIT_EVENT_DIRECT_SEND_FROM_OUTPUT_EXIT, "DIRECT_SEND_FROM_OUTPUT_EXIT" },
+  { NPKIT_EVENT_RECV_ENTRY, "RECV_ENTRY" },
+  { NPKIT_EVENT_RECV_EXIT, "RECV_EXIT" },
+  { NPKIT_EVENT_RECV_COPY_SEND_ENTRY, "RECV_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_RECV_COPY_SEND_EXIT, "RECV_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_RECV_REDUCE_COPY_ENTRY, "RECV_REDUCE_COPY_ENTRY" },
+  { NPKIT_EVENT_RECV_REDUCE_COPY_EXIT, "RECV_REDUCE_COPY_EXIT" },
+  { NPKIT_EVENT_RECV_REDUCE_COPY_SEND_ENTRY, "RECV_REDUCE_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_RECV_REDUCE_COPY_SEND_EXIT, "RECV_REDUCE_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_RECV_REDUCE_SEND_ENTRY, "RECV_REDUCE_SEND_ENTRY" },
+  { NPKIT_EVENT_RECV_REDUCE_SEND_EXIT, "RECV_REDUCE_SEND_EXIT" },
+  { NPKIT_EVENT_SEND_ENTRY, "SEND_ENTRY" },
+  { NPKIT_EVENT_SEND_EXIT, "SEND_EXIT" },
+  { NPKIT_EVENT_SEND_FROM_OUTPUT_ENTRY, "SEND_FROM_OUTPUT_ENTRY" },
+  { NPKIT_EVENT_SEND_FROM_OUTPUT_EXIT, "SEND_FROM_OUTPUT_EXIT" },
+  { NPKIT_EVENT_PRIM_SIMPLE_WAIT_PEER_ENTRY, "PRIM_SIMPLE_WAIT_PEER_ENTRY" },
+  { NPKIT_EVENT_PRIM_SIMPLE_WAIT_PEER_EXIT, "PRIM_SIMPLE_WAIT_PEER_EXIT" },
+  { NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY, "PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_ENTRY" },
+  { NPKIT_EVENT_PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT, "PRIM_SIMPLE_REDUCE_OR_COPY_MULTI_EXIT" },
+  { NPKIT_EVENT_PRIM_LL_WAIT_SEND_ENTRY, "PRIM_LL_WAIT_SEND_ENTRY" },
+  { NPKIT_EVENT_PRIM_LL_WAIT_SEND_EXIT, "PRIM_LL_WAIT_SEND_EXIT" },
+  { NPKIT_EVENT_PRIM_LL_DATA_PROCESS_ENTRY, "PRIM_LL_DATA_PROCESS_ENTRY" },
+  { NPKIT_EVENT_PRIM_LL_DATA_PROCESS_EXIT, "PRIM_LL_DATA_PROCESS_EXIT" },
+  { NPKIT_EVENT_PRIM_LL128_WAIT_SEND_ENTRY, "PRIM_LL128_WAIT_SEND_ENTRY" },
+  { NPKIT_EVENT_PRIM_LL128_WAIT_SEND_EXIT, "PRIM_LL128_WAIT_SEND_EXIT" },
+  { NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_ENTRY, "PRIM_LL128_DATA_PROCESS_ENTRY" },
+  { NPKIT_EVENT_PRIM_LL128_DATA_PROCESS_EXIT, "PRIM_LL128_DATA_PROCESS_EXIT" },
+  { NPKIT_EVENT_NET_SEND_ENTRY, "NET_SEND_ENTRY" },
+  { NPKIT_EVENT_NET_SEND_EXIT, "NET_SEND_EXIT" },
+  { NPKIT_EVENT_NET_RECV_ENTRY, "NET_RECV_ENTRY" },
+  { NPKIT_EVENT_NET_RECV_EXIT, "NET_RECV_EXIT" },
+  { NPKIT_EVENT_TIME_SYNC_GPU, "TIME_SYNC_GPU" },
+  { NPKIT_EVENT_TIME_SYNC_CPU, "TIME_SYNC_CPU" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_SEND_ENTRY, "ALL_REDUCE_RING_SEND_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_SEND_EXIT, "ALL_REDUCE_RING_SEND_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY, "ALL_REDUCE_RING_RECV_REDUCE_SEND_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT, "ALL_REDUCE_RING_RECV_REDUCE_SEND_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY, "ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT, "ALL_REDUCE_RING_DIRECT_RECV_REDUCE_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY, "ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT, "ALL_REDUCE_RING_DIRECT_RECV_COPY_SEND_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_ENTRY, "ALL_REDUCE_RING_DIRECT_RECV_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_RING_DIRECT_RECV_EXIT, "ALL_REDUCE_RING_DIRECT_RECV_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY, "ALL_REDUCE_TREE_UPDOWN_REDUCE_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT, "ALL_REDUCE_TREE_UPDOWN_REDUCE_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY, "ALL_REDUCE_TREE_UPDOWN_BROADCAST_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT, "ALL_REDUCE_TREE_UPDOWN_BROADCAST_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY, "ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT, "ALL_REDUCE_TREE_SPLIT_REDUCE_BROADCAST_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY, "ALL_REDUCE_TREE_SPLIT_REDUCE_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT, "ALL_REDUCE_TREE_SPLIT_REDUCE_EXIT" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY, "ALL_REDUCE_TREE_SPLIT_BROADCAST_ENTRY" },
+  { NPKIT_EVENT_ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT, "ALL_REDUCE_TREE_SPLIT_BROADCAST_EXIT" },
+  { NPKIT_EVENT_SEND_RECV_LOCAL_COPY_ENTRY, "SEND_RECV_LOCAL_COPY_ENTRY" },
+  { NPKIT_EVENT_SEND_RECV_LOCAL_COPY_EXIT, "SEND_RECV_LOCAL_COPY_EXIT" },
+  { NPKIT_EVENT_SEND_RECV_SEND_ENTRY, "SEND_RECV_SEND_ENTRY" },
+  { NPKIT_EVENT_SEND_RECV_SEND_EXIT, "SEND_RECV_SEND_EXIT" },
+  { NPKIT_EVENT_SEND_RECV_RECV_ENTRY, "SEND_RECV_RECV_ENTRY" },
+  { NPKIT_EVENT_SEND_RECV_RECV_EXIT, "SEND_RECV_RECV_EXIT" },
+  { NPKIT_PRIM_COLLECT_DATA_PROCESS_TIME, "PRIM_COLLECT_DATA_PROCESS_TIME" },
+  { NPKIT_EVENT_MSCCL_GENERIC_OP_ENTRY, "MSCCL_GENERIC_OP_ENTRY" },
+  { NPKIT_EVENT_MSCCL_GENERIC_OP_EXIT, "MSCCL_GENERIC_OP_EXIT" },
+  { NPKIT_EVENT_MSCCL_REDUCE_ENTRY, "MSCCL_REDUCE_ENTRY" },
+  { NPKIT_EVENT_MSCCL_REDUCE_EXIT, "MSCCL_REDUCE_EXIT" },
+  { NPKIT_EVENT_NET_IB_POST_SEND_ENTRY, "NET_IB_POST_SEND_ENTRY" },
+  { NPKIT_EVENT_NET_IB_POST_SEND_EXIT, "NET_IB_POST_SEND_EXIT" },
+  { NPKIT_EVENT_NET_IB_POLL_CQ_ENTRY, "NET_IB_POLL_CQ_ENTRY" },
+  { NPKIT_EVENT_NET_IB_POLL_CQ_EXIT, "NET_IB_POLL_CQ_EXIT" },
+  { NPKIT_EVENT_NET_IB_COMPLETION, "NET_IB_COMPLETION" },
+  { NPKIT_EVENT_NET_IB_SPLIT, "NET_IB_SPLIT" },
+};
+
+static const char* NpKitEventName(uint8_t type) {
+  for (size_t i = 0; i < sizeof(kNpKitEventNames)/sizeof(kNpKitEventNames[0]); i++) {
+    if (kNpKitEventNames[i].type == type) return kNpKitEventNames[i].name;
+  }
+  return nullptr;
+}
+
+static void NpKitWriteTextFile(const std::string& path, const std::string& str) {
+  auto file = std::fstream(path, std::ios::out);
+  file.write(str.c_str(), str.length());
+  file.close();
+}
+
+// Files of the NPKit trace generator: one per buffer and one per clock
+static ncclResult_t NpKitWriteRaw(const NpKitDumpJob& job) {
+  std::string rank_str = std::to_string(job.rank);
+  for (const NpKitDumpBuffer& buf : job.buffers) {
+    std::string path = job.dir + (buf.gpu ? "/gpu_events_rank_" : "/cpu_events_rank_") + rank_str +
+        (buf.gpu ? "_buf_" : "_channel_") + std::to_string(buf.id);
+    auto file = std::fstream(path, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(buf.events.data()), buf.events.size() * sizeof(NpKitEvent));
+    file.close();
+  }
+  NpKitWriteTextFile(job.dir + "/cpu_clock_period_num_rank_" + rank_str,
+      std::to_string(std::chrono::steady_clock::duration::period::num));
+  NpKitWriteTextFile(job.dir + "/cpu_clock_period_den_rank_" + rank_str,
+      std::to_string(std::chrono::steady_clock::duration::period::den));
+  NpKitWriteTextFile(job.dir + "/gpu_clock_rate_rank_" + rank_str, std::to_string(job.gpu_clock_rate));
+  std::string clock_sync_str;
+  for (const NpKitClockSample& sample : job.clock_samples) {
+    clock_sync_str += std::to_string(sample.local_time) + " " + std::to_string(sample.offset) + " " +
+        std::to_string(sample.rtt) + "\n";
+  }
+  if (!job.clock_samples.empty()) NpKitWriteTextFile(job.dir + "/clock_sync_rank_" + rank_str, clock_sync_str);
+  return ncclSuccess;
+}
+
+static void NpKitPutVarint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+// npkit_rank_<rank>.bin, all little endian:
+//   header  "NPKITBIN", u32 version, u32 rank, u64 cpu clock period num, u64 cpu clock period den,
+//           u64 gpu clock rate in kHz
+//   chunks  u8 source (0 GPU buffer, 1 CPU channel, 2 clock sync), u8 encoding, u16 0, u32 buffer,
+//           u64 events, u64 payload bytes, payload
+// The clock sync chunk is an array of NpKitClockSample, offsets of the CPU clock of rank 0, and
+// always uses encoding 0. Encoding 0 is an array of NpKitEvent. Encoding 1 stores each event as the type byte followed by
+// LEB128 varints of size, rsvd and the zigzag delta of the timestamp to the previous event.
+static ncclResult_t NpKitWriteBin(const NpKitDumpJob& job, bool delta) {
+  std::string path = job.dir + "/npkit_rank_" + std::to_string(job.rank) + ".bin";
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    WARN("NPKit: could not open %s", path.c_str());
+    return ncclSystemError;
+  }
+  struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rank;
+    uint64_t cpu_clock_num;
+    uint64_t cpu_clock_den;
+    uint64_t gpu_clock_rate;
+  } header;
+  memcpy(header.magic, "NPKITBIN", sizeof(header.magic));
+  header.version = 1;
+  header.rank = job.rank;
+  header.cpu_clock_num = std::chrono::steady_clock::duration::period::num;
+  header.cpu_clock_den = std::chrono::steady_clock::duration::period::den;
+  header.gpu_clock_rate = job.gpu_clock_rate;
+  fwrite(&header, sizeof(header), 1, file);
+
+  std::string payload;
+  for (const NpKitDumpBuffer& buf : job.buffers) {
+    struct {
+      uint8_t source;
+      uint8_t encoding;
+      uint16_t pad;
+      uint32_t id;
+      uint64_t num_events;
+      uint64_t num_bytes;
+    } chunk = { static_cast<uint8_t>(buf.gpu ? 0 : 1), static_cast<uint8_t>(delta ? 1 : 0), 0,
+        static_cast<uint32_t>(buf.id), buf.events.size(), 0 };
+    const char* data = reinterpret_cast<const char*>(buf.events.data());
+    chunk.num_bytes = buf.events.size() * sizeof(NpKitEvent);
+    if (delta) {
+      payload.clear();
+      uint64_t prev = 0;
+      for (const NpKitEvent& e : buf.events) {
+        int64_t diff = static_cast<int64_t>(e.fields.timestamp - prev);
+        payload.push_back(static_cast<char>(e.fields.type));
+        NpKitPutVarint(payload, e.fields.size);
+        NpKitPutVarint(payload, e.fields.rsvd);
+        NpKitPutVarint(payload, (static_cast<uint64_t>(diff) << 1) ^ static_cast<uint64_t>(diff >> 63));
+        prev = e.fields.timestamp;
+      }
+      data = payload.data();
+      chunk.num_bytes = payload.size();
+    }
+    fwrite(&chunk, sizeof(chunk), 1, file);
+    fwrite(data, 1, chunk.num_bytes, file);
+  }
+  if (!job.clock_samples.empty()) {
+    uint8_t chunk[24] = {};
+    uint64_t num_samples = job.clock_samples.size();
+    uint64_t num_bytes = num_samples * sizeof(NpKitClockSample);
+    chunk[0] = 2;
+    memcpy(chunk + 8, &num_samples, sizeof(num_samples));
+    memcpy(chunk + 16, &num_bytes, sizeof(num_bytes));
+    fwrite(chunk, sizeof(chunk), 1, file);
+    fwrite(job.clock_samples.data(), 1, num_bytes, file);
+  }
+  bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed) {
+    WARN("NPKit: could not write %s", path.c_str());
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+// Offset of the CPU clock of rank 0 at local CPU time t, interpolated between the samples around it
+static double NpKitClockOffset(const std::vector<NpKitClockSample>& samples, double t) {
+  if (samples.empty()) return 0;
+  if (t <= samples.front().local_time) return samples.front().offset;
+  for (size_t i = 1; i < samples.size(); i++) {
+    const NpKitClockSample& a = samples[i-1];
+    const NpKitClockSample& b = samples[i];
+    if (t > b.local_time || b.local_time == a.local_time) continue;
+    return a.offset + (b.offset - a.offset) * (t - a.local_time) / (double)(b.local_time - a.local_time);
+  }
+  return samples.back().offset;
+}
+
+// npkit_rank_<rank>.json in the Chrome trace event format, also read by Perfetto. Timestamps are
+// in microseconds of the CPU clock of rank 0, so that the files of all ranks can be loaded together.
+// GPU buffers are moved to the CPU clock with their time sync events.
+static ncclResult_t NpKitWriteJson(const NpKitDumpJob& job) {
+  std::string path = job.dir + "/npkit_rank_" + std::to_string(job.rank) + ".json";
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    WARN("NPKit: could not open %s", path.c_str());
+    return ncclSystemError;
+  }
+  const double cpu_us = 1e6 * std::chrono::steady_clock::duration::period::num /
+      std::chrono::steady_clock::duration::period::den;
+  const double gpu_us = job.gpu_clock_rate ? 1e3 / job.gpu_clock_rate : 0;
+  bool first = true;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (const NpKitDumpBuffer& buf : job.buffers) {
+    double scale = buf.gpu ? gpu_us : cpu_us;
+    double offset = 0;
+    if (buf.gpu) {
+      const NpKitEvent* sync_cpu = nullptr;
+      const NpKitEvent* sync_gpu = nullptr;
+      for (const NpKitEvent& e : buf.events) {
+        if (e.fields.type == NPKIT_EVENT_TIME_SYNC_CPU && sync_cpu == nullptr) sync_cpu = &e;
+        if (e.fields.type == NPKIT_EVENT_TIME_SYNC_GPU && sync_gpu == nullptr) sync_gpu = &e;
+      }
+      if (sync_cpu && sync_gpu) offset = sync_cpu->fields.timestamp * cpu_us - sync_gpu->fields.timestamp * gpu_us;
+    }
+    uint64_t tid = buf.gpu ? buf.id : NpKit::kNumGpuEventBuffers + buf.id;
+    for (const NpKitEvent& e : buf.events) {
+      uint8_t type = e.fields.type;
+      if (type == NPKIT_EVENT_TIME_SYNC_CPU || type == NPKIT_EVENT_TIME_SYNC_GPU) continue;
+      const char* name = NpKitEventName(type);
+      std::string label = name ? name : std::to_string(type);
+      const char* ph = "i";
+      size_t len = label.size();
+      if (len > 6 && label.compare(len - 6, 6, "_ENTRY") == 0) {
+        ph = "B";
+        label.resize(len - 6);
+      } else if (len > 5 && label.compare(len - 5, 5, "_EXIT") == 0) {
+        ph = "E";
+        label.resize(len - 5);
+      }
+      double ts = e.fields.timestamp * scale + offset;
+      ts += NpKitClockOffset(job.clock_samples, ts / cpu_us) * cpu_us;
+      uint64_t rsvd = e.fields.rsvd;
+      char args[64];
+      if (type >= NPKIT_EVENT_NET_IB_POST_SEND_ENTRY && type <= NPKIT_EVENT_NET_IB_SPLIT) {
+        snprintf(args, sizeof(args), "\"nic\":%lu,\"dev\":%lu,\"qp\":%ld", rsvd >> 16, (rsvd >> 8) & 0xff,
+            (rsvd & 0xff) == NPKIT_NET_IB_NO_QP ? -1L : static_cast<long>(rsvd & 0xff));
+      } else {
+        snprintf(args, sizeof(args), "\"rsvd\":%lu", rsvd);
+      }
+      fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu,"
+          "\"args\":{\"size\":%lu,%s}}", first ? "" : ",", label.c_str(), buf.gpu ? "gpu" : "cpu", ph,
+          ph[0] == 'i' ? "\"s\":\"t\"," : "", ts, job.rank, tid,
+          static_cast<uint64_t>(e.fields.size), args);
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+  bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed) {
+    WARN("NPKit: could not write %s", path.c_str());
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+enum NpKitDumpFormat { NpKitDumpRaw, NpKitDumpBin, NpKitDumpJson };
+
+static void NpKitWriteDump(NpKitDumpJob* job, NpKitDumpFormat format) {
+  ncclResult_t ret = ncclSuccess;
+  if (format == NpKitDumpBin) {
+    ret = NpKitWriteBin(*job, ncclParamNpKitDumpDelta() != 0);
+  } else if (format == NpKitDumpJson) {
+    ret = NpKitWriteJson(*job);
+  } else {
+    ret = NpKitWriteRaw(*job);
+  }
+  if (ret == ncclSuccess) INFO(NCCL_INIT, "NPKit: rank %lu dumped %lu buffers to %s", job->rank, job->buffers.size(), job->dir.c_str());
+  delete job;
+}
+
+static std::mutex npKitDumpThreadsMutex;
+static std::vector<std::thread> npKitDumpThreads;
+
+// Dumps written in the background must not be cut short by the process exit
+static void NpKitJoinDumpThreads() {
+  std::lock_guard<std::mutex> lock(npKitDumpThreadsMutex);
+  for (std::thread& thread : npKitDumpThreads) thread.join();
+  npKitDumpThreads.clear();
+}
+
 ncclResult_t NpKit::Dump(const std::string& dump_dir) {
+  ncclResult_t ret = ncclSuccess;
   uint64_t i = 0;
-  std::string dump_file_path;
+  uint64_t num_dropped_events = 0;
+  NpKitDumpFormat format = NpKitDumpRaw;
+  const char* formatStr = ncclGetEnv("NCCL_NPKIT_DUMP_FORMAT");
+  if (formatStr != nullptr && strcasecmp(formatStr, "bin") == 0) {
+    format = NpKitDumpBin;
+  } else if (formatStr != nullptr && strcasecmp(formatStr, "json") == 0) {
+    format = NpKitDumpJson;
+  } else if (formatStr != nullptr && strcasecmp(formatStr, "raw") != 0) {
+    WARN("NPKit: unknown NCCL_NPKIT_DUMP_FORMAT %s, writing raw buffers", formatStr);
+  }
+
+  NpKitDumpJob* job = new NpKitDumpJob;
+  job->dir = dump_dir;
+  job->rank = rank_;
+  {
+    std::lock_guard<std::mutex> lock(clock_samples_mutex_);
+    job->clock_samples = clock_samples_;
+  }
 
-  // Dump CPU events
+  // Copy CPU events
   for (i = 0; i < kNumCpuEventBuffers; i++) {
-    dump_file_path = dump_dir;
-    dump_file_path += "/cpu_events_rank_";
-    dump_file_path += std::to_string(rank_);
-    dump_file_path += "_channel_";
-    dump_file_path += std::to_string(i);
-    auto cpu_trace_file = std::fstream(dump_file_path, std::ios::out | std::ios::binary);
-    cpu_trace_file.write(reinterpret_cast<char*>(cpu_event_buffers_[i]),
-        cpu_collect_contexts_[i].event_buffer_head * sizeof(NpKitEvent));
-    cpu_trace_file.close();
-  }
-
-  // Dump CPU clock info
-  dump_file_path = dump_dir;
-  dump_file_path += "/cpu_clock_period_num_rank_";
-  dump_file_path += std::to_string(rank_);
-  std::string clock_period_num_str = std::to_string(std::chrono::steady_clock::duration::period::num);
-  auto clock_period_num_file = std::fstream(dump_file_path, std::ios::out);
-  clock_period_num_file.write(clock_period_num_str.c_str(), clock_period_num_str.length());
-  clock_period_num_file.close();
-
-  dump_file_path = dump_dir;
-  dump_file_path += "/cpu_clock_period_den_rank_";
-  dump_file_path += std::to_string(rank_);
-  std::string clock_period_den_str = std::to_string(std::chrono::steady_clock::duration::period::den);
-  auto clock_period_den_file = std::fstream(dump_file_path, std::ios::out);
-  clock_period_den_file.write(clock_period_den_str.c_str(), clock_period_den_str.length());
-  clock_period_den_file.close();
-
-  // Dump GPU events, reuse CPU struct
-  for (i = 0; i < kNumGpuEventBuffers; i++) {
-    dump_file_path = dump_dir;
-    dump_file_path += "/gpu_events_rank_";
-    dump_file_path += std::to_string(rank_);
-    dump_file_path += "_buf_";
-    dump_file_path += std::to_string(i);
-    NCCLCHECK(ncclCudaMemcpy(cpu_event_buffers_[0], gpu_event_buffers_[i], kMaxNumGpuEventsPerBuffer));
-    NCCLCHECK(ncclCudaMemcpy(cpu_collect_contexts_, gpu_collect_contexts_ + i, 1));
-    auto gpu_trace_file = std::fstream(dump_file_path, std::ios::out | std::ios::binary);
-    gpu_trace_file.write(reinterpret_cast<char*>(cpu_event_buffers_[0]),
-        cpu_collect_contexts_[0].event_buffer_head * sizeof(NpKitEvent));
-    gpu_trace_file.close();
-  }
-
-  // Dump GPU clockRate
-  dump_file_path = dump_dir;
-  dump_file_path += "/gpu_clock_rate_rank_";
-  dump_file_path += std::to_string(rank_);
+    uint64_t num_events = cpu_collect_contexts_[i].event_buffer_head;
+    if (num_events > num_cpu_events_per_buffer_) {
+      num_dropped_events += num_events - num_cpu_events_per_buffer_;
+      num_events = num_cpu_events_per_buffer_;
+    }
+    if (num_events == 0) continue;
+    job->buffers.push_back(NpKitDumpBuffer());
+    NpKitDumpBuffer& buf = job->buffers.back();
+    buf.gpu = false;
+    buf.id = i;
+    buf.events.assign(cpu_event_buffers_[i], cpu_event_buffers_[i] + num_events);
+  }
+
+  if (gpu_ring_mode_) {
+    // GPU events were streamed to the drain directory, the last ones are drained by the thread on exit
+    gpu_drain_thread_should_stop_ = true;
+    gpu_drain_thread_->join();
+    delete gpu_drain_thread_;
+    gpu_drain_thread_ = nullptr;
+    gpu_drain_files_.clear();
+    if (gpu_drain_lost_ > 0) {
+      WARN("NPKit: %lu GPU events were overwritten before they were drained, raise NCCL_NPKIT_GPU_EVENTS_PER_BUFFER "
+          "or lower NCCL_NPKIT_DRAIN_INTERVAL_MS", gpu_drain_lost_);
+    }
+  } else {
+    // Copy the collected GPU events, not the whole buffers
+    std::vector<NpKitEventCollectContext> gpu_ctxs(kNumGpuEventBuffers);
+    ret = ncclCudaMemcpy(gpu_ctxs.data(), gpu_collect_contexts_, kNumGpuEventBuffers);
+    for (i = 0; ret == ncclSuccess && i < kNumGpuEventBuffers; i++) {
+      uint64_t num_events = gpu_ctxs[i].event_buffer_head;
+      if (num_events > num_gpu_events_per_buffer_) {
+        num_dropped_events += num_events - num_gpu_events_per_buffer_;
+        num_events = num_gpu_events_per_buffer_;
+      }
+      if (num_events == 0) continue;
+      job->buffers.push_back(NpKitDumpBuffer());
+      NpKitDumpBuffer& buf = job->buffers.back();
+      buf.gpu = true;
+      buf.id = i;
+      buf.events.resize(num_events);
+      ret = ncclCudaMemcpy(buf.events.data(), gpu_event_buffers_[i], num_events);
+    }
+    if (ret != ncclSuccess) {
+      delete job;
+      return ret;
+    }
+  }
+  if (num_dropped_events > 0) {
+    WARN("NPKit: %lu events did not fit in their buffer, raise NCCL_NPKIT_GPU_EVENTS_PER_BUFFER and "
+        "NCCL_NPKIT_CPU_EVENTS_PER_BUFFER or set NCCL_NPKIT_RING=1", num_dropped_events);
+  }
+
   cudaDeviceProp dev_prop;
   int dev;
-  CUDACHECK(cudaGetDevice(&dev));
-  CUDACHECK(cudaGetDeviceProperties(&dev_prop, dev));
-  std::string clock_rate_str = std::to_string(dev_prop.clockRate);
-  auto gpu_clock_rate_file = std::fstream(dump_file_path, std::ios::out);
-  gpu_clock_rate_file.write(clock_rate_str.c_str(), clock_rate_str.length());
-  gpu_clock_rate_file.close();
+  CUDACHECKGOTO(cudaGetDevice(&dev), ret, fail);
+  CUDACHECKGOTO(cudaGetDeviceProperties(&dev_prop, dev), ret, fail);
+#if defined(ENABLE_NPKIT_GLOBALTIMER)
+  // GPU timestamps are ns of the globaltimer, a 1 GHz clock in kHz
+  job->gpu_clock_rate = 1000000;
+#else
+  job->gpu_clock_rate = dev_prop.clockRate;
+#endif
 
+  if (ncclParamNpKitDumpAsync()) {
+    std::lock_guard<std::mutex> lock(npKitDumpThreadsMutex);
+    static bool registered = false;
+    if (!registered) {
+      atexit(NpKitJoinDumpThreads);
+      registered = true;
+    }
+    npKitDumpThreads.emplace_back(NpKitWriteDump, job, format);
+  } else {
+    NpKitWriteDump(job, format);
+  }
   return ncclSuccess;
+fail:
+  delete job;
+  return ret;
 }
 
 ncclResult_t NpKit::Shutdown() {
   uint64_t i = 0;
 
+  // Stop clock sync first, it reads the CPU timestamp
+  StopClockSync();
+
   // Stop CPU timestamp updating thread
   cpu_timestamp_update_thread_should_stop_ = true;
   cpu_timestamp_update_thread_->join();
@@ -140,12 +822,30 @@ ncclResult_t NpKit::Shutdown() {
   free(cpu_event_buffers_);
   free(cpu_collect_contexts_);
 
+  // Stop the drain thread if Dump did not
+  if (gpu_drain_thread_ != nullptr) {
+    gpu_drain_thread_should_stop_ = true;
+    gpu_drain_thread_->join();
+    delete gpu_drain_thread_;
+    gpu_drain_thread_ = nullptr;
+  }
+  gpu_drain_files_.clear();
+
   // Free GPU event data structures
   for (i = 0; i < kNumGpuEventBuffers; i++) {
-    NCCLCHECK(ncclCudaFree(gpu_event_buffers_[i]));
+    if (gpu_ring_mode_) {
+      NCCLCHECK(ncclCudaHostFree(gpu_event_buffers_[i]));
+    } else {
+      NCCLCHECK(ncclCudaFree(gpu_event_buffers_[i]));
+    }
   }
   free(gpu_event_buffers_);
+  gpu_event_buffers_ = nullptr;
   NCCLCHECK(ncclCudaFree(gpu_collect_contexts_));
+  if (gpu_drain_heads_ != nullptr) {
+    NCCLCHECK(ncclCudaHostFree(gpu_drain_heads_));
+    gpu_drain_heads_ = nullptr;
+  }
 
   // Free timestamp
   NCCLCHECK(ncclCudaHostFree(cpu_timestamp_));
@@ -158,17 +858,47 @@ NpKitEventCollectContext* NpKit::GetGpuEventCollectContexts() {
 }
 
 void NpKit::CollectCpuEvent(uint8_t type, uint32_t size, uint32_t rsvd, uint64_t timestamp, int channel_id) {
+  if (!EventEnabled(event_mask_, type)) return;
   uint64_t event_buffer_head = cpu_collect_contexts_[channel_id].event_buffer_head;
-  if (event_buffer_head < kMaxNumCpuEventsPerBuffer) {
+  if (event_buffer_head < num_cpu_events_per_buffer_) {
     NpKitEvent& event = cpu_collect_contexts_[channel_id].event_buffer[event_buffer_head];
     event.fields.type = type;
     event.fields.size = size;
     event.fields.rsvd = rsvd;
     event.fields.timestamp = timestamp;
-    cpu_collect_contexts_[channel_id].event_buffer_head++;
   }
+  // Counts past the end so that Dump reports the dropped events
+  cpu_collect_contexts_[channel_id].event_buffer_head++;
+}
+
+static thread_local int npKitCpuChannel = 0;
+
+void NpKit::SetCpuChannel(int channel_id) {
+  npKitCpuChannel = channel_id;
+}
+
+int NpKit::GetCpuChannel() {
+  return npKitCpuChannel;
+}
+
+const NpKitEventMask& NpKit::GetEventMask() {
+  return event_mask_;
 }
 
 uint64_t* NpKit::GetCpuTimestamp() {
   return cpu_timestamp_;
 }
+
+void NpKit::GetMemoryUsage(size_t* dev_bytes, size_t* host_bytes) {
+  *dev_bytes = *host_bytes = 0;
+  if (gpu_event_buffers_ == nullptr) return;
+  size_t event_bytes = kNumGpuEventBuffers * num_gpu_events_per_buffer_ * sizeof(NpKitEvent);
+  *dev_bytes = kNumGpuEventBuffers * sizeof(NpKitEventCollectContext);
+  if (gpu_ring_mode_) {
+    *host_bytes = event_bytes + kNumGpuEventBuffers * sizeof(uint64_t);
+  } else {
+    *dev_bytes += event_bytes;
+  }
+  // The timestamp is the only pinned buffer of CPU events
+  *host_bytes += sizeof(uint64_t);
+}
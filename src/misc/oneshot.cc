@@ -0,0 +1,203 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "oneshot.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "bootstrap.h"
+#include "checks.h"
+#include "device.h"
+#include "enqueue.h"
+#include "graph.h"
+#include "group.h"
+#include "lanes.h"
+#include "p2p.h"
+#include "param.h"
+#include "register.h"
+
+NCCL_PARAM(OneShot, "ONESHOT", 1);
+// Bytes of an AllReduce, or per rank of an AllGather, above which the regular kernels are used
+NCCL_PARAM(OneShotThreshold, "ONESHOT_THRESHOLD", 16 << 10);
+
+// What a rank tells the others at setup, addresses are the ones each peer has to use
+struct ncclOneShotInfo {
+  int ok;
+  uintptr_t scratchAddrs[NCCL_ONESHOT_MAX_RANKS];
+};
+
+static bool oneShotType(ncclDataType_t datatype) {
+  switch (datatype) {
+  case ncclInt8: case ncclUint8: case ncclInt32: case ncclUint32: case ncclInt64: case ncclUint64:
+  case ncclFloat16: case ncclFloat32: case ncclFloat64:
+    return true;
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+  case ncclBfloat16:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+// A rank waits for every peer to write into its scratch, so all of them must take the path. The
+// scratch state is agreed on when it is mapped, the other checks only read the config and topology.
+static ncclResult_t oneShotEligible(struct ncclComm* comm, size_t nBytes, ncclDataType_t datatype, cudaStream_t stream, bool* eligible) {
+  *eligible = false;
+  if (ncclParamOneShot() == 0 || nBytes == 0 || nBytes > (size_t)ncclParamOneShotThreshold()) return ncclSuccess;
+  if (comm->oneShot && comm->oneShot->ready == -1) return ncclSuccess;
+  if (comm->nNodes != 1 || comm->localRanks != comm->nRanks) return ncclSuccess;
+  if (comm->nRanks < 2 || comm->nRanks > NCCL_ONESHOT_MAX_RANKS) return ncclSuccess;
+  if (!oneShotType(datatype)) return ncclSuccess;
+  // The kernel has to run in the order of the calls, not when the group ends
+  if (ncclGroupDepth != 0 || !comm->config.blocking) return ncclSuccess;
+  // The scratch is mapped by a call outside capture, graphs can then replay the kernel
+  if (comm->oneShot == NULL) {
+    struct ncclCudaGraph graph;
+    NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+    if (ncclCudaGraphValid(graph)) return ncclSuccess;
+  }
+  for (int p = 0; p < comm->nRanks; p++) {
+    int p2p;
+    if (p == comm->rank) continue;
+    NCCLCHECK(ncclTopoCheckP2p(comm->topo, comm->rank, p, &p2p, NULL, NULL));
+    if (!p2p) return ncclSuccess;
+  }
+  // Collectives held back for implicit aggregation come first on the stream
+  NCCLCHECK(ncclGroupImplicitFlush());
+  *eligible = true;
+  return ncclSuccess;
+}
+
+// Fill the part of info about this rank, ok stays 0 when any peer cannot map the scratch
+static ncclResult_t oneShotLocalInfo(struct ncclComm* comm, struct ncclOneShot* os, size_t scratchBytes,
+    struct ncclOneShotInfo* info) {
+  struct ncclReg* reg;
+  memset(info, 0, sizeof(*info));
+  NCCLCHECK(ncclCudaCalloc(&os->scratch, scratchBytes));
+  NCCLCHECK(ncclRegister(comm, os->scratch, scratchBytes, &os->scratchHandle));
+  NCCLCHECK(ncclRegFind(comm, os->scratch, scratchBytes, &reg));
+  if (reg == NULL) return ncclSuccess;
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (p == comm->localRank) continue;
+    int peer = comm->localRankToRank[p];
+    int regFlag;
+    uintptr_t offset;
+    uintptr_t* rmtAddr;
+    NCCLCHECK(ncclIpcLocalRegisterBuffer(comm, os->scratch, scratchBytes, &peer, 1, NCCL_IPC_SENDRECV, &regFlag, &offset, &rmtAddr));
+    if (regFlag == 0) return ncclSuccess;
+    info->scratchAddrs[p] = (uintptr_t)rmtAddr + offset;
+  }
+  info->ok = 1;
+  return ncclSuccess;
+}
+
+// Map the scratch of every local rank, once per comm. All ranks end up ready, or none of them.
+static ncclResult_t oneShotSetup(struct ncclComm* comm) {
+  struct ncclOneShot* os;
+  struct ncclOneShotInfo* infos;
+  int me = comm->localRank;
+  NCCLCHECK(ncclCalloc(&os, 1));
+  comm->oneShot = os;
+  NCCLCHECK(ncclCalloc(&infos, comm->localRanks));
+  os->slotBytes = alignUp((size_t)ncclParamOneShotThreshold(), 16);
+  if (oneShotLocalInfo(comm, os, NCCL_ONESHOT_DATA_OFFSET + 2*NCCL_ONESHOT_MAX_RANKS*os->slotBytes, infos+me) != ncclSuccess) {
+    infos[me].ok = 0;
+  }
+  ncclResult_t ret = bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, me, comm->localRanks, infos, sizeof(struct ncclOneShotInfo));
+  os->ready = 1;
+  for (int p = 0; p < comm->localRanks; p++) {
+    if (ret != ncclSuccess || infos[p].ok == 0) os->ready = -1;
+    os->peerScratch[p] = p == me ? os->scratch : (char*)infos[p].scratchAddrs[me];
+  }
+  if (os->ready != 1) INFO(NCCL_COLL, "rank %d cannot map one-shot scratch to its peers", comm->rank);
+  free(infos);
+  return ret;
+}
+
+static ncclResult_t oneShotRun(struct ncclComm* comm, bool allGather, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, struct ncclDevRedOpFull* opFull, cudaStream_t stream, bool* done) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclOneShotArgs args;
+  struct ncclCudaGraph graph;
+  struct ncclStrongStream* deviceStream = NULL;
+  int saveDev;
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  if (comm->oneShot == NULL) NCCLCHECKGOTO(oneShotSetup(comm), ret, exit);
+  if (comm->oneShot->ready != 1) goto exit;
+
+  memset(&args, 0, sizeof(args));
+  for (int p = 0; p < comm->localRanks; p++) {
+    args.scratch[p] = comm->oneShot->peerScratch[p];
+    args.ranks[p] = comm->localRankToRank[p];
+  }
+  args.sendbuff = sendbuff;
+  args.recvbuff = recvbuff;
+  args.count = count;
+  args.slotBytes = comm->oneShot->slotBytes;
+  args.abortFlag = comm->abortFlagDev;
+  args.redOpArg = opFull->scalarArg;
+  args.localRank = comm->localRank;
+  args.localRanks = comm->localRanks;
+  args.allGather = allGather;
+  TRACE(NCCL_COLL, "%s: rank %d %zu elements in one shot", allGather ? "AllGather" : "AllReduce", comm->rank, count);
+  // The kernel reads the sequence of the last call on the device. Calls on other streams are
+  // ordered through deviceStream like the plans, or two of them would take the same sequence.
+  NCCLCHECKGOTO(ncclCudaGetCapturingGraph(&graph, stream), ret, exit);
+  NCCLCHECKGOTO(ncclLanesAcquire(comm, graph, &deviceStream), ret, exit);
+  NCCLCHECKGOTO(ncclStrongStreamWaitStream(graph, stream, deviceStream), ret, exit);
+  NCCLCHECKGOTO(ncclLaunchOneShot(&args, opFull->op, datatype, stream), ret, exit);
+  NCCLCHECKGOTO(ncclStrongStreamWaitStream(graph, deviceStream, stream, /*b_subsumes_a=*/true), ret, exit);
+  *done = true;
+
+exit:
+  if (deviceStream) {
+    ncclResult_t res = ncclStrongStreamRelease(graph, deviceStream);
+    if (ret == ncclSuccess) ret = res;
+  }
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclOneShotAllReduce(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, cudaStream_t stream, bool* done) {
+  bool eligible;
+  struct ncclDevRedOpFull opFull;
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "AllReduce", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  NCCLCHECK(oneShotEligible(comm, count*ncclTypeSize(datatype), datatype, stream, &eligible));
+  if (!eligible) return ncclSuccess;
+  // Scalars of user ops living in device memory would have to be loaded by the kernel
+  if (ncclHostToDevRedOp(&opFull, op, datatype, comm) != ncclSuccess || opFull.scalarArgIsPtr) return ncclSuccess;
+  return oneShotRun(comm, false, sendbuff, recvbuff, count, datatype, &opFull, stream, done);
+}
+
+ncclResult_t ncclOneShotAllGather(struct ncclComm* comm, const void* sendbuff, void* recvbuff, size_t sendcount,
+    ncclDataType_t datatype, cudaStream_t stream, bool* done) {
+  bool eligible;
+  struct ncclDevRedOpFull opFull = {};
+  size_t nBytes = sendcount*ncclTypeSize(datatype);
+  *done = false;
+
+  NCCLCHECK(CommCheck(comm, "AllGather", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  NCCLCHECK(oneShotEligible(comm, nBytes, datatype, stream, &eligible));
+  if (!eligible) return ncclSuccess;
+  // Gathers move bytes whatever the type
+  opFull.op = ncclDevSum;
+  return oneShotRun(comm, true, sendbuff, recvbuff, nBytes, ncclUint8, &opFull, stream, done);
+}
+
+ncclResult_t ncclOneShotDestroy(struct ncclComm* comm) {
+  struct ncclOneShot* os = comm->oneShot;
+  if (os == NULL) return ncclSuccess;
+  if (os->scratch) NCCLCHECK(ncclCudaFree(os->scratch));
+  free(os);
+  comm->oneShot = NULL;
+  return ncclSuccess;
+}
@@ -345,6 +345,57 @@ ncclResult_t ncclProfilerStopTaskEvents(struct ncclKernelPlan* plan) {
   return ncclSuccess;
 }
 
+ncclResult_t ncclProfilerStartMscclEvents(struct ncclProfilerMscclTask* task) {
+  TIME_START_EVENT(taskStart);
+  task->groupEventHandle = NULL;
+  task->eventHandle = NULL;
+  task->eActivationMask = __atomic_load_n(&eActivationMask, __ATOMIC_RELAXED);
+  if (__builtin_expect(ncclProfiler != NULL, 0)) {
+    if (task->eActivationMask & (ncclProfileColl | ncclProfileProxyOp | ncclProfileProxyStep)) {
+      ncclProfilerEventDescr_t eDescr = { 0 };
+      eDescr.type = ncclProfileGroup;
+      ncclProfiler->startEvent(task->comm->profilerContext, &task->groupEventHandle, &eDescr);
+    }
+    if (task->groupEventHandle) {
+      ncclProfilerEventDescr_t eDescr = { 0 };
+      eDescr.type = ncclProfileColl;
+      eDescr.parentObj = task->groupEventHandle;
+      eDescr.rank = task->comm->rank;
+      eDescr.coll.name = task->comm->commName;
+      eDescr.coll.commHash = task->comm->commHash;
+      // all-to-all like algorithms are reported as ncclFuncSendRecv, which has no sequence numbers
+      eDescr.coll.seqNumber = task->func < NCCL_NUM_FUNCTIONS ? task->comm->seqNumber[task->func]++ : 0;
+      eDescr.coll.func = task->func;
+      eDescr.coll.sendBuff = task->sendBuff;
+      eDescr.coll.recvBuff = task->recvBuff;
+      eDescr.coll.count = task->count;
+      eDescr.coll.datatype = task->datatype;
+      eDescr.coll.op = task->op;
+      eDescr.coll.trafficBytes = task->trafficBytes;
+      eDescr.coll.nMaxChannels = task->nChannels;
+      eDescr.coll.nWarps = task->nWarps;
+      eDescr.coll.algo = NCCL_ALGO_UNDEF;
+      eDescr.coll.proto = task->proto;
+      eDescr.coll.mscclAlgoName = task->algoName;
+      eDescr.coll.mscclAlgoHandle = task->algoHandle;
+      eDescr.coll.mscclNBlocks = task->nBlocks;
+      ncclProfiler->startEvent(task->comm->profilerContext, &task->eventHandle, &eDescr);
+    }
+  }
+  TIME_STOP_EVENT(taskStart);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProfilerStopMscclEvents(struct ncclProfilerMscclTask* task) {
+  TIME_START_EVENT(taskStop);
+  if (__builtin_expect(ncclProfiler != NULL, 0)) {
+    if (task->eventHandle) ncclProfiler->stopEvent(task->eventHandle);
+    if (task->groupEventHandle) ncclProfiler->stopEvent(task->groupEventHandle);
+  }
+  TIME_STOP_EVENT(taskStop);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclProfilerStartSendProxyOpEvent(int s, struct ncclProxyArgs* args) {
   TIME_START_EVENT(proxyOpStart);
   struct ncclProxySubArgs* sub = &args->subs[s];
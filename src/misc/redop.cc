@@ -0,0 +1,156 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "redop.h"
+#include "alloc.h"
+#include "checks.h"
+#include "group.h"
+#include <algorithm>
+
+#define NCCL_CUSTOM_REDOP_THREADS 256
+#define NCCL_CUSTOM_REDOP_MAX_BLOCKS 1024
+
+struct ncclCustomRedOp* ncclRedOpCustom(struct ncclComm* comm, ncclRedOp_t op) {
+  if (comm == NULL || int(op) < int(ncclNumOps) || int(op) > int(ncclMaxRedOp)) return NULL;
+  int ix = int(ncclUserRedOpMangle(comm, op)) - int(ncclNumOps);
+  if (comm->userRedOpCapacity <= ix || comm->userRedOps[ix].freeNext != -1) return NULL;
+  return comm->userRedOps[ix].custom;
+}
+
+ncclResult_t ncclCustomRedOpLoad(struct ncclComm* comm, const void* image, const char* funcName, ncclDataType_t datatype,
+    struct ncclCustomRedOp** custom) {
+  ncclResult_t ret = ncclSuccess;
+  struct ncclCustomRedOp* c = NULL;
+  int saveDev;
+  if (CUPFN(cuModuleLoadData) == NULL || CUPFN(cuModuleGetFunction) == NULL) {
+    WARN("ncclRedOpCreateCustom : the CUDA driver does not provide the module API");
+    return ncclSystemError;
+  }
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&c, 1), ret, exit);
+  CUCHECKGOTO(cuModuleLoadData(&c->module, image), ret, fail);
+  if (CUPFN(cuModuleGetFunction(&c->function, c->module, funcName)) != CUDA_SUCCESS) {
+    WARN("ncclRedOpCreateCustom : function %s not found in the image", funcName);
+    ret = ncclInvalidArgument;
+    goto fail;
+  }
+  CUDACHECKGOTO(cudaEventCreateWithFlags(&c->done, cudaEventDisableTiming), ret, fail);
+  c->datatype = datatype;
+  *custom = c;
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+fail:
+  if (c && c->module) (void)CUPFN(cuModuleUnload(c->module));
+  free(c);
+  goto exit;
+}
+
+ncclResult_t ncclCustomRedOpFree(struct ncclCustomRedOp* custom) {
+  if (custom == NULL) return ncclSuccess;
+  // Kernels of the operator may still be queued
+  CUDACHECK(cudaEventSynchronize(custom->done));
+  CUDACHECK(cudaEventDestroy(custom->done));
+  CUCHECK(cuModuleUnload(custom->module));
+  free(custom);
+  return ncclSuccess;
+}
+
+static ncclResult_t customLaunch(struct ncclCustomRedOp* custom, void* inout, const void* in, size_t count, cudaStream_t stream) {
+  if (count == 0) return ncclSuccess;
+  unsigned grid = (unsigned)std::min<size_t>(NCCL_CUSTOM_REDOP_MAX_BLOCKS, divUp(count, NCCL_CUSTOM_REDOP_THREADS));
+  void* args[3] = {&inout, &in, &count};
+  CUCHECK(cuLaunchKernel(custom->function, grid, 1, 1, NCCL_CUSTOM_REDOP_THREADS, 1, 1, 0, stream, args, NULL));
+  return ncclSuccess;
+}
+
+static ncclResult_t customSendRecv(struct ncclComm* comm, const void* sendbuff, size_t sendcount, int next,
+    void* recvbuff, size_t recvcount, int prev, ncclDataType_t datatype, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  NCCLCHECKGOTO(ncclSend(sendbuff, sendcount, datatype, next, comm, stream), ret, group);
+  NCCLCHECKGOTO(ncclRecv(recvbuff, recvcount, datatype, prev, comm, stream), ret, group);
+group:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+ncclResult_t ncclCustomReduceRun(struct ncclComm* comm, ncclFunc_t coll, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, struct ncclCustomRedOp* custom, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  const char* name = coll == ncclFuncAllReduce ? "AllReduce" : "ReduceScatter";
+  int nRanks = comm->nRanks;
+  size_t eltSize = ncclTypeSize(datatype);
+  // Block of rank r, of the AllReduce vector or of the ReduceScatter send buffer
+  size_t blockCount = coll == ncclFuncAllReduce ? divUp(count, nRanks) : count;
+  auto blockOffset = [&](int r) { return std::min(r*blockCount, coll == ncclFuncAllReduce ? count : nRanks*count); };
+  auto blockLen = [&](int r) { return coll == ncclFuncAllReduce ? std::min(blockCount, count - blockOffset(r)) : count; };
+  // Ranks in ring order, this rank first
+  const int* ring = comm->channels[0].ring.userRanks;
+  int next = ring[1 % nRanks], prev = ring[nRanks-1];
+  char* finalBuff = (char*)recvbuff + (coll == ncclFuncAllReduce ? blockOffset(comm->rank)*eltSize : 0);
+  struct ncclCudaGraph graph;
+  char* work[2];
+  char* buff;
+  int saveDev;
+
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (ncclGroupDepth != 0 || !comm->config.blocking) {
+    // Each ring step is a group of its own followed by the operator kernel
+    WARN("%s : custom reduction operators cannot be used inside a group or on a nonblocking communicator", name);
+    return ncclInvalidUsage;
+  }
+  if (datatype != custom->datatype) {
+    WARN("%s : custom reduction operator created for type %d used with type %d", name, custom->datatype, datatype);
+    return ncclInvalidArgument;
+  }
+  if (count == 0) return ncclSuccess;
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  if (nRanks == 1) {
+    if (sendbuff != recvbuff) CUDACHECKGOTO(cudaMemcpyAsync(recvbuff, sendbuff, count*eltSize, cudaMemcpyDeviceToDevice, stream), ret, exit);
+    goto exit;
+  }
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->customReduce, 2*alignUp(blockCount*eltSize, 16), ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  work[0] = buff;
+  work[1] = buff + alignUp(blockCount*eltSize, 16);
+  TRACE(NCCL_COLL, "%s: rank %d %zu elements with custom operator, %d ring steps", name, comm->rank, count,
+    coll == ncclFuncAllReduce ? 2*(nRanks-1) : nRanks-1);
+
+  // Reduce-scatter, step s sends the partial block of ring position -1-s and reduces the
+  // contribution of this rank into the partial block of position -2-s
+  for (int s = 0; s < nRanks-1; s++) {
+    int sendRank = ring[(nRanks-1-s) % nRanks];
+    int recvRank = ring[(2*nRanks-2-s) % nRanks];
+    const char* sendPtr = s == 0 ? (const char*)sendbuff + blockOffset(sendRank)*eltSize : work[(s-1)%2];
+    NCCLCHECKGOTO(customSendRecv(comm, sendPtr, blockLen(sendRank), next, work[s%2], blockLen(recvRank), prev, datatype, stream), ret, exit);
+    NCCLCHECKGOTO(customLaunch(custom, work[s%2], (const char*)sendbuff + blockOffset(recvRank)*eltSize, blockLen(recvRank), stream), ret, exit);
+  }
+  // The last block received is the one of this rank
+  CUDACHECKGOTO(cudaMemcpyAsync(finalBuff, work[(nRanks-2)%2], blockLen(comm->rank)*eltSize, cudaMemcpyDeviceToDevice, stream), ret, exit);
+
+  if (coll == ncclFuncAllReduce) {
+    // Allgather, step s passes on the reduced block of ring position -s
+    for (int s = 0; s < nRanks-1; s++) {
+      int sendRank = ring[(nRanks-s) % nRanks];
+      int recvRank = ring[(nRanks-1-s) % nRanks];
+      NCCLCHECKGOTO(customSendRecv(comm, (char*)recvbuff + blockOffset(sendRank)*eltSize, blockLen(sendRank), next,
+        (char*)recvbuff + blockOffset(recvRank)*eltSize, blockLen(recvRank), prev, datatype, stream), ret, exit);
+    }
+  }
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->customReduce, ncclCudaGraphValid(graph), stream), ret, exit);
+  if (!ncclCudaGraphValid(graph)) CUDACHECKGOTO(cudaEventRecord(custom->done, stream), ret, exit);
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclCustomReduceDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->customReduce);
+}
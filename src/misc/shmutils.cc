@@ -7,16 +7,30 @@
 #include "shmutils.h"
 #include "comm.h"
 #include "checks.h"
+#include "param.h"
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <utils.h>
 
+NCCL_PARAM(ShmNumaBind, "SHM_NUMA_BIND", 1);
+NCCL_PARAM(ShmHugePages, "SHM_HUGEPAGES", 1);
+
+#define SHM_MPOL_PREFERRED 1
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#define SHM_HUGEPAGE_SIZE (2UL << 20)
+#define SHM_MAX_NUMA_NODES 1024
+
 struct shmHandleInternal {
   int fd;
   char* shmPath;
@@ -45,6 +59,53 @@ static void shmHandleInit(int fd, char* shmPath, size_t shmSize, size_t realShmS
   return;
 }
 
+// Set where the pages of a segment being created go before any is allocated, neither is fatal.
+// Returns whether the mapping was marked for transparent hugepages.
+static bool shmPlacePages(char* shmPath, char* hptr, size_t size) {
+  bool huge = false;
+  if (ncclParamShmHugePages() && size >= SHM_HUGEPAGE_SIZE) {
+    // Takes effect when /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it
+    if (madvise(hptr, size, MADV_HUGEPAGE) != 0) {
+      INFO(NCCL_ALLOC, "madvise(MADV_HUGEPAGE) of %s failed, error: %s (%d)", shmPath, strerror(errno), errno);
+    } else {
+      huge = true;
+    }
+  }
+  if (ncclParamShmNumaBind()) {
+    int node = ncclCudaDevNumaNode();
+    if (node < 0 || node >= SHM_MAX_NUMA_NODES) return huge;
+    unsigned long mask[SHM_MAX_NUMA_NODES/(8*sizeof(unsigned long))] = { 0 };
+    mask[node/(8*sizeof(unsigned long))] = 1UL << (node%(8*sizeof(unsigned long)));
+    if (syscall(SYS_mbind, hptr, size, SHM_MPOL_PREFERRED, mask, SHM_MAX_NUMA_NODES, 0) != 0) {
+      INFO(NCCL_ALLOC, "mbind of %s to NUMA node %d failed, error: %s (%d)", shmPath, node, strerror(errno), errno);
+    } else {
+      INFO(NCCL_ALLOC, "Bound %s to NUMA node %d", shmPath, node);
+    }
+  }
+  return huge;
+}
+
+// Allocate all pages now so that running out of shared memory fails here and not with a SIGBUS.
+// fallocate has no mapping to take hugepages from, populating through the mapping does.
+static ncclResult_t shmAllocatePages(int fd, char* shmPath, char* hptr, size_t size, bool huge) {
+  if (huge) {
+    if (madvise(hptr, size, MADV_POPULATE_WRITE) == 0) return ncclSuccess;
+    if (errno != EINVAL) {
+      WARN("Error: failed to populate %s with %ld bytes, error: %s (%d)", shmPath, size, strerror(errno), errno);
+      return ncclSystemError;
+    }
+  }
+  while (fallocate(fd, 0, 0, size) != 0) {
+    if (errno == EINTR) {
+      INFO(NCCL_ALL, "fallocate: Failed to extend %s to %ld bytes, error: %s (%d) - retrying", shmPath, size, strerror(errno), errno);
+      continue;
+    }
+    WARN("Error: failed to extend %s to %ld bytes, error: %s (%d)", shmPath, size, strerror(errno), errno);
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclShmOpen(char* shmPath, size_t shmSize, void** shmPtr, void** devShmPtr, int refcount, ncclShmHandle_t* handle) {
   int fd = -1;
   char* hptr = NULL;
@@ -77,18 +138,8 @@ ncclResult_t ncclShmOpen(char* shmPath, size_t shmSize, void** shmPtr, void** de
     } else {
       SYSCHECKGOTO(fd = open(shmPath, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR), "open", ret, fail);
     }
-
-  retry_fallocate:
-    if (fallocate(fd, 0, 0, realShmSize) != 0) {
-      if (errno == EINTR) {
-        INFO(NCCL_ALL, "fallocate: Failed to extend %s to %ld bytes, error: %s (%d) - retrying", shmPath, realShmSize, strerror(errno), errno);
-        goto retry_fallocate;
-      }
-      WARN("Error: failed to extend %s to %ld bytes, error: %s (%d)", shmPath, realShmSize, strerror(errno), errno);
-      ret = ncclSystemError;
-      goto fail;
-    }
-    INFO(NCCL_ALLOC, "Allocated %ld bytes of shared memory in %s", realShmSize, shmPath);
+    // Pages are allocated once they have been placed on the mapping
+    SYSCHECKGOTO(ftruncate(fd, realShmSize), "ftruncate", ret, fail);
   } else {
     SYSCHECKGOTO(fd = open(shmPath, O_RDWR, S_IRUSR | S_IWUSR), "open", ret, fail);
   }
@@ -102,6 +153,8 @@ ncclResult_t ncclShmOpen(char* shmPath, size_t shmSize, void** shmPtr, void** de
   }
 
   if (create) {
+    NCCLCHECKGOTO(shmAllocatePages(fd, shmPath, hptr, realShmSize, shmPlacePages(shmPath, hptr, realShmSize)), ret, fail);
+    INFO(NCCL_ALLOC, "Allocated %ld bytes of shared memory in %s", realShmSize, shmPath);
     *(int*)(hptr + shmSize) = refcount;
   } else {
     int remref = ncclAtomicRefCountDecrement((int*)(hptr + shmSize));
@@ -0,0 +1,76 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "comm.h"
+#include "simtimeline.h"
+
+struct ncclSimOp {
+  struct ncclComm* comm;
+  const char* opName;
+  size_t bytes;
+  const char* algorithm;
+  const char* protocol;
+  int nChannels;
+  float time;
+  float linkTime;
+};
+
+static thread_local std::vector<struct ncclSimOp> ncclSimOps;
+
+ncclResult_t ncclSimTimelineBegin() {
+  ncclSimOps.clear();
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSimTimelineRecord(struct ncclComm* comm, const char* opName, size_t bytes, const char* algorithm,
+    const char* protocol, int nChannels, float time, float linkTime) {
+  ncclSimOps.push_back({comm, opName, bytes, algorithm, protocol, nChannels, time, std::min(std::max(linkTime, 0.0f), time)});
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSimTimelineEnd(ncclSimInfo_t* simInfo) {
+  if (ncclSimOps.empty()) return ncclSuccess;
+  // Each comm runs its operations back to back from the start of the group
+  std::map<struct ncclComm*, float> clock;
+  std::vector<float> start(ncclSimOps.size());
+  for (size_t i = 0; i < ncclSimOps.size(); i++) {
+    float& c = clock[ncclSimOps[i].comm];
+    start[i] = c;
+    c += ncclSimOps[i].time;
+  }
+  // Comms of a GPU overlap, until their links are busier than the longest of them can hide
+  std::map<int, float> longest, linkBusy;
+  for (auto& c : clock) longest[c.first->cudaDev] = std::max(longest[c.first->cudaDev], c.second);
+  for (auto& op : ncclSimOps) linkBusy[op.comm->cudaDev] += op.linkTime;
+  std::map<int, float> stretch;
+  float groupTime = 0.0f;
+  for (auto& l : longest) {
+    float span = std::max(l.second, linkBusy[l.first]);
+    stretch[l.first] = l.second > 0.0f ? span / l.second : 1.0f;
+    groupTime = std::max(groupTime, span);
+  }
+  simInfo->estimatedTime = groupTime;
+  simInfo->nEvents = ncclSimOps.size();
+  for (size_t i = 0; i < ncclSimOps.size() && simInfo->events && (int)i < simInfo->maxEvents; i++) {
+    const struct ncclSimOp& op = ncclSimOps[i];
+    float s = stretch[op.comm->cudaDev];
+    ncclSimEvent_t* ev = simInfo->events + i;
+    ev->comm = op.comm;
+    ev->opName = op.opName;
+    ev->bytes = op.bytes;
+    ev->algorithm = op.algorithm;
+    ev->protocol = op.protocol;
+    ev->nChannels = op.nChannels;
+    ev->startTime = start[i] * s;
+    ev->endTime = (start[i] + op.time) * s;
+  }
+  INFO(NCCL_TUNING, "Simulated group: %zu operations on %zu comms, %.2f us", ncclSimOps.size(), clock.size(), groupTime);
+  ncclSimOps.clear();
+  return ncclSuccess;
+}
@@ -0,0 +1,74 @@
+/*************************************************************************
+ * Copyright (c) Microsoft Corporation.
+ * Licensed under the MIT License.
+ ************************************************************************/
+
+#include "sparse.h"
+#include "alloc.h"
+#include "argcheck.h"
+#include "checks.h"
+#include "device.h"
+#include "group.h"
+#include "param.h"
+
+// Percent of the bytes of a dense allreduce the gathered slots may move before going dense
+NCCL_PARAM(SparseAllReduceDenseRatio, "SPARSE_ALLREDUCE_DENSE_RATIO", 100);
+
+ncclResult_t ncclSparseAllReduceRun(struct ncclComm* comm, const void* values, const int64_t* indices, const size_t* nnz,
+    size_t maxnnz, void* recvbuff, size_t count, ncclDataType_t datatype, cudaStream_t stream) {
+  ncclResult_t ret = ncclSuccess;
+  size_t eltSize;
+  size_t slotBytes;
+  bool dense;
+  struct ncclCudaGraph graph;
+  char* buff;
+  int saveDev;
+
+  NCCLCHECK(CommCheck(comm, "SparseAllReduce", "comm"));
+  NCCLCHECK(ncclCommEnsureReady(comm));
+  if (ncclGroupDepth != 0 || !comm->config.blocking) {
+    // The slots are added by kernels queued after the gather
+    WARN("SparseAllReduce : cannot be called inside a group or on a nonblocking communicator");
+    return ncclInvalidUsage;
+  }
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("SparseAllReduce : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  if (maxnnz > 0 && (values == NULL || indices == NULL)) {
+    WARN("SparseAllReduce : values or indices argument is NULL");
+    return ncclInvalidArgument;
+  }
+  if (count == 0) return ncclSuccess;
+  eltSize = ncclTypeSize(datatype);
+  slotBytes = ncclSparseSlotBytes(maxnnz, eltSize);
+  // Bytes received per rank, (nRanks-1) slots against about twice the vector for a ring allreduce
+  dense = (double)comm->nRanks*slotBytes*100 > 2.0*count*eltSize*ncclParamSparseAllReduceDenseRatio();
+  NCCLCHECK(ncclCudaGetCapturingGraph(&graph, stream));
+
+  CUDACHECK(cudaGetDevice(&saveDev));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, exit);
+  CUDACHECKGOTO(cudaMemsetAsync(recvbuff, 0, count*eltSize, stream), ret, exit);
+  if (maxnnz == 0) goto exit;
+  NCCLCHECKGOTO(ncclScratchAcquire(&comm->sparseAllReduce, dense ? slotBytes : slotBytes*comm->nRanks, ncclCudaGraphValid(graph), stream, &buff), ret, exit);
+  TRACE(NCCL_COLL, "SparseAllReduce: rank %d up to %zu of %zu elements, %s", comm->rank, maxnnz, count, dense ? "dense" : "sparse");
+  if (dense) {
+    NCCLCHECKGOTO(ncclLaunchSparsePack(buff, values, indices, nnz, maxnnz, eltSize, stream), ret, exit);
+    NCCLCHECKGOTO(ncclLaunchSparseAccumulate(recvbuff, count, buff, slotBytes, 1, maxnnz, datatype, stream), ret, exit);
+    NCCLCHECKGOTO(ncclAllReduce(recvbuff, recvbuff, count, datatype, ncclSum, comm, stream), ret, exit);
+  } else {
+    char* slot = buff + comm->rank*slotBytes;
+    NCCLCHECKGOTO(ncclLaunchSparsePack(slot, values, indices, nnz, maxnnz, eltSize, stream), ret, exit);
+    NCCLCHECKGOTO(ncclAllGather(slot, buff, slotBytes, ncclUint8, comm, stream), ret, exit);
+    NCCLCHECKGOTO(ncclLaunchSparseAccumulate(recvbuff, count, buff, slotBytes, comm->nRanks, maxnnz, datatype, stream), ret, exit);
+  }
+  NCCLCHECKGOTO(ncclScratchRelease(&comm->sparseAllReduce, ncclCudaGraphValid(graph), stream), ret, exit);
+
+exit:
+  CUDACHECK(cudaSetDevice(saveDev));
+  return ret;
+}
+
+ncclResult_t ncclSparseAllReduceDestroy(struct ncclComm* comm) {
+  return ncclScratchDestroy(&comm->sparseAllReduce);
+}
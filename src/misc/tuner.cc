@@ -9,15 +9,20 @@
 #include <errno.h>
 #include <stdlib.h>
 
+#include "alloc.h"
 #include "checks.h"
 #include "debug.h"
+#include "metrics.h"
+#include "param.h"
 #include "tuner.h"
 
 pthread_mutex_t tunerPluginLock = PTHREAD_MUTEX_INITIALIZER;
 static int tunerPluginRefCount;
 static void* tunerPluginLib = nullptr;
-static ncclTuner_v3_t* tunerSymbol = nullptr;
+static ncclTuner_v4_t* tunerSymbol = nullptr;
+static ncclTuner_v3_t* ncclTuner_v3 = nullptr;
 static ncclTuner_v2_t* ncclTuner_v2 = nullptr;
+static ncclTuner_v4_t ncclTuner_v3_as_v4;
 static ncclTuner_v3_t ncclTuner_v2_as_v3;
 
 static int hasNvlsSupport(float** collCostTable) {
@@ -61,6 +66,15 @@ static ncclResult_t ncclTuner_v2_as_v3_init(size_t nRanks, size_t nNodes, ncclDe
   return ncclSuccess;
 }
 
+static ncclResult_t ncclTuner_v3_as_v4_init(size_t nRanks, size_t nNodes, ncclDebugLogger_t logFunction, void** context) {
+  NCCLCHECK(ncclTuner_v3->init(nRanks, nNodes, logFunction, context));
+  ncclTuner_v3_as_v4.name = ncclTuner_v3->name;
+  ncclTuner_v3_as_v4.getCollInfo = ncclTuner_v3->getCollInfo;
+  ncclTuner_v3_as_v4.destroy = ncclTuner_v3->destroy;
+  ncclTuner_v3_as_v4.reportPerf = nullptr;
+  return ncclSuccess;
+}
+
 #define MAX_STR_LEN 255
 
 static void* tryOpenLib(const char* name, int* err, char* errStr) {
@@ -198,19 +212,25 @@ ncclResult_t ncclTunerPluginLoad(struct ncclComm* comm) {
     goto fail;
   }
 
-  tunerSymbol = (ncclTuner_v3_t*)dlsym(tunerPluginLib, "ncclTunerPlugin_v3");
+  tunerSymbol = (ncclTuner_v4_t*)dlsym(tunerPluginLib, "ncclTunerPlugin_v4");
   if (tunerSymbol == nullptr) {
-    INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Failed to find ncclTunerPlugin_v3 symbol.");
-    ncclTuner_v2 = (ncclTuner_v2_t*)dlsym(tunerPluginLib, "ncclTunerPlugin_v2");
-    if (ncclTuner_v2 == nullptr) {
-      INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Failed to find ncclTunerPlugin_v2 symbol, using internal tuner instead.");
-      dlclose(tunerPluginLib);
-      goto fail;
-    } else {
+    INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Failed to find ncclTunerPlugin_v4 symbol.");
+    ncclTuner_v3 = (ncclTuner_v3_t*)dlsym(tunerPluginLib, "ncclTunerPlugin_v3");
+    if (ncclTuner_v3 == nullptr) {
+      INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Failed to find ncclTunerPlugin_v3 symbol.");
+      ncclTuner_v2 = (ncclTuner_v2_t*)dlsym(tunerPluginLib, "ncclTunerPlugin_v2");
+      if (ncclTuner_v2 == nullptr) {
+        INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Failed to find ncclTunerPlugin_v2 symbol, using internal tuner instead.");
+        dlclose(tunerPluginLib);
+        goto fail;
+      }
       ncclTuner_v2_as_v3.init = ncclTuner_v2_as_v3_init;
       ncclTuner_v2_as_v3.name = ncclTuner_v2->name;
-      tunerSymbol = &ncclTuner_v2_as_v3;
+      ncclTuner_v3 = &ncclTuner_v2_as_v3;
     }
+    ncclTuner_v3_as_v4.init = ncclTuner_v3_as_v4_init;
+    ncclTuner_v3_as_v4.name = ncclTuner_v3->name;
+    tunerSymbol = &ncclTuner_v3_as_v4;
   }
 
   INFO(NCCL_ENV|NCCL_TUNING, "TUNER/Plugin: Using tuner plugin %s", tunerSymbol->name);
@@ -228,6 +248,108 @@ fail:
   goto exit;
 }
 
+NCCL_PARAM(TunerFeedbackInterval, "TUNER_FEEDBACK_INTERVAL", 16);
+
+#define NCCL_TUNER_FEEDBACK_SAMPLES 4
+
+struct ncclTunerFeedbackSample {
+  cudaEvent_t events[2];
+  bool inFlight;
+  ncclFunc_t func;
+  size_t nBytes;
+  int algorithm;
+  int protocol;
+  int nChannels;
+};
+
+struct ncclTunerFeedback {
+  struct ncclTunerFeedbackSample samples[NCCL_TUNER_FEEDBACK_SAMPLES];
+  // launches of single collective kernels so far
+  uint64_t launches;
+  // sample of the kernel being launched, -1 if it is not timed
+  int current;
+};
+
+static ncclResult_t tunerFeedbackPoll(struct ncclComm* comm, struct ncclTunerFeedback* feedback) {
+  for (int i = 0; i < NCCL_TUNER_FEEDBACK_SAMPLES; i++) {
+    struct ncclTunerFeedbackSample* sample = feedback->samples + i;
+    if (!sample->inFlight) continue;
+    cudaError_t err = cudaEventQuery(sample->events[1]);
+    if (err == cudaErrorNotReady) continue;
+    CUDACHECK(err);
+    float ms;
+    CUDACHECK(cudaEventElapsedTime(&ms, sample->events[0], sample->events[1]));
+    sample->inFlight = false;
+    ncclMetricsCollLatency(sample->func, sample->algorithm, sample->protocol, ms * 1000.0f);
+    if (comm->tuner == nullptr || comm->tuner->reportPerf == nullptr) continue;
+    NCCLCHECK(comm->tuner->reportPerf(comm->tunerContext, sample->func, sample->nBytes,
+      sample->algorithm, sample->protocol, sample->nChannels, ms * 1000.0f));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTunerFeedbackBeforeLaunch(struct ncclComm* comm, struct ncclKernelPlan* plan, cudaStream_t stream) {
+  // Replays of captured kernels would all record the same events. Samples also feed the latency metrics.
+  bool tunerFeedback = comm->tuner != nullptr && comm->tuner->reportPerf != nullptr;
+  if ((!tunerFeedback && !ncclMetricsEnabled()) || plan->persistent) return ncclSuccess;
+  int64_t interval = ncclParamTunerFeedbackInterval();
+  if (interval <= 0) return ncclSuccess;
+  struct ncclTunerFeedback* feedback = comm->tunerFeedback;
+  if (feedback == nullptr) {
+    NCCLCHECK(ncclCalloc(&feedback, 1));
+    for (int i = 0; i < NCCL_TUNER_FEEDBACK_SAMPLES; i++) {
+      CUDACHECK(cudaEventCreate(&feedback->samples[i].events[0]));
+      CUDACHECK(cudaEventCreate(&feedback->samples[i].events[1]));
+    }
+    comm->tunerFeedback = feedback;
+  }
+  feedback->current = -1;
+  NCCLCHECK(tunerFeedbackPoll(comm, feedback));
+
+  // Kernels of several operations cannot tell the time of each
+  struct ncclTaskColl* task = ncclIntruQueueHead(&plan->collTaskQueue);
+  if (task == nullptr || task->next != nullptr || !ncclIntruQueueEmpty(&plan->p2pTaskQueue)) return ncclSuccess;
+  if (feedback->launches++ % interval != 0) return ncclSuccess;
+
+  for (int i = 0; i < NCCL_TUNER_FEEDBACK_SAMPLES; i++) {
+    struct ncclTunerFeedbackSample* sample = feedback->samples + i;
+    if (sample->inFlight) continue;
+    sample->func = task->func;
+    // The nBytes getCollInfo was given for the collective
+    bool perRank = task->func == ncclFuncAllGather || task->func == ncclFuncReduceScatter;
+    sample->nBytes = ncclTypeSize(task->datatype) * (perRank ? comm->nRanks*task->count : task->count);
+    sample->algorithm = task->algorithm;
+    sample->protocol = task->protocol;
+    sample->nChannels = countOneBits(plan->channelMask);
+    CUDACHECK(cudaEventRecord(sample->events[0], stream));
+    feedback->current = i;
+    break;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTunerFeedbackAfterLaunch(struct ncclComm* comm, cudaStream_t stream) {
+  struct ncclTunerFeedback* feedback = comm->tunerFeedback;
+  if (feedback == nullptr || feedback->current < 0) return ncclSuccess;
+  struct ncclTunerFeedbackSample* sample = feedback->samples + feedback->current;
+  CUDACHECK(cudaEventRecord(sample->events[1], stream));
+  sample->inFlight = true;
+  feedback->current = -1;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTunerFeedbackFree(struct ncclComm* comm) {
+  struct ncclTunerFeedback* feedback = comm->tunerFeedback;
+  if (feedback == nullptr) return ncclSuccess;
+  for (int i = 0; i < NCCL_TUNER_FEEDBACK_SAMPLES; i++) {
+    CUDACHECK(cudaEventDestroy(feedback->samples[i].events[0]));
+    CUDACHECK(cudaEventDestroy(feedback->samples[i].events[1]));
+  }
+  free(feedback);
+  comm->tunerFeedback = nullptr;
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTunerPluginUnload(struct ncclComm* comm) {
   pthread_mutex_lock(&tunerPluginLock);
   if (comm->tunerPluginLoaded && 0 == (--tunerPluginRefCount)) {
@@ -10,6 +10,10 @@
 #include "nvmlwrap.h"
 
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
 
 // Get current Compute Capability
 int ncclCudaCompCap() {
@@ -54,6 +58,24 @@ ncclResult_t getBusId(int cudaDev, int64_t *busId) {
   return ncclSuccess;
 }
 
+int ncclCudaDevNumaNode() {
+  int cudaDev;
+  char busId[64];
+  char path[PATH_MAX];
+  int node = -1;
+  if (cudaGetDevice(&cudaDev) != cudaSuccess || cudaDeviceGetPCIBusId(busId, sizeof(busId), cudaDev) != cudaSuccess) {
+    (void)cudaGetLastError();
+    return -1;
+  }
+  for (char* c = busId; *c; c++) *c = tolower(*c);
+  snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", busId);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return -1;
+  if (fscanf(file, "%d", &node) != 1) node = -1;
+  fclose(file);
+  return node;
+}
+
 ncclResult_t getHostName(char* hostname, int maxlen, const char delim) {
   if (gethostname(hostname, maxlen) != 0) {
     strncpy(hostname, "unknown", maxlen);
@@ -132,6 +154,44 @@ uint64_t getPidHash(void) {
   return getHash(pname, strlen(pname));
 }
 
+/* Leaf switch of this host, as given by NCCL_TREE_FABRIC_LEAF, or by the line of NCCL_TREE_FABRIC_FILE
+ * naming this host, each line being "<hostname> <leaf>" as in a scheduler topology file.
+ */
+static uint64_t fabricLeafHashValue;
+static void getFabricLeafHashOnce() {
+  char leaf[1024] = "";
+  const char* env;
+
+  if ((env = ncclGetEnv("NCCL_TREE_FABRIC_LEAF")) != NULL) {
+    INFO(NCCL_ENV, "NCCL_TREE_FABRIC_LEAF set by environment to %s", env);
+    strncpy(leaf, env, sizeof(leaf)-1);
+  } else if ((env = ncclGetEnv("NCCL_TREE_FABRIC_FILE")) != NULL) {
+    char host[1024], shortHost[1024], name[1024], value[1024];
+    (void) getHostName(host, sizeof(host), '\0');
+    (void) getHostName(shortHost, sizeof(shortHost), '.');
+    FILE* file = fopen(env, "r");
+    if (file == NULL) {
+      WARN("Could not open NCCL_TREE_FABRIC_FILE %s : %s", env, strerror(errno));
+      return;
+    }
+    while (fscanf(file, "%1023s %1023s", name, value) == 2) {
+      if (strcmp(name, host) == 0 || strcmp(name, shortHost) == 0) {
+        strcpy(leaf, value);
+        break;
+      }
+    }
+    fclose(file);
+    if (leaf[0] == '\0') INFO(NCCL_INIT, "Host %s is not in NCCL_TREE_FABRIC_FILE %s", host, env);
+  }
+  leaf[sizeof(leaf)-1] = '\0';
+  if (leaf[0] != '\0') fabricLeafHashValue = getHash(leaf, strlen(leaf));
+}
+uint64_t getFabricLeafHash(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, getFabricLeafHashOnce);
+  return fabricLeafHashValue;
+}
+
 int parseStringList(const char* string, struct netIf* ifList, int maxList) {
   if (!string) return 0;
 
@@ -339,6 +339,14 @@ enum ncclNetState {
 enum ncclNetState ncclNetStates[3] = { ncclNetStateInit, ncclNetStateInit, ncclNetStateInit };
 enum ncclNetState ncclCollNetStates[3] = { ncclNetStateInit, ncclNetStateInit, ncclNetStateInit };
 
+// Built-in network named name, for net plugins wrapping it (see ext-net/wrapper). NULL if unknown.
+extern "C" __attribute__ ((visibility("default"))) ncclNet_v8_t* ncclNetGetInternal_v8(const char* name) {
+  if (name == NULL) return NULL;
+  if (strcasecmp(name, ncclNetIb.name) == 0) return &ncclNetIb;
+  if (strcasecmp(name, ncclNetSocket.name) == 0) return &ncclNetSocket;
+  return NULL;
+}
+
 #define MAX_STR_LEN 255
 
 static void* tryOpenLib(char* name, int* err, char* errStr) {
@@ -15,12 +15,16 @@
 #include "timer.h"
 #include "profiler.h"
 #include "transport.h"
+#include "net.h"
+#include "async_error.h"
 
 #include <sys/syscall.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sched.h>
+#include <limits.h>
+#include <algorithm>
 
 void* ncclProxyServiceUDS(void* _args);
 
@@ -367,6 +371,9 @@ static ncclResult_t ncclProxyOpToArgs(struct ncclProxyOp* op, struct ncclProxyAr
   sub->offset = 0;
   sub->peer = op->peer;
   sub->reg = op->reg;
+  sub->regHost = op->regHost;
+  sub->netRegSend = op->netRegSend;
+  sub->netRegBytes = op->netRegBytes;
   sub->sendMhandle = op->sendMhandle;
   sub->recvMhandle = op->recvMhandle;
   sub->sendbuff = op->sendbuff;
@@ -448,20 +455,69 @@ static ncclResult_t ProxyAppend(struct ncclProxyProgressState* state, struct ncc
   return ncclSuccess;
 }
 
-ncclResult_t ncclProxyPost(struct ncclProxyOpsPool* pool, int nextOps, int nextOpsEnd) {
-  pthread_mutex_lock(&pool->mutex);
-  if (pool->nextOps == -1) {
-    pool->nextOps = nextOps;
+// Post a chain of ops of local rank tpLocalRank, with a single release store unless the
+// progress thread sleeps
+ncclResult_t ncclProxyPost(struct ncclProxyOpsPool* pool, int tpLocalRank, int nextOps, int nextOpsEnd) {
+  struct ncclProxyOpsPosted* posted = pool->posted+tpLocalRank;
+  uint64_t tail = posted->tail;
+  while (tail - __atomic_load_n(&posted->head, __ATOMIC_ACQUIRE) == NCCL_PROXY_POST_RING) sched_yield();
+  posted->chains[tail % NCCL_PROXY_POST_RING].nextOps = nextOps;
+  posted->chains[tail % NCCL_PROXY_POST_RING].nextOpsEnd = nextOpsEnd;
+  __atomic_store_n(&posted->tail, tail+1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&pool->mutex);
     pthread_cond_signal(&pool->cond);
-  } else {
-    pool->ops[pool->nextOpsEnd].next = nextOps;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return ncclSuccess;
+}
+
+static bool proxyOpsPosted(struct ncclProxyOpsPool* pool, int nRanks) {
+  for (int r = 0; r < nRanks; r++) {
+    if (__atomic_load_n(&pool->posted[r].tail, __ATOMIC_SEQ_CST) != pool->posted[r].head) return true;
+  }
+  return false;
+}
+
+// Take all chains posted so far as a single chain, -1 if there are none
+static int proxyOpsTake(struct ncclProxyOpsPool* pool, int nRanks) {
+  int nextOps = -1, nextOpsEnd = -1;
+  for (int r = 0; r < nRanks; r++) {
+    struct ncclProxyOpsPosted* posted = pool->posted+r;
+    uint64_t head = posted->head;
+    uint64_t tail = __atomic_load_n(&posted->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      int chainOps = posted->chains[head % NCCL_PROXY_POST_RING].nextOps;
+      if (nextOps == -1) nextOps = chainOps;
+      else pool->ops[nextOpsEnd].next = chainOps;
+      nextOpsEnd = posted->chains[head % NCCL_PROXY_POST_RING].nextOpsEnd;
+    }
+    __atomic_store_n(&posted->head, head, __ATOMIC_RELEASE);
+  }
+  return nextOps;
+}
+
+// Save the op in the template being built, the progress thread of this rank is the one posting it
+static ncclResult_t proxyReplayAppend(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, struct ncclProxyOp* proxyOp) {
+  struct ncclProxyReplayPlan* plan = comm->proxyReplayBuild;
+  if (proxyConn->tpLocalRank != comm->topParentLocalRanks[comm->localRank]) {
+    WARN("Rank %d cannot replay proxy ops of a connection progressed by local rank %d", comm->rank, proxyConn->tpLocalRank);
+    return ncclInternalError;
   }
-  pool->nextOpsEnd = nextOpsEnd;
-  pthread_mutex_unlock(&pool->mutex);
+  if (plan->nOps == plan->maxOps) {
+    int maxOps = std::max(16, 2*plan->maxOps);
+    NCCLCHECK(ncclRealloc(&plan->ops, plan->maxOps, maxOps));
+    plan->maxOps = maxOps;
+  }
+  struct ncclProxyOp* op = plan->ops + plan->nOps++;
+  memcpy(op, proxyOp, sizeof(struct ncclProxyOp));
+  op->next = -1;
+  op->connection = proxyConn->connection;
   return ncclSuccess;
 }
 
 static ncclResult_t ncclLocalOpAppend(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, struct ncclProxyOp* proxyOp) {
+  if (comm->proxyReplayBuild) return proxyReplayAppend(comm, proxyConn, proxyOp);
   int tpLocalRank = comm->topParentLocalRanks[comm->localRank];
   struct ncclProxyOps* proxyOps = comm->proxyState->proxyOps;
   if (proxyOps == NULL) return ncclInternalError;
@@ -516,7 +572,7 @@ static ncclResult_t ncclLocalOpAppend(struct ncclComm* comm, struct ncclProxyCon
     int nextOps = proxyOps->nextOps;
     proxyOps->nextOps = pool->ops[lastOp].next;
     pool->ops[lastOp].next = -1;
-    NCCLCHECK(ncclProxyPost(proxyOps->pool, nextOps, lastOp));
+    NCCLCHECK(ncclProxyPost(proxyOps->pool, tpLocalRank, nextOps, lastOp));
     proxyOps->count -= toSend;
   }
   TIME_STOP(0);
@@ -527,8 +583,8 @@ static ncclResult_t SaveProxy(struct ncclComm* comm, struct ncclChannel* channel
   if (peer < 0) return ncclSuccess;
 
   struct ncclChannelPeer* peerComm = channel->peers[peer];
-  struct ncclConnector* connector = type == proxyRecv ? peerComm->recv+connIndex : peerComm->send+connIndex;
-  if (connector->transportComm == NULL) {
+  struct ncclConnector* connector = peerComm == NULL ? NULL : type == proxyRecv ? peerComm->recv+connIndex : peerComm->send+connIndex;
+  if (connector == NULL || connector->transportComm == NULL) {
     WARN("Rank %d has no transport for %s peer %d on channel %d/%d", comm->rank,
         type == proxyRecv ? "recv" : "send", peer, channel->id, connIndex);
     return ncclInternalError;
@@ -543,8 +599,9 @@ static ncclResult_t SaveProxy(struct ncclComm* comm, struct ncclChannel* channel
   return ncclSuccess;
 }
 
-ncclResult_t mscclSaveProxy(struct ncclComm* comm, struct ncclChannel* channel, int type, int peer, struct ncclProxyOp* op, int connIndex) {
-  NCCLCHECK(SaveProxy(comm, channel, type, peer, op, connIndex, nullptr));
+// MSCCL resolves the connectors of its operations when it builds them, as SaveProxy would
+ncclResult_t mscclAppendProxyOp(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, struct ncclProxyOp* op) {
+  NCCLCHECK(ncclLocalOpAppend(comm, proxyConn, op));
   return ncclSuccess;
 }
 
@@ -724,8 +781,167 @@ static ncclResult_t progressOps(struct ncclProxyState* proxyState, struct ncclPr
   return ncclSuccess;
 }
 
+// A range per iteration is many events for a tool, so they are only recorded on demand
+NCCL_PARAM(ProxyNvtx, "PROXY_NVTX", 0);
+
+static ncclResult_t progressOpsNvtx(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, struct ncclProxyArgs* opStart, int* idle) {
+  struct NvtxParamsProxyProgress {
+    int cudaDev;
+    int nOps;
+    int nSubs;
+  };
+  static constexpr nvtxPayloadSchemaEntry_t ProxyProgressSchema[] = {
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "CUDA device"},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Active ops", nullptr, 0, offsetof(NvtxParamsProxyProgress, nOps)},
+    {0, NVTX_PAYLOAD_ENTRY_TYPE_INT, "Active sub-ops", nullptr, 0, offsetof(NvtxParamsProxyProgress, nSubs)}
+  };
+  NvtxParamsProxyProgress payload{proxyState->cudaDev, 0, 0};
+  for (struct ncclProxyArgs* op = opStart; op; op = op->next) {
+    payload.nOps++;
+    payload.nSubs += op->nsubs;
+  }
+  NVTX3_FUNC_WITH_PARAMS(ProxyProgress, ProxyProgressSchema, payload)
+  return progressOps(proxyState, state, opStart, idle);
+}
+
 NCCL_PARAM(ProxyAppendBatchSize, "PROXY_APPEND_BATCH_SIZE", 16);
 
+// Hand op to the thread of shard, false when its ring is full
+static bool proxyShardPush(struct ncclProxyProgressShard* shard, struct ncclProxyOp* op) {
+  uint64_t tail = shard->tail;
+  if (tail - __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE) == NCCL_PROXY_SHARD_RING) return false;
+  shard->ring[tail % NCCL_PROXY_SHARD_RING] = *op;
+  __atomic_store_n(&shard->tail, tail+1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&shard->mutex);
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  return true;
+}
+
+static void proxyReplayPlanFree(struct ncclProxyReplayPlan* plan) {
+  free(plan->ops);
+  free(plan);
+}
+
+ncclResult_t ncclProxyReplayInit(struct ncclComm* comm) {
+  struct ncclProxyReplay* replay;
+  NCCLCHECK(ncclCalloc(&replay, 1));
+  NCCLCHECK(ncclCudaHostCalloc(&replay->ring, 1));
+  NCCLCHECK(ncclCudaCalloc(&replay->seq, 1));
+  pthread_mutex_init(&replay->mutex, NULL);
+  comm->proxyState->replay = replay;
+  return ncclSuccess;
+}
+
+static ncclResult_t proxyReplayDestroy(struct ncclProxyReplay* replay) {
+  for (int i = 0; i < replay->nPlans; i++) {
+    if (replay->plans[i]) proxyReplayPlanFree(replay->plans[i]);
+  }
+  free(replay->plans);
+  NCCLCHECK(ncclCudaHostFree(replay->ring));
+  NCCLCHECK(ncclCudaFree(replay->seq));
+  pthread_mutex_destroy(&replay->mutex);
+  free(replay);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProxyReplayRegister(struct ncclComm* comm, struct ncclKernelPlan* plan, bool once, uint32_t* replayId) {
+  struct ncclProxyReplay* replay = comm->proxyState->replay;
+  struct ncclProxyReplayPlan* tpl;
+  ncclResult_t ret = ncclSuccess;
+  int id;
+  *replayId = 0;
+  NCCLCHECK(ncclCalloc(&tpl, 1));
+  tpl->collOpCount = plan->collOpCount;
+  tpl->once = once;
+  comm->proxyReplayBuild = tpl;
+  for (struct ncclProxyOp* op = ncclIntruQueueHead(&plan->proxyOpQueue); op != nullptr; op = op->enqNext) {
+    // Posted without a host task for the profiler to attach events to
+    op->profilerContext = comm->profilerContext;
+    op->eActivationMask = 0;
+    op->taskEventHandle = NULL;
+    if (op->opCount & 1) tpl->p2pOpBump[op->channelId] = (op->opCount>>1) + 1;
+    NCCLCHECKGOTO(ncclProxySaveOp(comm, op, nullptr), ret, fail);
+  }
+  comm->proxyReplayBuild = NULL;
+  // Nothing for the progress thread to do, the kernel does not ring
+  if (tpl->nOps == 0) goto fail;
+
+  pthread_mutex_lock(&replay->mutex);
+  for (id = 0; id < replay->nPlans && replay->plans[id]; id++);
+  if (id == replay->nPlans) {
+    int nPlans = std::max(16, 2*replay->nPlans);
+    ret = ncclRealloc(&replay->plans, replay->nPlans, nPlans);
+    if (ret == ncclSuccess) replay->nPlans = nPlans;
+  }
+  if (ret == ncclSuccess) replay->plans[id] = tpl;
+  pthread_mutex_unlock(&replay->mutex);
+  if (ret != ncclSuccess) goto fail;
+  *replayId = id+1;
+  return ncclSuccess;
+fail:
+  comm->proxyReplayBuild = NULL;
+  proxyReplayPlanFree(tpl);
+  return ret;
+}
+
+ncclResult_t ncclProxyReplayUnregister(struct ncclComm* comm, uint32_t replayId) {
+  struct ncclProxyReplay* replay = comm->proxyState->replay;
+  pthread_mutex_lock(&replay->mutex);
+  struct ncclProxyReplayPlan* tpl = replay->plans[replayId-1];
+  replay->plans[replayId-1] = NULL;
+  pthread_mutex_unlock(&replay->mutex);
+  if (tpl) proxyReplayPlanFree(tpl);
+  return ncclSuccess;
+}
+
+// Post the ops of the plans whose kernels rang since the last call, translating their opCounts
+// to the tip of the history as uploadProxyOps() does
+static ncclResult_t proxyReplayPoll(struct ncclProxyState* proxyState, int* added) {
+  struct ncclProxyReplay* replay = proxyState->replay;
+  struct ncclProxyProgressState* state = &proxyState->progressState;
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&replay->mutex);
+  while (true) {
+    uint64_t slot = __atomic_load_n(replay->ring->slots + replay->head % NCCL_PROXY_REPLAY_RING, __ATOMIC_ACQUIRE);
+    if ((uint32_t)(slot >> 32) != (uint32_t)(replay->head+1)) break;
+    uint32_t id = (uint32_t)slot;
+    struct ncclProxyReplayPlan* plan = id >= 1 && id <= (uint32_t)replay->nPlans ? replay->plans[id-1] : NULL;
+    if (plan == NULL) {
+      WARN("Kernel rang for unknown proxy ops template %u", id);
+      ret = ncclInternalError;
+    } else {
+      for (; replay->nextOp < plan->nOps; replay->nextOp++) {
+        struct ncclProxyOp op = plan->ops[replay->nextOp];
+        op.opCount += ((op.opCount & 1) ? replay->p2pOpCount[op.channelId] : replay->collOpCount) << 1;
+        int shard = op.connection->progressShard;
+        if (shard != 0) {
+          // Resume from this op once the shard thread made room
+          if (!proxyShardPush(state->shards+shard, &op)) goto exit;
+        } else {
+          NCCLCHECKGOTO(ProxyAppend(state, &op), ret, exit);
+        }
+        (*added)++;
+      }
+      replay->collOpCount += plan->collOpCount;
+      for (int c = 0; c < MAXCHANNELS; c++) replay->p2pOpCount[c] += plan->p2pOpBump[c];
+      if (plan->once) {
+        replay->plans[id-1] = NULL;
+        proxyReplayPlanFree(plan);
+      }
+    }
+    replay->nextOp = 0;
+    replay->head++;
+    __atomic_store_n(&replay->ring->consumed, replay->head, __ATOMIC_RELEASE);
+    if (ret != ncclSuccess) break;
+  }
+exit:
+  pthread_mutex_unlock(&replay->mutex);
+  return ret;
+}
+
 static ncclResult_t ncclProxyGetPostedOps(struct ncclProxyState* proxyState, int* added) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
   if (state->opsPool == NULL) return ncclInternalError;
@@ -734,28 +950,28 @@ static ncclResult_t ncclProxyGetPostedOps(struct ncclProxyState* proxyState, int
   if (state->nextOps != -1) goto process_nextops;
 
   void* eHandle;
-  // If we have ops to progress, no need to block waiting for something to arrive or even wait for the lock
-  // to be available. Exit, continue progress, and come back later.
-  if (state->active != NULL && (pool->nextOps == -1 || pthread_mutex_trylock(&pool->mutex) != 0)) return ncclSuccess;
+  // If we have ops to progress, no need to block waiting for something to arrive.
+  // Exit, continue progress, and come back later. Doorbells of kernels cannot wake us up either,
+  // nor the other proxies of a shared progress thread.
+  if ((state->active != NULL || proxyState->replay || state->hub) && !proxyOpsPosted(pool, proxyState->tpLocalnRanks)) return ncclSuccess;
 
   if (state->active == NULL) {
     pthread_mutex_lock(&pool->mutex);
-    while (pool->nextOps == -1 && !state->stop) {
+    __atomic_store_n(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!proxyOpsPosted(pool, proxyState->tpLocalnRanks) && !state->stop) {
       ncclProfilerStartProxyCtrlEvent(proxyState->profilerContext, &eHandle);
       ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlSleep);
+      state->nIdleSleeps++;
       pthread_cond_wait(&pool->cond, &pool->mutex);
       ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlWakeup);
       ncclProfilerStopProxyCtrlEvent(eHandle);
     }
-    if (state->stop) { // We might have been woken up to stop.
-      pthread_mutex_unlock(&pool->mutex);
-      return ncclSuccess;
-    }
+    __atomic_store_n(&pool->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->mutex);
+    if (state->stop) return ncclSuccess; // We might have been woken up to stop.
   }
 
-  state->nextOps = pool->nextOps;
-  pool->nextOps = pool->nextOpsEnd = -1;
-  pthread_mutex_unlock(&pool->mutex);
+  state->nextOps = proxyOpsTake(pool, proxyState->tpLocalnRanks);
   if (state->nextOps == -1) return ncclInternalError;
 
 process_nextops:
@@ -778,7 +994,13 @@ process_nextops:
     lastPeer = peer;
     if (peerOp->connection == NULL) return ncclInternalError;
     if (peerOp->next != -1) __builtin_prefetch(pool->ops+peerOp->next);
-    NCCLCHECK(ProxyAppend(state, peerOp));
+    int shard = peerOp->connection->progressShard;
+    if (shard != 0) {
+      // Resume from this op once the shard thread made room
+      if (!proxyShardPush(state->shards+shard, peerOp)) break;
+    } else {
+      NCCLCHECK(ProxyAppend(state, peerOp));
+    }
     (*added)++;
     int lastOpIndex = opIndex;
     opIndex = peerOp->next;
@@ -863,10 +1085,91 @@ exit:
   return 0;
 }
 
+// Once ops made no progress for PROXY_IDLE_SPIN iterations, the progress thread waits
+// for 1us, 2us, ... up to PROXY_IDLE_BACKOFF_MAX_US between iterations, or until ops are
+// posted. 0 keeps yielding forever.
+NCCL_PARAM(ProxyIdleSpin, "PROXY_IDLE_SPIN", 1024);
+NCCL_PARAM(ProxyIdleBackoffMaxUs, "PROXY_IDLE_BACKOFF_MAX_US", 0);
+
+// Time to wait after idleIters iterations without progress, 0 to yield
+static int64_t proxyIdleBackoffUs(struct ncclProxyProgressState* state, int idleIters) {
+  int64_t maxUs = ncclParamProxyIdleBackoffMaxUs();
+  int64_t spin = ncclParamProxyIdleSpin();
+  if (maxUs <= 0 || idleIters <= spin) {
+    state->nIdleYields++;
+    return 0;
+  }
+  if (idleIters == spin+1) state->nIdleBackoffEntries++;
+  state->nIdleBackoffs++;
+  return std::min<int64_t>(1LL << std::min<int64_t>(idleIters-spin-1, 30), maxUs);
+}
+
+static void proxyIdleDeadline(int64_t us, struct timespec* ts) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
 // Set to SIGUSR1 or SIGUSR2 to help debug proxy state during hangs
 NCCL_PARAM(ProxyDumpSignal, "PROXY_DUMP_SIGNAL", -1);
 NCCL_PARAM(ProgressAppendOpFreq, "PROGRESS_APPENDOP_FREQ", 8);
 
+// One pass over the active ops, and a look at the posted ops when idle or every
+// PROGRESS_APPENDOP_FREQ passes. Returns whether it looked.
+static bool proxyProgressStep(struct ncclProxyState* proxyState, int nvtxProgress, int* idleRet, int* addedRet) {
+  struct ncclProxyProgressState* state = &proxyState->progressState;
+  int idle = 1;
+  *addedRet = 0;
+  ncclResult_t ret = nvtxProgress && state->active ? progressOpsNvtx(proxyState, state, state->active, &idle) :
+    progressOps(proxyState, state, state->active, &idle);
+  *idleRet = idle;
+  // One doorbell per IB QP for the sends of this pass, one flush per recv comm
+  if (ret == ncclSuccess) ret = ncclIbPostFlush();
+  if (ret != ncclSuccess) {
+    __atomic_store_n(&proxyState->asyncResult, ret, __ATOMIC_RELEASE);
+    ncclAsyncErrorWake();
+    INFO(NCCL_ALL,"%s:%d -> %d [Progress Thread]", __FILE__, __LINE__, ret);
+    return false;
+  }
+  void* eHandle;
+  ncclProfilerStartProxyCtrlEvent(proxyState->profilerContext, &eHandle);
+  if (state->lastIdle == 0 && idle == 1) ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlIdle);
+  if (state->lastIdle == 1 && idle == 0) ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlActive);
+  ncclProfilerStopProxyCtrlEvent(eHandle);
+  state->lastIdle = idle;
+  /* Too frequent call of ncclProxyGetPostedOps() will result in perf regression for small message
+   * communication. appendCounter is a counter that helps us decide if we need to append proxy ops.
+   * After each progress, appendCounter will increase by 1 and compare with environment variable
+   * ncclParamProgressAppendOpFreq(). If they are equal, we will append proxy ops. This will decrease the
+   * frequency of calling ncclProxyGetPostedOps() and reduce the perf impact. */
+  if (!idle && ++state->appendCounter != ncclParamProgressAppendOpFreq()) return false;
+  int added = 0;
+  state->appendCounter = 0;
+  TIME_START(3);
+  if (state->stop == 0 && proxyState->replay)
+    ret = proxyReplayPoll(proxyState, &added);
+  if (state->stop == 0 && ret == ncclSuccess)
+    ret = ncclProxyGetPostedOps(proxyState, &added);
+  if (added) { TIME_STOP(3); } else { TIME_CANCEL(3); }
+  if (ret != ncclSuccess) {
+    __atomic_store_n(&proxyState->asyncResult, ret, __ATOMIC_RELEASE);
+    ncclAsyncErrorWake();
+    INFO(NCCL_ALL,"%s:%d -> %d [Progress Thread]", __FILE__, __LINE__, ret);
+  }
+  *addedRet = added;
+  return true;
+}
+
+static bool proxyProgressStopped(struct ncclProxyProgressState* state) {
+  return !(state->stop == 0 || (state->stop == 1 && state->active));
+}
+
+static void proxyProgressFollowNic(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, int shardIndex);
+
 void* ncclProxyProgress(void *proxyState_) {
   struct ncclProxyState* proxyState = (struct ncclProxyState*)proxyState_;
   if (setProxyThreadContext(proxyState)) {
@@ -879,7 +1182,6 @@ void* ncclProxyProgress(void *proxyState_) {
   INFO(NCCL_INIT, "[Proxy Progress] Device %d CPU core %d", proxyState->cudaDev, sched_getcpu());
 
   struct ncclProxyProgressState* state = &proxyState->progressState;
-  state->nextOps = -1;
   const int sig = ncclParamProxyDumpSignal();
   if (sig != -1) signal(sig, ncclDumpProxyState);
   ncclLastProxyState = state;
@@ -887,54 +1189,325 @@ void* ncclProxyProgress(void *proxyState_) {
   snprintf(threadName, NCCL_THREAD_NAMELEN, "NCCL Progress%2d", proxyState->cudaDev);
   nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
 
-  int lastIdle = 0;
-  /* Too frequent call of ncclProxyGetPostedOps() will result in perf regression for small message
-   * communication. proxyOpAppendCounter is a counter that helps us decide if we need to append proxy ops.
-   * After each progress, proxyOpAppendCounter will increase by 1 and compare with environment variable
-   * ncclParamProgressAppendOpFreq(). If they are equal, we will append proxy ops. This will decrease the
-   * frequency of calling ncclProxyGetPostedOps() and reduce the perf impact. */
-  int proxyOpAppendCounter = 0;
-  while (state->stop == 0 || (state->stop == 1 && state->active)) {
+  const int nvtxProgress = ncclParamProxyNvtx();
+  state->boundNuma = -1;
+  while (!proxyProgressStopped(state)) {
+    int idle, added;
+    proxyProgressFollowNic(proxyState, state, 0);
+    if (proxyProgressStep(proxyState, nvtxProgress, &idle, &added)) {
+      if (added) state->idleIters = 0;
+      if (added == 0 && idle) {
+        // No request progressed. Let others run, or wait for the network or a post
+        int64_t us = proxyIdleBackoffUs(state, ++state->idleIters);
+        if (us == 0 || proxyState->replay) {
+          sched_yield();
+        } else {
+          struct ncclProxyOpsPool* pool = state->opsPool;
+          struct timespec ts;
+          proxyIdleDeadline(us, &ts);
+          pthread_mutex_lock(&pool->mutex);
+          __atomic_store_n(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+          if (!proxyOpsPosted(pool, proxyState->tpLocalnRanks) && state->stop == 0) pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts);
+          __atomic_store_n(&pool->sleeping, 0, __ATOMIC_RELAXED);
+          pthread_mutex_unlock(&pool->mutex);
+        }
+      } else if (added == 0) {
+        sched_yield();
+      }
+    }
+    if (!idle) state->idleIters = 0;
+  }
+  return NULL;
+}
+
+// One progress thread per device for all the proxies of the process on it
+NCCL_PARAM(ProxySharedProgress, "PROXY_SHARED_PROGRESS", 0);
+
+// Proxies are progressed in turn, one pass each. The thread cannot sleep on the ops pools of
+// several proxies, so when none of them moved it yields or waits for the backoff time.
+struct ncclProxyProgressHub {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int cudaDev;
+  int idleIters;
+  struct ncclProxyState* states;
+};
+
+static pthread_mutex_t proxyHubsLock = PTHREAD_MUTEX_INITIALIZER;
+#define NCCL_PROXY_MAX_HUBS 64
+static struct ncclProxyProgressHub* proxyHubs[NCCL_PROXY_MAX_HUBS];
+
+static void* ncclProxyProgressHubMain(void* hub_) {
+  struct ncclProxyProgressHub* hub = (struct ncclProxyProgressHub*)hub_;
+  if (cudaSetDevice(hub->cudaDev) != cudaSuccess) {
+    WARN("[Proxy Progress] Failed to set CUDA device %d", hub->cudaDev);
+  }
+  INFO(NCCL_INIT, "[Proxy Progress] Device %d shared by its comms, CPU core %d", hub->cudaDev, sched_getcpu());
+  char threadName[NCCL_THREAD_NAMELEN];
+  snprintf(threadName, NCCL_THREAD_NAMELEN, "NCCL Progress%2d", hub->cudaDev);
+  nvtxNameOsThreadA(syscall(SYS_gettid), threadName);
+  const int nvtxProgress = ncclParamProxyNvtx();
+
+  pthread_mutex_lock(&hub->mutex);
+  while (true) {
+    while (hub->states == NULL) pthread_cond_wait(&hub->cond, &hub->mutex);
+    bool idle = true;
+    struct ncclProxyState** next = &hub->states;
+    while (*next) {
+      struct ncclProxyState* proxyState = *next;
+      struct ncclProxyProgressState* state = &proxyState->progressState;
+      if (proxyProgressStopped(state)) {
+        *next = state->hubNext;
+        state->hubDone = 1;
+        pthread_cond_broadcast(&hub->cond);
+        continue;
+      }
+      int stepIdle, added;
+      proxyProgressStep(proxyState, nvtxProgress, &stepIdle, &added);
+      if (!stepIdle || added) idle = false;
+      next = &state->hubNext;
+    }
+    if (!idle || hub->states == NULL) {
+      hub->idleIters = 0;
+      continue;
+    }
+    int64_t us = proxyIdleBackoffUs(&hub->states->progressState, ++hub->idleIters);
+    pthread_mutex_unlock(&hub->mutex);
+    if (us == 0) sched_yield(); else usleep(us);
+    pthread_mutex_lock(&hub->mutex);
+  }
+  pthread_mutex_unlock(&hub->mutex);
+  return NULL;
+}
+
+static ncclResult_t proxyProgressHubJoin(struct ncclProxyState* proxyState) {
+  struct ncclProxyProgressHub* hub;
+  int dev = proxyState->cudaDev;
+  if (dev < 0 || dev >= NCCL_PROXY_MAX_HUBS) return ncclInvalidUsage;
+  pthread_mutex_lock(&proxyHubsLock);
+  hub = proxyHubs[dev];
+  if (hub == NULL) {
+    if (ncclCalloc(&hub, 1) != ncclSuccess) goto fail;
+    hub->cudaDev = dev;
+    pthread_mutex_init(&hub->mutex, NULL);
+    pthread_cond_init(&hub->cond, NULL);
+    if (pthread_create(&hub->thread, NULL, ncclProxyProgressHubMain, hub) != 0) {
+      WARN("Could not start the shared proxy progress thread of device %d", dev);
+      free(hub);
+      goto fail;
+    }
+    ncclSetThreadName(hub->thread, "NCCL Progress%2d", dev);
+    proxyHubs[dev] = hub;
+  }
+  pthread_mutex_unlock(&proxyHubsLock);
+
+  pthread_mutex_lock(&hub->mutex);
+  proxyState->progressState.hub = hub;
+  proxyState->progressState.hubNext = hub->states;
+  hub->states = proxyState;
+  pthread_cond_broadcast(&hub->cond);
+  pthread_mutex_unlock(&hub->mutex);
+  return ncclSuccess;
+fail:
+  pthread_mutex_unlock(&proxyHubsLock);
+  return ncclSystemError;
+}
+
+// Threads progressing net connections besides the progress thread, one per NIC at most
+NCCL_PARAM(ProxyProgressThreads, "PROXY_PROGRESS_THREADS", 1);
+
+int ncclProxyProgressShardForNet(struct ncclProxyState* proxyState, int netDev) {
+  int nShards = proxyState->progressState.nShards;
+  return nShards > 1 ? netDev % nShards : 0;
+}
+
+void ncclProxyNetConnAdd(struct ncclProxyState* proxyState, int netDev) {
+  if (netDev < 0 || netDev >= NCCL_MAX_NETDEVS) return;
+  __atomic_add_fetch(proxyState->netConns+netDev, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&proxyState->netConnsSeq, 1, __ATOMIC_RELEASE);
+}
+
+static int proxyNetNumaNode(struct ncclProxyState* proxyState, int netDev) {
+  int numaNode = -1;
+  ncclNetProperties_t props;
+  if (proxyState->ncclNet->getProperties(netDev, &props) == ncclSuccess && props.pciPath) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/numa_node", props.pciPath);
+    FILE* file = fopen(path, "r");
+    if (file) {
+      if (fscanf(file, "%d", &numaNode) != 1) numaNode = -1;
+      fclose(file);
+    }
+  }
+  return numaNode;
+}
+
+// Bind the calling thread to the CPUs of a NUMA node
+static void proxyBindNuma(int numaNode) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/sys/devices/system/node/node%d/cpulist", numaNode);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return;
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  int beg, end;
+  while (fscanf(file, "%d", &beg) == 1) {
+    end = beg;
+    int c = fgetc(file);
+    if (c == '-') {
+      if (fscanf(file, "%d", &end) != 1) break;
+      c = fgetc(file);
+    }
+    for (int cpu = beg; cpu <= end && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &mask);
+    if (c != ',') break;
+  }
+  fclose(file);
+  if (CPU_COUNT(&mask) && sched_setaffinity(0, sizeof(cpu_set_t), &mask) != 0) {
+    INFO(NCCL_INIT, "[Proxy Progress] Could not bind to NUMA node %d", numaNode);
+  }
+}
+
+// Bind progress threads next to the NIC with the most connections among those they progress,
+// instead of the GPU their proxy was created for. With PXN that NIC may be on another socket.
+NCCL_PARAM(ProxyNicAffinity, "PROXY_NIC_AFFINITY", 1);
+
+static void proxyProgressFollowNic(struct ncclProxyState* proxyState, struct ncclProxyProgressState* state, int shardIndex) {
+  int seq = __atomic_load_n(&proxyState->netConnsSeq, __ATOMIC_ACQUIRE);
+  if (seq == state->netConnsSeen) return;
+  state->netConnsSeen = seq;
+  if (ncclParamProxyNicAffinity() == 0 || proxyState->ncclNet == NULL) return;
+  int netDev = -1, nConns = 0;
+  for (int d = 0; d < NCCL_MAX_NETDEVS; d++) {
+    if (ncclProxyProgressShardForNet(proxyState, d) != shardIndex) continue;
+    int n = __atomic_load_n(proxyState->netConns+d, __ATOMIC_RELAXED);
+    if (n > nConns) { netDev = d; nConns = n; }
+  }
+  if (netDev == -1) return;
+  int numaNode = proxyNetNumaNode(proxyState, netDev);
+  if (numaNode < 0 || numaNode == state->boundNuma) return;
+  proxyBindNuma(numaNode);
+  state->boundNuma = numaNode;
+  INFO(NCCL_INIT, "[Proxy Progress] Device %d thread %d follows NIC %d (%d connections) to NUMA node %d CPU core %d",
+      proxyState->cudaDev, shardIndex, netDev, nConns, numaNode, sched_getcpu());
+}
+
+static void* ncclProxyProgressShardMain(void* shard_) {
+  struct ncclProxyProgressShard* shard = (struct ncclProxyProgressShard*)shard_;
+  struct ncclProxyState* proxyState = shard->proxyState;
+  struct ncclProxyProgressState* state = &shard->state;
+  if (setProxyThreadContext(proxyState) == 0 && cudaSetDevice(proxyState->cudaDev) != cudaSuccess) {
+    WARN("[Proxy Progress] Failed to set CUDA device %d", proxyState->cudaDev);
+  }
+  if (shard->numaNode >= 0) proxyBindNuma(shard->numaNode);
+  state->boundNuma = shard->numaNode;
+  INFO(NCCL_INIT, "[Proxy Progress] Device %d thread %d NUMA node %d CPU core %d", proxyState->cudaDev, shard->index, shard->numaNode, sched_getcpu());
+
+  while (state->stop == 0 || state->active || __atomic_load_n(&shard->tail, __ATOMIC_ACQUIRE) != shard->head) {
     int idle = 1;
-    ncclResult_t ret = progressOps(proxyState, state, state->active, &idle);
+    ncclResult_t ret = ncclSuccess;
+    proxyProgressFollowNic(proxyState, state, shard->index);
+    if (state->active) ret = progressOps(proxyState, state, state->active, &idle);
+    if (ret == ncclSuccess) ret = ncclIbPostFlush();
+    uint64_t head = shard->head;
+    uint64_t tail = __atomic_load_n(&shard->tail, __ATOMIC_ACQUIRE);
+    for (; ret == ncclSuccess && head != tail; head++) {
+      ret = ProxyAppend(state, shard->ring + head % NCCL_PROXY_SHARD_RING);
+      idle = 0;
+    }
+    __atomic_store_n(&shard->head, head, __ATOMIC_RELEASE);
     if (ret != ncclSuccess) {
       __atomic_store_n(&proxyState->asyncResult, ret, __ATOMIC_RELEASE);
-      INFO(NCCL_ALL,"%s:%d -> %d [Progress Thread]", __FILE__, __LINE__, ret);
-      continue;
+      ncclAsyncErrorWake();
+      INFO(NCCL_ALL,"%s:%d -> %d [Progress Thread %d]", __FILE__, __LINE__, ret, shard->index);
     }
-    void* eHandle;
-    ncclProfilerStartProxyCtrlEvent(proxyState->profilerContext, &eHandle);
-    if (lastIdle == 0 && idle == 1) ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlIdle);
-    if (lastIdle == 1 && idle == 0) ncclProfilerRecordProxyCtrlEventState(eHandle, 0, ncclProfilerProxyCtrlActive);
-    ncclProfilerStopProxyCtrlEvent(eHandle);
-    if (idle || (++proxyOpAppendCounter == ncclParamProgressAppendOpFreq())) {
-      int added = 0;
-      proxyOpAppendCounter = 0;
-      TIME_START(3);
-      if (state->stop == 0)
-        ret = ncclProxyGetPostedOps(proxyState, &added);
-      if (added) { TIME_STOP(3); } else { TIME_CANCEL(3); }
-      if (ret != ncclSuccess) {
-        __atomic_store_n(&proxyState->asyncResult, ret, __ATOMIC_RELEASE);
-        INFO(NCCL_ALL,"%s:%d -> %d [Progress Thread]", __FILE__, __LINE__, ret);
-      }
-      if (added == 0) {
-        sched_yield(); // No request progressed. Let others run.
+    if (state->active == NULL) {
+      pthread_mutex_lock(&shard->mutex);
+      state->nIdleSleeps++;
+      __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&shard->tail, __ATOMIC_SEQ_CST) == shard->head && state->stop == 0) pthread_cond_wait(&shard->cond, &shard->mutex);
+      __atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&shard->mutex);
+    } else if (idle) {
+      int64_t us = proxyIdleBackoffUs(state, ++shard->idleIters);
+      if (us == 0) {
+        sched_yield();
+      } else {
+        struct timespec ts;
+        proxyIdleDeadline(us, &ts);
+        pthread_mutex_lock(&shard->mutex);
+        __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shard->tail, __ATOMIC_SEQ_CST) == shard->head && state->stop == 0) pthread_cond_timedwait(&shard->cond, &shard->mutex, &ts);
+        __atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->mutex);
       }
     }
-    lastIdle = idle;
+    if (!idle) shard->idleIters = 0;
   }
   return NULL;
 }
 
+// Net connections of NIC d are progressed by thread d%nShards, the threads other than the
+// progress thread start on the NUMA node of their first NIC, see proxyProgressFollowNic().
+static ncclResult_t ncclProxyProgressShardsCreate(struct ncclProxyState* proxyState) {
+  struct ncclProxyProgressState* state = &proxyState->progressState;
+  int nShards = std::min<int>(ncclParamProxyProgressThreads(), NCCL_PROXY_MAX_PROGRESS_THREADS);
+  int nNetDevs = 0;
+  if (nShards > 1 && proxyState->ncclNet) NCCLCHECK(proxyState->ncclNet->devices(&nNetDevs));
+  nShards = std::min(nShards, nNetDevs);
+  state->nShards = 1;
+  if (nShards <= 1) return ncclSuccess;
+
+  NCCLCHECK(ncclCalloc(&state->shards, nShards));
+  for (int s = 1; s < nShards; s++) {
+    struct ncclProxyProgressShard* shard = state->shards+s;
+    shard->proxyState = proxyState;
+    shard->index = s;
+    shard->numaNode = proxyNetNumaNode(proxyState, s);
+    pthread_mutex_init(&shard->mutex, NULL);
+    pthread_cond_init(&shard->cond, NULL);
+    PTHREADCHECK(pthread_create(&shard->state.thread, NULL, ncclProxyProgressShardMain, shard), "pthread_create");
+    ncclSetThreadName(shard->state.thread, "NCCL Prog%2d-%d", proxyState->cudaDev, s);
+  }
+  state->nShards = nShards;
+  INFO(NCCL_INIT, "Proxy progress of device %d uses %d threads", proxyState->cudaDev, nShards);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclProxyProgressShardsDestroy(struct ncclProxyState* proxyState) {
+  struct ncclProxyProgressState* state = &proxyState->progressState;
+  for (int s = 1; s < state->nShards; s++) {
+    struct ncclProxyProgressShard* shard = state->shards+s;
+    pthread_mutex_lock(&shard->mutex);
+    shard->state.stop = 1;
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->mutex);
+    PTHREADCHECK(pthread_join(shard->state.thread, NULL), "pthread_join");
+    INFO(NCCL_PROXY, "Proxy progress thread %d of device %d idled with %lu yields, %lu backoff waits over %lu backoffs, %lu sleeps",
+        s, proxyState->cudaDev, shard->state.nIdleYields, shard->state.nIdleBackoffs, shard->state.nIdleBackoffEntries, shard->state.nIdleSleeps);
+    while (shard->state.pools != NULL) {
+      struct ncclProxyPool *next = shard->state.pools->next;
+      free(shard->state.pools);
+      shard->state.pools = next;
+    }
+    pthread_mutex_destroy(&shard->mutex);
+    pthread_cond_destroy(&shard->cond);
+  }
+  free(state->shards);
+  state->shards = NULL;
+  state->nShards = 1;
+  return ncclSuccess;
+}
+
 ncclResult_t ncclProxyStart(struct ncclComm* comm) {
   struct ncclProxyOps* proxyOps = comm->proxyState->proxyOps;
   if (proxyOps == NULL) return ncclSuccess;
   TIME_START(1);
+  int tpLocalRank = comm->topParentLocalRanks[comm->localRank];
   for (int r = 0; r < comm->sharedRes->tpNLocalRanks; r++) {
     struct ncclProxyOps* ops = proxyOps + r;
     if (ops->pool == NULL || ops->nextOps == -1) continue;
-    NCCLCHECK(ncclProxyPost(ops->pool, ops->nextOps, ops->nextOpsEnd));
+    NCCLCHECK(ncclProxyPost(ops->pool, tpLocalRank, ops->nextOps, ops->nextOpsEnd));
     ops->nextOps = ops->nextOpsEnd = -1;
     ops->count = 0;
   }
@@ -945,7 +1518,11 @@ ncclResult_t ncclProxyStart(struct ncclComm* comm) {
 
 static ncclResult_t ncclProxyProgressCreate(struct ncclProxyState* proxyState) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
-  if (!state->thread) {
+  state->nextOps = -1;
+  if (!state->thread && !state->hub) {
+    NCCLCHECK(ncclProxyProgressShardsCreate(proxyState));
+    // Threads with their own CUDA context cannot be shared
+    if (ncclParamProxySharedProgress() && !ncclParamCreateThreadContext() && proxyProgressHubJoin(proxyState) == ncclSuccess) return ncclSuccess;
     PTHREADCHECK(pthread_create(&state->thread, NULL, ncclProxyProgress, proxyState), "pthread_create");
     ncclSetThreadName(state->thread, "NCCL Progress%2d", proxyState->tpLocalnRanks);
   }
@@ -956,13 +1533,24 @@ ncclResult_t ncclProxyProgressDestroy(struct ncclProxyState* proxyState) {
   struct ncclProxyProgressState* state = &proxyState->progressState;
 
   // Request the proxy to stop and then wake it
-  if (state->opsPool) {
+  if (state->hub) {
+    struct ncclProxyProgressHub* hub = state->hub;
+    pthread_mutex_lock(&hub->mutex);
+    state->stop = 1;
+    while (!state->hubDone) pthread_cond_wait(&hub->cond, &hub->mutex);
+    pthread_mutex_unlock(&hub->mutex);
+    state->hub = NULL;
+  } else if (state->opsPool) {
     pthread_mutex_lock(&state->opsPool->mutex);
     state->stop = 1;
     pthread_cond_signal(&state->opsPool->cond);
     pthread_mutex_unlock(&state->opsPool->mutex);
     PTHREADCHECK(pthread_join(state->thread, NULL), "pthread_join");
   }
+  INFO(NCCL_PROXY, "Proxy progress of device %d idled with %lu yields, %lu backoff waits over %lu backoffs, %lu sleeps",
+      proxyState->cudaDev, state->nIdleYields, state->nIdleBackoffs, state->nIdleBackoffEntries, state->nIdleSleeps);
+  // The progress thread handed its last ops, the other threads can finish them and stop
+  NCCLCHECK(ncclProxyProgressShardsDestroy(proxyState));
 
   // Free off any memory allocated for the proxy arg pools
   while (state->pools != NULL) {
@@ -1105,7 +1693,7 @@ ncclResult_t ncclProxyConnect(struct ncclComm* comm, int transport, int send, in
 }
 
 // UDS support
-ncclResult_t ncclProxyCallBlockingUDS(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, void* respBuff, int respSize, int* reqFd, int *respFd) {
+ncclResult_t ncclProxyCallBlockingUDS(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int type, void* reqBuff, int reqSize, void* respBuff, int respSize, int* reqFd, int *respFd, int nRespFds) {
   ncclResult_t res = ncclSuccess;
   struct ncclIpcSocket ipcSock = { 0 };
   void *opId;
@@ -1139,7 +1727,7 @@ ncclResult_t ncclProxyCallBlockingUDS(struct ncclComm* comm, struct ncclProxyCon
   assert(reqSize <= sizeof(hdr.data));
   memcpy(&hdr.data, reqBuff, reqSize);
   NCCLCHECKGOTO(ncclIpcSocketSendMsg(&ipcSock, &hdr, sizeof(hdr), reqFdtmp, proxyConn->tpRank, pidHash), res, error);
-  NCCLCHECKGOTO(ncclIpcSocketRecvMsg(&ipcSock, respBuff, respSize, respFd), res, error);
+  NCCLCHECKGOTO(ncclIpcSocketRecvMsgFds(&ipcSock, respBuff, respSize, respFd, respFd ? nRespFds : 0), res, error);
   NCCLCHECKGOTO(ncclIpcSocketClose(&ipcSock), res, error);
 
   INFO(NCCL_PROXY, "ProxyCall UDS comm %p rank %d tpRank %d(%lx) reqSize %d respSize %d respFd %d opId %p - DONE",
@@ -1162,7 +1750,7 @@ ncclResult_t ncclProxyClientGetFdBlocking(struct ncclComm* comm, int proxyRank,
   if (comm->gproxyConn[proxyRank].initialized == false) {
     NCCLCHECKGOTO(ncclProxyConnect(comm, TRANSPORT_P2P, 1, proxyRank, &comm->gproxyConn[proxyRank]), ret, error);
   }
-  NCCLCHECKGOTO(ncclProxyCallBlockingUDS(comm, &comm->gproxyConn[proxyRank], ncclProxyMsgGetFd, handle, sizeof(CUmemGenericAllocationHandle), NULL, 0, NULL, convertedFd), ret, error);
+  NCCLCHECKGOTO(ncclProxyCallBlockingUDS(comm, &comm->gproxyConn[proxyRank], ncclProxyMsgGetFd, handle, sizeof(CUmemGenericAllocationHandle), NULL, 0, NULL, convertedFd, 1), ret, error);
 
   // We have now received the converted fd over UDS
   INFO(NCCL_PROXY, "UDS: ClientGetFd handle 0x%lx tpRank %d returned fd %d sameProcess %d", *(uint64_t*)handle, comm->topParentRanks[proxyRank], *convertedFd, comm->gproxyConn[proxyRank].sameProcess);
@@ -1174,9 +1762,28 @@ error:
   return ret;
 }
 
+ncclResult_t ncclProxyClientGetFdsBlocking(struct ncclComm* comm, int proxyRank, int nHandles, uint64_t* handles, int* convertedFds) {
+  ncclResult_t ret = ncclSuccess;
+  static_assert(NCCL_IPC_MAX_FDS * sizeof(uint64_t) <= sizeof(((struct ncclIpcHdr*)0)->data), "UDS header too small for a batch of handles");
+
+  if (comm->gproxyConn[proxyRank].initialized == false) {
+    NCCLCHECKGOTO(ncclProxyConnect(comm, TRANSPORT_P2P, 1, proxyRank, &comm->gproxyConn[proxyRank]), ret, error);
+  }
+  for (int h = 0; h < nHandles; h += NCCL_IPC_MAX_FDS) {
+    int n = std::min(nHandles - h, NCCL_IPC_MAX_FDS);
+    NCCLCHECKGOTO(ncclProxyCallBlockingUDS(comm, &comm->gproxyConn[proxyRank], ncclProxyMsgGetFds, handles + h, n * sizeof(uint64_t), NULL, 0, NULL, convertedFds + h, n), ret, error);
+  }
+  INFO(NCCL_PROXY, "UDS: ClientGetFds %d handles tpRank %d in %d calls", nHandles, comm->topParentRanks[proxyRank], DIVUP(nHandles, NCCL_IPC_MAX_FDS));
+  return ret;
+
+error:
+  WARN("ncclProxyClientGetFds call to tpRank %d for %d handles failed : %d", comm->topParentRanks[proxyRank], nHandles, ret);
+  return ret;
+}
+
 ncclResult_t ncclProxyClientQueryFdBlocking(struct ncclComm* comm, struct ncclProxyConnector* proxyConn, int localFd, int* rmtFd) {
   ncclResult_t ret = ncclSuccess;
-  NCCLCHECKGOTO(ncclProxyCallBlockingUDS(comm, proxyConn, ncclProxyMsgQueryFd, NULL, 0, (void*)rmtFd, sizeof(int), &localFd, NULL), ret, fail);
+  NCCLCHECKGOTO(ncclProxyCallBlockingUDS(comm, proxyConn, ncclProxyMsgQueryFd, NULL, 0, (void*)rmtFd, sizeof(int), &localFd, NULL, 0), ret, fail);
 exit:
   // We have now received the converted fd over UDS
   INFO(NCCL_PROXY, "UDS: ClientQueryFd localFd %d tpRank %d remote fd %d sameProcess %d", localFd, proxyConn->tpRank, *rmtFd, proxyConn->sameProcess);
@@ -1300,9 +1907,10 @@ static ncclResult_t proxyProgressInit(struct ncclProxyState* proxyState) {
     shmPath[0] = '\0';
     NCCLCHECK(ncclShmOpen(shmPath, size, (void**)&pool, NULL, proxyState->tpLocalnRanks, &state->handle));
     // Init pool
-    pool->nextOps = -1;
+    pool->sleeping = 0;
 
     for (int r = 0; r < proxyState->tpLocalnRanks; r++) {
+      pool->posted[r].head = pool->posted[r].tail = 0;
       pool->freeOps[r] = r*MAX_OPS_PER_PEER;
       for (int i=0; i<MAX_OPS_PER_PEER-1; i++) pool->ops[r*MAX_OPS_PER_PEER+i].next = r*MAX_OPS_PER_PEER+i+1;
       pool->ops[(r+1)*MAX_OPS_PER_PEER-1].next = -1;
@@ -1412,6 +2020,31 @@ error:
 #endif
 }
 
+// Export a batch of handles and send all their fds back in one message
+static ncclResult_t proxyGetFds(struct ncclProxyState* proxyState, int rank, void *opId, uint64_t* handles, int nHandles) {
+#if CUDART_VERSION >= 11030
+  ncclResult_t ret = ncclSuccess;
+  struct ncclIpcSocket ipcSock = { 0 };
+  uint64_t hash = (uint64_t) opId;
+  int fds[NCCL_IPC_MAX_FDS];
+  int nFds = 0;
+  INFO(NCCL_PROXY, "UDS proxyGetFds received %d handles peer %d opId %lx", nHandles, rank, hash);
+
+  for (; nFds < nHandles; nFds++) {
+    CUCHECKGOTO(cuMemExportToShareableHandle(&fds[nFds], handles[nFds], CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR, 0), ret, exit);
+  }
+  NCCLCHECKGOTO(ncclIpcSocketInit(&ipcSock, proxyState->tpRank, hash^1, proxyState->abortFlag), ret, exit);
+  ret = ncclIpcSocketSendMsgFds(&ipcSock, NULL, 0, fds, nFds, rank, hash);
+  (void)ncclIpcSocketClose(&ipcSock);
+exit:
+  // The exported fds were duplicated into the peer
+  for (int f = 0; f < nFds; f++) close(fds[f]);
+  return ret;
+#else
+  return ncclInternalError;
+#endif
+}
+
 static ncclResult_t proxyProgressAsync(struct ncclProxyAsyncOp* op, struct ncclProxyState* proxyState, int* asyncOpCount, struct ncclProxyLocalPeer* peer, struct ncclProxyConnectionPool* connectionPool) {
   int done = 1;
   ncclResult_t res = ncclInternalError;
@@ -1701,6 +2334,11 @@ static ncclResult_t proxyUDSRecvReq(struct ncclProxyState* proxyState, int reqFd
     uint64_t handle = *(uint64_t*)hdr.data;
     INFO(NCCL_PROXY, "proxyUDSRecvReq::ncclProxyMsgGetFd rank %d opId %p handle=0x%lx", hdr.rank, hdr.opId, handle);
     return proxyGetFd(proxyState, hdr.rank, hdr.opId, handle);
+  } else if (hdr.type == ncclProxyMsgGetFds) {
+    int nHandles = hdr.reqSize / sizeof(uint64_t);
+    INFO(NCCL_PROXY, "proxyUDSRecvReq::ncclProxyMsgGetFds rank %d opId %p nHandles %d", hdr.rank, hdr.opId, nHandles);
+    if (nHandles < 1 || nHandles > NCCL_IPC_MAX_FDS) return ncclInternalError;
+    return proxyGetFds(proxyState, hdr.rank, hdr.opId, hdr.data, nHandles);
   } else if (hdr.type == ncclProxyMsgQueryFd) {
     INFO(NCCL_PROXY, "proxyUDSRecvReq::proxyQueryFd rank %d opId %p rmtFd %d", hdr.rank, hdr.opId, rmtFd);
     return proxyQueryFd(proxyState, hdr.rank, hdr.opId, rmtFd);
@@ -1856,6 +2494,7 @@ ncclResult_t ncclProxyDestroy(struct ncclComm* comm) {
     free(sharedProxyState->peerSocks);
     free(sharedProxyState->proxyOps);
     free(sharedProxyState->sharedDevMems);
+    if (sharedProxyState->replay) NCCLCHECK(proxyReplayDestroy(sharedProxyState->replay));
     expectedProxyResponseFree(sharedProxyState);
     free(sharedProxyState);
   }
@@ -11,6 +11,8 @@
 #include "register.h"
 #include "transport.h"
 
+#include <algorithm>
+
 ncclResult_t ncclNetDeregister(struct ncclComm* comm, struct ncclReg* reg) {
   struct ncclRegCache* cache = &comm->regCache;
   ncclDebugNoWarn = NCCL_NET;
@@ -31,6 +33,7 @@ ncclResult_t ncclNetRegister(struct ncclComm* comm, void* addr, size_t size, str
   if (netCount == 0) return ncclSuccess;
 
   ncclResult_t ret = ncclSuccess;
+  int ptrType;
 
   // Find local devices for p2p operations
   for (int c=0; c<comm->p2pnChannels; c++) {
@@ -48,6 +51,8 @@ ncclResult_t ncclNetRegister(struct ncclComm* comm, void* addr, size_t size, str
   }
 
   NCCLCHECKGOTO(ncclCalloc(&reg->handles, reg->nDevs), ret, end);
+  // The NIC reaches pinned host memory without GPU Direct RDMA
+  ptrType = (reg->state & HOST_REG_MEMORY) ? NCCL_PTR_HOST : NCCL_PTR_CUDA;
 
   ncclDebugNoWarn = NCCL_NET;
   for (int d=0; d<reg->nDevs; d++) {
@@ -72,7 +77,7 @@ ncclResult_t ncclNetRegister(struct ncclComm* comm, void* addr, size_t size, str
       }
       NCCLCHECK(comm->ncclNet->closeListen(lComm));
     }
-    if (comm->ncclNet->regMr(cache->sComms[dev], addr, size, NCCL_PTR_CUDA, reg->handles+d) != ncclSuccess) {
+    if (comm->ncclNet->regMr(cache->sComms[dev], addr, size, ptrType, reg->handles+d) != ncclSuccess) {
       reg->handles[d] = NULL;
       NCCLCHECK(ncclNetDeregister(comm, reg));
       reg->nDevs = 0;
@@ -86,21 +91,36 @@ end:
   return ret;
 }
 
+static void regCacheFixMaxEnd(struct ncclRegCache* cache, int from) {
+  for (int i=from; i<cache->population; i++) {
+    uintptr_t end = cache->slots[i]->addr + cache->slots[i]->pages*cache->pageSize;
+    cache->slots[i]->maxEnd = i == 0 ? end : std::max(end, cache->slots[i-1]->maxEnd);
+  }
+}
+
+// Slots are sorted by addr: find the first one past addr, then walk down the ones that can still
+// cover [addr, end). *slot is where a new registration of addr goes.
+static struct ncclReg* regCacheFind(struct ncclRegCache* cache, uintptr_t addr, uintptr_t end, int* slot) {
+  int lo = 0, hi = cache->population;
+  while (lo < hi) {
+    int mid = (lo+hi)/2;
+    if (cache->slots[mid]->addr <= addr) lo = mid+1; else hi = mid;
+  }
+  *slot = lo;
+  for (int i=lo-1; i>=0 && cache->slots[i]->maxEnd >= end; i--) {
+    if (cache->slots[i]->addr + cache->slots[i]->pages*cache->pageSize >= end) return cache->slots[i];
+  }
+  return NULL;
+}
+
 ncclResult_t ncclRegFind(struct ncclComm* comm, const void* data, size_t size, struct ncclReg** reg) {
   struct ncclRegCache* cache = &comm->regCache;
   uintptr_t pageSize = cache->pageSize;
   uintptr_t addr = (uintptr_t)data & -pageSize;
   size_t pages = ((uintptr_t)data + size - addr + pageSize-1)/pageSize;
-
-  *reg = NULL;
-  for (int slot=0; /*true*/; slot++) {
-    if (slot == cache->population || addr < cache->slots[slot]->addr) return ncclSuccess;
-    if ((addr >= cache->slots[slot]->addr) &&
-        ((addr-cache->slots[slot]->addr)/pageSize+pages) <= cache->slots[slot]->pages) {
-      *reg = cache->slots[slot];
-      return ncclSuccess;
-    }
-  }
+  int slot;
+  *reg = regCacheFind(cache, addr, addr+pages*pageSize, &slot);
+  return ncclSuccess;
 }
 NCCL_PARAM(LocalRegister, "LOCAL_REGISTER", 1);
 
@@ -114,30 +134,39 @@ ncclResult_t ncclRegister(struct ncclComm* comm, void* data, size_t size, void**
   uintptr_t pageSize = cache->pageSize;
   uintptr_t addr = (uintptr_t)data & -pageSize;
   size_t pages = ((uintptr_t)data + size - addr + pageSize-1)/pageSize;
-  for (int slot=0; /*true*/; slot++) {
-    if ((slot == cache->population) || (addr < cache->slots[slot]->addr)) {
-      if (cache->population == cache->capacity) { // must grow cache
-        cache->capacity = cache->capacity < 32 ? 32 : 2*cache->capacity;
-        NCCLCHECK(ncclRealloc(&cache->slots, cache->population, cache->capacity));
-      }
-      memmove(cache->slots+slot+1, cache->slots+slot, (cache->population-slot)*sizeof(struct ncclReg*));
-      NCCLCHECK(ncclCalloc(cache->slots+slot, 1));
-      struct ncclReg* regSlot = cache->slots[slot];
-      regSlot->addr = addr;
-      regSlot->pages = pages;
-      regSlot->refs = 1;
-      NCCLCHECK(ncclNetRegister(comm, (void*)addr, pages*pageSize, regSlot));
-      regSlot->state |= NET_REG_COMPLETE;
-      cache->population += 1;
-      *handle = regSlot;
-      return ncclSuccess;
-    } else if ((addr >= cache->slots[slot]->addr) &&
-        ((addr-cache->slots[slot]->addr)/pageSize+pages) <= cache->slots[slot]->pages) {
-      cache->slots[slot]->refs++;
-      *handle = cache->slots[slot];
-      return ncclSuccess;
-    }
+  int slot;
+  struct ncclReg* found = regCacheFind(cache, addr, addr+pages*pageSize, &slot);
+  if (found) {
+    found->refs++;
+    *handle = found;
+    return ncclSuccess;
+  }
+  if (cache->population == cache->capacity) { // must grow cache
+    cache->capacity = cache->capacity < 32 ? 32 : 2*cache->capacity;
+    NCCLCHECK(ncclRealloc(&cache->slots, cache->population, cache->capacity));
   }
+  memmove(cache->slots+slot+1, cache->slots+slot, (cache->population-slot)*sizeof(struct ncclReg*));
+  NCCLCHECK(ncclCalloc(cache->slots+slot, 1));
+  struct ncclReg* regSlot = cache->slots[slot];
+  regSlot->addr = addr;
+  regSlot->pages = pages;
+  regSlot->refs = 1;
+  cudaPointerAttributes attr;
+  if (cudaPointerGetAttributes(&attr, data) != cudaSuccess) (void)cudaGetLastError();
+  else if (attr.type == cudaMemoryTypeHost) regSlot->state |= HOST_REG_MEMORY;
+  cache->population += 1;
+  regCacheFixMaxEnd(cache, slot);
+  ncclResult_t ret = ncclNetRegister(comm, (void*)addr, pages*pageSize, regSlot);
+  if (ret != ncclSuccess) {
+    free(regSlot);
+    memmove(cache->slots+slot, cache->slots+slot+1, (cache->population-slot-1)*sizeof(struct ncclReg*));
+    cache->population -= 1;
+    regCacheFixMaxEnd(cache, slot);
+    return ret;
+  }
+  regSlot->state |= NET_REG_COMPLETE;
+  *handle = regSlot;
+  return ncclSuccess;
 }
 
 ncclResult_t ncclRegCleanup(struct ncclComm* comm) {
@@ -198,6 +227,7 @@ ncclResult_t ncclCommDeregister(const ncclComm_t comm, void* handle) {
   free(reg);
   memmove(cache->slots+slot, cache->slots+slot+1, (cache->population-slot-1)*sizeof(struct ncclReg*));
   cache->population -= 1;
+  regCacheFixMaxEnd(cache, slot);
   CUDACHECK(cudaSetDevice(saveDev));
 exit:
   return ncclSuccess;
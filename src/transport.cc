@@ -10,6 +10,7 @@
 #define ENABLE_TIMER 0
 #include "timer.h"
 #include "transport.h"
+#include "channel.h"
 
 struct ncclTransport* ncclTransports[NTRANSPORTS] = {
   &p2pTransport,
@@ -47,12 +48,12 @@ ncclResult_t ncclTransportP2pConnect(struct ncclComm* comm, int channelId, int n
   uint64_t mask = 1UL << channel->id;
   for (int i=0; i<nrecv; i++) {
     int peer = peerRecv[i];
-    if (peer == -1 || peer >= comm->nRanks || peer == comm->rank || channel->peers[peer]->recv[connIndex].connected) continue;
+    if (peer == -1 || peer >= comm->nRanks || peer == comm->rank || (channel->peers[peer] && channel->peers[peer]->recv[connIndex].connected)) continue;
     comm->connectRecv[peer] |= mask;
   }
   for (int i=0; i<nsend; i++) {
     int peer = peerSend[i];
-    if (peer == -1 || peer >= comm->nRanks || peer == comm->rank || channel->peers[peer]->send[connIndex].connected) continue;
+    if (peer == -1 || peer >= comm->nRanks || peer == comm->rank || (channel->peers[peer] && channel->peers[peer]->send[connIndex].connected)) continue;
     comm->connectSend[peer] |= mask;
   }
   return ncclSuccess;
@@ -68,9 +69,44 @@ void dumpData(struct ncclConnect* data, int ndata) {
 }
 
 NCCL_PARAM(ConnectRoundMaxPeers, "CONNECT_ROUND_MAX_PEERS", 128);
+NCCL_PARAM(ConnectMaxInflight, "CONNECT_MAX_INFLIGHT", 256);
 NCCL_PARAM(ReportConnectProgress, "REPORT_CONNECT_PROGRESS", 0);
 #include <sys/time.h>
 
+ncclResult_t ncclTransportSetupAsync(struct ncclComm* comm, struct ncclConnector* connector, void* req, int reqSize, void* resp, int respSize) {
+  NCCLCHECK(ncclProxyCallAsync(comm, &connector->proxyConn, ncclProxyMsgSetup, req, reqSize, respSize, connector));
+  connector->setupPending = 1;
+  connector->setupResp = resp;
+  return ncclSuccess;
+}
+
+static ncclResult_t waitSetup(struct ncclComm* comm, struct ncclConnector* connector) {
+  ncclResult_t ret;
+  if (connector->setupPending == 0) return ncclSuccess;
+  do {
+    ret = ncclPollProxyResponse(comm, &connector->proxyConn, connector->setupResp, connector);
+  } while (ret == ncclInProgress);
+  connector->setupPending = 0;
+  return ret;
+}
+
+// Complete the setups left in flight with a pair of peers, then send them our connect information
+static ncclResult_t sendSetupData(struct ncclComm* comm, int connIndex, int tag, int recvPeer, int sendPeer,
+    struct ncclConnect* recvData, int recvChannels, struct ncclConnect* sendData, int sendChannels) {
+  for (int c=0; c<MAXCHANNELS; c++) {
+    if (comm->connectRecv[recvPeer] & (1UL<<c)) NCCLCHECK(waitSetup(comm, comm->channels[c].peers[recvPeer]->recv + connIndex));
+    if (comm->connectSend[sendPeer] & (1UL<<c)) NCCLCHECK(waitSetup(comm, comm->channels[c].peers[sendPeer]->send + connIndex));
+  }
+  if (sendPeer == recvPeer) {
+    // Recv data comes first in the same array
+    if (recvChannels+sendChannels) NCCLCHECK(bootstrapSend(comm->bootstrap, recvPeer, tag, recvData, sizeof(struct ncclConnect)*(recvChannels+sendChannels)));
+  } else {
+    if (recvChannels) NCCLCHECK(bootstrapSend(comm->bootstrap, recvPeer, tag, recvData, sizeof(struct ncclConnect)*recvChannels));
+    if (sendChannels) NCCLCHECK(bootstrapSend(comm->bootstrap, sendPeer, tag, sendData, sizeof(struct ncclConnect)*sendChannels));
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTransportCheckP2pType(struct ncclComm* comm, bool* intraNodeP2pSupport, bool* directMode) {
   bool supportFlag = true;
   bool directFlag = false;
@@ -106,8 +142,13 @@ ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph*
   struct ncclConnect** data; // Store intermediate send/recvData structs for connect
   struct ncclConnect** recvData = NULL; // Points to entries inside data for given recv connection within a channel
   struct ncclConnect** sendData = NULL; // Points to entries inside data for given send connection within a channel
+  int* nRecvChannels = NULL;
+  int* nSendChannels = NULL;
   int done = 0;
+  int sent = 0; // Last peer our connect information was sent to
+  int inflight = 0; // Connectors set up since then
   int maxPeers = ncclParamConnectRoundMaxPeers();
+  int maxInflight = ncclParamConnectMaxInflight();
 
   struct timeval timeStart, timeLast;
   gettimeofday(&timeStart, NULL);
@@ -117,11 +158,13 @@ ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph*
   NCCLCHECK(ncclCalloc(&data, maxPeers));
   NCCLCHECKGOTO(ncclCalloc(&recvData, maxPeers), ret, fail);
   NCCLCHECKGOTO(ncclCalloc(&sendData, maxPeers), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&nRecvChannels, maxPeers), ret, fail);
+  NCCLCHECKGOTO(ncclCalloc(&nSendChannels, maxPeers), ret, fail);
 
+  NCCLCHECKGOTO(initChannelPeers(comm), ret, fail);
   NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->hostStream), ret, fail);
   // First time initialization
   for (int i=1; i<comm->nRanks; i++) {
-    int bootstrapTag = (i<<8) + (graph ? graph->id+1 : 0);
     int recvPeer = (comm->rank - i + comm->nRanks) % comm->nRanks;
     int sendPeer = (comm->rank + i) % comm->nRanks;
     uint64_t recvMask = comm->connectRecv[recvPeer];
@@ -156,24 +199,41 @@ ncclResult_t ncclTransportP2pSetup(struct ncclComm* comm, struct ncclTopoGraph*
       }
     }
     TIME_STOP(1);
+    nRecvChannels[p] = recvChannels;
+    nSendChannels[p] = sendChannels;
+    inflight += recvChannels+sendChannels;
 
+    // Setups of the following peers proceed while earlier ones complete. Proxy responses wait on the
+    // socket until they are polled, the proxy would block on a full one.
     TIME_START(2);
-    if (sendPeer == recvPeer) {
-      if (recvChannels+sendChannels) {
-        NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, data[p], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
-        NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, bootstrapTag, data[p], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
-        sendData[p] = data[p];
-        recvData[p] = data[p]+sendChannels;
-      }
-    } else {
-      if (recvChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, recvPeer, bootstrapTag, recvData[p], sizeof(struct ncclConnect)*recvChannels), ret, fail);
-      if (sendChannels) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, sendPeer, bootstrapTag, sendData[p], sizeof(struct ncclConnect)*sendChannels), ret, fail);
-      if (sendChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, sendPeer, bootstrapTag, sendData[p], sizeof(struct ncclConnect)*sendChannels), ret, fail);
-      if (recvChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, bootstrapTag, recvData[p], sizeof(struct ncclConnect)*recvChannels), ret, fail);
+    while (sent < i && (inflight > maxInflight || i-done == maxPeers || i == comm->nRanks-1)) {
+      int j = ++sent;
+      int q = j-(done+1);
+      NCCLCHECKGOTO(sendSetupData(comm, connIndex, (j<<8) + (graph ? graph->id+1 : 0), (comm->rank - j + comm->nRanks) % comm->nRanks,
+          (comm->rank + j) % comm->nRanks, recvData[q], nRecvChannels[q], sendData[q], nSendChannels[q]), ret, fail);
+      inflight -= nRecvChannels[q]+nSendChannels[q];
     }
     TIME_STOP(2);
 
     if (i-done == maxPeers || i == comm->nRanks-1) {
+      // Peers sent theirs as soon as their own setups completed
+      for (int j=done+1; j<=i; j++) {
+        int tag = (j<<8) + (graph ? graph->id+1 : 0);
+        int recvPeer = (comm->rank - j + comm->nRanks) % comm->nRanks;
+        int sendPeer = (comm->rank + j) % comm->nRanks;
+        int p = j-(done+1);
+        int recvChannels = nRecvChannels[p], sendChannels = nSendChannels[p];
+        if (sendPeer == recvPeer) {
+          if (recvChannels+sendChannels) {
+            NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, tag, data[p], sizeof(struct ncclConnect)*(recvChannels+sendChannels)), ret, fail);
+            sendData[p] = data[p];
+            recvData[p] = data[p]+sendChannels;
+          }
+        } else {
+          if (sendChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, sendPeer, tag, sendData[p], sizeof(struct ncclConnect)*sendChannels), ret, fail);
+          if (recvChannels) NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, recvPeer, tag, recvData[p], sizeof(struct ncclConnect)*recvChannels), ret, fail);
+        }
+      }
       // Loop until all channels with all ranks have been connected
       bool allChannelsConnected;
       allChannelsConnected = false;
@@ -294,6 +354,8 @@ exit:
   free(data);
   if (sendData) free(sendData);
   if (recvData) free(recvData);
+  free(nRecvChannels);
+  free(nSendChannels);
 
   NCCLCHECK(ncclStrongStreamWaitStream(ncclCudaGraphNone(), &comm->sharedRes->deviceStream, &comm->sharedRes->hostStream));
   NCCLCHECK(ncclStrongStreamRelease(ncclCudaGraphNone(), &comm->sharedRes->hostStream));
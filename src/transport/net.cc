@@ -16,7 +16,9 @@
 #include "profiler.h"
 #include "transport.h"
 #include "shm.h"
+#include "hostpool.h"
 #include "msccl/msccl_lifecycle.h"
+#include "metrics.h"
 
 #if defined(ENABLE_NPKIT)
 #include "npkit/npkit.h"
@@ -114,6 +116,22 @@ struct connectMap {
   } offsets;
 };
 
+// Time the proxy spends in each phase of the steps of a connection, with NCCL_NET_STATS=1. From the
+// buffer posted to the GPU until the GPU filled it, in isend and until the network completed it for
+// sends. In irecv, until the network completed it, flushing it and until the GPU consumed it for
+// receives.
+struct netProxyStats {
+  uint64_t steps;
+  uint64_t bytes;
+  uint64_t gpuWaitNs;
+  uint64_t postNs;
+  uint64_t netNs;
+  uint64_t flushNs;
+  uint64_t lastDumpTime;
+  // start of the current phase of each step slot
+  uint64_t stepTime[NCCL_STEPS];
+};
+
 struct sendNetResources {
   struct connectMap map;
   void* netSendComm;
@@ -132,6 +150,13 @@ struct sendNetResources {
   int shared;
   int channelId;
   int connIndex;
+  int protoMask;
+  // Of the comm, -1 for the defaults of the network
+  int trafficClass;
+  int serviceLevel;
+  int netPriority;
+  // Sends of this connection counted in netSchedInflight
+  int netSchedInflight;
   char* buffers[NCCL_NUM_PROTOCOLS];
   int buffSizes[NCCL_NUM_PROTOCOLS];
   void* mhandles[NCCL_NUM_PROTOCOLS];
@@ -140,6 +165,8 @@ struct sendNetResources {
   int netDeviceVersion;
   ncclNetDeviceType netDeviceType;
   ncclNetDeviceHandle_t* netDeviceHandle;
+  // NULL unless NCCL_NET_STATS is set
+  struct netProxyStats* stats;
 };
 
 struct recvNetResources {
@@ -164,6 +191,7 @@ struct recvNetResources {
   int shared;
   int channelId;
   int connIndex;
+  int protoMask;
   char* buffers[NCCL_NUM_PROTOCOLS];
   int buffSizes[NCCL_NUM_PROTOCOLS];
   void* mhandles[NCCL_NUM_PROTOCOLS];
@@ -172,6 +200,8 @@ struct recvNetResources {
   int netDeviceVersion;
   ncclNetDeviceType netDeviceType;
   ncclNetDeviceHandle_t* netDeviceHandle;
+  // NULL unless NCCL_NET_STATS is set
+  struct netProxyStats* stats;
 };
 
 /* Determine if two peers can communicate with NET */
@@ -186,6 +216,83 @@ static ncclResult_t canConnect(int* ret, struct ncclComm* comm, struct ncclTopoG
 
 NCCL_PARAM(NetSharedBuffers, "NET_SHARED_BUFFERS", -2);
 NCCL_PARAM(NetSharedComms, "NET_SHARED_COMMS", 1);
+NCCL_PARAM(NetStats, "NET_STATS", 0);
+NCCL_PARAM(NetStatsIntervalMs, "NET_STATS_INTERVAL_MS", 1000);
+NCCL_PARAM(NetSendWindow, "NET_SEND_WINDOW", 0);
+NCCL_PARAM(NetSendVector, "NET_SEND_VECTOR", 0);
+NCCL_PARAM(NetSchedMaxYieldUs, "NET_SCHED_MAX_YIELD_US", 100);
+
+// Sends in flight on each NIC of the process by net priority of their comm, shared by the proxy
+// threads of all comms. Nothing yields to priority 0, its sends are not counted.
+static int netSchedInflight[NCCL_MAX_NETDEVS][NCCL_NET_PRIORITIES];
+
+// Whether the next send of sub may go now. It yields while comms of a higher net priority have
+// sends in flight on its NIC, for NCCL_NET_SCHED_MAX_YIELD_US at most so that it keeps moving.
+static bool netSchedMayPost(struct sendNetResources* resources, struct ncclProxySubArgs* sub) {
+  bool yield = false;
+  for (int q = resources->netPriority+1; q < NCCL_NET_PRIORITIES && !yield; q++) {
+    yield = __atomic_load_n(&netSchedInflight[resources->netDev][q], __ATOMIC_RELAXED) > 0;
+  }
+  if (!yield) {
+    sub->netYieldStart = 0;
+    return true;
+  }
+  uint64_t now = clockNano();
+  if (sub->netYieldStart == 0) sub->netYieldStart = now;
+  if (now - sub->netYieldStart < (uint64_t)ncclParamNetSchedMaxYieldUs()*1000) return false;
+  sub->netYieldStart = 0;
+  return true;
+}
+
+static void netSchedAdd(struct sendNetResources* resources, int n) {
+  if (resources->netPriority == 0 || n == 0) return;
+  resources->netSchedInflight += n;
+  __atomic_fetch_add(&netSchedInflight[resources->netDev][resources->netPriority], n, __ATOMIC_RELAXED);
+}
+
+static pthread_mutex_t netStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* netStatsFile;
+static bool netStatsFileOpened;
+
+// Counters are cumulative over the life of the connection, one INFO line and, with
+// NCCL_NET_STATS_FILE, one JSON line per dump
+static void netStatsDump(struct netProxyStats* stats, int isRecv, int rank, int peer, int channelId, int connIndex,
+    int netDev, int final) {
+  INFO(NCCL_NET, "NET/Stats %s rank %d peer %d channel %d conn %d dev %d: %lu steps %lu bytes, GPU wait %.3f ms, "
+    "post %.3f ms, network %.3f ms, flush %.3f ms", isRecv ? "recv" : "send", rank, peer, channelId, connIndex, netDev,
+    stats->steps, stats->bytes, stats->gpuWaitNs/1e6, stats->postNs/1e6, stats->netNs/1e6, stats->flushNs/1e6);
+  pthread_mutex_lock(&netStatsLock);
+  if (!netStatsFileOpened) {
+    netStatsFileOpened = true;
+    const char* path = ncclGetEnv("NCCL_NET_STATS_FILE");
+    if (path) {
+      netStatsFile = fopen(path, "a");
+      if (netStatsFile == NULL) WARN("NET/Stats: cannot open %s : %s", path, strerror(errno));
+    }
+  }
+  if (netStatsFile) {
+    fprintf(netStatsFile, "{\"rank\": %d, \"dir\": \"%s\", \"peer\": %d, \"channel\": %d, \"conn\": %d, \"dev\": %d, "
+      "\"steps\": %lu, \"bytes\": %lu, \"gpuWaitUs\": %.1f, \"postUs\": %.1f, \"netUs\": %.1f, \"flushUs\": %.1f, \"final\": %d}\n",
+      rank, isRecv ? "recv" : "send", peer, channelId, connIndex, netDev, stats->steps, stats->bytes,
+      stats->gpuWaitNs/1e3, stats->postNs/1e3, stats->netNs/1e3, stats->flushNs/1e3, final);
+    fflush(netStatsFile);
+  }
+  pthread_mutex_unlock(&netStatsLock);
+}
+
+// Count a step done at time now and dump the counters when the interval is over
+template <typename T>
+static void netStatsStepDone(T* resources, int isRecv, uint64_t now) {
+  struct netProxyStats* stats = resources->stats;
+  stats->steps++;
+  uint64_t interval = ncclParamNetStatsIntervalMs() * 1000000ULL;
+  if (interval == 0) return;
+  if (stats->lastDumpTime == 0) stats->lastDumpTime = now;
+  if (now - stats->lastDumpTime < interval) return;
+  stats->lastDumpTime = now;
+  netStatsDump(stats, isRecv, resources->tpRank, resources->tpRemoteRank, resources->channelId, resources->connIndex,
+    resources->netDev, 0);
+}
 
 struct setupReq {
   int tpRank;
@@ -197,6 +304,10 @@ struct setupReq {
   int needFlush;
   int channelId;
   int connIndex;
+  int protoMask; // Protocols to allocate dedicated buffers for
+  int trafficClass;
+  int serviceLevel;
+  int netPriority;
 };
 
 // Forward declaration
@@ -210,6 +321,10 @@ static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   send->conn.shared = req.shared = (graph || mscclIsCaller() || connIndex == 0) ? 0 : ncclParamNetSharedBuffers() != -2 ? ncclParamNetSharedBuffers() : 1;
   req.channelId = channelId;
   req.connIndex = connIndex;
+  req.protoMask = ncclConnProtoMask(comm, connIndex);
+  req.trafficClass = comm->config.trafficClass;
+  req.serviceLevel = comm->config.serviceLevel;
+  req.netPriority = comm->config.netPriority;
 
   int proxyRank;
   int64_t netId;
@@ -221,7 +336,7 @@ static ncclResult_t sendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   req.tpLocalRank = comm->topParentLocalRanks[comm->localRank];
   req.tpRank = comm->topParentRanks[myInfo->rank];
   req.tpRemoteRank = comm->topParentRanks[peerInfo->rank];
-  NCCLCHECK(ncclProxyCallBlocking(comm, &send->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), NULL, 0));
+  NCCLCHECK(ncclTransportSetupAsync(comm, send, &req, sizeof(req), NULL, 0));
 
   if (proxyRank == myInfo->rank) {
     INFO(NCCL_INIT|NCCL_NET,"Channel %02d/%d : %d[%d] -> %d[%d] [send] via NET/%s/%d%s%s", channelId, connIndex, myInfo->rank, myInfo->nvmlDev, peerInfo->rank, peerInfo->nvmlDev, comm->ncclNet->name, req.netDev,
@@ -251,6 +366,7 @@ static ncclResult_t recvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   recv->conn.shared = req.shared = (graph || mscclIsCaller() || connIndex == 0) ? 0 : ncclParamNetSharedBuffers() != -2 ? ncclParamNetSharedBuffers() : 1;
   req.channelId = channelId;
   req.connIndex = connIndex;
+  req.protoMask = ncclConnProtoMask(comm, connIndex);
 
   // Use myInfo->rank as the receiver uses its own NIC
   int proxyRank;
@@ -267,7 +383,7 @@ static ncclResult_t recvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph
   req.tpLocalRank = comm->topParentLocalRanks[comm->localRank];
   req.tpRank = comm->topParentRanks[myInfo->rank];
   req.tpRemoteRank = comm->topParentRanks[peerInfo->rank];
-  NCCLCHECK(ncclProxyCallBlocking(comm, &recv->proxyConn, ncclProxyMsgSetup, &req, sizeof(req), connectInfo, sizeof(ncclNetHandle_t)));
+  NCCLCHECK(ncclTransportSetupAsync(comm, recv, &req, sizeof(req), connectInfo, sizeof(ncclNetHandle_t)));
   INFO(NCCL_INIT|NCCL_NET,"Channel %02d/%d : %d[%d] -> %d[%d] [receive] via NET/%s/%d%s%s", channelId, connIndex, peerInfo->rank, peerInfo->nvmlDev, myInfo->rank, myInfo->nvmlDev, comm->ncclNet->name, req.netDev,
       req.useGdr ? "/GDRDMA" : "", req.shared ? "/Shared" : "");
 
@@ -407,6 +523,12 @@ static ncclResult_t sendConnect(struct ncclComm* comm, struct ncclConnect* conne
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++)
     send->conn.buffs[p] = NCCL_NET_MAP_GET_POINTER(map, gpu, buffs[p]);
 
+  // The proxy can only send from user buffers it can register: the GPU buffers of its own
+  // device, when the NIC reads GPU memory and the connection has its own FIFO.
+  if (send->proxyConn.sameProcess && map->cudaDev == comm->cudaDev && !map->shared && (send->conn.flags & NCCL_DIRECT_NIC)) {
+    send->conn.flags |= NCCL_NET_REG_SEND;
+  }
+
   if (send->proxyConn.sameProcess) {
     if (send->proxyConn.connection->netDeviceHandle) {
       send->conn.netDeviceHandle = *send->proxyConn.connection->netDeviceHandle;
@@ -555,9 +677,11 @@ static ncclResult_t sharedNetBuffersInit(struct ncclProxyState* proxyState, int
     } else {
       NCCLCHECK(ncclCudaCalloc(&state->cudaBuff, state->size));
     }
+    ncclProxyMemAdd(proxyState->sharedBuffBytes, false, state->size);
   }
   if (!cuda && state->hostBuff == NULL) {
-    NCCLCHECK(ncclCudaHostCalloc(&state->hostBuff, state->size));
+    NCCLCHECK(ncclHostPoolCalloc(&state->hostBuff, state->size));
+    ncclProxyMemAdd(proxyState->sharedBuffBytes, true, state->size);
   }
   if (cpuPtr) *cpuPtr = cuda ? state->cudaBuff : state->hostBuff;
   if (gpuPtr) *gpuPtr = (cpuPtr && sameProcess) ? *cpuPtr : NULL;
@@ -586,7 +710,7 @@ static ncclResult_t sharedNetBuffersDestroy(struct ncclProxyState* proxyState, i
       }
       NCCLCHECK(ncclCudaFree(state->cudaBuff));
     }
-    if (state->hostBuff) NCCLCHECK(ncclCudaHostFree(state->hostBuff));
+    if (state->hostBuff) NCCLCHECK(ncclHostPoolFree(state->hostBuff));
   }
 
   if (peer->send.refcount || peer->recv.refcount) return ncclSuccess;
@@ -620,11 +744,18 @@ static ncclResult_t sendProxySetup(struct ncclProxyConnection* connection, struc
   resources->tpRemoteRank = req->tpRemoteRank;
   resources->netDev = req->netDev;
   resources->shared = connection->shared = req->shared;
+  connection->progressShard = ncclProxyProgressShardForNet(proxyState, req->netDev);
+  ncclProxyNetConnAdd(proxyState, req->netDev);
   resources->useGdr = req->useGdr;
   resources->channelId = req->channelId;
   resources->connIndex = req->connIndex;
+  resources->protoMask = req->protoMask;
+  resources->trafficClass = req->trafficClass;
+  resources->serviceLevel = req->serviceLevel;
+  resources->netPriority = req->netPriority;
   ncclNetProperties_t props;
   NCCLCHECK(proxyState->ncclNet->getProperties(req->netDev, &props));
+  ncclMetricsNetDevice(req->netDev, props.name);
   /* DMA-BUF support */
   resources->useDmaBuf = resources->useGdr && proxyState->dmaBufSupport && (props.ptrSupport & NCCL_PTR_DMABUF);
   resources->maxRecvs = props.maxRecvs;
@@ -653,12 +784,16 @@ static ncclResult_t recvProxySetup(struct ncclProxyConnection* connection, struc
   resources->tpRemoteRank = req->tpRemoteRank;
   resources->netDev = req->netDev;
   resources->shared = connection->shared = req->shared;
+  connection->progressShard = ncclProxyProgressShardForNet(proxyState, req->netDev);
+  ncclProxyNetConnAdd(proxyState, req->netDev);
   resources->useGdr = req->useGdr;
   resources->needFlush = req->needFlush;
   resources->channelId = req->channelId;
   resources->connIndex = req->connIndex;
+  resources->protoMask = req->protoMask;
   ncclNetProperties_t props;
   NCCLCHECK(proxyState->ncclNet->getProperties(req->netDev, &props));
+  ncclMetricsNetDevice(req->netDev, props.name);
   /* DMA-BUF support */
   resources->useDmaBuf = resources->useGdr && proxyState->dmaBufSupport && (props.ptrSupport & NCCL_PTR_DMABUF);
   resources->maxRecvs = props.maxRecvs;
@@ -700,6 +835,9 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
   ncclResult_t ret = ncclSuccess;
   netSendConnectArgs* req = (netSendConnectArgs*) reqBuff;
   NCCLCHECK(ncclNetGetDeviceHandle(resources->netDeviceType, resources->netDeviceVersion, false /*isRecv*/, &resources->netDeviceHandle));
+  if (ncclParamNetStats() && resources->stats == NULL) NCCLCHECK(ncclCalloc(&resources->stats, 1));
+  // Proxies of comms of different QoS may share this thread, each connect call sets its own
+  ncclIbSetConnectQos(resources->trafficClass, resources->serviceLevel);
   if (resources->shared) {
     // Shared buffers
     struct ncclProxyProgressState* progressState = &proxyState->progressState;
@@ -710,7 +848,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
     if (localPeers[resources->tpLocalRank] == NULL) {
       NCCLCHECK(ncclCalloc(localPeers + resources->tpLocalRank, 1));
     }
-    connection->proxyAppendPtr = localPeers[resources->tpLocalRank]->send.proxyAppend + resources->channelId;
+    connection->proxyAppendPtr = localPeers[resources->tpLocalRank]->send.proxyAppend[connection->progressShard] + resources->channelId;
 
     if (resources->maxRecvs > 1 && ncclParamNetSharedComms()) {
       // Connect or reuse connection for a netdev/remote rank.
@@ -729,6 +867,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
     ret = proxyState->ncclNet->connect(resources->netDev, req->handle, &resources->netSendComm, &resources->netDeviceHandle);
     connection->proxyAppendPtr = &connection->proxyAppend;
   }
+  ncclIbSetConnectQos(-1, -1);
 
   NCCLCHECK(ret);
   if (resources->netSendComm == NULL) {
@@ -752,6 +891,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
 
   if (resources->shared == 0) { // Only allocate dedicated buffers for ring/tree, not for p2p
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if ((resources->protoMask & (1 << p)) == 0) continue;
       NCCL_NET_MAP_ADD_POINTER(map, 0, p!= NCCL_PROTO_LL && resources->useGdr, proxyState->buffSizes[p], buffs[p]);
       resources->buffSizes[p] = proxyState->buffSizes[p];
     }
@@ -788,7 +928,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
     }
   }
   if (map->sameProcess) {
-    NCCLCHECK(ncclCudaHostCalloc(&map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr, map->mems[NCCL_NET_MAP_HOSTMEM].size));
+    NCCLCHECK(ncclHostPoolCalloc(&map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr, map->mems[NCCL_NET_MAP_HOSTMEM].size));
     map->mems[NCCL_NET_MAP_HOSTMEM].gpuPtr = map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr;
   } else {
     NCCLCHECK(netCreateShm(proxyState, map->mems+NCCL_NET_MAP_HOSTMEM));
@@ -797,7 +937,7 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
     memset(sendMem, 0, sizeof(struct ncclSendMem));
     memset(recvMem, 0, sizeof(struct ncclRecvMem));
   }
-  if (ncclGdrCopy && map->sameProcess && ncclParamGdrCopySyncEnable()) {
+  if (ncclGdrCopyTransports && map->sameProcess && ncclParamGdrCopySyncEnable()) {
     uint64_t *cpuPtr, *gpuPtr;
     NCCLCHECK(ncclGdrCudaCalloc(&cpuPtr, &gpuPtr, 1, &resources->gdrDesc));
 
@@ -808,6 +948,8 @@ static ncclResult_t sendProxyConnect(struct ncclProxyConnection* connection, str
     gdcMem->size = sizeof(uint64_t); // sendMem->head
   }
 
+  if (resources->shared == 0) ncclProxyMemAdd(proxyState->fifoBytes, false, map->mems[NCCL_NET_MAP_DEVMEM].size);
+  ncclProxyMemAdd(proxyState->fifoBytes, true, map->mems[NCCL_NET_MAP_HOSTMEM].size);
   resources->sendMem = (struct ncclSendMem*) NCCL_NET_MAP_GET_POINTER(map, cpu, sendMem);
   resources->recvMem = (struct ncclRecvMem*) NCCL_NET_MAP_GET_POINTER(map, cpu, recvMem);
 
@@ -853,6 +995,7 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
   ncclResult_t ret = ncclSuccess;
 
   NCCLCHECK(ncclNetGetDeviceHandle(resources->netDeviceType, resources->netDeviceVersion, true /*isRecv*/, &resources->netDeviceHandle));
+  if (ncclParamNetStats() && resources->stats == NULL) NCCLCHECK(ncclCalloc(&resources->stats, 1));
   // Finish connection establishment from remote peer
   if (resources->shared) {
     // Shared buffers
@@ -864,7 +1007,7 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
     if (localPeers[resources->tpLocalRank] == NULL) {
       NCCLCHECK(ncclCalloc(localPeers + resources->tpLocalRank, 1));
     }
-    connection->proxyAppendPtr = localPeers[resources->tpLocalRank]->recv.proxyAppend + resources->channelId;
+    connection->proxyAppendPtr = localPeers[resources->tpLocalRank]->recv.proxyAppend[connection->progressShard] + resources->channelId;
 
     if (resources->maxRecvs > 1 && ncclParamNetSharedComms()) {
       // Connect or reuse connection for a netdev/remote rank.
@@ -908,6 +1051,7 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
 
   if (resources->shared == 0) { // Only allocate dedicated buffers for ring/tree, not for p2p
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if ((resources->protoMask & (1 << p)) == 0) continue;
       NCCL_NET_MAP_ADD_POINTER(map, 0, resources->useGdr, proxyState->buffSizes[p], buffs[p]);
       resources->buffSizes[p] = proxyState->buffSizes[p];
     }
@@ -941,9 +1085,9 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
       map->mems[NCCL_NET_MAP_DEVMEM].cpuPtr = map->mems[NCCL_NET_MAP_DEVMEM].gpuPtr;
     }
   }
-  NCCLCHECK(ncclCudaHostCalloc(&map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr, map->mems[NCCL_NET_MAP_HOSTMEM].size));
+  NCCLCHECK(ncclHostPoolCalloc(&map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr, map->mems[NCCL_NET_MAP_HOSTMEM].size));
   map->mems[NCCL_NET_MAP_HOSTMEM].gpuPtr = map->mems[NCCL_NET_MAP_HOSTMEM].cpuPtr;
-  if (ncclGdrCopy && map->sameProcess) {
+  if (ncclGdrCopyTransports && map->sameProcess) {
     uint64_t *cpuPtr, *gpuPtr;
     NCCLCHECK(ncclGdrCudaCalloc(&cpuPtr, &gpuPtr, 2, &resources->gdrDesc));
 
@@ -957,6 +1101,8 @@ static ncclResult_t recvProxyConnect(struct ncclProxyConnection* connection, str
     if (ncclParamGdrCopyFlushEnable()) resources->gdcFlush = cpuPtr + 1;
   }
 
+  if (resources->shared == 0) ncclProxyMemAdd(proxyState->fifoBytes, false, map->mems[NCCL_NET_MAP_DEVMEM].size);
+  ncclProxyMemAdd(proxyState->fifoBytes, true, map->mems[NCCL_NET_MAP_HOSTMEM].size);
   resources->sendMem = (struct ncclSendMem*) NCCL_NET_MAP_GET_POINTER(map, cpu, sendMem);
   resources->recvMem = (struct ncclRecvMem*) NCCL_NET_MAP_GET_POINTER(map, cpu, recvMem);
   for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
@@ -996,6 +1142,8 @@ static ncclResult_t sendProxyFree(struct ncclProxyConnection* connection, struct
   }
 
   if (connection->state == connConnected) {
+    // Sends an abort left in flight no longer hold back the comms of lower priorities
+    netSchedAdd(resources, -resources->netSchedInflight);
     for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
       if (resources->buffers[p]) {
         NCCLCHECK(proxyState->ncclNet->deregMr(resources->netSendComm, resources->mhandles[p]));
@@ -1003,7 +1151,7 @@ static ncclResult_t sendProxyFree(struct ncclProxyConnection* connection, struct
     }
     struct connectMapMem* mems = resources->map.mems;
     if (resources->map.sameProcess) {
-      NCCLCHECK(ncclCudaHostFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
+      NCCLCHECK(ncclHostPoolFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
     } else {
       NCCLCHECK(ncclShmIpcClose(&mems[NCCL_NET_MAP_HOSTMEM].createDesc));
     }
@@ -1029,6 +1177,11 @@ static ncclResult_t sendProxyFree(struct ncclProxyConnection* connection, struct
     }
   }
 
+  if (resources && resources->stats) {
+    netStatsDump(resources->stats, 0, resources->tpRank, resources->tpRemoteRank, resources->channelId, resources->connIndex,
+      resources->netDev, 1);
+    free(resources->stats);
+  }
   if (resources) free(resources);
   return ncclSuccess;
 }
@@ -1047,7 +1200,7 @@ static ncclResult_t recvProxyFree(struct ncclProxyConnection* connection, struct
       }
     }
     struct connectMapMem* mems = resources->map.mems;
-    NCCLCHECK(ncclCudaHostFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
+    NCCLCHECK(ncclHostPoolFree(mems[NCCL_NET_MAP_HOSTMEM].cpuPtr));
     NCCLCHECK(ncclCudaFree(mems[NCCL_NET_MAP_DEVMEM].cpuPtr));
     if (!resources->map.sameProcess || ncclCuMemEnable()) {
       // cuMem API support
@@ -1070,6 +1223,11 @@ static ncclResult_t recvProxyFree(struct ncclProxyConnection* connection, struct
     }
   }
 
+  if (resources && resources->stats) {
+    netStatsDump(resources->stats, 1, resources->tpRank, resources->tpRemoteRank, resources->channelId, resources->connIndex,
+      resources->netDev, 1);
+    free(resources->stats);
+  }
   if (resources) free(resources);
   return ncclSuccess;
 }
@@ -1081,6 +1239,77 @@ static_assert(NCCL_STEPS <= NCCL_NET_MAX_REQUESTS, "Not enough net requests to c
 static int g_npkit_net_poll_cnt = 0;
 #endif
 
+// One send of the pass of sendProxyProgress, posted with the others by netIsendv
+struct sendVectorEntry {
+  int s, buffSlot, size;
+  uint64_t postTime;
+  uint64_t* inflight;
+};
+struct sendVector {
+  int n;
+  struct sendVectorEntry entries[NCCL_PROXY_MAX_SUBS];
+  void* comms[NCCL_PROXY_MAX_SUBS];
+  void* data[NCCL_PROXY_MAX_SUBS];
+  int sizes[NCCL_PROXY_MAX_SUBS];
+  int tags[NCCL_PROXY_MAX_SUBS];
+  void* mhandles[NCCL_PROXY_MAX_SUBS];
+  void* requests[NCCL_PROXY_MAX_SUBS];
+};
+
+// The IB transport posts the whole vector with one doorbell per QP, other networks get one isend per send
+static ncclResult_t netIsendv(struct ncclProxyState* proxyState, struct sendVector* v) {
+  if (proxyState->ncclNet == &ncclNetIb) return ncclIbIsendv(v->n, v->comms, v->data, v->sizes, v->tags, v->mhandles, v->requests);
+  for (int i = 0; i < v->n; i++) {
+    NCCLCHECK(proxyState->ncclNet->isend(v->comms[i], v->data[i], v->sizes[i], v->tags[i], v->mhandles[i], v->requests+i));
+  }
+  return ncclSuccess;
+}
+
+// Account for a send the network accepted into slot buffSlot of sub s, paced is whether its size was
+// added to the window of the NIC
+static void sendProxyPosted(struct ncclProxyState* proxyState, struct ncclProxyArgs* args, int s, int buffSlot, int size,
+    uint64_t postTime, bool paced) {
+  struct ncclProxySubArgs* sub = args->subs+s;
+  struct sendNetResources* resources = (struct sendNetResources*) (sub->connection->transportResources);
+  sub->pacedSizes[buffSlot] = paced ? size : 0;
+  netSchedAdd(resources, 1);
+  if (resources->stats) {
+    struct netProxyStats* stats = resources->stats;
+    uint64_t now = clockNano();
+    stats->gpuWaitNs += postTime - stats->stepTime[buffSlot];
+    stats->postNs += now - postTime;
+    stats->bytes += size;
+    stats->stepTime[buffSlot] = now;
+  }
+
+#if defined(ENABLE_NPKIT)
+  NpKit::CollectCpuEvent(
+      NPKIT_EVENT_NET_SEND_ENTRY,
+#if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
+      g_npkit_net_poll_cnt,
+#else
+      size,
+#endif
+      uint64_t(sub->requests+buffSlot)/sizeof(void*),
+      *(volatile uint64_t*)NpKit::GetCpuTimestamp(), sub->channelId);
+#if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
+  g_npkit_net_poll_cnt = 0;
+#endif
+#endif
+
+#if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
+  sub->npKitStartTime[buffSlot] = sub->npKitLastPollTime[buffSlot] = npKitGetTsInUs();
+  sub->npKitMaxPollInterval[buffSlot] = sub->npKitPollIntervalSum[buffSlot] = sub->npKitPollCnt[buffSlot] = 0;
+#endif
+
+  TRACE(NCCL_NET, "sendProxy [%ld/%d] Isend posted, req %p, size %d, proto %d, myRank %d, channelId %d", sub->transmitted, buffSlot, sub->requests[buffSlot], size, args->protocol, proxyState->tpRank, sub->channelId);
+  sub->transmitted += args->sliceSteps;
+  ncclProfilerRecordProxyOpEventState(s, args, sub->transmitted, sub->transSize, ncclProfilerProxyOpSendTransmitted);
+  ncclProfilerRecordProxyStepEventStates(s, args, sub->transmitted-args->sliceSteps, sub->transmitted, ncclProfilerProxyStepSendWait);
+  sub->transSize += size;
+  args->idle = 0;
+}
+
 static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
 #if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
   g_npkit_net_poll_cnt++;
@@ -1094,12 +1323,17 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
       // Set step base for next op
       resources->step = sub->base + sub->nsteps;
       sub->posted = sub->transmitted = sub->done = 0;
+      sub->netYieldStart = 0;
       ncclProfilerStartSendProxyOpEvent(s, args);
       if (sub->reg && sub->nbytes > 0) {
-        NCCLCHECK(proxyState->ncclNet->regMr(resources->netSendComm, sub->recvbuff, sub->nbytes, NCCL_PTR_CUDA, &sub->mhandle));
+        NCCLCHECK(proxyState->ncclNet->regMr(resources->netSendComm, sub->recvbuff, sub->nbytes, sub->regHost ? NCCL_PTR_HOST : NCCL_PTR_CUDA, &sub->mhandle));
       } else {
         sub->mhandle = resources->mhandles[args->protocol];
       }
+      sub->netRegMhandle = NULL;
+      if (sub->netRegSend && sub->nsteps > 0 && args->protocol == NCCL_PROTO_SIMPLE && sub->connection->sameProcess && resources->useGdr && !resources->shared) {
+        NCCLCHECK(proxyState->ncclNet->regMr(resources->netSendComm, sub->sendbuff, sub->netRegBytes, sub->regHost ? NCCL_PTR_HOST : NCCL_PTR_CUDA, &sub->netRegMhandle));
+      }
     }
     args->state = ncclProxyOpProgress;
   }
@@ -1107,6 +1341,9 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
   if (args->state == ncclProxyOpProgress) {
     int p = args->protocol;
     int maxDepth = std::min(NCCL_STEPS, NCCL_SHARED_STEPS/args->nsubs);
+    struct sendVector sendv;
+    struct sendVector* vector = ncclParamNetSendVector() && args->nsubs > 1 ? &sendv : NULL;
+    if (vector) vector->n = 0;
     for (int s=0; s<args->nsubs; s++) {
       struct ncclProxySubArgs* sub = args->subs+s;
       if (sub->done == sub->nsteps) continue;
@@ -1132,6 +1369,7 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
           if (sub->reg == 0 || sub->posted == args->sliceSteps) *sendHead = sub->base + sub->posted - NCCL_STEPS;
           if (resources->gdcSync) wc_store_fence(); // Flush out WC write
         } else sub->posted += args->sliceSteps;
+        if (resources->stats) resources->stats->stepTime[buffSlot] = clockNano();
         ncclProfilerRecordProxyOpEventState(s, args, sub->posted, sub->transSize, ncclProfilerProxyOpSendPosted);
         ncclProfilerRecordProxyStepEventStates(s, args, sub->posted-args->sliceSteps, sub->posted, ncclProfilerProxyStepSendGPUWait);
         args->idle = 0;
@@ -1146,10 +1384,7 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
           // We have something to receive, let's check if it's completely ready.
           int size = sub->reg ? std::min(MAX_NET_SIZE, sub->nbytes) : connFifo[buffSlot].size;
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_SEND_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_SEND_EXIT)
-          sub->npKitSizesFifo[buffSlot] = size;
-#endif
-#if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
+#if defined(ENABLE_NPKIT) || defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
           sub->npKitSizesFifo[buffSlot] = size;
 #endif
 
@@ -1181,42 +1416,52 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
           } else if (p == NCCL_PROTO_SIMPLE && resources->shared) {
             buff = sub->reg ? (char*)sub->recvbuff : localBuff+resources->recvMem->connFifo[buffSlot].offset;
           }
+          void* mhandle = sub->mhandle;
+          if (sub->netRegMhandle && connFifo[buffSlot].ptr) {
+            // The GPU left this step in the registered user buffer instead of the FIFO
+            buff = (char*)connFifo[buffSlot].ptr;
+            mhandle = sub->netRegMhandle;
+          }
+          // Hold p2p sends back while the NIC has a window of them in flight. Ops come in the round
+          // order of the plan, so later peers wait for earlier ones instead of all hitting the fabric
+          // at once. A send always goes when nothing is in flight.
+          uint64_t* inflight = NULL;
+          int64_t window = ncclParamNetSendWindow();
+          if (window > 0 && args->pattern == ncclPatternSend) {
+            inflight = proxyState->progressState.netSendInflight + resources->netDev;
+            uint64_t cur = __atomic_load_n(inflight, __ATOMIC_RELAXED);
+            if (cur > 0 && cur + size > (uint64_t)window) ready = 0;
+          }
+          if (ready && !netSchedMayPost(resources, sub)) ready = 0;
           if (ready) {
             ncclProfilerRecordProxyOpEventState(s, args, sub->transmitted + args->sliceSteps, sub->transSize, ncclProfilerProxyOpSendRemFifoWait);
-            // Data is ready, try to send.
-            // Coverity complains about the size here as pointing to an out-of-scope temporary.  Which is nonsense,
-            // since size is a plain integer.
-            // coverity[use_invalid:FALSE]
-            NCCLCHECK(proxyState->ncclNet->isend(resources->netSendComm, buff, size, resources->tpRank, sub->mhandle, sub->requests+buffSlot));
-            if (sub->requests[buffSlot] != NULL) {
-
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_SEND_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_SEND_EXIT)
-              NpKit::CollectCpuEvent(
-                  NPKIT_EVENT_NET_SEND_ENTRY,
-#if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
-                  g_npkit_net_poll_cnt,
-#else
-                  size,
-#endif
-                  uint64_t(sub->requests+buffSlot)/sizeof(void*),
-                  *(volatile uint64_t*)NpKit::GetCpuTimestamp(), sub->channelId);
-#if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
-              g_npkit_net_poll_cnt = 0;
-#endif
-#endif
-
-#if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
-              sub->npKitStartTime[buffSlot] = sub->npKitLastPollTime[buffSlot] = npKitGetTsInUs();
-              sub->npKitMaxPollInterval[buffSlot] = sub->npKitPollIntervalSum[buffSlot] = sub->npKitPollCnt[buffSlot] = 0;
+            uint64_t postTime = resources->stats ? clockNano() : 0;
+            if (vector) {
+              // Posted with the sends of the other subs once they have all been checked. Its size counts
+              // against the window right away, so that the next subs see it.
+              if (inflight) __atomic_fetch_add(inflight, size, __ATOMIC_RELAXED);
+              int i = vector->n++;
+              vector->entries[i] = { s, buffSlot, size, postTime, inflight };
+              vector->comms[i] = resources->netSendComm;
+              vector->data[i] = buff;
+              vector->sizes[i] = size;
+              vector->tags[i] = resources->tpRank;
+              vector->mhandles[i] = mhandle;
+              vector->requests[i] = NULL;
+            } else {
+#if defined(ENABLE_NPKIT)
+              NpKit::SetCpuChannel(sub->channelId);
 #endif
-
-              TRACE(NCCL_NET, "sendProxy [%ld/%d] Isend posted, req %p, size %d, proto %d, myRank %d, channelId %d", sub->transmitted, buffSlot, sub->requests[buffSlot], size, p, proxyState->tpRank, sub->channelId);
-              sub->transmitted += args->sliceSteps;
-              ncclProfilerRecordProxyOpEventState(s, args, sub->transmitted, sub->transSize, ncclProfilerProxyOpSendTransmitted);
-              ncclProfilerRecordProxyStepEventStates(s, args, sub->transmitted-args->sliceSteps, sub->transmitted, ncclProfilerProxyStepSendWait);
-              sub->transSize += size;
-              args->idle = 0;
-              continue;
+              // Data is ready, try to send.
+              // Coverity complains about the size here as pointing to an out-of-scope temporary.  Which is nonsense,
+              // since size is a plain integer.
+              // coverity[use_invalid:FALSE]
+              NCCLCHECK(proxyState->ncclNet->isend(resources->netSendComm, buff, size, resources->tpRank, mhandle, sub->requests+buffSlot));
+              if (sub->requests[buffSlot] != NULL) {
+                if (inflight) __atomic_fetch_add(inflight, size, __ATOMIC_RELAXED);
+                sendProxyPosted(proxyState, args, s, buffSlot, size, postTime, inflight != NULL);
+                continue;
+              }
             }
           }
         }
@@ -1226,6 +1471,9 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
         int done;
         int size;
         int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
+#if defined(ENABLE_NPKIT)
+        NpKit::SetCpuChannel(sub->channelId);
+#endif
         NCCLCHECK(proxyState->ncclNet->test(sub->requests[buffSlot], &done, &size));
 
 #if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
@@ -1240,6 +1488,12 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
 #endif
 
         if (done) {
+          ncclMetricsNetBytes(resources->netDev, true, size);
+          if (sub->pacedSizes[buffSlot]) {
+            __atomic_fetch_sub(proxyState->progressState.netSendInflight + resources->netDev, sub->pacedSizes[buffSlot], __ATOMIC_RELAXED);
+            sub->pacedSizes[buffSlot] = 0;
+          }
+          netSchedAdd(resources, -1);
           if (sub->reg) {
             if (size < sub->nbytes) {
               sub->recvbuff += size;
@@ -1253,9 +1507,10 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
           }
           // Make sure size is reset to -1 before we update the head.
           if (sub->reg == 0) connFifo[buffSlot].size = -1;
+          if (sub->netRegMhandle) connFifo[buffSlot].ptr = NULL;
           __sync_synchronize();
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_SEND_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_SEND_EXIT)
+#if defined(ENABLE_NPKIT)
           NpKit::CollectCpuEvent(
               NPKIT_EVENT_NET_SEND_EXIT,
 #if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
@@ -1283,6 +1538,11 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
           }
 #endif
 
+          if (resources->stats) {
+            uint64_t now = clockNano();
+            resources->stats->netNs += now - resources->stats->stepTime[buffSlot];
+            netStatsStepDone(resources, 0, now);
+          }
           TRACE(NCCL_NET, "sendProxy [%ld/%d] request %p done", sub->done, buffSlot, sub->requests[buffSlot]);
           sub->done += args->sliceSteps;
           ncclProfilerStopProxyStepEvents(s, args, sub->done-args->sliceSteps, sub->done);
@@ -1303,11 +1563,27 @@ static ncclResult_t sendProxyProgress(struct ncclProxyState* proxyState, struct
             if (sub->reg && sub->nbytes > 0) {
               NCCLCHECK(proxyState->ncclNet->deregMr(resources->netSendComm, sub->mhandle));
             }
+            if (sub->netRegMhandle) {
+              NCCLCHECK(proxyState->ncclNet->deregMr(resources->netSendComm, sub->netRegMhandle));
+              sub->netRegMhandle = NULL;
+            }
             args->done++;
           }
         }
       }
     }
+    if (vector && vector->n) {
+      NCCLCHECK(netIsendv(proxyState, vector));
+      for (int i = 0; i < vector->n; i++) {
+        struct sendVectorEntry* e = vector->entries+i;
+        args->subs[e->s].requests[e->buffSlot] = vector->requests[i];
+        if (vector->requests[i] != NULL) {
+          sendProxyPosted(proxyState, args, e->s, e->buffSlot, e->size, e->postTime, e->inflight != NULL);
+        } else if (e->inflight) {
+          __atomic_fetch_sub(e->inflight, e->size, __ATOMIC_RELAXED);
+        }
+      }
+    }
     if (args->done == args->nsubs) {
       for (int s=0; s<args->nsubs; s++) {
         ncclProfilerStopProxyOpEvent(s, args);
@@ -1360,7 +1636,7 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
       ncclProfilerStartRecvProxyOpEvent(s, args);
       if (sub->reg && sub->nbytes > 0) {
         // Register buffer
-        NCCLCHECK(proxyState->ncclNet->regMr(resources->netRecvComm, sub->recvbuff, sub->nbytes, NCCL_PTR_CUDA, &sub->mhandle));
+        NCCLCHECK(proxyState->ncclNet->regMr(resources->netRecvComm, sub->recvbuff, sub->nbytes, sub->regHost ? NCCL_PTR_HOST : NCCL_PTR_CUDA, &sub->mhandle));
       } else {
         sub->mhandle = resources->mhandles[args->protocol];
       }
@@ -1416,13 +1692,18 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
         uint64_t step = subGroup->posted;
         struct recvNetResources* resources = (struct recvNetResources*) (subGroup->connection->transportResources);
         void** requestPtr = subGroup->requests+(step%NCCL_STEPS);
+        uint64_t postTime = resources->stats ? clockNano() : 0;
+#if defined(ENABLE_NPKIT)
+        NpKit::SetCpuChannel(subGroup->channelId);
+#endif
         NCCLCHECK(proxyState->ncclNet->irecv(resources->netRecvComm, subCount, ptrs, sizes, tags, mhandles, requestPtr));
         if (*requestPtr) {
+          uint64_t now = resources->stats ? clockNano() : 0;
           subGroup->recvRequestsCache[step%NCCL_STEPS] = *requestPtr;
           subGroup->recvRequestsSubCount = subCount;
           for (int i=0; i<subGroup->groupSize; i++) {
             struct ncclProxySubArgs* sub = subGroup+i;
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_RECV_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_RECV_EXIT)
+#if defined(ENABLE_NPKIT)
             NpKit::CollectCpuEvent(
                 NPKIT_EVENT_NET_RECV_ENTRY,
 #if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
@@ -1441,6 +1722,11 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
             sub->npKitStartTime[step%NCCL_STEPS] = sub->npKitLastPollTime[step%NCCL_STEPS] = npKitGetTsInUs();
             sub->npKitMaxPollInterval[step%NCCL_STEPS] = sub->npKitPollIntervalSum[step%NCCL_STEPS] = sub->npKitPollCnt[step%NCCL_STEPS] = 0;
 #endif
+            struct netProxyStats* stats = ((struct recvNetResources*)sub->connection->transportResources)->stats;
+            if (stats) {
+              stats->postNs += now - postTime;
+              stats->stepTime[(sub->base+sub->posted)%NCCL_STEPS] = now;
+            }
             sub->posted += args->sliceSteps;
             ncclProfilerRecordProxyOpEventState(s+i, args, sub->posted, sub->transSize, ncclProfilerProxyOpRecvPosted);
             ncclProfilerRecordProxyStepEventStates(s+i, args, sub->posted-args->sliceSteps, sub->posted, ncclProfilerProxyStepRecvWait);
@@ -1460,6 +1746,9 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
         int sizes[NCCL_PROXY_MAX_SUBS];
         void* mhandles[NCCL_PROXY_MAX_SUBS];
         for (int i=0; i<NCCL_PROXY_MAX_SUBS; i++) sizes[i] = 0;
+#if defined(ENABLE_NPKIT)
+        NpKit::SetCpuChannel(subGroup->channelId);
+#endif
         NCCLCHECK(proxyState->ncclNet->test(subGroup->requests[step%NCCL_STEPS], &done, sizes));
 
 #if defined(ENABLE_NPKIT_NET_CHECK_LATENCY)
@@ -1481,10 +1770,11 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
           int totalSize = 0;
           int subIndex = 0;
           for (int i=0; i<NCCL_PROXY_MAX_SUBS; i++) totalSize += sizes[i];
+          ncclMetricsNetBytes(((struct recvNetResources*)subGroup->connection->transportResources)->netDev, false, totalSize);
           for (int i=0; i<subGroup->groupSize; i++) {
             struct ncclProxySubArgs* sub = subGroup + i;
 
-#if defined(ENABLE_NPKIT) && defined(ENABLE_NPKIT_EVENT_NET_RECV_ENTRY) && defined(ENABLE_NPKIT_EVENT_NET_RECV_EXIT)
+#if defined(ENABLE_NPKIT)
             NpKit::CollectCpuEvent(
                 NPKIT_EVENT_NET_RECV_EXIT,
 #if defined(ENABLE_NPKIT_NET_COLLECT_POLL_CNT)
@@ -1529,13 +1819,22 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
                 }
               }
             }
+            struct netProxyStats* stats = ((struct recvNetResources*)sub->connection->transportResources)->stats;
+            if (stats) {
+              uint64_t now = clockNano();
+              int buffSlot = (sub->base+sub->received)%NCCL_STEPS;
+              stats->netNs += now - stats->stepTime[buffSlot];
+              stats->bytes += sizes[i];
+              stats->stepTime[buffSlot] = now;
+            }
             sub->received += args->sliceSteps;
             sub->transSize += sizes[i];
             ncclProfilerRecordProxyOpEventState(s+i, args, sub->received, sub->transSize, ncclProfilerProxyOpRecvReceived);
             ncclProfilerRecordProxyStepEventStates(s+i, args, sub->received-args->sliceSteps, sub->received, ncclProfilerProxyStepRecvFlushWait);
             if (step < sub->nsteps) {
               struct recvNetResources* resources = (struct recvNetResources*) (sub->connection->transportResources);
-              if (resources->useGdr) needFlush |= resources->needFlush;
+              // Receives into host memory are visible to the GPU without a flush
+              if (resources->useGdr && !(sub->reg && sub->regHost)) needFlush |= resources->needFlush;
             }
           }
           subGroup->requests[step%NCCL_STEPS] = NULL;
@@ -1543,13 +1842,7 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
             // GDRCOPY support
             struct recvNetResources* resources = (struct recvNetResources*) (subGroup->connection->transportResources);
             if (resources->gdcFlush) {
-#if defined (__x86_64__)
-              // Force a PCI-E read from GPU memory
-              asm volatile ("mov (%0), %%eax" :: "l"(resources->gdcFlush) : "%eax");
-#else
-              WARN("NET: GDR Flush only supported on x86_64");
-              return ncclInternalError;
-#endif
+              wc_flush_read(resources->gdcFlush);
             } else {
               int subCount = 0;
               for (int i=0; i<subGroup->groupSize; i++) {
@@ -1582,11 +1875,21 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
         uint64_t step = subGroup->transmitted;
         int done = 1;
         void* request = subGroup->requests[step%NCCL_STEPS];
+#if defined(ENABLE_NPKIT)
+        NpKit::SetCpuChannel(subGroup->channelId);
+#endif
         if (request) NCCLCHECK(proxyState->ncclNet->test(request, &done, NULL));
         if (done) {
           for (int i=0; i<subGroup->groupSize; i++) {
             struct ncclProxySubArgs* sub = subGroup + i;
 
+            struct netProxyStats* stats = ((struct recvNetResources*)sub->connection->transportResources)->stats;
+            if (stats) {
+              uint64_t now = clockNano();
+              int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
+              stats->flushNs += now - stats->stepTime[buffSlot];
+              stats->stepTime[buffSlot] = now;
+            }
             sub->transmitted += args->sliceSteps;
             ncclProfilerRecordProxyOpEventState(s+i, args, sub->transmitted, sub->transSize, ncclProfilerProxyOpRecvTransmitted);
             ncclProfilerRecordProxyStepEventStates(s+i, args, sub->transmitted-args->sliceSteps, sub->transmitted, ncclProfilerProxyStepRecvGPUWait);
@@ -1626,6 +1929,11 @@ static ncclResult_t recvProxyProgress(struct ncclProxyState* proxyState, struct
                 NCCLCHECK(proxyState->ncclNet->irecvConsumed(resources->netRecvComm, subGroup->recvRequestsSubCount, subGroup->recvRequestsCache[sub->done%NCCL_STEPS]));
               subGroup->recvRequestsCache[sub->done%NCCL_STEPS] = NULL;
             }
+            if (resources->stats) {
+              uint64_t now = clockNano();
+              resources->stats->gpuWaitNs += now - resources->stats->stepTime[(sub->base+sub->done)%NCCL_STEPS];
+              netStatsStepDone(resources, 1, now);
+            }
             sub->done += args->sliceSteps;
             ncclProfilerStopProxyStepEvents(s+i, args, sub->done-args->sliceSteps, sub->done);
             ncclProfilerRecordProxyOpEventState(s+i, args, sub->done, sub->transSize, ncclProfilerProxyOpRecvDone);
@@ -11,6 +11,8 @@
 #include "graph.h"
 #include "utils.h"
 #include "param.h"
+#include "metrics.h"
+#include "async_error.h"
 
 #include <assert.h>
 #include <pthread.h>
@@ -25,6 +27,10 @@
 
 #include "ibvwrap.h"
 
+#if defined(ENABLE_NPKIT)
+#include "npkit/npkit.h"
+#endif
+
 #define MAXNAMESIZE 64
 static char ncclIbIfName[MAX_IF_NAME_SIZE+1];
 static union ncclSocketAddress ncclIbIfAddr;
@@ -34,11 +40,16 @@ struct ncclIbMr {
   size_t pages;
   int refs;
   ibv_mr *mr;
+  uintptr_t maxEnd; // Largest end of this slot and the ones before it, lookups stop below the end they need
+  unsigned long long bufferId; // CUDA buffer ID at addr when registered, 0 for host memory
+  uint64_t lastUse;
 };
 
+// Slots sorted by addr. Unreferenced CUDA MRs stay registered until NCCL_IB_MR_CACHE_MAX is reached
 struct ncclIbMrCache {
   struct ncclIbMr *slots;
   int capacity, population;
+  uint64_t useClock;
 };
 
 static int ncclNMergedIbDevs = -1;
@@ -67,6 +78,8 @@ struct alignas(64) ncclIbDev {
   ibv_context* context;
   int pdRefs;
   ibv_pd* pd;
+  int srqRefs;
+  struct ibv_srq* srq;
   char devName[MAXNAMESIZE];
   char* pciPath;
   int realPort;
@@ -90,12 +103,24 @@ NCCL_PARAM(IbTimeout, "IB_TIMEOUT", 20);
 NCCL_PARAM(IbRetryCnt, "IB_RETRY_CNT", 7);
 NCCL_PARAM(IbPkey, "IB_PKEY", 0);
 NCCL_PARAM(IbUseInline, "IB_USE_INLINE", 0);
+NCCL_PARAM(IbInlineSendMax, "IB_INLINE_SEND_MAX", 0);
+NCCL_PARAM(IbPostBatch, "IB_POST_BATCH", 1);
 NCCL_PARAM(IbSl, "IB_SL", 0);
 NCCL_PARAM(IbTc, "IB_TC", 0);
 NCCL_PARAM(IbArThreshold, "IB_AR_THRESHOLD", 8192);
 NCCL_PARAM(IbPciRelaxedOrdering, "IB_PCI_RELAXED_ORDERING", 2);
 NCCL_PARAM(IbAdaptiveRouting, "IB_ADAPTIVE_ROUTING", -2);
 NCCL_PARAM(IbFifoTc, "IB_FIFO_TC", 0);
+
+// Traffic class and service level of the comm whose connections the calling thread establishes,
+// -1 for NCCL_IB_TC and NCCL_IB_SL
+static thread_local int ncclIbQosTc = -1;
+static thread_local int ncclIbQosSl = -1;
+
+void ncclIbSetConnectQos(int trafficClass, int serviceLevel) {
+  ncclIbQosTc = trafficClass;
+  ncclIbQosSl = serviceLevel;
+}
 NCCL_PARAM(IbAsyncEvents,"IB_RETURN_ASYNC_EVENTS",1);
 NCCL_PARAM(IbEceEnable,"IB_ECE_ENABLE",1);
 
@@ -121,6 +146,13 @@ static void ncclIbCqFatalError(struct ibv_cq* cq) {
 }
 static void ncclIbDevFatalError(struct ncclIbDev* dev) {
   ncclIbStatsFatalError(&dev->stats);
+  if (!ncclParamIbAsyncEvents()) return;
+  // Comms learn it without waiting for their next operation on the device
+  for (int m = 0; m < ncclNMergedIbDevs; m++) {
+    for (int i = 0; i < ncclIbMergedDevs[m].ndevs; i++) {
+      if (ncclIbDevs + ncclIbMergedDevs[m].devs[i] == dev) ncclAsyncErrorNetFatal(m);
+    }
+  }
 }
 
 pthread_t ncclIbAsyncThread;
@@ -139,11 +171,13 @@ static void* ncclIbAsyncThreadMain(void* args) {
       // the above is device fatal error
       WARN("NET/IB : %s:%d async fatal event: %s", dev->devName, dev->portNum, str);
       ncclIbDevFatalError(dev);
+      ncclMetricsIbAsyncError(dev - ncclIbDevs, true);
       break;
     case IBV_EVENT_CQ_ERR:
       // the above is a CQ fatal error
       WARN("NET/IB : %s:%d async fatal event on CQ (%p): %s", dev->devName, dev->portNum, cq, str);
       ncclIbCqFatalError(cq);
+      ncclMetricsIbAsyncError(dev - ncclIbDevs, true);
       break;
     case IBV_EVENT_QP_FATAL:
     case IBV_EVENT_QP_REQ_ERR:
@@ -151,6 +185,7 @@ static void* ncclIbAsyncThreadMain(void* args) {
       // the above are QP fatal errors
       WARN("NET/IB : %s:%d async fatal event on QP (%p): %s", dev->devName, dev->portNum, qp, str);
       ncclIbQpFatalError(qp);
+      ncclMetricsIbAsyncError(dev - ncclIbDevs, true);
       break;
     case IBV_EVENT_SRQ_ERR:
       // SRQ are not used in NCCL
@@ -169,6 +204,7 @@ static void* ncclIbAsyncThreadMain(void* args) {
     case IBV_EVENT_SRQ_LIMIT_REACHED:
       // the above are non-fatal
       WARN("NET/IB : %s:%d Got async error event: %s", dev->devName, dev->portNum, str);
+      ncclMetricsIbAsyncError(dev - ncclIbDevs, false);
       break;
     case IBV_EVENT_COMM_EST:
       break;
@@ -573,12 +609,15 @@ build_ib_list:
           ncclIbDevs[ncclNIbDevs].context = context;
           ncclIbDevs[ncclNIbDevs].pdRefs = 0;
           ncclIbDevs[ncclNIbDevs].pd = NULL;
+          ncclIbDevs[ncclNIbDevs].srqRefs = 0;
+          ncclIbDevs[ncclNIbDevs].srq = NULL;
           strncpy(ncclIbDevs[ncclNIbDevs].devName, devices[d]->name, MAXNAMESIZE);
           NCCLCHECKGOTO(ncclIbGetPciPath(ncclIbDevs[ncclNIbDevs].devName, &ncclIbDevs[ncclNIbDevs].pciPath, &ncclIbDevs[ncclNIbDevs].realPort), ret, fail);
           ncclIbDevs[ncclNIbDevs].maxQp = devAttr.max_qp;
           ncclIbDevs[ncclNIbDevs].mrCache.capacity = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.population = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.slots = NULL;
+          ncclIbDevs[ncclNIbDevs].mrCache.useClock = 0;
           NCCLCHECK(ncclIbStatsInit(&ncclIbDevs[ncclNIbDevs].stats));
 
           // Enable ADAPTIVE_ROUTING by default on IB networks
@@ -589,6 +628,7 @@ build_ib_list:
           TRACE(NCCL_NET,"NET/IB: [%d] %s:%s:%d/%s speed=%d context=%p pciPath=%s ar=%d", d, devices[d]->name, devices[d]->dev_name, ncclIbDevs[ncclNIbDevs].portNum,
               portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND ? "IB" : "RoCE", ncclIbDevs[ncclNIbDevs].speed, context, ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[ncclNIbDevs].ar);
 
+          ncclMetricsIbDevice(ncclNIbDevs, devices[d]->name, port_num);
           PTHREADCHECKGOTO(pthread_create(&ncclIbAsyncThread, NULL, ncclIbAsyncThreadMain, ncclIbDevs + ncclNIbDevs), "pthread_create", ret, fail);
           ncclSetThreadName(ncclIbAsyncThread, "NCCL IbAsync %2d", ncclNIbDevs);
           PTHREADCHECKGOTO(pthread_detach(ncclIbAsyncThread), "pthread_detach", ret, fail); // will not be pthread_join()'d
@@ -815,6 +855,9 @@ struct ncclIbConnectionMetadata {
   char devName[MAX_MERGED_DEV_NAME];
   uint64_t fifoAddr;
   int ndevs;
+  // Chosen by the sender, the receiver uses them for its QPs too
+  int trafficClass;
+  int serviceLevel;
 };
 
 enum ncclIbCommState {
@@ -867,10 +910,22 @@ struct ncclIbRequest {
       void* data;
       uint32_t lkeys[NCCL_IB_MAX_DEVS_PER_NIC];
       int offset;
+      int host;
+      // Posted once the comm postSeq reaches it
+      uint64_t postSeq;
+      uint64_t postNs;
+      int devBytes[NCCL_IB_MAX_DEVS_PER_NIC]; // Chunk of each QP of the device
     } send;
     struct {
       int* sizes;
     } recv;
+    struct {
+      // Read on every device of the comm when posted
+      uint64_t addr;
+      uint32_t rkeys[NCCL_IB_MAX_DEVS_PER_NIC];
+      // Callers sharing the flush, the last one to see it done frees it
+      int refs;
+    } flush;
   };
 };
 
@@ -924,6 +979,7 @@ struct alignas(8) ncclIbSendCommDev {
 // Wrapper to track an MR per-device, if needed
 struct ncclIbMrHandle {
   ibv_mr* mrs[NCCL_IB_MAX_DEVS_PER_NIC];
+  int host;
 };
 
 struct alignas(32) ncclIbNetCommBase {
@@ -941,8 +997,15 @@ struct alignas(32) ncclIbNetCommBase {
   struct ncclIbDevInfo remDevs[NCCL_IB_MAX_DEVS_PER_NIC];
   // statistics about the comm
   struct ncclIbStats stats;
+  // Traffic class and service level of the QPs
+  int trafficClass;
+  int serviceLevel;
 };
 
+// Enough for 8 multi-sends on 4 QPs of 2 WRs each
+#define NCCL_IB_MAX_PENDING_WRS 64
+#define NCCL_IB_SPLIT_SCALE 1024
+
 struct ncclIbSendComm {
   struct ncclIbNetCommBase base;
   // Start with fifo and ibv structs as they have alignment restrictions
@@ -955,6 +1018,18 @@ struct ncclIbSendComm {
   struct ncclIbRemSizesFifo remSizesFifo;
   uint64_t fifoHead;
   int ar; // Use adaptive routing when all merged devices have it enabled
+  // Send WRs deferred by ncclIbMultiSend, posted once per QP by ncclIbPostPending
+  struct ibv_send_wr pendingWrs[NCCL_IB_MAX_PENDING_WRS];
+  struct ibv_sge pendingSges[NCCL_IB_MAX_PENDING_WRS];
+  struct ncclIbQp* pendingQps[NCCL_IB_MAX_PENDING_WRS];
+  int nPendingWrs;
+  int nPendingSends;
+  uint64_t postSeq;
+  struct ncclIbSendComm* pendingNext;
+  int inPendingList;
+  // Part of each send given to each device, out of NCCL_IB_SPLIT_SCALE
+  int devShare[NCCL_IB_MAX_DEVS_PER_NIC];
+  double devNsPerByte[NCCL_IB_MAX_DEVS_PER_NIC];
 };
 // The SendFifo needs to be 32-byte aligned and each element needs
 // to be a 32-byte multiple, so that an entry does not get split and
@@ -985,6 +1060,15 @@ struct alignas(16) ncclIbRecvCommDev {
   struct ibv_mr* fifoMr;
   struct ibv_sge fifoSge;
   struct ibv_mr* sizesFifoMr;
+  struct ibv_srq* srq;
+};
+
+// Recvs of a QP fed by an SRQ, in the order they were posted, which is the order their
+// RDMA_WRITE_WITH_IMM complete in
+struct ncclIbSrqQueue {
+  uint8_t reqs[MAX_REQUESTS];
+  uint32_t head;
+  uint32_t tail;
 };
 
 struct ncclIbRecvComm {
@@ -994,10 +1078,16 @@ struct ncclIbRecvComm {
   int sizesFifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
   int gpuFlushHostMem;
   int flushEnabled;
+  struct ncclIbSrqQueue* srqQueues; // One per QP when NCCL_IB_SRQ_SIZE is set
+  // Flush shared by the receives completed in this progress pass, posted by ncclIbPostFlush
+  struct ncclIbRequest* pendingFlush;
+  struct ncclIbRecvComm* flushNext;
+  int inFlushList;
 };
 static_assert((offsetof(struct ncclIbRecvComm, remFifo) % 32) == 0, "ncclIbRecvComm fifo must be 32-byte aligned");
 
 NCCL_PARAM(IbQpsPerConn, "IB_QPS_PER_CONNECTION", 1);
+NCCL_PARAM(IbSrqSize, "IB_SRQ_SIZE", 0);
 
 static void ncclIbAddEvent(struct ncclIbRequest* req, int devIndex, struct ncclIbNetCommDevBase* base) {
   req->events[devIndex]++;
@@ -1025,12 +1115,16 @@ ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base
   return ncclSuccess;
 }
 
+static ncclResult_t ncclIbMrCacheTrim(struct ncclIbMrCache* cache, int max);
+
 ncclResult_t ncclIbDestroyBase(struct ncclIbNetCommDevBase* base) {
   ncclResult_t res;
   NCCLCHECK(wrap_ibv_destroy_cq(base->cq));
 
   pthread_mutex_lock(&ncclIbDevs[base->ibDevN].lock);
   if (0 == --ncclIbDevs[base->ibDevN].pdRefs) {
+    // Cached MRs hold the PD
+    NCCLCHECKGOTO(ncclIbMrCacheTrim(&ncclIbDevs[base->ibDevN].mrCache, 0), res, returning);
     NCCLCHECKGOTO(wrap_ibv_dealloc_pd(ncclIbDevs[base->ibDevN].pd), res, returning);
   }
   res = ncclSuccess;
@@ -1039,7 +1133,50 @@ returning:
   return res;
 }
 
-ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base, int access_flags, void* qp_context, struct ncclIbQp* qp) {
+// One SRQ per device holds the receive WRs of all the recv comms using it, it is refilled as
+// completions consume them
+static ncclResult_t ncclIbSrqAcquire(int ibDevN, struct ibv_srq** srq) {
+  ncclResult_t res = ncclSuccess;
+  ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  pthread_mutex_lock(&ibDev->lock);
+  if (0 == ibDev->srqRefs) {
+    struct ibv_srq_init_attr srqInitAttr;
+    memset(&srqInitAttr, 0, sizeof(srqInitAttr));
+    srqInitAttr.attr.max_wr = ncclParamIbSrqSize();
+    srqInitAttr.attr.max_sge = 1;
+    NCCLCHECKGOTO(wrap_ibv_create_srq(&ibDev->srq, ibDev->pd, &srqInitAttr), res, returning);
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    struct ibv_recv_wr* bad_wr;
+    for (int i = 0; i < srqInitAttr.attr.max_wr; i++) {
+      if ((res = wrap_ibv_post_srq_recv(ibDev->srq, &wr, &bad_wr)) != ncclSuccess) {
+        (void) wrap_ibv_destroy_srq(ibDev->srq);
+        ibDev->srq = NULL;
+        goto returning;
+      }
+    }
+    INFO(NCCL_NET, "NET/IB : %s:%d shares an SRQ of %d WRs between its receive QPs", ibDev->devName, ibDev->portNum, srqInitAttr.attr.max_wr);
+  }
+  ibDev->srqRefs++;
+  *srq = ibDev->srq;
+returning:
+  pthread_mutex_unlock(&ibDev->lock);
+  return res;
+}
+
+static ncclResult_t ncclIbSrqRelease(int ibDevN) {
+  ncclResult_t res = ncclSuccess;
+  ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  pthread_mutex_lock(&ibDev->lock);
+  if (0 == --ibDev->srqRefs) {
+    res = wrap_ibv_destroy_srq(ibDev->srq);
+    ibDev->srq = NULL;
+  }
+  pthread_mutex_unlock(&ibDev->lock);
+  return res;
+}
+
+ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base, int access_flags, void* qp_context, struct ncclIbQp* qp, struct ibv_srq* srq = NULL) {
   struct ibv_qp_init_attr qpInitAttr;
   memset(&qpInitAttr, 0, sizeof(struct ibv_qp_init_attr));
   qpInitAttr.qp_context = qp_context;
@@ -1048,10 +1185,11 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
   qpInitAttr.qp_type = IBV_QPT_RC;
   // We might send 2 messages per send (RDMA and RDMA_WITH_IMM)
   qpInitAttr.cap.max_send_wr = 2*MAX_REQUESTS;
-  qpInitAttr.cap.max_recv_wr = MAX_REQUESTS;
+  qpInitAttr.srq = srq;
+  qpInitAttr.cap.max_recv_wr = srq ? 0 : MAX_REQUESTS;
   qpInitAttr.cap.max_send_sge = 1;
   qpInitAttr.cap.max_recv_sge = 1;
-  qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? sizeof(struct ncclIbSendFifo) : 0;
+  qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? std::max((int64_t)sizeof(struct ncclIbSendFifo), ncclParamIbInlineSendMax()) : 0;
   NCCLCHECK(wrap_ibv_create_qp(&qp->qp, base->pd, &qpInitAttr));
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
@@ -1063,7 +1201,8 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, struct ncclIbGidInfo* sGidInfo, uint32_t dest_qp_num, struct ncclIbDevInfo* info, bool override_tc) {
+ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, struct ncclIbGidInfo* sGidInfo, uint32_t dest_qp_num, struct ncclIbDevInfo* info, bool override_tc,
+    int trafficClass, int serviceLevel) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
   qpAttr.qp_state = IBV_QPS_RTR;
@@ -1082,7 +1221,7 @@ ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, struct ncclIbGidInfo* sGidInfo, uint
     if(ncclParamIbFifoTc() && override_tc) {
       qpAttr.ah_attr.grh.traffic_class = ncclParamIbFifoTc();
     } else {
-      qpAttr.ah_attr.grh.traffic_class = ncclParamIbTc();
+      qpAttr.ah_attr.grh.traffic_class = trafficClass;
     }
   } else {
     //pick lid if subnet prefixs are same, FLID if they are not
@@ -1105,7 +1244,7 @@ ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, struct ncclIbGidInfo* sGidInfo, uint
 	qpAttr.ah_attr.grh.hop_limit = 255;
     }
   }
-  qpAttr.ah_attr.sl = ncclParamIbSl();
+  qpAttr.ah_attr.sl = serviceLevel;
   qpAttr.ah_attr.src_path_bits = 0;
   qpAttr.ah_attr.port_num = info->ib_port;
   NCCLCHECK(wrap_ibv_modify_qp(qp, &qpAttr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER));
@@ -1166,6 +1305,8 @@ ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm, ncclNet
 
   NCCLCHECK(ncclIbMalloc((void**)&comm, sizeof(struct ncclIbSendComm)));
   NCCLCHECKGOTO(ncclIbStatsInit(&comm->base.stats), ret, fail);
+  comm->base.trafficClass = ncclIbQosTc >= 0 ? ncclIbQosTc : ncclParamIbTc();
+  comm->base.serviceLevel = ncclIbQosSl >= 0 ? ncclIbQosSl : ncclParamIbSl();
   NCCLCHECKGOTO(ncclSocketInit(&comm->base.sock, &handle->connectAddr, handle->magic, ncclSocketTypeNetIb, NULL, 1), ret, fail);
   stage->comm = comm;
   stage->state = ncclIbCommStateConnect;
@@ -1189,10 +1330,13 @@ ib_connect_check:
     int ibDevN = mergedDev->devs[i];
     NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &comm->devs[i].base, &comm->base.stats), ret, fail);
     comm->ar = comm->ar && ncclIbDevs[dev].ar; // ADAPTIVE_ROUTING - if all merged devs have it enabled
+    comm->devShare[i] = NCCL_IB_SPLIT_SCALE / mergedDev->ndevs;
   }
 
   struct ncclIbConnectionMetadata meta;
   meta.ndevs = comm->base.ndevs;
+  meta.trafficClass = comm->base.trafficClass;
+  meta.serviceLevel = comm->base.serviceLevel;
 
   // Alternate QPs between devices
   int devIndex;
@@ -1327,7 +1471,7 @@ ib_connect:
     if (remQpInfo->ece_supported)
       NCCLCHECKGOTO(wrap_ibv_set_ece(qp, &remQpInfo->ece, &remQpInfo->ece_supported), ret, fail);
 
-    NCCLCHECKGOTO(ncclIbRtrQp(qp, &commDev->base.gidInfo, remQpInfo->qpn, remDevInfo, false), ret, fail);
+    NCCLCHECKGOTO(ncclIbRtrQp(qp, &commDev->base.gidInfo, remQpInfo->qpn, remDevInfo, false, comm->base.trafficClass, comm->base.serviceLevel), ret, fail);
     NCCLCHECKGOTO(ncclIbRtsQp(qp), ret, fail);
   }
 
@@ -1414,6 +1558,8 @@ ib_recv:
   rComm->base.ndevs = mergedDev->ndevs;
   rComm->base.nqps  = ncclParamIbQpsPerConn() * rComm->base.ndevs; // We must have at least 1 qp per-device
   rComm->base.isSend = false;
+  rComm->base.trafficClass = remMeta.trafficClass;
+  rComm->base.serviceLevel = remMeta.serviceLevel;
 
   rComm->base.nRemDevs = remMeta.ndevs;
   if (rComm->base.nRemDevs != rComm->base.ndevs) {
@@ -1427,6 +1573,7 @@ ib_recv:
     rCommDev = rComm->devs + i;
     ibDevN = mergedDev->devs[i];
     NCCLCHECKGOTO(ncclIbInitCommDevBase(ibDevN, &rCommDev->base, &rComm->base.stats), ret, fail);
+    if (ncclParamIbSrqSize() > 0) NCCLCHECKGOTO(ncclIbSrqAcquire(ibDevN, &rCommDev->srq), ret, fail);
     ibDev = ncclIbDevs + ibDevN;
     NCCLCHECKGOTO(ncclIbGetGidIndex(ibDev->context, ibDev->portNum, &ibDev->portAttr, &rCommDev->base.gidInfo.localGidIndex), ret, fail);
     NCCLCHECKGOTO(wrap_ibv_query_gid(ibDev->context, ibDev->portNum, rCommDev->base.gidInfo.localGidIndex, &rCommDev->base.gidInfo.localGid), ret, fail);
@@ -1439,6 +1586,8 @@ ib_recv:
     rComm->base.remDevs[i].remoteGid.global.subnet_prefix = rComm->base.remDevs[i].gid.global.subnet_prefix;
   }
 
+  if (ncclParamIbSrqSize() > 0) NCCLCHECKGOTO(ncclCalloc(&rComm->srqQueues, rComm->base.nqps), ret, fail);
+
   // Stripe QP creation across merged devs
   // Make sure to get correct remote peer dev and QP info
   int remDevIndex;
@@ -1454,7 +1603,7 @@ ib_recv:
     // Local ibDevN
     ibDevN = rComm->devs[devIndex].base.ibDevN;
     ibDev = ncclIbDevs + ibDevN;
-    NCCLCHECKGOTO(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, &rComm->base.stats, qp), ret, fail);
+    NCCLCHECKGOTO(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, &rComm->base.stats, qp, rCommDev->srq), ret, fail);
     qp->devIndex = devIndex;
     devIndex = (devIndex + 1) % rComm->base.ndevs;
 
@@ -1472,7 +1621,8 @@ ib_recv:
     }
 
     bool override_tc = (q == 0) ? true : false;
-    NCCLCHECKGOTO(ncclIbRtrQp(qp->qp, &rCommDev->base.gidInfo, remMeta.qpInfo[q].qpn, remDevInfo, override_tc), ret, fail);
+    NCCLCHECKGOTO(ncclIbRtrQp(qp->qp, &rCommDev->base.gidInfo, remMeta.qpInfo[q].qpn, remDevInfo, override_tc,
+      rComm->base.trafficClass, rComm->base.serviceLevel), ret, fail);
     NCCLCHECKGOTO(ncclIbRtsQp(qp->qp), ret, fail);
   }
 
@@ -1505,7 +1655,8 @@ ib_recv:
       devInfo.gid.global.subnet_prefix        = rCommDev->base.gidInfo.localGid.global.subnet_prefix;
       devInfo.gid.global.interface_id         = rCommDev->base.gidInfo.localGid.global.interface_id;
       devInfo.mtu         = ibDev->portAttr.active_mtu;
-      NCCLCHECKGOTO(ncclIbRtrQp(rCommDev->gpuFlush.qp.qp, &rCommDev->base.gidInfo, rCommDev->gpuFlush.qp.qp->qp_num, &devInfo, false), ret, fail);
+      NCCLCHECKGOTO(ncclIbRtrQp(rCommDev->gpuFlush.qp.qp, &rCommDev->base.gidInfo, rCommDev->gpuFlush.qp.qp->qp_num, &devInfo, false,
+        rComm->base.trafficClass, rComm->base.serviceLevel), ret, fail);
       NCCLCHECKGOTO(ncclIbRtsQp(rCommDev->gpuFlush.qp.qp), ret, fail);
     }
 
@@ -1532,6 +1683,8 @@ ib_recv:
   }
 
   meta.ndevs = rComm->base.ndevs;
+  meta.trafficClass = rComm->base.trafficClass;
+  meta.serviceLevel = rComm->base.serviceLevel;
   strncpy(meta.devName, mergedDev->devName, MAX_MERGED_DEV_NAME);
 
   stage->state = ncclIbCommStateSend;
@@ -1593,54 +1746,138 @@ ncclResult_t ncclIbFreeRequest(struct ncclIbRequest* r) {
 
 ncclResult_t ncclIbTest(void* request, int* done, int* size);
 
+NCCL_PARAM(IbMrCacheMax, "IB_MR_CACHE_MAX", 1024);
+
+// The allocation of CUDA memory at addr, which changes when the memory is freed and allocated again
+static unsigned long long ncclIbBufferId(uintptr_t addr) {
+  unsigned long long bufferId = 0;
+  if (CUPFN(cuPointerGetAttribute) == NULL ||
+      CUPFN(cuPointerGetAttribute(&bufferId, CU_POINTER_ATTRIBUTE_BUFFER_ID, (CUdeviceptr)addr)) != CUDA_SUCCESS) return 0;
+  return bufferId;
+}
+
+static void ncclIbMrCacheFixMaxEnd(struct ncclIbMrCache* cache, int from) {
+  for (int i = from; i < cache->population; i++) {
+    uintptr_t end = cache->slots[i].addr + cache->slots[i].pages*sysconf(_SC_PAGESIZE);
+    cache->slots[i].maxEnd = i == 0 ? end : std::max(end, cache->slots[i-1].maxEnd);
+  }
+}
+
+static ncclResult_t ncclIbMrCacheRemove(struct ncclIbMrCache* cache, int slot) {
+  ibv_mr* mr = cache->slots[slot].mr;
+  memmove(cache->slots+slot, cache->slots+slot+1, (cache->population-slot-1)*sizeof(struct ncclIbMr));
+  cache->population--;
+  ncclIbMrCacheFixMaxEnd(cache, slot);
+  if (cache->population == 0) {
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->capacity = 0;
+  }
+  NCCLCHECK(wrap_ibv_dereg_mr(mr));
+  return ncclSuccess;
+}
+
+// Drop unreferenced MRs, oldest first, while the cache holds more than max of them
+static ncclResult_t ncclIbMrCacheTrim(struct ncclIbMrCache* cache, int max) {
+  while (cache->population > max) {
+    int lru = -1;
+    for (int i = 0; i < cache->population; i++) {
+      if (cache->slots[i].refs == 0 && (lru == -1 || cache->slots[i].lastUse < cache->slots[lru].lastUse)) lru = i;
+    }
+    if (lru == -1) break;
+    NCCLCHECK(ncclIbMrCacheRemove(cache, lru));
+  }
+  return ncclSuccess;
+}
+
+// Binary search the slots starting at or below addr, then walk down while one of them can still
+// reach end. Slots of freed CUDA memory are dropped on the way when nobody uses them.
+static ncclResult_t ncclIbMrCacheFind(struct ncclIbMrCache* cache, uintptr_t addr, uintptr_t end, unsigned long long bufferId, int* found) {
+  *found = -1;
+  int lo = 0, hi = cache->population;
+  while (lo < hi) {
+    int mid = (lo+hi)/2;
+    if (cache->slots[mid].addr <= addr) lo = mid+1; else hi = mid;
+  }
+  for (int i = lo-1; i >= 0 && cache->slots[i].maxEnd >= end; i--) {
+    struct ncclIbMr* slot = cache->slots+i;
+    if (slot->addr + slot->pages*sysconf(_SC_PAGESIZE) < end) continue;
+    if (slot->bufferId != bufferId) {
+      if (slot->refs == 0 && slot->bufferId != 0) NCCLCHECK(ncclIbMrCacheRemove(cache, i));
+      continue;
+    }
+    *found = i;
+    return ncclSuccess;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbRegMrDmaBufInternal(ncclIbNetCommDevBase* base, void* data, size_t size, int type, uint64_t offset, int fd, ibv_mr** mhandle) {
   static __thread uintptr_t pageSize = 0;
   if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
   struct ncclIbMrCache* cache = &ncclIbDevs[base->ibDevN].mrCache;
   uintptr_t addr = (uintptr_t)data & -pageSize;
   size_t pages = ((uintptr_t)data + size - addr + pageSize-1)/pageSize;
+  unsigned long long bufferId = type == NCCL_PTR_CUDA ? ncclIbBufferId((uintptr_t)data) : 0;
+  int slot;
   ncclResult_t res;
   pthread_mutex_lock(&ncclIbDevs[base->ibDevN].lock);
-  for (int slot=0; /*true*/; slot++) {
-    if (slot == cache->population || addr < cache->slots[slot].addr) { // didn't find in cache
-      if (cache->population == cache->capacity) { // must grow cache
-        cache->capacity = cache->capacity < 32 ? 32 : 2*cache->capacity;
-        NCCLCHECKGOTO(ncclRealloc(&cache->slots, cache->population, cache->capacity), res, returning);
+  NCCLCHECKGOTO(ncclIbMrCacheFind(cache, addr, addr+pages*pageSize, bufferId, &slot), res, returning);
+  if (slot == -1) {
+    // Cover the registrations of the same memory this one overlaps, so that the next lookups in
+    // any of them hit this MR. DMA-BUF offsets are tied to the range, those are not merged.
+    if (fd == -1) {
+      uintptr_t end = addr + pages*pageSize;
+      for (int i = 0; i < cache->population && cache->slots[i].addr < end; i++) {
+        uintptr_t slotEnd = cache->slots[i].addr + cache->slots[i].pages*pageSize;
+        if (slotEnd <= addr || cache->slots[i].bufferId != bufferId) continue;
+        addr = std::min(addr, cache->slots[i].addr);
+        end = std::max(end, slotEnd);
       }
-      // Deregister / register
-      struct ibv_mr* mr;
-      unsigned int flags = IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ;
-      if (ncclIbRelaxedOrderingEnabled) flags |= IBV_ACCESS_RELAXED_ORDERING;
-      if (fd != -1) {
-        /* DMA-BUF support */
-        NCCLCHECKGOTO(wrap_ibv_reg_dmabuf_mr(&mr, base->pd, offset, pages*pageSize, addr, fd, flags), res, returning);
-      } else {
-        if (ncclIbRelaxedOrderingEnabled) {
-          // Use IBVERBS_1.8 API - needed for IBV_ACCESS_RELAXED_ORDERING support
-          NCCLCHECKGOTO(wrap_ibv_reg_mr_iova2(&mr, base->pd, (void*)addr, pages*pageSize, addr, flags), res, returning);
-        }
-        else {
-          NCCLCHECKGOTO(wrap_ibv_reg_mr(&mr, base->pd, (void*)addr, pages*pageSize, flags), res, returning);
-        }
+      pages = (end-addr)/pageSize;
+    }
+    // Deregister / register
+    struct ibv_mr* mr;
+    unsigned int flags = IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ;
+    if (ncclIbRelaxedOrderingEnabled) flags |= IBV_ACCESS_RELAXED_ORDERING;
+    if (fd != -1) {
+      /* DMA-BUF support */
+      NCCLCHECKGOTO(wrap_ibv_reg_dmabuf_mr(&mr, base->pd, offset, pages*pageSize, addr, fd, flags), res, returning);
+    } else {
+      if (ncclIbRelaxedOrderingEnabled) {
+        // Use IBVERBS_1.8 API - needed for IBV_ACCESS_RELAXED_ORDERING support
+        NCCLCHECKGOTO(wrap_ibv_reg_mr_iova2(&mr, base->pd, (void*)addr, pages*pageSize, addr, flags), res, returning);
+      }
+      else {
+        NCCLCHECKGOTO(wrap_ibv_reg_mr(&mr, base->pd, (void*)addr, pages*pageSize, flags), res, returning);
       }
-      TRACE(NCCL_INIT|NCCL_NET,"regAddr=0x%lx size=%lld rkey=0x%x lkey=0x%x fd=%d", (unsigned long)addr, (long long)pages*pageSize, mr->rkey, mr->lkey, fd);
-      if (slot != cache->population) memmove(cache->slots+slot+1, cache->slots+slot, (cache->population-slot)*sizeof(struct ncclIbMr));
-      cache->slots[slot].addr = addr;
-      cache->slots[slot].pages = pages;
-      cache->slots[slot].refs = 1;
-      cache->slots[slot].mr = mr;
-      cache->population += 1;
-      *mhandle = mr;
-      res = ncclSuccess;
-      goto returning;
-    } else if ((addr >= cache->slots[slot].addr) &&
-        ((addr-cache->slots[slot].addr)/pageSize+pages) <= cache->slots[slot].pages) {
-      cache->slots[slot].refs += 1;
-      *mhandle = cache->slots[slot].mr;
-      res = ncclSuccess;
-      goto returning;
     }
-  }
+    TRACE(NCCL_INIT|NCCL_NET,"regAddr=0x%lx size=%lld rkey=0x%x lkey=0x%x fd=%d", (unsigned long)addr, (long long)pages*pageSize, mr->rkey, mr->lkey, fd);
+    // The merged registrations nobody uses are covered by the new one
+    for (int i = cache->population-1; i >= 0; i--) {
+      struct ncclIbMr* old = cache->slots+i;
+      if (old->refs == 0 && old->bufferId == bufferId && old->addr >= addr && old->addr + old->pages*pageSize <= addr + pages*pageSize) {
+        NCCLCHECKGOTO(ncclIbMrCacheRemove(cache, i), res, returning);
+      }
+    }
+    if (cache->population == cache->capacity) { // must grow cache
+      cache->capacity = cache->capacity < 32 ? 32 : 2*cache->capacity;
+      NCCLCHECKGOTO(ncclRealloc(&cache->slots, cache->population, cache->capacity), res, returning);
+    }
+    for (slot = 0; slot < cache->population && cache->slots[slot].addr <= addr; slot++);
+    if (slot != cache->population) memmove(cache->slots+slot+1, cache->slots+slot, (cache->population-slot)*sizeof(struct ncclIbMr));
+    cache->slots[slot].addr = addr;
+    cache->slots[slot].pages = pages;
+    cache->slots[slot].refs = 0;
+    cache->slots[slot].mr = mr;
+    cache->slots[slot].bufferId = bufferId;
+    cache->population += 1;
+    ncclIbMrCacheFixMaxEnd(cache, slot);
+  }
+  cache->slots[slot].refs += 1;
+  cache->slots[slot].lastUse = ++cache->useClock;
+  *mhandle = cache->slots[slot].mr;
+  res = ncclSuccess;
 returning:
   pthread_mutex_unlock(&ncclIbDevs[base->ibDevN].lock);
   return res;
@@ -1662,6 +1899,7 @@ ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, ui
   assert(size > 0);
   struct ncclIbNetCommBase* base = (struct ncclIbNetCommBase*) comm;
   struct ncclIbMrHandle* mhandleWrapper = (struct ncclIbMrHandle*) malloc(sizeof(struct ncclIbMrHandle));
+  mhandleWrapper->host = type == NCCL_PTR_HOST;
   for (int i = 0; i < base->ndevs; i++) {
     // Each ncclIbNetCommDevBase is at different offset in send and recv netComms
     struct ncclIbNetCommDevBase* devComm = ncclIbGetNetCommDevBase(base, i);
@@ -1686,13 +1924,12 @@ ncclResult_t ncclIbDeregMrInternal(ncclIbNetCommDevBase* base, ibv_mr* mhandle)
   for (int i=0; i < cache->population; i++) {
     if (mhandle == cache->slots[i].mr) {
       if (0 == --cache->slots[i].refs) {
-        memmove(&cache->slots[i], &cache->slots[--cache->population], sizeof(struct ncclIbMr));
-        if (cache->population == 0) {
-          free(cache->slots);
-          cache->slots = NULL;
-          cache->capacity = 0;
+        // Host pages can be freed and mapped again behind our back, only CUDA memory can be checked
+        if (cache->slots[i].bufferId == 0 || ncclParamIbMrCacheMax() <= 0) {
+          NCCLCHECKGOTO(ncclIbMrCacheRemove(cache, i), res, returning);
+        } else {
+          NCCLCHECKGOTO(ncclIbMrCacheTrim(cache, ncclParamIbMrCacheMax()), res, returning);
         }
-        NCCLCHECKGOTO(wrap_ibv_dereg_mr(mhandle), res, returning);
       }
       res = ncclSuccess;
       goto returning;
@@ -1718,6 +1955,139 @@ ncclResult_t ncclIbDeregMr(void* comm, void* mhandle) {
 }
 
 NCCL_PARAM(IbSplitDataOnQps, "IB_SPLIT_DATA_ON_QPS", 0);
+NCCL_PARAM(IbAdaptiveSplit, "IB_ADAPTIVE_SPLIT", 0);
+
+// Chunks below this complete in about the same time on any device, their latency says nothing of the load
+#define NCCL_IB_SPLIT_MIN_BYTES (64*1024)
+
+// Fold the completion time of the chunk req sent through dev into the rate of dev, and give each
+// device a part of the next sends that goes as its rate
+static void ncclIbSplitSample(struct ncclIbSendComm* comm, struct ncclIbRequest* req, int dev) {
+  int bytes = req->send.devBytes[dev];
+  if (comm->base.ndevs < 2 || bytes < NCCL_IB_SPLIT_MIN_BYTES) return;
+  double nsPerByte = (double)(clockNano() - req->send.postNs) / bytes;
+  double* avg = comm->devNsPerByte + dev;
+  *avg = *avg == 0 ? nsPerByte : 0.875 * *avg + 0.125 * nsPerByte;
+
+  double rates[NCCL_IB_MAX_DEVS_PER_NIC];
+  double sum = 0;
+  for (int d = 0; d < comm->base.ndevs; d++) {
+    if (comm->devNsPerByte[d] == 0) return;
+    rates[d] = 1.0 / comm->devNsPerByte[d];
+    sum += rates[d];
+  }
+  // Keep a floor so that a congested device still gets samples and can win its share back
+  const int minShare = NCCL_IB_SPLIT_SCALE / 16;
+  int left = NCCL_IB_SPLIT_SCALE;
+  for (int d = 0; d < comm->base.ndevs; d++) {
+    int share = d == comm->base.ndevs - 1 ? left : (int)(NCCL_IB_SPLIT_SCALE * rates[d] / sum);
+    share = std::max(minShare, std::min(share, left - minShare * (comm->base.ndevs - 1 - d)));
+    left -= share;
+#if defined(ENABLE_NPKIT)
+    if (share != comm->devShare[d]) {
+      NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_SPLIT, share, NPKIT_NET_IB_QP_ID(comm->devs[d].base.ibDevN, d, NPKIT_NET_IB_NO_QP),
+          *(volatile uint64_t*)NpKit::GetCpuTimestamp(), NpKit::GetCpuChannel());
+    }
+#endif
+    comm->devShare[d] = share;
+  }
+}
+
+// Send comms of this thread with deferred WRs
+static __thread struct ncclIbSendComm* ncclIbPendingComms = NULL;
+// Set while ncclIbIsendv posts a vector, whose sends are all deferred
+static __thread int ncclIbInVector = 0;
+
+// Ring one doorbell per QP for all the WRs deferred on comm, keeping the order of each QP
+static ncclResult_t ncclIbPostPending(struct ncclIbSendComm* comm) {
+  for (int i = 0; i < comm->nPendingWrs; i++) {
+    struct ncclIbQp* qp = comm->pendingQps[i];
+    if (qp == NULL) continue;
+    struct ibv_send_wr* tail = comm->pendingWrs+i;
+    for (int j = i+1; j < comm->nPendingWrs; j++) {
+      if (comm->pendingQps[j] != qp) continue;
+      tail->next = comm->pendingWrs+j;
+      tail = tail->next;
+      comm->pendingQps[j] = NULL;
+    }
+    tail->next = NULL;
+    struct ibv_send_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_send(qp->qp, comm->pendingWrs+i, &bad_wr));
+  }
+  comm->nPendingWrs = 0;
+  comm->nPendingSends = 0;
+  comm->postSeq++;
+  return ncclSuccess;
+}
+
+// Recv comms of this thread with a GPU flush not posted yet
+static __thread struct ncclIbRecvComm* ncclIbFlushComms = NULL;
+
+// One RDMA read per device covers every receive completed on it before the read is posted
+static ncclResult_t ncclIbPostGpuFlush(struct ncclIbRecvComm* comm) {
+  struct ncclIbRequest* req = comm->pendingFlush;
+  comm->pendingFlush = NULL;
+  // We don't know which devIndex the recvs were on, so we flush on all devices
+  for (int i = 0; i < comm->base.ndevs; i++) {
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = req - comm->base.reqs;
+
+    wr.wr.rdma.remote_addr = req->flush.addr;
+    wr.wr.rdma.rkey = req->flush.rkeys[i];
+    wr.sg_list = &comm->devs[i].gpuFlush.sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+
+    TIME_START(4);
+    struct ibv_send_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_send(comm->devs[i].gpuFlush.qp.qp, &wr, &bad_wr));
+    TIME_STOP(4);
+
+    ncclIbAddEvent(req, i, &comm->devs[i].base);
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbPostFlush() {
+  ncclResult_t ret = ncclSuccess;
+  while (ncclIbPendingComms) {
+    struct ncclIbSendComm* comm = ncclIbPendingComms;
+    ncclIbPendingComms = comm->pendingNext;
+    comm->inPendingList = 0;
+    if (comm->nPendingWrs && ret == ncclSuccess) ret = ncclIbPostPending(comm);
+  }
+  while (ncclIbFlushComms) {
+    struct ncclIbRecvComm* comm = ncclIbFlushComms;
+    ncclIbFlushComms = comm->flushNext;
+    comm->inFlushList = 0;
+    if (comm->pendingFlush && ret == ncclSuccess) ret = ncclIbPostGpuFlush(comm);
+  }
+  return ret;
+}
+
+// Copy the chain starting at wrs, which ncclIbMultiSend reuses for the next QP
+static ncclResult_t ncclIbDeferSend(struct ncclIbSendComm* comm, struct ncclIbQp* qp, struct ibv_send_wr* wrs) {
+  int n = 0;
+  for (struct ibv_send_wr* wr = wrs; wr; wr = wr->next) n++;
+  if (comm->nPendingWrs + n > NCCL_IB_MAX_PENDING_WRS) NCCLCHECK(ncclIbPostPending(comm));
+  for (struct ibv_send_wr* wr = wrs; wr; wr = wr->next) {
+    int i = comm->nPendingWrs++;
+    comm->pendingWrs[i] = *wr;
+    if (wr->sg_list) {
+      comm->pendingSges[i] = *wr->sg_list;
+      comm->pendingWrs[i].sg_list = comm->pendingSges+i;
+    }
+    comm->pendingQps[i] = qp;
+  }
+  if (comm->inPendingList == 0) {
+    comm->pendingNext = ncclIbPendingComms;
+    ncclIbPendingComms = comm;
+    comm->inPendingList = 1;
+  }
+  return ncclSuccess;
+}
 
 ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
   struct ncclIbRequest** reqs = comm->fifoReqs[slot];
@@ -1774,10 +2144,17 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
   // Multi-QP: make sure IB writes are multiples of 128B so that LL and LL128 protocols still work
   const int align = 128;
   int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+  int inlineMax = ncclParamIbUseInline() ? ncclParamIbInlineSendMax() : 0;
+  int defer = ncclParamIbPostBatch() > 1 || ncclIbInVector;
+  int adaptive = ncclParamIbAdaptiveSplit() && comm->base.ndevs > 1;
+  int devQps[NCCL_IB_MAX_DEVS_PER_NIC] = {0};
+  for (int i = 0; i < nqps; i++) devQps[comm->base.qps[(comm->base.qpIndex+i) % comm->base.nqps].devIndex]++;
+  uint64_t postNs = adaptive ? clockNano() : 0;
   for (int i = 0; i < nqps; i++) {
     int qpIndex = comm->base.qpIndex;
     ncclIbQp* qp = comm->base.qps + qpIndex;
     int devIndex = qp->devIndex;
+    int chunkSizes[NCCL_NET_IB_MAX_RECVS];
     for (int r=0; r<nreqs; r++) {
       // Track this event for completion
       //ncclIbAddEvent(reqs[r], devIndex, &comm->devs[devIndex].base);
@@ -1785,7 +2162,10 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
       // Select proper rkey (needed even for 0-size send)
       comm->wrs[r].wr.rdma.rkey = slots[r].rkeys[qp->remDevIdx];
 
-      int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
+      int chunkSize = adaptive ?
+        DIVUP(DIVUP((int64_t)reqs[r]->send.size * comm->devShare[devIndex], NCCL_IB_SPLIT_SCALE * devQps[devIndex]), align) * align :
+        DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
+      chunkSizes[r] = chunkSize;
       int length = std::min(reqs[r]->send.size-reqs[r]->send.offset, chunkSize);
       if (length <= 0) {
         comm->wrs[r].sg_list = NULL;
@@ -1797,6 +2177,9 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
         comm->wrs[r].sg_list = comm->sges+r;
         comm->wrs[r].num_sge = 1;
       }
+      // The NIC cannot read GPU memory through an inline copy
+      comm->wrs[r].send_flags &= ~IBV_SEND_INLINE;
+      if (length > 0 && length <= inlineMax && reqs[r]->send.host) comm->wrs[r].send_flags |= IBV_SEND_INLINE;
     }
 
     if (nreqs > 1) {
@@ -1805,20 +2188,46 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot) {
       lastWr->wr.rdma.rkey = comm->remSizesFifo.rkeys[devIndex];
     }
 
-    struct ibv_send_wr* bad_wr;
-    NCCLCHECK(wrap_ibv_post_send(qp->qp, comm->wrs, &bad_wr));
+#if defined(ENABLE_NPKIT)
+    uint32_t npKitQpId = NPKIT_NET_IB_QP_ID(comm->devs[devIndex].base.ibDevN, devIndex, qpIndex);
+    uint32_t npKitBytes = 0;
+    for (int r=0; r<nreqs; r++) {
+      if (comm->wrs[r].num_sge) npKitBytes += comm->sges[r].length;
+    }
+    NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_POST_SEND_ENTRY, npKitBytes, npKitQpId,
+        *(volatile uint64_t*)NpKit::GetCpuTimestamp(), NpKit::GetCpuChannel());
+#endif
+
+    if (defer) {
+      NCCLCHECK(ncclIbDeferSend(comm, qp, comm->wrs));
+    } else {
+      struct ibv_send_wr* bad_wr;
+      NCCLCHECK(wrap_ibv_post_send(qp->qp, comm->wrs, &bad_wr));
+    }
+
+#if defined(ENABLE_NPKIT)
+    NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_POST_SEND_EXIT, npKitBytes, npKitQpId,
+        *(volatile uint64_t*)NpKit::GetCpuTimestamp(), NpKit::GetCpuChannel());
+#endif
 
     for (int r=0; r<nreqs; r++) {
-      int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
-      reqs[r]->send.offset += chunkSize;
-      comm->sges[r].addr += chunkSize;
-      comm->wrs[r].wr.rdma.remote_addr += chunkSize;
+      if (adaptive) {
+        reqs[r]->send.postNs = postNs;
+        reqs[r]->send.devBytes[devIndex] = std::min(reqs[r]->send.size-reqs[r]->send.offset, chunkSizes[r]);
+      }
+      reqs[r]->send.offset += chunkSizes[r];
+      comm->sges[r].addr += chunkSizes[r];
+      comm->wrs[r].wr.rdma.remote_addr += chunkSizes[r];
     }
 
     // Select the next qpIndex
     comm->base.qpIndex = (comm->base.qpIndex+1) % comm->base.nqps;
   }
 
+  if (defer) {
+    for (int r=0; r<nreqs; r++) reqs[r]->send.postSeq = comm->postSeq+1;
+    if (++comm->nPendingSends >= ncclParamIbPostBatch() && !ncclIbInVector) NCCLCHECK(ncclIbPostPending(comm));
+  }
   return ncclSuccess;
 }
 
@@ -1866,6 +2275,8 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
     req->send.size = size;
     req->send.data = data;
     req->send.offset = 0;
+    req->send.host = mhandleWrapper->host;
+    req->send.postSeq = 0;
 
     // Populate events
     int nEvents = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
@@ -1909,6 +2320,21 @@ ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, int tag, void* mh
   return ncclSuccess;
 }
 
+ncclResult_t ncclIbIsendv(int n, void** sendComms, void** data, int* sizes, int* tags, void** mhandles, void** requests) {
+  ncclResult_t ret = ncclSuccess;
+  ncclIbInVector = 1;
+  for (int i = 0; i < n && ret == ncclSuccess; i++) {
+    ret = ncclIbIsend(sendComms[i], data[i], sizes[i], tags[i], mhandles[i], requests+i);
+  }
+  ncclIbInVector = 0;
+  // Ring the doorbells of the vector, unless NCCL_IB_POST_BATCH keeps sends for later
+  for (int i = 0; i < n && ret == ncclSuccess; i++) {
+    struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComms[i];
+    if (comm->nPendingWrs && comm->nPendingSends >= ncclParamIbPostBatch()) ret = ncclIbPostPending(comm);
+  }
+  return ret;
+}
+
 ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, int* sizes, int* tags, void** mhandles, struct ncclIbRequest* req) {
   struct ibv_send_wr wr;
   memset(&wr, 0, sizeof(wr));
@@ -2018,7 +2444,12 @@ ncclResult_t ncclIbIrecv(void* recvComm, int n, void** data, int* sizes, int* ta
   for (int i = 0; i < nqps; i++) {
     struct ncclIbQp* qp = comm->base.qps + comm->base.qpIndex;
     ncclIbAddEvent(req, qp->devIndex, &comm->devs[qp->devIndex].base);
-    NCCLCHECK(wrap_ibv_post_recv(qp->qp, &wr, &bad_wr));
+    if (comm->srqQueues) {
+      struct ncclIbSrqQueue* queue = comm->srqQueues + comm->base.qpIndex;
+      queue->reqs[queue->tail++ % MAX_REQUESTS] = wr.wr_id;
+    } else {
+      NCCLCHECK(wrap_ibv_post_recv(qp->qp, &wr, &bad_wr));
+    }
     comm->base.qpIndex = (comm->base.qpIndex+1)%comm->base.nqps;
   }
 
@@ -2039,32 +2470,27 @@ ncclResult_t ncclIbIflush(void* recvComm, int n, void** data, int* sizes, void**
   for (int i=0; i<n; i++) if (sizes[i]) last = i;
   if (comm->flushEnabled == 0 || last == -1) return ncclSuccess;
 
+  // Receives completed earlier in this pass already wait on a flush that is not posted yet
+  if (comm->pendingFlush) {
+    comm->pendingFlush->flush.refs++;
+    *request = comm->pendingFlush;
+    return ncclSuccess;
+  }
+
   // Only flush once using the last non-zero receive
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(&comm->base, &req));
   req->type = NCCL_NET_IB_REQ_FLUSH;
   req->sock = &comm->base.sock;
   struct ncclIbMrHandle* mhandle = (struct ncclIbMrHandle*) mhandles[last];
-
-  // We don't know which devIndex the recv was on, so we flush on all devices
-  for (int i = 0; i < comm->base.ndevs; i++) {
-    struct ibv_send_wr wr;
-    memset(&wr, 0, sizeof(wr));
-    wr.wr_id = req - comm->base.reqs;
-
-    wr.wr.rdma.remote_addr = (uint64_t)data[last];
-    wr.wr.rdma.rkey = mhandle->mrs[i]->rkey;
-    wr.sg_list = &comm->devs[i].gpuFlush.sge;
-    wr.num_sge = 1;
-    wr.opcode = IBV_WR_RDMA_READ;
-    wr.send_flags = IBV_SEND_SIGNALED;
-
-    TIME_START(4);
-    struct ibv_send_wr* bad_wr;
-    NCCLCHECK(wrap_ibv_post_send(comm->devs[i].gpuFlush.qp.qp, &wr, &bad_wr));
-    TIME_STOP(4);
-
-    ncclIbAddEvent(req, i, &comm->devs[i].base);
+  req->flush.addr = (uint64_t)data[last];
+  for (int i = 0; i < comm->base.ndevs; i++) req->flush.rkeys[i] = mhandle->mrs[i]->rkey;
+  req->flush.refs = 1;
+  comm->pendingFlush = req;
+  if (comm->inFlushList == 0) {
+    comm->flushNext = ncclIbFlushComms;
+    ncclIbFlushComms = comm;
+    comm->inFlushList = 1;
   }
 
   *request = req;
@@ -2073,9 +2499,40 @@ ncclResult_t ncclIbIflush(void* recvComm, int n, void** data, int* sizes, void**
 
 #define HCA_NAME(req, index) ((req)->devBases[(index)]->pd->context->device->name)
 
+// Give a recv completion from the SRQ the wr_id of the recv posted on its QP, and refill the SRQ
+static ncclResult_t ncclIbSrqCompletion(struct ncclIbRecvComm* comm, struct ibv_wc* wc) {
+  for (int q = 0; q < comm->base.nqps; q++) {
+    struct ncclIbQp* qp = comm->base.qps + q;
+    if (qp->qp->qp_num != wc->qp_num) continue;
+    struct ncclIbSrqQueue* queue = comm->srqQueues + q;
+    if (queue->head == queue->tail) {
+      WARN("NET/IB : completion on QP %u without a recv posted", wc->qp_num);
+      return ncclInternalError;
+    }
+    wc->wr_id = queue->reqs[queue->head++ % MAX_REQUESTS];
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    struct ibv_recv_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_srq_recv(comm->devs[qp->devIndex].srq, &wr, &bad_wr));
+    return ncclSuccess;
+  }
+  WARN("NET/IB : completion on unknown QP %u", wc->qp_num);
+  return ncclInternalError;
+}
+
 ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
   struct ncclIbRequest *r = (struct ncclIbRequest*)request;
   *done = 0;
+  if (r->type == NCCL_NET_IB_REQ_SEND) {
+    // A deferred send can't complete, post it now rather than waiting for the end of the pass
+    struct ncclIbSendComm* comm = (struct ncclIbSendComm*)r->base;
+    if (r->send.postSeq > comm->postSeq) NCCLCHECK(ncclIbPostPending(comm));
+  }
+  if (r->type == NCCL_NET_IB_REQ_FLUSH) {
+    // Same for a flush still gathering the receives of the pass
+    struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)r->base;
+    if (comm->pendingFlush == r) NCCLCHECK(ncclIbPostGpuFlush(comm));
+  }
   while (1) {
     NCCLCHECK(ncclIbStatsCheckFatalCount(&r->base->stats,__func__));
     if (r->events[0] == 0 && r->events[1] == 0) {
@@ -2087,6 +2544,7 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
       if (sizes && r->type == NCCL_NET_IB_REQ_SEND) {
         sizes[0] = r->send.size;
       }
+      if (r->type == NCCL_NET_IB_REQ_FLUSH && --r->flush.refs > 0) return ncclSuccess;
       NCCLCHECK(ncclIbFreeRequest(r));
       return ncclSuccess;
     }
@@ -2099,10 +2557,28 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
       TIME_START(3);
       // If we expect any completions from this device's CQ
       if (r->events[i]) {
+#if defined(ENABLE_NPKIT)
+        // Polls finding nothing are not recorded, there are far too many of them
+        uint64_t npKitPollTime = *(volatile uint64_t*)NpKit::GetCpuTimestamp();
+#endif
         NCCLCHECK(wrap_ibv_poll_cq(r->devBases[i]->cq, 4, wcs, &wrDone));
         totalWrDone += wrDone;
         if (wrDone == 0) { TIME_CANCEL(3); } else { TIME_STOP(3); }
         if (wrDone == 0) continue;
+#if defined(ENABLE_NPKIT)
+        uint32_t npKitCqId = NPKIT_NET_IB_QP_ID(r->devBases[i]->ibDevN, i, NPKIT_NET_IB_NO_QP);
+        uint64_t npKitCompletionTime = *(volatile uint64_t*)NpKit::GetCpuTimestamp();
+        NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_POLL_CQ_ENTRY, wrDone, npKitCqId, npKitPollTime, NpKit::GetCpuChannel());
+        for (int w=0; w<wrDone; w++) {
+          int qpIndex = NPKIT_NET_IB_NO_QP;
+          for (int q=0; q<r->base->nqps; q++) {
+            if (r->base->qps[q].qp && r->base->qps[q].qp->qp_num == wcs[w].qp_num) qpIndex = q;
+          }
+          NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_COMPLETION, wcs[w].byte_len,
+              NPKIT_NET_IB_QP_ID(r->devBases[i]->ibDevN, i, qpIndex), npKitCompletionTime, NpKit::GetCpuChannel());
+        }
+        NpKit::CollectCpuEvent(NPKIT_EVENT_NET_IB_POLL_CQ_EXIT, wrDone, npKitCqId, npKitCompletionTime, NpKit::GetCpuChannel());
+#endif
         for (int w=0; w<wrDone; w++) {
           struct ibv_wc *wc = wcs+w;
           if (wc->status != IBV_WC_SUCCESS) {
@@ -2124,6 +2600,10 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
             return ncclRemoteError;
           }
 
+          if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM && !r->base->isSend && ((struct ncclIbRecvComm*)r->base)->srqQueues) {
+            NCCLCHECK(ncclIbSrqCompletion((struct ncclIbRecvComm*)r->base, wc));
+          }
+
           union ncclSocketAddress addr;
           ncclSocketGetAddr(r->sock, &addr);
           struct ncclIbRequest* req = r->base->reqs+(wc->wr_id & 0xff);
@@ -2134,6 +2614,7 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
               ncclSocketToString(&addr, line), wc->status, wc->opcode,wc->byte_len, wc->wr_id, req, req->type, req->events[0], req->events[1], i);
           #endif
           if (req && req->type == NCCL_NET_IB_REQ_SEND) {
+            if (ncclParamIbAdaptiveSplit()) ncclIbSplitSample((struct ncclIbSendComm*)r->base, req, i);
             for (int j = 0; j < req->nreqs; j++) {
               struct ncclIbRequest* sendReq = r->base->reqs+((wc->wr_id >> (j*8)) & 0xff);
               if ((sendReq->events[i] <= 0)) {
@@ -2169,6 +2650,13 @@ ncclResult_t ncclIbTest(void* request, int* done, int* sizes) {
 ncclResult_t ncclIbCloseSend(void* sendComm) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
   if (comm) {
+    if (comm->inPendingList) {
+      // Progress threads empty their list at the end of each pass, unlink it if we are one
+      if (comm->nPendingWrs) WARN("NET/IB : closing send comm with %d WRs never posted", comm->nPendingWrs);
+      for (struct ncclIbSendComm** c = &ncclIbPendingComms; *c; c = &(*c)->pendingNext) {
+        if (*c == comm) { *c = comm->pendingNext; break; }
+      }
+    }
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
     for (int q = 0; q < comm->base.nqps; q++)
@@ -2189,6 +2677,11 @@ ncclResult_t ncclIbCloseSend(void* sendComm) {
 ncclResult_t ncclIbCloseRecv(void* recvComm) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   if (comm) {
+    if (comm->inFlushList) {
+      for (struct ncclIbRecvComm** c = &ncclIbFlushComms; *c; c = &(*c)->flushNext) {
+        if (*c == comm) { *c = comm->flushNext; break; }
+      }
+    }
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
     for (int q = 0; q < comm->base.nqps; q++)
@@ -2202,8 +2695,10 @@ ncclResult_t ncclIbCloseRecv(void* recvComm) {
       }
       if (commDev->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->fifoMr));
       if (commDev->sizesFifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->sizesFifoMr));
+      if (commDev->srq != NULL) NCCLCHECK(ncclIbSrqRelease(commDev->base.ibDevN));
       NCCLCHECK(ncclIbDestroyBase(&commDev->base));
     }
+    free(comm->srqQueues);
     free(comm);
   }
   return ncclSuccess;
@@ -9,12 +9,28 @@
 #include "socket.h"
 #include "net.h"
 #include "param.h"
+#include "cpuset.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 /* Init functions */
 static int ncclNetIfs = -1;
@@ -25,8 +41,25 @@ struct ncclNetSocketDev {
 };
 static struct ncclNetSocketDev ncclNetSocketDevs[MAX_IFS];
 
+#define NCCL_NET_SOCKET_MAX_DEVS_PER_NIC 2
+#define MAX_MERGED_SOCKET_DEV_NAME (MAX_IF_NAME_SIZE*NCCL_NET_SOCKET_MAX_DEVS_PER_NIC)+NCCL_NET_SOCKET_MAX_DEVS_PER_NIC
+// Device exposed to NCCL, its requests are striped over the sockets of its interfaces
+static int ncclNetSocketNMergedDevs = -1;
+struct ncclNetSocketMergedDev {
+  int ndevs;
+  int devs[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC]; // Points to an index in ncclNetSocketDevs
+  int speeds[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC];
+  int speed;
+  char devName[MAX_MERGED_SOCKET_DEV_NAME]; // Names of the interfaces joined by '+'
+};
+static struct ncclNetSocketMergedDev ncclNetSocketMergedDevs[MAX_IFS];
+
+NCCL_PARAM(SocketMergeNics, "SOCKET_MERGE_NICS", 0);
+
 pthread_mutex_t ncclNetSocketLock = PTHREAD_MUTEX_INITIALIZER;
 
+static ncclResult_t ncclNetSocketGetSpeed(char* devName, int* speed);
+
 static ncclResult_t ncclNetSocketGetPciPath(char* devName, char** pciPath) {
   char devicePath[PATH_MAX];
   snprintf(devicePath, PATH_MAX, "/sys/class/net/%s/device", devName);
@@ -60,6 +93,26 @@ ncclResult_t ncclNetSocketInit(ncclDebugLogger_t logFunction) {
         }
         line[MAX_LINE_LEN] = '\0';
         INFO(NCCL_INIT|NCCL_NET,"NET/Socket : Using%s", line);
+        // Consecutive interfaces are merged by pairs, in the order they were found
+        int perNic = ncclParamSocketMergeNics() ? NCCL_NET_SOCKET_MAX_DEVS_PER_NIC : 1;
+        int nMergedDevs = 0;
+        for (int i=0; i<ncclNetIfs; i+=perNic) {
+          struct ncclNetSocketMergedDev* mergedDev = ncclNetSocketMergedDevs+nMergedDevs++;
+          mergedDev->ndevs = std::min(perNic, ncclNetIfs-i);
+          mergedDev->speed = 0;
+          mergedDev->devName[0] = '\0';
+          for (int d=0; d<mergedDev->ndevs; d++) {
+            mergedDev->devs[d] = i+d;
+            NCCLCHECK(ncclNetSocketGetSpeed(ncclNetSocketDevs[i+d].devName, mergedDev->speeds+d));
+            mergedDev->speed += mergedDev->speeds[d];
+            if (d > 0) strcat(mergedDev->devName, "+");
+            strcat(mergedDev->devName, ncclNetSocketDevs[i+d].devName);
+          }
+          if (mergedDev->ndevs > 1) {
+            INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Merged %s into device %d, speed %d", mergedDev->devName, nMergedDevs-1, mergedDev->speed);
+          }
+        }
+        ncclNetSocketNMergedDevs = nMergedDevs;
       }
     }
     pthread_mutex_unlock(&ncclNetSocketLock);
@@ -68,7 +121,7 @@ ncclResult_t ncclNetSocketInit(ncclDebugLogger_t logFunction) {
 }
 
 ncclResult_t ncclNetSocketDevices(int* ndev) {
-  *ndev = ncclNetIfs;
+  *ndev = ncclNetSocketNMergedDevs;
   return ncclSuccess;
 }
 
@@ -97,12 +150,13 @@ static ncclResult_t ncclNetSocketGetSpeed(char* devName, int* speed) {
 }
 
 ncclResult_t ncclNetSocketGetProperties(int dev, ncclNetProperties_t* props) {
-  props->name = ncclNetSocketDevs[dev].devName;
-  props->pciPath = ncclNetSocketDevs[dev].pciPath;
+  struct ncclNetSocketMergedDev* mergedDev = ncclNetSocketMergedDevs+dev;
+  props->name = mergedDev->devName;
+  props->pciPath = ncclNetSocketDevs[mergedDev->devs[0]].pciPath;
   props->guid = dev;
   props->ptrSupport = NCCL_PTR_HOST;
   props->regIsGlobal = 0;
-  NCCLCHECK(ncclNetSocketGetSpeed(props->name, &props->speed));
+  props->speed = mergedDev->speed;
   props->latency = 0; // Not set
   props->port = 0;
   props->maxComms = 65536;
@@ -121,6 +175,8 @@ ncclResult_t ncclNetSocketGetProperties(int dev, ncclNetProperties_t* props) {
 
 NCCL_PARAM(SocketNsocksPerThread, "NSOCKS_PERTHREAD", -2);
 NCCL_PARAM(SocketNthreads, "SOCKET_NTHREADS", -2);
+NCCL_PARAM(SocketZeroCopy, "SOCKET_ZEROCOPY", 0);
+NCCL_PARAM(SocketThreadAffinity, "SOCKET_THREAD_AFFINITY", 1);
 
 enum ncclNetSocketCommState {
   ncclNetSocketCommStateStart = 0,
@@ -138,13 +194,29 @@ struct ncclNetSocketCommStage {
 };
 
 struct ncclNetSocketHandle {
-  union ncclSocketAddress connectAddr;
+  // One listening socket per interface of the device, data socket i connects to i % ndevs
+  union ncclSocketAddress connectAddrs[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC];
+  int speeds[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC];
+  int ndevs;
   uint64_t magic; // random number to help debugging
   int nSocks;
   int nThreads;
   struct ncclNetSocketCommStage stage;
 };
 
+#define NCCL_NET_SOCKET_ZC_AHEAD 64
+
+// MSG_ZEROCOPY state of a data socket, only touched by the helper thread owning the socket.
+// The kernel numbers the zerocopy sends of a socket and reports ranges of them as released.
+struct ncclNetSocketZc {
+  int enabled;
+  int copied; // The kernel had to copy, zerocopy only costs more on this path
+  uint32_t next;
+  uint32_t done; // Sends below it are released
+  uint32_t ahead[NCCL_NET_SOCKET_ZC_AHEAD][2]; // Ranges reported before the ones below them
+  int nAhead;
+};
+
 struct ncclNetSocketTask {
   int op;
   void* data;
@@ -153,6 +225,9 @@ struct ncclNetSocketTask {
   int offset;
   int used;
   ncclResult_t result;
+  struct ncclNetSocketZc* zc;
+  uint32_t zcLast;
+  int zcWait; // The kernel may still read data
 };
 
 struct ncclNetSocketRequest {
@@ -176,13 +251,16 @@ struct ncclNetSocketTaskQueue {
 struct ncclNetSocketThreadResources {
   struct ncclNetSocketTaskQueue threadTaskQueue;
   int stop;
+  int ready; // The thread allocated its task queue
+  cpu_set_t cpuset;
   struct ncclNetSocketComm* comm;
   pthread_mutex_t threadLock;
   pthread_cond_t  threadCond;
 };
 
 struct ncclNetSocketListenComm {
-  struct ncclSocket sock;
+  struct ncclSocket socks[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC];
+  int ndevs;
   struct ncclNetSocketCommStage stage;
   int nSocks;
   int nThreads;
@@ -197,16 +275,118 @@ struct ncclNetSocketComm {
   int nSocks;
   int nThreads;
   int nextSock;
+  // Interfaces of the listening side, the share of a request each data socket carries follows their speeds
+  int ndevs;
+  int speeds[NCCL_NET_SOCKET_MAX_DEVS_PER_NIC];
   struct ncclNetSocketRequest requests[MAX_REQUESTS];
+  struct ncclNetSocketZc zc[MAX_SOCKETS];
   pthread_t helperThread[MAX_THREADS];
   struct ncclNetSocketThreadResources threadResources[MAX_THREADS];
 };
 
+static ncclResult_t ncclNetSocketZcRelease(struct ncclNetSocketZc* zc, uint32_t lo, uint32_t hi) {
+  if ((int32_t)(lo - zc->done) > 0) {
+    // TCP reports in order in practice, keep the odd range for when the ones below it come
+    if (zc->nAhead == NCCL_NET_SOCKET_ZC_AHEAD) {
+      WARN("NET/Socket : too many zerocopy completions out of order");
+      return ncclSystemError;
+    }
+    zc->ahead[zc->nAhead][0] = lo;
+    zc->ahead[zc->nAhead][1] = hi;
+    zc->nAhead++;
+    return ncclSuccess;
+  }
+  if ((int32_t)(hi + 1 - zc->done) > 0) zc->done = hi + 1;
+  for (int i = 0; i < zc->nAhead; ) {
+    if ((int32_t)(zc->ahead[i][0] - zc->done) > 0) { i++; continue; }
+    if ((int32_t)(zc->ahead[i][1] + 1 - zc->done) > 0) zc->done = zc->ahead[i][1] + 1;
+    zc->nAhead--;
+    zc->ahead[i][0] = zc->ahead[zc->nAhead][0];
+    zc->ahead[i][1] = zc->ahead[zc->nAhead][1];
+    i = 0;
+  }
+  return ncclSuccess;
+}
+
+// Read the zerocopy completions the kernel queued on the error queue of fd
+static ncclResult_t ncclNetSocketZcReap(int fd, struct ncclNetSocketZc* zc) {
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return ncclSuccess;
+      WARN("NET/Socket : recvmsg(MSG_ERRQUEUE) failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+      struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && zc->copied == 0) {
+        INFO(NCCL_NET, "NET/Socket : the kernel copied zerocopy sends, going back to regular sends on this socket");
+        zc->copied = 1;
+      }
+      NCCLCHECK(ncclNetSocketZcRelease(zc, err->ee_info, err->ee_data));
+    }
+  }
+}
+
+// Like ncclSocketProgress for a send, except the data stays in use until the kernel released it
+static ncclResult_t ncclNetSocketZcProgress(struct ncclNetSocketTask* r) {
+  if (r->offset < r->size) {
+    int bytes = send(r->sock->fd, (char*)r->data+r->offset, r->size-r->offset, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes > 0) {
+      r->offset += bytes;
+      r->zcLast = r->zc->next++;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ENOBUFS) {
+      // ENOBUFS: too many sends pinned for the socket option memory, retry once some completed
+      char line[SOCKET_NAME_MAXLEN+1];
+      WARN("NET/Socket : zerocopy send to %s failed : %s", ncclSocketToString(&r->sock->addr, line), strerror(errno));
+      return ncclRemoteError;
+    }
+  }
+  NCCLCHECK(ncclNetSocketZcReap(r->sock->fd, r->zc));
+  if (r->offset == r->size && (int32_t)(r->zc->done - r->zcLast) > 0) __atomic_store_n(&r->zcWait, 0, __ATOMIC_RELEASE);
+  return ncclSuccess;
+}
+
+// CPUs local to the NIC of dev that we are allowed to run on, empty when unknown
+static void ncclNetSocketGetCpuset(int dev, cpu_set_t* mask) {
+  CPU_ZERO(mask);
+  if (ncclNetSocketDevs[dev].pciPath == NULL) return;
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/local_cpus", ncclNetSocketDevs[dev].pciPath);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return;
+  char str[1024];
+  if (fgets(str, sizeof(str), file) != NULL) {
+    cpu_set_t local, allowed;
+    CPU_ZERO(&local);
+    ncclStrToCpuset(str, &local);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) CPU_AND(mask, &local, &allowed);
+  }
+  fclose(file);
+}
+
 void* persistentSocketThread(void *args_) {
   struct ncclNetSocketThreadResources* resource = (struct ncclNetSocketThreadResources*)args_;
   struct ncclNetSocketComm* comm = resource->comm;
   struct ncclNetSocketTaskQueue* myQueue = &resource->threadTaskQueue;
   int nSocksPerThread = comm->nSocks / comm->nThreads;
+  if (CPU_COUNT(&resource->cpuset) && sched_setaffinity(0, sizeof(cpu_set_t), &resource->cpuset) != 0) {
+    INFO(NCCL_NET, "NET/Socket : could not bind helper thread to the CPUs of %s", ncclNetSocketMergedDevs[comm->dev].devName);
+  }
+  // Touch the task queue first from here so that it lands on the NUMA node of the NIC
+  pthread_mutex_lock(&resource->threadLock);
+  if (ncclCalloc(&myQueue->tasks, myQueue->len) != ncclSuccess) myQueue->tasks = NULL;
+  resource->ready = 1;
+  pthread_cond_broadcast(&resource->threadCond);
+  pthread_mutex_unlock(&resource->threadLock);
+  if (myQueue->tasks == NULL) return NULL;
   while (1) {
     int idle = 1;
     int mark = myQueue->next; // mark newest task seen
@@ -216,8 +396,8 @@ void* persistentSocketThread(void *args_) {
         repeat = 0;
         for (int j=0; j<nSocksPerThread; j++) {
           struct ncclNetSocketTask* r = myQueue->tasks+i+j;
-          if (r != NULL && r->used == 1 && r->offset < r->size) {
-            r->result = ncclSocketProgress(r->op, r->sock, r->data, r->size, &r->offset);
+          if (r != NULL && r->used == 1 && (r->offset < r->size || r->zcWait)) {
+            r->result = r->zc ? ncclNetSocketZcProgress(r) : ncclSocketProgress(r->op, r->sock, r->data, r->size, &r->offset);
             if (r->result != ncclSuccess) {
               WARN("NET/Socket : socket progress error");
               return NULL;
@@ -253,7 +433,7 @@ ncclResult_t ncclNetSocketGetNsockNthread(int dev, int* ns, int* nt) {
     // Auto-detection
     int autoNt=0, autoNs=1; // By default, we only use the main thread and do not spawn extra threads
     char vendorPath[PATH_MAX];
-    snprintf(vendorPath, PATH_MAX, "/sys/class/net/%s/device/vendor", ncclNetSocketDevs[dev].devName);
+    snprintf(vendorPath, PATH_MAX, "/sys/class/net/%s/device/vendor", ncclNetSocketDevs[ncclNetSocketMergedDevs[dev].devs[0]].devName);
     // Coverity is wrong.  NULL second argument to realpath() is OK by POSIX.1-2008.
     // coverity[alias_transfer:FALSE]
     char* rPath = realpath(vendorPath, NULL);
@@ -279,6 +459,12 @@ end:
     if (nThreads == -2) nThreads = autoNt;
     if (nSocksPerThread == -2) nSocksPerThread = autoNs;
   }
+  if (ncclNetSocketMergedDevs[dev].ndevs > 1) {
+    // Each interface needs sockets of its own, and each thread serves the sockets of one interface
+    int ndevs = ncclNetSocketMergedDevs[dev].ndevs;
+    nThreads = std::min(DIVUP(std::max(nThreads, ndevs), ndevs) * ndevs, MAX_THREADS / ndevs * ndevs);
+    nSocksPerThread = std::max(nSocksPerThread, 1);
+  }
   nSocks = nSocksPerThread * nThreads;
   if (nSocks > MAX_SOCKETS) {
     nSocksPerThread = MAX_SOCKETS/nThreads;
@@ -296,19 +482,25 @@ fail:
 }
 
 ncclResult_t ncclNetSocketListen(int dev, void* opaqueHandle, void** listenComm) {
-  if (dev < 0 || dev >= ncclNetIfs) { // data transfer socket is based on specified dev
+  if (dev < 0 || dev >= ncclNetSocketNMergedDevs) { // data transfer socket is based on specified dev
     return ncclInternalError;
   }
   ncclResult_t ret = ncclSuccess;
+  struct ncclNetSocketMergedDev* mergedDev = ncclNetSocketMergedDevs+dev;
   struct ncclNetSocketHandle* handle = (struct ncclNetSocketHandle*) opaqueHandle;
   memset(handle, 0, sizeof(struct ncclNetSocketHandle));
   static_assert(sizeof(struct ncclNetSocketHandle) <= NCCL_NET_HANDLE_MAXSIZE, "ncclNetSocketHandle size too large");
   struct ncclNetSocketListenComm* comm;
   NCCLCHECK(ncclCalloc(&comm, 1));
   handle->magic = NCCL_SOCKET_MAGIC;
-  NCCLCHECKGOTO(ncclSocketInit(&comm->sock, &ncclNetSocketDevs[dev].addr, handle->magic, ncclSocketTypeNetSocket, NULL, 1), ret, fail);
-  NCCLCHECKGOTO(ncclSocketListen(&comm->sock), ret, fail);
-  NCCLCHECKGOTO(ncclSocketGetAddr(&comm->sock, &handle->connectAddr), ret, fail);
+  for (; comm->ndevs<mergedDev->ndevs; comm->ndevs++) {
+    int d = comm->ndevs;
+    NCCLCHECKGOTO(ncclSocketInit(comm->socks+d, &ncclNetSocketDevs[mergedDev->devs[d]].addr, handle->magic, ncclSocketTypeNetSocket, NULL, 1), ret, fail);
+    NCCLCHECKGOTO(ncclSocketListen(comm->socks+d), ret, fail);
+    NCCLCHECKGOTO(ncclSocketGetAddr(comm->socks+d, handle->connectAddrs+d), ret, fail);
+    handle->speeds[d] = mergedDev->speeds[d];
+  }
+  handle->ndevs = comm->ndevs;
   NCCLCHECKGOTO(ncclNetSocketGetNsockNthread(dev, &comm->nSocks, &comm->nThreads), ret, fail);
   handle->nSocks = comm->nSocks;
   handle->nThreads = comm->nThreads;
@@ -317,13 +509,13 @@ ncclResult_t ncclNetSocketListen(int dev, void* opaqueHandle, void** listenComm)
 exit:
   return ret;
 fail:
-  (void)ncclSocketClose(&comm->sock);
+  for (int d=0; d<=comm->ndevs && d<mergedDev->ndevs; d++) (void)ncclSocketClose(comm->socks+d);
   free(comm);
   goto exit;
 }
 
 ncclResult_t ncclNetSocketConnect(int dev, void* opaqueHandle, void** sendComm, ncclNetDeviceHandle_t** /*sendDevComm*/) {
-  if (dev < 0 || dev >= ncclNetIfs) { // data transfer socket is based on specified dev
+  if (dev < 0 || dev >= ncclNetSocketNMergedDevs) { // data transfer socket is based on specified dev
     return ncclInternalError;
   }
 
@@ -343,10 +535,12 @@ ncclResult_t ncclNetSocketConnect(int dev, void* opaqueHandle, void** sendComm,
   comm->nSocks = handle->nSocks;
   comm->nThreads = handle->nThreads;
   comm->dev = dev;
+  comm->ndevs = handle->ndevs;
+  memcpy(comm->speeds, handle->speeds, sizeof(comm->speeds));
   CUDACHECK(cudaGetDevice(&comm->cudaDev));
   for (; i<comm->nSocks+1; i++) {
     sock = (i == comm->nSocks) ? &comm->ctrlSock : comm->socks+i;
-    NCCLCHECK(ncclSocketInit(sock, &handle->connectAddr, handle->magic, ncclSocketTypeNetSocket, NULL, 1));
+    NCCLCHECK(ncclSocketInit(sock, handle->connectAddrs + (i == comm->nSocks ? 0 : i % comm->ndevs), handle->magic, ncclSocketTypeNetSocket, NULL, 1));
 
     stage->sock = sock;
     stage->state = ncclNetSocketCommStateConnect;
@@ -363,6 +557,16 @@ socket_send:
     NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, sock, &i, sizeof(uint8_t), &done));
     if (done == 0) return ncclSuccess;
   }
+  if (ncclParamSocketZeroCopy() > 0) {
+    for (int s=0; s<comm->nSocks; s++) {
+      int one = 1;
+      if (setsockopt(comm->socks[s].fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        INFO(NCCL_NET, "NET/Socket : SO_ZEROCOPY not supported (%s), using regular sends", strerror(errno));
+        break;
+      }
+      comm->zc[s].enabled = 1;
+    }
+  }
   *sendComm = comm;
   return ncclSuccess;
 }
@@ -384,6 +588,8 @@ ncclResult_t ncclNetSocketAccept(void* listenComm, void** recvComm, ncclNetDevic
   rComm->nSocks = lComm->nSocks;
   rComm->nThreads = lComm->nThreads;
   rComm->dev = lComm->dev;
+  rComm->ndevs = lComm->ndevs;
+  memcpy(rComm->speeds, ncclNetSocketMergedDevs[lComm->dev].speeds, sizeof(rComm->speeds));
   CUDACHECK(cudaGetDevice(&rComm->cudaDev));
   for (; i<rComm->nSocks+1; i++) {
     uint8_t sendSockIdx;
@@ -393,7 +599,8 @@ ncclResult_t ncclNetSocketAccept(void* listenComm, void** recvComm, ncclNetDevic
     stage->sock = sock;
     stage->state = ncclNetSocketCommStateAccept;
     stage->iteration = i;
-    NCCLCHECK(ncclSocketAccept(sock, &lComm->sock));
+    // The connecting side sends data socket i to interface i % ndevs and the control socket to the first
+    NCCLCHECK(ncclSocketAccept(sock, lComm->socks + (i == rComm->nSocks ? 0 : i % rComm->ndevs)));
 
 socket_accept_check:
     NCCLCHECK(ncclSocketReady(sock, &ready));
@@ -450,13 +657,24 @@ ncclResult_t ncclNetSocketGetTask(struct ncclNetSocketComm* comm, int op, void*
     // these tasks are distributed to nThreads threads,
     // we need to make sure each thread queue has enough slots for MAX_REQUESTS
     queue->len = MAX_REQUESTS * DIVUP(comm->nSocks, comm->nThreads);
-    NCCLCHECK(ncclCalloc(&queue->tasks, queue->len));
     queue->next = 0;
     res->comm = comm;
+    res->ready = 0;
+    // Threads serve the sockets of a single interface, see ncclNetSocketGetNsockNthread
+    struct ncclNetSocketMergedDev* mergedDev = ncclNetSocketMergedDevs+comm->dev;
+    if (ncclParamSocketThreadAffinity()) ncclNetSocketGetCpuset(mergedDev->devs[tid % mergedDev->ndevs], &res->cpuset);
+    else CPU_ZERO(&res->cpuset);
     pthread_mutex_init(&res->threadLock, NULL);
     pthread_cond_init(&res->threadCond, NULL);
     PTHREADCHECK(pthread_create(comm->helperThread+tid, NULL, persistentSocketThread, res), "pthread_create");
     ncclSetThreadName(comm->helperThread[tid], "NCCL Sock%c%1u%2u%2u", op == NCCL_SOCKET_SEND ? 'S' : 'R', comm->dev, tid, comm->cudaDev);
+    pthread_mutex_lock(&res->threadLock);
+    while (res->ready == 0) pthread_cond_wait(&res->threadCond, &res->threadLock);
+    pthread_mutex_unlock(&res->threadLock);
+    if (queue->tasks == NULL) {
+      WARN("NET/Socket : helper thread failed to allocate its task queue");
+      return ncclSystemError;
+    }
   }
   struct ncclNetSocketTask* r = queue->tasks+queue->next;
   if (r->used == 0) {
@@ -466,6 +684,10 @@ ncclResult_t ncclNetSocketGetTask(struct ncclNetSocketComm* comm, int op, void*
     r->sock = comm->socks + comm->nextSock;
     r->offset = 0;
     r->result = ncclSuccess;
+    struct ncclNetSocketZc* zc = comm->zc + comm->nextSock;
+    // Pinning pages and reaping completions only pays off for large sends
+    r->zc = op == NCCL_SOCKET_SEND && zc->enabled && zc->copied == 0 && size >= ncclParamSocketZeroCopy() ? zc : NULL;
+    r->zcWait = r->zc != NULL;
     comm->nextSock = (comm->nextSock + 1) % comm->nSocks;
     r->used = 1;
     *req = r;
@@ -512,9 +734,13 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
     // divide into subtasks
     int chunkOffset = 0, i = 0;
     if (r->comm->nSocks > 0) {
-      // each request can be divided up to nSocks tasks
-      int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, r->comm->nSocks));
+      // each request can be divided up to nSocks tasks, each the share of the speed of the interface of its socket
+      struct ncclNetSocketComm* comm = r->comm;
+      int64_t totalSpeed = 0;
+      for (int s=0; s<comm->nSocks; s++) totalSpeed += comm->speeds[s % comm->ndevs];
       while (chunkOffset < r->size) {
+        int64_t speed = comm->speeds[comm->nextSock % comm->ndevs];
+        int taskSize = std::max<int64_t>(MIN_CHUNKSIZE, DIVUP(r->size * speed, totalSpeed));
         int chunkSize = std::min(taskSize, r->size-chunkOffset);
         NCCLCHECK(ncclNetSocketGetTask(r->comm, r->op, (char*)(r->data)+chunkOffset, chunkSize, r->tasks+i++));
         chunkOffset += chunkSize;
@@ -528,7 +754,7 @@ ncclResult_t ncclNetSocketTest(void* request, int* done, int* size) {
       for (int i=0; i<r->nSubs; i++) {
         struct ncclNetSocketTask* sub = r->tasks[i];
         if (sub->result != ncclSuccess) return sub->result;
-        if (sub->offset == sub->size) nCompleted++;
+        if (sub->offset == sub->size && __atomic_load_n(&sub->zcWait, __ATOMIC_ACQUIRE) == 0) nCompleted++;
       }
       if (nCompleted == r->nSubs) {
         if (size) *size = r->size;
@@ -579,9 +805,11 @@ ncclResult_t ncclNetSocketIflush(void* recvComm, int n, void** data, int* sizes,
 ncclResult_t ncclNetSocketCloseListen(void* opaqueComm) {
   struct ncclNetSocketListenComm* comm = (struct ncclNetSocketListenComm*)opaqueComm;
   if (comm) {
-    int ready;
-    NCCLCHECK(ncclSocketReady(&comm->sock, &ready));
-    if (ready) NCCLCHECK(ncclSocketClose(&comm->sock));
+    for (int d=0; d<comm->ndevs; d++) {
+      int ready;
+      NCCLCHECK(ncclSocketReady(comm->socks+d, &ready));
+      if (ready) NCCLCHECK(ncclSocketClose(comm->socks+d));
+    }
     free(comm);
   }
   return ncclSuccess;
@@ -21,6 +21,26 @@ struct graphRegData {
   size_t size;
 };
 
+// A multicast object bound to one user allocation. The id is the same on all local ranks since
+// entries are only created collectively, ranks reuse an entry only when they all found that id.
+struct ncclNvlsGraphReg {
+  struct ncclNvlsGraphReg* next;
+  uint64_t id;
+  uintptr_t base;
+  size_t localSize;
+  CUmemGenericAllocationHandle mcHandle;
+  CUdeviceptr ptr;
+  int dev;
+  size_t size;
+  int refs;
+};
+
+struct graphRegFlags {
+  bool usable;
+  uint64_t sendId;
+  uint64_t recvId;
+};
+
 struct localRegData {
   struct ncclReg reg;
   intptr_t offset;
@@ -266,6 +286,8 @@ ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm) {
   size_t nvlsTotalSize = 0;
   struct ncclNvlsSharedRes* resources = NULL;
   int nChannels = -1;
+  size_t memSize = 64;
+  size_t creditSize = 0;
 
   if (comm->nvlsSupport == 0 || comm->nvlsResources->inited) return ncclSuccess;
   // initialize after checking comm->nvlsSupport
@@ -277,10 +299,17 @@ ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm) {
   buffSize = nvlsStepSize * NCCL_STEPS;
   nvlsPerRankSize = nChannels * 2 * buffSize;
   nvlsTotalSize = nvlsPerRankSize * nHeads;
+  creditSize = nChannels * 2 * memSize * nHeads;
 
   INFO(NCCL_INIT | NCCL_NVLS, "NVLS comm %p headRank %d nHeads %d buffSize %zu nvlsPerRankSize %zu nvlsTotalSize %zu",
        comm, headRank, nHeads, buffSize, nvlsPerRankSize, nvlsTotalSize);
 
+  // Credits are created along with the buffers, so that with runtime connect a comm never running
+  // an NVLS collective holds no multicast object at all
+  if (resources->ucCredit == NULL) {
+    NCCLCHECKGOTO(nvlsAllocateMem(comm, CU_MULTICAST_GRANULARITY_MINIMUM, &resources->accessDesc, &creditSize, &resources->ucCreditHandle, &resources->mcCreditHandle, (void**)&resources->ucCredit, (void**)&resources->mcCredit), res, fail);
+    resources->creditSize = creditSize;
+  }
   NCCLCHECKGOTO(nvlsAllocateMem(comm, CU_MULTICAST_GRANULARITY_RECOMMENDED, &resources->accessDesc, &nvlsTotalSize, &resources->ucBuffHandle, &resources->mcBuffHandle, (void**)&resources->ucBuff, (void**)&resources->mcBuff), res, fail);
   resources->buffSize = nvlsTotalSize;
 
@@ -290,14 +319,37 @@ ncclResult_t ncclNvlsBufferSetup(struct ncclComm* comm) {
     for (int c = 0; c < nChannels; c++) {
       struct ncclChannel* channel = comm->channels + c;
       struct ncclChannelPeer* peer = channel->peers[nvlsPeer];
+      char* mem = NULL;
 
       // Reduce UC -> MC
+      mem = resources->ucCredit + (h * 2 * nChannels + c) * memSize;
+      peer->send[1].transportComm = &nvlsTransport.send;
       peer->send[1].conn.buffs[NCCL_PROTO_SIMPLE] = resources->ucBuff + (h * 2 * nChannels + c) * buffSize;
+      peer->send[1].conn.head = (uint64_t*)mem;
+      peer->send[1].conn.tail = (uint64_t*)(mem + memSize / 2);
+      peer->send[1].conn.stepSize = nvlsStepSize;
+      mem = resources->mcCredit + (h * 2 * nChannels + c) * memSize;
+      peer->recv[0].transportComm = &nvlsTransport.recv;
       peer->recv[0].conn.buffs[NCCL_PROTO_SIMPLE] = resources->mcBuff + (h * 2 * nChannels + c) * buffSize;
+      peer->recv[0].conn.head = (uint64_t*)mem;
+      peer->recv[0].conn.tail = (uint64_t*)(mem + memSize / 2);
+      peer->recv[0].conn.stepSize = nvlsStepSize;
+      peer->recv[0].conn.flags |= NCCL_NVLS_MIN_POLL;
 
       // Broadcast MC -> UC
+      mem = resources->ucCredit + ((h * 2 + 1) * nChannels + c) * memSize;
+      peer->recv[1].transportComm = &nvlsTransport.recv;
       peer->recv[1].conn.buffs[NCCL_PROTO_SIMPLE] = resources->ucBuff + ((h * 2 + 1) * nChannels + c) * buffSize;
+      peer->recv[1].conn.head = (uint64_t*)mem;
+      peer->recv[1].conn.tail = (uint64_t*)(mem + memSize / 2);
+      peer->recv[1].conn.stepSize = nvlsStepSize;
+      mem = resources->mcCredit + ((h * 2 + 1) * nChannels + c) * memSize;
+      peer->send[0].transportComm = &nvlsTransport.send;
       peer->send[0].conn.buffs[NCCL_PROTO_SIMPLE] = resources->mcBuff + ((h * 2 + 1) * nChannels + c) * buffSize;
+      peer->send[0].conn.head = (uint64_t*)mem;
+      peer->send[0].conn.tail = (uint64_t*)(mem + memSize / 2);
+      peer->send[0].conn.stepSize = nvlsStepSize;
+      peer->send[0].conn.flags |= NCCL_NVLS_MIN_POLL;
 
       CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->send[0], &peer->send[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
       CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->recv[0], &peer->recv[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
@@ -324,7 +376,7 @@ ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent) {
   size_t typeSize;
   char shmPath[sizeof("/dev/shm/nccl-XXXXXX")];
   uintptr_t *nvlsShmem = NULL;
-  bool nvlsShare = parent && parent->nvlsSupport && parent->config.splitShare;
+  bool nvlsShare = parent && parent->nvlsSupport && comm->shareRes;
   int nHeads = comm->channels[0].nvls.nHeads;
 
   if (comm->nvlsSupport == 0 || comm->nvlsChannels == 0) return ncclSuccess;
@@ -350,8 +402,9 @@ ncclResult_t ncclNvlsSetup(struct ncclComm* comm, struct ncclComm* parent) {
   }
 
 setup:
-  comm->nvlsChunkSize = ncclParamNvlsChunkSize();
+  if (comm->nvlsChunkSize == 0) comm->nvlsChunkSize = ncclParamNvlsChunkSize();
   if (nvlsShare) {
+    comm->nvlsChunkSize = parent->nvlsChunkSize;
     /* reuse NVLS resources */
     comm->nvlsChannels = std::min(comm->nvlsChannels, parent->nvlsResources->nChannels);
     for (int c = 0; c < comm->nChannels; c++) {
@@ -362,11 +415,6 @@ setup:
     ncclAtomicRefCountIncrement(&parent->nvlsResources->refCount);
   } else {
     struct ncclNvlsSharedRes* resources = NULL;
-    int nHeads = comm->channels[0].nvls.nHeads;
-    int nChannels = comm->nChannels;
-    size_t memSize = 64;
-    size_t creditSize = nChannels * 2 * memSize * nHeads;
-    int nvlsStepSize = comm->nvlsChunkSize;
 
     NCCLCHECKGOTO(ncclCalloc(&comm->nvlsResources, 1), res, fail);
     comm->nvlsResources->inited = false;
@@ -374,7 +422,7 @@ setup:
     comm->nvlsResources->nChannels = comm->nvlsChannels;
     resources = comm->nvlsResources;
 
-    if (parent && parent->nvlsSupport && parent->config.splitShare) {
+    if (parent && parent->nvlsSupport && comm->shareRes) {
       /* ranks on other nodes might share the NVLS resources, we need to cap nvlsChannels
        * to make sure nvlsChannels match for each rank. */
       comm->nvlsChannels = std::min(comm->nvlsChannels, parent->nvlsResources->nChannels);
@@ -390,57 +438,6 @@ setup:
     resources->accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
     resources->accessDesc.location.id = comm->cudaDev;
     resources->dev = comm->cudaDev;
-
-    NCCLCHECKGOTO(nvlsAllocateMem(comm, CU_MULTICAST_GRANULARITY_MINIMUM, &resources->accessDesc, &creditSize, &resources->ucCreditHandle, &resources->mcCreditHandle, (void**)&resources->ucCredit, (void**)&resources->mcCredit), res, fail);
-    resources->creditSize = creditSize;
-
-    // Set up head and tail only for now
-    NCCLCHECKGOTO(ncclStrongStreamAcquireUncaptured(&comm->sharedRes->hostStream), res, fail);
-    for (int h = 0; h < nHeads; h++) {
-      int nvlsPeer = comm->nRanks + 1 + h;
-      for (int c = 0; c < nChannels; c++) {
-        struct ncclChannel* channel = comm->channels + c;
-        char* mem = NULL;
-        struct ncclChannelPeer* peer = channel->peers[nvlsPeer];
-
-        // Reduce UC -> MC
-        mem = resources->ucCredit + (h * 2 * nChannels + c) * memSize;
-        peer->send[1].transportComm = &nvlsTransport.send;
-        peer->send[1].conn.buffs[NCCL_PROTO_SIMPLE] = NULL;
-        peer->send[1].conn.head = (uint64_t*)mem;
-        peer->send[1].conn.tail = (uint64_t*)(mem + memSize / 2);
-        peer->send[1].conn.stepSize = nvlsStepSize;
-        mem = resources->mcCredit + (h * 2 * nChannels + c) * memSize;
-        peer->recv[0].transportComm = &nvlsTransport.recv;
-        peer->recv[0].conn.buffs[NCCL_PROTO_SIMPLE] = NULL;
-        peer->recv[0].conn.head = (uint64_t*)mem;
-        peer->recv[0].conn.tail = (uint64_t*)(mem + memSize / 2);
-        peer->recv[0].conn.stepSize = nvlsStepSize;
-        peer->recv[0].conn.flags |= NCCL_NVLS_MIN_POLL;
-
-        // Broadcast MC -> UC
-        mem = resources->ucCredit + ((h * 2 + 1) * nChannels + c) * memSize;
-        peer->recv[1].transportComm = &nvlsTransport.recv;
-        peer->recv[1].conn.buffs[NCCL_PROTO_SIMPLE] = NULL;
-        peer->recv[1].conn.head = (uint64_t*)mem;
-        peer->recv[1].conn.tail = (uint64_t*)(mem + memSize / 2);
-        peer->recv[1].conn.stepSize = nvlsStepSize;
-        mem = resources->mcCredit + ((h * 2 + 1) * nChannels + c) * memSize;
-        peer->send[0].transportComm = &nvlsTransport.send;
-        peer->send[0].conn.buffs[NCCL_PROTO_SIMPLE] = NULL;
-        peer->send[0].conn.head = (uint64_t*)mem;
-        peer->send[0].conn.tail = (uint64_t*)(mem + memSize / 2);
-        peer->send[0].conn.stepSize = nvlsStepSize;
-        peer->send[0].conn.flags |= NCCL_NVLS_MIN_POLL;
-
-        CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->send[0], &peer->send[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
-        CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->recv[0], &peer->recv[0].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
-        CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->send[1], &peer->send[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
-        CUDACHECKGOTO(cudaMemcpyAsync(&comm->channels[c].devPeersHostPtr[nvlsPeer]->recv[1], &peer->recv[1].conn, sizeof(struct ncclConnInfo), cudaMemcpyHostToDevice, comm->sharedRes->hostStream.cudaStream), res, fail);
-      }
-    }
-    NCCLCHECKGOTO(ncclStrongStreamWaitStream(ncclCudaGraphNone(), &comm->sharedRes->deviceStream, &comm->sharedRes->hostStream), res, fail);
-    NCCLCHECKGOTO(ncclStrongStreamRelease(ncclCudaGraphNone(), &comm->sharedRes->hostStream), res, fail);
   }
 
   // MNNVL does not support NVLS buffer registration
@@ -714,18 +711,83 @@ fail:
 
 struct ncclNvlsCleanupCallback {
   struct ncclCommCallback base;
-  CUmemGenericAllocationHandle mcHandle;
-  CUdeviceptr ptr;
-  int dev;
-  size_t size;
+  struct ncclNvlsGraphReg* reg;
 };
 
+NCCL_PARAM(NvlsGraphRegCache, "NVLS_GRAPH_REG_CACHE", 1);
+
+static struct ncclNvlsGraphReg* nvlsGraphRegFind(struct ncclComm* comm, const void* base, size_t localSize) {
+  if (ncclParamNvlsGraphRegCache() == 0) return NULL;
+  for (struct ncclNvlsGraphReg* reg = comm->nvlsGraphRegs; reg; reg = reg->next) {
+    if (reg->base == (uintptr_t)base && reg->localSize == localSize) return reg;
+  }
+  return NULL;
+}
+
+// Drop one graph reference, the multicast object goes away with the last one
+static ncclResult_t nvlsGraphRegRelease(struct ncclComm* comm, struct ncclNvlsGraphReg* reg) {
+  if (--reg->refs > 0) return ncclSuccess;
+  for (struct ncclNvlsGraphReg** prev = &comm->nvlsGraphRegs; *prev; prev = &(*prev)->next) {
+    if (*prev == reg) {
+      *prev = reg->next;
+      break;
+    }
+  }
+  ncclResult_t ret = ncclNvlsDeregBuffer(&reg->mcHandle, reg->ptr, reg->dev, reg->size);
+  INFO(NCCL_NVLS, "rank %d - deregistered buffer %p on device %d, size %ld", comm->rank, (void*)reg->ptr, reg->dev, reg->size);
+  free(reg);
+  return ret;
+}
+
 static ncclResult_t cleanupNvls(struct ncclComm* comm, struct ncclCommCallback* cb) {
   struct ncclNvlsCleanupCallback* obj = (struct ncclNvlsCleanupCallback*)cb;
-  NCCLCHECK(ncclNvlsDeregBuffer(&obj->mcHandle, obj->ptr, obj->dev, obj->size));
-  INFO(NCCL_NVLS, "rank %d - deregistered buffer %p on device %d, size %ld", comm->rank, (void*)obj->ptr, obj->dev, obj->size);
+  ncclResult_t ret = nvlsGraphRegRelease(comm, obj->reg);
   free(obj);
-  return ncclSuccess;
+  return ret;
+}
+
+// Bind base to a new multicast object and map it, all local ranks call it together
+static ncclResult_t nvlsGraphRegCreate(struct ncclComm* comm, CUmulticastObjectProp* mcprop, const void* base, size_t localSize,
+    size_t size, size_t gran, struct ncclNvlsGraphReg** regOut) {
+  ncclResult_t ret = ncclSuccess;
+  char shareableHandle[NVLS_HANDLE_SIZE];
+  CUmemGenericAllocationHandle mcHandle;
+  CUdeviceptr regPtr = 0;
+  struct ncclNvlsGraphReg* reg = NULL;
+
+  mcprop->size = size;
+  if (comm->localRank == 0) {
+    NCCLCHECK(nvlsGroupCreate(comm, mcprop, comm->localRank, comm->localRanks, &mcHandle, shareableHandle));
+    NCCLCHECK(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE));
+  } else {
+    NCCLCHECK(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE));
+    NCCLCHECK(nvlsGroupConnect(comm, shareableHandle, comm->localRankToRank[0], &mcHandle));
+  }
+
+  CUCHECKGOTO(cuMulticastAddDevice(mcHandle, comm->nvlsResources->dev), ret, fail);
+  CUCHECKGOTO(cuMulticastBindAddr(mcHandle, 0, (CUdeviceptr)base, size, 0), ret, fail);
+
+  // Create a VA for the NVLS
+  CUCHECKGOTO(cuMemAddressReserve(&regPtr, size, gran, 0U, 0), ret, fail);
+  // Map the VA locally
+  CUCHECKGOTO(cuMemMap(regPtr, size, 0, mcHandle, 0), ret, fail);
+  CUCHECKGOTO(cuMemSetAccess(regPtr, size, &comm->nvlsResources->accessDesc, 1), ret, fail);
+
+  NCCLCHECKGOTO(ncclCalloc(&reg, 1), ret, fail);
+  reg->id = ++comm->nvlsGraphRegCount;
+  reg->base = (uintptr_t)base;
+  reg->localSize = localSize;
+  reg->mcHandle = mcHandle;
+  reg->ptr = regPtr;
+  reg->dev = comm->nvlsResources->dev;
+  reg->size = size;
+  reg->next = comm->nvlsGraphRegs;
+  comm->nvlsGraphRegs = reg;
+  *regOut = reg;
+exit:
+  return ret;
+fail:
+  goto exit;
 }
 
 ncclResult_t ncclNvlsGraphRegisterBuffer(
@@ -737,14 +799,13 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
   bool localRegBufUsed = false;
   struct ncclNvlsCleanupCallback* sendRecord = NULL;
   struct ncclNvlsCleanupCallback* recvRecord = NULL;
-  CUdeviceptr regSendPtr = 0;
-  CUdeviceptr regRecvPtr = 0;
+  struct ncclNvlsGraphReg* sendReg = NULL;
+  struct ncclNvlsGraphReg* recvReg = NULL;
+  bool sendCached = true, recvCached = true;
   CUmulticastObjectProp mcprop;
   CUmemAllocationProp ucprop;
-  char shareableHandle[NVLS_HANDLE_SIZE];
-  CUmemGenericAllocationHandle sendMcHandle, recvMcHandle;
   size_t sendGran = 0, recvGran = 0;
-  bool *regBufFlags = NULL;
+  struct graphRegFlags *regBufFlags = NULL;
   struct graphRegData *rdata = NULL;
   const void *baseSend = NULL;
   const void *baseRecv = NULL;
@@ -772,10 +833,18 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
     CUCHECKGOTO(cuMemGetAllocationGranularity(&ucgran, &ucprop, CU_MEM_ALLOC_GRANULARITY_RECOMMENDED), ret, fail);
 
     localRegBufUsed = ((uint64_t)baseSend % ucgran != 0 || (uint64_t)baseRecv % ucgran != 0) ? false : true;
-    regBufFlags[comm->localRank] = localRegBufUsed;
-    NCCLCHECKGOTO(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, regBufFlags, sizeof(bool)), ret, fail);
-    for (int i = 0; i < comm->localRanks; ++i)
-      if (regBufFlags[i] == false) goto fail;
+    regBufFlags[comm->localRank].usable = localRegBufUsed;
+    // Buffers captured before by another graph are already bound, reuse their multicast objects
+    if (sendbuff != NULL && (sendReg = nvlsGraphRegFind(comm, baseSend, baseSendSize)) != NULL)
+      regBufFlags[comm->localRank].sendId = sendReg->id;
+    if (recvbuff != NULL && (recvReg = nvlsGraphRegFind(comm, baseRecv, baseRecvSize)) != NULL)
+      regBufFlags[comm->localRank].recvId = recvReg->id;
+    NCCLCHECKGOTO(bootstrapIntraNodeAllGather(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, regBufFlags, sizeof(struct graphRegFlags)), ret, fail);
+    for (int i = 0; i < comm->localRanks; ++i) {
+      if (regBufFlags[i].usable == false) goto fail;
+      if (regBufFlags[i].sendId == 0 || regBufFlags[i].sendId != regBufFlags[0].sendId) sendCached = false;
+      if (regBufFlags[i].recvId == 0 || regBufFlags[i].recvId != regBufFlags[0].recvId) recvCached = false;
+    }
 
     memset(&mcprop, 0, sizeof(CUmulticastObjectProp));
     mcprop.numDevices = comm->localRanks;
@@ -783,6 +852,7 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
     mcprop.flags = 0;
 
     if (sendbuff != NULL) {
+      size_t localSize = baseSendSize;
       mcprop.size = baseSendSize;
       CUCHECKGOTO(cuMulticastGetGranularity(&sendGran, &mcprop, CU_MULTICAST_GRANULARITY_RECOMMENDED), ret, fail);
 
@@ -797,35 +867,20 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
       }
       if (baseSendSize % sendGran != 0) goto fail;
 
-      mcprop.size = baseSendSize;
-
       /* register sendbuff */
-      if (comm->localRank == 0) {
-        NCCLCHECKGOTO(nvlsGroupCreate(comm, &mcprop, comm->localRank, comm->localRanks, &sendMcHandle, shareableHandle), ret, fail);
-        NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), ret, fail);
+      NCCLCHECKGOTO(ncclCalloc(&sendRecord, 1), ret, fail);
+      sendRecord->base.fn = cleanupNvls;
+      if (sendCached) {
+        sendReg->refs++;
       } else {
-        NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), ret, fail);
-        NCCLCHECKGOTO(nvlsGroupConnect(comm, shareableHandle, comm->localRankToRank[0], &sendMcHandle), ret, fail);
+        NCCLCHECKGOTO(nvlsGraphRegCreate(comm, &mcprop, baseSend, localSize, baseSendSize, sendGran, &sendReg), ret, fail);
+        sendReg->refs = 1;
       }
-
-      CUCHECKGOTO(cuMulticastAddDevice(sendMcHandle, comm->nvlsResources->dev), ret, fail);
-      CUCHECKGOTO(cuMulticastBindAddr(sendMcHandle, 0, (CUdeviceptr)baseSend, baseSendSize, 0), ret, fail);
-
-      // Create a VA for the NVLS
-      CUCHECKGOTO(cuMemAddressReserve(&regSendPtr, baseSendSize, sendGran, 0U, 0), ret, fail);
-      // Map the VA locally
-      CUCHECKGOTO(cuMemMap(regSendPtr, baseSendSize, 0, sendMcHandle, 0), ret, fail);
-      CUCHECKGOTO(cuMemSetAccess(regSendPtr, baseSendSize, &comm->nvlsResources->accessDesc, 1), ret, fail);
-
-      sendRecord = (struct ncclNvlsCleanupCallback*)malloc(sizeof(struct ncclNvlsCleanupCallback));
-      sendRecord->base.fn = cleanupNvls;
-      sendRecord->mcHandle = sendMcHandle;
-      sendRecord->ptr = regSendPtr;
-      sendRecord->dev = comm->nvlsResources->dev;
-      sendRecord->size = baseSendSize;
+      sendRecord->reg = sendReg;
     }
 
     if (recvbuff != NULL) {
+      size_t localSize = baseRecvSize;
       mcprop.size = baseRecvSize;
       CUCHECKGOTO(cuMulticastGetGranularity(&recvGran, &mcprop, CU_MULTICAST_GRANULARITY_RECOMMENDED), ret, fail);
 
@@ -839,30 +894,15 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
       }
       if (baseRecvSize % recvGran != 0) goto fail;
 
-      mcprop.size = baseRecvSize;
-      if (comm->localRank == 0) {
-        NCCLCHECKGOTO(nvlsGroupCreate(comm, &mcprop, comm->localRank, comm->localRanks, &recvMcHandle, shareableHandle), ret, fail);
-        NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), ret, fail);
+      NCCLCHECKGOTO(ncclCalloc(&recvRecord, 1), ret, fail);
+      recvRecord->base.fn = cleanupNvls;
+      if (recvCached) {
+        recvReg->refs++;
       } else {
-        NCCLCHECKGOTO(bootstrapIntraNodeBroadcast(comm->bootstrap, comm->localRankToRank, comm->localRank, comm->localRanks, 0, shareableHandle, NVLS_HANDLE_SIZE), ret, fail);
-        NCCLCHECKGOTO(nvlsGroupConnect(comm, shareableHandle, comm->localRankToRank[0], &recvMcHandle), ret, fail);
+        NCCLCHECKGOTO(nvlsGraphRegCreate(comm, &mcprop, baseRecv, localSize, baseRecvSize, recvGran, &recvReg), ret, fail);
+        recvReg->refs = 1;
       }
-
-      CUCHECKGOTO(cuMulticastAddDevice(recvMcHandle, comm->nvlsResources->dev), ret, fail);
-      CUCHECKGOTO(cuMulticastBindAddr(recvMcHandle, 0, (CUdeviceptr)baseRecv, baseRecvSize, 0), ret, fail);
-
-      // Create a VA for the NVLS
-      CUCHECKGOTO(cuMemAddressReserve(&regRecvPtr, baseRecvSize, recvGran, 0U, 0), ret, fail);
-      // Map the VA locally
-      CUCHECKGOTO(cuMemMap(regRecvPtr, baseRecvSize, 0, recvMcHandle, 0), ret, fail);
-      CUCHECKGOTO(cuMemSetAccess(regRecvPtr, baseRecvSize, &comm->nvlsResources->accessDesc, 1), ret, fail);
-
-      recvRecord = (struct ncclNvlsCleanupCallback*)malloc(sizeof(struct ncclNvlsCleanupCallback));
-      recvRecord->base.fn = cleanupNvls;
-      recvRecord->mcHandle = recvMcHandle;
-      recvRecord->ptr = regRecvPtr;
-      recvRecord->dev = comm->nvlsResources->dev;
-      recvRecord->size = baseRecvSize;
+      recvRecord->reg = recvReg;
     }
 
     localRegBufUsed = true;
@@ -871,30 +911,28 @@ ncclResult_t ncclNvlsGraphRegisterBuffer(
 exit:
   if (localRegBufUsed == false) {
     if (sendRecord) {
-      ncclNvlsDeregBuffer(&sendRecord->mcHandle, sendRecord->ptr, sendRecord->dev, sendRecord->size);
+      if (sendRecord->reg) nvlsGraphRegRelease(comm, sendRecord->reg);
       free(sendRecord);
     }
 
     if (recvRecord) {
-      // Yes, it's a dead code.  That's fine...
-      // coverity[dead_error_begin]
-      ncclNvlsDeregBuffer(&recvRecord->mcHandle, recvRecord->ptr, recvRecord->dev, recvRecord->size);
+      if (recvRecord->reg) nvlsGraphRegRelease(comm, recvRecord->reg);
       free(recvRecord);
     }
   } else {
     if (sendRecord) {
-      *outRegBufSend = (void*)((uintptr_t)regSendPtr + (uintptr_t)sendbuff - (uintptr_t)baseSend);
+      *outRegBufSend = (void*)((uintptr_t)sendRecord->reg->ptr + (uintptr_t)sendbuff - (uintptr_t)baseSend);
       ncclIntruQueueEnqueue(cleanupQueue, (struct ncclCommCallback*)sendRecord);
       *nCleanupQueueEltsAdded += 1;
     }
 
     if (recvRecord) {
-      *outRegBufRecv = (void*)((uintptr_t)regRecvPtr + (uintptr_t)recvbuff - (uintptr_t)baseRecv);
+      *outRegBufRecv = (void*)((uintptr_t)recvRecord->reg->ptr + (uintptr_t)recvbuff - (uintptr_t)baseRecv);
       ncclIntruQueueEnqueue(cleanupQueue, (struct ncclCommCallback*)recvRecord);
       *nCleanupQueueEltsAdded += 1;
     }
 
-    INFO(NCCL_NVLS, "rank %d successfully graph-registered sendbuff %p, recvbuff %p, sendbuff size %ld (register size %ld, sendGran %ld), recvbuff size %ld (register size %ld, recvGran %ld), reg sendbuff %p, reg recvbuff %p", comm->rank, sendbuff, recvbuff, sendbuffSize, baseSendSize, sendGran, recvbuffSize, baseRecvSize, recvGran, (void*)regSendPtr, (void*)regRecvPtr);
+    INFO(NCCL_NVLS, "rank %d successfully graph-registered sendbuff %p, recvbuff %p, sendbuff size %ld (register size %ld, sendGran %ld%s), recvbuff size %ld (register size %ld, recvGran %ld%s), reg sendbuff %p, reg recvbuff %p", comm->rank, sendbuff, recvbuff, sendbuffSize, baseSendSize, sendGran, sendRecord && sendCached ? ", cached" : "", recvbuffSize, baseRecvSize, recvGran, recvRecord && recvCached ? ", cached" : "", sendReg ? (void*)sendReg->ptr : NULL, recvReg ? (void*)recvReg->ptr : NULL);
   }
 
   *outRegBufUsed = localRegBufUsed;
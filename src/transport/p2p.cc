@@ -82,6 +82,7 @@ struct p2pResources {
   struct p2pShm* shm;
   struct p2pShm* devShm;
   ncclShmIpcDesc_t desc;
+  int connIndex;
 };
 
 // cuMem API support
@@ -250,23 +251,45 @@ ncclResult_t ncclP2pFreeShareableBuffer(ncclIpcDesc *ipcDesc) {
   return ncclSuccess;
 }
 
+#if CUDART_VERSION >= 11030
+// Map an imported handle on the local GPU
+static ncclResult_t p2pMapImported(struct ncclComm *comm, CUmemGenericAllocationHandle handle, size_t size, void **devMemPtr) {
+  CUdeviceptr dptr = 0;
+  CUmemAllocationProp prop = {};
+  size_t granularity = 0;
+
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.requestedHandleTypes = ncclCuMemHandleType;
+  prop.location.id = comm->cudaDev;
+  CUCHECK(cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+  ALIGN_SIZE(size, granularity);
+
+  CUCHECK(cuMemAddressReserve(&dptr, size, /* alignment */ 0, /* addr */ 0, /* flags */ 0));
+  CUCHECK(cuMemMap(dptr, size, /* offset */ 0, handle, /* flags */ 0));
+
+  TRACE(NCCL_P2P, "Imported shareable buffer size %zu handle 0x%llx dptr %p", size, handle, (void*)dptr);
+
+  // Allow access by the local GPU
+  CUmemAccessDesc accessDesc = {};
+  accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  accessDesc.location.id = comm->cudaDev;
+  accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+  CUCHECK(cuMemSetAccess(dptr, size, &accessDesc, 1));
+  TRACE(NCCL_P2P, "Set Access for %p size %zu on dev %d", (void*)dptr, size, accessDesc.location.id);
+
+  *devMemPtr = (void *)dptr;
+  return ncclSuccess;
+}
+#endif
+
 ncclResult_t ncclP2pImportShareableBuffer(struct ncclComm *comm, int peer, size_t size, ncclIpcDesc *ipcDesc, void **devMemPtr) {
   if (ncclCuMemEnable()) {
 #if CUDART_VERSION >= 11030
     // cuMem API support
-    CUdeviceptr dptr = 0;
     CUmemAllocationHandleType type = ncclCuMemHandleType;
     CUmemGenericAllocationHandle handle;
     ncclCuDesc *cuDesc = &ipcDesc->cuDesc;
-    CUmemAllocationProp prop = {};
-    size_t granularity = 0;
-
-    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
-    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-    prop.requestedHandleTypes = type;
-    prop.location.id = comm->cudaDev;
-    CUCHECK(cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
-    ALIGN_SIZE(size, granularity);
 
     // Import and map the remote memory descriptor to the local GPU
     if (type == CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR) {
@@ -280,20 +303,7 @@ ncclResult_t ncclP2pImportShareableBuffer(struct ncclComm *comm, int peer, size_
     } else {
       CUCHECK(cuMemImportFromShareableHandle(&handle, cuDesc, type));
     }
-    CUCHECK(cuMemAddressReserve(&dptr, size, /* alignment */ 0, /* addr */ 0, /* flags */ 0));
-    CUCHECK(cuMemMap(dptr, size, /* offset */ 0, handle, /* flags */ 0));
-
-    TRACE(NCCL_P2P, "Imported shareable buffer size %zu handle 0x%llx dptr %p", size, handle, (void*)dptr);
-
-    // Allow access by the local GPU
-    CUmemAccessDesc accessDesc = {};
-    accessDesc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-    accessDesc.location.id = comm->cudaDev;
-    accessDesc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
-    CUCHECK(cuMemSetAccess(dptr, size, &accessDesc, 1));
-    TRACE(NCCL_P2P, "Set Access for %p size %zu on dev %d", (void*)dptr, size, accessDesc.location.id);
-
-    *devMemPtr = (void *)dptr;
+    NCCLCHECK(p2pMapImported(comm, handle, size, devMemPtr));
 #else
     return ncclInternalError;
 #endif
@@ -307,6 +317,96 @@ ncclResult_t ncclP2pImportShareableBuffer(struct ncclComm *comm, int peer, size_
   return ncclSuccess;
 }
 
+// cuMem handles of the peers, turned into fds by their proxy for a whole batch at once. Connectors
+// queue theirs and return ncclInProgress, the first one called again fetches and imports all the
+// handles queued for its peer, and each then maps its own.
+struct ncclP2pImport {
+  int peer;
+  uint64_t data; // handle in the peer process
+  bool imported;
+  CUmemGenericAllocationHandle handle;
+  struct ncclP2pImport* next;
+};
+
+NCCL_PARAM(P2pImportBatch, "P2P_IMPORT_BATCH", 1);
+
+static ncclResult_t p2pImportFlush(struct ncclComm *comm, int peer) {
+#if CUDART_VERSION >= 11030
+  ncclResult_t ret = ncclSuccess;
+  int n = 0;
+  for (struct ncclP2pImport* imp = comm->p2pImports; imp; imp = imp->next) n += (imp->peer == peer && !imp->imported);
+  uint64_t* handles = NULL;
+  int* fds = NULL;
+  int f = 0;
+  NCCLCHECKGOTO(ncclCalloc(&handles, n), ret, exit);
+  NCCLCHECKGOTO(ncclCalloc(&fds, n), ret, exit);
+  for (struct ncclP2pImport* imp = comm->p2pImports; imp; imp = imp->next) {
+    if (imp->peer == peer && !imp->imported) handles[f++] = imp->data;
+  }
+  NCCLCHECKGOTO(ncclProxyClientGetFdsBlocking(comm, peer, n, handles, fds), ret, exit);
+  f = 0;
+  for (struct ncclP2pImport* imp = comm->p2pImports; imp; imp = imp->next) {
+    if (imp->peer != peer || imp->imported) continue;
+    CUresult err = CUPFN(cuMemImportFromShareableHandle)(&imp->handle, (void *)(uintptr_t)fds[f], CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR);
+    // Fds of the batch are closed whatever happens to the others
+    close(fds[f++]);
+    if (err != CUDA_SUCCESS) {
+      if (ret == ncclSuccess) WARN("Cuda failure %d importing handle 0x%lx of rank %d", err, imp->data, peer);
+      ret = ncclUnhandledCudaError;
+      continue;
+    }
+    imp->imported = true;
+  }
+  if (ret == ncclSuccess) INFO(NCCL_P2P, "Imported %d shareable buffers of rank %d", n, peer);
+exit:
+  free(handles);
+  free(fds);
+  return ret;
+#else
+  return ncclInternalError;
+#endif
+}
+
+// Import through the batch when the handles travel as fds, ncclInProgress until it is done
+static ncclResult_t p2pImportBatched(struct ncclComm *comm, int peer, size_t size, ncclIpcDesc *ipcDesc, void **devMemPtr) {
+  if (!ncclCuMemEnable() || ncclCuMemHandleType != CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR || ncclParamP2pImportBatch() == 0) {
+    return ncclP2pImportShareableBuffer(comm, peer, size, ipcDesc, devMemPtr);
+  }
+#if CUDART_VERSION >= 11030
+  struct ncclP2pImport** list = &comm->p2pImports;
+  while (*list && ((*list)->peer != peer || (*list)->data != ipcDesc->cuDesc.data)) list = &(*list)->next;
+  struct ncclP2pImport* imp = *list;
+  if (imp == NULL) {
+    NCCLCHECK(ncclCalloc(&imp, 1));
+    imp->peer = peer;
+    imp->data = ipcDesc->cuDesc.data;
+    *list = imp;
+    return ncclInProgress;
+  }
+  if (!imp->imported) NCCLCHECK(p2pImportFlush(comm, peer));
+  *list = imp->next;
+  ncclResult_t ret = p2pMapImported(comm, imp->handle, size, devMemPtr);
+  free(imp);
+  NCCLCHECK(ret);
+  INFO(NCCL_P2P, "Imported shareable buffer device %d size %zu ptr %p", comm->cudaDev, size, *devMemPtr);
+  return ncclSuccess;
+#else
+  return ncclInternalError;
+#endif
+}
+
+ncclResult_t ncclP2pImportsFree(struct ncclComm *comm) {
+  while (comm->p2pImports) {
+    struct ncclP2pImport* imp = comm->p2pImports;
+    comm->p2pImports = imp->next;
+#if CUDART_VERSION >= 11030
+    if (imp->imported) CUCHECK(cuMemRelease(imp->handle));
+#endif
+    free(imp);
+  }
+  return ncclSuccess;
+}
+
 // Setting this to non zero causes P2P to use Reads rather than Writes
 NCCL_PARAM(P2pReadEnable, "P2P_READ_ENABLE", -2);
 NCCL_PARAM(P2pDirectDisable, "P2P_DIRECT_DISABLE", 0);
@@ -324,7 +424,8 @@ static ncclResult_t p2pGetInfo(struct ncclTopoSystem* topo, struct ncclPeerInfo*
   return ncclSuccess;
 }
 
-static ncclResult_t p2pMap(struct ncclComm *comm, struct ncclProxyConnector* proxyConn, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclP2pBuff* p2pBuff, void** devMem, void** ipcPtr) {
+// With batch set, may return ncclInProgress until the buffer of another process is imported
+static ncclResult_t p2pMap(struct ncclComm *comm, struct ncclProxyConnector* proxyConn, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclP2pBuff* p2pBuff, void** devMem, void** ipcPtr, bool batch = false) {
   if (P2P_SAME_PID(myInfo, peerInfo)) {
     if (peerInfo->cudaDev != myInfo->cudaDev) {
       // Same PID different GPUs, enable P2P access
@@ -353,7 +454,13 @@ static ncclResult_t p2pMap(struct ncclComm *comm, struct ncclProxyConnector* pro
     }
   } else {
     // Different PID
-    NCCLCHECK(ncclP2pImportShareableBuffer(comm, peerInfo->rank, p2pBuff->size, &p2pBuff->ipcDesc, devMem));
+    if (batch) {
+      ncclResult_t ret = p2pImportBatched(comm, peerInfo->rank, p2pBuff->size, &p2pBuff->ipcDesc, devMem);
+      NCCLCHECK(ret);
+      if (ret == ncclInProgress) return ret;
+    } else {
+      NCCLCHECK(ncclP2pImportShareableBuffer(comm, peerInfo->rank, p2pBuff->size, &p2pBuff->ipcDesc, devMem));
+    }
     *ipcPtr = *devMem;
   }
   return ncclSuccess;
@@ -366,6 +473,7 @@ ncclResult_t p2pSendSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
   struct ncclP2pRequest req;
   NCCLCHECK(ncclCalloc(&resources, 1));
   send->transportResources = resources;
+  resources->connIndex = connIndex;
   int useRead, intermediateRank;
   NCCLCHECK(p2pGetInfo(comm->topo, myInfo, peerInfo, &useRead, &intermediateRank));
   if (useMemcpy) useRead = 0;
@@ -436,6 +544,7 @@ ncclResult_t p2pRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
   struct ncclP2pRequest req;
   NCCLCHECK(ncclCalloc(&resources, 1));
   recv->transportResources = resources;
+  resources->connIndex = connIndex;
   int useRead, intermediateRank;
   NCCLCHECK(p2pGetInfo(comm->topo, myInfo, peerInfo, &useRead, &intermediateRank));
 
@@ -447,7 +556,7 @@ ncclResult_t p2pRecvSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, st
 
   int recvSize = sizeof(struct ncclRecvMem);
   // For P2P Read the SIMPLE buffer is tagged on the end of the ncclSendMem structure
-  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) if (!(info->read && p == NCCL_PROTO_SIMPLE)) recvSize += comm->buffSizes[p];
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) if (!(info->read && p == NCCL_PROTO_SIMPLE)) recvSize += ncclConnBuffSize(comm, connIndex, p);
   ALIGN_SIZE(recvSize, CUDA_IPC_MIN);
 
   if (intermediateRank == -1) {
@@ -490,7 +599,9 @@ static ncclResult_t p2pSendConnect(struct ncclComm* comm, struct ncclConnect* co
   struct ncclRecvMem* remDevMem = NULL;
   struct p2pConnectInfo* info = (struct p2pConnectInfo*)connectInfo;
 
-  NCCLCHECK(p2pMap(comm, &send->proxyConn, comm->peerInfo+rank, comm->peerInfo+info->rank, &info->p2pBuff, (void**)&remDevMem, &resources->recvMemIpc));
+  ncclResult_t ret = p2pMap(comm, &send->proxyConn, comm->peerInfo+rank, comm->peerInfo+info->rank, &info->p2pBuff, (void**)&remDevMem, &resources->recvMemIpc, true);
+  NCCLCHECK(ret);
+  if (ret == ncclInProgress) return ret;
   resources->recvMemSameProc = P2P_SAME_PID((comm->peerInfo + rank), (comm->peerInfo + info->rank));
 
   char* buff = (char*)(remDevMem+1);
@@ -500,8 +611,9 @@ static ncclResult_t p2pSendConnect(struct ncclComm* comm, struct ncclConnect* co
       if (resources->sendDevMem == NULL) return ncclInternalError; // We should not use read + memcpy
       send->conn.buffs[p] = (char*)(resources->sendDevMem+1);
     } else {
-      send->conn.buffs[p] = buff;
-      buff += comm->buffSizes[p];
+      int size = ncclConnBuffSize(comm, resources->connIndex, p);
+      send->conn.buffs[p] = size ? buff : NULL;
+      buff += size;
     }
   }
   send->conn.stepSize = comm->buffSizes[NCCL_PROTO_SIMPLE]/NCCL_STEPS;
@@ -538,7 +650,9 @@ ncclResult_t p2pRecvConnect(struct ncclComm* comm, struct ncclConnect* connectIn
     recv->conn.tail = &resources->devShm->recvMem.tail;
     recv->conn.head = &resources->devShm->sendMem.head;
   } else {
-    NCCLCHECK(p2pMap(comm, &recv->proxyConn, comm->peerInfo+rank, comm->peerInfo+info->rank, &info->p2pBuff, (void**)&remDevMem, &resources->sendMemIpc));
+    ncclResult_t ret = p2pMap(comm, &recv->proxyConn, comm->peerInfo+rank, comm->peerInfo+info->rank, &info->p2pBuff, (void**)&remDevMem, &resources->sendMemIpc, true);
+    NCCLCHECK(ret);
+    if (ret == ncclInProgress) return ret;
     resources->sendMemSameProc = P2P_SAME_PID((comm->peerInfo + rank), (comm->peerInfo + info->rank));
 
     struct ncclRecvMem* devMem = resources->recvDevMem;
@@ -556,8 +670,9 @@ ncclResult_t p2pRecvConnect(struct ncclComm* comm, struct ncclConnect* connectIn
       /* For P2P Read the SIMPLE buffer is remote (ncclSendMem) */
       recv->conn.buffs[p] = (char*)(remDevMem+1);
     } else {
-      recv->conn.buffs[p] = buff;
-      buff += comm->buffSizes[p];
+      int size = ncclConnBuffSize(comm, resources->connIndex, p);
+      recv->conn.buffs[p] = size ? buff : NULL;
+      buff += size;
     }
   }
   return ncclSuccess;
@@ -637,6 +752,7 @@ static ncclResult_t p2pSendProxySetup(struct ncclProxyConnection* connection, st
     connection->transportResources = proxyInfo;
 
     NCCLCHECK(ncclCudaCalloc(&proxyInfo->ceDevBuff, proxyState->buffSizes[NCCL_PROTO_SIMPLE]));
+    ncclProxyMemAdd(proxyState->fifoBytes, false, proxyState->buffSizes[NCCL_PROTO_SIMPLE]);
 
     // Create a SHM segment for the peer to attach to
     shmSize = sizeof(struct ncclSendMem) + sizeof(struct ncclRecvMem);
@@ -652,6 +768,7 @@ static ncclResult_t p2pSendProxySetup(struct ncclProxyConnection* connection, st
     struct ncclP2pBuff* p2pBuff = (struct ncclP2pBuff*)respBuff;
     NCCLCHECK(ncclP2pAllocateShareableBuffer(size, req->refcount, &p2pBuff->ipcDesc, &p2pBuff->directPtr));
     p2pBuff->size = size;
+    ncclProxyMemAdd(proxyState->fifoBytes, false, size);
     if (ncclCuMemEnable()) {
       // cuMem API support
       struct p2pCuMemProxyInfo* proxyInfo;
@@ -674,6 +791,7 @@ static ncclResult_t p2pRecvProxySetup(struct ncclProxyConnection* connection, st
   struct ncclP2pBuff* p2pBuff = (struct ncclP2pBuff*)respBuff;
   NCCLCHECK(ncclP2pAllocateShareableBuffer(size, req->refcount, &p2pBuff->ipcDesc, &p2pBuff->directPtr));
   p2pBuff->size = size;
+  ncclProxyMemAdd(proxyState->fifoBytes, false, size);
   if (ncclCuMemEnable()) {
     // cuMem API support
     struct p2pCuMemProxyInfo* proxyInfo;
@@ -822,7 +940,8 @@ ncclResult_t ncclIpcLocalRegisterBuffer(ncclComm* comm, const void* userbuff, si
   *peerRmtAddrsOut = NULL;
   if (comm && userbuff && buffSize > 0 && nPeers > 0) {
     NCCLCHECKGOTO(ncclRegFind(comm, userbuff, buffSize, &regRecord), ret, fail);
-    if (regRecord) {
+    // Pinned host memory cannot be exported to peers, they go through the connection buffers
+    if (regRecord && (regRecord->state & HOST_REG_MEMORY) == 0) {
       // buffer was registered by by users, we need to start to register or reuse it
       int peerLocalRank;
       for (int p = 0; p < nPeers; p++) {
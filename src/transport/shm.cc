@@ -8,8 +8,11 @@
 #include "shmutils.h"
 #include "shm.h"
 #include "transport.h"
+#include <sys/vfs.h>
+#include <algorithm>
 
 #define SHM_PATH_MAX 128
+#define SHM_HUGETLBFS_MAGIC 0x958458f6
 #define SHM_HANDLE_TYPE CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR
 
 struct shmBuffInfo {
@@ -49,6 +52,15 @@ struct shmProxyInfo {
   uint64_t step;
   cudaStream_t stream;
   cudaEvent_t events[NCCL_STEPS];
+  // Steps and bytes of the copy posted at each slot, and when
+  int batchSteps[NCCL_STEPS];
+  size_t batchBytes[NCCL_STEPS];
+  uint64_t postNs[NCCL_STEPS];
+  // Measured copy throughput of this connection, 0 until the first copy completes
+  float nsPerByte;
+  float latencyNs;
+  // When the first step of the copy being held became ready, 0 when none is held
+  uint64_t holdNs;
 
   // ipc desc
   ncclShmIpcDesc_t desc;
@@ -67,6 +79,7 @@ NCCL_PARAM(ShmMemcpyMode, "SHM_MEMCPY_MODE", SHM_SEND_SIDE); // 1 is sender-side
 static int useMemcpySend = 0;
 static int useMemcpyRecv = 0;
 NCCL_PARAM(ShmLocality, "SHM_LOCALITY", SHM_RECV_SIDE); // 1 is sender-size, 2 is receiver-size
+NCCL_PARAM(ShmCeBatch, "SHM_CE_BATCH", 1);
 static int shmLocality = 0;
 static void initCeOperation();
 
@@ -252,6 +265,7 @@ static ncclResult_t shmSendProxyConnect(struct ncclProxyConnection* connection,
   proxyInfo->sendMem = reqInfo->sendMem;
   proxyInfo->recvMem = reqInfo->recvMem;
   NCCLCHECKGOTO(ncclCudaCalloc(&proxyInfo->devFifo, proxyState->buffSizes[NCCL_PROTO_SIMPLE]), ret, fail);
+  ncclProxyMemAdd(proxyState->fifoBytes, false, proxyState->buffSizes[NCCL_PROTO_SIMPLE]);
   NCCLCHECKGOTO(ncclCudaHostCalloc(&proxyInfo->ceRecvMem, 1), ret, fail);
   CUDACHECKGOTO(cudaStreamCreateWithFlags(&proxyInfo->stream, cudaStreamNonBlocking), ret, fail);
   for (int i=0; i<NCCL_STEPS; i++) {
@@ -282,6 +296,7 @@ static ncclResult_t shmRecvProxyConnect(struct ncclProxyConnection* connection,
   proxyInfo->sendMem = reqInfo->sendMem;
   proxyInfo->recvMem = reqInfo->recvMem;
   NCCLCHECKGOTO(ncclCudaCalloc(&proxyInfo->devFifo, proxyState->buffSizes[NCCL_PROTO_SIMPLE]), ret, fail);
+  ncclProxyMemAdd(proxyState->fifoBytes, false, proxyState->buffSizes[NCCL_PROTO_SIMPLE]);
   NCCLCHECKGOTO(ncclCudaHostCalloc(&proxyInfo->ceRecvMem, 1), ret, fail);
   CUDACHECKGOTO(cudaStreamCreateWithFlags(&proxyInfo->stream, cudaStreamNonBlocking), ret, fail);
   for (int i=0; i<NCCL_STEPS; i++) {
@@ -337,6 +352,73 @@ static ncclResult_t shmRecvProxyFree(struct ncclProxyConnection* connection, str
   return ncclSuccess;
 }
 
+// Copy the steps the producer made ready from src to dst, and tell the consumer about the ones
+// that landed. Contiguous full slices ready together go in a single copy. While the copy would be
+// dominated by the measured latency of the connection, and more steps of the op are coming, the
+// copy is held back for at most that latency to gather them.
+static ncclResult_t shmCeProgress(struct ncclProxyArgs* args, struct ncclProxySubArgs* sub, struct shmProxyInfo* resources,
+    int stepSize, volatile uint64_t* readyTail, volatile struct ncclConnFifo* connFifo, char* dst, char* src,
+    cudaMemcpyKind kind, struct ncclConnFifo* sizesOut, volatile uint64_t* doneTail) {
+  int sliceSize = stepSize*args->sliceSteps;
+  while (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps && *readyTail > sub->base+sub->transmitted) {
+    int first = (sub->base+sub->transmitted)%NCCL_STEPS;
+    int steps = 0;
+    size_t bytes = 0;
+    bool full;
+    do {
+      int size = connFifo[(first+steps)%NCCL_STEPS].size;
+      bytes += size;
+      steps += args->sliceSteps;
+      full = size == sliceSize;
+    } while (ncclParamShmCeBatch() && full && first+steps < NCCL_STEPS && sub->transmitted+steps < sub->nsteps &&
+             sub->transmitted+steps < sub->done + NCCL_STEPS && *readyTail > sub->base+sub->transmitted+steps);
+    bool more = full && first+steps < NCCL_STEPS && sub->transmitted+steps < sub->nsteps && sub->transmitted+steps < sub->done + NCCL_STEPS;
+    if (ncclParamShmCeBatch() && more && resources->nsPerByte > 0 && bytes*resources->nsPerByte < resources->latencyNs) {
+      uint64_t now = clockNano();
+      if (resources->holdNs == 0) resources->holdNs = now;
+      if (now - resources->holdNs < resources->latencyNs) break;
+    }
+    resources->holdNs = 0;
+    CUDACHECK(cudaMemcpyAsync(dst+first*stepSize, src+first*stepSize, bytes, kind, resources->stream));
+    CUDACHECK(cudaEventRecord(resources->events[first], resources->stream));
+    resources->batchSteps[first] = steps;
+    resources->batchBytes[first] = bytes;
+    resources->postNs[first] = clockNano();
+    if (sizesOut) {
+      for (int s = 0; s < steps; s += args->sliceSteps) sizesOut[first+s].size = connFifo[first+s].size;
+      __sync_synchronize(); // make sure connFifo[].size is visible
+    }
+    sub->transmitted += steps;
+    args->idle = 0;
+  }
+  while (sub->done < sub->transmitted) {
+    int first = (sub->base+sub->done)%NCCL_STEPS;
+    cudaError_t res = cudaEventQuery(resources->events[first]);
+    if (res == cudaErrorNotReady) break;
+    CUDACHECK(res);
+    // The time includes waiting for the copies before, the first copy of an op is the closest to
+    // its latency and the following ones to the bandwidth
+    float ns = clockNano() - resources->postNs[first];
+    size_t bytes = resources->batchBytes[first];
+    if (sub->done == 0 || resources->latencyNs == 0) {
+      float latencyNs = std::max(ns - bytes*resources->nsPerByte, 0.0f);
+      resources->latencyNs = resources->latencyNs == 0 ? latencyNs : 0.875f*resources->latencyNs + 0.125f*latencyNs;
+    } else if (bytes > 0) {
+      float nsPerByte = ns/bytes;
+      resources->nsPerByte = resources->nsPerByte == 0 ? nsPerByte : 0.875f*resources->nsPerByte + 0.125f*nsPerByte;
+    }
+    sub->done += resources->batchSteps[first];
+    args->idle = 0;
+    // Notify the consumer
+    *doneTail = sub->base + sub->done;
+    if (sub->done == sub->nsteps) {
+      resources->step = sub->base + sub->nsteps;
+      args->done++;
+    }
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t shmSendProxyProgress(struct ncclProxyState* proxyState, struct ncclProxyArgs* args) {
   if (args->state == ncclProxyOpReady) {
     for (int s=0; s<args->nsubs; s++) {
@@ -360,34 +442,8 @@ static ncclResult_t shmSendProxyProgress(struct ncclProxyState* proxyState, stru
           args->done++;
           continue;
       }
-      if (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps) {
-        int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
-        volatile struct ncclConnFifo* connFifo = resources->ceRecvMem->connFifo;
-        volatile uint64_t* recvTail = &resources->ceRecvMem->tail;
-        // Check GPU has sent everything
-        if ((*recvTail > sub->base+sub->transmitted)) {
-          int size = connFifo[buffSlot].size;
-          CUDACHECK(cudaMemcpyAsync(resources->shmFifo+buffSlot*stepSize, resources->devFifo+buffSlot*stepSize, size, cudaMemcpyDeviceToHost, resources->stream));
-          CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
-          resources->recvMem->connFifo[buffSlot].size = size;
-          __sync_synchronize(); // make sure connFifo[].size is visible
-          sub->transmitted += args->sliceSteps;
-        }
-      }
-      if (sub->done < sub->transmitted) {
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
-        if (res != cudaErrorNotReady) CUDACHECK(res);
-        if (res == cudaSuccess) {
-          sub->done += args->sliceSteps;
-          // Notify SHM
-          resources->recvMem->tail = sub->base + sub->done;
-        }
-        if (sub->done == sub->nsteps) {
-          resources->step = sub->base + sub->nsteps;
-          args->done++;
-        }
-      }
+      NCCLCHECK(shmCeProgress(args, sub, resources, stepSize, &resources->ceRecvMem->tail, resources->ceRecvMem->connFifo,
+        resources->shmFifo, resources->devFifo, cudaMemcpyDeviceToHost, resources->recvMem->connFifo, &resources->recvMem->tail));
     }
     if (args->done == args->nsubs) {
       args->state = ncclProxyOpNone;
@@ -419,32 +475,8 @@ static ncclResult_t shmRecvProxyProgress(struct ncclProxyState* proxyState, stru
           args->done++;
           continue;
       }
-      if (sub->transmitted < sub->done + NCCL_STEPS && sub->transmitted < sub->nsteps) {
-        int buffSlot = (sub->base+sub->transmitted)%NCCL_STEPS;
-        volatile struct ncclConnFifo* connFifo = resources->recvMem->connFifo;
-        volatile uint64_t* recvTail = &resources->recvMem->tail;
-        // Check data is ready in SHM
-        if ((*recvTail > sub->base+sub->transmitted)) {
-          int size = connFifo[buffSlot].size;
-          CUDACHECK(cudaMemcpyAsync(resources->devFifo+buffSlot*stepSize, resources->shmFifo+buffSlot*stepSize, size, cudaMemcpyHostToDevice, resources->stream));
-          CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
-          sub->transmitted += args->sliceSteps;
-        }
-      }
-      if (sub->done < sub->transmitted) {
-        int buffSlot = (sub->base+sub->done)%NCCL_STEPS;
-        cudaError_t res = cudaEventQuery(resources->events[buffSlot]);
-        if (res != cudaErrorNotReady) CUDACHECK(res);
-        if (res == cudaSuccess) {
-          sub->done += args->sliceSteps;
-          // Notify GPU
-          resources->ceRecvMem->tail = sub->base + sub->done;
-        }
-        if (sub->done == sub->nsteps) {
-          resources->step = sub->base + sub->nsteps;
-          args->done++;
-        }
-      }
+      NCCLCHECK(shmCeProgress(args, sub, resources, stepSize, &resources->recvMem->tail, resources->recvMem->connFifo,
+        resources->devFifo, resources->shmFifo, cudaMemcpyHostToDevice, NULL, &resources->ceRecvMem->tail));
     }
     if (args->done == args->nsubs) {
       args->state = ncclProxyOpNone;
@@ -464,6 +496,7 @@ static ncclResult_t shmSendProxySetup(struct ncclProxyConnection* connection, st
 
   NCCLCHECK(ncclCalloc(&proxyInfo, 1));
   NCCLCHECK(ncclShmAllocateShareableBuffer(proxyState->tpRank, req->size, req->legacy, &proxyInfo->desc, &info->buf.hptr, &info->buf.dptr));
+  ncclProxyMemAdd(proxyState->fifoBytes, true, req->size);
   memcpy(&info->desc, &proxyInfo->desc, sizeof(ncclShmIpcDesc_t));
   connection->transportResources = proxyInfo;
   return ncclSuccess;
@@ -480,6 +513,7 @@ static ncclResult_t shmRecvProxySetup(struct ncclProxyConnection* connection, st
 
   NCCLCHECK(ncclCalloc(&proxyInfo, 1));
   NCCLCHECK(ncclShmAllocateShareableBuffer(proxyState->tpRank, req->size, req->legacy, &proxyInfo->desc, &info->buf.hptr, &info->buf.dptr));
+  ncclProxyMemAdd(proxyState->fifoBytes, true, req->size);
   memcpy(&info->desc, &proxyInfo->desc, sizeof(ncclShmIpcDesc_t));
   connection->transportResources = proxyInfo;
   return ncclSuccess;
@@ -507,6 +541,76 @@ static void initCeOperation() {
   }
 }
 
+static const char* shmHugeDir = NULL;
+static size_t shmHugePageSize = 0;
+static pthread_once_t shmHugeDirOnce = PTHREAD_ONCE_INIT;
+
+static void shmHugeDirInit() {
+  const char* env = ncclGetEnv("NCCL_SHM_HUGEPAGE_DIR");
+  struct statfs fs;
+  if (env == NULL || env[0] == '\0') return;
+  if (strlen(env) + sizeof("/nccl-XXXXXX") > SHM_PATH_MAX) {
+    WARN("Ignoring NCCL_SHM_HUGEPAGE_DIR %s, the path is too long", env);
+  } else if (statfs(env, &fs) != 0 || fs.f_type != SHM_HUGETLBFS_MAGIC) {
+    WARN("Ignoring NCCL_SHM_HUGEPAGE_DIR %s, it is not a hugetlbfs mount", env);
+  } else {
+    shmHugeDir = env;
+    shmHugePageSize = fs.f_bsize;
+    INFO(NCCL_INIT|NCCL_SHM, "Large SHM buffers use %s with %zu KB pages", shmHugeDir, shmHugePageSize >> 10);
+  }
+}
+
+// hugetlbfs mount set by NCCL_SHM_HUGEPAGE_DIR and its page size, NULL when unset or unusable
+static const char* shmHugetlbDir(size_t* pageSize) {
+  pthread_once(&shmHugeDirOnce, shmHugeDirInit);
+  *pageSize = shmHugePageSize;
+  return shmHugeDir;
+}
+
+static ncclResult_t shmLegacyAllocate(size_t size, ncclShmIpcDesc_t *desc, void **hptr, void **dptr) {
+  char shmPath[SHM_PATH_MAX] = { '\0' };
+  size_t pageSize;
+  const char* hugeDir = shmHugetlbDir(&pageSize);
+  desc->shmli.hugetlb = hugeDir != NULL && size >= pageSize;
+  if (desc->shmli.hugetlb) {
+    // The reference count behind the buffer is mapped too, the whole has to be made of hugepages
+    size = ROUNDUP(size + sizeof(int), pageSize) - sizeof(int);
+    snprintf(shmPath, sizeof(shmPath), "%s/nccl-XXXXXX", hugeDir);
+    int fd;
+    SYSCHECK(fd = mkstemp(shmPath), "mkstemp");
+    SYSCHECK(close(fd), "close");
+  }
+  desc->shmli.shmSize = size;
+  ncclResult_t ret = ncclShmOpen(shmPath, size, hptr, dptr, 1, &desc->shmli.handle);
+  if (ret != ncclSuccess) {
+    if (desc->shmli.hugetlb) (void)unlink(shmPath);
+    return ret;
+  }
+  memcpy(desc->shmli.shmSuffix, shmPath + strlen(shmPath) - (sizeof(desc->shmli.shmSuffix) - 1), sizeof(desc->shmli.shmSuffix));
+  desc->legacy = true;
+  INFO(NCCL_SHM, "MMAP allocated shareable host buffer %s size %zi ptr %p", shmPath, desc->shmli.shmSize, *hptr);
+  return ncclSuccess;
+}
+
+static ncclResult_t shmLegacyImport(ncclShmIpcDesc_t *desc, void **hptr, void **dptr, ncclShmIpcDesc_t *descOut) {
+  char shmPath[SHM_PATH_MAX];
+  if (desc->shmli.hugetlb) {
+    size_t pageSize;
+    const char* hugeDir = shmHugetlbDir(&pageSize);
+    if (hugeDir == NULL) {
+      WARN("SHM buffer nccl-%s is in NCCL_SHM_HUGEPAGE_DIR, which is not set for this process", desc->shmli.shmSuffix);
+      return ncclInvalidUsage;
+    }
+    snprintf(shmPath, sizeof(shmPath), "%s/nccl-%s", hugeDir, desc->shmli.shmSuffix);
+  } else {
+    sprintf(shmPath, "/dev/shm/nccl-%s", desc->shmli.shmSuffix);
+  }
+  NCCLCHECK(ncclShmOpen(shmPath, desc->shmli.shmSize, hptr, dptr, -1, &descOut->shmli.handle));
+  descOut->legacy = true;
+  INFO(NCCL_SHM, "MMAP imported shareable host buffer %s size %zi ptr %p", shmPath, desc->shmli.shmSize, *hptr);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclShmAllocateShareableBuffer(int tpProxyRank, size_t size, bool legacy, ncclShmIpcDesc_t *desc, void **hptr, void **dptr) {
   if (desc == NULL || hptr == NULL || tpProxyRank < -1) {
     WARN("Invalid argument desc %p, hptr %p, tpProxyRank %d", desc, hptr, tpProxyRank);
@@ -532,20 +636,10 @@ ncclResult_t ncclShmAllocateShareableBuffer(int tpProxyRank, size_t size, bool l
     desc->legacy = false;
     INFO(NCCL_SHM, "CUMEM allocated shareable buffer %p size %zi", desc->shmci.ptr, desc->shmci.size);
   } else {
-    char shmPath[SHM_PATH_MAX] = { '\0' };
-    desc->shmli.shmSize = size;
-    NCCLCHECK(ncclShmOpen(shmPath, size, hptr, dptr, 1, &desc->shmli.handle));
-    memcpy(desc->shmli.shmSuffix, shmPath + sizeof("/dev/shm/nccl-") - 1, sizeof(desc->shmli.shmSuffix));
-    desc->legacy = true;
-    INFO(NCCL_SHM, "MMAP allocated shareable host buffer %s size %zi ptr %p", shmPath, desc->shmli.shmSize, *hptr);
+    NCCLCHECK(shmLegacyAllocate(size, desc, hptr, dptr));
   }
 #else /* CUDART_VERSION >= 12020 */
-  char shmPath[SHM_PATH_MAX] = { '\0' };
-  desc->shmli.shmSize = size;
-  NCCLCHECK(ncclShmOpen(shmPath, size, hptr, dptr, 1, &desc->shmli.handle));
-  memcpy(desc->shmli.shmSuffix, shmPath + sizeof("/dev/shm/nccl-") - 1, sizeof(desc->shmli.shmSuffix));
-  desc->legacy = true;
-  INFO(NCCL_SHM, "MMAP allocated shareable host buffer %s size %zi ptr %p", shmPath, size, *hptr);
+  NCCLCHECK(shmLegacyAllocate(size, desc, hptr, dptr));
 #endif /* CUDART_VERSION >= 12020 */
   return ncclSuccess;
 }
@@ -617,18 +711,10 @@ ncclResult_t ncclShmImportShareableBuffer(struct ncclComm *comm, ncclShmIpcDesc_
     if (dptr) *dptr = (void *)hostptr;
     INFO(NCCL_SHM, "CUMEM imported shareable host buffer from tpProxyRank %d size %zi ptr %p, granularity %ld", desc->shmci.tpProxyRank, desc->shmci.size, descOut->shmci.ptr, granularity);
   } else {
-    char shmPath[SHM_PATH_MAX];
-    sprintf(shmPath, "/dev/shm/nccl-%s", desc->shmli.shmSuffix);
-    NCCLCHECK(ncclShmOpen(shmPath, desc->shmli.shmSize, hptr, dptr, -1, &descOut->shmli.handle));
-    descOut->legacy = true;
-    INFO(NCCL_SHM, "MMAP imported shareable host buffer %s size %zi ptr %p", shmPath, desc->shmli.shmSize, *hptr);
+    NCCLCHECK(shmLegacyImport(desc, hptr, dptr, descOut));
   }
 #else /* CUDART_VERSION >= 12020 */
-  char shmPath[SHM_PATH_MAX];
-  sprintf(shmPath, "/dev/shm/nccl-%s", desc->shmli.shmSuffix);
-  NCCLCHECK(ncclShmOpen(shmPath, desc->shmli.shmSize, hptr, dptr, -1, &descOut->shmli.handle));
-  descOut->legacy = true;
-  INFO(NCCL_SHM, "MMAP imported shareable host buffer %s size %zi ptr %p", shmPath, desc->shmli.shmSize, *hptr);
+  NCCLCHECK(shmLegacyImport(desc, hptr, dptr, descOut));
 #endif
   return ncclSuccess;
 }